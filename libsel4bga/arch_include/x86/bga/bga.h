@@ -5,6 +5,7 @@
  */
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 
 /* More information about the BGA device itself is available from
@@ -46,15 +47,77 @@ int bga_set_mode(bga_p device, unsigned int width, unsigned int height,
  * success.
  *
  * This function is mainly for drawing simple output to the screen. For
- * anything performance-critical you will want to use the raw frame buffer
- * access below.
+ * anything performance-critical you will want to use the bulk operations or
+ * raw frame buffer access below.
  *
  * XXX: This function has not been tested with BPPs other than 24.
  */
 int bga_set_pixel(bga_p device, unsigned int x, unsigned int y, char *value);
 
+/* Fill a rectangle of width x height pixels with its top left corner at (x, y)
+ * with a single colour. value is interpreted as for bga_set_pixel. Returns 0 on
+ * success, or non-zero if the rectangle does not lie within the screen or the
+ * current bits per pixel configuration is unsupported.
+ */
+int bga_fill_rect(bga_p device, unsigned int x, unsigned int y, unsigned int width,
+                  unsigned int height, const char *value);
+
+/* Copy a rectangle of width x height pixels from source into the frame buffer
+ * with its top left corner at (x, y). source must hold pixels in the frame
+ * buffer's format for the current mode, with consecutive rows source_stride
+ * bytes apart. Returns 0 on success, or non-zero as for bga_fill_rect.
+ */
+int bga_blit(bga_p device, unsigned int x, unsigned int y, unsigned int width,
+             unsigned int height, const void *source, size_t source_stride);
+
+/* Move the contents of the screen up by lines rows, or down if lines is
+ * negative. The rows exposed at the other edge are left as they were; use
+ * bga_fill_rect to clear them. Returns 0 on success, or non-zero if the current
+ * bits per pixel configuration is unsupported.
+ */
+int bga_scroll(bga_p device, int lines);
+
 /* Get a pointer to the frame buffer. You can output to the screen by directly
  * writing into this buffer. To do this correctly you will have to consult the
  * Bochs documentation for formatting details.
+ *
+ * The frame buffer is device memory and slow to access; consider drawing into
+ * a back buffer instead (see below).
  */
 void *bga_get_framebuffer(bga_p device);
+
+/* Allocate a back buffer in normal memory for the current mode. Once enabled,
+ * the drawing functions above write into the back buffer and record which
+ * regions they changed, and nothing reaches the screen until bga_present is
+ * called. The back buffer starts out as a copy of the screen. Setting a new mode
+ * disables the back buffer. Returns 0 on success.
+ *  framebuffer_size - The size in bytes of the frame buffer mapping. If it can
+ *                     hold two screens, presents are done by drawing into the
+ *                     off-screen half and panning the display to it, which
+ *                     avoids tearing. Pass 0 to always copy to the visible
+ *                     screen.
+ */
+int bga_enable_back_buffer(bga_p device, size_t framebuffer_size);
+
+/* Free the back buffer, if any, and return to drawing straight to the frame
+ * buffer. Anything drawn since the last bga_present is lost.
+ */
+void bga_disable_back_buffer(bga_p device);
+
+/* Get a pointer to the back buffer, or NULL if none is enabled. The layout is
+ * the same as the visible screen in the frame buffer. After writing to it
+ * directly, call bga_damage to have the changes included in the next present.
+ */
+void *bga_get_back_buffer(bga_p device);
+
+/* Mark a rectangle of the back buffer as changed. Returns 0 on success, or
+ * non-zero if there is no back buffer or the rectangle does not lie within the
+ * screen.
+ */
+int bga_damage(bga_p device, unsigned int x, unsigned int y, unsigned int width,
+               unsigned int height);
+
+/* Copy the regions of the back buffer changed since the last present to the
+ * screen. Returns 0 on success, or non-zero if there is no back buffer.
+ */
+int bga_present(bga_p device);
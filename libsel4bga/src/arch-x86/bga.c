@@ -8,14 +8,37 @@
  */
 
 #include <assert.h>
+#include <stdbool.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <bga/bga.h>
 
+/* Upper bound on the number of separate damaged rectangles tracked between
+ * presents. Beyond this they are collapsed into their bounding box.
+ */
+#define MAX_DAMAGE 8
+
+struct rect {
+    unsigned int x;
+    unsigned int y;
+    unsigned int width;
+    unsigned int height;
+};
+
+struct damage {
+    unsigned int count;
+    struct rect rects[MAX_DAMAGE];
+};
+
 struct bga {
     void *framebuffer;
 
+    /* Where drawing operations write to. This is the frame buffer itself, or
+     * the back buffer if one is enabled.
+     */
+    char *surface;
+
     /* IO port functions. */
     uint16_t (*read)(uint16_t port);
     void (*write)(uint16_t port, uint16_t value);
@@ -24,6 +47,24 @@ struct bga {
     unsigned int width;
     unsigned int height;
     unsigned int bpp;
+
+    /* Bytes occupied by a pixel in the frame buffer and the span fill routine
+     * for the current bpp, chosen in bga_set_mode. The fill routine is NULL
+     * if the bpp is not supported by the bulk operations.
+     */
+    unsigned int pixel_size;
+    void (*fill)(char *target, size_t pixels, const char *value);
+
+    /* Back buffer state. When page flipping, the frame buffer holds two pages
+     * and front_page is the one being scanned out. The hidden page last
+     * received the frame before the current one, so both that frame's damage
+     * (previous) and the current damage must be copied to it on present.
+     */
+    char *back_buffer;
+    bool page_flip;
+    unsigned int front_page;
+    struct damage damage;
+    struct damage previous;
 };
 
 /* The BGA device is controlled by operating on two IO ports, first the index
@@ -84,6 +125,7 @@ bga_p bga_init(void *framebuffer,
 
     memset(device, 0, sizeof(*device));
     device->framebuffer = framebuffer;
+    device->surface = framebuffer;
     device->write = ioport_write;
     device->read = ioport_read;
 
@@ -92,12 +134,146 @@ bga_p bga_init(void *framebuffer,
 
 int bga_destroy(bga_p device)
 {
+    bga_disable_back_buffer(device);
     free(device);
     return 0;
 }
 
+static size_t screen_size(bga_p device)
+{
+    return (size_t)device->width * device->height * device->pixel_size;
+}
+
+static bool rects_touch(const struct rect *a, const struct rect *b)
+{
+    return a->x <= b->x + b->width && b->x <= a->x + a->width &&
+           a->y <= b->y + b->height && b->y <= a->y + a->height;
+}
+
+static unsigned int min(unsigned int a, unsigned int b)
+{
+    return a < b ? a : b;
+}
+
+static unsigned int max(unsigned int a, unsigned int b)
+{
+    return a > b ? a : b;
+}
+
+static void rect_union(struct rect *a, const struct rect *b)
+{
+    unsigned int x_end = max(a->x + a->width, b->x + b->width);
+    unsigned int y_end = max(a->y + a->height, b->y + b->height);
+    a->x = min(a->x, b->x);
+    a->y = min(a->y, b->y);
+    a->width = x_end - a->x;
+    a->height = y_end - a->y;
+}
+
+static void damage_add(struct damage *damage, const struct rect *rect)
+{
+    /* Grow an existing rectangle that overlaps or abuts the new one, so runs
+     * of adjacent writes are tracked as a single rectangle.
+     */
+    for (unsigned int i = 0; i < damage->count; i++) {
+        if (rects_touch(&damage->rects[i], rect)) {
+            rect_union(&damage->rects[i], rect);
+            return;
+        }
+    }
+    if (damage->count == MAX_DAMAGE) {
+        for (unsigned int i = 1; i < damage->count; i++) {
+            rect_union(&damage->rects[0], &damage->rects[i]);
+        }
+        damage->count = 1;
+        rect_union(&damage->rects[0], rect);
+        return;
+    }
+    damage->rects[damage->count++] = *rect;
+}
+
+static void damage_screen(bga_p device, struct damage *damage)
+{
+    damage->count = 1;
+    damage->rects[0] = (struct rect) {
+        .x = 0, .y = 0, .width = device->width, .height = device->height
+    };
+}
+
+/* Record that a region of the back buffer has been drawn to. */
+static void mark_damaged(bga_p device, unsigned int x, unsigned int y,
+                         unsigned int width, unsigned int height)
+{
+    if (device->back_buffer != NULL && width > 0 && height > 0) {
+        struct rect rect = { .x = x, .y = y, .width = width, .height = height };
+        damage_add(&device->damage, &rect);
+    }
+}
+
+/* Span fill routines, one per supported pixel size. Rather than copying a pixel
+ * at a time, these build a 64-bit (or for 24-bit, 96-bit) word holding as many
+ * whole pixels as fit and store that repeatedly. The word-sized memcpy calls
+ * compile to single, possibly unaligned, stores and the loops are simple enough
+ * for the compiler to vectorise. Nothing is ever read back from the frame
+ * buffer.
+ */
+static void fill_8(char *target, size_t pixels, const char *value)
+{
+    (void)memset(target, value[0], pixels);
+}
+
+static void fill_16(char *target, size_t pixels, const char *value)
+{
+    uint16_t pixel;
+    (void)memcpy(&pixel, value, sizeof(pixel));
+    uint64_t word = pixel * 0x0001000100010001ull;
+
+    for (; pixels >= 4; pixels -= 4, target += sizeof(word)) {
+        (void)memcpy(target, &word, sizeof(word));
+    }
+    for (; pixels > 0; pixels--, target += sizeof(pixel)) {
+        (void)memcpy(target, &pixel, sizeof(pixel));
+    }
+}
+
+static void fill_24(char *target, size_t pixels, const char *value)
+{
+    /* Four pixels make up exactly three 32-bit words. */
+    uint8_t pattern[12];
+    for (size_t i = 0; i < sizeof(pattern); i += 3) {
+        (void)memcpy(&pattern[i], value, 3);
+    }
+    uint32_t words[3];
+    (void)memcpy(words, pattern, sizeof(words));
+
+    for (; pixels >= 4; pixels -= 4, target += sizeof(words)) {
+        (void)memcpy(target, words, sizeof(words));
+    }
+    for (; pixels > 0; pixels--, target += 3) {
+        (void)memcpy(target, value, 3);
+    }
+}
+
+static void fill_32(char *target, size_t pixels, const char *value)
+{
+    /* As in bga_set_pixel, only the low three bytes of the pixel are given. */
+    uint32_t pixel = 0;
+    (void)memcpy(&pixel, value, 3);
+    uint64_t word = pixel * 0x0000000100000001ull;
+
+    for (; pixels >= 2; pixels -= 2, target += sizeof(word)) {
+        (void)memcpy(target, &word, sizeof(word));
+    }
+    if (pixels > 0) {
+        (void)memcpy(target, &pixel, sizeof(pixel));
+    }
+}
+
 int bga_set_mode(bga_p device, unsigned int width, unsigned int height, unsigned int bpp)
 {
+    /* Any back buffer is sized for the old mode. */
+    bga_disable_back_buffer(device);
+
     /* We need to disable the device to change these parameters. */
     disable(device);
 
@@ -114,6 +290,31 @@ int bga_set_mode(bga_p device, unsigned int width, unsigned int height, unsigned
     write_data(device, bits_per_pixel, bpp);
     device->bpp = bpp;
 
+    /* Pick the bulk operation routines once here rather than per call. */
+    switch (bpp) {
+    case 8:
+        device->pixel_size = 1;
+        device->fill = fill_8;
+        break;
+    case 15:
+    case 16:
+        device->pixel_size = 2;
+        device->fill = fill_16;
+        break;
+    case 24:
+        device->pixel_size = 3;
+        device->fill = fill_24;
+        break;
+    case 32:
+        device->pixel_size = 4;
+        device->fill = fill_32;
+        break;
+    default:
+        device->pixel_size = 0;
+        device->fill = NULL;
+        break;
+    }
+
     /* Finally re-enable the device to have the settings take effect. */
     enable(device);
 
@@ -159,8 +360,95 @@ int bga_set_pixel(bga_p device, unsigned int x, unsigned int y, char *value)
     }
 
     /* Determine where we need to write and copy the pixel data over. */
-    target = ((char *)device->framebuffer) + (y * device->width + x) * coord_factor;
+    target = device->surface + (y * device->width + x) * coord_factor;
     (void)memcpy(target, value, len);
+    mark_damaged(device, x, y, 1, 1);
+
+    return 0;
+}
+
+/* Check that a rectangle lies within the screen and the mode supports the bulk
+ * operations.
+ */
+static bool rect_valid(bga_p device, unsigned int x, unsigned int y,
+                       unsigned int width, unsigned int height)
+{
+    return device->fill != NULL && x <= device->width && width <= device->width - x &&
+           y <= device->height && height <= device->height - y;
+}
+
+static char *pixel_address(bga_p device, unsigned int x, unsigned int y)
+{
+    return device->surface + ((size_t)y * device->width + x) * device->pixel_size;
+}
+
+int bga_fill_rect(bga_p device, unsigned int x, unsigned int y, unsigned int width,
+                  unsigned int height, const char *value)
+{
+    if (!rect_valid(device, x, y, width, height)) {
+        return -1;
+    }
+
+    size_t stride = (size_t)device->width * device->pixel_size;
+    char *target = pixel_address(device, x, y);
+    if (width == device->width) {
+        /* Whole rows are contiguous, so fill the lot as one span. */
+        device->fill(target, (size_t)width * height, value);
+    } else {
+        for (unsigned int row = 0; row < height; row++, target += stride) {
+            device->fill(target, width, value);
+        }
+    }
+    mark_damaged(device, x, y, width, height);
+
+    return 0;
+}
+
+int bga_blit(bga_p device, unsigned int x, unsigned int y, unsigned int width,
+             unsigned int height, const void *source, size_t source_stride)
+{
+    if (!rect_valid(device, x, y, width, height)) {
+        return -1;
+    }
+
+    size_t stride = (size_t)device->width * device->pixel_size;
+    size_t row_size = (size_t)width * device->pixel_size;
+    char *target = pixel_address(device, x, y);
+    const char *src = source;
+    if (row_size == stride && source_stride == stride) {
+        (void)memcpy(target, src, row_size * height);
+    } else {
+        for (unsigned int row = 0; row < height; row++, target += stride, src += source_stride) {
+            (void)memcpy(target, src, row_size);
+        }
+    }
+    mark_damaged(device, x, y, width, height);
+
+    return 0;
+}
+
+int bga_scroll(bga_p device, int lines)
+{
+    if (device->fill == NULL) {
+        return -1;
+    }
+
+    unsigned int distance = lines < 0 ? -(unsigned int)lines : (unsigned int)lines;
+    if (distance >= device->height) {
+        /* Everything scrolls off screen; there is nothing to move. */
+        return 0;
+    }
+
+    /* Rows are contiguous, so the whole move is a single (overlapping) copy. */
+    size_t stride = (size_t)device->width * device->pixel_size;
+    size_t size = (size_t)(device->height - distance) * stride;
+    char *top = device->surface;
+    if (lines > 0) {
+        (void)memmove(top, top + distance * stride, size);
+    } else {
+        (void)memmove(top + distance * stride, top, size);
+    }
+    mark_damaged(device, 0, 0, device->width, device->height);
 
     return 0;
 }
@@ -169,3 +457,138 @@ void *bga_get_framebuffer(bga_p device)
 {
     return device->framebuffer;
 }
+
+/* Registers used for page flipping. The virtual height is how many lines of
+ * the frame buffer the display may be panned across and the Y offset is the
+ * first line scanned out.
+ */
+static const uint16_t INDEX_VIRT_HEIGHT = 0x0007;
+static const uint16_t INDEX_Y_OFFSET = 0x0009;
+
+int bga_enable_back_buffer(bga_p device, size_t framebuffer_size)
+{
+    if (device->back_buffer != NULL) {
+        return 0;
+    }
+    if (device->fill == NULL) {
+        /* No mode set, or the bpp is not supported by the bulk operations. */
+        return -1;
+    }
+
+    size_t size = screen_size(device);
+    device->back_buffer = malloc(size);
+    if (device->back_buffer == NULL) {
+        return -1;
+    }
+
+    /* Start from what is currently on screen. This is the only time the
+     * frame buffer is read.
+     */
+    (void)memcpy(device->back_buffer, device->framebuffer, size);
+    device->surface = device->back_buffer;
+    device->front_page = 0;
+    device->damage.count = 0;
+    device->previous.count = 0;
+
+    device->page_flip = framebuffer_size / 2 >= size && device->height * 2 <= UINT16_MAX;
+    if (device->page_flip) {
+        write_data(device, INDEX_VIRT_HEIGHT, device->height * 2);
+        write_data(device, INDEX_Y_OFFSET, 0);
+        /* The hidden page holds nothing useful yet. */
+        damage_screen(device, &device->previous);
+    }
+
+    return 0;
+}
+
+void bga_disable_back_buffer(bga_p device)
+{
+    if (device->back_buffer == NULL) {
+        return;
+    }
+
+    if (device->page_flip && device->front_page != 0) {
+        /* Bring the frame on screen back to the start of the frame buffer,
+         * where raw frame buffer users expect it.
+         */
+        (void)memcpy(device->framebuffer, device->back_buffer, screen_size(device));
+        write_data(device, INDEX_Y_OFFSET, 0);
+    }
+
+    free(device->back_buffer);
+    device->back_buffer = NULL;
+    device->surface = device->framebuffer;
+    device->page_flip = false;
+    device->front_page = 0;
+}
+
+void *bga_get_back_buffer(bga_p device)
+{
+    return device->back_buffer;
+}
+
+int bga_damage(bga_p device, unsigned int x, unsigned int y, unsigned int width,
+               unsigned int height)
+{
+    if (device->back_buffer == NULL || !rect_valid(device, x, y, width, height)) {
+        return -1;
+    }
+
+    mark_damaged(device, x, y, width, height);
+    return 0;
+}
+
+static void copy_rect(bga_p device, char *page, const struct rect *rect)
+{
+    size_t stride = (size_t)device->width * device->pixel_size;
+    size_t offset = ((size_t)rect->y * device->width + rect->x) * device->pixel_size;
+    size_t row_size = (size_t)rect->width * device->pixel_size;
+    const char *src = device->back_buffer + offset;
+    char *target = page + offset;
+
+    if (row_size == stride) {
+        (void)memcpy(target, src, row_size * rect->height);
+        return;
+    }
+    for (unsigned int row = 0; row < rect->height; row++, src += stride, target += stride) {
+        (void)memcpy(target, src, row_size);
+    }
+}
+
+int bga_present(bga_p device)
+{
+    if (device->back_buffer == NULL) {
+        return -1;
+    }
+
+    if (!device->page_flip) {
+        for (unsigned int i = 0; i < device->damage.count; i++) {
+            copy_rect(device, device->framebuffer, &device->damage.rects[i]);
+        }
+        device->damage.count = 0;
+        return 0;
+    }
+
+    if (device->damage.count == 0) {
+        /* Nothing has changed since the last flip. */
+        return 0;
+    }
+
+    /* Bring the hidden page up to date with the back buffer and flip to it. */
+    unsigned int hidden = !device->front_page;
+    char *page = (char *)device->framebuffer + hidden * screen_size(device);
+    struct damage pending = device->previous;
+    for (unsigned int i = 0; i < device->damage.count; i++) {
+        damage_add(&pending, &device->damage.rects[i]);
+    }
+    for (unsigned int i = 0; i < pending.count; i++) {
+        copy_rect(device, page, &pending.rects[i]);
+    }
+    write_data(device, INDEX_Y_OFFSET, hidden * device->height);
+
+    device->front_page = hidden;
+    device->previous = device->damage;
+    device->damage.count = 0;
+
+    return 0;
+}
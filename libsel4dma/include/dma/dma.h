@@ -13,6 +13,7 @@
 #include <platsupport/io.h>
 
 struct dma_allocator;
+struct dma_thread_cache;
 typedef struct dma_mem *dma_mem_t;
 
 typedef void *vaddr_t;
@@ -61,6 +62,81 @@ enum dma_flags {
 };
 
 
+/**
+ * A range of DMA memory within a scatter list.
+ */
+struct dma_sg {
+    /// A handle to the DMA memory containing the range.
+    dma_mem_t dma_mem;
+    /// The starting virtual address of the range.
+    vaddr_t   vstart;
+    /// One greater than the last virtual address of the range.
+    vaddr_t   vend;
+};
+
+/**
+ * Usage of a node of memory provided to the allocator.
+ */
+struct dma_node_stats {
+    /// The virtual and physical addresses of the node.
+    uintptr_t vaddr;
+    uintptr_t paddr;
+    /// The size of the node in bytes.
+    size_t    size;
+    /// Whether the memory of the node is cached.
+    int       cached;
+    /// Whether the node belongs to the buddy allocator.
+    int       buddy;
+    /// Number of regions the node is split into.
+    size_t    nregions;
+    /// Bytes allocated.
+    size_t    used;
+    /// Bytes free within the allocator.
+    size_t    free;
+    /// Free bytes held by the slab caches, which are not reused for other sizes.
+    size_t    slab_cached;
+    /** The largest allocation the free memory of the node could serve, the
+        largest free block of a buddy node. */
+    size_t    largest_free;
+};
+
+/**
+ * Usage and activity of an allocator. The counters run from the creation of
+ * the allocator, or the last call to dma_reset_stats.
+ */
+struct dma_stats {
+    /// Number of nodes of memory, and their usage summed up.
+    size_t        nnodes;
+    size_t        size;
+    size_t        used;
+    size_t        free;
+    size_t        slab_cached;
+    /// The largest free extent of any node.
+    size_t        largest_free;
+    /// Allocations made and failed, and frees, of either interface.
+    unsigned long allocs;
+    unsigned long alloc_failures;
+    unsigned long frees;
+    /// Calls to morecore, and those that failed.
+    unsigned long morecore_calls;
+    unsigned long morecore_failures;
+    /** Searches of a node for free memory by the general allocator, and the
+        regions visited by them, giving the average list walk length. */
+    unsigned long walks;
+    unsigned long walk_steps;
+    /** Lookups by dma_vlookup and dma_plookup, and the steps taken by them,
+        through nodes and regions. */
+    unsigned long lookups;
+    unsigned long lookup_steps;
+};
+
+/**
+ * A callback for cache maintenance of the whole data cache.
+ * @param[in] op The operation to perform. DMA_CACHE_OP_INVALIDATE is never
+ *               requested, as it would discard the dirty lines of other memory.
+ */
+typedef void (*dma_cache_flush_fn)(dma_cache_op_t op);
+
 /**
  * A callback for providing DMA memory to the allocator.
  * @param[in]  min_size the minimum size for the allocation
@@ -93,8 +169,21 @@ int dma_dmaman_init(dma_morecore_fn morecore, ps_dma_cache_op_fn_t cache_ops,
 int dma_provide_mem(struct dma_allocator *allocator,
                     struct dma_mem_descriptor dma_desc);
 
+/**
+ * Explicitly provides memory to the buddy allocator.
+ * The memory is split into the largest blocks its physical alignment allows,
+ * for allocations of 64K and more. Its physical address must be 4K aligned.
+ * @param[in] dma_desc A description of the memory provided.
+ * @return             0 on success
+ */
+int dma_provide_buddy_mem(struct dma_allocator *allocator,
+                          struct dma_mem_descriptor dma_desc);
+
 /**
  * If possible, reclaim some memory from the DMA allocator.
+ * Memory can be reclaimed once none of it is allocated. Memory of the buddy
+ * allocator coalesces as it is freed, so it becomes reclaimable as soon as
+ * its last allocation is freed.
  * @param[in]  allocator A handle to the allocator to reclaim memory from
  * @param[out] dma_desc  If the call is successful, this structure will
  *                       be filled with a description of the memeory that
@@ -161,8 +250,59 @@ void dma_invalidate(dma_mem_t dma_mem, vaddr_t vstart, vaddr_t vend);
  */
 void dma_cleaninvalidate(dma_mem_t dma_mem, vaddr_t vstart, vaddr_t vend);
 
+/**
+ * Flush the ranges of a scatter list out to RAM.
+ * Ranges that touch or overlap the range before them are merged, so that each
+ * contiguous span of the list costs a single cache operation. All ranges must
+ * be managed by the same allocator.
+ * @param[in] sg    The scatter list.
+ * @param[in] nents The number of ranges in the scatter list.
+ */
+void dma_clean_sg(struct dma_sg *sg, int nents);
+
+/**
+ * Invalidate the ranges of a scatter list from cache.
+ * Ranges are merged as for dma_clean_sg.
+ * @param[in] sg    The scatter list.
+ * @param[in] nents The number of ranges in the scatter list.
+ */
+void dma_invalidate_sg(struct dma_sg *sg, int nents);
+
+/**
+ * Flush the ranges of a scatter list out to RAM and invalidate the caches.
+ * Ranges are merged as for dma_clean_sg.
+ * @param[in] sg    The scatter list.
+ * @param[in] nents The number of ranges in the scatter list.
+ */
+void dma_cleaninvalidate_sg(struct dma_sg *sg, int nents);
+
+/**
+ * Maintain the whole cache for large scatter lists.
+ * Cache maintenance of a scatter list totalling at least threshold bytes of
+ * cached memory is done with a single call to cache_flush instead.
+ * @param[in] allocator   The allocator managing the memory.
+ * @param[in] cache_flush The callback maintaining the whole cache, NULL to
+ *                        always maintain the ranges.
+ * @param[in] threshold   The size in bytes from which to maintain the whole
+ *                        cache.
+ */
+void dma_set_cache_flush(struct dma_allocator *allocator, dma_cache_flush_fn cache_flush,
+                         size_t threshold);
+
 /**
  * Allocate DMA memory.
+ * Memory is taken from separate pools of cached and uncached memory. DMAF_COHERENT
+ * requests uncached memory, while the other flags request cached memory, which the
+ * caller maintains with dma_clean and dma_invalidate. Allocators without cache
+ * maintenance operations only hand out uncached memory.
+ * Allocations of up to 4K are served from slab caches of fixed size blocks,
+ * so that allocating and freeing buffers of the same size takes constant
+ * time. Memory of those caches is kept by the allocator once freed.
+ * Allocations of 64K and more are served by a buddy allocator, from memory
+ * of its own, in blocks of a power of two size and alignment, which are split
+ * and coalesced in logarithmic time. This keeps large contiguous buffers from
+ * fragmenting the memory of smaller ones. More core for the buddy allocator
+ * is requested a block at a time.
  * @param[in]  allocator The DMA allocator instance to use for the allocation.
  * @param[in]  size      The allocation size.
  * @param[in]  align     The minimum alignment (in bytes) of the allocated
@@ -183,10 +323,53 @@ vaddr_t dma_alloc(struct dma_allocator *allocator, size_t size, int align,
 void dma_free(dma_mem_t dma_mem);
 
 
+/**
+ * Create a cache of DMA memory for a single thread.
+ * The allocator may be used from several threads at once, which serialises
+ * them on a lock. A thread cache holds magazines of free slab blocks for its
+ * thread instead, so that the thread only takes the lock to exchange a full
+ * or empty magazine with the allocator's depot, in batches of blocks.
+ * Blocks freed by another thread are handed back through the depot.
+ * @param[in] allocator The DMA allocator instance backing the cache.
+ * @return              A reference to the new thread cache, NULL on failure.
+ */
+struct dma_thread_cache *dma_thread_cache_init(struct dma_allocator *allocator);
+
+/**
+ * Destroy a thread cache, handing its free blocks back to the allocator.
+ * @param[in] cache The thread cache to destroy.
+ */
+void dma_thread_cache_destroy(struct dma_thread_cache *cache);
+
+/**
+ * Allocate DMA memory through a thread cache.
+ * Allocations that don't fit the slab caches are passed on to dma_alloc.
+ * @param[in]  cache     The thread cache of the calling thread.
+ * @param[in]  size      The allocation size.
+ * @param[in]  align     The minimum alignment (in bytes) of the allocated
+ *                       region.
+ * @param[in]  flags     The allocation properties of the request.
+ * @param[out] dma_mem   If the call is successful and dma_mem is not NULL,
+ *                       dma_mem will contain a handle to the allocated memory.
+ * @return               The virtual address of the allocated DMA memory, NULL
+ *                       on failure.
+ */
+vaddr_t dma_thread_cache_alloc(struct dma_thread_cache *cache, size_t size, int align,
+                               enum dma_flags flags, dma_mem_t *dma_mem);
+
+/**
+ * Free DMA memory through a thread cache.
+ * The memory may have been allocated by any thread, or with dma_alloc.
+ * @param[in] cache     The thread cache of the calling thread.
+ * @param[in] dma_mem   A handle to the DMA memory to free.
+ */
+void dma_thread_cache_free(struct dma_thread_cache *cache, dma_mem_t dma_mem);
+
 /**
  * Retrieve the DMA memory handle from a given physical address.
- * The performance of this operation is likely to be poor, but it may be useful
- * for rapid prototyping or debugging.
+ * Nodes of memory are found with a binary search and regions within them
+ * through a table indexed by page, so this is cheap enough for every free
+ * and pin made through the libplatsupport DMA manager.
  * @param[in] allocator The allocator managing the memory.
  * @param[in] paddr     The physical address of the memory in question
  * @return              The DMA memory handle associated with the
@@ -197,8 +380,9 @@ dma_mem_t dma_plookup(struct dma_allocator *allocator, paddr_t paddr);
 
 /**
  * Retrieve the DMA memory handle from a given virtual address.
- * The performance of this operation is likely to be poor, but it may be useful
- * for rapid prototyping or debugging.
+ * Nodes of memory are found with a binary search and regions within them
+ * through a table indexed by page, so this is cheap enough for every free
+ * and pin made through the libplatsupport DMA manager.
  * @param[in] allocator The allocator managing the memory.
  * @param[in] vaddr     The virtual address of the memory in question
  * @return              The DMA memory handle associated with the
@@ -206,3 +390,27 @@ dma_mem_t dma_plookup(struct dma_allocator *allocator, paddr_t paddr);
  *                      address is not managed by the provided allocator.
  */
 dma_mem_t dma_vlookup(struct dma_allocator *allocator, vaddr_t vaddr);
+
+/**
+ * Retrieve the usage and activity of an allocator.
+ * The usage is worked out by walking all the memory of the allocator, with it
+ * locked, so this is meant for occasional reporting.
+ * @param[in]  allocator The allocator to report on.
+ * @param[out] stats     Filled with the usage and the counters.
+ */
+void dma_get_stats(struct dma_allocator *allocator, struct dma_stats *stats);
+
+/**
+ * Retrieve the usage of a node of memory of an allocator.
+ * @param[in]  allocator The allocator to report on.
+ * @param[in]  index     The index of the node, in order of physical address.
+ * @param[out] stats     Filled with the usage of the node.
+ * @return               0 on success, non-zero if there is no node at index.
+ */
+int dma_get_node_stats(struct dma_allocator *allocator, int index, struct dma_node_stats *stats);
+
+/**
+ * Restart the counters of an allocator from zero.
+ * @param[in] allocator The allocator whose counters to reset.
+ */
+void dma_reset_stats(struct dma_allocator *allocator);
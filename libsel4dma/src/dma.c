@@ -9,6 +9,7 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <autoconf.h>
 
@@ -38,6 +39,32 @@
 
 /* dma_mem_t flag bit that signals that the memory is in use */
 #define DMFLAG_ALLOCATED 1
+/* dma_mem_t flag bit that signals that the memory is carved up by a slab */
+#define DMFLAG_SLAB 2
+/* dma_mem_t flag bit that signals that the memory is a block of a slab */
+#define DMFLAG_SLAB_BLOCK 4
+
+/* Size classes of the slab caches, powers of two alignment and size */
+#define DMA_SLAB_MIN_BITS 6
+#define DMA_SLAB_MAX_BITS 12
+#define DMA_SLAB_NCLASSES (DMA_SLAB_MAX_BITS - DMA_SLAB_MIN_BITS + 1)
+/* Slab caches for each size class, of uncached and of cached memory */
+#define DMA_SLAB_NCACHES (DMA_SLAB_NCLASSES * 2)
+/* Number of blocks carved out of each slab */
+#define DMA_SLAB_NBLOCKS 16
+
+/* Granularity of the per node table used to find regions by address */
+#define DMA_LOOKUP_BITS 12
+
+/* Number of blocks held by each magazine of a thread cache */
+#define DMA_MAGAZINE_SIZE 16
+
+/* Orders of the blocks of the buddy allocator, a page up to 1GiB */
+#define DMA_BUDDY_MIN_BITS 12
+#define DMA_BUDDY_MAX_BITS 30
+#define DMA_BUDDY_NORDERS (DMA_BUDDY_MAX_BITS - DMA_BUDDY_MIN_BITS + 1)
+/* Requests of at least this size are served by the buddy allocator */
+#define DMA_BUDDY_THRESHOLD_BITS 16
 
 /* Linked list of descriptors */
 struct dma_memd_node {
@@ -47,8 +74,18 @@ struct dma_memd_node {
     int nframes;
     /* Caps to the underlying frames */
     void **alloc_cookies;
+    /* Allocator managing this node */
+    struct dma_allocator *allocator;
     /* Head of linked list of regions */
     dma_mem_t dma_mem_head;
+    /* Region containing the start of each page of the node */
+    dma_mem_t *pages;
+    /* Number of entries in pages */
+    size_t npages;
+    /* Whether the regions are the blocks of the buddy allocator */
+    int buddy;
+    /* Number of blocks of a buddy node allocated */
+    int nused;
     /* Chain */
     struct dma_memd_node *next;
 };
@@ -61,15 +98,95 @@ struct dma_mem {
     int flags;
     /* Parent node */
     struct dma_memd_node *node;
-    /* Chain */
+    /* Slab carving up this region, or that this block belongs to */
+    struct dma_slab *slab;
+    /* Chain, or the free list of the slab cache for free blocks */
     dma_mem_t next;
+    /* Size of a buddy block (2^order bytes), 0 for memory the buddy allocator can't hand out */
+    int order;
+    /* Free list of buddy blocks of the same order */
+    dma_mem_t buddy_prev;
+    dma_mem_t buddy_next;
+};
+
+/* A batch of free blocks of a size class, held by a thread cache or the depot */
+struct dma_magazine {
+    /* Number of blocks held */
+    int rounds;
+    dma_mem_t blocks[DMA_MAGAZINE_SIZE];
+    /* Chain in the depot */
+    struct dma_magazine *next;
+};
+
+/* Free blocks of a size class */
+struct dma_slab_cache {
+    /* The size and alignment of each block (2^size_bits bytes) */
+    int size_bits;
+    /* Whether the blocks are of cached memory */
+    int cached;
+    /* Head of the free list */
+    dma_mem_t free;
+    /* Depot of full and of empty magazines, shared by the thread caches */
+    struct dma_magazine *full;
+    struct dma_magazine *empty;
+};
+
+/* Magazines of a thread, one pair for each size class */
+struct dma_thread_cache {
+    struct dma_allocator *allocator;
+    struct {
+        /* Blocks are allocated from and freed to the loaded magazine */
+        struct dma_magazine *loaded;
+        struct dma_magazine *previous;
+    } classes[DMA_SLAB_NCACHES];
+};
+
+/* A region of general memory carved up into the blocks of one size class */
+struct dma_slab {
+    /* Cache that the blocks are freed to */
+    struct dma_slab_cache *cache;
+    /* The region, allocated from the general allocator */
+    dma_mem_t mem;
+    /* The blocks, in address order */
+    struct dma_mem blocks[DMA_SLAB_NBLOCKS];
 };
 
 struct dma_allocator {
     dma_morecore_fn morecore;
     struct dma_memd_node *head;
+    /* Slab caches sitting in front of the general allocator */
+    struct dma_slab_cache slab_caches[DMA_SLAB_NCACHES];
+    /* Free blocks of the buddy allocator by order, of uncached and of cached memory */
+    dma_mem_t buddy_free[2][DMA_BUDDY_NORDERS];
+    /* Cache maintenance of cached memory, NULL to only hand out uncached memory */
+    ps_dma_cache_op_fn_t cache_op;
+    /* Maintenance of the whole cache, used for scatter lists of at least
+     * cache_flush_threshold bytes */
+    dma_cache_flush_fn cache_flush;
+    size_t cache_flush_threshold;
+    /* Nodes sorted by virtual and by physical address, for lookups */
+    struct dma_memd_node **vnodes;
+    struct dma_memd_node **pnodes;
+    int nnodes;
+    /* Counters of the allocator's activity */
+    struct dma_stats stats;
+    /* Serialises use of the allocator between threads */
+    char lock;
 };
 
+/* Counters bumped without the allocator locked, by thread caches */
+#define _stat_inc(allocator, counter) __atomic_fetch_add(&(allocator)->stats.counter, 1, __ATOMIC_RELAXED)
+
+static inline void _lock(struct dma_allocator *allocator)
+{
+    while (__atomic_test_and_set(&allocator->lock, __ATOMIC_ACQUIRE));
+}
+
+static inline void _unlock(struct dma_allocator *allocator)
+{
+    __atomic_clear(&allocator->lock, __ATOMIC_RELEASE);
+}
+
 
 /*** Helpers ***/
 
@@ -95,15 +212,38 @@ static inline size_t _mem_size(dma_mem_t m)
     return s -= m->offset;
 }
 
+static inline uintptr_t _mem_end(dma_mem_t m)
+{
+    return m->next ? m->next->offset : _node_size(m->node);
+}
+
+/* Point the entries of the pages that start within [start, end) at a region */
+static void _set_pages(struct dma_memd_node *n, uintptr_t start, uintptr_t end, dma_mem_t m)
+{
+    size_t i = (start + ((size_t)1 << DMA_LOOKUP_BITS) - 1) >> DMA_LOOKUP_BITS;
+    for (; i < n->npages && (i << DMA_LOOKUP_BITS) < end; i++) {
+        n->pages[i] = m;
+    }
+}
+
 /* @pre the offset must be contained within the node provided node */
-static inline dma_mem_t _find_mem(struct dma_memd_node *n, uintptr_t offset)
+static inline dma_mem_t _find_mem(struct dma_memd_node *n, uintptr_t offset, unsigned long *steps)
 {
     dma_mem_t m;
     assert(n);
     assert(offset < _node_size(n));
-    m = n->dma_mem_head;
+    /* Start from the region containing the start of the page */
+    m = n->pages[offset >> DMA_LOOKUP_BITS];
     while (m->next != NULL && offset >= m->next->offset) {
         m = m->next;
+        (*steps)++;
+    }
+    /* Memory in a slab is handed out by block */
+    if (m->flags & DMFLAG_SLAB) {
+        uintptr_t i = (offset - m->offset) >> m->slab->cache->size_bits;
+        if (i < DMA_SLAB_NBLOCKS) {
+            return &m->slab->blocks[i];
+        }
     }
     return m;
 }
@@ -113,6 +253,7 @@ static void _mem_compact(dma_mem_t m)
     while (m->next != NULL && _is_free(m->next)) {
         dma_mem_t compact = m->next;
         dprintf("Compacting:\n");
+        _set_pages(m->node, compact->offset, _mem_end(compact), m);
         m->next = compact->next;
         _free(compact);
     }
@@ -145,6 +286,61 @@ static void print_dma_allocator(struct dma_allocator *a)
     }
 }
 
+/*** Node lookup ***/
+
+static inline uintptr_t _node_start(struct dma_memd_node *n, int phys)
+{
+    return phys ? n->desc.paddr : n->desc.vaddr;
+}
+
+/* Find the index in a sorted array of the first node starting above an address */
+static int _node_index(struct dma_memd_node **nodes, int nnodes, uintptr_t addr, int phys, unsigned long *steps)
+{
+    int lo = 0, hi = nnodes;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (steps != NULL) {
+            (*steps)++;
+        }
+        if (_node_start(nodes[mid], phys) <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static void _node_insert(struct dma_memd_node **nodes, int nnodes, struct dma_memd_node *n, int phys)
+{
+    int i = _node_index(nodes, nnodes, _node_start(n, phys), phys, NULL);
+    memmove(&nodes[i + 1], &nodes[i], (nnodes - i) * sizeof(*nodes));
+    nodes[i] = n;
+}
+
+static void _node_remove(struct dma_memd_node **nodes, int nnodes, struct dma_memd_node *n)
+{
+    int i;
+    for (i = 0; nodes[i] != n; i++);
+    memmove(&nodes[i], &nodes[i + 1], (nnodes - i - 1) * sizeof(*nodes));
+}
+
+/* Find the node containing an address */
+static struct dma_memd_node *_find_node(struct dma_allocator *allocator, uintptr_t addr, int phys,
+                                       unsigned long *steps)
+{
+    struct dma_memd_node **nodes = phys ? allocator->pnodes : allocator->vnodes;
+    int i = _node_index(nodes, allocator->nnodes, addr, phys, steps);
+    if (i == 0) {
+        return NULL;
+    }
+    struct dma_memd_node *n = nodes[i - 1];
+    if (addr - _node_start(n, phys) >= _node_size(n)) {
+        return NULL;
+    }
+    return n;
+}
+
 /*** Interface ***/
 
 
@@ -152,10 +348,22 @@ static struct dma_memd_node *do_dma_provide_mem(struct dma_allocator *allocator,
                                                 struct dma_mem_descriptor *dma_desc)
 {
     struct dma_memd_node *n;
+    struct dma_memd_node **nodes;
     dma_mem_t m;
 
     /* The memory size must be sane */
     assert(dma_desc->size_bits > 0 && dma_desc->size_bits < 32);
+    /* Make room for the node in the lookup arrays */
+    nodes = realloc(allocator->vnodes, sizeof(*nodes) * (allocator->nnodes + 1));
+    if (nodes == NULL) {
+        return NULL;
+    }
+    allocator->vnodes = nodes;
+    nodes = realloc(allocator->pnodes, sizeof(*nodes) * (allocator->nnodes + 1));
+    if (nodes == NULL) {
+        return NULL;
+    }
+    allocator->pnodes = nodes;
     /* Allocate some objects */
     m = (dma_mem_t)_malloc(sizeof(*m));
     if (m == NULL) {
@@ -172,10 +380,15 @@ static struct dma_memd_node *do_dma_provide_mem(struct dma_allocator *allocator,
     m->flags = 0;
     m->next = NULL;
     m->node = n;
+    m->slab = NULL;
+    m->order = 0;
     /* Initialise the pool node */
     n->desc = *dma_desc;
+    n->allocator = allocator;
     n->dma_mem_head = m;
     n->next = allocator->head;
+    n->buddy = 0;
+    n->nused = 0;
     n->nframes = 1;
     n->alloc_cookies = _malloc(sizeof(*n->alloc_cookies) * n->nframes);
     if (n->alloc_cookies == NULL) {
@@ -184,8 +397,20 @@ static struct dma_memd_node *do_dma_provide_mem(struct dma_allocator *allocator,
         return NULL;
     }
     n->alloc_cookies[0] = dma_desc->alloc_cookie;
+    n->npages = (_node_size(n) + ((size_t)1 << DMA_LOOKUP_BITS) - 1) >> DMA_LOOKUP_BITS;
+    n->pages = _malloc(sizeof(*n->pages) * n->npages);
+    if (n->pages == NULL) {
+        _free(n->alloc_cookies);
+        _free(n);
+        _free(m);
+        return NULL;
+    }
+    _set_pages(n, 0, _node_size(n), m);
     /* Add the node to the allocator */
     allocator->head = n;
+    _node_insert(allocator->vnodes, allocator->nnodes, n, 0);
+    _node_insert(allocator->pnodes, allocator->nnodes, n, 1);
+    allocator->nnodes++;
 
     dprintf("DMA memory provided\n");
     print_dma_allocator(allocator);
@@ -204,6 +429,22 @@ dma_allocator_init(dma_morecore_fn morecore)
     }
     alloc->morecore = morecore;
     alloc->head = NULL;
+    alloc->vnodes = NULL;
+    alloc->pnodes = NULL;
+    alloc->nnodes = 0;
+    alloc->lock = 0;
+    alloc->cache_op = NULL;
+    alloc->cache_flush = NULL;
+    alloc->cache_flush_threshold = 0;
+    for (int i = 0; i < DMA_SLAB_NCACHES; i++) {
+        alloc->slab_caches[i].size_bits = DMA_SLAB_MIN_BITS + i % DMA_SLAB_NCLASSES;
+        alloc->slab_caches[i].cached = i >= DMA_SLAB_NCLASSES;
+        alloc->slab_caches[i].free = NULL;
+        alloc->slab_caches[i].full = NULL;
+        alloc->slab_caches[i].empty = NULL;
+    }
+    memset(alloc->buddy_free, 0, sizeof(alloc->buddy_free));
+    memset(&alloc->stats, 0, sizeof(alloc->stats));
     return alloc;
 }
 
@@ -212,15 +453,20 @@ int dma_provide_mem(struct dma_allocator *allocator,
                     struct dma_mem_descriptor dma_desc)
 {
     struct dma_memd_node *n;
+    _lock(allocator);
     n = do_dma_provide_mem(allocator, &dma_desc);
+    _unlock(allocator);
     return n == NULL;
 }
 
 static dma_mem_t dma_memd_alloc(struct dma_memd_node *n, size_t size, int align)
 {
     dma_mem_t m;
+    dma_mem_t prev = NULL;
     dprintf("Allocating 0x%x aligned to 0x%x\n", size, align);
-    for (m = n->dma_mem_head; m != NULL; m = m->next) {
+    n->allocator->stats.walks++;
+    for (m = n->dma_mem_head; m != NULL; prev = m, m = m->next) {
+        n->allocator->stats.walk_steps++;
         if (_is_free(m)) {
             size_t mem_size;
             int mem_align;
@@ -237,6 +483,10 @@ static dma_mem_t dma_memd_alloc(struct dma_memd_node *n, size_t size, int align)
             mem_size = _mem_size(m) - mem_align;
             /* Check for overflow in subtraction and check our size */
             if (_mem_size(m) > mem_align && mem_size >= size) {
+                /* The alignment gap is left to the previous region */
+                if (prev != NULL) {
+                    _set_pages(n, m->offset, m->offset + mem_align, prev);
+                }
                 m->offset += mem_align;
                 /* Split off the free memory if possible */
                 if (mem_size > size) {
@@ -247,8 +497,10 @@ static dma_mem_t dma_memd_alloc(struct dma_memd_node *n, size_t size, int align)
                         split->flags = m->flags;
                         split->next = m->next;
                         split->node = m->node;
+                        split->slab = NULL;
 
                         m->next = split;
+                        _set_pages(n, split->offset, _mem_end(split), split);
                     } else {
                         /* Just use the over size region... */
                     }
@@ -261,34 +513,22 @@ static dma_mem_t dma_memd_alloc(struct dma_memd_node *n, size_t size, int align)
     return NULL;
 }
 
-vaddr_t dma_alloc(struct dma_allocator *allocator, size_t size, int align,
-                  enum dma_flags flags, dma_mem_t *ret_mem)
+/* Allocate from the general allocator, first fit across the nodes */
+static dma_mem_t dma_general_alloc(struct dma_allocator *allocator, size_t size, int align, int cached)
 {
-    int cached;
     struct dma_memd_node *n;
-    assert(allocator);
-
-    if (align < DMA_MINALIGN_BYTES) {
-        align = DMA_MINALIGN_BYTES;
-    }
-    /* TODO access patterns and cachability */
-    cached = 0;
-    (void)flags;
 
-    /* Cycle through nodes looking for free memory */
+    /* Cycle through nodes of the right cachability looking for free memory.
+     * Without cache maintenance there is a single pool, as nothing is
+     * handed out as cached */
     for (n = allocator->head; n != NULL; n = n->next) {
         dma_mem_t m;
-        /* TODO some tricky stuff first to see if an allocation from
-         * this node is appropriate (access patterns/cachability) */
+        if (n->buddy || (allocator->cache_op && !n->desc.cached != !cached)) {
+            continue;
+        }
         m = dma_memd_alloc(n, size, align);
         if (m != NULL) {
-            dprintf("DMA mem allocated\n");
-            print_dma_mem(m, "-");
-            print_dma_allocator(allocator);
-            if (ret_mem) {
-                *ret_mem = m;
-            }
-            return dma_vaddr(m);
+            return m;
         }
     }
 
@@ -300,10 +540,13 @@ vaddr_t dma_alloc(struct dma_allocator *allocator, size_t size, int align,
         int err;
         dprintf("Morecore called for %d bytes\n", size);
         /* Grab more core */
+        allocator->stats.morecore_calls++;
         err = allocator->morecore(size, cached, &dma_desc);
         if (err) {
+            allocator->stats.morecore_failures++;
             return NULL;
         }
+        dma_desc.cached = cached;
         /* Add the memory to the allocator */
         n = do_dma_provide_mem(allocator, &dma_desc);
         if (n == NULL) {
@@ -315,27 +558,404 @@ vaddr_t dma_alloc(struct dma_allocator *allocator, size_t size, int align,
         if (m == NULL) {
             return NULL;
         }
-        /* Success */
-        dprintf("DMA mem allocated\n");
-        print_dma_mem(m, "-");
-        print_dma_allocator(allocator);
-        if (ret_mem) {
-            *ret_mem = m;
-        }
-        return dma_vaddr(m);
+        return m;
     }
-    dprintf("Failed to allocate DMA memory\n");
     return NULL;
 }
 
-int dma_reclaim_mem(struct dma_allocator *allocator,
-                    struct dma_mem_descriptor *dma_desc)
+/*** Buddy allocator ***/
+
+/* Free lists of a pool of memory. Without cache maintenance there is a single pool */
+static inline int _buddy_pool(struct dma_allocator *allocator, int cached)
+{
+    return allocator->cache_op != NULL && cached;
+}
+
+static void _buddy_push(struct dma_allocator *allocator, dma_mem_t m)
+{
+    dma_mem_t *head = &allocator->buddy_free[_buddy_pool(allocator, m->node->desc.cached)][m->order -
+                                                                                           DMA_BUDDY_MIN_BITS];
+    m->buddy_prev = NULL;
+    m->buddy_next = *head;
+    if (*head != NULL) {
+        (*head)->buddy_prev = m;
+    }
+    *head = m;
+}
+
+static void _buddy_remove(struct dma_allocator *allocator, dma_mem_t m)
+{
+    dma_mem_t *head = &allocator->buddy_free[_buddy_pool(allocator, m->node->desc.cached)][m->order -
+                                                                                           DMA_BUDDY_MIN_BITS];
+    if (m->buddy_prev != NULL) {
+        m->buddy_prev->buddy_next = m->buddy_next;
+    } else {
+        *head = m->buddy_next;
+    }
+    if (m->buddy_next != NULL) {
+        m->buddy_next->buddy_prev = m->buddy_prev;
+    }
+}
+
+/* Carve a node up into the largest blocks that its physical alignment allows */
+static struct dma_memd_node *do_dma_provide_buddy_mem(struct dma_allocator *allocator,
+                                                      struct dma_mem_descriptor *dma_desc)
+{
+    struct dma_memd_node *n;
+    dma_mem_t m;
+    uintptr_t offset = 0;
+
+    if (dma_desc->paddr % ((uintptr_t)1 << DMA_BUDDY_MIN_BITS)) {
+        return NULL;
+    }
+    n = do_dma_provide_mem(allocator, dma_desc);
+    if (n == NULL) {
+        return NULL;
+    }
+    n->buddy = 1;
+    m = n->dma_mem_head;
+    for (;;) {
+        size_t remaining = _node_size(n) - offset;
+        int order = DMA_BUDDY_MIN_BITS;
+        dma_mem_t next;
+        if (remaining < ((size_t)1 << DMA_BUDDY_MIN_BITS)) {
+            /* The tail is too small for a block, and is never handed out */
+            m->flags |= DMFLAG_ALLOCATED;
+            break;
+        }
+        while (order < DMA_BUDDY_MAX_BITS && !((n->desc.paddr + offset) % ((uintptr_t)1 << (order + 1)))
+               && ((size_t)1 << (order + 1)) <= remaining) {
+            order++;
+        }
+        m->order = order;
+        offset += (size_t)1 << order;
+        if (offset == _node_size(n)) {
+            _buddy_push(allocator, m);
+            break;
+        }
+        next = (dma_mem_t)_malloc(sizeof(*next));
+        if (next == NULL) {
+            /* Leave the rest of the node out of the allocator, it is reclaimed along with the node */
+            m->order = 0;
+            m->flags |= DMFLAG_ALLOCATED;
+            break;
+        }
+        _buddy_push(allocator, m);
+        next->offset = offset;
+        next->flags = 0;
+        next->next = NULL;
+        next->node = n;
+        next->slab = NULL;
+        next->order = 0;
+        m->next = next;
+        _set_pages(n, offset, _node_size(n), next);
+        m = next;
+    }
+    dprintf("DMA memory provided to the buddy allocator\n");
+    return n;
+}
+
+int dma_provide_buddy_mem(struct dma_allocator *allocator,
+                          struct dma_mem_descriptor dma_desc)
+{
+    struct dma_memd_node *n;
+    _lock(allocator);
+    n = do_dma_provide_buddy_mem(allocator, &dma_desc);
+    _unlock(allocator);
+    return n == NULL;
+}
+
+/* Take a free block of an order, splitting the smallest larger block there is */
+static dma_mem_t dma_buddy_take(struct dma_allocator *allocator, int order, int cached)
+{
+    dma_mem_t *lists = allocator->buddy_free[_buddy_pool(allocator, cached)];
+    dma_mem_t m;
+    int k;
+
+    for (k = order; k <= DMA_BUDDY_MAX_BITS && lists[k - DMA_BUDDY_MIN_BITS] == NULL; k++);
+    if (k > DMA_BUDDY_MAX_BITS) {
+        return NULL;
+    }
+    m = lists[k - DMA_BUDDY_MIN_BITS];
+    _buddy_remove(allocator, m);
+    /* Split the block down to the order, freeing each upper half */
+    while (m->order > order) {
+        dma_mem_t b = (dma_mem_t)_malloc(sizeof(*b));
+        if (b == NULL) {
+            /* Just use the over size block... */
+            break;
+        }
+        m->order--;
+        b->offset = m->offset + ((size_t)1 << m->order);
+        b->flags = 0;
+        b->node = m->node;
+        b->slab = NULL;
+        b->order = m->order;
+        b->next = m->next;
+        m->next = b;
+        _set_pages(m->node, b->offset, _mem_end(b), b);
+        _buddy_push(allocator, b);
+    }
+    return m;
+}
+
+/* Allocate a block of the buddy allocator, NULL if the request is too large or there is no memory */
+static dma_mem_t dma_buddy_alloc(struct dma_allocator *allocator, size_t size, int align, int cached)
+{
+    int order = DMA_BUDDY_MIN_BITS;
+    dma_mem_t m;
+
+    /* Blocks are aligned to their size, which covers power of two alignments */
+    if (align & (align - 1)) {
+        return NULL;
+    }
+    if (size < (size_t)align) {
+        size = align;
+    }
+    while (order <= DMA_BUDDY_MAX_BITS && ((size_t)1 << order) < size) {
+        order++;
+    }
+    if (order > DMA_BUDDY_MAX_BITS) {
+        return NULL;
+    }
+    m = dma_buddy_take(allocator, order, cached);
+    if (m == NULL && allocator->morecore) {
+        struct dma_mem_descriptor dma_desc;
+        dprintf("Morecore called for a block of %d bytes\n", 1 << order);
+        allocator->stats.morecore_calls++;
+        if (allocator->morecore((size_t)1 << order, cached, &dma_desc)) {
+            allocator->stats.morecore_failures++;
+            return NULL;
+        }
+        dma_desc.cached = cached;
+        if (do_dma_provide_buddy_mem(allocator, &dma_desc) == NULL) {
+            return NULL;
+        }
+        m = dma_buddy_take(allocator, order, cached);
+    }
+    if (m == NULL) {
+        return NULL;
+    }
+    m->flags |= DMFLAG_ALLOCATED;
+    m->node->nused++;
+    return m;
+}
+
+/* Free a block of the buddy allocator, coalescing it with its free buddies */
+static void dma_buddy_free(dma_mem_t m)
+{
+    struct dma_memd_node *n = m->node;
+    struct dma_allocator *allocator = n->allocator;
+
+    assert(!_is_free(m));
+    m->flags &= ~DMFLAG_ALLOCATED;
+    n->nused--;
+    while (m->order < DMA_BUDDY_MAX_BITS) {
+        size_t size = (size_t)1 << m->order;
+        uintptr_t buddy_offset = ((n->desc.paddr + m->offset) ^ size) - n->desc.paddr;
+        dma_mem_t b, lo, hi;
+        /* Buddies that would lie outside the node were never part of it */
+        if (buddy_offset >= _node_size(n) || _node_size(n) - buddy_offset < size) {
+            break;
+        }
+        /* Blocks start on a page, so the buddy is the region of its page */
+        b = n->pages[buddy_offset >> DMA_LOOKUP_BITS];
+        if (b->offset != buddy_offset || !_is_free(b) || b->order != m->order) {
+            break;
+        }
+        _buddy_remove(allocator, b);
+        lo = b->offset < m->offset ? b : m;
+        hi = b->offset < m->offset ? m : b;
+        lo->next = hi->next;
+        lo->order++;
+        _set_pages(n, hi->offset, _mem_end(lo), lo);
+        _free(hi);
+        m = lo;
+    }
+    _buddy_push(allocator, m);
+}
+
+/* Find the slab cache serving a request, NULL if it is too large for the slabs */
+static struct dma_slab_cache *dma_slab_cache(struct dma_allocator *allocator, size_t size, int align,
+                                             int cached)
+{
+    int size_bits = DMA_SLAB_MIN_BITS;
+    /* Blocks are aligned to their size, which covers power of two alignments */
+    if (align & (align - 1)) {
+        return NULL;
+    }
+    if (size < (size_t)align) {
+        size = align;
+    }
+    while (size_bits <= DMA_SLAB_MAX_BITS && ((size_t)1 << size_bits) < size) {
+        size_bits++;
+    }
+    if (size_bits > DMA_SLAB_MAX_BITS) {
+        return NULL;
+    }
+    return &allocator->slab_caches[(cached ? DMA_SLAB_NCLASSES : 0) + size_bits - DMA_SLAB_MIN_BITS];
+}
+
+/* Carve a new slab up in to free blocks for the cache */
+static int dma_slab_grow(struct dma_allocator *allocator, struct dma_slab_cache *cache)
+{
+    size_t block_size = (size_t)1 << cache->size_bits;
+    struct dma_slab *slab;
+    dma_mem_t m;
+
+    slab = (struct dma_slab *)_malloc(sizeof(*slab));
+    if (slab == NULL) {
+        return -1;
+    }
+    m = dma_general_alloc(allocator, block_size * DMA_SLAB_NBLOCKS, block_size, cache->cached);
+    if (m == NULL) {
+        _free(slab);
+        return -1;
+    }
+    m->flags |= DMFLAG_SLAB;
+    m->slab = slab;
+    slab->cache = cache;
+    slab->mem = m;
+    for (int i = DMA_SLAB_NBLOCKS - 1; i >= 0; i--) {
+        dma_mem_t b = &slab->blocks[i];
+        b->offset = m->offset + i * block_size;
+        b->flags = DMFLAG_SLAB_BLOCK;
+        b->node = m->node;
+        b->slab = slab;
+        b->next = cache->free;
+        cache->free = b;
+    }
+    dprintf("Slab of 0x%x byte blocks created\n", block_size);
+    return 0;
+}
+
+/* Take a free block off the free list of a slab cache */
+static dma_mem_t dma_slab_take(struct dma_allocator *allocator, struct dma_slab_cache *cache)
+{
+    dma_mem_t m;
+    if (cache->free == NULL && dma_slab_grow(allocator, cache)) {
+        return NULL;
+    }
+    m = cache->free;
+    cache->free = m->next;
+    m->next = NULL;
+    return m;
+}
+
+/* Allocate a block from a slab cache */
+static dma_mem_t dma_slab_alloc(struct dma_allocator *allocator, size_t size, int align, int cached)
+{
+    struct dma_slab_cache *cache;
+    dma_mem_t m;
+
+    cache = dma_slab_cache(allocator, size, align, cached);
+    if (cache == NULL) {
+        return NULL;
+    }
+    m = dma_slab_take(allocator, cache);
+    if (m == NULL) {
+        return NULL;
+    }
+    m->flags |= DMFLAG_ALLOCATED;
+    return m;
+}
+
+/* Whether requests with the given flags are served from cached memory */
+static int _flags_cached(struct dma_allocator *allocator, enum dma_flags flags)
+{
+    /* Without cache maintenance, all memory handed out must be uncached */
+    return flags != DMAF_COHERENT && allocator->cache_op != NULL;
+}
+
+static dma_mem_t do_dma_alloc(struct dma_allocator *allocator, size_t size, int align, int cached)
+{
+    dma_mem_t m;
+
+    /* Large requests are served by the buddy allocator, and small ones by the
+     * slab caches, falling back to the general allocator when neither can */
+    m = NULL;
+    if (size >= ((size_t)1 << DMA_BUDDY_THRESHOLD_BITS)) {
+        m = dma_buddy_alloc(allocator, size, align, cached);
+    }
+    if (m == NULL) {
+        m = dma_slab_alloc(allocator, size, align, cached);
+    }
+    if (m == NULL) {
+        m = dma_general_alloc(allocator, size, align, cached);
+    }
+    if (m == NULL && cached) {
+        /* Uncached memory is slower but always correct */
+        return do_dma_alloc(allocator, size, align, 0);
+    }
+    if (m == NULL) {
+        dprintf("Failed to allocate DMA memory\n");
+        return NULL;
+    }
+    dprintf("DMA mem allocated\n");
+    print_dma_mem(m, "-");
+    print_dma_allocator(allocator);
+    return m;
+}
+
+vaddr_t dma_alloc(struct dma_allocator *allocator, size_t size, int align,
+                  enum dma_flags flags, dma_mem_t *ret_mem)
+{
+    dma_mem_t m;
+    assert(allocator);
+
+    if (align < DMA_MINALIGN_BYTES) {
+        align = DMA_MINALIGN_BYTES;
+    }
+    _lock(allocator);
+    m = do_dma_alloc(allocator, size, align, _flags_cached(allocator, flags));
+    _unlock(allocator);
+    if (m == NULL) {
+        _stat_inc(allocator, alloc_failures);
+        return NULL;
+    }
+    _stat_inc(allocator, allocs);
+    if (ret_mem) {
+        *ret_mem = m;
+    }
+    return dma_vaddr(m);
+}
+
+/* Take the blocks of a buddy node with none allocated off the free lists,
+ * leaving the node as a single free region */
+static void _buddy_release_node(struct dma_allocator *allocator, struct dma_memd_node *n)
+{
+    dma_mem_t m = n->dma_mem_head;
+    while (m != NULL) {
+        dma_mem_t next = m->next;
+        if (_is_free(m)) {
+            _buddy_remove(allocator, m);
+        }
+        if (m != n->dma_mem_head) {
+            _free(m);
+        }
+        m = next;
+    }
+    m = n->dma_mem_head;
+    m->flags = 0;
+    m->order = 0;
+    m->next = NULL;
+}
+
+static int do_dma_reclaim_mem(struct dma_allocator *allocator,
+                              struct dma_mem_descriptor *dma_desc)
 {
     struct dma_memd_node *n;
     struct dma_memd_node **nptr = &allocator->head;
     for (n = allocator->head; n != NULL; n = n->next) {
         dma_mem_t m = n->dma_mem_head;
-        _mem_compact(m);
+        if (n->buddy) {
+            /* Freed blocks coalesce as they are freed, so the node is free once none are allocated */
+            if (n->nused == 0) {
+                _buddy_release_node(allocator, n);
+            }
+        } else {
+            _mem_compact(m);
+        }
         if (_is_free(m) && !m->next) {
             *dma_desc = n->desc;
             /* Currently there is not support for compacted nodes */
@@ -343,7 +963,11 @@ int dma_reclaim_mem(struct dma_allocator *allocator,
             dma_desc->alloc_cookie = n->alloc_cookies[0];
             /* Remove the node and free memory */
             *nptr = n->next;
+            _node_remove(allocator->vnodes, allocator->nnodes, n);
+            _node_remove(allocator->pnodes, allocator->nnodes, n);
+            allocator->nnodes--;
             _free(m);
+            _free(n->pages);
             _free(n->alloc_cookies);
             _free(n);
             return 0;
@@ -353,14 +977,212 @@ int dma_reclaim_mem(struct dma_allocator *allocator,
     return -1;
 }
 
-void dma_free(dma_mem_t m)
+int dma_reclaim_mem(struct dma_allocator *allocator,
+                    struct dma_mem_descriptor *dma_desc)
 {
-    if (m) {
+    int err;
+    _lock(allocator);
+    err = do_dma_reclaim_mem(allocator, dma_desc);
+    _unlock(allocator);
+    return err;
+}
+
+static void do_dma_free(dma_mem_t m)
+{
+    if (m->node->buddy) {
+        dma_buddy_free(m);
+    } else if (m->flags & DMFLAG_SLAB_BLOCK) {
+        /* Blocks go back on the free list of their cache */
+        struct dma_slab_cache *cache = m->slab->cache;
+        assert(!_is_free(m));
+        m->flags &= ~DMFLAG_ALLOCATED;
+        m->next = cache->free;
+        cache->free = m;
+    } else {
         m->flags &= ~DMFLAG_ALLOCATED;
         _mem_compact(m);
     }
 }
 
+void dma_free(dma_mem_t m)
+{
+    if (m) {
+        struct dma_allocator *allocator = m->node->allocator;
+        _lock(allocator);
+        do_dma_free(m);
+        _unlock(allocator);
+        _stat_inc(allocator, frees);
+    }
+}
+
+/*** Thread caches ***/
+
+struct dma_thread_cache *dma_thread_cache_init(struct dma_allocator *allocator)
+{
+    struct dma_thread_cache *tc;
+    assert(allocator);
+    tc = (struct dma_thread_cache *)_malloc(sizeof(*tc));
+    if (tc == NULL) {
+        return NULL;
+    }
+    tc->allocator = allocator;
+    for (int i = 0; i < DMA_SLAB_NCACHES; i++) {
+        tc->classes[i].loaded = (struct dma_magazine *)_malloc(sizeof(struct dma_magazine));
+        tc->classes[i].previous = (struct dma_magazine *)_malloc(sizeof(struct dma_magazine));
+        if (tc->classes[i].loaded == NULL || tc->classes[i].previous == NULL) {
+            _free(tc->classes[i].loaded);
+            _free(tc->classes[i].previous);
+            while (i-- > 0) {
+                _free(tc->classes[i].loaded);
+                _free(tc->classes[i].previous);
+            }
+            _free(tc);
+            return NULL;
+        }
+        tc->classes[i].loaded->rounds = 0;
+        tc->classes[i].previous->rounds = 0;
+    }
+    return tc;
+}
+
+/* Hand a magazine over to the depot, with the allocator locked */
+static void _depot_put(struct dma_slab_cache *cache, struct dma_magazine *mag)
+{
+    if (mag->rounds) {
+        mag->next = cache->full;
+        cache->full = mag;
+    } else {
+        mag->next = cache->empty;
+        cache->empty = mag;
+    }
+}
+
+void dma_thread_cache_destroy(struct dma_thread_cache *tc)
+{
+    struct dma_allocator *allocator = tc->allocator;
+    _lock(allocator);
+    for (int i = 0; i < DMA_SLAB_NCACHES; i++) {
+        _depot_put(&allocator->slab_caches[i], tc->classes[i].loaded);
+        _depot_put(&allocator->slab_caches[i], tc->classes[i].previous);
+    }
+    _unlock(allocator);
+    _free(tc);
+}
+
+/* Reload the magazines of a size class, from the depot or the slabs, with the allocator locked */
+static void _magazine_reload(struct dma_thread_cache *tc, int class)
+{
+    struct dma_slab_cache *cache = &tc->allocator->slab_caches[class];
+    struct dma_magazine *loaded = tc->classes[class].loaded;
+    if (cache->full != NULL) {
+        /* Swap the empty magazine for a full one */
+        _depot_put(cache, tc->classes[class].previous);
+        tc->classes[class].previous = loaded;
+        tc->classes[class].loaded = cache->full;
+        cache->full = cache->full->next;
+        return;
+    }
+    while (loaded->rounds < DMA_MAGAZINE_SIZE) {
+        dma_mem_t m = dma_slab_take(tc->allocator, cache);
+        if (m == NULL) {
+            break;
+        }
+        loaded->blocks[loaded->rounds++] = m;
+    }
+}
+
+vaddr_t dma_thread_cache_alloc(struct dma_thread_cache *tc, size_t size, int align,
+                               enum dma_flags flags, dma_mem_t *ret_mem)
+{
+    struct dma_allocator *allocator = tc->allocator;
+    struct dma_slab_cache *cache;
+    struct dma_magazine *mag;
+    int class;
+    dma_mem_t m;
+
+    if (align < DMA_MINALIGN_BYTES) {
+        align = DMA_MINALIGN_BYTES;
+    }
+    cache = dma_slab_cache(allocator, size, align, _flags_cached(allocator, flags));
+    if (cache == NULL) {
+        return dma_alloc(allocator, size, align, flags, ret_mem);
+    }
+    class = cache - allocator->slab_caches;
+
+    mag = tc->classes[class].loaded;
+    if (mag->rounds == 0 && tc->classes[class].previous->rounds) {
+        tc->classes[class].loaded = tc->classes[class].previous;
+        tc->classes[class].previous = mag;
+    } else if (mag->rounds == 0) {
+        _lock(allocator);
+        _magazine_reload(tc, class);
+        _unlock(allocator);
+    }
+    mag = tc->classes[class].loaded;
+    if (mag->rounds == 0) {
+        /* No slab could be created, try the general allocator */
+        return dma_alloc(allocator, size, align, flags, ret_mem);
+    }
+
+    m = mag->blocks[--mag->rounds];
+    m->flags |= DMFLAG_ALLOCATED;
+    _stat_inc(allocator, allocs);
+    if (ret_mem) {
+        *ret_mem = m;
+    }
+    return dma_vaddr(m);
+}
+
+void dma_thread_cache_free(struct dma_thread_cache *tc, dma_mem_t m)
+{
+    struct dma_allocator *allocator = tc->allocator;
+    struct dma_magazine *mag;
+    int class;
+
+    if (m == NULL) {
+        return;
+    }
+    if (!(m->flags & DMFLAG_SLAB_BLOCK) || m->node->allocator != allocator) {
+        dma_free(m);
+        return;
+    }
+    class = m->slab->cache - allocator->slab_caches;
+
+    mag = tc->classes[class].loaded;
+    if (mag->rounds == DMA_MAGAZINE_SIZE && tc->classes[class].previous->rounds == 0) {
+        tc->classes[class].loaded = tc->classes[class].previous;
+        tc->classes[class].previous = mag;
+    } else if (mag->rounds == DMA_MAGAZINE_SIZE) {
+        /* Hand the full magazines back to the depot as a batch */
+        struct dma_slab_cache *cache = &allocator->slab_caches[class];
+        struct dma_magazine *empty;
+        _lock(allocator);
+        _depot_put(cache, tc->classes[class].previous);
+        tc->classes[class].previous = mag;
+        empty = cache->empty;
+        if (empty != NULL) {
+            cache->empty = empty->next;
+        }
+        _unlock(allocator);
+        if (empty == NULL) {
+            empty = (struct dma_magazine *)_malloc(sizeof(*empty));
+        }
+        if (empty == NULL) {
+            /* Put the full magazine back, and free the block directly */
+            tc->classes[class].loaded = mag;
+            dma_free(m);
+            return;
+        }
+        empty->rounds = 0;
+        tc->classes[class].loaded = empty;
+    }
+    mag = tc->classes[class].loaded;
+    assert(!_is_free(m));
+    m->flags &= ~DMFLAG_ALLOCATED;
+    mag->blocks[mag->rounds++] = m;
+    _stat_inc(allocator, frees);
+}
+
 /*** Address translation ***/
 
 vaddr_t dma_vaddr(dma_mem_t m)
@@ -387,66 +1209,236 @@ dma_mem_t dma_plookup(struct dma_allocator *dma_allocator, paddr_t paddr)
 {
     struct dma_memd_node *n;
     uintptr_t offs;
-    /* Search the list for the associated node */
-    for (n = dma_allocator->head; n != NULL; n = n->next) {
-        if (n->desc.paddr <= paddr && n->desc.paddr < _node_size(n)) {
-            break;
-        }
-    }
+    dma_mem_t m = NULL;
+    _lock(dma_allocator);
+    /* Search the sorted nodes for the associated node */
+    dma_allocator->stats.lookups++;
+    n = _find_node(dma_allocator, paddr, 1, &dma_allocator->stats.lookup_steps);
     /* Search the mem list for the assocated dma_mem_t */
-    if (n == NULL) {
-        return NULL;
-    } else {
+    if (n != NULL) {
         offs = paddr - n->desc.paddr;
-        return _find_mem(n, offs);
+        m = _find_mem(n, offs, &dma_allocator->stats.lookup_steps);
     }
+    _unlock(dma_allocator);
+    return m;
 }
 
 dma_mem_t dma_vlookup(struct dma_allocator *dma_allocator, vaddr_t vaddr)
 {
     struct dma_memd_node *n;
     uintptr_t offs;
-    /* Search the list for the associated node */
-    for (n = dma_allocator->head; n != NULL; n = n->next) {
-        uintptr_t vn = (uintptr_t)n->desc.vaddr;
-        uintptr_t vm = (uintptr_t)vaddr;
-        if (vn <= vm && vm < vn + _node_size(n)) {
-            break;
-        }
-    }
+    dma_mem_t m = NULL;
+    _lock(dma_allocator);
+    /* Search the sorted nodes for the associated node */
+    dma_allocator->stats.lookups++;
+    n = _find_node(dma_allocator, (uintptr_t)vaddr, 0, &dma_allocator->stats.lookup_steps);
     /* Search the mem list for the assocated dma_mem_t */
-    if (n == NULL) {
-        return NULL;
-    } else {
+    if (n != NULL) {
         offs = (uintptr_t)vaddr - (uintptr_t)n->desc.vaddr;
-        return _find_mem(n, offs);
+        m = _find_mem(n, offs, &dma_allocator->stats.lookup_steps);
+    }
+    _unlock(dma_allocator);
+    return m;
+}
+
+
+
+/*** Statistics ***/
+
+static void _node_stats(struct dma_memd_node *n, struct dma_node_stats *stats)
+{
+    size_t extent = 0;
+    dma_mem_t m;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->vaddr = n->desc.vaddr;
+    stats->paddr = n->desc.paddr;
+    stats->size = _node_size(n);
+    stats->cached = n->desc.cached;
+    stats->buddy = n->buddy;
+    for (m = n->dma_mem_head; m != NULL; m = m->next) {
+        size_t size = _mem_size(m);
+        stats->nregions++;
+        if (m->flags & DMFLAG_SLAB) {
+            /* Free blocks, and any slack past the blocks, are held by the slab caches */
+            size_t block_size = (size_t)1 << m->slab->cache->size_bits;
+            for (int i = 0; i < DMA_SLAB_NBLOCKS; i++) {
+                if (_is_free(&m->slab->blocks[i])) {
+                    stats->slab_cached += block_size;
+                } else {
+                    stats->used += block_size;
+                }
+            }
+            stats->slab_cached += size - block_size * DMA_SLAB_NBLOCKS;
+            extent = 0;
+        } else if (_is_free(m)) {
+            stats->free += size;
+            /* Free regions not yet compacted are contiguous, buddy blocks can only be handed out whole */
+            extent = n->buddy ? size : extent + size;
+            if (extent > stats->largest_free) {
+                stats->largest_free = extent;
+            }
+        } else {
+            stats->used += size;
+            extent = 0;
+        }
+    }
+}
+
+int dma_get_node_stats(struct dma_allocator *allocator, int index, struct dma_node_stats *stats)
+{
+    int err = -1;
+    assert(allocator);
+    assert(stats);
+    _lock(allocator);
+    if (index >= 0 && index < allocator->nnodes) {
+        /* Nodes are reported in physical address order */
+        _node_stats(allocator->pnodes[index], stats);
+        err = 0;
     }
+    _unlock(allocator);
+    return err;
 }
 
+void dma_get_stats(struct dma_allocator *allocator, struct dma_stats *stats)
+{
+    assert(allocator);
+    assert(stats);
+    _lock(allocator);
+    *stats = allocator->stats;
+    stats->nnodes = allocator->nnodes;
+    stats->size = 0;
+    stats->used = 0;
+    stats->free = 0;
+    stats->slab_cached = 0;
+    stats->largest_free = 0;
+    for (int i = 0; i < allocator->nnodes; i++) {
+        struct dma_node_stats node;
+        _node_stats(allocator->pnodes[i], &node);
+        stats->size += node.size;
+        stats->used += node.used;
+        stats->free += node.free;
+        stats->slab_cached += node.slab_cached;
+        if (node.largest_free > stats->largest_free) {
+            stats->largest_free = node.largest_free;
+        }
+    }
+    _unlock(allocator);
+}
 
+void dma_reset_stats(struct dma_allocator *allocator)
+{
+    assert(allocator);
+    _lock(allocator);
+    memset(&allocator->stats, 0, sizeof(allocator->stats));
+    _unlock(allocator);
+}
 
 /*** Cache ops ***/
 
+/* Uncached memory needs no maintenance */
+static void do_dma_cache_op(dma_mem_t m, vaddr_t vstart, vaddr_t vend, dma_cache_op_t op)
+{
+    struct dma_allocator *allocator;
+    if (m == NULL || !m->node->desc.cached || vend <= vstart) {
+        return;
+    }
+    allocator = m->node->allocator;
+    if (allocator->cache_op == NULL) {
+        return;
+    }
+    allocator->cache_op(allocator, vstart, (uintptr_t)vend - (uintptr_t)vstart, op);
+}
+
 void dma_clean(dma_mem_t m, vaddr_t vstart, vaddr_t vend)
 {
-    (void)m;
-    (void)vstart;
-    (void)vend;
+    do_dma_cache_op(m, vstart, vend, DMA_CACHE_OP_CLEAN);
 }
 
 
 void dma_invalidate(dma_mem_t m, vaddr_t vstart, vaddr_t vend)
 {
-    (void)m;
-    (void)vstart;
-    (void)vend;
+    do_dma_cache_op(m, vstart, vend, DMA_CACHE_OP_INVALIDATE);
 }
 
 void dma_cleaninvalidate(dma_mem_t m, vaddr_t vstart, vaddr_t vend)
 {
-    (void)m;
-    (void)vstart;
-    (void)vend;
+    do_dma_cache_op(m, vstart, vend, DMA_CACHE_OP_CLEAN_INVALIDATE);
+}
+
+static inline int _sg_cached(struct dma_sg *sg)
+{
+    return sg->dma_mem != NULL && sg->dma_mem->node->desc.cached && sg->vend > sg->vstart;
+}
+
+/* One operation for each contiguous span of the list, or one for the whole cache */
+static void do_dma_cache_op_sg(struct dma_sg *sg, int nents, dma_cache_op_t op)
+{
+    struct dma_allocator *allocator = NULL;
+    uintptr_t start = 0, end = 0;
+    size_t total = 0;
+
+    for (int i = 0; i < nents; i++) {
+        if (_sg_cached(&sg[i])) {
+            assert(allocator == NULL || allocator == sg[i].dma_mem->node->allocator);
+            allocator = sg[i].dma_mem->node->allocator;
+            total += (uintptr_t)sg[i].vend - (uintptr_t)sg[i].vstart;
+        }
+    }
+    if (allocator == NULL || allocator->cache_op == NULL) {
+        return;
+    }
+    if (allocator->cache_flush != NULL && total >= allocator->cache_flush_threshold) {
+        /* Invalidating the whole cache would discard the dirty lines of other memory */
+        allocator->cache_flush(op == DMA_CACHE_OP_INVALIDATE ? DMA_CACHE_OP_CLEAN_INVALIDATE : op);
+        return;
+    }
+
+    for (int i = 0; i < nents; i++) {
+        uintptr_t s, e;
+        if (!_sg_cached(&sg[i])) {
+            continue;
+        }
+        s = (uintptr_t)sg[i].vstart;
+        e = (uintptr_t)sg[i].vend;
+        /* Merge ranges that touch or overlap the current span */
+        if (end > start && s <= end && e >= start) {
+            start = s < start ? s : start;
+            end = e > end ? e : end;
+            continue;
+        }
+        if (end > start) {
+            allocator->cache_op(allocator, (void *)start, end - start, op);
+        }
+        start = s;
+        end = e;
+    }
+    if (end > start) {
+        allocator->cache_op(allocator, (void *)start, end - start, op);
+    }
+}
+
+void dma_clean_sg(struct dma_sg *sg, int nents)
+{
+    do_dma_cache_op_sg(sg, nents, DMA_CACHE_OP_CLEAN);
+}
+
+void dma_invalidate_sg(struct dma_sg *sg, int nents)
+{
+    do_dma_cache_op_sg(sg, nents, DMA_CACHE_OP_INVALIDATE);
+}
+
+void dma_cleaninvalidate_sg(struct dma_sg *sg, int nents)
+{
+    do_dma_cache_op_sg(sg, nents, DMA_CACHE_OP_CLEAN_INVALIDATE);
+}
+
+void dma_set_cache_flush(struct dma_allocator *allocator, dma_cache_flush_fn cache_flush,
+                         size_t threshold)
+{
+    assert(allocator);
+    allocator->cache_flush = cache_flush;
+    allocator->cache_flush_threshold = threshold;
 }
 
 /******** libplatsupport adapter ********/
@@ -459,7 +1451,7 @@ static void *dma_dma_alloc(void *cookie, size_t size, int align, int cached, ps_
     assert(cookie);
     dalloc = (struct dma_allocator *)cookie;
 
-    if (cached) {
+    if (!cached) {
         dma_flags = DMAF_COHERENT;
     } else {
         switch (flags) {
@@ -504,6 +1496,22 @@ static void dma_dma_unpin(void *cookie UNUSED, void *addr UNUSED, size_t size UN
     /* DMA memory is unpinned when freed */
 }
 
+static void dma_dma_cache_op(void *cookie, void *addr, size_t size, dma_cache_op_t op)
+{
+    struct dma_allocator *dalloc;
+    dma_mem_t m;
+    assert(cookie);
+    dalloc = (struct dma_allocator *)cookie;
+    /* Skip maintenance of the uncached memory of the allocator */
+    m = dma_vlookup(dalloc, addr);
+    if (m != NULL && !m->node->desc.cached) {
+        return;
+    }
+    if (dalloc->cache_op) {
+        dalloc->cache_op(cookie, addr, size, op);
+    }
+}
+
 
 int dma_dmaman_init(dma_morecore_fn morecore, ps_dma_cache_op_fn_t cache_ops,
                     ps_dma_man_t *dma_man)
@@ -513,8 +1521,9 @@ int dma_dmaman_init(dma_morecore_fn morecore, ps_dma_cache_op_fn_t cache_ops,
 
     dalloc = dma_allocator_init(morecore);
     if (dalloc != NULL) {
+        dalloc->cache_op = cache_ops;
         dma_man->cookie = dalloc;
-        dma_man->dma_cache_op_fn = cache_ops;
+        dma_man->dma_cache_op_fn = &dma_dma_cache_op;
         dma_man->dma_alloc_fn = &dma_dma_alloc;
         dma_man->dma_free_fn = &dma_dma_free;
         dma_man->dma_pin_fn = &dma_dma_pin;
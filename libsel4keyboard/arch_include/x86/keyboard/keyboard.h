@@ -18,7 +18,9 @@ typedef void (*out8_fn)(uint16_t port, uint8_t value);
 
 /* Initialise the driver.
  *  enable_interrupt - Set the keyboard controller to generate interrupts
- *      when scancodes are generated.
+ *      when scancodes are generated. Scancodes are then only read from the
+ *      controller by sel4keyboard_handle_irq, and the functions below return
+ *      what it has queued.
  *  in8 - Function for getting a byte from either IO port 0x60 or port 0x64.
  *  out8 - Function for writing a byte to either IO port 0x60 or port 0x64.
  */
@@ -32,3 +34,19 @@ void sel4keyboard_reset(void);
  *  scancode - Location to store the read scancode
  */
 int sel4keyboard_get_scancode(int *scancode);
+
+/* Read up to max waiting scancodes. Returns the number read.
+ *  scancodes - Array of at least max entries to store the read scancodes
+ *  max - The most scancodes to read
+ */
+int sel4keyboard_get_scancodes(int *scancodes, int max);
+
+/* Handle a KEYBOARD_IRQ when the driver was initialised with interrupts. Every
+ * byte the controller has ready is read and queued for the functions above,
+ * which may be called concurrently from one other thread. Bytes arriving while
+ * the queue is full are dropped. Returns the number of bytes queued.
+ */
+int sel4keyboard_handle_irq(void);
+
+/* Get the number of scancodes dropped because the queue was full. */
+unsigned int sel4keyboard_dropped_scancodes(void);
@@ -6,7 +6,68 @@
 
 #pragma once
 
+#include <stdint.h>
+
 /* Convert a keyboard scan code (from set 2) to its character representation.
  * Returns 0 for anything that is not a scan code for a canonical character.
  */
 char sel4keyboard_code_to_char(int index);
+
+/* Keys reported by sel4keyboard_decode are identified by their set 2 make
+ * code. Keys whose scancodes carry an 0xe0 prefix (cursor keys, right control,
+ * and so on) additionally have SEL4KEYBOARD_KEY_EXTENDED set. The pause key has
+ * its own keycode and is only ever reported as pressed.
+ */
+#define SEL4KEYBOARD_KEY_EXTENDED   0x100
+#define SEL4KEYBOARD_KEY_PAUSE      0x200
+
+/* Modifier state reported with each key event. Caps lock toggles on each press
+ * rather than following the key.
+ */
+#define SEL4KEYBOARD_MOD_LSHIFT     0x01
+#define SEL4KEYBOARD_MOD_RSHIFT     0x02
+#define SEL4KEYBOARD_MOD_LCTRL      0x04
+#define SEL4KEYBOARD_MOD_RCTRL      0x08
+#define SEL4KEYBOARD_MOD_LALT       0x10
+#define SEL4KEYBOARD_MOD_RALT       0x20
+#define SEL4KEYBOARD_MOD_CAPS_LOCK  0x40
+
+typedef struct sel4keyboard_event {
+    /* The key that changed. */
+    uint16_t keycode;
+    /* Non-zero if the key was pressed, zero if it was released. */
+    uint8_t pressed;
+    /* The modifier state after this event. */
+    uint8_t modifiers;
+    /* The character typed, taking the modifiers into account, or 0 if the key
+     * does not produce one or was released.
+     */
+    char character;
+} sel4keyboard_event_t;
+
+/* State carried between batches of scancodes, so that multi-byte sequences may
+ * be split across calls to sel4keyboard_decode. Treat as opaque.
+ */
+typedef struct sel4keyboard_decoder {
+    int scancode_set;
+    int extended;
+    int release;
+    int skip;
+    uint8_t modifiers;
+} sel4keyboard_decoder_t;
+
+/* Initialise a decoder.
+ *  scancode_set - Which scancode set (1 or 2) the scancodes will be in. The
+ *      driver in keyboard/keyboard.h produces set 2.
+ */
+void sel4keyboard_decoder_init(sel4keyboard_decoder_t *decoder, int scancode_set);
+
+/* Translate a batch of scancodes into key events. Each scancode produces at
+ * most one event, so events must have room for count entries. Returns the
+ * number of events produced.
+ *  scancodes - The scancodes, e.g. as read by sel4keyboard_get_scancodes
+ *  count - The number of scancodes
+ *  events - Location to store the events
+ */
+int sel4keyboard_decode(sel4keyboard_decoder_t *decoder, const int *scancodes, int count,
+                        sel4keyboard_event_t *events);
@@ -48,6 +48,19 @@
 
 static in8_fn io_in8;
 static out8_fn io_out8;
+static int irq_mode;
+
+/* Scancodes drained from the controller by sel4keyboard_handle_irq waiting to
+ * be read. This is a single producer, single consumer ring: only the IRQ handler
+ * advances head and only readers advance tail, so the two sides can run in
+ * different threads without a lock. The indices run freely and are masked on
+ * access, so head - tail is the number of queued bytes.
+ */
+#define SCANCODE_RING_SIZE 256
+static uint8_t scancode_ring[SCANCODE_RING_SIZE];
+static unsigned int scancode_head;
+static unsigned int scancode_tail;
+static unsigned int scancodes_dropped;
 
 static inline uint8_t ps2_poll_output(void)
 {
@@ -59,6 +72,11 @@ static uint8_t _ps2_read_control(void)
     return io_in8(KEYBOARD_INPUT_CONTROL);
 }
 
+static inline int ps2_output_full(void)
+{
+    return _ps2_read_control() & 0x1;
+}
+
 static inline uint8_t ps2_read_output(void)
 {
     while ((_ps2_read_control() & 0x1) == 0);
@@ -76,6 +94,10 @@ void sel4keyboard_init(int enable_interrupt, in8_fn in8, out8_fn out8)
 {
     io_in8 = in8;
     io_out8 = out8;
+    irq_mode = enable_interrupt;
+    scancode_head = 0;
+    scancode_tail = 0;
+    scancodes_dropped = 0;
 
     int error;
     uint8_t config;
@@ -126,12 +148,63 @@ void sel4keyboard_reset()
     ps2_single_control(0xA7);
 }
 
-int sel4keyboard_get_scancode(int *scancode)
+int sel4keyboard_handle_irq(void)
 {
-    /* see if there is a waiting scancode */
-    if ((_ps2_read_control() & 0x1) == 0) {
-        return 0;
+    unsigned int head = scancode_head;
+    unsigned int tail = __atomic_load_n(&scancode_tail, __ATOMIC_ACQUIRE);
+    int count = 0;
+
+    /* The controller only buffers a single byte, so take everything it has
+     * now rather than one byte per interrupt.
+     */
+    while (ps2_output_full()) {
+        uint8_t byte = ps2_poll_output();
+        if (head - tail == SCANCODE_RING_SIZE) {
+            /* Readers have fallen behind. Dropping the newest bytes keeps the
+             * queued ones intact.
+             */
+            scancodes_dropped++;
+            continue;
+        }
+        scancode_ring[head % SCANCODE_RING_SIZE] = byte;
+        head++;
+        count++;
     }
-    *scancode = ps2_poll_output();
-    return 1;
+
+    /* Publish the new bytes. */
+    __atomic_store_n(&scancode_head, head, __ATOMIC_RELEASE);
+    return count;
+}
+
+int sel4keyboard_get_scancodes(int *scancodes, int max)
+{
+    int count = 0;
+
+    if (!irq_mode) {
+        while (count < max && ps2_output_full()) {
+            scancodes[count++] = ps2_poll_output();
+        }
+        return count;
+    }
+
+    unsigned int tail = scancode_tail;
+    unsigned int head = __atomic_load_n(&scancode_head, __ATOMIC_ACQUIRE);
+    while (count < max && tail != head) {
+        scancodes[count++] = scancode_ring[tail % SCANCODE_RING_SIZE];
+        tail++;
+    }
+
+    /* Hand the slots back to the IRQ handler. */
+    __atomic_store_n(&scancode_tail, tail, __ATOMIC_RELEASE);
+    return count;
+}
+
+int sel4keyboard_get_scancode(int *scancode)
+{
+    return sel4keyboard_get_scancodes(scancode, 1);
+}
+
+unsigned int sel4keyboard_dropped_scancodes(void)
+{
+    return scancodes_dropped;
 }
@@ -4,6 +4,7 @@
  * SPDX-License-Identifier: BSD-2-Clause
  */
 
+#include <assert.h>
 #include <keyboard/codes.h>
 
 /* Mapping from scan codes to characters. Anything that is not a definitive
@@ -68,3 +69,211 @@ char sel4keyboard_code_to_char(int index)
     }
     return codes[index];
 }
+
+/* Scancode decoding. Keys are identified by their set 2 make code, with
+ * SEL4KEYBOARD_KEY_EXTENDED set for keys sent with an 0xe0 prefix. Set 1 codes
+ * are converted to set 2 with set1_to_set2, which is the inverse of the
+ * translation done by the keyboard controller; extended keys convert with the
+ * same table.
+ */
+#define NUM_KEYS 0x84
+
+static const uint8_t set1_to_set2[0x80] = {
+    [0x01] = 0x76, [0x02] = 0x16, [0x03] = 0x1e, [0x04] = 0x26,
+    [0x05] = 0x25, [0x06] = 0x2e, [0x07] = 0x36, [0x08] = 0x3d,
+    [0x09] = 0x3e, [0x0a] = 0x46, [0x0b] = 0x45, [0x0c] = 0x4e,
+    [0x0d] = 0x55, [0x0e] = 0x66, [0x0f] = 0x0d, [0x10] = 0x15,
+    [0x11] = 0x1d, [0x12] = 0x24, [0x13] = 0x2d, [0x14] = 0x2c,
+    [0x15] = 0x35, [0x16] = 0x3c, [0x17] = 0x43, [0x18] = 0x44,
+    [0x19] = 0x4d, [0x1a] = 0x54, [0x1b] = 0x5b, [0x1c] = 0x5a,
+    [0x1d] = 0x14, [0x1e] = 0x1c, [0x1f] = 0x1b, [0x20] = 0x23,
+    [0x21] = 0x2b, [0x22] = 0x34, [0x23] = 0x33, [0x24] = 0x3b,
+    [0x25] = 0x42, [0x26] = 0x4b, [0x27] = 0x4c, [0x28] = 0x52,
+    [0x29] = 0x0e, [0x2a] = 0x12, [0x2b] = 0x5d, [0x2c] = 0x1a,
+    [0x2d] = 0x22, [0x2e] = 0x21, [0x2f] = 0x2a, [0x30] = 0x32,
+    [0x31] = 0x31, [0x32] = 0x3a, [0x33] = 0x41, [0x34] = 0x49,
+    [0x35] = 0x4a, [0x36] = 0x59, [0x37] = 0x7c, [0x38] = 0x11,
+    [0x39] = 0x29, [0x3a] = 0x58, [0x3b] = 0x05, [0x3c] = 0x06,
+    [0x3d] = 0x04, [0x3e] = 0x0c, [0x3f] = 0x03, [0x40] = 0x0b,
+    [0x41] = 0x83, [0x42] = 0x0a, [0x43] = 0x01, [0x44] = 0x09,
+    [0x45] = 0x77, [0x46] = 0x7e, [0x47] = 0x6c, [0x48] = 0x75,
+    [0x49] = 0x7d, [0x4a] = 0x7b, [0x4b] = 0x6b, [0x4c] = 0x73,
+    [0x4d] = 0x74, [0x4e] = 0x79, [0x4f] = 0x69, [0x50] = 0x72,
+    [0x51] = 0x7a, [0x52] = 0x70, [0x53] = 0x71, [0x56] = 0x61,
+    [0x57] = 0x78, [0x58] = 0x07, [0x5b] = 0x1f, [0x5c] = 0x27,
+    [0x5d] = 0x2f,
+};
+
+struct key_info {
+    char normal;
+    char shifted;
+    uint8_t modifier;
+};
+
+/* Indexed by whether the key is extended and then by its set 2 make code. */
+static const struct key_info keys[2][NUM_KEYS] = {
+    [0] = {
+        [0x0e] = {'`', '~'},
+        [0x16] = {'1', '!'},
+        [0x1e] = {'2', '@'},
+        [0x26] = {'3', '#'},
+        [0x25] = {'4', '$'},
+        [0x2e] = {'5', '%'},
+        [0x36] = {'6', '^'},
+        [0x3d] = {'7', '&'},
+        [0x3e] = {'8', '*'},
+        [0x46] = {'9', '('},
+        [0x45] = {'0', ')'},
+        [0x4e] = {'-', '_'},
+        [0x55] = {'=', '+'},
+        [0x66] = {'\b', '\b'},
+        [0x0d] = {'\t', '\t'},
+        [0x15] = {'q', 'Q'},
+        [0x1d] = {'w', 'W'},
+        [0x24] = {'e', 'E'},
+        [0x2d] = {'r', 'R'},
+        [0x2c] = {'t', 'T'},
+        [0x35] = {'y', 'Y'},
+        [0x3c] = {'u', 'U'},
+        [0x43] = {'i', 'I'},
+        [0x44] = {'o', 'O'},
+        [0x4d] = {'p', 'P'},
+        [0x54] = {'[', '{'},
+        [0x5b] = {']', '}'},
+        [0x5d] = {'\\', '|'},
+        [0x1c] = {'a', 'A'},
+        [0x1b] = {'s', 'S'},
+        [0x23] = {'d', 'D'},
+        [0x2b] = {'f', 'F'},
+        [0x34] = {'g', 'G'},
+        [0x33] = {'h', 'H'},
+        [0x3b] = {'j', 'J'},
+        [0x42] = {'k', 'K'},
+        [0x4b] = {'l', 'L'},
+        [0x4c] = {';', ':'},
+        [0x52] = {'\'', '"'},
+        [0x5a] = {'\n', '\n'},
+        [0x1a] = {'z', 'Z'},
+        [0x22] = {'x', 'X'},
+        [0x21] = {'c', 'C'},
+        [0x2a] = {'v', 'V'},
+        [0x32] = {'b', 'B'},
+        [0x31] = {'n', 'N'},
+        [0x3a] = {'m', 'M'},
+        [0x41] = {',', '<'},
+        [0x49] = {'.', '>'},
+        [0x4a] = {'/', '?'},
+        [0x29] = {' ', ' '},
+        [0x76] = {033, 033},
+        [0x7c] = {'*', '*'},
+        [0x7b] = {'-', '-'},
+        [0x79] = {'+', '+'},
+        [0x12] = {.modifier = SEL4KEYBOARD_MOD_LSHIFT},
+        [0x59] = {.modifier = SEL4KEYBOARD_MOD_RSHIFT},
+        [0x14] = {.modifier = SEL4KEYBOARD_MOD_LCTRL},
+        [0x11] = {.modifier = SEL4KEYBOARD_MOD_LALT},
+        [0x58] = {.modifier = SEL4KEYBOARD_MOD_CAPS_LOCK},
+    },
+    [1] = {
+        [0x5a] = {'\n', '\n'},
+        [0x4a] = {'/', '/'},
+        [0x14] = {.modifier = SEL4KEYBOARD_MOD_RCTRL},
+        [0x11] = {.modifier = SEL4KEYBOARD_MOD_RALT},
+    },
+};
+
+/* Bytes following the 0xe1 that starts the pause key sequence (which has no
+ * release sequence), indexed by scancode set.
+ */
+static const int pause_length[] = {
+    [1] = 5, /* e1 1d 45 e1 9d c5 */
+    [2] = 7, /* e1 14 77 e1 f0 14 f0 77 */
+};
+
+void sel4keyboard_decoder_init(sel4keyboard_decoder_t *decoder, int scancode_set)
+{
+    assert(scancode_set == 1 || scancode_set == 2);
+    decoder->scancode_set = scancode_set;
+    decoder->extended = 0;
+    decoder->release = 0;
+    decoder->skip = 0;
+    decoder->modifiers = 0;
+}
+
+int sel4keyboard_decode(sel4keyboard_decoder_t *decoder, const int *scancodes, int count,
+                        sel4keyboard_event_t *events)
+{
+    int num_events = 0;
+
+    for (int i = 0; i < count; i++) {
+        int byte = scancodes[i] & 0xff;
+
+        if (decoder->skip > 0) {
+            decoder->skip--;
+            continue;
+        }
+        if (byte == 0xe0) {
+            decoder->extended = 1;
+            continue;
+        }
+        if (byte == 0xe1) {
+            decoder->skip = pause_length[decoder->scancode_set];
+            events[num_events++] = (sel4keyboard_event_t) {
+                .keycode = SEL4KEYBOARD_KEY_PAUSE,
+                .pressed = 1,
+                .modifiers = decoder->modifiers,
+            };
+            continue;
+        }
+
+        int code;
+        int release;
+        if (decoder->scancode_set == 1) {
+            code = set1_to_set2[byte & 0x7f];
+            release = byte >> 7;
+        } else {
+            if (byte == 0xf0) {
+                decoder->release = 1;
+                continue;
+            }
+            /* Anything beyond the largest make code is a controller response
+             * (ack, self test passed, ...) rather than a key.
+             */
+            code = byte < NUM_KEYS ? byte : 0;
+            release = decoder->release;
+        }
+        int extended = decoder->extended;
+        decoder->extended = 0;
+        decoder->release = 0;
+
+        /* Extended shifts are sent around some extended keys for compatibility
+         * and are not real key presses.
+         */
+        if (code == 0 || (extended && (code == 0x12 || code == 0x59))) {
+            continue;
+        }
+
+        const struct key_info *key = &keys[extended][code];
+        if (key->modifier == SEL4KEYBOARD_MOD_CAPS_LOCK) {
+            decoder->modifiers ^= release ? 0 : key->modifier;
+        } else if (release) {
+            decoder->modifiers &= ~key->modifier;
+        } else {
+            decoder->modifiers |= key->modifier;
+        }
+
+        int shifted = !!(decoder->modifiers & (SEL4KEYBOARD_MOD_LSHIFT | SEL4KEYBOARD_MOD_RSHIFT));
+        if ((decoder->modifiers & SEL4KEYBOARD_MOD_CAPS_LOCK) && key->normal >= 'a' && key->normal <= 'z') {
+            shifted = !shifted;
+        }
+
+        events[num_events++] = (sel4keyboard_event_t) {
+            .keycode = (extended ? SEL4KEYBOARD_KEY_EXTENDED : 0) | code,
+            .pressed = !release,
+            .modifiers = decoder->modifiers,
+            .character = release ? 0 : (shifted ? key->shifted : key->normal),
+        };
+    }
+
+    return num_events;
+}
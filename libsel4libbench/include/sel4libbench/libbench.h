@@ -0,0 +1,134 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+/*
+ * Benchmarks of the support libraries: the libsel4dma allocator, libsel4vchan
+ * connections and libsel4rpc calls. Each benchmark appends fixed layout
+ * results to a libbench_results_t, which can be collected across the suites
+ * and printed as CSV to compare releases. Latencies are measured in ticks of
+ * the architecture's timestamp counter, the TSC on x86 and the virtual counter
+ * on arm.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sel4/sel4.h>
+#include <platsupport/io.h>
+#include <dma/dma.h>
+#include <sel4vchan/libvchan.h>
+
+/* Number of operations timed together, limiting the overhead of reading the timestamp counter */
+#define LIBBENCH_BATCH 64
+
+/* Benchmarked operations, identifying a libbench_result_t */
+typedef enum libbench_id {
+    /* ps_dma_alloc followed by ps_dma_free, param is the size, param2 the alignment */
+    LIBBENCH_DMA_ALLOC_FREE,
+    /* dma_vlookup of an address in a node, param is the number of nodes of the allocator */
+    LIBBENCH_DMA_VLOOKUP,
+    /* libvchan_write of a message followed by libvchan_read of its echo, param is the message size */
+    LIBBENCH_VCHAN_ROUND_TRIP,
+    /* Messages streamed to and echoed back by the peer, param is the message size. Timed as a single batch */
+    LIBBENCH_VCHAN_STREAM,
+    /* sel4rpc_call of a memory allocation, param is the size_bits */
+    LIBBENCH_RPC_MEMORY_ALLOC,
+    /* sel4rpc_call of a memory free, param is the size_bits */
+    LIBBENCH_RPC_MEMORY_FREE,
+    /* sel4rpc_call of an IO port range followed by deleting the cap received, param and param2 are the first and last port */
+    LIBBENCH_RPC_IOPORT,
+    /* sel4rpc_call of an IRQ handler followed by deleting the cap received, param is the irq */
+    LIBBENCH_RPC_IRQ,
+    LIBBENCH_NUM_IDS
+} libbench_id_t;
+
+/* Result of a benchmark. Operations are timed in batches of LIBBENCH_BATCH */
+typedef struct libbench_result {
+    /* benchmark, a value of libbench_id_t */
+    uint32_t id;
+    /* parameters of the benchmark, as described by its id */
+    uint32_t param2;
+    uint64_t param;
+    /* number of operations performed */
+    uint64_t iterations;
+    /* time taken by all operations, and by the fastest and slowest batch of them */
+    uint64_t total_ticks;
+    uint64_t min_batch_ticks;
+    uint64_t max_batch_ticks;
+} libbench_result_t;
+
+/* Buffer benchmark results are appended to */
+typedef struct libbench_results {
+    libbench_result_t *results;
+    size_t max_results;
+    size_t num_results;
+} libbench_results_t;
+
+/**
+ * Benchmark the libsel4dma allocator through the DMA manager installed by
+ * dma_dmaman_init, allocating and freeing memory of sizes from 64 bytes to 1M
+ * at word and page alignment, and looking up addresses with up to 256 nodes
+ * of memory. Nodes are added for the lookups by calling morecore for pages,
+ * and are left with the allocator
+ * @param[in] results    Buffer the results are appended to
+ * @param[in] dma_man    DMA manager installed by dma_dmaman_init
+ * @param[in] morecore   Provider of memory to add nodes with, NULL to skip the lookups
+ * @param[in] iterations Number of operations performed by each benchmark
+ * @return               0 on success, -1 if an operation failed or the results are full
+ */
+int libbench_run_dma(libbench_results_t *results, ps_dma_man_t *dma_man, dma_morecore_fn morecore,
+                     size_t iterations);
+
+/**
+ * Benchmark a vchan connection with messages of 16 bytes up to 4K, or the size
+ * of the connection's rings if smaller. The peer of the connection must echo
+ * back everything it reads, and the connection must be blocking
+ * @param[in] results    Buffer the results are appended to
+ * @param[in] ctrl       The connected vchan
+ * @param[in] iterations Number of messages sent by each benchmark
+ * @return               0 on success, -1 if an operation failed or the results are full
+ */
+int libbench_run_vchan(libbench_results_t *results, libvchan_t *ctrl, size_t iterations);
+
+/* Parameters of the sel4rpc benchmarks, those of the requests not provided are skipped */
+typedef struct libbench_rpc_params {
+    /* number of calls made by each benchmark */
+    size_t iterations;
+    /* LIBBENCH_BATCH consecutive empty slots to receive caps in */
+    seL4_CPtr root;
+    seL4_CPtr slot;
+    seL4_Word depth;
+    /* untyped memory the server can allocate at, size_bits 0 to skip */
+    uintptr_t mem_addr;
+    size_t mem_size_bits;
+    /* IO port range the server can issue (x86 only), end before start to skip */
+    uint16_t ioport_start;
+    uint16_t ioport_end;
+    /* IRQ with no handler the server can issue, -1 to skip */
+    int irq;
+} libbench_rpc_params_t;
+
+struct sel4rpc_client_env;
+
+/**
+ * Benchmark the round trip of each type of sel4rpc request. Only available
+ * when built with LibNanopb
+ * @param[in] results Buffer the results are appended to
+ * @param[in] client  Client connected to a server handling requests with sel4rpc_default_handler
+ * @param[in] params  Parameters of the requests
+ * @return            0 on success, -1 if a call failed or the results are full
+ */
+int libbench_run_rpc(libbench_results_t *results, struct sel4rpc_client_env *client,
+                     const libbench_rpc_params_t *params);
+
+/**
+ * Print benchmark results to the console as CSV, preceded by a header line
+ * naming the columns
+ * @param[in] results Benchmark results
+ */
+void libbench_print_results(const libbench_results_t *results);
@@ -0,0 +1,82 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include <utils/util.h>
+
+#include <sel4libbench/libbench.h>
+
+#include "benchmark.h"
+
+static const char *benchmark_names[LIBBENCH_NUM_IDS] = {
+    [LIBBENCH_DMA_ALLOC_FREE] = "dma_alloc_free",
+    [LIBBENCH_DMA_VLOOKUP] = "dma_vlookup",
+    [LIBBENCH_VCHAN_ROUND_TRIP] = "vchan_round_trip",
+    [LIBBENCH_VCHAN_STREAM] = "vchan_stream",
+    [LIBBENCH_RPC_MEMORY_ALLOC] = "rpc_memory_alloc",
+    [LIBBENCH_RPC_MEMORY_FREE] = "rpc_memory_free",
+    [LIBBENCH_RPC_IOPORT] = "rpc_ioport",
+    [LIBBENCH_RPC_IRQ] = "rpc_irq",
+};
+
+const char *libbench_name(libbench_id_t id)
+{
+    return id < LIBBENCH_NUM_IDS ? benchmark_names[id] : "unknown";
+}
+
+libbench_result_t *libbench_result_new(libbench_results_t *results, libbench_id_t id, uint64_t param,
+                                       uint32_t param2)
+{
+    if (results->num_results == results->max_results) {
+        ZF_LOGE("Failed to run benchmark %s: Results buffer full", libbench_name(id));
+        return NULL;
+    }
+    libbench_result_t *result = &results->results[results->num_results++];
+    *result = (libbench_result_t) {
+        .id = id,
+        .param = param,
+        .param2 = param2,
+        .min_batch_ticks = UINT64_MAX
+    };
+    return result;
+}
+
+int libbench_run_op(libbench_results_t *results, libbench_id_t id, uint64_t param, uint32_t param2,
+                    size_t iterations, libbench_op_fn op, void *cookie)
+{
+    libbench_result_t *result = libbench_result_new(results, id, param, param2);
+    if (!result) {
+        return -1;
+    }
+    for (size_t i = 0; i < iterations; i += LIBBENCH_BATCH) {
+        size_t batch_end = MIN(i + LIBBENCH_BATCH, iterations);
+        uint64_t start = libbench_timestamp();
+        for (size_t j = i; j < batch_end; j++) {
+            if (op(j, cookie)) {
+                ZF_LOGE("Failed to run benchmark %s: Operation failed", libbench_name(id));
+                return -1;
+            }
+        }
+        libbench_result_add(result, batch_end - i, libbench_timestamp() - start);
+    }
+    if (!iterations) {
+        result->min_batch_ticks = 0;
+    }
+    return 0;
+}
+
+void libbench_print_results(const libbench_results_t *results)
+{
+    printf("benchmark,param,param2,iterations,total_ticks,min_batch_ticks,max_batch_ticks\n");
+    for (size_t i = 0; i < results->num_results; i++) {
+        const libbench_result_t *result = &results->results[i];
+        printf("%s,%"PRIu64",%"PRIu32",%"PRIu64",%"PRIu64",%"PRIu64",%"PRIu64"\n", libbench_name(result->id),
+               result->param, result->param2, result->iterations, result->total_ticks, result->min_batch_ticks,
+               result->max_batch_ticks);
+    }
+}
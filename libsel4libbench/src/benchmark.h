@@ -0,0 +1,69 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <autoconf.h>
+#include <stdint.h>
+
+#include <sel4libbench/libbench.h>
+
+#ifdef CONFIG_ARCH_X86
+#include <platsupport/arch/tsc.h>
+#endif
+
+static inline uint64_t libbench_timestamp(void)
+{
+#if defined(CONFIG_ARCH_X86)
+    return rdtsc_pure();
+#elif defined(CONFIG_ARCH_AARCH64)
+    uint64_t ticks;
+    asm volatile("isb; mrs %0, cntvct_el0" : "=r"(ticks));
+    return ticks;
+#else
+    uint64_t ticks;
+    asm volatile("isb; mrrc p15, 1, %Q0, %R0, c14" : "=r"(ticks));
+    return ticks;
+#endif
+}
+
+/**
+ * Type signature of a benchmarked operation
+ * @param[in] iteration Index of the operation within the benchmark
+ * @param[in] cookie    Cookie of the benchmark
+ * @return              0 on success, -1 on error
+ */
+typedef int (*libbench_op_fn)(size_t iteration, void *cookie);
+
+/**
+ * Start a new result of a benchmark, to which batches are added
+ * @return NULL if the results are full
+ */
+libbench_result_t *libbench_result_new(libbench_results_t *results, libbench_id_t id, uint64_t param,
+                                       uint32_t param2);
+
+/* Add the time taken by a batch of operations to a result */
+static inline void libbench_result_add(libbench_result_t *result, size_t count, uint64_t ticks)
+{
+    result->iterations += count;
+    result->total_ticks += ticks;
+    if (ticks < result->min_batch_ticks) {
+        result->min_batch_ticks = ticks;
+    }
+    if (ticks > result->max_batch_ticks) {
+        result->max_batch_ticks = ticks;
+    }
+}
+
+/**
+ * Time a number of calls of an operation, appending the result to the results
+ * @return 0 on success, -1 if an operation failed or the results are full
+ */
+int libbench_run_op(libbench_results_t *results, libbench_id_t id, uint64_t param, uint32_t param2,
+                    size_t iterations, libbench_op_fn op, void *cookie);
+
+/* Name of a benchmark, for reporting */
+const char *libbench_name(libbench_id_t id);
@@ -0,0 +1,121 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdlib.h>
+
+#include <utils/util.h>
+#include <platsupport/io.h>
+#include <dma/dma.h>
+
+#include <sel4libbench/libbench.h>
+
+#include "benchmark.h"
+
+/* Sizes allocated, spanning the slab caches, the general allocator and the buddy allocator */
+static const size_t alloc_sizes[] = { 64, 512, BIT(12), BIT(16), BIT(20) };
+static const int alloc_aligns[] = { sizeof(seL4_Word), BIT(12) };
+/* Numbers of nodes looked up amongst */
+static const size_t node_counts[] = { 1, 16, 64, 256 };
+
+struct alloc_bench {
+    ps_dma_man_t *dma_man;
+    size_t size;
+    int align;
+};
+
+static int alloc_free_op(size_t iteration, void *cookie)
+{
+    struct alloc_bench *bench = cookie;
+    void *vaddr = ps_dma_alloc(bench->dma_man, bench->size, bench->align, 1, PS_MEM_NORMAL);
+    if (!vaddr) {
+        return -1;
+    }
+    ps_dma_free(bench->dma_man, vaddr, bench->size);
+    return 0;
+}
+
+struct lookup_bench {
+    struct dma_allocator *allocator;
+    uintptr_t *vaddrs;
+    size_t num_nodes;
+};
+
+static int lookup_op(size_t iteration, void *cookie)
+{
+    struct lookup_bench *bench = cookie;
+    /* Visit the nodes in a scattered order to not favour neighbouring lookups */
+    size_t idx = (iteration * 2654435761u) % bench->num_nodes;
+    return dma_vlookup(bench->allocator, (vaddr_t)(bench->vaddrs[idx] + 8)) ? 0 : -1;
+}
+
+static int run_lookup(libbench_results_t *results, struct dma_allocator *allocator, dma_morecore_fn morecore,
+                      size_t iterations)
+{
+    size_t max_nodes = node_counts[ARRAY_SIZE(node_counts) - 1];
+    struct lookup_bench bench = {
+        .allocator = allocator,
+        .vaddrs = calloc(max_nodes, sizeof(uintptr_t))
+    };
+    struct dma_stats stats;
+    int err = 0;
+
+    if (!bench.vaddrs) {
+        ZF_LOGE("Failed to run dma lookup benchmark: Unable to allocate node addresses");
+        return -1;
+    }
+    for (int i = 0; i < ARRAY_SIZE(node_counts) && !err; i++) {
+        /* Grow the allocator to the next count of nodes */
+        dma_get_stats(allocator, &stats);
+        while (stats.nnodes < node_counts[i]) {
+            struct dma_mem_descriptor desc;
+            if (morecore(BIT(12), 1, &desc) || dma_provide_mem(allocator, desc)) {
+                ZF_LOGE("Failed to run dma lookup benchmark: Unable to add a node");
+                err = -1;
+                break;
+            }
+            stats.nnodes++;
+        }
+        if (err) {
+            break;
+        }
+        bench.num_nodes = MIN(stats.nnodes, max_nodes);
+        for (int j = 0; j < bench.num_nodes; j++) {
+            struct dma_node_stats node;
+            dma_get_node_stats(allocator, j, &node);
+            bench.vaddrs[j] = node.vaddr;
+        }
+        err = libbench_run_op(results, LIBBENCH_DMA_VLOOKUP, stats.nnodes, 0, iterations, lookup_op, &bench);
+    }
+    free(bench.vaddrs);
+    return err;
+}
+
+int libbench_run_dma(libbench_results_t *results, ps_dma_man_t *dma_man, dma_morecore_fn morecore,
+                     size_t iterations)
+{
+    if (!results || !dma_man) {
+        ZF_LOGE("Failed to run dma benchmarks: Invalid results or DMA manager");
+        return -1;
+    }
+    for (int i = 0; i < ARRAY_SIZE(alloc_sizes); i++) {
+        for (int j = 0; j < ARRAY_SIZE(alloc_aligns); j++) {
+            struct alloc_bench bench = {
+                .dma_man = dma_man,
+                .size = alloc_sizes[i],
+                .align = alloc_aligns[j]
+            };
+            if (libbench_run_op(results, LIBBENCH_DMA_ALLOC_FREE, bench.size, bench.align, iterations,
+                                alloc_free_op, &bench)) {
+                return -1;
+            }
+        }
+    }
+    if (!morecore) {
+        return 0;
+    }
+    /* The DMA manager's cookie is the allocator installed by dma_dmaman_init */
+    return run_lookup(results, dma_man->cookie, morecore, iterations);
+}
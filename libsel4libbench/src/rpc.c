@@ -0,0 +1,153 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <autoconf.h>
+
+#include <utils/util.h>
+#include <sel4rpc/client.h>
+#include <rpc.pb.h>
+
+#include <sel4libbench/libbench.h>
+
+#include "benchmark.h"
+
+static int rpc_call(sel4rpc_client_t *client, RpcMessage *msg, const libbench_rpc_params_t *params,
+                    seL4_CPtr slot)
+{
+    if (sel4rpc_call(client, msg, params->root, slot, params->depth) || msg->msg.ret.errorCode) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Allocations are timed in batches into consecutive slots, the caps received
+ * being deleted before the batch is freed again */
+static int run_memory(libbench_results_t *results, sel4rpc_client_t *client, const libbench_rpc_params_t *params)
+{
+    libbench_result_t *alloc = libbench_result_new(results, LIBBENCH_RPC_MEMORY_ALLOC, params->mem_size_bits, 0);
+    libbench_result_t *frees = libbench_result_new(results, LIBBENCH_RPC_MEMORY_FREE, params->mem_size_bits, 0);
+    seL4_Word cookies[LIBBENCH_BATCH];
+
+    if (!alloc || !frees) {
+        return -1;
+    }
+    for (size_t i = 0; i < params->iterations; i += LIBBENCH_BATCH) {
+        size_t count = MIN(LIBBENCH_BATCH, params->iterations - i);
+        size_t allocated;
+        int err = 0;
+
+        uint64_t start = libbench_timestamp();
+        for (allocated = 0; allocated < count; allocated++) {
+            RpcMessage msg = {
+                .which_msg = RpcMessage_memory_tag,
+                .msg.memory = {
+                    .address = params->mem_addr,
+                    .size_bits = params->mem_size_bits,
+                    .type = seL4_UntypedObject,
+                    .action = Action_ALLOCATE,
+                },
+            };
+            if (rpc_call(client, &msg, params, params->slot + allocated)) {
+                err = -1;
+                break;
+            }
+            cookies[allocated] = msg.msg.ret.cookie;
+        }
+        libbench_result_add(alloc, allocated, libbench_timestamp() - start);
+        for (size_t j = 0; j < allocated; j++) {
+            seL4_CNode_Delete(params->root, params->slot + j, params->depth);
+        }
+
+        start = libbench_timestamp();
+        for (size_t j = 0; j < allocated; j++) {
+            RpcMessage msg = {
+                .which_msg = RpcMessage_memory_tag,
+                .msg.memory = {
+                    .address = cookies[j],
+                    .size_bits = params->mem_size_bits,
+                    .type = seL4_UntypedObject,
+                    .action = Action_FREE,
+                },
+            };
+            if (rpc_call(client, &msg, params, seL4_CapNull)) {
+                err = -1;
+            }
+        }
+        libbench_result_add(frees, allocated, libbench_timestamp() - start);
+        if (err) {
+            ZF_LOGE("Failed to run rpc memory benchmark: Call failed");
+            return -1;
+        }
+    }
+    if (!params->iterations) {
+        alloc->min_batch_ticks = 0;
+        frees->min_batch_ticks = 0;
+    }
+    return 0;
+}
+
+struct rpc_bench {
+    sel4rpc_client_t *client;
+    const libbench_rpc_params_t *params;
+    RpcMessage msg;
+};
+
+static int cap_op(size_t iteration, void *cookie)
+{
+    struct rpc_bench *bench = cookie;
+    /* The reply overwrites the request */
+    RpcMessage msg = bench->msg;
+    if (rpc_call(bench->client, &msg, bench->params, bench->params->slot)) {
+        return -1;
+    }
+    return seL4_CNode_Delete(bench->params->root, bench->params->slot, bench->params->depth) ? -1 : 0;
+}
+
+int libbench_run_rpc(libbench_results_t *results, struct sel4rpc_client_env *client,
+                     const libbench_rpc_params_t *params)
+{
+    if (!results || !client || !params) {
+        ZF_LOGE("Failed to run rpc benchmarks: Invalid results, client or parameters");
+        return -1;
+    }
+    if (params->mem_size_bits && run_memory(results, client, params)) {
+        return -1;
+    }
+    struct rpc_bench bench = {
+        .client = client,
+        .params = params
+    };
+#ifdef CONFIG_ARCH_X86
+    if (params->ioport_start <= params->ioport_end) {
+        bench.msg = (RpcMessage) {
+            .which_msg = RpcMessage_ioport_tag,
+            .msg.ioport = {
+                .start = params->ioport_start,
+                .end = params->ioport_end,
+            },
+        };
+        if (libbench_run_op(results, LIBBENCH_RPC_IOPORT, params->ioport_start, params->ioport_end,
+                            params->iterations, cap_op, &bench)) {
+            return -1;
+        }
+    }
+#endif
+    if (params->irq >= 0) {
+        bench.msg = (RpcMessage) {
+            .which_msg = RpcMessage_irq_tag,
+            .msg.irq = {
+                .which_type = IrqAllocMessage_simple_tag,
+                .type.simple = {
+                    .irq = params->irq,
+                },
+            },
+        };
+        if (libbench_run_op(results, LIBBENCH_RPC_IRQ, params->irq, 0, params->iterations, cap_op, &bench)) {
+            return -1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <utils/util.h>
+#include <sel4vchan/vchan_component.h>
+
+#include <sel4libbench/libbench.h>
+
+#include "benchmark.h"
+
+static const size_t message_sizes[] = { 16, 64, 256, 1024, 4096 };
+
+static char message[4096];
+static char echo[4096];
+
+struct vchan_bench {
+    libvchan_t *ctrl;
+    size_t size;
+};
+
+static int round_trip_op(size_t iteration, void *cookie)
+{
+    struct vchan_bench *bench = cookie;
+    if (libvchan_write(bench->ctrl, message, bench->size) != bench->size) {
+        return -1;
+    }
+    return libvchan_recv(bench->ctrl, echo, bench->size) == bench->size ? 0 : -1;
+}
+
+/* Keep as many messages in flight as the rings allow, receiving echoes whenever
+ * no more can be sent, so the peer is never blocked waiting on us for long */
+static int run_stream(libbench_results_t *results, struct vchan_bench *bench, size_t iterations)
+{
+    libbench_result_t *result = libbench_result_new(results, LIBBENCH_VCHAN_STREAM, bench->size, 0);
+    size_t sent = 0, received = 0;
+
+    if (!result) {
+        return -1;
+    }
+    uint64_t start = libbench_timestamp();
+    while (received < iterations) {
+        if (sent < iterations && libvchan_buffer_space(bench->ctrl) >= (int)bench->size) {
+            if (libvchan_send(bench->ctrl, message, bench->size) != bench->size) {
+                ZF_LOGE("Failed to run vchan stream benchmark: Send failed");
+                return -1;
+            }
+            sent++;
+            continue;
+        }
+        if (libvchan_recv(bench->ctrl, echo, bench->size) != bench->size) {
+            ZF_LOGE("Failed to run vchan stream benchmark: Receive failed");
+            return -1;
+        }
+        received++;
+    }
+    libbench_result_add(result, iterations, libbench_timestamp() - start);
+    if (!iterations) {
+        result->min_batch_ticks = 0;
+    }
+    return 0;
+}
+
+int libbench_run_vchan(libbench_results_t *results, libvchan_t *ctrl, size_t iterations)
+{
+    if (!results || !ctrl) {
+        ZF_LOGE("Failed to run vchan benchmarks: Invalid results or vchan");
+        return -1;
+    }
+    for (int i = 0; i < ARRAY_SIZE(message_sizes); i++) {
+        size_t buf_size = ctrl->buf_size ? ctrl->buf_size : VCHAN_BUF_SIZE;
+        if (message_sizes[i] > buf_size) {
+            break;
+        }
+        struct vchan_bench bench = {
+            .ctrl = ctrl,
+            .size = message_sizes[i]
+        };
+        if (libbench_run_op(results, LIBBENCH_VCHAN_ROUND_TRIP, bench.size, 0, iterations, round_trip_op, &bench)
+            || run_stream(results, &bench, iterations)) {
+            return -1;
+        }
+    }
+    return 0;
+}
@@ -8,6 +8,8 @@
 #include <pb.h>
 #include <sel4/sel4.h>
 
-/* bind a nanopb stream to the IPC buffer of the thread */
+/* bind a nanopb stream to the IPC buffer of the thread, from the message register at
+ * offset to the end of the message registers. The streams read and write the IPC
+ * buffer in place, without an intermediate buffer */
 pb_ostream_t pb_ostream_from_IPC(seL4_Word offset);
 pb_istream_t pb_istream_from_IPC(seL4_Word offset);
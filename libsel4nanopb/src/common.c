@@ -13,13 +13,13 @@
 pb_ostream_t pb_ostream_from_IPC(seL4_Word offset)
 {
     char *msg_buffer = (char *) & (seL4_GetIPCBuffer()->msg[offset]);
-    size_t size = seL4_MsgMaxLength * sizeof(seL4_Word) - offset;
+    size_t size = (seL4_MsgMaxLength - offset) * sizeof(seL4_Word);
     return pb_ostream_from_buffer(msg_buffer, size);
 }
 
 pb_istream_t pb_istream_from_IPC(seL4_Word offset)
 {
     char *msg_buffer = (char *) & (seL4_GetIPCBuffer()->msg[offset]);
-    size_t size = seL4_MsgMaxLength * sizeof(seL4_Word) - offset;
+    size_t size = (seL4_MsgMaxLength - offset) * sizeof(seL4_Word);
     return pb_istream_from_buffer(msg_buffer, size);
 }
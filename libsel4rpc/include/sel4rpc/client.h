@@ -7,6 +7,7 @@
 #pragma once
 
 #include <sel4/sel4.h>
+#include <sel4rpc/ring.h>
 
 struct _RpcMessage;
 typedef struct _RpcMessage RpcMessage;
@@ -14,8 +15,25 @@ typedef struct _RpcMessage RpcMessage;
 typedef struct sel4rpc_client_env {
     seL4_CPtr server_ep;
     seL4_Word magic;
+    /* version of the raw request layout understood by the server, 0 until
+     * the server has said it understands any */
+    seL4_Word server_version;
+
+    /* rings shared with the server for pipelined requests, if any */
+    sel4rpc_rings_t *rings;
+    seL4_CPtr server_ntfn;
+    seL4_Word next_id;
 } sel4rpc_client_t;
 
 int sel4rpc_client_init(sel4rpc_client_t *client, seL4_CPtr server_ep, seL4_Word magic);
 int sel4rpc_call(sel4rpc_client_t *client, RpcMessage *msg, seL4_CPtr root,
                  seL4_CPtr capPtr, seL4_Word capDepth);
+
+/* use the given rings, shared with the server, for pipelined requests, signalling
+ * server_ntfn when the server has requests to process */
+int sel4rpc_client_set_rings(sel4rpc_client_t *client, sel4rpc_rings_t *rings, seL4_CPtr server_ntfn);
+/* post a fixed shape request without waiting for its reply, any cap being placed
+ * in dest_slot of the client's CNode. Returns -1 if the request ring is full */
+int sel4rpc_call_async(sel4rpc_client_t *client, RpcMessage *msg, seL4_Word dest_slot, seL4_Word *id);
+/* collect the reply to a pipelined request, returning -1 if there is none yet */
+int sel4rpc_async_poll(sel4rpc_client_t *client, seL4_Word *id, RpcMessage *reply);
@@ -0,0 +1,53 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <sel4/sel4.h>
+
+/*
+ * Shared memory rings for pipelined requests.
+ *
+ * The client posts requests to the request ring and the server posts a
+ * response to the response ring for each one, matched by the id the client
+ * gave the request. Requests are the words of a raw request, so only the
+ * fixed shape messages of rpc.proto can be sent through the rings, and any
+ * cap sent back is placed in the client's CNode at the request's dest_slot.
+ *
+ * Each ring is written by one side only, and each side only advances its own
+ * index. The rings fit in a single 4K page.
+ */
+#define SEL4RPC_RING_SIZE 32
+#define SEL4RPC_RING_REQUEST_WORDS 7
+
+typedef struct sel4rpc_ring_request {
+    seL4_Word id;
+    /* slot of the client's CNode any cap is placed in */
+    seL4_Word dest_slot;
+    seL4_Word length;
+    seL4_Word words[SEL4RPC_RING_REQUEST_WORDS];
+} sel4rpc_ring_request_t;
+
+typedef struct sel4rpc_ring_response {
+    seL4_Word id;
+    seL4_Word errorCode;
+    seL4_Word cookie;
+} sel4rpc_ring_response_t;
+
+typedef struct sel4rpc_rings {
+    /* written by the client */
+    seL4_Word req_head;
+    seL4_Word resp_tail;
+    /* written by the server */
+    seL4_Word req_tail;
+    seL4_Word resp_head;
+    /* set by the server when it stopped on a full response ring, for the
+     * client to signal it once responses have been consumed */
+    seL4_Word stalled;
+
+    sel4rpc_ring_request_t requests[SEL4RPC_RING_SIZE];
+    sel4rpc_ring_response_t responses[SEL4RPC_RING_SIZE];
+} sel4rpc_rings_t;
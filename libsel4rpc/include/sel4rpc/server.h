@@ -10,6 +10,7 @@
 #include <vka/object.h>
 #include <vka/vka.h>
 #include <rpc.pb.h>
+#include <sel4rpc/ring.h>
 
 #define SEL4RPC_MSG_MAGIC (0xcafed00d)
 
@@ -25,11 +26,52 @@ typedef struct sel4rpc_env {
     void *data;
 
     simple_t *simple;
+
+    /* raw layout version advertised in replies, set once requests are
+     * received through sel4rpc_server_recv_info */
+    seL4_Word version;
+    /* whether the request being handled was raw, and so is its reply */
+    bool raw;
+
+    /* the client's CNode, that batch allocations place their caps in */
+    seL4_CPtr client_cnode;
+    seL4_Word client_depth;
+
+    /* rings shared with the client for pipelined requests, if any */
+    sel4rpc_rings_t *rings;
+    seL4_CPtr client_ntfn;
+    /* the ring request being handled, whose reply goes to the response ring */
+    sel4rpc_ring_request_t *ring_request;
+    bool ring_replied;
 } sel4rpc_server_env_t;
 
 int sel4rpc_server_init(sel4rpc_server_env_t *env, vka_t *vka,
                         sel4rpc_handler_t handler_func, void *data, vka_object_t *reply, simple_t *simple);
+
+/* A pool of server threads receiving on a shared endpoint, each with its own
+ * env and reply object. The threads allocate through the pool's vka, which
+ * serialises their use of the vka it wraps */
+typedef struct sel4rpc_server_pool {
+    vka_t vka;
+    vka_t *backing;
+    volatile int locked;
+} sel4rpc_server_pool_t;
+
+int sel4rpc_server_pool_init(sel4rpc_server_pool_t *pool, vka_t *vka);
+/* initialise the env of a thread of the pool, as sel4rpc_server_init does. The
+ * handler and its data are shared by the threads, so must be thread safe */
+int sel4rpc_server_pool_env_init(sel4rpc_server_pool_t *pool, sel4rpc_server_env_t *env,
+                                 sel4rpc_handler_t handler_func, void *data, vka_object_t *reply, simple_t *simple);
+/* give the server a cap to the client's CNode, addressed with the given depth, for batch allocations */
+int sel4rpc_server_set_client_cspace(sel4rpc_server_env_t *env, seL4_CPtr cnode, seL4_Word depth);
+/* serve pipelined requests from rings shared with the client, signalling client_ntfn
+ * when there are responses. Requires the client's CNode to have been set */
+int sel4rpc_server_set_rings(sel4rpc_server_env_t *env, sel4rpc_rings_t *rings, seL4_CPtr client_ntfn);
+/* handle the requests posted to the rings, returning the number handled */
+int sel4rpc_server_process_ring(sel4rpc_server_env_t *env);
 int sel4rpc_server_recv(sel4rpc_server_env_t *env);
+/* receive a request, using the message info it was received with to also accept raw requests */
+int sel4rpc_server_recv_info(sel4rpc_server_env_t *env, seL4_MessageInfo_t info);
 int sel4rpc_server_reply(sel4rpc_server_env_t *env, int caps, int errorCode, int cookie);
 int sel4rpc_default_handler(sel4rpc_server_env_t *env, UNUSED void *data, RpcMessage *rpcMsg);
 
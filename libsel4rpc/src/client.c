@@ -13,17 +13,113 @@
 
 #include <utils/zf_log.h>
 
+#include "raw.h"
+
 #define IPC_RESERVED_WORDS (1)
 
 int sel4rpc_client_init(sel4rpc_client_t *client, seL4_CPtr server_ep, seL4_Word magic)
 {
     client->server_ep = server_ep;
     client->magic = magic;
+    client->server_version = 0;
+    client->rings = NULL;
+    client->server_ntfn = seL4_CapNull;
+    client->next_id = 0;
+    return 0;
+}
+
+/* Set the next word of a raw request, if the value fits in a word */
+static bool raw_set(seL4_Word *words, int *n, uint64_t value)
+{
+    if ((seL4_Word)value != value) {
+        return false;
+    }
+    words[(*n)++] = value;
+    return true;
+}
+
+/* Encode a fixed shape message as the words of a raw request, its tag followed by its
+ * arguments, returning the number of words or 0 if the message has no raw layout */
+static int raw_encode(RpcMessage *msg, seL4_Word words[SEL4RPC_RAW_MAX_WORDS])
+{
+    int n = 1;
+    bool fits;
+    seL4_Word type = 0;
+
+    switch (msg->which_msg) {
+    case RpcMessage_memory_tag:
+        fits = raw_set(words, &n, msg->msg.memory.address) && raw_set(words, &n, msg->msg.memory.size_bits)
+               && raw_set(words, &n, msg->msg.memory.type) && raw_set(words, &n, msg->msg.memory.action);
+        break;
+    case RpcMessage_memory_batch_tag:
+        fits = raw_set(words, &n, msg->msg.memory_batch.address) && raw_set(words, &n, msg->msg.memory_batch.size_bits)
+               && raw_set(words, &n, msg->msg.memory_batch.type) && raw_set(words, &n, msg->msg.memory_batch.action)
+               && raw_set(words, &n, msg->msg.memory_batch.count) && raw_set(words, &n, msg->msg.memory_batch.dest_slot);
+        break;
+    case RpcMessage_ioport_tag:
+        fits = raw_set(words, &n, msg->msg.ioport.start) && raw_set(words, &n, msg->msg.ioport.end);
+        break;
+    case RpcMessage_irq_tag:
+        type = msg->msg.irq.which_type;
+        switch (type) {
+        case IrqAllocMessage_msi_tag: {
+            IrqAllocMessagex86_MSI *msi = &msg->msg.irq.type.msi;
+            fits = raw_set(words, &n, msi->pci_bus) && raw_set(words, &n, msi->pci_dev) && raw_set(words, &n, msi->pci_func)
+                   && raw_set(words, &n, msi->handle) && raw_set(words, &n, msi->vector);
+            break;
+        }
+        case IrqAllocMessage_ioapic_tag: {
+            IrqAllocMessagex86_IOAPIC *ioapic = &msg->msg.irq.type.ioapic;
+            fits = raw_set(words, &n, ioapic->ioapic) && raw_set(words, &n, ioapic->pin) && raw_set(words, &n, ioapic->level)
+                   && raw_set(words, &n, ioapic->polarity) && raw_set(words, &n, ioapic->vector);
+            break;
+        }
+        case IrqAllocMessage_simple_tag: {
+            IrqAllocMessageSimple *simple = &msg->msg.irq.type.simple;
+            fits = raw_set(words, &n, simple->setTrigger) && raw_set(words, &n, simple->irq)
+                   && raw_set(words, &n, simple->trigger);
+            break;
+        }
+        default:
+            fits = false;
+        }
+        break;
+    default:
+        fits = false;
+    }
+    if (!fits) {
+        return 0;
+    }
+    words[0] = SEL4RPC_RAW_TAG(msg->which_msg, type);
+    return n;
 }
 
 int sel4rpc_call(sel4rpc_client_t *client, RpcMessage *msg, seL4_CPtr root,
                  seL4_CPtr capPtr, seL4_Word capDepth)
 {
+    /* Servers that understand raw requests are sent the fixed shape messages raw */
+    seL4_Word words[SEL4RPC_RAW_MAX_WORDS];
+    int raw_words = client->server_version >= SEL4RPC_RAW_VERSION ? raw_encode(msg, words) : 0;
+    if (raw_words) {
+        for (int i = 0; i < raw_words; i++) {
+            seL4_SetMR(SEL4RPC_RAW_TAG_MR + i, words[i]);
+        }
+        seL4_SetCapReceivePath(root, capPtr, capDepth);
+        seL4_SetMR(0, client->magic);
+        seL4_MessageInfo_t info = seL4_Call(client->server_ep,
+                                            seL4_MessageInfo_new(SEL4RPC_RAW_VERSION, 0, 0,
+                                                                 SEL4RPC_RAW_TAG_MR + raw_words));
+        if (seL4_MessageInfo_get_label(info) != SEL4RPC_RAW_VERSION ||
+            seL4_MessageInfo_get_length(info) < SEL4RPC_RAW_REPLY_LENGTH) {
+            ZF_LOGE("Failed to decode server reply: Invalid raw reply");
+            return -1;
+        }
+        msg->which_msg = RpcMessage_ret_tag;
+        msg->msg.ret.errorCode = seL4_GetMR(0);
+        msg->msg.ret.cookie = seL4_GetMR(1);
+        return 0;
+    }
+
     pb_ostream_t stream = pb_ostream_from_IPC(IPC_RESERVED_WORDS);
     bool ret = pb_encode_delimited(&stream, &RpcMessage_msg, msg);
     if (!ret) {
@@ -44,7 +140,9 @@ int sel4rpc_call(sel4rpc_client_t *client, RpcMessage *msg, seL4_CPtr root,
     seL4_SetCapReceivePath(root, capPtr, capDepth);
     /* set magic header */
     seL4_SetMR(0, client->magic);
-    seL4_Call(client->server_ep, seL4_MessageInfo_new(0, 0, 0, stream_size));
+    seL4_MessageInfo_t info = seL4_Call(client->server_ep, seL4_MessageInfo_new(0, 0, 0, stream_size));
+    /* the reply's label advertises the raw layout version the server understands */
+    client->server_version = seL4_MessageInfo_get_label(info);
 
     pb_istream_t istream = pb_istream_from_IPC(0);
     ret = pb_decode_delimited(&istream, &RpcMessage_msg, msg);
@@ -55,3 +153,86 @@ int sel4rpc_call(sel4rpc_client_t *client, RpcMessage *msg, seL4_CPtr root,
 
     return 0;
 }
+
+int sel4rpc_client_set_rings(sel4rpc_client_t *client, sel4rpc_rings_t *rings, seL4_CPtr server_ntfn)
+{
+    if (!rings) {
+        ZF_LOGE("Failed to set rings: No rings given");
+        return -1;
+    }
+    rings->req_head = 0;
+    rings->req_tail = 0;
+    rings->resp_head = 0;
+    rings->resp_tail = 0;
+    rings->stalled = 0;
+    client->rings = rings;
+    client->server_ntfn = server_ntfn;
+    return 0;
+}
+
+int sel4rpc_call_async(sel4rpc_client_t *client, RpcMessage *msg, seL4_Word dest_slot, seL4_Word *id)
+{
+    sel4rpc_rings_t *rings = client->rings;
+    if (!rings) {
+        ZF_LOGE("Failed to post request: No rings set");
+        return -1;
+    }
+
+    seL4_Word head = rings->req_head;
+    seL4_Word tail = __atomic_load_n(&rings->req_tail, __ATOMIC_ACQUIRE);
+    if (head - tail >= SEL4RPC_RING_SIZE) {
+        return -1;
+    }
+
+    sel4rpc_ring_request_t *req = &rings->requests[head % SEL4RPC_RING_SIZE];
+    int length = raw_encode(msg, req->words);
+    if (!length) {
+        ZF_LOGE("Failed to post request: Message has no raw layout");
+        return -1;
+    }
+    seL4_Word req_id = client->next_id++;
+    req->id = req_id;
+    req->dest_slot = dest_slot;
+    req->length = length;
+    __atomic_store_n(&rings->req_head, head + 1, __ATOMIC_RELEASE);
+
+    /* the server drains the ring before waiting again, so only needs waking if
+     * it had already consumed everything before this request */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&rings->req_tail, __ATOMIC_RELAXED) == head) {
+        seL4_Signal(client->server_ntfn);
+    }
+
+    if (id) {
+        *id = req_id;
+    }
+    return 0;
+}
+
+int sel4rpc_async_poll(sel4rpc_client_t *client, seL4_Word *id, RpcMessage *reply)
+{
+    sel4rpc_rings_t *rings = client->rings;
+    if (!rings) {
+        ZF_LOGE("Failed to poll: No rings set");
+        return -1;
+    }
+
+    seL4_Word tail = rings->resp_tail;
+    if (__atomic_load_n(&rings->resp_head, __ATOMIC_ACQUIRE) == tail) {
+        return -1;
+    }
+
+    sel4rpc_ring_response_t *resp = &rings->responses[tail % SEL4RPC_RING_SIZE];
+    *id = resp->id;
+    reply->which_msg = RpcMessage_ret_tag;
+    reply->msg.ret.errorCode = resp->errorCode;
+    reply->msg.ret.cookie = resp->cookie;
+    __atomic_store_n(&rings->resp_tail, tail + 1, __ATOMIC_RELEASE);
+
+    /* wake a server that stopped for want of room to respond in */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&rings->stalled, __ATOMIC_RELAXED)) {
+        seL4_Signal(client->server_ntfn);
+    }
+    return 0;
+}
@@ -0,0 +1,34 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <sel4rpc/ring.h>
+
+/*
+ * Layout of raw requests, which carry the fixed shape messages of rpc.proto
+ * directly in message registers rather than protobuf encoded.
+ *
+ * A raw request has the version of the layout as its label, where protobuf
+ * requests have a label of 0. MR0 holds the magic header as it does for
+ * protobuf requests, MR1 the tag of the message and the remaining registers
+ * the fields of the message in the order they appear in rpc.proto.
+ *
+ * A raw reply has the same label, with the error code in MR0 and the cookie
+ * in MR1. Servers able to receive raw requests also label their protobuf
+ * replies with the version, which is how a client learns it can use them.
+ */
+#define SEL4RPC_RAW_VERSION 1
+
+#define SEL4RPC_RAW_TAG_MR 1
+
+/* The tag holds which_msg, and for IRQ messages which_type as well */
+#define SEL4RPC_RAW_TAG(msg, type) ((msg) | ((type) << 8))
+
+/* The tag, and up to 6 arguments, which is also what a ring request holds */
+#define SEL4RPC_RAW_MAX_WORDS SEL4RPC_RING_REQUEST_WORDS
+
+#define SEL4RPC_RAW_REPLY_LENGTH 2
@@ -5,6 +5,7 @@
  */
 
 #include <autoconf.h>
+#include <string.h>
 #include <sel4nanopb/sel4nanopb.h>
 #include <sel4rpc/server.h>
 #include <sel4utils/api.h>
@@ -18,6 +19,8 @@
 
 #include <utils/zf_log.h>
 
+#include "raw.h"
+
 static int sel4rpc_handle_memory(sel4rpc_server_env_t *env, RpcMessage *rpcMsg)
 {
     cspacepath_t path;
@@ -55,6 +58,59 @@ static int sel4rpc_handle_memory(sel4rpc_server_env_t *env, RpcMessage *rpcMsg)
     }
 }
 
+/* the reply's cookie is the number of regions allocated or freed */
+static int sel4rpc_handle_memory_batch(sel4rpc_server_env_t *env, RpcMessage *rpcMsg)
+{
+    MemoryBatchMessage *batch = &rpcMsg->msg.memory_batch;
+    cspacepath_t path;
+    uint64_t i;
+    int error;
+
+    if (batch->action != Action_ALLOCATE) {
+        for (i = 0; i < batch->count; i++) {
+            vka_utspace_free(env->vka, batch->type, batch->size_bits, batch->address + (i << batch->size_bits));
+        }
+        return sel4rpc_server_reply(env, 0, 0, batch->count);
+    }
+
+    if (env->client_cnode == seL4_CapNull) {
+        ZF_LOGE("Failed to alloc batch: No client CNode to place caps in\n");
+        sel4rpc_server_reply(env, 0, 1, 0);
+        return -1;
+    }
+
+    error = vka_cspace_alloc_path(env->vka, &path);
+    if (error) {
+        ZF_LOGE("Failed to alloc path: %d\n", error);
+        sel4rpc_server_reply(env, 0, 1, 0);
+        return -1;
+    }
+
+    /* the same slot is reused for each region, as each cap is moved out of it */
+    for (i = 0; i < batch->count; i++) {
+        uintptr_t address = batch->address + (i << batch->size_bits);
+        uintptr_t cookie;
+        error = vka_utspace_alloc_at(env->vka, &path, batch->type, batch->size_bits, address, &cookie);
+        if (error) {
+            ZF_LOGE("Failed to alloc at: %d\n", error);
+            break;
+        }
+
+        error = seL4_CNode_Move(env->client_cnode, batch->dest_slot + i, env->client_depth,
+                                path.root, path.capPtr, path.capDepth);
+        if (error) {
+            ZF_LOGE("Failed to move cap to client slot: %d\n", error);
+            vka_cnode_delete(&path);
+            vka_utspace_free(env->vka, batch->type, batch->size_bits, address);
+            break;
+        }
+    }
+    vka_cspace_free_path(env->vka, path);
+
+    int ret = sel4rpc_server_reply(env, 0, error != 0, i);
+    return error ? -1 : ret;
+}
+
 static int sel4rpc_handle_ioport(sel4rpc_server_env_t *env, RpcMessage *rpcMsg)
 {
     cspacepath_t path;
@@ -154,6 +210,8 @@ int sel4rpc_default_handler(sel4rpc_server_env_t *env, UNUSED void *data, RpcMes
     switch (rpcMsg->which_msg) {
     case RpcMessage_memory_tag:
         return sel4rpc_handle_memory(env, rpcMsg);
+    case RpcMessage_memory_batch_tag:
+        return sel4rpc_handle_memory_batch(env, rpcMsg);
     case RpcMessage_ioport_tag:
         return sel4rpc_handle_ioport(env, rpcMsg);
     case RpcMessage_irq_tag:
@@ -173,11 +231,200 @@ int sel4rpc_server_init(sel4rpc_server_env_t *env, vka_t *vka,
     env->handler = handler_func;
     env->data = data;
     env->simple = simple;
+    env->version = 0;
+    env->raw = false;
+    env->client_cnode = seL4_CapNull;
+    env->client_depth = 0;
+    env->rings = NULL;
+    env->client_ntfn = seL4_CapNull;
+    env->ring_request = NULL;
+    env->ring_replied = false;
     return 0;
 }
 
+static void pool_lock(sel4rpc_server_pool_t *pool)
+{
+    while (__atomic_exchange_n(&pool->locked, 1, __ATOMIC_ACQUIRE)) {
+        /* let the holder make progress if it shares our core */
+        seL4_Yield();
+    }
+}
+
+static void pool_unlock(sel4rpc_server_pool_t *pool)
+{
+    __atomic_store_n(&pool->locked, 0, __ATOMIC_RELEASE);
+}
+
+static int pool_cspace_alloc(void *data, seL4_CPtr *res)
+{
+    sel4rpc_server_pool_t *pool = data;
+    pool_lock(pool);
+    int ret = pool->backing->cspace_alloc(pool->backing->data, res);
+    pool_unlock(pool);
+    return ret;
+}
+
+static void pool_cspace_make_path(void *data, seL4_CPtr slot, cspacepath_t *res)
+{
+    /* only derives the path from the vka's cspace layout, so needs no lock */
+    sel4rpc_server_pool_t *pool = data;
+    pool->backing->cspace_make_path(pool->backing->data, slot, res);
+}
+
+static void pool_cspace_free(void *data, seL4_CPtr slot)
+{
+    sel4rpc_server_pool_t *pool = data;
+    pool_lock(pool);
+    pool->backing->cspace_free(pool->backing->data, slot);
+    pool_unlock(pool);
+}
+
+static int pool_utspace_alloc(void *data, const cspacepath_t *dest, seL4_Word type, seL4_Word size_bits,
+                              seL4_Word *res)
+{
+    sel4rpc_server_pool_t *pool = data;
+    pool_lock(pool);
+    int ret = pool->backing->utspace_alloc(pool->backing->data, dest, type, size_bits, res);
+    pool_unlock(pool);
+    return ret;
+}
+
+static int pool_utspace_alloc_maybe_device(void *data, const cspacepath_t *dest, seL4_Word type,
+                                           seL4_Word size_bits, bool can_use_dev, seL4_Word *res)
+{
+    sel4rpc_server_pool_t *pool = data;
+    pool_lock(pool);
+    int ret = pool->backing->utspace_alloc_maybe_device(pool->backing->data, dest, type, size_bits, can_use_dev,
+                                                        res);
+    pool_unlock(pool);
+    return ret;
+}
+
+static int pool_utspace_alloc_at(void *data, const cspacepath_t *dest, seL4_Word type, seL4_Word size_bits,
+                                 uintptr_t paddr, seL4_Word *cookie)
+{
+    sel4rpc_server_pool_t *pool = data;
+    pool_lock(pool);
+    int ret = pool->backing->utspace_alloc_at(pool->backing->data, dest, type, size_bits, paddr, cookie);
+    pool_unlock(pool);
+    return ret;
+}
+
+static void pool_utspace_free(void *data, seL4_Word type, seL4_Word size_bits, seL4_Word target)
+{
+    sel4rpc_server_pool_t *pool = data;
+    pool_lock(pool);
+    pool->backing->utspace_free(pool->backing->data, type, size_bits, target);
+    pool_unlock(pool);
+}
+
+static uintptr_t pool_utspace_paddr(void *data, seL4_Word target, seL4_Word type, seL4_Word size_bits)
+{
+    sel4rpc_server_pool_t *pool = data;
+    pool_lock(pool);
+    uintptr_t paddr = pool->backing->utspace_paddr(pool->backing->data, target, type, size_bits);
+    pool_unlock(pool);
+    return paddr;
+}
+
+int sel4rpc_server_pool_init(sel4rpc_server_pool_t *pool, vka_t *vka)
+{
+    if (!pool || !vka) {
+        ZF_LOGE("Failed to init server pool: No pool or vka given");
+        return -1;
+    }
+    pool->backing = vka;
+    pool->locked = 0;
+    /* operations the wrapped vka doesn't provide are left out of the pool's too */
+    pool->vka = (vka_t) {
+        .data = pool,
+        .cspace_alloc = vka->cspace_alloc ? pool_cspace_alloc : NULL,
+        .cspace_make_path = vka->cspace_make_path ? pool_cspace_make_path : NULL,
+        .utspace_alloc = vka->utspace_alloc ? pool_utspace_alloc : NULL,
+        .utspace_alloc_maybe_device = vka->utspace_alloc_maybe_device ? pool_utspace_alloc_maybe_device : NULL,
+        .utspace_alloc_at = vka->utspace_alloc_at ? pool_utspace_alloc_at : NULL,
+        .cspace_free = vka->cspace_free ? pool_cspace_free : NULL,
+        .utspace_free = vka->utspace_free ? pool_utspace_free : NULL,
+        .utspace_paddr = vka->utspace_paddr ? pool_utspace_paddr : NULL,
+    };
+    return 0;
+}
+
+int sel4rpc_server_pool_env_init(sel4rpc_server_pool_t *pool, sel4rpc_server_env_t *env,
+                                 sel4rpc_handler_t handler_func, void *data, vka_object_t *reply, simple_t *simple)
+{
+    if (!pool || !reply) {
+        ZF_LOGE("Failed to init pool server: Each thread needs its own reply object");
+        return -1;
+    }
+    return sel4rpc_server_init(env, &pool->vka, handler_func, data, reply, simple);
+}
+
+int sel4rpc_server_set_client_cspace(sel4rpc_server_env_t *env, seL4_CPtr cnode, seL4_Word depth)
+{
+    env->client_cnode = cnode;
+    env->client_depth = depth;
+    return 0;
+}
+
+int sel4rpc_server_set_rings(sel4rpc_server_env_t *env, sel4rpc_rings_t *rings, seL4_CPtr client_ntfn)
+{
+    if (!rings) {
+        ZF_LOGE("Failed to set rings: No rings given");
+        return -1;
+    }
+    env->rings = rings;
+    env->client_ntfn = client_ntfn;
+    return 0;
+}
+
+/* Respond to the ring request being handled, moving any cap to the slot it asked for */
+static int sel4rpc_server_ring_reply(sel4rpc_server_env_t *env, int caps, int errorCode, int cookie)
+{
+    sel4rpc_rings_t *rings = env->rings;
+    int ret = 0;
+
+    if (env->ring_replied) {
+        ZF_LOGE("Failed to reply: Request %lu already replied to", (unsigned long)env->ring_request->id);
+        return -1;
+    }
+
+    if (caps > 0) {
+        cspacepath_t path;
+        vka_cspace_make_path(env->vka, seL4_GetCap(0), &path);
+        int error = seL4_CNode_Move(env->client_cnode, env->ring_request->dest_slot, env->client_depth,
+                                    path.root, path.capPtr, path.capDepth);
+        if (error) {
+            ZF_LOGE("Failed to move cap to client slot: %d\n", error);
+            errorCode = 1;
+            ret = -1;
+        }
+    }
+
+    /* room for the response was checked before the request was handled */
+    seL4_Word head = rings->resp_head;
+    sel4rpc_ring_response_t *resp = &rings->responses[head % SEL4RPC_RING_SIZE];
+    resp->id = env->ring_request->id;
+    resp->errorCode = errorCode;
+    resp->cookie = cookie;
+    __atomic_store_n(&rings->resp_head, head + 1, __ATOMIC_RELEASE);
+    env->ring_replied = true;
+    return ret;
+}
+
 int sel4rpc_server_reply(sel4rpc_server_env_t *env, int caps, int errorCode, int cookie)
 {
+    if (env->ring_request) {
+        return sel4rpc_server_ring_reply(env, caps, errorCode, cookie);
+    }
+
+    if (env->raw) {
+        seL4_SetMR(0, errorCode);
+        seL4_SetMR(1, cookie);
+        api_reply(env->reply->cptr, seL4_MessageInfo_new(SEL4RPC_RAW_VERSION, 0, caps, SEL4RPC_RAW_REPLY_LENGTH));
+        return 0;
+    }
+
     pb_ostream_t ostream = pb_ostream_from_IPC(0);
     RpcMessage rpcMsg;
     rpcMsg.which_msg = RpcMessage_ret_tag;
@@ -200,14 +447,26 @@ int sel4rpc_server_reply(sel4rpc_server_env_t *env, int caps, int errorCode, int
         size++;
     }
 
-    api_reply(env->reply->cptr, seL4_MessageInfo_new(0, 0, caps, size));
+    api_reply(env->reply->cptr, seL4_MessageInfo_new(env->version, 0, caps, size));
 
     return 0;
 }
 
+static int sel4rpc_server_handle(sel4rpc_server_env_t *env, RpcMessage *rpcMsg)
+{
+    int err = 0;
+    if (env->handler) {
+        err = env->handler(env, env->data, rpcMsg);
+    } else {
+        err = sel4rpc_default_handler(env, NULL, rpcMsg);
+    }
+    return err;
+}
+
 int sel4rpc_server_recv(sel4rpc_server_env_t *env)
 {
     RpcMessage rpcMsg;
+    env->raw = false;
     pb_istream_t stream = pb_istream_from_IPC(1);
     bool ret = pb_decode_delimited(&stream, &RpcMessage_msg, &rpcMsg);
     if (!ret) {
@@ -215,11 +474,198 @@ int sel4rpc_server_recv(sel4rpc_server_env_t *env)
         return -1;
     }
 
-    int err = 0;
-    if (env->handler) {
-        err = env->handler(env, env->data, &rpcMsg);
-    } else {
-        err = sel4rpc_default_handler(env, NULL, &rpcMsg);
+    return sel4rpc_server_handle(env, &rpcMsg);
+}
+
+/* Decode the words of a raw request into the message protobuf decoding would produce */
+static int raw_decode(RpcMessage *rpcMsg, const seL4_Word *words, seL4_Word length)
+{
+    seL4_Word tag = words[0];
+    seL4_Word args = length - 1;
+    int n = 1;
+
+    memset(rpcMsg, 0, sizeof(*rpcMsg));
+    switch (tag) {
+    case SEL4RPC_RAW_TAG(RpcMessage_memory_tag, 0):
+        if (args < 4) {
+            break;
+        }
+        rpcMsg->which_msg = RpcMessage_memory_tag;
+        rpcMsg->msg.memory.address = words[n++];
+        rpcMsg->msg.memory.size_bits = words[n++];
+        rpcMsg->msg.memory.type = words[n++];
+        rpcMsg->msg.memory.action = words[n++];
+        return 0;
+    case SEL4RPC_RAW_TAG(RpcMessage_memory_batch_tag, 0):
+        if (args < 6) {
+            break;
+        }
+        rpcMsg->which_msg = RpcMessage_memory_batch_tag;
+        rpcMsg->msg.memory_batch.address = words[n++];
+        rpcMsg->msg.memory_batch.size_bits = words[n++];
+        rpcMsg->msg.memory_batch.type = words[n++];
+        rpcMsg->msg.memory_batch.action = words[n++];
+        rpcMsg->msg.memory_batch.count = words[n++];
+        rpcMsg->msg.memory_batch.dest_slot = words[n++];
+        return 0;
+    case SEL4RPC_RAW_TAG(RpcMessage_ioport_tag, 0):
+        if (args < 2) {
+            break;
+        }
+        rpcMsg->which_msg = RpcMessage_ioport_tag;
+        rpcMsg->msg.ioport.start = words[n++];
+        rpcMsg->msg.ioport.end = words[n++];
+        return 0;
+    case SEL4RPC_RAW_TAG(RpcMessage_irq_tag, IrqAllocMessage_msi_tag): {
+        IrqAllocMessagex86_MSI *msi = &rpcMsg->msg.irq.type.msi;
+        if (args < 5) {
+            break;
+        }
+        rpcMsg->which_msg = RpcMessage_irq_tag;
+        rpcMsg->msg.irq.which_type = IrqAllocMessage_msi_tag;
+        msi->pci_bus = words[n++];
+        msi->pci_dev = words[n++];
+        msi->pci_func = words[n++];
+        msi->handle = words[n++];
+        msi->vector = words[n++];
+        return 0;
+    }
+    case SEL4RPC_RAW_TAG(RpcMessage_irq_tag, IrqAllocMessage_ioapic_tag): {
+        IrqAllocMessagex86_IOAPIC *ioapic = &rpcMsg->msg.irq.type.ioapic;
+        if (args < 5) {
+            break;
+        }
+        rpcMsg->which_msg = RpcMessage_irq_tag;
+        rpcMsg->msg.irq.which_type = IrqAllocMessage_ioapic_tag;
+        ioapic->ioapic = words[n++];
+        ioapic->pin = words[n++];
+        ioapic->level = words[n++];
+        ioapic->polarity = words[n++];
+        ioapic->vector = words[n++];
+        return 0;
+    }
+    case SEL4RPC_RAW_TAG(RpcMessage_irq_tag, IrqAllocMessage_simple_tag): {
+        IrqAllocMessageSimple *simple = &rpcMsg->msg.irq.type.simple;
+        if (args < 3) {
+            break;
+        }
+        rpcMsg->which_msg = RpcMessage_irq_tag;
+        rpcMsg->msg.irq.which_type = IrqAllocMessage_simple_tag;
+        simple->setTrigger = words[n++];
+        simple->irq = words[n++];
+        simple->trigger = words[n++];
+        return 0;
+    }
+    default:
+        break;
+    }
+    ZF_LOGE("Invalid raw request (tag 0x%lx, length %lu)", (unsigned long)tag, (unsigned long)length);
+    return -1;
+}
+
+int sel4rpc_server_recv_info(sel4rpc_server_env_t *env, seL4_MessageInfo_t info)
+{
+    seL4_Word label = seL4_MessageInfo_get_label(info);
+    /* the label is passed on, so raw requests can be accepted from now on */
+    env->version = SEL4RPC_RAW_VERSION;
+    if (label == 0) {
+        return sel4rpc_server_recv(env);
+    }
+    if (label != SEL4RPC_RAW_VERSION) {
+        ZF_LOGE("Unsupported raw request version %lu", (unsigned long)label);
+        return -1;
+    }
+
+    seL4_Word words[SEL4RPC_RAW_MAX_WORDS];
+    seL4_Word length = seL4_MessageInfo_get_length(info);
+    if (length <= SEL4RPC_RAW_TAG_MR) {
+        ZF_LOGE("Invalid raw request (length %lu)", (unsigned long)length);
+        return -1;
+    }
+    length -= SEL4RPC_RAW_TAG_MR;
+    if (length > SEL4RPC_RAW_MAX_WORDS) {
+        length = SEL4RPC_RAW_MAX_WORDS;
+    }
+    for (int i = 0; i < length; i++) {
+        words[i] = seL4_GetMR(SEL4RPC_RAW_TAG_MR + i);
+    }
+
+    RpcMessage rpcMsg;
+    if (raw_decode(&rpcMsg, words, length)) {
+        return -1;
     }
+    env->raw = true;
+    int err = sel4rpc_server_handle(env, &rpcMsg);
+    env->raw = false;
     return err;
 }
+
+/* Whether there is room in the response ring for another response */
+static bool ring_can_respond(sel4rpc_rings_t *rings)
+{
+    return rings->resp_head - __atomic_load_n(&rings->resp_tail, __ATOMIC_ACQUIRE) < SEL4RPC_RING_SIZE;
+}
+
+int sel4rpc_server_process_ring(sel4rpc_server_env_t *env)
+{
+    sel4rpc_rings_t *rings = env->rings;
+    if (!rings) {
+        ZF_LOGE("Failed to process ring: No rings set");
+        return -1;
+    }
+    if (env->client_cnode == seL4_CapNull) {
+        ZF_LOGE("Failed to process ring: No client CNode to place caps in");
+        return -1;
+    }
+
+    int handled = 0;
+    seL4_Word tail = rings->req_tail;
+    while (true) {
+        if (tail == __atomic_load_n(&rings->req_head, __ATOMIC_ACQUIRE)) {
+            /* check again after publishing the tail, as the client only signals
+             * for requests posted once the ring looked drained */
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (tail == __atomic_load_n(&rings->req_head, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+        }
+        if (!ring_can_respond(rings)) {
+            __atomic_store_n(&rings->stalled, 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (!ring_can_respond(rings)) {
+                /* the client signals once it has consumed a response */
+                break;
+            }
+        }
+        __atomic_store_n(&rings->stalled, 0, __ATOMIC_RELAXED);
+
+        sel4rpc_ring_request_t *req = &rings->requests[tail % SEL4RPC_RING_SIZE];
+        seL4_Word length = req->length;
+        if (length > SEL4RPC_RAW_MAX_WORDS) {
+            length = SEL4RPC_RAW_MAX_WORDS;
+        }
+
+        env->ring_request = req;
+        env->ring_replied = false;
+        RpcMessage rpcMsg;
+        if (length == 0 || raw_decode(&rpcMsg, req->words, length)) {
+            sel4rpc_server_ring_reply(env, 0, 1, 0);
+        } else {
+            sel4rpc_server_handle(env, &rpcMsg);
+            if (!env->ring_replied) {
+                /* every request gets a response, so the client isn't left waiting */
+                sel4rpc_server_ring_reply(env, 0, 1, 0);
+            }
+        }
+        env->ring_request = NULL;
+
+        tail++;
+        __atomic_store_n(&rings->req_tail, tail, __ATOMIC_RELEASE);
+        handled++;
+    }
+
+    if (handled) {
+        seL4_Signal(env->client_ntfn);
+    }
+    return handled;
+}
@@ -16,6 +16,13 @@ typedef struct camkes_vchan_con {
     int dest_dom_number;
     int source_dom_number;
     void *data_buf;
+    /* Size of each ring in data_buf, a power of two between VCHAN_BUF_SIZE
+     * and VCHAN_BUF_SIZE_MAX. 0 for rings of VCHAN_BUF_SIZE */
+    size_t buf_size;
+    /* Set when the component only waits on the connection through libvchan,
+     * so the peer can skip alerting it while it isn't waiting. Components
+     * acting on alerts through reg_callback or poll leave this unset */
+    int suppress_alerts;
 
     /* Function Pointers */
     int (*connect)(vchan_connect_t);
@@ -38,9 +45,62 @@ struct libvchan {
     int server_persists;
     int blocking;
     int domain_num, port_num;
+    /* Size of the connection's rings */
+    size_t buf_size;
 
     camkes_vchan_con_t *con;
 };
 
 libvchan_t *link_vchan_comp(libvchan_t *ctrl, camkes_vchan_con_t *vchan_com);
 vchan_buf_t *get_vchan_buf(vchan_ctrl_t *args, camkes_vchan_con_t *c, int action);
+
+/*
+    Zero-copy access to the vchan buffer
+
+    Rather than copying through libvchan_write and libvchan_read, a sender can
+    acquire space in the shared vchan buffer, produce its data in place and
+    commit it, and a receiver can acquire the data in place and release it once
+    consumed. Acquiring blocks until there is space or data, and hands back the
+    largest contiguous region available, which ends at the end of the buffer.
+    The region remains valid until it is committed or released, each of which
+    alerts the peer. Returns -1 on error, otherwise 0.
+*/
+int libvchan_write_acquire(libvchan_t *ctrl, void **data, size_t *size);
+int libvchan_write_commit(libvchan_t *ctrl, size_t size);
+int libvchan_read_acquire(libvchan_t *ctrl, const void **data, size_t *size);
+int libvchan_read_release(libvchan_t *ctrl, size_t size);
+
+/*
+    Waiting on many vchans at once
+
+    A wait set lets a single thread serve many vchans, blocking on one
+    notification rather than on each connection's wait. The component's
+    connections have to be set up so that their peers' alerts all signal
+    that notification, each with distinct badge bits, which are given when
+    the vchan is added. Waiting returns a mask of the indices vchans were
+    added at that are ready: those with data to read, if read was asked
+    for, with space to write, if write was asked for, or closed. A ready
+    vchan can then be read or written without blocking, up to what is
+    ready. Vchans in a wait set are not to be waited on through
+    libvchan_wait.
+*/
+#define LIBVCHAN_WAITSET_MAX 64
+
+#define LIBVCHAN_WAIT_READ BIT(0)
+#define LIBVCHAN_WAIT_WRITE BIT(1)
+
+typedef struct libvchan_waitset {
+    seL4_CPtr ntfn;
+    int num_ctrls;
+    libvchan_t *ctrls[LIBVCHAN_WAITSET_MAX];
+    seL4_Word badges[LIBVCHAN_WAITSET_MAX];
+    int events[LIBVCHAN_WAITSET_MAX];
+} libvchan_waitset_t;
+
+int libvchan_waitset_init(libvchan_waitset_t *ws, seL4_CPtr ntfn);
+/* Returns -1 on error, otherwise the index of the vchan in the set */
+int libvchan_waitset_add(libvchan_waitset_t *ws, libvchan_t *ctrl, seL4_Word badge, int events);
+/* Returns -1 on error, otherwise 0 with ready set to the mask of ready vchans */
+int libvchan_waitset_wait(libvchan_waitset_t *ws, uint64_t *ready);
+/* Like libvchan_waitset_wait, but a ready mask of 0 is returned rather than blocking */
+int libvchan_waitset_poll(libvchan_waitset_t *ws, uint64_t *ready);
@@ -62,4 +62,35 @@ typedef struct vchan_connect {
     unsigned event_mon;
 } vchan_connect_t;
 
+/*
+    Argument structure used for mapping the rings of a vchan into a guest
+        Rather than each read and write being a hypercall copying through
+        the VMM, the guest asks for the pages of the component's vchan
+        rings to be mapped at guest physical address paddr, and reads and
+        writes the vchan_buf_t at send_offset and recv_offset itself. The
+        guest follows the same protocol as components, advertising its
+        state in the rings, so hypercalls are only needed for wakeups
+*/
+typedef struct vchan_map_args {
+    vchan_ctrl_t v;
+    /* Filled in by the VMM */
+    unsigned long long paddr;
+    unsigned size;
+    unsigned buf_size;
+    unsigned send_offset;
+    unsigned recv_offset;
+} vchan_map_args_t;
+
+/*
+    Argument structure used for waking the component of a mapped vchan
+        Issued by the guest after updating the ring of type, VCHAN_SEND or
+        VCHAN_RECV, only when the component's state in it is not
+        VCHAN_PEER_RUNNING. The component wakes the guest through
+        VCHAN_EVENT_IRQ
+*/
+typedef struct vchan_notify_args {
+    vchan_ctrl_t v;
+    int type;
+} vchan_notify_args_t;
+
 int libvchan_readwrite(libvchan_t *ctrl, void *data, size_t size, int cmd, int stream);
@@ -0,0 +1,63 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: GPL-2.0-only
+ */
+#pragma once
+
+/*
+    Layout of the rings of a vchan, shared between components and, once
+        mapped into a guest with SEL4_VCHAN_MAP, the Linux vchan driver.
+        This header doesn't depend on seL4 headers, so it can be included
+        by the driver
+*/
+#ifdef __KERNEL__
+#include <linux/stddef.h>
+#else
+#include <stddef.h>
+#endif
+
+/* Default size of a vchan ring */
+#define VCHAN_BUF_SIZE 4096
+/* Largest size of a vchan ring */
+#define VCHAN_BUF_SIZE_MAX (1 << 23)
+#define NUM_SHARED_VCHAN_BUFFERS 2
+
+/*
+    State advertised by the reader and the writer of a vchan buffer
+        VCHAN_PEER_ALERT: always alert it, it doesn't advertise when it waits
+        VCHAN_PEER_RUNNING: it isn't waiting, alerting it can be skipped
+        VCHAN_PEER_WAITING: it is waiting, or about to, and has to be alerted
+*/
+#define VCHAN_PEER_ALERT 0
+#define VCHAN_PEER_RUNNING 1
+#define VCHAN_PEER_WAITING 2
+
+/* Each side's position sits on its own cache line */
+#define VCHAN_CACHE_LINE 64
+
+/*
+    Rings are a power of two in size, so positions are free running and wrap
+        around along with the unsigned arithmetic on them. A side publishes
+        its position with a release store once done with the data, and the
+        peer's position is loaded with acquire before touching the data. Rings larger than
+        the default extend sync_data past the end of the structure, across
+        as many pages of the dataport as VCHAN_BUF_BYTES of the size needs
+*/
+typedef struct vchan_buf {
+    int owner;
+    /* Written only by the writer */
+    struct {
+        unsigned int write_pos;
+        int writer_state;
+    } __attribute__((aligned(VCHAN_CACHE_LINE)));
+    /* Written only by the reader */
+    struct {
+        unsigned int read_pos;
+        int reader_state;
+    } __attribute__((aligned(VCHAN_CACHE_LINE)));
+    char sync_data[VCHAN_BUF_SIZE] __attribute__((aligned(VCHAN_CACHE_LINE)));
+} vchan_buf_t;
+
+/* Bytes of dataport taken up by a vchan ring of the given size */
+#define VCHAN_BUF_BYTES(size) (offsetof(vchan_buf_t, sync_data) + (size))
@@ -7,21 +7,14 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <sel4/sel4.h>
 #include <sel4utils/util.h>
 #include <simple/simple.h>
+#include "vchan_ring.h"
 
 
-#define VCHAN_BUF_SIZE PAGE_SIZE_4K
-#define NUM_SHARED_VCHAN_BUFFERS 2
-
-typedef struct vchan_buf {
-    int owner;
-    int read_pos, write_pos;
-    char sync_data[VCHAN_BUF_SIZE];
-} vchan_buf_t;
-
 /*
     Handles managing of packets, storing packets in shared mem,
         copying in memory and reading from memory for sync comms
@@ -29,6 +29,10 @@
 #define SEL4_VCHAN_STATE    26
 #define SEL4_VCHAN_WAIT     27
 #define SEL4_VCHAN_BUF      28
+/* vchan_map_args_t */
+#define SEL4_VCHAN_MAP      29
+/* vchan_notify_args_t */
+#define SEL4_VCHAN_NOTIFY   30
 
 #define DATATYPE_INT        0
 
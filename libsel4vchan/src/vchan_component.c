@@ -22,7 +22,14 @@ libvchan_t *link_vchan_comp(libvchan_t *ctrl, camkes_vchan_con_t *vchan_com)
     }
 
     int res;
+    size_t buf_size = vchan_com->buf_size ? vchan_com->buf_size : VCHAN_BUF_SIZE;
+    if (buf_size < VCHAN_BUF_SIZE || buf_size > VCHAN_BUF_SIZE_MAX || (buf_size & (buf_size - 1))) {
+        ZF_LOGE("Invalid vchan ring size %zu", buf_size);
+        free(ctrl);
+        return NULL;
+    }
     ctrl->con = vchan_com;
+    ctrl->buf_size = buf_size;
     /* Perform vchan component initialisation */
     vchan_connect_t t = {
         .v.domain = vchan_com->source_dom_number,
@@ -134,24 +141,93 @@ vchan_buf_t *get_vchan_ctrl_databuf(libvchan_t *ctrl, int action)
     return get_vchan_buf(&args, ctrl->con, action);
 }
 
-static size_t get_actionsize(int type, size_t size, vchan_buf_t *buf)
+/* Number of times to check a buffer before blocking on the connection */
+#ifndef VCHAN_SPIN_COUNT
+#define VCHAN_SPIN_COUNT 1000
+#endif
+
+static size_t get_filled(vchan_buf_t *buf)
+{
+    unsigned int write_pos = __atomic_load_n(&buf->write_pos, __ATOMIC_ACQUIRE);
+    unsigned int read_pos = __atomic_load_n(&buf->read_pos, __ATOMIC_ACQUIRE);
+    return write_pos - read_pos;
+}
+
+/*
+    Publish a side's new position once it is done with the data
+*/
+static void advance_pos(unsigned int *pos, size_t size)
+{
+    __atomic_store_n(pos, *pos + size, __ATOMIC_RELEASE);
+}
+
+static size_t get_actionsize(libvchan_t *ctrl, int type, size_t size, vchan_buf_t *buf)
 {
     assert(buf != NULL);
-    size_t filled = abs(buf->write_pos - buf->read_pos);
+    size_t filled = get_filled(buf);
     if (type == VCHAN_SEND) {
-        return MIN(VCHAN_BUF_SIZE - filled, size);
+        return MIN(ctrl->buf_size - filled, size);
     } else {
         return MIN(filled, size);
     }
 }
 
+/*
+    Wait until there is space or data for a read/write action
+        The buffer is polled for a while first, blocking is the slow path.
+        Before blocking, a component suppressing alerts advertises that it
+        is waiting and checks the buffer again, so that an update from the
+        peer either is seen or is followed by an alert
+*/
+static size_t wait_actionsize(libvchan_t *ctrl, int type, size_t size, vchan_buf_t *buf)
+{
+    size_t ssize = get_actionsize(ctrl, type, size, buf);
+    for (int i = 0; ssize == 0 && i < VCHAN_SPIN_COUNT; i++) {
+        ssize = get_actionsize(ctrl, type, size, buf);
+    }
+
+    int *state = (type == VCHAN_SEND) ? &buf->writer_state : &buf->reader_state;
+    while (ssize == 0) {
+        if (ctrl->con->suppress_alerts) {
+            /* The state has to be visible before checking the buffer again */
+            __atomic_store_n(state, VCHAN_PEER_WAITING, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            ssize = get_actionsize(ctrl, type, size, buf);
+            if (ssize != 0) {
+                break;
+            }
+        }
+        ctrl->con->wait();
+        ssize = get_actionsize(ctrl, type, size, buf);
+    }
+
+    if (ctrl->con->suppress_alerts) {
+        __atomic_store_n(state, VCHAN_PEER_RUNNING, __ATOMIC_RELAXED);
+    }
+    return ssize;
+}
+
+/*
+    Alert the peer of an update to a buffer, unless it has advertised it isn't waiting
+*/
+static void notify_peer(libvchan_t *ctrl, int type, vchan_buf_t *buf)
+{
+    /* Order the position update before looking at whether the peer is waiting */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int state = __atomic_load_n((type == VCHAN_SEND) ? &buf->reader_state : &buf->writer_state, __ATOMIC_RELAXED);
+    if (state != VCHAN_PEER_RUNNING) {
+        ctrl->con->alert();
+    }
+}
+
 /*
     Perform a vchan read/write action into a given buffer
      This function is intended for non Init components, Init components have a different method
 */
 int libvchan_readwrite(libvchan_t *ctrl, void *data, size_t size, int cmd, int stream)
 {
-    int *update;
+    unsigned int *update;
+    size_t mask = ctrl->buf_size - 1;
     vchan_buf_t *b = get_vchan_ctrl_databuf(ctrl, cmd);
     if (b == NULL) {
         return -1;
@@ -161,7 +237,7 @@ int libvchan_readwrite(libvchan_t *ctrl, void *data, size_t size, int cmd, int s
         How data is stored in a given vchan buffer
 
         Position of data in buffer is given by
-            (either b->write_pos or b->read_pos) % VCHAN_BUF_SIZE
+            (either b->write_pos or b->read_pos) & (ring size - 1)
             read_pos is incremented by x when x bytes are read from the buffer
             write_pos is incremented by x when x bytes are read from the buffer
 
@@ -177,12 +253,8 @@ int libvchan_readwrite(libvchan_t *ctrl, void *data, size_t size, int cmd, int s
 
     size_t data_sz = size;
     while (data_sz > 0) {
-        size_t call_size = MIN(data_sz, VCHAN_BUF_SIZE);
-        size_t ssize = get_actionsize(cmd, call_size, b);
-        while (ssize == 0) {
-            ctrl->con->wait();
-            ssize = get_actionsize(cmd, call_size, b);
-        }
+        size_t call_size = MIN(data_sz, ctrl->buf_size);
+        size_t ssize = wait_actionsize(ctrl, cmd, call_size, b);
 
         call_size = ssize;
 
@@ -192,11 +264,11 @@ int libvchan_readwrite(libvchan_t *ctrl, void *data, size_t size, int cmd, int s
                 This is achieved by doing two copies, one to buffer end
                 And one at start of buffer for remaining data
         */
-        off_t start = (*update % VCHAN_BUF_SIZE);
+        off_t start = (*update & mask);
         off_t remain = 0;
 
-        if (start + call_size > VCHAN_BUF_SIZE) {
-            remain = (start + call_size) - VCHAN_BUF_SIZE;
+        if (start + call_size > ctrl->buf_size) {
+            remain = (start + call_size) - ctrl->buf_size;
             call_size -= remain;
         }
 
@@ -217,32 +289,98 @@ int libvchan_readwrite(libvchan_t *ctrl, void *data, size_t size, int cmd, int s
             memcpy(data, ((void *) dbuf) + start, call_size);
             memcpy(data + call_size, dbuf, remain);
         }
-        __sync_synchronize();
 
         /*
             Update either the read byte counter or the written byte counter
                 With how much was written or read
         */
-        *update += (call_size + remain);
+        advance_pos(update, call_size + remain);
         /*
             If stream, we have written as much data as we can in one pass.
                 Otherwise, continue to write data and block block if the buffer is full
         */
         if (stream) {
-            ctrl->con->alert();
+            notify_peer(ctrl, cmd, b);
             return (call_size + remain);
         } else {
             data_sz -= (call_size + remain);
         }
 
         data = data + (call_size + remain);
-        ctrl->con->alert();
+        notify_peer(ctrl, cmd, b);
     }
 
     return size;
 }
 
 
+/*
+    Find the contiguous region of the vchan buffer available for a read/write action
+*/
+static int vchan_buf_acquire(libvchan_t *ctrl, int cmd, void **data, size_t *size)
+{
+    vchan_buf_t *b = get_vchan_ctrl_databuf(ctrl, cmd);
+    if (b == NULL) {
+        return -1;
+    }
+
+    size_t ssize = wait_actionsize(ctrl, cmd, ctrl->buf_size, b);
+
+    unsigned int pos = (cmd == VCHAN_SEND) ? b->write_pos : b->read_pos;
+    off_t start = (pos & (ctrl->buf_size - 1));
+    /*
+        The region stops at the end of the buffer, the rest of the
+            space or data wrapping around is acquired next time
+    */
+    *size = MIN(ssize, ctrl->buf_size - start);
+    *data = &b->sync_data[start];
+    return 0;
+}
+
+/*
+    Hand back a region acquired with vchan_buf_acquire
+*/
+static int vchan_buf_commit(libvchan_t *ctrl, int cmd, size_t size)
+{
+    vchan_buf_t *b = get_vchan_ctrl_databuf(ctrl, cmd);
+    if (b == NULL) {
+        return -1;
+    }
+
+    /* More than is available can't have been acquired */
+    if (get_actionsize(ctrl, cmd, size, b) < size) {
+        return -1;
+    }
+
+    if (cmd == VCHAN_SEND) {
+        advance_pos(&b->write_pos, size);
+    } else {
+        advance_pos(&b->read_pos, size);
+    }
+    notify_peer(ctrl, cmd, b);
+    return 0;
+}
+
+int libvchan_write_acquire(libvchan_t *ctrl, void **data, size_t *size)
+{
+    return vchan_buf_acquire(ctrl, VCHAN_SEND, data, size);
+}
+
+int libvchan_write_commit(libvchan_t *ctrl, size_t size)
+{
+    return vchan_buf_commit(ctrl, VCHAN_SEND, size);
+}
+
+int libvchan_read_acquire(libvchan_t *ctrl, const void **data, size_t *size)
+{
+    return vchan_buf_acquire(ctrl, VCHAN_RECV, (void **)data, size);
+}
+
+int libvchan_read_release(libvchan_t *ctrl, size_t size)
+{
+    return vchan_buf_commit(ctrl, VCHAN_RECV, size);
+}
+
 /*
     Wait for data to arrive to a component from a given vchan
 */
@@ -250,12 +388,7 @@ int libvchan_wait(libvchan_t *ctrl)
 {
     vchan_buf_t *b = get_vchan_ctrl_databuf(ctrl, VCHAN_RECV);
     assert(b != NULL);
-    size_t filled = abs(b->write_pos - b->read_pos);
-    while (filled == 0) {
-        ctrl->con->wait();
-        b = get_vchan_ctrl_databuf(ctrl, VCHAN_RECV);
-        filled = abs(b->write_pos - b->read_pos);
-    }
+    wait_actionsize(ctrl, VCHAN_RECV, 1, b);
 
     return 0;
 }
@@ -299,7 +432,7 @@ int libvchan_data_ready(libvchan_t *ctrl)
 {
     vchan_buf_t *b = get_vchan_ctrl_databuf(ctrl, VCHAN_RECV);
     assert(b != NULL);
-    size_t filled = abs(b->write_pos - b->read_pos);
+    size_t filled = get_filled(b);
 
     return filled;
 }
@@ -315,7 +448,127 @@ int libvchan_buffer_space(libvchan_t *ctrl)
 
     vchan_buf_t *b = get_vchan_ctrl_databuf(ctrl, VCHAN_SEND);
     assert(b != NULL);
-    size_t filled = abs(b->write_pos - b->read_pos);
+    size_t filled = get_filled(b);
+
+    return ctrl->buf_size - filled;
+}
+
+int libvchan_waitset_init(libvchan_waitset_t *ws, seL4_CPtr ntfn)
+{
+    if (ws == NULL) {
+        return -1;
+    }
+    memset(ws, 0, sizeof(*ws));
+    ws->ntfn = ntfn;
+    return 0;
+}
+
+int libvchan_waitset_add(libvchan_waitset_t *ws, libvchan_t *ctrl, seL4_Word badge, int events)
+{
+    if (ws == NULL || ctrl == NULL || badge == 0) {
+        return -1;
+    }
+    if (ws->num_ctrls == LIBVCHAN_WAITSET_MAX) {
+        ZF_LOGE("Failed to add vchan: Wait set full");
+        return -1;
+    }
+    int i = ws->num_ctrls++;
+    ws->ctrls[i] = ctrl;
+    ws->badges[i] = badge;
+    ws->events[i] = events;
+    return i;
+}
+
+static const int waitset_cmds[] = { VCHAN_SEND, VCHAN_RECV };
+
+/*
+    Whether a vchan of a wait set is ready
+        With advertise set, a component suppressing alerts advertises
+        it is waiting on each buffer that isn't ready, so that the peer
+        alerts it on updating the buffer
+*/
+static bool waitset_ready(libvchan_waitset_t *ws, int i, bool advertise)
+{
+    libvchan_t *ctrl = ws->ctrls[i];
+    bool suppress = ctrl->con->suppress_alerts;
+    bool ready = false;
+
+    if (libvchan_is_open(ctrl) != 1) {
+        return true;
+    }
+    for (int j = 0; j < ARRAY_SIZE(waitset_cmds); j++) {
+        int cmd = waitset_cmds[j];
+        if (!(ws->events[i] & (cmd == VCHAN_SEND ? LIBVCHAN_WAIT_WRITE : LIBVCHAN_WAIT_READ))) {
+            continue;
+        }
+        vchan_buf_t *b = get_vchan_ctrl_databuf(ctrl, cmd);
+        if (b == NULL) {
+            return true;
+        }
+        int *state = (cmd == VCHAN_SEND) ? &b->writer_state : &b->reader_state;
+        if (suppress && advertise) {
+            /* The state has to be visible before checking the buffer */
+            __atomic_store_n(state, VCHAN_PEER_WAITING, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        }
+        if (get_actionsize(ctrl, cmd, 1, b)) {
+            ready = true;
+        }
+    }
+    return ready;
+}
+
+static void waitset_running(libvchan_waitset_t *ws)
+{
+    for (int i = 0; i < ws->num_ctrls; i++) {
+        libvchan_t *ctrl = ws->ctrls[i];
+        if (!ctrl->con->suppress_alerts) {
+            continue;
+        }
+        for (int j = 0; j < ARRAY_SIZE(waitset_cmds); j++) {
+            int cmd = waitset_cmds[j];
+            vchan_buf_t *b = get_vchan_ctrl_databuf(ctrl, cmd);
+            if (b != NULL) {
+                __atomic_store_n((cmd == VCHAN_SEND) ? &b->writer_state : &b->reader_state, VCHAN_PEER_RUNNING,
+                                 __ATOMIC_RELAXED);
+            }
+        }
+    }
+}
 
-    return VCHAN_BUF_SIZE - filled;
+static int waitset_wait(libvchan_waitset_t *ws, uint64_t *ready, bool block)
+{
+    if (ws == NULL || ready == NULL) {
+        return -1;
+    }
+
+    /* Every vchan is checked first, then only those whose badge was signalled */
+    seL4_Word badge = ~(seL4_Word)0;
+    *ready = 0;
+    while (true) {
+        for (int i = 0; i < ws->num_ctrls; i++) {
+            if ((ws->badges[i] & badge) && waitset_ready(ws, i, block)) {
+                *ready |= 1ull << i;
+            }
+        }
+        if (*ready || !block) {
+            break;
+        }
+        seL4_Wait(ws->ntfn, &badge);
+    }
+
+    if (block) {
+        waitset_running(ws);
+    }
+    return 0;
+}
+
+int libvchan_waitset_wait(libvchan_waitset_t *ws, uint64_t *ready)
+{
+    return waitset_wait(ws, ready, true);
+}
+
+int libvchan_waitset_poll(libvchan_waitset_t *ws, uint64_t *ready)
+{
+    return waitset_wait(ws, ready, false);
 }
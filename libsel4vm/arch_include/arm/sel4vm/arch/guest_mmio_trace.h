@@ -0,0 +1,92 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+/***
+ * @module guest_mmio_trace.h
+ * The guest MMIO trace interface records the emulated memory accesses of a running VM and replays them through the
+ * VM's memory fault handlers, measuring the cost of emulating each access without a guest. Replaying a trace drives
+ * the real device callbacks with faults that are not backed by a faulting vcpu, so it modifies the state of the
+ * emulated devices exactly as the recorded accesses did. Tracing is only available if libsel4vm is built with
+ * CONFIG_LIB_SEL4VM_MMIO_TRACE. Latencies are measured in ticks of the virtual counter.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sel4vm/guest_vm.h>
+
+/***
+ * @struct vm_mmio_trace_record
+ * A recorded emulated memory access
+ * @param {uint64_t} addr           Guest physical address of the access
+ * @param {uint64_t} value          Value written, or the value returned to the guest for reads
+ * @param {uint16_t} vcpu_id        Id of the vcpu performing the access
+ * @param {uint8_t} width           Width of the access in bytes
+ * @param {uint8_t} write           1 if the access is a write, 0 if it is a read
+ * @param {uint32_t} reserved       Reserved, set to 0
+ */
+typedef struct vm_mmio_trace_record {
+    uint64_t addr;
+    uint64_t value;
+    uint16_t vcpu_id;
+    uint8_t width;
+    uint8_t write;
+    uint32_t reserved;
+} vm_mmio_trace_record_t;
+
+/***
+ * @struct vm_mmio_replay_stats
+ * Cost of replaying the accesses to an emulated memory reservation
+ * @param {uint64_t} addr           Base address of the reservation, or the page of the accesses outside of any reservation
+ * @param {uint64_t} count          Number of accesses replayed
+ * @param {uint64_t} total_ticks    Sum of the handling latencies of the accesses
+ * @param {uint64_t} max_ticks      Largest handling latency of an access
+ * @param {uint64_t} ns_per_op      Average handling latency of an access in nanoseconds
+ */
+typedef struct vm_mmio_replay_stats {
+    uint64_t addr;
+    uint64_t count;
+    uint64_t total_ticks;
+    uint64_t max_ticks;
+    uint64_t ns_per_op;
+} vm_mmio_replay_stats_t;
+
+/***
+ * @function vm_mmio_trace_start(vm, records, num_records)
+ * Start recording the emulated memory accesses of a VM. Recording stops once the buffer is full
+ * @param {vm_t *} vm                           A handle to the VM
+ * @param {vm_mmio_trace_record_t *} records    Buffer to record accesses into, must remain valid until recording is stopped
+ * @param {size_t} num_records                  Number of records the buffer can hold
+ * @return                                      -1 on failure (i.e. tracing not enabled), otherwise 0 for success
+ */
+int vm_mmio_trace_start(vm_t *vm, vm_mmio_trace_record_t *records, size_t num_records);
+
+/***
+ * @function vm_mmio_trace_stop(vm, num_recorded)
+ * Stop recording the emulated memory accesses of a VM
+ * @param {vm_t *} vm                           A handle to the VM
+ * @param {size_t *} num_recorded               Pointer set with the number of records written to the buffer
+ * @return                                      -1 on failure (i.e. not recording), otherwise 0 for success
+ */
+int vm_mmio_trace_stop(vm_t *vm, size_t *num_recorded);
+
+/***
+ * @function vm_mmio_trace_replay(vm, records, num_records, stats, max_stats, num_stats)
+ * Replay recorded accesses through the memory fault handlers of a VM, accounting the cost of each access against the
+ * reservation it falls in. The vcpus of the recorded accesses must not have a pending fault, so the VM should not be
+ * running. Recording must not be active
+ * @param {vm_t *} vm                           A handle to the VM
+ * @param {const vm_mmio_trace_record_t *} records  Accesses to replay
+ * @param {size_t} num_records                  Number of accesses to replay
+ * @param {vm_mmio_replay_stats_t *} stats      Buffer populated with the cost of the accesses to each reservation
+ * @param {size_t} max_stats                    Number of entries 'stats' can hold
+ * @param {size_t *} num_stats                  Pointer set with the number of entries written to 'stats'
+ * @return                                      -1 on failure (i.e. an access failed to be handled or 'stats' is too small), otherwise 0 for success
+ */
+int vm_mmio_trace_replay(vm_t *vm, const vm_mmio_trace_record_t *records, size_t num_records,
+                         vm_mmio_replay_stats_t *stats, size_t max_stats, size_t *num_stats);
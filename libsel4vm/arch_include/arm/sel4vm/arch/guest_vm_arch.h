@@ -16,6 +16,11 @@
 
 typedef struct fault fault_t;
 typedef struct vm_vcpu vm_vcpu_t;
+typedef struct vm_vmm_lock vm_vmm_lock_t;
+typedef struct vm_vcpu_thread vm_vcpu_thread_t;
+typedef struct vm_wfx vm_wfx_t;
+typedef struct vm_mmio_trace vm_mmio_trace_t;
+struct vgic_dist_device;
 
 typedef int (*unhandled_vcpu_fault_callback_fn)(vm_vcpu_t *vcpu, uint32_t hsr, void *cookie);
 
@@ -23,7 +28,27 @@ typedef int (*unhandled_vcpu_fault_callback_fn)(vm_vcpu_t *vcpu, uint32_t hsr, v
 #define VM_FAULT_EP_SLOT       1
 #define VM_CSPACE_SLOT         VM_FAULT_EP_SLOT + CONFIG_MAX_NUM_NODES
 
-struct vm_arch {};
+/**
+ * Enumeration of the policies a vcpu can wait with when the guest executes WFI or WFE
+ */
+typedef enum vm_wfx_policy {
+    VM_WFX_TRAP_BLOCK = 0, /** Trap WFx and block the vcpu until an interrupt is injected into it (default) */
+    VM_WFX_TRAP_POLL, /** Trap WFx and poll for an interrupt to be injected for an adaptive window before blocking */
+    VM_WFX_PASSTHROUGH /** Don't trap WFx, the guest idles the core itself. Requires a kernel with WFI/WFE traps disabled */
+} vm_wfx_policy_t;
+
+/***
+ * @struct vm_arch
+ * Structure representing ARM specific vm properties
+ * @param {vm_vmm_lock_t *} vmm_lock            Lock serialising exit handling of vcpu threads
+ * @param {vm_mmio_trace_t *} mmio_trace        Recording state of the VM's MMIO trace, NULL if not recording
+ * @param {struct vgic_dist_device *} vgic_dist Virtual GIC distributor of the VM, NULL until it is installed
+ */
+struct vm_arch {
+    vm_vmm_lock_t *vmm_lock;
+    vm_mmio_trace_t *mmio_trace;
+    struct vgic_dist_device *vgic_dist;
+};
 
 /***
  * @struct vm_vcpu_arch
@@ -31,11 +56,15 @@ struct vm_arch {};
  * @param {fault_t *} fault                                             Current VCPU fault
  * @param {unhandled_vcpu_fault_callback_fn} unhandled_vcpu_callback    A callback for processing unhandled vcpu faults
  * @param {void *} unhandled_vcpu_callback_cookie                       A cookie to supply to the vcpu fault handler
+ * @param {vm_vcpu_thread_t *} vcpu_thread                              VMM thread handling the vcpu's faults, NULL for the boot vcpu
+ * @param {vm_wfx_t *} wfx                                              WFx policy and polling state, NULL for the default trap-and-block policy
  */
 struct vm_vcpu_arch {
     fault_t *fault;
     unhandled_vcpu_fault_callback_fn unhandled_vcpu_callback;
     void *unhandled_vcpu_callback_cookie;
+    vm_vcpu_thread_t *vcpu_thread;
+    vm_wfx_t *wfx;
 };
 
 /***
@@ -48,3 +77,17 @@ struct vm_vcpu_arch {
  */
 int vm_register_unhandled_vcpu_fault_callback(vm_vcpu_t *vcpu, unhandled_vcpu_fault_callback_fn vcpu_fault_callback,
                                               void *cookie);
+
+/***
+ * @function vm_vcpu_set_wfx_policy(vcpu, policy, poll_max_ticks)
+ * Set how a vcpu waits when the guest executes WFI or WFE. With VM_WFX_TRAP_POLL the thread handling the vcpu's faults
+ * keeps its core busy polling for the interrupt that ends the wait, avoiding the latency of blocking the core and
+ * being woken. The poll window adapts to the length of the vcpu's recent waits, up to 'poll_max_ticks'. Polling
+ * trades the core's idle time for wakeup latency, so is intended for vcpus with a core of their own. This should be
+ * called before the vcpu is started
+ * @param {vm_vcpu_t *} vcpu                    A handle to the VCPU
+ * @param {vm_wfx_policy_t} policy              WFx policy of the vcpu
+ * @param {uint64_t} poll_max_ticks             Maximum poll window in ticks of the virtual counter, only used by VM_WFX_TRAP_POLL
+ * @return                                      0 on success, -1 on error
+ */
+int vm_vcpu_set_wfx_policy(vm_vcpu_t *vcpu, vm_wfx_policy_t policy, uint64_t poll_max_ticks);
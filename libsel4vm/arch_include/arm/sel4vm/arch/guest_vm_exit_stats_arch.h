@@ -0,0 +1,48 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+/***
+ * @module guest_vm_exit_stats_arch.h
+ * The arm guest vm exit statistics, accumulated by the vm run loop. Each vcpu exit is accounted against its exit class
+ * (the fault type delivered by seL4) and vcpu faults are further accounted against their HSR exception class.
+ * Latencies are measured in ticks of the virtual counter.
+ */
+
+#include <stdint.h>
+
+#include <sel4vm/arch/processor.h>
+
+/* Number of exit classes the vm run loop dispatches on */
+#define VM_EXIT_STATS_NUM_EXITS 7
+/* Number of HSR exception classes */
+#define VM_EXIT_STATS_NUM_HSR_CLASSES (HSR_MAX_EXCEPTION + 1)
+
+/***
+ * @struct vm_exit_stats
+ * Structure representing the exit statistics of an arm vcpu
+ * @param {vm_exit_latency_t} exits[VM_EXIT_STATS_NUM_EXITS]                Handling latency of each exit class
+ * @param {vm_exit_latency_t} hsr_classes[VM_EXIT_STATS_NUM_HSR_CLASSES]    Handling latency of vcpu faults by HSR exception class
+ * @param {vm_exit_latency_t} notifications                                 Latency of the notification callback (boot vcpu only)
+ * @param {uint64_t} wfx_blocks                                             Number of trapped WFx that blocked the vcpu without polling
+ * @param {uint64_t} wfx_polls_successful                                   Number of trapped WFx ended by an interrupt whilst polling
+ * @param {uint64_t} wfx_polls_failed                                       Number of trapped WFx that blocked after polling for the full window
+ * @param {uint64_t} wfx_poll_ticks                                         Ticks spent polling for interrupts on trapped WFx
+ * @param {uint64_t} vtimer_fast_injections                                 Number of virtual timer PPIs injected into the reserved list register
+ * @param {uint64_t} vtimer_slow_injections                                 Number of virtual timer PPIs injected through the generic path
+ */
+struct vm_exit_stats {
+    vm_exit_latency_t exits[VM_EXIT_STATS_NUM_EXITS];
+    vm_exit_latency_t hsr_classes[VM_EXIT_STATS_NUM_HSR_CLASSES];
+    vm_exit_latency_t notifications;
+    uint64_t wfx_blocks;
+    uint64_t wfx_polls_successful;
+    uint64_t wfx_polls_failed;
+    uint64_t wfx_poll_ticks;
+    uint64_t vtimer_fast_injections;
+    uint64_t vtimer_slow_injections;
+};
@@ -0,0 +1,49 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+/***
+ * @module cpuid.h
+ * The x86 cpuid interface configures the values a VM reads through the CPUID instruction. The leaves supported by
+ * the host are read and virtualised once, when the first vcpu of the VM is created, such that guest CPUID exits are
+ * answered from a table. Entries of the table can be replaced to present the same CPU model on different hosts.
+ */
+
+#include <stdint.h>
+
+#include <sel4vm/guest_vm.h>
+
+/***
+ * @struct vm_cpuid_entry
+ * Values returned by the CPUID instruction for a leaf and subleaf
+ * @param {uint32_t} function       Leaf, the value of eax given to CPUID
+ * @param {uint32_t} index          Subleaf, the value of ecx given to CPUID. Ignored for leaves without subleaves
+ * @param {uint32_t} eax            Value returned in eax
+ * @param {uint32_t} ebx            Value returned in ebx
+ * @param {uint32_t} ecx            Value returned in ecx
+ * @param {uint32_t} edx            Value returned in edx
+ */
+typedef struct vm_cpuid_entry {
+    uint32_t function;
+    uint32_t index;
+    uint32_t eax;
+    uint32_t ebx;
+    uint32_t ecx;
+    uint32_t edx;
+} vm_cpuid_entry_t;
+
+/***
+ * @function vm_cpuid_set_entries(vm, entries, num_entries)
+ * Replace or add entries of the CPUID table of a VM. Feature bits the VMM doesn't support are still masked from the
+ * given values, and the initial APIC id of leaf 1 is still set per vcpu. This must be called after the first vcpu
+ * is created and before the VM is run
+ * @param {vm_t *} vm                           A handle to the VM
+ * @param {const vm_cpuid_entry_t *} entries    Array of entries
+ * @param {int} num_entries                     Number of entries
+ * @return                                      0 on success, -1 on error
+ */
+int vm_cpuid_set_entries(vm_t *vm, const vm_cpuid_entry_t *entries, int num_entries);
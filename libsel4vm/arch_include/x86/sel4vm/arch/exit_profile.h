@@ -0,0 +1,28 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+/***
+ * @module exit_profile.h
+ * The x86 exit profile interface selects the set of VM execution controls the vcpus of a VM are created with, trading
+ * the events the VMM can observe and emulate for fewer guest exits. The effect of a profile can be measured with the
+ * per exit reason counts of the exit statistics.
+ */
+
+#include <sel4vm/guest_vm.h>
+
+/***
+ * @function vm_set_exit_profile(vm, profile)
+ * Set the exit profile of a VM, which must be done before any of its vcpus are created. VMs default to
+ * VM_EXIT_PROFILE_COMPATIBLE. With VM_EXIT_PROFILE_PERFORMANCE a halting vcpu stays in the guest, waiting in hardware
+ * until a host interrupt or notification causes an exit, so halt polling and the VMM's halt handling are bypassed
+ * and the vcpu's physical core is not released to other threads
+ * @param {vm_t *} vm                   A handle to the VM
+ * @param {vm_exit_profile_t} profile   Exit profile to create the vcpus with
+ * @return                              0 on success, -1 on error
+ */
+int vm_set_exit_profile(vm_t *vm, vm_exit_profile_t profile);
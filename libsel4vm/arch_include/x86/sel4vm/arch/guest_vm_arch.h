@@ -23,6 +23,20 @@
 typedef struct vm_lapic vm_lapic_t;
 typedef struct i8259 i8259_t;
 typedef struct guest_state guest_state_t;
+typedef struct vm_vmm_lock vm_vmm_lock_t;
+typedef struct vm_vcpu_thread vm_vcpu_thread_t;
+typedef struct vm_pvclock vm_pvclock_t;
+typedef struct vm_ioapic vm_ioapic_t;
+typedef struct vm_cpuid_table vm_cpuid_table_t;
+typedef struct vm_doorbell_table vm_doorbell_table_t;
+
+/* Set of VM execution controls selecting which guest events cause exits */
+typedef enum vm_exit_profile {
+    /* Exit on every event the VMM emulates, including hlt */
+    VM_EXIT_PROFILE_COMPATIBLE,
+    /* Leave hlt to the hardware, for vcpus whose physical cores are dedicated to them */
+    VM_EXIT_PROFILE_PERFORMANCE
+} vm_exit_profile_t;
 
 /* Function prototype for vm exit handlers */
 typedef int(*vmexit_handler_ptr)(vm_vcpu_t *vcpu);
@@ -35,27 +49,74 @@ typedef struct vmcall_handler {
     vmcall_handler func;
 } vmcall_handler_t;
 
+/* Policy applied to guest accesses of a model specific register */
+typedef enum vm_msr_policy {
+    /* Accesses are emulated by the read and write handlers */
+    VM_MSR_EMULATE,
+    /* Reads return zero and writes are ignored */
+    VM_MSR_READ_AS_ZERO,
+    /* Accesses go to the register as held in the guest state of the VMCS */
+    VM_MSR_PASSTHROUGH
+} vm_msr_policy_t;
+
+/* Handlers emulating accesses of a model specific register. A non-zero return injects a general protection
+ * fault into the guest */
+typedef int (*vm_msr_read_fn)(vm_vcpu_t *vcpu, unsigned int msr, uint64_t *value, void *cookie);
+typedef int (*vm_msr_write_fn)(vm_vcpu_t *vcpu, unsigned int msr, uint64_t value, void *cookie);
+
+/* Handler of an inclusive range of model specific registers */
+typedef struct vm_msr_handler {
+    unsigned int start;
+    unsigned int end;
+    vm_msr_policy_t policy;
+    vm_msr_read_fn read;
+    vm_msr_write_fn write;
+    void *cookie;
+} vm_msr_handler_t;
+
 /***
  * @struct vm_vcpu
  * Structure representing x86 specific vm properties
  * @param {vmexit_handler_ptr} vmexit_handler                           Set of exit handler hooks
- * @param {vmcall_handler_t *} vmcall_handlers                          Set of registered vmcall handlers
+ * @param {vmcall_handler_t *} vmcall_handlers                          Hash table of registered vmcall handlers, indexed by token
  * @param {unsigned int} vmcall_num_handler                             Total number of registered vmcall handlers
+ * @param {unsigned int} vmcall_table_size                              Number of slots in the vmcall handler table
  * @param {uintptr_t} guest_pd                                          Guest physical address of where we built the vm's page directory
  * @param {unhandled_ioport_callback_fn} unhandled_ioport_callback      A callback for processing unhandled ioport faults
  * @param {void *} unhandled_ioport_callback_cookie                     A cookie to supply to the ioport callback
  * @param {vm_io_port_list_t} ioport_list                               List of registered ioport handlers
+ * @param {vm_doorbell_table_t *} ioport_doorbells                      Ioports whose writes signal notifications
  * @param {i8259_t *} i8259_gs                                          PIC machine state
+ * @param {vm_vmm_lock_t *} vmm_lock                                    Lock serialising exit handling of vcpu threads
+ * @param {vm_pvclock_t *} pvclock                                      Paravirtual clock state, NULL if not enabled
+ * @param {vm_ioapic_t *} ioapic                                        IOAPIC machine state, NULL if not enabled
+ * @param {vm_cpuid_table_t *} cpuid                                    CPUID values of the VM, NULL until the first vcpu is created
+ * @param {vm_msr_handler_t *} msr_handlers                             Registered MSR handlers, sorted by MSR range
+ * @param {unsigned int} msr_num_handlers                               Total number of registered MSR handlers
+ * @param {unsigned int} msr_table_size                                 Number of slots in the MSR handler table
+ * @param {vm_exit_profile_t} exit_profile                              Execution controls vcpus are created with
+ * @param {unsigned int} pause_last_boosted                             Id of the vcpu a spinning vcpu last yielded to
  */
 struct vm_arch {
     vmexit_handler_ptr vmexit_handlers[VM_EXIT_REASON_NUM];
     vmcall_handler_t *vmcall_handlers;
     unsigned int vmcall_num_handlers;
+    unsigned int vmcall_table_size;
     uintptr_t guest_pd;
     unhandled_ioport_callback_fn unhandled_ioport_callback;
     void *unhandled_ioport_callback_cookie;
     vm_io_port_list_t ioport_list;
+    vm_doorbell_table_t *ioport_doorbells;
     i8259_t *i8259_gs;
+    vm_vmm_lock_t *vmm_lock;
+    vm_pvclock_t *pvclock;
+    vm_ioapic_t *ioapic;
+    vm_cpuid_table_t *cpuid;
+    vm_msr_handler_t *msr_handlers;
+    unsigned int msr_num_handlers;
+    unsigned int msr_table_size;
+    vm_exit_profile_t exit_profile;
+    unsigned int pause_last_boosted;
 };
 
 /***
@@ -63,8 +124,10 @@ struct vm_arch {
  * Structure representing x86 specific vcpu properties
  * @param {guest_state_t *} guest_state         Current VCPU State
  * @param {vm_lapic_t *} lapic                  VM local apic
+ * @param {vm_vcpu_thread_t *} vcpu_thread      VMM thread running the vcpu, NULL for the boot vcpu
  */
 struct vm_vcpu_arch {
     guest_state_t *guest_state;
     vm_lapic_t *lapic;
+    vm_vcpu_thread_t *vcpu_thread;
 };
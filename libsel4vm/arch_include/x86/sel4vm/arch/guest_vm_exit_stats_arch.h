@@ -0,0 +1,40 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+/***
+ * @module guest_vm_exit_stats_arch.h
+ * The x86 guest vm exit statistics, accumulated by the vcpu run loop. Each vm exit is accounted against its VMX exit
+ * reason, with the time spent in the VMM split from the time spent in the guest.
+ */
+
+#include <stdint.h>
+
+#include <sel4vm/arch/vmexit_reasons.h>
+
+/***
+ * @struct vm_exit_stats
+ * Structure representing the exit statistics of an x86 vcpu
+ * @param {vm_exit_latency_t} exits[VM_EXIT_REASON_NUM]     Handling latency of each VMX exit reason
+ * @param {vm_exit_latency_t} notifications                 Latency of the notification callback
+ * @param {uint64_t} guest_cycles                           Cycles spent in seL4_VMEnter, running the guest
+ * @param {uint64_t} idle_cycles                            Cycles spent waiting for events while the vcpu is halted
+ * @param {uint64_t} halt_poll_cycles                       Cycles of 'idle_cycles' spent polling for events before blocking
+ * @param {uint64_t} halt_polls_successful                  Number of halts ended by an event whilst polling
+ * @param {uint64_t} halt_polls_failed                      Number of halts that blocked after polling for the full window
+ * @param {uint64_t} vmm_cycles                             Cycles spent in the VMM handling exits and events
+ */
+struct vm_exit_stats {
+    vm_exit_latency_t exits[VM_EXIT_REASON_NUM];
+    vm_exit_latency_t notifications;
+    uint64_t guest_cycles;
+    uint64_t idle_cycles;
+    uint64_t halt_poll_cycles;
+    uint64_t halt_polls_successful;
+    uint64_t halt_polls_failed;
+    uint64_t vmm_cycles;
+};
@@ -12,6 +12,7 @@
  * for a guest VM instance. IOPort faults are directed through this interface.
  */
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #include <sel4/sel4.h>
@@ -87,10 +88,22 @@ typedef struct vm_ioport_entry {
     vm_ioport_interface_t interface;
 } vm_ioport_entry_t;
 
+/* An ioport range passed through to every vcpu of a VM, see vm_passthrough_ioport */
+typedef struct vm_passthrough_ioport {
+    vm_ioport_range_t range;
+    /* capability to the range, of which each vcpu is given a copy */
+    seL4_CPtr cap;
+} vm_passthrough_ioport_t;
+
 typedef struct vm_io_list {
     int num_ioports;
-    /* Sorted list of ioport functions */
+    /* List of ioport functions, in registration order */
     vm_ioport_entry_t *ioports;
+    /* Direct map of every ioport address to (index + 1) of its entry in 'ioports', 0 if unhandled.
+     * Allocated on the first handler registration */
+    uint16_t *port_map;
+    int num_passthrough;
+    vm_passthrough_ioport_t *passthrough;
 } vm_io_port_list_t;
 
 /***
@@ -115,6 +128,24 @@ int vm_io_port_add_handler(vm_t *vm, vm_ioport_range_t ioport_range,
 int vm_register_unhandled_ioport_callback(vm_t *vm, unhandled_ioport_callback_fn ioport_callback,
                                           void *cookie);
 
+/***
+ * @function vm_register_ioport_doorbell(vm, port_start, port_end, match_value, value, notification)
+ * Register a doorbell on an ioport range. A guest out instruction within the range signals the given notification
+ * and resumes the vcpu at the next instruction, without invoking the handler registered on the range. Guest in
+ * instructions are emulated as usual
+ * @param {vm_t *} vm                   A handle to the VM
+ * @param {uint16_t} port_start         Base address of ioport
+ * @param {uint16_t} port_end           End address of ioport
+ * @param {bool} match_value            If true, only writes of 'value' ring the doorbell. Other writes are passed onto
+ *                                      the handler registered on the range
+ * @param {seL4_Word} value             Value to match writes against if 'match_value' is set
+ * @param {seL4_CPtr} notification      Notification to signal. The capability should be badged for the backend to
+ *                                      identify the doorbell
+ * @return                              0 for success, -1 for error
+ */
+int vm_register_ioport_doorbell(vm_t *vm, uint16_t port_start, uint16_t port_end, bool match_value,
+                                seL4_Word value, seL4_CPtr notification);
+
 /***
  * @function vm_enable_passthrough_ioport(vcpu, port_start, port_end)
  * Enable the passing-through of specific ioport ranges to the VM
@@ -124,3 +155,15 @@ int vm_register_unhandled_ioport_callback(vm_t *vm, unhandled_ioport_callback_fn
  * @return                              0 for success, -1 for error
  */
 int vm_enable_passthrough_ioport(vm_vcpu_t *vcpu, uint16_t port_start, uint16_t port_end);
+
+/***
+ * @function vm_passthrough_ioport(vm, port_start, port_end)
+ * Pass an ioport range through to every vcpu of the VM, including vcpus created later, such that guest accesses to it
+ * are executed natively rather than exiting to the VMM. Unlike `vm_enable_passthrough_ioport`, which enables a range
+ * on a single vcpu, each vcpu is given its own copy of the capability to the range
+ * @param {vm_t *} vm                   A handle to the VM
+ * @param {uint16_t} port_start         Base address of ioport
+ * @param {uint16_t} port_end           End address of ioport
+ * @return                              0 for success, -1 for error
+ */
+int vm_passthrough_ioport(vm_t *vm, uint16_t port_start, uint16_t port_end);
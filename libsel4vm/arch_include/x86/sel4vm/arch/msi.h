@@ -0,0 +1,29 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+/***
+ * @module msi.h
+ * The x86 msi interface delivers message signalled interrupts to the local apics of a VM. A message is the address
+ * and data pair an emulated device writes when signalling an MSI or MSI-X vector, as programmed by the guest.
+ * The message selects its destination apics itself, so each message can target a different vcpu.
+ */
+
+#include <stdint.h>
+
+#include <sel4vm/guest_vm.h>
+
+/***
+ * @function vm_inject_msi(vm, address, data)
+ * Deliver an MSI to the local apics of a VM. This must be called whilst holding the VMM lock of a vcpu,
+ * i.e. from an exit or notification handler
+ * @param {vm_t *} vm               A handle to the VM
+ * @param {uint64_t} address        Message address, within the 0xfee00000 interrupt address range
+ * @param {uint32_t} data           Message data
+ * @return                          0 on success, -1 if the message is invalid or no local apic accepted it
+ */
+int vm_inject_msi(vm_t *vm, uint64_t address, uint32_t data);
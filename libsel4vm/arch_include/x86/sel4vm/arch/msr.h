@@ -0,0 +1,34 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+/***
+ * @module msr.h
+ * The x86 msr interface provides methods for registering handlers of guest accesses to model specific registers
+ * (MSRs). Handlers are kept in a table sorted by MSR, looked up on each rdmsr and wrmsr exit. libsel4vm registers
+ * handlers of the MSRs it emulates itself when the VM is initialised.
+ */
+
+#include <sel4vm/guest_vm.h>
+
+/***
+ * @function vm_register_msr_handler(vm, start, end, policy, read, write, cookie)
+ * Register a handler for an inclusive range of MSRs, which must not overlap the range of another handler. MSRs
+ * without a handler inject a general protection fault into the guest. VM_MSR_PASSTHROUGH is only supported for the
+ * MSRs held in the guest state of the VMCS: IA32_SYSENTER_CS/ESP/EIP, FS_BASE and GS_BASE. The MSR bitmaps are owned
+ * by the seL4 kernel, so these accesses still exit, but reach the guest's register without an emulation handler
+ * @param {vm_t *} vm                   A handle to the VM
+ * @param {unsigned int} start          First MSR of the range
+ * @param {unsigned int} end            Last MSR of the range
+ * @param {vm_msr_policy_t} policy      How guest accesses of the MSRs are handled
+ * @param {vm_msr_read_fn} read         Handler of reads for VM_MSR_EMULATE, NULL to fault reads
+ * @param {vm_msr_write_fn} write       Handler of writes for VM_MSR_EMULATE, NULL to fault writes
+ * @param {void *} cookie               Cookie to supply to the handlers
+ * @return                              0 on success, -1 on error
+ */
+int vm_register_msr_handler(vm_t *vm, unsigned int start, unsigned int end, vm_msr_policy_t policy,
+                            vm_msr_read_fn read, vm_msr_write_fn write, void *cookie);
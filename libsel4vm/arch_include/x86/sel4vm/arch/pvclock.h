@@ -0,0 +1,44 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+/***
+ * @module pvclock.h
+ * The x86 pvclock interface provides a KVM compatible paravirtual clock (kvmclock) to guests. Once initialised,
+ * the KVM clocksource features are advertised through cpuid and each vcpu can register a pvclock structure in
+ * guest memory through the kvmclock MSRs. The structure describes how to convert the TSC into the time since the
+ * VM was started, such that the guest can read time without exiting. The VMM only rewrites the structures when
+ * they are registered or the TSC parameters change. With CONFIG_LIB_SEL4VM_PV_STEAL_TIME, vcpus can also register a
+ * KVM steal time structure through its MSR, to which the VMM publishes how long the vcpu was kept from running.
+ */
+
+#include <stdint.h>
+
+#include <sel4vm/guest_vm.h>
+
+/***
+ * @function vm_pvclock_init(vm, tsc_frequency, wall_clock_sec, wall_clock_nsec)
+ * Enable the paravirtual clock of a VM. This must be called before the VM is run, such that the guest
+ * finds the clocksource on boot. Time 0 of the clock is the TSC value at the time of this call
+ * @param {vm_t *} vm                   A handle to the VM
+ * @param {uint64_t} tsc_frequency      Frequency of the TSC as seen by the guest, in Hz
+ * @param {uint32_t} wall_clock_sec     Wall clock time, in seconds since the epoch, reported to the guest for time 0
+ * @param {uint32_t} wall_clock_nsec    Nanoseconds part of the wall clock time reported for time 0
+ * @return                              0 on success, -1 on error
+ */
+int vm_pvclock_init(vm_t *vm, uint64_t tsc_frequency, uint32_t wall_clock_sec, uint32_t wall_clock_nsec);
+
+/***
+ * @function vm_pvclock_update(vm, tsc_frequency)
+ * Update the TSC frequency of the paravirtual clock, e.g. after a frequency change or after the VM was moved
+ * onto a different TSC. The clock continues from its current time and the pvclock structures of all vcpus are
+ * rewritten. This must be called whilst holding the VMM lock of a vcpu, i.e. from an exit or notification handler
+ * @param {vm_t *} vm                   A handle to the VM
+ * @param {uint64_t} tsc_frequency      New frequency of the TSC as seen by the guest, in Hz
+ * @return                              0 on success, -1 on error
+ */
+int vm_pvclock_update(vm_t *vm, uint64_t tsc_frequency);
@@ -14,6 +14,24 @@
 
 #include <sel4vm/guest_vm.h>
 
+/* Maximum number of entries run by a single multicall */
+#define VMCALL_MULTICALL_MAX_ENTRIES 32
+/* Number of argument registers (EBX, ECX, EDX, ESI, EDI) passed to each multicall entry */
+#define VMCALL_MULTICALL_NUM_ARGS 5
+
+/***
+ * @struct vmcall_multicall_entry
+ * Entry of the vector passed to a multicall by the guest
+ * @param {uint32_t} token      vmcall token of the handler to run
+ * @param {uint32_t} args       Values of EBX, ECX, EDX, ESI and EDI passed to the handler
+ * @param {uint32_t} result     Value of EAX after the handler ran, written back by the VMM
+ */
+typedef struct vmcall_multicall_entry {
+    uint32_t token;
+    uint32_t args[VMCALL_MULTICALL_NUM_ARGS];
+    uint32_t result;
+} vmcall_multicall_entry_t;
+
 /***
  * @function vm_reg_new_vmcall_handler(vm, func, token)
  * Register a new vmcall handler. The being hypercalls invoked by the
@@ -25,3 +43,16 @@
  * @return                          0 on success, -1 on error
  */
 int vm_reg_new_vmcall_handler(vm_t *vm, vmcall_handler func, int token);
+
+/***
+ * @function vm_reg_vmcall_multicall_handler(vm, token)
+ * Register a multicall handler, running a vector of vmcalls in a single exit. On the vmcall EBX holds the guest
+ * physical address of a vector of 'vmcall_multicall_entry_t' and ECX the number of entries, at most
+ * VMCALL_MULTICALL_MAX_ENTRIES of which are run in order. Each entry is run as if the guest had issued it, its
+ * result is written back to the vector and EAX returns the number of entries run, stopping at the first unknown
+ * token. All other registers are preserved
+ * @param {vm_t *} vm               A handle to the VM
+ * @param {int} token               Token the guest places in EAX to issue a multicall
+ * @return                          0 on success, -1 on error
+ */
+int vm_reg_vmcall_multicall_handler(vm_t *vm, int token);
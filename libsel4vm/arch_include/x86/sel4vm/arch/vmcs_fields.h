@@ -88,8 +88,10 @@
 #define VMX_CONTROL_PIN_EXECUTION_CONTROLS 0x00004000
 #define VMX_CONTROL_PRIMARY_PROCESSOR_CONTROLS 0x00004002
 #define VMX_CONTROL_PPC_HLT_EXITING BIT(7)
+#define VMX_CONTROL_PPC_INVLPG_EXITING BIT(9)
 #define VMX_CONTROL_PPC_CR3_LOAD_EXITING BIT(15)
 #define VMX_CONTROL_PPC_CR3_STORE_EXITING BIT(16)
+#define VMX_CONTROL_PPC_PAUSE_EXITING BIT(30)
 #define VMX_CONTROL_SECONDARY_PROCESSOR_CONTROLS 0x0000401E
 #define VMX_CONTROL_EXCEPTION_BITMAP 0x00004004
 #define VMX_CONTROL_EXIT_CONTROLS 0x0000400C
@@ -37,6 +37,17 @@
 int vm_init(vm_t *vm, vka_t *vka, simple_t *host_simple, vspace_t host_vspace,
             ps_io_ops_t *io_ops, seL4_CPtr host_endpoint, const char *name);
 
+/***
+ * @function vm_destroy(vm)
+ * Destroy a VM, freeing its vcpus, guest RAM, kernel objects and bookkeeping, after which the handle can be
+ * initialised again. The VM must not be running. Devices, notifications and ram pools installed by the VMM are not
+ * freed and must be torn down by the VMM beforehand. Pages of the VM shared with other VMs are detached, staying
+ * mapped into the other VMs
+ * @param {vm_t *} vm                   Handle to the VM being destroyed
+ * @return                              0 on success, otherwise -1 for error
+ */
+int vm_destroy(vm_t *vm);
+
 /***
  * @function vm_create_vcpu(vm, priority)
  * Create a VCPU for a given VM
@@ -54,3 +65,26 @@ vm_vcpu_t *vm_create_vcpu(vm_t *vm, int priority);
  * @return                      -1 for error, otherwise 0 for success
  */
 int vm_assign_vcpu_target(vm_vcpu_t *vcpu, int target_cpu);
+
+/***
+ * @function vm_vcpu_set_sched_budget(vcpu, budget_us, period_us, extra_refills)
+ * Guarantee a vcpu a share of its core by running it on a scheduling context of its own, with the given budget per
+ * period. The scheduling context is created and bound to the thread executing the vcpu on the first call and
+ * reconfigured on later calls. This is only supported on kernels configured with MCS (CONFIG_KERNEL_MCS), and
+ * for vcpus executing on a thread other than the VMM's, which must not already have a scheduling context bound
+ * @param {vm_vcpu_t *} vcpu                A handle to the VCPU
+ * @param {uint64_t} budget_us              Time the vcpu may run for each period, in microseconds
+ * @param {uint64_t} period_us              Period the budget is replenished at, in microseconds
+ * @param {unsigned int} extra_refills      Number of extra refills, allowing the budget to be split across the period
+ * @return                                  -1 for error, otherwise 0 for success
+ */
+int vm_vcpu_set_sched_budget(vm_vcpu_t *vcpu, uint64_t budget_us, uint64_t period_us, unsigned int extra_refills);
+
+/***
+ * @function vm_vcpu_get_sched_consumed(vcpu, consumed_us)
+ * Get the total time a vcpu has consumed from the scheduling context configured by 'vm_vcpu_set_sched_budget'
+ * @param {vm_vcpu_t *} vcpu                A handle to the VCPU
+ * @param {uint64_t *} consumed_us          Pointer that will be set with the consumed time, in microseconds
+ * @return                                  -1 for error (i.e. no budget configured), otherwise 0 for success
+ */
+int vm_vcpu_get_sched_consumed(vm_vcpu_t *vcpu, uint64_t *consumed_us);
@@ -0,0 +1,51 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+/***
+ * @module guest_doorbell.h
+ * The guest doorbell interface allows guest writes to an address to be forwarded straight onto a notification,
+ * without running any device emulation code. This suits queue notification registers (e.g. virtio queue kicks)
+ * whose only purpose is to wake a backend. Doorbells are matched before any other fault handling, so they can be
+ * placed within a region that is otherwise emulated by a reservation. Guest reads of a doorbell are left to the
+ * regular fault handling path.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sel4/sel4.h>
+
+typedef struct vm vm_t;
+
+/***
+ * @function vm_register_mmio_doorbell(vm, addr, size, match_value, value, notification)
+ * Register a doorbell on a range of guest physical addresses. A guest write that lies within the range signals the
+ * given notification and resumes the vcpu at the next instruction
+ * @param {vm_t *} vm                   A handle to the VM
+ * @param {uintptr_t} addr              Base guest physical address of the doorbell
+ * @param {size_t} size                 Size of the doorbell in bytes
+ * @param {bool} match_value            If true, only writes of 'value' ring the doorbell. Other writes are left to the
+ *                                      regular fault handling path
+ * @param {seL4_Word} value             Value to match writes against if 'match_value' is set
+ * @param {seL4_CPtr} notification      Notification to signal. The capability should be badged for the backend to
+ *                                      identify the doorbell
+ * @return                              0 for success, -1 for error
+ */
+int vm_register_mmio_doorbell(vm_t *vm, uintptr_t addr, size_t size, bool match_value, seL4_Word value,
+                              seL4_CPtr notification);
+
+/***
+ * @function vm_deregister_mmio_doorbell(vm, addr, size)
+ * Deregister the doorbells registered on a range of guest physical addresses
+ * @param {vm_t *} vm                   A handle to the VM
+ * @param {uintptr_t} addr              Base guest physical address of the doorbell
+ * @param {size_t} size                 Size of the doorbell in bytes
+ * @return                              0 for success, -1 if no doorbell was registered on the range
+ */
+int vm_deregister_mmio_doorbell(vm_t *vm, uintptr_t addr, size_t size);
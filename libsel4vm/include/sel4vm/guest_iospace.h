@@ -19,10 +19,22 @@
 
 /***
  * @function vm_guest_add_iospace(vm, loader, iospace)
- * Attach an additional IO space to the given VM
+ * Attach an additional IO space to the given VM, into which all guest mappings are mirrored. IO spaces are to be
+ * attached before any guest RAM is registered. IO spaces only map 4K frames, and faults of devices on them are not
+ * reported to the VMM, so the guest RAM of a VM with IO spaces is backed by 4K frames and mapped when registered, even
+ * with LIB_SEL4VM_LARGE_FRAMES and LIB_SEL4VM_LAZY_RAM enabled
  * @param {vm_t *} vm           A handle to the VM
  * @param {vspace_t *} loader   Host loader vspace to create a new iospace
  * @param {seL4_CPtr} iospace   Capability to iospace being added
  * @return                      0 on success, otherwise -1 for error
  */
 int vm_guest_add_iospace(vm_t *vm, vspace_t *loader, seL4_CPtr iospace);
+
+/***
+ * @function vm_guest_num_iospaces(vm)
+ * Get the number of IO spaces the guest RAM mappings of the given VM are mirrored into. Devices translated by these
+ * IO spaces can access guest RAM by its guest physical addresses
+ * @param {vm_t *} vm           A handle to the VM
+ * @return                      Number of IO spaces attached, 0 if none are or IOMMU/SMMU support is not enabled
+ */
+int vm_guest_num_iospaces(vm_t *vm);
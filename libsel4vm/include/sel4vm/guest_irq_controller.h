@@ -38,6 +38,56 @@ int vm_inject_irq(vm_vcpu_t *vcpu, int irq);
  */
 int vm_set_irq_level(vm_vcpu_t *vcpu, int irq, int irq_level);
 
+/***
+ * @function vm_irq_queue_init(vm, num_events, notification, badge)
+ * Initialise the irq queue of a VM, allowing threads other than the VMM thread to inject IRQs with 'vm_post_irq'
+ * and 'vm_post_irq_level'. Posted IRQs are delivered by 'vm_run' before it next enters the guest.
+ * @param {vm_t *} vm                   Handle to the VM
+ * @param {size_t} num_events           Number of events the queue can hold, a power of 2
+ * @param {seL4_CPtr} notification      Notification capability signalled by posting threads to wake the VMM thread
+ * @param {seL4_Word} badge             Non-zero badge bits the VMM thread receives when 'notification' is signalled
+ * @return                              0 on success, otherwise -1 for error
+ */
+int vm_irq_queue_init(vm_t *vm, size_t num_events, seL4_CPtr notification, seL4_Word badge);
+
+/***
+ * @function vm_post_irq(vcpu, irq)
+ * Queue an IRQ to be injected into a VM, as with 'vm_inject_irq'. This can be called from any thread
+ * @param {vm_vcpu_t *} vcpu    Handle to the VCPU
+ * @param {int} irq             IRQ number to inject
+ * @return                      0 on success, otherwise -1 if the queue is full or not initialised
+ */
+int vm_post_irq(vm_vcpu_t *vcpu, int irq);
+
+/***
+ * @function vm_post_irq_level(vcpu, irq, irq_level)
+ * Queue a change of IRQ level in a VM, as with 'vm_set_irq_level'. This can be called from any thread
+ * @param {vm_vcpu_t *} vcpu    Handle to the VCPU
+ * @param {int} irq             IRQ number to set level on
+ * @param {int} irq_level       Value of IRQ level
+ * @return                      0 on success, otherwise -1 if the queue is full or not initialised
+ */
+int vm_post_irq_level(vm_vcpu_t *vcpu, int irq, int irq_level);
+
+/***
+ * @function vm_bind_notification_irq(vcpu, badge, irq, level, resample)
+ * Bind a bit of the notification badges received by the VMM to an IRQ. When 'vm_run' receives a notification with
+ * the bit set, it delivers the IRQ itself rather than passing the bit onto the registered notification callback.
+ * The binding registers the IRQ's acknowledgement function, the IRQ must not also be registered with
+ * 'vm_register_irq'. The badge bit must not be used by the VMM for any other purpose, e.g. the irq queue
+ * @param {vm_vcpu_t *} vcpu            Handle to the VCPU the IRQ is delivered to
+ * @param {seL4_Word} badge             Badge bit to bind, a single bit
+ * @param {int} irq                     IRQ number to deliver
+ * @param {bool} level                  If true, the IRQ line is raised on a notification and lowered once the guest
+ *                                      acknowledges the IRQ, as with 'vm_set_irq_level'. Otherwise the IRQ is
+ *                                      injected, as with 'vm_inject_irq'
+ * @param {seL4_CPtr} resample          Notification signalled when the guest acknowledges the IRQ, allowing the
+ *                                      backend to raise it again if its device still needs servicing. seL4_CapNull
+ *                                      if not needed
+ * @return                              0 on success, otherwise -1 for error
+ */
+int vm_bind_notification_irq(vm_vcpu_t *vcpu, seL4_Word badge, int irq, bool level, seL4_CPtr resample);
+
 /***
  * @function vm_register_irq(vcpu, irq, ack_fn, cookie)
  * Register irq with an acknowledgment function
@@ -27,17 +27,21 @@ typedef struct vm_vcpu vm_vcpu_t;
 
 /***
  * @struct vm_frame_t
- * Structure representing a mappable memory frame
+ * Structure representing a mappable memory frame. Frames larger than a page must be mapped at an address aligned
+ * to their size and lie entirely within the reservation being mapped
  * @param {seL4_CPtr} cptr              Capability to frame
  * @param {seL4_CapRights_t} rights     Mapping rights of frame
  * @param {uintptr_t} vaddr             Virtual address of which to map the frame into
  * @param {size_t} size_bits            Size of frame in bits
+ * @param {uintptr_t} cookie            Allocator cookie of frame, with which the frame is returned to the vka when
+ *                                      unmapped. 0 if the frame is not owned by the vka
  */
 typedef struct vm_frame {
     seL4_CPtr cptr; /** Capability to frame */
     seL4_CapRights_t rights; /** Mapping rights of frame */
     uintptr_t vaddr; /** Virtual address of which to map the frame into */
     size_t size_bits; /** Size of frame in bits */
+    uintptr_t cookie; /** Allocator cookie of frame */
 } vm_frame_t;
 
 /**
@@ -48,7 +52,8 @@ typedef enum memory_fault_result {
     FAULT_UNHANDLED, /** The memory fault was left unhandled */
     FAULT_RESTART, /** The memory fault should be restarted, restart execution */
     FAULT_IGNORE, /** Ignore the memory fault, advance execution */
-    FAULT_ERROR /** Handling the memory fault resulted in an error */
+    FAULT_ERROR, /** Handling the memory fault resulted in an error */
+    FAULT_PENDING /** The memory fault is completed later through 'vm_complete_fault', the vcpu stays suspended */
 } memory_fault_result_t;
 
 /**
@@ -64,15 +69,40 @@ typedef memory_fault_result_t (*memory_fault_callback_fn)(vm_t *vm, vm_vcpu_t *v
                                                           size_t fault_length,
                                                           void *cookie);
 /**
- * Type signature of memory map iterator function, provided when mapping a memory reservation
+ * Type signature of memory map iterator function, provided when mapping a memory reservation. The iterator
+ * is invoked with the address following the last frame it returned, allowing it to return frames larger than a page
+ * (see 'vm_get_reservation_frame_size_bits')
  * @param {uintptr_t} addr      Address being mapped
  * @param {void *} cookie       User cookie to pass onto iterator
  * @return                      vm_frame_t describing the memory frame that corresponds with the given address
  */
 typedef vm_frame_t (*memory_map_iterator_fn)(uintptr_t addr, void *cookie);
 
+/***
+ * @struct vm_coalesced_write
+ * A guest write buffered by a reservation with coalesced mmio enabled
+ * @param {uintptr_t} addr          Guest physical address written
+ * @param {size_t} size             Size of the write in bytes
+ * @param {seL4_Word} value         Value written
+ */
+typedef struct vm_coalesced_write {
+    uintptr_t addr;
+    size_t size;
+    seL4_Word value;
+} vm_coalesced_write_t;
+
+/**
+ * Type signature of the function processing the writes buffered by a reservation with coalesced mmio enabled
+ * @param {vm_t *} vm                           A handle to the VM
+ * @param {vm_coalesced_write_t *} writes       Buffered writes, in the order the guest made them
+ * @param {size_t} num_writes                   Number of buffered writes
+ * @param {void *} cookie                       User cookie to pass onto callback
+ */
+typedef void (*coalesced_mmio_flush_fn)(vm_t *vm, vm_coalesced_write_t *writes, size_t num_writes, void *cookie);
+
 typedef struct vm_memory_reservation vm_memory_reservation_t;
 typedef struct vm_memory_reservation_cookie vm_memory_reservation_cookie_t;
+typedef struct vm_memory_fault_cache vm_memory_fault_cache_t;
 
 /***
  * @function vm_reserve_memory_at(vm, addr, size, fault_callback, cookie)
@@ -134,6 +164,54 @@ int vm_free_reserved_memory(vm_t *vm, vm_memory_reservation_t *reservation);
 int vm_map_reservation(vm_t *vm, vm_memory_reservation_t *reservation, memory_map_iterator_fn map_iterator,
                        void *cookie);
 
+/***
+ * @function vm_reservation_map_frame(vm, reservation, frame)
+ * Map a 4K frame into a reservation where no frame is mapped, for reservations whose backing changes at runtime,
+ * such as a window onto memory of another component. Guest accesses of the reservation's unmapped addresses keep
+ * faulting to its callback
+ * @param {vm_t *} vm                                   A handle to the VM
+ * @param {vm_memory_reservation_t *} reservation       Pointer to reservation object to map the frame into
+ * @param {vm_frame_t} frame                            Frame to map, at the page aligned guest physical address 'vaddr'
+ * @return                                              -1 on failure otherwise 0 for success
+ */
+int vm_reservation_map_frame(vm_t *vm, vm_memory_reservation_t *reservation, vm_frame_t frame);
+
+/***
+ * @function vm_reservation_unmap_frame(vm, reservation, addr)
+ * Unmap a 4K frame mapped with 'vm_reservation_map_frame', leaving its cap with the caller and the address reserved
+ * @param {vm_t *} vm                                   A handle to the VM
+ * @param {vm_memory_reservation_t *} reservation       Pointer to reservation object the frame is mapped into
+ * @param {uintptr_t} addr                              Page aligned guest physical address of the frame
+ * @return                                              -1 on failure otherwise 0 for success
+ */
+int vm_reservation_unmap_frame(vm_t *vm, vm_memory_reservation_t *reservation, uintptr_t addr);
+
+/***
+ * @function vm_reservation_enable_coalesced_mmio(vm, reservation, num_writes, flush, cookie)
+ * Coalesce guest writes to an emulated (unmapped) reservation, for write-only registers tolerant to their writes
+ * being processed late. Writes are appended to a buffer and the guest resumed without invoking the reservation's
+ * fault callback. The buffered writes are passed onto 'flush' when the buffer fills, before a guest read of the
+ * reservation is passed onto the fault callback, or when 'vm_reservation_flush_coalesced_mmio' is called
+ * (e.g. from a timer tick)
+ * @param {vm_t *} vm                                   A handle to the VM
+ * @param {vm_memory_reservation_t *} reservation       Pointer to reservation object
+ * @param {size_t} num_writes                           Number of writes that can be buffered
+ * @param {coalesced_mmio_flush_fn} flush               Callback processing buffered writes
+ * @param {void *} cookie                               User cookie to pass onto flush callback
+ * @return                                              -1 on failure otherwise 0 for success
+ */
+int vm_reservation_enable_coalesced_mmio(vm_t *vm, vm_memory_reservation_t *reservation, size_t num_writes,
+                                         coalesced_mmio_flush_fn flush, void *cookie);
+
+/***
+ * @function vm_reservation_flush_coalesced_mmio(vm, reservation)
+ * Pass the writes buffered by a reservation with coalesced mmio enabled onto its flush callback
+ * @param {vm_t *} vm                                   A handle to the VM
+ * @param {vm_memory_reservation_t *} reservation       Pointer to reservation object
+ * @return                                              -1 on failure otherwise 0 for success
+ */
+int vm_reservation_flush_coalesced_mmio(vm_t *vm, vm_memory_reservation_t *reservation);
+
 /***
  * @function vm_get_reservation_memory_region(reservation, addr, size)
  * Get the memory region information (address & size) from a given reservation
@@ -143,6 +221,27 @@ int vm_map_reservation(vm_t *vm, vm_memory_reservation_t *reservation, memory_ma
  */
 void vm_get_reservation_memory_region(vm_memory_reservation_t *reservation, uintptr_t *addr, size_t *size);
 
+/***
+ * @function vm_get_reservation_frame_size_bits(reservation, addr)
+ * Get the largest frame size a map iterator can use to back a reservation at a given address. This is the size
+ * of a large page if large frames are enabled (CONFIG_LIB_SEL4VM_LARGE_FRAMES) and a large page aligned at 'addr'
+ * fits within the reservation, otherwise the size of a 4K page
+ * @param {vm_memory_reservation_t *} reservation           Pointer to reservation object
+ * @param {uintptr_t} addr                                  Address being mapped
+ * @return                                                  Size bits of the largest frame that can be mapped at 'addr'
+ */
+size_t vm_get_reservation_frame_size_bits(vm_memory_reservation_t *reservation, uintptr_t addr);
+
+/***
+ * @function vm_memory_get_fault_cache_stats(vcpu, hits, misses)
+ * Get the hit and miss counts of a vcpu's memory fault reservation cache. Each memory fault taken by the vcpu
+ * first checks a small cache of recently faulted on reservations before searching all of the VM's reservations.
+ * @param {vm_vcpu_t *} vcpu        A handle to the vcpu
+ * @param {uint64_t *} hits         Pointer that will be set with the number of cache hits
+ * @param {uint64_t *} misses       Pointer that will be set with the number of cache misses
+ */
+void vm_memory_get_fault_cache_stats(vm_vcpu_t *vcpu, uint64_t *hits, uint64_t *misses);
+
 /***
  * @function vm_memory_init(vm)
  * Initialise a VM's memory management interface
@@ -27,3 +27,52 @@
  */
 memory_fault_result_t default_error_fault_callback(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t fault_addr,
                                                    size_t fault_length, void *cookie);
+
+/* Most frames retyped into a batch at once */
+#define VM_FRAME_BATCH_MAX_FRAMES 64
+
+/***
+ * @struct vm_frame_batch
+ * Frames retyped together from an untyped covering consecutive physical memory, ahead of a map iterator asking for
+ * them in address order. Zero initialise before first use
+ * @param {uintptr_t} paddr             Physical address of the first frame of the batch
+ * @param {size_t} size_bits            Size of each frame of the batch in bits
+ * @param {unsigned int} num_frames     Number of frames of the batch
+ * @param {bool} disabled               Set once a batch fails to be retyped, frames then being allocated one by one
+ * @param {seL4_CPtr *} frames          Frames of the batch not handed out yet, seL4_CapNull once handed out
+ */
+typedef struct vm_frame_batch {
+    uintptr_t paddr;
+    size_t size_bits;
+    unsigned int num_frames;
+    bool disabled;
+    seL4_CPtr frames[VM_FRAME_BATCH_MAX_FRAMES];
+} vm_frame_batch_t;
+
+/***
+ * @function vm_frame_batch_take(batch, paddr, size_bits)
+ * Take the frame at a physical address from a batch
+ * @param {vm_frame_batch_t *} batch    The batch
+ * @param {uintptr_t} paddr             Physical address of the frame, aligned to its size
+ * @param {size_t} size_bits            Size of the frame in bits
+ * @return                              The frame, seL4_CapNull if the batch doesn't hold it
+ */
+seL4_CPtr vm_frame_batch_take(vm_frame_batch_t *batch, uintptr_t paddr, size_t size_bits);
+
+/***
+ * @function vm_frame_batch_alloc(vm, batch, paddr, size_bits, max_frames)
+ * Retype a new batch of up to `max_frames` frames from a physical address on, taking the first of them. The frames
+ * are retyped from a single untyped, into runs of consecutive free cslots of the VMM with one seL4_Untyped_Retype
+ * each. The untyped is kept for as long as its frames, which are not returned to the allocator one by one. Frames
+ * the previous batch didn't hand out are left allocated
+ * @param {vm_t *} vm                   A handle to the VM
+ * @param {vm_frame_batch_t *} batch    The batch
+ * @param {uintptr_t} paddr             Physical address of the first frame, aligned to its size
+ * @param {size_t} size_bits            Size of each frame in bits
+ * @param {unsigned int} max_frames     Number of frames of the same size the iterator goes on to ask for from the
+ *                                      address on, including the first
+ * @return                              The first frame, seL4_CapNull if the frames can't be allocated in a batch, for
+ *                                      the caller to allocate them one by one
+ */
+seL4_CPtr vm_frame_batch_alloc(vm_t *vm, vm_frame_batch_t *batch, uintptr_t paddr, size_t size_bits,
+                               unsigned int max_frames);
@@ -0,0 +1,56 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+/***
+ * @module guest_mmio_batch.h
+ * The guest MMIO batch interface runs a guest supplied sequence of register accesses through the fault callbacks of
+ * the emulated memory reservations they fall in, as if each of them had faulted on its own. This lets paravirtual
+ * drivers that program many registers in a row do so with a single exit, made through a hypercall rather than a
+ * memory fault per register. Only accesses handled on the spot by a reservation are supported, accesses to guest
+ * RAM, unreserved memory or reservations completing their faults later end the batch.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sel4vm/guest_vm.h>
+
+/* Operation of a batched access */
+#define VM_MMIO_BATCH_READ 0
+#define VM_MMIO_BATCH_WRITE 1
+
+/* Maximum number of accesses run by a single batch */
+#define VM_MMIO_BATCH_MAX_OPS 64
+
+/***
+ * @struct vm_mmio_batch_op
+ * Access of a batch, as laid out in guest memory
+ * @param {uint64_t} addr       Guest physical address accessed, aligned to the width of the access
+ * @param {uint32_t} width      Width of the access in bytes, 1, 2, 4 or (on 64 bit ARM only) 8
+ * @param {uint32_t} op         VM_MMIO_BATCH_READ or VM_MMIO_BATCH_WRITE
+ * @param {uint64_t} value      Value to write, or the value read written back by the VMM
+ */
+typedef struct vm_mmio_batch_op {
+    uint64_t addr;
+    uint32_t width;
+    uint32_t op;
+    uint64_t value;
+} vm_mmio_batch_op_t;
+
+/***
+ * @function vm_mmio_batch_run(vcpu, ops_addr, num_ops, num_run)
+ * Run a batch of accesses on behalf of a vcpu, in order, stopping at the first access that is invalid or not
+ * handled by a reservation. The values read are written back in place for the accesses run. To be called while
+ * handling an exit of the vcpu, such as a hypercall, the fault of which is left untouched
+ * @param {vm_vcpu_t *} vcpu            A handle to the vcpu making the accesses
+ * @param {uintptr_t} ops_addr          Guest physical address of an array of 'vm_mmio_batch_op_t', in guest RAM
+ * @param {size_t} num_ops              Number of accesses in the array, at most VM_MMIO_BATCH_MAX_OPS
+ * @param {size_t *} num_run            Set with the number of accesses run
+ * @return                              0 on success, -1 if the array could not be accessed
+ */
+int vm_mmio_batch_run(vm_vcpu_t *vcpu, uintptr_t ops_addr, size_t num_ops, size_t *num_run);
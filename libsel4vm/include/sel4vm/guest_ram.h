@@ -27,6 +27,79 @@
 typedef int (*ram_touch_callback_fn)(vm_t *vm, uintptr_t guest_addr, void *vmm_vaddr, size_t size, size_t offset,
                                      void *cookie);
 
+/***
+ * @struct vm_guest_iovec
+ * Structure describing a contiguous region of guest physical memory within a scatter-gather list
+ * @param {uintptr_t} addr      Guest physical address of region
+ * @param {size_t} len          Length of region in bytes
+ */
+typedef struct vm_guest_iovec {
+    uintptr_t addr;
+    size_t len;
+} vm_guest_iovec_t;
+
+/***
+ * @struct vm_host_iovec
+ * Structure describing a contiguous buffer in the hosts (vmm) vspace within a scatter-gather list
+ * @param {void *} base         Virtual address of buffer
+ * @param {size_t} len          Length of buffer in bytes
+ */
+typedef struct vm_host_iovec {
+    void *base;
+    size_t len;
+} vm_host_iovec_t;
+
+/***
+ * @struct vm_ram_snapshot
+ * A copy of a VM's allocated RAM, taken with 'vm_ram_snapshot'. Pages that are entirely zero are left out, as the
+ * RAM of a new VM starts zeroed
+ * @param {int} num_regions             Number of allocated RAM regions
+ * @param {vm_ram_region_t *} regions   The allocated RAM regions
+ * @param {int} num_pages               Number of pages held
+ * @param {uintptr_t *} pages           Guest physical address of each page held, in ascending order
+ * @param {void *} data                 Contents of the pages held, one after the other
+ */
+typedef struct vm_ram_snapshot {
+    int num_regions;
+    vm_ram_region_t *regions;
+    int num_pages;
+    uintptr_t *pages;
+    void *data;
+} vm_ram_snapshot_t;
+
+/***
+ * @struct vm_ram_mapping
+ * A region of guest RAM kept mapped into the VMM's vspace by 'vm_ram_map'
+ * @param {uintptr_t} start     Guest physical address of the region
+ * @param {size_t} size         Size of the region in bytes
+ * @param {void *} vaddr        Virtual address of 'start' in the VMM's vspace, NULL whilst the region is not mapped
+ */
+typedef struct vm_ram_mapping {
+    uintptr_t start;
+    size_t size;
+    void *vaddr;
+} vm_ram_mapping_t;
+
+/**
+ * Hint of how the data copied by 'vm_ram_copy' is used next, which selects the copy kernel
+ */
+typedef enum vm_ram_copy_hint {
+    VM_RAM_COPY_CACHED, /** The VMM or guest reads the copy soon, e.g. the packets and requests of emulated devices */
+    VM_RAM_COPY_STREAM, /** The copy is not read soon, e.g. guest images and snapshots, so it bypasses the cache */
+} vm_ram_copy_hint_t;
+
+/***
+ * @function vm_ram_copy(dest, src, size, hint)
+ * Copy memory between guest RAM mapped into the VMM and a host buffer. Streamed copies of at least a few cache lines
+ * use the architecture's non-temporal stores where it has them, so that loading an image does not evict the VMM's
+ * cache, and all other copies use 'memcpy'
+ * @param {void *} dest                 Destination to copy to
+ * @param {const void *} src            Source to copy from
+ * @param {size_t} size                 Number of bytes to copy
+ * @param {vm_ram_copy_hint_t} hint     How the copied data is used next
+ */
+void vm_ram_copy(void *dest, const void *src, size_t size, vm_ram_copy_hint_t hint);
+
 /***
  * @function vm_guest_ram_read_callback(vm, guest_addr, vaddr, size, offset, buf)
  * Common guest ram touch callback for reading from a guest address into a user supplied buffer
@@ -53,9 +126,27 @@ int vm_guest_ram_read_callback(vm_t *vm, uintptr_t guest_addr, void *vaddr, size
  */
 int vm_guest_ram_write_callback(vm_t *vm, uintptr_t guest_addr, void *vaddr, size_t size, size_t offset, void *buf);
 
+/***
+ * @function vm_guest_ram_stream_write_callback(vm, guest_addr, vaddr, size, offset, buf)
+ * Guest ram touch callback for writing a user supplied buffer into a guest address with a 'VM_RAM_COPY_STREAM' copy,
+ * for bulk writes the VMM does not read back such as loading images
+ * @param {vm_t *} vm               A handle to the VM
+ * @param {uintptr_t} guest_addr    Guest physical address to write to
+ * @param {void *} vmm_vaddr        Virtual address in hosts (vmm) vspace corresponding with the 'guest_addr'
+ * @param {size_t} size             Size of region being currently accessed
+ * @param {size_t} offset           Current offset from the base guest physical address supplied to 'vm_ram_touch'
+ * @param {void *} cookie           User supplied buffer to write data from
+ * @return                          0 on success, -1 on error
+ */
+int vm_guest_ram_stream_write_callback(vm_t *vm, uintptr_t guest_addr, void *vaddr, size_t size, size_t offset,
+                                       void *buf);
+
 /***
  * @function vm_ram_touch(vm, addr, size, touch_callback, cookie)
- * Touch a series of pages in the guest vm and invoke a callback for each page accessed
+ * Touch a series of pages in the guest vm and invoke a callback for each page accessed. This is safe to call from any
+ * number of threads, but touches are serialised unless the calling thread has a mapping window (see
+ * 'vm_ram_window_create'). A callback invoked through a mapping window must not itself touch guest RAM or change the
+ * vm's memory reservations
  * @param {vm_t *} vm                       A handle to the VM
  * @param {uintptr_t} addr                  Address to access in the guest vm
  * @param {size_t} size                     Size of memory region to access
@@ -65,6 +156,118 @@ int vm_guest_ram_write_callback(vm_t *vm, uintptr_t guest_addr, void *vaddr, siz
  */
 int vm_ram_touch(vm_t *vm, uintptr_t addr, size_t size, ram_touch_callback_fn touch_callback, void *cookie);
 
+/***
+ * @function vm_ram_readv(vm, guest_iov, guest_iovcnt, host_iov, host_iovcnt, copied)
+ * Copy a scatter-gather list of guest RAM regions into a scatter-gather list of host buffers. Data is copied in a
+ * single pass, with each guest region validated once and each guest page accessed once. Copying stops when either
+ * list is exhausted.
+ * @param {vm_t *} vm                           A handle to the VM
+ * @param {const vm_guest_iovec_t *} guest_iov  List of guest physical regions to read from
+ * @param {int} guest_iovcnt                    Number of entries in 'guest_iov'
+ * @param {const vm_host_iovec_t *} host_iov    List of host buffers to copy into
+ * @param {int} host_iovcnt                     Number of entries in 'host_iov'
+ * @param {size_t *} copied                     Optional pointer to be set with the number of bytes copied
+ * @return                                      0 on success, -1 on error
+ */
+int vm_ram_readv(vm_t *vm, const vm_guest_iovec_t *guest_iov, int guest_iovcnt, const vm_host_iovec_t *host_iov,
+                 int host_iovcnt, size_t *copied);
+
+/***
+ * @function vm_ram_writev(vm, guest_iov, guest_iovcnt, host_iov, host_iovcnt, copied)
+ * Copy a scatter-gather list of host buffers into a scatter-gather list of guest RAM regions. Data is copied in a
+ * single pass, with each guest region validated once and each guest page accessed once. Copying stops when either
+ * list is exhausted.
+ * @param {vm_t *} vm                           A handle to the VM
+ * @param {const vm_guest_iovec_t *} guest_iov  List of guest physical regions to write to
+ * @param {int} guest_iovcnt                    Number of entries in 'guest_iov'
+ * @param {const vm_host_iovec_t *} host_iov    List of host buffers to copy from
+ * @param {int} host_iovcnt                     Number of entries in 'host_iov'
+ * @param {size_t *} copied                     Optional pointer to be set with the number of bytes copied
+ * @return                                      0 on success, -1 on error
+ */
+int vm_ram_writev(vm_t *vm, const vm_guest_iovec_t *guest_iov, int guest_iovcnt, const vm_host_iovec_t *host_iov,
+                  int host_iovcnt, size_t *copied);
+
+/***
+ * @function vm_ram_direct_map(vm, start, bytes)
+ * Map a registered region of guest RAM contiguously into the VMM's vspace. The mapping persists for the lifetime of the
+ * RAM region, allowing the VMM to access guest RAM through plain pointers (see 'vm_guest_ram_vaddr'). Subsequent
+ * calls to 'vm_ram_touch' on the region also use the mapping instead of mapping each page on access.
+ * This should only be used on RAM regions whose backing frames do not change once registered.
+ * @param {vm_t *} vm               A handle to the VM
+ * @param {uintptr_t} start         Starting guest physical address of the region, must be 4K aligned
+ * @param {size_t} bytes            Size of the region, must be a multiple of 4K
+ * @return                          0 on success, -1 on error
+ */
+int vm_ram_direct_map(vm_t *vm, uintptr_t start, size_t bytes);
+
+/***
+ * @function vm_guest_ram_vaddr(vm, addr, size)
+ * Translate a guest physical address into a virtual address in the VMM's vspace. This only succeeds for regions
+ * previously mapped with 'vm_ram_direct_map'
+ * @param {vm_t *} vm               A handle to the VM
+ * @param {uintptr_t} addr          Guest physical address to translate
+ * @param {size_t} size             Size of the region being accessed, which must lie entirely within a direct mapped region
+ * @return                          VMM virtual address corresponding to 'addr', NULL if the region isn't direct mapped
+ */
+void *vm_guest_ram_vaddr(vm_t *vm, uintptr_t addr, size_t size);
+
+/***
+ * @function vm_ram_map(vm, start, bytes, mapping)
+ * Keep a region of guest RAM mapped into the VMM's vspace, such as the rings of an emulated device which are accessed
+ * on every request, so that it can be accessed through 'vaddr' of the mapping without mapping it on each access.
+ * Unlike 'vm_ram_direct_map' the region need not be page aligned and may be backed by a large frame, and the frames
+ * backing it may later change, e.g. when the RAM is released or shared. The region is then unmapped and 'vaddr' of
+ * the mapping cleared, after which the region is to be accessed with 'vm_ram_touch' or mapped again. Pages of the
+ * region are always reported as dirty by 'vm_ram_get_dirty_log', as the VMM writes them without faulting
+ * @param {vm_t *} vm                   A handle to the VM
+ * @param {uintptr_t} start             Guest physical address of the region
+ * @param {size_t} bytes                Size of the region, which must be backed by frames of a single size
+ * @param {vm_ram_mapping_t *} mapping  Mapping to populate, which must remain valid until unmapped with 'vm_ram_unmap'
+ * @return                              0 on success, -1 on error
+ */
+int vm_ram_map(vm_t *vm, uintptr_t start, size_t bytes, vm_ram_mapping_t *mapping);
+
+/***
+ * @function vm_ram_unmap(vm, mapping)
+ * Unmap a region of guest RAM mapped with 'vm_ram_map', if it is still mapped
+ * @param {vm_t *} vm                   A handle to the VM
+ * @param {vm_ram_mapping_t *} mapping  Mapping to unmap
+ */
+void vm_ram_unmap(vm_t *vm, vm_ram_mapping_t *mapping);
+
+/***
+ * @function vm_ram_window_create(vm)
+ * Give the calling thread a mapping window, a page of the VMM's vspace it maps guest RAM into by itself. Touches of
+ * RAM backed by 4K frames by a thread with a window then run alongside those of other threads with windows and the
+ * handling of vm exits, such as for the vcpu threads and device backends of a multi-threaded VMM. Each page not direct
+ * mapped is mapped into the window on every access, instead of through the cache of VMM mappings
+ * @param {vm_t *} vm               A handle to the VM
+ * @return                          0 on success, -1 on error
+ */
+int vm_ram_window_create(vm_t *vm);
+
+/***
+ * @function vm_ram_window_destroy(vm)
+ * Destroy the mapping window of the calling thread, if it has one
+ * @param {vm_t *} vm               A handle to the VM
+ */
+void vm_ram_window_destroy(vm_t *vm);
+
+/***
+ * @function vm_ram_share_vspace(vm, start, bytes, vspace)
+ * Map a region of guest RAM into the vspace of another component, such as a device backend processing the guest's
+ * buffers itself. The component writes the region without the VMM seeing it, so this is only suitable for RAM whose
+ * backing frames no longer change, as with 'vm_ram_direct_map': the region should not subsequently be released,
+ * shared or restored from a snapshot, and its pages are not reported by 'vm_ram_get_dirty_log'
+ * @param {vm_t *} vm                   A handle to the VM
+ * @param {uintptr_t} start             Guest physical address of the region, aligned to the frames backing it
+ * @param {size_t} bytes                Size of the region, which must be backed by frames of a single size
+ * @param {vspace_t *} vspace           Vspace to map the region into
+ * @return                              Address of the region in 'vspace', NULL on error
+ */
+void *vm_ram_share_vspace(vm_t *vm, uintptr_t start, size_t bytes, vspace_t *vspace);
+
 /***
  * @function vm_ram_find_largest_free_region(vm, addr, size)
  * Find the largest free ram region
@@ -77,7 +280,8 @@ int vm_ram_find_largest_free_region(vm_t *vm, uintptr_t *addr, size_t *size);
 
 /***
  * @function vm_ram_register(vm, bytes)
- * Reserve a region of memory for RAM in the guest VM
+ * Reserve a region of memory for RAM in the guest VM. If CONFIG_LIB_SEL4VM_LAZY_RAM is enabled, frames are
+ * only allocated and mapped when first faulted on or touched
  * @param {vm_t *} vm           A handle to the VM
  * @param {size_t} bytes        Size of RAM region to allocate
  * @return                      Starting address of registered ram region
@@ -86,7 +290,8 @@ uintptr_t vm_ram_register(vm_t *vm, size_t bytes);
 
 /***
  * @function vm_ram_register_at(vm, start, bytes, untyped)
- * Reserve a region of memory for RAM in the guest VM at a starting guest physical address
+ * Reserve a region of memory for RAM in the guest VM at a starting guest physical address. If
+ * CONFIG_LIB_SEL4VM_LAZY_RAM is enabled, frames are only allocated and mapped when first faulted on or touched
  * @param {vm_t *} vm           A handle to the VM that ram needs to be allocated for
  * @param {uintptr_t} start     Starting guest physical address of the ram region being allocated
  * @param {size_t} size         The size of the RAM region to be allocated
@@ -95,6 +300,19 @@ uintptr_t vm_ram_register(vm_t *vm, size_t bytes);
  */
 int vm_ram_register_at(vm_t *vm, uintptr_t start, size_t bytes, bool untyped);
 
+/***
+ * @function vm_ram_register_at_node(vm, start, bytes, node)
+ * Reserve a region of memory for RAM in the guest VM at a starting guest physical address, backed by frames from
+ * the memory of a host node given to `vm_ram_placement_init`. Frames come from other memory once the node's
+ * memory runs out
+ * @param {vm_t *} vm           A handle to the VM that ram needs to be allocated for
+ * @param {uintptr_t} start     Starting guest physical address of the ram region being allocated
+ * @param {size_t} size         The size of the RAM region to be allocated
+ * @param {int} node            Host node to allocate frames from, such as from `vm_vcpu_ram_node`. -1 for any
+ * @return                      0 on success, -1 on error
+ */
+int vm_ram_register_at_node(vm_t *vm, uintptr_t start, size_t bytes, int node);
+
 /***
  * @function vm_ram_register_at(vm, start, bytes, untyped)
  * Reserve a region of memory for RAM in the guest VM at a starting guest physical address with a custom memory iterator
@@ -126,6 +344,220 @@ void vm_ram_mark_allocated(vm_t *vm, uintptr_t start, size_t bytes);
  */
 uintptr_t vm_ram_allocate(vm_t *vm, size_t bytes);
 
+/***
+ * @function vm_ram_snapshot(vm, snapshot)
+ * Take a copy of the allocated RAM of a VM, such as once its images and boot structures have been loaded, so further
+ * VMs with the same RAM layout can be started from it with 'vm_ram_restore' instead of loading them again
+ * @param {vm_t *} vm                       A handle to the VM
+ * @param {vm_ram_snapshot_t *} snapshot    Snapshot to fill in, released with 'vm_ram_snapshot_free'
+ * @return                                  0 on success, -1 on error
+ */
+int vm_ram_snapshot(vm_t *vm, vm_ram_snapshot_t *snapshot);
+
+/***
+ * @function vm_ram_restore(vm, snapshot)
+ * Restore a snapshot into the RAM of a VM, marking the regions allocated in the snapshot allocated. The VM must have
+ * the same RAM registered as the VM the snapshot was taken of, and none of it written to yet
+ * @param {vm_t *} vm                       A handle to the VM
+ * @param {vm_ram_snapshot_t *} snapshot    Snapshot to restore
+ * @return                                  0 on success, -1 on error
+ */
+int vm_ram_restore(vm_t *vm, vm_ram_snapshot_t *snapshot);
+
+/***
+ * @function vm_ram_reset(vm, snapshot)
+ * Reset the RAM of a running VM back to a snapshot taken of it, such as to reboot the guest without loading its
+ * images again. Every page of registered RAM is rewritten, with the pages held in the snapshot restored and the rest
+ * zeroed. Pages released with 'vm_ram_release' and not held in the snapshot are left released, and the regions
+ * allocated in the snapshot are marked allocated again
+ * @param {vm_t *} vm                       A handle to the VM
+ * @param {vm_ram_snapshot_t *} snapshot    Snapshot taken of the VM with 'vm_ram_snapshot'
+ * @return                                  0 on success, -1 on error
+ */
+int vm_ram_reset(vm_t *vm, vm_ram_snapshot_t *snapshot);
+
+/***
+ * @function vm_ram_snapshot_free(snapshot)
+ * Release the memory held by a snapshot
+ * @param {vm_ram_snapshot_t *} snapshot    Snapshot to release
+ */
+void vm_ram_snapshot_free(vm_ram_snapshot_t *snapshot);
+
+/***
+ * @function vm_ram_dirty_log_enable(vm, start, bytes)
+ * Start logging the pages of a region of guest RAM that are written to, such as for pre-copying the RAM of a running
+ * VM. The pages of the region are write protected and marked dirty on the first write to them by either the guest
+ * or the VMM
+ * @param {vm_t *} vm           A handle to the VM
+ * @param {uintptr_t} start     Starting guest physical address of the region, 4K aligned
+ * @param {size_t} bytes        Size of the region in bytes, a multiple of 4K
+ * @return                      0 on success, -1 on error
+ */
+int vm_ram_dirty_log_enable(vm_t *vm, uintptr_t start, size_t bytes);
+
+/***
+ * @function vm_ram_get_dirty_log(vm, start, bytes, bitmap, clear)
+ * Get the pages of a logged region of guest RAM written to since logging was enabled or the log was last cleared
+ * @param {vm_t *} vm               A handle to the VM
+ * @param {uintptr_t} start         Starting guest physical address of the region given to 'vm_ram_dirty_log_enable'
+ * @param {size_t} bytes            Size of the region given to 'vm_ram_dirty_log_enable'
+ * @param {unsigned long *} bitmap  Filled with a bit per 4K page of the region, set for pages that are dirty
+ * @param {bool} clear              Clear the log and write protect the dirty pages again, starting a new round
+ * @return                          0 on success, -1 on error
+ */
+int vm_ram_get_dirty_log(vm_t *vm, uintptr_t start, size_t bytes, unsigned long *bitmap, bool clear);
+
+/***
+ * @function vm_ram_release(vm, start, bytes)
+ * Return the frames backing a region of allocated guest RAM to the VKA, such as for pages a guest has given up to a
+ * memory balloon. The region stays registered and allocated to the guest, and each released page is given a fresh
+ * frame when next accessed by the guest or the VMM, or with 'vm_ram_repopulate'. Pages backed by frames larger than
+ * 4K are left backed
+ * @param {vm_t *} vm           A handle to the VM
+ * @param {uintptr_t} start     Starting guest physical address of the region, 4K aligned
+ * @param {size_t} bytes        Size of the region in bytes, a multiple of 4K
+ * @return                      0 on success, -1 on error
+ */
+int vm_ram_release(vm_t *vm, uintptr_t start, size_t bytes);
+
+/***
+ * @function vm_ram_repopulate(vm, start, bytes)
+ * Give the pages of a region of guest RAM released with 'vm_ram_release' fresh frames
+ * @param {vm_t *} vm           A handle to the VM
+ * @param {uintptr_t} start     Starting guest physical address of the region
+ * @param {size_t} bytes        Size of the region in bytes
+ * @return                      0 on success, -1 on error
+ */
+int vm_ram_repopulate(vm_t *vm, uintptr_t start, size_t bytes);
+
+/***
+ * @function vm_ram_share_init(share)
+ * Initialise an instance for sharing the frames of identical pages of guest RAM, across any of the VMs run by the
+ * VMM
+ * @param {vm_ram_share_t **} share     Pointer set with the new instance
+ * @return                              0 on success, -1 on error
+ */
+int vm_ram_share_init(vm_ram_share_t **share);
+
+/***
+ * @function vm_ram_share_scan(share, vm, start, bytes)
+ * Scan a region of guest RAM, mapping each 4K page identical to a page scanned before read only to the frame of that
+ * page. A write to a shared page gives it a copy of the frame of its own again. The VMM calls this periodically, such
+ * as a few pages at a time from a timer, to share pages as they settle
+ * @param {vm_ram_share_t *} share      Instance to share pages through, a VM can only be scanned by one instance
+ * @param {vm_t *} vm                   A handle to the VM
+ * @param {uintptr_t} start             Starting guest physical address of the region
+ * @param {size_t} bytes                Size of the region in bytes
+ * @return                              0 on success, -1 on error
+ */
+int vm_ram_share_scan(vm_ram_share_t *share, vm_t *vm, uintptr_t start, size_t bytes);
+
+/***
+ * @function vm_ram_share_frame_iterator(addr, cookie)
+ * Memory map iterator handing out the cleared frames freed through sharing, for registering RAM of further VMs with
+ * 'vm_ram_register_at_custom_iterator'. Returns a null frame once none are left
+ * @param {uintptr_t} addr      Guest physical address of the frame
+ * @param {void *} cookie       The 'vm_ram_share_t *' instance
+ * @return                      vm_frame_t of a free 4K frame
+ */
+vm_frame_t vm_ram_share_frame_iterator(uintptr_t addr, void *cookie);
+
+/***
+ * @function vm_ram_share_num_free_frames(share)
+ * Get the number of frames freed through sharing that are yet to be reused
+ * @param {vm_ram_share_t *} share      Instance sharing pages
+ * @return                              Number of free 4K frames
+ */
+int vm_ram_share_num_free_frames(vm_ram_share_t *share);
+
+/***
+ * @function vm_ram_pool_init(vka, size_bits, capacity, pool)
+ * Initialise a pool of cleared frames, which a low priority VMM thread fills in the background with
+ * 'vm_ram_pool_refill'. VMs the pool is attached to back their RAM with its frames before allocating any, leaving
+ * only the cost of mapping frames on the path of creating a VM. The pool can be attached to any of the VMs run by
+ * the VMM
+ * @param {vka_t *} vka             Allocator the frames are allocated from, only used by the refilling thread and
+ *                                  not shared with the VMs
+ * @param {size_t} size_bits        Size of the frames, frames of other sizes are allocated as before
+ * @param {int} capacity            Number of frames the pool holds at most
+ * @param {vm_ram_pool_t **} pool   Pointer set with the new pool
+ * @return                          0 on success, -1 on error
+ */
+int vm_ram_pool_init(vka_t *vka, size_t size_bits, int capacity, vm_ram_pool_t **pool);
+
+/***
+ * @function vm_ram_pool_refill(pool, max_frames)
+ * Allocate frames into a pool until it is full, or a number of frames have been allocated. Allocating a frame clears
+ * it, which is the bulk of the cost of backing guest RAM. Only one thread refills a pool at a time, whilst any of the
+ * VMs it is attached to take frames from it
+ * @param {vm_ram_pool_t *} pool    The pool
+ * @param {int} max_frames          Number of frames to allocate at most, such that the thread can yield in between
+ * @return                          Number of frames allocated, -1 on error
+ */
+int vm_ram_pool_refill(vm_ram_pool_t *pool, int max_frames);
+
+/***
+ * @function vm_ram_pool_attach(vm, pool)
+ * Back the RAM of a VM with frames of a pool, on registering RAM, populating lazily allocated RAM and repopulating
+ * released RAM, for as long as the pool has frames of the size. Frames of RAM placed on a host node are not taken
+ * from the pool. The untyped memory of taken frames is not returned to the allocator when the VM frees them
+ * @param {vm_t *} vm               A handle to the VM
+ * @param {vm_ram_pool_t *} pool    The pool
+ * @return                          0 on success, -1 on error
+ */
+int vm_ram_pool_attach(vm_t *vm, vm_ram_pool_t *pool);
+
+/***
+ * @function vm_ram_pool_num_frames(pool)
+ * Get the number of cleared frames a pool holds
+ * @param {vm_ram_pool_t *} pool    The pool
+ * @return                          Number of frames ready to be taken
+ */
+int vm_ram_pool_num_frames(vm_ram_pool_t *pool);
+
+/***
+ * @struct vm_ram_node
+ * A host memory node, giving its physical memory and the host cpus local to it
+ * @param {uintptr_t} paddr     Base physical address of the node's memory
+ * @param {size_t} size         Size of the node's memory in bytes
+ * @param {seL4_Word} cpus      Bitmap of the host cpus local to the node
+ */
+typedef struct vm_ram_node {
+    uintptr_t paddr;
+    size_t size;
+    seL4_Word cpus;
+} vm_ram_node_t;
+
+/***
+ * @function vm_ram_placement_init(vm, nodes, num_nodes)
+ * Initialise placement of guest RAM on host memory nodes. seL4 doesn't describe the host's NUMA topology, so this
+ * is given by the VMM from its platform's configuration
+ * @param {vm_t *} vm                       A handle to the VM
+ * @param {const vm_ram_node_t *} nodes     Array of host memory nodes, copied
+ * @param {int} num_nodes                   Number of nodes
+ * @return                                  0 on success, -1 on error
+ */
+int vm_ram_placement_init(vm_t *vm, const vm_ram_node_t *nodes, int num_nodes);
+
+/***
+ * @function vm_vcpu_ram_node(vcpu)
+ * Get the host memory node local to the target cpu of a vcpu
+ * @param {vm_vcpu_t *} vcpu        A handle to the vcpu
+ * @return                          Index of the node, -1 if the vcpu has no target cpu or no node is local to it
+ */
+int vm_vcpu_ram_node(vm_vcpu_t *vcpu);
+
+/***
+ * @function vm_ram_placement_locality(vm, node, local_frames, remote_frames)
+ * Get the number of frames allocated for RAM placed on a host node, from the node's own memory and from elsewhere
+ * @param {vm_t *} vm                   A handle to the VM
+ * @param {int} node                    Index of the node
+ * @param {size_t *} local_frames       Set with the number of frames allocated from the node's memory
+ * @param {size_t *} remote_frames      Set with the number of frames allocated from other memory
+ * @return                              0 on success, -1 on error
+ */
+int vm_ram_placement_locality(vm_t *vm, int node, size_t *local_frames, size_t *remote_frames);
+
 /***
  * @function vm_ram_free(vm, start, bytes)
  * Free a RAM a previously allocated RAM region
@@ -97,3 +97,21 @@ void advance_vcpu_fault(vm_vcpu_t *vcpu);
  * @param {vm_vcpu_t *} vcpu    Handle to vcpu
  */
 void restart_vcpu_fault(vm_vcpu_t *vcpu);
+
+/***
+ * @function vm_complete_fault(vcpu, data)
+ * Complete a memory fault whose callback returned FAULT_PENDING, resuming the vcpu at the next instruction. This
+ * can be called while the VMM serves other events, e.g. once another component has answered a forwarded access
+ * @param {vm_vcpu_t *} vcpu    Handle to vcpu
+ * @param {seL4_Word} data      Value of a read access, ignored for writes
+ * @return                      0 on success, -1 if the vcpu has no pending fault
+ */
+int vm_complete_fault(vm_vcpu_t *vcpu, seL4_Word data);
+
+/***
+ * @function wait_vcpu_fault(vcpu)
+ * Complete the current vcpu fault once an interrupt is pending for the vcpu, as with a trapped WFI or HLT. The vcpu
+ * doesn't resume until then, the fault completing straight away if an interrupt is already pending
+ * @param {vm_vcpu_t *} vcpu    Handle to vcpu
+ */
+void wait_vcpu_fault(vm_vcpu_t *vcpu);
@@ -20,8 +20,23 @@ typedef struct vm vm_t;
 typedef struct vm_vcpu vm_vcpu_t;
 typedef struct vm_mem vm_mem_t;
 typedef struct vm_ram_region vm_ram_region_t;
+typedef struct vm_ram_free_index vm_ram_free_index_t;
 typedef struct vm_run vm_run_t;
 typedef struct vm_arch vm_arch_t;
+typedef struct vm_ram_map_cache vm_ram_map_cache_t;
+typedef struct vm_mmio_dispatch vm_mmio_dispatch_t;
+typedef struct vm_exit_stats vm_exit_stats_t;
+typedef struct vm_profile vm_profile_t;
+typedef struct vm_event_trace vm_event_trace_t;
+typedef struct vm_mmio_exit_stats vm_mmio_exit_stats_t;
+typedef struct vm_irq_queue vm_irq_queue_t;
+typedef struct vm_irq_bindings vm_irq_bindings_t;
+typedef struct vm_dirty_log vm_dirty_log_t;
+typedef struct vm_ram_share vm_ram_share_t;
+typedef struct vm_doorbell_table vm_doorbell_table_t;
+typedef struct vm_ram_placement vm_ram_placement_t;
+typedef struct vm_ram_pool vm_ram_pool_t;
+typedef struct vm_arena vm_arena_t;
 
 /***
  * @module guest_vm.h
@@ -74,7 +89,15 @@ struct vm_ram_region {
  * @param {vspace_t} vmm_vspace                                             Hosts/VMMs vspace
  * @param {int} num_ram_regions                                             Total number of registered `vm_ram_regions`
  * @param {struct vm_ram_region *}                                          Set of registered `vm_ram_regions`
+ * @param {vm_ram_free_index_t *} ram_free_index                           Free `vm_ram_regions` ordered by size for best fit allocation
  * @param {vm_memory_reservation_cookie_t *}                                Initialised instance of vm memory interface
+ * @param {vm_ram_map_cache_t *} ram_map_cache                             Cache of guest RAM pages mapped into the VMM vspace
+ * @param {vm_mmio_dispatch_t *} mmio_dispatch                             Table dispatching faults on sub-page reservations by page
+ * @param {vm_dirty_log_t *} dirty_log                                     Regions of guest RAM logging the pages written to
+ * @param {vm_ram_share_t *} ram_share                                     Pages of guest RAM shared with identical pages
+ * @param {vm_ram_placement_t *} ram_placement                             Host memory nodes guest RAM is placed on, NULL if not initialised
+ * @param {vm_ram_pool_t *} ram_pool                                       Pool of cleared frames guest RAM is backed from, NULL if none attached
+ * @param {vm_doorbell_table_t *} doorbells                                 Guest physical addresses whose writes signal notifications
  * @param {unhandled_mem_fault_callback_fn}  unhandled_mem_fault_handler    Registered callback for unhandled memory faults
  * @param {void *} unhandled_mem_fault_cookie                               User data passed onto unhandled mem fault callback
  */
@@ -90,8 +113,24 @@ struct vm_mem {
      * This is memory that we will specifically give the guest as actual RAM */
     int num_ram_regions;
     struct vm_ram_region *ram_regions;
+    /* Free ram regions indexed by size */
+    vm_ram_free_index_t *ram_free_index;
     /* Memory reservations */
     vm_memory_reservation_cookie_t *reservation_cookie;
+    /* Guest ram pages kept mapped in the vmm vspace */
+    vm_ram_map_cache_t *ram_map_cache;
+    /* Fault callbacks of sub-page reservations indexed by guest page */
+    vm_mmio_dispatch_t *mmio_dispatch;
+    /* Guest ram regions write protected to log dirty pages */
+    vm_dirty_log_t *dirty_log;
+    /* Guest ram pages mapped to frames shared with identical pages */
+    vm_ram_share_t *ram_share;
+    /* Host memory nodes guest ram frames are allocated from */
+    vm_ram_placement_t *ram_placement;
+    /* Cleared frames guest ram frames are taken from first */
+    vm_ram_pool_t *ram_pool;
+    /* Guest physical addresses forwarding writes to notifications */
+    vm_doorbell_table_t *doorbells;
     unhandled_mem_fault_callback_fn unhandled_mem_fault_handler;
     void *unhandled_mem_fault_cookie;
 };
@@ -101,7 +140,11 @@ struct vm_mem {
  * Structure used for TCB management within a VCPU
  * @param {vka_object_t} tcb            VKA allocated TCB object
  * @param {vka_object_t} sc             VKA allocated scheduling context
+ * @param {vka_object_t} sched_ctrl     Scheduling control capability the scheduling context is configured with
  * @param {int} priority                VCPU scheduling priority
+ * @param {uint64_t} budget_us          Budget of the scheduling context per period, in microseconds
+ * @param {uint64_t} period_us          Period of the scheduling context, in microseconds
+ * @param {uint64_t} consumed_us        Budget consumed through the scheduling context, in microseconds
  */
 struct vm_tcb {
     /* Guest vm tcb management objects */
@@ -110,6 +153,10 @@ struct vm_tcb {
     vka_object_t sched_ctrl;
     /* vcpu scheduling priority */
     int priority;
+    /* MCS budget and period of 'sc', and the time consumed through it */
+    uint64_t budget_us;
+    uint64_t period_us;
+    uint64_t consumed_us;
 };
 
 /***
@@ -121,6 +168,10 @@ struct vm_tcb {
  * @param {unsigned int} vcpu_id            VCPU Identifier
  * @param {int} target_cpu                  The target core the vcpu is assigned to
  * @param {bool} vcpu_online                Flag representing if the vcpu has been started
+ * @param {vm_memory_fault_cache_t *} mem_fault_cache  Cache of recently faulted memory reservations
+ * @param {vm_exit_stats_t *} exit_stats    Exit statistics of the vcpu, NULL unless CONFIG_LIB_SEL4VM_EXIT_STATS is enabled
+ * @param {vm_profile_t *} profile          Samples of the vcpu's execution, NULL unless a profile is started
+ * @param {vm_event_trace_t *} event_trace  Ring of the vcpu's traced events, NULL unless a trace is started
  * @param {struct vm_vcpu_arch} vcpu_arch   Architecture specific vcpu properties
  */
 struct vm_vcpu {
@@ -136,6 +187,14 @@ struct vm_vcpu {
     int target_cpu;
     /* is the vcpu online */
     bool vcpu_online;
+    /* Recently faulted memory reservations */
+    vm_memory_fault_cache_t *mem_fault_cache;
+    /* Exit statistics */
+    vm_exit_stats_t *exit_stats;
+    /* Execution samples */
+    vm_profile_t *profile;
+    /* Event trace */
+    vm_event_trace_t *event_trace;
     /* Architecture specfic vcpu */
     struct vm_vcpu_arch vcpu_arch;
 };
@@ -146,11 +205,17 @@ struct vm_vcpu {
  * @param {int} exit_reason                                     Records last vm exit reason
  * @param {notification_callback_fn} notification_callback      Callback for processing unhandled notifications
  * @param {void *} notification_callback_cookie                 A cookie to supply to the notification callback
+ * @param {vm_mmio_exit_stats_t *} mmio_exit_stats              Fault handling statistics of emulated memory reservations
+ * @param {vm_irq_queue_t *} irq_queue                          Queue of irqs posted by other threads, NULL unless initialised
+ * @param {vm_irq_bindings_t *} irq_bindings                    Notification badge bits bound to irqs, NULL until the first binding
  */
 struct vm_run {
     int exit_reason;
     notification_callback_fn notification_callback;
     void *notification_callback_cookie;
+    vm_mmio_exit_stats_t *mmio_exit_stats;
+    vm_irq_queue_t *irq_queue;
+    vm_irq_bindings_t *irq_bindings;
 };
 
 /***
@@ -177,6 +242,7 @@ struct vm_cspace {
  * @param {vka_t *} vka                 Handle to virtual kernel allocator for seL4 kernel object allocation
  * @param {ps_io_ops_t *} io_ops        Handle to platforms io ops
  * @param {simple_t *} simple           Handle to hosts simple environment
+ * @param {vm_arena_t *} arena          Arena the bookkeeping of the VM is allocated from
  * @param {char *} vm_name              String used to describe VM. Useful for debugging
  * @param {unsigned int} vm_id          Identifier for VM. Useful for debugging
  * @param {bool} vm_initialised         Boolean flagging whether VM is intialised or not
@@ -199,6 +265,7 @@ struct vm {
     vka_t *vka;
     ps_io_ops_t *io_ops;
     simple_t *simple;
+    vm_arena_t *arena;
     /* Debugging & Identification */
     char *vm_name;
     unsigned int vm_id;
@@ -0,0 +1,40 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+/***
+ * @module guest_vm_arena.h
+ * The guest vm arena interface allocates the bookkeeping of a VM that lives as long as the VM does, such as its
+ * memory reservations and device structures. Allocations are carved out of large chunks, keeping the structures
+ * looked up on the fault path close together in memory and making VM construction a sequence of pointer bumps
+ * rather than heap allocations. Freed allocations are kept on a free list by size, to be handed out again by later
+ * allocations of the same size. The chunks are released together when the VM is destroyed.
+ */
+
+#include <stddef.h>
+
+typedef struct vm vm_t;
+
+/***
+ * @function vm_arena_alloc(vm, size)
+ * Allocate zeroed memory from the arena of a VM. The memory remains valid until it is freed with 'vm_arena_free'
+ * or the VM is destroyed
+ * @param {vm_t *} vm                   A handle to the VM
+ * @param {size_t} size                 Size of the allocation in bytes
+ * @return                              Pointer to the allocation aligned to 16 bytes, NULL on error
+ */
+void *vm_arena_alloc(vm_t *vm, size_t size);
+
+/***
+ * @function vm_arena_free(vm, size, ptr)
+ * Return an allocation to the arena of a VM for reuse. Allocations larger than 512 bytes are only released when the
+ * VM is destroyed
+ * @param {vm_t *} vm                   A handle to the VM
+ * @param {size_t} size                 Size the memory was allocated with
+ * @param {void *} ptr                  Allocation to free, may be NULL
+ */
+void vm_arena_free(vm_t *vm, size_t size, void *ptr);
@@ -0,0 +1,100 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+/***
+ * @module guest_vm_benchmark.h
+ * The guest vm benchmark interface measures the cost of libsel4vm's hot paths in isolation, such as guest RAM
+ * accesses, memory reservation lookups and interrupt injection. Benchmarks run against the real state of a VM and
+ * leave side effects in it (e.g. list registers holding injected interrupts), so they are intended for a VM created
+ * for benchmarking that does not go on to run a guest. Benchmarks are only available if libsel4vm is built with
+ * CONFIG_LIB_SEL4VM_BENCHMARKS. Latencies are measured in ticks of the architecture's timestamp counter, the TSC on
+ * x86 and the virtual counter on arm.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sel4vm/guest_vm.h>
+
+/* Number of operations timed together, limiting the overhead of reading the timestamp counter */
+#define VM_BENCHMARK_BATCH 64
+
+/**
+ * Benchmarked paths, identifying a `vm_benchmark_result_t`
+ */
+typedef enum vm_benchmark_id {
+    VM_BENCHMARK_RAM_TOUCH, /** vm_ram_touch of a region, param is the size of the region in bytes */
+    VM_BENCHMARK_RESERVATION_LOOKUP, /** Memory reservation lookup by address, param is the number of reservations added */
+    VM_BENCHMARK_IOPORT_LOOKUP, /** ioport handler lookup of vm_io_instruction_handler (x86 only), param is 0 */
+    VM_BENCHMARK_DECODE_INSTRUCTION, /** vm_decode_instruction of an MMIO instruction (x86 only), param is the instruction length */
+    VM_BENCHMARK_LAPIC_HIGHEST_IRR, /** Highest pending LAPIC vector lookup (x86 only), param is 0 */
+    VM_BENCHMARK_VGIC_INJECT, /** vGIC injection of an irq followed by its maintenance (arm only), param is the irq */
+    VM_BENCHMARK_NUM_IDS
+} vm_benchmark_id_t;
+
+/***
+ * @struct vm_benchmark_params
+ * Parameters of a benchmark run. Benchmarks whose parameters are not provided are skipped
+ * @param {size_t} iterations           Number of operations performed by each benchmark
+ * @param {uintptr_t} ram_addr          Guest physical address of a region of guest RAM to touch
+ * @param {size_t} ram_size             Size of the RAM region, regions of up to this size are touched
+ * @param {uintptr_t} scratch_addr      Guest physical address of a page aligned region without any reservations,
+ *                                      used to add reservations for the lookup benchmark
+ * @param {size_t} scratch_size         Size of the scratch region
+ * @param {int} irq                     An irq not registered with the VM to inject (arm only), -1 to skip
+ */
+typedef struct vm_benchmark_params {
+    size_t iterations;
+    uintptr_t ram_addr;
+    size_t ram_size;
+    uintptr_t scratch_addr;
+    size_t scratch_size;
+    int irq;
+} vm_benchmark_params_t;
+
+/***
+ * @struct vm_benchmark_result
+ * Result of a benchmark. Operations are timed in batches of VM_BENCHMARK_BATCH
+ * @param {uint32_t} id                 Benchmark, a value of `vm_benchmark_id_t`
+ * @param {uint32_t} reserved           Reserved, set to 0
+ * @param {uint64_t} param              Parameter of the benchmark, as described by its id
+ * @param {uint64_t} iterations         Number of operations performed
+ * @param {uint64_t} total_ticks        Time taken by all operations
+ * @param {uint64_t} min_batch_ticks    Time taken by the fastest batch of operations
+ * @param {uint64_t} max_batch_ticks    Time taken by the slowest batch of operations
+ */
+typedef struct vm_benchmark_result {
+    uint32_t id;
+    uint32_t reserved;
+    uint64_t param;
+    uint64_t iterations;
+    uint64_t total_ticks;
+    uint64_t min_batch_ticks;
+    uint64_t max_batch_ticks;
+} vm_benchmark_result_t;
+
+/***
+ * @function vm_run_benchmarks(vcpu, params, results, max_results, num_results)
+ * Run the benchmarks of the hot paths available on the architecture against a VM
+ * @param {vm_vcpu_t *} vcpu                    A handle to a vcpu of the VM, which must not be running
+ * @param {vm_benchmark_params_t *} params      Parameters of the benchmarks
+ * @param {vm_benchmark_result_t *} results     Buffer populated with the benchmark results
+ * @param {size_t} max_results                  Number of results the buffer can hold
+ * @param {size_t *} num_results                Pointer set with the number of results written
+ * @return                                      -1 on failure (i.e. benchmarks not enabled, a benchmark failed or the buffer is too small), otherwise 0 for success
+ */
+int vm_run_benchmarks(vm_vcpu_t *vcpu, vm_benchmark_params_t *params, vm_benchmark_result_t *results,
+                      size_t max_results, size_t *num_results);
+
+/***
+ * @function vm_print_benchmark_results(results, num_results)
+ * Print benchmark results to the console as CSV, preceded by a header line naming the columns
+ * @param {vm_benchmark_result_t *} results     Benchmark results
+ * @param {size_t} num_results                  Number of results
+ */
+void vm_print_benchmark_results(vm_benchmark_result_t *results, size_t num_results);
@@ -0,0 +1,89 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+/***
+ * @module guest_vm_boot_phases.h
+ * The guest vm boot phases interface breaks the time and kernel memory taken to bring up a VM down by the stages of
+ * VM creation, such as initialising the VM, registering its RAM, loading its images, generating its ACPI tables or
+ * device tree and installing its devices. The libsel4vm and libsel4vmmplatsupport functions implementing each stage
+ * report into the breakdown as named phases, and a VMM can add phases of its own. Memory is accounted by interposing
+ * on the VKA used to create the VM, counting the frames and bytes of untyped memory retyped through it whilst a
+ * phase runs. Phases nest, with the time and memory of a phase including that of the phases it calls, and phases of
+ * the same name are accumulated. Recording is meant for the single thread creating VMs before they run. Times are
+ * measured in ticks of the architecture's timestamp counter, the TSC on x86 and the virtual counter on arm.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vka/vka.h>
+
+/***
+ * @struct vm_boot_phase
+ * Time and memory taken by a boot phase
+ * @param {const char *} name           Name of the phase
+ * @param {unsigned int} depth          Nesting depth the phase was first entered at, 0 for outermost phases
+ * @param {unsigned int} count          Number of times the phase was entered
+ * @param {uint64_t} ticks              Timestamp counter ticks spent in the phase
+ * @param {uint64_t} frames             Number of frames allocated during the phase
+ * @param {uint64_t} untyped_bytes      Bytes of untyped memory retyped into objects of any type during the phase
+ */
+typedef struct vm_boot_phase {
+    const char *name;
+    unsigned int depth;
+    unsigned int count;
+    uint64_t ticks;
+    uint64_t frames;
+    uint64_t untyped_bytes;
+} vm_boot_phase_t;
+
+/***
+ * @function vm_boot_phases_start(vka, max_phases)
+ * Start recording boot phases, interposing on a VKA to account the memory allocated through it. This is to be
+ * called before the VKA is handed to 'vm_init' or any other user, as the VKA is modified in place
+ * @param {vka_t *} vka                 VKA kernel objects of the VMs are allocated from
+ * @param {size_t} max_phases           Number of distinct phases that can be recorded
+ * @return                              -1 on failure (i.e. already started), otherwise 0 for success
+ */
+int vm_boot_phases_start(vka_t *vka, size_t max_phases);
+
+/***
+ * @function vm_boot_phases_stop()
+ * Stop recording boot phases, restoring the VKA interposed on and discarding the recorded phases
+ */
+void vm_boot_phases_stop(void);
+
+/***
+ * @function vm_boot_phase_begin(name)
+ * Enter a boot phase. A phase re-entered whilst it is still running is accounted to its outer instance only
+ * @param {const char *} name           Name of the phase, must remain valid whilst recording
+ * @return                              Handle of the phase to pass to 'vm_boot_phase_end', -1 if not recording
+ */
+int vm_boot_phase_begin(const char *name);
+
+/***
+ * @function vm_boot_phase_end(phase)
+ * Leave a boot phase, accounting the time and memory spent since it was entered
+ * @param {int} phase                   Handle returned by 'vm_boot_phase_begin', -1 is ignored
+ */
+void vm_boot_phase_end(int phase);
+
+/***
+ * @function vm_boot_phases_get(phases, max_phases)
+ * Copy out the recorded boot phases, in the order they were first entered
+ * @param {vm_boot_phase_t *} phases    Buffer that will be populated with phases
+ * @param {size_t} max_phases           Number of phases the buffer can hold
+ * @return                              Number of phases copied
+ */
+size_t vm_boot_phases_get(vm_boot_phase_t *phases, size_t max_phases);
+
+/***
+ * @function vm_boot_phases_print()
+ * Print the recorded boot phases as a table, indenting nested phases
+ */
+void vm_boot_phases_print(void);
@@ -0,0 +1,99 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+/***
+ * @module guest_vm_event_trace.h
+ * The guest vm event trace interface records individual, timestamped events of a vcpu into a ring of fixed size
+ * records. Events are recorded for each exit and the completion of its handler, for each interrupt injected into
+ * the vcpu, for the entry and exit of each emulated memory callback, and for device specific events such as the
+ * kicks and completions of emulated virtio queues. The ring is written without locks by any thread recording an
+ * event on the vcpu, overwriting the oldest records once full, so that tracing can be left running and drained,
+ * e.g. into a dataport shared with another component or out over a serial port, when a latency spike is seen.
+ * Timestamps are taken from the same counter as the exit statistics, the timestamp counter on x86 and the virtual
+ * counter on arm.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct vm_vcpu vm_vcpu_t;
+
+/**
+ * Enumeration of the types of events recorded in an event trace, with the meaning of their arguments
+ */
+enum vm_event_trace_type {
+    VM_EVENT_TRACE_EXIT = 1, /** Guest exit: arg0 exit reason, arg1 exit qualification (x86) or HSR (arm), arg2 guest ip (x86) */
+    VM_EVENT_TRACE_EXIT_HANDLED, /** Exit handler returned: arg0 exit reason, arg1 handler result */
+    VM_EVENT_TRACE_IRQ_INJECT, /** Interrupt injected: arg0 irq */
+    VM_EVENT_TRACE_IRQ_LEVEL, /** Interrupt line level set: arg0 irq, arg1 level */
+    VM_EVENT_TRACE_MMIO_ENTER, /** Emulated memory callback entered: arg0 non-zero for writes, arg1 address, arg2 size */
+    VM_EVENT_TRACE_MMIO_EXIT, /** Emulated memory callback returned: arg0 fault result, arg1 address */
+    VM_EVENT_TRACE_DEVICE_KICK, /** Emulated device notified by the guest: arg0 queue, arg1 device specific */
+    VM_EVENT_TRACE_DEVICE_COMPLETE, /** Emulated device completed guest requests: arg0 queue, arg1 device specific */
+    VM_EVENT_TRACE_USER = 0x100, /** First of the event types available to users of the library */
+};
+
+/***
+ * @struct vm_event_trace_record
+ * A record of a single event, records are 32 bytes such that they can be copied out as is
+ * @param {uint64_t} timestamp          Counter value the event was recorded at
+ * @param {uint16_t} type               Type of the event, one of 'enum vm_event_trace_type'
+ * @param {uint16_t} vcpu_id            Id of the vcpu the event was recorded on
+ * @param {uint32_t} arg0               First event specific argument
+ * @param {uint64_t} arg1               Second event specific argument
+ * @param {uint64_t} arg2               Third event specific argument
+ */
+typedef struct vm_event_trace_record {
+    uint64_t timestamp;
+    uint16_t type;
+    uint16_t vcpu_id;
+    uint32_t arg0;
+    uint64_t arg1;
+    uint64_t arg2;
+} vm_event_trace_record_t;
+
+/***
+ * @function vm_event_trace_start(vcpu, num_records)
+ * Start tracing the events of a vcpu
+ * @param {vm_vcpu_t *} vcpu            A handle to the vcpu
+ * @param {size_t} num_records          Number of records the ring holds, must be a power of 2
+ * @return                              -1 on failure (i.e. already started), otherwise 0 for success
+ */
+int vm_event_trace_start(vm_vcpu_t *vcpu, size_t num_records);
+
+/***
+ * @function vm_event_trace_stop(vcpu)
+ * Stop tracing the events of a vcpu and free its ring. This must not be called whilst events may still be recorded
+ * on the vcpu, i.e. whilst the vcpu is running
+ * @param {vm_vcpu_t *} vcpu            A handle to the vcpu
+ */
+void vm_event_trace_stop(vm_vcpu_t *vcpu);
+
+/***
+ * @function vm_event_trace_record(vcpu, type, arg0, arg1, arg2)
+ * Record an event on a vcpu, doing nothing if the vcpu is not being traced. This can be called from any thread
+ * @param {vm_vcpu_t *} vcpu            A handle to the vcpu
+ * @param {uint16_t} type               Type of the event
+ * @param {uint32_t} arg0               First event specific argument
+ * @param {uint64_t} arg1               Second event specific argument
+ * @param {uint64_t} arg2               Third event specific argument
+ */
+void vm_event_trace_record(vm_vcpu_t *vcpu, uint16_t type, uint32_t arg0, uint64_t arg1, uint64_t arg2);
+
+/***
+ * @function vm_event_trace_read(vcpu, records, max_records, num_lost)
+ * Copy the records of a vcpu not yet read out of its ring, oldest first. Records overwritten before they could be
+ * read are counted as lost. Only one thread may read the records of a vcpu at a time
+ * @param {vm_vcpu_t *} vcpu                        A handle to the vcpu
+ * @param {vm_event_trace_record_t *} records       Buffer that will be populated with records, e.g. a dataport
+ * @param {size_t} max_records                      Number of records the buffer can hold
+ * @param {uint64_t *} num_lost                     Populated with the number of records lost since the last read, can be NULL
+ * @return                                          Number of records copied
+ */
+size_t vm_event_trace_read(vm_vcpu_t *vcpu, vm_event_trace_record_t *records, size_t max_records,
+                           uint64_t *num_lost);
@@ -0,0 +1,134 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+/***
+ * @module guest_vm_exit_stats.h
+ * The guest vm exit statistics interface provides per-vcpu accounting of the time spent handling guest exits, along
+ * with the time spent handling faults on each emulated memory reservation. Statistics are only gathered if libsel4vm
+ * is built with CONFIG_LIB_SEL4VM_EXIT_STATS. Latencies are measured in ticks of the architecture's timestamp counter,
+ * the TSC on x86 and the virtual counter on arm. All statistics can be exported into a compact binary dump
+ * through `vm_dump_exit_stats`.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct vm vm_t;
+typedef struct vm_vcpu vm_vcpu_t;
+typedef struct vm_exit_stats vm_exit_stats_t;
+
+/* Number of buckets in a latency histogram */
+#define VM_EXIT_STATS_HIST_BUCKETS 16
+/* Latencies below BIT(VM_EXIT_STATS_HIST_SHIFT + 1) cycles are counted in the first bucket. Each following bucket
+ * counts latencies up to double that of the previous bucket, the last bucket counting all remaining latencies */
+#define VM_EXIT_STATS_HIST_SHIFT 8
+
+/***
+ * @struct vm_exit_latency
+ * Latency statistics of a class of events
+ * @param {uint64_t} count                                  Number of events recorded
+ * @param {uint64_t} total_cycles                           Sum of the latencies of all recorded events
+ * @param {uint64_t} max_cycles                             Largest latency recorded
+ * @param {uint64_t} histogram[VM_EXIT_STATS_HIST_BUCKETS]  Log2 histogram of the recorded latencies
+ */
+typedef struct vm_exit_latency {
+    uint64_t count;
+    uint64_t total_cycles;
+    uint64_t max_cycles;
+    uint64_t histogram[VM_EXIT_STATS_HIST_BUCKETS];
+} vm_exit_latency_t;
+
+#include <sel4vm/arch/guest_vm_exit_stats_arch.h>
+
+/* Identifies a binary exit statistics dump */
+#define VM_EXIT_STATS_DUMP_MAGIC 0x53545856
+#define VM_EXIT_STATS_DUMP_VERSION 1
+/* vcpu id of records that are not specific to a vcpu */
+#define VM_EXIT_STATS_NO_VCPU 0xffff
+
+/**
+ * Types of records found in a binary exit statistics dump
+ */
+typedef enum vm_exit_stats_record_type {
+    VM_EXIT_STATS_RECORD_EXIT, /** Exit reason, id is the architecture's exit reason (x86) or exit class (arm) */
+    VM_EXIT_STATS_RECORD_FAULT_CLASS, /** vcpu fault class, id is the HSR exception class (arm only) */
+    VM_EXIT_STATS_RECORD_NOTIFICATION, /** Notification callback, id is 0 */
+    VM_EXIT_STATS_RECORD_MMIO /** Faults on an emulated memory reservation, id is the reservation base address */
+} vm_exit_stats_record_type_t;
+
+/***
+ * @struct vm_exit_stats_dump_header
+ * Header of a binary exit statistics dump, followed by 'num_records' records of type `vm_exit_stats_record_t`
+ * @param {uint32_t} magic              VM_EXIT_STATS_DUMP_MAGIC
+ * @param {uint16_t} version            VM_EXIT_STATS_DUMP_VERSION
+ * @param {uint16_t} hist_buckets       Number of buckets in each latency histogram
+ * @param {uint32_t} num_records        Number of records following the header
+ * @param {uint32_t} record_size        Size of each record in bytes
+ */
+typedef struct vm_exit_stats_dump_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t hist_buckets;
+    uint32_t num_records;
+    uint32_t record_size;
+} vm_exit_stats_dump_header_t;
+
+/***
+ * @struct vm_exit_stats_record
+ * A record of a binary exit statistics dump. Only events that have occurred at least once are recorded
+ * @param {uint16_t} type                   Record type, a value of `vm_exit_stats_record_type_t`
+ * @param {uint16_t} vcpu_id                Id of the vcpu the record belongs to or VM_EXIT_STATS_NO_VCPU
+ * @param {uint32_t} reserved               Reserved, set to 0
+ * @param {uint64_t} id                     Identifier of the event within its record type
+ * @param {vm_exit_latency_t} latency       Latency statistics of the event
+ */
+typedef struct vm_exit_stats_record {
+    uint16_t type;
+    uint16_t vcpu_id;
+    uint32_t reserved;
+    uint64_t id;
+    vm_exit_latency_t latency;
+} vm_exit_stats_record_t;
+
+/***
+ * @function vm_get_exit_stats(vcpu, stats)
+ * Get a snapshot of the exit statistics of a vcpu
+ * @param {vm_vcpu_t *} vcpu            A handle to the vcpu
+ * @param {vm_exit_stats_t *} stats     Pointer that will be populated with the vcpu's exit statistics
+ * @return                              -1 on failure (i.e. statistics not enabled), otherwise 0 for success
+ */
+int vm_get_exit_stats(vm_vcpu_t *vcpu, vm_exit_stats_t *stats);
+
+/***
+ * @function vm_reset_exit_stats(vcpu)
+ * Reset the exit statistics of a vcpu
+ * @param {vm_vcpu_t *} vcpu            A handle to the vcpu
+ */
+void vm_reset_exit_stats(vm_vcpu_t *vcpu);
+
+/***
+ * @function vm_get_mmio_exit_stats(vm, addr, latency)
+ * Get the fault handling statistics of an emulated memory reservation
+ * @param {vm_t *} vm                       A handle to the VM
+ * @param {uintptr_t} addr                  Base address of the reservation
+ * @param {vm_exit_latency_t *} latency     Pointer that will be populated with the reservation's statistics
+ * @return                                  -1 on failure (i.e. no faults recorded on the reservation), otherwise 0 for success
+ */
+int vm_get_mmio_exit_stats(vm_t *vm, uintptr_t addr, vm_exit_latency_t *latency);
+
+/***
+ * @function vm_dump_exit_stats(vm, buf, len, size)
+ * Export the exit statistics of all of a VM's vcpus and emulated memory reservations into a compact binary dump.
+ * The dump consists of a `vm_exit_stats_dump_header_t` followed by `vm_exit_stats_record_t` records
+ * @param {vm_t *} vm                       A handle to the VM
+ * @param {void *} buf                      Buffer to write the dump into
+ * @param {size_t} len                      Size of the buffer
+ * @param {size_t *} size                   Pointer set with the size of the dump, or the required size if 'buf' is too small
+ * @return                                  -1 on failure (i.e. statistics not enabled or buffer too small), otherwise 0 for success
+ */
+int vm_dump_exit_stats(vm_t *vm, void *buf, size_t len, size_t *size);
@@ -0,0 +1,74 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+/***
+ * @module guest_vm_profile.h
+ * The guest vm profile interface samples where a guest spends its time without any tooling inside the guest. Once
+ * started on a vcpu, every nth exit of the vcpu records the guest instruction pointer the exit was taken at along
+ * with the exit reason into a ring of samples, overwriting the oldest samples once full. Samples can be read out
+ * individually or histogrammed over an address range, e.g. to be symbolised against the guest kernel image offline.
+ * As samples are taken on exits, regular exit sources such as timer interrupts give the most representative
+ * profiles, while exits for emulated devices show where the guest accesses them.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct vm_vcpu vm_vcpu_t;
+
+/***
+ * @struct vm_profile_sample
+ * A sample of a guest's execution
+ * @param {uintptr_t} ip                Guest instruction pointer the exit was taken at
+ * @param {uint32_t} exit_reason        Architecture specific reason of the exit
+ */
+typedef struct vm_profile_sample {
+    uintptr_t ip;
+    uint32_t exit_reason;
+} vm_profile_sample_t;
+
+/***
+ * @function vm_profile_start(vcpu, num_samples, interval)
+ * Start sampling the execution of a vcpu, discarding any samples of a previous profile
+ * @param {vm_vcpu_t *} vcpu            A handle to the vcpu
+ * @param {size_t} num_samples          Number of samples the ring holds
+ * @param {unsigned int} interval       Number of exits per sample, 1 to sample every exit
+ * @return                              -1 on failure, otherwise 0 for success
+ */
+int vm_profile_start(vm_vcpu_t *vcpu, size_t num_samples, unsigned int interval);
+
+/***
+ * @function vm_profile_stop(vcpu)
+ * Stop sampling the execution of a vcpu and free its samples
+ * @param {vm_vcpu_t *} vcpu            A handle to the vcpu
+ */
+void vm_profile_stop(vm_vcpu_t *vcpu);
+
+/***
+ * @function vm_profile_get_samples(vcpu, samples, max_samples)
+ * Copy the samples of a vcpu out of its ring, oldest first
+ * @param {vm_vcpu_t *} vcpu                    A handle to the vcpu
+ * @param {vm_profile_sample_t *} samples       Buffer that will be populated with samples
+ * @param {size_t} max_samples                  Number of samples the buffer can hold
+ * @return                                      Number of samples copied
+ */
+size_t vm_profile_get_samples(vm_vcpu_t *vcpu, vm_profile_sample_t *samples, size_t max_samples);
+
+/***
+ * @function vm_profile_histogram(vcpu, start, bucket_size, buckets, num_buckets)
+ * Count the samples of a vcpu falling into consecutive address ranges, starting at 'start' and 'bucket_size'
+ * bytes each. Samples outside of all the ranges are not counted
+ * @param {vm_vcpu_t *} vcpu            A handle to the vcpu
+ * @param {uintptr_t} start             Guest address of the first range
+ * @param {size_t} bucket_size          Size of each range in bytes
+ * @param {uint64_t *} buckets          Array that will be populated with the number of samples in each range
+ * @param {size_t} num_buckets          Number of ranges
+ * @return                              -1 on failure (i.e. not started), otherwise the number of samples counted
+ */
+int vm_profile_histogram(vm_vcpu_t *vcpu, uintptr_t start, size_t bucket_size, uint64_t *buckets,
+                         size_t num_buckets);
@@ -25,6 +25,7 @@
 #include "vm_boot.h"
 #include "guest_vspace.h"
 #include "fault.h"
+#include "vcpu_thread.h"
 
 int vm_init_arch(vm_t *vm)
 {
@@ -40,6 +41,14 @@ int vm_init_arch(vm_t *vm)
         return -1;
     }
 
+    vm->arch.vmm_lock = NULL;
+#ifdef CONFIG_LIB_SEL4VM_VCPU_THREADS
+    err = vm_vcpu_threads_init(vm);
+    if (err) {
+        return -1;
+    }
+#endif
+
     /* Create a cspace */
     vka = vm->vka;
     err = vka_alloc_cnode_object(vka, VM_CSPACE_SIZE_BITS, &vm->cspace.cspace_obj);
@@ -71,9 +80,21 @@ int vm_create_vcpu_arch(vm_t *vm, vm_vcpu_t *vcpu)
     cspacepath_t dst = {0};
 
     seL4_Word badge = VCPU_BADGE_CREATE((seL4_Word)vcpu->vcpu_id);
+    seL4_CPtr fault_endpoint = vm->host_endpoint;
+
+#ifdef CONFIG_LIB_SEL4VM_VCPU_THREADS
+    if (vcpu->vcpu_id != BOOT_VCPU) {
+        /* Secondary vcpus fault to their own VMM thread */
+        err = vm_vcpu_thread_create(vcpu);
+        if (err) {
+            return -1;
+        }
+        fault_endpoint = vm_vcpu_fault_endpoint(vcpu);
+    }
+#endif
 
     /* Badge the endpoint */
-    vka_cspace_make_path(vm->vka, vm->host_endpoint, &src);
+    vka_cspace_make_path(vm->vka, fault_endpoint, &src);
     err = vka_cspace_alloc_path(vm->vka, &dst);
     assert(!err);
     err = vka_cnode_mint(&dst, &src, seL4_AllRights, badge);
@@ -103,6 +124,7 @@ int vm_create_vcpu_arch(vm_t *vm, vm_vcpu_t *vcpu)
     assert(vcpu->vcpu_arch.fault);
     vcpu->vcpu_arch.unhandled_vcpu_callback = NULL;
     vcpu->vcpu_arch.unhandled_vcpu_callback_cookie = NULL;
+    vcpu->vcpu_arch.wfx = NULL;
 
 #if CONFIG_MAX_NUM_NODES > 1
     if (seL4_TCB_SetAffinity(vcpu->tcb.tcb.cptr, vcpu->vcpu_id)) {
@@ -111,3 +133,29 @@ int vm_create_vcpu_arch(vm_t *vm, vm_vcpu_t *vcpu)
 #endif /* CONFIG_MAX_NUM_NODES > 1 */
     return err;
 }
+
+void vm_destroy_vcpu_arch(vm_t *vm, vm_vcpu_t *vcpu)
+{
+#ifdef CONFIG_LIB_SEL4VM_VCPU_THREADS
+    vm_vcpu_thread_destroy(vcpu);
+#endif
+    fault_destroy(vcpu->vcpu_arch.fault);
+    free(vcpu->vcpu_arch.wfx);
+    vka_free_object(vm->vka, &vcpu->tcb.tcb);
+}
+
+void vm_destroy_arch(vm_t *vm)
+{
+    free(vm->arch.vmm_lock);
+    free(vm->arch.mmio_trace);
+    /* Deleting the cnode drops the fault endpoint copies of the vcpus with it */
+    vka_free_object(vm->vka, &vm->cspace.cspace_obj);
+}
+
+int vm_vcpu_sched_target_arch(vm_vcpu_t *vcpu, seL4_CPtr *tcb, int *core)
+{
+    /* Each vcpu has a TCB of its own, with its affinity set to the vcpu's id */
+    *tcb = vcpu->tcb.tcb.cptr;
+    *core = CONFIG_MAX_NUM_NODES > 1 ? vcpu->vcpu_id : 0;
+    return 0;
+}
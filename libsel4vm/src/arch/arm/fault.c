@@ -17,6 +17,7 @@
 
 #include <utils/ansi.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sel4/sel4_arch/constants.h>
 
 //#define DEBUG_FAULTS
@@ -47,8 +48,10 @@
 #define HSR_IS_SYNDROME_VALID(hsr) ((hsr) & HSR_SYNDROME_VALID)
 #define HSR_SYNDROME_RT(x)         (((x) >> 16) & SRT_MASK)
 #define HSR_SYNDROME_WIDTH(x)      (((x) >> 22) & 0x3)
+#define HSR_SYNDROME_SSE           BIT(21)
+#define HSR_SYNDROME_SF            BIT(15)
+#define HSR_SYNDROME_WNR           BIT(6)
 
-#define CONTENT_REGS               BIT(0)
 #define CONTENT_DATA               BIT(1)
 #define CONTENT_INST               BIT(2)
 #define CONTENT_WIDTH              BIT(3)
@@ -110,7 +113,7 @@ static int errata766422_get_rt(fault_t *f, seL4_Word hsr)
         return err;
     }
     if (HSR_IS_INST32(hsr)) {
-        DERRATA("Errata766422 @ 0x%08x (0x%08x)\n", fault_get_ctx(f)->pc, inst);
+        DERRATA("Errata766422 @ 0x%08x (0x%08x)\n", f->ip, inst);
         if ((inst & 0xff700000) == 0xf8400000) {
             return (inst >> 12) & 0xf;
         } else if ((inst & 0xfff00000) == 0xf8800000) {
@@ -126,7 +129,7 @@ static int errata766422_get_rt(fault_t *f, seL4_Word hsr)
             return -1;
         }
     } else {
-        DERRATA("Errata766422 @ 0x%08lx (0x%04lx)\n", (long) fault_get_ctx(f)->pc, (long) inst);
+        DERRATA("Errata766422 @ 0x%08lx (0x%04lx)\n", (long) f->ip, (long) inst);
         /* 16 bit insts */
         if ((inst & 0xf800) == 0x6000) {
             return (inst >> 0) & 0x7;
@@ -234,27 +237,63 @@ static int decode_instruction(fault_t *f)
     }
 }
 
-static int get_rt(fault_t *f)
+/* Read the registers of the context up to and including 'reg' that have not been read yet. The TCB
+ * invocations transfer a prefix of seL4_UserContext, so a temporary context is used to not overwrite
+ * registers that have been modified */
+static void fault_load_ctx_regs(fault_t *f, unsigned int reg)
 {
+    seL4_UserContext regs;
+    int err;
+
+    assert(reg < FAULT_CTX_NUM_REGS);
+    if (reg < f->regs_loaded) {
+        return;
+    }
+    err = seL4_TCB_ReadRegisters(vm_get_vcpu_tcb(f->vcpu), false, 0, reg + 1, &regs);
+    assert(!err);
+    memcpy((seL4_Word *)&f->regs + f->regs_loaded, (seL4_Word *)&regs + f->regs_loaded,
+           (reg + 1 - f->regs_loaded) * sizeof(seL4_Word));
+    f->regs_loaded = reg + 1;
+}
 
+/* Index of the context register holding general purpose register 'rt', -1 for the zero register */
+static int fault_rt_ctx_reg(fault_t *f, int rt)
+{
+    seL4_Word *base = (seL4_Word *)&f->regs;
+    seL4_Word *reg = decode_rt(rt, &f->regs);
+    if (reg < base || reg >= base + FAULT_CTX_NUM_REGS) {
+        return -1;
+    }
+    return reg - base;
+}
+
+static void fault_fetch_pmode(fault_t *f)
+{
     /* Save processor mode in fault struct */
     if ((f->content & CONTENT_PMODE)  == 0) {
 #ifdef CONFIG_ARCH_AARCH64
 #else
-        f->pmode = fault_get_ctx(f)->cpsr & 0x1f;
+        f->pmode = fault_get_ctx_reg(f, FAULT_CTX_REG(cpsr)) & 0x1f;
 #endif
         f->content |= CONTENT_PMODE;
     }
+}
 
+static int get_rt(fault_t *f)
+{
     int rt;
     if (HSR_IS_SYNDROME_VALID(f->fsr)) {
         if (HAS_ERRATA766422(f)) {
             rt = errata766422_get_rt(f, f->fsr);
         } else {
             rt = HSR_SYNDROME_RT(f->fsr);
-            //printf("here rt %d\n", rt);
+        }
+        /* Only r8 to r14 are banked between processor modes, the mode of other registers is not needed */
+        if (rt >= 8) {
+            fault_fetch_pmode(f);
         }
     } else {
+        fault_fetch_pmode(f);
 #ifdef CONFIG_ARCH_AARCH64
         printf("decode_insturction for arm64 not implemented\n");
 #endif
@@ -264,6 +303,28 @@ static int get_rt(fault_t *f)
     return rt;
 }
 
+/* Value of the destination register of a emulated load. With a valid syndrome the access is a single register
+ * load, which replaces the register with its zero or sign extended data. Otherwise the data is merged */
+static seL4_Word fault_load_value(fault_t *f, seL4_Word reg)
+{
+    if (!HSR_IS_SYNDROME_VALID(f->fsr)) {
+        return fault_emulate(f, reg);
+    }
+    seL4_Word value = (fault_get_data(f) & fault_get_data_mask(f)) >> ((f->addr & 0x3) * 8);
+    size_t bits = fault_get_width_size(f) * 8;
+    if ((f->fsr & HSR_SYNDROME_SSE) && bits < sizeof(seL4_Word) * 8) {
+        seL4_Word sign = BIT(bits - 1);
+        value = (value ^ sign) - sign;
+    }
+#ifdef CONFIG_ARCH_AARCH64
+    if (!(f->fsr & HSR_SYNDROME_SF)) {
+        /* 32 bit destination register */
+        value &= 0xffffffff;
+    }
+#endif
+    return value;
+}
+
 fault_t *fault_init(vm_vcpu_t *vcpu)
 {
     fault_t *fault;
@@ -281,6 +342,17 @@ fault_t *fault_init(vm_vcpu_t *vcpu)
     return fault;
 }
 
+void fault_destroy(fault_t *fault)
+{
+    if (!fault) {
+        return;
+    }
+    /* The slot may still hold the reply cap of a fault never replied to */
+    vka_cnode_delete(&fault->reply_cap);
+    vka_cspace_free_path(fault->vcpu->vm->vka, fault->reply_cap);
+    free(fault);
+}
+
 int new_vcpu_fault(fault_t *fault, uint32_t hsr)
 {
     int err;
@@ -291,6 +363,10 @@ int new_vcpu_fault(fault_t *fault, uint32_t hsr)
     fault->data = 0;
     fault->width = -1;
     fault->content = 0;
+    fault->regs_loaded = 0;
+    fault->regs_dirty = 0;
+    fault->replay = false;
+    fault->wait_irq = false;
     fault->stage = 1;
     assert(fault->reply_cap.capPtr);
     err = vka_cnode_saveCaller(&fault->reply_cap);
@@ -325,6 +401,12 @@ int new_memory_fault(fault_t *fault)
     fault->instruction = 0;
     fault->data = 0;
     fault->width = -1;
+    /* The PC is reported by the fault message */
+    fault->regs.pc = ip;
+    fault->regs_loaded = 1;
+    fault->regs_dirty = 0;
+    fault->replay = false;
+    fault->wait_irq = false;
     if (fault_is_data(fault)) {
         if (fault_is_read(fault)) {
             /* No need to load data */
@@ -351,6 +433,46 @@ int new_memory_fault(fault_t *fault)
     return err;
 }
 
+int new_replay_fault(fault_t *fault, seL4_Word addr, size_t width, bool write, seL4_Word value)
+{
+    seL4_Word sas;
+    assert(fault_handled(fault));
+    switch (width) {
+    case 1:
+        sas = 0;
+        break;
+    case 2:
+        sas = 1;
+        break;
+    case 4:
+        sas = 2;
+        break;
+    case 8:
+        sas = 3;
+        break;
+    default:
+        ZF_LOGE("Invalid replay access width %zu", width);
+        return -1;
+    }
+    fault->type = DATA;
+    fault->ip = 0;
+    fault->base_addr = fault->addr = addr;
+    /* A 32 bit instruction accessing register 0, described by the syndrome */
+    fault->fsr = HSR_INST32 | HSR_SYNDROME_VALID | (sas << 22) | (write ? HSR_SYNDROME_WNR : 0);
+    fault->instruction = 0;
+    fault->data = write ? value : 0;
+    fault->width = -1;
+    fault->content = CONTENT_DATA | CONTENT_STAGE;
+    /* No thread context to load, the accessed register starts at zero */
+    memset(&fault->regs, 0, sizeof(fault->regs));
+    fault->regs_loaded = FAULT_CTX_NUM_REGS;
+    fault->regs_dirty = 0;
+    fault->replay = true;
+    fault->wait_irq = false;
+    fault->stage = 1;
+    return 0;
+}
+
 int abandon_fault(fault_t *fault)
 {
     /* Nothing to do here */
@@ -368,22 +490,28 @@ int restart_fault(fault_t *fault)
     reply = seL4_MessageInfo_new(0, 0, 0, 0);
     DFAULT("%s: Restart fault @ 0x%x from PC 0x%x\n",
            fault->vcpu->vm->vm_name, fault->addr, fault->ip);
-    seL4_Send(fault->reply_cap.capPtr, reply);
+    if (!fault->replay) {
+        seL4_Send(fault->reply_cap.capPtr, reply);
+    }
     /* Clean up */
     return abandon_fault(fault);
 }
 
 int ignore_fault(fault_t *fault)
 {
-    seL4_UserContext *regs;
+    seL4_Word pc;
     int err;
 
-    regs = fault_get_ctx(fault);
+    if (fault->replay) {
+        /* Nothing to write back to or resume */
+        return restart_fault(fault);
+    }
     /* Advance the PC */
-    regs->pc += fault_is_32bit_instruction(fault) ? 4 : 2;
-    /* Write back CPU registers */
+    pc = fault_get_ctx_reg(fault, FAULT_CTX_REG(pc));
+    fault_set_ctx_reg(fault, FAULT_CTX_REG(pc), pc + (fault_is_32bit_instruction(fault) ? 4 : 2));
+    /* Write back the modified CPU registers */
     err = seL4_TCB_WriteRegisters(vm_get_vcpu_tcb(fault->vcpu), false, 0,
-                                  sizeof(*regs) / sizeof(regs->pc), regs);
+                                  fault->regs_dirty, &fault->regs);
     assert(!err);
     if (err) {
         abandon_fault(fault);
@@ -404,8 +532,12 @@ int advance_fault(fault_t *fault)
         int reg = decode_vcpu_reg(rt, fault);
         if (reg == seL4_VCPUReg_Num) {
             /* register is not banked, use seL4_UserContext */
-            seL4_Word *reg_ctx = decode_rt(rt, fault_get_ctx(fault));
-            *reg_ctx = fault_emulate(fault, *reg_ctx);
+            int ctx_reg = fault_rt_ctx_reg(fault, rt);
+            if (ctx_reg >= 0) {
+                /* A syndrome described load replaces the register, so it need not be read */
+                seL4_Word old = HSR_IS_SYNDROME_VALID(fault->fsr) ? 0 : fault_get_ctx_reg(fault, ctx_reg);
+                fault_set_ctx_reg(fault, ctx_reg, fault_load_value(fault, old));
+            }
         } else {
             /* register is banked, use vcpu invocations */
             seL4_ARM_VCPU_ReadRegs_t res = seL4_ARM_VCPU_ReadRegs(fault->vcpu->vcpu.cptr, reg);
@@ -413,7 +545,7 @@ int advance_fault(fault_t *fault)
                 ZF_LOGF("Read registers failed");
                 return -1;
             }
-            int error = seL4_ARM_VCPU_WriteRegs(fault->vcpu->vcpu.cptr, reg, fault_emulate(fault, res.value));
+            int error = seL4_ARM_VCPU_WriteRegs(fault->vcpu->vcpu.cptr, reg, fault_load_value(fault, res.value));
             if (error) {
                 ZF_LOGF("Write registers failed");
                 return -1;
@@ -511,7 +643,8 @@ seL4_Word fault_get_data(fault_t *f)
         seL4_Word data;
         if (reg == seL4_VCPUReg_Num) {
             /* Not banked, use seL4_UserContext */
-            data = *decode_rt(rt, fault_get_ctx(f));
+            int ctx_reg = fault_rt_ctx_reg(f, rt);
+            data = ctx_reg >= 0 ? fault_get_ctx_reg(f, ctx_reg) : 0;
         } else {
             /* Banked, use VCPU invocations */
             seL4_ARM_VCPU_ReadRegs_t res = seL4_ARM_VCPU_ReadRegs(f->vcpu->vcpu.cptr, reg);
@@ -543,21 +676,30 @@ seL4_Word fault_get_fsr(fault_t *f)
 
 seL4_UserContext *fault_get_ctx(fault_t *f)
 {
-    if ((f->content & CONTENT_REGS) == 0) {
-        int err;
-        err = seL4_TCB_ReadRegisters(vm_get_vcpu_tcb(f->vcpu), false, 0,
-                                     sizeof(f->regs) / sizeof(f->regs.pc),
-                                     &f->regs);
-        assert(!err);
-        f->content |= CONTENT_REGS;
-    }
+    fault_load_ctx_regs(f, FAULT_CTX_NUM_REGS - 1);
+    /* The caller may modify any register */
+    f->regs_dirty = FAULT_CTX_NUM_REGS;
     return &f->regs;
 }
 
 void fault_set_ctx(fault_t *f, seL4_UserContext *ctx)
 {
     f->regs = *ctx;
-    f->content |= CONTENT_REGS;
+    f->regs_loaded = f->regs_dirty = FAULT_CTX_NUM_REGS;
+}
+
+seL4_Word fault_get_ctx_reg(fault_t *f, unsigned int reg)
+{
+    fault_load_ctx_regs(f, reg);
+    return ((seL4_Word *)&f->regs)[reg];
+}
+
+void fault_set_ctx_reg(fault_t *f, unsigned int reg, seL4_Word value)
+{
+    /* Registers below 'reg' are written back along with it */
+    fault_load_ctx_regs(f, reg);
+    ((seL4_Word *)&f->regs)[reg] = value;
+    f->regs_dirty = MAX(f->regs_dirty, reg + 1);
 }
 
 int fault_handled(fault_t *f)
@@ -572,7 +714,12 @@ int fault_is_prefetch(fault_t *f)
 
 int fault_is_wfi(fault_t *f)
 {
-    return HSR_EXCEPTION_CLASS(f->fsr) == HSR_WFx_EXCEPTION;
+    return f->wait_irq || HSR_EXCEPTION_CLASS(f->fsr) == HSR_WFx_EXCEPTION;
+}
+
+void fault_set_wait_irq(fault_t *f)
+{
+    f->wait_irq = true;
 }
 
 int fault_is_vcpu(fault_t *f)
@@ -5,6 +5,7 @@
  */
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <vka/cspacepath_t.h>
@@ -21,6 +22,10 @@ enum fault_width {
     WIDTH_BYTE
 };
 
+/* Index of a register of seL4_UserContext, as used by fault_get_ctx_reg and fault_set_ctx_reg */
+#define FAULT_CTX_REG(r)           (offsetof(seL4_UserContext, r) / sizeof(seL4_Word))
+#define FAULT_CTX_NUM_REGS         (sizeof(seL4_UserContext) / sizeof(seL4_Word))
+
 typedef enum {
     DATA,
     PREFETCH,
@@ -40,6 +45,10 @@ struct fault {
     cspacepath_t reply_cap;
 /// VM registers at the time of the fault
     seL4_UserContext regs;
+/// Number of leading registers of 'regs' that have been read from the TCB
+    unsigned int regs_loaded;
+/// Number of leading registers of 'regs' that must be written back to the TCB
+    unsigned int regs_dirty;
 
 /// The IPA address of the fault
     seL4_Word base_addr;
@@ -63,6 +72,10 @@ struct fault {
     processor_mode_t pmode;
 /// The active content within the fault structure to allow lazy loading
     int content;
+/// The fault is replayed from an MMIO trace, there is no faulting thread to resume
+    bool replay;
+/// The vcpu waits for an interrupt before resuming from the fault, as with a trapped WFI
+    bool wait_irq;
 };
 typedef struct fault fault_t;
 
@@ -75,6 +88,12 @@ typedef struct fault fault_t;
  */
 fault_t *fault_init(vm_vcpu_t *vcpu);
 
+/**
+ * Free a fault structure and its reply cap slot.
+ * @param[in] fault A handle to the fault
+ */
+void fault_destroy(fault_t *fault);
+
 /**
  * Populate an initialised fault structure with fault data obtained from
  * a pending VCPU fault message. The reply cap to the faulting TCB will
@@ -93,6 +112,20 @@ int new_vcpu_fault(fault_t *fault, uint32_t hsr);
  */
 int new_memory_fault(fault_t *fault);
 
+/**
+ * Populate an initialised fault structure with a data fault replaying an
+ * emulated memory access. The fault is described by a valid syndrome for
+ * register 0 and has a zeroed context. Completing the fault does not access
+ * or resume the vcpu's TCB.
+ * @param[in] fault  A handle to a fault structure
+ * @param[in] addr   The IPA address of the access
+ * @param[in] width  The width of the access in bytes
+ * @param[in] write  True if the access is a write
+ * @param[in] value  The data written by a write access
+ * @return           0 on success, -1 on an invalid width
+ */
+int new_replay_fault(fault_t *fault, seL4_Word addr, size_t width, bool write, seL4_Word value);
+
 /**
  * Abandon the fault.
  * Performs any necessary clean up of the fault structure once a fault
@@ -206,7 +239,9 @@ enum fault_width fault_get_width(fault_t *f);
 size_t fault_get_width_size(fault_t *f);
 
 /**
- * Get the context of a fault
+ * Get the context of a fault. The whole context is loaded and, as it may be
+ * modified through the returned handle, written back when the fault is ignored.
+ * Prefer fault_get_ctx_reg and fault_set_ctx_reg to access single registers.
  * @param[in] fault  A handle to the fault
  * @return           A handle to the fault context
  */
@@ -219,6 +254,24 @@ seL4_UserContext *fault_get_ctx(fault_t *fault);
  */
 void fault_set_ctx(fault_t *f, seL4_UserContext *ctx);
 
+/**
+ * Get a register of the context of a fault. Only the registers of the context
+ * up to the requested one are read from the TCB.
+ * @param[in] fault  A handle to the fault
+ * @param[in] reg    Index of the register within seL4_UserContext
+ * @return           The value of the register
+ */
+seL4_Word fault_get_ctx_reg(fault_t *f, unsigned int reg);
+
+/**
+ * Set a register of the context of a fault. The register is written back to
+ * the TCB when the fault is ignored.
+ * @param[in] fault  A handle to the fault
+ * @param[in] reg    Index of the register within seL4_UserContext
+ * @param[in] value  The new value of the register
+ */
+void fault_set_ctx_reg(fault_t *f, unsigned int reg, seL4_Word value);
+
 /**
  * Get the fault status register of a fault
  * @param[in] fault  A handle to the fault
@@ -241,6 +294,12 @@ int fault_is_prefetch(fault_t *fault);
  */
 int fault_is_wfi(fault_t *fault);
 
+/**
+ * Have a fault wait for an interrupt before resuming, as a trapped WFI does
+ * @param[in] fault A handle to the fault
+ */
+void fault_set_wait_irq(fault_t *fault);
+
 /**
  * Determine if a fault is a vcpu fault
  * @param[in] fault  A handle to the fault
@@ -31,22 +31,24 @@ int vm_set_thread_context(vm_vcpu_t *vcpu, seL4_UserContext context)
 
 int vm_set_thread_context_reg(vm_vcpu_t *vcpu, unsigned int reg, uintptr_t value)
 {
+    if (reg >= FAULT_CTX_NUM_REGS) {
+        ZF_LOGE("Failed to set thread context reg: Invalid register index %u", reg);
+        return -1;
+    }
     seL4_CPtr tcb = vm_get_vcpu_tcb(vcpu);
     if (!fault_handled(vcpu->vcpu_arch.fault)) {
         /* If we are in a fault use and modify its cached context */
-        seL4_UserContext *regs;
-        regs = fault_get_ctx(vcpu->vcpu_arch.fault);
-        (&regs->pc)[reg] = value;
+        fault_set_ctx_reg(vcpu->vcpu_arch.fault, reg, value);
     } else {
-        /* Otherwise write to the TCB directly */
+        /* Otherwise write to the TCB directly, transferring only the registers up to 'reg' */
         seL4_UserContext regs;
-        int err = seL4_TCB_ReadRegisters(tcb, false, 0, sizeof(regs) / sizeof(regs.pc), &regs);
+        int err = seL4_TCB_ReadRegisters(tcb, false, 0, reg + 1, &regs);
         if (err) {
             ZF_LOGE("Failed to set thread context reg: Unable to read TCB registers");
             return -1;
         }
         (&regs.pc)[reg] = value;
-        err = seL4_TCB_WriteRegisters(tcb, false, 0, sizeof(regs) / sizeof(regs.pc), &regs);
+        err = seL4_TCB_WriteRegisters(tcb, false, 0, reg + 1, &regs);
         if (err) {
             ZF_LOGE("Failed to set thread context register: Unable to write new register to TCB");
             return -1;
@@ -78,16 +80,18 @@ int vm_get_thread_context(vm_vcpu_t *vcpu, seL4_UserContext *context)
 
 int vm_get_thread_context_reg(vm_vcpu_t *vcpu, unsigned int reg, uintptr_t *value)
 {
+    if (reg >= FAULT_CTX_NUM_REGS) {
+        ZF_LOGE("Failed to get thread context register: Invalid register index %u", reg);
+        return -1;
+    }
     if (!fault_handled(vcpu->vcpu_arch.fault)) {
         /* If we are in a fault use its cached context */
-        seL4_UserContext *regs;
-        regs = fault_get_ctx(vcpu->vcpu_arch.fault);
-        *value = (&regs->pc)[reg];
+        *value = fault_get_ctx_reg(vcpu->vcpu_arch.fault, reg);
     } else {
         /* Otherwise read it from the TCB directly */
         seL4_UserContext regs;
         seL4_CPtr tcb = vm_get_vcpu_tcb(vcpu);
-        int err = seL4_TCB_ReadRegisters(tcb, false, 0, sizeof(regs) / sizeof(regs.pc), &regs);
+        int err = seL4_TCB_ReadRegisters(tcb, false, 0, reg + 1, &regs);
         if (err) {
             ZF_LOGE("Failed to get thread context register: Unable to read TCB registers");
             return -1;
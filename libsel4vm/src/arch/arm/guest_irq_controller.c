@@ -4,6 +4,11 @@
  * SPDX-License-Identifier: BSD-2-Clause
  */
 
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_irq_controller.h>
+#include <sel4vm/guest_vm_boot_phases.h>
+
+#include "guest_irq_queue.h"
 #include "vgic/vgic.h"
 
 int vm_create_default_irq_controller(vm_t *vm)
@@ -12,5 +17,17 @@ int vm_create_default_irq_controller(vm_t *vm)
         ZF_LOGE("Failed to initialise default irq controller: Invalid vm");
         return -1;
     }
-    return vm_install_vgic(vm);
+    int phase = vm_boot_phase_begin("vm_install_vgic");
+    int err = vm_install_vgic(vm);
+    vm_boot_phase_end(phase);
+    return err;
+}
+
+int vm_irq_queue_deliver_arch(vm_vcpu_t *vcpu, vm_irq_event_t *event)
+{
+    /* The vGIC does not track line levels, a raised line is injected and lowering it is left to the guest's EOI */
+    if (event->type == VM_IRQ_EVENT_LEVEL && !event->irq_level) {
+        return 0;
+    }
+    return vm_inject_irq(vcpu, event->irq);
 }
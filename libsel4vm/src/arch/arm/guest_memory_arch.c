@@ -8,6 +8,8 @@
 #include <sel4vm/guest_vm_util.h>
 #include <sel4vm/guest_memory.h>
 
+#include "guest_memory.h"
+
 uintptr_t vm_arm_ipa_to_pa(vm_t *vm, uintptr_t ipa_base, size_t size)
 {
     seL4_ARM_Page_GetAddress_t ret;
@@ -24,9 +26,8 @@ uintptr_t vm_arm_ipa_to_pa(vm_t *vm, uintptr_t ipa_base, size_t size)
         if (cap == seL4_CapNull) {
             return 0;
         }
-        /* Find mapping size */
-        bits = vspace_get_cookie(vspace, (void *)ipa);
-        assert(bits == 12 || bits == 21);
+        /* Find mapping size. The mapping cookie is the frame's allocator cookie, not its size */
+        bits = vm_memory_frame_size_bits(vm, ipa);
         /* Find the physical address */
         ret = seL4_ARM_Page_GetAddress(cap);
         if (ret.error) {
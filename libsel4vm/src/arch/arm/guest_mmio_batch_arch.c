@@ -0,0 +1,45 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <inttypes.h>
+
+#include <utils/util.h>
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_memory.h>
+#include <sel4vm/guest_mmio_batch.h>
+
+#include "fault.h"
+#include "guest_memory.h"
+#include "guest_mmio_dispatch.h"
+#include "guest_mmio_batch.h"
+
+int vm_mmio_batch_access_arch(vm_vcpu_t *vcpu, vm_mmio_batch_op_t *op)
+{
+    /* The access is described by a replayed data fault, with no thread to resume, which stands in for the fault of
+     * the exit the batch is run from while the access is handled */
+    fault_t batch_fault = { .vcpu = vcpu };
+    fault_t *fault = vcpu->vcpu_arch.fault;
+    memory_fault_result_t result;
+    if (new_replay_fault(&batch_fault, op->addr, op->width, op->op == VM_MMIO_BATCH_WRITE, op->value)) {
+        return -1;
+    }
+    vcpu->vcpu_arch.fault = &batch_fault;
+    if (!vm_mmio_dispatch_fault(vcpu->vm, vcpu, op->addr, op->width, &result)) {
+        result = vm_memory_handle_fault(vcpu->vm, vcpu, op->addr, op->width);
+    }
+    vcpu->vcpu_arch.fault = fault;
+    restart_fault(&batch_fault);
+    if (result != FAULT_HANDLED && result != FAULT_IGNORE) {
+        ZF_LOGE("Failed to run batched mmio access: Access to 0x%"PRIx64" not handled by a reservation (%d)",
+                op->addr, result);
+        return -1;
+    }
+    if (op->op == VM_MMIO_BATCH_READ) {
+        op->value = batch_fault.data;
+    }
+    return 0;
+}
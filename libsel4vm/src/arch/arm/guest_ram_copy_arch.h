@@ -0,0 +1,35 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <autoconf.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Copy whole cache lines with non-temporal stores, which hint the cache not to keep the lines
+ * rather than evicting the VMM's working set. The destination is cache line aligned. Returns the
+ * bytes copied, which is none where there are no non-temporal stores */
+static inline size_t vm_ram_copy_stream_lines(void *dest, const void *src, size_t size)
+{
+    size_t done = 0;
+#ifdef CONFIG_ARCH_AARCH64
+    for (; done + 64 <= size; done += 64) {
+        for (int i = 0; i < 64; i += 16) {
+            uint64_t lo, hi;
+            asm volatile("ldp %0, %1, [%2]" : "=r"(lo), "=r"(hi) : "r"(src + done + i) : "memory");
+            asm volatile("stnp %0, %1, [%2]" :: "r"(lo), "r"(hi), "r"(dest + done + i) : "memory");
+        }
+    }
+#endif
+    return done;
+}
+
+/* Order non-temporal stores before any later stores */
+static inline void vm_ram_copy_stream_fence(void)
+{
+    asm volatile("dmb ishst" ::: "memory");
+}
@@ -7,6 +7,7 @@
 #include <sel4vm/guest_vcpu_fault.h>
 
 #include "fault.h"
+#include "vgic/vgic.h"
 
 seL4_Word get_vcpu_fault_address(vm_vcpu_t *vcpu)
 {
@@ -57,8 +58,27 @@ void advance_vcpu_fault(vm_vcpu_t *vcpu)
     return;
 }
 
+int vm_complete_fault(vm_vcpu_t *vcpu, seL4_Word data)
+{
+    fault_t *fault = vcpu->vcpu_arch.fault;
+    if (fault_handled(fault)) {
+        ZF_LOGE("Failed to complete fault: vcpu %d has no pending fault", vcpu->vcpu_id);
+        return -1;
+    }
+    if (fault_is_read(fault)) {
+        fault_set_data(fault, data);
+    }
+    advance_fault(fault);
+    return 0;
+}
+
 void restart_vcpu_fault(vm_vcpu_t *vcpu)
 {
     restart_fault(vcpu->vcpu_arch.fault);
     return;
 }
+
+void wait_vcpu_fault(vm_vcpu_t *vcpu)
+{
+    vm_vgic_wait_for_irq(vcpu);
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <autoconf.h>
+#include <sel4vm/gen_config.h>
+
+#include <utils/util.h>
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_irq_controller.h>
+
+#include "guest_vm_benchmark.h"
+#include "vgic/vgic.h"
+
+#ifdef CONFIG_LIB_SEL4VM_BENCHMARKS
+struct vgic_inject_bench {
+    vm_vcpu_t *vcpu;
+    int irq;
+};
+
+static void vgic_bench_ack(vm_vcpu_t *vcpu, int irq, void *cookie)
+{
+}
+
+static int vgic_inject_op(size_t iteration, void *cookie)
+{
+    struct vgic_inject_bench *bench = cookie;
+    return vm_vgic_benchmark_inject(bench->vcpu, bench->irq);
+}
+
+int vm_run_benchmarks_arch(vm_vcpu_t *vcpu, vm_benchmark_params_t *params, vm_benchmark_writer_t *writer)
+{
+    if (params->irq < 0) {
+        return 0;
+    }
+    struct vgic_inject_bench bench = {
+        .vcpu = vcpu,
+        .irq = params->irq
+    };
+    if (vm_register_irq(vcpu, params->irq, vgic_bench_ack, NULL)) {
+        ZF_LOGE("Failed to run vgic benchmark: Unable to register irq %d", params->irq);
+        return -1;
+    }
+    return vm_benchmark_run_op(writer, VM_BENCHMARK_VGIC_INJECT, params->irq, params->iterations, vgic_inject_op,
+                               &bench);
+}
+#endif /* CONFIG_LIB_SEL4VM_BENCHMARKS */
@@ -0,0 +1,26 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <autoconf.h>
+#include <sel4vm/gen_config.h>
+
+#include <sel4vm/guest_vm.h>
+
+#include "guest_vm_exit_stats.h"
+
+#ifdef CONFIG_LIB_SEL4VM_EXIT_STATS
+void vm_exit_stats_dump_arch(vm_vcpu_t *vcpu, vm_exit_stats_writer_t *writer)
+{
+    vm_exit_stats_t *stats = vcpu->exit_stats;
+    for (int i = 0; i < VM_EXIT_STATS_NUM_EXITS; i++) {
+        vm_exit_stats_write_record(writer, VM_EXIT_STATS_RECORD_EXIT, vcpu->vcpu_id, i, &stats->exits[i]);
+    }
+    for (int i = 0; i < VM_EXIT_STATS_NUM_HSR_CLASSES; i++) {
+        vm_exit_stats_write_record(writer, VM_EXIT_STATS_RECORD_FAULT_CLASS, vcpu->vcpu_id, i, &stats->hsr_classes[i]);
+    }
+    vm_exit_stats_write_record(writer, VM_EXIT_STATS_RECORD_NOTIFICATION, vcpu->vcpu_id, 0, &stats->notifications);
+}
+#endif /* CONFIG_LIB_SEL4VM_EXIT_STATS */
@@ -0,0 +1,36 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <autoconf.h>
+#include <stdint.h>
+
+/* Read the virtual counter */
+static inline uint64_t vm_exit_stats_timestamp(void)
+{
+    uint64_t ticks;
+#ifdef CONFIG_ARCH_AARCH64
+    asm volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+#else
+    asm volatile("mrrc p15, 1, %Q0, %R0, c14" : "=r"(ticks));
+#endif
+    return ticks;
+}
+
+/* Frequency of the virtual counter in Hz */
+static inline uint64_t vm_exit_stats_timestamp_freq(void)
+{
+    uint64_t freq;
+#ifdef CONFIG_ARCH_AARCH64
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(freq));
+#else
+    uint32_t freq32;
+    asm volatile("mrc p15, 0, %0, c14, c0, 0" : "=r"(freq32));
+    freq = freq32;
+#endif
+    return freq;
+}
@@ -16,6 +16,8 @@
 #include "mem_abort.h"
 #include "fault.h"
 #include "guest_memory.h"
+#include "guest_mmio_dispatch.h"
+#include "mmio_trace.h"
 
 static int unhandled_memory_fault(vm_t *vm, vm_vcpu_t *vcpu, fault_t *fault)
 {
@@ -31,6 +33,8 @@ static int unhandled_memory_fault(vm_t *vm, vm_vcpu_t *vcpu, fault_t *fault)
         return 0;
     case FAULT_IGNORE:
         return ignore_fault(fault);
+    case FAULT_PENDING:
+        return 0;
     case FAULT_ERROR:
         print_fault(fault);
         abandon_fault(fault);
@@ -47,7 +51,10 @@ int handle_page_fault(vm_t *vm, vm_vcpu_t *vcpu, fault_t *fault)
     uintptr_t addr = fault_get_address(fault);
     size_t fault_size = fault_get_width_size(fault);
 
-    memory_fault_result_t fault_result = vm_memory_handle_fault(vm, vcpu, addr, fault_size);
+    memory_fault_result_t fault_result;
+    if (!vm_mmio_dispatch_fault(vm, vcpu, addr, fault_size, &fault_result)) {
+        fault_result = vm_memory_handle_fault(vm, vcpu, addr, fault_size);
+    }
     switch (fault_result) {
     case FAULT_HANDLED:
         return 0;
@@ -56,6 +63,9 @@ int handle_page_fault(vm_t *vm, vm_vcpu_t *vcpu, fault_t *fault)
         return 0;
     case FAULT_IGNORE:
         return ignore_fault(fault);
+    case FAULT_PENDING:
+        /* The vcpu stays blocked on its saved reply cap until the fault is completed */
+        return 0;
     case FAULT_ERROR:
         print_fault(fault);
         abandon_fault(fault);
@@ -89,7 +99,13 @@ int vm_guest_mem_abort_handler(vm_vcpu_t *vcpu)
         ZF_LOGE("Failed to initialise new fault");
         return -1;
     }
+#ifdef CONFIG_LIB_SEL4VM_MMIO_TRACE
+    vm_mmio_trace_record_t *trace_record = vm_mmio_trace_begin(vcpu, fault);
+#endif
     err = handle_page_fault(vcpu->vm, vcpu, fault);
+#ifdef CONFIG_LIB_SEL4VM_MMIO_TRACE
+    vm_mmio_trace_end(trace_record, fault);
+#endif
     if (err) {
         return VM_EXIT_HANDLE_ERROR;
     }
@@ -8,4 +8,15 @@
 
 #include <sel4vm/guest_vm.h>
 
+#include "fault.h"
+
+/**
+ * Handle a populated memory fault through the VM's memory reservations and unhandled memory fault handler
+ * @param {vm_t *} vm               A handle to the VM
+ * @param {vm_vcpu_t *} vcpu        A handle to the faulting vcpu
+ * @param {fault_t *} fault         The populated fault of the vcpu
+ * @return                          0 on success, -1 if the fault could not be handled
+ */
+int handle_page_fault(vm_t *vm, vm_vcpu_t *vcpu, fault_t *fault);
+
 int vm_guest_mem_abort_handler(vm_vcpu_t *vcpu);
@@ -0,0 +1,193 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <autoconf.h>
+#include <sel4vm/gen_config.h>
+
+#include <inttypes.h>
+#include <stdlib.h>
+
+#include <utils/util.h>
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/arch/guest_mmio_trace.h>
+
+#include "fault.h"
+#include "mem_abort.h"
+#include "mmio_trace.h"
+#include "guest_memory.h"
+#include "guest_vm_exit_stats_arch.h"
+
+#define NSEC_PER_SEC 1000000000ULL
+
+#ifdef CONFIG_LIB_SEL4VM_MMIO_TRACE
+struct vm_mmio_trace {
+    vm_mmio_trace_record_t *records;
+    size_t num_records;
+    size_t count;
+};
+
+vm_mmio_trace_record_t *vm_mmio_trace_begin(vm_vcpu_t *vcpu, fault_t *fault)
+{
+    vm_mmio_trace_t *trace = vcpu->vm->arch.mmio_trace;
+    if (!trace || trace->count == trace->num_records || !fault_is_data(fault)) {
+        return NULL;
+    }
+    vm_mmio_trace_record_t *record = &trace->records[trace->count++];
+    record->addr = fault_get_address(fault);
+    record->width = fault_get_width_size(fault);
+    record->write = fault_is_write(fault) ? 1 : 0;
+    /* Writes have to be loaded before the fault is completed and the vcpu resumes */
+    record->value = record->write ? fault_get_data(fault) : 0;
+    record->vcpu_id = vcpu->vcpu_id;
+    record->reserved = 0;
+    return record;
+}
+
+void vm_mmio_trace_end(vm_mmio_trace_record_t *record, fault_t *fault)
+{
+    if (record && !record->write) {
+        record->value = fault->data;
+    }
+}
+
+/* Find the stats of the reservation at 'addr', adding them if the reservation has none yet */
+static vm_mmio_replay_stats_t *replay_stats_get(vm_mmio_replay_stats_t *stats, size_t max_stats, size_t *num_stats,
+                                                uint64_t addr)
+{
+    for (size_t i = 0; i < *num_stats; i++) {
+        if (stats[i].addr == addr) {
+            return &stats[i];
+        }
+    }
+    if (*num_stats == max_stats) {
+        return NULL;
+    }
+    vm_mmio_replay_stats_t *entry = &stats[(*num_stats)++];
+    *entry = (vm_mmio_replay_stats_t) {
+        .addr = addr
+    };
+    return entry;
+}
+
+static uint64_t replay_ns_per_op(vm_mmio_replay_stats_t *entry, uint64_t freq)
+{
+    /* Split the average to not overflow the conversion of large totals */
+    uint64_t avg = entry->total_ticks / entry->count;
+    uint64_t rem = entry->total_ticks % entry->count;
+    return (avg * NSEC_PER_SEC + rem * NSEC_PER_SEC / entry->count) / freq;
+}
+#endif /* CONFIG_LIB_SEL4VM_MMIO_TRACE */
+
+int vm_mmio_trace_start(vm_t *vm, vm_mmio_trace_record_t *records, size_t num_records)
+{
+#ifdef CONFIG_LIB_SEL4VM_MMIO_TRACE
+    if (!vm || !records || !num_records) {
+        ZF_LOGE("Failed to start MMIO trace: Invalid vm or record buffer");
+        return -1;
+    }
+    if (vm->arch.mmio_trace) {
+        ZF_LOGE("Failed to start MMIO trace: Already recording");
+        return -1;
+    }
+    vm_mmio_trace_t *trace = calloc(1, sizeof(vm_mmio_trace_t));
+    if (!trace) {
+        ZF_LOGE("Failed to start MMIO trace: Unable to allocate trace");
+        return -1;
+    }
+    trace->records = records;
+    trace->num_records = num_records;
+    vm->arch.mmio_trace = trace;
+    return 0;
+#else
+    ZF_LOGE("Failed to start MMIO trace: MMIO tracing not enabled");
+    return -1;
+#endif
+}
+
+int vm_mmio_trace_stop(vm_t *vm, size_t *num_recorded)
+{
+#ifdef CONFIG_LIB_SEL4VM_MMIO_TRACE
+    if (!vm || !vm->arch.mmio_trace || !num_recorded) {
+        ZF_LOGE("Failed to stop MMIO trace: Invalid vm or not recording");
+        return -1;
+    }
+    *num_recorded = vm->arch.mmio_trace->count;
+    free(vm->arch.mmio_trace);
+    vm->arch.mmio_trace = NULL;
+    return 0;
+#else
+    ZF_LOGE("Failed to stop MMIO trace: MMIO tracing not enabled");
+    return -1;
+#endif
+}
+
+int vm_mmio_trace_replay(vm_t *vm, const vm_mmio_trace_record_t *records, size_t num_records,
+                         vm_mmio_replay_stats_t *stats, size_t max_stats, size_t *num_stats)
+{
+#ifdef CONFIG_LIB_SEL4VM_MMIO_TRACE
+    if (!vm || (num_records && !records) || !num_stats) {
+        ZF_LOGE("Failed to replay MMIO trace: Invalid vm or buffers");
+        return -1;
+    }
+    if (vm->arch.mmio_trace) {
+        ZF_LOGE("Failed to replay MMIO trace: Recording is active");
+        return -1;
+    }
+    *num_stats = 0;
+    for (size_t i = 0; i < num_records; i++) {
+        const vm_mmio_trace_record_t *record = &records[i];
+        if (record->vcpu_id >= vm->num_vcpus) {
+            ZF_LOGE("Failed to replay MMIO trace: Invalid vcpu %d in record %zu", record->vcpu_id, i);
+            return -1;
+        }
+        vm_vcpu_t *vcpu = vm->vcpus[record->vcpu_id];
+        fault_t *fault = vcpu->vcpu_arch.fault;
+        if (!fault_handled(fault)) {
+            ZF_LOGE("Failed to replay MMIO trace: vcpu %d has a pending fault", record->vcpu_id);
+            return -1;
+        }
+
+        uintptr_t base;
+        if (vm_memory_reservation_base(vm, record->addr, &base)) {
+            base = PAGE_ALIGN_4K(record->addr);
+        }
+        vm_mmio_replay_stats_t *entry = replay_stats_get(stats, max_stats, num_stats, base);
+        if (!entry) {
+            ZF_LOGE("Failed to replay MMIO trace: Too many reservations for the stats buffer");
+            return -1;
+        }
+
+        if (new_replay_fault(fault, record->addr, record->width, record->write, record->value)) {
+            ZF_LOGE("Failed to replay MMIO trace: Invalid record %zu", i);
+            return -1;
+        }
+        uint64_t start = vm_exit_stats_timestamp();
+        int err = handle_page_fault(vm, vcpu, fault);
+        uint64_t ticks = vm_exit_stats_timestamp() - start;
+        if (!fault_handled(fault)) {
+            /* Release faults abandoned, or left pending for later completion, by the handler */
+            restart_fault(fault);
+        }
+        if (err) {
+            ZF_LOGE("Failed to replay MMIO trace: Record %zu at 0x%"PRIx64" not handled", i, record->addr);
+            return -1;
+        }
+        entry->count++;
+        entry->total_ticks += ticks;
+        entry->max_ticks = MAX(entry->max_ticks, ticks);
+    }
+
+    uint64_t freq = vm_exit_stats_timestamp_freq();
+    for (size_t i = 0; i < *num_stats; i++) {
+        stats[i].ns_per_op = freq ? replay_ns_per_op(&stats[i], freq) : 0;
+    }
+    return 0;
+#else
+    ZF_LOGE("Failed to replay MMIO trace: MMIO tracing not enabled");
+    return -1;
+#endif
+}
@@ -0,0 +1,34 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <autoconf.h>
+#include <sel4vm/gen_config.h>
+
+#include <sel4vm/guest_vm.h>
+
+#include "fault.h"
+
+#ifdef CONFIG_LIB_SEL4VM_MMIO_TRACE
+#include <sel4vm/arch/guest_mmio_trace.h>
+
+/**
+ * Record a data fault about to be handled in the MMIO trace of its VM. The
+ * data of write faults is loaded for the record
+ * @param {vm_vcpu_t *} vcpu        A handle to the faulting vcpu
+ * @param {fault_t *} fault         The populated fault of the vcpu
+ * @return                          The record of the fault, NULL if it is not recorded
+ */
+vm_mmio_trace_record_t *vm_mmio_trace_begin(vm_vcpu_t *vcpu, fault_t *fault);
+
+/**
+ * Complete the record of a handled fault with the data returned to the guest by reads
+ * @param {vm_mmio_trace_record_t *} record     The record returned by vm_mmio_trace_begin
+ * @param {fault_t *} fault                     The handled fault
+ */
+void vm_mmio_trace_end(vm_mmio_trace_record_t *record, fault_t *fault);
+#endif /* CONFIG_LIB_SEL4VM_MMIO_TRACE */
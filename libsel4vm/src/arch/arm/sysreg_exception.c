@@ -0,0 +1,60 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <autoconf.h>
+#include <sel4vm/gen_config.h>
+
+#include <sel4/sel4.h>
+#include <utils/util.h>
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/sel4_arch/processor.h>
+
+#include "vm.h"
+#include "fault.h"
+#include "sysreg_exception.h"
+#include "vgic/vgic.h"
+
+/* ISS of a trapped MSR, MRS or system instruction (ESR_EL2.EC 0x18) */
+#define SYSREG_ISS_DIR_READ     BIT(0)
+#define SYSREG_ISS_RT(iss)      (((iss) >> 5) & 0x1f)
+/* ISS bits identifying the accessed register, all but Rt and the direction */
+#define SYSREG_ISS_REG_MASK     0x3ffc1e
+#define SYSREG(op0, op1, crn, crm, op2) \
+    (((op0) << 20) | ((op2) << 17) | ((op1) << 14) | ((crn) << 10) | ((crm) << 1))
+
+#define SYSREG_ICC_SGI1R_EL1    SYSREG(3, 0, 12, 11, 5)
+
+int vm_sysreg_handler(vm_vcpu_t *vcpu, uint32_t hsr)
+{
+    uint32_t iss = hsr & HSR_ISS_MASK;
+
+    switch (iss & SYSREG_ISS_REG_MASK) {
+#if defined(CONFIG_ARM_GIC_V3_SUPPORT) && defined(CONFIG_ARCH_AARCH64)
+    case SYSREG_ICC_SGI1R_EL1: {
+        fault_t *fault = vcpu->vcpu_arch.fault;
+        if (iss & SYSREG_ISS_DIR_READ) {
+            /* Write only */
+            break;
+        }
+        if (new_vcpu_fault(fault, hsr)) {
+            ZF_LOGE("Failed to create new fault");
+            return VM_EXIT_HANDLE_ERROR;
+        }
+        /* Only the source register is read, Rt 31 is the zero register */
+        int rt = SYSREG_ISS_RT(iss);
+        vm_vgic_sgi1r_write(vcpu, rt == 31 ? 0 : fault_get_ctx_reg(fault, FAULT_CTX_REG(x0) + rt));
+        if (ignore_fault(fault)) {
+            return VM_EXIT_HANDLE_ERROR;
+        }
+        return VM_EXIT_HANDLED;
+    }
+#endif
+    default:
+        break;
+    }
+    return VM_EXIT_UNHANDLED;
+}
@@ -0,0 +1,19 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <sel4vm/guest_vm.h>
+
+/**
+ * Handle a trapped MSR, MRS or system instruction of a vcpu. Only registers emulated by the VMM are handled, others
+ * are left to the unhandled vcpu fault callback
+ * @param {vm_vcpu_t *} vcpu        A handle to the vcpu
+ * @param {uint32_t} hsr            HSR value of the vcpu fault
+ * @return                          VM_EXIT_HANDLED if the access was emulated, VM_EXIT_UNHANDLED if it is left to the
+ *                                  unhandled vcpu fault callback, VM_EXIT_HANDLE_ERROR on error
+ */
+int vm_sysreg_handler(vm_vcpu_t *vcpu, uint32_t hsr);
@@ -0,0 +1,176 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <autoconf.h>
+#include <sel4vm/gen_config.h>
+
+#include <stdlib.h>
+
+#include <sel4/sel4.h>
+#include <sel4utils/thread.h>
+#include <simple/simple.h>
+#include <vka/object.h>
+#include <vka/capops.h>
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/boot.h>
+
+#include "arm_vm.h"
+#include "vcpu_thread.h"
+#include "vm_lock.h"
+
+#ifdef CONFIG_LIB_SEL4VM_VCPU_THREADS
+struct vm_vmm_lock {
+    vm_lock_t lock;
+};
+
+struct vm_vcpu_thread {
+    /* VMM thread handling the faults of the vcpu */
+    sel4utils_thread_t thread;
+    /* Endpoint the faults of the vcpu are delivered to */
+    vka_object_t fault_endpoint;
+    /* Copy of the host endpoint with the vcpu's badge, used to report a failure of the thread */
+    seL4_CPtr host_endpoint;
+    bool started;
+};
+
+int vm_vcpu_threads_init(vm_t *vm)
+{
+    vm->arch.vmm_lock = calloc(1, sizeof(vm_vmm_lock_t));
+    if (!vm->arch.vmm_lock) {
+        ZF_LOGE("Failed to initialise vcpu threads: Unable to allocate vmm lock");
+        return -1;
+    }
+    return 0;
+}
+
+int vm_vcpu_thread_create(vm_vcpu_t *vcpu)
+{
+    int err;
+    vm_t *vm = vcpu->vm;
+    cspacepath_t src, dst;
+    vm_vcpu_thread_t *vcpu_thread = calloc(1, sizeof(vm_vcpu_thread_t));
+    if (!vcpu_thread) {
+        ZF_LOGE("Failed to create vcpu thread: Unable to allocate thread");
+        return -1;
+    }
+    err = vka_alloc_endpoint(vm->vka, &vcpu_thread->fault_endpoint);
+    if (err) {
+        ZF_LOGE("Failed to create vcpu thread: Unable to allocate fault endpoint");
+        free(vcpu_thread);
+        return -1;
+    }
+    vka_cspace_make_path(vm->vka, vm->host_endpoint, &src);
+    err = vka_cspace_alloc_path(vm->vka, &dst);
+    if (err) {
+        ZF_LOGE("Failed to create vcpu thread: Unable to allocate host endpoint slot");
+        return -1;
+    }
+    err = vka_cnode_mint(&dst, &src, seL4_AllRights, VCPU_BADGE_CREATE((seL4_Word)vcpu->vcpu_id));
+    if (err) {
+        ZF_LOGE("Failed to create vcpu thread: Unable to mint host endpoint");
+        return -1;
+    }
+    vcpu_thread->host_endpoint = dst.capPtr;
+    err = sel4utils_configure_thread(vm->vka, &vm->mem.vmm_vspace, &vm->mem.vmm_vspace, seL4_CapNull,
+                                     simple_get_cnode(vm->simple), seL4_NilData, &vcpu_thread->thread);
+    if (err) {
+        ZF_LOGE("Failed to create vcpu thread: Unable to configure thread");
+        return -1;
+    }
+    /* The VMM thread must preempt the vcpu it serves when they share a core */
+    int priority = MIN(vcpu->tcb.priority + 1, seL4_MaxPrio);
+    err = seL4_TCB_SetSchedParams(vcpu_thread->thread.tcb.cptr, simple_get_tcb(vm->simple), priority, priority);
+    if (err) {
+        ZF_LOGE("Failed to create vcpu thread: Unable to set priority");
+        return -1;
+    }
+#if CONFIG_MAX_NUM_NODES > 1
+    /* Pin the thread next to the vcpu */
+    err = seL4_TCB_SetAffinity(vcpu_thread->thread.tcb.cptr, vcpu->vcpu_id);
+    if (err) {
+        ZF_LOGE("Failed to create vcpu thread: Unable to set affinity");
+        return -1;
+    }
+#endif /* CONFIG_MAX_NUM_NODES > 1 */
+    vcpu->vcpu_arch.vcpu_thread = vcpu_thread;
+    return 0;
+}
+
+seL4_CPtr vm_vcpu_fault_endpoint(vm_vcpu_t *vcpu)
+{
+    if (vcpu->vcpu_arch.vcpu_thread) {
+        return vcpu->vcpu_arch.vcpu_thread->fault_endpoint.cptr;
+    }
+    return vcpu->vm->host_endpoint;
+}
+
+int vm_vcpu_threads_start(vm_t *vm, sel4utils_thread_entry_fn entry)
+{
+    for (int i = 0; i < vm->num_vcpus; i++) {
+        vm_vcpu_t *vcpu = vm->vcpus[i];
+        vm_vcpu_thread_t *vcpu_thread = vcpu->vcpu_arch.vcpu_thread;
+        if (!vcpu_thread || vcpu_thread->started) {
+            continue;
+        }
+        int err = sel4utils_start_thread(&vcpu_thread->thread, entry, vcpu, NULL, 1);
+        if (err) {
+            ZF_LOGE("Failed to start vcpu thread: Unable to start thread of vcpu %d", vcpu->vcpu_id);
+            return -1;
+        }
+        vcpu_thread->started = true;
+    }
+    return 0;
+}
+
+void vm_vcpu_threads_stop(vm_t *vm)
+{
+    for (int i = 0; i < vm->num_vcpus; i++) {
+        vm_vcpu_thread_t *vcpu_thread = vm->vcpus[i]->vcpu_arch.vcpu_thread;
+        if (vcpu_thread && vcpu_thread->started) {
+            seL4_TCB_Suspend(vcpu_thread->thread.tcb.cptr);
+            vcpu_thread->started = false;
+        }
+    }
+}
+
+void vm_vcpu_thread_destroy(vm_vcpu_t *vcpu)
+{
+    vm_t *vm = vcpu->vm;
+    vm_vcpu_thread_t *vcpu_thread = vcpu->vcpu_arch.vcpu_thread;
+    cspacepath_t path;
+    if (!vcpu_thread) {
+        return;
+    }
+    sel4utils_clean_up_thread(vm->vka, &vm->mem.vmm_vspace, &vcpu_thread->thread);
+    vka_cspace_make_path(vm->vka, vcpu_thread->host_endpoint, &path);
+    vka_cnode_delete(&path);
+    vka_cspace_free(vm->vka, vcpu_thread->host_endpoint);
+    vka_free_object(vm->vka, &vcpu_thread->fault_endpoint);
+    free(vcpu_thread);
+    vcpu->vcpu_arch.vcpu_thread = NULL;
+}
+
+void vm_vcpu_thread_exit(vm_vcpu_t *vcpu)
+{
+    vm_vcpu_thread_t *vcpu_thread = vcpu->vcpu_arch.vcpu_thread;
+    /* Faults of secondary vcpus are never delivered to the host endpoint, a message with the vcpu's badge
+     * tells the thread calling vm_run that the vcpu's thread has stopped */
+    seL4_Send(vcpu_thread->host_endpoint, seL4_MessageInfo_new(0, 0, 0, 0));
+    seL4_TCB_Suspend(vcpu_thread->thread.tcb.cptr);
+    ZF_LOGF("vcpu thread resumed after exiting");
+}
+
+void vm_vmm_lock(vm_t *vm)
+{
+    vm_lock_acquire(&vm->arch.vmm_lock->lock);
+}
+
+void vm_vmm_unlock(vm_t *vm)
+{
+    vm_lock_release(&vm->arch.vmm_lock->lock);
+}
+#endif /* CONFIG_LIB_SEL4VM_VCPU_THREADS */
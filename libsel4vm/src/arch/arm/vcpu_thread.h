@@ -0,0 +1,94 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <autoconf.h>
+#include <sel4vm/gen_config.h>
+
+#include <sel4/sel4.h>
+#include <sel4utils/thread.h>
+
+#include <sel4vm/guest_vm.h>
+
+/*
+ * With CONFIG_LIB_SEL4VM_VCPU_THREADS the faults of every secondary vcpu are delivered to their own endpoint and
+ * handled by a dedicated VMM thread, pinned to the same core as the vcpu. The boot vcpu's faults and all host
+ * notifications are still handled by the thread calling vm_run. Exits touching state shared between vcpus (guest
+ * memory, memory reservations and the device callbacks behind them, notification callbacks) are serialised by the
+ * VMM lock, while vcpu local exits such as virtual PPIs only take the vGIC lock. Without
+ * CONFIG_LIB_SEL4VM_VCPU_THREADS the VMM lock is a no-op.
+ */
+
+#ifdef CONFIG_LIB_SEL4VM_VCPU_THREADS
+/**
+ * Initialise the VMM lock of a VM
+ * @param {vm_t *} vm               A handle to the VM
+ * @return                          0 on success, -1 on error
+ */
+int vm_vcpu_threads_init(vm_t *vm);
+
+/**
+ * Create the fault endpoint and VMM thread of a secondary vcpu. The thread is not started
+ * @param {vm_vcpu_t *} vcpu        A handle to the vcpu
+ * @return                          0 on success, -1 on error
+ */
+int vm_vcpu_thread_create(vm_vcpu_t *vcpu);
+
+/**
+ * Get the endpoint the faults of a vcpu are delivered to
+ * @param {vm_vcpu_t *} vcpu        A handle to the vcpu
+ * @return                          Endpoint capability, the VM's host endpoint for the boot vcpu
+ */
+seL4_CPtr vm_vcpu_fault_endpoint(vm_vcpu_t *vcpu);
+
+/**
+ * Start the VMM threads of all secondary vcpus
+ * @param {vm_t *} vm                           A handle to the VM
+ * @param {sel4utils_thread_entry_fn} entry     Entry point of the threads, invoked with the vcpu as its first argument
+ * @return                                      0 on success, -1 on error
+ */
+int vm_vcpu_threads_start(vm_t *vm, sel4utils_thread_entry_fn entry);
+
+/**
+ * Stop the VMM threads of all secondary vcpus
+ * @param {vm_t *} vm               A handle to the VM
+ */
+void vm_vcpu_threads_stop(vm_t *vm);
+
+/**
+ * Destroy the VMM thread of a vcpu, freeing the objects it was created with. The thread must have been stopped
+ * @param {vm_vcpu_t *} vcpu        A handle to the vcpu
+ */
+void vm_vcpu_thread_destroy(vm_vcpu_t *vcpu);
+
+/**
+ * Exit the VMM thread of a vcpu after it failed to handle a fault, having the thread calling vm_run stop the VM.
+ * This does not return
+ * @param {vm_vcpu_t *} vcpu        A handle to the vcpu
+ */
+void vm_vcpu_thread_exit(vm_vcpu_t *vcpu);
+
+/**
+ * Acquire the VMM lock of a VM
+ * @param {vm_t *} vm               A handle to the VM
+ */
+void vm_vmm_lock(vm_t *vm);
+
+/**
+ * Release the VMM lock of a VM
+ * @param {vm_t *} vm               A handle to the VM
+ */
+void vm_vmm_unlock(vm_t *vm);
+#else
+static inline void vm_vmm_lock(vm_t *vm)
+{
+}
+
+static inline void vm_vmm_unlock(vm_t *vm)
+{
+}
+#endif /* CONFIG_LIB_SEL4VM_VCPU_THREADS */
@@ -50,10 +50,17 @@
 #include <sel4vm/guest_memory.h>
 #include <sel4vm/guest_irq_controller.h>
 #include <sel4vm/guest_vm_util.h>
+#include <sel4vm/guest_vm_exit_stats.h>
 
 #include "vgicv2_defs.h"
+#ifdef CONFIG_ARM_GIC_V3_SUPPORT
+#include "vgicv3_defs.h"
+#endif
 #include "vm.h"
+#include "vm_lock.h"
 #include "../fault.h"
+#include "../wfx.h"
+#include "guest_vm_event_trace.h"
 
 //#define DEBUG_IRQ
 //#define DEBUG_DIST
@@ -72,6 +79,19 @@
 
 
 /* FIXME these should be defined in a way that is friendlier to extension. */
+#ifdef CONFIG_ARM_GIC_V3_SUPPORT
+
+#if defined(CONFIG_PLAT_QEMU_ARM_VIRT)
+#define GIC_DIST_PADDR       0x8000000
+#define GIC_REDIST_PADDR     0x80A0000
+#else
+#error "Unsupported platform for GICv3"
+#endif
+
+#define GIC_DIST_SIZE        0x10000
+
+#else
+
 #if defined(CONFIG_PLAT_EXYNOS5)
 #define GIC_PADDR   0x10480000
 #elif defined(CONFIG_PLAT_TK1) || defined(CONFIG_PLAT_TX1)
@@ -98,10 +118,16 @@
 #define GIC_VCPU_PADDR       (GIC_PADDR + 0x6000)
 #endif
 
-#define MAX_VIRQS   200
+#define GIC_DIST_SIZE        0x1000
+
+#endif /* CONFIG_ARM_GIC_V3_SUPPORT */
+
 #define NUM_SGI_VIRQS   16
 #define NUM_PPI_VIRQS   16
 #define GIC_SPI_IRQ_MIN      NUM_SGI_VIRQS + NUM_PPI_VIRQS
+/* INTIDs from 1020 are special */
+#define GIC_SPI_IRQ_MAX      1019
+#define NUM_SPI_VIRQS        (GIC_SPI_IRQ_MAX - GIC_SPI_IRQ_MIN + 1)
 
 /* GIC Distributor register access utilities */
 #define GIC_DIST_REGN(offset, reg) ((offset-reg)/sizeof(uint32_t))
@@ -151,7 +177,7 @@ struct gic_dist_map {
     uint32_t active0[CONFIG_MAX_NUM_NODES];             /* [0x300, 0x304) */
     uint32_t active[31];                                /* [0x300, 0x380) */
     uint32_t active_clr0[CONFIG_MAX_NUM_NODES];         /* [0x380, 0x384) */
-    uint32_t active_clr[32];                            /* [0x384, 0x400) */
+    uint32_t active_clr[31];                            /* [0x384, 0x400) */
     uint32_t priority0[CONFIG_MAX_NUM_NODES][8];        /* [0x400, 0x420) */
     uint32_t priority[247];                             /* [0x420, 0x7FC) */
     uint32_t res3;                                      /* 0x7FC */
@@ -176,35 +202,106 @@ struct gic_dist_map {
 
     uint32_t sgi_pending_clr[CONFIG_MAX_NUM_NODES][4];  /* [0xF10, 0xF20) */
     uint32_t sgi_pending_set[CONFIG_MAX_NUM_NODES][4];  /* [0xF20, 0xF30) */
-    uint32_t res10[40];                                 /* [0xF30, 0xFC0) */
+    uint32_t res10[36];                                 /* [0xF30, 0xFC0) */
 
     uint32_t periph_id[12];                             /* [0xFC0, 0xFF0) */
     uint32_t component_id[4];                           /* [0xFF0, 0xFFF] */
 };
 
+#ifdef CONFIG_LIB_SEL4VM_VGIC_DIST_SHADOW
+/* The distributor state is mapped read-only into the guest as its register map */
+compile_time_assert(gic_dist_map_is_register_map, sizeof(struct gic_dist_map) == PAGE_SIZE_4K);
+#endif
+
 #define MAX_LR_OVERFLOW 64
-#define LR_OF_NEXT(_i) (((_i) == MAX_LR_OVERFLOW - 1) ? 0 : ((_i) + 1))
+/* GICH_VTR.ListRegs is 6 bits, so there are at most 64 list registers */
+#define MAX_LIST_REGS 64
+#define LR_BIT(lr) (1ULL << (lr))
+
+#ifdef CONFIG_LIB_SEL4VM_VTIMER_FAST_PATH
+/* List register reserved for the virtual timer PPI, which is masked by seL4 until it is acked */
+#define VTIMER_LR 0
+#define LR_RESERVED LR_BIT(VTIMER_LR)
+#else
+#define LR_RESERVED 0ULL
+#endif
 
+struct lr_of_entry {
+    struct virq_handle *irq;
+    uint8_t priority;
+    uint64_t seq;
+};
+
+/* Binary min-heap of the irqs waiting for a list register, ordered by priority and then by arrival */
 struct lr_of {
-    struct virq_handle irqs[MAX_LR_OVERFLOW]; /* circular buffer */
-    size_t head;
-    size_t tail;
-    bool full;
+    struct lr_of_entry *irqs;
+    int num_irqs;
+    int size;
+    uint64_t next_seq;
+};
+
+#if CONFIG_LIB_SEL4VM_HOST_DRAIN_BATCH > 0
+struct vgic_batch_irq {
+    vm_vcpu_t *vcpu;
+    struct virq_handle *irq;
+};
+
+struct vgic_batch {
+    /* Thread that opened the batch, NULL if no batch is open */
+    void *owner;
+    int num_irqs;
+    struct vgic_batch_irq irqs[MAX_LR_OVERFLOW];
 };
+#endif
 
 typedef struct vgic {
 /// Mirrors the vcpu list registers
-    struct virq_handle *irq[CONFIG_MAX_NUM_NODES][MAX_LR_OVERFLOW - 1];
+    struct virq_handle *irq[CONFIG_MAX_NUM_NODES][MAX_LIST_REGS];
+/// Bitmap of the list registers in use by each vcpu
+    uint64_t lr_used[CONFIG_MAX_NUM_NODES];
+/// Bitmap of the list registers implemented by the hardware. GICH_VTR is only visible to the kernel,
+/// so the bitmap is narrowed the first time the kernel rejects an injection into a list register
+    uint64_t lr_valid;
 /// IRQs that would not fit in the vcpu list registers
     struct lr_of lr_overflow[CONFIG_MAX_NUM_NODES];
 /// Complete set of virtual irqs
     struct virq_handle *sgi_ppi_irq[CONFIG_MAX_NUM_NODES][NUM_SGI_VIRQS + NUM_PPI_VIRQS];
-    struct virq_handle *virqs[MAX_VIRQS];
+    struct virq_handle *virqs[NUM_SPI_VIRQS];
 /// Virtual distributer registers
     struct gic_dist_map *dist;
+#ifdef CONFIG_LIB_SEL4VM_VGIC_DIST_SHADOW
+/// Frame backing the distributor registers, mapped read-only into the guest
+    vka_object_t dist_shadow;
+#endif
+#ifdef CONFIG_ARM_GIC_V3_SUPPORT
+/// Affinity routing of the SPIs, GICD_IROUTER<n>
+    uint64_t irouter[NUM_SPI_VIRQS];
+/// Power management state of the redistributors, GICR_WAKER
+    uint32_t redist_waker[CONFIG_MAX_NUM_NODES];
+#endif
+/// Serialises access to the distributor and list register state between VMM threads
+    vm_lock_t lock;
+#if CONFIG_LIB_SEL4VM_HOST_DRAIN_BATCH > 0
+/// Injections deferred until the end of a batch, see vm_vgic_batch_begin
+    struct vgic_batch batch;
+#endif
 } vgic_t;
 
-static struct vgic_dist_device *vgic_dist;
+static int vgic_vcpu_inject_irq_lr(vgic_t *vgic, vm_vcpu_t *inject_vcpu, struct virq_handle *irq);
+
+static inline void vgic_lock(vgic_t *vgic)
+{
+#ifdef CONFIG_LIB_SEL4VM_VCPU_THREADS
+    vm_lock_acquire(&vgic->lock);
+#endif
+}
+
+static inline void vgic_unlock(vgic_t *vgic)
+{
+#ifdef CONFIG_LIB_SEL4VM_VCPU_THREADS
+    vm_lock_release(&vgic->lock);
+#endif
+}
 
 static struct virq_handle *virq_get_sgi_ppi(vgic_t *vgic, vm_vcpu_t *vcpu, int virq)
 {
@@ -214,13 +311,10 @@ static struct virq_handle *virq_get_sgi_ppi(vgic_t *vgic, vm_vcpu_t *vcpu, int v
 
 static struct virq_handle *virq_find_spi_irq_data(struct vgic *vgic, int virq)
 {
-    int i;
-    for (i = 0; i < MAX_VIRQS; i++) {
-        if (vgic->virqs[i] && vgic->virqs[i]->virq == virq) {
-            return vgic->virqs[i];
-        }
+    if (virq > GIC_SPI_IRQ_MAX) {
+        return NULL;
     }
-    return NULL;
+    return vgic->virqs[virq - GIC_SPI_IRQ_MIN];
 }
 
 static struct virq_handle *virq_find_irq_data(struct vgic *vgic, vm_vcpu_t *vcpu, int virq)
@@ -233,14 +327,16 @@ static struct virq_handle *virq_find_irq_data(struct vgic *vgic, vm_vcpu_t *vcpu
 
 static int virq_spi_add(vgic_t *vgic, struct virq_handle *virq_data)
 {
-    int i;
-    for (i = 0; i < MAX_VIRQS; i++) {
-        if (vgic->virqs[i] == NULL) {
-            vgic->virqs[i] = virq_data;
-            return 0;
-        }
+    if (virq_data->virq > GIC_SPI_IRQ_MAX) {
+        ZF_LOGE("VIRQ %d is not a valid SPI\n", virq_data->virq);
+        return -1;
     }
-    return -1;
+    if (vgic->virqs[virq_data->virq - GIC_SPI_IRQ_MIN] != NULL) {
+        ZF_LOGE("VIRQ %d already registered\n", virq_data->virq);
+        return -1;
+    }
+    vgic->virqs[virq_data->virq - GIC_SPI_IRQ_MIN] = virq_data;
+    return 0;
 }
 
 static int virq_sgi_ppi_add(vm_vcpu_t *vcpu, vgic_t *vgic, struct virq_handle *virq_data)
@@ -267,11 +363,13 @@ static int vgic_virq_init(vgic_t *vgic)
     memset(vgic->virqs, 0, sizeof(vgic->virqs));
     for (int i = 0; i < CONFIG_MAX_NUM_NODES; i++) {
         memset(vgic->irq[i], 0, sizeof(vgic->irq[i]));
-        vgic->lr_overflow[i].head = 0;
-        vgic->lr_overflow[i].tail = 0;
-        vgic->lr_overflow[i].full = false;
-        memset(vgic->lr_overflow[i].irqs, 0, sizeof(vgic->lr_overflow[i].irqs));
+        vgic->lr_used[i] = 0;
+        vgic->lr_overflow[i].irqs = NULL;
+        vgic->lr_overflow[i].num_irqs = 0;
+        vgic->lr_overflow[i].size = 0;
+        vgic->lr_overflow[i].next_seq = 0;
     }
+    vgic->lr_valid = ~0ULL;
     return 0;
 }
 
@@ -450,77 +548,178 @@ static inline int is_active(struct gic_dist_map *gic_dist, int irq, int vcpu_id)
     return is_spi_active(gic_dist, irq, vcpu_id);
 }
 
-static inline int vgic_add_overflow_cpu(struct lr_of *lr_overflow, struct virq_handle *irq)
+static inline uint8_t get_priority(struct gic_dist_map *gic_dist, int irq, int vcpu_id)
 {
-    /* Add to overflow list */
-    int idx = lr_overflow->tail;
-    if (unlikely(lr_overflow->full)) {
-        ZF_LOGF("too many overflow irqs");
-        return -1;
+    uint32_t reg;
+    if (irq < GIC_SPI_IRQ_MIN) {
+        reg = gic_dist->priority0[vcpu_id][irq / 4];
+    } else {
+        reg = gic_dist->priority[(irq - GIC_SPI_IRQ_MIN) / 4];
     }
+    return reg >> ((irq % 4) * 8);
+}
 
-    lr_overflow->irqs[idx] = *irq;
-    lr_overflow->full = (lr_overflow->head == LR_OF_NEXT(lr_overflow->tail));
-    if (!lr_overflow->full) {
-        lr_overflow->tail = LR_OF_NEXT(idx);
+static inline bool lr_of_before(struct lr_of_entry *a, struct lr_of_entry *b)
+{
+    return a->priority < b->priority || (a->priority == b->priority && a->seq < b->seq);
+}
+
+static inline void lr_of_swap(struct lr_of *lr_overflow, int a, int b)
+{
+    struct lr_of_entry tmp = lr_overflow->irqs[a];
+    lr_overflow->irqs[a] = lr_overflow->irqs[b];
+    lr_overflow->irqs[b] = tmp;
+}
+
+static int vgic_add_overflow(vgic_t *vgic, struct virq_handle *irq, vm_vcpu_t *vcpu)
+{
+    struct lr_of *lr_overflow = &vgic->lr_overflow[vcpu->vcpu_id];
+    if (unlikely(lr_overflow->num_irqs == lr_overflow->size)) {
+        int size = lr_overflow->size ? lr_overflow->size * 2 : MAX_LR_OVERFLOW;
+        struct lr_of_entry *irqs = realloc(lr_overflow->irqs, size * sizeof(*irqs));
+        if (!irqs) {
+            ZF_LOGE("Failed to grow overflow list of vcpu %d: IRQ %d dropped", vcpu->vcpu_id, irq->virq);
+            return -1;
+        }
+        lr_overflow->irqs = irqs;
+        lr_overflow->size = size;
+    }
+    /* Lower GICD_IPRIORITYR values are higher priorities */
+    int i = lr_overflow->num_irqs++;
+    lr_overflow->irqs[i] = (struct lr_of_entry) {
+        .irq = irq,
+        .priority = get_priority(vgic->dist, irq->virq, vcpu->vcpu_id),
+        .seq = lr_overflow->next_seq++
+    };
+    while (i > 0 && lr_of_before(&lr_overflow->irqs[i], &lr_overflow->irqs[(i - 1) / 2])) {
+        lr_of_swap(lr_overflow, i, (i - 1) / 2);
+        i = (i - 1) / 2;
     }
     return 0;
 }
 
-static inline int vgic_add_overflow(vgic_t *vgic, struct virq_handle *irq, vm_vcpu_t *vcpu)
+static void lr_of_pop(struct lr_of *lr_overflow)
 {
-    return vgic_add_overflow_cpu(&vgic->lr_overflow[vcpu->vcpu_id], irq);
+    int i = 0;
+    lr_overflow->irqs[0] = lr_overflow->irqs[--lr_overflow->num_irqs];
+    while (true) {
+        int first = i;
+        int left = 2 * i + 1;
+        int right = 2 * i + 2;
+        if (left < lr_overflow->num_irqs && lr_of_before(&lr_overflow->irqs[left], &lr_overflow->irqs[first])) {
+            first = left;
+        }
+        if (right < lr_overflow->num_irqs && lr_of_before(&lr_overflow->irqs[right], &lr_overflow->irqs[first])) {
+            first = right;
+        }
+        if (first == i) {
+            break;
+        }
+        lr_of_swap(lr_overflow, i, first);
+        i = first;
+    }
 }
 
-static inline void vgic_handle_overflow_cpu(vgic_t *vgic, struct lr_of *lr_overflow, vm_vcpu_t *vcpu)
+/* Move overflowed irqs into the free list registers, highest priority first */
+static inline void vgic_handle_overflow(vgic_t *vgic, vm_vcpu_t *vcpu)
 {
-    /* copy tail, as vgic_vcpu_inject_irq can mutate it, and we do
-     * not want to process any new overflow irqs */
-    size_t tail = lr_overflow->tail;
-    for (size_t i = lr_overflow->head; i != tail; i = LR_OF_NEXT(i)) {
-        if (vgic_vcpu_inject_irq(vgic_dist, vcpu, &lr_overflow->irqs[i]) == 0) {
-            lr_overflow->head = LR_OF_NEXT(i);
-            lr_overflow->full = (lr_overflow->head == LR_OF_NEXT(lr_overflow->tail));
-        } else {
+    struct lr_of *lr_overflow = &vgic->lr_overflow[vcpu->vcpu_id];
+    while (lr_overflow->num_irqs > 0) {
+        if (vgic_vcpu_inject_irq_lr(vgic, vcpu, lr_overflow->irqs[0].irq)) {
             break;
         }
+        lr_of_pop(lr_overflow);
     }
 }
 
-static inline void vgic_handle_overflow(vgic_t *vgic, vm_vcpu_t *vcpu)
+/* Inject an interrupt into the lowest free list register. Returns -1 if none is free */
+static int vgic_vcpu_inject_irq_lr(vgic_t *vgic, vm_vcpu_t *inject_vcpu, struct virq_handle *irq)
 {
-    vgic_handle_overflow_cpu(vgic, &vgic->lr_overflow[vcpu->vcpu_id], vcpu);
+    int vcpu_id = inject_vcpu->vcpu_id;
+    uint64_t lr_free = ~(vgic->lr_used[vcpu_id] | LR_RESERVED) & vgic->lr_valid;
+    while (lr_free) {
+        int lr = CTZLL(lr_free);
+        seL4_Error err = seL4_ARM_VCPU_InjectIRQ(inject_vcpu->vcpu.cptr, irq->virq, 0, 0, lr);
+        if (err == seL4_NoError) {
+            /* Shadow */
+            vgic->irq[vcpu_id][lr] = irq;
+            vgic->lr_used[vcpu_id] |= LR_BIT(lr);
+            return 0;
+        }
+        if (err != seL4_RangeError) {
+            ZF_LOGE("Failed to inject irq %d into list register %d of vcpu %d", irq->virq, lr, vcpu_id);
+            return -1;
+        }
+        /* The hardware implements fewer list registers */
+        vgic->lr_valid = LR_BIT(lr) - 1;
+        lr_free &= vgic->lr_valid;
+    }
+    return -1;
 }
 
-static int vgic_vcpu_inject_irq(struct vgic_dist_device *d, vm_vcpu_t *inject_vcpu, struct virq_handle *irq)
+/* Inject an interrupt into a free list register, or queue it until one is freed */
+static int vgic_vcpu_inject_irq_from(vgic_t *vgic, vm_vcpu_t *inject_vcpu, struct virq_handle *irq)
 {
-    vgic_t *vgic;
-    int err;
-    int i;
+    if (!vgic_vcpu_inject_irq_lr(vgic, inject_vcpu, irq)) {
+        return 0;
+    }
+    return vgic_add_overflow(vgic, irq, inject_vcpu);
+}
 
-    vgic = vgic_device_get_vgic(d);
+#if CONFIG_LIB_SEL4VM_HOST_DRAIN_BATCH > 0
+static inline bool vgic_batch_is_open(vgic_t *vgic)
+{
+    return vgic->batch.owner && vgic->batch.owner == seL4_GetIPCBuffer();
+}
 
-    seL4_CPtr vcpu;
-    vcpu = inject_vcpu->vcpu.cptr;
-    for (i = 0; i < MAX_LR_OVERFLOW; i++) {
-        if (vgic->irq[inject_vcpu->vcpu_id][i] == NULL) {
-            break;
+/* Queue an injection until the batch is closed. Returns -1 if the batch is full */
+static int vgic_batch_add(vgic_t *vgic, vm_vcpu_t *inject_vcpu, struct virq_handle *irq)
+{
+    struct vgic_batch *batch = &vgic->batch;
+    for (int i = 0; i < batch->num_irqs; i++) {
+        if (batch->irqs[i].vcpu == inject_vcpu && batch->irqs[i].irq == irq) {
+            /* Already queued, the guest only needs to see it once */
+            return 0;
         }
     }
-    err = seL4_ARM_VCPU_InjectIRQ(vcpu, irq->virq, 0, 0, i);
-    assert((i < 4) || err);
-    if (!err) {
-        /* Shadow */
-        vgic->irq[inject_vcpu->vcpu_id][i] = irq;
-        return err;
-    } else {
-        /* Add to overflow list */
-        return vgic_add_overflow(vgic, irq, inject_vcpu);
+    if (batch->num_irqs == MAX_LR_OVERFLOW) {
+        return -1;
     }
+    batch->irqs[batch->num_irqs].vcpu = inject_vcpu;
+    batch->irqs[batch->num_irqs].irq = irq;
+    batch->num_irqs++;
+    return 0;
+}
+
+/* Inject the queued irqs */
+static void vgic_batch_flush(vgic_t *vgic)
+{
+    struct vgic_batch *batch = &vgic->batch;
+    for (int i = 0; i < batch->num_irqs; i++) {
+        vm_vcpu_t *vcpu = batch->irqs[i].vcpu;
+        int err = vgic_vcpu_inject_irq_from(vgic, vcpu, batch->irqs[i].irq);
+        if (err) {
+            ZF_LOGE("IRQ %d dropped on vcpu %d: overflow list full", batch->irqs[i].irq->virq, vcpu->vcpu_id);
+        }
+    }
+    batch->num_irqs = 0;
+}
+#endif
+
+static int vgic_vcpu_inject_irq(struct vgic_dist_device *d, vm_vcpu_t *inject_vcpu, struct virq_handle *irq)
+{
+    vgic_t *vgic = vgic_device_get_vgic(d);
+#if CONFIG_LIB_SEL4VM_HOST_DRAIN_BATCH > 0
+    if (vgic_batch_is_open(vgic) && !vgic_batch_add(vgic, inject_vcpu, irq)) {
+        return 0;
+    }
+#endif
+    return vgic_vcpu_inject_irq_from(vgic, inject_vcpu, irq);
 }
 
 int handle_vgic_maintenance(vm_vcpu_t *vcpu, int idx)
 {
+    struct vgic_dist_device *vgic_dist = vcpu->vm->arch.vgic_dist;
     /* STATE d) */
     struct gic_dist_map *gic_dist;
     struct virq_handle **lr;
@@ -530,6 +729,22 @@ int handle_vgic_maintenance(vm_vcpu_t *vcpu, int idx)
     lr = vgic_priv_get_lr(vgic_dist, vcpu);
     assert(lr[idx]);
 
+#ifdef CONFIG_LIB_SEL4VM_VTIMER_FAST_PATH
+    if (idx == VTIMER_LR) {
+        /* Unmask the timer PPI directly, no overflowed irq can be moved into the reserved list register */
+        DIRQ("Maintenance vtimer IRQ %d\n", lr[idx]->virq);
+        set_sgi_ppi_pending(gic_dist, lr[idx]->virq, false, vcpu->vcpu_id);
+        seL4_Error err = seL4_ARM_VCPU_AckVPPI(vcpu->vcpu.cptr, lr[idx]->virq);
+        lr[idx] = NULL;
+        vgic_device_get_vgic(vgic_dist)->lr_used[vcpu->vcpu_id] &= ~LR_BIT(idx);
+        if (err) {
+            ZF_LOGE("Failed to ACK VPPI: VPPI Ack invocation failed");
+            return -1;
+        }
+        return 0;
+    }
+#endif
+
     /* Clear pending */
     DIRQ("Maintenance IRQ %d\n", lr[idx]->virq);
     set_pending(gic_dist, lr[idx]->virq, false, vcpu->vcpu_id);
@@ -538,6 +753,7 @@ int handle_vgic_maintenance(vm_vcpu_t *vcpu, int idx)
     /* Check the overflow list for pending IRQs */
     lr[idx] = NULL;
     vgic_t *vgic = vgic_device_get_vgic(vgic_dist);
+    vgic->lr_used[vcpu->vcpu_id] &= ~LR_BIT(idx);
     vgic_handle_overflow(vgic, vcpu);
     return 0;
 }
@@ -629,15 +845,12 @@ static int vgic_dist_clr_pending_irq(struct vgic_dist_device *d, vm_vcpu_t *vcpu
     return 0;
 }
 
-static memory_fault_result_t handle_vgic_dist_read_fault(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t fault_addr,
-                                                         size_t fault_length,
-                                                         void *cookie)
+static memory_fault_result_t handle_vgic_dist_read_fault(vm_t *vm, vm_vcpu_t *vcpu, int offset, void *cookie)
 {
     int err = 0;
     fault_t *fault = vcpu->vcpu_arch.fault;
     struct vgic_dist_device *d = (struct vgic_dist_device *)cookie;
     struct gic_dist_map *gic_dist = vgic_priv_get_dist(d);
-    int offset = fault_get_address(fault) - d->pstart;
     int vcpu_id = vcpu->vcpu_id;
     uint32_t reg = 0;
     int reg_offset = 0;
@@ -784,15 +997,12 @@ fault_return:
     return FAULT_HANDLED;
 }
 
-static memory_fault_result_t handle_vgic_dist_write_fault(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t fault_addr,
-                                                          size_t fault_length,
-                                                          void *cookie)
+static memory_fault_result_t handle_vgic_dist_write_fault(vm_t *vm, vm_vcpu_t *vcpu, int offset, void *cookie)
 {
     int err = 0;
     fault_t *fault = vcpu->vcpu_arch.fault;
     struct vgic_dist_device *d = (struct vgic_dist_device *)cookie;
     struct gic_dist_map *gic_dist = vgic_priv_get_dist(d);
-    int offset = fault_get_address(fault) - d->pstart;
     int vcpu_id = vcpu->vcpu_id;
     uint32_t reg = 0;
     uint32_t mask = fault_get_data_mask(fault);
@@ -891,7 +1101,14 @@ static memory_fault_result_t handle_vgic_dist_write_fault(vm_t *vm, vm_vcpu_t *v
         reg_offset = GIC_DIST_REGN(offset, GIC_DIST_ICACTIVER1);
         gic_dist->active_clr[reg_offset] = fault_emulate(fault, gic_dist->active_clr[reg_offset]);
         break;
-    case RANGE32(GIC_DIST_IPRIORITYR0, GIC_DIST_IPRIORITYRN):
+    case RANGE32(GIC_DIST_IPRIORITYR0, GIC_DIST_IPRIORITYR7):
+        reg_offset = GIC_DIST_REGN(offset, GIC_DIST_IPRIORITYR0);
+        gic_dist->priority0[vcpu->vcpu_id][reg_offset] = fault_emulate(fault,
+                                                                       gic_dist->priority0[vcpu->vcpu_id][reg_offset]);
+        break;
+    case RANGE32(GIC_DIST_IPRIORITYR8, GIC_DIST_IPRIORITYRN):
+        reg_offset = GIC_DIST_REGN(offset, GIC_DIST_IPRIORITYR8);
+        gic_dist->priority[reg_offset] = fault_emulate(fault, gic_dist->priority[reg_offset]);
         break;
     case RANGE32(0x7FC, 0x7FC):
         /* Reserved */
@@ -962,14 +1179,244 @@ ignore_fault:
     return FAULT_HANDLED;
 }
 
+#ifdef CONFIG_ARM_GIC_V3_SUPPORT
+/* Affinity of a vcpu in the Aff3:Aff2:Aff1:Aff0 format of GICR_TYPER, matching the VMPIDR given by vcpu_start */
+static uint32_t vgic_vcpu_affinity(vm_vcpu_t *vcpu)
+{
+    if (CONFIG_MAX_NUM_NODES == 1 || vcpu->vcpu_id == BOOT_VCPU) {
+        return 0;
+    }
+    return vcpu->target_cpu & 0xffffff;
+}
+
+/* Registers of INTIDs 0 to 31, which are held by the redistributors when affinity routing is enabled */
+static bool vgic_is_sgi_ppi_reg(int offset)
+{
+    switch (offset) {
+    case RANGE32(GIC_DIST_IGROUPR0, GIC_DIST_IGROUPR0):
+    case RANGE32(GIC_DIST_ISENABLER0, GIC_DIST_ISENABLER0):
+    case RANGE32(GIC_DIST_ICENABLER0, GIC_DIST_ICENABLER0):
+    case RANGE32(GIC_DIST_ISPENDR0, GIC_DIST_ISPENDR0):
+    case RANGE32(GIC_DIST_ICPENDR0, GIC_DIST_ICPENDR0):
+    case RANGE32(GIC_DIST_ISACTIVER0, GIC_DIST_ISACTIVER0):
+    case RANGE32(GIC_DIST_ICACTIVER0, GIC_DIST_ICACTIVER0):
+    case RANGE32(GIC_DIST_IPRIORITYR0, GIC_REDIST_IPRIORITYR7):
+    case RANGE32(GIC_REDIST_ICFGR0, GIC_REDIST_ICFGR1):
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* Complete a read of 'reg', or a write, to a register that is emulated without the GICv2 handlers */
+static memory_fault_result_t vgic_v3_complete_fault(fault_t *fault, uint64_t reg)
+{
+    int err;
+    if (fault_is_read(fault)) {
+        fault_set_data(fault, reg & fault_get_data_mask(fault));
+        err = advance_fault(fault);
+    } else {
+        err = ignore_fault(fault);
+    }
+    if (err) {
+        return FAULT_ERROR;
+    }
+    return FAULT_HANDLED;
+}
+
+static memory_fault_result_t handle_vgic_dist_v3_fault(vm_t *vm, vm_vcpu_t *vcpu, int offset, void *cookie)
+{
+    fault_t *fault = vcpu->vcpu_arch.fault;
+    struct vgic_dist_device *d = (struct vgic_dist_device *)cookie;
+    struct gic_dist_map *gic_dist = vgic_priv_get_dist(d);
+    vgic_t *vgic = vgic_device_get_vgic(d);
+    uint64_t reg = 0;
+
+    switch (offset) {
+    case RANGE32(GIC_DIST_CTLR, GIC_DIST_CTLR):
+        /* Affinity routing is always enabled and there is a single security state */
+        if (fault_is_read(fault)) {
+            reg = gic_dist->enable | GIC_DIST_CTLR_ARE | GIC_DIST_CTLR_DS;
+        } else {
+            gic_dist->enable = fault_get_data(fault) & GIC_DIST_CTLR_ENABLE_MASK;
+            DDIST("%s gic distributer\n", gic_dist->enable ? "enabling" : "disabling");
+        }
+        break;
+    case RANGE32(GIC_DIST_ITARGETSR0, GIC_DIST_ITARGETSRN):
+    case RANGE32(GIC_DIST_SGIR, GIC_DIST_SPENDSGIRN):
+        /* Not used with affinity routing */
+        break;
+    case GIC_DIST_IROUTER32 ... GIC_DIST_IROUTERN + sizeof(uint64_t) - 1: {
+        uint64_t *irouter = &vgic->irouter[(offset - GIC_DIST_IROUTER32) / sizeof(uint64_t)];
+        /* The registers are 64 bit, and may be accessed one word at a time */
+        int shift = (offset & sizeof(uint32_t)) * 8;
+        if (fault_is_read(fault)) {
+            reg = *irouter >> shift;
+        } else {
+            uint64_t mask = (uint64_t)fault_get_data_mask(fault) << shift;
+            uint64_t data = (uint64_t)fault_get_data(fault) << (shift + (offset & 0x3) * 8);
+            *irouter = ((*irouter & ~mask) | (data & mask)) & GIC_DIST_IROUTER_MASK;
+        }
+        break;
+    }
+    case RANGE32(GIC_DIST_PIDR2, GIC_DIST_PIDR2):
+        reg = GIC_PIDR2_ARCH_GICV3;
+        break;
+    default:
+        if (offset < PAGE_SIZE_4K && !vgic_is_sgi_ppi_reg(offset)) {
+            /* Registers shared with GICv2 */
+            if (fault_is_read(fault)) {
+                return handle_vgic_dist_read_fault(vm, vcpu, offset, cookie);
+            }
+            return handle_vgic_dist_write_fault(vm, vcpu, offset, cookie);
+        }
+        /* Reserved, or not implemented */
+        break;
+    }
+    return vgic_v3_complete_fault(fault, reg);
+}
+
+static uint64_t vgic_redist_typer(vm_t *vm, int redist)
+{
+    uint64_t affinity = redist;
+    if (redist < vm->num_vcpus) {
+        affinity = vgic_vcpu_affinity(vm->vcpus[redist]);
+    }
+    uint64_t typer = (affinity << 32) | ((uint64_t)redist << GIC_REDIST_TYPER_PROCESSOR_SHIFT);
+    if (redist == vm->num_vcpus - 1 || redist == CONFIG_MAX_NUM_NODES - 1) {
+        typer |= GIC_REDIST_TYPER_LAST;
+    }
+    return typer;
+}
+
+static memory_fault_result_t handle_vgic_redist_fault(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t fault_addr,
+                                                      size_t fault_length,
+                                                      void *cookie)
+{
+    memory_fault_result_t result;
+    fault_t *fault = vcpu->vcpu_arch.fault;
+    vgic_t *vgic = vgic_device_get_vgic((struct vgic_dist_device *)cookie);
+    int offset = fault_get_address(fault) - GIC_REDIST_PADDR;
+    /* Redistributor 'n' is the redistributor of the vcpu with id 'n' */
+    int redist = offset / GIC_REDIST_SIZE;
+    int frame_offset = offset % GIC_REDIST_FRAME_SIZE;
+    uint64_t reg = 0;
+
+    vgic_lock(vgic);
+    if (offset % GIC_REDIST_SIZE >= GIC_REDIST_FRAME_SIZE) {
+        /* SGI_base frame, the SGI and PPI state is banked by the GICv2 handlers on the faulting vcpu */
+        if (redist == vcpu->vcpu_id && vgic_is_sgi_ppi_reg(frame_offset)) {
+            if (fault_is_read(fault)) {
+                result = handle_vgic_dist_read_fault(vm, vcpu, frame_offset, cookie);
+            } else {
+                result = handle_vgic_dist_write_fault(vm, vcpu, frame_offset, cookie);
+            }
+            vgic_unlock(vgic);
+            return result;
+        }
+        /* Registers of other vcpus' redistributors are RAZ/WI */
+    } else {
+        switch (frame_offset) {
+        case RANGE32(GIC_REDIST_CTLR, GIC_REDIST_CTLR):
+            /* No LPIs, and register writes take effect immediately */
+            break;
+        case RANGE32(GIC_REDIST_IIDR, GIC_REDIST_IIDR):
+            reg = vgic->dist->dist_ident;
+            break;
+        case RANGE32(GIC_REDIST_TYPER, GIC_REDIST_TYPER_HI):
+            reg = vgic_redist_typer(vm, redist) >> ((frame_offset & sizeof(uint32_t)) * 8);
+            break;
+        case RANGE32(GIC_REDIST_WAKER, GIC_REDIST_WAKER):
+            if (fault_is_read(fault)) {
+                reg = vgic->redist_waker[redist];
+            } else if (fault_get_data(fault) & GIC_REDIST_WAKER_PROCESSOR_SLEEP) {
+                /* The redistributor is quiescent as soon as the PE asks it to be */
+                vgic->redist_waker[redist] = GIC_REDIST_WAKER_PROCESSOR_SLEEP | GIC_REDIST_WAKER_CHILDREN_ASLEEP;
+            } else {
+                vgic->redist_waker[redist] = 0;
+            }
+            break;
+        case RANGE32(GIC_REDIST_PIDR2, GIC_REDIST_PIDR2):
+            reg = GIC_PIDR2_ARCH_GICV3;
+            break;
+        default:
+            /* Reserved, or not implemented */
+            break;
+        }
+    }
+    result = vgic_v3_complete_fault(fault, reg);
+    vgic_unlock(vgic);
+    return result;
+}
+
+/* Route an SPI to the vcpu selected by its GICD_IROUTER, falling back on 'vcpu' for 1 of N routing or
+ * when no online vcpu has a matching affinity */
+static vm_vcpu_t *vgic_irouter_vcpu(vgic_t *vgic, vm_vcpu_t *vcpu, int irq)
+{
+    if (irq < GIC_SPI_IRQ_MIN || irq > GIC_SPI_IRQ_MAX) {
+        return vcpu;
+    }
+    uint64_t irouter = vgic->irouter[irq - GIC_SPI_IRQ_MIN];
+    if (irouter & GIC_DIST_IROUTER_IRM) {
+        return vcpu;
+    }
+    uint32_t affinity = (irouter & 0xffffff) | ((irouter >> 32) & 0xff) << 24;
+    for (int i = 0; i < vcpu->vm->num_vcpus; i++) {
+        vm_vcpu_t *target_vcpu = vcpu->vm->vcpus[i];
+        if (is_vcpu_online(target_vcpu) && vgic_vcpu_affinity(target_vcpu) == affinity) {
+            return target_vcpu;
+        }
+    }
+    return vcpu;
+}
+
+void vm_vgic_sgi1r_write(vm_vcpu_t *vcpu, uint64_t value)
+{
+    int virq = (value >> ICC_SGI1R_INTID_SHIFT) & ICC_SGI1R_INTID_MASK;
+    uint16_t target_list = value & ICC_SGI1R_TARGET_LIST_MASK;
+    uint32_t affinity = ((value >> ICC_SGI1R_AFF1_SHIFT) & ICC_SGI1R_AFF_MASK) << 8 |
+                        ((value >> ICC_SGI1R_AFF2_SHIFT) & ICC_SGI1R_AFF_MASK) << 16 |
+                        ((value >> ICC_SGI1R_AFF3_SHIFT) & ICC_SGI1R_AFF_MASK) << 24;
+    for (int i = 0; i < vcpu->vm->num_vcpus; i++) {
+        vm_vcpu_t *target_vcpu = vcpu->vm->vcpus[i];
+        uint32_t target_affinity = vgic_vcpu_affinity(target_vcpu);
+        if (!is_vcpu_online(target_vcpu)) {
+            continue;
+        }
+        if (value & ICC_SGI1R_IRM) {
+            /* Forward virq to all vcpus but the requesting vcpu */
+            if (target_vcpu == vcpu) {
+                continue;
+            }
+        } else if ((target_affinity & ~0xffU) != affinity || (target_affinity & 0xff) >= 16 ||
+                   !(target_list & BIT(target_affinity & 0xff))) {
+            continue;
+        }
+        vm_inject_irq(target_vcpu, virq);
+    }
+}
+#endif /* CONFIG_ARM_GIC_V3_SUPPORT */
+
 static memory_fault_result_t handle_vgic_dist_fault(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t fault_addr,
                                                     size_t fault_length,
                                                     void *cookie)
 {
+    memory_fault_result_t result;
+    struct vgic_dist_device *d = (struct vgic_dist_device *)cookie;
+    vgic_t *vgic = vgic_device_get_vgic(d);
+    int offset = fault_get_address(vcpu->vcpu_arch.fault) - d->pstart;
+    vgic_lock(vgic);
+#ifdef CONFIG_ARM_GIC_V3_SUPPORT
+    result = handle_vgic_dist_v3_fault(vm, vcpu, offset, cookie);
+#else
     if (fault_is_read(vcpu->vcpu_arch.fault)) {
-        return handle_vgic_dist_read_fault(vm, vcpu, fault_addr, fault_length, cookie);
+        result = handle_vgic_dist_read_fault(vm, vcpu, offset, cookie);
+    } else {
+        result = handle_vgic_dist_write_fault(vm, vcpu, offset, cookie);
     }
-    return handle_vgic_dist_write_fault(vm, vcpu, fault_addr, fault_length, cookie);
+#endif
+    vgic_unlock(vgic);
+    return result;
 }
 
 static void vgic_dist_reset(struct vgic_dist_device *d)
@@ -977,7 +1424,15 @@ static void vgic_dist_reset(struct vgic_dist_device *d)
     struct gic_dist_map *gic_dist;
     gic_dist = vgic_priv_get_dist(d);
     memset(gic_dist, 0, sizeof(*gic_dist));
-    gic_dist->ic_type         = 0x0000fce7; /* RO */
+#ifdef CONFIG_ARM_GIC_V3_SUPPORT
+    gic_dist->ic_type         = 0x0048001f; /* RO, all 1020 INTIDs, 10 INTID bits */
+    vgic_t *vgic = vgic_device_get_vgic(d);
+    for (int i = 0; i < CONFIG_MAX_NUM_NODES; i++) {
+        vgic->redist_waker[i] = GIC_REDIST_WAKER_PROCESSOR_SLEEP | GIC_REDIST_WAKER_CHILDREN_ASLEEP;
+    }
+#else
+    gic_dist->ic_type         = 0x0000fcff; /* RO, all 1020 INTIDs */
+#endif
     gic_dist->dist_ident      = 0x0200043b; /* RO */
 
     for (int i = 0; i < CONFIG_MAX_NUM_NODES; i++) {
@@ -1030,6 +1485,7 @@ static void vgic_dist_reset(struct vgic_dist_device *d)
 
 int vm_register_irq(vm_vcpu_t *vcpu, int irq, irq_ack_fn_t ack_fn, void *cookie)
 {
+    struct vgic_dist_device *vgic_dist = vcpu->vm->arch.vgic_dist;
     struct virq_handle *virq_data;
     struct vgic *vgic;
     int err;
@@ -1042,7 +1498,9 @@ int vm_register_irq(vm_vcpu_t *vcpu, int irq, irq_ack_fn_t ack_fn, void *cookie)
         return -1;
     }
     virq_init(virq_data, irq, ack_fn, cookie);
+    vgic_lock(vgic);
     err = virq_add(vcpu, vgic, virq_data);
+    vgic_unlock(vgic);
     if (err) {
         free(virq_data);
         return -1;
@@ -1052,21 +1510,88 @@ int vm_register_irq(vm_vcpu_t *vcpu, int irq, irq_ack_fn_t ack_fn, void *cookie)
 
 int vm_inject_irq(vm_vcpu_t *vcpu, int irq)
 {
-    // vm->lock();
+    struct vgic_dist_device *vgic_dist = vcpu->vm->arch.vgic_dist;
+    vgic_t *vgic = vgic_device_get_vgic(vgic_dist);
+    vgic_lock(vgic);
 
     DIRQ("VM received IRQ %d\n", irq);
+#ifdef CONFIG_ARM_GIC_V3_SUPPORT
+    vcpu = vgic_irouter_vcpu(vgic, vcpu, irq);
+#endif
 
+    vm_event_trace(vcpu, VM_EVENT_TRACE_IRQ_INJECT, irq, 0, 0);
     int err = vgic_dist_set_pending_irq(vgic_dist, vcpu, irq);
 
     if (!fault_handled(vcpu->vcpu_arch.fault) && fault_is_wfi(vcpu->vcpu_arch.fault)) {
+        vm_wfx_wake(vcpu);
         ignore_fault(vcpu->vcpu_arch.fault);
     }
 
-    // vm->unlock();
+    vgic_unlock(vgic);
 
     return err;
 }
 
+void vm_vgic_wait_for_irq(vm_vcpu_t *vcpu)
+{
+    struct vgic_dist_device *vgic_dist = vcpu->vm->arch.vgic_dist;
+    vgic_t *vgic = vgic_device_get_vgic(vgic_dist);
+    vgic_lock(vgic);
+    /* An irq in a list register or the overflow queue would have ended a WFI too */
+    if (vgic->lr_used[vcpu->vcpu_id] || vgic->lr_overflow[vcpu->vcpu_id].num_irqs) {
+        ignore_fault(vcpu->vcpu_arch.fault);
+    } else {
+        fault_set_wait_irq(vcpu->vcpu_arch.fault);
+    }
+    vgic_unlock(vgic);
+}
+
+#ifndef CONFIG_ARM_GIC_V3_SUPPORT
+#ifdef CONFIG_LIB_SEL4VM_VTIMER_FAST_PATH
+int vm_vgic_inject_vtimer(vm_vcpu_t *vcpu, int irq)
+{
+    struct vgic_dist_device *vgic_dist = vcpu->vm->arch.vgic_dist;
+    if (irq < NUM_SGI_VIRQS || irq >= GIC_SPI_IRQ_MIN) {
+        return vm_inject_irq(vcpu, irq);
+    }
+    vgic_t *vgic = vgic_device_get_vgic(vgic_dist);
+    struct gic_dist_map *gic_dist = vgic->dist;
+    int vcpu_id = vcpu->vcpu_id;
+    int err = -1;
+    vgic_lock(vgic);
+
+    DIRQ("VM received vtimer IRQ %d\n", irq);
+
+    struct virq_handle *virq_data = virq_get_sgi_ppi(vgic, vcpu, irq);
+    if (virq_data && gic_dist->enable && is_sgi_ppi_enabled(gic_dist, irq, vcpu_id)) {
+        set_sgi_ppi_pending(gic_dist, irq, true, vcpu_id);
+        if (!(vgic->lr_used[vcpu_id] & LR_BIT(VTIMER_LR)) &&
+            seL4_ARM_VCPU_InjectIRQ(vcpu->vcpu.cptr, irq, 0, 0, VTIMER_LR) == seL4_NoError) {
+            vgic->irq[vcpu_id][VTIMER_LR] = virq_data;
+            vgic->lr_used[vcpu_id] |= LR_BIT(VTIMER_LR);
+#ifdef CONFIG_LIB_SEL4VM_EXIT_STATS
+            vcpu->exit_stats->vtimer_fast_injections++;
+#endif
+            err = 0;
+        } else {
+            /* Another interrupt holds the reserved list register */
+            err = vgic_vcpu_inject_irq(vgic_dist, vcpu, virq_data);
+#ifdef CONFIG_LIB_SEL4VM_EXIT_STATS
+            vcpu->exit_stats->vtimer_slow_injections++;
+#endif
+        }
+    }
+
+    if (!fault_handled(vcpu->vcpu_arch.fault) && fault_is_wfi(vcpu->vcpu_arch.fault)) {
+        vm_wfx_wake(vcpu);
+        ignore_fault(vcpu->vcpu_arch.fault);
+    }
+
+    vgic_unlock(vgic);
+    return err;
+}
+#endif
+
 static memory_fault_result_t handle_vgic_vcpu_fault(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t fault_addr,
                                                     size_t fault_length,
                                                     void *cookie)
@@ -1103,6 +1628,57 @@ static vm_frame_t vgic_vcpu_iterator(uintptr_t addr, void *cookie)
     frame_result.size_bits = seL4_PageBits;
     return frame_result;
 }
+#endif
+
+#ifdef CONFIG_LIB_SEL4VM_VGIC_DIST_SHADOW
+static vm_frame_t vgic_dist_shadow_iterator(uintptr_t addr, void *cookie)
+{
+    int err;
+    cspacepath_t frame;
+    vm_frame_t frame_result = { seL4_CapNull, seL4_NoRights, 0, 0 };
+    vm_t *vm = (vm_t *)cookie;
+    vgic_t *vgic = vgic_device_get_vgic(vm->arch.vgic_dist);
+    cspacepath_t shadow_frame;
+
+    err = vka_cspace_alloc_path(vm->vka, &frame);
+    if (err) {
+        ZF_LOGE("Failed to allocate cslot for vgic distributor shadow");
+        return frame_result;
+    }
+    vka_cspace_make_path(vm->vka, vgic->dist_shadow.cptr, &shadow_frame);
+    err = vka_cnode_copy(&frame, &shadow_frame, seL4_AllRights);
+    if (err) {
+        ZF_LOGE("Failed to copy vgic distributor shadow cap");
+        vka_cspace_free_path(vm->vka, frame);
+        return frame_result;
+    }
+    /* Reads are served from the shadow without faulting, writes fault and are emulated */
+    frame_result.cptr = frame.capPtr;
+    frame_result.rights = seL4_CanRead;
+    frame_result.vaddr = GIC_DIST_PADDR;
+    frame_result.size_bits = seL4_PageBits;
+    return frame_result;
+}
+
+static struct gic_dist_map *vgic_dist_shadow_alloc(vm_t *vm, vgic_t *vgic)
+{
+    int err = vka_alloc_frame(vm->vka, seL4_PageBits, &vgic->dist_shadow);
+    if (err) {
+        ZF_LOGE("Failed to allocate vgic distributor shadow");
+        return NULL;
+    }
+    cspacepath_t path;
+    vka_cspace_make_path(vm->vka, vgic->dist_shadow.cptr, &path);
+    /* Uncached, as the guest reads the shadow through a device mapping */
+    void *dist = vspace_map_pages(&vm->mem.vmm_vspace, &path.capPtr, NULL, seL4_AllRights, 1, seL4_PageBits, 0);
+    if (!dist) {
+        ZF_LOGE("Failed to map vgic distributor shadow into vmm vspace");
+        vka_free_object(vm->vka, &vgic->dist_shadow);
+        return NULL;
+    }
+    return dist;
+}
+#endif
 
 /*
  * 1) completely virtual the distributor
@@ -1110,10 +1686,15 @@ static vm_frame_t vgic_vcpu_iterator(uintptr_t addr, void *cookie)
  */
 int vm_install_vgic(vm_t *vm)
 {
+    struct vgic_dist_device *vgic_dist;
     struct vgic *vgic;
     void *addr;
     int err;
 
+    if (vm->arch.vgic_dist) {
+        ZF_LOGE("Failed to install vgic: VM already has one");
+        return -1;
+    }
     vgic = calloc(1, sizeof(*vgic));
     if (!vgic) {
         assert(!"Unable to calloc memory for VGIC");
@@ -1132,16 +1713,38 @@ int vm_install_vgic(vm_t *vm)
     }
     memcpy(vgic_dist, &dev_vgic_dist, sizeof(struct vgic_dist_device));
 
+#ifdef CONFIG_LIB_SEL4VM_VGIC_DIST_SHADOW
+    vgic->dist = vgic_dist_shadow_alloc(vm, vgic);
+#else
     vgic->dist = calloc(1, sizeof(struct gic_dist_map));
+#endif
     assert(vgic->dist);
     if (vgic->dist == NULL) {
         return -1;
     }
-    vm_memory_reservation_t *vgic_dist_res = vm_reserve_memory_at(vm, GIC_DIST_PADDR, PAGE_SIZE_4K,
+    vm_memory_reservation_t *vgic_dist_res = vm_reserve_memory_at(vm, GIC_DIST_PADDR, GIC_DIST_SIZE,
                                                                   handle_vgic_dist_fault, (void *)vgic_dist);
     vgic_dist->priv = (void *)vgic;
     vgic_dist_reset(vgic_dist);
+    vm->arch.vgic_dist = vgic_dist;
+#ifdef CONFIG_LIB_SEL4VM_VGIC_DIST_SHADOW
+    err = vm_map_reservation(vm, vgic_dist_res, vgic_dist_shadow_iterator, (void *)vm);
+    if (err) {
+        ZF_LOGE("Failed to map vgic distributor shadow into vm");
+        return -1;
+    }
+#endif
 
+#ifdef CONFIG_ARM_GIC_V3_SUPPORT
+    /* Redistributors, the CPU interface is accessed through system registers */
+    vm_memory_reservation_t *vgic_redist_res = vm_reserve_memory_at(vm, GIC_REDIST_PADDR,
+                                                                    GIC_REDIST_SIZE * CONFIG_MAX_NUM_NODES,
+                                                                    handle_vgic_redist_fault, (void *)vgic_dist);
+    if (!vgic_redist_res) {
+        free(vgic_dist->priv);
+        return -1;
+    }
+#else
     /* Remap VCPU to CPU */
     vm_memory_reservation_t *vgic_vcpu_reservation = vm_reserve_memory_at(vm, GIC_CPU_PADDR,
                                                                           0x1000, handle_vgic_vcpu_fault, NULL);
@@ -1150,19 +1753,24 @@ int vm_install_vgic(vm_t *vm)
         free(vgic_dist->priv);
         return -1;
     }
+#endif
 
     return 0;
 }
 
 int vm_vgic_maintenance_handler(vm_vcpu_t *vcpu)
 {
+    struct vgic_dist_device *vgic_dist = vcpu->vm->arch.vgic_dist;
     int idx;
     int err;
     idx = seL4_GetMR(seL4_UnknownSyscall_ARG0);
     /* Currently not handling spurious IRQs */
     assert(idx >= 0);
 
+    vgic_t *vgic = vgic_device_get_vgic(vgic_dist);
+    vgic_lock(vgic);
     err = handle_vgic_maintenance(vcpu, idx);
+    vgic_unlock(vgic);
     if (!err) {
         seL4_MessageInfo_t reply;
         reply = seL4_MessageInfo_new(0, 0, 0, 0);
@@ -1171,8 +1779,70 @@ int vm_vgic_maintenance_handler(vm_vcpu_t *vcpu)
     return VM_EXIT_HANDLED;
 }
 
+#ifdef CONFIG_LIB_SEL4VM_BENCHMARKS
+int vm_vgic_benchmark_inject(vm_vcpu_t *vcpu, int irq)
+{
+    struct vgic_dist_device *vgic_dist = vcpu->vm->arch.vgic_dist;
+    vgic_t *vgic = vgic_device_get_vgic(vgic_dist);
+    struct gic_dist_map *gic_dist = vgic_priv_get_dist(vgic_dist);
+    struct virq_handle **lr = vgic_priv_get_lr(vgic_dist, vcpu);
+    int err = -1;
+
+    vgic_lock(vgic);
+    struct virq_handle *virq_data = virq_find_irq_data(vgic, vcpu, irq);
+    if (!virq_data) {
+        vgic_unlock(vgic);
+        return -1;
+    }
+    /* Inject as for an irq the guest has enabled, bypassing any open batch */
+    set_pending(gic_dist, irq, true, vcpu->vcpu_id);
+    if (!vgic_vcpu_inject_irq_from(vgic, vcpu, virq_data)) {
+        /* Complete it as the maintenance interrupt of its list register would */
+        for (int i = 0; i < MAX_LIST_REGS; i++) {
+            if (lr[i] == virq_data) {
+                err = handle_vgic_maintenance(vcpu, i);
+                break;
+            }
+        }
+    }
+    vgic_unlock(vgic);
+    return err;
+}
+#endif
+
+#if CONFIG_LIB_SEL4VM_HOST_DRAIN_BATCH > 0
+void vm_vgic_batch_begin(vm_t *vm)
+{
+    struct vgic_dist_device *vgic_dist = vm->arch.vgic_dist;
+    if (!vgic_dist) {
+        /* No irq controller installed */
+        return;
+    }
+    vgic_t *vgic = vgic_device_get_vgic(vgic_dist);
+    vgic_lock(vgic);
+    assert(!vgic->batch.owner);
+    vgic->batch.owner = seL4_GetIPCBuffer();
+    vgic_unlock(vgic);
+}
+
+void vm_vgic_batch_end(vm_t *vm)
+{
+    struct vgic_dist_device *vgic_dist = vm->arch.vgic_dist;
+    if (!vgic_dist) {
+        /* No irq controller installed */
+        return;
+    }
+    vgic_t *vgic = vgic_device_get_vgic(vgic_dist);
+    vgic_lock(vgic);
+    assert(vgic_batch_is_open(vgic));
+    vgic_batch_flush(vgic);
+    vgic->batch.owner = NULL;
+    vgic_unlock(vgic);
+}
+#endif
+
 const struct vgic_dist_device dev_vgic_dist = {
     .pstart = GIC_DIST_PADDR,
-    .size = 0x1000,
+    .size = GIC_DIST_SIZE,
     .priv = NULL,
 };
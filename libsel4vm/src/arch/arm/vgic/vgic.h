@@ -4,6 +4,8 @@
  * SPDX-License-Identifier: BSD-2-Clause
  */
 
+#include <autoconf.h>
+#include <sel4vm/gen_config.h>
 #include <sel4vm/guest_vm.h>
 
 struct vgic_dist_device {
@@ -16,3 +18,31 @@ extern const struct vgic_dist_device dev_vgic_dist;
 
 int vm_install_vgic(vm_t *vm);
 int vm_vgic_maintenance_handler(vm_vcpu_t *vcpu);
+
+/* Leave a vcpu blocked on its current fault until an irq is injected into it, which completes the fault. The fault
+ * is completed straight away if the vcpu already has an irq pending */
+void vm_vgic_wait_for_irq(vm_vcpu_t *vcpu);
+
+#ifdef CONFIG_LIB_SEL4VM_VTIMER_FAST_PATH
+/* Inject the virtual timer PPI of a vcpu into its reserved list register, falling back on the generic injection
+ * path if the list register is in use. Returns -1 if the PPI is not enabled by the guest */
+int vm_vgic_inject_vtimer(vm_vcpu_t *vcpu, int irq);
+#endif
+
+#ifdef CONFIG_ARM_GIC_V3_SUPPORT
+/* Generate the SGIs requested by a write of 'value' to the ICC_SGI1R_EL1 register of a vcpu */
+void vm_vgic_sgi1r_write(vm_vcpu_t *vcpu, uint64_t value);
+#endif
+
+#ifdef CONFIG_LIB_SEL4VM_BENCHMARKS
+/* Inject a registered irq into a list register of a vcpu and complete it through the maintenance path, as if the
+ * guest had acknowledged it. Returns -1 if the irq is not registered or could not be injected into a list register */
+int vm_vgic_benchmark_inject(vm_vcpu_t *vcpu, int irq);
+#endif
+
+#if CONFIG_LIB_SEL4VM_HOST_DRAIN_BATCH > 0
+/* Defer the vGIC injections made by the calling thread until 'vm_vgic_batch_end', which injects them
+ * with a single pass over the list registers of each vcpu */
+void vm_vgic_batch_begin(vm_t *vm);
+void vm_vgic_batch_end(vm_t *vm);
+#endif
@@ -0,0 +1,73 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/*
+ * GIC Distributor and Redistributor Register Map
+ * ARM Generic Interrupt Controller Architecture Specification
+ * GIC architecture version 3 and version 4 (Issue E)
+ * Chapter 12 Programmers' Model - Tables 12-25 and 12-27
+ *
+ * The GICv2 distributor offsets and layout in vgicv2_defs.h are otherwise shared by GICv3
+ */
+#define GIC_DIST_IROUTER0       0x6000
+#define GIC_DIST_IROUTER32      0x6100
+#define GIC_DIST_IROUTERN       0x7FD8
+#define GIC_DIST_PIDR2          0xFFE8
+
+/* 12.9.4 Distributor Control Register, GICD_CTLR, with a single security state */
+#define GIC_DIST_CTLR_ENABLE_MASK   0x3
+#define GIC_DIST_CTLR_ARE           (1U << 4)
+#define GIC_DIST_CTLR_DS            (1U << 6)
+
+/* 12.9.22 Interrupt Routing Registers, GICD_IROUTER<n> */
+#define GIC_DIST_IROUTER_IRM        (1ULL << 31)
+#define GIC_DIST_IROUTER_MASK       0x000000ff80ffffffULL
+
+/* Identification register value of an architecture version 3 GIC */
+#define GIC_PIDR2_ARCH_GICV3        0x3b
+
+/* Each redistributor has a RD_base frame followed by a SGI_base frame */
+#define GIC_REDIST_FRAME_SIZE       0x10000
+#define GIC_REDIST_SIZE             (2 * GIC_REDIST_FRAME_SIZE)
+
+/* RD_base frame, Table 12-27 */
+#define GIC_REDIST_CTLR             0x0000
+#define GIC_REDIST_IIDR             0x0004
+#define GIC_REDIST_TYPER            0x0008
+#define GIC_REDIST_TYPER_HI         0x000C
+#define GIC_REDIST_WAKER            0x0014
+#define GIC_REDIST_PIDR2            0xFFE8
+
+/* 12.11.37 Redistributor Type Register, GICR_TYPER */
+#define GIC_REDIST_TYPER_LAST               (1U << 4)
+#define GIC_REDIST_TYPER_PROCESSOR_SHIFT    8
+
+/* 12.11.42 Redistributor Wake Register, GICR_WAKER */
+#define GIC_REDIST_WAKER_PROCESSOR_SLEEP    (1U << 1)
+#define GIC_REDIST_WAKER_CHILDREN_ASLEEP    (1U << 2)
+
+/*
+ * The SGI_base frame holds the registers of the SGIs and PPIs of the redistributor's PE, at the
+ * offsets of the corresponding GICD registers for INTIDs 0 to 31
+ */
+#define GIC_REDIST_IGROUPR0         GIC_DIST_IGROUPR0
+#define GIC_REDIST_ICACTIVER0       GIC_DIST_ICACTIVER0
+#define GIC_REDIST_IPRIORITYR7      GIC_DIST_IPRIORITYR7
+#define GIC_REDIST_ICFGR0           GIC_DIST_ICFGR0
+#define GIC_REDIST_ICFGR1           (GIC_DIST_ICFGR0 + 4)
+
+/*
+ * 12.2.16 Interrupt Controller Software Generated Interrupt Group 1 Register, ICC_SGI1R_EL1
+ * op0 3, op1 0, CRn 12, CRm 11, op2 5
+ */
+#define ICC_SGI1R_TARGET_LIST_MASK  0xffffULL
+#define ICC_SGI1R_AFF1_SHIFT        16
+#define ICC_SGI1R_INTID_SHIFT       24
+#define ICC_SGI1R_INTID_MASK        0xfULL
+#define ICC_SGI1R_AFF2_SHIFT        32
+#define ICC_SGI1R_IRM               (1ULL << 40)
+#define ICC_SGI1R_AFF3_SHIFT        48
+#define ICC_SGI1R_AFF_MASK          0xffULL
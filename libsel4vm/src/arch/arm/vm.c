@@ -5,6 +5,7 @@
  */
 
 #include <autoconf.h>
+#include <sel4vm/gen_config.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -16,6 +17,7 @@
 #include <sel4vm/boot.h>
 #include <sel4vm/guest_vm_exits.h>
 #include <sel4vm/guest_irq_controller.h>
+#include <sel4vm/guest_vcpu_fault.h>
 #include <sel4vm/sel4_arch/processor.h>
 #include <sel4vm/arch/guest_arm_context.h>
 
@@ -27,6 +29,14 @@
 #include "vgic/vgic.h"
 #include "syscalls.h"
 #include "mem_abort.h"
+#include "guest_vm_exit_stats.h"
+#include "guest_vm_profile.h"
+#include "guest_vm_event_trace.h"
+#include "guest_irq_binding.h"
+#include "guest_irq_queue.h"
+#include "vcpu_thread.h"
+#include "wfx.h"
+#include "sysreg_exception.h"
 
 static int vm_user_exception_handler(vm_vcpu_t *vcpu);
 static int vm_vcpu_handler(vm_vcpu_t *vcpu);
@@ -43,6 +53,10 @@ static vm_exit_handler_fn_t arm_exit_handlers[] = {
     [VM_UNKNOWN_EXIT] = vm_unknown_exit_handler
 };
 
+#ifdef CONFIG_LIB_SEL4VM_EXIT_STATS
+compile_time_assert(exit_stats_num_exits, VM_NUM_EXITS == VM_EXIT_STATS_NUM_EXITS);
+#endif
+
 static int vm_decode_exit(seL4_Word label)
 {
     int exit_reason = VM_UNKNOWN_EXIT;
@@ -92,7 +106,11 @@ static int vm_vppi_event_handler(vm_vcpu_t *vcpu)
     ppi_irq = seL4_GetMR(0);
     /* We directly inject the interrupt assuming it has been previously registered
      * If not the interrupt will dropped by the VM */
+#ifdef CONFIG_LIB_SEL4VM_VTIMER_FAST_PATH
+    err = vm_vgic_inject_vtimer(vcpu, ppi_irq);
+#else
     err = vm_inject_irq(vcpu, ppi_irq);
+#endif
     if (err) {
         ZF_LOGE("VPPI IRQ %d dropped on vcpu %d", ppi_irq, vcpu->vcpu_id);
         /* Acknowledge to unmask it as our guest will not use the interrupt */
@@ -140,6 +158,20 @@ static int vm_vcpu_handler(vm_vcpu_t *vcpu)
     fault_t *fault;
     fault = vcpu->vcpu_arch.fault;
     hsr = seL4_GetMR(seL4_UnknownSyscall_ARG0);
+    if (HSR_EXCEPTION_CLASS(hsr) == HSR_WFx_EXCEPTION) {
+        err = vm_wfx_handler(vcpu, hsr);
+        if (err != VM_EXIT_UNHANDLED) {
+            return err;
+        }
+    }
+#ifdef CONFIG_ARCH_AARCH64
+    if (HSR_EXCEPTION_CLASS(hsr) == HSR_SYSREG_64_EXCEPTION) {
+        err = vm_sysreg_handler(vcpu, hsr);
+        if (err != VM_EXIT_UNHANDLED) {
+            return err;
+        }
+    }
+#endif
     if (vcpu->vcpu_arch.unhandled_vcpu_callback) {
         /* Pass the vcpu fault to library user in case they can handle it */
         err = new_vcpu_fault(fault, hsr);
@@ -219,47 +251,165 @@ int vm_register_unhandled_vcpu_fault_callback(vm_vcpu_t *vcpu, unhandled_vcpu_fa
 
 }
 
-int vm_run_arch(vm_t *vm)
+/* Exits that only touch the state of the faulting vcpu and the vGIC, these are handled without the VMM lock */
+static bool vcpu_exit_is_local(int vm_exit_reason)
+{
+    return vm_exit_reason == VM_VPPI_EXIT;
+}
+
+static int handle_vcpu_exit(vm_vcpu_t *vcpu, seL4_Word label)
+{
+    int ret;
+    vm_t *vm = vcpu->vm;
+    int vm_exit_reason = vm_decode_exit(label);
+    bool lock = !vcpu_exit_is_local(vm_exit_reason);
+
+    if (lock) {
+        vm_vmm_lock(vm);
+    }
+    /* Read the HSR before the handler can clobber the message registers */
+    uint32_t hsr = vm_exit_reason == VM_VCPU_EXIT ? seL4_GetMR(seL4_UnknownSyscall_ARG0) : 0;
+    vm_event_trace(vcpu, VM_EVENT_TRACE_EXIT, vm_exit_reason, hsr, 0);
+#ifdef CONFIG_LIB_SEL4VM_EXIT_STATS
+    vm_exit_stats_t *stats = vcpu->exit_stats;
+    uint64_t handler_start = vm_exit_stats_timestamp();
+#endif
+    ret = arm_exit_handlers[vm_exit_reason](vcpu);
+    vm_event_trace(vcpu, VM_EVENT_TRACE_EXIT_HANDLED, vm_exit_reason, ret, 0);
+#ifdef CONFIG_LIB_SEL4VM_EXIT_STATS
+    uint64_t handler_cycles = vm_exit_stats_timestamp() - handler_start;
+    vm_exit_latency_record(&stats->exits[vm_exit_reason], handler_cycles);
+    if (vm_exit_reason == VM_VCPU_EXIT) {
+        vm_exit_latency_record(&stats->hsr_classes[HSR_EXCEPTION_CLASS(hsr)], handler_cycles);
+    }
+#endif
+    if (vm_profile_due(vcpu)) {
+        /* Sampled after the handler, as reading the pc from the vcpu's thread clobbers the exit's message */
+        uintptr_t pc = 0;
+        if (vm_exit_reason == VM_GUEST_ABORT_EXIT) {
+            pc = get_vcpu_fault_ip(vcpu);
+        } else {
+            vm_get_thread_context_reg(vcpu, FAULT_CTX_REG(pc), &pc);
+        }
+        vm_profile_record(vcpu, pc, vm_exit_reason);
+    }
+    if (ret == VM_EXIT_HANDLE_ERROR) {
+        vm->run.exit_reason = VM_GUEST_ERROR_EXIT;
+    }
+    if (lock) {
+        vm_vmm_unlock(vm);
+    }
+    return ret;
+}
+
+#ifdef CONFIG_LIB_SEL4VM_VCPU_THREADS
+/* Entry point of the VMM thread of a secondary vcpu */
+static void vcpu_thread_entry(void *arg0, void *arg1, void *ipc_buf)
+{
+    vm_vcpu_t *vcpu = arg0;
+    int ret = 1;
+    while (ret > 0) {
+        seL4_Word sender_badge;
+        seL4_MessageInfo_t tag = vm_wfx_wait(vcpu, vm_vcpu_fault_endpoint(vcpu), &sender_badge);
+        ret = handle_vcpu_exit(vcpu, seL4_MessageInfo_get_label(tag));
+    }
+    ZF_LOGE("Failed to handle fault of vcpu %d, stopping VM", vcpu->vcpu_id);
+    vm_vcpu_thread_exit(vcpu);
+}
+#endif
+
+static int handle_host_message(vm_t *vm, seL4_MessageInfo_t tag, seL4_Word sender_badge)
 {
     int err;
     int ret;
+    seL4_Word label = seL4_MessageInfo_get_label(tag);
+
+    if (sender_badge >= MIN_VCPU_BADGE && sender_badge <= MAX_VCPU_BADGE) {
+        seL4_Word vcpu_idx = VCPU_BADGE_IDX(sender_badge);
+        if (vcpu_idx >= vm->num_vcpus) {
+            ZF_LOGE("Invalid VCPU index. Exiting");
+            return -1;
+        }
+        if (vm->vcpus[vcpu_idx]->vcpu_arch.vcpu_thread) {
+            /* The vcpu's own VMM thread has stopped */
+            vm->run.exit_reason = VM_GUEST_ERROR_EXIT;
+            return -1;
+        }
+        return handle_vcpu_exit(vm->vcpus[vcpu_idx], label);
+    }
+
+    ret = 1;
+    vm_vmm_lock(vm);
+    if (sender_badge != 0) {
+        sender_badge = vm_irq_queue_handle_badge(vm, sender_badge);
+        sender_badge = vm_irq_binding_handle_badge(vm, sender_badge);
+        if (!sender_badge) {
+            /* Only posted or bound irqs were pending */
+            vm_vmm_unlock(vm);
+            return ret;
+        }
+    }
+    if (vm->run.notification_callback) {
+#ifdef CONFIG_LIB_SEL4VM_EXIT_STATS
+        uint64_t callback_start = vm_exit_stats_timestamp();
+#endif
+        err = vm->run.notification_callback(vm, sender_badge, tag,
+                                            vm->run.notification_callback_cookie);
+#ifdef CONFIG_LIB_SEL4VM_EXIT_STATS
+        /* Notifications are not specific to a vcpu, account them against the boot vcpu */
+        vm_exit_latency_record(&vm->vcpus[BOOT_VCPU]->exit_stats->notifications,
+                               vm_exit_stats_timestamp() - callback_start);
+#endif
+    } else {
+        ZF_LOGE("Unable to handle VM notification. Exiting");
+        err = -1;
+    }
+    if (err) {
+        ret = -1;
+        vm->run.exit_reason = VM_GUEST_ERROR_EXIT;
+    }
+    vm_vmm_unlock(vm);
+    return ret;
+}
+
+int vm_run_arch(vm_t *vm)
+{
+    int ret;
 
+#ifdef CONFIG_LIB_SEL4VM_VCPU_THREADS
+    int err = vm_vcpu_threads_start(vm, vcpu_thread_entry);
+    if (err) {
+        vm_vcpu_threads_stop(vm);
+        return -1;
+    }
+#endif
     ret = 1;
     /* Loop, handling events */
     while (ret > 0) {
         seL4_MessageInfo_t tag;
         seL4_Word sender_badge;
-        seL4_Word label;
-        int vm_exit_reason;
-
-        tag = seL4_Recv(vm->host_endpoint, &sender_badge);
-        label = seL4_MessageInfo_get_label(tag);
-        if (sender_badge >= MIN_VCPU_BADGE && sender_badge <= MAX_VCPU_BADGE) {
-            seL4_Word vcpu_idx = VCPU_BADGE_IDX(sender_badge);
-            if (vcpu_idx >= vm->num_vcpus) {
-                ZF_LOGE("Invalid VCPU index. Exiting");
-                ret = -1;
-            } else {
-                vm_exit_reason = vm_decode_exit(label);
-                ret = arm_exit_handlers[vm_exit_reason](vm->vcpus[vcpu_idx]);
-                if (ret == VM_EXIT_HANDLE_ERROR) {
-                    vm->run.exit_reason = VM_GUEST_ERROR_EXIT;
-                }
-            }
-        } else {
-            if (vm->run.notification_callback) {
-                err = vm->run.notification_callback(vm, sender_badge, tag,
-                                                    vm->run.notification_callback_cookie);
-            } else {
-                ZF_LOGE("Unable to handle VM notification. Exiting");
-                err = -1;
-            }
-            if (err) {
-                ret = -1;
-                vm->run.exit_reason = VM_GUEST_ERROR_EXIT;
+
+        tag = vm_wfx_wait(vm_wfx_poll_vcpu(vm), vm->host_endpoint, &sender_badge);
+#if CONFIG_LIB_SEL4VM_HOST_DRAIN_BATCH > 0
+        vm_vgic_batch_begin(vm);
+#endif
+        ret = handle_host_message(vm, tag, sender_badge);
+#if CONFIG_LIB_SEL4VM_HOST_DRAIN_BATCH > 0
+        /* Handle any faults and notifications that queued up meanwhile before blocking again. A
+         * zero badge means nothing was pending */
+        for (int i = 1; ret > 0 && i < CONFIG_LIB_SEL4VM_HOST_DRAIN_BATCH; i++) {
+            tag = seL4_NBRecv(vm->host_endpoint, &sender_badge);
+            if (sender_badge == 0) {
+                break;
             }
+            ret = handle_host_message(vm, tag, sender_badge);
         }
+        vm_vgic_batch_end(vm);
+#endif
     }
 
+#ifdef CONFIG_LIB_SEL4VM_VCPU_THREADS
+    vm_vcpu_threads_stop(vm);
+#endif
     return ret;
 }
@@ -0,0 +1,167 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <autoconf.h>
+#include <sel4vm/gen_config.h>
+
+#include <stdlib.h>
+
+#include <sel4/sel4.h>
+#include <utils/util.h>
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_vm_exit_stats.h>
+
+#include "vm.h"
+#include "fault.h"
+#include "wfx.h"
+#include "guest_vm_exit_stats_arch.h"
+
+/* Poll window a vcpu starts from once polling could have caught its wakeups, and the factor the window grows by */
+#define WFX_POLL_START_TICKS(wfx) MAX((wfx)->poll_max_ticks / 16, 1)
+#define WFX_POLL_GROW 2
+#define WFX_POLL_SHRINK 2
+
+struct vm_wfx {
+    vm_wfx_policy_t policy;
+    uint64_t poll_max_ticks;
+    /* Current poll window, adapted to the length of recent waits */
+    uint64_t poll_ticks;
+    /* Start and poll deadline of the current wait, only accessed by the thread handling the vcpu's faults */
+    uint64_t wait_start;
+    uint64_t poll_end;
+    bool polling;
+};
+
+int vm_vcpu_set_wfx_policy(vm_vcpu_t *vcpu, vm_wfx_policy_t policy, uint64_t poll_max_ticks)
+{
+    if (!vcpu) {
+        ZF_LOGE("Failed to set wfx policy: Invalid VCPU handle");
+        return -1;
+    }
+    if (policy != VM_WFX_TRAP_BLOCK && policy != VM_WFX_TRAP_POLL && policy != VM_WFX_PASSTHROUGH) {
+        ZF_LOGE("Failed to set wfx policy: Invalid policy");
+        return -1;
+    }
+    /* Whether WFx is trapped is configured for all vcpus by the kernel */
+    if (config_set(CONFIG_DISABLE_WFI_WFE_TRAPS) != (policy == VM_WFX_PASSTHROUGH)) {
+        ZF_LOGE("Failed to set wfx policy: Passthrough requires, and is the only policy of, kernels with WFI/WFE traps disabled");
+        return -1;
+    }
+    if (policy == VM_WFX_TRAP_POLL && poll_max_ticks == 0) {
+        ZF_LOGE("Failed to set wfx policy: Invalid poll window");
+        return -1;
+    }
+    if (!vcpu->vcpu_arch.wfx) {
+        vcpu->vcpu_arch.wfx = calloc(1, sizeof(vm_wfx_t));
+        if (!vcpu->vcpu_arch.wfx) {
+            ZF_LOGE("Failed to set wfx policy: Unable to allocate wfx state");
+            return -1;
+        }
+    }
+    vm_wfx_t *wfx = vcpu->vcpu_arch.wfx;
+    wfx->policy = policy;
+    wfx->poll_max_ticks = poll_max_ticks;
+    wfx->poll_ticks = 0;
+    wfx->polling = false;
+    return 0;
+}
+
+int vm_wfx_handler(vm_vcpu_t *vcpu, uint32_t hsr)
+{
+    vm_wfx_t *wfx = vcpu->vcpu_arch.wfx;
+    if (!wfx || wfx->policy != VM_WFX_TRAP_POLL) {
+#ifdef CONFIG_LIB_SEL4VM_EXIT_STATS
+        vcpu->exit_stats->wfx_blocks++;
+#endif
+        return VM_EXIT_UNHANDLED;
+    }
+    /* Leaving the fault pending blocks the vcpu until vm_inject_irq resumes it */
+    if (new_vcpu_fault(vcpu->vcpu_arch.fault, hsr)) {
+        ZF_LOGE("Failed to create new fault");
+        return VM_EXIT_HANDLE_ERROR;
+    }
+    wfx->wait_start = vm_exit_stats_timestamp();
+    wfx->poll_end = wfx->wait_start + wfx->poll_ticks;
+    wfx->polling = wfx->poll_ticks != 0;
+#ifdef CONFIG_LIB_SEL4VM_EXIT_STATS
+    if (!wfx->polling) {
+        vcpu->exit_stats->wfx_blocks++;
+    }
+#endif
+    return VM_EXIT_HANDLED;
+}
+
+/* Adapt the poll window to the length of the last wait, as KVM's halt_poll_ns does. Waits ending
+ * within a longer window grow it, waits longer than the maximum window shrink it */
+static void wfx_poll_adjust(vm_wfx_t *wfx, uint64_t wait_ticks)
+{
+    if (wait_ticks <= wfx->poll_ticks) {
+        return;
+    }
+    if (wait_ticks > wfx->poll_max_ticks) {
+        wfx->poll_ticks /= WFX_POLL_SHRINK;
+    } else if (!wfx->poll_ticks) {
+        wfx->poll_ticks = WFX_POLL_START_TICKS(wfx);
+    } else {
+        wfx->poll_ticks = MIN(wfx->poll_ticks * WFX_POLL_GROW, wfx->poll_max_ticks);
+    }
+}
+
+void vm_wfx_wake(vm_vcpu_t *vcpu)
+{
+    vm_wfx_t *wfx = vcpu->vcpu_arch.wfx;
+    if (wfx && wfx->policy == VM_WFX_TRAP_POLL) {
+        wfx_poll_adjust(wfx, vm_exit_stats_timestamp() - wfx->wait_start);
+    }
+}
+
+vm_vcpu_t *vm_wfx_poll_vcpu(vm_t *vm)
+{
+    for (unsigned int i = 0; i < vm->num_vcpus; i++) {
+        vm_vcpu_t *vcpu = vm->vcpus[i];
+        if (!vcpu->vcpu_arch.vcpu_thread && vcpu->vcpu_arch.wfx && vcpu->vcpu_arch.wfx->polling) {
+            return vcpu;
+        }
+    }
+    return NULL;
+}
+
+seL4_MessageInfo_t vm_wfx_wait(vm_vcpu_t *vcpu, seL4_CPtr endpoint, seL4_Word *badge)
+{
+    vm_wfx_t *wfx = vcpu ? vcpu->vcpu_arch.wfx : NULL;
+    if (!wfx || !wfx->polling) {
+        return seL4_Recv(endpoint, badge);
+    }
+
+    uint64_t now = vm_exit_stats_timestamp();
+    while (now < wfx->poll_end) {
+        /* Another vcpu thread or a handled host message injected an interrupt, resuming the vcpu */
+        if (fault_handled(vcpu->vcpu_arch.fault)) {
+            wfx->polling = false;
+#ifdef CONFIG_LIB_SEL4VM_EXIT_STATS
+            vcpu->exit_stats->wfx_polls_successful++;
+            vcpu->exit_stats->wfx_poll_ticks += now - wfx->wait_start;
+#endif
+            return seL4_Recv(endpoint, badge);
+        }
+        if (!vcpu->vcpu_arch.vcpu_thread) {
+            /* The host endpoint also receives the notifications that may wake the vcpu. A zero
+             * badge means nothing was pending */
+            seL4_MessageInfo_t tag = seL4_NBRecv(endpoint, badge);
+            if (*badge != 0) {
+                return tag;
+            }
+        }
+        now = vm_exit_stats_timestamp();
+    }
+    wfx->polling = false;
+#ifdef CONFIG_LIB_SEL4VM_EXIT_STATS
+    vcpu->exit_stats->wfx_polls_failed++;
+    vcpu->exit_stats->wfx_poll_ticks += now - wfx->wait_start;
+#endif
+    return seL4_Recv(endpoint, badge);
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <sel4/sel4.h>
+#include <sel4vm/guest_vm.h>
+
+/**
+ * Handle a trapped WFI/WFE according to the WFx policy of a vcpu. With the poll policy the vcpu is left blocked
+ * on its fault and the thread handling its faults polls for its wakeup in the next call to vm_wfx_wait
+ * @param {vm_vcpu_t *} vcpu        A handle to the vcpu
+ * @param {uint32_t} hsr            HSR value of the vcpu fault
+ * @return                          VM_EXIT_HANDLED if the wait was handled, VM_EXIT_UNHANDLED if it is left to the
+ *                                  unhandled vcpu fault callback, VM_EXIT_HANDLE_ERROR on error
+ */
+int vm_wfx_handler(vm_vcpu_t *vcpu, uint32_t hsr);
+
+/**
+ * Account the wakeup of a vcpu waiting in a trapped WFx, adapting its poll window to the length of the wait
+ * @param {vm_vcpu_t *} vcpu        A handle to the vcpu
+ */
+void vm_wfx_wake(vm_vcpu_t *vcpu);
+
+/**
+ * Get a vcpu handled by the VM's host thread that polls for the end of a WFx
+ * @param {vm_t *} vm               A handle to the VM
+ * @return                          A handle to the vcpu, NULL if none is polling
+ */
+vm_vcpu_t *vm_wfx_poll_vcpu(vm_t *vm);
+
+/**
+ * Receive the next message on the endpoint of the thread handling a vcpu's faults. If the vcpu is waiting in a polled
+ * WFx, its wakeup is polled for until the end of its poll window before blocking. Host endpoint messages arriving
+ * meanwhile are returned without ending the poll. Must be called without holding the VMM lock
+ * @param {vm_vcpu_t *} vcpu        A handle to the vcpu, NULL to only receive
+ * @param {seL4_CPtr} endpoint      Endpoint to receive on
+ * @param {seL4_Word *} badge       Pointer to store the badge of the received message
+ * @return                          Message info of the received message
+ */
+seL4_MessageInfo_t vm_wfx_wait(vm_vcpu_t *vcpu, seL4_CPtr endpoint, seL4_Word *badge);
@@ -31,6 +31,11 @@
 #include "processor/apicdef.h"
 #include "processor/lapic.h"
 #include "processor/platfeature.h"
+#include "processor/cpuid.h"
+#include "processor/msr.h"
+#include "vcpu_thread.h"
+#include "vmexit.h"
+#include "halt.h"
 
 #define VM_VMCS_CR0_MASK           (X86_CR0_PG | X86_CR0_PE)
 #define VM_VMCS_CR0_VALUE          VM_VMCS_CR0_MASK
@@ -108,8 +113,37 @@ int vm_init_arch(vm_t *vm)
 
     vm->arch.vmcall_handlers = NULL;
     vm->arch.vmcall_num_handlers = 0;
+    vm->arch.vmcall_table_size = 0;
     vm->arch.ioport_list.num_ioports = 0;
     vm->arch.ioport_list.ioports = NULL;
+    vm->arch.ioport_list.port_map = NULL;
+    vm->arch.ioport_list.num_passthrough = 0;
+    vm->arch.ioport_list.passthrough = NULL;
+    vm->arch.vmm_lock = NULL;
+    vm->arch.pvclock = NULL;
+    vm->arch.ioapic = NULL;
+    vm->arch.cpuid = NULL;
+    vm->arch.msr_handlers = NULL;
+    vm->arch.msr_num_handlers = 0;
+    vm->arch.msr_table_size = 0;
+    vm->arch.exit_profile = VM_EXIT_PROFILE_COMPATIBLE;
+    vm->arch.pause_last_boosted = 0;
+    err = vm_msr_init(vm);
+    if (err) {
+        return -1;
+    }
+#ifdef CONFIG_LIB_SEL4VM_PV_UNHALT
+    err = vm_halt_init_pv_unhalt(vm);
+    if (err) {
+        return -1;
+    }
+#endif
+#ifdef CONFIG_LIB_SEL4VM_VCPU_THREADS
+    err = vm_vcpu_threads_init(vm);
+    if (err) {
+        return -1;
+    }
+#endif
 
     /* Create an EPT which is the pd for all the vcpu tcbs */
     err = vka_alloc_ept_pml4(vm->vka, &vm->mem.vm_vspace_root);
@@ -141,8 +175,25 @@ int vm_init_arch(vm_t *vm)
 int vm_create_vcpu_arch(vm_t *vm, vm_vcpu_t *vcpu)
 {
     int err;
-    err = seL4_X86_VCPU_SetTCB(vcpu->vcpu.cptr, simple_get_tcb(vm->simple));
-    assert(err == seL4_NoError);
+#ifdef CONFIG_LIB_SEL4VM_VCPU_THREADS
+    if (vcpu->vcpu_id != BOOT_VCPU) {
+        /* Application processors are run by their own VMM thread */
+        err = vm_vcpu_thread_create(vcpu);
+        if (err) {
+            return -1;
+        }
+    } else
+#endif
+    {
+        err = seL4_X86_VCPU_SetTCB(vcpu->vcpu.cptr, simple_get_tcb(vm->simple));
+        assert(err == seL4_NoError);
+    }
+    if (!vm->arch.cpuid) {
+        err = vm_cpuid_init(vm);
+        if (err) {
+            return -1;
+        }
+    }
     /* All LAPICs are created enabled, in virtual wire mode */
     vm_create_lapic(vcpu, 1);
     vcpu->vcpu_arch.guest_state = calloc(1, sizeof(guest_state_t));
@@ -170,5 +221,36 @@ int vm_create_vcpu_arch(vm_t *vm, vm_vcpu_t *vcpu)
     vm_guest_state_set_cr4(vcpu->vcpu_arch.guest_state, vcpu->vcpu_arch.guest_state->virt.cr.cr4_host_bits);
     /* Init guest OS vcpu state. */
     vm_vmcs_init_guest(vcpu);
+    return vm_ioport_passthrough_vcpu(vcpu);
+}
+
+void vm_destroy_vcpu_arch(vm_t *vm, vm_vcpu_t *vcpu)
+{
+#ifdef CONFIG_LIB_SEL4VM_VCPU_THREADS
+    vm_vcpu_thread_destroy(vcpu);
+#endif
+    vm_free_lapic(vcpu);
+    free(vcpu->vcpu_arch.guest_state);
+}
+
+void vm_destroy_arch(vm_t *vm)
+{
+    /* Let the next VM bind the host endpoint again */
+    seL4_TCB_UnbindNotification(simple_get_init_cap(vm->simple, seL4_CapInitThreadTCB));
+    vm_ioport_list_destroy(vm);
+    vm_cpuid_destroy(vm);
+    free(vm->arch.vmcall_handlers);
+    free(vm->arch.msr_handlers);
+    free(vm->arch.vmm_lock);
+}
+
+int vm_vcpu_sched_target_arch(vm_vcpu_t *vcpu, seL4_CPtr *tcb, int *core)
+{
+    *tcb = vm_vcpu_thread_tcb(vcpu);
+    if (*tcb == seL4_CapNull) {
+        /* The vcpu executes on the VMM's own thread */
+        return -1;
+    }
+    *core = vcpu->target_cpu >= 0 ? vcpu->target_cpu : 0;
     return 0;
 }
@@ -20,6 +20,7 @@
 #include "debug.h"
 #include "processor/decode.h"
 #include "guest_memory.h"
+#include "guest_mmio_dispatch.h"
 
 #define EPT_VIOL_READ(qual) ((qual) & BIT(0))
 #define EPT_VIOL_WRITE(qual) ((qual) & BIT(1))
@@ -50,6 +51,9 @@ static int unhandled_memory_fault(vm_t *vm, vm_vcpu_t *vcpu, uint32_t guest_phys
     case FAULT_IGNORE:
         vm_guest_exit_next_instruction(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr);
         return 0;
+    case FAULT_PENDING:
+        vcpu->vcpu_arch.guest_state->virt.fault_pending = 1;
+        return 0;
     }
     return -1;
 }
@@ -77,16 +81,25 @@ int vm_ept_violation_handler(vm_vcpu_t *vcpu)
     uint32_t imm;
     int size;
     vm_decode_ept_violation(vcpu, &reg, &imm, &size);
-    memory_fault_result_t fault_result = vm_memory_handle_fault(vcpu->vm, vcpu, guest_phys, size);
+    memory_fault_result_t fault_result;
+    if (!vm_mmio_dispatch_fault(vcpu->vm, vcpu, guest_phys, size, &fault_result)) {
+        fault_result = vm_memory_handle_fault(vcpu->vm, vcpu, guest_phys, size);
+    }
     switch (fault_result) {
     case FAULT_ERROR:
         print_ept_violation(vcpu);
         return -1;
     case FAULT_HANDLED:
+    case FAULT_RESTART:
+        /* Restarted faults re-execute the faulting instruction */
         return VM_EXIT_HANDLED;
     case FAULT_IGNORE:
         vm_guest_exit_next_instruction(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr);
         return VM_EXIT_HANDLED;
+    case FAULT_PENDING:
+        /* Don't resume the guest until the fault is completed */
+        vcpu->vcpu_arch.guest_state->virt.fault_pending = 1;
+        return VM_EXIT_HANDLED;
     case FAULT_UNHANDLED:
         if (vcpu->vm->mem.unhandled_mem_fault_handler) {
             err = unhandled_memory_fault(vcpu->vm, vcpu, guest_phys, size);
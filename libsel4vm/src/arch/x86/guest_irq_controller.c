@@ -4,10 +4,16 @@
  * SPDX-License-Identifier: BSD-2-Clause
  */
 
+#include <autoconf.h>
+#include <sel4vm/gen_config.h>
+
 #include <sel4vm/guest_vm.h>
 #include <sel4vm/guest_memory.h>
+#include <sel4vm/guest_irq_controller.h>
 
+#include "guest_irq_queue.h"
 #include "i8259/i8259.h"
+#include "ioapic/ioapic.h"
 #include "processor/apicdef.h"
 #include "processor/lapic.h"
 
@@ -33,5 +39,20 @@ int vm_create_default_irq_controller(vm_t *vm)
         return -1;
     }
 
+#ifdef CONFIG_LIB_SEL4VM_IOAPIC
+    err = vm_ioapic_init(vm);
+    if (err) {
+        return -1;
+    }
+#endif
+
     return 0;
 }
+
+int vm_irq_queue_deliver_arch(vm_vcpu_t *vcpu, vm_irq_event_t *event)
+{
+    if (event->type == VM_IRQ_EVENT_LEVEL) {
+        return vm_set_irq_level(vcpu, event->irq, event->irq_level);
+    }
+    return vm_inject_irq(vcpu, event->irq);
+}
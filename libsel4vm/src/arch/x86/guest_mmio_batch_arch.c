@@ -0,0 +1,40 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <inttypes.h>
+
+#include <utils/util.h>
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_memory.h>
+#include <sel4vm/guest_mmio_batch.h>
+
+#include "guest_state.h"
+#include "guest_memory.h"
+#include "guest_mmio_dispatch.h"
+#include "guest_mmio_batch.h"
+
+int vm_mmio_batch_access_arch(vm_vcpu_t *vcpu, vm_mmio_batch_op_t *op)
+{
+    guest_virt_state_t *virt = &vcpu->vcpu_arch.guest_state->virt;
+    memory_fault_result_t result;
+    if (op->width > sizeof(uint32_t)) {
+        ZF_LOGE("Failed to run batched mmio access: Accesses are at most 4 bytes wide");
+        return -1;
+    }
+    /* The fault accessors report the access in place of the exit the batch is run from */
+    virt->mmio_batch_op = op;
+    if (!vm_mmio_dispatch_fault(vcpu->vm, vcpu, op->addr, op->width, &result)) {
+        result = vm_memory_handle_fault(vcpu->vm, vcpu, op->addr, op->width);
+    }
+    virt->mmio_batch_op = NULL;
+    if (result != FAULT_HANDLED && result != FAULT_IGNORE) {
+        ZF_LOGE("Failed to run batched mmio access: Access to 0x%"PRIx64" not handled by a reservation (%d)",
+                op->addr, result);
+        return -1;
+    }
+    return 0;
+}
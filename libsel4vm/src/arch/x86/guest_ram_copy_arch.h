@@ -0,0 +1,34 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <string.h>
+
+/* Copy whole cache lines with non-temporal stores, which write around the cache rather than
+ * evicting the VMM's working set. The destination is cache line aligned. Returns the bytes copied */
+static inline size_t vm_ram_copy_stream_lines(void *dest, const void *src, size_t size)
+{
+    size_t done = 0;
+#ifdef __SSE2__
+    for (; done + 64 <= size; done += 64) {
+        unsigned long *line = dest + done;
+        for (int i = 0; i < 64 / sizeof(unsigned long); i++) {
+            unsigned long word;
+            memcpy(&word, src + done + i * sizeof(word), sizeof(word));
+            asm volatile("movnti %1, %0" : "=m"(line[i]) : "r"(word));
+        }
+    }
+#endif
+    return done;
+}
+
+/* Order non-temporal stores before any later stores */
+static inline void vm_ram_copy_stream_fence(void)
+{
+    asm volatile("sfence" ::: "memory");
+}
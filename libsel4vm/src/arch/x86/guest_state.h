@@ -10,6 +10,7 @@
 
 #include <sel4/sel4.h>
 
+#include <sel4vm/guest_mmio_batch.h>
 #include <sel4vm/arch/vmcs_fields.h>
 
 #include "vmcs.h"
@@ -63,19 +64,75 @@ typedef enum machine_state_status {
 #define IS_MACHINE_STATE_UNKNOWN(name) (name##_status == machine_state_unknown)
 #define IS_MACHINE_STATE_MODIFIED(name) (name##_status == machine_state_modified)
 
+/* A VMCS field shadowed by the guest state. State of the guest is only valid until the guest next runs. Control
+ * fields ('VMCS_CACHE_FIRST_CONTROL' onwards) are only ever written by the VMM and stay valid across guest entries */
+typedef enum vmcs_cache_field {
+    VMCS_CACHE_CR0,
+    VMCS_CACHE_CR3,
+    VMCS_CACHE_CR4,
+    VMCS_CACHE_RFLAGS,
+    VMCS_CACHE_INTERRUPTIBILITY,
+    VMCS_CACHE_ACTIVITY,
+    VMCS_CACHE_IDTR_BASE,
+    VMCS_CACHE_IDTR_LIMIT,
+    VMCS_CACHE_GDTR_BASE,
+    VMCS_CACHE_GDTR_LIMIT,
+    VMCS_CACHE_ES_SELECTOR,
+    VMCS_CACHE_CS_SELECTOR,
+    VMCS_CACHE_SS_SELECTOR,
+    VMCS_CACHE_DS_SELECTOR,
+    VMCS_CACHE_FS_SELECTOR,
+    VMCS_CACHE_GS_SELECTOR,
+    VMCS_CACHE_LDTR_SELECTOR,
+    VMCS_CACHE_TR_SELECTOR,
+    VMCS_CACHE_ES_BASE,
+    VMCS_CACHE_CS_BASE,
+    VMCS_CACHE_SS_BASE,
+    VMCS_CACHE_DS_BASE,
+    VMCS_CACHE_FS_BASE,
+    VMCS_CACHE_GS_BASE,
+    VMCS_CACHE_LDTR_BASE,
+    VMCS_CACHE_TR_BASE,
+    VMCS_CACHE_ES_LIMIT,
+    VMCS_CACHE_CS_LIMIT,
+    VMCS_CACHE_SS_LIMIT,
+    VMCS_CACHE_DS_LIMIT,
+    VMCS_CACHE_FS_LIMIT,
+    VMCS_CACHE_GS_LIMIT,
+    VMCS_CACHE_LDTR_LIMIT,
+    VMCS_CACHE_TR_LIMIT,
+    VMCS_CACHE_ES_ACCESS_RIGHTS,
+    VMCS_CACHE_CS_ACCESS_RIGHTS,
+    VMCS_CACHE_SS_ACCESS_RIGHTS,
+    VMCS_CACHE_DS_ACCESS_RIGHTS,
+    VMCS_CACHE_FS_ACCESS_RIGHTS,
+    VMCS_CACHE_GS_ACCESS_RIGHTS,
+    VMCS_CACHE_LDTR_ACCESS_RIGHTS,
+    VMCS_CACHE_TR_ACCESS_RIGHTS,
+    VMCS_CACHE_CR0_MASK,
+    VMCS_CACHE_FIRST_CONTROL = VMCS_CACHE_CR0_MASK,
+    VMCS_CACHE_CR4_MASK,
+    VMCS_CACHE_CR0_READ_SHADOW,
+    VMCS_CACHE_CR4_READ_SHADOW,
+    VMCS_CACHE_ENTRY_EXCEPTION_ERROR_CODE,
+    VMCS_CACHE_NUM_FIELDS
+} vmcs_cache_field_t;
+
+#define VMCS_CACHE_BIT(f) (1ull << (f))
+#define VMCS_CACHE_CONTROL_FIELDS (~(VMCS_CACHE_BIT(VMCS_CACHE_FIRST_CONTROL) - 1))
+
+typedef struct vmcs_cache {
+    /* Fields whose value in 'value' is up to date */
+    uint64_t valid;
+    /* Fields we have modified that need to be written back to the VMCS before the guest is resumed */
+    uint64_t dirty;
+    unsigned int value[VMCS_CACHE_NUM_FIELDS];
+} vmcs_cache_t;
+
 typedef struct guest_machine_state {
     MACHINE_STATE(seL4_VCPUContext, context);
-    MACHINE_STATE(unsigned int, cr0);
-    MACHINE_STATE(unsigned int, cr3);
-    MACHINE_STATE(unsigned int, cr4);
-    MACHINE_STATE(unsigned int, rflags);
-    MACHINE_STATE(unsigned int, guest_interruptibility);
-    MACHINE_STATE(unsigned int, idt_base);
-    MACHINE_STATE(unsigned int, idt_limit);
-    MACHINE_STATE(unsigned int, gdt_base);
-    MACHINE_STATE(unsigned int, gdt_limit);
-    MACHINE_STATE(unsigned int, cs_selector);
-    MACHINE_STATE(unsigned int, entry_exception_error_code);
+    /* Shadow of the VMCS, see 'vmcs_cache_field_t' */
+    vmcs_cache_t vmcs;
     /* This is state that we set on VMentry and get back on
      * a vmexit, therefore it is always valid and correct */
     unsigned int eip;
@@ -92,10 +149,83 @@ typedef struct guest_machine_state {
 #define USER_CONTEXT_EDI 5
 #define USER_CONTEXT_EBP 6
 
+/* Number of entries in the per vcpu cache of decoded instructions, must be a power of 2 */
+#define DECODE_CACHE_SIZE 16
+/* Longest possible x86 instruction */
+#define MAX_INSTR_LEN 15
+
+/* An instruction previously decoded by 'vm_decode_ept_violation' */
+typedef struct decode_cache_entry {
+    bool valid;
+    /* Guest address space and address the instruction was fetched from */
+    unsigned int cr3;
+    unsigned int eip;
+    /* Guest physical address of the instruction, used to revalidate the cached bytes */
+    uintptr_t instr_phys;
+    int instr_len;
+    uint8_t instr[MAX_INSTR_LEN];
+    /* Decoded operands */
+    int reg;
+    uint32_t imm;
+    int size;
+} decode_cache_entry_t;
+
+/* Number of entries in the per vcpu software TLB of guest page table walks, must be a power of 2 */
+#define GUEST_TLB_SIZE 16
+
+/* A guest virtual to guest physical translation of a 4K page, cached by 'vm_guest_virt_to_phys' */
+typedef struct guest_tlb_entry {
+    bool valid;
+    /* Translated through a 4M page, such that an invlpg anywhere in the 4M region drops the entry */
+    bool large;
+    unsigned int cr3;
+    uint32_t vpage;
+    uint32_t ppage;
+} guest_tlb_entry_t;
+
 typedef struct guest_virt_state {
     guest_cr_virt_state_t cr;
     /* are we hlt'ed waiting for an interrupted */
     int interrupt_halt;
+    /* has an interrupt arrived or the interrupt window opened since the last guest entry */
+    int interrupt_check;
+    /* are we hlt'ed in the HLT activity state, i.e. still entering the guest */
+    int activity_halt;
+    /* is the VMX preemption timer enabled in the pin based controls */
+    int vmx_timer_enabled;
+    /* is unrestricted guest mode enabled, such that real mode runs natively */
+    int unrestricted_guest;
+    /* Cycles to poll for events before blocking when hlt'ed */
+    uint64_t halt_poll_cycles;
+    /* set by other vcpu threads before kicking this vcpu */
+    int kick_pending;
+    /* is a memory fault waiting on 'vm_complete_fault', and has it been completed with 'fault_data' */
+    int fault_pending;
+    int fault_completed;
+    seL4_Word fault_data;
+    /* Access of a batch being run by 'vm_mmio_batch_run', reported by the vcpu fault accessors in place of the exit */
+    vm_mmio_batch_op_t *mmio_batch_op;
+    /* Recently decoded instructions, indexed by eip */
+    decode_cache_entry_t decode_cache[DECODE_CACHE_SIZE];
+    /* Recent guest page table walks, indexed by virtual page */
+    guest_tlb_entry_t tlb[GUEST_TLB_SIZE];
+    /* Value of the kvmclock system time MSR and version of the published pvclock structure */
+    uint64_t pvclock_msr;
+    uint32_t pvclock_version;
+    /* Value of the steal time MSR, version of the published steal time structure and the steal time it holds */
+    uint64_t steal_time_msr;
+    uint32_t steal_time_version;
+    uint64_t steal_time_ns;
+    /* Timestamp and consumed scheduling context time steal time was last accounted at, and the cycles spent
+     * waiting on events whilst halted since */
+    uint64_t steal_time_last;
+    uint64_t steal_time_last_consumed_us;
+    uint64_t steal_time_idle_cycles;
+    /* set by the KVM_HC_KICK_CPU of another vcpu, waking this vcpu from its current or next halt */
+    int pv_unhalted;
+    /* Timestamps of the last pause exit and of the start of the spin loop it belongs to */
+    uint64_t pause_last;
+    uint64_t pause_spin_start;
 } guest_virt_state_t;
 
 typedef struct guest_state {
@@ -110,55 +240,206 @@ typedef struct guest_state {
     guest_exit_information_t exit;
 } guest_state_t;
 
+/* Map a VMCS field encoding onto its cache field, -1 if the field is not cached */
+static inline int vmcs_cache_field_index(seL4_Word field)
+{
+    switch (field) {
+    case VMX_GUEST_CR0:
+        return VMCS_CACHE_CR0;
+    case VMX_GUEST_CR3:
+        return VMCS_CACHE_CR3;
+    case VMX_GUEST_CR4:
+        return VMCS_CACHE_CR4;
+    case VMX_GUEST_RFLAGS:
+        return VMCS_CACHE_RFLAGS;
+    case VMX_GUEST_INTERRUPTABILITY:
+        return VMCS_CACHE_INTERRUPTIBILITY;
+    case VMX_GUEST_ACTIVITY:
+        return VMCS_CACHE_ACTIVITY;
+    case VMX_GUEST_IDTR_BASE:
+        return VMCS_CACHE_IDTR_BASE;
+    case VMX_GUEST_IDTR_LIMIT:
+        return VMCS_CACHE_IDTR_LIMIT;
+    case VMX_GUEST_GDTR_BASE:
+        return VMCS_CACHE_GDTR_BASE;
+    case VMX_GUEST_GDTR_LIMIT:
+        return VMCS_CACHE_GDTR_LIMIT;
+    case VMX_GUEST_ES_SELECTOR:
+        return VMCS_CACHE_ES_SELECTOR;
+    case VMX_GUEST_CS_SELECTOR:
+        return VMCS_CACHE_CS_SELECTOR;
+    case VMX_GUEST_SS_SELECTOR:
+        return VMCS_CACHE_SS_SELECTOR;
+    case VMX_GUEST_DS_SELECTOR:
+        return VMCS_CACHE_DS_SELECTOR;
+    case VMX_GUEST_FS_SELECTOR:
+        return VMCS_CACHE_FS_SELECTOR;
+    case VMX_GUEST_GS_SELECTOR:
+        return VMCS_CACHE_GS_SELECTOR;
+    case VMX_GUEST_LDTR_SELECTOR:
+        return VMCS_CACHE_LDTR_SELECTOR;
+    case VMX_GUEST_TR_SELECTOR:
+        return VMCS_CACHE_TR_SELECTOR;
+    case VMX_GUEST_ES_BASE:
+        return VMCS_CACHE_ES_BASE;
+    case VMX_GUEST_CS_BASE:
+        return VMCS_CACHE_CS_BASE;
+    case VMX_GUEST_SS_BASE:
+        return VMCS_CACHE_SS_BASE;
+    case VMX_GUEST_DS_BASE:
+        return VMCS_CACHE_DS_BASE;
+    case VMX_GUEST_FS_BASE:
+        return VMCS_CACHE_FS_BASE;
+    case VMX_GUEST_GS_BASE:
+        return VMCS_CACHE_GS_BASE;
+    case VMX_GUEST_LDTR_BASE:
+        return VMCS_CACHE_LDTR_BASE;
+    case VMX_GUEST_TR_BASE:
+        return VMCS_CACHE_TR_BASE;
+    case VMX_GUEST_ES_LIMIT:
+        return VMCS_CACHE_ES_LIMIT;
+    case VMX_GUEST_CS_LIMIT:
+        return VMCS_CACHE_CS_LIMIT;
+    case VMX_GUEST_SS_LIMIT:
+        return VMCS_CACHE_SS_LIMIT;
+    case VMX_GUEST_DS_LIMIT:
+        return VMCS_CACHE_DS_LIMIT;
+    case VMX_GUEST_FS_LIMIT:
+        return VMCS_CACHE_FS_LIMIT;
+    case VMX_GUEST_GS_LIMIT:
+        return VMCS_CACHE_GS_LIMIT;
+    case VMX_GUEST_LDTR_LIMIT:
+        return VMCS_CACHE_LDTR_LIMIT;
+    case VMX_GUEST_TR_LIMIT:
+        return VMCS_CACHE_TR_LIMIT;
+    case VMX_GUEST_ES_ACCESS_RIGHTS:
+        return VMCS_CACHE_ES_ACCESS_RIGHTS;
+    case VMX_GUEST_CS_ACCESS_RIGHTS:
+        return VMCS_CACHE_CS_ACCESS_RIGHTS;
+    case VMX_GUEST_SS_ACCESS_RIGHTS:
+        return VMCS_CACHE_SS_ACCESS_RIGHTS;
+    case VMX_GUEST_DS_ACCESS_RIGHTS:
+        return VMCS_CACHE_DS_ACCESS_RIGHTS;
+    case VMX_GUEST_FS_ACCESS_RIGHTS:
+        return VMCS_CACHE_FS_ACCESS_RIGHTS;
+    case VMX_GUEST_GS_ACCESS_RIGHTS:
+        return VMCS_CACHE_GS_ACCESS_RIGHTS;
+    case VMX_GUEST_LDTR_ACCESS_RIGHTS:
+        return VMCS_CACHE_LDTR_ACCESS_RIGHTS;
+    case VMX_GUEST_TR_ACCESS_RIGHTS:
+        return VMCS_CACHE_TR_ACCESS_RIGHTS;
+    case VMX_CONTROL_CR0_MASK:
+        return VMCS_CACHE_CR0_MASK;
+    case VMX_CONTROL_CR4_MASK:
+        return VMCS_CACHE_CR4_MASK;
+    case VMX_CONTROL_CR0_READ_SHADOW:
+        return VMCS_CACHE_CR0_READ_SHADOW;
+    case VMX_CONTROL_CR4_READ_SHADOW:
+        return VMCS_CACHE_CR4_READ_SHADOW;
+    case VMX_CONTROL_ENTRY_EXCEPTION_ERROR_CODE:
+        return VMCS_CACHE_ENTRY_EXCEPTION_ERROR_CODE;
+    default:
+        return -1;
+    }
+}
+
+/* VMCS field encoding of each cache field */
+static inline seL4_Word vmcs_cache_field_encoding(vmcs_cache_field_t f)
+{
+    static const seL4_Word encodings[VMCS_CACHE_NUM_FIELDS] = {
+        [VMCS_CACHE_CR0] = VMX_GUEST_CR0,
+        [VMCS_CACHE_CR3] = VMX_GUEST_CR3,
+        [VMCS_CACHE_CR4] = VMX_GUEST_CR4,
+        [VMCS_CACHE_RFLAGS] = VMX_GUEST_RFLAGS,
+        [VMCS_CACHE_INTERRUPTIBILITY] = VMX_GUEST_INTERRUPTABILITY,
+        [VMCS_CACHE_ACTIVITY] = VMX_GUEST_ACTIVITY,
+        [VMCS_CACHE_IDTR_BASE] = VMX_GUEST_IDTR_BASE,
+        [VMCS_CACHE_IDTR_LIMIT] = VMX_GUEST_IDTR_LIMIT,
+        [VMCS_CACHE_GDTR_BASE] = VMX_GUEST_GDTR_BASE,
+        [VMCS_CACHE_GDTR_LIMIT] = VMX_GUEST_GDTR_LIMIT,
+        [VMCS_CACHE_ES_SELECTOR] = VMX_GUEST_ES_SELECTOR,
+        [VMCS_CACHE_CS_SELECTOR] = VMX_GUEST_CS_SELECTOR,
+        [VMCS_CACHE_SS_SELECTOR] = VMX_GUEST_SS_SELECTOR,
+        [VMCS_CACHE_DS_SELECTOR] = VMX_GUEST_DS_SELECTOR,
+        [VMCS_CACHE_FS_SELECTOR] = VMX_GUEST_FS_SELECTOR,
+        [VMCS_CACHE_GS_SELECTOR] = VMX_GUEST_GS_SELECTOR,
+        [VMCS_CACHE_LDTR_SELECTOR] = VMX_GUEST_LDTR_SELECTOR,
+        [VMCS_CACHE_TR_SELECTOR] = VMX_GUEST_TR_SELECTOR,
+        [VMCS_CACHE_ES_BASE] = VMX_GUEST_ES_BASE,
+        [VMCS_CACHE_CS_BASE] = VMX_GUEST_CS_BASE,
+        [VMCS_CACHE_SS_BASE] = VMX_GUEST_SS_BASE,
+        [VMCS_CACHE_DS_BASE] = VMX_GUEST_DS_BASE,
+        [VMCS_CACHE_FS_BASE] = VMX_GUEST_FS_BASE,
+        [VMCS_CACHE_GS_BASE] = VMX_GUEST_GS_BASE,
+        [VMCS_CACHE_LDTR_BASE] = VMX_GUEST_LDTR_BASE,
+        [VMCS_CACHE_TR_BASE] = VMX_GUEST_TR_BASE,
+        [VMCS_CACHE_ES_LIMIT] = VMX_GUEST_ES_LIMIT,
+        [VMCS_CACHE_CS_LIMIT] = VMX_GUEST_CS_LIMIT,
+        [VMCS_CACHE_SS_LIMIT] = VMX_GUEST_SS_LIMIT,
+        [VMCS_CACHE_DS_LIMIT] = VMX_GUEST_DS_LIMIT,
+        [VMCS_CACHE_FS_LIMIT] = VMX_GUEST_FS_LIMIT,
+        [VMCS_CACHE_GS_LIMIT] = VMX_GUEST_GS_LIMIT,
+        [VMCS_CACHE_LDTR_LIMIT] = VMX_GUEST_LDTR_LIMIT,
+        [VMCS_CACHE_TR_LIMIT] = VMX_GUEST_TR_LIMIT,
+        [VMCS_CACHE_ES_ACCESS_RIGHTS] = VMX_GUEST_ES_ACCESS_RIGHTS,
+        [VMCS_CACHE_CS_ACCESS_RIGHTS] = VMX_GUEST_CS_ACCESS_RIGHTS,
+        [VMCS_CACHE_SS_ACCESS_RIGHTS] = VMX_GUEST_SS_ACCESS_RIGHTS,
+        [VMCS_CACHE_DS_ACCESS_RIGHTS] = VMX_GUEST_DS_ACCESS_RIGHTS,
+        [VMCS_CACHE_FS_ACCESS_RIGHTS] = VMX_GUEST_FS_ACCESS_RIGHTS,
+        [VMCS_CACHE_GS_ACCESS_RIGHTS] = VMX_GUEST_GS_ACCESS_RIGHTS,
+        [VMCS_CACHE_LDTR_ACCESS_RIGHTS] = VMX_GUEST_LDTR_ACCESS_RIGHTS,
+        [VMCS_CACHE_TR_ACCESS_RIGHTS] = VMX_GUEST_TR_ACCESS_RIGHTS,
+        [VMCS_CACHE_CR0_MASK] = VMX_CONTROL_CR0_MASK,
+        [VMCS_CACHE_CR4_MASK] = VMX_CONTROL_CR4_MASK,
+        [VMCS_CACHE_CR0_READ_SHADOW] = VMX_CONTROL_CR0_READ_SHADOW,
+        [VMCS_CACHE_CR4_READ_SHADOW] = VMX_CONTROL_CR4_READ_SHADOW,
+        [VMCS_CACHE_ENTRY_EXCEPTION_ERROR_CODE] = VMX_CONTROL_ENTRY_EXCEPTION_ERROR_CODE,
+    };
+    return encodings[f];
+}
+
 static inline bool vm_guest_state_no_modified(guest_state_t *gs)
 {
-    return !(
-               IS_MACHINE_STATE_MODIFIED(gs->machine.context) ||
-               IS_MACHINE_STATE_MODIFIED(gs->machine.cr0) ||
-               IS_MACHINE_STATE_MODIFIED(gs->machine.cr3) ||
-               IS_MACHINE_STATE_MODIFIED(gs->machine.cr4) ||
-               IS_MACHINE_STATE_MODIFIED(gs->machine.rflags) ||
-               IS_MACHINE_STATE_MODIFIED(gs->machine.guest_interruptibility) ||
-               IS_MACHINE_STATE_MODIFIED(gs->machine.idt_base) ||
-               IS_MACHINE_STATE_MODIFIED(gs->machine.idt_limit) ||
-               IS_MACHINE_STATE_MODIFIED(gs->machine.gdt_base) ||
-               IS_MACHINE_STATE_MODIFIED(gs->machine.gdt_limit) ||
-               IS_MACHINE_STATE_MODIFIED(gs->machine.cs_selector) ||
-               IS_MACHINE_STATE_MODIFIED(gs->machine.entry_exception_error_code)
-           );
+    return !IS_MACHINE_STATE_MODIFIED(gs->machine.context) && !gs->machine.vmcs.dirty;
 }
 
 static inline void vm_guest_state_initialise(guest_state_t *gs)
 {
     memset(gs, 0, sizeof(guest_state_t));
     MACHINE_STATE_INIT(gs->machine.context);
-    MACHINE_STATE_INIT(gs->machine.cr0);
-    MACHINE_STATE_INIT(gs->machine.cr3);
-    MACHINE_STATE_INIT(gs->machine.cr4);
-    MACHINE_STATE_INIT(gs->machine.rflags);
-    MACHINE_STATE_INIT(gs->machine.guest_interruptibility);
-    MACHINE_STATE_INIT(gs->machine.idt_base);
-    MACHINE_STATE_INIT(gs->machine.idt_limit);
-    MACHINE_STATE_INIT(gs->machine.gdt_base);
-    MACHINE_STATE_INIT(gs->machine.gdt_limit);
-    MACHINE_STATE_INIT(gs->machine.cs_selector);
-    MACHINE_STATE_INIT(gs->machine.entry_exception_error_code);
 }
 
 static inline void vm_guest_state_invalidate_all(guest_state_t *gs)
 {
     MACHINE_STATE_INVAL(gs->machine.context);
-    MACHINE_STATE_INVAL(gs->machine.cr0);
-    MACHINE_STATE_INVAL(gs->machine.cr3);
-    MACHINE_STATE_INVAL(gs->machine.cr4);
-    MACHINE_STATE_INVAL(gs->machine.rflags);
-    MACHINE_STATE_INVAL(gs->machine.guest_interruptibility);
-    MACHINE_STATE_INVAL(gs->machine.idt_base);
-    MACHINE_STATE_INVAL(gs->machine.idt_limit);
-    MACHINE_STATE_INVAL(gs->machine.gdt_base);
-    MACHINE_STATE_INVAL(gs->machine.gdt_limit);
-    MACHINE_STATE_INVAL(gs->machine.cs_selector);
-    MACHINE_STATE_INVAL(gs->machine.entry_exception_error_code);
+    assert(!gs->machine.vmcs.dirty);
+    gs->machine.vmcs.valid &= VMCS_CACHE_CONTROL_FIELDS;
+}
+
+/* Record the value of a field reported by the kernel on a vm exit */
+static inline void vm_guest_state_vmcs_fill(guest_state_t *gs, vmcs_cache_field_t f, unsigned int value)
+{
+    assert(!(gs->machine.vmcs.valid & VMCS_CACHE_BIT(f)));
+    gs->machine.vmcs.value[f] = value;
+    gs->machine.vmcs.valid |= VMCS_CACHE_BIT(f);
+}
+
+static inline unsigned int vm_guest_state_vmcs_get(guest_state_t *gs, seL4_CPtr vcpu, vmcs_cache_field_t f)
+{
+    if (!(gs->machine.vmcs.valid & VMCS_CACHE_BIT(f))) {
+        unsigned int value;
+        int err = vm_vmcs_read(vcpu, vmcs_cache_field_encoding(f), &value);
+        assert(!err);
+        vm_guest_state_vmcs_fill(gs, f, value);
+    }
+    return gs->machine.vmcs.value[f];
+}
+
+static inline void vm_guest_state_vmcs_set(guest_state_t *gs, vmcs_cache_field_t f, unsigned int value)
+{
+    gs->machine.vmcs.value[f] = value;
+    gs->machine.vmcs.valid |= VMCS_CACHE_BIT(f);
+    gs->machine.vmcs.dirty |= VMCS_CACHE_BIT(f);
 }
 
 /* get */
@@ -169,62 +450,32 @@ static inline unsigned int vm_guest_state_get_eip(guest_state_t *gs)
 
 static inline unsigned int vm_guest_state_get_cr0(guest_state_t *gs, seL4_CPtr vcpu)
 {
-    int err;
-    unsigned int value;
-    if (IS_MACHINE_STATE_UNKNOWN(gs->machine.cr0)) {
-        err = vm_vmcs_read(vcpu, VMX_GUEST_CR0, &value);
-        assert(!err);
-        MACHINE_STATE_READ(gs->machine.cr0, value);
-    }
-    return gs->machine.cr0;
+    return vm_guest_state_vmcs_get(gs, vcpu, VMCS_CACHE_CR0);
 }
 
 static inline unsigned int vm_guest_state_get_cr3(guest_state_t *gs, seL4_CPtr vcpu)
 {
-    int err;
-    unsigned int value;
-    if (IS_MACHINE_STATE_UNKNOWN(gs->machine.cr3)) {
-        err = vm_vmcs_read(vcpu, VMX_GUEST_CR3, &value);
-        assert(!err);
-        MACHINE_STATE_READ(gs->machine.cr3, value);
-    }
-    return gs->machine.cr3;
+    return vm_guest_state_vmcs_get(gs, vcpu, VMCS_CACHE_CR3);
 }
 
 static inline unsigned int vm_guest_state_get_cr4(guest_state_t *gs, seL4_CPtr vcpu)
 {
-    int err;
-    unsigned int value;
-    if (IS_MACHINE_STATE_UNKNOWN(gs->machine.cr4)) {
-        err = vm_vmcs_read(vcpu, VMX_GUEST_CR4, &value);
-        assert(!err);
-        MACHINE_STATE_READ(gs->machine.cr4, value);
-    }
-    return gs->machine.cr4;
+    return vm_guest_state_vmcs_get(gs, vcpu, VMCS_CACHE_CR4);
 }
 
 static inline unsigned int vm_guest_state_get_rflags(guest_state_t *gs, seL4_CPtr vcpu)
 {
-    int err;
-    unsigned int value;
-    if (IS_MACHINE_STATE_UNKNOWN(gs->machine.rflags)) {
-        err = vm_vmcs_read(vcpu, VMX_GUEST_RFLAGS, &value);
-        assert(!err);
-        MACHINE_STATE_READ(gs->machine.rflags, value);
-    }
-    return gs->machine.rflags;
+    return vm_guest_state_vmcs_get(gs, vcpu, VMCS_CACHE_RFLAGS);
 }
 
 static inline unsigned int vm_guest_state_get_interruptibility(guest_state_t *gs, seL4_CPtr vcpu)
 {
-    int err;
-    unsigned int value;
-    if (IS_MACHINE_STATE_UNKNOWN(gs->machine.guest_interruptibility)) {
-        err = vm_vmcs_read(vcpu, VMX_GUEST_INTERRUPTABILITY, &value);
-        assert(!err);
-        MACHINE_STATE_READ(gs->machine.guest_interruptibility, value);
-    }
-    return gs->machine.guest_interruptibility;
+    return vm_guest_state_vmcs_get(gs, vcpu, VMCS_CACHE_INTERRUPTIBILITY);
+}
+
+static inline unsigned int vm_guest_state_get_activity(guest_state_t *gs, seL4_CPtr vcpu)
+{
+    return vm_guest_state_vmcs_get(gs, vcpu, VMCS_CACHE_ACTIVITY);
 }
 
 static inline unsigned int vm_guest_state_get_control_entry(guest_state_t *gs)
@@ -239,62 +490,27 @@ static inline unsigned int vm_guest_state_get_control_ppc(guest_state_t *gs)
 
 static inline unsigned int vm_guest_state_get_idt_base(guest_state_t *gs, seL4_CPtr vcpu)
 {
-    int err;
-    unsigned int value;
-    if (IS_MACHINE_STATE_UNKNOWN(gs->machine.idt_base)) {
-        err = vm_vmcs_read(vcpu, VMX_GUEST_IDTR_BASE, &value);
-        assert(!err);
-        MACHINE_STATE_READ(gs->machine.idt_base, value);
-    }
-    return gs->machine.idt_base;
+    return vm_guest_state_vmcs_get(gs, vcpu, VMCS_CACHE_IDTR_BASE);
 }
 
 static inline unsigned int vm_guest_state_get_idt_limit(guest_state_t *gs, seL4_CPtr vcpu)
 {
-    int err;
-    unsigned int value;
-    if (IS_MACHINE_STATE_UNKNOWN(gs->machine.idt_limit)) {
-        err = vm_vmcs_read(vcpu, VMX_GUEST_IDTR_LIMIT, &value);
-        assert(!err);
-        MACHINE_STATE_READ(gs->machine.idt_limit, value);
-    }
-    return gs->machine.idt_limit;
+    return vm_guest_state_vmcs_get(gs, vcpu, VMCS_CACHE_IDTR_LIMIT);
 }
 
 static inline unsigned int vm_guest_state_get_gdt_base(guest_state_t *gs, seL4_CPtr vcpu)
 {
-    int err;
-    unsigned int value;
-    if (IS_MACHINE_STATE_UNKNOWN(gs->machine.gdt_base)) {
-        err = vm_vmcs_read(vcpu, VMX_GUEST_GDTR_BASE, &value);
-        assert(!err);
-        MACHINE_STATE_READ(gs->machine.gdt_base, value);
-    }
-    return gs->machine.gdt_base;
+    return vm_guest_state_vmcs_get(gs, vcpu, VMCS_CACHE_GDTR_BASE);
 }
 
 static inline unsigned int vm_guest_state_get_gdt_limit(guest_state_t *gs, seL4_CPtr vcpu)
 {
-    int err;
-    unsigned int value;
-    if (IS_MACHINE_STATE_UNKNOWN(gs->machine.gdt_limit)) {
-        err = vm_vmcs_read(vcpu, VMX_GUEST_GDTR_LIMIT, &value);
-        assert(!err);
-        MACHINE_STATE_READ(gs->machine.gdt_limit, value);
-    }
-    return gs->machine.gdt_limit;
+    return vm_guest_state_vmcs_get(gs, vcpu, VMCS_CACHE_GDTR_LIMIT);
 }
 
 static inline unsigned int vm_guest_state_get_cs_selector(guest_state_t *gs, seL4_CPtr vcpu)
 {
-    int err;
-    unsigned int value;
-    if (IS_MACHINE_STATE_UNKNOWN(gs->machine.cs_selector)) {
-        err = vm_vmcs_read(vcpu, VMX_GUEST_CS_SELECTOR, &value);
-        assert(!err);
-        MACHINE_STATE_READ(gs->machine.cs_selector, value);
-    }
-    return gs->machine.cs_selector;
+    return vm_guest_state_vmcs_get(gs, vcpu, VMCS_CACHE_CS_SELECTOR);
 }
 
 /* set */
@@ -305,26 +521,27 @@ static inline void vm_guest_state_set_eip(guest_state_t *gs, unsigned int val)
 
 static inline void vm_guest_state_set_cr0(guest_state_t *gs, unsigned int val)
 {
-    MACHINE_STATE_DIRTY(gs->machine.cr0);
-    gs->machine.cr0 = val;
+    vm_guest_state_vmcs_set(gs, VMCS_CACHE_CR0, val);
 }
 
 static inline void vm_guest_state_set_cr3(guest_state_t *gs, unsigned int val)
 {
-    MACHINE_STATE_DIRTY(gs->machine.cr3);
-    gs->machine.cr3 = val;
+    vm_guest_state_vmcs_set(gs, VMCS_CACHE_CR3, val);
 }
 
 static inline void vm_guest_state_set_cr4(guest_state_t *gs, unsigned int val)
 {
-    MACHINE_STATE_DIRTY(gs->machine.cr4);
-    gs->machine.cr4 = val;
+    vm_guest_state_vmcs_set(gs, VMCS_CACHE_CR4, val);
 }
 
 static inline void vm_guest_state_set_rflags(guest_state_t *gs, unsigned int val)
 {
-    MACHINE_STATE_DIRTY(gs->machine.rflags);
-    gs->machine.rflags = val;
+    vm_guest_state_vmcs_set(gs, VMCS_CACHE_RFLAGS, val);
+}
+
+static inline void vm_guest_state_set_activity(guest_state_t *gs, unsigned int val)
+{
+    vm_guest_state_vmcs_set(gs, VMCS_CACHE_ACTIVITY, val);
 }
 
 static inline void vm_guest_state_set_control_entry(guest_state_t *gs, unsigned int val)
@@ -339,145 +556,48 @@ static inline void vm_guest_state_set_control_ppc(guest_state_t *gs, unsigned in
 
 static inline void vm_guest_state_set_idt_base(guest_state_t *gs, unsigned int val)
 {
-    MACHINE_STATE_DIRTY(gs->machine.idt_base);
-    gs->machine.idt_base = val;
+    vm_guest_state_vmcs_set(gs, VMCS_CACHE_IDTR_BASE, val);
 }
 
 static inline void vm_guest_state_set_idt_limit(guest_state_t *gs, unsigned int val)
 {
-    MACHINE_STATE_DIRTY(gs->machine.idt_limit);
-    gs->machine.idt_limit = val;
+    vm_guest_state_vmcs_set(gs, VMCS_CACHE_IDTR_LIMIT, val);
 }
 
 static inline void vm_guest_state_set_gdt_base(guest_state_t *gs, unsigned int val)
 {
-    MACHINE_STATE_DIRTY(gs->machine.gdt_base);
-    gs->machine.gdt_base = val;
+    vm_guest_state_vmcs_set(gs, VMCS_CACHE_GDTR_BASE, val);
 }
 
 static inline void vm_guest_state_set_gdt_limit(guest_state_t *gs, unsigned int val)
 {
-    MACHINE_STATE_DIRTY(gs->machine.gdt_limit);
-    gs->machine.gdt_limit = val;
+    vm_guest_state_vmcs_set(gs, VMCS_CACHE_GDTR_LIMIT, val);
 }
 
 static inline void vm_guest_state_set_cs_selector(guest_state_t *gs, unsigned int val)
 {
-    MACHINE_STATE_DIRTY(gs->machine.cs_selector);
-    gs->machine.cs_selector = val;
+    vm_guest_state_vmcs_set(gs, VMCS_CACHE_CS_SELECTOR, val);
 }
 
 static inline void vm_guest_state_set_entry_exception_error_code(guest_state_t *gs, unsigned int val)
 {
-    MACHINE_STATE_DIRTY(gs->machine.entry_exception_error_code);
-    gs->machine.entry_exception_error_code = val;
+    vm_guest_state_vmcs_set(gs, VMCS_CACHE_ENTRY_EXCEPTION_ERROR_CODE, val);
 }
 
 /* sync */
-static inline void vm_guest_state_sync_cr0(guest_state_t *gs, seL4_CPtr vcpu)
-{
-    if (IS_MACHINE_STATE_MODIFIED(gs->machine.cr0)) {
-        int err = vm_vmcs_write(vcpu, VMX_GUEST_CR0, gs->machine.cr0);
-        assert(!err);
-        MACHINE_STATE_SYNC(gs->machine.cr0);
-    }
-}
-
-static inline void vm_guest_state_sync_cr3(guest_state_t *gs, seL4_CPtr vcpu)
-{
-    if (IS_MACHINE_STATE_MODIFIED(gs->machine.cr3)) {
-        int err = vm_vmcs_write(vcpu, VMX_GUEST_CR3, gs->machine.cr3);
-        assert(!err);
-        MACHINE_STATE_SYNC(gs->machine.cr3);
-    }
-}
-
-static inline void vm_guest_state_sync_cr4(guest_state_t *gs, seL4_CPtr vcpu)
-{
-    if (IS_MACHINE_STATE_MODIFIED(gs->machine.cr4)) {
-        int err = vm_vmcs_write(vcpu, VMX_GUEST_CR4, gs->machine.cr4);
-        assert(!err);
-        MACHINE_STATE_SYNC(gs->machine.cr4);
-    }
-}
-
-static inline void vm_guest_state_sync_rflags(guest_state_t *gs, seL4_CPtr vcpu)
-{
-    if (IS_MACHINE_STATE_MODIFIED(gs->machine.rflags)) {
-        int err = vm_vmcs_write(vcpu, VMX_GUEST_RFLAGS, gs->machine.rflags);
-        assert(!err);
-        MACHINE_STATE_SYNC(gs->machine.rflags);
-    }
-}
-
-static inline void vm_guest_state_sync_idt_base(guest_state_t *gs, seL4_CPtr vcpu)
-{
-    if (IS_MACHINE_STATE_MODIFIED(gs->machine.idt_base)) {
-        int err = vm_vmcs_write(vcpu, VMX_GUEST_IDTR_BASE, gs->machine.idt_base);
-        assert(!err);
-        MACHINE_STATE_SYNC(gs->machine.idt_base);
-    }
-}
-
-static inline void vm_guest_state_sync_idt_limit(guest_state_t *gs, seL4_CPtr vcpu)
-{
-    if (IS_MACHINE_STATE_MODIFIED(gs->machine.idt_limit)) {
-        int err = vm_vmcs_write(vcpu, VMX_GUEST_IDTR_LIMIT, gs->machine.idt_limit);
-        assert(!err);
-        MACHINE_STATE_SYNC(gs->machine.idt_limit);
-    }
-}
-
-static inline void vm_guest_state_sync_gdt_base(guest_state_t *gs, seL4_CPtr vcpu)
-{
-    if (IS_MACHINE_STATE_MODIFIED(gs->machine.gdt_base)) {
-        int err = vm_vmcs_write(vcpu, VMX_GUEST_GDTR_BASE, gs->machine.gdt_base);
-        assert(!err);
-        MACHINE_STATE_SYNC(gs->machine.gdt_base);
-    }
-}
-
-static inline void vm_guest_state_sync_gdt_limit(guest_state_t *gs, seL4_CPtr vcpu)
-{
-    if (IS_MACHINE_STATE_MODIFIED(gs->machine.gdt_limit)) {
-        int err = vm_vmcs_write(vcpu, VMX_GUEST_GDTR_LIMIT, gs->machine.gdt_limit);
-        assert(!err);
-        MACHINE_STATE_SYNC(gs->machine.gdt_limit);
-    }
-}
-
-static inline void vm_guest_state_sync_cs_selector(guest_state_t *gs, seL4_CPtr vcpu)
-{
-    if (IS_MACHINE_STATE_MODIFIED(gs->machine.cs_selector)) {
-        int err = vm_vmcs_write(vcpu, VMX_GUEST_CS_SELECTOR, gs->machine.cs_selector);
-        assert(!err);
-        MACHINE_STATE_SYNC(gs->machine.cs_selector);
-    }
-}
-
-static inline void vm_guest_state_sync_entry_exception_error_code(guest_state_t *gs, seL4_CPtr vcpu)
+/* Write all modified fields back to the VMCS. This is done once before the guest is resumed rather than on
+ * every modification */
+static inline void vm_sync_guest_vmcs_state(vm_vcpu_t *vcpu)
 {
-    if (IS_MACHINE_STATE_MODIFIED(gs->machine.entry_exception_error_code)) {
-        int err = vm_vmcs_write(vcpu, VMX_CONTROL_ENTRY_EXCEPTION_ERROR_CODE, gs->machine.entry_exception_error_code);
+    vmcs_cache_t *vmcs = &vcpu->vcpu_arch.guest_state->machine.vmcs;
+    while (vmcs->dirty) {
+        vmcs_cache_field_t f = __builtin_ctzll(vmcs->dirty);
+        int err = vm_vmcs_write(vcpu->vcpu.cptr, vmcs_cache_field_encoding(f), vmcs->value[f]);
         assert(!err);
-        MACHINE_STATE_SYNC(gs->machine.entry_exception_error_code);
+        vmcs->dirty &= ~VMCS_CACHE_BIT(f);
     }
 }
 
-static inline void vm_sync_guest_vmcs_state(vm_vcpu_t *vcpu)
-{
-    vm_guest_state_sync_cr0(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr);
-    vm_guest_state_sync_cr3(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr);
-    vm_guest_state_sync_cr4(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr);
-    vm_guest_state_sync_rflags(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr);
-    vm_guest_state_sync_idt_base(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr);
-    vm_guest_state_sync_idt_limit(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr);
-    vm_guest_state_sync_gdt_base(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr);
-    vm_guest_state_sync_gdt_limit(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr);
-    vm_guest_state_sync_cs_selector(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr);
-    vm_guest_state_sync_entry_exception_error_code(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr);
-}
-
 /**
  * Sync a VCPU's current context state (seL4_VCPUContext)
  * @param[in] vcpu      Handle to the vcpu
@@ -10,9 +10,15 @@
 
 #include "guest_state.h"
 #include "processor/decode.h"
+#include "processor/lapic.h"
+#include "vcpu_thread.h"
 
 seL4_Word get_vcpu_fault_address(vm_vcpu_t *vcpu)
 {
+    vm_mmio_batch_op_t *batch_op = vcpu->vcpu_arch.guest_state->virt.mmio_batch_op;
+    if (batch_op) {
+        return batch_op->addr;
+    }
     return vm_guest_exit_get_physical(vcpu->vcpu_arch.guest_state);
 }
 
@@ -26,6 +32,10 @@ seL4_Word get_vcpu_fault_data(vm_vcpu_t *vcpu)
     int reg;
     uint32_t imm;
     int size;
+    vm_mmio_batch_op_t *batch_op = vcpu->vcpu_arch.guest_state->virt.mmio_batch_op;
+    if (batch_op) {
+        return batch_op->value;
+    }
     vm_decode_ept_violation(vcpu, &reg, &imm, &size);
     int vcpu_reg = vm_decoder_reg_mapw[reg];
     unsigned int data;
@@ -38,6 +48,10 @@ size_t get_vcpu_fault_size(vm_vcpu_t *vcpu)
     int reg;
     uint32_t imm;
     int size;
+    vm_mmio_batch_op_t *batch_op = vcpu->vcpu_arch.guest_state->virt.mmio_batch_op;
+    if (batch_op) {
+        return batch_op->width;
+    }
     vm_decode_ept_violation(vcpu, &reg, &imm, &size);
     return size;
 }
@@ -67,6 +81,10 @@ seL4_Word get_vcpu_fault_data_mask(vm_vcpu_t *vcpu)
 
 bool is_vcpu_read_fault(vm_vcpu_t *vcpu)
 {
+    vm_mmio_batch_op_t *batch_op = vcpu->vcpu_arch.guest_state->virt.mmio_batch_op;
+    if (batch_op) {
+        return batch_op->op == VM_MMIO_BATCH_READ;
+    }
     unsigned int qualification = vm_guest_exit_get_qualification(vcpu->vcpu_arch.guest_state);
     return true ? qualification & BIT(0) : false;
 }
@@ -76,6 +94,11 @@ int set_vcpu_fault_data(vm_vcpu_t *vcpu, seL4_Word data)
     int reg;
     uint32_t imm;
     int size;
+    vm_mmio_batch_op_t *batch_op = vcpu->vcpu_arch.guest_state->virt.mmio_batch_op;
+    if (batch_op) {
+        batch_op->value = data;
+        return 0;
+    }
     vm_decode_ept_violation(vcpu, &reg, &imm, &size);
     int vcpu_reg = vm_decoder_reg_mapw[reg];
     return vm_set_thread_context_reg(vcpu, vcpu_reg, data);
@@ -83,10 +106,39 @@ int set_vcpu_fault_data(vm_vcpu_t *vcpu, seL4_Word data)
 
 void advance_vcpu_fault(vm_vcpu_t *vcpu)
 {
+    if (vcpu->vcpu_arch.guest_state->virt.mmio_batch_op) {
+        /* The exit the batch is run from advances the guest */
+        return;
+    }
     vm_guest_exit_next_instruction(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr);
 }
 
+int vm_complete_fault(vm_vcpu_t *vcpu, seL4_Word data)
+{
+    guest_virt_state_t *virt = &vcpu->vcpu_arch.guest_state->virt;
+    if (!virt->fault_pending || virt->fault_completed) {
+        ZF_LOGE("Failed to complete fault: vcpu %d has no pending fault", vcpu->vcpu_id);
+        return -1;
+    }
+    /* The vcpu's thread finishes the fault before it next resumes the guest */
+    virt->fault_data = data;
+    __atomic_store_n(&virt->fault_completed, 1, __ATOMIC_RELEASE);
+#ifdef CONFIG_LIB_SEL4VM_VCPU_THREADS
+    vm_vcpu_kick(vcpu);
+#endif
+    return 0;
+}
+
 void restart_vcpu_fault(vm_vcpu_t *vcpu)
 {
     return;
 }
+
+void wait_vcpu_fault(vm_vcpu_t *vcpu)
+{
+    /* Halt as hlt does, until the lapic has an interrupt to deliver */
+    if (vm_apic_has_interrupt(vcpu) == -1) {
+        vcpu->vcpu_arch.guest_state->virt.interrupt_halt = 1;
+    }
+    vm_guest_exit_next_instruction(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr);
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <autoconf.h>
+#include <sel4vm/gen_config.h>
+
+#include <utils/util.h>
+
+#include <sel4vm/guest_vm.h>
+
+#include "guest_vm_benchmark.h"
+#include "guest_state.h"
+#include "vmexit.h"
+#include "processor/decode.h"
+#include "processor/lapic.h"
+
+#ifdef CONFIG_LIB_SEL4VM_BENCHMARKS
+/* MMIO instructions as emitted by guest drivers */
+static uint8_t decode_bench_instrs[][MAX_INSTR_LEN] = {
+    /* mov %eax, (%ebx) */
+    { 0x89, 0x03 },
+    /* mov 0x10(%ebx), %ecx */
+    { 0x8b, 0x4b, 0x10 },
+    /* mov %ax, 0x10(%ebx) */
+    { 0x66, 0x89, 0x43, 0x10 },
+    /* movl $0x12345678, 0x4(%eax) */
+    { 0xc7, 0x40, 0x04, 0x78, 0x56, 0x34, 0x12 },
+};
+static const int decode_bench_instr_lens[] = { 2, 3, 4, 7 };
+
+static int ioport_lookup_op(size_t iteration, void *cookie)
+{
+    vm_t *vm = cookie;
+    /* Sweep all ports, covering handled and unhandled ones */
+    volatile vm_ioport_entry_t *port = vm_ioport_lookup(&vm->arch.ioport_list, iteration & 0xffff);
+    (void)port;
+    return 0;
+}
+
+static int decode_op(size_t iteration, void *cookie)
+{
+    int idx = (uintptr_t)cookie;
+    int reg, op_len;
+    uint32_t imm;
+    return vm_decode_instruction(decode_bench_instrs[idx], decode_bench_instr_lens[idx], &reg, &imm, &op_len);
+}
+
+static int lapic_highest_irr_op(size_t iteration, void *cookie)
+{
+    volatile int irr = vm_lapic_find_highest_irr(cookie);
+    (void)irr;
+    return 0;
+}
+
+int vm_run_benchmarks_arch(vm_vcpu_t *vcpu, vm_benchmark_params_t *params, vm_benchmark_writer_t *writer)
+{
+    if (vm_benchmark_run_op(writer, VM_BENCHMARK_IOPORT_LOOKUP, 0, params->iterations, ioport_lookup_op,
+                            vcpu->vm)) {
+        return -1;
+    }
+    for (int i = 0; i < ARRAY_SIZE(decode_bench_instrs); i++) {
+        if (vm_benchmark_run_op(writer, VM_BENCHMARK_DECODE_INSTRUCTION, decode_bench_instr_lens[i],
+                                params->iterations, decode_op, (void *)(uintptr_t)i)) {
+            return -1;
+        }
+    }
+    if (vcpu->vcpu_arch.lapic &&
+        vm_benchmark_run_op(writer, VM_BENCHMARK_LAPIC_HIGHEST_IRR, 0, params->iterations, lapic_highest_irr_op,
+                            vcpu)) {
+        return -1;
+    }
+    return 0;
+}
+#endif /* CONFIG_LIB_SEL4VM_BENCHMARKS */
@@ -0,0 +1,16 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <platsupport/arch/tsc.h>
+
+/* Read the timestamp counter */
+static inline uint64_t vm_exit_stats_timestamp(void)
+{
+    return rdtsc_pure();
+}
@@ -49,6 +49,7 @@ int vm_get_thread_context_reg(vm_vcpu_t *vcpu, unsigned int reg, uint32_t *value
 int vm_set_vmcs_field(vm_vcpu_t *vcpu, seL4_Word field, uint32_t value)
 {
     int err = 0;
+    int cache_field;
     switch (field) {
     case VMX_GUEST_CR0:
         vm_guest_state_set_cr0(vcpu->vcpu_arch.guest_state, value);
@@ -87,8 +88,14 @@ int vm_set_vmcs_field(vm_vcpu_t *vcpu, seL4_Word field, uint32_t value)
         vm_guest_state_set_control_entry(vcpu->vcpu_arch.guest_state, value);
         break;
     default:
-        /* Write through to VMCS */
-        err = vm_vmcs_write(vcpu->vcpu.cptr, field, value);
+        cache_field = vmcs_cache_field_index(field);
+        if (cache_field >= 0) {
+            /* Written back to the VMCS before the guest is resumed */
+            vm_guest_state_vmcs_set(vcpu->vcpu_arch.guest_state, cache_field, value);
+        } else {
+            /* Write through to VMCS */
+            err = vm_vmcs_write(vcpu->vcpu.cptr, field, value);
+        }
     }
     return err;
 }
@@ -96,6 +103,7 @@ int vm_set_vmcs_field(vm_vcpu_t *vcpu, seL4_Word field, uint32_t value)
 int vm_get_vmcs_field(vm_vcpu_t *vcpu, seL4_Word field, uint32_t *value)
 {
     int err = 0;
+    int cache_field;
     uint32_t val;
     switch (field) {
     case VMX_GUEST_CR0:
@@ -135,8 +143,13 @@ int vm_get_vmcs_field(vm_vcpu_t *vcpu, seL4_Word field, uint32_t *value)
         val = vm_guest_state_get_control_entry(vcpu->vcpu_arch.guest_state);
         break;
     default:
-        /* Write through to VMCS */
-        err = vm_vmcs_read(vcpu->vcpu.cptr, field, &val);
+        cache_field = vmcs_cache_field_index(field);
+        if (cache_field >= 0) {
+            val = vm_guest_state_vmcs_get(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr, cache_field);
+        } else {
+            /* Read through from VMCS */
+            err = vm_vmcs_read(vcpu->vcpu.cptr, field, &val);
+        }
     }
     *value = val;
     return err;
@@ -6,29 +6,179 @@
 
 /*vm exits related with hlt'ing*/
 
+#include <autoconf.h>
+#include <sel4vm/gen_config.h>
+
 #include <stdio.h>
 #include <stdlib.h>
 
 #include <sel4/sel4.h>
+#include <utils/util.h>
+#include <platsupport/arch/tsc.h>
 
 #include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_vm_exit_stats.h>
+#include <sel4vm/arch/guest_x86_context.h>
+#include <sel4vm/arch/vmcall.h>
 
 #include "vm.h"
 #include "guest_state.h"
+#include "halt.h"
+#include "vcpu_thread.h"
 #include "processor/lapic.h"
+#include "processor/platfeature.h"
+
+/* Poll window a vcpu starts from once polling could have caught its wakeups, and the factor the window grows by */
+#define HALT_POLL_START_CYCLES MAX(CONFIG_LIB_SEL4VM_HALT_POLL_MAX_CYCLES / 16, 1)
+#define HALT_POLL_GROW 2
+#define HALT_POLL_SHRINK 2
+
+/* KVM hypercall waking a vcpu halted in a paravirtual spinlock */
+#define KVM_HC_KICK_CPU 5
+#define KVM_EINVAL 22
+
+/* Take a KVM_HC_KICK_CPU made to a vcpu since it last halted */
+static bool halt_take_pv_unhalt(vm_vcpu_t *vcpu)
+{
+    return config_set(CONFIG_LIB_SEL4VM_PV_UNHALT) &&
+           __atomic_exchange_n(&vcpu->vcpu_arch.guest_state->virt.pv_unhalted, 0, __ATOMIC_ACQ_REL);
+}
 
 /* Handling halt instruction VMExit Events. */
 int vm_hlt_handler(vm_vcpu_t *vcpu)
 {
-    if (!(vm_guest_state_get_rflags(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr) & BIT(9))) {
+    if (halt_take_pv_unhalt(vcpu)) {
+        /* Kicked before it got to halt, the lock it waits on may already be free */
+        vm_guest_exit_next_instruction(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr);
+        return VM_EXIT_HANDLED;
+    }
+    /* Paravirtual spinlocks halt with interrupts disabled, to be woken by a kick */
+    if (!config_set(CONFIG_LIB_SEL4VM_PV_UNHALT) &&
+        !(vm_guest_state_get_rflags(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr) & BIT(9))) {
         printf("vcpu %d is halted forever :(\n", vcpu->vcpu_id);
     }
 
     if (vm_apic_has_interrupt(vcpu) == -1) {
-        /* Halted, don't reply until we get an interrupt */
-        vcpu->vcpu_arch.guest_state->virt.interrupt_halt = 1;
+        if (config_set(CONFIG_LIB_SEL4VM_LAPIC_TIMER) && vm_lapic_timer_get_expiry(vcpu)) {
+            /* Keep entering the guest in the HLT activity state, such that the VMX
+             * preemption timer still wakes it when the LAPIC timer expires */
+            vm_guest_state_set_activity(vcpu->vcpu_arch.guest_state, GUEST_ACTIVITY_HLT);
+            vcpu->vcpu_arch.guest_state->virt.activity_halt = 1;
+        } else {
+            /* Halted, don't reply until we get an interrupt */
+            vcpu->vcpu_arch.guest_state->virt.interrupt_halt = 1;
+        }
     }
 
     vm_guest_exit_next_instruction(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr);
     return VM_EXIT_HANDLED;
 }
+
+/* Check whether an event has arrived for a halted vcpu without blocking */
+static bool halt_poll_event(vm_vcpu_t *vcpu, seL4_Word *badge)
+{
+    seL4_Poll(vm_vcpu_wait_cap(vcpu), badge);
+    if (*badge) {
+        return true;
+    }
+#ifdef CONFIG_LIB_SEL4VM_VCPU_THREADS
+    /* Kicks are unbadged, so they can't be told apart from an empty poll by their badge */
+    return __atomic_load_n(&vcpu->vcpu_arch.guest_state->virt.kick_pending, __ATOMIC_ACQUIRE);
+#else
+    return false;
+#endif
+}
+
+/* Adapt the poll window to the length of the last halt, as KVM's halt_poll_ns does. Halts ending
+ * within a longer window grow it, halts longer than the maximum window shrink it */
+static void halt_poll_adjust(guest_virt_state_t *virt, uint64_t halt_cycles)
+{
+    if (halt_cycles <= virt->halt_poll_cycles) {
+        return;
+    }
+    if (halt_cycles > CONFIG_LIB_SEL4VM_HALT_POLL_MAX_CYCLES) {
+        virt->halt_poll_cycles /= HALT_POLL_SHRINK;
+    } else if (!virt->halt_poll_cycles) {
+        virt->halt_poll_cycles = HALT_POLL_START_CYCLES;
+    } else {
+        virt->halt_poll_cycles = MIN(virt->halt_poll_cycles * HALT_POLL_GROW, CONFIG_LIB_SEL4VM_HALT_POLL_MAX_CYCLES);
+    }
+}
+
+seL4_Word vm_halt_wait(vm_vcpu_t *vcpu)
+{
+    guest_virt_state_t *virt = &vcpu->vcpu_arch.guest_state->virt;
+    seL4_Word badge;
+
+    if (CONFIG_LIB_SEL4VM_HALT_POLL_MAX_CYCLES == 0 || !vcpu->vcpu_online || !virt->interrupt_halt) {
+        seL4_Wait(vm_vcpu_wait_cap(vcpu), &badge);
+        return badge;
+    }
+
+    uint64_t start = rdtsc_pure();
+    uint64_t now = start;
+    while (now - start < virt->halt_poll_cycles) {
+        if (halt_poll_event(vcpu, &badge)) {
+#ifdef CONFIG_LIB_SEL4VM_EXIT_STATS
+            vcpu->exit_stats->halt_polls_successful++;
+            vcpu->exit_stats->halt_poll_cycles += rdtsc_pure() - start;
+#endif
+            return badge;
+        }
+        now = rdtsc_pure();
+    }
+#ifdef CONFIG_LIB_SEL4VM_EXIT_STATS
+    if (virt->halt_poll_cycles) {
+        vcpu->exit_stats->halt_polls_failed++;
+        vcpu->exit_stats->halt_poll_cycles += now - start;
+    }
+#endif
+    seL4_Wait(vm_vcpu_wait_cap(vcpu), &badge);
+    halt_poll_adjust(virt, rdtsc_pure() - start);
+    return badge;
+}
+
+void vm_halt_pv_unhalt(vm_vcpu_t *vcpu)
+{
+    guest_virt_state_t *virt = &vcpu->vcpu_arch.guest_state->virt;
+    if (!halt_take_pv_unhalt(vcpu)) {
+        return;
+    }
+    virt->interrupt_halt = 0;
+    if (virt->activity_halt) {
+        vm_guest_state_set_activity(vcpu->vcpu_arch.guest_state, GUEST_ACTIVITY_ACTIVE);
+        virt->activity_halt = 0;
+    }
+}
+
+#ifdef CONFIG_LIB_SEL4VM_PV_UNHALT
+/* KVM_HC_KICK_CPU: EBX holds flags and ECX the APIC ID of the vcpu to wake. EAX returns 0, or -KVM_EINVAL if
+ * there is no such vcpu */
+static int halt_kick_cpu_handler(vm_vcpu_t *vcpu)
+{
+    uint32_t apic_id;
+    if (vm_get_thread_context_reg(vcpu, VCPU_CONTEXT_ECX, &apic_id)) {
+        return -1;
+    }
+    vm_vcpu_t *target = vm_lapic_find_vcpu(vcpu->vm, apic_id);
+    if (target) {
+        __atomic_store_n(&target->vcpu_arch.guest_state->virt.pv_unhalted, 1, __ATOMIC_RELEASE);
+#ifdef CONFIG_LIB_SEL4VM_VCPU_THREADS
+        if (target != vcpu) {
+            /* Wake the target from waiting on events, it takes the kick on its own thread */
+            vm_vcpu_kick(target);
+        }
+#endif
+    }
+    return vm_set_thread_context_reg(vcpu, VCPU_CONTEXT_EAX, target ? 0 : -KVM_EINVAL);
+}
+
+int vm_halt_init_pv_unhalt(vm_t *vm)
+{
+    int err = vm_reg_new_vmcall_handler(vm, halt_kick_cpu_handler, KVM_HC_KICK_CPU);
+    if (err) {
+        ZF_LOGE("Failed to register KVM_HC_KICK_CPU handler");
+    }
+    return err;
+}
+#endif
@@ -0,0 +1,33 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <sel4/sel4.h>
+#include <sel4vm/guest_vm.h>
+
+/**
+ * Wait for an event to wake a vcpu that is halted or offline. A halted vcpu first polls for events for a window of
+ * at most CONFIG_LIB_SEL4VM_HALT_POLL_MAX_CYCLES before blocking, the window adapting to how long its recent halts
+ * lasted. Must be called without holding the VMM lock
+ * @param {vm_vcpu_t *} vcpu        A handle to the vcpu
+ * @return                          Badge of the received event
+ */
+seL4_Word vm_halt_wait(vm_vcpu_t *vcpu);
+
+/**
+ * Wake a vcpu from its current halt if it has been kicked through KVM_HC_KICK_CPU. Called on the vcpu's own thread
+ * when it is kicked
+ * @param {vm_vcpu_t *} vcpu        A handle to the vcpu
+ */
+void vm_halt_pv_unhalt(vm_vcpu_t *vcpu);
+
+/**
+ * Register the KVM_HC_KICK_CPU hypercall of paravirtual spinlocks (see CONFIG_LIB_SEL4VM_PV_UNHALT)
+ * @param {vm_t *} vm               A handle to the VM
+ * @return                          0 on success, -1 on error
+ */
+int vm_halt_init_pv_unhalt(vm_t *vm);
@@ -12,6 +12,7 @@
  */
 
 #include <autoconf.h>
+#include <sel4vm/gen_config.h>
 #include <assert.h>
 #include <stdio.h>
 #include <stdbool.h>
@@ -24,6 +25,8 @@
 #include <sel4vm/guest_irq_controller.h>
 #include <sel4vm/arch/ioports.h>
 #include "i8259.h"
+#include "ioapic/ioapic.h"
+#include "guest_vm_event_trace.h"
 
 #define I8259_MASTER   0
 #define I8259_SLAVE    1
@@ -47,8 +50,6 @@ typedef struct i8259_irq_ack {
     void *cookie;
 } i8259_irq_ack_t;
 
-static i8259_irq_ack_t irq_ack_fns[PIC_NUM_PINS];
-
 /* PIC Machine state. */
 struct i8259_state {
     unsigned char last_irr;        /* Edge detection */
@@ -68,6 +69,8 @@ struct i8259_state {
     unsigned char elcr;            /* PIIX edge/trigger selection */
     unsigned char elcr_mask;
     unsigned char isr_ack;         /* Interrupt ack detection */
+    unsigned char pending;         /* Cached irr & ~imr */
+    int irq_out;                   /* Cached irq requested from the CPU or master, -1 if none */
     struct i8259 *pics_state;
 };
 
@@ -78,6 +81,11 @@ struct i8259 {
     struct i8259_state pics[2];  /* 0 is master pic, 1 is slave pic */
     int output;                    /* Intr from master PIC */
     int emitagain;
+    /* Bumped whenever the PIC output, or the LAPIC state deciding whether it is accepted, may have changed */
+    unsigned int generation;
+    unsigned int checked_generation;
+    /* Ack callbacks of the guest's irqs */
+    i8259_irq_ack_t irq_acks[PIC_NUM_PINS];
 };
 
 static inline int select_pic(unsigned int irq)
@@ -106,16 +114,12 @@ static inline int __vm_irq_line_state(unsigned long *irq_state,
 /* Return the highest priority found in mask (highest = smallest number). Return 8 if no irq */
 static inline int get_priority(struct i8259_state *s, int mask)
 {
-    int priority = 0;
-
     if (!mask) {
         return 8;
     }
-
-    while (!(mask & (1 << ((priority + s->priority_add) & 7)))) {
-        priority++;
-    }
-    return priority;
+    /* Rotate the mask such that bit 0 is the irq with the highest priority */
+    unsigned int rotated = ((mask >> s->priority_add) | (mask << (8 - s->priority_add))) & 0xff;
+    return CTZ(rotated);
 }
 
 /* Check if given IO address is valid. */
@@ -139,12 +143,11 @@ static int i8259_in_range(unsigned int addr)
  *    Returns -1 if no interrupts,
  *    Otherwise returns the PIC interrupt generated.
  */
-static int pic_get_irq(struct i8259_state *s)
+static int pic_compute_irq(struct i8259_state *s)
 {
     int mask, cur_priority, priority;
 
-    mask = s->irr & ~s->imr;
-    priority = get_priority(s, mask);
+    priority = get_priority(s, s->pending);
     if (priority == 8) {
         return -1;
     }
@@ -165,18 +168,34 @@ static int pic_get_irq(struct i8259_state *s)
     }
 }
 
+/* Recompute the cached output of a PIC. Must be called every time its IRR, IMR, ISR or priorities
+ * change, such that resolving the pending interrupt doesn't re-evaluate the PIC. */
+static void pic_update_state(struct i8259_state *s)
+{
+    s->pending = s->irr & ~s->imr;
+    s->irq_out = pic_compute_irq(s);
+}
+
+/* Returns the cached pending PIC interrupt, -1 if no interrupts */
+static inline int pic_get_irq(struct i8259_state *s)
+{
+    return s->irq_out;
+}
+
 /* Clear the IRQ from ISR, the IRQ has been served. */
 static void pic_clear_isr(vm_t *vm, struct i8259_state *s, int irq)
 {
     /* Clear the ISR, notify the ack handler. */
     s->isr &= ~(1 << irq);
+    pic_update_state(s);
     if (s != &s->pics_state->pics[0]) {
         irq += 8;
     }
 
     if (irq != 2) {
-        if (irq_ack_fns[irq].callback) {
-            irq_ack_fns[irq].callback(vm->vcpus[BOOT_VCPU], irq, irq_ack_fns[irq].cookie);
+        i8259_irq_ack_t *ack = &s->pics_state->irq_acks[irq];
+        if (ack->callback) {
+            ack->callback(vm->vcpus[BOOT_VCPU], irq, ack->cookie);
         }
     }
 }
@@ -209,6 +228,7 @@ static inline int pic_set_irq1(struct i8259_state *s, int irq, int level)
             s->last_irr &= ~mask;
         }
     }
+    pic_update_state(s);
 
     return (s->imr & mask) ? -1 : ret;
 }
@@ -220,6 +240,8 @@ static void pic_update_irq(struct i8259 *s)
 {
     int irq2, irq;
 
+    s->generation++;
+
     irq2 = pic_get_irq(&s->pics[1]);
     if (irq2 >= 0) {
         /* If IRQ request by slave PIC, signal master PIC and set the IRR in master PIC. */
@@ -262,6 +284,7 @@ static void pic_reset(vm_t *vm, struct i8259_state *s)
         s->auto_eoi = 0;
     }
     s->init_state = 1;
+    pic_update_state(s);
 
 #if 0
     /* FIXME: CONNECT pic with APIC */
@@ -346,6 +369,7 @@ static void pic_ioport_write(vm_vcpu_t *vcpu, struct i8259_state *s, unsigned in
             case 6:
                 /* Set priority command. */
                 s->priority_add = (val + 1) & 7;
+                pic_update_state(s);
                 pic_update_irq(s->pics_state);
                 break;
             case 7:
@@ -367,6 +391,7 @@ static void pic_ioport_write(vm_vcpu_t *vcpu, struct i8259_state *s, unsigned in
             (void) imr_diff;
             //off = (s == &s->pics_state->pics[0]) ? 0 : 8;
             s->imr = val;
+            pic_update_state(s);
 #if 0
             for (irq = 0; irq < PIC_NUM_PINS / 2; irq++)
                 if (imr_diff & (1 << irq))
@@ -397,6 +422,7 @@ static void pic_ioport_write(vm_vcpu_t *vcpu, struct i8259_state *s, unsigned in
             s->special_fully_nested_mode = (val >> 4) & 1;
             s->auto_eoi = (val >> 1) & 1;
             s->init_state = 0;
+            pic_update_state(s);
             break;
         }
 }
@@ -413,6 +439,7 @@ static unsigned int pic_poll_read(vm_t *vm, struct i8259_state *s, unsigned int
         if (addr1 >> 7) {
             s->pics_state->pics[0].isr &= ~(1 << 2);
             s->pics_state->pics[0].irr &= ~(1 << 2);
+            pic_update_state(&s->pics_state->pics[0]);
         }
         s->irr &= ~(1 << ret);
         pic_clear_isr(vm, s, ret);
@@ -540,6 +567,8 @@ static void i8259_init_state(struct i8259 *s)
     s->pics[1].elcr_mask = 0xde;
     s->pics[0].pics_state = s;
     s->pics[1].pics_state = s;
+    s->pics[0].irq_out = -1;
+    s->pics[1].irq_out = -1;
 }
 
 
@@ -553,6 +582,7 @@ static inline void pic_intack(vm_t *vm, struct i8259_state *s, int irq)
     if (!(s->elcr & (1 << irq))) {
         s->irr &= ~(1 << irq);
     }
+    pic_update_state(s);
 
     /* Clear the ISR for auto EOI mode. */
     if (s->auto_eoi) {
@@ -663,6 +693,24 @@ int i8259_has_interrupt(vm_t *vm)
     return ret;
 }
 
+void i8259_irq_state_touch(vm_t *vm)
+{
+    /* LAPICs are created before the PIC */
+    if (vm->arch.i8259_gs) {
+        vm->arch.i8259_gs->generation++;
+    }
+}
+
+bool i8259_irq_state_changed(vm_t *vm)
+{
+    struct i8259 *s = vm->arch.i8259_gs;
+    if (s->generation == s->checked_generation) {
+        return false;
+    }
+    s->checked_generation = s->generation;
+    return true;
+}
+
 vm_ioport_entry_t pic_ioports[] = {
     {{X86_IO_PIC_1_START, X86_IO_PIC_1_END}, {NULL, i8259_port_in, i8259_port_out, "8259 Programmable Interrupt Controller (1st, Master)"}},
     {{X86_IO_PIC_2_START, X86_IO_PIC_2_END}, {NULL, i8259_port_in, i8259_port_out, "8259 Programmable Interrupt Controller (2nd, Slave)"}},
@@ -698,36 +746,71 @@ int i8259_pre_init(vm_t *vm)
  * IRQ source ID is used for mapping multiple IRQ source into a IRQ pin.
  * Sets irq request into the state machine for PIC.
  */
-int vm_set_irq_level(vm_vcpu_t *vcpu, int irq, int irq_level)
+static int set_irq_level(vm_vcpu_t *vcpu, int irq, int irq_level)
 {
-    int ret;
+    int ret = -1;
 
     struct i8259 *s = vcpu->vm->arch.i8259_gs;
 
-    /* Set IRR. */
-    ret = pic_set_irq1(&s->pics[irq >> 3], irq & 7, irq_level);
-    pic_update_irq(s);
+#ifdef CONFIG_LIB_SEL4VM_IOAPIC
+    /* The guest uses either controller, masking the other, so the irq is only dropped if both mask it */
+    int ioapic_ret = vm_ioapic_set_irq(vcpu->vm, irq, irq_level);
+    if (irq >= PIC_NUM_PINS) {
+        return ioapic_ret;
+    }
+#endif
+
+    if (irq >= 0 && irq < PIC_NUM_PINS) {
+        /* Set IRR. */
+        ret = pic_set_irq1(&s->pics[irq >> 3], irq & 7, irq_level);
+        pic_update_irq(s);
+    }
 
+#ifdef CONFIG_LIB_SEL4VM_IOAPIC
+    if (ioapic_ret == 0) {
+        return 0;
+    }
+#endif
     if (ret == -1) {
         return -1;
     }
     return 0;
 }
 
+int vm_set_irq_level(vm_vcpu_t *vcpu, int irq, int irq_level)
+{
+    vm_event_trace(vcpu, VM_EVENT_TRACE_IRQ_LEVEL, irq, irq_level, 0);
+    return set_irq_level(vcpu, irq, irq_level);
+}
+
 int vm_inject_irq(vm_vcpu_t *vcpu, int irq)
 {
-    vm_set_irq_level(vcpu, irq, 1);
-    vm_set_irq_level(vcpu, irq, 0);
+    vm_event_trace(vcpu, VM_EVENT_TRACE_IRQ_INJECT, irq, 0, 0);
+    set_irq_level(vcpu, irq, 1);
+    set_irq_level(vcpu, irq, 0);
     return 0;
 }
 
 int vm_register_irq(vm_vcpu_t *vcpu, int irq, irq_ack_fn_t fn, void *cookie)
 {
+#ifdef CONFIG_LIB_SEL4VM_IOAPIC
+    if (vm_ioapic_register_irq(vcpu->vm, irq, fn, cookie)) {
+        ZF_LOGE("irq %d is invalid", irq);
+        return -1;
+    }
+    if (irq >= PIC_NUM_PINS) {
+        return 0;
+    }
+#endif
     if (irq < 0 || irq >= PIC_NUM_PINS) {
         ZF_LOGE("irq %d is invalid", irq);
         return -1;
     }
-    i8259_irq_ack_t *ack = &irq_ack_fns[irq];
+    if (!vcpu->vm->arch.i8259_gs) {
+        ZF_LOGE("Failed to register irq %d: VM has no i8259", irq);
+        return -1;
+    }
+    i8259_irq_ack_t *ack = &vcpu->vm->arch.i8259_gs->irq_acks[irq];
     ack->callback = fn;
     ack->cookie = cookie;
     return 0;
@@ -14,3 +14,10 @@ int i8259_pre_init(vm_t *vm);
 /* Functions to retrieve interrupt state */
 int i8259_get_interrupt(vm_t *vm);
 int i8259_has_interrupt(vm_t *vm);
+
+/* Record that LAPIC state affecting whether the PIC's interrupts are accepted may have changed. Changes to the
+ * PIC itself are recorded internally */
+void i8259_irq_state_touch(vm_t *vm);
+
+/* Returns true if the PIC's output, or whether it is accepted, may have changed since the last call */
+bool i8259_irq_state_changed(vm_t *vm);
@@ -19,22 +19,31 @@
 #include "guest_state.h"
 #include "processor/decode.h"
 #include "processor/lapic.h"
+#include "processor/platfeature.h"
 #include "interrupt.h"
+#include "vcpu_thread.h"
 
 #define TRAMPOLINE_LENGTH (100)
 
-static void resume_guest(vm_vcpu_t *vcpu)
+/* Set whether the guest exits as soon as it can take an interrupt, leaving the controls alone if unchanged */
+static void set_interrupt_window(vm_vcpu_t *vcpu, bool exit)
 {
-    /* Disable exit-for-interrupt in guest state to allow the guest to resume. */
     uint32_t state = vm_guest_state_get_control_ppc(vcpu->vcpu_arch.guest_state);
-    state &= ~BIT(2); /* clear the exit for interrupt flag */
-    vm_guest_state_set_control_ppc(vcpu->vcpu_arch.guest_state, state);
+    uint32_t new_state = exit ? state | BIT(2) : state & ~BIT(2); /* the exit for interrupt flag */
+    if (new_state != state) {
+        vm_guest_state_set_control_ppc(vcpu->vcpu_arch.guest_state, new_state);
+    }
 }
 
 static void inject_irq(vm_vcpu_t *vcpu, int irq)
 {
     /* Inject a vectored exception into the guest */
     assert(irq >= 16);
+    if (vcpu->vcpu_arch.guest_state->virt.activity_halt) {
+        /* Wake the guest from the HLT activity state to take the interrupt */
+        vm_guest_state_set_activity(vcpu->vcpu_arch.guest_state, GUEST_ACTIVITY_ACTIVE);
+        vcpu->vcpu_arch.guest_state->virt.activity_halt = 0;
+    }
     vm_guest_state_set_control_entry(vcpu->vcpu_arch.guest_state, BIT(31) | irq);
 }
 
@@ -55,9 +64,7 @@ void vm_inject_exception(vm_vcpu_t *vcpu, int exception, int has_error, uint32_t
 void wait_for_guest_ready(vm_vcpu_t *vcpu)
 {
     /* Request that the guest exit at the earliest point that we can inject an interrupt. */
-    uint32_t state = vm_guest_state_get_control_ppc(vcpu->vcpu_arch.guest_state);
-    state |= BIT(2); /* set the exit for interrupt flag */
-    vm_guest_state_set_control_ppc(vcpu->vcpu_arch.guest_state, state);
+    set_interrupt_window(vcpu, true);
 }
 
 int can_inject(vm_vcpu_t *vcpu)
@@ -79,73 +86,105 @@ int can_inject(vm_vcpu_t *vcpu)
 /* This function is called by the local apic when a new interrupt has occured. */
 void vm_have_pending_interrupt(vm_vcpu_t *vcpu)
 {
-    if (vm_apic_has_interrupt(vcpu) >= 0) {
-        /* there is actually an interrupt to inject */
-        if (can_inject(vcpu)) {
-            if (vcpu->vcpu_arch.guest_state->virt.interrupt_halt) {
-                /* currently halted. need to put the guest
-                 * in a state where it can inject again */
-                wait_for_guest_ready(vcpu);
-                vcpu->vcpu_arch.guest_state->virt.interrupt_halt = 0;
-            } else {
-                int irq = vm_apic_get_interrupt(vcpu);
-                inject_irq(vcpu, irq);
-                /* see if there are more */
-                if (vm_apic_has_interrupt(vcpu) >= 0) {
-                    wait_for_guest_ready(vcpu);
-                }
-            }
-        } else {
-            wait_for_guest_ready(vcpu);
-            if (vcpu->vcpu_arch.guest_state->virt.interrupt_halt) {
-                vcpu->vcpu_arch.guest_state->virt.interrupt_halt = 0;
-            }
-        }
-    }
+    /* Leave the injection to vm_inject_pending_interrupt on the way into the guest, such that the apic and the
+     * guest's interruptibility are only looked at once however many interrupts arrive in the meantime */
+    vcpu->vcpu_arch.guest_state->virt.interrupt_check = 1;
+    /* A hlt'ed guest wakes up to take the interrupt */
+    vcpu->vcpu_arch.guest_state->virt.interrupt_halt = 0;
 }
 
 int vm_pending_interrupt_handler(vm_vcpu_t *vcpu)
 {
-    /* see if there is actually a pending interrupt */
-    assert(can_inject(vcpu));
-    int irq = vm_apic_get_interrupt(vcpu);
-    if (irq == -1) {
-        resume_guest(vcpu);
-    } else {
-        /* inject the interrupt */
-        inject_irq(vcpu, irq);
-        if (!(vm_apic_has_interrupt(vcpu) >= 0)) {
-            resume_guest(vcpu);
-        }
-        vcpu->vcpu_arch.guest_state->virt.interrupt_halt = 0;
-    }
+    /* The interrupt window has opened, the injection happens on the way back into the guest */
+    vcpu->vcpu_arch.guest_state->virt.interrupt_check = 1;
     return VM_EXIT_HANDLED;
 }
 
+void vm_inject_pending_interrupt(vm_vcpu_t *vcpu)
+{
+    guest_state_t *gs = vcpu->vcpu_arch.guest_state;
+    if (!gs->virt.interrupt_check) {
+        /* Nothing has changed since the last entry, any interrupt window requested then is still wanted */
+        return;
+    }
+    gs->virt.interrupt_check = 0;
+
+    bool pending = vm_apic_has_interrupt(vcpu) >= 0;
+    if (pending && can_inject(vcpu)) {
+        inject_irq(vcpu, vm_apic_get_interrupt(vcpu));
+        /* Anything else has to wait for the guest to have taken this one */
+        pending = vm_apic_has_interrupt(vcpu) >= 0;
+    }
+    set_interrupt_window(vcpu, pending);
+}
+
+/* Put a vcpu in the state a sipi leaves it in, to run the trampoline natively in unrestricted guest mode */
+static void start_ap_realmode(vm_vcpu_t *vcpu, unsigned int sipi_vector)
+{
+    guest_state_t *gs = vcpu->vcpu_arch.guest_state;
+    static const vmcs_cache_field_t data_segments[][4] = {
+        {VMCS_CACHE_ES_SELECTOR, VMCS_CACHE_ES_BASE, VMCS_CACHE_ES_LIMIT, VMCS_CACHE_ES_ACCESS_RIGHTS},
+        {VMCS_CACHE_SS_SELECTOR, VMCS_CACHE_SS_BASE, VMCS_CACHE_SS_LIMIT, VMCS_CACHE_SS_ACCESS_RIGHTS},
+        {VMCS_CACHE_DS_SELECTOR, VMCS_CACHE_DS_BASE, VMCS_CACHE_DS_LIMIT, VMCS_CACHE_DS_ACCESS_RIGHTS},
+        {VMCS_CACHE_FS_SELECTOR, VMCS_CACHE_FS_BASE, VMCS_CACHE_FS_LIMIT, VMCS_CACHE_FS_ACCESS_RIGHTS},
+        {VMCS_CACHE_GS_SELECTOR, VMCS_CACHE_GS_BASE, VMCS_CACHE_GS_LIMIT, VMCS_CACHE_GS_ACCESS_RIGHTS},
+    };
+
+    /* Execution starts at vector:0000 in real mode, with flat 64K data segments */
+    vm_guest_state_set_cs_selector(gs, sipi_vector << 8);
+    vm_guest_state_vmcs_set(gs, VMCS_CACHE_CS_BASE, sipi_vector << 12);
+    vm_guest_state_vmcs_set(gs, VMCS_CACHE_CS_LIMIT, 0xffff);
+    vm_guest_state_vmcs_set(gs, VMCS_CACHE_CS_ACCESS_RIGHTS, 0x9b);
+    for (int i = 0; i < ARRAY_SIZE(data_segments); i++) {
+        vm_guest_state_vmcs_set(gs, data_segments[i][0], 0);
+        vm_guest_state_vmcs_set(gs, data_segments[i][1], 0);
+        vm_guest_state_vmcs_set(gs, data_segments[i][2], 0xffff);
+        vm_guest_state_vmcs_set(gs, data_segments[i][3], 0x93);
+    }
+    vm_guest_state_set_rflags(gs, BIT(1));
+    vm_guest_state_set_eip(gs, 0);
+    /* Protection and paging are off, further cr0 writes keep the guest's PE and PG bits */
+    vm_guest_state_set_cr0(gs, gs->virt.cr.cr0_shadow & ~(X86_CR0_PE | X86_CR0_PG));
+}
+
 /* Start an AP vcpu after a sipi with the requested vector */
 void vm_start_ap_vcpu(vm_vcpu_t *vcpu, unsigned int sipi_vector)
 {
     ZF_LOGD("trying to start vcpu %d\n", vcpu->vcpu_id);
+#ifdef CONFIG_LIB_SEL4VM_VCPU_THREADS
+    if (!vm_vcpu_is_current(vcpu)) {
+        /* The vcpu can only be started from its own thread */
+        vm_vcpu_thread_set_sipi(vcpu, sipi_vector);
+        return;
+    }
+#endif
 
     uint16_t segment = sipi_vector * 0x100;
     uintptr_t eip = sipi_vector * 0x1000;
     guest_state_t *gs = vcpu->vcpu_arch.guest_state;
 
-    /* Emulate up to 100 bytes of trampoline code */
-    uint8_t instr[TRAMPOLINE_LENGTH];
-    vm_fetch_instruction(vcpu, eip, vm_guest_state_get_cr3(gs, vcpu->vcpu.cptr),
-                         TRAMPOLINE_LENGTH, instr);
+    if (gs->virt.unrestricted_guest) {
+        start_ap_realmode(vcpu, sipi_vector);
+    } else {
+        /* Emulate up to 100 bytes of trampoline code */
+        uint8_t instr[TRAMPOLINE_LENGTH];
+        vm_fetch_instruction(vcpu, eip, vm_guest_state_get_cr3(gs, vcpu->vcpu.cptr),
+                             TRAMPOLINE_LENGTH, instr);
 
-    eip = vm_emulate_realmode(vcpu, instr, &segment, eip,
-                              TRAMPOLINE_LENGTH, gs);
+        eip = vm_emulate_realmode(vcpu, instr, &segment, eip,
+                                  TRAMPOLINE_LENGTH, gs);
 
-    vm_guest_state_set_eip(vcpu->vcpu_arch.guest_state, eip);
+        vm_guest_state_set_eip(vcpu->vcpu_arch.guest_state, eip);
+    }
 
     vm_sync_guest_context(vcpu);
     vm_sync_guest_vmcs_state(vcpu);
 
+#ifdef CONFIG_LIB_SEL4VM_VCPU_THREADS
+    vcpu->vcpu_online = true;
+#else
     assert(!"no tcb");
-//    seL4_TCB_Resume(vcpu->guest_tcb);
+#endif
 }
 
 /* Got interrupt(s) from PIC, propagate to relevant vcpu lapic */
@@ -167,6 +206,14 @@ void vm_vcpu_accept_interrupt(vm_vcpu_t *vcpu)
         return;
     }
 
+#ifdef CONFIG_LIB_SEL4VM_VCPU_THREADS
+    if (!vm_vcpu_is_current(vcpu)) {
+        /* The vcpu is run by another thread, have it inject the interrupt itself */
+        vm_vcpu_kick(vcpu);
+        return;
+    }
+#endif
+
     /* in an exit, can call the regular injection method */
     vm_have_pending_interrupt(vcpu);
 }
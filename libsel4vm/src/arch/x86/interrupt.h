@@ -27,3 +27,8 @@ void vm_vcpu_accept_interrupt(vm_vcpu_t *vcpu);
 /* This function is called when a new interrupt has occured. */
 void vm_have_pending_interrupt(vm_vcpu_t *vcpu);
 
+/* Inject the highest priority pending interrupt if the guest can take it, otherwise request that the guest exit
+ * once it can. Called once before every guest entry, this only does work if an interrupt arrived or the
+ * interrupt window opened since the last entry */
+void vm_inject_pending_interrupt(vm_vcpu_t *vcpu);
+
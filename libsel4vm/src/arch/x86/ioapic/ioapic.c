@@ -0,0 +1,249 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdlib.h>
+
+#include <utils/util.h>
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_memory.h>
+#include <sel4vm/guest_vcpu_fault.h>
+#include <sel4vm/boot.h>
+
+#include "ioapic.h"
+#include "processor/apicdef.h"
+#include "processor/lapic.h"
+
+/* MMIO registers */
+#define IOAPIC_REG_SELECT   0x00
+#define IOAPIC_REG_WINDOW   0x10
+
+/* Indirect registers */
+#define IOAPIC_ID           0x00
+#define IOAPIC_VERSION      0x01
+#define IOAPIC_ARB          0x02
+#define IOAPIC_REDTBL_BASE  0x10
+
+/* Version 0x11, as the 82093AA, which has no EOI register */
+#define IOAPIC_VERSION_ID   0x11
+#define IOAPIC_ID_SHIFT     24
+#define IOAPIC_ID_MASK      (0xf << IOAPIC_ID_SHIFT)
+
+/* Redirection entry fields. Vector, delivery, destination and trigger modes use the ICR encoding */
+#define IOAPIC_RTE_VECTOR_MASK      0xff
+#define IOAPIC_RTE_DELIVERY_STATUS  BIT(12)
+#define IOAPIC_RTE_REMOTE_IRR       BIT(14)
+#define IOAPIC_RTE_MASKED           BIT(16)
+#define IOAPIC_RTE_DEST_SHIFT       56
+#define IOAPIC_RTE_RO_BITS          (IOAPIC_RTE_DELIVERY_STATUS | IOAPIC_RTE_REMOTE_IRR)
+
+typedef struct ioapic_irq_ack {
+    irq_ack_fn_t callback;
+    void *cookie;
+} ioapic_irq_ack_t;
+
+struct vm_ioapic {
+    uint32_t id;
+    uint32_t ioregsel;
+    /* Bitmap of asserted input pins */
+    uint32_t line_level;
+    uint64_t redirtbl[IOAPIC_NUM_PINS];
+    ioapic_irq_ack_t irq_ack_fns[IOAPIC_NUM_PINS];
+};
+
+static bool ioapic_pin_level_triggered(vm_ioapic_t *ioapic, int pin)
+{
+    return ioapic->redirtbl[pin] & APIC_INT_LEVELTRIG;
+}
+
+static void ioapic_ack(vm_t *vm, vm_ioapic_t *ioapic, int pin)
+{
+    ioapic_irq_ack_t *ack = &ioapic->irq_ack_fns[pin];
+    if (ack->callback) {
+        ack->callback(vm->vcpus[BOOT_VCPU], pin, ack->cookie);
+    }
+}
+
+/* Send the interrupt of a pin to the local apics of its redirection entry. Returns -1 if none accepted it */
+static int ioapic_deliver(vm_t *vm, vm_ioapic_t *ioapic, int pin)
+{
+    uint64_t entry = ioapic->redirtbl[pin];
+    struct vm_lapic_irq irq = {
+        .vector = entry & IOAPIC_RTE_VECTOR_MASK,
+        .delivery_mode = entry & APIC_MODE_MASK,
+        .dest_mode = entry & APIC_DEST_LOGICAL,
+        .level = 1,
+        .trig_mode = entry & APIC_INT_LEVELTRIG,
+        .shorthand = APIC_DEST_NOSHORT,
+        .dest_id = entry >> IOAPIC_RTE_DEST_SHIFT
+    };
+    int r = vm_irq_delivery_to_apic(vm->vcpus[BOOT_VCPU], &irq, NULL);
+    if (r <= 0) {
+        return -1;
+    }
+    if (irq.trig_mode) {
+        /* Delivery of the pin is held off until the guest EOIs the vector */
+        ioapic->redirtbl[pin] |= IOAPIC_RTE_REMOTE_IRR;
+    } else {
+        /* The EOI of edge triggered interrupts is not seen by the IOAPIC, so the source is acknowledged
+         * once the interrupt is latched by a local apic */
+        ioapic_ack(vm, ioapic, pin);
+    }
+    return 0;
+}
+
+/* Deliver the interrupt of an asserted level triggered pin, once it is unmasked and its last delivery EOId */
+static void ioapic_service_level(vm_t *vm, vm_ioapic_t *ioapic, int pin)
+{
+    uint64_t entry = ioapic->redirtbl[pin];
+    if ((entry & APIC_INT_LEVELTRIG) && (ioapic->line_level & BIT(pin)) &&
+        !(entry & (IOAPIC_RTE_MASKED | IOAPIC_RTE_REMOTE_IRR))) {
+        ioapic_deliver(vm, ioapic, pin);
+    }
+}
+
+int vm_ioapic_set_irq(vm_t *vm, int pin, int level)
+{
+    vm_ioapic_t *ioapic = vm->arch.ioapic;
+    if (!ioapic || pin < 0 || pin >= IOAPIC_NUM_PINS) {
+        return -1;
+    }
+    bool was_asserted = ioapic->line_level & BIT(pin);
+    if (!level) {
+        ioapic->line_level &= ~BIT(pin);
+        return 0;
+    }
+    ioapic->line_level |= BIT(pin);
+    if (ioapic->redirtbl[pin] & IOAPIC_RTE_MASKED) {
+        return -1;
+    }
+    if (ioapic_pin_level_triggered(ioapic, pin)) {
+        ioapic_service_level(vm, ioapic, pin);
+    } else if (!was_asserted) {
+        /* Polarity is not modelled: 'level' is the asserted state of the pin */
+        ioapic_deliver(vm, ioapic, pin);
+    }
+    return 0;
+}
+
+int vm_ioapic_register_irq(vm_t *vm, int pin, irq_ack_fn_t fn, void *cookie)
+{
+    vm_ioapic_t *ioapic = vm->arch.ioapic;
+    if (!ioapic || pin < 0 || pin >= IOAPIC_NUM_PINS) {
+        return -1;
+    }
+    ioapic->irq_ack_fns[pin].callback = fn;
+    ioapic->irq_ack_fns[pin].cookie = cookie;
+    return 0;
+}
+
+void vm_ioapic_eoi(vm_t *vm, int vector)
+{
+    vm_ioapic_t *ioapic = vm->arch.ioapic;
+    if (!ioapic) {
+        return;
+    }
+    for (int pin = 0; pin < IOAPIC_NUM_PINS; pin++) {
+        uint64_t entry = ioapic->redirtbl[pin];
+        if ((entry & IOAPIC_RTE_VECTOR_MASK) != vector || !(entry & IOAPIC_RTE_REMOTE_IRR)) {
+            continue;
+        }
+        ioapic->redirtbl[pin] &= ~IOAPIC_RTE_REMOTE_IRR;
+        ioapic_ack(vm, ioapic, pin);
+        /* A line still asserted after its source was acknowledged interrupts again */
+        ioapic_service_level(vm, ioapic, pin);
+    }
+}
+
+static uint32_t ioapic_read_indirect(vm_ioapic_t *ioapic)
+{
+    uint32_t reg = ioapic->ioregsel;
+    switch (reg) {
+    case IOAPIC_ID:
+    case IOAPIC_ARB:
+        return ioapic->id << IOAPIC_ID_SHIFT;
+    case IOAPIC_VERSION:
+        return IOAPIC_VERSION_ID | ((IOAPIC_NUM_PINS - 1) << 16);
+    default:
+        if (reg >= IOAPIC_REDTBL_BASE && reg < IOAPIC_REDTBL_BASE + IOAPIC_NUM_PINS * 2) {
+            uint64_t entry = ioapic->redirtbl[(reg - IOAPIC_REDTBL_BASE) / 2];
+            return (reg & 1) ? entry >> 32 : entry & 0xffffffff;
+        }
+        return 0;
+    }
+}
+
+static void ioapic_write_indirect(vm_t *vm, vm_ioapic_t *ioapic, uint32_t val)
+{
+    uint32_t reg = ioapic->ioregsel;
+    if (reg == IOAPIC_ID) {
+        ioapic->id = (val & IOAPIC_ID_MASK) >> IOAPIC_ID_SHIFT;
+        return;
+    }
+    if (reg < IOAPIC_REDTBL_BASE || reg >= IOAPIC_REDTBL_BASE + IOAPIC_NUM_PINS * 2) {
+        return;
+    }
+    int pin = (reg - IOAPIC_REDTBL_BASE) / 2;
+    uint64_t entry = ioapic->redirtbl[pin];
+    if (reg & 1) {
+        entry = (entry & 0xffffffff) | ((uint64_t)val << 32);
+    } else {
+        entry = (entry & (0xffffffff00000000ULL | IOAPIC_RTE_RO_BITS)) | (val & ~IOAPIC_RTE_RO_BITS);
+        if (!(entry & APIC_INT_LEVELTRIG)) {
+            entry &= ~IOAPIC_RTE_REMOTE_IRR;
+        }
+    }
+    ioapic->redirtbl[pin] = entry;
+    /* Unmasking or retargeting an asserted level triggered pin delivers its pending interrupt */
+    ioapic_service_level(vm, ioapic, pin);
+}
+
+static memory_fault_result_t ioapic_fault_callback(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t fault_addr,
+                                                   size_t fault_length, void *cookie)
+{
+    vm_ioapic_t *ioapic = cookie;
+    uintptr_t offset = fault_addr - IO_APIC_DEFAULT_PHYS_BASE;
+
+    if (is_vcpu_read_fault(vcpu)) {
+        uint32_t data = 0;
+        if (offset == IOAPIC_REG_SELECT) {
+            data = ioapic->ioregsel;
+        } else if (offset == IOAPIC_REG_WINDOW) {
+            data = ioapic_read_indirect(ioapic);
+        }
+        set_vcpu_fault_data(vcpu, data);
+    } else {
+        uint32_t data = get_vcpu_fault_data(vcpu);
+        if (offset == IOAPIC_REG_SELECT) {
+            ioapic->ioregsel = data & 0xff;
+        } else if (offset == IOAPIC_REG_WINDOW) {
+            ioapic_write_indirect(vm, ioapic, data);
+        }
+    }
+    advance_vcpu_fault(vcpu);
+    return FAULT_HANDLED;
+}
+
+int vm_ioapic_init(vm_t *vm)
+{
+    vm_ioapic_t *ioapic = calloc(1, sizeof(vm_ioapic_t));
+    if (!ioapic) {
+        ZF_LOGE("Failed to initialise ioapic: Unable to allocate ioapic");
+        return -1;
+    }
+    for (int pin = 0; pin < IOAPIC_NUM_PINS; pin++) {
+        ioapic->redirtbl[pin] = IOAPIC_RTE_MASKED;
+    }
+    vm_memory_reservation_t *reservation = vm_reserve_memory_at(vm, IO_APIC_DEFAULT_PHYS_BASE, PAGE_SIZE_4K,
+                                                                ioapic_fault_callback, ioapic);
+    if (!reservation) {
+        ZF_LOGE("Failed to reserve ioapic memory");
+        free(ioapic);
+        return -1;
+    }
+    vm->arch.ioapic = ioapic;
+    return 0;
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_irq_controller.h>
+
+#define IOAPIC_NUM_PINS 24
+
+/**
+ * Create the IOAPIC of a VM and register its MMIO region at IO_APIC_DEFAULT_PHYS_BASE.
+ * All redirection entries start masked, leaving interrupts to the i8259 until the guest programs them
+ * @param {vm_t *} vm               A handle to the VM
+ * @return                          0 on success, -1 on error
+ */
+int vm_ioapic_init(vm_t *vm);
+
+/**
+ * Set the level of an IOAPIC input pin. Edge triggered pins deliver on a rising edge, level triggered pins
+ * deliver whilst asserted and not awaiting an EOI
+ * @param {vm_t *} vm               A handle to the VM
+ * @param {int} pin                 IOAPIC input pin
+ * @param {int} level               Level of the pin
+ * @return                          0 if the interrupt was accepted or the pin deasserted, -1 if the pin is invalid
+ *                                  or masked
+ */
+int vm_ioapic_set_irq(vm_t *vm, int pin, int level);
+
+/**
+ * Register a function called when the interrupt of an IOAPIC pin is acknowledged by the guest
+ * @param {vm_t *} vm               A handle to the VM
+ * @param {int} pin                 IOAPIC input pin
+ * @param {irq_ack_fn_t} fn         Acknowledgement function
+ * @param {void *} cookie           Cookie passed to the acknowledgement function
+ * @return                          0 on success, -1 if the pin is invalid
+ */
+int vm_ioapic_register_irq(vm_t *vm, int pin, irq_ack_fn_t fn, void *cookie);
+
+/**
+ * Handle the EOI of a level triggered vector by a local apic, completing the pins delivering it
+ * @param {vm_t *} vm               A handle to the VM
+ * @param {int} vector              EOId vector
+ */
+void vm_ioapic_eoi(vm_t *vm, int vector);
@@ -8,45 +8,46 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <sel4/sel4.h>
 #include <sel4utils/util.h>
 #include <simple/simple.h>
+#include <vka/capops.h>
 
 #include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_ram.h>
 #include <sel4vm/arch/ioports.h>
 #include <sel4vm/arch/guest_x86_context.h>
 
 #include "vm.h"
+#include "guest_doorbell.h"
 #include "guest_state.h"
+#include "vmexit.h"
+#include "processor/decode.h"
 
-static int io_port_compare_by_range(const void *pkey, const void *pelem)
-{
-    unsigned int key = (unsigned int)(uintptr_t)pkey;
-    const vm_ioport_entry_t *entry = (const vm_ioport_entry_t *)pelem;
-    const vm_ioport_range_t *elem = &entry->range;
-    if (key < elem->start) {
-        return -1;
-    }
-    if (key > elem->end) {
-        return 1;
-    }
-    return 0;
-}
+/* Number of entries in the port map, one for each addressable ioport */
+#define IOPORT_MAP_SIZE BIT(16)
+
+/* Maximum number of bytes moved by a single string io exit. Longer rep transfers are continued by
+ * resuming the guest without advancing its instruction pointer, such that it exits again */
+#define IOPORT_STRING_MAX_BYTES PAGE_SIZE_4K
 
-static int io_port_compare_by_start(const void *a, const void *b)
+#define RFLAGS_DF BIT(10)
+
+static vm_ioport_entry_t *search_port(vm_io_port_list_t *ioports, unsigned int port_no)
 {
-    const vm_ioport_entry_t *a_entry = (const vm_ioport_entry_t *)a;
-    const vm_ioport_range_t *a_range = &a_entry->range;
-    const vm_ioport_entry_t *b_entry = (const vm_ioport_entry_t *)b;
-    const vm_ioport_range_t *b_range = &b_entry->range;
-    return a_range->start - b_range->start;
+    if (!ioports->port_map || port_no >= IOPORT_MAP_SIZE) {
+        return NULL;
+    }
+    /* Port map entries are offset by one such that 0 denotes an unhandled port */
+    uint16_t id = ioports->port_map[port_no];
+    return id ? &ioports->ioports[id - 1] : NULL;
 }
 
-static vm_ioport_entry_t *search_port(vm_io_port_list_t *ioports, unsigned int port_no)
+vm_ioport_entry_t *vm_ioport_lookup(vm_io_port_list_t *ioports, unsigned int port_no)
 {
-    return (vm_ioport_entry_t *)bsearch((void *)(uintptr_t)port_no, ioports->ioports, ioports->num_ioports,
-                                        sizeof(vm_ioport_entry_t), io_port_compare_by_range);
+    return search_port(ioports, port_no);
 }
 
 static void set_io_in_unhandled(vm_vcpu_t *vcpu, unsigned int size)
@@ -76,24 +77,47 @@ static void set_io_in_value(vm_vcpu_t *vcpu, unsigned int value, unsigned int si
 
 static int add_io_port_range(vm_io_port_list_t *ioport_list, vm_ioport_entry_t port)
 {
+    if (port.range.start > port.range.end) {
+        ZF_LOGE("Invalid ioport range 0x%x-0x%x for %s", port.range.start, port.range.end,
+                port.interface.desc ? port.interface.desc : "Unknown IO Port");
+        return -1;
+    }
+    /* Handler ids are stored in 16 bits with 0 reserved for unhandled ports */
+    if (ioport_list->num_ioports >= UINT16_MAX) {
+        ZF_LOGE("Unable to add ioport range 0x%x-0x%x: Too many ioport handlers", port.range.start, port.range.end);
+        return -1;
+    }
+    if (!ioport_list->port_map) {
+        ioport_list->port_map = calloc(IOPORT_MAP_SIZE, sizeof(uint16_t));
+        if (!ioport_list->port_map) {
+            ZF_LOGE("Unable to add ioport range: Failed to allocate port map");
+            return -1;
+        }
+    }
     /* ensure this range does not overlap */
-    for (int i = 0; i < ioport_list->num_ioports; i++) {
-        if (ioport_list->ioports[i].range.end > port.range.start && ioport_list->ioports[i].range.start < port.range.end) {
+    for (unsigned int i = port.range.start; i <= port.range.end; i++) {
+        if (ioport_list->port_map[i]) {
+            vm_ioport_entry_t *existing = &ioport_list->ioports[ioport_list->port_map[i] - 1];
             ZF_LOGE("Requested ioport range 0x%x-0x%x for %s overlaps with existing range 0x%x-0x%x for %s",
                     port.range.start, port.range.end, port.interface.desc ? port.interface.desc : "Unknown IO Port",
-                    ioport_list->ioports[i].range.start, ioport_list->ioports[i].range.end,
-                    ioport_list->ioports[i].interface.desc ? ioport_list->ioports[i].interface.desc : "Unknown IO Port");
+                    existing->range.start, existing->range.end,
+                    existing->interface.desc ? existing->interface.desc : "Unknown IO Port");
             return -1;
         }
     }
     /* grow the array */
-    ioport_list->ioports = realloc(ioport_list->ioports, sizeof(vm_ioport_entry_t) * (ioport_list->num_ioports + 1));
-    assert(ioport_list->ioports);
-    /* add the new entry */
+    vm_ioport_entry_t *ioports = realloc(ioport_list->ioports, sizeof(vm_ioport_entry_t) * (ioport_list->num_ioports + 1));
+    if (!ioports) {
+        ZF_LOGE("Unable to add ioport range: Failed to grow ioport list");
+        return -1;
+    }
+    ioport_list->ioports = ioports;
+    /* add the new entry, entries are never reordered such that port map ids remain valid */
     ioport_list->ioports[ioport_list->num_ioports] = port;
     ioport_list->num_ioports++;
-    /* sort */
-    qsort(ioport_list->ioports, ioport_list->num_ioports, sizeof(vm_ioport_entry_t), io_port_compare_by_start);
+    for (unsigned int i = port.range.start; i <= port.range.end; i++) {
+        ioport_list->port_map[i] = ioport_list->num_ioports;
+    }
     return 0;
 }
 
@@ -120,6 +144,220 @@ int vm_enable_passthrough_ioport(vm_vcpu_t *vcpu, uint16_t port_start, uint16_t
     return 0;
 }
 
+/* Enable a passed through range on a vcpu through a copy of its capability, as a
+ * capability to an ioport range is only enabled on the vcpu it was last given to */
+static int enable_passthrough_copy(vm_vcpu_t *vcpu, vm_passthrough_ioport_t *port)
+{
+    vka_t *vka = vcpu->vm->vka;
+    cspacepath_t src, dest;
+    int error = vka_cspace_alloc_path(vka, &dest);
+    if (error) {
+        ZF_LOGE("Failed to allocate slot");
+        return -1;
+    }
+    vka_cspace_make_path(vka, port->cap, &src);
+    error = vka_cnode_copy(&dest, &src, seL4_AllRights);
+    if (error) {
+        ZF_LOGE("Failed to copy io port cap for range 0x%x - 0x%x", port->range.start, port->range.end);
+        vka_cspace_free_path(vka, dest);
+        return -1;
+    }
+    error = seL4_X86_VCPU_EnableIOPort(vcpu->vcpu.cptr, dest.capPtr, port->range.start, port->range.end);
+    if (error != seL4_NoError) {
+        ZF_LOGE("Failed to enable io port range 0x%x - 0x%x on vcpu %d", port->range.start, port->range.end,
+                vcpu->vcpu_id);
+        return -1;
+    }
+    return 0;
+}
+
+int vm_passthrough_ioport(vm_t *vm, uint16_t port_start, uint16_t port_end)
+{
+    vm_io_port_list_t *ioport_list = &vm->arch.ioport_list;
+    if (port_end < port_start) {
+        ZF_LOGE("Failed to pass through ioport range 0x%x - 0x%x: Invalid range", port_start, port_end);
+        return -1;
+    }
+    vm_passthrough_ioport_t *passthrough = realloc(ioport_list->passthrough,
+                                                   sizeof(vm_passthrough_ioport_t) * (ioport_list->num_passthrough + 1));
+    if (!passthrough) {
+        ZF_LOGE("Failed to pass through ioport range 0x%x - 0x%x: Unable to grow passthrough list", port_start,
+                port_end);
+        return -1;
+    }
+    ioport_list->passthrough = passthrough;
+    cspacepath_t path;
+    int error = vka_cspace_alloc_path(vm->vka, &path);
+    if (error) {
+        ZF_LOGE("Failed to allocate slot");
+        return -1;
+    }
+    error = simple_get_IOPort_cap(vm->simple, port_start, port_end, path.root, path.capPtr, path.capDepth);
+    if (error) {
+        ZF_LOGE("Failed to get io port from simple for range 0x%x - 0x%x", port_start, port_end);
+        vka_cspace_free_path(vm->vka, path);
+        return -1;
+    }
+    vm_passthrough_ioport_t *port = &passthrough[ioport_list->num_passthrough];
+    *port = (vm_passthrough_ioport_t) {
+        .range = { .start = port_start, .end = port_end },
+        .cap = path.capPtr
+    };
+    ioport_list->num_passthrough++;
+    ZF_LOGD("Passing through IO port 0x%x - 0x%x", port_start, port_end);
+    for (int i = 0; i < vm->num_vcpus; i++) {
+        if (enable_passthrough_copy(vm->vcpus[i], port)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int vm_ioport_passthrough_vcpu(vm_vcpu_t *vcpu)
+{
+    vm_io_port_list_t *ioport_list = &vcpu->vm->arch.ioport_list;
+    for (int i = 0; i < ioport_list->num_passthrough; i++) {
+        if (enable_passthrough_copy(vcpu, &ioport_list->passthrough[i])) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void vm_ioport_list_destroy(vm_t *vm)
+{
+    vm_io_port_list_t *ioport_list = &vm->arch.ioport_list;
+    for (int i = 0; i < ioport_list->num_passthrough; i++) {
+        cspacepath_t path;
+        vka_cspace_make_path(vm->vka, ioport_list->passthrough[i].cap, &path);
+        vka_cnode_delete(&path);
+        vka_cspace_free(vm->vka, path.capPtr);
+    }
+    free(ioport_list->passthrough);
+    free(ioport_list->ioports);
+    free(ioport_list->port_map);
+    memset(ioport_list, 0, sizeof(*ioport_list));
+    vm_doorbell_table_destroy(vm->arch.ioport_doorbells);
+    vm->arch.ioport_doorbells = NULL;
+}
+
+/* Emulate a single port access through a registered handler or the unhandled ioport callback */
+static ioport_fault_result_t emulate_port_access(vm_vcpu_t *vcpu, unsigned int port_no, bool is_in,
+                                                 unsigned int *value, unsigned int size)
+{
+    vm_ioport_entry_t *port = search_port(&vcpu->vm->arch.ioport_list, port_no);
+    if (port) {
+        if (is_in) {
+            return port->interface.port_in(vcpu, port->interface.cookie, port_no, size, value);
+        }
+        return port->interface.port_out(vcpu, port->interface.cookie, port_no, size, *value);
+    }
+    if (vcpu->vm->arch.unhandled_ioport_callback) {
+        return vcpu->vm->arch.unhandled_ioport_callback(vcpu, port_no, is_in, value, size,
+                                                        vcpu->vm->arch.unhandled_ioport_callback_cookie);
+    }
+    /* No means of handling ioport instruction */
+    ZF_LOGW("ignoring unsupported ioport 0x%x", port_no);
+    return IO_FAULT_UNHANDLED;
+}
+
+/* Copy between a buffer and a range of guest virtual memory, translating each page separately */
+static int string_io_copy(vm_vcpu_t *vcpu, uintptr_t vaddr, size_t len, uint8_t *buf, bool to_guest)
+{
+    uintptr_t cr3 = vm_guest_state_get_cr3(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr);
+    while (len > 0) {
+        uintptr_t paddr;
+        size_t chunk = MIN(len, PAGE_SIZE_4K - (vaddr & (PAGE_SIZE_4K - 1)));
+        if (vm_guest_virt_to_phys(vcpu, vaddr, cr3, &paddr)) {
+            return -1;
+        }
+        int err = vm_ram_touch(vcpu->vm, paddr, chunk,
+                               to_guest ? vm_guest_ram_write_callback : vm_guest_ram_read_callback, buf);
+        if (err) {
+            return -1;
+        }
+        vaddr += chunk;
+        buf += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+/* Emulate an ins/outs instruction, moving up to IOPORT_STRING_MAX_BYTES between the port and guest memory.
+ * A 32-bit address size is assumed and segment overrides on outs are not decoded */
+static int io_string_instruction_handler(vm_vcpu_t *vcpu, unsigned int port_no, bool is_in, unsigned int size,
+                                         bool rep)
+{
+    guest_state_t *gs = vcpu->vcpu_arch.guest_state;
+    uint8_t buf[IOPORT_STRING_MAX_BYTES];
+    int addr_reg = is_in ? VCPU_CONTEXT_EDI : VCPU_CONTEXT_ESI;
+    uint32_t count = 1;
+    uint32_t addr;
+
+    if (rep) {
+        if (vm_get_thread_context_reg(vcpu, VCPU_CONTEXT_ECX, &count)) {
+            return VM_EXIT_HANDLE_ERROR;
+        }
+        if (count == 0) {
+            vm_guest_exit_next_instruction(gs, vcpu->vcpu.cptr);
+            return VM_EXIT_HANDLED;
+        }
+    }
+    if (vm_get_thread_context_reg(vcpu, addr_reg, &addr)) {
+        return VM_EXIT_HANDLE_ERROR;
+    }
+
+    /* ins always stores through ES, outs loads through DS */
+    unsigned int seg_base = vm_guest_state_vmcs_get(gs, vcpu->vcpu.cptr,
+                                                    is_in ? VMCS_CACHE_ES_BASE : VMCS_CACHE_DS_BASE);
+    bool backwards = vm_guest_state_get_rflags(gs, vcpu->vcpu.cptr) & RFLAGS_DF;
+    uint32_t num_elems = MIN(count, IOPORT_STRING_MAX_BYTES / size);
+    size_t len = num_elems * size;
+    /* Lowest guest address touched, elements are accessed in descending order when backwards */
+    uintptr_t start = seg_base + (backwards ? addr - (num_elems - 1) * size : addr);
+
+    if (!is_in && string_io_copy(vcpu, start, len, buf, false)) {
+        ZF_LOGE("Failed to read string io source buffer at 0x%x", start);
+        return VM_EXIT_HANDLE_ERROR;
+    }
+    for (uint32_t i = 0; i < num_elems; i++) {
+        uint8_t *elem = buf + (backwards ? num_elems - 1 - i : i) * size;
+        unsigned int value = 0;
+        if (!is_in) {
+            memcpy(&value, elem, size);
+        }
+        ioport_fault_result_t res = emulate_port_access(vcpu, port_no, is_in, &value, size);
+        if (res == IO_FAULT_ERROR) {
+            ZF_LOGE("VM Exit IO Error: string %d  in %d rep %d  port no 0x%x size %d", 1,
+                    is_in, rep, port_no, size);
+            return VM_EXIT_HANDLE_ERROR;
+        }
+        if (is_in) {
+            if (res == IO_FAULT_UNHANDLED) {
+                value = -1;
+            }
+            memcpy(elem, &value, size);
+        }
+    }
+    if (is_in && string_io_copy(vcpu, start, len, buf, true)) {
+        ZF_LOGE("Failed to write string io destination buffer at 0x%x", start);
+        return VM_EXIT_HANDLE_ERROR;
+    }
+
+    addr = backwards ? addr - len : addr + len;
+    vm_set_thread_context_reg(vcpu, addr_reg, addr);
+    if (rep) {
+        count -= num_elems;
+        vm_set_thread_context_reg(vcpu, VCPU_CONTEXT_ECX, count);
+        if (count) {
+            /* Re-execute the instruction to continue the transfer */
+            return VM_EXIT_HANDLED;
+        }
+    }
+    vm_guest_exit_next_instruction(gs, vcpu->vcpu.cptr);
+    return VM_EXIT_HANDLED;
+}
+
 /* IO instruction execution handler. */
 int vm_io_instruction_handler(vm_vcpu_t *vcpu)
 {
@@ -139,10 +377,8 @@ int vm_io_instruction_handler(vm_vcpu_t *vcpu)
     size = (exit_qualification & 7) + 1;
     rep = (exit_qualification & 0x20) >> 5;
 
-    /*FIXME: does not support string and rep instructions*/
-    if (string || rep) {
-        ZF_LOGE("FIXME: IO exit does not support string and rep instructions");
-        return VM_EXIT_HANDLE_ERROR;
+    if (string) {
+        return io_string_instruction_handler(vcpu, port_no, is_in, size, rep);
     }
 
     if (!is_in) {
@@ -155,29 +391,13 @@ int vm_io_instruction_handler(vm_vcpu_t *vcpu)
         }
     }
 
-    /* Search internal ioport list */
-    vm_ioport_entry_t *port = search_port(&vcpu->vm->arch.ioport_list, port_no);
-    if (port) {
-        if (is_in) {
-            res = port->interface.port_in(vcpu, port->interface.cookie, port_no, size, &value);
-        } else {
-            res = port->interface.port_out(vcpu, port->interface.cookie, port_no, size, value);
-        }
-    } else if (vcpu->vm->arch.unhandled_ioport_callback) {
-        res = vcpu->vm->arch.unhandled_ioport_callback(vcpu, port_no, is_in, &value, size,
-                                                       vcpu->vm->arch.unhandled_ioport_callback_cookie);
-    } else {
-        /* No means of handling ioport instruction */
-        if (port_no != -1) {
-            ZF_LOGW("ignoring unsupported ioport 0x%x", port_no);
-        }
-        if (is_in) {
-            set_io_in_unhandled(vcpu, size);
-        }
+    if (!is_in && vm_doorbell_ring(vcpu->vm->arch.ioport_doorbells, port_no, size, value)) {
         vm_guest_exit_next_instruction(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr);
         return VM_EXIT_HANDLED;
     }
 
+    res = emulate_port_access(vcpu, port_no, is_in, &value, size);
+
     if (is_in) {
         if (res == IO_FAULT_UNHANDLED) {
             set_io_in_unhandled(vcpu, size);
@@ -214,6 +434,21 @@ int vm_register_unhandled_ioport_callback(vm_t *vm, unhandled_ioport_callback_fn
     return 0;
 }
 
+int vm_register_ioport_doorbell(vm_t *vm, uint16_t port_start, uint16_t port_end, bool match_value,
+                                seL4_Word value, seL4_CPtr notification)
+{
+    if (!vm) {
+        ZF_LOGE("Failed to register ioport doorbell: Invalid VM handle");
+        return -1;
+    }
+    if (port_end < port_start) {
+        ZF_LOGE("Failed to register ioport doorbell: Invalid port range");
+        return -1;
+    }
+    return vm_doorbell_add(&vm->arch.ioport_doorbells, port_start, port_end - port_start + 1, match_value, value,
+                           notification);
+}
+
 int vm_io_port_add_handler(vm_t *vm, vm_ioport_range_t io_range, vm_ioport_interface_t io_interface)
 {
     return add_io_port_range(&vm->arch.ioport_list, (vm_ioport_entry_t) {
@@ -0,0 +1,45 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <utils/util.h>
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/boot.h>
+#include <sel4vm/arch/msi.h>
+
+#include "processor/apicdef.h"
+#include "processor/lapic.h"
+
+/* Message address fields */
+#define MSI_ADDR_BASE_SHIFT     20
+#define MSI_ADDR_BASE           (APIC_DEFAULT_PHYS_BASE >> MSI_ADDR_BASE_SHIFT)
+#define MSI_ADDR_DEST_SHIFT     12
+#define MSI_ADDR_DEST_MASK      0xff
+#define MSI_ADDR_DEST_LOGICAL   BIT(2)
+
+/* Message data uses the vector, delivery mode, level and trigger mode encoding of the ICR */
+#define MSI_DATA_VECTOR_MASK    0xff
+
+int vm_inject_msi(vm_t *vm, uint64_t address, uint32_t data)
+{
+    if (!vm || (address >> MSI_ADDR_BASE_SHIFT) != MSI_ADDR_BASE) {
+        ZF_LOGE("Failed to inject msi: Invalid vm or message address 0x%llx", (unsigned long long)address);
+        return -1;
+    }
+    struct vm_lapic_irq irq = {
+        .vector = data & MSI_DATA_VECTOR_MASK,
+        .delivery_mode = data & APIC_MODE_MASK,
+        .dest_mode = (address & MSI_ADDR_DEST_LOGICAL) ? APIC_DEST_LOGICAL : APIC_DEST_PHYSICAL,
+        .level = data & APIC_INT_ASSERT,
+        .trig_mode = data & APIC_INT_LEVELTRIG,
+        .shorthand = APIC_DEST_NOSHORT,
+        .dest_id = (address >> MSI_ADDR_DEST_SHIFT) & MSI_ADDR_DEST_MASK
+    };
+    if (vm_irq_delivery_to_apic(vm->vcpus[BOOT_VCPU], &irq, NULL) <= 0) {
+        return -1;
+    }
+    return 0;
+}
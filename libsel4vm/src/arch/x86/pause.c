@@ -0,0 +1,77 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/* vm exits of spinning vcpus executing pause */
+
+#include <autoconf.h>
+#include <sel4vm/gen_config.h>
+
+#include <sel4/sel4.h>
+#include <utils/util.h>
+#include <platsupport/arch/tsc.h>
+
+#include <sel4vm/guest_vm.h>
+
+#include "vm.h"
+#include "guest_state.h"
+#include "vmexit.h"
+#include "vcpu_thread.h"
+
+/* Pause exits closer together than this are taken to be the same spin loop */
+#define PAUSE_SPIN_GAP_CYCLES   BIT(14)
+/* Length a spin loop runs for before its vcpu yields to a sibling that may be holding the lock it waits on */
+#define PAUSE_SPIN_WINDOW_CYCLES BIT(18)
+
+#ifdef CONFIG_LIB_SEL4VM_PAUSE_YIELD
+/* Whether a sibling vcpu is worth yielding to, following KVM's directed yield heuristic: it has to be running
+ * guest code, and competes for the spinning vcpu's core, and isn't spinning itself */
+static bool pause_yield_eligible(vm_vcpu_t *vcpu, vm_vcpu_t *candidate, uint64_t now)
+{
+    guest_virt_state_t *virt = &candidate->vcpu_arch.guest_state->virt;
+    if (candidate == vcpu || !candidate->vcpu_online || __atomic_load_n(&virt->interrupt_halt, __ATOMIC_RELAXED)) {
+        return false;
+    }
+    if (vcpu->target_cpu >= 0 && candidate->target_cpu >= 0 && candidate->target_cpu != vcpu->target_cpu) {
+        return false;
+    }
+    return now - __atomic_load_n(&virt->pause_last, __ATOMIC_RELAXED) > PAUSE_SPIN_GAP_CYCLES;
+}
+
+/* Yield the core of a spinning vcpu if there is a sibling that may be holding the lock it waits on. Candidates are
+ * tried round robin starting after the vcpu last yielded to, such that all siblings get a turn */
+static void pause_directed_yield(vm_vcpu_t *vcpu, uint64_t now)
+{
+    vm_t *vm = vcpu->vm;
+    for (unsigned int i = 1; i <= vm->num_vcpus; i++) {
+        unsigned int id = (vm->arch.pause_last_boosted + i) % vm->num_vcpus;
+        if (pause_yield_eligible(vcpu, vm->vcpus[id], now)) {
+            vm->arch.pause_last_boosted = id;
+            /* Siblings share the vcpu's priority, a yield hands them the rest of its timeslice */
+            vm_vcpu_yield(vcpu);
+            return;
+        }
+    }
+}
+#endif /* CONFIG_LIB_SEL4VM_PAUSE_YIELD */
+
+int vm_pause_handler(vm_vcpu_t *vcpu)
+{
+#ifdef CONFIG_LIB_SEL4VM_PAUSE_YIELD
+    guest_virt_state_t *virt = &vcpu->vcpu_arch.guest_state->virt;
+    uint64_t now = rdtsc_pure();
+    if (now - virt->pause_last > PAUSE_SPIN_GAP_CYCLES) {
+        /* Start of a new spin loop */
+        virt->pause_spin_start = now;
+    }
+    __atomic_store_n(&virt->pause_last, now, __ATOMIC_RELAXED);
+    if (now - virt->pause_spin_start > PAUSE_SPIN_WINDOW_CYCLES) {
+        pause_directed_yield(vcpu, now);
+        virt->pause_spin_start = rdtsc_pure();
+    }
+#endif
+    vm_guest_exit_next_instruction(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr);
+    return VM_EXIT_HANDLED;
+}
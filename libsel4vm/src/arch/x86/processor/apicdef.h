@@ -79,6 +79,7 @@
 #define     APIC_ESR_ILLREGA    0x00080
 #define     APIC_LVTCMCI    0x2f0
 #define APIC_ICR    0x300
+#define     APIC_DEST_NOSHORT   0x00000
 #define     APIC_DEST_SELF      0x40000
 #define     APIC_DEST_ALLINC    0x80000
 #define     APIC_DEST_ALLBUT    0xC0000
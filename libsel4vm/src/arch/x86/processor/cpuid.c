@@ -11,19 +11,42 @@
  *         Qian Ge
  */
 
+#include <autoconf.h>
+#include <sel4vm/gen_config.h>
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <sel4/sel4.h>
+#include <utils/util.h>
 
 #include <sel4vm/guest_vm.h>
 #include <sel4vm/arch/guest_x86_context.h>
+#include <sel4vm/arch/cpuid.h>
 
 #include "processor/cpuid.h"
 #include "processor/cpufeature.h"
 
 #include "vm.h"
 #include "guest_state.h"
+#include "pvclock.h"
+
+/* Bound on the subleaves of a leaf read into the table */
+#define CPUID_MAX_SUBLEAVES 16
+
+typedef struct cpuid_entry {
+    unsigned int function;
+    unsigned int index;
+    struct cpuid_val val;
+} cpuid_entry_t;
+
+/* The CPUID values of a VM, sorted by leaf then subleaf */
+struct vm_cpuid_table {
+    int num_entries;
+    int table_size;
+    cpuid_entry_t *entries;
+};
 
 static inline void native_cpuid(unsigned int *eax, unsigned int *ebx,
                                 unsigned int *ecx, unsigned int *edx)
@@ -38,14 +61,10 @@ static inline void native_cpuid(unsigned int *eax, unsigned int *ebx,
                  : "memory");
 }
 
-static int vm_cpuid_virt(unsigned int function, unsigned int index, struct cpuid_val *val, vm_vcpu_t *vcpu)
+/* Virtualise the host's values of a CPUID leaf, returning -1 if the leaf isn't supported */
+static int cpuid_virtualise(vm_t *vm, unsigned int function, struct cpuid_val *val)
 {
-    unsigned int eax, ebx, ecx, edx;
-
-    eax = function;
-    ecx = index;
-
-    native_cpuid(&eax, &ebx, &ecx, &edx);
+    unsigned int eax = val->eax, ebx = val->ebx, ecx = val->ecx, edx = val->edx;
 
     /* cpuid 1.edx */
     const unsigned int kvm_supported_word0_x86_features =
@@ -65,9 +84,10 @@ static int vm_cpuid_virt(unsigned int function, unsigned int index, struct cpuid
         0 /* TM2 */ | F(SSSE3) | 0 /* CNXT-ID */ | 0 /* Reserved */ |
         0 /*F(FMA)*/ | 0 /*F(CX16)*/ | 0 /* xTPR Update, PDCM */ |
         0 /*F(PCID)*/ | 0 /* Reserved, DCA */ | F(XMM4_1) |
-        F(XMM4_2) | 0 /*F(X2APIC)*/ | 0 /*F(MOVBE)*/ | 0 /*F(POPCNT)*/ |
+        F(XMM4_2) | (config_set(CONFIG_LIB_SEL4VM_X2APIC) ? F(X2APIC) : 0) | 0 /*F(MOVBE)*/ | 0 /*F(POPCNT)*/ |
         0 /* Reserved*/ | 0 /*F(AES)*/ | 0/*F(XSAVE)*/ | 0/*F(OSXSAVE)*/ | 0 /*F(AVX)*/ |
-        0 /*F(F16C)*/ | 0 /*F(RDRAND)*/;
+        0 /*F(F16C)*/ | 0 /*F(RDRAND)*/ |
+        (config_set(CONFIG_LIB_SEL4VM_LAPIC_TIMER) ? F(TSC_DEADLINE_TIMER) : 0);
 
     /* cpuid 0x80000001.edx */
     const unsigned int kvm_supported_word1_x86_features =
@@ -89,9 +109,14 @@ static int vm_cpuid_virt(unsigned int function, unsigned int index, struct cpuid
         F(FSGSBASE) | F(BMI1) | F(HLE) | F(AVX2) | F(SMEP) |
         F(BMI2) | F(ERMS) | 0 /*F(INVPCID)*/ | F(RTM);
 
+    /* cpuid 0x40000001.eax */
+    const unsigned int kvm_supported_pv_features =
+        (config_set(CONFIG_LIB_SEL4VM_PV_EOI) ? BIT(KVM_FEATURE_PV_EOI) : 0) |
+        (config_set(CONFIG_LIB_SEL4VM_PV_UNHALT) ? BIT(KVM_FEATURE_PV_UNHALT) : 0) | vm_pvclock_features(vm);
+
     /* Virtualize the return value according to the function. */
 
-    ZF_LOGD("cpuid function 0x%x index 0x%x eax 0x%x ebx 0%x ecx 0x%x edx 0x%x\n", function, index, eax, ebx, ecx, edx);
+    ZF_LOGD("cpuid function 0x%x eax 0x%x ebx 0%x ecx 0x%x edx 0x%x\n", function, eax, ebx, ecx, edx);
 
     /* ref: http://www.sandpile.org/x86/cpuid.htm */
 
@@ -124,9 +149,22 @@ static int vm_cpuid_virt(unsigned int function, unsigned int index, struct cpuid
         eax = ebx = ecx = edx = 0;
         break;
 
-    case VMM_CPUID_KVM_SIGNATURE: /* Unsupported KVM features. We are not KVM. */
+    case VMM_CPUID_KVM_SIGNATURE:
+        if (!kvm_supported_pv_features) {
+            /* No KVM paravirtual features are supported. We are not KVM. */
+            eax = ebx = ecx = edx = 0;
+            break;
+        }
+        /* Identify as KVM such that guests probe the paravirtual features we do support */
+        eax = VMM_CPUID_KVM_FEATURES;
+        ebx = VMM_CPUID_KVM_SIGNATURE_EBX;
+        ecx = VMM_CPUID_KVM_SIGNATURE_ECX;
+        edx = VMM_CPUID_KVM_SIGNATURE_EDX;
+        break;
+
     case VMM_CPUID_KVM_FEATURES:
-        eax = ebx = ecx = edx = 0;
+        eax = kvm_supported_pv_features;
+        ebx = ecx = edx = 0;
         break;
 
     case 0x80000000: /* Get highest extended function supported */
@@ -161,7 +199,6 @@ static int vm_cpuid_virt(unsigned int function, unsigned int index, struct cpuid
 
     default:
         /* TODO: Adding more CPUID functions whenever necessary */
-        ZF_LOGE("CPUID unimplemented function 0x%x\n", function);
         return -1;
 
     }
@@ -177,6 +214,197 @@ static int vm_cpuid_virt(unsigned int function, unsigned int index, struct cpuid
 
 }
 
+static int vm_cpuid_virt(unsigned int function, unsigned int index, struct cpuid_val *val, vm_vcpu_t *vcpu)
+{
+    val->eax = function;
+    val->ecx = index;
+    native_cpuid(&val->eax, &val->ebx, &val->ecx, &val->edx);
+    if (cpuid_virtualise(vcpu->vm, function, val)) {
+        ZF_LOGE("CPUID unimplemented function 0x%x\n", function);
+        return -1;
+    }
+    return 0;
+}
+
+/* Leaves whose values depend on the subleaf given in ecx */
+static bool cpuid_index_significant(unsigned int function)
+{
+    switch (function) {
+    case 4:
+    case 7:
+    case 0xb:
+    case 0xd:
+    case 0xf:
+    case 0x10:
+    case 0x12:
+    case 0x14:
+    case 0x17:
+    case 0x18:
+    case 0x8000001d:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* Index of the first entry not ordered before the given leaf and subleaf */
+static int cpuid_table_lower_bound(vm_cpuid_table_t *table, unsigned int function, unsigned int index)
+{
+    int low = 0;
+    int high = table->num_entries;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        cpuid_entry_t *entry = &table->entries[mid];
+        if (entry->function < function || (entry->function == function && entry->index < index)) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+static cpuid_entry_t *cpuid_table_find(vm_cpuid_table_t *table, unsigned int function, unsigned int index)
+{
+    if (!cpuid_index_significant(function)) {
+        index = 0;
+    }
+    int i = cpuid_table_lower_bound(table, function, index);
+    if (i < table->num_entries && table->entries[i].function == function && table->entries[i].index == index) {
+        return &table->entries[i];
+    }
+    return NULL;
+}
+
+static int cpuid_table_set(vm_cpuid_table_t *table, unsigned int function, unsigned int index,
+                           struct cpuid_val *val)
+{
+    if (!cpuid_index_significant(function)) {
+        index = 0;
+    }
+    int i = cpuid_table_lower_bound(table, function, index);
+    if (i < table->num_entries && table->entries[i].function == function && table->entries[i].index == index) {
+        table->entries[i].val = *val;
+        return 0;
+    }
+    if (table->num_entries == table->table_size) {
+        int size = table->table_size ? table->table_size * 2 : 32;
+        cpuid_entry_t *entries = realloc(table->entries, size * sizeof(cpuid_entry_t));
+        if (!entries) {
+            ZF_LOGE("Failed to set cpuid entry: Unable to grow table");
+            return -1;
+        }
+        table->entries = entries;
+        table->table_size = size;
+    }
+    memmove(&table->entries[i + 1], &table->entries[i], (table->num_entries - i) * sizeof(cpuid_entry_t));
+    table->entries[i] = (cpuid_entry_t) {
+        .function = function,
+        .index = index,
+        .val = *val
+    };
+    table->num_entries++;
+    return 0;
+}
+
+/* Add the subleaves of a leaf to the table. Leaves the VMM doesn't support are left out, such that they are still
+ * reported as unimplemented on exit */
+static int cpuid_table_add_leaf(vm_t *vm, vm_cpuid_table_t *table, unsigned int function)
+{
+    unsigned int max_index = 0;
+    for (unsigned int index = 0; index < CPUID_MAX_SUBLEAVES; index++) {
+        struct cpuid_val val = { .eax = function, .ecx = index };
+        native_cpuid(&val.eax, &val.ebx, &val.ecx, &val.edx);
+        unsigned int native_eax = val.eax;
+        if (cpuid_virtualise(vm, function, &val)) {
+            return 0;
+        }
+        if (cpuid_table_set(table, function, index, &val)) {
+            return -1;
+        }
+        if (function == 7 && index == 0) {
+            /* eax of the first subleaf gives the last subleaf */
+            max_index = native_eax;
+        }
+        /* Cache subleaves end with a null cache type */
+        if (!cpuid_index_significant(function) || (function == 4 && !(native_eax & 0x1f))
+            || (function != 4 && index >= max_index)) {
+            break;
+        }
+    }
+    return 0;
+}
+
+int vm_cpuid_init(vm_t *vm)
+{
+    vm_cpuid_table_t *table = calloc(1, sizeof(vm_cpuid_table_t));
+    if (!table) {
+        ZF_LOGE("Failed to initialise cpuid table: Unable to allocate table");
+        return -1;
+    }
+
+    struct cpuid_val val = { .eax = 0, .ecx = 0 };
+    native_cpuid(&val.eax, &val.ebx, &val.ecx, &val.edx);
+    cpuid_virtualise(vm, 0, &val);
+    unsigned int max_function = val.eax;
+
+    val = (struct cpuid_val) {
+        .eax = 0x80000000, .ecx = 0
+    };
+    native_cpuid(&val.eax, &val.ebx, &val.ecx, &val.edx);
+    unsigned int max_ext_function = MIN(val.eax, VMM_CPUID_P4_MAX_EXTFUNCTION);
+
+    int err = 0;
+    for (unsigned int function = 0; !err && function <= max_function; function++) {
+        err = cpuid_table_add_leaf(vm, table, function);
+    }
+    for (unsigned int function = 0x80000000; !err && function <= max_ext_function; function++) {
+        err = cpuid_table_add_leaf(vm, table, function);
+    }
+    if (err) {
+        free(table->entries);
+        free(table);
+        return -1;
+    }
+    vm->arch.cpuid = table;
+    return 0;
+}
+
+void vm_cpuid_destroy(vm_t *vm)
+{
+    vm_cpuid_table_t *table = vm->arch.cpuid;
+    if (!table) {
+        return;
+    }
+    free(table->entries);
+    free(table);
+    vm->arch.cpuid = NULL;
+}
+
+int vm_cpuid_set_entries(vm_t *vm, const vm_cpuid_entry_t *entries, int num_entries)
+{
+    if (!vm->arch.cpuid) {
+        ZF_LOGE("Failed to set cpuid entries: Table not initialised, no vcpu has been created");
+        return -1;
+    }
+    for (int i = 0; i < num_entries; i++) {
+        struct cpuid_val val = {
+            .eax = entries[i].eax,
+            .ebx = entries[i].ebx,
+            .ecx = entries[i].ecx,
+            .edx = entries[i].edx
+        };
+        if (cpuid_virtualise(vm, entries[i].function, &val)) {
+            ZF_LOGE("Failed to set cpuid entries: Unsupported function 0x%x", entries[i].function);
+            return -1;
+        }
+        if (cpuid_table_set(vm->arch.cpuid, entries[i].function, entries[i].index, &val)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
 #if 0
 /* function 2 entries are STATEFUL. That is, repeated cpuid commands
  * may return different values. This forces us to get_cpu() before
@@ -375,28 +603,38 @@ break;
 /* VM exit handler: for the CPUID instruction. */
 int vm_cpuid_handler(vm_vcpu_t *vcpu)
 {
-
     int ret;
     struct cpuid_val val;
+    seL4_VCPUContext context;
 
     /* Read parameter information. */
-    unsigned int function, index;
-    if (vm_get_thread_context_reg(vcpu, VCPU_CONTEXT_EAX, &function)
-        || vm_get_thread_context_reg(vcpu, VCPU_CONTEXT_ECX, &index)) {
+    if (vm_get_thread_context(vcpu, &context)) {
         return VM_EXIT_HANDLE_ERROR;
     }
+    unsigned int function = context.eax;
+    unsigned int index = context.ecx;
 
-    /* Virtualise the CPUID instruction. */
-    ret = vm_cpuid_virt(function, index, &val, vcpu);
-    if (ret) {
-        return VM_EXIT_HANDLE_ERROR;
+    /* Virtualise the CPUID instruction, from the table where the leaf is in it. */
+    cpuid_entry_t *entry = vcpu->vm->arch.cpuid ? cpuid_table_find(vcpu->vm->arch.cpuid, function, index) : NULL;
+    if (entry) {
+        val = entry->val;
+    } else {
+        ret = vm_cpuid_virt(function, index, &val, vcpu);
+        if (ret) {
+            return VM_EXIT_HANDLE_ERROR;
+        }
+    }
+    if (function == 1) {
+        /* Initial APIC id, in agreement with the LAPIC and ACPI code */
+        val.ebx = (val.ebx & 0x00ffffff) | (vcpu->vcpu_id << 24);
     }
 
     /* Set the return values in guest context. */
-    vm_set_thread_context_reg(vcpu, VCPU_CONTEXT_EAX, val.eax);
-    vm_set_thread_context_reg(vcpu, VCPU_CONTEXT_EBX, val.ebx);
-    vm_set_thread_context_reg(vcpu, VCPU_CONTEXT_ECX, val.ecx);
-    vm_set_thread_context_reg(vcpu, VCPU_CONTEXT_EDX, val.edx);
+    context.eax = val.eax;
+    context.ebx = val.ebx;
+    context.ecx = val.ecx;
+    context.edx = val.edx;
+    vm_set_thread_context(vcpu, context);
 
     vm_guest_exit_next_instruction(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr);
 
@@ -16,6 +16,8 @@
 
 #include <utils/util.h>
 
+#include <sel4vm/guest_vm.h>
+
 #define F(x) BIT( (X86_FEATURE_##x) & 31)
 
 /* Basic information for the processor P4 hyperthread. */
@@ -36,6 +38,19 @@
 /* This CPUID returns a feature bitmap in eax */
 #define VMM_CPUID_KVM_FEATURES      0x40000001
 
+/* 'KVMKVMKVM\0\0\0' split over ebx, ecx and edx */
+#define VMM_CPUID_KVM_SIGNATURE_EBX 0x4b4d564b
+#define VMM_CPUID_KVM_SIGNATURE_ECX 0x564b4d56
+#define VMM_CPUID_KVM_SIGNATURE_EDX 0x0000004d
+
+/* KVM paravirtual feature bits */
+#define KVM_FEATURE_CLOCKSOURCE     0
+#define KVM_FEATURE_CLOCKSOURCE2    3
+#define KVM_FEATURE_STEAL_TIME      5
+#define KVM_FEATURE_PV_EOI          6
+#define KVM_FEATURE_PV_UNHALT       7
+#define KVM_FEATURE_CLOCKSOURCE_STABLE_BIT 24
+
 /* CPUID instruction return value. */
 struct cpuid_val {
     unsigned int eax;
@@ -44,3 +59,9 @@ struct cpuid_val {
     unsigned int edx;
 };
 
+
+/* Build the CPUID table of a VM from the host's CPUID leaves */
+int vm_cpuid_init(vm_t *vm);
+
+/* Free the CPUID table of a VM */
+void vm_cpuid_destroy(vm_t *vm);
@@ -8,6 +8,8 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <autoconf.h>
+#include <sel4vm/gen_config.h>
 
 #include <sel4/sel4.h>
 #include <utils/util.h>
@@ -20,6 +22,7 @@
 #include "guest_state.h"
 #include "vmcs.h"
 #include "processor/platfeature.h"
+#include "processor/decode.h"
 
 static inline unsigned int apply_cr_bits(unsigned int cr, unsigned int mask, unsigned int host_bits)
 {
@@ -31,7 +34,6 @@ static inline unsigned int apply_cr_bits(unsigned int cr, unsigned int mask, uns
 
 static int vm_cr_set_cr0(vm_vcpu_t *vcpu, unsigned int value)
 {
-    int err;
     if (value & CR0_RESERVED_BITS) {
         return -1;
     }
@@ -47,14 +49,14 @@ static int vm_cr_set_cr0(vm_vcpu_t *vcpu, unsigned int value)
                                   vcpu->vcpu_arch.guest_state->virt.cr.cr4_shadow);
         /* update mask and cr4 value */
         vcpu->vcpu_arch.guest_state->virt.cr.cr4_mask = new_mask;
-        err = vm_vmcs_write(vcpu->vcpu.cptr, VMX_CONTROL_CR4_MASK, new_mask);
-        if (err) {
-            return -1;
-        }
+        vm_guest_state_vmcs_set(vcpu->vcpu_arch.guest_state, VMCS_CACHE_CR4_MASK, new_mask);
         vm_guest_state_set_cr4(vcpu->vcpu_arch.guest_state, cr4_value);
-        /* now turn of cr3 load/store exiting */
+        /* now turn of cr3 load/store exiting, loads still exit for the software TLB to observe them */
         unsigned int ppc = vm_guest_state_get_control_ppc(vcpu->vcpu_arch.guest_state);
-        ppc &= ~(VMX_CONTROL_PPC_CR3_LOAD_EXITING | VMX_CONTROL_PPC_CR3_STORE_EXITING);
+        ppc &= ~VMX_CONTROL_PPC_CR3_STORE_EXITING;
+        if (!config_set(CONFIG_LIB_SEL4VM_GUEST_TLB)) {
+            ppc &= ~VMX_CONTROL_PPC_CR3_LOAD_EXITING;
+        }
         vm_guest_state_set_control_ppc(vcpu->vcpu_arch.guest_state, ppc);
         /* load the cached cr3 value */
         vm_guest_state_set_cr3(vcpu->vcpu_arch.guest_state, vcpu->vcpu_arch.guest_state->virt.cr.cr3_guest);
@@ -70,12 +72,13 @@ static int vm_cr_set_cr0(vm_vcpu_t *vcpu, unsigned int value)
 
     /* update the guest shadow */
     vcpu->vcpu_arch.guest_state->virt.cr.cr0_shadow = value;
-    err = vm_vmcs_write(vcpu->vcpu.cptr, VMX_CONTROL_CR0_READ_SHADOW, value);
-    if (err) {
-        return -1;
+    vm_guest_state_vmcs_set(vcpu->vcpu_arch.guest_state, VMCS_CACHE_CR0_READ_SHADOW, value);
+    unsigned int host_bits = vcpu->vcpu_arch.guest_state->virt.cr.cr0_host_bits;
+    if (vcpu->vcpu_arch.guest_state->virt.unrestricted_guest) {
+        /* The guest runs with its own PE and PG bits, they are only masked to catch paging being enabled */
+        host_bits = (host_bits & ~(X86_CR0_PE | X86_CR0_PG)) | (value & (X86_CR0_PE | X86_CR0_PG));
     }
-    value = apply_cr_bits(value, vcpu->vcpu_arch.guest_state->virt.cr.cr0_mask,
-                          vcpu->vcpu_arch.guest_state->virt.cr.cr0_host_bits);
+    value = apply_cr_bits(value, vcpu->vcpu_arch.guest_state->virt.cr.cr0_mask, host_bits);
 
     vm_guest_state_set_cr0(vcpu->vcpu_arch.guest_state, value);
 
@@ -86,6 +89,9 @@ static int vm_cr_set_cr3(vm_vcpu_t *vcpu, unsigned int value)
 {
     /* if the guest hasn't turned on paging then just cache this */
     vcpu->vcpu_arch.guest_state->virt.cr.cr3_guest = value;
+    /* A cr3 load may follow changes to the page tables the cached instructions were fetched through */
+    vm_decode_cache_invalidate(vcpu->vcpu_arch.guest_state);
+    vm_guest_tlb_flush(vcpu->vcpu_arch.guest_state);
     if (vcpu->vcpu_arch.guest_state->virt.cr.cr0_shadow & X86_CR0_PG) {
         vm_guest_state_set_cr3(vcpu->vcpu_arch.guest_state, value);
     }
@@ -110,12 +116,12 @@ static int vm_cr_set_cr4(vm_vcpu_t *vcpu, unsigned int value)
         return -1;
     }
 
+    /* Paging mode changes and toggling global pages flush the TLB */
+    vm_guest_tlb_flush(vcpu->vcpu_arch.guest_state);
+
     /* update the guest shadow */
     vcpu->vcpu_arch.guest_state->virt.cr.cr4_shadow = value;
-    int err = vm_vmcs_write(vcpu->vcpu.cptr, VMX_CONTROL_CR4_READ_SHADOW, value);
-    if (err) {
-        return -1;
-    }
+    vm_guest_state_vmcs_set(vcpu->vcpu_arch.guest_state, VMCS_CACHE_CR4_READ_SHADOW, value);
 
     value = apply_cr_bits(value, vcpu->vcpu_arch.guest_state->virt.cr.cr4_mask,
                           vcpu->vcpu_arch.guest_state->virt.cr.cr4_host_bits);
@@ -127,17 +133,16 @@ static int vm_cr_set_cr4(vm_vcpu_t *vcpu, unsigned int value)
 
 static int vm_cr_clts(vm_vcpu_t *vcpu)
 {
-    ZF_LOGI("Ignoring call of clts");
-
-    return -1;
+    /* clts only exits if the VMM owns cr0.TS, emulate it as a write of the shadow with TS cleared */
+    return vm_cr_set_cr0(vcpu, vcpu->vcpu_arch.guest_state->virt.cr.cr0_shadow & ~X86_CR0_TS);
 }
 
 static int vm_cr_lmsw(vm_vcpu_t *vcpu, unsigned int value)
 {
-    ZF_LOGI("Ignoring call of lmsw");
-
-    return -1;
-
+    /* lmsw loads the low four bits of cr0 (PE, MP, EM and TS) but can not clear PE */
+    unsigned int cr0 = vcpu->vcpu_arch.guest_state->virt.cr.cr0_shadow;
+    cr0 = (cr0 & ~(X86_CR0_MP | X86_CR0_EM | X86_CR0_TS)) | (value & 0x0f);
+    return vm_cr_set_cr0(vcpu, cr0);
 }
 
 /* Convert exit regs to seL4 user context */
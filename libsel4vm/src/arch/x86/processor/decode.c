@@ -13,15 +13,20 @@ Author: W.A.
 #include <stdlib.h>
 #include <string.h>
 
+#include <autoconf.h>
+#include <sel4vm/gen_config.h>
+
 #include <sel4vm/guest_vm.h>
 #include <sel4vm/guest_ram.h>
 #include <sel4vm/arch/guest_x86_context.h>
 
 #include "sel4vm/guest_memory.h"
 
+#include "vm.h"
 #include "processor/platfeature.h"
 #include "processor/decode.h"
 #include "guest_state.h"
+#include "vmexit.h"
 
 /* TODO are these defined elsewhere? */
 #define IA32_PDE_SIZE(pde) (pde & BIT(7))
@@ -129,12 +134,48 @@ inline static uint32_t guest_get_phys_word(vm_t *vm, uintptr_t addr)
     return val;
 }
 
-/* Fetch a guest's instruction */
-int vm_fetch_instruction(vm_vcpu_t *vcpu, uint32_t eip, uintptr_t cr3,
-                         int len, uint8_t *buf)
+static guest_tlb_entry_t *guest_tlb_slot(guest_state_t *gs, uintptr_t vaddr)
 {
-    /* Walk page tables to get physical address of instruction */
-    uintptr_t instr_phys = 0;
+    return &gs->virt.tlb[(vaddr >> 12) & (GUEST_TLB_SIZE - 1)];
+}
+
+void vm_guest_tlb_flush(guest_state_t *gs)
+{
+    for (int i = 0; i < GUEST_TLB_SIZE; i++) {
+        gs->virt.tlb[i].valid = false;
+    }
+}
+
+void vm_guest_tlb_flush_page(guest_state_t *gs, uintptr_t vaddr)
+{
+    uint32_t vpage = vaddr >> 12;
+    for (int i = 0; i < GUEST_TLB_SIZE; i++) {
+        guest_tlb_entry_t *entry = &gs->virt.tlb[i];
+        if (entry->vpage == vpage || (entry->large && (entry->vpage >> 10) == (vpage >> 10))) {
+            entry->valid = false;
+        }
+    }
+}
+
+int vm_invlpg_handler(vm_vcpu_t *vcpu)
+{
+    /* The qualification holds the linear address operand */
+    guest_state_t *gs = vcpu->vcpu_arch.guest_state;
+    vm_guest_tlb_flush_page(gs, vm_guest_exit_get_qualification(gs));
+    /* Cached instructions are revalidated against their bytes, but not their translation */
+    vm_decode_cache_invalidate(gs);
+    vm_guest_exit_next_instruction(gs, vcpu->vcpu.cptr);
+    return VM_EXIT_HANDLED;
+}
+
+/* Translate a guest virtual address to a guest physical address by walking the guest's page tables */
+int vm_guest_virt_to_phys(vm_vcpu_t *vcpu, uintptr_t vaddr, uintptr_t cr3, uintptr_t *paddr)
+{
+    /* Guest virtual addresses are physical addresses until paging is enabled */
+    if (!(vm_guest_state_get_cr0(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr) & X86_CR0_PG)) {
+        *paddr = vaddr;
+        return 0;
+    }
 
     /* ensure that PAE is not enabled */
     if (vm_guest_state_get_cr4(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr) & X86_CR4_PAE) {
@@ -142,27 +183,64 @@ int vm_fetch_instruction(vm_vcpu_t *vcpu, uint32_t eip, uintptr_t cr3,
         return -1;
     }
 
-    // TODO implement page-boundary crossing properly
-    assert((eip >> 12) == ((eip + len) >> 12));
+    /* Walks are only cached if the guest's TLB invalidations are trapped, see vm_vmcs_init_guest */
+    guest_tlb_entry_t *entry = NULL;
+    if (config_set(CONFIG_LIB_SEL4VM_GUEST_TLB)) {
+        entry = guest_tlb_slot(vcpu->vcpu_arch.guest_state, vaddr);
+        if (entry->valid && entry->cr3 == cr3 && entry->vpage == vaddr >> 12) {
+            *paddr = ((uintptr_t)entry->ppage << 12) | (vaddr & 0xFFF);
+            return 0;
+        }
+    }
 
-    uint32_t pdi = eip >> 22;
-    uint32_t pti = (eip >> 12) & 0x3FF;
+    uint32_t pdi = vaddr >> 22;
+    uint32_t pti = (vaddr >> 12) & 0x3FF;
 
     uint32_t pde = guest_get_phys_word(vcpu->vm, cr3 + pdi * 4);
-
-    assert(IA32_PDE_PRESENT(pde)); /* WTF? */
+    if (!IA32_PDE_PRESENT(pde)) {
+        ZF_LOGE("Guest virtual address 0x%x is not mapped", vaddr);
+        return -1;
+    }
 
     if (IA32_PDE_SIZE(pde)) {
         /* PSE is used, 4M pages */
-        instr_phys = (uintptr_t)IA32_PSE_ADDR(pde) + (eip & 0x3FFFFF);
+        *paddr = (uintptr_t)IA32_PSE_ADDR(pde) + (vaddr & 0x3FFFFF);
     } else {
         /* 4k pages */
         uint32_t pte = guest_get_phys_word(vcpu->vm,
                                            (uintptr_t)IA32_PTE_ADDR(pde) + pti * 4);
+        if (!IA32_PDE_PRESENT(pte)) {
+            ZF_LOGE("Guest virtual address 0x%x is not mapped", vaddr);
+            return -1;
+        }
 
-        assert(IA32_PDE_PRESENT(pte));
+        *paddr = (uintptr_t)IA32_PTE_ADDR(pte) + (vaddr & 0xFFF);
+    }
+
+    if (entry) {
+        *entry = (guest_tlb_entry_t) {
+            .valid = true,
+            .large = IA32_PDE_SIZE(pde),
+            .cr3 = cr3,
+            .vpage = vaddr >> 12,
+            .ppage = *paddr >> 12,
+        };
+    }
+    return 0;
+}
+
+/* Fetch a guest's instruction */
+int vm_fetch_instruction(vm_vcpu_t *vcpu, uint32_t eip, uintptr_t cr3,
+                         int len, uint8_t *buf)
+{
+    /* Walk page tables to get physical address of instruction */
+    uintptr_t instr_phys = 0;
+
+    // TODO implement page-boundary crossing properly
+    assert((eip >> 12) == ((eip + len) >> 12));
 
-        instr_phys = (uintptr_t)IA32_PTE_ADDR(pte) + (eip & 0xFFF);
+    if (vm_guest_virt_to_phys(vcpu, eip, cr3, &instr_phys)) {
+        return -1;
     }
 
     /* Fetch instruction */
@@ -244,17 +322,72 @@ int vm_decode_instruction(uint8_t *instr, int instr_len, int *reg, uint32_t *imm
     return 0;
 }
 
+/* Find the cache entry an instruction maps to, it still needs to be checked whether it holds the instruction */
+static decode_cache_entry_t *decode_cache_slot(guest_state_t *gs, unsigned int eip)
+{
+    /* Mix in higher bits such that identical offsets in different pages don't always collide */
+    unsigned int index = (eip ^ (eip >> 12)) & (DECODE_CACHE_SIZE - 1);
+    return &gs->virt.decode_cache[index];
+}
+
+void vm_decode_cache_invalidate(guest_state_t *gs)
+{
+    for (int i = 0; i < DECODE_CACHE_SIZE; i++) {
+        gs->virt.decode_cache[i].valid = false;
+    }
+}
+
 void vm_decode_ept_violation(vm_vcpu_t *vcpu, int *reg, uint32_t *imm, int *size)
 {
-    /* Decode instruction */
-    uint8_t ibuf[15];
-    int instr_len = vm_guest_exit_get_int_len(vcpu->vcpu_arch.guest_state);
-    vm_fetch_instruction(vcpu,
-                         vm_guest_state_get_eip(vcpu->vcpu_arch.guest_state),
-                         vm_guest_state_get_cr3(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr),
-                         instr_len, ibuf);
+    guest_state_t *gs = vcpu->vcpu_arch.guest_state;
+    uint8_t ibuf[MAX_INSTR_LEN];
+    int instr_len = vm_guest_exit_get_int_len(gs);
+    unsigned int eip = vm_guest_state_get_eip(gs);
+    unsigned int cr3 = vm_guest_state_get_cr3(gs, vcpu->vcpu.cptr);
+    decode_cache_entry_t *entry = decode_cache_slot(gs, eip);
+
+    assert(instr_len <= MAX_INSTR_LEN);
+    if (entry->valid && entry->eip == eip && entry->cr3 == cr3 && entry->instr_len == instr_len) {
+        /* Re-read the instruction from its known physical location, skipping the page table walk,
+         * to catch the guest having modified its code since it was decoded */
+        if (!vm_ram_touch(vcpu->vm, entry->instr_phys, instr_len, vm_guest_ram_read_callback, ibuf) &&
+            !memcmp(ibuf, entry->instr, instr_len)) {
+            *reg = entry->reg;
+            *imm = entry->imm;
+            *size = entry->size;
+            return;
+        }
+        entry->valid = false;
+    }
+
+    /* Fetch and decode instruction */
+    uintptr_t instr_phys;
+    // TODO implement page-boundary crossing properly
+    assert((eip >> 12) == ((eip + instr_len) >> 12));
+    int err = vm_guest_virt_to_phys(vcpu, eip, cr3, &instr_phys);
+    if (!err) {
+        err = vm_ram_touch(vcpu->vm, instr_phys, instr_len, vm_guest_ram_read_callback, ibuf);
+    }
+    if (err) {
+        ZF_LOGE("Failed to fetch instruction at 0x%x", eip);
+        memset(ibuf, 0, sizeof(ibuf));
+        vm_decode_instruction(ibuf, instr_len, reg, imm, size);
+        return;
+    }
 
     vm_decode_instruction(ibuf, instr_len, reg, imm, size);
+
+    *entry = (decode_cache_entry_t) {
+        .valid = true,
+        .cr3 = cr3,
+        .eip = eip,
+        .instr_phys = instr_phys,
+        .instr_len = instr_len,
+        .reg = *reg,
+        .imm = *imm,
+        .size = *size,
+    };
+    memcpy(entry->instr, ibuf, instr_len);
 }
 
 /*
@@ -11,12 +11,25 @@
 #define MAX_INSTR_OPCODES 255
 #define OP_ESCAPE 0xf
 
+int vm_guest_virt_to_phys(vm_vcpu_t *vcpu, uintptr_t vaddr, uintptr_t cr3, uintptr_t *paddr);
+
 int vm_fetch_instruction(vm_vcpu_t *vcpu, uint32_t eip, uintptr_t cr3, int len, uint8_t *buf);
 
 int vm_decode_instruction(uint8_t *instr, int instr_len, int *reg, uint32_t *imm, int *op_len);
 
+/* Decode the instruction that caused the current EPT violation. Decoded instructions are cached per vcpu
+ * and revalidated against the guest's code on every hit */
 void vm_decode_ept_violation(vm_vcpu_t *vcpu, int *reg, uint32_t *imm, int *size);
 
+/* Drop all cached decoded instructions of a vcpu, e.g. when its address space changes */
+void vm_decode_cache_invalidate(guest_state_t *gs);
+
+/* Drop all translations in the software TLB of a vcpu, on anything that would flush a hardware TLB */
+void vm_guest_tlb_flush(guest_state_t *gs);
+
+/* Drop the translations in the software TLB of a vcpu covering a guest virtual address */
+void vm_guest_tlb_flush_page(guest_state_t *gs, uintptr_t vaddr);
+
 /* Interpret just enough virtual 8086 instructions to run trampoline code.
    Returns the final jump address */
 uintptr_t vm_emulate_realmode(vm_vcpu_t *vcpu, uint8_t *instr_buf,
@@ -19,12 +19,17 @@
 
 // SPDX-License-Identifier: GPL-2.0-only
 
+#include <autoconf.h>
+#include <sel4vm/gen_config.h>
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <utils/util.h>
+#include <platsupport/arch/tsc.h>
 
 #include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_ram.h>
 #include <sel4vm/boot.h>
 #include <sel4vm/guest_vcpu_fault.h>
 
@@ -32,6 +37,7 @@
 #include "processor/apicdef.h"
 #include "processor/msr.h"
 #include "i8259/i8259.h"
+#include "ioapic/ioapic.h"
 #include "interrupt.h"
 
 #define APIC_BUS_CYCLE_NS 1
@@ -45,10 +51,13 @@
 #define LAPIC_MMIO_LENGTH       (BIT(12))
 /* followed define is not in apicdef.h */
 #define APIC_SHORT_MASK         0xc0000
-#define APIC_DEST_NOSHORT       0x0
 #define APIC_DEST_MASK          0x800
 #define MAX_APIC_VECTOR         256
 #define APIC_VECTORS_PER_REG        32
+/* Vector bitmaps (IRR, ISR, TMR) are spread over 8 registers, each 16 byte aligned */
+#define APIC_VECTOR_REG_OFFSET(vec) (((vec) >> 5) << 4)
+#define APIC_VECTOR_REG(bitmap, vec) ((uint32_t *)((bitmap) + APIC_VECTOR_REG_OFFSET(vec)))
+#define APIC_LVT_TIMER_MODE_MASK    (3 << 17)
 
 inline static int pic_get_interrupt(vm_t *vm)
 {
@@ -60,55 +69,15 @@ inline static int pic_has_interrupt(vm_t *vm)
     return i8259_has_interrupt(vm);
 }
 
-struct vm_lapic_irq {
-    uint32_t vector;
-    uint32_t delivery_mode;
-    uint32_t dest_mode;
-    uint32_t level;
-    uint32_t trig_mode;
-    uint32_t shorthand;
-    uint32_t dest_id;
-};
-
 /* Generic bit operations; TODO move these elsewhere */
-static inline int fls(int x)
+static inline int fls(uint32_t x)
 {
-    int r = 32;
-
-    if (!x) {
-        return 0;
-    }
-
-    if (!(x & 0xffff0000u)) {
-        x <<= 16;
-        r -= 16;
-    }
-    if (!(x & 0xff000000u)) {
-        x <<= 8;
-        r -= 8;
-    }
-    if (!(x & 0xf0000000u)) {
-        x <<= 4;
-        r -= 4;
-    }
-    if (!(x & 0xc0000000u)) {
-        x <<= 2;
-        r -= 2;
-    }
-    if (!(x & 0x80000000u)) {
-        x <<= 1;
-        r -= 1;
-    }
-    return r;
+    return x ? 32 - __builtin_clz(x) : 0;
 }
 
-static uint32_t hweight32(unsigned int w)
+static inline uint32_t hweight32(uint32_t w)
 {
-    uint32_t res = w - ((w >> 1) & 0x55555555);
-    res = (res & 0x33333333) + ((res >> 2) & 0x33333333);
-    res = (res + (res >> 4)) & 0x0F0F0F0F;
-    res = res + (res >> 8);
-    return (res + (res >> 16)) & 0x000000FF;
+    return __builtin_popcount(w);
 }
 /* End generic bit ops */
 
@@ -133,7 +102,7 @@ static inline uint32_t vm_apic_get_reg(vm_lapic_t *apic, int reg_off)
 
 static inline int apic_test_vector(int vec, void *bitmap)
 {
-    return ((1UL << (vec & 31)) & ((uint32_t *)bitmap)[vec >> 5]) != 0;
+    return ((1UL << (vec & 31)) & *APIC_VECTOR_REG(bitmap, vec)) != 0;
 }
 
 bool vm_apic_pending_eoi(vm_vcpu_t *vcpu, int vector)
@@ -146,12 +115,27 @@ bool vm_apic_pending_eoi(vm_vcpu_t *vcpu, int vector)
 
 static inline void apic_set_vector(int vec, void *bitmap)
 {
-    ((uint32_t *)bitmap)[vec >> 5] |= 1UL << (vec & 31);
+    *APIC_VECTOR_REG(bitmap, vec) |= 1UL << (vec & 31);
 }
 
 static inline void apic_clear_vector(int vec, void *bitmap)
 {
-    ((uint32_t *)bitmap)[vec >> 5] &= ~(1UL << (vec & 31));
+    *APIC_VECTOR_REG(bitmap, vec) &= ~(1UL << (vec & 31));
+}
+
+/* Set a vector in a bitmap, tracking which of its registers are non-zero in 'summary' */
+static inline void apic_set_vector_summary(int vec, void *bitmap, uint8_t *summary)
+{
+    apic_set_vector(vec, bitmap);
+    *summary |= BIT(vec >> 5);
+}
+
+static inline void apic_clear_vector_summary(int vec, void *bitmap, uint8_t *summary)
+{
+    apic_clear_vector(vec, bitmap);
+    if (!*APIC_VECTOR_REG(bitmap, vec)) {
+        *summary &= ~BIT(vec >> 5);
+    }
 }
 
 static inline int vm_apic_sw_enabled(vm_lapic_t *apic)
@@ -181,6 +165,11 @@ static inline int vm_apic_id(vm_lapic_t *apic)
     return (vm_apic_get_reg(apic, APIC_ID) >> 24) & 0xff;
 }
 
+static inline bool apic_x2apic_mode(vm_lapic_t *apic)
+{
+    return apic->apic_base & MSR_IA32_APICBASE_EXTD;
+}
+
 static inline void apic_set_spiv(vm_lapic_t *apic, uint32_t val)
 {
     apic_set_reg(apic, APIC_SPIV, val);
@@ -232,41 +221,34 @@ int vm_apic_compare_prio(vm_vcpu_t *vcpu1, vm_vcpu_t *vcpu2)
 static void UNUSED dump_vector(const char *name, void *bitmap)
 {
     int vec;
-    uint32_t *reg = bitmap;
 
     printf("%s = 0x", name);
 
     for (vec = MAX_APIC_VECTOR - APIC_VECTORS_PER_REG;
          vec >= 0; vec -= APIC_VECTORS_PER_REG) {
-        printf("%08x", reg[vec >> 5]);
+        printf("%08x", *APIC_VECTOR_REG(bitmap, vec));
     }
 
     printf("\n");
 }
 
-static int find_highest_vector(void *bitmap)
+/* Find the highest vector set in a bitmap, using its summary to go straight to the highest non-zero register */
+static int find_highest_vector(void *bitmap, uint8_t summary)
 {
-    int vec;
-    uint32_t *reg = bitmap;
-
-    for (vec = MAX_APIC_VECTOR - APIC_VECTORS_PER_REG;
-         vec >= 0; vec -= APIC_VECTORS_PER_REG) {
-        if (reg[vec >> 5]) {
-            return fls(reg[vec >> 5]) - 1 + vec;
-        }
+    if (!summary) {
+        return -1;
     }
-
-    return -1;
+    int vec = (fls(summary) - 1) * APIC_VECTORS_PER_REG;
+    return fls(*APIC_VECTOR_REG(bitmap, vec)) - 1 + vec;
 }
 
 static uint8_t UNUSED count_vectors(void *bitmap)
 {
     int vec;
-    uint32_t *reg = bitmap;
     uint8_t count = 0;
 
     for (vec = 0; vec < MAX_APIC_VECTOR; vec += APIC_VECTORS_PER_REG) {
-        count += hweight32(reg[vec >> 5]);
+        count += hweight32(*APIC_VECTOR_REG(bitmap, vec));
     }
 
     return count;
@@ -274,21 +256,19 @@ static uint8_t UNUSED count_vectors(void *bitmap)
 
 static inline int apic_search_irr(vm_lapic_t *apic)
 {
-    return find_highest_vector(apic->regs + APIC_IRR);
+    return find_highest_vector(apic->regs + APIC_IRR, apic->irr_summary);
 }
 
 static inline int apic_find_highest_irr(vm_lapic_t *apic)
 {
-    int result;
-
     if (!apic->irr_pending) {
         return -1;
     }
 
-    result = apic_search_irr(apic);
-    assert(result == -1 || result >= 16);
+    assert(apic->highest_irr_cache == apic_search_irr(apic));
+    assert(apic->highest_irr_cache >= 16);
 
-    return result;
+    return apic->highest_irr_cache;
 }
 
 static inline void apic_set_irr(int vec, vm_lapic_t *apic)
@@ -298,15 +278,18 @@ static inline void apic_set_irr(int vec, vm_lapic_t *apic)
     }
 
     apic->irr_pending = true;
-    apic_set_vector(vec, apic->regs + APIC_IRR);
+    apic_set_vector_summary(vec, apic->regs + APIC_IRR, &apic->irr_summary);
+    apic->highest_irr_cache = MAX(apic->highest_irr_cache, vec);
 }
 
 static inline void apic_clear_irr(int vec, vm_lapic_t *apic)
 {
-    apic_clear_vector(vec, apic->regs + APIC_IRR);
+    apic_clear_vector_summary(vec, apic->regs + APIC_IRR, &apic->irr_summary);
 
-    vec = apic_search_irr(apic);
-    apic->irr_pending = (vec != -1);
+    apic->irr_pending = (apic->irr_summary != 0);
+    if (vec == apic->highest_irr_cache) {
+        apic->highest_irr_cache = apic_search_irr(apic);
+    }
 }
 
 static inline void apic_set_isr(int vec, vm_lapic_t *apic)
@@ -314,7 +297,7 @@ static inline void apic_set_isr(int vec, vm_lapic_t *apic)
     if (apic_test_vector(vec, apic->regs + APIC_ISR)) {
         return;
     }
-    apic_set_vector(vec, apic->regs + APIC_ISR);
+    apic_set_vector_summary(vec, apic->regs + APIC_ISR, &apic->isr_summary);
 
     ++apic->isr_count;
     /*
@@ -322,27 +305,15 @@ static inline void apic_set_isr(int vec, vm_lapic_t *apic)
      * The highest vector is injected. Thus the latest bit set matches
      * the highest bit in ISR.
      */
+    apic->highest_isr_cache = MAX(apic->highest_isr_cache, vec);
 }
 
 static inline int apic_find_highest_isr(vm_lapic_t *apic)
 {
-    int result;
-
-    /*
-     * Note that isr_count is always 1, and highest_isr_cache
-     * is always -1, with APIC virtualization enabled.
-     */
-    if (!apic->isr_count) {
-        return -1;
-    }
-    if (apic->highest_isr_cache != -1) {
-        return apic->highest_isr_cache;
-    }
-
-    result = find_highest_vector(apic->regs + APIC_ISR);
-    assert(result == -1 || result >= 16);
+    assert(apic->highest_isr_cache == find_highest_vector(apic->regs + APIC_ISR, apic->isr_summary));
+    assert(apic->highest_isr_cache == -1 || apic->highest_isr_cache >= 16);
 
-    return result;
+    return apic->highest_isr_cache;
 }
 
 static inline void apic_clear_isr(int vec, vm_lapic_t *apic)
@@ -350,10 +321,12 @@ static inline void apic_clear_isr(int vec, vm_lapic_t *apic)
     if (!apic_test_vector(vec, apic->regs + APIC_ISR)) {
         return;
     }
-    apic_clear_vector(vec, apic->regs + APIC_ISR);
+    apic_clear_vector_summary(vec, apic->regs + APIC_ISR, &apic->isr_summary);
 
     --apic->isr_count;
-    apic->highest_isr_cache = -1;
+    if (vec == apic->highest_isr_cache) {
+        apic->highest_isr_cache = find_highest_vector(apic->regs + APIC_ISR, apic->isr_summary);
+    }
 }
 
 int vm_lapic_find_highest_irr(vm_vcpu_t *vcpu)
@@ -427,11 +400,18 @@ int vm_apic_match_physical_addr(vm_lapic_t *apic, uint16_t dest)
     return dest == 0xff || vm_apic_id(apic) == dest;
 }
 
-int vm_apic_match_logical_addr(vm_lapic_t *apic, uint8_t mda)
+int vm_apic_match_logical_addr(vm_lapic_t *apic, uint32_t mda)
 {
     int result = 0;
     uint32_t logical_id;
 
+    if (apic_x2apic_mode(apic)) {
+        /* x2APIC logical destinations are a 16-bit cluster id and a 16-bit mask of cpus in the cluster */
+        logical_id = vm_apic_get_reg(apic, APIC_LDR);
+        return mda == 0xffffffff ||
+               ((logical_id >> 16) == (mda >> 16) && (logical_id & mda & 0xffff));
+    }
+
     logical_id = GET_APIC_LOGICAL_ID(vm_apic_get_reg(apic, APIC_LDR));
 
     switch (vm_apic_get_reg(apic, APIC_DFR)) {
@@ -512,19 +492,32 @@ int vm_irq_delivery_to_apic(vm_vcpu_t *src_vcpu, struct vm_lapic_irq *irq, unsig
         return vm_apic_set_irq(src_vcpu, irq, dest_map);
     }
 
-    vm_vcpu_t *dest_vcpu = vm->vcpus[BOOT_VCPU];
+    for (i = 0; i < vm->num_vcpus; i++) {
+        vm_vcpu_t *dest_vcpu = vm->vcpus[i];
 
-    if (!vm_apic_hw_enabled(dest_vcpu->vcpu_arch.lapic)) {
-        return r;
-    }
+        if (!vm_apic_hw_enabled(dest_vcpu->vcpu_arch.lapic)) {
+            continue;
+        }
 
-    if (!vm_apic_match_dest(dest_vcpu, src, irq->shorthand,
-                            irq->dest_id, irq->dest_mode)) {
-        return r;
+        if (!vm_apic_match_dest(dest_vcpu, src, irq->shorthand,
+                                irq->dest_id, irq->dest_mode)) {
+            continue;
+        }
+
+        if (!vm_is_dm_lowest_prio(irq)) {
+            if (r < 0) {
+                r = 0;
+            }
+            r += vm_apic_set_irq(dest_vcpu, irq, dest_map);
+        } else if (vm_apic_enabled(dest_vcpu->vcpu_arch.lapic)) {
+            if (!lowest || vm_apic_compare_prio(dest_vcpu, lowest) < 0) {
+                lowest = dest_vcpu;
+            }
+        }
     }
 
-    if (!vm_is_dm_lowest_prio(irq) || (vm_apic_enabled(dest_vcpu->vcpu_arch.lapic))) {
-        r = vm_apic_set_irq(dest_vcpu, irq, dest_map);
+    if (lowest) {
+        r = vm_apic_set_irq(lowest, irq, dest_map);
     }
 
     return r;
@@ -552,6 +545,12 @@ static int __apic_accept_irq(vm_vcpu_t *vcpu, int delivery_mode,
         apic_debug(4, "####fixed ipi 0x%x to vcpu %d\n", vector, vcpu->vcpu_id);
 
         result = 1;
+        /* Level triggered interrupts are EOId to the IOAPIC they were delivered from */
+        if (trig_mode) {
+            apic_set_vector(vector, apic->regs + APIC_TMR);
+        } else {
+            apic_clear_vector(vector, apic->regs + APIC_TMR);
+        }
         apic_set_irr(vector, apic);
         vm_vcpu_accept_interrupt(vcpu);
         break;
@@ -617,6 +616,8 @@ static int apic_set_eoi(vm_vcpu_t *vcpu)
     vm_lapic_t *apic = vcpu->vcpu_arch.lapic;
     int vector = apic_find_highest_isr(apic);
 
+    i8259_irq_state_touch(vcpu->vm);
+
     /*
      * Not every write EOI will has corresponding ISR,
      * one example is when Kernel check timer on setup_IO_APIC
@@ -627,6 +628,11 @@ static int apic_set_eoi(vm_vcpu_t *vcpu)
 
     apic_clear_isr(vector, apic);
     apic_update_ppr(vcpu);
+#ifdef CONFIG_LIB_SEL4VM_IOAPIC
+    if (apic_test_vector(vector, apic->regs + APIC_TMR)) {
+        vm_ioapic_eoi(vcpu->vm, vector);
+    }
+#endif
 
     /* If another interrupt is pending, raise it */
     vm_vcpu_accept_interrupt(vcpu);
@@ -647,7 +653,12 @@ static void apic_send_ipi(vm_vcpu_t *vcpu)
     irq.level = icr_low & APIC_INT_ASSERT;
     irq.trig_mode = icr_low & APIC_INT_LEVELTRIG;
     irq.shorthand = icr_low & APIC_SHORT_MASK;
-    irq.dest_id = GET_APIC_DEST_FIELD(icr_high);
+    if (apic_x2apic_mode(apic)) {
+        /* The destination is all 32 bits of the high word, all ones is the broadcast destination */
+        irq.dest_id = (icr_high == 0xffffffff && !irq.dest_mode) ? 0xff : icr_high;
+    } else {
+        irq.dest_id = GET_APIC_DEST_FIELD(icr_high);
+    }
 
     apic_debug(3, "icr_high 0x%x, icr_low 0x%x, "
                "short_hand 0x%x, dest 0x%x, trig_mode 0x%x, level 0x%x, "
@@ -659,6 +670,129 @@ static void apic_send_ipi(vm_vcpu_t *vcpu)
     vm_irq_delivery_to_apic(vcpu, &irq, NULL);
 }
 
+static inline uint32_t apic_lvtt_mode(vm_lapic_t *apic)
+{
+    return vm_apic_get_reg(apic, APIC_LVTT) & apic->lapic_timer.timer_mode_mask;
+}
+
+static void apic_update_divide_count(vm_lapic_t *apic)
+{
+    uint32_t tdcr = vm_apic_get_reg(apic, APIC_TDCR);
+    uint32_t tmp = ((tdcr & 0x3) | ((tdcr & 0x8) >> 1)) + 1;
+    apic->divide_count = 0x1 << (tmp & 0x7);
+}
+
+static void apic_timer_cancel(vm_lapic_t *apic)
+{
+    apic->lapic_timer.period = 0;
+    apic->lapic_timer.expires = 0;
+}
+
+/* (Re)start the timer in one-shot or periodic mode from the initial count */
+static void apic_timer_start(vm_lapic_t *apic)
+{
+    struct vm_timer *timer = &apic->lapic_timer;
+    uint64_t length = (uint64_t)vm_apic_get_reg(apic, APIC_TMICT) * apic->divide_count;
+
+    if (length == 0) {
+        apic_timer_cancel(apic);
+        return;
+    }
+    timer->period = apic_lvtt_mode(apic) == APIC_LVT_TIMER_PERIODIC ? length : 0;
+    timer->expires = rdtsc_pure() + length;
+}
+
+static uint32_t apic_get_tmcct(vm_lapic_t *apic)
+{
+    struct vm_timer *timer = &apic->lapic_timer;
+    uint64_t now;
+
+    if (!timer->expires || apic_lvtt_mode(apic) == APIC_LVT_TIMER_TSCDEADLINE) {
+        return 0;
+    }
+    now = rdtsc_pure();
+    if (now >= timer->expires) {
+        return 0;
+    }
+    return (timer->expires - now) / apic->divide_count;
+}
+
+static void apic_set_lvtt(vm_lapic_t *apic, uint32_t val)
+{
+    struct vm_timer *timer = &apic->lapic_timer;
+
+    if (!vm_apic_sw_enabled(apic)) {
+        val |= APIC_LVT_MASKED;
+    }
+    val &= apic_lvt_mask[0] | timer->timer_mode_mask;
+    if ((vm_apic_get_reg(apic, APIC_LVTT) ^ val) & timer->timer_mode_mask) {
+        /* Switching the timer mode disarms the timer */
+        apic_set_reg(apic, APIC_TMICT, 0);
+        timer->tscdeadline = 0;
+        apic_timer_cancel(apic);
+    }
+    apic_set_reg(apic, APIC_LVTT, val);
+}
+
+uint64_t vm_get_lapic_tscdeadline_msr(vm_vcpu_t *vcpu)
+{
+    vm_lapic_t *apic = vcpu->vcpu_arch.lapic;
+
+    if (apic_lvtt_mode(apic) != APIC_LVT_TIMER_TSCDEADLINE) {
+        return 0;
+    }
+    return apic->lapic_timer.tscdeadline;
+}
+
+void vm_set_lapic_tscdeadline_msr(vm_vcpu_t *vcpu, uint64_t data)
+{
+    vm_lapic_t *apic = vcpu->vcpu_arch.lapic;
+
+    /* Writes are ignored outside of TSC-deadline mode */
+    if (apic_lvtt_mode(apic) != APIC_LVT_TIMER_TSCDEADLINE) {
+        return;
+    }
+    /* A deadline of 0 disarms the timer, a deadline in the past fires on the next check */
+    apic->lapic_timer.tscdeadline = data;
+    apic->lapic_timer.period = 0;
+    apic->lapic_timer.expires = data;
+}
+
+uint64_t vm_lapic_timer_get_expiry(vm_vcpu_t *vcpu)
+{
+    return vcpu->vcpu_arch.lapic->lapic_timer.expires;
+}
+
+void vm_lapic_timer_check(vm_vcpu_t *vcpu)
+{
+    vm_lapic_t *apic = vcpu->vcpu_arch.lapic;
+    struct vm_timer *timer = &apic->lapic_timer;
+    uint64_t now;
+
+    if (!timer->expires) {
+        return;
+    }
+    now = rdtsc_pure();
+    if (now < timer->expires) {
+        return;
+    }
+    if (timer->period) {
+        timer->expires += timer->period;
+        if (timer->expires <= now) {
+            /* Periods missed whilst the vcpu wasn't running are coalesced into a single interrupt */
+            timer->expires = now + timer->period;
+        }
+    } else {
+        timer->expires = 0;
+        timer->tscdeadline = 0;
+    }
+
+    uint32_t lvtt = vm_apic_get_reg(apic, APIC_LVTT);
+    if (!(lvtt & APIC_LVT_MASKED)) {
+        __apic_accept_irq(vcpu, APIC_DM_FIXED, lvtt & APIC_VECTOR_MASK, 1, 0, NULL);
+    }
+}
+
 static uint32_t __apic_read(vm_lapic_t *apic, unsigned int offset)
 {
     uint32_t val = 0;
@@ -676,6 +810,7 @@ static uint32_t __apic_read(vm_lapic_t *apic, unsigned int offset)
         break;
 
     case APIC_TMCCT:    /* Timer CCR */
+        val = apic_get_tmcct(apic);
         break;
     case APIC_PROCPRI:
         val = vm_apic_get_reg(apic, offset);
@@ -704,6 +839,8 @@ static int apic_reg_write(vm_vcpu_t *vcpu, uint32_t reg, uint32_t val)
     vm_lapic_t *apic = vcpu->vcpu_arch.lapic;
     int ret = 0;
 
+    i8259_irq_state_touch(vcpu->vm);
+
     switch (reg) {
     case APIC_ID:       /* Local APIC ID */
         vm_apic_set_id(apic, val >> 24);
@@ -774,15 +911,21 @@ static int apic_reg_write(vm_vcpu_t *vcpu, uint32_t reg, uint32_t val)
         break;
 
     case APIC_LVTT:
-        apic_set_reg(apic, APIC_LVTT, val);
+        apic_set_lvtt(apic, val);
         break;
 
     case APIC_TMICT:
+        /* The initial count is ignored in TSC-deadline mode */
+        if (apic_lvtt_mode(apic) == APIC_LVT_TIMER_TSCDEADLINE) {
+            break;
+        }
         apic_set_reg(apic, APIC_TMICT, val);
+        apic_timer_start(apic);
         break;
 
     case APIC_TDCR:
-        apic_set_reg(apic, APIC_TDCR, val);
+        apic_set_reg(apic, APIC_TDCR, val & 0xb);
+        apic_update_divide_count(apic);
         break;
 
     default:
@@ -906,6 +1049,12 @@ void vm_lapic_set_base_msr(vm_vcpu_t *vcpu, uint32_t value)
                "This will probably not work!\n", vcpu->vcpu_id);
     }
 
+    if ((value & MSR_IA32_APICBASE_EXTD) && !apic_x2apic_mode(vcpu->vcpu_arch.lapic)) {
+        /* The logical id is derived from the apic id in x2APIC mode */
+        uint32_t id = vm_apic_id(vcpu->vcpu_arch.lapic);
+        vm_apic_set_ldr(vcpu->vcpu_arch.lapic, ((id >> 4) << 16) | BIT(id & 0xf));
+    }
+
     vcpu->vcpu_arch.lapic->apic_base = value;
 }
 
@@ -924,11 +1073,165 @@ uint32_t vm_lapic_get_base_msr(vm_vcpu_t *vcpu)
     return value;
 }
 
+int vm_lapic_x2apic_msr_read(vm_vcpu_t *vcpu, unsigned int msr, uint64_t *data)
+{
+    vm_lapic_t *apic = vcpu->vcpu_arch.lapic;
+    uint32_t offset = (msr - MSR_IA32_X2APIC_START) << 4;
+    uint32_t low = 0;
+    uint32_t high = 0;
+
+    if (!apic_x2apic_mode(apic)) {
+        return -1;
+    }
+
+    switch (offset) {
+    case APIC_ID:
+        low = vm_apic_id(apic);
+        break;
+    case APIC_ICR:
+        low = vm_apic_get_reg(apic, APIC_ICR);
+        high = vm_apic_get_reg(apic, APIC_ICR2);
+        break;
+    case APIC_ARBPRI:
+    case APIC_DFR:
+    case APIC_ICR2:
+    case APIC_EOI:
+    case APIC_SELF_IPI:
+        /* Not present or write only in x2APIC mode */
+        return -1;
+    default:
+        if (apic_reg_read(apic, offset, 4, &low)) {
+            return -1;
+        }
+        break;
+    }
+
+    *data = ((uint64_t)high << 32) | low;
+    return 0;
+}
+
+int vm_lapic_x2apic_msr_write(vm_vcpu_t *vcpu, unsigned int msr, uint64_t data)
+{
+    vm_lapic_t *apic = vcpu->vcpu_arch.lapic;
+    uint32_t offset = (msr - MSR_IA32_X2APIC_START) << 4;
+
+    if (!apic_x2apic_mode(apic)) {
+        return -1;
+    }
+
+    switch (offset) {
+    case APIC_EOI:
+        if (data) {
+            return -1;
+        }
+        apic_set_eoi(vcpu);
+        return 0;
+    case APIC_SELF_IPI:
+        __apic_accept_irq(vcpu, APIC_DM_FIXED, data & APIC_VECTOR_MASK, 1, 0, NULL);
+        return 0;
+    case APIC_ICR:
+        apic_set_reg(apic, APIC_ICR2, data >> 32);
+        break;
+    case APIC_ID:
+    case APIC_LDR:
+    case APIC_DFR:
+    case APIC_ICR2:
+        /* Not present or read only in x2APIC mode */
+        return -1;
+    default:
+        break;
+    }
+
+    return apic_reg_write(vcpu, offset, (uint32_t)data) ? -1 : 0;
+}
+
+uint64_t vm_lapic_get_pv_eoi_msr(vm_vcpu_t *vcpu)
+{
+    return vcpu->vcpu_arch.lapic->pv_eoi_msr;
+}
+
+int vm_lapic_set_pv_eoi_msr(vm_vcpu_t *vcpu, uint64_t data)
+{
+    vm_lapic_t *apic = vcpu->vcpu_arch.lapic;
+    uint64_t addr = data & ~(uint64_t)KVM_MSR_ENABLED;
+    uint8_t flag;
+
+    if (!(data & KVM_MSR_ENABLED)) {
+        /* Disabled, any EOI still flagged in the guest will be written to the APIC from now on */
+        apic->pv_eoi_msr = data;
+        apic->pv_eoi_pending = false;
+        return 0;
+    }
+    /* The flag must be 4 byte aligned and within guest RAM */
+    if (!IS_ALIGNED(addr, 2) || (uintptr_t)addr != addr ||
+        vm_ram_touch(vcpu->vm, addr, sizeof(flag), vm_guest_ram_read_callback, &flag)) {
+        ZF_LOGE("Invalid PV EOI address 0x%llx", (unsigned long long)addr);
+        return -1;
+    }
+    apic->pv_eoi_msr = data;
+    apic->pv_eoi_pending = false;
+    return 0;
+}
+
+static int pv_eoi_set_flag(vm_vcpu_t *vcpu, uint8_t flag)
+{
+    vm_lapic_t *apic = vcpu->vcpu_arch.lapic;
+    uintptr_t addr = apic->pv_eoi_msr & ~(uint64_t)KVM_MSR_ENABLED;
+    return vm_ram_touch(vcpu->vm, addr, sizeof(flag), vm_guest_ram_write_callback, &flag);
+}
+
+void vm_lapic_pv_eoi_sync_to_guest(vm_vcpu_t *vcpu)
+{
+    vm_lapic_t *apic = vcpu->vcpu_arch.lapic;
+    if (!(apic->pv_eoi_msr & KVM_MSR_ENABLED)) {
+        return;
+    }
+    /* The guest can only skip the EOI write if it has no side effects other than
+     * retiring the highest in-service vector. Level triggered vectors and pending
+     * vectors that need to be raised once the ISR is lower go through the APIC */
+    int vector = apic_find_highest_isr(apic);
+    bool pending = vector != -1 && apic_find_highest_irr(apic) == -1 &&
+                   !apic_test_vector(vector, apic->regs + APIC_TMR);
+    if (pending == apic->pv_eoi_pending) {
+        return;
+    }
+    if (pv_eoi_set_flag(vcpu, pending ? KVM_PV_EOI_ENABLED : 0)) {
+        ZF_LOGE("Failed to update PV EOI flag, disabling PV EOI");
+        apic->pv_eoi_msr = 0;
+        pending = false;
+    }
+    apic->pv_eoi_pending = pending;
+}
+
+void vm_lapic_pv_eoi_sync_from_guest(vm_vcpu_t *vcpu)
+{
+    vm_lapic_t *apic = vcpu->vcpu_arch.lapic;
+    uintptr_t addr = apic->pv_eoi_msr & ~(uint64_t)KVM_MSR_ENABLED;
+    uint8_t flag;
+
+    if (!apic->pv_eoi_pending) {
+        return;
+    }
+    if (vm_ram_touch(vcpu->vm, addr, sizeof(flag), vm_guest_ram_read_callback, &flag)) {
+        ZF_LOGE("Failed to read PV EOI flag");
+        return;
+    }
+    if (flag & KVM_PV_EOI_ENABLED) {
+        /* Guest hasn't acknowledged the interrupt yet */
+        return;
+    }
+    /* The guest cleared the flag instead of writing the EOI register */
+    apic->pv_eoi_pending = false;
+    apic_set_eoi(vcpu);
+}
+
 void vm_lapic_reset(vm_vcpu_t *vcpu)
 {
     vm_lapic_t *apic;
     int i;
 
+    i8259_irq_state_touch(vcpu->vm);
+
     apic_debug(4, "%s\n", __func__);
 
     assert(vcpu);
@@ -936,6 +1239,8 @@ void vm_lapic_reset(vm_vcpu_t *vcpu)
     assert(apic != NULL);
 
     /* Stop the timer in case it's a reset to an active apic */
+    apic->lapic_timer.tscdeadline = 0;
+    apic_timer_cancel(apic);
 
     vm_apic_set_id(apic, vcpu->vcpu_id); /* In agreement with ACPI code */
     apic_set_reg(apic, APIC_LVR, APIC_VERSION);
@@ -959,9 +1264,17 @@ void vm_lapic_reset(vm_vcpu_t *vcpu)
         apic_set_reg(apic, APIC_TMR + 0x10 * i, 0);
     }
     apic->irr_pending = 0;
+    apic->irr_summary = 0;
+    apic->isr_summary = 0;
     apic->isr_count = 0;
     apic->highest_isr_cache = -1;
+    apic->highest_irr_cache = -1;
+    apic->pv_eoi_msr = 0;
+    apic->pv_eoi_pending = false;
     apic_update_ppr(vcpu);
+    apic_update_divide_count(apic);
+    apic->lapic_timer.timer_mode_mask = APIC_LVT_TIMER_PERIODIC |
+                                        (config_set(CONFIG_LIB_SEL4VM_LAPIC_TIMER) ? APIC_LVT_TIMER_TSCDEADLINE : 0);
 
     vcpu->vcpu_arch.lapic->arb_prio = 0;
 
@@ -1030,6 +1343,17 @@ int vm_apic_accept_pic_intr(vm_vcpu_t *vcpu)
             vm_apic_sw_enabled(vcpu->vcpu_arch.lapic));
 }
 
+vm_vcpu_t *vm_lapic_find_vcpu(vm_t *vm, uint32_t apic_id)
+{
+    for (unsigned int i = 0; i < vm->num_vcpus; i++) {
+        vm_vcpu_t *vcpu = vm->vcpus[i];
+        if (vcpu->vcpu_arch.lapic && vm_apic_id(vcpu->vcpu_arch.lapic) == apic_id) {
+            return vcpu;
+        }
+    }
+    return NULL;
+}
+
 /* Service an interrupt */
 int vm_apic_get_interrupt(vm_vcpu_t *vcpu)
 {
@@ -14,27 +14,44 @@ enum vm_lapic_state {
     LAPIC_STATE_RUN
 };
 
-#if 0
+/* Times of the timer are in TSC cycles, one count of the initial count register is one
+ * TSC cycle multiplied by the divide configuration */
 struct vm_timer {
-    struct hrtimer timer;
-    int64_t period;                 /* unit: ns */
+    uint64_t period;                /* unit: TSC cycles, 0 unless in periodic mode */
     uint32_t timer_mode_mask;
     uint64_t tscdeadline;
-    atomic_t pending;           /* accumulated triggered timers */
+    uint64_t expires;               /* TSC value of the next expiry, 0 if not armed */
+};
+
+/* An interrupt message delivered to local apics, e.g. an IPI, IOAPIC redirection or MSI */
+struct vm_lapic_irq {
+    uint32_t vector;
+    uint32_t delivery_mode;
+    uint32_t dest_mode;
+    uint32_t level;
+    uint32_t trig_mode;
+    uint32_t shorthand;
+    uint32_t dest_id;
 };
-#endif
 
 typedef struct vm_lapic {
     uint32_t apic_base; // BSP flag is ignored in this
 
-    //struct vm_timer lapic_timer;
+    struct vm_timer lapic_timer;
     uint32_t divide_count;
 
     bool irr_pending;
+    /* Bit n is set if IRR/ISR register n (vectors 32n to 32n + 31) has any vector set */
+    uint8_t irr_summary;
+    uint8_t isr_summary;
     /* Number of bits set in ISR. */
     int16_t isr_count;
-    /* The highest vector set in ISR; if -1 - invalid, must scan ISR. */
+    /* The highest vectors set in IRR and ISR, -1 if none are set. Kept up to date on every set and clear */
+    int highest_irr_cache;
     int highest_isr_cache;
+    /* Value of MSR_KVM_PV_EOI_EN and whether the EOI flag is currently set in the guest */
+    uint64_t pv_eoi_msr;
+    bool pv_eoi_pending;
     /**
      * APIC register page.  The layout matches the register layout seen by
      * the guest 1:1, because it is accessed by the vmx microcode. XXX ???
@@ -53,6 +70,7 @@ int vm_create_lapic(vm_vcpu_t *vcpu, int enabled);
 void vm_free_lapic(vm_vcpu_t *vcpu);
 
 int vm_apic_has_interrupt(vm_vcpu_t *vcpu);
+int vm_lapic_find_highest_irr(vm_vcpu_t *vcpu);
 int vm_apic_get_interrupt(vm_vcpu_t *vcpu);
 
 void vm_apic_consume_extints(vm_vcpu_t *vcpu, int (*get)(void));
@@ -61,8 +79,24 @@ void vm_apic_consume_extints(vm_vcpu_t *vcpu, int (*get)(void));
 void vm_lapic_set_base_msr(vm_vcpu_t *vcpu, uint32_t value);
 uint32_t vm_lapic_get_base_msr(vm_vcpu_t *vcpu);
 
+/* x2APIC register MSR accesses, these return -1 if the access should raise a #GP */
+int vm_lapic_x2apic_msr_read(vm_vcpu_t *vcpu, unsigned int msr, uint64_t *data);
+int vm_lapic_x2apic_msr_write(vm_vcpu_t *vcpu, unsigned int msr, uint64_t data);
+
+/* KVM paravirtual EOI. The flag in guest memory is set before entering the guest if the next EOI can be
+ * performed lazily, and the EOI is performed on the next exit if the guest has cleared it */
+uint64_t vm_lapic_get_pv_eoi_msr(vm_vcpu_t *vcpu);
+int vm_lapic_set_pv_eoi_msr(vm_vcpu_t *vcpu, uint64_t data);
+void vm_lapic_pv_eoi_sync_to_guest(vm_vcpu_t *vcpu);
+void vm_lapic_pv_eoi_sync_from_guest(vm_vcpu_t *vcpu);
+
+/* Deliver an interrupt message to the local apics it is destined for. Returns -1 if none accepted it */
+int vm_irq_delivery_to_apic(vm_vcpu_t *src_vcpu, struct vm_lapic_irq *irq, unsigned long *dest_map);
+
 int vm_apic_local_deliver(vm_vcpu_t *vcpu, int lvt_type);
 int vm_apic_accept_pic_intr(vm_vcpu_t *vcpu);
+/* Find the vcpu whose local apic has the given APIC ID, NULL if there is none */
+vm_vcpu_t *vm_lapic_find_vcpu(vm_t *vm, uint32_t apic_id);
 
 memory_fault_result_t apic_fault_callback(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t fault_addr,
                                           size_t fault_length, void *cookie);
@@ -70,3 +104,8 @@ memory_fault_result_t apic_fault_callback(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t f
 uint64_t vm_get_lapic_tscdeadline_msr(vm_vcpu_t *vcpu);
 void vm_set_lapic_tscdeadline_msr(vm_vcpu_t *vcpu, uint64_t data);
 
+/* LAPIC timer. The expiry is the TSC value at which the timer next fires, 0 if it is not armed.
+ * Checking the timer delivers its interrupt if the expiry has passed */
+uint64_t vm_lapic_timer_get_expiry(vm_vcpu_t *vcpu);
+void vm_lapic_timer_check(vm_vcpu_t *vcpu);
+
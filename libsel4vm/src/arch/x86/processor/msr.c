@@ -6,132 +6,325 @@
 
 /*handling msr read & write exceptions*/
 
+#include <autoconf.h>
+#include <sel4vm/gen_config.h>
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <sel4/sel4.h>
 
 #include <sel4vm/guest_vm.h>
 #include <sel4vm/arch/guest_x86_context.h>
+#include <sel4vm/arch/vmcs_fields.h>
+#include <sel4vm/arch/msr.h>
 
 #include "vm.h"
 #include "guest_state.h"
 #include "processor/msr.h"
 #include "processor/lapic.h"
 #include "interrupt.h"
+#include "pvclock.h"
 
-int vm_rdmsr_handler(vm_vcpu_t *vcpu)
+#define MSR_TABLE_MIN_SIZE 32
+
+/* Values of the MSRs emulated as constants */
+static uint64_t msr_zero = 0;
+static uint64_t msr_ucode_rev = 0x100000000ULL;
+static uint64_t msr_fsb_frequency = 3;
+static uint64_t msr_ebc_frequency_id = 1 << 24;
+
+static int msr_read_constant(vm_vcpu_t *vcpu, unsigned int msr, uint64_t *value, void *cookie)
 {
+    *value = *(uint64_t *)cookie;
+    return 0;
+}
 
-    int ret = 0;
-    unsigned int msr_no;
-    if (vm_get_thread_context_reg(vcpu, VCPU_CONTEXT_ECX, &msr_no)) {
-        return VM_EXIT_HANDLE_ERROR;
+static int msr_write_ignore(vm_vcpu_t *vcpu, unsigned int msr, uint64_t value, void *cookie)
+{
+    return 0;
+}
+
+static int msr_apicbase_read(vm_vcpu_t *vcpu, unsigned int msr, uint64_t *value, void *cookie)
+{
+    *value = vm_lapic_get_base_msr(vcpu);
+    return 0;
+}
+
+static int msr_apicbase_write(vm_vcpu_t *vcpu, unsigned int msr, uint64_t value, void *cookie)
+{
+    if (!config_set(CONFIG_LIB_SEL4VM_X2APIC) && (value & MSR_IA32_APICBASE_EXTD)) {
+        /* x2APIC mode is not advertised */
+        return -1;
     }
-    uint64_t data = 0;
+    vm_lapic_set_base_msr(vcpu, (uint32_t)value);
+    return 0;
+}
 
-    ZF_LOGD("rdmsr ecx 0x%x\n", msr_no);
+#ifdef CONFIG_LIB_SEL4VM_LAPIC_TIMER
+static int msr_tscdeadline_read(vm_vcpu_t *vcpu, unsigned int msr, uint64_t *value, void *cookie)
+{
+    *value = vm_get_lapic_tscdeadline_msr(vcpu);
+    return 0;
+}
 
-    // src reference: Linux kernel 3.11 kvm arch/x86/kvm/x86.c
-    switch (msr_no) {
-    case MSR_IA32_PLATFORM_ID:
-    case MSR_IA32_EBL_CR_POWERON:
-    case MSR_IA32_DEBUGCTLMSR:
-    case MSR_IA32_LASTBRANCHFROMIP:
-    case MSR_IA32_LASTBRANCHTOIP:
-    case MSR_IA32_LASTINTFROMIP:
-    case MSR_IA32_LASTINTTOIP:
-    case MSR_IA32_MISC_ENABLE:
-        data = 0;
-        break;
+static int msr_tscdeadline_write(vm_vcpu_t *vcpu, unsigned int msr, uint64_t value, void *cookie)
+{
+    vm_set_lapic_tscdeadline_msr(vcpu, value);
+    return 0;
+}
+#endif
 
-    case MSR_IA32_UCODE_REV:
-        data = 0x100000000ULL;
-        break;
+#ifdef CONFIG_LIB_SEL4VM_X2APIC
+static int msr_x2apic_read(vm_vcpu_t *vcpu, unsigned int msr, uint64_t *value, void *cookie)
+{
+    return vm_lapic_x2apic_msr_read(vcpu, msr, value);
+}
 
-    case MSR_P6_PERFCTR0:
-    case MSR_P6_PERFCTR1:
-    case MSR_P6_EVNTSEL0:
-    case MSR_P6_EVNTSEL1:
-    case MSR_IA32_PERF_GLOBAL_STATUS_SET:
-        /* performance counters not supported. */
-        data = 0;
-        break;
+static int msr_x2apic_write(vm_vcpu_t *vcpu, unsigned int msr, uint64_t value, void *cookie)
+{
+    return vm_lapic_x2apic_msr_write(vcpu, msr, value);
+}
+#endif
 
-    case 0xcd: /* fsb frequency */
-        data = 3;
-        break;
+#ifdef CONFIG_LIB_SEL4VM_PV_EOI
+static int msr_pv_eoi_read(vm_vcpu_t *vcpu, unsigned int msr, uint64_t *value, void *cookie)
+{
+    *value = vm_lapic_get_pv_eoi_msr(vcpu);
+    return 0;
+}
 
-    case MSR_EBC_FREQUENCY_ID:
-        data = 1 << 24;
-        break;
+static int msr_pv_eoi_write(vm_vcpu_t *vcpu, unsigned int msr, uint64_t value, void *cookie)
+{
+    return vm_lapic_set_pv_eoi_msr(vcpu, value);
+}
+#endif
 
-    case MSR_IA32_APICBASE:
-        data = vm_lapic_get_base_msr(vcpu);
-        break;
+static int msr_pvclock_read(vm_vcpu_t *vcpu, unsigned int msr, uint64_t *value, void *cookie)
+{
+    return vm_pvclock_msr_read(vcpu, msr, value);
+}
 
-    default:
-        ZF_LOGW("rdmsr WARNING unsupported msr_no 0x%x\n", msr_no);
-        // generate a GP fault
-        vm_inject_exception(vcpu, 13, 1, 0);
-        return VM_EXIT_HANDLED;
+static int msr_pvclock_write(vm_vcpu_t *vcpu, unsigned int msr, uint64_t value, void *cookie)
+{
+    return vm_pvclock_msr_write(vcpu, msr, value);
+}
 
-    }
+// src reference: Linux kernel 3.11 kvm arch/x86/kvm/x86.c
+static const vm_msr_handler_t default_msr_handlers[] = {
+    { MSR_IA32_PLATFORM_ID, MSR_IA32_PLATFORM_ID, VM_MSR_EMULATE, msr_read_constant, NULL, &msr_zero },
+    { MSR_IA32_EBL_CR_POWERON, MSR_IA32_EBL_CR_POWERON, VM_MSR_EMULATE, msr_read_constant, NULL, &msr_zero },
+    { MSR_IA32_DEBUGCTLMSR, MSR_IA32_DEBUGCTLMSR, VM_MSR_EMULATE, msr_read_constant, NULL, &msr_zero },
+    { MSR_IA32_LASTBRANCHFROMIP, MSR_IA32_LASTINTTOIP, VM_MSR_EMULATE, msr_read_constant, NULL, &msr_zero },
+    { MSR_IA32_MISC_ENABLE, MSR_IA32_MISC_ENABLE, VM_MSR_EMULATE, msr_read_constant, NULL, &msr_zero },
+    { MSR_IA32_UCODE_REV, MSR_IA32_UCODE_REV, VM_MSR_EMULATE, msr_read_constant, msr_write_ignore, &msr_ucode_rev },
+    { MSR_IA32_UCODE_WRITE, MSR_IA32_UCODE_WRITE, VM_MSR_EMULATE, NULL, msr_write_ignore, NULL },
+    /* performance counters not supported. */
+    { MSR_P6_PERFCTR0, MSR_P6_PERFCTR1, VM_MSR_READ_AS_ZERO, NULL, NULL, NULL },
+    { MSR_P6_EVNTSEL0, MSR_P6_EVNTSEL1, VM_MSR_READ_AS_ZERO, NULL, NULL, NULL },
+    { MSR_IA32_PERF_GLOBAL_STATUS_SET, MSR_IA32_PERF_GLOBAL_STATUS_SET, VM_MSR_READ_AS_ZERO, NULL, NULL, NULL },
+    /* fsb frequency */
+    { 0xcd, 0xcd, VM_MSR_EMULATE, msr_read_constant, NULL, &msr_fsb_frequency },
+    { MSR_EBC_FREQUENCY_ID, MSR_EBC_FREQUENCY_ID, VM_MSR_EMULATE, msr_read_constant, NULL, &msr_ebc_frequency_id },
+    { MSR_IA32_APICBASE, MSR_IA32_APICBASE, VM_MSR_EMULATE, msr_apicbase_read, msr_apicbase_write, NULL },
+#ifdef CONFIG_LIB_SEL4VM_LAPIC_TIMER
+    { MSR_IA32_TSCDEADLINE, MSR_IA32_TSCDEADLINE, VM_MSR_EMULATE, msr_tscdeadline_read, msr_tscdeadline_write, NULL },
+#endif
+#ifdef CONFIG_LIB_SEL4VM_X2APIC
+    { MSR_IA32_X2APIC_START, MSR_IA32_X2APIC_END, VM_MSR_EMULATE, msr_x2apic_read, msr_x2apic_write, NULL },
+#endif
+#ifdef CONFIG_LIB_SEL4VM_PV_EOI
+    { MSR_KVM_PV_EOI_EN, MSR_KVM_PV_EOI_EN, VM_MSR_EMULATE, msr_pv_eoi_read, msr_pv_eoi_write, NULL },
+#endif
+#ifdef CONFIG_LIB_SEL4VM_PV_STEAL_TIME
+    { MSR_KVM_STEAL_TIME, MSR_KVM_STEAL_TIME, VM_MSR_EMULATE, msr_pvclock_read, msr_pvclock_write, NULL },
+#endif
+    { MSR_KVM_WALL_CLOCK, MSR_KVM_SYSTEM_TIME, VM_MSR_EMULATE, msr_pvclock_read, msr_pvclock_write, NULL },
+    { MSR_KVM_WALL_CLOCK_NEW, MSR_KVM_SYSTEM_TIME_NEW, VM_MSR_EMULATE, msr_pvclock_read, msr_pvclock_write, NULL },
+};
 
-    if (!ret) {
-        vm_set_thread_context_reg(vcpu, VCPU_CONTEXT_EAX, (uint32_t)(data & 0xffffffff));
-        vm_set_thread_context_reg(vcpu, VCPU_CONTEXT_EDX, (uint32_t)(data >> 32));
-        vm_guest_exit_next_instruction(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr);
-        return VM_EXIT_HANDLED;
+/* VMCS guest state field holding an MSR, 0 if it isn't held in the VMCS */
+static seL4_Word msr_vmcs_field(unsigned int msr)
+{
+    switch (msr) {
+    case MSR_IA32_SYSENTER_CS:
+        return VMX_GUEST_SYSENTER_CS;
+    case MSR_IA32_SYSENTER_ESP:
+        return VMX_GUEST_SYSENTER_ESP;
+    case MSR_IA32_SYSENTER_EIP:
+        return VMX_GUEST_SYSENTER_EIP;
+    case MSR_FS_BASE:
+        return VMX_GUEST_FS_BASE;
+    case MSR_GS_BASE:
+        return VMX_GUEST_GS_BASE;
+    default:
+        return 0;
     }
+}
 
-    return VM_EXIT_HANDLE_ERROR;
+/* Index of the first handler whose range doesn't end before the MSR */
+static unsigned int msr_table_lower_bound(vm_t *vm, unsigned int msr)
+{
+    unsigned int low = 0;
+    unsigned int high = vm->arch.msr_num_handlers;
+    while (low < high) {
+        unsigned int mid = low + (high - low) / 2;
+        if (vm->arch.msr_handlers[mid].end < msr) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
 }
 
-int vm_wrmsr_handler(vm_vcpu_t *vcpu)
+static vm_msr_handler_t *msr_find_handler(vm_t *vm, unsigned int msr)
 {
+    unsigned int i = msr_table_lower_bound(vm, msr);
+    if (i < vm->arch.msr_num_handlers && vm->arch.msr_handlers[i].start <= msr) {
+        return &vm->arch.msr_handlers[i];
+    }
+    return NULL;
+}
 
-    int ret = 0;
+int vm_register_msr_handler(vm_t *vm, unsigned int start, unsigned int end, vm_msr_policy_t policy,
+                            vm_msr_read_fn read, vm_msr_write_fn write, void *cookie)
+{
+    if (end < start) {
+        ZF_LOGE("Failed to register msr handler: Invalid range 0x%x-0x%x", start, end);
+        return -1;
+    }
+    if (policy == VM_MSR_PASSTHROUGH) {
+        for (unsigned int msr = start; msr <= end; msr++) {
+            if (!msr_vmcs_field(msr)) {
+                ZF_LOGE("Failed to register msr handler: msr 0x%x can't be passed through", msr);
+                return -1;
+            }
+        }
+    }
+    unsigned int i = msr_table_lower_bound(vm, start);
+    if (i < vm->arch.msr_num_handlers && vm->arch.msr_handlers[i].start <= end) {
+        ZF_LOGE("Failed to register msr handler: Range 0x%x-0x%x overlaps existing handler", start, end);
+        return -1;
+    }
+    if (vm->arch.msr_num_handlers == vm->arch.msr_table_size) {
+        unsigned int new_size = vm->arch.msr_table_size ? vm->arch.msr_table_size * 2 : MSR_TABLE_MIN_SIZE;
+        vm_msr_handler_t *new_table = realloc(vm->arch.msr_handlers, new_size * sizeof(vm_msr_handler_t));
+        if (!new_table) {
+            ZF_LOGE("Failed to register msr handler: Unable to grow table");
+            return -1;
+        }
+        vm->arch.msr_handlers = new_table;
+        vm->arch.msr_table_size = new_size;
+    }
+    memmove(&vm->arch.msr_handlers[i + 1], &vm->arch.msr_handlers[i],
+            (vm->arch.msr_num_handlers - i) * sizeof(vm_msr_handler_t));
+    vm->arch.msr_handlers[i] = (vm_msr_handler_t) {
+        .start = start,
+        .end = end,
+        .policy = policy,
+        .read = read,
+        .write = write,
+        .cookie = cookie
+    };
+    vm->arch.msr_num_handlers++;
+    return 0;
+}
 
-    unsigned int msr_no;
-    if (vm_get_thread_context_reg(vcpu, VCPU_CONTEXT_ECX, &msr_no)) {
-        return VM_EXIT_HANDLE_ERROR;
+int vm_msr_init(vm_t *vm)
+{
+    for (int i = 0; i < ARRAY_SIZE(default_msr_handlers); i++) {
+        const vm_msr_handler_t *h = &default_msr_handlers[i];
+        int err = vm_register_msr_handler(vm, h->start, h->end, h->policy, h->read, h->write, h->cookie);
+        if (err) {
+            return -1;
+        }
     }
-    unsigned int val_high, val_low;
+    return 0;
+}
 
-    if (vm_get_thread_context_reg(vcpu, VCPU_CONTEXT_EDX, &val_high)
-        || vm_get_thread_context_reg(vcpu, VCPU_CONTEXT_EAX, &val_low)) {
+int vm_rdmsr_handler(vm_vcpu_t *vcpu)
+{
+    seL4_VCPUContext context;
+    if (vm_get_thread_context(vcpu, &context)) {
         return VM_EXIT_HANDLE_ERROR;
     }
+    unsigned int msr_no = context.ecx;
+    uint64_t data = 0;
+    uint32_t field_val;
 
-    ZF_LOGD("wrmsr ecx 0x%x   value: 0x%x  0x%x\n", msr_no, val_high, val_low);
+    ZF_LOGD("rdmsr ecx 0x%x\n", msr_no);
 
-    // src reference: Linux kernel 3.11 kvm arch/x86/kvm/x86.c
-    switch (msr_no) {
-    case MSR_IA32_UCODE_REV:
-    case MSR_IA32_UCODE_WRITE:
-        break;
+    vm_msr_handler_t *h = msr_find_handler(vcpu->vm, msr_no);
+    if (!h) {
+        ZF_LOGW("rdmsr WARNING unsupported msr_no 0x%x\n", msr_no);
+        // generate a GP fault
+        vm_inject_exception(vcpu, 13, 1, 0);
+        return VM_EXIT_HANDLED;
+    }
 
-    case MSR_P6_PERFCTR0:
-    case MSR_P6_PERFCTR1:
-    case MSR_P6_EVNTSEL0:
-    case MSR_P6_EVNTSEL1:
-    case MSR_IA32_PERF_GLOBAL_STATUS_SET:
-        /* performance counters not supported. */
+    switch (h->policy) {
+    case VM_MSR_READ_AS_ZERO:
         break;
-
-    case MSR_IA32_APICBASE:
-        vm_lapic_set_base_msr(vcpu, val_low);
+    case VM_MSR_PASSTHROUGH:
+        if (vm_get_vmcs_field(vcpu, msr_vmcs_field(msr_no), &field_val)) {
+            return VM_EXIT_HANDLE_ERROR;
+        }
+        data = field_val;
         break;
-
+    case VM_MSR_EMULATE:
     default:
+        if (!h->read || h->read(vcpu, msr_no, &data, h->cookie)) {
+            vm_inject_exception(vcpu, 13, 1, 0);
+            return VM_EXIT_HANDLED;
+        }
+        break;
+    }
+
+    context.eax = (uint32_t)(data & 0xffffffff);
+    context.edx = (uint32_t)(data >> 32);
+    vm_set_thread_context(vcpu, context);
+    vm_guest_exit_next_instruction(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr);
+    return VM_EXIT_HANDLED;
+}
+
+int vm_wrmsr_handler(vm_vcpu_t *vcpu)
+{
+    seL4_VCPUContext context;
+    if (vm_get_thread_context(vcpu, &context)) {
+        return VM_EXIT_HANDLE_ERROR;
+    }
+    unsigned int msr_no = context.ecx;
+    uint64_t data = ((uint64_t)context.edx << 32) | (uint32_t)context.eax;
+
+    ZF_LOGD("wrmsr ecx 0x%x   value: 0x%x  0x%x\n", msr_no, (uint32_t)context.edx, (uint32_t)context.eax);
+
+    vm_msr_handler_t *h = msr_find_handler(vcpu->vm, msr_no);
+    if (!h) {
         ZF_LOGW("wrmsr WARNING unsupported msr_no 0x%x\n", msr_no);
         // generate a GP fault
         vm_inject_exception(vcpu, 13, 1, 0);
         return VM_EXIT_HANDLED;
     }
 
+    switch (h->policy) {
+    case VM_MSR_READ_AS_ZERO:
+        break;
+    case VM_MSR_PASSTHROUGH:
+        if (vm_set_vmcs_field(vcpu, msr_vmcs_field(msr_no), (uint32_t)data)) {
+            return VM_EXIT_HANDLE_ERROR;
+        }
+        break;
+    case VM_MSR_EMULATE:
+    default:
+        if (!h->write || h->write(vcpu, msr_no, data, h->cookie)) {
+            vm_inject_exception(vcpu, 13, 1, 0);
+            return VM_EXIT_HANDLED;
+        }
+        break;
+    }
+
     vm_guest_exit_next_instruction(vcpu->vcpu_arch.guest_state, vcpu->vcpu.cptr);
     return VM_EXIT_HANDLED;
-
 }
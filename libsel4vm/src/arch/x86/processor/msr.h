@@ -11,6 +11,8 @@
 
 #pragma once
 
+#include <sel4vm/guest_vm.h>
+
 /* Intel MSRs. Some also available on other CPUs */
 
 #define MSR_IA32_PERFCTR0       0x000000c1
@@ -187,11 +189,31 @@
 
 #define MSR_IA32_APICBASE       0x0000001b
 #define MSR_IA32_APICBASE_BSP       (1<<8)
+#define MSR_IA32_APICBASE_EXTD      (1<<10)
 #define MSR_IA32_APICBASE_ENABLE    (1<<11)
 #define MSR_IA32_APICBASE_BASE      (0xfffff<<12)
 
 #define MSR_IA32_TSCDEADLINE        0x000006e0
 
+/* x2APIC registers, MSR 0x800 + (xAPIC register offset >> 4) */
+#define MSR_IA32_X2APIC_START       0x00000800
+#define MSR_IA32_X2APIC_END         0x000008ff
+
+/* KVM paravirtual MSRs, the legacy and new clock MSR variants behave the same */
+#define MSR_KVM_WALL_CLOCK          0x00000011
+#define MSR_KVM_SYSTEM_TIME         0x00000012
+#define MSR_KVM_WALL_CLOCK_NEW      0x4b564d00
+#define MSR_KVM_SYSTEM_TIME_NEW     0x4b564d01
+#define MSR_KVM_STEAL_TIME          0x4b564d03
+#define MSR_KVM_PV_EOI_EN           0x4b564d04
+#define KVM_MSR_ENABLED             1
+/* Flag bit in the guest word registered through MSR_KVM_PV_EOI_EN */
+#define KVM_PV_EOI_ENABLED          (1<<0)
+
+/* Segment base MSRs, held in the guest state of the VMCS */
+#define MSR_FS_BASE                 0xc0000100
+#define MSR_GS_BASE                 0xc0000101
+
 #define MSR_IA32_UCODE_WRITE        0x00000079
 #define MSR_IA32_UCODE_REV      0x0000008b
 
@@ -284,3 +306,6 @@
 
 #define MSR_IA32_TSC_DEADLINE       0x000006E0
 
+
+/* Register the handlers of the MSRs emulated by libsel4vm */
+int vm_msr_init(vm_t *vm);
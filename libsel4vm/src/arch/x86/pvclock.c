@@ -0,0 +1,377 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stddef.h>
+#include <stdlib.h>
+
+#include <utils/util.h>
+#include <platsupport/arch/tsc.h>
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_ram.h>
+#include <sel4vm/boot.h>
+#include <sel4vm/arch/pvclock.h>
+
+#include "guest_state.h"
+#include "pvclock.h"
+#include "processor/cpuid.h"
+#include "processor/msr.h"
+
+#define NSEC_PER_SEC 1000000000ULL
+
+/* Enable bit of the system time MSR */
+#define PVCLOCK_MSR_ENABLED BIT(0)
+/* pvclock_vcpu_time_info flags */
+#define PVCLOCK_TSC_STABLE_BIT BIT(0)
+/* Bits of the steal time MSR below the 64 byte aligned address that are reserved */
+#define STEAL_TIME_MSR_RESERVED (MASK(6) & ~PVCLOCK_MSR_ENABLED)
+/* Steal time is accounted at most this often, as reading the consumed time of a scheduling context is a syscall */
+#define STEAL_TIME_UPDATE_CYCLES BIT(22)
+
+/* Layouts shared with the guest, as defined by the KVM ABI */
+typedef struct pvclock_vcpu_time_info {
+    uint32_t version;
+    uint32_t pad0;
+    uint64_t tsc_timestamp;
+    uint64_t system_time;
+    uint32_t tsc_to_system_mul;
+    int8_t tsc_shift;
+    uint8_t flags;
+    uint8_t pad[2];
+} PACKED pvclock_vcpu_time_info_t;
+
+typedef struct kvm_steal_time {
+    uint64_t steal;
+    uint32_t version;
+    uint32_t flags;
+    uint8_t preempted;
+    uint8_t pad0[3];
+    uint32_t pad[11];
+} PACKED kvm_steal_time_t;
+
+typedef struct pvclock_wall_clock {
+    uint32_t version;
+    uint32_t sec;
+    uint32_t nsec;
+} PACKED pvclock_wall_clock_t;
+
+struct vm_pvclock {
+    /* Clock time in ns at 'tsc_timestamp' */
+    uint64_t tsc_timestamp;
+    uint64_t system_time;
+    /* TSC to ns conversion: ns = ((tsc << tsc_shift) * tsc_to_system_mul) >> 32 */
+    uint32_t tsc_to_system_mul;
+    int8_t tsc_shift;
+    /* Wall clock at clock time 0 */
+    uint32_t wall_clock_sec;
+    uint32_t wall_clock_nsec;
+    /* Last value written to the wall clock MSR and version of the wall clock structure */
+    uint64_t wall_clock_msr;
+    uint32_t wall_clock_version;
+};
+
+/* Find a multiplier and shift converting from 'base_hz' to 'scaled_hz' (see kvm_get_time_scale in Linux) */
+static void pvclock_time_scale(uint64_t scaled_hz, uint64_t base_hz, int8_t *shift, uint32_t *mul)
+{
+    uint64_t scaled64 = scaled_hz;
+    uint64_t tps64 = base_hz;
+    uint32_t tps32;
+    int32_t s = 0;
+
+    while (tps64 > scaled64 * 2 || tps64 & 0xffffffff00000000ULL) {
+        tps64 >>= 1;
+        s--;
+    }
+    tps32 = (uint32_t)tps64;
+    while (tps32 <= scaled64 || scaled64 & 0xffffffff00000000ULL) {
+        if (scaled64 & 0xffffffff00000000ULL || tps32 & 0x80000000) {
+            scaled64 >>= 1;
+        } else {
+            tps32 <<= 1;
+        }
+        s++;
+    }
+    *shift = s;
+    *mul = (uint32_t)((scaled64 << 32) / tps32);
+}
+
+static uint64_t pvclock_scale_delta(uint64_t delta, uint32_t mul, int8_t shift)
+{
+    if (shift < 0) {
+        delta >>= -shift;
+    } else {
+        delta <<= shift;
+    }
+    /* 64x32 bit multiply keeping the upper 64 bits, without relying on 128 bit arithmetic */
+    return (((delta & 0xffffffff) * mul) >> 32) + (delta >> 32) * mul;
+}
+
+static int pvclock_write_guest(vm_t *vm, uintptr_t addr, void *data, size_t size)
+{
+    return vm_ram_touch(vm, addr, size, vm_guest_ram_write_callback, data);
+}
+
+/* Publish a structure starting with a version field, such that a guest reading it concurrently retries
+ * until it observes an even version that is unchanged across its read */
+static int pvclock_publish(vm_t *vm, uintptr_t addr, uint32_t *version, void *data, size_t size)
+{
+    uint32_t odd_version = *version + 1;
+    uint32_t even_version = *version + 2;
+
+    if (pvclock_write_guest(vm, addr, &odd_version, sizeof(odd_version))) {
+        return -1;
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    *(uint32_t *)data = odd_version;
+    if (pvclock_write_guest(vm, addr, data, size)) {
+        return -1;
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    if (pvclock_write_guest(vm, addr, &even_version, sizeof(even_version))) {
+        return -1;
+    }
+    *version = even_version;
+    return 0;
+}
+
+static int pvclock_publish_vcpu(vm_vcpu_t *vcpu)
+{
+    vm_pvclock_t *pvclock = vcpu->vm->arch.pvclock;
+    guest_virt_state_t *virt = &vcpu->vcpu_arch.guest_state->virt;
+    uintptr_t addr = virt->pvclock_msr & ~(uint64_t)PVCLOCK_MSR_ENABLED;
+
+    if (!(virt->pvclock_msr & PVCLOCK_MSR_ENABLED)) {
+        return 0;
+    }
+    pvclock_vcpu_time_info_t info = {
+        .tsc_timestamp = pvclock->tsc_timestamp,
+        .system_time = pvclock->system_time,
+        .tsc_to_system_mul = pvclock->tsc_to_system_mul,
+        .tsc_shift = pvclock->tsc_shift,
+        /* All vcpus share the same parameters, so the clock is consistent across them */
+        .flags = PVCLOCK_TSC_STABLE_BIT
+    };
+    return pvclock_publish(vcpu->vm, addr, &virt->pvclock_version, &info, sizeof(info));
+}
+
+/* Publish the steal time of a vcpu. Only the steal and version fields are written, the rest of the structure
+ * belongs to the guest */
+static int steal_time_publish(vm_vcpu_t *vcpu)
+{
+    guest_virt_state_t *virt = &vcpu->vcpu_arch.guest_state->virt;
+    uintptr_t addr = virt->steal_time_msr & ~(uint64_t)MASK(6);
+    uint32_t odd_version = virt->steal_time_version + 1;
+    uint32_t even_version = virt->steal_time_version + 2;
+    uintptr_t version_addr = addr + offsetof(kvm_steal_time_t, version);
+
+    if (pvclock_write_guest(vcpu->vm, version_addr, &odd_version, sizeof(odd_version))) {
+        return -1;
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    if (pvclock_write_guest(vcpu->vm, addr, &virt->steal_time_ns, sizeof(virt->steal_time_ns))) {
+        return -1;
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    if (pvclock_write_guest(vcpu->vm, version_addr, &even_version, sizeof(even_version))) {
+        return -1;
+    }
+    virt->steal_time_version = even_version;
+    return 0;
+}
+
+/* Start accounting steal time from now on */
+static void steal_time_rebase(vm_vcpu_t *vcpu, uint64_t now)
+{
+    guest_virt_state_t *virt = &vcpu->vcpu_arch.guest_state->virt;
+    uint64_t consumed_us = 0;
+
+    if (vcpu->tcb.sc.cptr != seL4_CapNull && vm_vcpu_get_sched_consumed(vcpu, &consumed_us)) {
+        consumed_us = virt->steal_time_last_consumed_us;
+    }
+    virt->steal_time_last = now;
+    virt->steal_time_last_consumed_us = consumed_us;
+    virt->steal_time_idle_cycles = 0;
+}
+
+int vm_pvclock_init(vm_t *vm, uint64_t tsc_frequency, uint32_t wall_clock_sec, uint32_t wall_clock_nsec)
+{
+    if (!vm || tsc_frequency == 0 || wall_clock_nsec >= NSEC_PER_SEC) {
+        ZF_LOGE("Failed to initialise pvclock: Invalid vm or clock parameters");
+        return -1;
+    }
+    if (vm->arch.pvclock) {
+        ZF_LOGE("Failed to initialise pvclock: Already initialised");
+        return -1;
+    }
+    vm_pvclock_t *pvclock = calloc(1, sizeof(vm_pvclock_t));
+    if (!pvclock) {
+        ZF_LOGE("Failed to initialise pvclock: Unable to allocate pvclock");
+        return -1;
+    }
+    pvclock->tsc_timestamp = rdtsc_pure();
+    pvclock->system_time = 0;
+    pvclock_time_scale(NSEC_PER_SEC, tsc_frequency, &pvclock->tsc_shift, &pvclock->tsc_to_system_mul);
+    pvclock->wall_clock_sec = wall_clock_sec;
+    pvclock->wall_clock_nsec = wall_clock_nsec;
+    vm->arch.pvclock = pvclock;
+    return 0;
+}
+
+int vm_pvclock_update(vm_t *vm, uint64_t tsc_frequency)
+{
+    if (!vm || !vm->arch.pvclock || tsc_frequency == 0) {
+        ZF_LOGE("Failed to update pvclock: Invalid vm, pvclock not initialised or invalid frequency");
+        return -1;
+    }
+    vm_pvclock_t *pvclock = vm->arch.pvclock;
+    /* Rebase the clock on the current TSC value before switching frequency */
+    uint64_t now = rdtsc_pure();
+    pvclock->system_time += pvclock_scale_delta(now - pvclock->tsc_timestamp, pvclock->tsc_to_system_mul,
+                                                pvclock->tsc_shift);
+    pvclock->tsc_timestamp = now;
+    pvclock_time_scale(NSEC_PER_SEC, tsc_frequency, &pvclock->tsc_shift, &pvclock->tsc_to_system_mul);
+
+    int err = 0;
+    for (unsigned int i = 0; i < vm->num_vcpus; i++) {
+        if (pvclock_publish_vcpu(vm->vcpus[i])) {
+            ZF_LOGE("Failed to update pvclock of vcpu %d", i);
+            err = -1;
+        }
+    }
+    return err;
+}
+
+uint32_t vm_pvclock_features(vm_t *vm)
+{
+    if (!vm->arch.pvclock) {
+        return 0;
+    }
+    return BIT(KVM_FEATURE_CLOCKSOURCE) | BIT(KVM_FEATURE_CLOCKSOURCE2) | BIT(KVM_FEATURE_CLOCKSOURCE_STABLE_BIT) |
+           (config_set(CONFIG_LIB_SEL4VM_PV_STEAL_TIME) ? BIT(KVM_FEATURE_STEAL_TIME) : 0);
+}
+
+void vm_pvclock_steal_time_update(vm_vcpu_t *vcpu)
+{
+    vm_pvclock_t *pvclock = vcpu->vm->arch.pvclock;
+    guest_virt_state_t *virt = &vcpu->vcpu_arch.guest_state->virt;
+    uint64_t consumed_us;
+
+    if (!pvclock || !(virt->steal_time_msr & PVCLOCK_MSR_ENABLED)) {
+        return;
+    }
+    uint64_t now = rdtsc_pure();
+    if (now - virt->steal_time_last < STEAL_TIME_UPDATE_CYCLES) {
+        return;
+    }
+    if (vcpu->tcb.sc.cptr == seL4_CapNull || vm_vcpu_get_sched_consumed(vcpu, &consumed_us)) {
+        /* Without a scheduling context of its own there is no telling how long the vcpu ran */
+        steal_time_rebase(vcpu, now);
+        return;
+    }
+    /* Whatever time the vcpu neither ran nor waited on events for, it was kept from running */
+    uint64_t elapsed = pvclock_scale_delta(now - virt->steal_time_last, pvclock->tsc_to_system_mul,
+                                           pvclock->tsc_shift);
+    uint64_t idle = pvclock_scale_delta(virt->steal_time_idle_cycles, pvclock->tsc_to_system_mul,
+                                        pvclock->tsc_shift);
+    uint64_t ran = (consumed_us - virt->steal_time_last_consumed_us) * 1000;
+    if (elapsed > ran + idle) {
+        virt->steal_time_ns += elapsed - ran - idle;
+    }
+    virt->steal_time_last = now;
+    virt->steal_time_last_consumed_us = consumed_us;
+    virt->steal_time_idle_cycles = 0;
+    if (steal_time_publish(vcpu)) {
+        ZF_LOGE("Failed to write steal time of vcpu %d", vcpu->vcpu_id);
+    }
+}
+
+int vm_pvclock_msr_read(vm_vcpu_t *vcpu, unsigned int msr, uint64_t *data)
+{
+    vm_pvclock_t *pvclock = vcpu->vm->arch.pvclock;
+    if (!pvclock) {
+        return -1;
+    }
+    switch (msr) {
+    case MSR_KVM_WALL_CLOCK:
+    case MSR_KVM_WALL_CLOCK_NEW:
+        *data = pvclock->wall_clock_msr;
+        break;
+    case MSR_KVM_SYSTEM_TIME:
+    case MSR_KVM_SYSTEM_TIME_NEW:
+        *data = vcpu->vcpu_arch.guest_state->virt.pvclock_msr;
+        break;
+    case MSR_KVM_STEAL_TIME:
+        *data = vcpu->vcpu_arch.guest_state->virt.steal_time_msr;
+        break;
+    default:
+        return -1;
+    }
+    return 0;
+}
+
+int vm_pvclock_msr_write(vm_vcpu_t *vcpu, unsigned int msr, uint64_t data)
+{
+    vm_pvclock_t *pvclock = vcpu->vm->arch.pvclock;
+    guest_virt_state_t *virt = &vcpu->vcpu_arch.guest_state->virt;
+    if (!pvclock) {
+        return -1;
+    }
+    switch (msr) {
+    case MSR_KVM_WALL_CLOCK:
+    case MSR_KVM_WALL_CLOCK_NEW: {
+        /* Writing the MSR requests the wall clock structure to be written at the given address */
+        pvclock_wall_clock_t wall_clock = {
+            .sec = pvclock->wall_clock_sec,
+            .nsec = pvclock->wall_clock_nsec
+        };
+        if ((uintptr_t)data != data || PAGE_ALIGN_4K(data) != PAGE_ALIGN_4K(data + sizeof(wall_clock) - 1)) {
+            ZF_LOGE("Invalid pvclock wall clock address 0x%llx", (unsigned long long)data);
+            return -1;
+        }
+        if (pvclock_publish(vcpu->vm, data, &pvclock->wall_clock_version, &wall_clock, sizeof(wall_clock))) {
+            ZF_LOGE("Failed to write pvclock wall clock");
+            return -1;
+        }
+        pvclock->wall_clock_msr = data;
+        break;
+    }
+    case MSR_KVM_SYSTEM_TIME:
+    case MSR_KVM_SYSTEM_TIME_NEW: {
+        uint64_t addr = data & ~(uint64_t)PVCLOCK_MSR_ENABLED;
+        if ((data & PVCLOCK_MSR_ENABLED) && ((uintptr_t)addr != addr ||
+                                            PAGE_ALIGN_4K(addr) != PAGE_ALIGN_4K(addr + sizeof(pvclock_vcpu_time_info_t) - 1))) {
+            ZF_LOGE("Invalid pvclock system time address 0x%llx", (unsigned long long)addr);
+            return -1;
+        }
+        virt->pvclock_msr = data;
+        if (pvclock_publish_vcpu(vcpu)) {
+            ZF_LOGE("Failed to write pvclock of vcpu %d", vcpu->vcpu_id);
+            virt->pvclock_msr = 0;
+            return -1;
+        }
+        break;
+    }
+    case MSR_KVM_STEAL_TIME:
+        if (data & STEAL_TIME_MSR_RESERVED || (uintptr_t)data != data) {
+            ZF_LOGE("Invalid steal time MSR value 0x%llx", (unsigned long long)data);
+            return -1;
+        }
+        virt->steal_time_msr = data;
+        if (!(data & PVCLOCK_MSR_ENABLED)) {
+            break;
+        }
+        steal_time_rebase(vcpu, rdtsc_pure());
+        if (steal_time_publish(vcpu)) {
+            ZF_LOGE("Failed to write steal time of vcpu %d", vcpu->vcpu_id);
+            virt->steal_time_msr = 0;
+            return -1;
+        }
+        break;
+    default:
+        return -1;
+    }
+    return 0;
+}
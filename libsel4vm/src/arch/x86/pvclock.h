@@ -0,0 +1,42 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <sel4vm/guest_vm.h>
+
+/**
+ * Get the KVM feature bits (cpuid 0x40000001.eax) provided by the paravirtual clock of a VM
+ * @param {vm_t *} vm               A handle to the VM
+ * @return                          Feature bits, 0 if the paravirtual clock is not initialised
+ */
+uint32_t vm_pvclock_features(vm_t *vm);
+
+/**
+ * Account the time a vcpu was kept from running since this was last called, and publish it to the steal time
+ * structure the vcpu registered, if any. This is called before entering the guest, and only does any work once
+ * enough time has passed since the last update
+ * @param {vm_vcpu_t *} vcpu        A handle to the vcpu
+ */
+void vm_pvclock_steal_time_update(vm_vcpu_t *vcpu);
+
+/**
+ * Read a kvmclock MSR
+ * @param {vm_vcpu_t *} vcpu        A handle to the vcpu
+ * @param {unsigned int} msr        MSR number
+ * @param {uint64_t *} data         Pointer to store the value of the MSR
+ * @return                          0 on success, -1 if the access should raise a #GP
+ */
+int vm_pvclock_msr_read(vm_vcpu_t *vcpu, unsigned int msr, uint64_t *data);
+
+/**
+ * Write a kvmclock MSR, publishing the wall clock or pvclock structure at the given guest physical address
+ * @param {vm_vcpu_t *} vcpu        A handle to the vcpu
+ * @param {unsigned int} msr        MSR number
+ * @param {uint64_t} data           Value written to the MSR
+ * @return                          0 on success, -1 if the access should raise a #GP
+ */
+int vm_pvclock_msr_write(vm_vcpu_t *vcpu, unsigned int msr, uint64_t data);
@@ -0,0 +1,231 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <autoconf.h>
+#include <sel4vm/gen_config.h>
+
+#include <stdlib.h>
+
+#include <sel4/sel4.h>
+#include <sel4utils/thread.h>
+#include <simple/simple.h>
+#include <vka/object.h>
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/boot.h>
+
+#include "vcpu_thread.h"
+#include "vm_lock.h"
+#include "guest_state.h"
+
+#ifdef CONFIG_LIB_SEL4VM_VCPU_THREADS
+struct vm_vmm_lock {
+    vm_lock_t lock;
+    /* vcpu the lock is held on behalf of */
+    vm_vcpu_t *owner;
+};
+
+struct vm_vcpu_thread {
+    /* VMM thread the vcpu is bound to */
+    sel4utils_thread_t thread;
+    /* Notification bound to the thread, signalled to kick the vcpu */
+    vka_object_t notification;
+    bool started;
+    /* Startup IPI received from another vcpu, to be handled by the vcpu's own thread */
+    bool sipi_pending;
+    unsigned int sipi_vector;
+};
+
+int vm_vcpu_threads_init(vm_t *vm)
+{
+    vm->arch.vmm_lock = calloc(1, sizeof(vm_vmm_lock_t));
+    if (!vm->arch.vmm_lock) {
+        ZF_LOGE("Failed to initialise vcpu threads: Unable to allocate vmm lock");
+        return -1;
+    }
+    return 0;
+}
+
+int vm_vcpu_thread_create(vm_vcpu_t *vcpu)
+{
+    int err;
+    vm_t *vm = vcpu->vm;
+    vm_vcpu_thread_t *vcpu_thread = calloc(1, sizeof(vm_vcpu_thread_t));
+    if (!vcpu_thread) {
+        ZF_LOGE("Failed to create vcpu thread: Unable to allocate thread");
+        return -1;
+    }
+    err = sel4utils_configure_thread(vm->vka, &vm->mem.vmm_vspace, &vm->mem.vmm_vspace, seL4_CapNull,
+                                     simple_get_cnode(vm->simple), seL4_NilData, &vcpu_thread->thread);
+    if (err) {
+        ZF_LOGE("Failed to create vcpu thread: Unable to configure thread");
+        free(vcpu_thread);
+        return -1;
+    }
+    err = seL4_TCB_SetSchedParams(vcpu_thread->thread.tcb.cptr, simple_get_tcb(vm->simple), vcpu->tcb.priority,
+                                  vcpu->tcb.priority);
+    if (err) {
+        ZF_LOGE("Failed to create vcpu thread: Unable to set priority");
+        return -1;
+    }
+    err = seL4_TCB_SetEPTRoot(vcpu_thread->thread.tcb.cptr, vm->mem.vm_vspace_root.cptr);
+    if (err) {
+        ZF_LOGE("Failed to create vcpu thread: Unable to set EPT root");
+        return -1;
+    }
+    err = vka_alloc_notification(vm->vka, &vcpu_thread->notification);
+    if (err) {
+        ZF_LOGE("Failed to create vcpu thread: Unable to allocate notification");
+        return -1;
+    }
+    err = seL4_TCB_BindNotification(vcpu_thread->thread.tcb.cptr, vcpu_thread->notification.cptr);
+    if (err) {
+        ZF_LOGE("Failed to create vcpu thread: Unable to bind notification");
+        return -1;
+    }
+    err = seL4_X86_VCPU_SetTCB(vcpu->vcpu.cptr, vcpu_thread->thread.tcb.cptr);
+    if (err) {
+        ZF_LOGE("Failed to create vcpu thread: Unable to bind vcpu");
+        return -1;
+    }
+    vcpu->vcpu_arch.vcpu_thread = vcpu_thread;
+    return 0;
+}
+
+int vm_vcpu_threads_start(vm_t *vm, sel4utils_thread_entry_fn entry)
+{
+    int err;
+    for (int i = 0; i < vm->num_vcpus; i++) {
+        vm_vcpu_t *vcpu = vm->vcpus[i];
+        vm_vcpu_thread_t *vcpu_thread = vcpu->vcpu_arch.vcpu_thread;
+        if (!vcpu_thread || vcpu_thread->started) {
+            continue;
+        }
+#if CONFIG_MAX_NUM_NODES > 1
+        if (vcpu->target_cpu >= 0) {
+            err = seL4_TCB_SetAffinity(vcpu_thread->thread.tcb.cptr, vcpu->target_cpu);
+            if (err) {
+                ZF_LOGE("Failed to start vcpu thread: Unable to set affinity of vcpu %d", vcpu->vcpu_id);
+                return -1;
+            }
+        }
+#endif /* CONFIG_MAX_NUM_NODES > 1 */
+        err = sel4utils_start_thread(&vcpu_thread->thread, entry, vcpu, NULL, 1);
+        if (err) {
+            ZF_LOGE("Failed to start vcpu thread: Unable to start thread of vcpu %d", vcpu->vcpu_id);
+            return -1;
+        }
+        vcpu_thread->started = true;
+    }
+    return 0;
+}
+
+void vm_vcpu_threads_stop(vm_t *vm)
+{
+    for (int i = 0; i < vm->num_vcpus; i++) {
+        vm_vcpu_thread_t *vcpu_thread = vm->vcpus[i]->vcpu_arch.vcpu_thread;
+        if (vcpu_thread && vcpu_thread->started) {
+            seL4_TCB_Suspend(vcpu_thread->thread.tcb.cptr);
+            vcpu_thread->started = false;
+        }
+    }
+}
+
+void vm_vcpu_thread_destroy(vm_vcpu_t *vcpu)
+{
+    vm_t *vm = vcpu->vm;
+    vm_vcpu_thread_t *vcpu_thread = vcpu->vcpu_arch.vcpu_thread;
+    if (!vcpu_thread) {
+        return;
+    }
+    sel4utils_clean_up_thread(vm->vka, &vm->mem.vmm_vspace, &vcpu_thread->thread);
+    vka_free_object(vm->vka, &vcpu_thread->notification);
+    free(vcpu_thread);
+    vcpu->vcpu_arch.vcpu_thread = NULL;
+}
+
+void vm_vcpu_thread_exit(vm_vcpu_t *vcpu)
+{
+    /* The boot vcpu picks up the error recorded in the VM's exit reason */
+    vm_vcpu_kick(vcpu->vm->vcpus[BOOT_VCPU]);
+    seL4_TCB_Suspend(vcpu->vcpu_arch.vcpu_thread->thread.tcb.cptr);
+    ZF_LOGF("vcpu thread resumed after exiting");
+}
+
+void vm_vmm_lock(vm_vcpu_t *vcpu)
+{
+    vm_vmm_lock_t *lock = vcpu->vm->arch.vmm_lock;
+    vm_lock_acquire(&lock->lock);
+    lock->owner = vcpu;
+}
+
+void vm_vmm_unlock(vm_vcpu_t *vcpu)
+{
+    vm_vmm_lock_t *lock = vcpu->vm->arch.vmm_lock;
+    assert(lock->owner == vcpu);
+    lock->owner = NULL;
+    vm_lock_release(&lock->lock);
+}
+
+bool vm_vcpu_is_current(vm_vcpu_t *vcpu)
+{
+    return vcpu->vm->arch.vmm_lock->owner == vcpu;
+}
+
+void vm_vcpu_yield(vm_vcpu_t *vcpu)
+{
+    vm_vmm_unlock(vcpu);
+    seL4_Yield();
+    vm_vmm_lock(vcpu);
+}
+
+void vm_vcpu_kick(vm_vcpu_t *vcpu)
+{
+    /* An unbadged signal is a kick, the boot vcpu shares its notification with the VMM's event sources.
+     * The flag lets a polling vcpu tell a kick apart from an empty poll */
+    __atomic_store_n(&vcpu->vcpu_arch.guest_state->virt.kick_pending, 1, __ATOMIC_RELEASE);
+    seL4_Signal(vm_vcpu_wait_cap(vcpu));
+}
+
+seL4_CPtr vm_vcpu_wait_cap(vm_vcpu_t *vcpu)
+{
+    if (vcpu->vcpu_arch.vcpu_thread) {
+        return vcpu->vcpu_arch.vcpu_thread->notification.cptr;
+    }
+    return vcpu->vm->host_endpoint;
+}
+
+seL4_CPtr vm_vcpu_thread_tcb(vm_vcpu_t *vcpu)
+{
+    if (vcpu->vcpu_arch.vcpu_thread) {
+        return vcpu->vcpu_arch.vcpu_thread->thread.tcb.cptr;
+    }
+    return seL4_CapNull;
+}
+
+void vm_vcpu_thread_set_sipi(vm_vcpu_t *vcpu, unsigned int sipi_vector)
+{
+    vm_vcpu_thread_t *vcpu_thread = vcpu->vcpu_arch.vcpu_thread;
+    if (!vcpu_thread) {
+        ZF_LOGE("Unable to start vcpu %d: vcpu has no thread", vcpu->vcpu_id);
+        return;
+    }
+    vcpu_thread->sipi_vector = sipi_vector;
+    vcpu_thread->sipi_pending = true;
+    vm_vcpu_kick(vcpu);
+}
+
+bool vm_vcpu_thread_take_sipi(vm_vcpu_t *vcpu, unsigned int *sipi_vector)
+{
+    vm_vcpu_thread_t *vcpu_thread = vcpu->vcpu_arch.vcpu_thread;
+    if (!vcpu_thread || !vcpu_thread->sipi_pending) {
+        return false;
+    }
+    *sipi_vector = vcpu_thread->sipi_vector;
+    vcpu_thread->sipi_pending = false;
+    return true;
+}
+#endif /* CONFIG_LIB_SEL4VM_VCPU_THREADS */
@@ -0,0 +1,151 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <autoconf.h>
+#include <sel4vm/gen_config.h>
+
+#include <sel4/sel4.h>
+#include <sel4utils/thread.h>
+
+#include <sel4vm/guest_vm.h>
+
+/*
+ * With CONFIG_LIB_SEL4VM_VCPU_THREADS every application processor vcpu is run by its own VMM thread, the boot vcpu
+ * being run by the thread calling vm_run. Each thread enters its guest in parallel with the other threads, the
+ * handling of vm exits and notifications is serialised by the VMM lock. The VMM lock protects all state shared between
+ * vcpus (lapic IPI delivery, i8259 state, ioport tables and guest memory management). The owner of the VMM lock is
+ * the vcpu whose exit is being handled, the state of any other vcpu is only modified through its lapic and a kick of
+ * its thread. Without CONFIG_LIB_SEL4VM_VCPU_THREADS these are all no-ops and only the boot vcpu is run.
+ */
+
+#ifdef CONFIG_LIB_SEL4VM_VCPU_THREADS
+/**
+ * Initialise the VMM lock of a VM
+ * @param {vm_t *} vm               A handle to the VM
+ * @return                          0 on success, -1 on error
+ */
+int vm_vcpu_threads_init(vm_t *vm);
+
+/**
+ * Create the VMM thread of an application processor vcpu and bind the vcpu to it. The thread is not started
+ * @param {vm_vcpu_t *} vcpu        A handle to the vcpu
+ * @return                          0 on success, -1 on error
+ */
+int vm_vcpu_thread_create(vm_vcpu_t *vcpu);
+
+/**
+ * Start the VMM threads of all application processor vcpus, pinning each thread to its vcpu's target cpu
+ * @param {vm_t *} vm                           A handle to the VM
+ * @param {sel4utils_thread_entry_fn} entry     Entry point of the threads, invoked with the vcpu as its first argument
+ * @return                                      0 on success, -1 on error
+ */
+int vm_vcpu_threads_start(vm_t *vm, sel4utils_thread_entry_fn entry);
+
+/**
+ * Stop the VMM threads of all application processor vcpus
+ * @param {vm_t *} vm               A handle to the VM
+ */
+void vm_vcpu_threads_stop(vm_t *vm);
+
+/**
+ * Destroy the VMM thread of a vcpu, freeing the objects it was created with. The thread must have been stopped
+ * @param {vm_vcpu_t *} vcpu        A handle to the vcpu
+ */
+void vm_vcpu_thread_destroy(vm_vcpu_t *vcpu);
+
+/**
+ * Exit the VMM thread of a vcpu after it failed to handle a vm exit, having the boot vcpu stop the VM.
+ * This does not return
+ * @param {vm_vcpu_t *} vcpu        A handle to the vcpu
+ */
+void vm_vcpu_thread_exit(vm_vcpu_t *vcpu);
+
+/**
+ * Acquire the VMM lock on behalf of a vcpu
+ * @param {vm_vcpu_t *} vcpu        A handle to the vcpu
+ */
+void vm_vmm_lock(vm_vcpu_t *vcpu);
+
+/**
+ * Release the VMM lock held by a vcpu
+ * @param {vm_vcpu_t *} vcpu        A handle to the vcpu
+ */
+void vm_vmm_unlock(vm_vcpu_t *vcpu);
+
+/**
+ * Test whether a vcpu is owned by the calling thread, i.e. its exit is currently being handled
+ * @param {vm_vcpu_t *} vcpu        A handle to the vcpu
+ * @return                          True if the vcpu holds the VMM lock
+ */
+bool vm_vcpu_is_current(vm_vcpu_t *vcpu);
+
+/**
+ * Release the VMM lock held by a vcpu and yield the rest of its thread's timeslice, reacquiring the lock once the
+ * thread runs again
+ * @param {vm_vcpu_t *} vcpu        A handle to the vcpu
+ */
+void vm_vcpu_yield(vm_vcpu_t *vcpu);
+
+/**
+ * Kick the thread of a vcpu out of the guest or out of waiting, such that it re-evaluates its pending interrupts
+ * @param {vm_vcpu_t *} vcpu        A handle to the vcpu
+ */
+void vm_vcpu_kick(vm_vcpu_t *vcpu);
+
+/**
+ * Get the notification a vcpu's thread waits on while the vcpu is halted or offline
+ * @param {vm_vcpu_t *} vcpu        A handle to the vcpu
+ * @return                          Notification capability
+ */
+seL4_CPtr vm_vcpu_wait_cap(vm_vcpu_t *vcpu);
+
+/**
+ * Get the TCB of a vcpu's own VMM thread
+ * @param {vm_vcpu_t *} vcpu        A handle to the vcpu
+ * @return                          TCB capability, seL4_CapNull if the vcpu is run by the VMM's thread
+ */
+seL4_CPtr vm_vcpu_thread_tcb(vm_vcpu_t *vcpu);
+
+/**
+ * Defer the start of an application processor vcpu to its own thread
+ * @param {vm_vcpu_t *} vcpu                A handle to the vcpu
+ * @param {unsigned int} sipi_vector        Vector of the startup IPI
+ */
+void vm_vcpu_thread_set_sipi(vm_vcpu_t *vcpu, unsigned int sipi_vector);
+
+/**
+ * Consume a deferred start of an application processor vcpu
+ * @param {vm_vcpu_t *} vcpu                A handle to the vcpu
+ * @param {unsigned int *} sipi_vector      Set with the vector of the startup IPI
+ * @return                                  True if a start was pending
+ */
+bool vm_vcpu_thread_take_sipi(vm_vcpu_t *vcpu, unsigned int *sipi_vector);
+#else
+static inline void vm_vmm_lock(vm_vcpu_t *vcpu)
+{
+}
+
+static inline void vm_vmm_unlock(vm_vcpu_t *vcpu)
+{
+}
+
+static inline bool vm_vcpu_is_current(vm_vcpu_t *vcpu)
+{
+    return true;
+}
+
+static inline seL4_CPtr vm_vcpu_wait_cap(vm_vcpu_t *vcpu)
+{
+    return vcpu->vm->host_endpoint;
+}
+
+static inline seL4_CPtr vm_vcpu_thread_tcb(vm_vcpu_t *vcpu)
+{
+    return seL4_CapNull;
+}
+#endif /* CONFIG_LIB_SEL4VM_VCPU_THREADS */
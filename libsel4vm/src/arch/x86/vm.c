@@ -5,20 +5,22 @@
  */
 
 #include <autoconf.h>
+#include <sel4vm/gen_config.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <sel4/sel4.h>
 #include <sel4/messages.h>
-#include <platsupport/arch/tsc.h>
 #include <sel4/arch/vmenter.h>
 #include <vka/capops.h>
+#include <platsupport/arch/tsc.h>
 
 #include <sel4vm/guest_vm.h>
 #include <sel4vm/guest_vm_util.h>
 #include <sel4vm/boot.h>
 #include <sel4vm/guest_vm_exits.h>
+#include <sel4vm/guest_vcpu_fault.h>
 
 #include "vm.h"
 #include "i8259/i8259.h"
@@ -27,6 +29,16 @@
 #include "guest_state.h"
 #include "debug.h"
 #include "vmexit.h"
+#include "guest_vm_exit_stats.h"
+#include "guest_vm_profile.h"
+#include "guest_vm_event_trace.h"
+#include "guest_irq_binding.h"
+#include "guest_irq_queue.h"
+#include "vcpu_thread.h"
+#include "processor/lapic.h"
+#include "vmx_timer.h"
+#include "halt.h"
+#include "pvclock.h"
 
 static vm_exit_handler_fn_t x86_exit_handlers[VM_EXIT_REASON_NUM] = {
     [EXIT_REASON_PENDING_INTERRUPT] = vm_pending_interrupt_handler,
@@ -39,11 +51,29 @@ static vm_exit_handler_fn_t x86_exit_handlers[VM_EXIT_REASON_NUM] = {
     [EXIT_REASON_HLT] = vm_hlt_handler,
     [EXIT_REASON_VMX_TIMER] = vm_vmx_timer_handler,
     [EXIT_REASON_VMCALL] = vm_vmcall_handler,
+    [EXIT_REASON_PAUSE_INSTRUCTION] = vm_pause_handler,
+    [EXIT_REASON_INVLPG] = vm_invlpg_handler,
 };
 
 /* Reply to the VM exit exception to resume guest. */
 static void vm_resume(vm_vcpu_t *vcpu)
 {
+    guest_virt_state_t *virt = &vcpu->vcpu_arch.guest_state->virt;
+    if (virt->fault_pending && __atomic_load_n(&virt->fault_completed, __ATOMIC_ACQUIRE)) {
+        /* Finish the memory fault on the vcpu's own thread, as the completion may have come from any thread */
+        if (is_vcpu_read_fault(vcpu)) {
+            set_vcpu_fault_data(vcpu, virt->fault_data);
+        }
+        advance_vcpu_fault(vcpu);
+        virt->fault_completed = 0;
+        virt->fault_pending = 0;
+    }
+    if (virt->fault_pending) {
+        return;
+    }
+    if (!vcpu->vcpu_arch.guest_state->virt.interrupt_halt) {
+        vm_inject_pending_interrupt(vcpu);
+    }
     vm_sync_guest_vmcs_state(vcpu);
     if (vcpu->vcpu_arch.guest_state->exit.in_exit && !vcpu->vcpu_arch.guest_state->virt.interrupt_halt) {
         /* Guest is blocked, but we are no longer halted. Reply to it */
@@ -79,8 +109,22 @@ static int handle_vm_exit(vm_vcpu_t *vcpu)
         return -1;
     }
 
+    if (vm_profile_due(vcpu)) {
+        vm_profile_record(vcpu, vm_guest_state_get_eip(vcpu->vcpu_arch.guest_state), reason);
+    }
+
+    vm_event_trace(vcpu, VM_EVENT_TRACE_EXIT, reason, vm_guest_exit_get_qualification(vcpu->vcpu_arch.guest_state),
+                   vm_guest_state_get_eip(vcpu->vcpu_arch.guest_state));
+
     /* Call the handler. */
+#ifdef CONFIG_LIB_SEL4VM_EXIT_STATS
+    uint64_t handler_start = vm_exit_stats_timestamp();
+#endif
     ret = x86_exit_handlers[reason](vcpu);
+#ifdef CONFIG_LIB_SEL4VM_EXIT_STATS
+    vm_exit_latency_record(&vcpu->exit_stats->exits[reason], vm_exit_stats_timestamp() - handler_start);
+#endif
+    vm_event_trace(vcpu, VM_EVENT_TRACE_EXIT_HANDLED, reason, ret, 0);
     if (ret == -1) {
         printf("VM_FATAL_ERROR ::: vmexit handler return error\n");
         vm_print_guest_context(vcpu);
@@ -110,9 +154,10 @@ static void vm_update_guest_state_from_fault(volatile vm_vcpu_t *vcpu, volatile
     vcpu->vcpu_arch.guest_state->exit.instruction_length = msg[SEL4_VMENTER_FAULT_INSTRUCTION_LEN_MR];
     vcpu->vcpu_arch.guest_state->exit.guest_physical = msg[SEL4_VMENTER_FAULT_GUEST_PHYSICAL_MR];
 
-    MACHINE_STATE_READ(vcpu->vcpu_arch.guest_state->machine.rflags, msg[SEL4_VMENTER_FAULT_RFLAGS_MR]);
-    MACHINE_STATE_READ(vcpu->vcpu_arch.guest_state->machine.guest_interruptibility, msg[SEL4_VMENTER_FAULT_GUEST_INT_MR]);
-    MACHINE_STATE_READ(vcpu->vcpu_arch.guest_state->machine.cr3, msg[SEL4_VMENTER_FAULT_CR3_MR]);
+    vm_guest_state_vmcs_fill(vcpu->vcpu_arch.guest_state, VMCS_CACHE_RFLAGS, msg[SEL4_VMENTER_FAULT_RFLAGS_MR]);
+    vm_guest_state_vmcs_fill(vcpu->vcpu_arch.guest_state, VMCS_CACHE_INTERRUPTIBILITY,
+                             msg[SEL4_VMENTER_FAULT_GUEST_INT_MR]);
+    vm_guest_state_vmcs_fill(vcpu->vcpu_arch.guest_state, VMCS_CACHE_CR3, msg[SEL4_VMENTER_FAULT_CR3_MR]);
 
     seL4_VCPUContext context;
     context.eax = msg[SEL4_VMENTER_FAULT_EAX];
@@ -130,12 +175,69 @@ int vcpu_start(vm_vcpu_t *vcpu)
     vcpu->vcpu_online = true;
 }
 
-int vm_run_arch(vm_t *vm)
+static int handle_vm_notification(vm_vcpu_t *vcpu, seL4_Word badge)
 {
     int err;
+    vm_t *vm = vcpu->vm;
+    if (badge != 0) {
+        seL4_Word remaining = vm_irq_queue_handle_badge(vm, badge);
+        remaining = vm_irq_binding_handle_badge(vm, remaining);
+        if (remaining != badge && i8259_has_interrupt(vm)) {
+            /* Posted or bound irqs were delivered */
+            vm_check_external_interrupt(vm);
+        }
+        if (!remaining) {
+            return VM_EXIT_HANDLED;
+        }
+        badge = remaining;
+    }
+#ifdef CONFIG_LIB_SEL4VM_VCPU_THREADS
+    if (badge == 0) {
+        /* Kicked by another vcpu thread */
+        unsigned int sipi_vector;
+        __atomic_store_n(&vcpu->vcpu_arch.guest_state->virt.kick_pending, 0, __ATOMIC_RELEASE);
+        if (vm->run.exit_reason == VM_GUEST_ERROR_EXIT) {
+            return VM_EXIT_HANDLE_ERROR;
+        }
+        vm_halt_pv_unhalt(vcpu);
+        if (vm_vcpu_thread_take_sipi(vcpu, &sipi_vector)) {
+            vm_start_ap_vcpu(vcpu, sipi_vector);
+        }
+        vm_vcpu_accept_interrupt(vcpu);
+        return VM_EXIT_HANDLED;
+    }
+#endif
+    assert(badge >= vm->num_vcpus);
+    /* assume interrupt */
+    if (!vm->run.notification_callback) {
+        ZF_LOGE("Unable to handle VM notification. Exiting");
+        return VM_EXIT_HANDLE_ERROR;
+    }
+    seL4_MessageInfo_t tag = {0};
+#ifdef CONFIG_LIB_SEL4VM_EXIT_STATS
+    uint64_t callback_start = vm_exit_stats_timestamp();
+#endif
+    err = vm->run.notification_callback(vm, badge, tag, vm->run.notification_callback_cookie);
+#ifdef CONFIG_LIB_SEL4VM_EXIT_STATS
+    vm_exit_latency_record(&vcpu->exit_stats->notifications, vm_exit_stats_timestamp() - callback_start);
+#endif
+    if (err == -1) {
+        return VM_EXIT_HANDLE_ERROR;
+    }
+    if (i8259_has_interrupt(vm)) {
+        /* Check if this caused PIC to generate interrupt */
+        vm_check_external_interrupt(vm);
+    }
+    return VM_EXIT_HANDLED;
+}
+
+/* Run a vcpu until its exits can no longer be handled. This is called from the thread the vcpu is bound to */
+static int vcpu_run_loop(vm_vcpu_t *vcpu)
+{
     int ret;
-    vm_vcpu_t *vcpu = vm->vcpus[BOOT_VCPU];
+    vm_t *vm = vcpu->vm;
 
+    vm_vmm_lock(vcpu);
     vcpu->vcpu_arch.guest_state->virt.interrupt_halt = 0;
     vcpu->vcpu_arch.guest_state->exit.in_exit = 0;
 
@@ -147,63 +249,104 @@ int vm_run_arch(vm_t *vm)
     vm_guest_state_invalidate_all(vcpu->vcpu_arch.guest_state);
 
     ret = 1;
-    vm->run.exit_reason = -1;
+#ifdef CONFIG_LIB_SEL4VM_EXIT_STATS
+    /* Time the VMM last resumed from running the guest or waiting on events */
+    uint64_t vmm_start = vm_exit_stats_timestamp();
+#endif
     while (ret > 0) {
         /* Block and wait for incoming msg or VM exits. */
         seL4_Word badge;
         int fault;
 
+        /* Deliver irqs posted by other threads before entering the guest */
+        if (vcpu->vcpu_id == BOOT_VCPU && vm_irq_queue_drain(vm) && i8259_has_interrupt(vm)) {
+            vm_check_external_interrupt(vm);
+        }
         if (vcpu->vcpu_online && !vcpu->vcpu_arch.guest_state->virt.interrupt_halt
-            && !vcpu->vcpu_arch.guest_state->exit.in_exit) {
+            && !vcpu->vcpu_arch.guest_state->exit.in_exit && !vcpu->vcpu_arch.guest_state->virt.fault_pending) {
+#ifdef CONFIG_LIB_SEL4VM_PV_EOI
+            vm_lapic_pv_eoi_sync_to_guest(vcpu);
+#endif
+#ifdef CONFIG_LIB_SEL4VM_PV_STEAL_TIME
+            vm_pvclock_steal_time_update(vcpu);
+#endif
+#ifdef CONFIG_LIB_SEL4VM_LAPIC_TIMER
+            if (vm_vmx_timer_program(vcpu)) {
+                ZF_LOGE("Failed to program VMX preemption timer of vcpu %d", vcpu->vcpu_id);
+                vm->run.exit_reason = VM_GUEST_ERROR_EXIT;
+                ret = VM_EXIT_HANDLE_ERROR;
+                break;
+            }
+#endif
             seL4_SetMR(0, vm_guest_state_get_eip(vcpu->vcpu_arch.guest_state));
             seL4_SetMR(1, vm_guest_state_get_control_ppc(vcpu->vcpu_arch.guest_state));
             seL4_SetMR(2, vm_guest_state_get_control_entry(vcpu->vcpu_arch.guest_state));
+            vm_vmm_unlock(vcpu);
+#ifdef CONFIG_LIB_SEL4VM_EXIT_STATS
+            uint64_t enter_start = vm_exit_stats_timestamp();
+#endif
             fault = seL4_VMEnter(&badge);
+            /* Take the exit message out of the IPC buffer in one copy, and before taking the VMM lock as
+             * blocking on it reuses the message registers. Only as much as the kind of exit carries is copied */
+            seL4_Word message[MAX(SEL4_VMENTER_RESULT_FAULT_LEN, SEL4_VMENTER_RESULT_NOTIF_LEN)];
+            memcpy(message, seL4_GetIPCBuffer()->msg, sizeof(seL4_Word) *
+                   (fault == SEL4_VMENTER_RESULT_FAULT ? SEL4_VMENTER_RESULT_FAULT_LEN : SEL4_VMENTER_RESULT_NOTIF_LEN));
+#ifdef CONFIG_LIB_SEL4VM_EXIT_STATS
+            vcpu->exit_stats->vmm_cycles += enter_start - vmm_start;
+            vmm_start = vm_exit_stats_timestamp();
+            vcpu->exit_stats->guest_cycles += vmm_start - enter_start;
+#endif
+            vm_vmm_lock(vcpu);
 
             vm_guest_state_invalidate_all(vcpu->vcpu_arch.guest_state);
             if (fault == SEL4_VMENTER_RESULT_FAULT) {
                 /* We in a fault */
                 vcpu->vcpu_arch.guest_state->exit.in_exit = 1;
                 /* Update the guest state from a fault */
-                seL4_Word fault_message[SEL4_VMENTER_RESULT_FAULT_LEN];
-                for (int i = 0 ; i < SEL4_VMENTER_RESULT_FAULT_LEN; i++) {
-                    fault_message[i] = seL4_GetMR(i);
-                }
-                vm_update_guest_state_from_fault(vcpu, fault_message);
+                vm_update_guest_state_from_fault(vcpu, message);
             } else {
                 /* update the guest state from a non fault */
-                seL4_Word int_message[SEL4_VMENTER_RESULT_NOTIF_LEN];
-                for (int i = 0 ; i < SEL4_VMENTER_RESULT_NOTIF_LEN; i++) {
-                    int_message[i] = seL4_GetMR(i);
-                }
-                vm_update_guest_state_from_interrupt(vcpu, int_message);
+                vm_update_guest_state_from_interrupt(vcpu, message);
             }
+#ifdef CONFIG_LIB_SEL4VM_PV_EOI
+            /* Perform any EOI the guest made through the PV EOI flag while it was running */
+            vm_lapic_pv_eoi_sync_from_guest(vcpu);
+#endif
         } else {
-            seL4_Wait(vm->host_endpoint, &badge);
+            vm_vmm_unlock(vcpu);
+#ifdef CONFIG_LIB_SEL4VM_EXIT_STATS
+            uint64_t wait_start = vm_exit_stats_timestamp();
+#endif
+#ifdef CONFIG_LIB_SEL4VM_PV_STEAL_TIME
+            uint64_t idle_start = rdtsc_pure();
+#endif
+            badge = vm_halt_wait(vcpu);
             fault = SEL4_VMENTER_RESULT_NOTIF;
+#ifdef CONFIG_LIB_SEL4VM_PV_STEAL_TIME
+            vcpu->vcpu_arch.guest_state->virt.steal_time_idle_cycles += rdtsc_pure() - idle_start;
+#endif
+#ifdef CONFIG_LIB_SEL4VM_EXIT_STATS
+            vcpu->exit_stats->vmm_cycles += wait_start - vmm_start;
+            vmm_start = vm_exit_stats_timestamp();
+            vcpu->exit_stats->idle_cycles += vmm_start - wait_start;
+#endif
+            vm_vmm_lock(vcpu);
         }
 
         if (fault == SEL4_VMENTER_RESULT_NOTIF) {
-            assert(badge >= vm->num_vcpus);
-            /* assume interrupt */
-            if (vm->run.notification_callback) {
-                seL4_MessageInfo_t tag = {0};
-                err = vm->run.notification_callback(vm, badge, tag, vm->run.notification_callback_cookie);
-                if (err == -1) {
-                    ret = VM_EXIT_HANDLE_ERROR;
-                } else if (i8259_has_interrupt(vm)) {
-                    /* Check if this caused PIC to generate interrupt */
-                    vm_check_external_interrupt(vm);
-                }
-            } else {
-                ZF_LOGE("Unable to handle VM notification. Exiting");
-                ret = VM_EXIT_HANDLE_ERROR;
-            }
+            ret = handle_vm_notification(vcpu, badge);
         } else {
             /* Handle the vm exit */
             ret = handle_vm_exit(vcpu);
-            vm_check_external_interrupt(vm);
+            /* Most exits can't have changed the PIC or whether the boot vcpu accepts its interrupts */
+            if (i8259_irq_state_changed(vm)) {
+                vm_check_external_interrupt(vm);
+            }
         }
+#ifdef CONFIG_LIB_SEL4VM_LAPIC_TIMER
+        /* Deliver an expired LAPIC timer at the exit boundary */
+        vm_lapic_timer_check(vcpu);
+#endif
 
         if (ret == VM_EXIT_HANDLE_ERROR) {
             vm->run.exit_reason = VM_GUEST_ERROR_EXIT;
@@ -212,5 +355,36 @@ int vm_run_arch(vm_t *vm)
         }
 
     }
+    vm_vmm_unlock(vcpu);
+    return ret;
+}
+
+#ifdef CONFIG_LIB_SEL4VM_VCPU_THREADS
+/* Entry point of the VMM thread of an application processor vcpu */
+static void vcpu_thread_entry(void *arg0, void *arg1, void *ipc_buf)
+{
+    vm_vcpu_t *vcpu = arg0;
+    vcpu_run_loop(vcpu);
+    ZF_LOGE("Failed to run vcpu %d, stopping VM", vcpu->vcpu_id);
+    vm_vcpu_thread_exit(vcpu);
+}
+#endif
+
+int vm_run_arch(vm_t *vm)
+{
+    int ret;
+
+    vm->run.exit_reason = -1;
+#ifdef CONFIG_LIB_SEL4VM_VCPU_THREADS
+    int err = vm_vcpu_threads_start(vm, vcpu_thread_entry);
+    if (err) {
+        vm_vcpu_threads_stop(vm);
+        return -1;
+    }
+#endif
+    ret = vcpu_run_loop(vm->vcpus[BOOT_VCPU]);
+#ifdef CONFIG_LIB_SEL4VM_VCPU_THREADS
+    vm_vcpu_threads_stop(vm);
+#endif
     return ret;
 }
@@ -4,7 +4,10 @@
  * SPDX-License-Identifier: GPL-2.0-only
  */
 
+#include <stdlib.h>
+
 #include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_ram.h>
 #include <sel4vm/arch/guest_x86_context.h>
 #include <sel4vm/arch/vmcall.h>
 
@@ -12,40 +15,137 @@
 #include "guest_state.h"
 #include "vmexit.h"
 
+/* Handlers are kept in an open-addressed table indexed by a hash of their token. Free slots have no handler
+ * function. The table is grown to keep it at most three quarters full */
+#define VMCALL_TABLE_MIN_SIZE 8
+
 static vmcall_handler_t *get_handle(vm_t *vm, int token);
+static int vmcall_multicall_handler(vm_vcpu_t *vcpu);
+
+static inline unsigned int vmcall_hash(int token, unsigned int table_size)
+{
+    /* Fibonacci hashing spreads consecutive tokens across the table */
+    return ((uint32_t)token * 2654435761u) & (table_size - 1);
+}
+
+static vmcall_handler_t *vmcall_table_slot(vmcall_handler_t *table, unsigned int table_size, int token)
+{
+    unsigned int i = vmcall_hash(token, table_size);
+    while (table[i].func && table[i].token != token) {
+        i = (i + 1) & (table_size - 1);
+    }
+    return &table[i];
+}
 
 static vmcall_handler_t *get_handle(vm_t *vm, int token)
 {
-    int i;
-    for (i = 0; i < vm->arch.vmcall_num_handlers; i++) {
-        if (vm->arch.vmcall_handlers[i].token == token) {
-            return &vm->arch.vmcall_handlers[i];
-        }
+    if (vm->arch.vmcall_table_size == 0) {
+        return NULL;
     }
+    vmcall_handler_t *h = vmcall_table_slot(vm->arch.vmcall_handlers, vm->arch.vmcall_table_size, token);
+    return h->func ? h : NULL;
+}
 
-    return NULL;
+static int vmcall_table_grow(vm_t *vm)
+{
+    unsigned int new_size = vm->arch.vmcall_table_size ? vm->arch.vmcall_table_size * 2 : VMCALL_TABLE_MIN_SIZE;
+    vmcall_handler_t *new_table = calloc(new_size, sizeof(vmcall_handler_t));
+    if (new_table == NULL) {
+        return -1;
+    }
+    for (unsigned int i = 0; i < vm->arch.vmcall_table_size; i++) {
+        vmcall_handler_t *h = &vm->arch.vmcall_handlers[i];
+        if (h->func) {
+            *vmcall_table_slot(new_table, new_size, h->token) = *h;
+        }
+    }
+    free(vm->arch.vmcall_handlers);
+    vm->arch.vmcall_handlers = new_table;
+    vm->arch.vmcall_table_size = new_size;
+    return 0;
 }
 
 int vm_reg_new_vmcall_handler(vm_t *vm, vmcall_handler func, int token)
 {
     unsigned int *hnum = &(vm->arch.vmcall_num_handlers);
-    if (get_handle(vm, token) != NULL) {
+    if (func == NULL || get_handle(vm, token) != NULL) {
         return -1;
     }
 
-    vm->arch.vmcall_handlers = realloc(vm->arch.vmcall_handlers, sizeof(vmcall_handler_t) * (*hnum + 1));
-    if (vm->arch.vmcall_handlers == NULL) {
-        return -1;
+    if ((*hnum + 1) * 4 > vm->arch.vmcall_table_size * 3) {
+        if (vmcall_table_grow(vm)) {
+            return -1;
+        }
     }
 
-    vm->arch.vmcall_handlers[*hnum].func = func;
-    vm->arch.vmcall_handlers[*hnum].token = token;
+    vmcall_handler_t *h = vmcall_table_slot(vm->arch.vmcall_handlers, vm->arch.vmcall_table_size, token);
+    h->func = func;
+    h->token = token;
     vm->arch.vmcall_num_handlers++;
 
     ZF_LOGD("Reg. handler %u for vm, total = %u\n", *hnum - 1, *hnum);
     return 0;
 }
 
+int vm_reg_vmcall_multicall_handler(vm_t *vm, int token)
+{
+    return vm_reg_new_vmcall_handler(vm, vmcall_multicall_handler, token);
+}
+
+/* Run each entry of a guest supplied vector as if it was a vmcall of its own. EBX holds the guest physical address
+ * of the vector and ECX the number of entries. On return EAX holds the number of entries run, or -1 if the vector
+ * could not be accessed. The other registers are preserved */
+static int vmcall_multicall_handler(vm_vcpu_t *vcpu)
+{
+    vmcall_multicall_entry_t entries[VMCALL_MULTICALL_MAX_ENTRIES];
+    seL4_VCPUContext context;
+    uint32_t addr, count;
+    uint32_t completed = 0;
+    int err;
+
+    if (vm_get_thread_context(vcpu, &context)) {
+        return -1;
+    }
+    addr = context.ebx;
+    count = MIN(context.ecx, VMCALL_MULTICALL_MAX_ENTRIES);
+    if (count == 0) {
+        return vm_set_thread_context_reg(vcpu, VCPU_CONTEXT_EAX, 0);
+    }
+    err = vm_ram_touch(vcpu->vm, addr, count * sizeof(vmcall_multicall_entry_t), vm_guest_ram_read_callback,
+                       entries);
+    if (err) {
+        ZF_LOGE("Failed to read multicall vector at 0x%x", addr);
+        return vm_set_thread_context_reg(vcpu, VCPU_CONTEXT_EAX, -1);
+    }
+
+    for (completed = 0; completed < count; completed++) {
+        vmcall_multicall_entry_t *entry = &entries[completed];
+        vmcall_handler_t *h = get_handle(vcpu->vm, entry->token);
+        if (h == NULL || h->func == vmcall_multicall_handler) {
+            ZF_LOGE("Failed to find multicall handler for token:%x\n", entry->token);
+            break;
+        }
+        vm_set_thread_context_reg(vcpu, VCPU_CONTEXT_EAX, entry->token);
+        for (int i = 0; i < VMCALL_MULTICALL_NUM_ARGS; i++) {
+            vm_set_thread_context_reg(vcpu, VCPU_CONTEXT_EBX + i, entry->args[i]);
+        }
+        if (h->func(vcpu)) {
+            return -1;
+        }
+        vm_get_thread_context_reg(vcpu, VCPU_CONTEXT_EAX, &entry->result);
+    }
+
+    if (completed > 0) {
+        err = vm_ram_touch(vcpu->vm, addr, completed * sizeof(vmcall_multicall_entry_t),
+                           vm_guest_ram_write_callback, entries);
+        if (err) {
+            ZF_LOGE("Failed to write back multicall results at 0x%x", addr);
+        }
+    }
+    context.eax = err ? -1 : completed;
+    return vm_set_thread_context(vcpu, context);
+}
+
 int vm_vmcall_handler(vm_vcpu_t *vcpu)
 {
     int res;
@@ -4,16 +4,22 @@
  * SPDX-License-Identifier: GPL-2.0-only
  */
 
+#include <autoconf.h>
+#include <sel4vm/gen_config.h>
+
 #include <stdio.h>
 #include <stdlib.h>
 
 #include <sel4/sel4.h>
+#include <utils/util.h>
 
 #include <sel4vm/guest_vm.h>
 #include <sel4vm/arch/vmcs_fields.h>
+#include <sel4vm/arch/exit_profile.h>
 
 #include "guest_state.h"
 #include "vmcs.h"
+#include "processor/platfeature.h"
 
 /*init the vmcs structure for a guest os thread*/
 void vm_vmcs_init_guest(vm_vcpu_t *vcpu)
@@ -62,10 +68,41 @@ void vm_vmcs_init_guest(vm_vcpu_t *vcpu)
     vm_vmcs_write(vcpu->vcpu.cptr, VMX_GUEST_RFLAGS, BIT(1));
     vm_vmcs_write(vcpu->vcpu.cptr, VMX_GUEST_SYSENTER_ESP, 0);
     vm_vmcs_write(vcpu->vcpu.cptr, VMX_GUEST_SYSENTER_EIP, 0);
-    vcpu->vcpu_arch.guest_state->machine.control_ppc = VMX_CONTROL_PPC_HLT_EXITING | VMX_CONTROL_PPC_CR3_LOAD_EXITING |
-                                                       VMX_CONTROL_PPC_CR3_STORE_EXITING;
+    /* Only the cr0/cr4 bits in the masks above trap, and then only when a write changes them from the read
+     * shadow. Guest physical memory is always translated through the EPT, so cr3 accesses only need to exit
+     * whilst the guest has paging disabled and is running on the VMM's initial page directory */
+    vcpu->vcpu_arch.guest_state->machine.control_ppc = 0;
+    if (vcpu->vm->arch.exit_profile == VM_EXIT_PROFILE_COMPATIBLE) {
+        vcpu->vcpu_arch.guest_state->machine.control_ppc |= VMX_CONTROL_PPC_HLT_EXITING;
+    }
+    if (config_set(CONFIG_LIB_SEL4VM_PAUSE_YIELD)) {
+        vcpu->vcpu_arch.guest_state->machine.control_ppc |= VMX_CONTROL_PPC_PAUSE_EXITING;
+    }
+    if (!(vcpu->vcpu_arch.guest_state->virt.cr.cr0_shadow & X86_CR0_PG)) {
+        vcpu->vcpu_arch.guest_state->machine.control_ppc |= VMX_CONTROL_PPC_CR3_LOAD_EXITING |
+                                                            VMX_CONTROL_PPC_CR3_STORE_EXITING;
+    }
+    if (config_set(CONFIG_LIB_SEL4VM_GUEST_TLB)) {
+        /* The software TLB of guest page table walks has to see every guest TLB invalidation, being invlpg and
+         * cr3 loads. Global pages are flushed along with everything else on a cr3 load */
+        vcpu->vcpu_arch.guest_state->machine.control_ppc |= VMX_CONTROL_PPC_INVLPG_EXITING |
+                                                            VMX_CONTROL_PPC_CR3_LOAD_EXITING;
+    }
     vm_vmcs_write(vcpu->vcpu.cptr, VMX_CONTROL_PRIMARY_PROCESSOR_CONTROLS,
                   vcpu->vcpu_arch.guest_state->machine.control_ppc);
+    if (config_set(CONFIG_LIB_SEL4VM_UNRESTRICTED_GUEST)) {
+        /* The kernel masks the secondary controls by what the processor allows, so whether unrestricted guest
+         * mode is available is found by reading back the control */
+        unsigned int secondary = 0;
+        vm_vmcs_read(vcpu->vcpu.cptr, VMX_CONTROL_SECONDARY_PROCESSOR_CONTROLS, &secondary);
+        vm_vmcs_write(vcpu->vcpu.cptr, VMX_CONTROL_SECONDARY_PROCESSOR_CONTROLS,
+                      secondary | SECONDARY_EXEC_UNRESTRICTED_GUEST);
+        vm_vmcs_read(vcpu->vcpu.cptr, VMX_CONTROL_SECONDARY_PROCESSOR_CONTROLS, &secondary);
+        vcpu->vcpu_arch.guest_state->virt.unrestricted_guest = !!(secondary & SECONDARY_EXEC_UNRESTRICTED_GUEST);
+        if (!vcpu->vcpu_arch.guest_state->virt.unrestricted_guest) {
+            ZF_LOGW("Unrestricted guest mode unavailable, vcpu %d will emulate real mode", vcpu->vcpu_id);
+        }
+    }
     vm_vmcs_read(vcpu->vcpu.cptr, VMX_CONTROL_ENTRY_INTERRUPTION_INFO, &vcpu->vcpu_arch.guest_state->machine.control_entry);
 
 #ifdef CONFIG_LIB_VM_VMX_TIMER_DEBUG
@@ -75,3 +112,17 @@ void vm_vmcs_init_guest(vm_vcpu_t *vcpu)
     vm_vmcs_write(vcpu->vcpu.cptr, VMX_GUEST_VMX_PREEMPTION_TIMER_VALUE, CONFIG_LIB_VM_VMX_TIMER_TIMEOUT);
 #endif
 }
+
+int vm_set_exit_profile(vm_t *vm, vm_exit_profile_t profile)
+{
+    if (profile != VM_EXIT_PROFILE_COMPATIBLE && profile != VM_EXIT_PROFILE_PERFORMANCE) {
+        ZF_LOGE("Failed to set exit profile: Invalid profile %d", profile);
+        return -1;
+    }
+    if (vm->num_vcpus) {
+        ZF_LOGE("Failed to set exit profile: vcpus have already been created");
+        return -1;
+    }
+    vm->arch.exit_profile = profile;
+    return 0;
+}
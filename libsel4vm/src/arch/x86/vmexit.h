@@ -7,6 +7,7 @@
 #pragma once
 
 #include <sel4vm/guest_vm.h>
+#include <sel4vm/arch/ioports.h>
 
 /*typedef int(*vmexit_handler_ptr)(vm_vcpu_t *vcpu);*/
 
@@ -21,3 +22,14 @@ int vm_vmx_timer_handler(vm_vcpu_t *vcpu);
 int vm_cr_access_handler(vm_vcpu_t *vcpu);
 int vm_vmcall_handler(vm_vcpu_t *vcpu);
 int vm_pending_interrupt_handler(vm_vcpu_t *vcpu);
+int vm_pause_handler(vm_vcpu_t *vcpu);
+int vm_invlpg_handler(vm_vcpu_t *vcpu);
+
+/* Find the registered handler of an ioport, as used by vm_io_instruction_handler. Returns NULL for unhandled ports */
+vm_ioport_entry_t *vm_ioport_lookup(vm_io_port_list_t *ioports, unsigned int port_no);
+
+/* Enable the ioport ranges passed through with vm_passthrough_ioport on a newly created vcpu */
+int vm_ioport_passthrough_vcpu(vm_vcpu_t *vcpu);
+
+/* Free the ioport handlers, doorbells and passthrough ranges of a VM */
+void vm_ioport_list_destroy(vm_t *vm);
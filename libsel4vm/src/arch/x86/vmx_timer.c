@@ -12,6 +12,8 @@
 #include <stdlib.h>
 
 #include <sel4/sel4.h>
+#include <utils/util.h>
+#include <platsupport/arch/tsc.h>
 
 #include <sel4vm/guest_vm.h>
 #include <sel4vm/arch/vmcs_fields.h>
@@ -19,6 +21,10 @@
 #include "vm.h"
 #include "vmcs.h"
 #include "debug.h"
+#include "guest_state.h"
+#include "vmx_timer.h"
+#include "processor/lapic.h"
+#include "processor/platfeature.h"
 
 int vm_vmx_timer_handler(vm_vcpu_t *vcpu)
 {
@@ -30,7 +36,46 @@ int vm_vmx_timer_handler(vm_vcpu_t *vcpu)
         return VM_EXIT_HANDLE_ERROR;
     }
     return VM_EXIT_HANDLED;
+#elif defined(CONFIG_LIB_SEL4VM_LAPIC_TIMER)
+    /* The expired LAPIC timer is delivered by vm_lapic_timer_check once the exit is handled */
+    return VM_EXIT_HANDLED;
 #else
     return VM_EXIT_HANDLE_ERROR;
 #endif
 }
+
+#ifdef CONFIG_LIB_SEL4VM_LAPIC_TIMER
+int vm_vmx_timer_program(vm_vcpu_t *vcpu)
+{
+    guest_virt_state_t *virt = &vcpu->vcpu_arch.guest_state->virt;
+    uint64_t expires = vm_lapic_timer_get_expiry(vcpu);
+    int err;
+
+    if (!expires) {
+        if (virt->vmx_timer_enabled) {
+            err = vm_vmcs_write(vcpu->vcpu.cptr, VMX_CONTROL_PIN_EXECUTION_CONTROLS, 0);
+            if (err) {
+                return -1;
+            }
+            virt->vmx_timer_enabled = 0;
+        }
+        return 0;
+    }
+    if (!virt->vmx_timer_enabled) {
+        err = vm_vmcs_write(vcpu->vcpu.cptr, VMX_CONTROL_PIN_EXECUTION_CONTROLS, PIN_BASED_VMX_PREEMPTION_TIMER);
+        if (err) {
+            return -1;
+        }
+        virt->vmx_timer_enabled = 1;
+    }
+    /* The preemption timer counts down at the TSC rate divided by 2^CONFIG_LIB_SEL4VM_VMX_TIMER_RATE_SHIFT
+     * whilst the guest runs. The value is loaded on every entry, so it is recomputed each time. Round
+     * up such that the exit doesn't happen before the expiry */
+    uint64_t now = rdtsc_pure();
+    uint64_t ticks = 0;
+    if (expires > now) {
+        ticks = (expires - now + BIT(CONFIG_LIB_SEL4VM_VMX_TIMER_RATE_SHIFT) - 1) >> CONFIG_LIB_SEL4VM_VMX_TIMER_RATE_SHIFT;
+    }
+    return vm_vmcs_write(vcpu->vcpu.cptr, VMX_GUEST_VMX_PREEMPTION_TIMER_VALUE, MIN(ticks, UINT32_MAX));
+}
+#endif
@@ -0,0 +1,17 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <sel4vm/guest_vm.h>
+
+/**
+ * Program the VMX preemption timer of a vcpu to exit the guest at the expiry of its LAPIC timer. The
+ * preemption timer is disabled whilst the LAPIC timer is not armed. To be called before every entry
+ * @param {vm_vcpu_t *} vcpu        A handle to the vcpu
+ * @return                          0 on success, -1 on error
+ */
+int vm_vmx_timer_program(vm_vcpu_t *vcpu);
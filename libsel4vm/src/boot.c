@@ -10,18 +10,31 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <utils/util.h>
+#include <vka/object.h>
 
 #include <sel4vm/guest_vm.h>
 #include <sel4vm/boot.h>
 #include <sel4vm/guest_vm_exits.h>
 #include <sel4vm/guest_vm_util.h>
+#include <sel4vm/guest_vm_boot_phases.h>
+#include <sel4vm/guest_vm_profile.h>
+#include <sel4vm/guest_vm_event_trace.h>
 
 #include "vm_boot.h"
+#include "guest_memory.h"
+#include "guest_ram_cache.h"
+#include "guest_vm_exit_stats.h"
+#include "guest_vspace.h"
+#include "guest_dirty_log.h"
+#include "guest_doorbell.h"
+#include "guest_irq_binding.h"
+#include "guest_irq_queue.h"
+#include "guest_ram_placement.h"
+#include "guest_ram_share.h"
+#include "guest_vm_arena.h"
 
-static int curr_vcpu_index = 0;
-
-int vm_init(vm_t *vm, vka_t *vka, simple_t *host_simple, vspace_t host_vspace,
-            ps_io_ops_t *io_ops, seL4_CPtr host_endpoint, const char *name)
+static int init_vm(vm_t *vm, vka_t *vka, simple_t *host_simple, vspace_t host_vspace,
+                   ps_io_ops_t *io_ops, seL4_CPtr host_endpoint, const char *name)
 {
     int err;
     bzero(vm, sizeof(vm_t));
@@ -37,12 +50,24 @@ int vm_init(vm_t *vm, vka_t *vka, simple_t *host_simple, vspace_t host_vspace,
     vm->mem.num_ram_regions = 0;
     vm->mem.ram_regions = malloc(0);
     assert(vm->vcpus);
+    /* Initialise the arena the vm bookkeeping is allocated from */
+    err = vm_arena_init(vm);
+    if (err) {
+        ZF_LOGE("Failed to initialise VM arena");
+        return err;
+    }
     /* Initialise vm memory management interface */
     err = vm_memory_init(vm);
     if (err) {
         ZF_LOGE("Failed to initialise VM memory manager");
         return err;
     }
+    /* Initialise guest ram mapping cache */
+    err = vm_ram_map_cache_init(vm);
+    if (err) {
+        ZF_LOGE("Failed to initialise VM ram mapping cache");
+        return err;
+    }
 
     /* Initialise vm architecture support */
     err = vm_init_arch(vm);
@@ -56,6 +81,69 @@ int vm_init(vm_t *vm, vka_t *vka, simple_t *host_simple, vspace_t host_vspace,
     return 0;
 }
 
+int vm_init(vm_t *vm, vka_t *vka, simple_t *host_simple, vspace_t host_vspace,
+            ps_io_ops_t *io_ops, seL4_CPtr host_endpoint, const char *name)
+{
+    int phase = vm_boot_phase_begin("vm_init");
+    int err = init_vm(vm, vka, host_simple, host_vspace, io_ops, host_endpoint, name);
+    vm_boot_phase_end(phase);
+    return err;
+}
+
+static void destroy_vcpu(vm_t *vm, vm_vcpu_t *vcpu)
+{
+    vm_profile_stop(vcpu);
+    vm_event_trace_stop(vcpu);
+    if (vcpu->tcb.sc.cptr != seL4_CapNull) {
+        vka_free_object(vm->vka, &vcpu->tcb.sc);
+    }
+    vm_destroy_vcpu_arch(vm, vcpu);
+    vm_memory_destroy_vcpu(vcpu);
+    vm_exit_stats_destroy_vcpu(vcpu);
+    vka_free_object(vm->vka, &vcpu->vcpu);
+    free(vcpu);
+}
+
+int vm_destroy(vm_t *vm)
+{
+    if (!vm || !vm->vm_initialised) {
+        ZF_LOGE("Failed to destroy vm: Invalid vm");
+        return -1;
+    }
+    for (int i = 0; i < vm->num_vcpus; i++) {
+        destroy_vcpu(vm, vm->vcpus[i]);
+        vm->vcpus[i] = NULL;
+    }
+    vm->num_vcpus = 0;
+    vm_ram_map_cache_destroy(vm);
+    /* Pages shared with other VMs stay with them, everything else left in the guest vspace belongs to this VM */
+    if (vm_ram_share_detach(vm)) {
+        ZF_LOGE("Failed to destroy vm: Unable to detach shared ram");
+        return -1;
+    }
+    /* Deleting the root drops every guest mapping at once, leaving the teardown of the vspace to only free the
+     * frames and paging structures rather than unmap them from a live address space */
+    vka_free_object(vm->vka, &vm->mem.vm_vspace_root);
+    vm_tear_down_guest_vspace(&vm->mem.vm_vspace);
+    vm_ram_destroy(vm);
+    vm_memory_destroy(vm);
+    vm_dirty_log_destroy(vm);
+    vm_ram_placement_destroy(vm);
+    vm_doorbell_table_destroy(vm->mem.doorbells);
+    vm->mem.doorbells = NULL;
+    vm->mem.ram_pool = NULL;
+    vm_irq_queue_destroy(vm);
+    vm_irq_binding_destroy(vm);
+    vm_exit_stats_destroy(vm);
+    vm_destroy_arch(vm);
+    /* Last, the subsystems above may return allocations to the arena */
+    vm_arena_destroy(vm);
+    free(vm->vm_name);
+    vm->vm_name = NULL;
+    vm->vm_initialised = false;
+    return 0;
+}
+
 vm_vcpu_t *vm_create_vcpu(vm_t *vm, int priority)
 {
     int err;
@@ -70,10 +158,14 @@ vm_vcpu_t *vm_create_vcpu(vm_t *vm, int priority)
     assert(!err);
     /* Initialise vcpu fields */
     vcpu_new->vm = vm;
-    vcpu_new->vcpu_id = curr_vcpu_index++;
+    vcpu_new->vcpu_id = vm->num_vcpus;
     vcpu_new->tcb.priority = priority;
     vcpu_new->vcpu_online = false;
     vcpu_new->target_cpu = -1;
+    err = vm_memory_init_vcpu(vcpu_new);
+    assert(!err);
+    err = vm_exit_stats_init_vcpu(vcpu_new);
+    assert(!err);
     err = vm_create_vcpu_arch(vm, vcpu_new);
     assert(!err);
     vm->vcpus[vm->num_vcpus] = vcpu_new;
@@ -81,6 +173,76 @@ vm_vcpu_t *vm_create_vcpu(vm_t *vm, int priority)
     return vcpu_new;
 }
 
+int vm_vcpu_set_sched_budget(vm_vcpu_t *vcpu, uint64_t budget_us, uint64_t period_us, unsigned int extra_refills)
+{
+    if (vcpu == NULL) {
+        ZF_LOGE("Failed to set vcpu budget - Invalid vcpu");
+        return -1;
+    }
+#ifdef CONFIG_KERNEL_MCS
+    int err;
+    seL4_CPtr tcb;
+    int core;
+    vm_t *vm = vcpu->vm;
+    if (budget_us == 0 || budget_us > period_us) {
+        ZF_LOGE("Failed to set vcpu budget - Budget must be non-zero and no larger than the period");
+        return -1;
+    }
+    if (vm_vcpu_sched_target_arch(vcpu, &tcb, &core)) {
+        ZF_LOGE("Failed to set vcpu budget - vcpu %d has no thread of its own", vcpu->vcpu_id);
+        return -1;
+    }
+    bool created = false;
+    if (vcpu->tcb.sc.cptr == seL4_CapNull) {
+        err = vka_alloc_sched_context(vm->vka, &vcpu->tcb.sc);
+        if (err) {
+            ZF_LOGE("Failed to set vcpu budget - Unable to allocate scheduling context");
+            return -1;
+        }
+        vcpu->tcb.sched_ctrl.cptr = simple_get_sched_ctrl(vm->simple, core);
+        created = true;
+    }
+    err = seL4_SchedControl_ConfigureFlags(vcpu->tcb.sched_ctrl.cptr, vcpu->tcb.sc.cptr, budget_us, period_us,
+                                           extra_refills, vcpu->vcpu_id, seL4_SchedContext_NoFlag);
+    if (!err && created) {
+        err = seL4_SchedContext_Bind(vcpu->tcb.sc.cptr, tcb);
+    }
+    if (err) {
+        ZF_LOGE("Failed to set vcpu budget - Unable to configure scheduling context (%d)", err);
+        if (created) {
+            vka_free_object(vm->vka, &vcpu->tcb.sc);
+            vcpu->tcb.sc.cptr = seL4_CapNull;
+        }
+        return -1;
+    }
+    vcpu->tcb.budget_us = budget_us;
+    vcpu->tcb.period_us = period_us;
+    return 0;
+#else
+    ZF_LOGE("Failed to set vcpu budget - Kernel not configured with MCS");
+    return -1;
+#endif
+}
+
+int vm_vcpu_get_sched_consumed(vm_vcpu_t *vcpu, uint64_t *consumed_us)
+{
+    if (vcpu == NULL || vcpu->tcb.sc.cptr == seL4_CapNull) {
+        ZF_LOGE("Failed to get vcpu consumed time - No budget configured");
+        return -1;
+    }
+#ifdef CONFIG_KERNEL_MCS
+    /* The kernel resets its count each time it is read */
+    seL4_SchedContext_Consumed_t consumed = seL4_SchedContext_Consumed(vcpu->tcb.sc.cptr);
+    if (consumed.error) {
+        ZF_LOGE("Failed to get vcpu consumed time - Unable to read scheduling context");
+        return -1;
+    }
+    vcpu->tcb.consumed_us += consumed.consumed;
+#endif
+    *consumed_us = vcpu->tcb.consumed_us;
+    return 0;
+}
+
 int vm_assign_vcpu_target(vm_vcpu_t *vcpu, int target_cpu)
 {
     if (vcpu == NULL) {
@@ -0,0 +1,220 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <autoconf.h>
+#include <sel4vm/gen_config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sel4/sel4.h>
+#include <vspace/vspace.h>
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_ram.h>
+
+#include "guest_memory.h"
+#include "guest_dirty_log.h"
+#include "guest_ram_cache.h"
+#include "guest_vspace_arch.h"
+
+#define LOG_BITS (sizeof(unsigned long) * 8)
+
+typedef struct dirty_log_region {
+    uintptr_t start;
+    size_t size;
+    /* a bit per page, set once the page is written */
+    unsigned long *dirty;
+} dirty_log_region_t;
+
+struct vm_dirty_log {
+    int num_regions;
+    dirty_log_region_t *regions;
+};
+
+static dirty_log_region_t *find_region(vm_t *vm, uintptr_t addr)
+{
+    vm_dirty_log_t *log = vm->mem.dirty_log;
+    if (!log) {
+        return NULL;
+    }
+    for (int i = 0; i < log->num_regions; i++) {
+        dirty_log_region_t *region = &log->regions[i];
+        if (addr >= region->start && addr - region->start < region->size) {
+            return region;
+        }
+    }
+    return NULL;
+}
+
+static bool page_dirty(dirty_log_region_t *region, size_t page)
+{
+    return region->dirty[page / LOG_BITS] & BIT(page % LOG_BITS);
+}
+
+/* Pages of a frame are marked together, as a frame is protected as a whole */
+static void mark_dirty(dirty_log_region_t *region, uintptr_t addr, size_t size)
+{
+    uintptr_t end = MIN(addr + size, region->start + region->size);
+    for (uintptr_t page = MAX(addr, region->start); page < end; page += PAGE_SIZE_4K) {
+        size_t idx = (page - region->start) / PAGE_SIZE_4K;
+        region->dirty[idx / LOG_BITS] |= BIT(idx % LOG_BITS);
+    }
+}
+
+/* Remap the guest frame at addr with the given rights, returning the frame's base and size */
+static int remap_frame(vm_t *vm, uintptr_t addr, seL4_CapRights_t rights, uintptr_t *frame_addr, size_t *frame_size)
+{
+    size_t size_bits = vm_memory_frame_size_bits(vm, addr);
+    uintptr_t base = ROUND_DOWN(addr, BIT(size_bits));
+    seL4_CPtr cap = vspace_get_cap(&vm->mem.vm_vspace, (void *)base);
+    if (cap == seL4_CapNull) {
+        return -1;
+    }
+    int err = guest_vspace_map_page_arch(&vm->mem.vm_vspace, cap, (void *)base, rights, 1, size_bits);
+    if (err) {
+        ZF_LOGE("Failed to remap guest frame at %p", (void *)base);
+        return -1;
+    }
+    *frame_addr = base;
+    *frame_size = BIT(size_bits);
+    return 0;
+}
+
+/* Write protect the pages of a region that aren't yet, or that are dirty if clearing */
+static int protect_region(vm_t *vm, dirty_log_region_t *region, bool dirty_only)
+{
+    uintptr_t end = region->start + region->size;
+    for (uintptr_t addr = region->start; addr < end;) {
+        size_t idx = (addr - region->start) / PAGE_SIZE_4K;
+        if (dirty_only && !page_dirty(region, idx)) {
+            addr += PAGE_SIZE_4K;
+            continue;
+        }
+        uintptr_t frame_addr;
+        size_t frame_size;
+        if (remap_frame(vm, addr, seL4_CanRead, &frame_addr, &frame_size)) {
+            /* Frames not yet mapped are logged by the map itself */
+            addr += PAGE_SIZE_4K;
+            continue;
+        }
+        addr = frame_addr + frame_size;
+    }
+    return 0;
+}
+
+int vm_ram_dirty_log_enable(vm_t *vm, uintptr_t start, size_t bytes)
+{
+    if (!IS_ALIGNED(start, seL4_PageBits) || !bytes || !IS_ALIGNED(bytes, seL4_PageBits)) {
+        ZF_LOGE("Failed to enable dirty log: Region must be 4K aligned");
+        return -1;
+    }
+    if (find_region(vm, start)) {
+        ZF_LOGE("Failed to enable dirty log: Region at %p is already logged", (void *)start);
+        return -1;
+    }
+#ifdef CONFIG_LIB_SEL4VM_LAZY_RAM
+    /* Every frame has to be mapped to be write protected */
+    if (vm_memory_populate(vm, start, bytes)) {
+        ZF_LOGE("Failed to enable dirty log: Unable to populate region");
+        return -1;
+    }
+#endif
+
+    vm_dirty_log_t *log = vm->mem.dirty_log;
+    if (!log) {
+        log = calloc(1, sizeof(*log));
+        if (!log) {
+            ZF_LOGE("Failed to enable dirty log: Unable to allocate log");
+            return -1;
+        }
+        vm->mem.dirty_log = log;
+    }
+    dirty_log_region_t *regions = realloc(log->regions, sizeof(*regions) * (log->num_regions + 1));
+    if (!regions) {
+        ZF_LOGE("Failed to enable dirty log: Unable to allocate region");
+        return -1;
+    }
+    log->regions = regions;
+    size_t num_pages = bytes / PAGE_SIZE_4K;
+    unsigned long *dirty = calloc(DIV_ROUND_UP(num_pages, LOG_BITS), sizeof(unsigned long));
+    if (!dirty) {
+        ZF_LOGE("Failed to enable dirty log: Unable to allocate bitmap");
+        return -1;
+    }
+    dirty_log_region_t *region = &log->regions[log->num_regions++];
+    *region = (dirty_log_region_t) {
+        .start = start, .size = bytes, .dirty = dirty
+    };
+    return protect_region(vm, region, false);
+}
+
+int vm_ram_get_dirty_log(vm_t *vm, uintptr_t start, size_t bytes, unsigned long *bitmap, bool clear)
+{
+    dirty_log_region_t *region = find_region(vm, start);
+    if (!region || region->start != start || region->size != bytes) {
+        ZF_LOGE("Failed to get dirty log: No logged region at %p of size 0x%zx", (void *)start, bytes);
+        return -1;
+    }
+    /* Pages the VMM keeps mapped may have been written without faulting */
+    vm_ram_map_cache_log_pinned(vm);
+    size_t words = DIV_ROUND_UP(bytes / PAGE_SIZE_4K, LOG_BITS);
+    memcpy(bitmap, region->dirty, words * sizeof(unsigned long));
+    if (clear) {
+        /* Protect the pages written since the last checkpoint again */
+        int err = protect_region(vm, region, true);
+        memset(region->dirty, 0, words * sizeof(unsigned long));
+        return err;
+    }
+    return 0;
+}
+
+bool vm_dirty_log_handle_fault(vm_t *vm, uintptr_t addr)
+{
+    dirty_log_region_t *region = find_region(vm, addr);
+    if (!region) {
+        return false;
+    }
+    size_t idx = (addr - region->start) / PAGE_SIZE_4K;
+    if (page_dirty(region, idx)) {
+        /* Already writable, so this is some other fault */
+        return false;
+    }
+    uintptr_t frame_addr;
+    size_t frame_size;
+    if (remap_frame(vm, addr, seL4_AllRights, &frame_addr, &frame_size)) {
+        return false;
+    }
+    mark_dirty(region, frame_addr, frame_size);
+    return true;
+}
+
+void vm_dirty_log_mark(vm_t *vm, uintptr_t addr, size_t size)
+{
+    vm_dirty_log_t *log = vm->mem.dirty_log;
+    if (!log) {
+        return;
+    }
+    /* The accessed range may span more than one logged region */
+    for (int i = 0; i < log->num_regions; i++) {
+        mark_dirty(&log->regions[i], ROUND_DOWN(addr, PAGE_SIZE_4K), size + (addr & MASK(seL4_PageBits)));
+    }
+}
+
+void vm_dirty_log_destroy(vm_t *vm)
+{
+    vm_dirty_log_t *log = vm->mem.dirty_log;
+    if (!log) {
+        return;
+    }
+    for (int i = 0; i < log->num_regions; i++) {
+        free(log->regions[i].dirty);
+    }
+    free(log->regions);
+    free(log);
+    vm->mem.dirty_log = NULL;
+}
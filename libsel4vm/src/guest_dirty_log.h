@@ -0,0 +1,32 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <sel4vm/guest_vm.h>
+
+/**
+ * Handle a guest fault on a page of RAM write protected for dirty logging, recording the page as dirty and
+ * letting the guest write to it again
+ * @param {vm_t *} vm               A handle to the VM
+ * @param {uintptr_t} addr          Faulting guest physical address
+ * @return                          true if the fault was on a write protected page and has been handled
+ */
+bool vm_dirty_log_handle_fault(vm_t *vm, uintptr_t addr);
+
+/**
+ * Record a region of guest RAM accessed by the VMM as dirty, as such writes don't fault
+ * @param {vm_t *} vm               A handle to the VM
+ * @param {uintptr_t} addr          Base guest physical address of region
+ * @param {size_t} size             Size of region in bytes
+ */
+void vm_dirty_log_mark(vm_t *vm, uintptr_t addr, size_t size);
+
+/**
+ * Free the dirty log of a VM. The write protection of the logged regions is left as is
+ * @param {vm_t *} vm               A handle to the VM
+ */
+void vm_dirty_log_destroy(vm_t *vm);
@@ -0,0 +1,142 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdlib.h>
+
+#include <sel4/sel4.h>
+#include <utils/util.h>
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_doorbell.h>
+
+#include "guest_doorbell.h"
+
+typedef struct vm_doorbell {
+    uintptr_t addr;
+    size_t size;
+    bool match_value;
+    seL4_Word value;
+    seL4_CPtr notification;
+} vm_doorbell_t;
+
+/* Doorbells are few (typically one per device queue) so they are kept in a small unsorted array */
+struct vm_doorbell_table {
+    int num_doorbells;
+    int max_doorbells;
+    vm_doorbell_t *doorbells;
+};
+
+int vm_doorbell_add(vm_doorbell_table_t **table, uintptr_t addr, size_t size, bool match_value, seL4_Word value,
+                    seL4_CPtr notification)
+{
+    if (size == 0 || addr + size < addr) {
+        ZF_LOGE("Failed to add doorbell: Invalid range");
+        return -1;
+    }
+    if (notification == seL4_CapNull) {
+        ZF_LOGE("Failed to add doorbell: Invalid notification");
+        return -1;
+    }
+    if (!*table) {
+        *table = calloc(1, sizeof(vm_doorbell_table_t));
+        if (!*table) {
+            ZF_LOGE("Failed to add doorbell: Unable to allocate doorbell table");
+            return -1;
+        }
+    }
+    vm_doorbell_table_t *doorbells = *table;
+    if (doorbells->num_doorbells == doorbells->max_doorbells) {
+        int max_doorbells = doorbells->max_doorbells ? doorbells->max_doorbells * 2 : 4;
+        vm_doorbell_t *entries = realloc(doorbells->doorbells, max_doorbells * sizeof(vm_doorbell_t));
+        if (!entries) {
+            ZF_LOGE("Failed to add doorbell: Unable to grow doorbell table");
+            return -1;
+        }
+        doorbells->doorbells = entries;
+        doorbells->max_doorbells = max_doorbells;
+    }
+    doorbells->doorbells[doorbells->num_doorbells++] = (vm_doorbell_t) {
+        .addr = addr,
+        .size = size,
+        .match_value = match_value,
+        .value = value,
+        .notification = notification
+    };
+    return 0;
+}
+
+int vm_doorbell_remove(vm_doorbell_table_t *table, uintptr_t addr, size_t size)
+{
+    int removed = 0;
+    if (!table) {
+        return -1;
+    }
+    for (int i = 0; i < table->num_doorbells;) {
+        vm_doorbell_t *doorbell = &table->doorbells[i];
+        if (doorbell->addr == addr && doorbell->size == size) {
+            *doorbell = table->doorbells[--table->num_doorbells];
+            removed++;
+        } else {
+            i++;
+        }
+    }
+    return removed ? 0 : -1;
+}
+
+bool vm_doorbell_table_active(vm_doorbell_table_t *table)
+{
+    return table && table->num_doorbells;
+}
+
+void vm_doorbell_table_destroy(vm_doorbell_table_t *table)
+{
+    if (!table) {
+        return;
+    }
+    free(table->doorbells);
+    free(table);
+}
+
+bool vm_doorbell_ring(vm_doorbell_table_t *table, uintptr_t addr, size_t size, seL4_Word value)
+{
+    if (!vm_doorbell_table_active(table)) {
+        return false;
+    }
+    if (size < sizeof(seL4_Word)) {
+        value &= MASK(size * 8);
+    }
+    for (int i = 0; i < table->num_doorbells; i++) {
+        vm_doorbell_t *doorbell = &table->doorbells[i];
+        if (addr < doorbell->addr || addr + size > doorbell->addr + doorbell->size) {
+            continue;
+        }
+        if (doorbell->match_value && doorbell->value != value) {
+            continue;
+        }
+        seL4_Signal(doorbell->notification);
+        return true;
+    }
+    return false;
+}
+
+int vm_register_mmio_doorbell(vm_t *vm, uintptr_t addr, size_t size, bool match_value, seL4_Word value,
+                              seL4_CPtr notification)
+{
+    if (!vm) {
+        ZF_LOGE("Failed to register mmio doorbell: Invalid VM handle");
+        return -1;
+    }
+    return vm_doorbell_add(&vm->mem.doorbells, addr, size, match_value, value, notification);
+}
+
+int vm_deregister_mmio_doorbell(vm_t *vm, uintptr_t addr, size_t size)
+{
+    if (!vm) {
+        ZF_LOGE("Failed to deregister mmio doorbell: Invalid VM handle");
+        return -1;
+    }
+    return vm_doorbell_remove(vm->mem.doorbells, addr, size);
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sel4/sel4.h>
+
+typedef struct vm_doorbell_table vm_doorbell_table_t;
+
+/**
+ * Add a doorbell to a doorbell table, allocating the table if it does not exist yet
+ * @param {vm_doorbell_table_t **} table    Pointer to the doorbell table
+ * @param {uintptr_t} addr                  Base address of the doorbell
+ * @param {size_t} size                     Size of the doorbell
+ * @param {bool} match_value                Whether only writes of 'value' ring the doorbell
+ * @param {seL4_Word} value                 Value to match writes against
+ * @param {seL4_CPtr} notification          Notification to signal
+ * @return                                  0 on success, -1 on error
+ */
+int vm_doorbell_add(vm_doorbell_table_t **table, uintptr_t addr, size_t size, bool match_value, seL4_Word value,
+                    seL4_CPtr notification);
+
+/**
+ * Remove the doorbells registered on a range from a doorbell table
+ * @param {vm_doorbell_table_t *} table     The doorbell table
+ * @param {uintptr_t} addr                  Base address of the doorbell
+ * @param {size_t} size                     Size of the doorbell
+ * @return                                  0 on success, -1 if no doorbell was registered on the range
+ */
+int vm_doorbell_remove(vm_doorbell_table_t *table, uintptr_t addr, size_t size);
+
+/**
+ * Signal the doorbell matching a guest write, if there is one
+ * @param {vm_doorbell_table_t *} table     The doorbell table, may be NULL
+ * @param {uintptr_t} addr                  Address written
+ * @param {size_t} size                     Size of the write in bytes
+ * @param {seL4_Word} value                 Value written
+ * @return                                  true if a doorbell was signalled and the write needs no further handling
+ */
+bool vm_doorbell_ring(vm_doorbell_table_t *table, uintptr_t addr, size_t size, seL4_Word value);
+
+/**
+ * Test whether a doorbell table has any doorbells registered, such that callers can skip fetching the written
+ * value otherwise
+ * @param {vm_doorbell_table_t *} table     The doorbell table, may be NULL
+ * @return                                  true if the table has doorbells registered
+ */
+bool vm_doorbell_table_active(vm_doorbell_table_t *table);
+
+/**
+ * Free a doorbell table and its doorbells. The notifications signalled are not freed
+ * @param {vm_doorbell_table_t *} table     The doorbell table, may be NULL
+ */
+void vm_doorbell_table_destroy(vm_doorbell_table_t *table);
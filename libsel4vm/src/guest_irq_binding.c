@@ -0,0 +1,121 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <limits.h>
+
+#include <sel4/sel4.h>
+#include <utils/util.h>
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_irq_controller.h>
+
+#include "guest_irq_binding.h"
+#include "guest_irq_queue.h"
+
+#define NUM_BADGE_BITS (sizeof(seL4_Word) * CHAR_BIT)
+
+typedef struct irq_binding {
+    vm_vcpu_t *vcpu;
+    int irq;
+    bool level;
+    /* Signalled when the guest acknowledges the irq, seL4_CapNull if not requested */
+    seL4_CPtr resample;
+} irq_binding_t;
+
+/* Bindings are indexed by the bit number of the badge bit they are bound to */
+struct vm_irq_bindings {
+    seL4_Word bound;
+    irq_binding_t bindings[NUM_BADGE_BITS];
+};
+
+static void irq_binding_ack(vm_vcpu_t *vcpu, int irq, void *cookie)
+{
+    irq_binding_t *binding = cookie;
+    if (binding->level) {
+        vm_irq_event_t event = {
+            .type = VM_IRQ_EVENT_LEVEL,
+            .irq = binding->irq,
+            .irq_level = 0,
+        };
+        vm_irq_queue_deliver_arch(binding->vcpu, &event);
+    }
+    if (binding->resample != seL4_CapNull) {
+        /* The backend re-raises the irq if its device still needs servicing */
+        seL4_Signal(binding->resample);
+    }
+}
+
+int vm_bind_notification_irq(vm_vcpu_t *vcpu, seL4_Word badge, int irq, bool level, seL4_CPtr resample)
+{
+    int err;
+    if (!vcpu) {
+        ZF_LOGE("Failed to bind notification irq: Invalid vcpu");
+        return -1;
+    }
+    vm_t *vm = vcpu->vm;
+    if (badge == 0 || (badge & (badge - 1))) {
+        ZF_LOGE("Failed to bind notification irq: Badge 0x%lx is not a single bit", (unsigned long)badge);
+        return -1;
+    }
+    if (!vm->run.irq_bindings) {
+        ps_io_ops_t *ops = vm->io_ops;
+        err = ps_calloc(&ops->malloc_ops, 1, sizeof(vm_irq_bindings_t), (void **)&vm->run.irq_bindings);
+        if (err) {
+            ZF_LOGE("Failed to bind notification irq: Unable to allocate bindings");
+            return -1;
+        }
+    }
+    vm_irq_bindings_t *bindings = vm->run.irq_bindings;
+    if (bindings->bound & badge) {
+        ZF_LOGE("Failed to bind notification irq: Badge 0x%lx is already bound", (unsigned long)badge);
+        return -1;
+    }
+    irq_binding_t *binding = &bindings->bindings[CTZL(badge)];
+    binding->vcpu = vcpu;
+    binding->irq = irq;
+    binding->level = level;
+    binding->resample = resample;
+    err = vm_register_irq(vcpu, irq, irq_binding_ack, binding);
+    if (err) {
+        ZF_LOGE("Failed to bind notification irq: Unable to register irq %d", irq);
+        return -1;
+    }
+    bindings->bound |= badge;
+    return 0;
+}
+
+seL4_Word vm_irq_binding_handle_badge(vm_t *vm, seL4_Word badge)
+{
+    vm_irq_bindings_t *bindings = vm->run.irq_bindings;
+    if (!bindings || !(badge & bindings->bound)) {
+        return badge;
+    }
+    seL4_Word pending = badge & bindings->bound;
+    while (pending) {
+        int bit = CTZL(pending);
+        pending &= ~BIT(bit);
+        irq_binding_t *binding = &bindings->bindings[bit];
+        vm_irq_event_t event = {
+            .type = binding->level ? VM_IRQ_EVENT_LEVEL : VM_IRQ_EVENT_INJECT,
+            .irq = binding->irq,
+            .irq_level = 1,
+        };
+        if (vm_irq_queue_deliver_arch(binding->vcpu, &event)) {
+            ZF_LOGW("Failed to deliver bound irq %d", binding->irq);
+        }
+    }
+    return badge & ~bindings->bound;
+}
+
+void vm_irq_binding_destroy(vm_t *vm)
+{
+    ps_io_ops_t *ops = vm->io_ops;
+    if (!vm->run.irq_bindings) {
+        return;
+    }
+    ps_free(&ops->malloc_ops, sizeof(vm_irq_bindings_t), vm->run.irq_bindings);
+    vm->run.irq_bindings = NULL;
+}
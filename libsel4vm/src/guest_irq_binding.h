@@ -0,0 +1,25 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <sel4vm/guest_vm.h>
+
+/**
+ * Handle the bits of a notification badge bound to irqs with 'vm_bind_notification_irq', delivering the bound irqs
+ * to the VM's interrupt controller. This must only be called by the thread running the boot vcpu, with the VMM lock
+ * held.
+ * @param {vm_t *} vm               A handle to the VM
+ * @param {seL4_Word} badge         Badge received by the VMM
+ * @return                          The badge with the bound bits cleared
+ */
+seL4_Word vm_irq_binding_handle_badge(vm_t *vm, seL4_Word badge);
+
+/**
+ * Free the irq bindings of a VM. The resample notifications are not freed.
+ * @param {vm_t *} vm               A handle to the VM
+ */
+void vm_irq_binding_destroy(vm_t *vm);
@@ -0,0 +1,195 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdlib.h>
+
+#include <sel4/sel4.h>
+#include <utils/util.h>
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_irq_controller.h>
+
+#include "guest_irq_queue.h"
+
+/*
+ * The queue is a bounded ring shared by any number of producer threads and the VMM thread as its only consumer.
+ * Each slot carries a sequence number: a slot at position 'pos' is free for a producer when its sequence equals
+ * 'pos', and holds an event ready for the consumer when its sequence equals 'pos + 1'. Producers claim positions
+ * by advancing 'tail' with a compare-and-swap, the consumer owns 'head'.
+ */
+typedef struct irq_queue_slot {
+    size_t seq;
+    vm_irq_event_t event;
+} irq_queue_slot_t;
+
+struct vm_irq_queue {
+    size_t num_slots;
+    irq_queue_slot_t *slots;
+    size_t tail;
+    size_t head;
+    /* Set once a producer has signalled the VMM and cleared by the VMM before draining */
+    int kick_pending;
+    /* Capability signalled to wake the VMM, the VMM receives it with 'badge' */
+    seL4_CPtr notification;
+    seL4_Word badge;
+};
+
+int vm_irq_queue_init(vm_t *vm, size_t num_events, seL4_CPtr notification, seL4_Word badge)
+{
+    vm_irq_queue_t *queue;
+    int err;
+
+    if (!vm) {
+        ZF_LOGE("Failed to initialise irq queue: Invalid vm");
+        return -1;
+    }
+    if (vm->run.irq_queue) {
+        ZF_LOGE("Failed to initialise irq queue: Queue already initialised");
+        return -1;
+    }
+    if (num_events == 0 || (num_events & (num_events - 1))) {
+        ZF_LOGE("Failed to initialise irq queue: Queue size %zu is not a power of 2", num_events);
+        return -1;
+    }
+    if (badge == 0) {
+        ZF_LOGE("Failed to initialise irq queue: Invalid badge");
+        return -1;
+    }
+    ps_io_ops_t *ops = vm->io_ops;
+    err = ps_calloc(&ops->malloc_ops, 1, sizeof(vm_irq_queue_t), (void **)&queue);
+    if (err) {
+        ZF_LOGE("Failed to initialise irq queue: Unable to allocate queue");
+        return -1;
+    }
+    err = ps_calloc(&ops->malloc_ops, num_events, sizeof(irq_queue_slot_t), (void **)&queue->slots);
+    if (err) {
+        ZF_LOGE("Failed to initialise irq queue: Unable to allocate queue slots");
+        ps_free(&ops->malloc_ops, sizeof(vm_irq_queue_t), queue);
+        return -1;
+    }
+    for (size_t i = 0; i < num_events; i++) {
+        queue->slots[i].seq = i;
+    }
+    queue->num_slots = num_events;
+    queue->notification = notification;
+    queue->badge = badge;
+    __atomic_store_n(&vm->run.irq_queue, queue, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static int irq_queue_post(vm_vcpu_t *vcpu, vm_irq_event_t *event)
+{
+    if (!vcpu) {
+        ZF_LOGE("Failed to post irq: Invalid vcpu");
+        return -1;
+    }
+    vm_irq_queue_t *queue = __atomic_load_n(&vcpu->vm->run.irq_queue, __ATOMIC_ACQUIRE);
+    if (!queue) {
+        ZF_LOGE("Failed to post irq: Queue not initialised");
+        return -1;
+    }
+    event->vcpu_id = vcpu->vcpu_id;
+
+    irq_queue_slot_t *slot;
+    size_t pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+    while (1) {
+        slot = &queue->slots[pos & (queue->num_slots - 1)];
+        size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&queue->tail, &pos, pos + 1, true, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                break;
+            }
+            /* Lost the race for this position, 'pos' has been reloaded */
+        } else if (diff < 0) {
+            ZF_LOGE("Failed to post irq %d: Queue full", event->irq);
+            return -1;
+        } else {
+            pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+        }
+    }
+    slot->event = *event;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+    /* Only the first producer since the VMM last drained the queue needs to wake it */
+    if (!__atomic_exchange_n(&queue->kick_pending, 1, __ATOMIC_SEQ_CST)) {
+        seL4_Signal(queue->notification);
+    }
+    return 0;
+}
+
+int vm_post_irq(vm_vcpu_t *vcpu, int irq)
+{
+    vm_irq_event_t event = {
+        .type = VM_IRQ_EVENT_INJECT,
+        .irq = irq,
+    };
+    return irq_queue_post(vcpu, &event);
+}
+
+int vm_post_irq_level(vm_vcpu_t *vcpu, int irq, int irq_level)
+{
+    vm_irq_event_t event = {
+        .type = VM_IRQ_EVENT_LEVEL,
+        .irq = irq,
+        .irq_level = irq_level,
+    };
+    return irq_queue_post(vcpu, &event);
+}
+
+int vm_irq_queue_drain(vm_t *vm)
+{
+    vm_irq_queue_t *queue = vm->run.irq_queue;
+    int num_events = 0;
+    if (!queue) {
+        return 0;
+    }
+    /* Clear the kick before draining such that events posted from here on signal the VMM again */
+    __atomic_store_n(&queue->kick_pending, 0, __ATOMIC_SEQ_CST);
+    while (1) {
+        irq_queue_slot_t *slot = &queue->slots[queue->head & (queue->num_slots - 1)];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != queue->head + 1) {
+            /* Empty, or the next producer has not finished writing its event */
+            break;
+        }
+        vm_irq_event_t event = slot->event;
+        __atomic_store_n(&slot->seq, queue->head + queue->num_slots, __ATOMIC_RELEASE);
+        queue->head++;
+
+        if (event.vcpu_id >= vm->num_vcpus || !vm->vcpus[event.vcpu_id]) {
+            ZF_LOGE("Dropping irq %d posted to invalid vcpu %u", event.irq, event.vcpu_id);
+            continue;
+        }
+        if (vm_irq_queue_deliver_arch(vm->vcpus[event.vcpu_id], &event)) {
+            ZF_LOGE("Failed to deliver irq %d posted to vcpu %u", event.irq, event.vcpu_id);
+        }
+        num_events++;
+    }
+    return num_events;
+}
+
+seL4_Word vm_irq_queue_handle_badge(vm_t *vm, seL4_Word badge)
+{
+    vm_irq_queue_t *queue = vm->run.irq_queue;
+    if (!queue || !(badge & queue->badge)) {
+        return badge;
+    }
+    vm_irq_queue_drain(vm);
+    return badge & ~queue->badge;
+}
+
+void vm_irq_queue_destroy(vm_t *vm)
+{
+    vm_irq_queue_t *queue = vm->run.irq_queue;
+    ps_io_ops_t *ops = vm->io_ops;
+    if (!queue) {
+        return;
+    }
+    vm->run.irq_queue = NULL;
+    ps_free(&ops->malloc_ops, sizeof(irq_queue_slot_t) * queue->num_slots, queue->slots);
+    ps_free(&ops->malloc_ops, sizeof(vm_irq_queue_t), queue);
+}
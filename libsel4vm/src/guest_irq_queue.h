@@ -0,0 +1,55 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <sel4vm/guest_vm.h>
+
+typedef enum vm_irq_event_type {
+    /* Inject the irq, as with 'vm_inject_irq' */
+    VM_IRQ_EVENT_INJECT,
+    /* Set the level of the irq, as with 'vm_set_irq_level' */
+    VM_IRQ_EVENT_LEVEL,
+} vm_irq_event_type_t;
+
+typedef struct vm_irq_event {
+    vm_irq_event_type_t type;
+    unsigned int vcpu_id;
+    int irq;
+    int irq_level;
+} vm_irq_event_t;
+
+/**
+ * Deliver the irq events posted to the queue of a VM to its interrupt controller. This must only be called by the
+ * thread running the boot vcpu, with the VMM lock held.
+ * @param {vm_t *} vm               A handle to the VM
+ * @return                          Number of events delivered
+ */
+int vm_irq_queue_drain(vm_t *vm);
+
+/**
+ * Handle the bits of a notification badge that belong to the irq queue of a VM, draining the queue if any are set.
+ * The same restrictions as for 'vm_irq_queue_drain' apply.
+ * @param {vm_t *} vm               A handle to the VM
+ * @param {seL4_Word} badge         Badge received by the VMM
+ * @return                          The badge with the irq queue's bits cleared
+ */
+seL4_Word vm_irq_queue_handle_badge(vm_t *vm, seL4_Word badge);
+
+/**
+ * Free the irq queue of a VM, dropping any events still posted. The notification of the queue is not freed, and no
+ * other thread may post to the queue any more.
+ * @param {vm_t *} vm               A handle to the VM
+ */
+void vm_irq_queue_destroy(vm_t *vm);
+
+/**
+ * Deliver a single irq event to the VM's interrupt controller. This is implemented by each architecture.
+ * @param {vm_vcpu_t *} vcpu            A handle to the vcpu the event was posted to
+ * @param {vm_irq_event_t *} event      The event to deliver
+ * @return                              0 on success, -1 on error
+ */
+int vm_irq_queue_deliver_arch(vm_vcpu_t *vcpu, vm_irq_event_t *event);
@@ -4,6 +4,9 @@
  * SPDX-License-Identifier: BSD-2-Clause
  */
 
+#include <autoconf.h>
+#include <sel4vm/gen_config.h>
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,14 +15,30 @@
 
 #include <sel4vm/guest_vm.h>
 #include <sel4vm/guest_memory.h>
+#include <sel4vm/guest_vcpu_fault.h>
+#include <sel4vm/guest_vm_arena.h>
 
 #include "guest_memory.h"
+#include "guest_ram_cache.h"
+#include "guest_mmio_dispatch.h"
+#include "guest_vm_exit_stats.h"
+#include "guest_vm_event_trace.h"
+#include "guest_dirty_log.h"
+#include "guest_ram_share.h"
+#include "vm_lock.h"
 
 typedef enum reservation_type {
     MEM_REGULAR_RES,
     MEM_ANON_RES
 } reservation_type_t;
 
+/* A run of contiguous, equally sized frames larger than a page mapped into a reservation */
+typedef struct frame_run {
+    uintptr_t start;
+    size_t size;
+    size_t size_bits;
+} frame_run_t;
+
 /* VM Memory reservation object: Represents a reservation in the guest VM's memory */
 struct vm_memory_reservation {
     /* Base address of reserved memory region */
@@ -39,17 +58,242 @@ struct vm_memory_reservation {
     reservation_t vspace_reservation;
     /* The type of reservation i.e regular, anonymous */
     reservation_type_t res_type;
+    /* Frames larger than a page that back the reservation. Any address
+     * not covered by a run is backed by a 4K frame */
+    int num_frame_runs;
+    frame_run_t *frame_runs;
+    /* If the reservation is mapped on demand, mapping the faulting page and
+     * 'prefetch_pages' pages after it on each fault */
+    bool lazy_map;
+    size_t prefetch_pages;
+    /* Writes to the reservation buffered for the coalesced mmio flush callback, NULL if not enabled */
+    struct coalesced_mmio *coalesced;
 };
 
+typedef struct coalesced_mmio {
+    size_t num_writes;
+    size_t max_writes;
+    vm_coalesced_write_t *writes;
+    coalesced_mmio_flush_fn flush;
+    void *flush_cookie;
+} coalesced_mmio_t;
+
+/* Space left free in an anonymous region by aligning a reservation, kept for later reservations */
+typedef struct anon_hole {
+    uintptr_t addr;
+    size_t size;
+} anon_hole_t;
+
 typedef struct anon_region {
     uintptr_t addr;
     size_t size;
+    /* Reservations are made from the holes, then from alloc_addr up */
     uintptr_t alloc_addr;
     reservation_t vspace_reservation;
+    /* Reservations of the region, sorted by address */
     int num_reservations;
+    int max_reservations;
     vm_memory_reservation_t **reservations;
+    /* Holes below alloc_addr, sorted by address */
+    int num_holes;
+    int max_holes;
+    anon_hole_t *holes;
+    /* Next anonymous region of the vm, in order of address */
+    struct anon_region *next;
 } anon_region_t;
 
+/* Number of reservations cached per vcpu by the memory fault handler */
+#define MEM_FAULT_CACHE_SIZE 4
+
+/* Per-vcpu cache of the most recently faulted on reservations, ordered from most to least recently used */
+struct vm_memory_fault_cache {
+    vm_memory_reservation_t *entries[MEM_FAULT_CACHE_SIZE];
+    uint64_t hits;
+    uint64_t misses;
+};
+
+static vm_memory_reservation_t *fault_cache_lookup(vm_vcpu_t *vcpu, uintptr_t addr, size_t size)
+{
+    vm_memory_fault_cache_t *cache = vcpu->mem_fault_cache;
+    if (!cache) {
+        return NULL;
+    }
+    for (int i = 0; i < MEM_FAULT_CACHE_SIZE; i++) {
+        vm_memory_reservation_t *res = cache->entries[i];
+        if (!res) {
+            break;
+        }
+        if (res->addr <= addr && addr + size <= res->addr + res->size) {
+            /* Move the entry to the front */
+            memmove(&cache->entries[1], &cache->entries[0], sizeof(vm_memory_reservation_t *) * i);
+            cache->entries[0] = res;
+            cache->hits++;
+            return res;
+        }
+    }
+    cache->misses++;
+    return NULL;
+}
+
+static void fault_cache_insert(vm_vcpu_t *vcpu, vm_memory_reservation_t *reservation)
+{
+    vm_memory_fault_cache_t *cache = vcpu->mem_fault_cache;
+    if (!cache) {
+        return;
+    }
+    /* Evict the least recently used entry */
+    memmove(&cache->entries[1], &cache->entries[0], sizeof(vm_memory_reservation_t *) * (MEM_FAULT_CACHE_SIZE - 1));
+    cache->entries[0] = reservation;
+}
+
+static void fault_cache_invalidate(vm_t *vm, vm_memory_reservation_t *reservation)
+{
+    for (int i = 0; i < vm->num_vcpus; i++) {
+        vm_memory_fault_cache_t *cache = vm->vcpus[i]->mem_fault_cache;
+        if (!cache) {
+            continue;
+        }
+        for (int j = 0; j < MEM_FAULT_CACHE_SIZE; j++) {
+            if (cache->entries[j] == reservation) {
+                memmove(&cache->entries[j], &cache->entries[j + 1],
+                        sizeof(vm_memory_reservation_t *) * (MEM_FAULT_CACHE_SIZE - j - 1));
+                cache->entries[MEM_FAULT_CACHE_SIZE - 1] = NULL;
+                break;
+            }
+        }
+    }
+}
+
+#ifdef CONFIG_LIB_SEL4VM_FLAT_RESERVATION_INDEX
+
+/* Reservations are kept in a single index sorted by address, covering both regular reservations and
+ * anonymous regions. Lookups binary search a packed array of keys, the corresponding node holds the
+ * reservation data */
+typedef struct res_key {
+    uintptr_t addr;
+    size_t size;
+} res_key_t;
+
+typedef struct res_node {
+    uintptr_t addr;
+    size_t size;
+    reservation_type_t res_type;
+    void *data;
+} res_node_t;
+
+struct vm_memory_reservation_cookie {
+    int num_nodes;
+    int max_nodes;
+    res_key_t *keys;
+    res_node_t *nodes;
+    /* The anonymous regions, in order of address */
+    anon_region_t *anon_regions;
+    /* Serialises changes to the reservations against their lookups */
+    vm_rwlock_t lock;
+};
+
+/* Returns the index of the first key with an address greater than 'addr' */
+static int res_index_upper_bound(vm_memory_reservation_cookie_t *res_cookie, uintptr_t addr)
+{
+    int low = 0;
+    int high = res_cookie->num_nodes;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (res_cookie->keys[mid].addr <= addr) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+static res_node_t *find_memory_reservation_by_addr(vm_t *vm, uintptr_t addr)
+{
+    vm_memory_reservation_cookie_t *res_cookie = vm->mem.reservation_cookie;
+    if (!res_cookie) {
+        ZF_LOGE("Failed to find memory reservation: VM memory backend not initialised");
+        return NULL;
+    }
+    /* The candidate is the last reservation starting at or below the address */
+    int idx = res_index_upper_bound(res_cookie, addr) - 1;
+    if (idx < 0) {
+        return NULL;
+    }
+    res_key_t *key = &res_cookie->keys[idx];
+    if (addr - key->addr >= key->size) {
+        return NULL;
+    }
+    return &res_cookie->nodes[idx];
+}
+
+static void remove_memory_reservation_node(vm_t *vm,  uintptr_t addr, size_t size, reservation_type_t res_type)
+{
+    vm_memory_reservation_cookie_t *res_cookie = vm->mem.reservation_cookie;
+    if (!res_cookie) {
+        ZF_LOGE("Failed to find memory reservation: VM memory backend not initialised");
+        return;
+    }
+    int idx = res_index_upper_bound(res_cookie, addr) - 1;
+    if (idx < 0) {
+        /* No node found */
+        return;
+    }
+    /* Region needs to be an exact match */
+    res_node_t *node = &res_cookie->nodes[idx];
+    if (node->addr != addr || node->size != size || node->res_type != res_type) {
+        return;
+    }
+    res_cookie->num_nodes--;
+    memmove(&res_cookie->keys[idx], &res_cookie->keys[idx + 1], sizeof(res_key_t) * (res_cookie->num_nodes - idx));
+    memmove(&res_cookie->nodes[idx], &res_cookie->nodes[idx + 1], sizeof(res_node_t) * (res_cookie->num_nodes - idx));
+}
+
+static int add_memory_reservation_node(vm_t *vm, uintptr_t addr, size_t size, reservation_type_t res_type, void *data)
+{
+    vm_memory_reservation_cookie_t *res_cookie = vm->mem.reservation_cookie;
+    if (!res_cookie) {
+        ZF_LOGE("Failed to find memory reservation: VM memory backend not initialised");
+        return -1;
+    }
+    /* New node is inserted before the first reservation starting above it. Check it doesn't
+     * intersect either of its neighbours */
+    int idx = res_index_upper_bound(res_cookie, addr);
+    if ((idx > 0 && res_cookie->keys[idx - 1].addr + res_cookie->keys[idx - 1].size > addr) ||
+        (idx < res_cookie->num_nodes && res_cookie->keys[idx].addr < addr + size)) {
+        ZF_LOGE("Failed to add memory reservation: Reservation region already exists");
+        return -1;
+    }
+    if (res_cookie->num_nodes == res_cookie->max_nodes) {
+        int max_nodes = res_cookie->max_nodes ? res_cookie->max_nodes * 2 : 16;
+        res_key_t *keys = realloc(res_cookie->keys, sizeof(res_key_t) * max_nodes);
+        if (!keys) {
+            ZF_LOGE("Failed to add memory reservation: Unable to grow reservation index");
+            return -1;
+        }
+        res_cookie->keys = keys;
+        res_node_t *nodes = realloc(res_cookie->nodes, sizeof(res_node_t) * max_nodes);
+        if (!nodes) {
+            ZF_LOGE("Failed to add memory reservation: Unable to grow reservation index");
+            return -1;
+        }
+        res_cookie->nodes = nodes;
+        res_cookie->max_nodes = max_nodes;
+    }
+    memmove(&res_cookie->keys[idx + 1], &res_cookie->keys[idx], sizeof(res_key_t) * (res_cookie->num_nodes - idx));
+    memmove(&res_cookie->nodes[idx + 1], &res_cookie->nodes[idx], sizeof(res_node_t) * (res_cookie->num_nodes - idx));
+    res_cookie->keys[idx].addr = addr;
+    res_cookie->keys[idx].size = size;
+    res_cookie->nodes[idx].addr = addr;
+    res_cookie->nodes[idx].size = size;
+    res_cookie->nodes[idx].res_type = res_type;
+    res_cookie->nodes[idx].data = data;
+    res_cookie->num_nodes++;
+    return 0;
+}
+
+#else
+
 typedef struct res_tree {
     uintptr_t addr;
     size_t size;
@@ -60,6 +304,8 @@ typedef struct res_tree {
     struct res_tree *right;
 } res_tree;
 
+typedef res_tree res_node_t;
+
 static inline int reservation_node_cmp(res_tree *x, res_tree *y)
 {
     if (x->addr < y->addr) {
@@ -83,6 +329,10 @@ SGLIB_DEFINE_RBTREE_FUNCTIONS(res_tree, left, right, color_field, reservation_no
 struct vm_memory_reservation_cookie {
     struct res_tree *regular_res_tree;
     struct res_tree *anon_res_tree;
+    /* The anonymous regions, in order of address */
+    anon_region_t *anon_regions;
+    /* Serialises changes to the reservations against their lookups */
+    vm_rwlock_t lock;
 };
 
 static res_tree *find_memory_reservation_by_addr(vm_t *vm, uintptr_t addr)
@@ -131,6 +381,7 @@ static void remove_memory_reservation_node(vm_t *vm,  uintptr_t addr, size_t siz
     /* Region needs to be an exact match */
     if ((result_node->addr == search_node.addr) && (result_node->size == search_node.size)) {
         sglib_res_tree_delete(&tree, result_node);
+        vm_arena_free(vm, sizeof(res_tree), result_node);
         if (res_type == MEM_REGULAR_RES) {
             res_cookie->regular_res_tree = tree;
         } else {
@@ -142,10 +393,8 @@ static void remove_memory_reservation_node(vm_t *vm,  uintptr_t addr, size_t siz
 
 static int add_memory_reservation_node(vm_t *vm, uintptr_t addr, size_t size, reservation_type_t res_type, void *data)
 {
-    int err;
     res_tree *tree;
     res_tree *result_node;
-    ps_io_ops_t *ops = vm->io_ops;
     vm_memory_reservation_cookie_t *res_cookie = vm->mem.reservation_cookie;
     if (!res_cookie) {
         ZF_LOGE("Failed to find memory reservation: VM memory backend not initialised");
@@ -162,8 +411,8 @@ static int add_memory_reservation_node(vm_t *vm, uintptr_t addr, size_t size, re
 
     res_tree *found_node = sglib_res_tree_find_member(tree, &search_node);
     if (found_node == NULL) {
-        err = ps_calloc(&ops->malloc_ops, 1, sizeof(res_tree), (void **)&result_node);
-        if (err) {
+        result_node = vm_arena_alloc(vm, sizeof(res_tree));
+        if (!result_node) {
             ZF_LOGE("Failed to add memory reservation: Unable to allocate new reservation node");
             return -1;
         }
@@ -184,28 +433,44 @@ static int add_memory_reservation_node(vm_t *vm, uintptr_t addr, size_t size, re
     return 0;
 }
 
-static anon_region_t *find_allocable_anon_region(vm_t *vm, size_t size, size_t align)
+#endif /* CONFIG_LIB_SEL4VM_FLAT_RESERVATION_INDEX */
+
+void vm_memory_read_lock(vm_t *vm)
 {
-    res_tree *anon_tree;
-    res_tree *anon_node;
-    anon_region_t *ret_region = NULL;
-    struct sglib_res_tree_iterator it;
-    vm_memory_reservation_cookie_t *res_cookie = vm->mem.reservation_cookie;
-    if (!res_cookie) {
-        return NULL;
+    if (vm && vm->mem.reservation_cookie) {
+        vm_rwlock_read_acquire(&vm->mem.reservation_cookie->lock);
     }
-    anon_tree = res_cookie->anon_res_tree;
-    for (anon_node = sglib_res_tree_it_init_inorder(&it, anon_tree); anon_node != NULL;
-         anon_node = sglib_res_tree_it_next(&it)) {
-        anon_region_t *curr_region = (anon_region_t *)anon_node->data;
-        uintptr_t allocable_addr = ROUND_UP(curr_region->alloc_addr, (uintptr_t) align);
-        size_t free_area_size = curr_region->size - (allocable_addr - curr_region->addr);
-        if (size <= free_area_size) {
-            ret_region = curr_region;
-            break;
-        }
+}
+
+void vm_memory_read_unlock(vm_t *vm)
+{
+    if (vm && vm->mem.reservation_cookie) {
+        vm_rwlock_read_release(&vm->mem.reservation_cookie->lock);
+    }
+}
+
+void vm_memory_write_lock(vm_t *vm)
+{
+    if (vm && vm->mem.reservation_cookie) {
+        vm_rwlock_write_acquire(&vm->mem.reservation_cookie->lock);
+    }
+}
+
+void vm_memory_write_unlock(vm_t *vm)
+{
+    if (vm && vm->mem.reservation_cookie) {
+        vm_rwlock_write_release(&vm->mem.reservation_cookie->lock);
+    }
+}
+
+/* Free the heap allocations hanging off a reservation, the reservation itself is in the arena */
+static void free_reservation_data(vm_memory_reservation_t *reservation)
+{
+    free(reservation->frame_runs);
+    if (reservation->coalesced) {
+        free(reservation->coalesced->writes);
+        free(reservation->coalesced);
     }
-    return ret_region;
 }
 
 static void free_vm_reservation(vm_t *vm, vm_memory_reservation_t *reservation)
@@ -213,18 +478,119 @@ static void free_vm_reservation(vm_t *vm, vm_memory_reservation_t *reservation)
     if (!vm || !reservation) {
         return;
     }
-    ps_io_ops_t *ops = vm->io_ops;
-    ps_free(&ops->malloc_ops, sizeof(vm_memory_reservation_t), reservation);
+    free_reservation_data(reservation);
+    vm_arena_free(vm, sizeof(vm_memory_reservation_t), reservation);
+}
+
+static size_t reservation_frame_bits(vm_memory_reservation_t *reservation, uintptr_t addr)
+{
+    for (int i = 0; i < reservation->num_frame_runs; i++) {
+        frame_run_t *run = &reservation->frame_runs[i];
+        if (run->start <= addr && addr < run->start + run->size) {
+            return run->size_bits;
+        }
+    }
+    return seL4_PageBits;
+}
+
+static bool reservation_frame_mapped(vm_t *vm, vm_memory_reservation_t *reservation, uintptr_t addr)
+{
+    /* Runs are only recorded for large frames that have been mapped */
+    if (reservation_frame_bits(reservation, addr) != seL4_PageBits) {
+        return true;
+    }
+    return vspace_get_cap(&vm->mem.vm_vspace, (void *)PAGE_ALIGN_4K(addr)) != seL4_CapNull;
+}
+
+static int add_reservation_frame_run(vm_memory_reservation_t *reservation, uintptr_t vaddr, size_t size_bits)
+{
+    if (reservation->num_frame_runs) {
+        frame_run_t *last = &reservation->frame_runs[reservation->num_frame_runs - 1];
+        if (last->size_bits == size_bits && last->start + last->size == vaddr) {
+            last->size += BIT(size_bits);
+            return 0;
+        }
+    }
+    frame_run_t *extended_runs = realloc(reservation->frame_runs,
+                                         sizeof(frame_run_t) * (reservation->num_frame_runs + 1));
+    if (!extended_runs) {
+        return -1;
+    }
+    reservation->frame_runs = extended_runs;
+    reservation->frame_runs[reservation->num_frame_runs].start = vaddr;
+    reservation->frame_runs[reservation->num_frame_runs].size = BIT(size_bits);
+    reservation->frame_runs[reservation->num_frame_runs].size_bits = size_bits;
+    reservation->num_frame_runs++;
+    return 0;
+}
+
+static void unmap_reservation_frames(vm_t *vm, vm_memory_reservation_t *reservation)
+{
+    uintptr_t current_addr = PAGE_ALIGN_4K(reservation->addr);
+    uintptr_t end_addr = reservation->addr + reservation->size;
+    while (current_addr < end_addr) {
+        size_t size_bits = reservation_frame_bits(reservation, current_addr);
+        /* Lazily mapped reservations may not have all their frames mapped */
+        if (!reservation->lazy_map || reservation_frame_mapped(vm, reservation, current_addr)) {
+            vspace_unmap_pages(&vm->mem.vm_vspace, (void *)current_addr, 1, size_bits, vm->vka);
+        }
+        current_addr += BIT(size_bits);
+    }
+}
+
+/* Map the frames of a reservation covering [start, end). Frames of lazily mapped reservations that have
+ * already been mapped are skipped */
+static int map_reservation_frames(vm_t *vm, vm_memory_reservation_t *vm_reservation, uintptr_t start, uintptr_t end,
+                                  memory_map_iterator_fn map_iterator, void *map_cookie)
+{
+    int err;
+    uintptr_t reservation_addr = vm_reservation->addr;
+    size_t reservation_size = vm_reservation->size;
+    uintptr_t current_addr = start;
+
+    while (current_addr < end) {
+        if (vm_reservation->lazy_map && reservation_frame_mapped(vm, vm_reservation, current_addr)) {
+            size_t size_bits = reservation_frame_bits(vm_reservation, current_addr);
+            current_addr = ROUND_DOWN(current_addr, BIT(size_bits)) + BIT(size_bits);
+            continue;
+        }
+        vm_frame_t reservation_frame = map_iterator(current_addr, map_cookie);
+        if (reservation_frame.cptr == seL4_CapNull) {
+            ZF_LOGE("Failed to get frame for reservation address 0x%lx", current_addr);
+            return -1;
+        }
+        if (reservation_frame.size_bits > seL4_PageBits) {
+            /* Frames larger than a page must be aligned and lie within the reservation */
+            if (reservation_frame.vaddr != current_addr || !IS_ALIGNED(reservation_frame.vaddr, reservation_frame.size_bits) ||
+                reservation_frame.vaddr + BIT(reservation_frame.size_bits) > reservation_addr + reservation_size) {
+                ZF_LOGE("Invalid frame of size bits %zu for reservation address 0x%x", reservation_frame.size_bits,
+                        current_addr);
+                return -1;
+            }
+            err = add_reservation_frame_run(vm_reservation, reservation_frame.vaddr, reservation_frame.size_bits);
+            if (err) {
+                ZF_LOGE("Failed to record frame for reservation address 0x%x", current_addr);
+                return -1;
+            }
+        }
+        int ret = vspace_deferred_rights_map_pages_at_vaddr(&vm->mem.vm_vspace, &reservation_frame.cptr,
+                                                            &reservation_frame.cookie,
+                                                            (void *)reservation_frame.vaddr, 1, reservation_frame.size_bits,
+                                                            reservation_frame.rights, vm_reservation->vspace_reservation);
+        if (ret) {
+            ZF_LOGE("Failed to map address 0x%x into guest vm vspace", reservation_frame.vaddr);
+            return -1;
+        }
+        current_addr += BIT(reservation_frame.size_bits);
+    }
+    return 0;
 }
 
 static vm_memory_reservation_t *allocate_vm_reservation(vm_t *vm, uintptr_t addr, size_t size,
                                                         reservation_t vspace_reservation)
 {
-    int err;
-    ps_io_ops_t *ops = vm->io_ops;
-    vm_memory_reservation_t *new_reservation;
-    err = ps_calloc(&ops->malloc_ops, 1, sizeof(vm_memory_reservation_t), (void **)&new_reservation);
-    if (err) {
+    vm_memory_reservation_t *new_reservation = vm_arena_alloc(vm, sizeof(vm_memory_reservation_t));
+    if (!new_reservation) {
         ZF_LOGE("Failed to allocate vm reservation: Unable to allocate new vm memory reservation");
         return NULL;
     }
@@ -236,48 +602,179 @@ static vm_memory_reservation_t *allocate_vm_reservation(vm_t *vm, uintptr_t addr
     return new_reservation;
 }
 
+/* Returns the index of the first reservation of an anonymous region starting above 'addr' */
+static int anon_reservation_upper_bound(anon_region_t *anon_region, uintptr_t addr)
+{
+    int low = 0;
+    int high = anon_region->num_reservations;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (anon_region->reservations[mid]->addr <= addr) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
 static vm_memory_reservation_t *find_anon_reservation_by_addr(uintptr_t addr, size_t size,
                                                               anon_region_t *anon_region)
 {
-    int num_anon_reservations;
-    vm_memory_reservation_t **reservations;
-
     if (!anon_region) {
         ZF_LOGE("Failed to find anonymous reservation: anon region NULL");
         return NULL;
     }
-    num_anon_reservations = anon_region->num_reservations;
-    reservations = anon_region->reservations;
-
-    if (!reservations) {
+    if (!anon_region->reservations) {
         ZF_LOGE("Failed to find anonymous reservation: anon region has no reservations");
         return NULL;
     }
 
-    for (int i = 0; i < num_anon_reservations; i++) {
-        vm_memory_reservation_t *curr_res = reservations[i];
-        if (curr_res->addr <= addr && curr_res->addr + curr_res->size >= addr + size) {
-            return curr_res;
+    /* The candidate is the last reservation starting at or below the address */
+    int idx = anon_reservation_upper_bound(anon_region, addr) - 1;
+    if (idx < 0) {
+        return NULL;
+    }
+    vm_memory_reservation_t *curr_res = anon_region->reservations[idx];
+    if (curr_res->addr + curr_res->size >= addr + size) {
+        return curr_res;
+    }
+    return NULL;
+}
+
+/* Find where a reservation fits in an anonymous region, in the first hole it fits in or else
+ * past the last reservation. 'hole' is set to the index of the hole, -1 for past the last reservation */
+static bool anon_region_fit(anon_region_t *region, size_t size, size_t align, uintptr_t *addr, int *hole)
+{
+    for (int i = 0; i < region->num_holes; i++) {
+        anon_hole_t *curr_hole = &region->holes[i];
+        uintptr_t hole_addr = ROUND_UP(curr_hole->addr, (uintptr_t) align);
+        if (hole_addr - curr_hole->addr < curr_hole->size && size <= curr_hole->size - (hole_addr - curr_hole->addr)) {
+            *addr = hole_addr;
+            *hole = i;
+            return true;
         }
     }
+    uintptr_t allocable_addr = ROUND_UP(region->alloc_addr, (uintptr_t) align);
+    if (allocable_addr < region->alloc_addr || allocable_addr - region->addr > region->size) {
+        return false;
+    }
+    if (size <= region->size - (allocable_addr - region->addr)) {
+        *addr = allocable_addr;
+        *hole = -1;
+        return true;
+    }
+    return false;
+}
 
+static anon_region_t *find_allocable_anon_region(vm_t *vm, size_t size, size_t align, uintptr_t *addr, int *hole)
+{
+    vm_memory_reservation_cookie_t *res_cookie = vm->mem.reservation_cookie;
+    if (!res_cookie) {
+        return NULL;
+    }
+    for (anon_region_t *curr_region = res_cookie->anon_regions; curr_region; curr_region = curr_region->next) {
+        if (anon_region_fit(curr_region, size, align, addr, hole)) {
+            return curr_region;
+        }
+    }
     return NULL;
 }
 
-memory_fault_result_t vm_memory_handle_fault(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t addr, size_t size)
+/* Insert a hole before index 'idx' of an anonymous region's holes */
+static int anon_region_insert_hole(anon_region_t *region, int idx, uintptr_t addr, size_t size)
+{
+    if (region->num_holes == region->max_holes) {
+        int max_holes = region->max_holes ? region->max_holes * 2 : 4;
+        anon_hole_t *holes = realloc(region->holes, sizeof(anon_hole_t) * max_holes);
+        if (!holes) {
+            return -1;
+        }
+        region->holes = holes;
+        region->max_holes = max_holes;
+    }
+    memmove(&region->holes[idx + 1], &region->holes[idx], sizeof(anon_hole_t) * (region->num_holes - idx));
+    region->holes[idx].addr = addr;
+    region->holes[idx].size = size;
+    region->num_holes++;
+    return 0;
+}
+
+/* Take the space of a reservation fitted by anon_region_fit out of an anonymous region */
+static int anon_region_take(anon_region_t *region, uintptr_t addr, size_t size, int hole)
+{
+    if (hole < 0) {
+        if (addr > region->alloc_addr &&
+            anon_region_insert_hole(region, region->num_holes, region->alloc_addr, addr - region->alloc_addr)) {
+            return -1;
+        }
+        region->alloc_addr = addr + size;
+        return 0;
+    }
+    anon_hole_t *curr_hole = &region->holes[hole];
+    uintptr_t hole_end = curr_hole->addr + curr_hole->size;
+    if (addr > curr_hole->addr) {
+        /* Keep the front of the hole, and add what is left past the reservation after it */
+        curr_hole->size = addr - curr_hole->addr;
+        if (addr + size < hole_end) {
+            return anon_region_insert_hole(region, hole + 1, addr + size, hole_end - (addr + size));
+        }
+    } else if (addr + size < hole_end) {
+        curr_hole->addr = addr + size;
+        curr_hole->size = hole_end - (addr + size);
+    } else {
+        region->num_holes--;
+        memmove(&region->holes[hole], &region->holes[hole + 1], sizeof(anon_hole_t) * (region->num_holes - hole));
+    }
+    return 0;
+}
+
+static vm_memory_reservation_t *find_reservation_at(vm_t *vm, uintptr_t addr)
+{
+    res_node_t *reservation_node = find_memory_reservation_by_addr(vm, addr);
+    if (!reservation_node) {
+        return NULL;
+    }
+    if (reservation_node->res_type == MEM_REGULAR_RES) {
+        return (vm_memory_reservation_t *)reservation_node->data;
+    }
+    return find_anon_reservation_by_addr(addr, 1, (anon_region_t *)reservation_node->data);
+}
+
+static int vm_memory_reservation_base_locked(vm_t *vm, uintptr_t addr, uintptr_t *base)
+{
+    vm_memory_reservation_t *reservation = find_reservation_at(vm, addr);
+    if (!reservation) {
+        return -1;
+    }
+    *base = reservation->addr;
+    return 0;
+}
+
+int vm_memory_reservation_base(vm_t *vm, uintptr_t addr, uintptr_t *base)
+{
+    vm_memory_read_lock(vm);
+    int result = vm_memory_reservation_base_locked(vm, addr, base);
+    vm_memory_read_unlock(vm);
+    return result;
+}
+
+static vm_memory_reservation_t *find_fault_reservation(vm_t *vm, uintptr_t addr, size_t size,
+                                                       memory_fault_result_t *result)
 {
-    int err;
-    res_tree *reservation_node = find_memory_reservation_by_addr(vm, addr);
     vm_memory_reservation_t *fault_reservation;
+    res_node_t *reservation_node = find_memory_reservation_by_addr(vm, addr);
 
     if (!reservation_node) {
         ZF_LOGW("Unable to find reservation for addr: 0x%x, memory fault left unhandled", addr);
-        return FAULT_UNHANDLED;
+        *result = FAULT_UNHANDLED;
+        return NULL;
     }
 
     if ((reservation_node->addr + size) > (reservation_node->addr + reservation_node->size)) {
         ZF_LOGE("Failed to handle memory fault: Invalid fault region");
-        return FAULT_ERROR;
+        *result = FAULT_ERROR;
+        return NULL;
     }
 
     if (reservation_node->res_type == MEM_REGULAR_RES) {
@@ -287,11 +784,56 @@ memory_fault_result_t vm_memory_handle_fault(vm_t *vm, vm_vcpu_t *vcpu, uintptr_
                                                           (anon_region_t *)reservation_node->data);
         if (!fault_reservation) {
             ZF_LOGW("Unable to find anoymous reservation for addr: 0x%x, memory fault left unhandled", addr);
-            return FAULT_UNHANDLED;
+            *result = FAULT_UNHANDLED;
+            return NULL;
         }
     }
+    return fault_reservation;
+}
 
-    if (!fault_reservation->is_mapped && fault_reservation->memory_map_iterator) {
+static void coalesced_mmio_flush(vm_t *vm, coalesced_mmio_t *coalesced)
+{
+    if (coalesced->num_writes) {
+        coalesced->flush(vm, coalesced->writes, coalesced->num_writes, coalesced->flush_cookie);
+        coalesced->num_writes = 0;
+    }
+}
+
+/* Handle a fault on the vm's memory, leaving 'callback_reservation' set to the reservation whose fault callback is left
+ * to handle the fault. Called with the memory lock held for writing */
+static memory_fault_result_t resolve_memory_fault(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t addr, size_t size,
+                                                  vm_memory_reservation_t **callback_reservation)
+{
+    int err;
+    if (vm_ram_share_handle_fault(vm, addr) || vm_dirty_log_handle_fault(vm, addr)) {
+        return FAULT_RESTART;
+    }
+    vm_memory_reservation_t *fault_reservation = fault_cache_lookup(vcpu, addr, size);
+
+    if (!fault_reservation) {
+        memory_fault_result_t result;
+        fault_reservation = find_fault_reservation(vm, addr, size, &result);
+        if (!fault_reservation) {
+            return result;
+        }
+        fault_cache_insert(vcpu, fault_reservation);
+    }
+
+    if (fault_reservation->lazy_map && !reservation_frame_mapped(vm, fault_reservation, addr)) {
+        /* Map the faulting page along with a window of the pages that follow it */
+        uintptr_t map_start = PAGE_ALIGN_4K(addr);
+        uintptr_t map_end = MIN(ROUND_UP(fault_reservation->addr + fault_reservation->size, PAGE_SIZE_4K),
+                                map_start + PAGE_SIZE_4K * (fault_reservation->prefetch_pages + 1));
+        err = map_reservation_frames(vm, fault_reservation, map_start, map_end,
+                                     fault_reservation->memory_map_iterator, fault_reservation->memory_iterator_cookie);
+        if (err) {
+            ZF_LOGE("Unable to handle memory fault: Failed to map memory");
+            return FAULT_ERROR;
+        }
+        return FAULT_RESTART;
+    }
+
+    if (!fault_reservation->is_mapped && !fault_reservation->lazy_map && fault_reservation->memory_map_iterator) {
         /* Deferred mapping */
         err = map_vm_memory_reservation(vm, fault_reservation,
                                         fault_reservation->memory_map_iterator, fault_reservation->memory_iterator_cookie);
@@ -302,15 +844,56 @@ memory_fault_result_t vm_memory_handle_fault(vm_t *vm, vm_vcpu_t *vcpu, uintptr_
         return FAULT_RESTART;
     }
 
+    if (fault_reservation->coalesced) {
+        coalesced_mmio_t *coalesced = fault_reservation->coalesced;
+        if (!is_vcpu_read_fault(vcpu)) {
+            if (coalesced->num_writes == coalesced->max_writes) {
+                coalesced_mmio_flush(vm, coalesced);
+            }
+            coalesced->writes[coalesced->num_writes++] = (vm_coalesced_write_t) {
+                .addr = addr,
+                .size = size,
+                .value = get_vcpu_fault_data(vcpu),
+            };
+            advance_vcpu_fault(vcpu);
+            return FAULT_HANDLED;
+        }
+        /* Reads observe the effects of all the writes before them */
+        coalesced_mmio_flush(vm, coalesced);
+    }
+
     if (!fault_reservation->fault_callback) {
         return FAULT_ERROR;
     }
+    *callback_reservation = fault_reservation;
+    return FAULT_HANDLED;
+}
 
-    return fault_reservation->fault_callback(vm, vcpu, addr, size, fault_reservation->fault_callback_cookie);
+memory_fault_result_t vm_memory_handle_fault(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t addr, size_t size)
+{
+    vm_memory_reservation_t *fault_reservation = NULL;
+    vm_memory_write_lock(vm);
+    memory_fault_result_t result = resolve_memory_fault(vm, vcpu, addr, size, &fault_reservation);
+    vm_memory_write_unlock(vm);
+    if (!fault_reservation) {
+        return result;
+    }
+
+    /* The callback runs without the memory lock, such that it can access guest memory from other threads */
+    vm_event_trace_mmio_enter(vcpu, addr, size);
+#ifdef CONFIG_LIB_SEL4VM_EXIT_STATS
+    uint64_t callback_start = vm_exit_stats_timestamp();
+#endif
+    result = fault_reservation->fault_callback(vm, vcpu, addr, size, fault_reservation->fault_callback_cookie);
+#ifdef CONFIG_LIB_SEL4VM_EXIT_STATS
+    vm_exit_stats_record_mmio(vm, fault_reservation->addr, vm_exit_stats_timestamp() - callback_start);
+#endif
+    vm_event_trace(vcpu, VM_EVENT_TRACE_MMIO_EXIT, result, addr, 0);
+    return result;
 }
 
-vm_memory_reservation_t *vm_reserve_memory_at(vm_t *vm, uintptr_t addr, size_t size,
-                                              memory_fault_callback_fn fault_callback, void *cookie)
+static vm_memory_reservation_t *vm_reserve_memory_at_locked(vm_t *vm, uintptr_t addr, size_t size,
+                                                            memory_fault_callback_fn fault_callback, void *cookie)
 {
     int err;
     vm_memory_reservation_t *new_reservation;
@@ -346,10 +929,21 @@ vm_memory_reservation_t *vm_reserve_memory_at(vm_t *vm, uintptr_t addr, size_t s
         free_vm_reservation(vm, new_reservation);
         return NULL;
     }
+    /* Sub-page reservations are typically emulated device registers, let their faults bypass the reservation search */
+    vm_mmio_dispatch_add(vm, addr, size, fault_callback, cookie);
     return new_reservation;
 }
 
-int vm_memory_make_anon(vm_t *vm, uintptr_t addr, size_t size)
+vm_memory_reservation_t *vm_reserve_memory_at(vm_t *vm, uintptr_t addr, size_t size,
+                                              memory_fault_callback_fn fault_callback, void *cookie)
+{
+    vm_memory_write_lock(vm);
+    vm_memory_reservation_t *result = vm_reserve_memory_at_locked(vm, addr, size, fault_callback, cookie);
+    vm_memory_write_unlock(vm);
+    return result;
+}
+
+static int vm_memory_make_anon_locked(vm_t *vm, uintptr_t addr, size_t size)
 {
     int err;
     reservation_t vspace_reservation = vspace_reserve_deferred_rights_range_at(&vm->mem.vm_vspace, (void *)addr,
@@ -359,10 +953,8 @@ int vm_memory_make_anon(vm_t *vm, uintptr_t addr, size_t size)
         return -1;
     }
 
-    anon_region_t *region_data;
-    ps_io_ops_t *ops = vm->io_ops;
-    err = ps_calloc(&ops->malloc_ops, 1, sizeof(anon_region_t), (void **)&region_data);
-    if (err) {
+    anon_region_t *region_data = vm_arena_alloc(vm, sizeof(anon_region_t));
+    if (!region_data) {
         ZF_LOGE("Failed to make anonymous memory region : Unable to allocate anonymous region");
         return -1;
     }
@@ -376,33 +968,49 @@ int vm_memory_make_anon(vm_t *vm, uintptr_t addr, size_t size)
     if (err) {
         ZF_LOGE("Failed to reserve vm memory: Unable to add vm memory reservation to list");
         vspace_free_reservation(&vm->mem.vm_vspace, vspace_reservation);
-        ps_free(&ops->malloc_ops, sizeof(anon_region_t), region_data);
+        vm_arena_free(vm, sizeof(anon_region_t), region_data);
         return -1;
     }
+
+    anon_region_t **prev = &vm->mem.reservation_cookie->anon_regions;
+    while (*prev && (*prev)->addr < addr) {
+        prev = &(*prev)->next;
+    }
+    region_data->next = *prev;
+    *prev = region_data;
     return 0;
 }
 
-vm_memory_reservation_t *vm_reserve_anon_memory(vm_t *vm, size_t size, size_t align,
-                                                memory_fault_callback_fn fault_callback, void *cookie, uintptr_t *addr)
+int vm_memory_make_anon(vm_t *vm, uintptr_t addr, size_t size)
+{
+    vm_memory_write_lock(vm);
+    int result = vm_memory_make_anon_locked(vm, addr, size);
+    vm_memory_write_unlock(vm);
+    return result;
+}
+
+static vm_memory_reservation_t *vm_reserve_anon_memory_locked(vm_t *vm, size_t size, size_t align,
+                                                              memory_fault_callback_fn fault_callback, void *cookie,
+                                                              uintptr_t *addr)
 {
     int err;
     vm_memory_reservation_t *new_reservation;
     anon_region_t *allocable_region;
     uintptr_t reservation_addr;
+    int hole;
 
     if (!fault_callback) {
         ZF_LOGE("Failed to reserve anon memory region: NULL fault callback");
         return NULL;
     }
 
-    allocable_region = find_allocable_anon_region(vm, ROUND_UP(size, BIT(seL4_PageBits)), align);
+    size_t alloc_size = ROUND_UP(size, BIT(seL4_PageBits));
+    allocable_region = find_allocable_anon_region(vm, alloc_size, align, &reservation_addr, &hole);
     if (!allocable_region) {
         ZF_LOGE("Failed to reserve anon memory: No anonymous memory available to cater reservation size");
         return NULL;
     }
 
-    reservation_addr = ROUND_UP(allocable_region->alloc_addr, (uintptr_t) align);
-
     /* Make a sub-reservation token. */
     new_reservation = allocate_vm_reservation(vm, reservation_addr, size, allocable_region->vspace_reservation);
     if (!new_reservation) {
@@ -413,24 +1021,45 @@ vm_memory_reservation_t *vm_reserve_anon_memory(vm_t *vm, size_t size, size_t al
     new_reservation->fault_callback_cookie = cookie;
     new_reservation->res_type = MEM_ANON_RES;
 
-    /* Register the sub-reservation token into the region - It will need to iterate over it on faults */
-    vm_memory_reservation_t **extended_reservations = realloc(allocable_region->reservations,
-                                                              sizeof(vm_memory_reservation_t *) * (allocable_region->num_reservations + 1));
-    if (!extended_reservations) {
+    /* Register the sub-reservation token into the region, in order of address for lookups on faults */
+    if (allocable_region->num_reservations == allocable_region->max_reservations) {
+        int max_reservations = allocable_region->max_reservations ? allocable_region->max_reservations * 2 : 8;
+        vm_memory_reservation_t **extended_reservations = realloc(allocable_region->reservations,
+                                                                  sizeof(vm_memory_reservation_t *) * max_reservations);
+        if (!extended_reservations) {
+            free_vm_reservation(vm, new_reservation);
+            return NULL;
+        }
+        allocable_region->reservations = extended_reservations;
+        allocable_region->max_reservations = max_reservations;
+    }
+    if (anon_region_take(allocable_region, reservation_addr, alloc_size, hole)) {
+        ZF_LOGE("Failed to reserve anon memory: Unable to track free anonymous memory");
         free_vm_reservation(vm, new_reservation);
         return NULL;
     }
-    allocable_region->reservations = extended_reservations;
 
-    allocable_region->reservations[allocable_region->num_reservations] = new_reservation;
-    allocable_region->alloc_addr = reservation_addr + ROUND_UP(size, BIT(seL4_PageBits));
+    int idx = anon_reservation_upper_bound(allocable_region, reservation_addr);
+    memmove(&allocable_region->reservations[idx + 1], &allocable_region->reservations[idx],
+            sizeof(vm_memory_reservation_t *) * (allocable_region->num_reservations - idx));
+    allocable_region->reservations[idx] = new_reservation;
     allocable_region->num_reservations += 1;
+    vm_mmio_dispatch_add(vm, reservation_addr, size, fault_callback, cookie);
 
     *addr = reservation_addr;
     return new_reservation;
 }
 
-int vm_free_reserved_memory(vm_t *vm, vm_memory_reservation_t *reservation)
+vm_memory_reservation_t *vm_reserve_anon_memory(vm_t *vm, size_t size, size_t align,
+                                                memory_fault_callback_fn fault_callback, void *cookie, uintptr_t *addr)
+{
+    vm_memory_write_lock(vm);
+    vm_memory_reservation_t *result = vm_reserve_anon_memory_locked(vm, size, align, fault_callback, cookie, addr);
+    vm_memory_write_unlock(vm);
+    return result;
+}
+
+static int vm_free_reserved_memory_locked(vm_t *vm, vm_memory_reservation_t *reservation)
 {
     ps_io_ops_t *ops = vm->io_ops;
     if (!reservation) {
@@ -445,48 +1074,114 @@ int vm_free_reserved_memory(vm_t *vm, vm_memory_reservation_t *reservation)
         return -1;
     }
 
+    if (reservation->coalesced) {
+        coalesced_mmio_flush(vm, reservation->coalesced);
+    }
     remove_memory_reservation_node(vm, reservation->addr, reservation->size, reservation->res_type);
-    if (reservation->is_mapped) {
-        int page_size = seL4_PageBits;
-        int num_pages = ROUND_UP(reservation->size, BIT(page_size)) >> page_size;
-        vspace_unmap_pages(&vm->mem.vm_vspace, (void *)reservation->addr, num_pages, page_size, vm->vka);
+    fault_cache_invalidate(vm, reservation);
+    vm_mmio_dispatch_remove(vm, reservation->addr, reservation->size);
+    vm_ram_map_cache_invalidate(vm, reservation->addr, reservation->size);
+    vm_ram_map_cache_remove_direct(vm, reservation->addr, reservation->size);
+    if (reservation->is_mapped || reservation->lazy_map) {
+        unmap_reservation_frames(vm, reservation);
     }
     vspace_free_reservation(&vm->mem.vm_vspace, reservation->vspace_reservation);
     free_vm_reservation(vm, reservation);
     return 0;
 }
 
+int vm_free_reserved_memory(vm_t *vm, vm_memory_reservation_t *reservation)
+{
+    vm_memory_write_lock(vm);
+    int result = vm_free_reserved_memory_locked(vm, reservation);
+    vm_memory_write_unlock(vm);
+    return result;
+}
+
+static int map_vm_memory_reservation_locked(vm_t *vm, vm_memory_reservation_t *vm_reservation,
+                                            memory_map_iterator_fn map_iterator, void *map_cookie)
+{
+    int err = map_reservation_frames(vm, vm_reservation, vm_reservation->addr,
+                                     vm_reservation->addr + vm_reservation->size, map_iterator, map_cookie);
+    if (err) {
+        return -1;
+    }
+    vm_reservation->memory_map_iterator = NULL;
+    vm_reservation->memory_iterator_cookie = NULL;
+    vm_reservation->is_mapped = true;
+    return 0;
+}
+
 int map_vm_memory_reservation(vm_t *vm, vm_memory_reservation_t *vm_reservation,
                               memory_map_iterator_fn map_iterator, void *map_cookie)
 {
-    int err;
-    uintptr_t reservation_addr = vm_reservation->addr;
-    size_t reservation_size = vm_reservation->size;
-    uintptr_t current_addr = vm_reservation->addr;
+    vm_memory_write_lock(vm);
+    int result = map_vm_memory_reservation_locked(vm, vm_reservation, map_iterator, map_cookie);
+    vm_memory_write_unlock(vm);
+    return result;
+}
 
-    while (current_addr < reservation_addr + reservation_size) {
-        vm_frame_t reservation_frame = map_iterator(current_addr, map_cookie);
-        if (reservation_frame.cptr == seL4_CapNull) {
-            ZF_LOGE("Failed to get frame for reservation address 0x%lx", current_addr);
-            break;
+static int map_vm_memory_reservation_lazy_locked(vm_t *vm, vm_memory_reservation_t *vm_reservation,
+                                                 memory_map_iterator_fn map_iterator, void *map_cookie,
+                                                 size_t prefetch_pages)
+{
+    if (!map_iterator) {
+        ZF_LOGE("Failed to lazily map vm reservation: Invalid map iterator given");
+        return -1;
+    }
+    /* Lazily mapped reservations need to go through the generic fault handler */
+    vm_mmio_dispatch_remove(vm, vm_reservation->addr, vm_reservation->size);
+    vm_reservation->memory_map_iterator = map_iterator;
+    vm_reservation->memory_iterator_cookie = map_cookie;
+    vm_reservation->prefetch_pages = prefetch_pages;
+    vm_reservation->lazy_map = true;
+    return 0;
+}
+
+int map_vm_memory_reservation_lazy(vm_t *vm, vm_memory_reservation_t *vm_reservation,
+                                   memory_map_iterator_fn map_iterator, void *map_cookie, size_t prefetch_pages)
+{
+    vm_memory_write_lock(vm);
+    int result = map_vm_memory_reservation_lazy_locked(vm, vm_reservation, map_iterator, map_cookie, prefetch_pages);
+    vm_memory_write_unlock(vm);
+    return result;
+}
+
+static int vm_memory_populate_locked(vm_t *vm, uintptr_t addr, size_t size)
+{
+    uintptr_t current_addr = PAGE_ALIGN_4K(addr);
+    uintptr_t end_addr = addr + size;
+    while (current_addr < end_addr) {
+        vm_memory_reservation_t *reservation = find_reservation_at(vm, current_addr);
+        if (!reservation) {
+            current_addr += PAGE_SIZE_4K;
+            continue;
         }
-        int ret = vspace_deferred_rights_map_pages_at_vaddr(&vm->mem.vm_vspace, &reservation_frame.cptr, NULL,
-                                                            (void *)reservation_frame.vaddr, 1, reservation_frame.size_bits,
-                                                            reservation_frame.rights, vm_reservation->vspace_reservation);
-        if (ret) {
-            ZF_LOGE("Failed to map address 0x%x into guest vm vspace", reservation_frame.vaddr);
-            return -1;
+        uintptr_t reservation_end = reservation->addr + reservation->size;
+        if (reservation->lazy_map) {
+            int err = map_reservation_frames(vm, reservation, current_addr,
+                                             ROUND_UP(MIN(end_addr, reservation_end), PAGE_SIZE_4K),
+                                             reservation->memory_map_iterator, reservation->memory_iterator_cookie);
+            if (err) {
+                ZF_LOGE("Failed to populate reservation at address 0x%x", current_addr);
+                return -1;
+            }
         }
-        current_addr += BIT(reservation_frame.size_bits);
+        current_addr = ROUND_UP(reservation_end, PAGE_SIZE_4K);
     }
-    vm_reservation->memory_map_iterator = NULL;
-    vm_reservation->memory_iterator_cookie = NULL;
-    vm_reservation->is_mapped = true;
     return 0;
 }
 
-int vm_map_reservation(vm_t *vm, vm_memory_reservation_t *reservation,
-                       memory_map_iterator_fn map_iterator, void *cookie)
+int vm_memory_populate(vm_t *vm, uintptr_t addr, size_t size)
+{
+    vm_memory_write_lock(vm);
+    int result = vm_memory_populate_locked(vm, addr, size);
+    vm_memory_write_unlock(vm);
+    return result;
+}
+
+static int vm_map_reservation_locked(vm_t *vm, vm_memory_reservation_t *reservation,
+                                     memory_map_iterator_fn map_iterator, void *cookie)
 {
     int err;
     if (!vm) {
@@ -500,6 +1195,8 @@ int vm_map_reservation(vm_t *vm, vm_memory_reservation_t *reservation,
         return -1;
     }
 
+    /* Faults on a mapped (or deferred) reservation need to go through the generic fault handler */
+    vm_mmio_dispatch_remove(vm, reservation->addr, reservation->size);
     reservation->memory_map_iterator = map_iterator;
     reservation->memory_iterator_cookie = cookie;
     if (!config_set(CONFIG_LIB_SEL4VM_DEFER_MEMORY_MAP)) {
@@ -515,12 +1212,251 @@ int vm_map_reservation(vm_t *vm, vm_memory_reservation_t *reservation,
     return 0;
 }
 
+int vm_map_reservation(vm_t *vm, vm_memory_reservation_t *reservation,
+                       memory_map_iterator_fn map_iterator, void *cookie)
+{
+    vm_memory_write_lock(vm);
+    int result = vm_map_reservation_locked(vm, reservation, map_iterator, cookie);
+    vm_memory_write_unlock(vm);
+    return result;
+}
+
+static bool reservation_page_valid(vm_memory_reservation_t *reservation, uintptr_t addr)
+{
+    return reservation && IS_ALIGNED(addr, seL4_PageBits) && addr >= reservation->addr &&
+           addr - reservation->addr < reservation->size;
+}
+
+static int vm_reservation_map_frame_locked(vm_t *vm, vm_memory_reservation_t *reservation, vm_frame_t frame)
+{
+    if (!reservation_page_valid(reservation, frame.vaddr) || frame.size_bits != seL4_PageBits) {
+        ZF_LOGE("Failed to map reservation frame: 0x%x is not a 4K frame of the reservation", frame.vaddr);
+        return -1;
+    }
+    return vm_memory_map_frame(vm, frame);
+}
+
+int vm_reservation_map_frame(vm_t *vm, vm_memory_reservation_t *reservation, vm_frame_t frame)
+{
+    vm_memory_write_lock(vm);
+    int result = vm_reservation_map_frame_locked(vm, reservation, frame);
+    vm_memory_write_unlock(vm);
+    return result;
+}
+
+static int vm_reservation_unmap_frame_locked(vm_t *vm, vm_memory_reservation_t *reservation, uintptr_t addr)
+{
+    if (!reservation_page_valid(reservation, addr)) {
+        ZF_LOGE("Failed to unmap reservation frame: 0x%x is not a 4K frame of the reservation", addr);
+        return -1;
+    }
+    return vm_memory_unmap_frame(vm, addr, VSPACE_PRESERVE);
+}
+
+int vm_reservation_unmap_frame(vm_t *vm, vm_memory_reservation_t *reservation, uintptr_t addr)
+{
+    vm_memory_write_lock(vm);
+    int result = vm_reservation_unmap_frame_locked(vm, reservation, addr);
+    vm_memory_write_unlock(vm);
+    return result;
+}
+
+static int vm_reservation_enable_coalesced_mmio_locked(vm_t *vm, vm_memory_reservation_t *reservation,
+                                                       size_t num_writes, coalesced_mmio_flush_fn flush, void *cookie)
+{
+    if (!vm) {
+        ZF_LOGE("Failed to enable coalesced mmio: Invalid NULL VM handle given");
+        return -1;
+    } else if (!reservation) {
+        ZF_LOGE("Failed to enable coalesced mmio: Invalid NULL reservation given");
+        return -1;
+    } else if (!flush || num_writes == 0) {
+        ZF_LOGE("Failed to enable coalesced mmio: Invalid flush callback or buffer size given");
+        return -1;
+    } else if (reservation->coalesced) {
+        ZF_LOGE("Failed to enable coalesced mmio: Already enabled on reservation");
+        return -1;
+    } else if (reservation->is_mapped || reservation->lazy_map || reservation->memory_map_iterator) {
+        ZF_LOGE("Failed to enable coalesced mmio: Reservation is backed by memory");
+        return -1;
+    }
+
+    coalesced_mmio_t *coalesced = calloc(1, sizeof(coalesced_mmio_t));
+    if (!coalesced) {
+        ZF_LOGE("Failed to enable coalesced mmio: Unable to allocate coalesced mmio state");
+        return -1;
+    }
+    coalesced->writes = calloc(num_writes, sizeof(vm_coalesced_write_t));
+    if (!coalesced->writes) {
+        ZF_LOGE("Failed to enable coalesced mmio: Unable to allocate write buffer");
+        free(coalesced);
+        return -1;
+    }
+    coalesced->max_writes = num_writes;
+    coalesced->flush = flush;
+    coalesced->flush_cookie = cookie;
+    /* Buffered writes need the reservation, which the dispatch table does not record */
+    vm_mmio_dispatch_remove(vm, reservation->addr, reservation->size);
+    reservation->coalesced = coalesced;
+    return 0;
+}
+
+int vm_reservation_enable_coalesced_mmio(vm_t *vm, vm_memory_reservation_t *reservation, size_t num_writes,
+                                         coalesced_mmio_flush_fn flush, void *cookie)
+{
+    vm_memory_write_lock(vm);
+    int result = vm_reservation_enable_coalesced_mmio_locked(vm, reservation, num_writes, flush, cookie);
+    vm_memory_write_unlock(vm);
+    return result;
+}
+
+static int vm_reservation_flush_coalesced_mmio_locked(vm_t *vm, vm_memory_reservation_t *reservation)
+{
+    if (!vm || !reservation || !reservation->coalesced) {
+        ZF_LOGE("Failed to flush coalesced mmio: Coalesced mmio not enabled on reservation");
+        return -1;
+    }
+    coalesced_mmio_flush(vm, reservation->coalesced);
+    return 0;
+}
+
+int vm_reservation_flush_coalesced_mmio(vm_t *vm, vm_memory_reservation_t *reservation)
+{
+    vm_memory_write_lock(vm);
+    int result = vm_reservation_flush_coalesced_mmio_locked(vm, reservation);
+    vm_memory_write_unlock(vm);
+    return result;
+}
+
 void vm_get_reservation_memory_region(vm_memory_reservation_t *reservation, uintptr_t *addr, size_t *size)
 {
     *addr = reservation->addr;
     *size = reservation->size;
 }
 
+size_t vm_get_reservation_frame_size_bits(vm_memory_reservation_t *reservation, uintptr_t addr)
+{
+    if (config_set(CONFIG_LIB_SEL4VM_LARGE_FRAMES) && IS_ALIGNED(addr, seL4_LargePageBits) &&
+        addr >= reservation->addr && addr + BIT(seL4_LargePageBits) <= reservation->addr + reservation->size) {
+        return seL4_LargePageBits;
+    }
+    return seL4_PageBits;
+}
+
+static size_t vm_memory_frame_size_bits_locked(vm_t *vm, uintptr_t addr)
+{
+    if (!config_set(CONFIG_LIB_SEL4VM_LARGE_FRAMES)) {
+        return seL4_PageBits;
+    }
+    vm_memory_reservation_t *reservation = find_reservation_at(vm, addr);
+    if (!reservation) {
+        return seL4_PageBits;
+    }
+    return reservation_frame_bits(reservation, addr);
+}
+
+size_t vm_memory_frame_size_bits(vm_t *vm, uintptr_t addr)
+{
+    vm_memory_read_lock(vm);
+    size_t result = vm_memory_frame_size_bits_locked(vm, addr);
+    vm_memory_read_unlock(vm);
+    return result;
+}
+
+static int vm_memory_map_frame_locked(vm_t *vm, vm_frame_t frame)
+{
+    vm_memory_reservation_t *reservation = find_reservation_at(vm, frame.vaddr);
+    if (!reservation || frame.size_bits != seL4_PageBits ||
+        reservation_frame_bits(reservation, frame.vaddr) != seL4_PageBits) {
+        ZF_LOGE("Failed to map frame: No 4K frame reserved at address 0x%x", frame.vaddr);
+        return -1;
+    }
+    int err = vspace_deferred_rights_map_pages_at_vaddr(&vm->mem.vm_vspace, &frame.cptr, &frame.cookie,
+                                                        (void *)frame.vaddr, 1, seL4_PageBits, frame.rights,
+                                                        reservation->vspace_reservation);
+    if (err) {
+        ZF_LOGE("Failed to map frame: Unable to map address 0x%x into guest vm vspace", frame.vaddr);
+        return -1;
+    }
+    return 0;
+}
+
+int vm_memory_map_frame(vm_t *vm, vm_frame_t frame)
+{
+    vm_memory_write_lock(vm);
+    int result = vm_memory_map_frame_locked(vm, frame);
+    vm_memory_write_unlock(vm);
+    return result;
+}
+
+static int vm_memory_unmap_frame_locked(vm_t *vm, uintptr_t addr, vka_t *vka)
+{
+    vm_memory_reservation_t *reservation = find_reservation_at(vm, addr);
+    if (!reservation || reservation_frame_bits(reservation, addr) != seL4_PageBits) {
+        ZF_LOGE("Failed to unmap frame: No 4K frame reserved at address 0x%x", addr);
+        return -1;
+    }
+    /* Cached vmm mappings refer to the frame being unmapped */
+    vm_ram_map_cache_invalidate(vm, addr, PAGE_SIZE_4K);
+    /* The unmapped range stays within the vspace reservation, ready for another frame */
+    vspace_unmap_pages(&vm->mem.vm_vspace, (void *)addr, 1, seL4_PageBits, vka);
+    return 0;
+}
+
+int vm_memory_unmap_frame(vm_t *vm, uintptr_t addr, vka_t *vka)
+{
+    vm_memory_write_lock(vm);
+    int result = vm_memory_unmap_frame_locked(vm, addr, vka);
+    vm_memory_write_unlock(vm);
+    return result;
+}
+
+static int vm_memory_replace_frame_locked(vm_t *vm, uintptr_t addr, seL4_CPtr frame, seL4_CapRights_t rights)
+{
+    if (vm_memory_unmap_frame(vm, addr, VSPACE_PRESERVE)) {
+        return -1;
+    }
+    vm_frame_t new_frame = { frame, rights, addr, seL4_PageBits, 0 };
+    return vm_memory_map_frame(vm, new_frame);
+}
+
+int vm_memory_replace_frame(vm_t *vm, uintptr_t addr, seL4_CPtr frame, seL4_CapRights_t rights)
+{
+    vm_memory_write_lock(vm);
+    int result = vm_memory_replace_frame_locked(vm, addr, frame, rights);
+    vm_memory_write_unlock(vm);
+    return result;
+}
+
+int vm_memory_init_vcpu(vm_vcpu_t *vcpu)
+{
+    ps_io_ops_t *ops = vcpu->vm->io_ops;
+    vm_memory_fault_cache_t *cache;
+    int err = ps_calloc(&ops->malloc_ops, 1, sizeof(vm_memory_fault_cache_t), (void **)&cache);
+    if (err) {
+        ZF_LOGE("Failed to initialise vcpu memory fault cache: Unable to allocate cache");
+        return -1;
+    }
+    vcpu->mem_fault_cache = cache;
+    return 0;
+}
+
+void vm_memory_destroy_vcpu(vm_vcpu_t *vcpu)
+{
+    ps_io_ops_t *ops = vcpu->vm->io_ops;
+    if (vcpu->mem_fault_cache) {
+        ps_free(&ops->malloc_ops, sizeof(vm_memory_fault_cache_t), vcpu->mem_fault_cache);
+        vcpu->mem_fault_cache = NULL;
+    }
+}
+
+void vm_memory_get_fault_cache_stats(vm_vcpu_t *vcpu, uint64_t *hits, uint64_t *misses)
+{
+    vm_memory_fault_cache_t *cache = vcpu->mem_fault_cache;
+    *hits = cache ? cache->hits : 0;
+    *misses = cache ? cache->misses : 0;
+}
+
 int vm_memory_init(vm_t *vm)
 {
     ps_io_ops_t *ops = vm->io_ops;
@@ -531,5 +1467,76 @@ int vm_memory_init(vm_t *vm)
         return -1;
     }
     vm->mem.reservation_cookie = cookie;
+    err = vm_mmio_dispatch_init(vm);
+    if (err) {
+        ZF_LOGE("Failed to initialise vm memory backend: Unable to initialise mmio dispatch table");
+        return -1;
+    }
     return 0;
 }
+
+void *vm_memory_lazy_cookie(vm_t *vm, uintptr_t addr, uintptr_t *end)
+{
+    void *cookie = NULL;
+    vm_memory_read_lock(vm);
+    vm_memory_reservation_t *reservation = find_reservation_at(vm, addr);
+    if (reservation) {
+        *end = reservation->addr + reservation->size;
+        cookie = reservation->lazy_map ? reservation->memory_iterator_cookie : NULL;
+    }
+    vm_memory_read_unlock(vm);
+    return cookie;
+}
+
+#ifdef CONFIG_LIB_SEL4VM_FLAT_RESERVATION_INDEX
+static void free_reservation_index(vm_t *vm)
+{
+    vm_memory_reservation_cookie_t *res_cookie = vm->mem.reservation_cookie;
+    for (int i = 0; i < res_cookie->num_nodes; i++) {
+        if (res_cookie->nodes[i].res_type == MEM_REGULAR_RES) {
+            free_reservation_data(res_cookie->nodes[i].data);
+        }
+    }
+    free(res_cookie->keys);
+    free(res_cookie->nodes);
+}
+#else
+static void free_res_tree(res_tree *node)
+{
+    if (!node) {
+        return;
+    }
+    free_res_tree(node->left);
+    free_res_tree(node->right);
+    free_reservation_data(node->data);
+}
+
+static void free_reservation_index(vm_t *vm)
+{
+    /* The tree nodes are in the arena, only the regular reservations have data of their own */
+    free_res_tree(vm->mem.reservation_cookie->regular_res_tree);
+}
+#endif /* CONFIG_LIB_SEL4VM_FLAT_RESERVATION_INDEX */
+
+void vm_memory_destroy(vm_t *vm)
+{
+    vm_memory_reservation_cookie_t *res_cookie = vm->mem.reservation_cookie;
+    ps_io_ops_t *ops = vm->io_ops;
+    if (!res_cookie) {
+        return;
+    }
+    /* The frames and vspace reservations go with the guest vspace and the reservations, tree nodes and anonymous
+     * regions with the arena, leaving the arrays and data hanging off them to free. Each reservation is reached
+     * once, through the index or its anonymous region */
+    free_reservation_index(vm);
+    for (anon_region_t *region = res_cookie->anon_regions; region; region = region->next) {
+        for (int i = 0; i < region->num_reservations; i++) {
+            free_reservation_data(region->reservations[i]);
+        }
+        free(region->reservations);
+        free(region->holes);
+    }
+    vm_mmio_dispatch_destroy(vm);
+    ps_free(&ops->malloc_ops, sizeof(vm_memory_reservation_cookie_t), res_cookie);
+    vm->mem.reservation_cookie = NULL;
+}
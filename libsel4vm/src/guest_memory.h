@@ -9,6 +9,38 @@
 #include <sel4vm/guest_vm.h>
 #include <sel4vm/guest_memory.h>
 
+/*
+ * The memory lock serialises changes to the vm's reservations, the frames backing them and the mappings of guest
+ * memory into the VMM against each other, while letting any number of threads look reservations up and access guest
+ * memory through their own mapping windows (see 'vm_ram_window_create') at once. A thread holding the lock for writing
+ * may take it again, a thread holding it for reading must not take it for writing. The VMM lock of a VM running vcpu
+ * threads is taken before the memory lock
+ */
+
+/**
+ * Take the memory lock of a VM for reading
+ * @param {vm_t *} vm               A handle to the VM
+ */
+void vm_memory_read_lock(vm_t *vm);
+
+/**
+ * Release the memory lock of a VM taken for reading
+ * @param {vm_t *} vm               A handle to the VM
+ */
+void vm_memory_read_unlock(vm_t *vm);
+
+/**
+ * Take the memory lock of a VM for writing
+ * @param {vm_t *} vm               A handle to the VM
+ */
+void vm_memory_write_lock(vm_t *vm);
+
+/**
+ * Release the memory lock of a VM taken for writing
+ * @param {vm_t *} vm               A handle to the VM
+ */
+void vm_memory_write_unlock(vm_t *vm);
+
 /**
  * Handle a vm memory fault through searching previously created reservations and invoking the appropriate fault callback
  * @param {vm_t *} vm               A handle to the VM
@@ -19,6 +51,15 @@
  */
 memory_fault_result_t vm_memory_handle_fault(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t addr, size_t size);
 
+/**
+ * Find the base address of the reservation containing a guest physical address
+ * @param {vm_t *} vm               A handle to the VM
+ * @param {uintptr_t} addr          Guest physical address
+ * @param {uintptr_t *} base        Pointer set with the base address of the reservation
+ * @return                          0 on success, -1 if 'addr' is not within a reservation
+ */
+int vm_memory_reservation_base(vm_t *vm, uintptr_t addr, uintptr_t *base);
+
 /**
  * Map a vm memory reservation - this invokation is performed immediately (mapping is not deferred)
  * @param {vm_t *} vm                                   A handle to the VM
@@ -29,3 +70,100 @@ memory_fault_result_t vm_memory_handle_fault(vm_t *vm, vm_vcpu_t *vcpu, uintptr_
  */
 int map_vm_memory_reservation(vm_t *vm, vm_memory_reservation_t *vm_reservation,
                               memory_map_iterator_fn map_iterator, void *map_cookie);
+
+/**
+ * Lazily map a vm memory reservation. No frames are mapped up front, instead each fault on an unmapped page of
+ * the reservation maps the faulting page along with a window of the pages following it
+ * @param {vm_t *} vm                                   A handle to the VM
+ * @param {vm_memory_reservation_t *} vm_reservation    A handle to the VM reservation being mapped
+ * @param {memory_map_iterator_fn} map_iterator         Pointer to the map iterator function for retrieving reservation frames
+ * @param {void *} map_cookie                           Cookie to pass onto map iterator, must remain valid for the
+ *                                                      lifetime of the reservation
+ * @param {size_t} prefetch_pages                       Number of pages to map after a faulting page
+ * @return                                              0 on success, -1 on error
+ */
+int map_vm_memory_reservation_lazy(vm_t *vm, vm_memory_reservation_t *vm_reservation,
+                                   memory_map_iterator_fn map_iterator, void *map_cookie, size_t prefetch_pages);
+
+/**
+ * Map any unmapped frames of lazily mapped reservations within a region of guest physical memory
+ * @param {vm_t *} vm               A handle to the VM
+ * @param {uintptr_t} addr          Base guest physical address of region
+ * @param {size_t} size             Size of region in bytes
+ * @return                          0 on success, -1 on error
+ */
+int vm_memory_populate(vm_t *vm, uintptr_t addr, size_t size);
+
+/**
+ * Initialise the per-vcpu state of the vm memory interface
+ * @param {vm_vcpu_t *} vcpu        A handle to the vcpu
+ * @return                          0 on success, -1 on error
+ */
+int vm_memory_init_vcpu(vm_vcpu_t *vcpu);
+
+/**
+ * Free the per-vcpu state of the vm memory interface
+ * @param {vm_vcpu_t *} vcpu        A handle to the vcpu
+ */
+void vm_memory_destroy_vcpu(vm_vcpu_t *vcpu);
+
+/**
+ * Get the size of the frame backing a guest physical address. Addresses within a reservation
+ * that has not been mapped with frames larger than a page are assumed to be backed by 4K frames
+ * @param {vm_t *} vm               A handle to the VM
+ * @param {uintptr_t} addr          Guest physical address
+ * @return                          Size bits of the frame mapped at 'addr'
+ */
+size_t vm_memory_frame_size_bits(vm_t *vm, uintptr_t addr);
+
+/**
+ * Map a 4K frame into the reservation covering its address, where no frame is mapped
+ * @param {vm_t *} vm                   A handle to the VM
+ * @param {vm_frame_t} frame            Frame to map, at the page aligned guest physical address 'vaddr'
+ * @return                              0 on success, -1 on error
+ */
+int vm_memory_map_frame(vm_t *vm, vm_frame_t frame);
+
+/**
+ * Unmap the 4K frame mapped at an address, leaving the address reserved
+ * @param {vm_t *} vm                   A handle to the VM
+ * @param {uintptr_t} addr              Page aligned guest physical address
+ * @param {vka_t *} vka                 Allocator to free the frame to, or VSPACE_PRESERVE to leave its cap with the caller
+ * @return                              0 on success, -1 on error
+ */
+int vm_memory_unmap_frame(vm_t *vm, uintptr_t addr, vka_t *vka);
+
+/**
+ * Replace the 4K frame mapped at an address of guest RAM, leaving the caller with the cap of the frame replaced
+ * @param {vm_t *} vm                   A handle to the VM
+ * @param {uintptr_t} addr              Page aligned guest physical address
+ * @param {seL4_CPtr} frame             Cap of the frame to map in its place
+ * @param {seL4_CapRights_t} rights     Rights to map the new frame with
+ * @return                              0 on success, -1 on error
+ */
+int vm_memory_replace_frame(vm_t *vm, uintptr_t addr, seL4_CPtr frame, seL4_CapRights_t rights);
+
+/**
+ * Get the map iterator cookie of the lazily mapped reservation containing an address, such that its owner can free
+ * it along with the VM
+ * @param {vm_t *} vm                   A handle to the VM
+ * @param {uintptr_t} addr              Guest physical address
+ * @param {uintptr_t *} end             Set with the end of the reservation containing 'addr', if there is one
+ * @return                              Cookie given to 'map_vm_memory_reservation_lazy', NULL if 'addr' is not within
+ *                                      a lazily mapped reservation
+ */
+void *vm_memory_lazy_cookie(vm_t *vm, uintptr_t addr, uintptr_t *end);
+
+/**
+ * Free the reservations of a VM, along with the rest of the state of the vm memory interface. The frames mapped into
+ * the reservations and their vspace reservations are not touched, they are freed along with the guest vspace
+ * @param {vm_t *} vm                   A handle to the VM
+ */
+void vm_memory_destroy(vm_t *vm);
+
+/**
+ * Free the RAM regions of a VM, along with the state kept for allocating from them and mapping them lazily. This
+ * must be called before 'vm_memory_destroy'
+ * @param {vm_t *} vm                   A handle to the VM
+ */
+void vm_ram_destroy(vm_t *vm);
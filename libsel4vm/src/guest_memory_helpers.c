@@ -4,8 +4,15 @@
  * SPDX-License-Identifier: BSD-2-Clause
  */
 
+#include <inttypes.h>
+
+#include <sel4/sel4.h>
+#include <vka/capops.h>
+#include <vka/object.h>
+
 #include <sel4vm/guest_vm.h>
 #include <sel4vm/guest_memory.h>
+#include <sel4vm/guest_memory_helpers.h>
 
 memory_fault_result_t default_error_fault_callback(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t fault_addr,
                                                    size_t fault_length, void *cookie)
@@ -13,3 +20,106 @@ memory_fault_result_t default_error_fault_callback(vm_t *vm, vm_vcpu_t *vcpu, ui
     ZF_LOGE("Failed to handle fault addr: 0x%x", fault_addr);
     return FAULT_ERROR;
 }
+
+/* Retype the frames of a batch from a single untyped covering them, a run of
+ * consecutive free cslots at a time */
+static int frame_batch_retype(vm_t *vm, vm_frame_batch_t *batch, uintptr_t paddr, size_t size_bits,
+                              unsigned int num_frames)
+{
+    size_t ut_bits = size_bits + CTZL(num_frames);
+    cspacepath_t ut_path;
+    seL4_Word ut_cookie;
+    if (vka_cspace_alloc_path(vm->vka, &ut_path)) {
+        return -1;
+    }
+    if (vka_utspace_alloc_at(vm->vka, &ut_path, seL4_UntypedObject, ut_bits, paddr, &ut_cookie)) {
+        vka_cspace_free_path(vm->vka, ut_path);
+        return -1;
+    }
+    unsigned int num_slots;
+    int error = 0;
+    for (num_slots = 0; !error && num_slots < num_frames; num_slots++) {
+        error = vka_cspace_alloc(vm->vka, &batch->frames[num_slots]);
+    }
+    if (error) {
+        num_slots--;
+    }
+    seL4_Word type = kobject_get_type(KOBJECT_FRAME, size_bits);
+    for (unsigned int start = 0; !error && start < num_frames;) {
+        cspacepath_t first;
+        vka_cspace_make_path(vm->vka, batch->frames[start], &first);
+        unsigned int end;
+        for (end = start + 1; end < num_frames; end++) {
+            cspacepath_t path;
+            vka_cspace_make_path(vm->vka, batch->frames[end], &path);
+            if (path.root != first.root || path.dest != first.dest || path.destDepth != first.destDepth ||
+                path.offset != first.offset + (end - start)) {
+                break;
+            }
+        }
+        /* Objects are retyped in order from the start of the untyped, so the
+         * frames follow each other in physical memory */
+        error = seL4_Untyped_Retype(ut_path.capPtr, type, size_bits, first.root, first.dest, first.destDepth,
+                                    first.offset, end - start);
+        start = end;
+    }
+    if (error) {
+        /* Revoking the untyped deletes the frames retyped from it */
+        vka_cnode_revoke(&ut_path);
+        for (unsigned int i = 0; i < num_slots; i++) {
+            vka_cspace_free(vm->vka, batch->frames[i]);
+            batch->frames[i] = seL4_CapNull;
+        }
+        vka_cnode_delete(&ut_path);
+        vka_utspace_free(vm->vka, seL4_UntypedObject, ut_bits, ut_cookie);
+        vka_cspace_free_path(vm->vka, ut_path);
+        return -1;
+    }
+    batch->paddr = paddr;
+    batch->size_bits = size_bits;
+    batch->num_frames = num_frames;
+    return 0;
+}
+
+seL4_CPtr vm_frame_batch_take(vm_frame_batch_t *batch, uintptr_t paddr, size_t size_bits)
+{
+    if (!batch->num_frames || size_bits != batch->size_bits || paddr < batch->paddr) {
+        return seL4_CapNull;
+    }
+    uintptr_t idx = (paddr - batch->paddr) >> size_bits;
+    if (idx >= batch->num_frames) {
+        return seL4_CapNull;
+    }
+    seL4_CPtr frame = batch->frames[idx];
+    batch->frames[idx] = seL4_CapNull;
+    return frame;
+}
+
+seL4_CPtr vm_frame_batch_alloc(vm_t *vm, vm_frame_batch_t *batch, uintptr_t paddr, size_t size_bits,
+                               unsigned int max_frames)
+{
+    if (batch->disabled) {
+        return seL4_CapNull;
+    }
+    /* An untyped is a power of 2 in size and aligned to it */
+    unsigned int num_frames = MIN(max_frames, VM_FRAME_BATCH_MAX_FRAMES);
+    if (num_frames) {
+        num_frames = BIT(seL4_WordBits - 1 - CLZL(num_frames));
+    }
+    while (num_frames > 1 && !IS_ALIGNED(paddr, size_bits + CTZL(num_frames))) {
+        num_frames >>= 1;
+    }
+    if (num_frames <= 1) {
+        return seL4_CapNull;
+    }
+    batch->num_frames = 0;
+    if (frame_batch_retype(vm, batch, paddr, size_bits, num_frames)) {
+        ZF_LOGD("Failed to retype a batch of %u frames at 0x%"PRIxPTR", allocating frames one by one", num_frames,
+                paddr);
+        batch->disabled = true;
+        return seL4_CapNull;
+    }
+    seL4_CPtr frame = batch->frames[0];
+    batch->frames[0] = seL4_CapNull;
+    return frame;
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <inttypes.h>
+
+#include <utils/util.h>
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_ram.h>
+#include <sel4vm/guest_mmio_batch.h>
+
+#include "guest_mmio_batch.h"
+
+static int batch_access(vm_vcpu_t *vcpu, vm_mmio_batch_op_t *op)
+{
+    uint32_t width = op->width;
+    if (op->op > VM_MMIO_BATCH_WRITE || width == 0 || width > sizeof(seL4_Word) || (width & (width - 1)) ||
+        (op->addr & (width - 1)) || op->addr > UINTPTR_MAX) {
+        ZF_LOGE("Failed to run mmio batch: Invalid access of width %"PRIu32" at 0x%"PRIx64, width, op->addr);
+        return -1;
+    }
+    uint64_t mask = width < sizeof(uint64_t) ? (1ULL << (width * 8)) - 1 : UINT64_MAX;
+    op->value = op->op == VM_MMIO_BATCH_WRITE ? op->value & mask : 0;
+    if (vm_mmio_batch_access_arch(vcpu, op)) {
+        return -1;
+    }
+    op->value &= mask;
+    return 0;
+}
+
+int vm_mmio_batch_run(vm_vcpu_t *vcpu, uintptr_t ops_addr, size_t num_ops, size_t *num_run)
+{
+    vm_mmio_batch_op_t ops[VM_MMIO_BATCH_MAX_OPS];
+    if (!vcpu || !num_run) {
+        ZF_LOGE("Failed to run mmio batch: Invalid vcpu");
+        return -1;
+    }
+    if (num_ops > VM_MMIO_BATCH_MAX_OPS) {
+        ZF_LOGE("Failed to run mmio batch: %zu accesses exceed the maximum of %d", num_ops, VM_MMIO_BATCH_MAX_OPS);
+        return -1;
+    }
+    *num_run = 0;
+    if (num_ops == 0) {
+        return 0;
+    }
+    vm_t *vm = vcpu->vm;
+    int err = vm_ram_touch(vm, ops_addr, num_ops * sizeof(vm_mmio_batch_op_t), vm_guest_ram_read_callback, ops);
+    if (err) {
+        ZF_LOGE("Failed to run mmio batch: Unable to read accesses at 0x%"PRIxPTR, ops_addr);
+        return -1;
+    }
+    size_t run = 0;
+    while (run < num_ops && !batch_access(vcpu, &ops[run])) {
+        run++;
+    }
+    if (run) {
+        err = vm_ram_touch(vm, ops_addr, run * sizeof(vm_mmio_batch_op_t), vm_guest_ram_write_callback, ops);
+        if (err) {
+            ZF_LOGE("Failed to run mmio batch: Unable to write back results at 0x%"PRIxPTR, ops_addr);
+            return -1;
+        }
+    }
+    *num_run = run;
+    return 0;
+}
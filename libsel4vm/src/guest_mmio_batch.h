@@ -0,0 +1,18 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_mmio_batch.h>
+
+/**
+ * Run a single validated access of a batch through the fault handling of the vcpu, as if the guest had made it
+ * @param {vm_vcpu_t *} vcpu            A handle to the vcpu making the access
+ * @param {vm_mmio_batch_op_t *} op     Access to run, a read is completed with the value read
+ * @return                              0 if a reservation handled the access, -1 otherwise
+ */
+int vm_mmio_batch_access_arch(vm_vcpu_t *vcpu, vm_mmio_batch_op_t *op);
@@ -0,0 +1,203 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <autoconf.h>
+#include <sel4vm/gen_config.h>
+
+#include <sel4/sel4.h>
+#include <utils/util.h>
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_memory.h>
+#include <sel4vm/guest_vcpu_fault.h>
+
+#include "guest_doorbell.h"
+#include "guest_mmio_dispatch.h"
+#include "guest_vm_exit_stats.h"
+#include "guest_vm_event_trace.h"
+
+typedef struct mmio_dispatch_entry {
+    /* Guest physical page number of the entry */
+    uintptr_t page;
+    /* Region within the page handled by 'fault_callback' */
+    uintptr_t addr;
+    size_t size;
+    memory_fault_callback_fn fault_callback;
+    void *fault_callback_cookie;
+    /* Number of regions added on this page. Faults on pages shared by
+     * multiple regions are left to the generic fault handler */
+    int num_regions;
+    bool valid;
+} mmio_dispatch_entry_t;
+
+/* Open addressed hash table of entries, collisions are resolved through linear probing */
+struct vm_mmio_dispatch {
+    int num_slots;
+    mmio_dispatch_entry_t *slots;
+};
+
+static inline int slot_index(vm_mmio_dispatch_t *table, uintptr_t page)
+{
+    return page % table->num_slots;
+}
+
+static mmio_dispatch_entry_t *find_entry(vm_mmio_dispatch_t *table, uintptr_t page)
+{
+    int index = slot_index(table, page);
+    for (int i = 0; i < table->num_slots; i++) {
+        mmio_dispatch_entry_t *entry = &table->slots[index];
+        if (!entry->valid) {
+            return NULL;
+        }
+        if (entry->page == page) {
+            return entry;
+        }
+        index = (index + 1) % table->num_slots;
+    }
+    return NULL;
+}
+
+static void remove_entry(vm_mmio_dispatch_t *table, mmio_dispatch_entry_t *entry)
+{
+    int hole = entry - table->slots;
+    int index = hole;
+    table->slots[hole].valid = false;
+    /* Shift back any subsequent entries in the probe sequence that can fill the hole */
+    while (true) {
+        index = (index + 1) % table->num_slots;
+        mmio_dispatch_entry_t *next = &table->slots[index];
+        if (!next->valid) {
+            break;
+        }
+        int home = slot_index(table, next->page);
+        /* Distances are measured along the probe sequence, accounting for wrap around */
+        int dist_hole = (hole - home + table->num_slots) % table->num_slots;
+        int dist_next = (index - home + table->num_slots) % table->num_slots;
+        if (dist_hole < dist_next) {
+            table->slots[hole] = *next;
+            next->valid = false;
+            hole = index;
+        }
+    }
+}
+
+int vm_mmio_dispatch_init(vm_t *vm)
+{
+    vm_mmio_dispatch_t *table;
+    int err;
+    ps_io_ops_t *ops = vm->io_ops;
+
+    if (CONFIG_LIB_SEL4VM_MMIO_DISPATCH_TABLE_SIZE == 0) {
+        vm->mem.mmio_dispatch = NULL;
+        return 0;
+    }
+    err = ps_calloc(&ops->malloc_ops, 1, sizeof(vm_mmio_dispatch_t), (void **)&table);
+    if (err) {
+        ZF_LOGE("Failed to initialise mmio dispatch table: Unable to allocate table");
+        return -1;
+    }
+    err = ps_calloc(&ops->malloc_ops, CONFIG_LIB_SEL4VM_MMIO_DISPATCH_TABLE_SIZE, sizeof(mmio_dispatch_entry_t),
+                    (void **)&table->slots);
+    if (err) {
+        ZF_LOGE("Failed to initialise mmio dispatch table: Unable to allocate table slots");
+        ps_free(&ops->malloc_ops, sizeof(vm_mmio_dispatch_t), table);
+        return -1;
+    }
+    table->num_slots = CONFIG_LIB_SEL4VM_MMIO_DISPATCH_TABLE_SIZE;
+    vm->mem.mmio_dispatch = table;
+    return 0;
+}
+
+void vm_mmio_dispatch_destroy(vm_t *vm)
+{
+    vm_mmio_dispatch_t *table = vm->mem.mmio_dispatch;
+    ps_io_ops_t *ops = vm->io_ops;
+    if (!table) {
+        return;
+    }
+    ps_free(&ops->malloc_ops, sizeof(mmio_dispatch_entry_t) * table->num_slots, table->slots);
+    ps_free(&ops->malloc_ops, sizeof(vm_mmio_dispatch_t), table);
+    vm->mem.mmio_dispatch = NULL;
+}
+
+int vm_mmio_dispatch_add(vm_t *vm, uintptr_t addr, size_t size, memory_fault_callback_fn fault_callback,
+                         void *cookie)
+{
+    vm_mmio_dispatch_t *table = vm->mem.mmio_dispatch;
+    uintptr_t page = addr >> seL4_PageBits;
+    if (!table || size == 0 || ((addr + size - 1) >> seL4_PageBits) != page) {
+        return -1;
+    }
+    mmio_dispatch_entry_t *entry = find_entry(table, page);
+    if (entry) {
+        /* The page is shared with another region */
+        entry->num_regions++;
+        entry->fault_callback = NULL;
+        return 0;
+    }
+    int index = slot_index(table, page);
+    for (int i = 0; i < table->num_slots; i++) {
+        entry = &table->slots[index];
+        if (!entry->valid) {
+            entry->page = page;
+            entry->addr = addr;
+            entry->size = size;
+            entry->fault_callback = fault_callback;
+            entry->fault_callback_cookie = cookie;
+            entry->num_regions = 1;
+            entry->valid = true;
+            return 0;
+        }
+        index = (index + 1) % table->num_slots;
+    }
+    ZF_LOGW("MMIO dispatch table full, faults on 0x%x will use the generic fault handler", addr);
+    return -1;
+}
+
+void vm_mmio_dispatch_remove(vm_t *vm, uintptr_t addr, size_t size)
+{
+    vm_mmio_dispatch_t *table = vm->mem.mmio_dispatch;
+    if (!table || size == 0) {
+        return;
+    }
+    mmio_dispatch_entry_t *entry = find_entry(table, addr >> seL4_PageBits);
+    if (!entry) {
+        return;
+    }
+    entry->num_regions--;
+    if (entry->num_regions == 0) {
+        remove_entry(table, entry);
+    }
+}
+
+bool vm_mmio_dispatch_fault(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t addr, size_t size, memory_fault_result_t *result)
+{
+    /* Doorbells take precedence over whatever reservation they lie within */
+    if (vm_doorbell_table_active(vm->mem.doorbells) && !is_vcpu_read_fault(vcpu)
+        && vm_doorbell_ring(vm->mem.doorbells, addr, size, get_vcpu_fault_data(vcpu))) {
+        advance_vcpu_fault(vcpu);
+        *result = FAULT_HANDLED;
+        return true;
+    }
+    vm_mmio_dispatch_t *table = vm->mem.mmio_dispatch;
+    if (!table) {
+        return false;
+    }
+    mmio_dispatch_entry_t *entry = find_entry(table, addr >> seL4_PageBits);
+    if (!entry || !entry->fault_callback || addr < entry->addr || addr + size > entry->addr + entry->size) {
+        return false;
+    }
+    vm_event_trace_mmio_enter(vcpu, addr, size);
+#ifdef CONFIG_LIB_SEL4VM_EXIT_STATS
+    uint64_t callback_start = vm_exit_stats_timestamp();
+#endif
+    *result = entry->fault_callback(vm, vcpu, addr, size, entry->fault_callback_cookie);
+#ifdef CONFIG_LIB_SEL4VM_EXIT_STATS
+    vm_exit_stats_record_mmio(vm, entry->addr, vm_exit_stats_timestamp() - callback_start);
+#endif
+    vm_event_trace(vcpu, VM_EVENT_TRACE_MMIO_EXIT, *result, addr, 0);
+    return true;
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_memory.h>
+
+/**
+ * Initialise the MMIO dispatch table of a VM. The table maps guest physical page numbers directly onto the fault
+ * callback of an unmapped, sub-page sized reservation (e.g. an emulated device's registers) such that faults on
+ * these pages can be dispatched without searching the VM's reservations. The number of table slots is configured
+ * through CONFIG_LIB_SEL4VM_MMIO_DISPATCH_TABLE_SIZE. The table is disabled if this is 0.
+ * @param {vm_t *} vm               A handle to the VM
+ * @return                          0 on success, -1 on error
+ */
+int vm_mmio_dispatch_init(vm_t *vm);
+
+/**
+ * Free the mmio dispatch table of a VM
+ * @param {vm_t *} vm               A handle to the VM
+ */
+void vm_mmio_dispatch_destroy(vm_t *vm);
+
+/**
+ * Add a reservation region to the MMIO dispatch table. The region must lie within a single page. If the page is
+ * already claimed by another region, faults on the page fall back to the generic fault handling path.
+ * @param {vm_t *} vm                                   A handle to the VM
+ * @param {uintptr_t} addr                              Base guest physical address of the region
+ * @param {size_t} size                                 Size of the region in bytes
+ * @param {memory_fault_callback_fn} fault_callback     Callback to invoke on faults in the region
+ * @param {void *} cookie                               Cookie to pass onto the fault callback
+ * @return                                              0 on success, -1 if the region could not be added
+ */
+int vm_mmio_dispatch_add(vm_t *vm, uintptr_t addr, size_t size, memory_fault_callback_fn fault_callback,
+                         void *cookie);
+
+/**
+ * Remove a region previously added with 'vm_mmio_dispatch_add' from the MMIO dispatch table
+ * @param {vm_t *} vm               A handle to the VM
+ * @param {uintptr_t} addr          Base guest physical address of the region
+ * @param {size_t} size             Size of the region in bytes
+ */
+void vm_mmio_dispatch_remove(vm_t *vm, uintptr_t addr, size_t size);
+
+/**
+ * Dispatch a memory fault through the MMIO dispatch table. This is intended to be called by the architecture fault
+ * handlers before falling back onto 'vm_memory_handle_fault'. Writes ringing a doorbell registered through
+ * 'vm_register_mmio_doorbell' are completed here before the table is consulted.
+ * @param {vm_t *} vm                           A handle to the VM
+ * @param {vm_vcpu_t *} vcpu                    A handle to the faulting vcpu
+ * @param {uintptr_t} addr                      Faulting address
+ * @param {size_t} size                         Size of the faulting access
+ * @param {memory_fault_result_t *} result      Set with the result of the fault callback if the fault was dispatched
+ * @return                                      true if the fault was dispatched, false if it needs to be handled
+ *                                              through 'vm_memory_handle_fault'
+ */
+bool vm_mmio_dispatch_fault(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t addr, size_t size, memory_fault_result_t *result);
@@ -4,136 +4,308 @@
  * SPDX-License-Identifier: BSD-2-Clause
  */
 
+#include <autoconf.h>
+#include <sel4vm/gen_config.h>
+
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include <sel4/sel4.h>
+#include <vka/capops.h>
 
 #include <sel4vm/guest_vm.h>
 #include <sel4vm/guest_ram.h>
 #include <sel4vm/guest_memory.h>
+#include <sel4vm/guest_memory_helpers.h>
+#include <sel4vm/guest_iospace.h>
+#include <sel4vm/guest_vm_boot_phases.h>
 
 #include "guest_memory.h"
+#include "guest_ram_cache.h"
+#include "guest_dirty_log.h"
+#include "guest_ram_share.h"
+#include "guest_ram_placement.h"
+#include "guest_ram_pool.h"
+#include "guest_ram_copy_arch.h"
+
+/* Smallest copy worth streaming, below which the partial lines and store fence outweigh
+ * bypassing the cache */
+#define RAM_COPY_STREAM_MIN 1024
 
 struct guest_mem_touch_params {
     void *data;
     size_t size;
     size_t offset;
     uintptr_t current_addr;
+    /* Base guest physical address of the touch */
+    uintptr_t base_addr;
     vm_t *vm;
     ram_touch_callback_fn touch_fn;
 };
 
-static int push_guest_ram_region(vm_mem_t *guest_memory, uintptr_t start, size_t size, int allocated)
+struct ram_alloc_iterator_cookie {
+    vm_t *vm;
+    vm_memory_reservation_t *reservation;
+    /* Host node to allocate frames from, -1 for any */
+    int node;
+    /* Frames of untyped RAM retyped ahead of the iterator, when it maps the
+     * reservation in address order. NULL to allocate frames one by one */
+    vm_frame_batch_t *batch;
+};
+
+struct guest_iov_touch_params {
+    const vm_host_iovec_t *host_iov;
+    int host_iovcnt;
+    /* Current position in the host buffer list */
+    int host_idx;
+    size_t host_offset;
+    bool to_guest;
+};
+
+/* Free RAM regions ordered by size and then address, such that the best fit for an allocation is found with a
+ * binary search. Each entry mirrors a free entry of 'ram_regions' */
+struct vm_ram_free_index {
+    int num_extents;
+    vm_ram_region_t *extents;
+};
+
+/* Index of the first region ending after 'addr', the only region that can contain it */
+static int find_ram_region(vm_mem_t *guest_memory, uintptr_t addr)
 {
-    int last_region = guest_memory->num_ram_regions;
-    if (size == 0) {
-        return -1;
+    int low = 0;
+    int high = guest_memory->num_ram_regions;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        vm_ram_region_t *region = &guest_memory->ram_regions[mid];
+        if (region->start + region->size <= addr) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
     }
-    vm_ram_region_t *extended_regions = realloc(guest_memory->ram_regions, sizeof(vm_ram_region_t) * (last_region + 1));
-    if (extended_regions == NULL) {
+    return low;
+}
+
+/* Make room for 'extra' more regions, such that inserting them can't fail part way through an update */
+static int reserve_ram_regions(vm_mem_t *guest_memory, int extra)
+{
+    vm_ram_region_t *regions = realloc(guest_memory->ram_regions,
+                                       sizeof(vm_ram_region_t) * (guest_memory->num_ram_regions + extra));
+    if (!regions) {
         return -1;
     }
-    guest_memory->ram_regions = extended_regions;
-
-    guest_memory->ram_regions[last_region].start = start;
-    guest_memory->ram_regions[last_region].size = size;
-    guest_memory->ram_regions[last_region].allocated = allocated;
-    guest_memory->num_ram_regions++;
+    guest_memory->ram_regions = regions;
     return 0;
 }
 
-static int ram_region_cmp(const void *a, const void *b)
+/* Insert a region at 'index', room for it must have been reserved */
+static void insert_ram_region(vm_mem_t *guest_memory, int index, uintptr_t start, size_t size, int allocated)
 {
-    const vm_ram_region_t *aa = a;
-    const vm_ram_region_t *bb = b;
-    return aa->start - bb->start;
+    vm_ram_region_t *regions = guest_memory->ram_regions;
+    memmove(&regions[index + 1], &regions[index], sizeof(vm_ram_region_t) * (guest_memory->num_ram_regions - index));
+    regions[index] = (vm_ram_region_t) {
+        .start = start,
+        .size = size,
+        .allocated = allocated,
+    };
+    guest_memory->num_ram_regions++;
 }
 
-static void sort_guest_ram_regions(vm_mem_t *guest_memory)
+static void remove_ram_region(vm_mem_t *guest_memory, int index)
 {
-    qsort(guest_memory->ram_regions, guest_memory->num_ram_regions, sizeof(vm_ram_region_t), ram_region_cmp);
+    guest_memory->num_ram_regions--;
+    memmove(&guest_memory->ram_regions[index], &guest_memory->ram_regions[index + 1],
+            sizeof(vm_ram_region_t) * (guest_memory->num_ram_regions - index));
 }
 
-static void guest_ram_remove_region(vm_mem_t *guest_memory, int region)
+/* Position of the first free extent not ordered before one of 'size' bytes at 'start' */
+static int find_free_extent(vm_ram_free_index_t *index, uintptr_t start, size_t size)
 {
-    if (region >= guest_memory->num_ram_regions) {
-        return;
+    int low = 0;
+    int high = index->num_extents;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        vm_ram_region_t *extent = &index->extents[mid];
+        if (extent->size < size || (extent->size == size && extent->start < start)) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
     }
-    guest_memory->num_ram_regions--;
-    memmove(&guest_memory->ram_regions[region], &guest_memory->ram_regions[region + 1],
-            sizeof(vm_ram_region_t) * (guest_memory->num_ram_regions - region));
-    /* realloc it smaller */
-    guest_memory->ram_regions = realloc(guest_memory->ram_regions, sizeof(vm_ram_region_t) * guest_memory->num_ram_regions);
+    return low;
 }
 
-static void collapse_guest_ram_regions(vm_mem_t *guest_memory)
+static int add_free_extent(vm_mem_t *guest_memory, uintptr_t start, size_t size)
 {
-    int i;
-    for (i = 1; i < guest_memory->num_ram_regions;) {
-        /* Only collapse regions with the same allocation flag that are contiguous */
-        if (guest_memory->ram_regions[i - 1].allocated == guest_memory->ram_regions[i].allocated &&
-            guest_memory->ram_regions[i - 1].start + guest_memory->ram_regions[i - 1].size == guest_memory->ram_regions[i].start) {
-
-            guest_memory->ram_regions[i - 1].size += guest_memory->ram_regions[i].size;
-            guest_ram_remove_region(guest_memory, i);
-        } else {
-            /* We are satisified that this entry cannot be merged. So now we
-             * move onto the next one */
-            i++;
+    vm_ram_free_index_t *index = guest_memory->ram_free_index;
+    if (!index) {
+        index = calloc(1, sizeof(vm_ram_free_index_t));
+        if (!index) {
+            return -1;
         }
+        guest_memory->ram_free_index = index;
     }
+    vm_ram_region_t *extents = realloc(index->extents, sizeof(vm_ram_region_t) * (index->num_extents + 1));
+    if (!extents) {
+        return -1;
+    }
+    index->extents = extents;
+    int pos = find_free_extent(index, start, size);
+    memmove(&extents[pos + 1], &extents[pos], sizeof(vm_ram_region_t) * (index->num_extents - pos));
+    extents[pos] = (vm_ram_region_t) {
+        .start = start,
+        .size = size,
+        .allocated = 0,
+    };
+    index->num_extents++;
+    return 0;
+}
+
+static void remove_free_extent(vm_mem_t *guest_memory, uintptr_t start, size_t size)
+{
+    vm_ram_free_index_t *index = guest_memory->ram_free_index;
+    int pos = find_free_extent(index, start, size);
+    assert(pos < index->num_extents && index->extents[pos].start == start);
+    index->num_extents--;
+    memmove(&index->extents[pos], &index->extents[pos + 1], sizeof(vm_ram_region_t) * (index->num_extents - pos));
 }
 
 static int expand_guest_ram_region(vm_t *vm, uintptr_t start, size_t bytes)
 {
-    int err;
     vm_mem_t *guest_memory = &vm->mem;
-    /* blindly put a new region at the end */
-    err = push_guest_ram_region(guest_memory, start, bytes, 0);
-    if (err) {
+    if (bytes == 0) {
+        ZF_LOGE("Failed to expand guest ram region: Empty region");
+        return -1;
+    }
+    if (reserve_ram_regions(guest_memory, 1)) {
         ZF_LOGE("Failed to expand guest ram region");
-        return err;
+        return -1;
+    }
+    /* Merge the new region with whichever free neighbours it is contiguous with */
+    int index = find_ram_region(guest_memory, start);
+    vm_ram_region_t *prev = index > 0 ? &guest_memory->ram_regions[index - 1] : NULL;
+    vm_ram_region_t *next = index < guest_memory->num_ram_regions ? &guest_memory->ram_regions[index] : NULL;
+    if (prev && (prev->allocated || prev->start + prev->size != start)) {
+        prev = NULL;
+    }
+    if (next && (next->allocated || start + bytes != next->start)) {
+        next = NULL;
+    }
+    uintptr_t merged_start = prev ? prev->start : start;
+    size_t merged_size = bytes + (prev ? prev->size : 0) + (next ? next->size : 0);
+    if (add_free_extent(guest_memory, merged_start, merged_size)) {
+        ZF_LOGE("Failed to expand guest ram region: Unable to grow free index");
+        return -1;
+    }
+    if (prev) {
+        remove_free_extent(guest_memory, prev->start, prev->size);
+        prev->size = merged_size;
+    }
+    if (next) {
+        remove_free_extent(guest_memory, next->start, next->size);
+        if (prev) {
+            remove_ram_region(guest_memory, index);
+        } else {
+            next->start = merged_start;
+            next->size = merged_size;
+        }
+    }
+    if (!prev && !next) {
+        insert_ram_region(guest_memory, index, start, bytes, 0);
     }
-    /* sort the region we just added */
-    sort_guest_ram_regions(guest_memory);
-    /* collapse any contiguous regions */
-    collapse_guest_ram_regions(guest_memory);
     return 0;
 }
 
 static bool is_ram_region(vm_t *vm, uintptr_t addr, size_t size)
 {
     vm_mem_t *guest_memory = &vm->mem;
-    for (int i = 0; i < guest_memory->num_ram_regions; i++) {
-        if (guest_memory->ram_regions[i].start <= addr &&
-            guest_memory->ram_regions[i].start + guest_memory->ram_regions[i].size >= addr + size) {
-            /* We are within a ram region*/
-            return true;
-        }
+    int index = find_ram_region(guest_memory, addr);
+    if (index == guest_memory->num_ram_regions) {
+        return false;
     }
-    return false;
+    vm_ram_region_t *region = &guest_memory->ram_regions[index];
+    /* We are within a ram region */
+    return region->start <= addr && region->start + region->size >= addr + size;
+}
+
+/* Give a page of RAM released with vm_ram_release a fresh frame */
+static int ram_repopulate_page(vm_t *vm, uintptr_t addr)
+{
+    vka_object_t object;
+    int err = vm_ram_pool_take_frame(vm, seL4_PageBits, &object);
+    if (err) {
+        err = vka_alloc_frame(vm->vka, seL4_PageBits, &object);
+    }
+    if (err) {
+        ZF_LOGE("Failed to allocate frame for address 0x%x", addr);
+        return -1;
+    }
+    vm_frame_t frame = { object.cptr, seL4_AllRights, addr, seL4_PageBits, object.ut };
+    err = vm_memory_map_frame(vm, frame);
+    if (err && object.ut) {
+        vka_free_object(vm->vka, &object);
+    } else if (err) {
+        /* A frame of the ram pool, whose untyped the pool keeps */
+        cspacepath_t path;
+        vka_cspace_make_path(vm->vka, object.cptr, &path);
+        vka_cnode_delete(&path);
+        vka_cspace_free_path(vm->vka, path);
+    }
+    return err ? -1 : 0;
+}
+
+static bool ram_page_released(vm_t *vm, uintptr_t addr)
+{
+    return vm_memory_frame_size_bits(vm, addr) == seL4_PageBits &&
+           vspace_get_cap(&vm->mem.vm_vspace, (void *)PAGE_ALIGN_4K(addr)) == seL4_CapNull;
 }
 
 static memory_fault_result_t default_ram_fault_callback(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t fault_addr,
                                                         size_t fault_length, void *cookie)
 {
+    /* Released pages may be used again by the guest before it has said so */
+    if (ram_page_released(vm, fault_addr) && !ram_repopulate_page(vm, PAGE_ALIGN_4K(fault_addr))) {
+        return FAULT_RESTART;
+    }
     /* We don't handle RAM faults by default unless the callback is specifically overrided, hence we fail here */
     ZF_LOGE("ERROR: UNHANDLED RAM FAULT");
     return FAULT_ERROR;
 }
 
+void vm_ram_copy(void *dest, const void *src, size_t size, vm_ram_copy_hint_t hint)
+{
+    if (hint != VM_RAM_COPY_STREAM || size < RAM_COPY_STREAM_MIN) {
+        memcpy(dest, src, size);
+        return;
+    }
+    /* Stream the cache line aligned middle of the copy, copying the ends and anything the
+     * architecture can't stream normally */
+    size_t head = MIN(size, ROUND_UP((uintptr_t)dest, 64) - (uintptr_t)dest);
+    memcpy(dest, src, head);
+    size_t done = head + vm_ram_copy_stream_lines(dest + head, src + head, size - head);
+    memcpy(dest + done, src + done, size - done);
+    if (done != head) {
+        vm_ram_copy_stream_fence();
+    }
+}
+
 /* Helpers for use with touch below */
 int vm_guest_ram_read_callback(vm_t *vm, uintptr_t addr, void *vaddr, size_t size, size_t offset, void *buf)
 {
-    memcpy(buf, vaddr, size);
+    vm_ram_copy(buf + offset, vaddr, size, VM_RAM_COPY_CACHED);
     return 0;
 }
 
 int vm_guest_ram_write_callback(vm_t *vm, uintptr_t addr, void *vaddr, size_t size, size_t offset, void *buf)
 {
-    memcpy(vaddr, buf, size);
+    vm_ram_copy(vaddr, buf + offset, size, VM_RAM_COPY_CACHED);
+    return 0;
+}
+
+int vm_guest_ram_stream_write_callback(vm_t *vm, uintptr_t addr, void *vaddr, size_t size, size_t offset, void *buf)
+{
+    vm_ram_copy(vaddr, buf + offset, size, VM_RAM_COPY_STREAM);
     return 0;
 }
 
@@ -147,11 +319,80 @@ static int touch_access_callback(void *access_addr, void *vaddr, void *cookie)
                                  guest_touch->size, guest_touch->offset, guest_touch->data);
 }
 
+/* Touch the pages of a region from 'current_addr' on, advancing it past each page touched. With a mapping window, pages
+ * are mapped into the window and touching stops at the first page not backed by a mapped 4K frame, which is left to be
+ * touched with the memory lock held for writing */
+static int ram_touch_pages(vm_t *vm, uintptr_t *current_addr, uintptr_t end_addr, vm_ram_window_t *window,
+                           struct guest_mem_touch_params *access_cookie)
+{
+    uintptr_t next_addr;
+    for (; *current_addr < end_addr; *current_addr = next_addr) {
+        /* Guest RAM may be backed by frames larger than a page, these are accessed whole */
+        size_t frame_bits = vm_memory_frame_size_bits(vm, *current_addr);
+        uintptr_t current_aligned = ROUND_DOWN(*current_addr, BIT(frame_bits));
+        uintptr_t next_page_start = current_aligned + BIT(frame_bits);
+        next_addr = MIN(end_addr, next_page_start);
+        access_cookie->size = next_addr - *current_addr;
+        access_cookie->offset = *current_addr - access_cookie->base_addr;
+        access_cookie->current_addr = *current_addr;
+        void *cached_vaddr = NULL;
+        if (frame_bits == seL4_PageBits) {
+            cached_vaddr = window ? vm_ram_map_cache_find_direct(vm, current_aligned, PAGE_SIZE_4K) :
+                           vm_ram_map_cache_lookup(vm, current_aligned);
+        }
+        if (cached_vaddr) {
+            int result = touch_access_callback((void *)current_aligned, cached_vaddr, access_cookie);
+            if (result) {
+                return result;
+            }
+            continue;
+        }
+        if (window) {
+            if (frame_bits != seL4_PageBits || ram_page_released(vm, current_aligned)) {
+                return 0;
+            }
+            int result = vm_ram_map_cache_window_access(vm, window, current_aligned, touch_access_callback,
+                                                        access_cookie);
+            if (result) {
+                return result;
+            }
+            continue;
+        }
+        if (ram_page_released(vm, current_aligned) && ram_repopulate_page(vm, current_aligned)) {
+            ZF_LOGE("Failed to touch ram region: Unable to repopulate released page");
+            return -1;
+        }
+        int result = vspace_access_page_with_callback(&vm->mem.vm_vspace, &vm->mem.vmm_vspace, (void *)current_aligned,
+                                                      frame_bits, seL4_AllRights, 1, touch_access_callback, access_cookie);
+        if (result) {
+            return result;
+        }
+    }
+    return 0;
+}
+
+static int ram_touch_prepare(vm_t *vm, uintptr_t addr, size_t size)
+{
+#ifdef CONFIG_LIB_SEL4VM_LAZY_RAM
+    /* RAM the guest has not yet faulted on is populated when touched */
+    if (vm_memory_populate(vm, addr, size)) {
+        ZF_LOGE("Failed to touch ram region: Unable to populate region");
+        return -1;
+    }
+#endif
+    /* Writes through the VMM's mappings don't fault, so anything touched is taken as written */
+    if (vm_ram_share_unshare(vm, addr, size)) {
+        ZF_LOGE("Failed to touch ram region: Unable to unshare pages");
+        return -1;
+    }
+    vm_dirty_log_mark(vm, addr, size);
+    return 0;
+}
+
 int vm_ram_touch(vm_t *vm, uintptr_t addr, size_t size, ram_touch_callback_fn touch_callback, void *cookie)
 {
     struct guest_mem_touch_params access_cookie;
-    uintptr_t current_addr;
-    uintptr_t next_addr;
+    uintptr_t current_addr = addr;
     uintptr_t end_addr = (uintptr_t)(addr + size);
     if (!is_ram_region(vm, addr, size)) {
         ZF_LOGE("Failed to touch ram region: Not registered RAM region");
@@ -160,45 +401,267 @@ int vm_ram_touch(vm_t *vm, uintptr_t addr, size_t size, ram_touch_callback_fn to
     access_cookie.touch_fn = touch_callback;
     access_cookie.data = cookie;
     access_cookie.vm = vm;
-    for (current_addr = addr; current_addr < end_addr; current_addr = next_addr) {
-        uintptr_t current_aligned = PAGE_ALIGN_4K(current_addr);
-        uintptr_t next_page_start = current_aligned + PAGE_SIZE_4K;
-        next_addr = MIN(end_addr, next_page_start);
-        access_cookie.size = next_addr - current_addr;
-        access_cookie.offset = current_addr - addr;
-        access_cookie.current_addr = current_addr;
-        int result = vspace_access_page_with_callback(&vm->mem.vm_vspace, &vm->mem.vmm_vspace, (void *)current_aligned,
-                                                      seL4_PageBits, seL4_AllRights, 1, touch_access_callback, &access_cookie);
-        if (result) {
+    access_cookie.base_addr = addr;
+    vm_memory_write_lock(vm);
+    if (ram_touch_prepare(vm, addr, size)) {
+        vm_memory_write_unlock(vm);
+        return -1;
+    }
+    /* Threads with their own mapping window only need to keep the frames they map from changing */
+    vm_ram_window_t *window = vm_ram_map_cache_window(vm);
+    if (window) {
+        vm_memory_write_unlock(vm);
+        vm_memory_read_lock(vm);
+        int result = ram_touch_pages(vm, &current_addr, end_addr, window, &access_cookie);
+        vm_memory_read_unlock(vm);
+        if (result || current_addr == end_addr) {
             return result;
         }
+        vm_memory_write_lock(vm);
+    }
+    int result = ram_touch_pages(vm, &current_addr, end_addr, NULL, &access_cookie);
+    vm_memory_write_unlock(vm);
+    return result;
+}
+
+static int iov_touch_callback(vm_t *vm, uintptr_t guest_addr, void *vaddr, size_t size, size_t offset, void *cookie)
+{
+    struct guest_iov_touch_params *params = (struct guest_iov_touch_params *)cookie;
+    while (size > 0 && params->host_idx < params->host_iovcnt) {
+        const vm_host_iovec_t *host = &params->host_iov[params->host_idx];
+        size_t copy = MIN(size, host->len - params->host_offset);
+        void *host_vaddr = host->base + params->host_offset;
+        if (params->to_guest) {
+            vm_ram_copy(vaddr, host_vaddr, copy, VM_RAM_COPY_CACHED);
+        } else {
+            vm_ram_copy(host_vaddr, vaddr, copy, VM_RAM_COPY_CACHED);
+        }
+        vaddr += copy;
+        size -= copy;
+        params->host_offset += copy;
+        if (params->host_offset == host->len) {
+            params->host_idx++;
+            params->host_offset = 0;
+        }
     }
     return 0;
 }
 
-int vm_ram_find_largest_free_region(vm_t *vm, uintptr_t *addr, size_t *size)
+static int ram_copyv(vm_t *vm, const vm_guest_iovec_t *guest_iov, int guest_iovcnt, const vm_host_iovec_t *host_iov,
+                     int host_iovcnt, bool to_guest, size_t *copied)
 {
-    vm_mem_t *guest_memory = &vm->mem;
-    int largest = -1;
-    int i;
-    /* find a first region */
-    for (i = 0; i < guest_memory->num_ram_regions && largest == -1; i++) {
-        if (!guest_memory->ram_regions[i].allocated) {
-            largest = i;
+    struct guest_iov_touch_params params = {
+        .host_iov = host_iov,
+        .host_iovcnt = host_iovcnt,
+        .host_idx = 0,
+        .host_offset = 0,
+        .to_guest = to_guest
+    };
+    size_t host_len = 0;
+    size_t total = 0;
+    for (int i = 0; i < host_iovcnt; i++) {
+        host_len += host_iov[i].len;
+    }
+    for (int i = 0; i < guest_iovcnt && total < host_len; i++) {
+        /* Only touch as much of the guest region as there is host buffer for */
+        size_t len = MIN(guest_iov[i].len, host_len - total);
+        if (len == 0) {
+            continue;
         }
+        int err = vm_ram_touch(vm, guest_iov[i].addr, len, iov_touch_callback, &params);
+        if (err) {
+            return -1;
+        }
+        total += len;
     }
-    if (largest == -1) {
-        ZF_LOGE("Failed to find free region");
+    if (copied) {
+        *copied = total;
+    }
+    return 0;
+}
+
+int vm_ram_readv(vm_t *vm, const vm_guest_iovec_t *guest_iov, int guest_iovcnt, const vm_host_iovec_t *host_iov,
+                 int host_iovcnt, size_t *copied)
+{
+    return ram_copyv(vm, guest_iov, guest_iovcnt, host_iov, host_iovcnt, false, copied);
+}
+
+int vm_ram_writev(vm_t *vm, const vm_guest_iovec_t *guest_iov, int guest_iovcnt, const vm_host_iovec_t *host_iov,
+                  int host_iovcnt, size_t *copied)
+{
+    return ram_copyv(vm, guest_iov, guest_iovcnt, host_iov, host_iovcnt, true, copied);
+}
+
+static int vm_ram_direct_map_locked(vm_t *vm, uintptr_t start, size_t bytes)
+{
+    if (!IS_ALIGNED(start, seL4_PageBits) || !IS_ALIGNED(bytes, seL4_PageBits) || bytes == 0) {
+        ZF_LOGE("Failed to direct map ram region: Region not page aligned");
+        return -1;
+    }
+    if (!is_ram_region(vm, start, bytes)) {
+        ZF_LOGE("Failed to direct map ram region: Not registered RAM region");
+        return -1;
+    }
+#ifdef CONFIG_LIB_SEL4VM_LAZY_RAM
+    if (vm_memory_populate(vm, start, bytes)) {
+        ZF_LOGE("Failed to direct map ram region: Unable to populate region");
+        return -1;
+    }
+#endif
+    for (uintptr_t addr = start; addr < start + bytes; addr += PAGE_SIZE_4K) {
+        if (vm_memory_frame_size_bits(vm, addr) != seL4_PageBits) {
+            ZF_LOGE("Failed to direct map ram region: Region is backed by large frames");
+            return -1;
+        }
+    }
+    return vm_ram_map_cache_add_direct(vm, start, bytes);
+}
+
+int vm_ram_direct_map(vm_t *vm, uintptr_t start, size_t bytes)
+{
+    vm_memory_write_lock(vm);
+    int result = vm_ram_direct_map_locked(vm, start, bytes);
+    vm_memory_write_unlock(vm);
+    return result;
+}
+
+void *vm_guest_ram_vaddr(vm_t *vm, uintptr_t addr, size_t size)
+{
+    vm_memory_read_lock(vm);
+    void *vaddr = vm_ram_map_cache_find_direct(vm, addr, size);
+    vm_memory_read_unlock(vm);
+    return vaddr;
+}
+
+static int vm_ram_map_locked(vm_t *vm, uintptr_t start, size_t bytes, vm_ram_mapping_t *mapping)
+{
+    *mapping = (vm_ram_mapping_t) {
+        .start = start,
+        .size = bytes,
+    };
+    if (bytes == 0 || !is_ram_region(vm, start, bytes)) {
+        ZF_LOGE("Failed to map ram region: Not registered RAM region");
+        return -1;
+    }
+#ifdef CONFIG_LIB_SEL4VM_LAZY_RAM
+    if (vm_memory_populate(vm, start, bytes)) {
+        ZF_LOGE("Failed to map ram region: Unable to populate region");
+        return -1;
+    }
+#endif
+    /* The VMM writes through the mapping without faulting */
+    if (vm_ram_share_unshare(vm, start, bytes)) {
+        ZF_LOGE("Failed to map ram region: Unable to unshare pages");
         return -1;
     }
-    for (i++; i < guest_memory->num_ram_regions; i++) {
-        if (!guest_memory->ram_regions[i].allocated &&
-            guest_memory->ram_regions[i].size > guest_memory->ram_regions[largest].size) {
-            largest = i;
+    size_t frame_bits = vm_memory_frame_size_bits(vm, start);
+    uintptr_t map_start = ROUND_DOWN(start, BIT(frame_bits));
+    uintptr_t map_end = ROUND_UP(start + bytes, BIT(frame_bits));
+    for (uintptr_t addr = map_start; addr < map_end; addr += BIT(frame_bits)) {
+        if (ram_page_released(vm, addr) && ram_repopulate_page(vm, addr)) {
+            ZF_LOGE("Failed to map ram region: Unable to repopulate released page");
+            return -1;
+        }
+        if (vm_memory_frame_size_bits(vm, addr) != frame_bits) {
+            ZF_LOGE("Failed to map ram region: Region is not backed by frames of a single size");
+            return -1;
         }
     }
-    *addr = guest_memory->ram_regions[largest].start;
-    *size = guest_memory->ram_regions[largest].size;
+    return vm_ram_map_cache_pin(vm, map_start, map_end - map_start, frame_bits, mapping);
+}
+
+int vm_ram_map(vm_t *vm, uintptr_t start, size_t bytes, vm_ram_mapping_t *mapping)
+{
+    vm_memory_write_lock(vm);
+    int result = vm_ram_map_locked(vm, start, bytes, mapping);
+    vm_memory_write_unlock(vm);
+    return result;
+}
+
+void vm_ram_unmap(vm_t *vm, vm_ram_mapping_t *mapping)
+{
+    vm_memory_write_lock(vm);
+    if (mapping->vaddr) {
+        vm_ram_map_cache_unpin(vm, mapping);
+    }
+    vm_memory_write_unlock(vm);
+}
+
+int vm_ram_window_create(vm_t *vm)
+{
+    vm_memory_write_lock(vm);
+    int err = vm_ram_map_cache_add_window(vm);
+    vm_memory_write_unlock(vm);
+    return err;
+}
+
+void vm_ram_window_destroy(vm_t *vm)
+{
+    vm_memory_write_lock(vm);
+    vm_ram_map_cache_remove_window(vm);
+    vm_memory_write_unlock(vm);
+}
+
+static void *vm_ram_share_vspace_locked(vm_t *vm, uintptr_t start, size_t bytes, vspace_t *vspace)
+{
+    if (bytes == 0 || !is_ram_region(vm, start, bytes)) {
+        ZF_LOGE("Failed to share ram region: Not registered RAM region");
+        return NULL;
+    }
+#ifdef CONFIG_LIB_SEL4VM_LAZY_RAM
+    if (vm_memory_populate(vm, start, bytes)) {
+        ZF_LOGE("Failed to share ram region: Unable to populate region");
+        return NULL;
+    }
+#endif
+    if (vm_ram_share_unshare(vm, start, bytes)) {
+        ZF_LOGE("Failed to share ram region: Unable to unshare pages");
+        return NULL;
+    }
+    size_t frame_bits = vm_memory_frame_size_bits(vm, start);
+    if (!IS_ALIGNED(start, frame_bits) || !IS_ALIGNED(bytes, frame_bits)) {
+        ZF_LOGE("Failed to share ram region: Region not aligned to its frames");
+        return NULL;
+    }
+    for (uintptr_t addr = start; addr < start + bytes; addr += BIT(frame_bits)) {
+        if (ram_page_released(vm, addr) && ram_repopulate_page(vm, addr)) {
+            ZF_LOGE("Failed to share ram region: Unable to repopulate released page");
+            return NULL;
+        }
+        if (vm_memory_frame_size_bits(vm, addr) != frame_bits) {
+            ZF_LOGE("Failed to share ram region: Region is not backed by frames of a single size");
+            return NULL;
+        }
+    }
+    void *vaddr = vspace_share_mem(&vm->mem.vm_vspace, vspace, (void *)start, bytes >> frame_bits, frame_bits,
+                                   seL4_AllRights, 1);
+    if (!vaddr) {
+        ZF_LOGE("Failed to share ram region: Unable to map region into vspace");
+        return NULL;
+    }
+    return vaddr;
+}
+
+void *vm_ram_share_vspace(vm_t *vm, uintptr_t start, size_t bytes, vspace_t *vspace)
+{
+    vm_memory_write_lock(vm);
+    void *result = vm_ram_share_vspace_locked(vm, start, bytes, vspace);
+    vm_memory_write_unlock(vm);
+    return result;
+}
+
+int vm_ram_find_largest_free_region(vm_t *vm, uintptr_t *addr, size_t *size)
+{
+    vm_ram_free_index_t *index = vm->mem.ram_free_index;
+    if (!index || index->num_extents == 0) {
+        ZF_LOGE("Failed to find free region");
+        return -1;
+    }
+    /* Of the largest free regions, pick the lowest */
+    size_t largest = index->extents[index->num_extents - 1].size;
+    vm_ram_region_t *extent = &index->extents[find_free_extent(index, 0, largest)];
+    *addr = extent->start;
+    *size = extent->size;
     return 0;
 }
 
@@ -206,42 +669,79 @@ void vm_ram_mark_allocated(vm_t *vm, uintptr_t start, size_t bytes)
 {
     vm_mem_t *guest_memory = &vm->mem;
     /* Find the region */
-    int i;
-    int region = -1;
-    for (i = 0; i < guest_memory->num_ram_regions; i++) {
-        if (guest_memory->ram_regions[i].start <= start &&
-            guest_memory->ram_regions[i].start + guest_memory->ram_regions[i].size >= start + bytes) {
-            region = i;
-            break;
-        }
+    int index = find_ram_region(guest_memory, start);
+    if (index == guest_memory->num_ram_regions) {
+        return;
+    }
+    vm_ram_region_t r = guest_memory->ram_regions[index];
+    if (r.allocated || r.start > start || r.start + r.size < start + bytes || bytes == 0) {
+        return;
+    }
+    size_t before = start - r.start;
+    size_t after = r.size - bytes - before;
+    /* Make room for the pieces the region is split into before changing anything */
+    int num_pieces = 1 + (before != 0) + (after != 0);
+    if (reserve_ram_regions(guest_memory, num_pieces - 1)) {
+        ZF_LOGE("Failed to mark ram allocated: Unable to grow region list");
+        return;
     }
-    if (region == -1 || guest_memory->ram_regions[region].allocated) {
+    if ((before && add_free_extent(guest_memory, r.start, before)) ||
+        (after && add_free_extent(guest_memory, start + bytes, after))) {
+        ZF_LOGE("Failed to mark ram allocated: Unable to grow free index");
+        if (before) {
+            remove_free_extent(guest_memory, r.start, before);
+        }
         return;
     }
-    /* Remove the region */
-    vm_ram_region_t r = guest_memory->ram_regions[region];
-    guest_ram_remove_region(guest_memory, region);
-    /* Split the region into three pieces and add them */
-    push_guest_ram_region(guest_memory, r.start, start - r.start, 0);
-    push_guest_ram_region(guest_memory, start, bytes, 1);
-    push_guest_ram_region(guest_memory, start + bytes, r.size - bytes - (start - r.start), 0);
-    /* sort and collapse */
-    sort_guest_ram_regions(guest_memory);
-    collapse_guest_ram_regions(guest_memory);
+    remove_free_extent(guest_memory, r.start, r.size);
+
+    /* Split the region into up to three pieces. Its neighbours are not free and contiguous with it, or they would
+     * have been collapsed into it, so only the allocated piece can merge with them */
+    remove_ram_region(guest_memory, index);
+    if (after) {
+        insert_ram_region(guest_memory, index, start + bytes, after, 0);
+    }
+    vm_ram_region_t *next = index < guest_memory->num_ram_regions ? &guest_memory->ram_regions[index] : NULL;
+    if (!after && next && next->allocated && next->start == start + bytes) {
+        next->start = start;
+        next->size += bytes;
+    } else {
+        insert_ram_region(guest_memory, index, start, bytes, 1);
+    }
+    if (before) {
+        insert_ram_region(guest_memory, index, r.start, before, 0);
+    } else if (index > 0) {
+        vm_ram_region_t *prev = &guest_memory->ram_regions[index - 1];
+        vm_ram_region_t *allocated = &guest_memory->ram_regions[index];
+        if (prev->allocated && prev->start + prev->size == start) {
+            prev->size += allocated->size;
+            remove_ram_region(guest_memory, index);
+        }
+    }
 }
 
 uintptr_t vm_ram_allocate(vm_t *vm, size_t bytes)
 {
-    vm_mem_t *guest_memory = &vm->mem;
-    for (int i = 0; i < guest_memory->num_ram_regions; i++) {
-        if (!guest_memory->ram_regions[i].allocated && guest_memory->ram_regions[i].size >= bytes) {
-            uintptr_t addr = guest_memory->ram_regions[i].start;
-            vm_ram_mark_allocated(vm, addr, bytes);
-            return addr;
-        }
+    vm_ram_free_index_t *index = vm->mem.ram_free_index;
+    /* Best fit, the smallest free region large enough */
+    int pos = index ? find_free_extent(index, 0, bytes) : 0;
+    if (!index || pos == index->num_extents) {
+        ZF_LOGE("Failed to allocate %zu bytes of guest RAM", bytes);
+        return 0;
     }
-    ZF_LOGE("Failed to allocate %zu bytes of guest RAM", bytes);
-    return 0;
+    uintptr_t addr = index->extents[pos].start;
+    vm_ram_mark_allocated(vm, addr, bytes);
+    return addr;
+}
+
+/* Size of the frame backing guest RAM at an address. RAM mirrored into IO spaces
+ * is backed by 4K frames, the only frames IO spaces map */
+static size_t ram_frame_size_bits(vm_t *vm, vm_memory_reservation_t *reservation, uintptr_t addr)
+{
+    if (vm_guest_num_iospaces(vm)) {
+        return seL4_PageBits;
+    }
+    return vm_get_reservation_frame_size_bits(reservation, addr);
 }
 
 static vm_frame_t ram_alloc_iterator(uintptr_t addr, void *cookie)
@@ -249,73 +749,174 @@ static vm_frame_t ram_alloc_iterator(uintptr_t addr, void *cookie)
     int ret;
     vka_object_t object;
     vm_frame_t frame_result = { seL4_CapNull, seL4_NoRights, 0, 0 };
-    vm_t *vm = (vm_t *)cookie;
-    if (!vm) {
+    struct ram_alloc_iterator_cookie *alloc_cookie = (struct ram_alloc_iterator_cookie *)cookie;
+    if (!alloc_cookie) {
         return frame_result;
     }
-    int page_size = seL4_PageBits;
-    uintptr_t frame_start = ROUND_DOWN(addr, BIT(page_size));
-    ret = vka_alloc_frame_maybe_device(vm->vka, page_size, true, &object);
+    vm_t *vm = alloc_cookie->vm;
+    size_t page_size = ram_frame_size_bits(vm, alloc_cookie->reservation, addr);
+    ret = vm_ram_placement_alloc_frame(vm, alloc_cookie->node, page_size, &object);
+    if (ret && page_size != seL4_PageBits) {
+        /* Fall back onto a 4K frame */
+        page_size = seL4_PageBits;
+        ret = vm_ram_placement_alloc_frame(vm, alloc_cookie->node, page_size, &object);
+    }
     if (ret) {
         ZF_LOGE("Failed to allocate frame for address 0x%x", addr);
         return frame_result;
     }
     frame_result.cptr = object.cptr;
     frame_result.rights = seL4_AllRights;
-    frame_result.vaddr = frame_start;
+    frame_result.vaddr = ROUND_DOWN(addr, BIT(page_size));
     frame_result.size_bits = page_size;
+    frame_result.cookie = object.ut;
     return frame_result;
 }
 
+static int ram_ut_alloc_frame(vm_t *vm, uintptr_t frame_start, size_t page_size, cspacepath_t *path,
+                              seL4_Word *vka_cookie)
+{
+    int error = vka_cspace_alloc_path(vm->vka, path);
+    if (error) {
+        ZF_LOGE("Failed to allocate path");
+        return error;
+    }
+    error = vka_utspace_alloc_at(vm->vka, path, kobject_get_type(KOBJECT_FRAME, page_size), page_size, frame_start,
+                                 vka_cookie);
+    if (error) {
+        vka_cspace_free_path(vm->vka, *path);
+    }
+    return error;
+}
+
+/* Number of frames of the same size mapping the reservation from an address on, up to a batch's worth */
+static unsigned int ram_batch_frames(vm_t *vm, vm_memory_reservation_t *reservation, uintptr_t addr,
+                                     size_t size_bits)
+{
+    uintptr_t start;
+    size_t size;
+    vm_get_reservation_memory_region(reservation, &start, &size);
+    unsigned int num_frames = 0;
+    while (num_frames < VM_FRAME_BATCH_MAX_FRAMES && addr + BIT(size_bits) <= start + size &&
+           ram_frame_size_bits(vm, reservation, addr) == size_bits) {
+        num_frames++;
+        addr += BIT(size_bits);
+    }
+    return num_frames;
+}
+
+/* Take the frame from the iterator's batch, retyping a new batch if it doesn't hold it */
+static seL4_CPtr ram_ut_batch_frame(struct ram_alloc_iterator_cookie *alloc_cookie, uintptr_t frame_start,
+                                    size_t page_size)
+{
+    if (!alloc_cookie->batch) {
+        return seL4_CapNull;
+    }
+    seL4_CPtr frame = vm_frame_batch_take(alloc_cookie->batch, frame_start, page_size);
+    if (frame == seL4_CapNull) {
+        vm_t *vm = alloc_cookie->vm;
+        frame = vm_frame_batch_alloc(vm, alloc_cookie->batch, frame_start, page_size,
+                                     ram_batch_frames(vm, alloc_cookie->reservation, frame_start, page_size));
+    }
+    return frame;
+}
+
 static vm_frame_t ram_ut_alloc_iterator(uintptr_t addr, void *cookie)
 {
-    int ret;
     int error;
-    vka_object_t object;
+    cspacepath_t path;
+    seL4_Word vka_cookie;
     vm_frame_t frame_result = { seL4_CapNull, seL4_NoRights, 0, 0 };
-    vm_t *vm = (vm_t *)cookie;
-    if (!vm) {
+    struct ram_alloc_iterator_cookie *alloc_cookie = (struct ram_alloc_iterator_cookie *)cookie;
+    if (!alloc_cookie) {
         return frame_result;
     }
-    int page_size = seL4_PageBits;
-    uintptr_t frame_start = ROUND_DOWN(addr, BIT(page_size));
-    cspacepath_t path;
-    error = vka_cspace_alloc_path(vm->vka, &path);
-    if (error) {
-        ZF_LOGE("Failed to allocate path");
+    vm_t *vm = alloc_cookie->vm;
+    size_t page_size = ram_frame_size_bits(vm, alloc_cookie->reservation, addr);
+    seL4_CPtr frame = ram_ut_batch_frame(alloc_cookie, ROUND_DOWN(addr, BIT(page_size)), page_size);
+    if (frame != seL4_CapNull) {
+        /* The frames of a batch are freed along with their untyped */
+        frame_result.cptr = frame;
+        frame_result.rights = seL4_AllRights;
+        frame_result.vaddr = ROUND_DOWN(addr, BIT(page_size));
+        frame_result.size_bits = page_size;
         return frame_result;
     }
-    seL4_Word vka_cookie;
-    error = vka_utspace_alloc_at(vm->vka, &path, kobject_get_type(KOBJECT_FRAME, page_size), page_size, frame_start,
-                                 &vka_cookie);
+    error = ram_ut_alloc_frame(vm, ROUND_DOWN(addr, BIT(page_size)), page_size, &path, &vka_cookie);
+    if (error && page_size != seL4_PageBits) {
+        /* The untyped covering the address may not fit a large frame, fall back onto a 4K frame */
+        page_size = seL4_PageBits;
+        error = ram_ut_alloc_frame(vm, ROUND_DOWN(addr, BIT(page_size)), page_size, &path, &vka_cookie);
+    }
     if (error) {
         ZF_LOGE("Failed to allocate page");
-        vka_cspace_free_path(vm->vka, path);
         return frame_result;
     }
     frame_result.cptr = path.capPtr;
     frame_result.rights = seL4_AllRights;
-    frame_result.vaddr = frame_start;
+    frame_result.vaddr = ROUND_DOWN(addr, BIT(page_size));
     frame_result.size_bits = page_size;
+    frame_result.cookie = vka_cookie;
     return frame_result;
 }
 
-static int map_ram_reservation(vm_t *vm, vm_memory_reservation_t *ram_reservation, bool untyped)
+static int map_ram_reservation(vm_t *vm, vm_memory_reservation_t *ram_reservation, bool untyped, int node)
 {
     int err;
+#ifdef CONFIG_LIB_SEL4VM_LAZY_RAM
+    /* Frames are allocated and mapped when first faulted on or touched. Faults
+     * of devices on IO spaces are not delivered to the VMM though, so RAM the
+     * guest can hand to passthrough devices is mapped up front */
+    if (vm_guest_num_iospaces(vm)) {
+        vm_frame_batch_t batch = { 0 };
+        struct ram_alloc_iterator_cookie cookie = {
+            .vm = vm, .reservation = ram_reservation, .node = node, .batch = &batch
+        };
+        err = map_vm_memory_reservation(vm, ram_reservation, untyped ? ram_ut_alloc_iterator : ram_alloc_iterator,
+                                        (void *)&cookie);
+        if (err) {
+            ZF_LOGE("Failed to map new ram reservation");
+            return -1;
+        }
+        return 0;
+    }
+    struct ram_alloc_iterator_cookie *lazy_cookie;
+    ps_io_ops_t *ops = vm->io_ops;
+    err = ps_calloc(&ops->malloc_ops, 1, sizeof(struct ram_alloc_iterator_cookie), (void **)&lazy_cookie);
+    if (err) {
+        ZF_LOGE("Failed to lazily map new ram reservation: Unable to allocate iterator cookie");
+        return -1;
+    }
+    lazy_cookie->vm = vm;
+    lazy_cookie->reservation = ram_reservation;
+    lazy_cookie->node = node;
+    err = map_vm_memory_reservation_lazy(vm, ram_reservation, untyped ? ram_ut_alloc_iterator : ram_alloc_iterator,
+                                         (void *)lazy_cookie, CONFIG_LIB_SEL4VM_LAZY_RAM_PREFETCH_PAGES);
+    if (err) {
+        ZF_LOGE("Failed to lazily map new ram reservation");
+        ps_free(&ops->malloc_ops, sizeof(struct ram_alloc_iterator_cookie), lazy_cookie);
+        return -1;
+    }
+    return 0;
+#else
+    vm_frame_batch_t batch = { 0 };
+    struct ram_alloc_iterator_cookie cookie = {
+        .vm = vm, .reservation = ram_reservation, .node = node, .batch = &batch
+    };
     /* We map the reservation immediately, by-passing the deferred mapping functionality
      * This allows us the allocate, touch and manipulate VM RAM prior to the region needing to be
      * faulted upon first */
     if (untyped) {
-        err = map_vm_memory_reservation(vm, ram_reservation, ram_ut_alloc_iterator, (void *)vm);
+        err = map_vm_memory_reservation(vm, ram_reservation, ram_ut_alloc_iterator, (void *)&cookie);
     } else {
-        err = map_vm_memory_reservation(vm, ram_reservation, ram_alloc_iterator, (void *)vm);
+        err = map_vm_memory_reservation(vm, ram_reservation, ram_alloc_iterator, (void *)&cookie);
     }
     if (err) {
         ZF_LOGE("Failed to map new ram reservation");
         return -1;
     }
     return 0;
+#endif /* CONFIG_LIB_SEL4VM_LAZY_RAM */
 }
 
 uintptr_t vm_ram_register(vm_t *vm, size_t bytes)
@@ -329,7 +930,7 @@ uintptr_t vm_ram_register(vm_t *vm, size_t bytes)
         ZF_LOGE("Unable to reserve ram region of size 0x%x", bytes);
         return 0;
     }
-    err = map_ram_reservation(vm, ram_reservation, false);
+    err = map_ram_reservation(vm, ram_reservation, false, -1);
     if (err) {
         vm_free_reserved_memory(vm, ram_reservation);
         return 0;
@@ -344,7 +945,7 @@ uintptr_t vm_ram_register(vm_t *vm, size_t bytes)
     return base_addr;
 }
 
-int vm_ram_register_at(vm_t *vm, uintptr_t start, size_t bytes, bool untyped)
+static int register_ram_at(vm_t *vm, uintptr_t start, size_t bytes, bool untyped, int node)
 {
     vm_memory_reservation_t *ram_reservation;
     int err;
@@ -353,22 +954,38 @@ int vm_ram_register_at(vm_t *vm, uintptr_t start, size_t bytes, bool untyped)
                                            NULL);
     if (!ram_reservation) {
         ZF_LOGE("Unable to reserve ram region at addr 0x%x of size 0x%x", start, bytes);
-        return 0;
+        return -1;
     }
-    err = map_ram_reservation(vm, ram_reservation, untyped);
+    err = map_ram_reservation(vm, ram_reservation, untyped, node);
     if (err) {
         vm_free_reserved_memory(vm, ram_reservation);
-        return 0;
+        return -1;
     }
     err = expand_guest_ram_region(vm, start, bytes);
     if (err) {
         ZF_LOGE("Failed to register new ram region");
         vm_free_reserved_memory(vm, ram_reservation);
-        return 0;
+        return -1;
     }
     return 0;
 }
 
+int vm_ram_register_at(vm_t *vm, uintptr_t start, size_t bytes, bool untyped)
+{
+    int phase = vm_boot_phase_begin("vm_ram_register_at");
+    int err = register_ram_at(vm, start, bytes, untyped, -1);
+    vm_boot_phase_end(phase);
+    return err;
+}
+
+int vm_ram_register_at_node(vm_t *vm, uintptr_t start, size_t bytes, int node)
+{
+    int phase = vm_boot_phase_begin("vm_ram_register_at");
+    int err = register_ram_at(vm, start, bytes, false, node);
+    vm_boot_phase_end(phase);
+    return err;
+}
+
 int vm_ram_register_at_custom_iterator(vm_t *vm, uintptr_t start, size_t bytes, memory_map_iterator_fn map_iterator,
                                        void *cookie)
 {
@@ -397,5 +1014,255 @@ int vm_ram_register_at_custom_iterator(vm_t *vm, uintptr_t start, size_t bytes,
 
 void vm_ram_free(vm_t *vm, uintptr_t start, size_t bytes)
 {
+    /* Drop any VMM mappings of the region, the RAM backing it may be repurposed */
+    vm_ram_map_cache_invalidate(vm, start, bytes);
     return;
 }
+
+void vm_ram_destroy(vm_t *vm)
+{
+#ifdef CONFIG_LIB_SEL4VM_LAZY_RAM
+    ps_io_ops_t *ops = vm->io_ops;
+    /* Lazily mapped RAM reservations hold on to their iterator cookies for as long as they exist */
+    for (int i = 0; i < vm->mem.num_ram_regions; i++) {
+        vm_ram_region_t *region = &vm->mem.ram_regions[i];
+        uintptr_t addr = region->start;
+        while (addr < region->start + region->size) {
+            uintptr_t end = region->start + region->size;
+            void *cookie = vm_memory_lazy_cookie(vm, addr, &end);
+            if (cookie) {
+                ps_free(&ops->malloc_ops, sizeof(struct ram_alloc_iterator_cookie), cookie);
+            }
+            addr = end;
+        }
+    }
+#endif /* CONFIG_LIB_SEL4VM_LAZY_RAM */
+    vm_ram_free_index_t *index = vm->mem.ram_free_index;
+    if (index) {
+        free(index->extents);
+        free(index);
+        vm->mem.ram_free_index = NULL;
+    }
+    free(vm->mem.ram_regions);
+    vm->mem.ram_regions = NULL;
+    vm->mem.num_ram_regions = 0;
+}
+
+int vm_ram_release(vm_t *vm, uintptr_t start, size_t bytes)
+{
+    if (!IS_ALIGNED(start, seL4_PageBits) || !IS_ALIGNED(bytes, seL4_PageBits) || !is_ram_region(vm, start, bytes)) {
+        ZF_LOGE("Failed to release ram: 0x%x of size 0x%zx is not a page aligned ram region", start, bytes);
+        return -1;
+    }
+    /* Shared frames are still in use by other pages, released pages go to frames of their own first */
+    if (vm_ram_share_unshare(vm, start, bytes)) {
+        ZF_LOGE("Failed to release ram: Unable to unshare pages");
+        return -1;
+    }
+    for (uintptr_t addr = start; addr < start + bytes; addr += PAGE_SIZE_4K) {
+        /* Parts of larger frames can't be given up on their own, these pages stay backed */
+        if (vm_memory_frame_size_bits(vm, addr) != seL4_PageBits ||
+            vspace_get_cap(&vm->mem.vm_vspace, (void *)addr) == seL4_CapNull) {
+            continue;
+        }
+        if (vm_memory_unmap_frame(vm, addr, vm->vka)) {
+            ZF_LOGE("Failed to release ram page 0x%x", addr);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int vm_ram_repopulate(vm_t *vm, uintptr_t start, size_t bytes)
+{
+    if (!is_ram_region(vm, start, bytes)) {
+        ZF_LOGE("Failed to repopulate ram: Not registered RAM region");
+        return -1;
+    }
+    for (uintptr_t addr = PAGE_ALIGN_4K(start); addr < start + bytes; addr += PAGE_SIZE_4K) {
+        if (ram_page_released(vm, addr) && ram_repopulate_page(vm, addr)) {
+            ZF_LOGE("Failed to repopulate ram page 0x%x", addr);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static bool page_is_zero(const void *page)
+{
+    const seL4_Word *words = page;
+    for (int i = 0; i < PAGE_SIZE_4K / sizeof(seL4_Word); i++) {
+        if (words[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+struct snapshot_touch_params {
+    vm_ram_snapshot_t *snapshot;
+    uintptr_t start;
+    int max_pages;
+};
+
+static int snapshot_touch_callback(vm_t *vm, uintptr_t guest_addr, void *vaddr, size_t size, size_t offset,
+                                   void *cookie)
+{
+    struct snapshot_touch_params *params = (struct snapshot_touch_params *)cookie;
+    vm_ram_snapshot_t *snapshot = params->snapshot;
+    for (size_t page = 0; page < size; page += PAGE_SIZE_4K) {
+        void *page_vaddr = vaddr + page;
+        if (page_is_zero(page_vaddr)) {
+            continue;
+        }
+        if (snapshot->num_pages == params->max_pages) {
+            int max_pages = params->max_pages ? params->max_pages * 2 : 64;
+            uintptr_t *pages = realloc(snapshot->pages, sizeof(*pages) * max_pages);
+            if (!pages) {
+                ZF_LOGE("Failed to snapshot ram: Unable to grow page list");
+                return -1;
+            }
+            snapshot->pages = pages;
+            void *data = realloc(snapshot->data, (size_t)max_pages * PAGE_SIZE_4K);
+            if (!data) {
+                ZF_LOGE("Failed to snapshot ram: Unable to grow page data");
+                return -1;
+            }
+            snapshot->data = data;
+            params->max_pages = max_pages;
+        }
+        snapshot->pages[snapshot->num_pages] = params->start + offset + page;
+        vm_ram_copy(snapshot->data + (size_t)snapshot->num_pages * PAGE_SIZE_4K, page_vaddr, PAGE_SIZE_4K,
+                    VM_RAM_COPY_STREAM);
+        snapshot->num_pages++;
+    }
+    return 0;
+}
+
+int vm_ram_snapshot(vm_t *vm, vm_ram_snapshot_t *snapshot)
+{
+    vm_mem_t *guest_memory = &vm->mem;
+    struct snapshot_touch_params params = { .snapshot = snapshot };
+    *snapshot = (vm_ram_snapshot_t) {
+        0
+    };
+
+    for (int i = 0; i < guest_memory->num_ram_regions; i++) {
+        vm_ram_region_t *region = &guest_memory->ram_regions[i];
+        if (!region->allocated) {
+            continue;
+        }
+        vm_ram_region_t *regions = realloc(snapshot->regions, sizeof(*regions) * (snapshot->num_regions + 1));
+        if (!regions) {
+            ZF_LOGE("Failed to snapshot ram: Unable to grow region list");
+            vm_ram_snapshot_free(snapshot);
+            return -1;
+        }
+        snapshot->regions = regions;
+        snapshot->regions[snapshot->num_regions++] = *region;
+
+        /* Allocations needn't be page aligned, though the RAM they lie in is */
+        uintptr_t start = ROUND_DOWN(region->start, PAGE_SIZE_4K);
+        uintptr_t end = ROUND_UP(region->start + region->size, PAGE_SIZE_4K);
+        /* Skip pages already held from the end of the previous region */
+        if (snapshot->num_pages && snapshot->pages[snapshot->num_pages - 1] >= start) {
+            start = snapshot->pages[snapshot->num_pages - 1] + PAGE_SIZE_4K;
+        }
+        if (start >= end) {
+            continue;
+        }
+        params.start = start;
+        if (vm_ram_touch(vm, start, end - start, snapshot_touch_callback, &params)) {
+            ZF_LOGE("Failed to snapshot ram region at %p", (void *)region->start);
+            vm_ram_snapshot_free(snapshot);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int vm_ram_restore(vm_t *vm, vm_ram_snapshot_t *snapshot)
+{
+    for (int i = 0; i < snapshot->num_regions; i++) {
+        vm_ram_mark_allocated(vm, snapshot->regions[i].start, snapshot->regions[i].size);
+    }
+    /* Runs of consecutive pages are written with a single touch */
+    for (int i = 0; i < snapshot->num_pages;) {
+        int j = i + 1;
+        while (j < snapshot->num_pages && snapshot->pages[j] == snapshot->pages[j - 1] + PAGE_SIZE_4K) {
+            j++;
+        }
+        int err = vm_ram_touch(vm, snapshot->pages[i], (size_t)(j - i) * PAGE_SIZE_4K,
+                               vm_guest_ram_stream_write_callback, snapshot->data + (size_t)i * PAGE_SIZE_4K);
+        if (err) {
+            ZF_LOGE("Failed to restore ram snapshot at %p", (void *)snapshot->pages[i]);
+            return -1;
+        }
+        i = j;
+    }
+    return 0;
+}
+
+static int zero_touch_callback(vm_t *vm, uintptr_t guest_addr, void *vaddr, size_t size, size_t offset, void *cookie)
+{
+    memset(vaddr, 0, size);
+    return 0;
+}
+
+int vm_ram_reset(vm_t *vm, vm_ram_snapshot_t *snapshot)
+{
+    vm_mem_t *guest_memory = &vm->mem;
+    int page = 0;
+    uintptr_t done = 0;
+    for (int i = 0; i < guest_memory->num_ram_regions; i++) {
+        vm_ram_region_t *region = &guest_memory->ram_regions[i];
+        uintptr_t addr = MAX(ROUND_DOWN(region->start, PAGE_SIZE_4K), done);
+        uintptr_t end = ROUND_UP(region->start + region->size, PAGE_SIZE_4K);
+        while (addr < end) {
+            while (page < snapshot->num_pages && snapshot->pages[page] < addr) {
+                page++;
+            }
+            uintptr_t run_end = addr + PAGE_SIZE_4K;
+            int err;
+            if (page < snapshot->num_pages && snapshot->pages[page] == addr) {
+                /* Runs of consecutive held pages are written with a single touch */
+                int last = page;
+                while (run_end < end && last + 1 < snapshot->num_pages && snapshot->pages[last + 1] == run_end) {
+                    last++;
+                    run_end += PAGE_SIZE_4K;
+                }
+                err = vm_ram_touch(vm, addr, run_end - addr, vm_guest_ram_stream_write_callback,
+                                   snapshot->data + (size_t)page * PAGE_SIZE_4K);
+            } else if (ram_page_released(vm, addr)) {
+                /* Released pages are given zeroed frames when next used */
+                err = 0;
+            } else {
+                uintptr_t next = page < snapshot->num_pages ? snapshot->pages[page] : end;
+                while (run_end < MIN(next, end) && !ram_page_released(vm, run_end)) {
+                    run_end += PAGE_SIZE_4K;
+                }
+                err = vm_ram_touch(vm, addr, run_end - addr, zero_touch_callback, NULL);
+            }
+            if (err) {
+                ZF_LOGE("Failed to reset ram at %p", (void *)addr);
+                return -1;
+            }
+            addr = run_end;
+        }
+        done = MAX(done, end);
+    }
+    for (int i = 0; i < snapshot->num_regions; i++) {
+        vm_ram_mark_allocated(vm, snapshot->regions[i].start, snapshot->regions[i].size);
+    }
+    return 0;
+}
+
+void vm_ram_snapshot_free(vm_ram_snapshot_t *snapshot)
+{
+    free(snapshot->regions);
+    free(snapshot->pages);
+    free(snapshot->data);
+    *snapshot = (vm_ram_snapshot_t) {
+        0
+    };
+}
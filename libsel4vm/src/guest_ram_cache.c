@@ -0,0 +1,472 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <autoconf.h>
+#include <sel4vm/gen_config.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <sel4/sel4.h>
+#include <sel4utils/mapping.h>
+#include <utils/util.h>
+#include <vka/capops.h>
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_ram.h>
+
+#include "guest_ram_cache.h"
+#include "guest_dirty_log.h"
+
+typedef struct ram_map_cache_entry {
+    /* Guest physical address of the cached page */
+    uintptr_t guest_page;
+    /* Address the page is mapped to in the VMM vspace */
+    void *vmm_vaddr;
+    /* Value of the cache tick when this entry was last used */
+    uint64_t last_used;
+    bool valid;
+} ram_map_cache_entry_t;
+
+typedef struct ram_direct_map {
+    /* Guest physical region mapped into the VMM */
+    uintptr_t start;
+    size_t size;
+    /* Base address of the region in the VMM vspace */
+    void *vmm_vaddr;
+} ram_direct_map_t;
+
+typedef struct ram_pinned_map {
+    /* Frame aligned guest physical region mapped into the VMM, and the size of its frames */
+    uintptr_t start;
+    size_t size;
+    size_t frame_bits;
+    void *vmm_vaddr;
+    /* The user's handle to the mapping, cleared when the mapping is invalidated */
+    vm_ram_mapping_t *mapping;
+} ram_pinned_map_t;
+
+/* A page of the VMM vspace a thread maps guest frames into by itself, through a copy of the frame's cap */
+struct vm_ram_window {
+    /* The thread, identified by its IPC buffer */
+    void *owner;
+    void *vmm_vaddr;
+    reservation_t reservation;
+    /* Frame first mapped at 'vmm_vaddr', leaving the paging structures for the window in place */
+    vka_object_t frame;
+    /* Slot the cap of the guest frame is copied to while it is mapped */
+    cspacepath_t slot;
+    struct vm_ram_window *next;
+};
+
+struct vm_ram_map_cache {
+    /* Monotonic counter used to order entries by recency */
+    uint64_t tick;
+    int num_entries;
+    ram_map_cache_entry_t *entries;
+    /* Regions mapped contiguously into the VMM for the lifetime of the VM */
+    int num_direct_maps;
+    ram_direct_map_t *direct_maps;
+    /* Regions mapped into the VMM until unmapped or their frames change */
+    int num_pinned_maps;
+    ram_pinned_map_t *pinned_maps;
+    /* Mapping windows of the threads accessing guest ram */
+    vm_ram_window_t *windows;
+};
+
+static void evict_entry(vm_t *vm, ram_map_cache_entry_t *entry)
+{
+    vspace_unmap_pages(&vm->mem.vmm_vspace, entry->vmm_vaddr, 1, seL4_PageBits, VSPACE_FREE);
+    entry->valid = false;
+    entry->vmm_vaddr = NULL;
+}
+
+static void remove_direct_map(vm_t *vm, int index)
+{
+    vm_ram_map_cache_t *cache = vm->mem.ram_map_cache;
+    ram_direct_map_t *map = &cache->direct_maps[index];
+    vspace_unmap_pages(&vm->mem.vmm_vspace, map->vmm_vaddr, map->size >> seL4_PageBits, seL4_PageBits, VSPACE_FREE);
+    cache->num_direct_maps--;
+    memmove(map, map + 1, sizeof(ram_direct_map_t) * (cache->num_direct_maps - index));
+}
+
+static void remove_pinned_map(vm_t *vm, int index)
+{
+    vm_ram_map_cache_t *cache = vm->mem.ram_map_cache;
+    ram_pinned_map_t *map = &cache->pinned_maps[index];
+    vspace_unmap_pages(&vm->mem.vmm_vspace, map->vmm_vaddr, map->size >> map->frame_bits, map->frame_bits,
+                       VSPACE_FREE);
+    map->mapping->vaddr = NULL;
+    cache->num_pinned_maps--;
+    memmove(map, map + 1, sizeof(ram_pinned_map_t) * (cache->num_pinned_maps - index));
+}
+
+static void free_window(vm_t *vm, vm_ram_window_t *window)
+{
+    vka_cspace_free_path(vm->vka, window->slot);
+    vspace_unmap_pages(&vm->mem.vmm_vspace, window->vmm_vaddr, 1, seL4_PageBits, VSPACE_PRESERVE);
+    vka_free_object(vm->vka, &window->frame);
+    vspace_free_reservation(&vm->mem.vmm_vspace, window->reservation);
+    ps_free(&vm->io_ops->malloc_ops, sizeof(vm_ram_window_t), window);
+}
+
+int vm_ram_map_cache_init(vm_t *vm)
+{
+    vm_ram_map_cache_t *cache;
+    int err;
+    ps_io_ops_t *ops = vm->io_ops;
+
+    err = ps_calloc(&ops->malloc_ops, 1, sizeof(vm_ram_map_cache_t), (void **)&cache);
+    if (err) {
+        ZF_LOGE("Failed to initialise ram map cache: Unable to allocate cache");
+        return -1;
+    }
+    if (CONFIG_LIB_SEL4VM_RAM_MAP_CACHE_SIZE > 0) {
+        err = ps_calloc(&ops->malloc_ops, CONFIG_LIB_SEL4VM_RAM_MAP_CACHE_SIZE, sizeof(ram_map_cache_entry_t),
+                        (void **)&cache->entries);
+        if (err) {
+            ZF_LOGE("Failed to initialise ram map cache: Unable to allocate cache entries");
+            ps_free(&ops->malloc_ops, sizeof(vm_ram_map_cache_t), cache);
+            return -1;
+        }
+        cache->num_entries = CONFIG_LIB_SEL4VM_RAM_MAP_CACHE_SIZE;
+    }
+    vm->mem.ram_map_cache = cache;
+    return 0;
+}
+
+void vm_ram_map_cache_destroy(vm_t *vm)
+{
+    vm_ram_map_cache_t *cache = vm->mem.ram_map_cache;
+    ps_io_ops_t *ops = vm->io_ops;
+    if (!cache) {
+        return;
+    }
+    for (int i = 0; i < cache->num_entries; i++) {
+        if (cache->entries[i].valid) {
+            evict_entry(vm, &cache->entries[i]);
+        }
+    }
+    while (cache->num_direct_maps) {
+        remove_direct_map(vm, cache->num_direct_maps - 1);
+    }
+    while (cache->num_pinned_maps) {
+        remove_pinned_map(vm, cache->num_pinned_maps - 1);
+    }
+    /* The windows of every thread go, not only the caller's */
+    while (cache->windows) {
+        vm_ram_window_t *window = cache->windows;
+        cache->windows = window->next;
+        free_window(vm, window);
+    }
+    free(cache->direct_maps);
+    free(cache->pinned_maps);
+    if (cache->entries) {
+        ps_free(&ops->malloc_ops, sizeof(ram_map_cache_entry_t) * cache->num_entries, cache->entries);
+    }
+    ps_free(&ops->malloc_ops, sizeof(vm_ram_map_cache_t), cache);
+    vm->mem.ram_map_cache = NULL;
+}
+
+int vm_ram_map_cache_add_direct(vm_t *vm, uintptr_t start, size_t size)
+{
+    vm_ram_map_cache_t *cache = vm->mem.ram_map_cache;
+    if (!cache) {
+        ZF_LOGE("Failed to direct map ram: ram map cache not initialised");
+        return -1;
+    }
+    if (vm_ram_map_cache_find_direct(vm, start, size)) {
+        /* Already mapped */
+        return 0;
+    }
+    ram_direct_map_t *extended_maps = realloc(cache->direct_maps,
+                                              sizeof(ram_direct_map_t) * (cache->num_direct_maps + 1));
+    if (!extended_maps) {
+        ZF_LOGE("Failed to direct map ram: Unable to allocate direct map entry");
+        return -1;
+    }
+    cache->direct_maps = extended_maps;
+    /* Drop any individually cached pages of the region, they are superseded by the direct mapping */
+    vm_ram_map_cache_invalidate(vm, start, size);
+    void *vmm_vaddr = vspace_share_mem(&vm->mem.vm_vspace, &vm->mem.vmm_vspace, (void *)start,
+                                       size >> seL4_PageBits, seL4_PageBits, seL4_AllRights, 1);
+    if (!vmm_vaddr) {
+        ZF_LOGE("Failed to direct map ram: Unable to map guest region 0x%x into vmm vspace", start);
+        return -1;
+    }
+    cache->direct_maps[cache->num_direct_maps].start = start;
+    cache->direct_maps[cache->num_direct_maps].size = size;
+    cache->direct_maps[cache->num_direct_maps].vmm_vaddr = vmm_vaddr;
+    cache->num_direct_maps++;
+    return 0;
+}
+
+void *vm_ram_map_cache_find_direct(vm_t *vm, uintptr_t addr, size_t size)
+{
+    vm_ram_map_cache_t *cache = vm->mem.ram_map_cache;
+    if (!cache) {
+        return NULL;
+    }
+    for (int i = 0; i < cache->num_direct_maps; i++) {
+        ram_direct_map_t *map = &cache->direct_maps[i];
+        if (map->start <= addr && map->start + map->size >= addr + size) {
+            return map->vmm_vaddr + (addr - map->start);
+        }
+    }
+    return NULL;
+}
+
+void *vm_ram_map_cache_lookup(vm_t *vm, uintptr_t guest_page)
+{
+    vm_ram_map_cache_t *cache = vm->mem.ram_map_cache;
+    ram_map_cache_entry_t *victim = NULL;
+    if (!cache) {
+        return NULL;
+    }
+    void *direct_vaddr = vm_ram_map_cache_find_direct(vm, guest_page, PAGE_SIZE_4K);
+    if (direct_vaddr || cache->num_entries == 0) {
+        return direct_vaddr;
+    }
+    cache->tick++;
+    for (int i = 0; i < cache->num_entries; i++) {
+        ram_map_cache_entry_t *entry = &cache->entries[i];
+        if (entry->valid && entry->guest_page == guest_page) {
+            entry->last_used = cache->tick;
+            return entry->vmm_vaddr;
+        }
+        /* Prefer free entries, otherwise track the least recently used one */
+        if (!victim || (victim->valid && (!entry->valid || entry->last_used < victim->last_used))) {
+            victim = entry;
+        }
+    }
+    /* Cache miss: map the guest page into the VMM */
+    void *vmm_vaddr = vspace_share_mem(&vm->mem.vm_vspace, &vm->mem.vmm_vspace, (void *)guest_page, 1,
+                                       seL4_PageBits, seL4_AllRights, 1);
+    if (!vmm_vaddr) {
+        return NULL;
+    }
+    if (victim->valid) {
+        evict_entry(vm, victim);
+    }
+    victim->guest_page = guest_page;
+    victim->vmm_vaddr = vmm_vaddr;
+    victim->last_used = cache->tick;
+    victim->valid = true;
+    return vmm_vaddr;
+}
+
+void vm_ram_map_cache_invalidate(vm_t *vm, uintptr_t addr, size_t size)
+{
+    vm_ram_map_cache_t *cache = vm->mem.ram_map_cache;
+    if (!cache || size == 0) {
+        return;
+    }
+    uintptr_t start = PAGE_ALIGN_4K(addr);
+    uintptr_t end = addr + size;
+    for (int i = 0; i < cache->num_entries; i++) {
+        ram_map_cache_entry_t *entry = &cache->entries[i];
+        if (entry->valid && entry->guest_page >= start && entry->guest_page < end) {
+            evict_entry(vm, entry);
+        }
+    }
+    for (int i = 0; i < cache->num_pinned_maps;) {
+        ram_pinned_map_t *map = &cache->pinned_maps[i];
+        if (map->start < end && start < map->start + map->size) {
+            remove_pinned_map(vm, i);
+        } else {
+            i++;
+        }
+    }
+}
+
+int vm_ram_map_cache_pin(vm_t *vm, uintptr_t start, size_t size, size_t frame_bits, vm_ram_mapping_t *mapping)
+{
+    vm_ram_map_cache_t *cache = vm->mem.ram_map_cache;
+    if (!cache) {
+        ZF_LOGE("Failed to map ram: ram map cache not initialised");
+        return -1;
+    }
+    ram_pinned_map_t *extended_maps = realloc(cache->pinned_maps,
+                                              sizeof(ram_pinned_map_t) * (cache->num_pinned_maps + 1));
+    if (!extended_maps) {
+        ZF_LOGE("Failed to map ram: Unable to allocate pinned map entry");
+        return -1;
+    }
+    cache->pinned_maps = extended_maps;
+    void *vmm_vaddr = vspace_share_mem(&vm->mem.vm_vspace, &vm->mem.vmm_vspace, (void *)start,
+                                       size >> frame_bits, frame_bits, seL4_AllRights, 1);
+    if (!vmm_vaddr) {
+        ZF_LOGE("Failed to map ram: Unable to map guest region 0x%x into vmm vspace", start);
+        return -1;
+    }
+    cache->pinned_maps[cache->num_pinned_maps++] = (ram_pinned_map_t) {
+        .start = start,
+        .size = size,
+        .frame_bits = frame_bits,
+        .vmm_vaddr = vmm_vaddr,
+        .mapping = mapping,
+    };
+    mapping->vaddr = vmm_vaddr + (mapping->start - start);
+    return 0;
+}
+
+void vm_ram_map_cache_unpin(vm_t *vm, vm_ram_mapping_t *mapping)
+{
+    vm_ram_map_cache_t *cache = vm->mem.ram_map_cache;
+    if (!cache) {
+        return;
+    }
+    for (int i = 0; i < cache->num_pinned_maps; i++) {
+        if (cache->pinned_maps[i].mapping == mapping) {
+            remove_pinned_map(vm, i);
+            return;
+        }
+    }
+}
+
+void vm_ram_map_cache_log_pinned(vm_t *vm)
+{
+    vm_ram_map_cache_t *cache = vm->mem.ram_map_cache;
+    if (!cache) {
+        return;
+    }
+    for (int i = 0; i < cache->num_pinned_maps; i++) {
+        vm_dirty_log_mark(vm, cache->pinned_maps[i].start, cache->pinned_maps[i].size);
+    }
+}
+
+void vm_ram_map_cache_remove_direct(vm_t *vm, uintptr_t addr, size_t size)
+{
+    vm_ram_map_cache_t *cache = vm->mem.ram_map_cache;
+    if (!cache || size == 0) {
+        return;
+    }
+    for (int i = 0; i < cache->num_direct_maps;) {
+        ram_direct_map_t *map = &cache->direct_maps[i];
+        if (map->start < addr + size && addr < map->start + map->size) {
+            remove_direct_map(vm, i);
+        } else {
+            i++;
+        }
+    }
+}
+
+int vm_ram_map_cache_add_window(vm_t *vm)
+{
+    vm_ram_map_cache_t *cache = vm->mem.ram_map_cache;
+    vm_ram_window_t *window;
+    int err;
+    if (!cache) {
+        ZF_LOGE("Failed to create ram window: ram map cache not initialised");
+        return -1;
+    }
+    if (vm_ram_map_cache_window(vm)) {
+        ZF_LOGE("Failed to create ram window: Thread already has a window");
+        return -1;
+    }
+    err = ps_calloc(&vm->io_ops->malloc_ops, 1, sizeof(vm_ram_window_t), (void **)&window);
+    if (err) {
+        ZF_LOGE("Failed to create ram window: Unable to allocate window");
+        return -1;
+    }
+    window->reservation = vspace_reserve_range(&vm->mem.vmm_vspace, PAGE_SIZE_4K, seL4_AllRights, 1,
+                                               &window->vmm_vaddr);
+    if (!window->reservation.res) {
+        ZF_LOGE("Failed to create ram window: Unable to reserve vmm vspace");
+        ps_free(&vm->io_ops->malloc_ops, sizeof(vm_ram_window_t), window);
+        return -1;
+    }
+    err = vka_alloc_frame(vm->vka, seL4_PageBits, &window->frame);
+    if (!err) {
+        err = vspace_map_pages_at_vaddr(&vm->mem.vmm_vspace, &window->frame.cptr, NULL, window->vmm_vaddr, 1,
+                                        seL4_PageBits, window->reservation);
+        if (err) {
+            vka_free_object(vm->vka, &window->frame);
+        }
+    }
+    if (err) {
+        ZF_LOGE("Failed to create ram window: Unable to map frame");
+        vspace_free_reservation(&vm->mem.vmm_vspace, window->reservation);
+        ps_free(&vm->io_ops->malloc_ops, sizeof(vm_ram_window_t), window);
+        return -1;
+    }
+    /* The window's frame stays in the vspace's books, only the mapping is taken down */
+    seL4_ARCH_Page_Unmap(window->frame.cptr);
+    err = vka_cspace_alloc_path(vm->vka, &window->slot);
+    if (err) {
+        ZF_LOGE("Failed to create ram window: Unable to allocate cslot");
+        vspace_unmap_pages(&vm->mem.vmm_vspace, window->vmm_vaddr, 1, seL4_PageBits, VSPACE_PRESERVE);
+        vka_free_object(vm->vka, &window->frame);
+        vspace_free_reservation(&vm->mem.vmm_vspace, window->reservation);
+        ps_free(&vm->io_ops->malloc_ops, sizeof(vm_ram_window_t), window);
+        return -1;
+    }
+    window->owner = seL4_GetIPCBuffer();
+    window->next = cache->windows;
+    cache->windows = window;
+    return 0;
+}
+
+void vm_ram_map_cache_remove_window(vm_t *vm)
+{
+    vm_ram_map_cache_t *cache = vm->mem.ram_map_cache;
+    if (!cache) {
+        return;
+    }
+    void *self = seL4_GetIPCBuffer();
+    for (vm_ram_window_t **prev = &cache->windows; *prev; prev = &(*prev)->next) {
+        vm_ram_window_t *window = *prev;
+        if (window->owner != self) {
+            continue;
+        }
+        *prev = window->next;
+        free_window(vm, window);
+        return;
+    }
+}
+
+vm_ram_window_t *vm_ram_map_cache_window(vm_t *vm)
+{
+    vm_ram_map_cache_t *cache = vm->mem.ram_map_cache;
+    if (!cache) {
+        return NULL;
+    }
+    void *self = seL4_GetIPCBuffer();
+    for (vm_ram_window_t *window = cache->windows; window; window = window->next) {
+        if (window->owner == self) {
+            return window;
+        }
+    }
+    return NULL;
+}
+
+int vm_ram_map_cache_window_access(vm_t *vm, vm_ram_window_t *window, uintptr_t guest_page,
+                                   vspace_access_callback_fn callback, void *cookie)
+{
+    seL4_CPtr cap = vspace_get_cap(&vm->mem.vm_vspace, (void *)guest_page);
+    if (cap == seL4_CapNull) {
+        ZF_LOGE("Failed to access ram through window: No frame mapped at 0x%x", guest_page);
+        return -1;
+    }
+    cspacepath_t frame;
+    vka_cspace_make_path(vm->vka, cap, &frame);
+    int err = vka_cnode_copy(&window->slot, &frame, seL4_AllRights);
+    if (err) {
+        ZF_LOGE("Failed to access ram through window: Unable to copy frame cap");
+        return -1;
+    }
+    err = seL4_ARCH_Page_Map(window->slot.capPtr, vspace_get_root(&vm->mem.vmm_vspace), (seL4_Word)window->vmm_vaddr,
+                             seL4_AllRights, seL4_ARCH_Default_VMAttributes);
+    if (err) {
+        ZF_LOGE("Failed to access ram through window: Unable to map frame");
+        vka_cnode_delete(&window->slot);
+        return -1;
+    }
+    int result = callback((void *)guest_page, window->vmm_vaddr, cookie);
+    seL4_ARCH_Page_Unmap(window->slot.capPtr);
+    vka_cnode_delete(&window->slot);
+    return result;
+}
@@ -0,0 +1,134 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_ram.h>
+
+typedef struct vm_ram_window vm_ram_window_t;
+
+/**
+ * Initialise the guest RAM mapping cache of a VM. The cache keeps recently touched guest RAM pages
+ * mapped into the VMM's vspace such that subsequent touches can avoid a map/unmap cycle. It also tracks
+ * RAM regions that have been mapped contiguously into the VMM's vspace (see 'vm_ram_direct_map').
+ * The number of cached pages is configured through CONFIG_LIB_SEL4VM_RAM_MAP_CACHE_SIZE. No pages
+ * are cached if this is 0.
+ * @param {vm_t *} vm               A handle to the VM
+ * @return                          0 on success, -1 on error
+ */
+int vm_ram_map_cache_init(vm_t *vm);
+
+/**
+ * Take down every mapping of guest RAM into the VMM's vspace, including the cached pages, direct and pinned maps and
+ * the mapping windows of all threads, and free the cache. The handles of pinned mappings are left with a NULL vaddr
+ * @param {vm_t *} vm               A handle to the VM
+ */
+void vm_ram_map_cache_destroy(vm_t *vm);
+
+/**
+ * Lookup the VMM virtual address of a guest RAM page, mapping it into the VMM vspace if it is not already
+ * cached or part of a direct mapped region. The least recently used cache entry is evicted if the cache is full.
+ * @param {vm_t *} vm               A handle to the VM
+ * @param {uintptr_t} guest_page    4K aligned guest physical address of the page
+ * @return                          VMM virtual address of the page or NULL if the page could not be cached
+ */
+void *vm_ram_map_cache_lookup(vm_t *vm, uintptr_t guest_page);
+
+/**
+ * Invalidate any cached mappings overlapping a region of guest physical memory. This unmaps the pages from
+ * the VMM vspace and must be called before the guest frames backing the region are unmapped or freed.
+ * @param {vm_t *} vm               A handle to the VM
+ * @param {uintptr_t} addr          Base guest physical address of region
+ * @param {size_t} size             Size of region in bytes
+ */
+void vm_ram_map_cache_invalidate(vm_t *vm, uintptr_t addr, size_t size);
+
+/**
+ * Map a region of guest RAM contiguously into the VMM vspace. The mapping is kept until it is removed with
+ * 'vm_ram_map_cache_remove_direct'.
+ * @param {vm_t *} vm               A handle to the VM
+ * @param {uintptr_t} start         4K aligned base guest physical address of region
+ * @param {size_t} size             Size of region in bytes, a multiple of 4K
+ * @return                          0 on success, -1 on error
+ */
+int vm_ram_map_cache_add_direct(vm_t *vm, uintptr_t start, size_t size);
+
+/**
+ * Find the VMM virtual address of a guest physical region that lies within a direct mapped region
+ * @param {vm_t *} vm               A handle to the VM
+ * @param {uintptr_t} addr          Guest physical address
+ * @param {size_t} size             Size of access in bytes
+ * @return                          VMM virtual address of 'addr' or NULL if the region is not direct mapped
+ */
+void *vm_ram_map_cache_find_direct(vm_t *vm, uintptr_t addr, size_t size);
+
+/**
+ * Remove any direct mapped regions overlapping a region of guest physical memory
+ * @param {vm_t *} vm               A handle to the VM
+ * @param {uintptr_t} addr          Base guest physical address of region
+ * @param {size_t} size             Size of region in bytes
+ */
+void vm_ram_map_cache_remove_direct(vm_t *vm, uintptr_t addr, size_t size);
+
+/**
+ * Map a region of guest RAM into the VMM vspace for a 'vm_ram_mapping_t', keeping it mapped until it is unpinned or
+ * the region is invalidated. Invalidating the region clears the mapping's 'vaddr'.
+ * @param {vm_t *} vm                   A handle to the VM
+ * @param {uintptr_t} start             Base guest physical address of region, aligned to its frames
+ * @param {size_t} size                 Size of region in bytes, a multiple of its frames
+ * @param {size_t} frame_bits           Size bits of the frames backing the region
+ * @param {vm_ram_mapping_t *} mapping  Mapping to populate, whose 'start' lies within the region
+ * @return                              0 on success, -1 on error
+ */
+int vm_ram_map_cache_pin(vm_t *vm, uintptr_t start, size_t size, size_t frame_bits, vm_ram_mapping_t *mapping);
+
+/**
+ * Unmap a region mapped with 'vm_ram_map_cache_pin', if it is still mapped
+ * @param {vm_t *} vm                   A handle to the VM
+ * @param {vm_ram_mapping_t *} mapping  Mapping to unmap
+ */
+void vm_ram_map_cache_unpin(vm_t *vm, vm_ram_mapping_t *mapping);
+
+/**
+ * Mark the pinned regions dirty in the dirty log, as the VMM writes them without faulting
+ * @param {vm_t *} vm               A handle to the VM
+ */
+void vm_ram_map_cache_log_pinned(vm_t *vm);
+
+/**
+ * Create a mapping window for the calling thread, a page of the VMM vspace reserved for the thread to map guest
+ * frames into by itself. Mapping a frame into a window touches none of the VMM's vspace or allocator state, such that
+ * threads can access guest RAM through their windows at once
+ * @param {vm_t *} vm               A handle to the VM
+ * @return                          0 on success, -1 on error
+ */
+int vm_ram_map_cache_add_window(vm_t *vm);
+
+/**
+ * Destroy the mapping window of the calling thread, if it has one
+ * @param {vm_t *} vm               A handle to the VM
+ */
+void vm_ram_map_cache_remove_window(vm_t *vm);
+
+/**
+ * Find the mapping window of the calling thread
+ * @param {vm_t *} vm               A handle to the VM
+ * @return                          The thread's window, NULL if it has none
+ */
+vm_ram_window_t *vm_ram_map_cache_window(vm_t *vm);
+
+/**
+ * Map the 4K frame backing a guest RAM page into a mapping window and invoke a callback on it, unmapping it after
+ * @param {vm_t *} vm                           A handle to the VM
+ * @param {vm_ram_window_t *} window            Mapping window of the calling thread
+ * @param {uintptr_t} guest_page                4K aligned guest physical address of the page
+ * @param {vspace_access_callback_fn} callback  Callback invoked with the guest page and its address in the window
+ * @param {void *} cookie                       Cookie to pass onto callback
+ * @return                                      Result of the callback, -1 if the page could not be mapped
+ */
+int vm_ram_map_cache_window_access(vm_t *vm, vm_ram_window_t *window, uintptr_t guest_page,
+                                   vspace_access_callback_fn callback, void *cookie);
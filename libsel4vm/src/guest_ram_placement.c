@@ -0,0 +1,142 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <autoconf.h>
+#include <sel4vm/gen_config.h>
+
+#include <stdlib.h>
+
+#include <vka/object.h>
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_ram.h>
+
+#include "guest_ram_placement.h"
+#include "guest_ram_pool.h"
+
+typedef struct placement_node {
+    uintptr_t paddr;
+    size_t size;
+    seL4_Word cpus;
+    /* Physical address allocation of the node's memory continues from. Frames below it are taken */
+    uintptr_t next;
+    /* Smallest frame size no longer available from the node */
+    size_t exhausted_bits;
+    size_t local_frames;
+    size_t remote_frames;
+} placement_node_t;
+
+struct vm_ram_placement {
+    int num_nodes;
+    placement_node_t *nodes;
+};
+
+static int alloc_node_frame(vm_t *vm, placement_node_t *node, size_t size_bits, vka_object_t *object)
+{
+    if (size_bits >= node->exhausted_bits) {
+        return -1;
+    }
+    uintptr_t end = node->paddr + node->size;
+    for (uintptr_t paddr = ROUND_UP(node->next, BIT(size_bits)); paddr + BIT(size_bits) <= end;
+         paddr += BIT(size_bits)) {
+        if (!vka_alloc_frame_at(vm->vka, size_bits, paddr, object)) {
+            /* Memory below a large frame may still fit smaller frames, only move on past frames of the smallest
+             * size */
+            if (size_bits == seL4_PageBits) {
+                node->next = paddr + BIT(size_bits);
+            }
+            return 0;
+        }
+    }
+    node->exhausted_bits = size_bits;
+    return -1;
+}
+
+int vm_ram_placement_alloc_frame(vm_t *vm, int node, size_t size_bits, vka_object_t *object)
+{
+    vm_ram_placement_t *placement = vm->mem.ram_placement;
+    if (placement && node >= 0 && node < placement->num_nodes) {
+        placement_node_t *n = &placement->nodes[node];
+        if (!alloc_node_frame(vm, n, size_bits, object)) {
+            n->local_frames++;
+            return 0;
+        }
+        n->remote_frames++;
+    } else if (!vm_ram_pool_take_frame(vm, size_bits, object)) {
+        return 0;
+    }
+    return vka_alloc_frame_maybe_device(vm->vka, size_bits, true, object);
+}
+
+int vm_ram_placement_init(vm_t *vm, const vm_ram_node_t *nodes, int num_nodes)
+{
+    if (vm->mem.ram_placement) {
+        ZF_LOGE("Failed to initialise ram placement: Already initialised");
+        return -1;
+    }
+    if (num_nodes <= 0) {
+        ZF_LOGE("Failed to initialise ram placement: Invalid number of nodes");
+        return -1;
+    }
+    vm_ram_placement_t *placement = calloc(1, sizeof(vm_ram_placement_t));
+    if (!placement) {
+        ZF_LOGE("Failed to initialise ram placement: Unable to allocate placement");
+        return -1;
+    }
+    placement->nodes = calloc(num_nodes, sizeof(placement_node_t));
+    if (!placement->nodes) {
+        ZF_LOGE("Failed to initialise ram placement: Unable to allocate nodes");
+        free(placement);
+        return -1;
+    }
+    for (int i = 0; i < num_nodes; i++) {
+        placement->nodes[i].paddr = nodes[i].paddr;
+        placement->nodes[i].size = nodes[i].size;
+        placement->nodes[i].cpus = nodes[i].cpus;
+        placement->nodes[i].next = nodes[i].paddr;
+        placement->nodes[i].exhausted_bits = seL4_WordBits;
+    }
+    placement->num_nodes = num_nodes;
+    vm->mem.ram_placement = placement;
+    return 0;
+}
+
+void vm_ram_placement_destroy(vm_t *vm)
+{
+    vm_ram_placement_t *placement = vm->mem.ram_placement;
+    if (!placement) {
+        return;
+    }
+    free(placement->nodes);
+    free(placement);
+    vm->mem.ram_placement = NULL;
+}
+
+int vm_vcpu_ram_node(vm_vcpu_t *vcpu)
+{
+    vm_ram_placement_t *placement = vcpu->vm->mem.ram_placement;
+    if (!placement || vcpu->target_cpu < 0 || vcpu->target_cpu >= seL4_WordBits) {
+        return -1;
+    }
+    for (int i = 0; i < placement->num_nodes; i++) {
+        if (placement->nodes[i].cpus & BIT(vcpu->target_cpu)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int vm_ram_placement_locality(vm_t *vm, int node, size_t *local_frames, size_t *remote_frames)
+{
+    vm_ram_placement_t *placement = vm->mem.ram_placement;
+    if (!placement || node < 0 || node >= placement->num_nodes) {
+        ZF_LOGE("Failed to get ram locality: Invalid node %d", node);
+        return -1;
+    }
+    *local_frames = placement->nodes[node].local_frames;
+    *remote_frames = placement->nodes[node].remote_frames;
+    return 0;
+}
@@ -0,0 +1,29 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <vka/vka.h>
+#include <vka/object.h>
+
+#include <sel4vm/guest_vm.h>
+
+/**
+ * Allocate a frame of guest RAM, preferring memory of the given host node and falling back onto any memory the
+ * VM's allocator hands out. Frames are counted towards the locality of the node
+ * @param {vm_t *} vm               A handle to the VM
+ * @param {int} node                Host node to allocate from, -1 for any
+ * @param {size_t} size_bits        Size of the frame
+ * @param {vka_object_t *} object   Allocated frame object
+ * @return                          0 on success, -1 on error
+ */
+int vm_ram_placement_alloc_frame(vm_t *vm, int node, size_t size_bits, vka_object_t *object);
+
+/**
+ * Free the ram placement of a VM
+ * @param {vm_t *} vm               A handle to the VM
+ */
+void vm_ram_placement_destroy(vm_t *vm);
@@ -0,0 +1,164 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdlib.h>
+
+#include <sel4/sel4.h>
+#include <vka/capops.h>
+#include <vka/object.h>
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_ram.h>
+
+#include "guest_ram_pool.h"
+#include "vm_lock.h"
+
+struct vm_ram_pool {
+    /* Allocator frames are retyped from, only used by the refilling thread */
+    vka_t *vka;
+    size_t size_bits;
+    int capacity;
+    /* Slots allocated from the pool's allocator, at most 'capacity' */
+    int num_slots;
+    /* Slots holding cleared frames ready to be taken */
+    seL4_CPtr *frames;
+    int num_frames;
+    /* Slots of the pool's allocator emptied by takes, for refills to reuse */
+    seL4_CPtr *free_slots;
+    int num_free_slots;
+    /* Serialises takes against refills, held only for the lists */
+    vm_lock_t lock;
+};
+
+int vm_ram_pool_init(vka_t *vka, size_t size_bits, int capacity, vm_ram_pool_t **pool)
+{
+    if (!vka || capacity <= 0) {
+        ZF_LOGE("Failed to initialise ram pool: Invalid arguments");
+        return -1;
+    }
+    vm_ram_pool_t *new_pool = calloc(1, sizeof(vm_ram_pool_t));
+    if (!new_pool) {
+        ZF_LOGE("Failed to initialise ram pool: Unable to allocate pool");
+        return -1;
+    }
+    new_pool->frames = calloc(capacity, sizeof(seL4_CPtr));
+    new_pool->free_slots = calloc(capacity, sizeof(seL4_CPtr));
+    if (!new_pool->frames || !new_pool->free_slots) {
+        ZF_LOGE("Failed to initialise ram pool: Unable to allocate lists");
+        free(new_pool->frames);
+        free(new_pool->free_slots);
+        free(new_pool);
+        return -1;
+    }
+    new_pool->vka = vka;
+    new_pool->size_bits = size_bits;
+    new_pool->capacity = capacity;
+    *pool = new_pool;
+    return 0;
+}
+
+int vm_ram_pool_refill(vm_ram_pool_t *pool, int max_frames)
+{
+    int refilled = 0;
+    while (refilled < max_frames) {
+        seL4_CPtr slot = seL4_CapNull;
+        vm_lock_acquire(&pool->lock);
+        if (pool->num_free_slots) {
+            slot = pool->free_slots[--pool->num_free_slots];
+        }
+        vm_lock_release(&pool->lock);
+        if (!slot) {
+            if (pool->num_slots == pool->capacity) {
+                /* Every slot holds a frame, or is being taken */
+                break;
+            }
+            if (vka_cspace_alloc(pool->vka, &slot)) {
+                ZF_LOGE("Failed to refill ram pool: Unable to allocate slot");
+                return -1;
+            }
+            pool->num_slots++;
+        }
+        /* Retyping clears the frame, which is the work the pool takes off the VM's critical path */
+        cspacepath_t path;
+        seL4_Word ut;
+        vka_cspace_make_path(pool->vka, slot, &path);
+        int err = vka_utspace_alloc(pool->vka, &path, kobject_get_type(KOBJECT_FRAME, pool->size_bits),
+                                    pool->size_bits, &ut);
+        vm_lock_acquire(&pool->lock);
+        if (err) {
+            pool->free_slots[pool->num_free_slots++] = slot;
+        } else {
+            pool->frames[pool->num_frames++] = slot;
+        }
+        vm_lock_release(&pool->lock);
+        if (err) {
+            ZF_LOGE("Failed to refill ram pool: Unable to allocate frame");
+            return -1;
+        }
+        refilled++;
+    }
+    return refilled;
+}
+
+int vm_ram_pool_attach(vm_t *vm, vm_ram_pool_t *pool)
+{
+    if (vm->mem.ram_pool) {
+        ZF_LOGE("Failed to attach ram pool: VM already has a pool attached");
+        return -1;
+    }
+    vm->mem.ram_pool = pool;
+    return 0;
+}
+
+int vm_ram_pool_num_frames(vm_ram_pool_t *pool)
+{
+    vm_lock_acquire(&pool->lock);
+    int num_frames = pool->num_frames;
+    vm_lock_release(&pool->lock);
+    return num_frames;
+}
+
+int vm_ram_pool_take_frame(vm_t *vm, size_t size_bits, vka_object_t *object)
+{
+    vm_ram_pool_t *pool = vm->mem.ram_pool;
+    if (!pool || pool->size_bits != size_bits) {
+        return -1;
+    }
+    seL4_CPtr slot = seL4_CapNull;
+    vm_lock_acquire(&pool->lock);
+    if (pool->num_frames) {
+        slot = pool->frames[--pool->num_frames];
+    }
+    vm_lock_release(&pool->lock);
+    if (!slot) {
+        return -1;
+    }
+    cspacepath_t src, dest;
+    vka_cspace_make_path(pool->vka, slot, &src);
+    int err = vka_cspace_alloc_path(vm->vka, &dest);
+    if (!err) {
+        err = vka_cnode_move(&dest, &src);
+        if (err) {
+            vka_cspace_free_path(vm->vka, dest);
+        }
+    }
+    vm_lock_acquire(&pool->lock);
+    if (err) {
+        pool->frames[pool->num_frames++] = slot;
+    } else {
+        pool->free_slots[pool->num_free_slots++] = slot;
+    }
+    vm_lock_release(&pool->lock);
+    if (err) {
+        ZF_LOGE("Failed to take frame from ram pool: Unable to move cap");
+        return -1;
+    }
+    object->cptr = dest.capPtr;
+    object->ut = 0;
+    object->type = kobject_get_type(KOBJECT_FRAME, size_bits);
+    object->size_bits = size_bits;
+    return 0;
+}
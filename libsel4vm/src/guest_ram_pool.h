@@ -0,0 +1,22 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <vka/vka.h>
+#include <vka/object.h>
+
+#include <sel4vm/guest_vm.h>
+
+/**
+ * Take a cleared frame from the pool attached to the VM, moving its cap into a slot of the VM's allocator. The
+ * frame's untyped is kept by the pool, so the object's 'ut' is 0
+ * @param {vm_t *} vm               A handle to the VM
+ * @param {size_t} size_bits        Size of the frame
+ * @param {vka_object_t *} object   Taken frame object
+ * @return                          0 on success, -1 if no pool is attached or it has no frames of the size
+ */
+int vm_ram_pool_take_frame(vm_t *vm, size_t size_bits, vka_object_t *object);
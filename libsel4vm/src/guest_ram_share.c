@@ -0,0 +1,511 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <autoconf.h>
+#include <sel4vm/gen_config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sel4/sel4.h>
+#include <vka/capops.h>
+#include <utils/sglib.h>
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_ram.h>
+
+#include "guest_memory.h"
+#include "guest_ram_cache.h"
+#include "guest_ram_share.h"
+#include "guest_dirty_log.h"
+#include "guest_vspace_arch.h"
+
+struct share_page;
+
+/* A scanned guest page, indexed by its VM and address */
+typedef struct share_mapping {
+    vm_t *vm;
+    uintptr_t addr;
+    /* Cap the guest page is mapped with */
+    seL4_CPtr cap;
+    struct share_page *page;
+    /* Next guest page mapping the same frame */
+    struct share_mapping *next_user;
+    char color_field;
+    struct share_mapping *left;
+    struct share_mapping *right;
+} share_mapping_t;
+
+/* A frame of guest RAM contents, indexed by the hash of its contents. A frame with a single user is a candidate
+ * for sharing and is left writable, so its contents may no longer match its hash */
+typedef struct share_page {
+    uint64_t hash;
+    int num_users;
+    share_mapping_t *users;
+    char color_field;
+    struct share_page *left;
+    struct share_page *right;
+} share_page_t;
+
+static inline int share_page_cmp(share_page_t *x, share_page_t *y)
+{
+    if (x->hash == y->hash) {
+        return 0;
+    }
+    return x->hash < y->hash ? -1 : 1;
+}
+
+static inline int share_mapping_cmp(share_mapping_t *x, share_mapping_t *y)
+{
+    if (x->vm != y->vm) {
+        return (uintptr_t)x->vm < (uintptr_t)y->vm ? -1 : 1;
+    }
+    if (x->addr == y->addr) {
+        return 0;
+    }
+    return x->addr < y->addr ? -1 : 1;
+}
+
+SGLIB_DEFINE_RBTREE_PROTOTYPES(share_page_t, left, right, color_field, share_page_cmp);
+SGLIB_DEFINE_RBTREE_FUNCTIONS(share_page_t, left, right, color_field, share_page_cmp);
+SGLIB_DEFINE_RBTREE_PROTOTYPES(share_mapping_t, left, right, color_field, share_mapping_cmp);
+SGLIB_DEFINE_RBTREE_FUNCTIONS(share_mapping_t, left, right, color_field, share_mapping_cmp);
+
+struct vm_ram_share {
+    share_page_t *pages;
+    share_mapping_t *mappings;
+    /* Frames no longer mapped by any guest page, cleared and ready for reuse */
+    int num_free_frames;
+    vm_frame_t *free_frames;
+    /* Buffers for comparing the contents of pages */
+    uint64_t page_buf[PAGE_SIZE_4K / sizeof(uint64_t)];
+    uint64_t compare_buf[PAGE_SIZE_4K / sizeof(uint64_t)];
+};
+
+/* FNV-1a over the words of a page */
+static uint64_t page_hash(uint64_t *data)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (int i = 0; i < PAGE_SIZE_4K / sizeof(uint64_t); i++) {
+        hash ^= data[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+static int read_page_callback(void *access_addr, void *vaddr, void *cookie)
+{
+    memcpy(cookie, vaddr, PAGE_SIZE_4K);
+    return 0;
+}
+
+/* Read a guest page through a read only mapping, as vm_ram_touch unshares the pages it accesses */
+static int read_page(vm_t *vm, uintptr_t addr, void *buf)
+{
+    return vspace_access_page_with_callback(&vm->mem.vm_vspace, &vm->mem.vmm_vspace, (void *)addr, seL4_PageBits,
+                                            seL4_CanRead, 1, read_page_callback, buf);
+}
+
+static int protect_page(vm_t *vm, uintptr_t addr, seL4_CPtr cap, seL4_CapRights_t rights)
+{
+    int err = guest_vspace_map_page_arch(&vm->mem.vm_vspace, cap, (void *)addr, rights, 1, seL4_PageBits);
+    if (err) {
+        ZF_LOGE("Failed to remap guest page 0x%x", addr);
+    }
+    return err;
+}
+
+/* Let a guest write to a page again, logging it as dirty as any write protection of the dirty log is lost */
+static void unprotect_page(vm_t *vm, uintptr_t addr, seL4_CPtr cap)
+{
+    protect_page(vm, addr, cap, seL4_AllRights);
+    vm_dirty_log_mark(vm, addr, PAGE_SIZE_4K);
+}
+
+static share_mapping_t *find_mapping(vm_ram_share_t *share, vm_t *vm, uintptr_t addr)
+{
+    share_mapping_t search_node = { .vm = vm, .addr = addr };
+    return sglib_share_mapping_t_find_member(share->mappings, &search_node);
+}
+
+static share_page_t *find_page(vm_ram_share_t *share, uint64_t hash)
+{
+    share_page_t search_node = { .hash = hash };
+    return sglib_share_page_t_find_member(share->pages, &search_node);
+}
+
+static share_mapping_t *add_user(vm_ram_share_t *share, share_page_t *page, vm_t *vm, uintptr_t addr, seL4_CPtr cap)
+{
+    share_mapping_t *mapping = calloc(1, sizeof(*mapping));
+    if (!mapping) {
+        ZF_LOGE("Failed to share page: Unable to allocate mapping");
+        return NULL;
+    }
+    mapping->vm = vm;
+    mapping->addr = addr;
+    mapping->cap = cap;
+    mapping->page = page;
+    mapping->next_user = page->users;
+    page->users = mapping;
+    page->num_users++;
+    sglib_share_mapping_t_add(&share->mappings, mapping);
+    return mapping;
+}
+
+static void remove_user(vm_ram_share_t *share, share_mapping_t *mapping)
+{
+    share_page_t *page = mapping->page;
+    share_mapping_t **user = &page->users;
+    while (*user != mapping) {
+        user = &(*user)->next_user;
+    }
+    *user = mapping->next_user;
+    page->num_users--;
+    sglib_share_mapping_t_delete(&share->mappings, mapping);
+    free(mapping);
+    if (!page->num_users) {
+        sglib_share_page_t_delete(&share->pages, page);
+        free(page);
+    }
+}
+
+static share_page_t *add_page(vm_ram_share_t *share, uint64_t hash)
+{
+    share_page_t *page = calloc(1, sizeof(*page));
+    if (!page) {
+        ZF_LOGE("Failed to share page: Unable to allocate page");
+        return NULL;
+    }
+    page->hash = hash;
+    sglib_share_page_t_add(&share->pages, page);
+    return page;
+}
+
+static void delete_cap(vm_t *vm, seL4_CPtr cap)
+{
+    cspacepath_t path;
+    vka_cspace_make_path(vm->vka, cap, &path);
+    vka_cnode_delete(&path);
+    vka_cspace_free(vm->vka, cap);
+}
+
+/* Map a frame into the vmm to either copy a guest page into it or, when 'addr' is 0, clear it */
+static int fill_frame(vm_t *vm, seL4_CPtr frame, uintptr_t addr)
+{
+    void *vaddr = vspace_map_pages(&vm->mem.vmm_vspace, &frame, NULL, seL4_AllRights, 1, seL4_PageBits, 1);
+    if (!vaddr) {
+        ZF_LOGE("Failed to map frame into vmm vspace");
+        return -1;
+    }
+    int err = 0;
+    if (addr) {
+        err = read_page(vm, addr, vaddr);
+    } else {
+        memset(vaddr, 0, PAGE_SIZE_4K);
+    }
+    vspace_unmap_pages(&vm->mem.vmm_vspace, vaddr, 1, seL4_PageBits, VSPACE_PRESERVE);
+    return err;
+}
+
+/* Keep a frame for reuse, along with its allocator cookie so it can still be returned to the vka */
+static int free_frame(vm_ram_share_t *share, vm_t *vm, seL4_CPtr cap, uintptr_t cookie)
+{
+    /* Nothing of one guest may be handed on to another */
+    if (fill_frame(vm, cap, 0)) {
+        return -1;
+    }
+    vm_frame_t *free_frames = realloc(share->free_frames, sizeof(vm_frame_t) * (share->num_free_frames + 1));
+    if (!free_frames) {
+        ZF_LOGE("Failed to free shared frame: Unable to grow free list");
+        return -1;
+    }
+    share->free_frames = free_frames;
+    share->free_frames[share->num_free_frames++] = (vm_frame_t) {
+        .cptr = cap, .cookie = cookie, .size_bits = seL4_PageBits
+    };
+    return 0;
+}
+
+static vm_frame_t take_frame(vm_ram_share_t *share, vm_t *vm, uintptr_t addr)
+{
+    vm_frame_t frame = { seL4_CapNull, seL4_AllRights, addr, seL4_PageBits, 0 };
+    if (share->num_free_frames) {
+        frame.cptr = share->free_frames[--share->num_free_frames].cptr;
+        frame.cookie = share->free_frames[share->num_free_frames].cookie;
+        return frame;
+    }
+    vka_object_t object;
+    if (vka_alloc_frame(vm->vka, seL4_PageBits, &object)) {
+        ZF_LOGE("Failed to allocate frame for unshared page");
+        return frame;
+    }
+    frame.cptr = object.cptr;
+    frame.cookie = object.ut;
+    return frame;
+}
+
+/* Map a guest page to the frame of a page with the same hash. Returns 1 if the contents turn out to differ */
+static int share_with_page(vm_ram_share_t *share, share_page_t *page, vm_t *vm, uintptr_t addr, seL4_CPtr cap)
+{
+    share_mapping_t *owner = page->users;
+    bool candidate = page->num_users == 1;
+    if (owner->vm == vm && owner->addr == addr) {
+        return 1;
+    }
+    if (candidate && vspace_get_cap(&owner->vm->mem.vm_vspace, (void *)owner->addr) != owner->cap) {
+        /* The candidate's frame has since been released */
+        return 1;
+    }
+    /* Neither page may change while they are compared and merged */
+    if (candidate && protect_page(owner->vm, owner->addr, owner->cap, seL4_CanRead)) {
+        return -1;
+    }
+    if (protect_page(vm, addr, cap, seL4_CanRead)) {
+        if (candidate) {
+            unprotect_page(owner->vm, owner->addr, owner->cap);
+        }
+        return -1;
+    }
+    int err = read_page(owner->vm, owner->addr, share->compare_buf) || read_page(vm, addr, share->page_buf);
+    if (err || memcmp(share->compare_buf, share->page_buf, PAGE_SIZE_4K)) {
+        if (candidate) {
+            unprotect_page(owner->vm, owner->addr, owner->cap);
+        }
+        unprotect_page(vm, addr, cap);
+        return err ? -1 : 1;
+    }
+
+    cspacepath_t src, dest;
+    vka_cspace_make_path(owner->vm->vka, owner->cap, &src);
+    err = vka_cspace_alloc_path(vm->vka, &dest);
+    if (!err) {
+        err = vka_cnode_copy(&dest, &src, seL4_AllRights);
+        if (err) {
+            vka_cspace_free_path(vm->vka, dest);
+        }
+    }
+    if (err) {
+        ZF_LOGE("Failed to share page: Unable to copy frame cap");
+        unprotect_page(vm, addr, cap);
+        return -1;
+    }
+    uintptr_t cookie = vspace_get_cookie(&vm->mem.vm_vspace, (void *)addr);
+    err = vm_memory_replace_frame(vm, addr, dest.capPtr, seL4_CanRead);
+    if (err) {
+        delete_cap(vm, dest.capPtr);
+        return -1;
+    }
+    if (!add_user(share, page, vm, addr, dest.capPtr)) {
+        return -1;
+    }
+    /* The frame replaced held the same contents and can go to other guest pages */
+    return free_frame(share, vm, cap, cookie);
+}
+
+static int scan_page(vm_ram_share_t *share, vm_t *vm, uintptr_t addr)
+{
+    /* Only 4K frames are shared, and only those accessed solely through per page vmm mappings */
+    if (vm_memory_frame_size_bits(vm, addr) != seL4_PageBits || vm_ram_map_cache_find_direct(vm, addr, PAGE_SIZE_4K)) {
+        return 0;
+    }
+    seL4_CPtr cap = vspace_get_cap(&vm->mem.vm_vspace, (void *)addr);
+    if (cap == seL4_CapNull) {
+        /* Not yet populated */
+        return 0;
+    }
+    share_mapping_t *mapping = find_mapping(share, vm, addr);
+    if (mapping && mapping->cap != cap) {
+        /* The page has been released and repopulated since it was scanned */
+        remove_user(share, mapping);
+        mapping = NULL;
+    }
+    if (mapping && mapping->page->num_users > 1) {
+        /* Already shared and read only */
+        return 0;
+    }
+    if (read_page(vm, addr, share->page_buf)) {
+        return -1;
+    }
+    uint64_t hash = page_hash(share->page_buf);
+    if (mapping) {
+        if (mapping->page->hash == hash) {
+            return 0;
+        }
+        remove_user(share, mapping);
+    }
+
+    share_page_t *page = find_page(share, hash);
+    if (page) {
+        int err = share_with_page(share, page, vm, addr, cap);
+        if (err <= 0) {
+            return err;
+        }
+        if (page->num_users > 1) {
+            /* A hash collision with a shared page, leave this page unshared */
+            return 0;
+        }
+        /* The candidate has been written to since it was scanned, this page replaces it */
+        remove_user(share, page->users);
+    }
+    page = add_page(share, hash);
+    if (!page || !add_user(share, page, vm, addr, cap)) {
+        return -1;
+    }
+    return 0;
+}
+
+int vm_ram_share_init(vm_ram_share_t **share)
+{
+    *share = calloc(1, sizeof(vm_ram_share_t));
+    if (!*share) {
+        ZF_LOGE("Failed to initialise ram sharing: Unable to allocate state");
+        return -1;
+    }
+    return 0;
+}
+
+int vm_ram_share_scan(vm_ram_share_t *share, vm_t *vm, uintptr_t start, size_t bytes)
+{
+    if (vm->mem.ram_share && vm->mem.ram_share != share) {
+        ZF_LOGE("Failed to scan ram: VM is sharing ram through another instance");
+        return -1;
+    }
+    vm->mem.ram_share = share;
+    for (uintptr_t addr = PAGE_ALIGN_4K(start); addr < start + bytes; addr += PAGE_SIZE_4K) {
+        if (scan_page(share, vm, addr)) {
+            ZF_LOGE("Failed to scan ram: Unable to share page 0x%x", addr);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+vm_frame_t vm_ram_share_frame_iterator(uintptr_t addr, void *cookie)
+{
+    vm_frame_t frame_result = { seL4_CapNull, seL4_NoRights, 0, 0 };
+    vm_ram_share_t *share = (vm_ram_share_t *)cookie;
+    if (!share || !share->num_free_frames) {
+        return frame_result;
+    }
+    frame_result = share->free_frames[--share->num_free_frames];
+    frame_result.rights = seL4_AllRights;
+    frame_result.vaddr = PAGE_ALIGN_4K(addr);
+    return frame_result;
+}
+
+int vm_ram_share_num_free_frames(vm_ram_share_t *share)
+{
+    return share->num_free_frames;
+}
+
+/* Give a shared guest page a copy of the frame of its own */
+static int unshare_page(vm_ram_share_t *share, share_mapping_t *mapping)
+{
+    vm_t *vm = mapping->vm;
+    vm_frame_t frame = take_frame(share, vm, mapping->addr);
+    if (frame.cptr == seL4_CapNull) {
+        return -1;
+    }
+    if (fill_frame(vm, frame.cptr, mapping->addr)) {
+        free_frame(share, vm, frame.cptr, frame.cookie);
+        return -1;
+    }
+    if (vm_memory_unmap_frame(vm, mapping->addr, VSPACE_PRESERVE) || vm_memory_map_frame(vm, frame)) {
+        ZF_LOGE("Failed to unshare page 0x%x", mapping->addr);
+        return -1;
+    }
+    delete_cap(vm, mapping->cap);
+    share_page_t *page = mapping->page;
+    remove_user(share, mapping);
+    if (page->num_users == 1) {
+        /* The last user has the frame to itself again */
+        share_mapping_t *last = page->users;
+        unprotect_page(last->vm, last->addr, last->cap);
+    }
+    return 0;
+}
+
+int vm_ram_share_unshare(vm_t *vm, uintptr_t addr, size_t size)
+{
+    vm_ram_share_t *share = vm->mem.ram_share;
+    if (!share) {
+        return 0;
+    }
+    for (uintptr_t page = PAGE_ALIGN_4K(addr); page < addr + size; page += PAGE_SIZE_4K) {
+        share_mapping_t *mapping = find_mapping(share, vm, page);
+        if (mapping && mapping->page->num_users > 1 && unshare_page(share, mapping)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+bool vm_ram_share_handle_fault(vm_t *vm, uintptr_t addr)
+{
+    vm_ram_share_t *share = vm->mem.ram_share;
+    if (!share) {
+        return false;
+    }
+    share_mapping_t *mapping = find_mapping(share, vm, PAGE_ALIGN_4K(addr));
+    if (!mapping || mapping->page->num_users < 2) {
+        return false;
+    }
+    /* Any fault on a shared page is a write */
+    return !unshare_page(share, mapping);
+}
+
+/* Drop a guest page from the share without copying its frame, as its VM is going away */
+static void detach_page(vm_ram_share_t *share, share_mapping_t *mapping)
+{
+    vm_t *vm = mapping->vm;
+    share_page_t *page = mapping->page;
+    int num_users = page->num_users;
+    if (num_users > 1) {
+        /* The frame must not be freed along with the VM's vspace while other guests map it */
+        vm_memory_unmap_frame(vm, mapping->addr, VSPACE_PRESERVE);
+        delete_cap(vm, mapping->cap);
+    }
+    remove_user(share, mapping);
+    if (num_users == 2) {
+        /* The last user has the frame to itself again */
+        share_mapping_t *last = page->users;
+        unprotect_page(last->vm, last->addr, last->cap);
+    }
+}
+
+int vm_ram_share_detach(vm_t *vm)
+{
+    vm_ram_share_t *share = vm->mem.ram_share;
+    struct sglib_share_mapping_t_iterator it;
+    int num_mappings = 0;
+    if (!share) {
+        return 0;
+    }
+    /* The tree can't be changed while it is iterated over, collect the mappings of the VM first */
+    for (share_mapping_t *m = sglib_share_mapping_t_it_init(&it, share->mappings); m;
+         m = sglib_share_mapping_t_it_next(&it)) {
+        num_mappings += m->vm == vm;
+    }
+    share_mapping_t **mappings = calloc(num_mappings ? num_mappings : 1, sizeof(share_mapping_t *));
+    if (!mappings) {
+        ZF_LOGE("Failed to detach vm from ram share: Unable to allocate mapping list");
+        return -1;
+    }
+    int i = 0;
+    for (share_mapping_t *m = sglib_share_mapping_t_it_init(&it, share->mappings); m;
+         m = sglib_share_mapping_t_it_next(&it)) {
+        if (m->vm == vm) {
+            mappings[i++] = m;
+        }
+    }
+    for (i = 0; i < num_mappings; i++) {
+        detach_page(share, mappings[i]);
+    }
+    free(mappings);
+    vm->mem.ram_share = NULL;
+    return 0;
+}
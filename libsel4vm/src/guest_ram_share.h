@@ -0,0 +1,37 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <sel4vm/guest_vm.h>
+
+/**
+ * Handle a guest write fault on a page of RAM shared with other guest pages, giving the faulting page its own
+ * copy of the frame
+ * @param {vm_t *} vm               A handle to the VM
+ * @param {uintptr_t} addr          Faulting guest physical address
+ * @return                          true if the fault was on a shared page and has been handled
+ */
+bool vm_ram_share_handle_fault(vm_t *vm, uintptr_t addr);
+
+/**
+ * Give any shared pages within a region of guest RAM copies of their frames of their own, before the VMM accesses
+ * them through mappings of its own that may write to them
+ * @param {vm_t *} vm               A handle to the VM
+ * @param {uintptr_t} addr          Base guest physical address of region
+ * @param {size_t} size             Size of region in bytes
+ * @return                          0 on success, -1 on error
+ */
+int vm_ram_share_unshare(vm_t *vm, uintptr_t addr, size_t size);
+
+/**
+ * Remove the pages of a VM being destroyed from the ram share it scanned its RAM into. Pages still sharing a frame
+ * with other guests are unmapped from the VM, leaving the frame to the other guests, rather than given copies of
+ * their own. Pages that do not share their frame keep it, to be freed along with the VM's vspace
+ * @param {vm_t *} vm               A handle to the VM
+ * @return                          0 on success, -1 on error
+ */
+int vm_ram_share_detach(vm_t *vm);
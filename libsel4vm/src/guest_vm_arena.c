@@ -0,0 +1,151 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <utils/util.h>
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_vm_arena.h>
+
+#include "guest_vm_arena.h"
+#include "vm_lock.h"
+
+#define ARENA_ALIGN 16
+#define ARENA_CHUNK_SIZE BIT(14)
+/* Allocations of up to ARENA_NUM_CLASSES * ARENA_ALIGN bytes are recycled through a free list per size */
+#define ARENA_NUM_CLASSES 32
+
+typedef struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;
+    size_t used;
+} arena_chunk_t;
+
+#define ARENA_HEADER_SIZE ROUND_UP(sizeof(arena_chunk_t), ARENA_ALIGN)
+
+typedef struct arena_block {
+    struct arena_block *next;
+} arena_block_t;
+
+/* Allocations are carved from the chunk at the head of the list, the chunks behind it are full or hold a single
+ * allocation too large for a chunk of the regular size */
+struct vm_arena {
+    vm_lock_t lock;
+    arena_chunk_t *chunks;
+    arena_block_t *free_blocks[ARENA_NUM_CLASSES];
+};
+
+static arena_chunk_t *arena_new_chunk(size_t size)
+{
+    arena_chunk_t *chunk = calloc(1, size);
+    if (!chunk) {
+        return NULL;
+    }
+    chunk->size = size;
+    chunk->used = ARENA_HEADER_SIZE;
+    return chunk;
+}
+
+static void *arena_take(vm_arena_t *arena, size_t size)
+{
+    int size_class = size / ARENA_ALIGN - 1;
+    if (size_class < ARENA_NUM_CLASSES && arena->free_blocks[size_class]) {
+        arena_block_t *block = arena->free_blocks[size_class];
+        arena->free_blocks[size_class] = block->next;
+        memset(block, 0, size);
+        return block;
+    }
+    arena_chunk_t *chunk = arena->chunks;
+    if (ARENA_HEADER_SIZE + size > ARENA_CHUNK_SIZE) {
+        /* Give large allocations a chunk of their own, behind the chunk being carved */
+        arena_chunk_t *large = arena_new_chunk(ARENA_HEADER_SIZE + size);
+        if (!large) {
+            return NULL;
+        }
+        large->used = large->size;
+        if (chunk) {
+            large->next = chunk->next;
+            chunk->next = large;
+        } else {
+            arena->chunks = large;
+        }
+        return (char *)large + ARENA_HEADER_SIZE;
+    }
+    if (!chunk || chunk->size - chunk->used < size) {
+        chunk = arena_new_chunk(ARENA_CHUNK_SIZE);
+        if (!chunk) {
+            return NULL;
+        }
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+    }
+    void *ptr = (char *)chunk + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
+
+void *vm_arena_alloc(vm_t *vm, size_t size)
+{
+    vm_arena_t *arena = vm->arena;
+    if (!arena || size == 0) {
+        ZF_LOGE("Failed to allocate from vm arena: Invalid arena or size");
+        return NULL;
+    }
+    size = ROUND_UP(size, ARENA_ALIGN);
+    vm_lock_acquire(&arena->lock);
+    void *ptr = arena_take(arena, size);
+    vm_lock_release(&arena->lock);
+    if (!ptr) {
+        ZF_LOGE("Failed to allocate from vm arena: Unable to allocate chunk");
+    }
+    return ptr;
+}
+
+void vm_arena_free(vm_t *vm, size_t size, void *ptr)
+{
+    vm_arena_t *arena = vm->arena;
+    if (!arena || !ptr) {
+        return;
+    }
+    int size_class = ROUND_UP(size, ARENA_ALIGN) / ARENA_ALIGN - 1;
+    if (size_class >= ARENA_NUM_CLASSES) {
+        /* Left in its chunk until the VM is destroyed */
+        return;
+    }
+    arena_block_t *block = ptr;
+    vm_lock_acquire(&arena->lock);
+    block->next = arena->free_blocks[size_class];
+    arena->free_blocks[size_class] = block;
+    vm_lock_release(&arena->lock);
+}
+
+int vm_arena_init(vm_t *vm)
+{
+    vm->arena = calloc(1, sizeof(vm_arena_t));
+    if (!vm->arena) {
+        ZF_LOGE("Failed to initialise vm arena: Unable to allocate arena");
+        return -1;
+    }
+    return 0;
+}
+
+void vm_arena_destroy(vm_t *vm)
+{
+    vm_arena_t *arena = vm->arena;
+    if (!arena) {
+        return;
+    }
+    arena_chunk_t *chunk = arena->chunks;
+    while (chunk) {
+        arena_chunk_t *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    free(arena);
+    vm->arena = NULL;
+}
@@ -0,0 +1,22 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <sel4vm/guest_vm.h>
+
+/**
+ * Initialise the arena of a VM
+ * @param {vm_t *} vm   A handle to the VM
+ * @return              0 on success, -1 on error
+ */
+int vm_arena_init(vm_t *vm);
+
+/**
+ * Release every chunk of the arena of a VM, freeing all of its allocations at once
+ * @param {vm_t *} vm   A handle to the VM
+ */
+void vm_arena_destroy(vm_t *vm);
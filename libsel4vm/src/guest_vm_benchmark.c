@@ -0,0 +1,219 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <autoconf.h>
+#include <sel4vm/gen_config.h>
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <utils/util.h>
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_ram.h>
+#include <sel4vm/guest_memory.h>
+#include <sel4vm/guest_vm_benchmark.h>
+
+#include "guest_memory.h"
+#include "guest_vm_benchmark.h"
+#include "guest_vm_exit_stats_arch.h"
+
+#ifdef CONFIG_LIB_SEL4VM_BENCHMARKS
+static const char *benchmark_names[VM_BENCHMARK_NUM_IDS] = {
+    [VM_BENCHMARK_RAM_TOUCH] = "ram_touch",
+    [VM_BENCHMARK_RESERVATION_LOOKUP] = "reservation_lookup",
+    [VM_BENCHMARK_IOPORT_LOOKUP] = "ioport_lookup",
+    [VM_BENCHMARK_DECODE_INSTRUCTION] = "decode_instruction",
+    [VM_BENCHMARK_LAPIC_HIGHEST_IRR] = "lapic_highest_irr",
+    [VM_BENCHMARK_VGIC_INJECT] = "vgic_inject",
+};
+
+/* Sizes of the RAM regions touched, spanning sub-page, page and large page accesses */
+static const size_t ram_touch_sizes[] = { 64, BIT(12), BIT(16), BIT(21) };
+/* Numbers of reservations added for the lookup benchmark */
+static const size_t reservation_counts[] = { 1, 16, 256, 1024 };
+
+int vm_benchmark_run_op(vm_benchmark_writer_t *writer, vm_benchmark_id_t id, uint64_t param, size_t iterations,
+                        vm_benchmark_op_fn op, void *cookie)
+{
+    if (writer->num_results == writer->max_results) {
+        ZF_LOGE("Failed to run benchmark %s: Results buffer full", benchmark_names[id]);
+        return -1;
+    }
+    vm_benchmark_result_t result = {
+        .id = id,
+        .param = param,
+        .iterations = iterations,
+        .min_batch_ticks = UINT64_MAX
+    };
+    for (size_t i = 0; i < iterations; i += VM_BENCHMARK_BATCH) {
+        size_t batch_end = MIN(i + VM_BENCHMARK_BATCH, iterations);
+        uint64_t start = vm_exit_stats_timestamp();
+        for (size_t j = i; j < batch_end; j++) {
+            if (op(j, cookie)) {
+                ZF_LOGE("Failed to run benchmark %s: Operation failed", benchmark_names[id]);
+                return -1;
+            }
+        }
+        uint64_t ticks = vm_exit_stats_timestamp() - start;
+        result.total_ticks += ticks;
+        result.min_batch_ticks = MIN(result.min_batch_ticks, ticks);
+        result.max_batch_ticks = MAX(result.max_batch_ticks, ticks);
+    }
+    if (!iterations) {
+        result.min_batch_ticks = 0;
+    }
+    writer->results[writer->num_results++] = result;
+    return 0;
+}
+
+struct ram_touch_bench {
+    vm_t *vm;
+    uintptr_t addr;
+    size_t size;
+};
+
+static int ram_touch_nop(vm_t *vm, uintptr_t guest_addr, void *vmm_vaddr, size_t size, size_t offset,
+                         void *cookie)
+{
+    return 0;
+}
+
+static int ram_touch_op(size_t iteration, void *cookie)
+{
+    struct ram_touch_bench *bench = cookie;
+    return vm_ram_touch(bench->vm, bench->addr, bench->size, ram_touch_nop, NULL);
+}
+
+static int run_ram_touch(vm_t *vm, vm_benchmark_params_t *params, vm_benchmark_writer_t *writer)
+{
+    for (int i = 0; i < ARRAY_SIZE(ram_touch_sizes); i++) {
+        if (ram_touch_sizes[i] > params->ram_size) {
+            break;
+        }
+        struct ram_touch_bench bench = {
+            .vm = vm,
+            .addr = params->ram_addr,
+            .size = ram_touch_sizes[i]
+        };
+        if (vm_benchmark_run_op(writer, VM_BENCHMARK_RAM_TOUCH, bench.size, params->iterations,
+                                ram_touch_op, &bench)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+struct reservation_lookup_bench {
+    vm_t *vm;
+    uintptr_t addr;
+    size_t num_reservations;
+};
+
+static memory_fault_result_t reservation_bench_fault(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t paddr, size_t len,
+                                                     void *cookie)
+{
+    ZF_LOGE("Unexpected fault on benchmark reservation 0x%"PRIxPTR, paddr);
+    return FAULT_ERROR;
+}
+
+static int reservation_lookup_op(size_t iteration, void *cookie)
+{
+    struct reservation_lookup_bench *bench = cookie;
+    /* Visit the reservations in a scattered order to not favour neighbouring lookups */
+    size_t idx = (iteration * 2654435761u) % bench->num_reservations;
+    uintptr_t base;
+    return vm_memory_reservation_base(bench->vm, bench->addr + idx * PAGE_SIZE_4K + 8, &base);
+}
+
+static int run_reservation_lookup(vm_t *vm, vm_benchmark_params_t *params, vm_benchmark_writer_t *writer)
+{
+    size_t max_reservations = MIN(params->scratch_size / PAGE_SIZE_4K,
+                                  reservation_counts[ARRAY_SIZE(reservation_counts) - 1]);
+    size_t num_reserved = 0;
+    int err = 0;
+
+    if (!max_reservations) {
+        return 0;
+    }
+    vm_memory_reservation_t **reservations = calloc(max_reservations, sizeof(vm_memory_reservation_t *));
+    if (!reservations) {
+        ZF_LOGE("Failed to run reservation lookup benchmark: Unable to allocate reservations");
+        return -1;
+    }
+    for (int i = 0; i < ARRAY_SIZE(reservation_counts) && reservation_counts[i] <= max_reservations; i++) {
+        /* Grow the set of reservations to the next count */
+        for (; num_reserved < reservation_counts[i]; num_reserved++) {
+            reservations[num_reserved] = vm_reserve_memory_at(vm, params->scratch_addr + num_reserved * PAGE_SIZE_4K,
+                                                              PAGE_SIZE_4K, reservation_bench_fault, NULL);
+            if (!reservations[num_reserved]) {
+                ZF_LOGE("Failed to run reservation lookup benchmark: Unable to reserve scratch memory");
+                err = -1;
+                break;
+            }
+        }
+        if (err) {
+            break;
+        }
+        struct reservation_lookup_bench bench = {
+            .vm = vm,
+            .addr = params->scratch_addr,
+            .num_reservations = num_reserved
+        };
+        err = vm_benchmark_run_op(writer, VM_BENCHMARK_RESERVATION_LOOKUP, num_reserved, params->iterations,
+                                  reservation_lookup_op, &bench);
+        if (err) {
+            break;
+        }
+    }
+    for (size_t i = 0; i < num_reserved; i++) {
+        vm_free_reserved_memory(vm, reservations[i]);
+    }
+    free(reservations);
+    return err;
+}
+#endif /* CONFIG_LIB_SEL4VM_BENCHMARKS */
+
+int vm_run_benchmarks(vm_vcpu_t *vcpu, vm_benchmark_params_t *params, vm_benchmark_result_t *results,
+                      size_t max_results, size_t *num_results)
+{
+#ifdef CONFIG_LIB_SEL4VM_BENCHMARKS
+    if (!vcpu || !params || !results || !num_results) {
+        ZF_LOGE("Failed to run benchmarks: Invalid vcpu, parameters or results buffer");
+        return -1;
+    }
+    vm_benchmark_writer_t writer = {
+        .results = results,
+        .max_results = max_results
+    };
+    int err = run_ram_touch(vcpu->vm, params, &writer);
+    if (!err) {
+        err = run_reservation_lookup(vcpu->vm, params, &writer);
+    }
+    if (!err) {
+        err = vm_run_benchmarks_arch(vcpu, params, &writer);
+    }
+    *num_results = writer.num_results;
+    return err;
+#else
+    ZF_LOGE("Failed to run benchmarks: Benchmarks not enabled");
+    return -1;
+#endif
+}
+
+void vm_print_benchmark_results(vm_benchmark_result_t *results, size_t num_results)
+{
+#ifdef CONFIG_LIB_SEL4VM_BENCHMARKS
+    printf("benchmark,param,iterations,total_ticks,min_batch_ticks,max_batch_ticks\n");
+    for (size_t i = 0; i < num_results; i++) {
+        vm_benchmark_result_t *result = &results[i];
+        printf("%s,%"PRIu64",%"PRIu64",%"PRIu64",%"PRIu64",%"PRIu64"\n",
+               result->id < VM_BENCHMARK_NUM_IDS ? benchmark_names[result->id] : "unknown", result->param,
+               result->iterations, result->total_ticks, result->min_batch_ticks, result->max_batch_ticks);
+    }
+#endif
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <autoconf.h>
+#include <sel4vm/gen_config.h>
+
+#include <sel4vm/guest_vm.h>
+
+#ifdef CONFIG_LIB_SEL4VM_BENCHMARKS
+#include <sel4vm/guest_vm_benchmark.h>
+
+/* Results of a benchmark run being written */
+typedef struct vm_benchmark_writer {
+    vm_benchmark_result_t *results;
+    size_t max_results;
+    size_t num_results;
+} vm_benchmark_writer_t;
+
+/**
+ * Type signature of a benchmarked operation
+ * @param {size_t} iteration        Index of the operation within the benchmark
+ * @param {void *} cookie           Cookie of the benchmark
+ * @return                          0 on success, -1 on error
+ */
+typedef int (*vm_benchmark_op_fn)(size_t iteration, void *cookie);
+
+/**
+ * Time a number of calls of an operation, appending the result to a benchmark run
+ * @param {vm_benchmark_writer_t *} writer      Results being written
+ * @param {vm_benchmark_id_t} id                Benchmark being run
+ * @param {uint64_t} param                      Parameter of the benchmark
+ * @param {size_t} iterations                   Number of calls of the operation
+ * @param {vm_benchmark_op_fn} op               Operation to time
+ * @param {void *} cookie                       Cookie passed to the operation
+ * @return                                      0 on success, -1 if an operation failed or the results are full
+ */
+int vm_benchmark_run_op(vm_benchmark_writer_t *writer, vm_benchmark_id_t id, uint64_t param, size_t iterations,
+                        vm_benchmark_op_fn op, void *cookie);
+
+/**
+ * Run the architecture specific benchmarks
+ * @param {vm_vcpu_t *} vcpu                    A handle to the vcpu to benchmark with
+ * @param {vm_benchmark_params_t *} params      Parameters of the benchmarks
+ * @param {vm_benchmark_writer_t *} writer      Results being written
+ * @return                                      0 on success, -1 on error
+ */
+int vm_run_benchmarks_arch(vm_vcpu_t *vcpu, vm_benchmark_params_t *params, vm_benchmark_writer_t *writer);
+#endif /* CONFIG_LIB_SEL4VM_BENCHMARKS */
@@ -0,0 +1,244 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <utils/util.h>
+#include <vka/vka.h>
+#include <vka/object.h>
+
+#include <sel4vm/guest_vm_boot_phases.h>
+
+#include "guest_vm_exit_stats_arch.h"
+
+typedef struct boot_phase_state {
+    vm_boot_phase_t phase;
+    /* Whether the phase is running and the counters it was entered with */
+    bool active;
+    uint64_t start_ticks;
+    uint64_t start_frames;
+    uint64_t start_untyped_bytes;
+} boot_phase_state_t;
+
+typedef struct boot_phases {
+    /* VKA interposed on, and its original operations */
+    vka_t *vka;
+    vka_t parent;
+    /* Object types of small and large frames */
+    seL4_Word frame_type;
+    seL4_Word large_frame_type;
+    /* Memory allocated through the VKA since recording started */
+    uint64_t frames;
+    uint64_t untyped_bytes;
+    unsigned int depth;
+    size_t num_phases;
+    size_t max_phases;
+    boot_phase_state_t *phases;
+} boot_phases_t;
+
+static boot_phases_t *boot_phases;
+
+static void account_object(boot_phases_t *phases, seL4_Word type, seL4_Word size_bits)
+{
+    if (type == phases->frame_type || type == phases->large_frame_type) {
+        phases->frames++;
+    }
+    phases->untyped_bytes += BIT(vka_get_object_size(type, size_bits));
+}
+
+static int counting_cspace_alloc(void *data, seL4_CPtr *res)
+{
+    boot_phases_t *phases = data;
+    return phases->parent.cspace_alloc(phases->parent.data, res);
+}
+
+static void counting_cspace_make_path(void *data, seL4_CPtr slot, cspacepath_t *res)
+{
+    boot_phases_t *phases = data;
+    phases->parent.cspace_make_path(phases->parent.data, slot, res);
+}
+
+static void counting_cspace_free(void *data, seL4_CPtr slot)
+{
+    boot_phases_t *phases = data;
+    phases->parent.cspace_free(phases->parent.data, slot);
+}
+
+static int counting_utspace_alloc(void *data, const cspacepath_t *dest, seL4_Word type, seL4_Word size_bits,
+                                  seL4_Word *res)
+{
+    boot_phases_t *phases = data;
+    int err = phases->parent.utspace_alloc(phases->parent.data, dest, type, size_bits, res);
+    if (!err) {
+        account_object(phases, type, size_bits);
+    }
+    return err;
+}
+
+static int counting_utspace_alloc_maybe_device(void *data, const cspacepath_t *dest, seL4_Word type,
+                                               seL4_Word size_bits, bool can_use_dev, seL4_Word *res)
+{
+    boot_phases_t *phases = data;
+    int err = phases->parent.utspace_alloc_maybe_device(phases->parent.data, dest, type, size_bits, can_use_dev,
+                                                        res);
+    if (!err) {
+        account_object(phases, type, size_bits);
+    }
+    return err;
+}
+
+static int counting_utspace_alloc_at(void *data, const cspacepath_t *dest, seL4_Word type, seL4_Word size_bits,
+                                     uintptr_t paddr, seL4_Word *cookie)
+{
+    boot_phases_t *phases = data;
+    int err = phases->parent.utspace_alloc_at(phases->parent.data, dest, type, size_bits, paddr, cookie);
+    if (!err) {
+        account_object(phases, type, size_bits);
+    }
+    return err;
+}
+
+static void counting_utspace_free(void *data, seL4_Word type, seL4_Word size_bits, seL4_Word target)
+{
+    boot_phases_t *phases = data;
+    phases->parent.utspace_free(phases->parent.data, type, size_bits, target);
+}
+
+static uintptr_t counting_utspace_paddr(void *data, seL4_Word target, seL4_Word type, seL4_Word size_bits)
+{
+    boot_phases_t *phases = data;
+    return phases->parent.utspace_paddr(phases->parent.data, target, type, size_bits);
+}
+
+int vm_boot_phases_start(vka_t *vka, size_t max_phases)
+{
+    if (boot_phases) {
+        ZF_LOGE("Failed to start boot phases: Already started");
+        return -1;
+    }
+    if (!vka || max_phases == 0) {
+        ZF_LOGE("Failed to start boot phases: Invalid vka or number of phases");
+        return -1;
+    }
+    boot_phases_t *phases = calloc(1, sizeof(boot_phases_t));
+    if (!phases) {
+        ZF_LOGE("Failed to start boot phases: Unable to allocate state");
+        return -1;
+    }
+    phases->phases = calloc(max_phases, sizeof(boot_phase_state_t));
+    if (!phases->phases) {
+        ZF_LOGE("Failed to start boot phases: Unable to allocate %zu phases", max_phases);
+        free(phases);
+        return -1;
+    }
+    phases->max_phases = max_phases;
+    phases->frame_type = kobject_get_type(KOBJECT_FRAME, seL4_PageBits);
+    phases->large_frame_type = kobject_get_type(KOBJECT_FRAME, seL4_LargePageBits);
+    phases->vka = vka;
+    phases->parent = *vka;
+    vka->data = phases;
+    vka->cspace_alloc = counting_cspace_alloc;
+    vka->cspace_make_path = counting_cspace_make_path;
+    vka->utspace_alloc = counting_utspace_alloc;
+    vka->utspace_alloc_maybe_device = counting_utspace_alloc_maybe_device;
+    vka->utspace_alloc_at = counting_utspace_alloc_at;
+    vka->cspace_free = counting_cspace_free;
+    vka->utspace_free = counting_utspace_free;
+    vka->utspace_paddr = counting_utspace_paddr;
+    boot_phases = phases;
+    return 0;
+}
+
+void vm_boot_phases_stop(void)
+{
+    if (!boot_phases) {
+        return;
+    }
+    *boot_phases->vka = boot_phases->parent;
+    free(boot_phases->phases);
+    free(boot_phases);
+    boot_phases = NULL;
+}
+
+int vm_boot_phase_begin(const char *name)
+{
+    boot_phases_t *phases = boot_phases;
+    if (!phases) {
+        return -1;
+    }
+    size_t i;
+    for (i = 0; i < phases->num_phases; i++) {
+        if (!strcmp(phases->phases[i].phase.name, name)) {
+            break;
+        }
+    }
+    if (i == phases->num_phases) {
+        if (phases->num_phases == phases->max_phases) {
+            ZF_LOGW("Not recording boot phase %s: No phases left", name);
+            return -1;
+        }
+        phases->phases[i].phase.name = name;
+        phases->phases[i].phase.depth = phases->depth;
+        phases->num_phases++;
+    }
+    boot_phase_state_t *state = &phases->phases[i];
+    if (state->active) {
+        return -1;
+    }
+    state->active = true;
+    state->phase.count++;
+    state->start_frames = phases->frames;
+    state->start_untyped_bytes = phases->untyped_bytes;
+    phases->depth++;
+    state->start_ticks = vm_exit_stats_timestamp();
+    return i;
+}
+
+void vm_boot_phase_end(int phase)
+{
+    uint64_t ticks = vm_exit_stats_timestamp();
+    boot_phases_t *phases = boot_phases;
+    if (!phases || phase < 0 || (size_t)phase >= phases->num_phases || !phases->phases[phase].active) {
+        return;
+    }
+    boot_phase_state_t *state = &phases->phases[phase];
+    state->active = false;
+    state->phase.ticks += ticks - state->start_ticks;
+    state->phase.frames += phases->frames - state->start_frames;
+    state->phase.untyped_bytes += phases->untyped_bytes - state->start_untyped_bytes;
+    phases->depth--;
+}
+
+size_t vm_boot_phases_get(vm_boot_phase_t *phases, size_t max_phases)
+{
+    if (!boot_phases) {
+        return 0;
+    }
+    size_t count = MIN(boot_phases->num_phases, max_phases);
+    for (size_t i = 0; i < count; i++) {
+        phases[i] = boot_phases->phases[i].phase;
+    }
+    return count;
+}
+
+void vm_boot_phases_print(void)
+{
+    if (!boot_phases) {
+        return;
+    }
+    printf("%-40s %8s %16s %10s %16s\n", "phase", "count", "ticks", "frames", "untyped bytes");
+    for (size_t i = 0; i < boot_phases->num_phases; i++) {
+        vm_boot_phase_t *phase = &boot_phases->phases[i].phase;
+        int indent = MIN(phase->depth * 2, 20);
+        printf("%*s%-*s %8u %16"PRIu64" %10"PRIu64" %16"PRIu64"\n", indent, "", 40 - indent, phase->name,
+               phase->count, phase->ticks, phase->frames, phase->untyped_bytes);
+    }
+    printf("%-40s %8s %16s %10"PRIu64" %16"PRIu64"\n", "total", "", "", boot_phases->frames,
+           boot_phases->untyped_bytes);
+}
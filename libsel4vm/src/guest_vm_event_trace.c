@@ -0,0 +1,145 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdlib.h>
+
+#include <utils/util.h>
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_vm_event_trace.h>
+
+#include "guest_vm_event_trace.h"
+#include "guest_vm_exit_stats_arch.h"
+
+compile_time_assert(event_trace_record_size, sizeof(vm_event_trace_record_t) == 32);
+
+/*
+ * The trace is a ring written by any number of producer threads and read by a single consumer. Producers claim
+ * positions by advancing 'head' and never wait for the consumer, overwriting records it has not read yet. Each slot
+ * carries a sequence number acting as a seqlock over its record: it is odd whilst the record of position 'pos' is
+ * being written and '2 * pos + 2' once written, so the consumer can tell a complete record of the position it
+ * expects from one still being written or already overwritten by a later lap of the ring.
+ */
+typedef struct event_trace_slot {
+    size_t seq;
+    vm_event_trace_record_t record;
+} event_trace_slot_t;
+
+struct vm_event_trace {
+    size_t num_slots;
+    event_trace_slot_t *slots;
+    size_t head;
+    /* Next position to be read, owned by the consumer */
+    size_t tail;
+};
+
+int vm_event_trace_start(vm_vcpu_t *vcpu, size_t num_records)
+{
+    if (!vcpu) {
+        ZF_LOGE("Failed to start event trace: Invalid vcpu");
+        return -1;
+    }
+    if (vcpu->event_trace) {
+        ZF_LOGE("Failed to start event trace: Trace already started");
+        return -1;
+    }
+    if (num_records == 0 || (num_records & (num_records - 1))) {
+        ZF_LOGE("Failed to start event trace: Ring size %zu is not a power of 2", num_records);
+        return -1;
+    }
+    vm_event_trace_t *trace = calloc(1, sizeof(vm_event_trace_t));
+    if (!trace) {
+        ZF_LOGE("Failed to start event trace: Unable to allocate trace");
+        return -1;
+    }
+    /* Zeroed sequence numbers never match a written record */
+    trace->slots = calloc(num_records, sizeof(event_trace_slot_t));
+    if (!trace->slots) {
+        ZF_LOGE("Failed to start event trace: Unable to allocate %zu records", num_records);
+        free(trace);
+        return -1;
+    }
+    trace->num_slots = num_records;
+    __atomic_store_n(&vcpu->event_trace, trace, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void vm_event_trace_stop(vm_vcpu_t *vcpu)
+{
+    if (!vcpu || !vcpu->event_trace) {
+        return;
+    }
+    vm_event_trace_t *trace = vcpu->event_trace;
+    __atomic_store_n(&vcpu->event_trace, NULL, __ATOMIC_RELEASE);
+    free(trace->slots);
+    free(trace);
+}
+
+void vm_event_trace_record(vm_vcpu_t *vcpu, uint16_t type, uint32_t arg0, uint64_t arg1, uint64_t arg2)
+{
+    if (!vcpu) {
+        return;
+    }
+    vm_event_trace_t *trace = __atomic_load_n(&vcpu->event_trace, __ATOMIC_ACQUIRE);
+    if (!trace) {
+        return;
+    }
+    size_t pos = __atomic_fetch_add(&trace->head, 1, __ATOMIC_RELAXED);
+    event_trace_slot_t *slot = &trace->slots[pos & (trace->num_slots - 1)];
+    __atomic_store_n(&slot->seq, 2 * pos + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    slot->record = (vm_event_trace_record_t) {
+        .timestamp = vm_exit_stats_timestamp(),
+        .type = type,
+        .vcpu_id = vcpu->vcpu_id,
+        .arg0 = arg0,
+        .arg1 = arg1,
+        .arg2 = arg2,
+    };
+    __atomic_store_n(&slot->seq, 2 * pos + 2, __ATOMIC_RELEASE);
+}
+
+size_t vm_event_trace_read(vm_vcpu_t *vcpu, vm_event_trace_record_t *records, size_t max_records,
+                           uint64_t *num_lost)
+{
+    uint64_t lost = 0;
+    size_t count = 0;
+    if (num_lost) {
+        *num_lost = 0;
+    }
+    if (!vcpu || !vcpu->event_trace) {
+        return 0;
+    }
+    vm_event_trace_t *trace = vcpu->event_trace;
+    size_t head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+    size_t pos = trace->tail;
+    if (head - pos > trace->num_slots) {
+        /* The ring has lapped the consumer, only the last 'num_slots' positions can still be held */
+        lost += head - pos - trace->num_slots;
+        pos = head - trace->num_slots;
+    }
+    for (; pos != head && count < max_records; pos++) {
+        event_trace_slot_t *slot = &trace->slots[pos & (trace->num_slots - 1)];
+        size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq < 2 * pos + 2) {
+            /* Still being written, leave it and any later records for the next read */
+            break;
+        }
+        vm_event_trace_record_t record = slot->record;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (seq != 2 * pos + 2 || __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) {
+            /* Overwritten by a later lap of the ring */
+            lost++;
+            continue;
+        }
+        records[count++] = record;
+    }
+    trace->tail = pos;
+    if (num_lost) {
+        *num_lost = lost;
+    }
+    return count;
+}
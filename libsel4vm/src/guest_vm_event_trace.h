@@ -0,0 +1,39 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_vm_event_trace.h>
+#include <sel4vm/guest_vcpu_fault.h>
+
+/**
+ * Record an event on a vcpu if it is being traced, only calling out of line when it is
+ * @param {vm_vcpu_t *} vcpu            A handle to the vcpu
+ * @param {uint16_t} type               Type of the event
+ * @param {uint32_t} arg0               First event specific argument
+ * @param {uint64_t} arg1               Second event specific argument
+ * @param {uint64_t} arg2               Third event specific argument
+ */
+static inline void vm_event_trace(vm_vcpu_t *vcpu, uint16_t type, uint32_t arg0, uint64_t arg1, uint64_t arg2)
+{
+    if (__atomic_load_n(&vcpu->event_trace, __ATOMIC_RELAXED)) {
+        vm_event_trace_record(vcpu, type, arg0, arg1, arg2);
+    }
+}
+
+/**
+ * Record the entry of an emulated memory callback for a vcpu's fault, only decoding the fault when traced
+ * @param {vm_vcpu_t *} vcpu            A handle to the faulting vcpu
+ * @param {uintptr_t} addr              Faulting guest physical address
+ * @param {size_t} size                 Size of the faulting access
+ */
+static inline void vm_event_trace_mmio_enter(vm_vcpu_t *vcpu, uintptr_t addr, size_t size)
+{
+    if (__atomic_load_n(&vcpu->event_trace, __ATOMIC_RELAXED)) {
+        vm_event_trace_record(vcpu, VM_EVENT_TRACE_MMIO_ENTER, !is_vcpu_read_fault(vcpu), addr, size);
+    }
+}
@@ -0,0 +1,202 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <autoconf.h>
+#include <sel4vm/gen_config.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <sel4vm/guest_vm.h>
+
+#include "guest_vm_exit_stats.h"
+
+int vm_exit_stats_init_vcpu(vm_vcpu_t *vcpu)
+{
+#ifdef CONFIG_LIB_SEL4VM_EXIT_STATS
+    ps_io_ops_t *ops = vcpu->vm->io_ops;
+    vm_exit_stats_t *stats;
+    int err = ps_calloc(&ops->malloc_ops, 1, sizeof(vm_exit_stats_t), (void **)&stats);
+    if (err) {
+        ZF_LOGE("Failed to initialise vcpu exit stats: Unable to allocate stats");
+        return -1;
+    }
+    vcpu->exit_stats = stats;
+#endif
+    return 0;
+}
+
+void vm_exit_stats_destroy_vcpu(vm_vcpu_t *vcpu)
+{
+#ifdef CONFIG_LIB_SEL4VM_EXIT_STATS
+    ps_io_ops_t *ops = vcpu->vm->io_ops;
+    if (vcpu->exit_stats) {
+        ps_free(&ops->malloc_ops, sizeof(vm_exit_stats_t), vcpu->exit_stats);
+        vcpu->exit_stats = NULL;
+    }
+#endif
+}
+
+#ifdef CONFIG_LIB_SEL4VM_EXIT_STATS
+typedef struct mmio_exit_stats_entry {
+    /* Base address of the reservation */
+    uintptr_t addr;
+    vm_exit_latency_t latency;
+} mmio_exit_stats_entry_t;
+
+/* Entries are kept sorted by reservation address */
+struct vm_mmio_exit_stats {
+    int num_entries;
+    mmio_exit_stats_entry_t *entries;
+};
+
+static int find_mmio_entry(vm_mmio_exit_stats_t *stats, uintptr_t addr, bool *found)
+{
+    int low = 0;
+    int high = stats->num_entries;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (stats->entries[mid].addr < addr) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    *found = low < stats->num_entries && stats->entries[low].addr == addr;
+    return low;
+}
+
+void vm_exit_stats_record_mmio(vm_t *vm, uintptr_t addr, uint64_t cycles)
+{
+    vm_mmio_exit_stats_t *stats = vm->run.mmio_exit_stats;
+    bool found;
+    if (!stats) {
+        int err = ps_calloc(&vm->io_ops->malloc_ops, 1, sizeof(vm_mmio_exit_stats_t), (void **)&stats);
+        if (err) {
+            ZF_LOGE("Failed to record mmio exit stats: Unable to allocate stats");
+            return;
+        }
+        vm->run.mmio_exit_stats = stats;
+    }
+    int index = find_mmio_entry(stats, addr, &found);
+    if (!found) {
+        mmio_exit_stats_entry_t *entries = realloc(stats->entries,
+                                                   sizeof(mmio_exit_stats_entry_t) * (stats->num_entries + 1));
+        if (!entries) {
+            ZF_LOGE("Failed to record mmio exit stats: Unable to allocate stats entry");
+            return;
+        }
+        stats->entries = entries;
+        memmove(&entries[index + 1], &entries[index], sizeof(mmio_exit_stats_entry_t) * (stats->num_entries - index));
+        memset(&entries[index], 0, sizeof(mmio_exit_stats_entry_t));
+        entries[index].addr = addr;
+        stats->num_entries++;
+    }
+    vm_exit_latency_record(&stats->entries[index].latency, cycles);
+}
+
+void vm_exit_stats_write_record(vm_exit_stats_writer_t *writer, vm_exit_stats_record_type_t type, uint16_t vcpu_id,
+                                uint64_t id, vm_exit_latency_t *latency)
+{
+    if (latency->count == 0) {
+        return;
+    }
+    if (writer->offset + sizeof(vm_exit_stats_record_t) <= writer->len) {
+        vm_exit_stats_record_t record = {
+            .type = type,
+            .vcpu_id = vcpu_id,
+            .reserved = 0,
+            .id = id,
+            .latency = *latency
+        };
+        memcpy(writer->buf + writer->offset, &record, sizeof(record));
+    }
+    writer->offset += sizeof(vm_exit_stats_record_t);
+    writer->num_records++;
+}
+
+int vm_get_mmio_exit_stats(vm_t *vm, uintptr_t addr, vm_exit_latency_t *latency)
+{
+    vm_mmio_exit_stats_t *stats = vm->run.mmio_exit_stats;
+    bool found;
+    if (!stats) {
+        return -1;
+    }
+    int index = find_mmio_entry(stats, addr, &found);
+    if (!found) {
+        return -1;
+    }
+    *latency = stats->entries[index].latency;
+    return 0;
+}
+
+int vm_dump_exit_stats(vm_t *vm, void *buf, size_t len, size_t *size)
+{
+    vm_exit_stats_writer_t writer = {
+        .buf = buf,
+        .len = len,
+        .offset = sizeof(vm_exit_stats_dump_header_t),
+        .num_records = 0
+    };
+    for (int i = 0; i < vm->num_vcpus; i++) {
+        vm_vcpu_t *vcpu = vm->vcpus[i];
+        if (vcpu && vcpu->exit_stats) {
+            vm_exit_stats_dump_arch(vcpu, &writer);
+        }
+    }
+    vm_mmio_exit_stats_t *mmio_stats = vm->run.mmio_exit_stats;
+    if (mmio_stats) {
+        for (int i = 0; i < mmio_stats->num_entries; i++) {
+            vm_exit_stats_write_record(&writer, VM_EXIT_STATS_RECORD_MMIO, VM_EXIT_STATS_NO_VCPU,
+                                       mmio_stats->entries[i].addr, &mmio_stats->entries[i].latency);
+        }
+    }
+    *size = writer.offset;
+    if (writer.offset > len) {
+        ZF_LOGE("Failed to dump exit stats: Buffer too small, %zu bytes required", writer.offset);
+        return -1;
+    }
+    vm_exit_stats_dump_header_t header = {
+        .magic = VM_EXIT_STATS_DUMP_MAGIC,
+        .version = VM_EXIT_STATS_DUMP_VERSION,
+        .hist_buckets = VM_EXIT_STATS_HIST_BUCKETS,
+        .num_records = writer.num_records,
+        .record_size = sizeof(vm_exit_stats_record_t)
+    };
+    memcpy(buf, &header, sizeof(header));
+    return 0;
+}
+
+int vm_get_exit_stats(vm_vcpu_t *vcpu, vm_exit_stats_t *stats)
+{
+    if (!vcpu || !vcpu->exit_stats) {
+        ZF_LOGE("Failed to get exit stats: Invalid vcpu");
+        return -1;
+    }
+    memcpy(stats, vcpu->exit_stats, sizeof(vm_exit_stats_t));
+    return 0;
+}
+
+void vm_reset_exit_stats(vm_vcpu_t *vcpu)
+{
+    if (!vcpu || !vcpu->exit_stats) {
+        return;
+    }
+    memset(vcpu->exit_stats, 0, sizeof(vm_exit_stats_t));
+}
+#endif /* CONFIG_LIB_SEL4VM_EXIT_STATS */
+
+void vm_exit_stats_destroy(vm_t *vm)
+{
+#ifdef CONFIG_LIB_SEL4VM_EXIT_STATS
+    vm_mmio_exit_stats_t *stats = vm->run.mmio_exit_stats;
+    if (stats) {
+        free(stats->entries);
+        ps_free(&vm->io_ops->malloc_ops, sizeof(vm_mmio_exit_stats_t), stats);
+        vm->run.mmio_exit_stats = NULL;
+    }
+#endif
+}
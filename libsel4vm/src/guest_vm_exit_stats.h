@@ -0,0 +1,91 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <autoconf.h>
+#include <sel4vm/gen_config.h>
+
+#include <utils/util.h>
+
+#include <sel4vm/guest_vm.h>
+
+#ifdef CONFIG_LIB_SEL4VM_EXIT_STATS
+#include <sel4vm/guest_vm_exit_stats.h>
+
+#include "guest_vm_exit_stats_arch.h"
+
+/* State of an exit statistics dump being written */
+typedef struct vm_exit_stats_writer {
+    void *buf;
+    size_t len;
+    /* Size of the dump so far, this can exceed 'len' */
+    size_t offset;
+    uint32_t num_records;
+} vm_exit_stats_writer_t;
+
+/**
+ * Record the latency of an event
+ * @param {vm_exit_latency_t *} latency     Latency statistics of the event class
+ * @param {uint64_t} cycles                 Latency of the event in timestamp counter ticks
+ */
+static inline void vm_exit_latency_record(vm_exit_latency_t *latency, uint64_t cycles)
+{
+    int bucket = 0;
+    if (cycles >> VM_EXIT_STATS_HIST_SHIFT) {
+        bucket = MIN(63 - CLZLL(cycles) - VM_EXIT_STATS_HIST_SHIFT, VM_EXIT_STATS_HIST_BUCKETS - 1);
+    }
+    latency->count++;
+    latency->total_cycles += cycles;
+    latency->max_cycles = MAX(latency->max_cycles, cycles);
+    latency->histogram[bucket]++;
+}
+
+/**
+ * Record the latency of handling a fault on an emulated memory reservation
+ * @param {vm_t *} vm               A handle to the VM
+ * @param {uintptr_t} addr          Base address of the reservation
+ * @param {uint64_t} cycles         Latency of the fault callback in timestamp counter ticks
+ */
+void vm_exit_stats_record_mmio(vm_t *vm, uintptr_t addr, uint64_t cycles);
+
+/**
+ * Append a record to an exit statistics dump. Nothing is written if no events have been recorded in 'latency'
+ * @param {vm_exit_stats_writer_t *} writer     Dump being written
+ * @param {vm_exit_stats_record_type_t} type    Type of the record
+ * @param {uint16_t} vcpu_id                    Id of the vcpu the record belongs to
+ * @param {uint64_t} id                         Identifier of the event
+ * @param {vm_exit_latency_t *} latency         Latency statistics of the event
+ */
+void vm_exit_stats_write_record(vm_exit_stats_writer_t *writer, vm_exit_stats_record_type_t type, uint16_t vcpu_id,
+                                uint64_t id, vm_exit_latency_t *latency);
+
+/**
+ * Append the architecture specific exit statistics of a vcpu to an exit statistics dump
+ * @param {vm_vcpu_t *} vcpu                    A handle to the vcpu
+ * @param {vm_exit_stats_writer_t *} writer     Dump being written
+ */
+void vm_exit_stats_dump_arch(vm_vcpu_t *vcpu, vm_exit_stats_writer_t *writer);
+#endif /* CONFIG_LIB_SEL4VM_EXIT_STATS */
+
+/**
+ * Initialise the exit statistics of a vcpu, a no-op if exit statistics are disabled
+ * @param {vm_vcpu_t *} vcpu        A handle to the vcpu
+ * @return                          0 on success, -1 on error
+ */
+int vm_exit_stats_init_vcpu(vm_vcpu_t *vcpu);
+
+/**
+ * Free the exit statistics of a vcpu, a no-op if exit statistics are disabled
+ * @param {vm_vcpu_t *} vcpu        A handle to the vcpu
+ */
+void vm_exit_stats_destroy_vcpu(vm_vcpu_t *vcpu);
+
+/**
+ * Free the emulated memory reservation statistics of a VM, a no-op if exit statistics are disabled
+ * @param {vm_t *} vm               A handle to the VM
+ */
+void vm_exit_stats_destroy(vm_t *vm);
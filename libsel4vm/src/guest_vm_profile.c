@@ -0,0 +1,99 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdlib.h>
+
+#include <utils/util.h>
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_vm_profile.h>
+
+#include "guest_vm_profile.h"
+
+int vm_profile_start(vm_vcpu_t *vcpu, size_t num_samples, unsigned int interval)
+{
+    if (!vcpu) {
+        ZF_LOGE("Failed to start profile: Invalid vcpu");
+        return -1;
+    }
+    if (num_samples == 0 || interval == 0) {
+        ZF_LOGE("Failed to start profile: Invalid number of samples or interval");
+        return -1;
+    }
+    vm_profile_t *profile = calloc(1, sizeof(vm_profile_t));
+    if (!profile) {
+        ZF_LOGE("Failed to start profile: Unable to allocate profile");
+        return -1;
+    }
+    profile->samples = calloc(num_samples, sizeof(vm_profile_sample_t));
+    if (!profile->samples) {
+        ZF_LOGE("Failed to start profile: Unable to allocate %zu samples", num_samples);
+        free(profile);
+        return -1;
+    }
+    profile->num_samples = num_samples;
+    profile->interval = interval;
+    profile->countdown = interval;
+    vm_profile_stop(vcpu);
+    vcpu->profile = profile;
+    return 0;
+}
+
+void vm_profile_stop(vm_vcpu_t *vcpu)
+{
+    if (!vcpu || !vcpu->profile) {
+        return;
+    }
+    free(vcpu->profile->samples);
+    free(vcpu->profile);
+    vcpu->profile = NULL;
+}
+
+size_t vm_profile_get_samples(vm_vcpu_t *vcpu, vm_profile_sample_t *samples, size_t max_samples)
+{
+    if (!vcpu || !vcpu->profile) {
+        return 0;
+    }
+    vm_profile_t *profile = vcpu->profile;
+    size_t count = MIN(MIN(profile->next, profile->num_samples), max_samples);
+    /* The oldest sample still held is at 'next - held' */
+    size_t first = profile->next - MIN(profile->next, profile->num_samples);
+    for (size_t i = 0; i < count; i++) {
+        samples[i] = profile->samples[(first + i) % profile->num_samples];
+    }
+    return count;
+}
+
+int vm_profile_histogram(vm_vcpu_t *vcpu, uintptr_t start, size_t bucket_size, uint64_t *buckets,
+                         size_t num_buckets)
+{
+    if (!vcpu || !vcpu->profile) {
+        ZF_LOGE("Failed to histogram profile: Profile not started");
+        return -1;
+    }
+    if (bucket_size == 0) {
+        ZF_LOGE("Failed to histogram profile: Invalid bucket size");
+        return -1;
+    }
+    vm_profile_t *profile = vcpu->profile;
+    size_t held = MIN(profile->next, profile->num_samples);
+    int counted = 0;
+    for (size_t i = 0; i < num_buckets; i++) {
+        buckets[i] = 0;
+    }
+    for (size_t i = 0; i < held; i++) {
+        uintptr_t ip = profile->samples[i].ip;
+        if (ip < start) {
+            continue;
+        }
+        size_t bucket = (ip - start) / bucket_size;
+        if (bucket < num_buckets) {
+            buckets[bucket]++;
+            counted++;
+        }
+    }
+    return counted;
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_vm_profile.h>
+
+struct vm_profile {
+    /* Ring of 'num_samples' samples, 'next' counts all samples taken */
+    vm_profile_sample_t *samples;
+    size_t num_samples;
+    size_t next;
+    unsigned int interval;
+    /* Exits left before the next sample */
+    unsigned int countdown;
+};
+
+/**
+ * Test whether the current exit of a vcpu is to be sampled, such that the guest instruction pointer is only
+ * fetched for sampled exits
+ * @param {vm_vcpu_t *} vcpu        A handle to the vcpu
+ * @return                          true if 'vm_profile_record' is to be called for the exit
+ */
+static inline bool vm_profile_due(vm_vcpu_t *vcpu)
+{
+    vm_profile_t *profile = vcpu->profile;
+    if (!profile || --profile->countdown) {
+        return false;
+    }
+    profile->countdown = profile->interval;
+    return true;
+}
+
+/**
+ * Record a sample of a vcpu's execution
+ * @param {vm_vcpu_t *} vcpu            A handle to the vcpu
+ * @param {uintptr_t} ip                Guest instruction pointer of the exit
+ * @param {uint32_t} exit_reason        Reason of the exit
+ */
+static inline void vm_profile_record(vm_vcpu_t *vcpu, uintptr_t ip, uint32_t exit_reason)
+{
+    vm_profile_t *profile = vcpu->profile;
+    profile->samples[profile->next % profile->num_samples] = (vm_profile_sample_t) {
+        .ip = ip,
+        .exit_reason = exit_reason,
+    };
+    profile->next++;
+}
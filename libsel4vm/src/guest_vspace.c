@@ -50,6 +50,10 @@ static int guest_vspace_map(vspace_t *vspace, seL4_CPtr cap, void *vaddr, seL4_C
     guest_vspace_t *guest_vspace = (guest_vspace_t *) data;
     /* set the mapping bit */
     guest_vspace->done_mapping = 1;
+    if (guest_vspace->num_iospaces && size_bits != seL4_PageBits) {
+        ZF_LOGE("Failed to map page into iospace: IO spaces only map 4K frames");
+        return -1;
+    }
     cspacepath_t orig_path;
     /* duplicate the cap so we can do a mapping */
     vka_cspace_make_path(guest_vspace->vspace_data.vka, cap, &orig_path);
@@ -71,6 +75,8 @@ static int guest_vspace_map(vspace_t *vspace, seL4_CPtr cap, void *vaddr, seL4_C
                                            size_bits, NULL, NULL);
         if (error) {
             ZF_LOGE("Failed to map page into iospace");
+            vka_cnode_delete(&new_path);
+            vka_cspace_free_path(guest_vspace->vspace_data.vka, new_path);
             return error;
         }
 
@@ -98,7 +104,7 @@ void guest_vspace_unmap(vspace_t *vspace, void *vaddr, size_t num_pages, size_t
      * This can be done in a single call as mappings are contiguous in this vspace. */
     sel4utils_unmap_pages(vspace, vaddr, num_pages, size_bits, vka);
 
-#if defined(CONFIG_ARM_SMMU) || defined(CONFIG_IOMMU)
+#if defined(CONFIG_TK1_SMMU) || defined(CONFIG_IOMMU)
     /* Each page must be unmapped individually from the vmm vspace, as mappings are not
      * necessarily host-virtually contiguous. */
     size_t page_size = BIT(size_bits);
@@ -161,6 +167,18 @@ int vm_guest_add_iospace(vm_t *vm, vspace_t *loader, seL4_CPtr iospace)
     return 0;
 }
 
+int vm_guest_num_iospaces(vm_t *vm)
+{
+#if defined(CONFIG_TK1_SMMU) || defined(CONFIG_IOMMU)
+    struct sel4utils_alloc_data *data = get_alloc_data(&vm->mem.vm_vspace);
+    guest_vspace_t *guest_vspace = (guest_vspace_t *) data;
+    return guest_vspace->num_iospaces;
+#else
+    /* guest mappings are only mirrored into iospaces with IOMMU support */
+    return 0;
+#endif
+}
+
 int vm_init_guest_vspace(vspace_t *loader, vspace_t *vmm, vspace_t *new_vspace, vka_t *vka, seL4_CPtr page_directory)
 {
     int error;
@@ -184,3 +202,18 @@ int vm_init_guest_vspace(vspace_t *loader, vspace_t *vmm, vspace_t *new_vspace,
 
     return 0;
 }
+
+void vm_tear_down_guest_vspace(vspace_t *vspace)
+{
+    struct sel4utils_alloc_data *data = get_alloc_data(vspace);
+    guest_vspace_t *guest_vspace = (guest_vspace_t *) data;
+
+    /* Unmapping the guest vspace drops the copies of the frame caps mapped into the iospaces as it goes */
+    vspace_tear_down(vspace, VSPACE_FREE);
+    for (int i = 0; i < guest_vspace->num_iospaces; i++) {
+        vspace_tear_down(&guest_vspace->iospaces[i]->iospace_vspace, VSPACE_FREE);
+        free(guest_vspace->iospaces[i]);
+    }
+    free(guest_vspace->iospaces);
+    free(guest_vspace);
+}
@@ -12,3 +12,7 @@
 
 /* Constructs a vspace that will duplicate mappings between a page directory and several IO spaces */
 int vm_init_guest_vspace(vspace_t *loader, vspace_t *vmm, vspace_t *new_vspace, vka_t *vka, seL4_CPtr page_directory);
+
+/* Unmap and free every frame and paging structure of a vspace constructed with vm_init_guest_vspace, along with its
+ * IO spaces and bookkeeping */
+void vm_tear_down_guest_vspace(vspace_t *vspace);
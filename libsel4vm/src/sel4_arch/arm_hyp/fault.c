@@ -177,5 +177,5 @@ void fault_print_data(fault_t *fault)
 
 bool fault_is_thumb(fault_t *f)
 {
-    return CPSR_IS_THUMB(fault_get_ctx(f)->cpsr);
+    return CPSR_IS_THUMB(fault_get_ctx_reg(f, FAULT_CTX_REG(cpsr)));
 }
@@ -10,3 +10,9 @@
 
 int vm_init_arch(vm_t *vm);
 int vm_create_vcpu_arch(vm_t *vm, vm_vcpu_t *vcpu);
+void vm_destroy_vcpu_arch(vm_t *vm, vm_vcpu_t *vcpu);
+void vm_destroy_arch(vm_t *vm);
+
+/* Get the TCB of the thread a vcpu executes on, and the core it runs on, for binding the vcpu's scheduling context.
+ * Returns -1 if the vcpu runs on a thread its scheduling context can't be bound to */
+int vm_vcpu_sched_target_arch(vm_vcpu_t *vcpu, seL4_CPtr *tcb, int *core);
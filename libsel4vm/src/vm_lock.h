@@ -0,0 +1,95 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <assert.h>
+
+#include <sel4/sel4.h>
+
+/* A spinlock that can be re-acquired by the thread holding it, used to serialise VMM threads
+ * (see CONFIG_LIB_SEL4VM_VCPU_THREADS). Threads are identified by their IPC buffer */
+typedef struct vm_lock {
+    volatile int locked;
+    void *owner;
+    int depth;
+} vm_lock_t;
+
+static inline void vm_lock_acquire(vm_lock_t *lock)
+{
+    void *self = seL4_GetIPCBuffer();
+    if (__atomic_load_n(&lock->owner, __ATOMIC_RELAXED) == self) {
+        lock->depth++;
+        return;
+    }
+    while (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE)) {
+        /* Let any other thread sharing our core make progress */
+        seL4_Yield();
+    }
+    __atomic_store_n(&lock->owner, self, __ATOMIC_RELAXED);
+    lock->depth = 1;
+}
+
+static inline void vm_lock_release(vm_lock_t *lock)
+{
+    assert(lock->owner == seL4_GetIPCBuffer());
+    if (--lock->depth > 0) {
+        return;
+    }
+    __atomic_store_n(&lock->owner, NULL, __ATOMIC_RELAXED);
+    __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+}
+
+/* A lock shared by any number of readers or held by a single writer, for state that is looked up far more often than
+ * it is changed. The writer may take the lock again, for reading or writing, while it holds it. A reader must not
+ * take the lock for writing, and readers are let in while a writer is waiting, such that a reader may nest reads */
+typedef struct vm_rwlock {
+    vm_lock_t write;
+    volatile int readers;
+} vm_rwlock_t;
+
+static inline void vm_rwlock_read_acquire(vm_rwlock_t *lock)
+{
+    if (__atomic_load_n(&lock->write.owner, __ATOMIC_RELAXED) == seL4_GetIPCBuffer()) {
+        return;
+    }
+    for (;;) {
+        __atomic_add_fetch(&lock->readers, 1, __ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&lock->write.locked, __ATOMIC_SEQ_CST)) {
+            return;
+        }
+        __atomic_sub_fetch(&lock->readers, 1, __ATOMIC_RELEASE);
+        while (__atomic_load_n(&lock->write.locked, __ATOMIC_RELAXED)) {
+            seL4_Yield();
+        }
+    }
+}
+
+static inline void vm_rwlock_read_release(vm_rwlock_t *lock)
+{
+    if (__atomic_load_n(&lock->write.owner, __ATOMIC_RELAXED) == seL4_GetIPCBuffer()) {
+        return;
+    }
+    __atomic_sub_fetch(&lock->readers, 1, __ATOMIC_RELEASE);
+}
+
+static inline void vm_rwlock_write_acquire(vm_rwlock_t *lock)
+{
+    vm_lock_acquire(&lock->write);
+    if (lock->write.depth > 1) {
+        return;
+    }
+    /* Pairs with the readers announcing themselves before they check for a writer */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&lock->readers, __ATOMIC_ACQUIRE)) {
+        seL4_Yield();
+    }
+}
+
+static inline void vm_rwlock_write_release(vm_rwlock_t *lock)
+{
+    vm_lock_release(&lock->write);
+}
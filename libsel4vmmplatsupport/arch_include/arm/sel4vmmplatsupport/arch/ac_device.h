@@ -50,3 +50,18 @@ enum vacdev_action {
  */
 int vm_install_generic_ac_device(vm_t *vm, const struct device *d, void *mask,
                                  size_t size, enum vacdev_action action);
+
+/***
+ * @function vm_install_generic_ac_device_trap_writes(vm, d, mask, size, action)
+ * Installs a generic access controlled device that is mapped read only into the guest, so that reads of the device
+ * don't fault and only writes are trapped to check against the access mask. Suited to read mostly devices such as
+ * clock or power controllers. The device must be a single page, aligned to the page size
+ * @param {vm_t *} vm                       The VM to install the device into
+ * @param {const struct device *} d         A description of the device to install
+ * @param {void *} mask                     An access mask, as for `vm_install_generic_ac_device`
+ * @param {size_t} size                     The size of the mask, as for `vm_install_generic_ac_device`
+ * @param {enum vacdev_action} action       Action to take when access is violated.
+ * @return                                  0 on success, -1 on error
+ */
+int vm_install_generic_ac_device_trap_writes(vm_t *vm, const struct device *d, void *mask,
+                                             size_t size, enum vacdev_action action);
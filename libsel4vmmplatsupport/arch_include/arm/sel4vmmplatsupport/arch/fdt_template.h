@@ -0,0 +1,69 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#pragma once
+
+/***
+ * @module fdt_template.h
+ * The fdt template interface lets a VMM generate the final DTB of a guest once, such as with
+ * `fdt_generate_plat_vcpu_node` and `fdt_generate_vpci_node`, and keep it as a template from which the DTBs of
+ * further identical guests are made. Making a DTB from a template only patches the properties that differ between
+ * instances, e.g. the memory node's reg, a MAC address or the bootargs, without generating any nodes again. A
+ * template is a packed DTB, so it can be serialised and loaded again as is.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+/***
+ * @struct fdt_template_patch
+ * A property set on a DTB made from a template, added to its node if the template doesn't have it
+ * @param {const char *} path       Path of the node holding the property, e.g. "/chosen"
+ * @param {const char *} name       Name of the property, e.g. "bootargs"
+ * @param {const void *} value      Value of the property
+ * @param {int} len                 Length of the value in bytes
+ */
+typedef struct fdt_template_patch {
+    const char *path;
+    const char *name;
+    const void *value;
+    int len;
+} fdt_template_patch_t;
+
+/***
+ * @function fdt_template_create(fdt, template, size)
+ * Create a template from a generated DTB, copying it into a packed DTB
+ * @param {const void *} fdt            Generated DTB
+ * @param {void **} template            Set to the template, allocated with malloc
+ * @param {size_t *} size               Set to the size of the template in bytes
+ * @return                              0 on success, -1 on error
+ */
+int fdt_template_create(const void *fdt, void **template, size_t *size);
+
+/***
+ * @function fdt_template_instantiate(template, fdt, fdt_size, patches, num_patches)
+ * Make the DTB of a guest from a template, setting the properties that differ between guests
+ * @param {const void *} template               Template created with `fdt_template_create`
+ * @param {void *} fdt                          Buffer to make the DTB in
+ * @param {size_t} fdt_size                     Size of the buffer, leaving room for the patches
+ * @param {const fdt_template_patch_t *} patches    Properties to set
+ * @param {int} num_patches                     Number of properties to set
+ * @return                                      0 on success, -1 on error
+ */
+int fdt_template_instantiate(const void *template, void *fdt, size_t fdt_size, const fdt_template_patch_t *patches,
+                             int num_patches);
+
+/***
+ * @function fdt_template_encode_reg(template, path, addr, size, cells)
+ * Encode a single address and size "reg" property for a node of a template, such as to patch the size of the memory
+ * node, using the number of address and size cells of the node's parent
+ * @param {const void *} template       Template holding the node
+ * @param {const char *} path           Path of the node, e.g. "/memory"
+ * @param {uint64_t} addr               Address to encode
+ * @param {uint64_t} size               Size to encode
+ * @param {uint32_t *} cells            Buffer of at least 4 cells to encode the property into
+ * @return                              Length of the encoded property in bytes, -1 on error
+ */
+int fdt_template_encode_reg(const void *template, const char *path, uint64_t addr, uint64_t size, uint32_t *cells);
@@ -12,6 +12,8 @@
  * a device frame for a real device can be given to a different CAmkES component
  * and this virtual device will forward read and write faults over a CAmkES
  * interface so the component can perform or emulate the actions.
+ * Writes can also be posted to the component without waiting for them to be performed, with the vcpu resumed
+ * straight away. Posted writes are flushed before any read is forwarded, so reads observe every earlier write.
  */
 
 #include <stdint.h>
@@ -20,16 +22,26 @@
 
 typedef void (*forward_write_fn)(uint32_t addr, uint32_t value);
 typedef uint32_t (*forward_read_fn)(uint32_t addr);
+typedef int (*forward_post_write_fn)(uint32_t addr, uint32_t value);
+typedef void (*forward_flush_fn)(void);
 
 /***
  * @struct generic_forward_cfg
  * Interface for forwarding read and write faults
- * @param {forward_write_fn} write_fn   A callback for forwarding write faults
- * @param {forward_read_fn} read_fn     A callback for forwarding read faults
+ * @param {forward_write_fn} write_fn           A callback for forwarding write faults
+ * @param {forward_read_fn} read_fn             A callback for forwarding read faults
+ * @param {forward_post_write_fn} post_write_fn Optional callback for posting write faults without waiting for them
+ *                                              to be performed, such as onto a ring shared with the component.
+ *                                              Returns -1 if the write can't be posted, such as when the ring is
+ *                                              full, in which case posted writes are flushed and it is posted again
+ * @param {forward_flush_fn} flush_fn           Callback waiting for every posted write to be performed, required
+ *                                              with `post_write_fn`
  */
 struct generic_forward_cfg {
     forward_write_fn write_fn;
     forward_read_fn read_fn;
+    forward_post_write_fn post_write_fn;
+    forward_flush_fn flush_fn;
 };
 
 /***
@@ -21,6 +21,8 @@ enum img_type {
     IMG_INITRD_GZ,
     /* Flattened device tree blob */
     IMG_DTB,
+    /* Image compressed in the lz4 legacy format, decompressed as it is loaded */
+    IMG_LZ4,
 };
 
 struct guest_kernel_image_arch {};
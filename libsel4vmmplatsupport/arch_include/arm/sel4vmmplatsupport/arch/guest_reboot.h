@@ -10,8 +10,12 @@
  * @module guest_reboot.h
  * The guest reboot interface provides a series of helpers for registering callbacks when rebooting the VMM.
  * This interface giving various VMM components and drivers the ability to reset necessary state on a reboot.
+ * A VMM can also reboot a guest without loading its images again, by saving the guest's RAM once it is loaded with
+ * `vmm_fast_reboot_init` and resetting it back with `vmm_fast_reboot`.
  */
 
+#include <sel4vm/guest_ram.h>
+
 typedef int (*reboot_hook_fn)(vm_t *vm, void *token);
 
 /***
@@ -31,10 +35,12 @@ typedef struct reboot_hook {
  * Reboot hooks management datastructure. Contains a list of reboot hooks that a VMM registers
  * @param {reboot_hook_t *} rb_hooks        List of reboot hooks
  * @param {size_t} nhooks                   Number of reboot hooks in `rb_hooks` member
+ * @param {vm_ram_snapshot_t *} boot_ram    Guest RAM saved by `vmm_fast_reboot_init`, NULL if not saved
  */
 typedef struct reboot_hooks_list {
     reboot_hook_t *rb_hooks;
     size_t nhooks;
+    vm_ram_snapshot_t *boot_ram;
 } reboot_hooks_list_t;
 
 /***
@@ -63,3 +69,24 @@ int vmm_register_reboot_callback(reboot_hooks_list_t *rb_hooks_list, reboot_hook
  * @return                                          0 for success, otherwise -1 for error
  */
 int vmm_process_reboot_callbacks(vm_t *vm, reboot_hooks_list_t *rb_hooks_list);
+
+/***
+ * @function vmm_fast_reboot_init(vm, rb_hooks_list)
+ * Save the RAM of a guest, once its kernel, DTB and initrd are loaded and before it is started, for use by
+ * `vmm_fast_reboot`
+ * @param {vm_t *} vm                               Handle to vm
+ * @param {reboot_hooks_list_t *} rb_hooks_list     Handle to reboot hooks list to hold the saved RAM
+ * @return                                          0 for success, otherwise -1 for error
+ */
+int vmm_fast_reboot_init(vm_t *vm, reboot_hooks_list_t *rb_hooks_list);
+
+/***
+ * @function vmm_fast_reboot(vm, rb_hooks_list)
+ * Reboot a guest without loading its images again. The reboot hooks are processed to reset device state, and the
+ * guest's RAM is reset in place to that saved by `vmm_fast_reboot_init`, keeping it mapped. The VMM then restarts the
+ * boot vcpu as it did on first boot
+ * @param {vm_t *} vm                               Handle to vm - passed onto reboot callback
+ * @param {reboot_hooks_list_t *} rb_hooks_list     Handle to reboot hooks list
+ * @return                                          0 for success, otherwise -1 for error
+ */
+int vmm_fast_reboot(vm_t *vm, reboot_hooks_list_t *rb_hooks_list);
@@ -29,9 +29,11 @@ typedef int (*vcpu_exception_handler_fn)(vm_vcpu_t *vcpu, uint32_t hsr);
 int vmm_handle_arm_vcpu_exception(vm_vcpu_t *vcpu, uint32_t hsr, void *cookie);
 
 /***
- * @function register_arm_vcpu_exception_handler(ec_class, exception_handler)
- * Register a handler to a vcpu exception class
+ * @function register_arm_vcpu_exception_handler(vm, ec_class, exception_handler)
+ * Register a handler to a vcpu exception class of a VM, the VM's other exception classes keeping their handlers
+ * @param {vm_t *} vm                                       A handle to the VM
  * @param {uint32_t} ec_class                               The exception class the handler will be called on
  * @param {vcpu_exception_handler_fn} exception_handler     Function pointer to the exception handler
+ * @return                                                  -1 on error, otherwise 0 for success
  */
-int register_arm_vcpu_exception_handler(uint32_t ec_class, vcpu_exception_handler_fn exception_handler);
+int register_arm_vcpu_exception_handler(vm_t *vm, uint32_t ec_class, vcpu_exception_handler_fn exception_handler);
@@ -14,9 +14,22 @@
 /***
  * @function fdt_generate_plat_vcpu_node(vm, fdt)
  * Generate a CPU device node for a given fdt. This taking into account
- * the vcpus created for the VM.
+ * the vcpus created for the VM. vcpus with a host memory node local to their target cpu, see `vm_vcpu_ram_node`,
+ * are given that node as their numa-node-id.
  * @param {vm_t *} vm       A handle to the VM
  * @param {void *} fdt      FDT blob to append generated device node
  * @return                  0 for success, -1 for error
  */
 int fdt_generate_plat_vcpu_node(vm_t *vm, void *fdt);
+
+/***
+ * @function fdt_generate_numa_memory_node(fdt, addr, size, node)
+ * Generate a memory node for a region of guest RAM placed on a host memory node, such as with
+ * `vm_ram_register_at_node`, giving the guest the node as its numa-node-id
+ * @param {void *} fdt          FDT blob to append generated memory node
+ * @param {uintptr_t} addr      Guest physical address of the RAM region
+ * @param {size_t} size         Size of the RAM region in bytes
+ * @param {int} node            Node of the RAM region
+ * @return                      0 for success, -1 for error
+ */
+int fdt_generate_numa_memory_node(void *fdt, uintptr_t addr, size_t size, int node);
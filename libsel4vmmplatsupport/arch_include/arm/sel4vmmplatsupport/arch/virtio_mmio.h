@@ -0,0 +1,44 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#pragma once
+
+/***
+ * @module virtio_mmio.h
+ * The ARM virtio mmio interface exposes an emulated virtio device to the guest through the legacy (version 1)
+ * virtio-mmio register layout, as an alternative to a virtio-pci device behind the vPCI I/O window. Each register
+ * access is a single MMIO fault on the device's window, which is dispatched without going through the PCI
+ * configuration space or I/O port emulation. The device is described to the guest with a "virtio,mmio" device tree
+ * node, which can be generated with `fdt_generate_virtio_mmio_node`.
+ */
+
+#include <stdint.h>
+#include <sel4vm/guest_vm.h>
+#include <sel4vmmplatsupport/drivers/virtio_pci_emul.h>
+
+/* Size of the register window of a virtio mmio device */
+#define VIRTIO_MMIO_SIZE 0x200
+
+/***
+ * @function vm_install_virtio_mmio(vm, emul, addr, device_id)
+ * Install a virtio mmio transport for an emulated virtio device into a VM instance
+ * @param {vm_t *} vm                   A handle to the VM
+ * @param {virtio_emul_t *} emul        Emulated virtio device to expose, which must not be used by another transport
+ * @param {uintptr_t} addr              Guest physical address of the register window, of VIRTIO_MMIO_SIZE bytes
+ * @param {uint32_t} device_id          Virtio device id reported to the guest, e.g. VIRTIO_ID_NET
+ * @return                              -1 for error, otherwise 0 for success
+ */
+int vm_install_virtio_mmio(vm_t *vm, virtio_emul_t *emul, uintptr_t addr, uint32_t device_id);
+
+/***
+ * @function fdt_generate_virtio_mmio_node(fdt, addr, irq, gic_phandle)
+ * Generate a "virtio,mmio" device node for a given fdt
+ * @param {void *} fdt              FDT blob to append generated device node
+ * @param {uintptr_t} addr          Guest physical address of the device's register window
+ * @param {int} irq                 Shared peripheral interrupt the device's backend injects
+ * @param {int} gic_phandle         Phandle of IRQ controller to generate a correct interrupt property
+ * @return                          0 for success, -1 for error
+ */
+int fdt_generate_virtio_mmio_node(void *fdt, uintptr_t addr, int irq, int gic_phandle);
@@ -49,4 +49,13 @@ vusb_device_t *vm_install_vusb(vm_t *vm, usb_host_t *hcd, uintptr_t pbase,
  */
 void vm_vusb_notify(vusb_device_t *vusb);
 
+/***
+ * @function vm_vusb_handle_hcd_irq(vusb)
+ * Handle an interrupt of the USB host controller used by a virtual usb device, in place of
+ * calling `usb_hcd_handle_irq` directly. Every URB completed by the interrupt is reported
+ * to the VM with a single virtual IRQ, rather than one per URB.
+ * @param {vusb_device_t *} vusb        A handle to a virtual usb device
+ */
+void vm_vusb_handle_hcd_irq(vusb_device_t *vusb);
+
 #endif /* CONFIG_LIB_USB */
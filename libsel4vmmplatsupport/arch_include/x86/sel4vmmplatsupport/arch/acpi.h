@@ -18,9 +18,59 @@
 #define ACPI_START (LOWER_BIOS_START) // Start of ACPI tables; RSD PTR is right here
 #define XSDT_START (ACPI_START + 0x1000)
 
-#define MAX_ACPI_TABLES (2)
+#define MAX_ACPI_TABLES (4)
 
 #include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_memory.h>
+
+/***
+ * @struct guest_numa_node
+ * A NUMA node of a guest VM, and the RAM local to it
+ * @param {uintptr_t} ram_start                     Guest physical address of the node's RAM
+ * @param {size_t} ram_size                         Size of the node's RAM in bytes
+ * @param {memory_map_iterator_fn} map_iterator     Iterator returning frames from the matching host node, NULL to
+ *                                                  allocate the RAM from untyped memory with vm_ram_register_at
+ * @param {void *} map_cookie                       Cookie to supply to the iterator
+ */
+typedef struct guest_numa_node {
+    uintptr_t ram_start;
+    size_t ram_size;
+    memory_map_iterator_fn map_iterator;
+    void *map_cookie;
+} guest_numa_node_t;
+
+/***
+ * @struct guest_numa_config
+ * The NUMA topology presented to a guest VM in its SRAT and SLIT tables
+ * @param {int} num_nodes                   Number of nodes
+ * @param {guest_numa_node_t *} nodes       Array of num_nodes nodes, indexed by proximity domain
+ * @param {int *} vcpu_nodes                Node of each vcpu, indexed by vcpu id. NULL to use the host memory node
+ *                                          local to each vcpu's target cpu, from `vm_vcpu_ram_node`
+ * @param {uint8_t *} distances             num_nodes * num_nodes matrix of relative distances between nodes, NULL
+ *                                          for 10 within a node and 20 between nodes
+ */
+typedef struct guest_numa_config {
+    int num_nodes;
+    guest_numa_node_t *nodes;
+    int *vcpu_nodes;
+    uint8_t *distances;
+} guest_numa_config_t;
+
+/***
+ * @struct guest_acpi_tables
+ * A copy of the ACPI tables built for a guest, kept by `make_guest_acpi_tables_cached` for giving to further guests
+ * with the same number of vcpus. Zero initialise before first use
+ * @param {int} num_vcpus                   Number of vcpus of the guests the tables describe
+ * @param {guest_numa_config_t *} numa      NUMA topology of the guests the tables describe
+ * @param {size_t} size                     Size of the tables in bytes, from ACPI_START
+ * @param {void *} data                     The tables, NULL if none have been built yet
+ */
+typedef struct guest_acpi_tables {
+    int num_vcpus;
+    guest_numa_config_t *numa;
+    size_t size;
+    void *data;
+} guest_acpi_tables_t;
 
 /***
  * @function make_guest_acpi_tables(vm)
@@ -29,3 +79,23 @@
  * @return                  0 for success, -1 for error
  */
 int make_guest_acpi_tables(vm_t *vm);
+
+/***
+ * @function make_guest_acpi_tables_cached(vm, cache)
+ * Creates ACPI table for the guest VM, copying tables previously built for a guest with the same number of vcpus
+ * rather than building them again. Otherwise the tables are built and kept in the cache
+ * @param {vm_t *} vm                       A handle to the guest VM instance
+ * @param {guest_acpi_tables_t *} cache     Tables shared between guests
+ * @return                                  0 for success, -1 for error
+ */
+int make_guest_acpi_tables_cached(vm_t *vm, guest_acpi_tables_t *cache);
+
+/***
+ * @function make_guest_numa_topology(vm, numa)
+ * Register the RAM of each NUMA node of the guest VM and describe the nodes in the SRAT and SLIT tables created by
+ * later calls to `make_guest_acpi_tables`. The configuration must remain valid while tables are being created
+ * @param {vm_t *} vm                       A handle to the guest VM instance
+ * @param {guest_numa_config_t *} numa      NUMA topology of the guest
+ * @return                                  0 for success, -1 for error
+ */
+int make_guest_numa_topology(vm_t *vm, guest_numa_config_t *numa);
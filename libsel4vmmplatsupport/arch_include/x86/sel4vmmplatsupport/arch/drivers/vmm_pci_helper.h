@@ -19,7 +19,8 @@
 /***
  * @function vmm_pci_helper_map_bars(vm, cfg, bars)
  * Given a PCI device config, map the PCI device bars into the VM, effectively passing-through the
- * PCI device. This will map MMIO and IO-based bars.
+ * PCI device. This will map MMIO and IO-based bars, IO-based bars being passed through to all vcpus of the VM such
+ * that guest accesses to them do not exit to the VMM.
  * @param {vm_t *} vm                       A handle to the VM
  * @param {libpci_device_iocfg_t *} cfg     PCI device config
  * @param {vmm_pci_bar_t *} bars            Resulting PCI bars mapped into the VM
@@ -27,6 +28,78 @@
  */
 int vmm_pci_helper_map_bars(vm_t *vm, libpci_device_iocfg_t *cfg, vmm_pci_bar_t *bars);
 
+/***
+ * @function vmm_pci_helper_inject_msi(vm, msi, vector)
+ * Signal a vector of an emulated MSI capability, delivering the message programmed by the guest to its
+ * local apics. This must be called whilst holding the VMM lock of a vcpu, i.e. from an exit or notification handler
+ * @param {vm_t *} vm                       A handle to the VM
+ * @param {pci_msi_emulation_t *} msi       A handle to the emulated MSI capability
+ * @param {unsigned int} vector             Vector to signal
+ * @return                                  0 on success, -1 if the vector is not enabled or the message is not delivered
+ */
+int vmm_pci_helper_inject_msi(vm_t *vm, pci_msi_emulation_t *msi, unsigned int vector);
+
+/***
+ * @struct pci_msix_host_vector
+ * Host interrupt backing a vector of a passthrough device's MSI-X table, being the message the host IRQ of the vector
+ * was allocated for (with seL4_IRQControl_GetMSI)
+ * @param {uint64_t} address        Message address, within the 0xfee00000 interrupt address range
+ * @param {uint32_t} data           Message data
+ */
+typedef struct pci_msix_host_vector {
+    uint64_t address;
+    uint32_t data;
+} pci_msix_host_vector_t;
+
+typedef struct pci_msix_passthrough pci_msix_passthrough_t;
+
+/***
+ * @function vmm_pci_helper_create_msix_passthrough(existing, host_vectors, num_vectors, msix)
+ * Construct a pci entry that exposes the MSI-X capability of a passthrough device to the guest, with its message
+ * control register emulated and its table size limited to the vectors given host interrupts. The MSI capability is
+ * hidden, as by `vmm_pci_no_msi_cap_emulation`, which the entry falls back to if the device has no MSI-X capability.
+ * The device's MSI-X table is emulated once its bars are mapped with `vmm_pci_helper_map_bars_msix`: the guest
+ * programs the messages it wants delivered, whilst the device's table is programmed with the host messages, each
+ * vector signalling its own host IRQ. The pending bit array is passed through
+ * @param {vmm_pci_entry_t} existing                    Existing PCI entry of the passthrough device to wrap over
+ * @param {const pci_msix_host_vector_t *} host_vectors Host messages of the vectors, copied
+ * @param {unsigned int} num_vectors                    Number of vectors given host interrupts
+ * @param {pci_msix_passthrough_t **} msix              Pointer to store the handle to the emulated MSI-X state, set
+ *                                                      to NULL if the device has no MSI-X capability
+ * @return                                              `vmm_pci_entry_t` with an emulated MSI-X capability
+ */
+vmm_pci_entry_t vmm_pci_helper_create_msix_passthrough(vmm_pci_entry_t existing,
+                                                       const pci_msix_host_vector_t *host_vectors,
+                                                       unsigned int num_vectors, pci_msix_passthrough_t **msix);
+
+/***
+ * @function vmm_pci_helper_map_bars_msix(vm, cfg, bars, msix)
+ * Map the bars of a passthrough PCI device into the VM as `vmm_pci_helper_map_bars` does, leaving the pages of the
+ * device's MSI-X table unmapped from the guest such that the table is emulated. The pages are mapped into the VMM
+ * instead, and the device's table is programmed with the host messages of its vectors. The bar holding the table is
+ * mapped with 4K frames
+ * @param {vm_t *} vm                               A handle to the VM
+ * @param {libpci_device_iocfg_t *} cfg             PCI device config
+ * @param {vmm_pci_bar_t *} bars                    Resulting PCI bars mapped into the VM
+ * @param {pci_msix_passthrough_t *} msix           A handle to the emulated MSI-X state of the device
+ * @return                                          -1 for error, otherwise the number of bars mapped into the VM (>=0)
+ */
+int vmm_pci_helper_map_bars_msix(vm_t *vm, libpci_device_iocfg_t *cfg, vmm_pci_bar_t *bars,
+                                  pci_msix_passthrough_t *msix);
+
+/***
+ * @function vmm_pci_helper_inject_msix(vm, msix, vector)
+ * Signal a vector of a passthrough device's MSI-X table, to be called when the host IRQ of the vector fires. The
+ * message programmed by the guest is delivered to its local apics, or held pending while the guest has the vector
+ * masked and delivered once it unmasks it. This must be called whilst holding the VMM lock of a vcpu, i.e. from an
+ * exit or notification handler
+ * @param {vm_t *} vm                               A handle to the VM
+ * @param {pci_msix_passthrough_t *} msix           A handle to the emulated MSI-X state of the device
+ * @param {unsigned int} vector                     Vector to signal
+ * @return                                          0 on success, -1 if MSI-X is disabled or the message is not delivered
+ */
+int vmm_pci_helper_inject_msix(vm_t *vm, pci_msix_passthrough_t *msix, unsigned int vector);
+
 /* Functions for emulating PCI config spaces over IO ports */
 /***
  * @function vmm_pci_io_port_in(vcpu, cookie, port_no, size, result)
@@ -12,12 +12,31 @@
  * instance.
  */
 
+#include <stdbool.h>
+#include <stdint.h>
+
 #include <sel4vm/guest_vm.h>
 #include <sel4vmmplatsupport/device.h>
 
+typedef struct vm_shadow_device vm_shadow_device_t;
+
+/***
+ * @function vm_shadow_device_write_fn(vm, vcpu, offset, value, cookie)
+ * Emulate a guest write to a register of a shadow device
+ * @param {vm_t *} vm                       A handle to the VM
+ * @param {vm_vcpu_t *} vcpu                The vcpu that wrote to the register
+ * @param {uintptr_t} offset                Offset of the 32-bit register from the start of the device
+ * @param {uint32_t *} value                The register with the write applied, stored in the shadow on return
+ * @param {void *} cookie                   Cookie the device was installed with
+ * @return                                  0 on success, -1 to fail the guest's access
+ */
+typedef int (*vm_shadow_device_write_fn)(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t offset, uint32_t *value,
+                                         void *cookie);
+
 /***
  * @function vm_install_passthrough_device(vm, device)
- * Install a passthrough device into a VM
+ * Install a passthrough device into a VM. The device is mapped with a single reservation, with large frames where
+ * CONFIG_LIB_SEL4VM_LARGE_FRAMES is set and the physical address of the device is aligned for them
  * @param {vm_t *} vm                       A handle to the VM that the device should be install to
  * @param {const struct device *} device    A description of the device
  * @return                                  0 on success, -1 for error
@@ -41,3 +60,29 @@ int vm_install_ram_only_device(vm_t *vm, const struct device *device);
  * @return                                  0 on success, -1 for error
  */
 int vm_install_listening_device(vm_t *vm, const struct device *device);
+
+/***
+ * @function vm_install_shadow_device(vm, device, copy_hw, write, cookie)
+ * Install a device whose registers are kept in shadow pages maintained by the VMM, which are mapped read only into the
+ * guest. Reads of the device are served from the shadow without a fault, whereas writes fault, are emulated by 'write'
+ * and the result stored in the shadow. Suited to devices whose registers the guest mostly reads and which do not change
+ * behind the VMM's back, such as clock, power and system register controllers. The device must be aligned to the page
+ * size
+ * @param {vm_t *} vm                       A handle to the VM that the device should be installed to
+ * @param {const struct device *} device    A description of the device
+ * @param {bool} copy_hw                    Initialise the shadow from the physical device rather than with zeros
+ * @param {vm_shadow_device_write_fn} write Called on each write to the device, NULL to only store it in the shadow
+ * @param {void *} cookie                   Cookie passed to 'write'
+ * @return                                  A handle to the device, NULL on error
+ */
+vm_shadow_device_t *vm_install_shadow_device(vm_t *vm, const struct device *device, bool copy_hw,
+                                             vm_shadow_device_write_fn write, void *cookie);
+
+/***
+ * @function vm_shadow_device_reg(sdev, offset)
+ * Get a register of a shadow device, for the VMM to update what the guest reads
+ * @param {vm_shadow_device_t *} sdev       A handle to the device
+ * @param {uintptr_t} offset                Offset of the 32-bit register from the start of the device
+ * @return                                  Pointer to the register in the shadow
+ */
+volatile uint32_t *vm_shadow_device_reg(vm_shadow_device_t *sdev, uintptr_t offset);
@@ -0,0 +1,462 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+/***
+ * @module cross_vm_broadcast.h
+ * A single-producer, many-subscriber lock-free ring of fixed size slots, for broadcasting a stream to many VMs with a
+ * single copy. The ring is laid out in the producer's dataport, which is mapped read only into every subscriber, and
+ * each subscriber keeps its read index in a small region of shared memory of its own, which the producer reads. By
+ * default the producer never waits on subscribers: a subscriber falling more than a ring behind loses the oldest slots,
+ * which it detects and counts. A producer can instead keep to the pace of its slowest subscriber by only producing into
+ * `crossvm_bcast_free` slots. Commits report the subscribers waiting on them as a mask, so the producer signals them
+ * all in one pass. As with `cross_vm_ring.h` the interface only depends on the compiler's atomic builtins, so both
+ * sides can include it, and nothing read from memory written by the other side is trusted.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define CROSSVM_BCAST_MAGIC 0x5342564d
+#define CROSSVM_BCAST_CACHE_LINE 64
+#define CROSSVM_BCAST_MAX_SUBSCRIBERS 32
+
+/* Layout of the ring at the start of the producer's dataport. The slots follow the header */
+struct crossvm_bcast_shared {
+    /* fixed once the ring is initialised */
+    struct {
+        uint32_t magic;
+        uint32_t num_slots;
+        uint32_t slot_size;
+    } __attribute__((aligned(CROSSVM_BCAST_CACHE_LINE))) config;
+    /* written by the producer */
+    struct {
+        uint32_t head;
+        /* the producer is waiting for the slowest subscriber to make space */
+        uint32_t waiting;
+        /* number of times the producer has waited */
+        uint32_t wait_seq;
+    } __attribute__((aligned(CROSSVM_BCAST_CACHE_LINE))) producer;
+} __attribute__((aligned(CROSSVM_BCAST_CACHE_LINE)));
+
+/* State of a subscriber, in memory written by the subscriber and read by the producer */
+struct crossvm_bcast_subscriber_shared {
+    uint32_t tail;
+    /* the subscriber is waiting for the producer to add slots */
+    uint32_t waiting;
+    /* number of times the subscriber has waited */
+    uint32_t wait_seq;
+} __attribute__((aligned(CROSSVM_BCAST_CACHE_LINE)));
+
+/***
+ * @struct crossvm_bcast_stats
+ * Counters of a side of a broadcast ring
+ * @param {uint64_t} slots              Number of slots produced or consumed
+ * @param {uint64_t} batches            Number of batches the slots were committed in
+ * @param {uint64_t} notifications      Number of notifications owed to peers after commits
+ * @param {uint64_t} waits              Number of times the side was prepared to wait
+ * @param {uint64_t} dropped            Subscriber: number of slots overwritten before they were read
+ */
+typedef struct crossvm_bcast_stats {
+    uint64_t slots;
+    uint64_t batches;
+    uint64_t notifications;
+    uint64_t waits;
+    uint64_t dropped;
+} crossvm_bcast_stats_t;
+
+/***
+ * @struct crossvm_bcast_producer
+ * Handle to the producer side of a broadcast ring, private to the producer
+ * @param {struct crossvm_bcast_shared *} shared                    The ring in the producer's dataport
+ * @param {uint8_t *} slots                                         The slots of the ring
+ * @param {uint32_t} num_slots                                      Number of slots, a power of 2
+ * @param {uint32_t} slot_size                                      Size of each slot in bytes
+ * @param {uint32_t} head                                           Local copy of the head
+ * @param {uint32_t} wait_seq                                       Number of times the producer has waited
+ * @param {uint32_t} num_subscribers                                Number of subscribers added
+ * @param {struct crossvm_bcast_subscriber_shared *} subscribers    State of each subscriber, in its shared memory
+ * @param {uint32_t} notified_seq                                   Wait of each subscriber last notified
+ * @param {crossvm_bcast_stats_t} stats                             Counters of the producer
+ */
+typedef struct crossvm_bcast_producer {
+    struct crossvm_bcast_shared *shared;
+    uint8_t *slots;
+    uint32_t num_slots;
+    uint32_t slot_size;
+    uint32_t head;
+    uint32_t wait_seq;
+    uint32_t num_subscribers;
+    struct crossvm_bcast_subscriber_shared *subscribers[CROSSVM_BCAST_MAX_SUBSCRIBERS];
+    uint32_t notified_seq[CROSSVM_BCAST_MAX_SUBSCRIBERS];
+    crossvm_bcast_stats_t stats;
+} crossvm_bcast_producer_t;
+
+/***
+ * @struct crossvm_bcast_subscriber
+ * Handle to a subscriber of a broadcast ring, private to the subscriber
+ * @param {const struct crossvm_bcast_shared *} shared              The ring, mapped read only
+ * @param {const uint8_t *} slots                                   The slots of the ring
+ * @param {struct crossvm_bcast_subscriber_shared *} state          State of the subscriber read by the producer
+ * @param {uint32_t} num_slots                                      Number of slots, a power of 2
+ * @param {uint32_t} slot_size                                      Size of each slot in bytes
+ * @param {uint32_t} tail                                           Local copy of the subscriber's read index
+ * @param {uint32_t} head                                           Last head read from the producer
+ * @param {uint32_t} wait_seq                                       Number of times the subscriber has waited
+ * @param {uint32_t} notified_seq                                   Wait of the producer last notified
+ * @param {crossvm_bcast_stats_t} stats                             Counters of the subscriber
+ */
+typedef struct crossvm_bcast_subscriber {
+    const struct crossvm_bcast_shared *shared;
+    const uint8_t *slots;
+    struct crossvm_bcast_subscriber_shared *state;
+    uint32_t num_slots;
+    uint32_t slot_size;
+    uint32_t tail;
+    uint32_t head;
+    uint32_t wait_seq;
+    uint32_t notified_seq;
+    crossvm_bcast_stats_t stats;
+} crossvm_bcast_subscriber_t;
+
+static inline size_t crossvm_bcast_slots_offset(void)
+{
+    return sizeof(struct crossvm_bcast_shared);
+}
+
+/***
+ * @function crossvm_bcast_init(producer, mem, mem_size, slot_size)
+ * Producer: lay out a new broadcast ring in the producer's dataport, taking up as many slots as fit in it
+ * @param {crossvm_bcast_producer_t *} producer     Handle to initialise
+ * @param {void *} mem                              The producer's dataport, aligned to a cache line
+ * @param {size_t} mem_size                         Size of the dataport in bytes
+ * @param {uint32_t} slot_size                      Size of each slot in bytes, a multiple of 8
+ * @return                                          0 on success, -1 on error
+ */
+static inline int crossvm_bcast_init(crossvm_bcast_producer_t *producer, void *mem, size_t mem_size,
+                                     uint32_t slot_size)
+{
+    if (mem_size <= crossvm_bcast_slots_offset() || slot_size == 0 || slot_size % 8) {
+        return -1;
+    }
+    size_t max_slots = (mem_size - crossvm_bcast_slots_offset()) / slot_size;
+    if (max_slots == 0) {
+        return -1;
+    }
+    uint32_t num_slots = 1;
+    while ((size_t)num_slots * 2 <= max_slots && num_slots < (1u << 30)) {
+        num_slots *= 2;
+    }
+    memset(producer, 0, sizeof(*producer));
+    producer->shared = (struct crossvm_bcast_shared *)mem;
+    producer->slots = (uint8_t *)mem + crossvm_bcast_slots_offset();
+    producer->num_slots = num_slots;
+    producer->slot_size = slot_size;
+    memset(producer->shared, 0, sizeof(*producer->shared));
+    producer->shared->config.num_slots = num_slots;
+    producer->shared->config.slot_size = slot_size;
+    /* the magic tells subscribers the ring is ready */
+    __atomic_store_n(&producer->shared->config.magic, CROSSVM_BCAST_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/***
+ * @function crossvm_bcast_add_subscriber(producer, state)
+ * Producer: add a subscriber, whose state the subscriber initialises when it attaches with `crossvm_bcast_attach`
+ * @param {crossvm_bcast_producer_t *} producer                     Producer handle of the ring
+ * @param {struct crossvm_bcast_subscriber_shared *} state          State of the subscriber, in memory shared with it
+ * @return                                                          Index of the subscriber, bit of it in notification masks, -1 on error
+ */
+static inline int crossvm_bcast_add_subscriber(crossvm_bcast_producer_t *producer,
+                                               struct crossvm_bcast_subscriber_shared *state)
+{
+    if (producer->num_subscribers == CROSSVM_BCAST_MAX_SUBSCRIBERS || state == NULL) {
+        return -1;
+    }
+    int idx = producer->num_subscribers++;
+    producer->subscribers[idx] = state;
+    producer->notified_seq[idx] = __atomic_load_n(&state->wait_seq, __ATOMIC_RELAXED);
+    return idx;
+}
+
+/***
+ * @function crossvm_bcast_free(producer)
+ * Producer: the number of slots that can be produced without overwriting any slot a subscriber has yet to read. A
+ * subscriber whose read index is invalid is treated as a whole ring behind, so a producer keeping to this pace trusts
+ * its subscribers to keep up
+ * @param {crossvm_bcast_producer_t *} producer     Producer handle of the ring
+ * @return                                          Number of free slots
+ */
+static inline uint32_t crossvm_bcast_free(crossvm_bcast_producer_t *producer)
+{
+    uint32_t behind = 0;
+    for (uint32_t i = 0; i < producer->num_subscribers; i++) {
+        uint32_t tail = __atomic_load_n(&producer->subscribers[i]->tail, __ATOMIC_ACQUIRE);
+        uint32_t lag = producer->head - tail;
+        if (lag > producer->num_slots) {
+            lag = producer->num_slots;
+        }
+        if (lag > behind) {
+            behind = lag;
+        }
+    }
+    return producer->num_slots - behind;
+}
+
+/***
+ * @function crossvm_bcast_produce_slot(producer, n)
+ * Producer: the n'th next slot, to be filled in before being committed with `crossvm_bcast_produce_commit`
+ * @param {crossvm_bcast_producer_t *} producer     Producer handle of the ring
+ * @param {uint32_t} n                              Slot to return, less than the number of slots
+ * @return                                          Pointer to the slot
+ */
+static inline void *crossvm_bcast_produce_slot(crossvm_bcast_producer_t *producer, uint32_t n)
+{
+    return producer->slots + (size_t)((producer->head + n) & (producer->num_slots - 1)) * producer->slot_size;
+}
+
+/***
+ * @function crossvm_bcast_produce_commit(producer, n)
+ * Producer: publish the next 'n' slots to every subscriber
+ * @param {crossvm_bcast_producer_t *} producer     Producer handle of the ring
+ * @param {uint32_t} n                              Number of slots to commit, at most the number of slots
+ * @return                                          Mask of the subscribers waiting, that have to be notified
+ */
+static inline uint32_t crossvm_bcast_produce_commit(crossvm_bcast_producer_t *producer, uint32_t n)
+{
+    uint32_t notify = 0;
+    if (n == 0) {
+        return 0;
+    }
+    producer->head += n;
+    __atomic_store_n(&producer->shared->producer.head, producer->head, __ATOMIC_RELEASE);
+    producer->stats.slots += n;
+    producer->stats.batches++;
+    /* order the head update before reading the subscribers' flags, pairing with
+     * their order of setting the flag before reading the head */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (uint32_t i = 0; i < producer->num_subscribers; i++) {
+        struct crossvm_bcast_subscriber_shared *state = producer->subscribers[i];
+        if (!__atomic_load_n(&state->waiting, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+        uint32_t seq = __atomic_load_n(&state->wait_seq, __ATOMIC_RELAXED);
+        if (seq != producer->notified_seq[i]) {
+            producer->notified_seq[i] = seq;
+            producer->stats.notifications++;
+            notify |= 1u << i;
+        }
+    }
+    return notify;
+}
+
+/***
+ * @function crossvm_bcast_write(producer, msgs, n, paced, notify)
+ * Producer: copy messages into the ring, committing them as a single batch
+ * @param {crossvm_bcast_producer_t *} producer     Producer handle of the ring
+ * @param {const void *} msgs                       Array of messages of the ring's slot size
+ * @param {uint32_t} n                              Number of messages
+ * @param {bool} paced                              Whether to only write into `crossvm_bcast_free` slots, rather than overwrite unread slots
+ * @param {uint32_t *} notify                       Set to the mask of subscribers that have to be notified
+ * @return                                          Number of messages written
+ */
+static inline uint32_t crossvm_bcast_write(crossvm_bcast_producer_t *producer, const void *msgs, uint32_t n,
+                                           bool paced, uint32_t *notify)
+{
+    uint32_t max = paced ? crossvm_bcast_free(producer) : producer->num_slots;
+    if (n > max) {
+        n = max;
+    }
+    /* copy in at most two runs either side of the end of the ring */
+    uint32_t start = producer->head & (producer->num_slots - 1);
+    uint32_t first = n < producer->num_slots - start ? n : producer->num_slots - start;
+    memcpy(crossvm_bcast_produce_slot(producer, 0), msgs, (size_t)first * producer->slot_size);
+    memcpy(producer->slots, (const uint8_t *)msgs + (size_t)first * producer->slot_size,
+           (size_t)(n - first) * producer->slot_size);
+    *notify = crossvm_bcast_produce_commit(producer, n);
+    return n;
+}
+
+/***
+ * @function crossvm_bcast_attach(sub, mem, mem_size, state)
+ * Subscriber: attach to a ring initialised by the producer, starting from the slots produced from now on
+ * @param {crossvm_bcast_subscriber_t *} sub                        Handle to initialise
+ * @param {const void *} mem                                        The producer's dataport, mapped read only
+ * @param {size_t} mem_size                                         Size of the dataport in bytes
+ * @param {struct crossvm_bcast_subscriber_shared *} state          State of the subscriber, in memory shared with the producer
+ * @return                                                          0 on success, -1 if the ring is not initialised or is invalid
+ */
+static inline int crossvm_bcast_attach(crossvm_bcast_subscriber_t *sub, const void *mem, size_t mem_size,
+                                       struct crossvm_bcast_subscriber_shared *state)
+{
+    const struct crossvm_bcast_shared *shared = (const struct crossvm_bcast_shared *)mem;
+    if (mem_size <= crossvm_bcast_slots_offset() ||
+        __atomic_load_n(&shared->config.magic, __ATOMIC_ACQUIRE) != CROSSVM_BCAST_MAGIC) {
+        return -1;
+    }
+    uint32_t num_slots = shared->config.num_slots;
+    uint32_t slot_size = shared->config.slot_size;
+    if (num_slots == 0 || (num_slots & (num_slots - 1)) || slot_size == 0 || slot_size % 8 ||
+        (uint64_t)num_slots * slot_size > mem_size - crossvm_bcast_slots_offset()) {
+        return -1;
+    }
+    memset(sub, 0, sizeof(*sub));
+    sub->shared = shared;
+    sub->slots = (const uint8_t *)mem + crossvm_bcast_slots_offset();
+    sub->state = state;
+    sub->num_slots = num_slots;
+    sub->slot_size = slot_size;
+    sub->head = __atomic_load_n(&shared->producer.head, __ATOMIC_ACQUIRE);
+    sub->tail = sub->head;
+    sub->wait_seq = state->wait_seq;
+    sub->notified_seq = __atomic_load_n(&shared->producer.wait_seq, __ATOMIC_RELAXED);
+    state->waiting = 0;
+    __atomic_store_n(&state->tail, sub->tail, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Catch up with the producer's head, skipping any slots the producer has overwritten */
+static inline void crossvm_bcast_update_head(crossvm_bcast_subscriber_t *sub)
+{
+    uint32_t head = __atomic_load_n(&sub->shared->producer.head, __ATOMIC_ACQUIRE);
+    /* the head only moves forward, anything else is treated as the producer not having moved */
+    if ((int32_t)(head - sub->head) > 0) {
+        sub->head = head;
+    }
+    if (sub->head - sub->tail > sub->num_slots) {
+        uint32_t oldest = sub->head - sub->num_slots;
+        sub->stats.dropped += oldest - sub->tail;
+        sub->tail = oldest;
+    }
+}
+
+/***
+ * @function crossvm_bcast_available(sub)
+ * Subscriber: the number of slots produced and not yet read
+ * @param {crossvm_bcast_subscriber_t *} sub        Subscriber handle of the ring
+ * @return                                          Number of available slots
+ */
+static inline uint32_t crossvm_bcast_available(crossvm_bcast_subscriber_t *sub)
+{
+    crossvm_bcast_update_head(sub);
+    return sub->head - sub->tail;
+}
+
+/***
+ * @function crossvm_bcast_read(sub, msgs, n, notify)
+ * Subscriber: copy out up to 'n' available slots, releasing them as a single batch. Slots the producer overwrites
+ * whilst they are copied are dropped, so only intact messages are returned
+ * @param {crossvm_bcast_subscriber_t *} sub        Subscriber handle of the ring
+ * @param {void *} msgs                             Array of messages of the ring's slot size
+ * @param {uint32_t} n                              Maximum number of messages
+ * @param {bool *} notify                           Set to whether the producer is waiting for space and has to be notified
+ * @return                                          Number of messages read
+ */
+static inline uint32_t crossvm_bcast_read(crossvm_bcast_subscriber_t *sub, void *msgs, uint32_t n, bool *notify)
+{
+    uint32_t available = crossvm_bcast_available(sub);
+    if (n > available) {
+        n = available;
+    }
+    uint32_t from = sub->tail;
+    uint32_t start = from & (sub->num_slots - 1);
+    uint32_t first = n < sub->num_slots - start ? n : sub->num_slots - start;
+    memcpy(msgs, sub->slots + (size_t)start * sub->slot_size, (size_t)first * sub->slot_size);
+    memcpy((uint8_t *)msgs + (size_t)first * sub->slot_size, sub->slots, (size_t)(n - first) * sub->slot_size);
+
+    /* slots older than a ring behind the head after the copy may have been overwritten during it */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    sub->tail = from + n;
+    crossvm_bcast_update_head(sub);
+    uint32_t oldest = sub->head - sub->num_slots;
+    if ((int32_t)(oldest - from) > 0) {
+        uint32_t lost = oldest - from < n ? oldest - from : n;
+        memmove(msgs, (uint8_t *)msgs + (size_t)lost * sub->slot_size, (size_t)(n - lost) * sub->slot_size);
+        sub->stats.dropped += lost;
+        n -= lost;
+    }
+
+    __atomic_store_n(&sub->state->tail, sub->tail, __ATOMIC_RELEASE);
+    *notify = false;
+    if (n) {
+        sub->stats.slots += n;
+        sub->stats.batches++;
+    }
+    /* order the tail update before reading the producer's flag */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&sub->shared->producer.waiting, __ATOMIC_ACQUIRE)) {
+        uint32_t seq = __atomic_load_n(&sub->shared->producer.wait_seq, __ATOMIC_RELAXED);
+        if (seq != sub->notified_seq) {
+            sub->notified_seq = seq;
+            sub->stats.notifications++;
+            *notify = true;
+        }
+    }
+    return n;
+}
+
+/***
+ * @function crossvm_bcast_subscriber_prepare_wait(sub)
+ * Subscriber: announce that it is about to wait for the producer, so the producer notifies it on its next commit.
+ * Returns false if there are already slots to read, in which case the subscriber carries on rather than waits
+ * @param {crossvm_bcast_subscriber_t *} sub        Subscriber handle of the ring
+ * @return                                          Whether the subscriber can wait for a notification
+ */
+static inline bool crossvm_bcast_subscriber_prepare_wait(crossvm_bcast_subscriber_t *sub)
+{
+    __atomic_store_n(&sub->state->wait_seq, ++sub->wait_seq, __ATOMIC_RELAXED);
+    __atomic_store_n(&sub->state->waiting, 1, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (crossvm_bcast_available(sub)) {
+        __atomic_store_n(&sub->state->waiting, 0, __ATOMIC_RELAXED);
+        return false;
+    }
+    sub->stats.waits++;
+    return true;
+}
+
+/***
+ * @function crossvm_bcast_subscriber_finish_wait(sub)
+ * Subscriber: announce that it is active again, after waking from a wait
+ * @param {crossvm_bcast_subscriber_t *} sub        Subscriber handle of the ring
+ */
+static inline void crossvm_bcast_subscriber_finish_wait(crossvm_bcast_subscriber_t *sub)
+{
+    __atomic_store_n(&sub->state->waiting, 0, __ATOMIC_RELAXED);
+}
+
+/***
+ * @function crossvm_bcast_producer_prepare_wait(producer)
+ * Producer: announce that it is about to wait for its slowest subscriber, when keeping to the subscribers' pace.
+ * Returns false if there already are free slots
+ * @param {crossvm_bcast_producer_t *} producer     Producer handle of the ring
+ * @return                                          Whether the producer can wait for a notification
+ */
+static inline bool crossvm_bcast_producer_prepare_wait(crossvm_bcast_producer_t *producer)
+{
+    __atomic_store_n(&producer->shared->producer.wait_seq, ++producer->wait_seq, __ATOMIC_RELAXED);
+    __atomic_store_n(&producer->shared->producer.waiting, 1, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (crossvm_bcast_free(producer)) {
+        __atomic_store_n(&producer->shared->producer.waiting, 0, __ATOMIC_RELAXED);
+        return false;
+    }
+    producer->stats.waits++;
+    return true;
+}
+
+/***
+ * @function crossvm_bcast_producer_finish_wait(producer)
+ * Producer: announce that it is active again, after waking from a wait
+ * @param {crossvm_bcast_producer_t *} producer     Producer handle of the ring
+ */
+static inline void crossvm_bcast_producer_finish_wait(crossvm_bcast_producer_t *producer)
+{
+    __atomic_store_n(&producer->shared->producer.waiting, 0, __ATOMIC_RELAXED);
+}
@@ -10,7 +10,8 @@
  * @module cross_vm_connection.h
  * The crossvm connection module facilitates the creation of communication channels between VM's and other
  * components on a seL4-based system. The module exports registered cross vm connections to a Linux VM such that
- * processes can access them from userlevel. This being facilitated over a virtual PCI device.
+ * processes can access them from userlevel. This being facilitated over a virtual PCI device. A standard protocol for
+ * passing messages over the dataport of a connection is provided by `cross_vm_ring.h`.
  */
 
 #include <sel4vm/guest_vm.h>
@@ -19,6 +20,15 @@
 #include <sel4vmmplatsupport/drivers/pci_helper.h>
 #include <pci/helper.h>
 
+/* Token of the x86 vmcall emitting on connections, with the mask of connections in EBX */
+#define CROSSVM_FAST_EMIT_VMCALL_TOKEN 0x43564d45
+/* Function id of the ARM SMC emitting on connections, with the mask of connections in the first argument
+ * register. A fast, 32 bit, vendor specific hypervisor service call */
+#define CROSSVM_FAST_EMIT_SMC_FUNC_ID 0x86000100
+/* Set in the fast emit register of a connection's event bar once fast emits are enabled, alongside the
+ * connection's bit number in the mask */
+#define CROSSVM_FAST_EMIT_ENABLED BIT(31)
+
 typedef void (*event_callback_fn)(void *arg);
 typedef void (*emit_fn)(void);
 typedef int (*consume_callback_fn)(event_callback_fn, void *arg);
@@ -27,14 +37,17 @@ typedef int (*alloc_free_interrupt_fn)(void);
 /***
  * @struct crossvm_dataport_handle
  * Datastructure representing a dataport of a crossvm connection
- * @param {size_t} size         The size of the crossvm dataport
- * @param {int} num_frames      Total number of frames in the `frames` member
- * @param {seL4_CPtr *} frames  The set of frames backing the dataport
+ * @param {size_t} size                 The size of the crossvm dataport
+ * @param {int} num_frames              Total number of frames in the `frames` member
+ * @param {seL4_CPtr *} frames          The set of frames backing the dataport
+ * @param {size_t} frame_size_bits      Size bits of each of the frames, such as those of large pages, or 0 for
+ *                                      seL4_PageBits. The dataport's guest address has to be aligned to the frame size
  */
 typedef struct crossvm_dataport_handle {
     size_t size;
     unsigned int num_frames;
     seL4_CPtr *frames;
+    size_t frame_size_bits;
 } crossvm_dataport_handle_t;
 
 /***
@@ -57,7 +70,8 @@ typedef struct crossvm_handle {
  * Install a set of cross vm connections into a guest VM (for either x86 or ARM VM platforms)
  * @param {vm_t *} vm                           A handle to the VM
  * @param {uintptr_t} connection_base_addr      The base guest physical address that can be used to reserve memory
- *                                              for the crossvm connectors
+ *                                              for the crossvm connectors. Dataports backed by large frames need it
+ *                                              aligned to their size
  * @param {crossvm_handle_t *} connections      The set of crossvm connections to be initialised and installed in the guest
  * @param {int} num_connection                  The number of connections passed in through the 'connections' parameter
  * @param {vmm_pci_space_t *} pci               A handle to the VM's host PCI device. The connections are advertised through the
@@ -68,12 +82,27 @@ typedef struct crossvm_handle {
 int cross_vm_connections_init_common(vm_t *vm, uintptr_t connection_base_addr, crossvm_handle_t *connections,
                                      int num_connections, vmm_pci_space_t *pci, alloc_free_interrupt_fn alloc_irq);
 
+/***
+ * @function cross_vm_connections_init_fast_emit(vm)
+ * Let the guest emit on cross vm connections with a hypercall rather than a write to the event bar, avoiding the
+ * decoding of a memory fault. The guest issues a vmcall with CROSSVM_FAST_EMIT_VMCALL_TOKEN on x86, or an SMC with
+ * CROSSVM_FAST_EMIT_SMC_FUNC_ID on ARM, passing a mask of the connections to emit on. This batches emits on several
+ * connections into a single exit. The hypercall returns 0, or -1 if the mask included a connection unable to emit.
+ * The bit of each connection is found in the fast emit register at offset 0x40 of its event bar, alongside
+ * CROSSVM_FAST_EMIT_ENABLED. To be called after `cross_vm_connections_init_common`
+ * @param {vm_t *} vm                   A handle to the VM
+ * @return                              -1 on failure otherwise 0 for success
+ */
+int cross_vm_connections_init_fast_emit(vm_t *vm);
+
 /***
  * @function consume_connection_event(vm, event_id, inject_irq)
  * Handler to consume a cross vm connection event. This being called by the VMM when it recieves a notification from an
- * external process. The event is then relayed onto the VM.
+ * external process. The event is then relayed onto the VM. Connections whose `consume_id` is a single badge bit
+ * are found directly from the bits of `event_id`, so a notification combining the badges of several connections
+ * consumes an event on each of them, interrupting the VM once.
  * @param {vm_t *} vm                   A handle to the VM
- * @param {seL4_Word} event_id          The id that corresponds to the occuring event
+ * @param {seL4_Word} event_id          The id that corresponds to the occuring event, or the badge of a notification
  * @param {bool} inject_irq             Whether to inject an interrupt into the VM
  */
 void consume_connection_event(vm_t *vm, seL4_Word event_id, bool inject_irq);
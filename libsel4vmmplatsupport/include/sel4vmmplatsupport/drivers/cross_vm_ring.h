@@ -0,0 +1,390 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+/***
+ * @module cross_vm_ring.h
+ * A single-producer, single-consumer lock-free ring of fixed size slots, laid out in the dataport of a crossvm
+ * connection. The interface is self contained, depending on nothing but the compiler's atomic builtins, so that
+ * both the VMM and the guest on the other end of the dataport can include it. The producer and consumer indices
+ * are kept in cache lines of their own. Slots are produced and consumed in batches, publishing a batch with a single
+ * index update, and a side only needs to notify its peer when the peer has said it is about to wait. As the memory
+ * is shared with the peer, nothing read from it is trusted: a peer corrupting the indices only ever sees an empty
+ * or full ring.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define CROSSVM_RING_MAGIC 0x52564d43
+#define CROSSVM_RING_CACHE_LINE 64
+
+/* Layout of the ring at the start of the dataport. The slots follow the header */
+struct crossvm_ring_shared {
+    /* fixed once the ring is initialised */
+    struct {
+        uint32_t magic;
+        uint32_t num_slots;
+        uint32_t slot_size;
+    } __attribute__((aligned(CROSSVM_RING_CACHE_LINE))) config;
+    /* written by the producer */
+    struct {
+        uint32_t head;
+        /* the producer is waiting for the consumer to make space */
+        uint32_t waiting;
+        /* number of times the producer has waited */
+        uint32_t wait_seq;
+    } __attribute__((aligned(CROSSVM_RING_CACHE_LINE))) producer;
+    /* written by the consumer */
+    struct {
+        uint32_t tail;
+        /* the consumer is waiting for the producer to add slots */
+        uint32_t waiting;
+        /* number of times the consumer has waited */
+        uint32_t wait_seq;
+    } __attribute__((aligned(CROSSVM_RING_CACHE_LINE))) consumer;
+} __attribute__((aligned(CROSSVM_RING_CACHE_LINE)));
+
+/***
+ * @struct crossvm_ring_stats
+ * Counters of a side of a ring, for measuring the throughput and batching of a connection
+ * @param {uint64_t} slots              Number of slots produced or consumed
+ * @param {uint64_t} batches            Number of batches the slots were committed in
+ * @param {uint64_t} notifications      Number of commits after which the peer had to be notified
+ * @param {uint64_t} waits              Number of times the side was prepared to wait on its peer
+ */
+typedef struct crossvm_ring_stats {
+    uint64_t slots;
+    uint64_t batches;
+    uint64_t notifications;
+    uint64_t waits;
+} crossvm_ring_stats_t;
+
+/***
+ * @struct crossvm_ring
+ * Handle to one side of a ring, private to that side
+ * @param {struct crossvm_ring_shared *} shared     The ring in shared memory
+ * @param {uint8_t *} slots                         The slots of the ring in shared memory
+ * @param {uint32_t} num_slots                      Number of slots, a power of 2
+ * @param {uint32_t} slot_size                      Size of each slot in bytes
+ * @param {uint32_t} index                          Local copy of the index this side writes
+ * @param {uint32_t} peer_index                     Last index read from the peer
+ * @param {uint32_t} wait_seq                       Number of times this side has waited
+ * @param {uint32_t} notified_seq                   Wait of the peer last notified, so each wait is notified once
+ * @param {crossvm_ring_stats_t} stats              Counters of this side
+ */
+typedef struct crossvm_ring {
+    struct crossvm_ring_shared *shared;
+    uint8_t *slots;
+    uint32_t num_slots;
+    uint32_t slot_size;
+    uint32_t index;
+    uint32_t peer_index;
+    uint32_t wait_seq;
+    uint32_t notified_seq;
+    crossvm_ring_stats_t stats;
+} crossvm_ring_t;
+
+static inline size_t crossvm_ring_slots_offset(void)
+{
+    return sizeof(struct crossvm_ring_shared);
+}
+
+static inline void crossvm_ring_setup(crossvm_ring_t *ring, void *mem, uint32_t num_slots, uint32_t slot_size)
+{
+    memset(ring, 0, sizeof(*ring));
+    ring->shared = (struct crossvm_ring_shared *)mem;
+    ring->slots = (uint8_t *)mem + crossvm_ring_slots_offset();
+    ring->num_slots = num_slots;
+    ring->slot_size = slot_size;
+}
+
+/***
+ * @function crossvm_ring_init(ring, mem, mem_size, slot_size)
+ * Lay out a new ring in shared memory, taking up as many slots as fit in it. Done by one side only, before the
+ * other attaches
+ * @param {crossvm_ring_t *} ring       Handle to initialise
+ * @param {void *} mem                  Shared memory, aligned to a cache line
+ * @param {size_t} mem_size             Size of the shared memory in bytes
+ * @param {uint32_t} slot_size          Size of each slot in bytes, a multiple of 8
+ * @return                              0 on success, -1 on error
+ */
+static inline int crossvm_ring_init(crossvm_ring_t *ring, void *mem, size_t mem_size, uint32_t slot_size)
+{
+    if (mem_size <= crossvm_ring_slots_offset() || slot_size == 0 || slot_size % 8) {
+        return -1;
+    }
+    size_t max_slots = (mem_size - crossvm_ring_slots_offset()) / slot_size;
+    if (max_slots == 0) {
+        return -1;
+    }
+    uint32_t num_slots = 1;
+    while ((size_t)num_slots * 2 <= max_slots && num_slots < (1u << 31)) {
+        num_slots *= 2;
+    }
+    struct crossvm_ring_shared *shared = (struct crossvm_ring_shared *)mem;
+    memset(shared, 0, sizeof(*shared));
+    shared->config.num_slots = num_slots;
+    shared->config.slot_size = slot_size;
+    /* the magic tells the peer the ring is ready */
+    __atomic_store_n(&shared->config.magic, CROSSVM_RING_MAGIC, __ATOMIC_RELEASE);
+    crossvm_ring_setup(ring, mem, num_slots, slot_size);
+    return 0;
+}
+
+/***
+ * @function crossvm_ring_attach(ring, mem, mem_size, producer)
+ * Attach to a ring initialised by the peer, checking the ring fits in the shared memory
+ * @param {crossvm_ring_t *} ring       Handle to initialise
+ * @param {void *} mem                  Shared memory holding the ring
+ * @param {size_t} mem_size             Size of the shared memory in bytes
+ * @param {bool} producer               Whether to attach as the producer rather than the consumer
+ * @return                              0 on success, -1 if the ring is not initialised or is invalid
+ */
+static inline int crossvm_ring_attach(crossvm_ring_t *ring, void *mem, size_t mem_size, bool producer)
+{
+    struct crossvm_ring_shared *shared = (struct crossvm_ring_shared *)mem;
+    if (mem_size <= crossvm_ring_slots_offset() ||
+        __atomic_load_n(&shared->config.magic, __ATOMIC_ACQUIRE) != CROSSVM_RING_MAGIC) {
+        return -1;
+    }
+    uint32_t num_slots = shared->config.num_slots;
+    uint32_t slot_size = shared->config.slot_size;
+    if (num_slots == 0 || (num_slots & (num_slots - 1)) || slot_size == 0 || slot_size % 8 ||
+        (uint64_t)num_slots * slot_size > mem_size - crossvm_ring_slots_offset()) {
+        return -1;
+    }
+    crossvm_ring_setup(ring, mem, num_slots, slot_size);
+    /* pick up wherever the ring is at */
+    uint32_t head = __atomic_load_n(&shared->producer.head, __ATOMIC_ACQUIRE);
+    uint32_t tail = __atomic_load_n(&shared->consumer.tail, __ATOMIC_ACQUIRE);
+    if (head - tail > num_slots) {
+        return -1;
+    }
+    ring->index = producer ? head : tail;
+    ring->peer_index = producer ? tail : head;
+    ring->wait_seq = producer ? shared->producer.wait_seq : shared->consumer.wait_seq;
+    ring->notified_seq = producer ? shared->consumer.wait_seq : shared->producer.wait_seq;
+    return 0;
+}
+
+static inline void *crossvm_ring_slot(crossvm_ring_t *ring, uint32_t idx)
+{
+    return ring->slots + (size_t)(idx & (ring->num_slots - 1)) * ring->slot_size;
+}
+
+/* Indices from the peer too far from our own are treated as the peer not having moved */
+static inline uint32_t crossvm_ring_peer_load(crossvm_ring_t *ring, uint32_t *peer, uint32_t from, uint32_t to)
+{
+    uint32_t idx = __atomic_load_n(peer, __ATOMIC_ACQUIRE);
+    if ((uint32_t)(idx - from) <= (uint32_t)(to - from)) {
+        ring->peer_index = idx;
+    }
+    return ring->peer_index;
+}
+
+/* Whether the peer is waiting on a commit just made, and hasn't been notified of an earlier one */
+static inline bool crossvm_ring_peer_need_notify(crossvm_ring_t *ring, uint32_t *waiting, uint32_t *wait_seq)
+{
+    /* order the index update before reading the peer's flag, pairing with the
+     * peer's order of setting the flag before reading the index */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(waiting, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    uint32_t seq = __atomic_load_n(wait_seq, __ATOMIC_RELAXED);
+    if (seq == ring->notified_seq) {
+        return false;
+    }
+    ring->notified_seq = seq;
+    ring->stats.notifications++;
+    return true;
+}
+
+/***
+ * @function crossvm_ring_free(ring)
+ * Producer: the number of slots that can be produced. The consumer's index is only read once the slots known to be
+ * free have been used up
+ * @param {crossvm_ring_t *} ring       Producer handle of the ring
+ * @return                              Number of free slots
+ */
+static inline uint32_t crossvm_ring_free(crossvm_ring_t *ring)
+{
+    uint32_t head = ring->index;
+    uint32_t num_free = ring->num_slots - (head - ring->peer_index);
+    if (num_free == 0) {
+        /* the tail is always between the last tail seen and the head */
+        uint32_t tail = crossvm_ring_peer_load(ring, &ring->shared->consumer.tail, ring->peer_index, head);
+        num_free = ring->num_slots - (head - tail);
+    }
+    return num_free;
+}
+
+/***
+ * @function crossvm_ring_produce_slot(ring, n)
+ * Producer: the n'th free slot, to be filled in before being committed with `crossvm_ring_produce_commit`
+ * @param {crossvm_ring_t *} ring       Producer handle of the ring
+ * @param {uint32_t} n                  Slot to return, less than `crossvm_ring_free`
+ * @return                              Pointer to the slot
+ */
+static inline void *crossvm_ring_produce_slot(crossvm_ring_t *ring, uint32_t n)
+{
+    return crossvm_ring_slot(ring, ring->index + n);
+}
+
+/***
+ * @function crossvm_ring_produce_commit(ring, n)
+ * Producer: hand the first 'n' free slots to the consumer
+ * @param {crossvm_ring_t *} ring       Producer handle of the ring
+ * @param {uint32_t} n                  Number of slots to commit
+ * @return                              Whether the consumer is waiting and has to be notified
+ */
+static inline bool crossvm_ring_produce_commit(crossvm_ring_t *ring, uint32_t n)
+{
+    if (n == 0) {
+        return false;
+    }
+    ring->index += n;
+    __atomic_store_n(&ring->shared->producer.head, ring->index, __ATOMIC_RELEASE);
+    ring->stats.slots += n;
+    ring->stats.batches++;
+    return crossvm_ring_peer_need_notify(ring, &ring->shared->consumer.waiting, &ring->shared->consumer.wait_seq);
+}
+
+/***
+ * @function crossvm_ring_write(ring, msgs, n, notify)
+ * Producer: copy up to 'n' slots worth of messages into the ring, committing them as a single batch
+ * @param {crossvm_ring_t *} ring       Producer handle of the ring
+ * @param {const void *} msgs           Array of messages of the ring's slot size
+ * @param {uint32_t} n                  Number of messages
+ * @param {bool *} notify               Set to whether the consumer has to be notified
+ * @return                              Number of messages written
+ */
+static inline uint32_t crossvm_ring_write(crossvm_ring_t *ring, const void *msgs, uint32_t n, bool *notify)
+{
+    uint32_t num_free = crossvm_ring_free(ring);
+    if (n > num_free) {
+        n = num_free;
+    }
+    /* copy in at most two runs either side of the end of the ring */
+    uint32_t start = ring->index & (ring->num_slots - 1);
+    uint32_t first = n < ring->num_slots - start ? n : ring->num_slots - start;
+    memcpy(crossvm_ring_produce_slot(ring, 0), msgs, (size_t)first * ring->slot_size);
+    memcpy(ring->slots, (const uint8_t *)msgs + (size_t)first * ring->slot_size, (size_t)(n - first) * ring->slot_size);
+    *notify = crossvm_ring_produce_commit(ring, n);
+    return n;
+}
+
+/***
+ * @function crossvm_ring_available(ring)
+ * Consumer: the number of slots that can be consumed
+ * @param {crossvm_ring_t *} ring       Consumer handle of the ring
+ * @return                              Number of slots produced and not yet consumed
+ */
+static inline uint32_t crossvm_ring_available(crossvm_ring_t *ring)
+{
+    uint32_t tail = ring->index;
+    uint32_t head = ring->peer_index;
+    if (head == tail) {
+        /* the head is always ahead of the last head seen by at most a ring */
+        head = crossvm_ring_peer_load(ring, &ring->shared->producer.head, tail, tail + ring->num_slots);
+    }
+    return head - tail;
+}
+
+/***
+ * @function crossvm_ring_consume_slot(ring, n)
+ * Consumer: the n'th available slot, to be read before being released with `crossvm_ring_consume_commit`
+ * @param {crossvm_ring_t *} ring       Consumer handle of the ring
+ * @param {uint32_t} n                  Slot to return, less than `crossvm_ring_available`
+ * @return                              Pointer to the slot
+ */
+static inline void *crossvm_ring_consume_slot(crossvm_ring_t *ring, uint32_t n)
+{
+    return crossvm_ring_slot(ring, ring->index + n);
+}
+
+/***
+ * @function crossvm_ring_consume_commit(ring, n)
+ * Consumer: hand the first 'n' available slots back to the producer
+ * @param {crossvm_ring_t *} ring       Consumer handle of the ring
+ * @param {uint32_t} n                  Number of slots to release
+ * @return                              Whether the producer is waiting for space and has to be notified
+ */
+static inline bool crossvm_ring_consume_commit(crossvm_ring_t *ring, uint32_t n)
+{
+    if (n == 0) {
+        return false;
+    }
+    ring->index += n;
+    __atomic_store_n(&ring->shared->consumer.tail, ring->index, __ATOMIC_RELEASE);
+    ring->stats.slots += n;
+    ring->stats.batches++;
+    return crossvm_ring_peer_need_notify(ring, &ring->shared->producer.waiting, &ring->shared->producer.wait_seq);
+}
+
+/***
+ * @function crossvm_ring_read(ring, msgs, n, notify)
+ * Consumer: copy out up to 'n' available slots, releasing them as a single batch
+ * @param {crossvm_ring_t *} ring       Consumer handle of the ring
+ * @param {void *} msgs                 Array of messages of the ring's slot size
+ * @param {uint32_t} n                  Maximum number of messages
+ * @param {bool *} notify               Set to whether the producer has to be notified
+ * @return                              Number of messages read
+ */
+static inline uint32_t crossvm_ring_read(crossvm_ring_t *ring, void *msgs, uint32_t n, bool *notify)
+{
+    uint32_t available = crossvm_ring_available(ring);
+    if (n > available) {
+        n = available;
+    }
+    uint32_t start = ring->index & (ring->num_slots - 1);
+    uint32_t first = n < ring->num_slots - start ? n : ring->num_slots - start;
+    memcpy(msgs, crossvm_ring_consume_slot(ring, 0), (size_t)first * ring->slot_size);
+    memcpy((uint8_t *)msgs + (size_t)first * ring->slot_size, ring->slots, (size_t)(n - first) * ring->slot_size);
+    *notify = crossvm_ring_consume_commit(ring, n);
+    return n;
+}
+
+/***
+ * @function crossvm_ring_prepare_wait(ring, producer)
+ * Announce that this side is about to wait for its peer, so the peer notifies it on its next commit. Until then
+ * commits of the peer need no notification, and the peer notifies once per wait. Returns false if there is already
+ * something to do, in which case the side carries on rather than waits
+ * @param {crossvm_ring_t *} ring       Handle of the ring
+ * @param {bool} producer               Whether the handle is of the producer, waiting for free slots
+ * @return                              Whether the side can wait for a notification
+ */
+static inline bool crossvm_ring_prepare_wait(crossvm_ring_t *ring, bool producer)
+{
+    uint32_t *waiting = producer ? &ring->shared->producer.waiting : &ring->shared->consumer.waiting;
+    uint32_t *wait_seq = producer ? &ring->shared->producer.wait_seq : &ring->shared->consumer.wait_seq;
+    /* a new wait, which the peer notifies even if it notified the last one */
+    __atomic_store_n(wait_seq, ++ring->wait_seq, __ATOMIC_RELAXED);
+    __atomic_store_n(waiting, 1, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (producer ? crossvm_ring_free(ring) : crossvm_ring_available(ring)) {
+        __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+        return false;
+    }
+    ring->stats.waits++;
+    return true;
+}
+
+/***
+ * @function crossvm_ring_finish_wait(ring, producer)
+ * Announce that this side is active again, after waking from a wait
+ * @param {crossvm_ring_t *} ring       Handle of the ring
+ * @param {bool} producer               Whether the handle is of the producer
+ */
+static inline void crossvm_ring_finish_wait(crossvm_ring_t *ring, bool producer)
+{
+    uint32_t *waiting = producer ? &ring->shared->producer.waiting : &ring->shared->consumer.waiting;
+    __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+}
@@ -147,11 +147,15 @@ typedef struct pci_irq_emulation {
  * Datastructure providing direct passthrough access to a pci entry configuration space
  * @param {vmm_pci_address_t} addr          Address of PCI device
  * @param {vmm_pci_config_t} config         Ops for accessing config space
+ * @param {uint8_t[64]} header              Copy of the device's configuration header
+ * @param {uint64_t} header_cached          Bitmask of the read only bytes of the header, read from the copy
  */
 typedef struct pci_passthrough_device {
     /* The address on the host system of this device */
     vmm_pci_address_t addr;
     vmm_pci_config_t config;
+    uint8_t header[64];
+    uint64_t header_cached;
 } pci_passthrough_device_t;
 
 /***
@@ -174,6 +178,28 @@ typedef struct pci_cap_emulation {
     uint8_t *ignore_end;
 } pci_cap_emulation_t;
 
+/***
+ * @struct pci_msi_emulation
+ * Wrapper datastructure over a pci entry and its configuration space. This is leveraged to emulate a 64-bit
+ * MSI capability, without per-vector masking, in an entries configuration space
+ * @param {vmm_pci_entry_t} passthrough     PCI entry being emulated
+ * @param {uint8_t} cap_offset              Offset of the MSI capability in the configuration space
+ * @param {uint8_t} next_cap                Offset of the next capability of the PCI entry, 0 if none
+ * @param {uint8_t} vectors_log2            Log2 of the number of vectors the capability supports
+ * @param {uint16_t} control                Message control register written by the guest
+ * @param {uint64_t} address                Message address written by the guest
+ * @param {uint16_t} data                   Message data written by the guest
+ */
+typedef struct pci_msi_emulation {
+    vmm_pci_entry_t passthrough;
+    uint8_t cap_offset;
+    uint8_t next_cap;
+    uint8_t vectors_log2;
+    uint16_t control;
+    uint64_t address;
+    uint16_t data;
+} pci_msi_emulation_t;
+
 /***
  * @function vmm_pci_entry_ignore_write(cookie, offset, size, value)
  * Helper write function that just ignores any writes
@@ -187,7 +213,8 @@ int vmm_pci_entry_ignore_write(void *cookie, int offset, int size, uint32_t valu
 
 /***
  * @function vmm_pci_mem_device_read(cookie, offset, size, result)
- * Read method for a PCI devices memory
+ * Read method for a PCI devices memory. Reads of the capability space are served from the header's `caps`, which
+ * are laid out from the start of the capability space
  * @param {void *} cookie       PCI device header
  * @param {int} offset          Offset into PCI device header
  * @param {int} size            Size of data to be read
@@ -217,7 +244,8 @@ void define_pci_host_bridge(vmm_pci_device_def_t *bridge);
 /***
  * @function vmm_pci_create_passthrough(addr, config)
  * Construct a pure passthrough device based on the real PCI. This is almost always useless as
- * you will almost certainly want to rebase io memory
+ * you will almost certainly want to rebase io memory. The read only registers of the device's header, such as
+ * its IDs and class, are read once here and served from a copy rather than from the device
  * @param {vmm_pci_address_t} addr      Address of passthrough PCI device
  * @param {vmm_pci_config_t} config     Ops for accessing the passthrough config space
  * @return                              `vmm_pci_entry_t` for passthrough device
@@ -275,3 +303,37 @@ vmm_pci_entry_t vmm_pci_create_cap_emulation(vmm_pci_entry_t existing, int num_c
  * @return                              `vmm_pci_entry_t` with an emulated capability space (ignoring MSI capabilties)
  */
 vmm_pci_entry_t vmm_pci_no_msi_cap_emulation(vmm_pci_entry_t existing);
+
+/***
+ * @function vmm_pci_msix_only_cap_emulation(existing)
+ * Finds the MSI capability and uses vmm_pci_create_cap_emulation to register it as ignored, leaving any MSI-X
+ * capability in the capability list
+ * @param {vmm_pci_entry_t} existing    Existing PCI entry to wrap over with an ignored MSI capability
+ * @return                              `vmm_pci_entry_t` with an emulated capability space (ignoring the MSI capability)
+ */
+vmm_pci_entry_t vmm_pci_msix_only_cap_emulation(vmm_pci_entry_t existing);
+
+/***
+ * @function vmm_pci_create_msi_emulation(existing, cap_offset, num_vectors, msi)
+ * Construct a pci entry that emulates an MSI capability at the given offset of the configuration space, inserted
+ * at the head of the capability list of the existing entry. The rest of the configuration space is passed on.
+ * The message programmed by the guest is retrieved with `vmm_pci_msi_get_message` when signalling a vector
+ * @param {vmm_pci_entry_t} existing        Existing PCI entry to wrap over and add an MSI capability to
+ * @param {uint8_t} cap_offset              Offset of the emulated capability, clear of the existing capabilities
+ * @param {unsigned int} num_vectors        Number of vectors supported, a power of 2 up to 32
+ * @param {pci_msi_emulation_t **} msi      Pointer to store the handle to the emulated capability
+ * @return                                  `vmm_pci_entry_t` with an emulated MSI capability
+ */
+vmm_pci_entry_t vmm_pci_create_msi_emulation(vmm_pci_entry_t existing, uint8_t cap_offset, unsigned int num_vectors,
+                                             pci_msi_emulation_t **msi);
+
+/***
+ * @function vmm_pci_msi_get_message(msi, vector, address, data)
+ * Get the message a device writes to signal a vector of an emulated MSI capability
+ * @param {pci_msi_emulation_t *} msi       A handle to the emulated MSI capability
+ * @param {unsigned int} vector             Vector to signal, within the number of vectors enabled by the guest
+ * @param {uint64_t *} address              Pointer to store the message address
+ * @param {uint32_t *} data                 Pointer to store the message data
+ * @return                                  0 on success, -1 if MSI is disabled or the vector is not enabled
+ */
+int vmm_pci_msi_get_message(pci_msi_emulation_t *msi, unsigned int vector, uint64_t *address, uint32_t *data);
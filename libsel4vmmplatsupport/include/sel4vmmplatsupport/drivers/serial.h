@@ -0,0 +1,59 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+/***
+ * @module serial.h
+ * This interface provides the ability to initialise a buffered 16550 UART emulation on a range of ioports.
+ * Bytes written by the guest are accumulated in a ring buffer and passed on to a backend in batches, flushed
+ * on a newline, once a threshold of buffered bytes is reached or explicitly through 'vmm_serial_flush' (e.g.
+ * from a periodic timer). The transmitter is always reported as empty and no receive data or interrupts are
+ * emulated, such that guests drive the device by polling.
+ */
+
+#include <stdlib.h>
+
+#include <sel4vmmplatsupport/ioports.h>
+
+/* Number of ioports used by the 16550 UART register set */
+#define VMM_SERIAL_NUM_IOPORTS 8
+
+typedef struct vmm_serial vmm_serial_t;
+
+/**
+ * Type signature of serial output backend function, invoked when buffered output is flushed
+ * @param {void *} cookie           User supplied cookie to pass onto the backend
+ * @param {const char *} buf        Buffered output bytes
+ * @param {size_t} len              Number of bytes in 'buf'
+ * @return                          Number of bytes consumed by the backend, -1 on error. Bytes that aren't consumed
+ *                                  remain buffered until the next flush
+ */
+typedef int (*vmm_serial_write_fn)(void *cookie, const char *buf, size_t len);
+
+/***
+ * @function vmm_serial_init(io_list, ioport_range, port_type, buffer_size, flush_threshold, write_fn, cookie)
+ * Initialise a buffered serial device and register its ioport handlers
+ * @param {vmm_io_port_list_t *} io_list        IOPort library instance to register the serial ioports with
+ * @param {ioport_range_t} ioport_range         IOPort range of the UART registers, at least VMM_SERIAL_NUM_IOPORTS ports
+ * @param {ioport_type_t} port_type             Type of ioport i.e. whether to alloc or use given range
+ * @param {size_t} buffer_size                  Size in bytes of the output ring buffer
+ * @param {size_t} flush_threshold              Number of buffered bytes that triggers a flush, 0 to only flush on newlines, full buffers and explicit flushes
+ * @param {vmm_serial_write_fn} write_fn        Backend function receiving flushed output
+ * @param {void *} cookie                       Cookie to supply to the backend function
+ * @return                                      Pointer to an initialised vmm_serial_t, NULL if error
+ */
+vmm_serial_t *vmm_serial_init(vmm_io_port_list_t *io_list, ioport_range_t ioport_range, ioport_type_t port_type,
+                              size_t buffer_size, size_t flush_threshold, vmm_serial_write_fn write_fn, void *cookie);
+
+/***
+ * @function vmm_serial_flush(serial)
+ * Pass any buffered output of a serial device onto its backend. This is intended to be invoked periodically
+ * such that partial lines don't remain buffered indefinitely
+ * @param {vmm_serial_t *} serial               A handle to the serial device
+ * @return                                      0 on success, -1 on error
+ */
+int vmm_serial_flush(vmm_serial_t *serial);
@@ -16,12 +16,24 @@
 
 /* Virtio device IDs  */
 #define VIRTIO_NET_PCI_DEVICE_ID        0x1000
+#define VIRTIO_BLK_PCI_DEVICE_ID        0x1001
+#define VIRTIO_BALLOON_PCI_DEVICE_ID    0x1002
 #define VIRTIO_CONSOLE_PCI_DEVICE_ID    0x1003
 
 /* Virtio subsystem device ids */
 #define VIRTIO_ID_NET                   1
+#define VIRTIO_ID_BLOCK                 2
 #define VIRTIO_ID_CONSOLE               3
+#define VIRTIO_ID_BALLOON               5
+#define VIRTIO_ID_VSOCK                 19
+#define VIRTIO_ID_MEM                   24
+#define VIRTIO_ID_FS                    26
 
 /* Virtio PCI device classes  */
 #define VIRTIO_PCI_CLASS_NET            0x020000
+#define VIRTIO_PCI_CLASS_BLOCK          0x018000
 #define VIRTIO_PCI_CLASS_CONSOLE        0x078000
+#define VIRTIO_PCI_CLASS_BALLOON        0xff0000
+#define VIRTIO_PCI_CLASS_VSOCK          0x078000
+#define VIRTIO_PCI_CLASS_FS             0x018000
+#define VIRTIO_PCI_CLASS_MEM            0xff0000
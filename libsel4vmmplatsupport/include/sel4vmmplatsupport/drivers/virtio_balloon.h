@@ -0,0 +1,84 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+/***
+ * @module virtio_balloon.h
+ * This interface provides the ability to initalise a VMM virtio balloon device, creating a virtio PCI device in the
+ * VM's virtual pci. The VMM sets the number of pages it wants the guest to give up, and the frames of the pages the
+ * guest puts in the balloon are returned to the VKA with `vm_ram_release`. Pages the guest takes back out of the
+ * balloon are given fresh frames.
+ */
+
+#include <sel4vm/guest_vm.h>
+
+#include <sel4vmmplatsupport/ioports.h>
+#include <sel4vmmplatsupport/drivers/pci.h>
+#include <sel4vmmplatsupport/drivers/virtio_pci_emul.h>
+
+/***
+ * @struct virtio_balloon
+ * Virtio Balloon Driver Interface
+ * @param {unsigned int} iobase                             IO Port base for virtio balloon device
+ * @param {virtio_emul_t *} emul                            Virtio balloon emulation interface: VMM <-> Guest
+ * @param {struct balloon_passthrough} emul_driver_funcs    Virtio balloon backend functions: VMM <-> Backend
+ * @param {ps_io_ops_t} ioops                               Platform support io ops datastructure
+ */
+typedef struct virtio_balloon {
+    unsigned int iobase;
+    virtio_emul_t *emul;
+    struct balloon_passthrough emul_driver_funcs;
+    ps_io_ops_t ioops;
+} virtio_balloon_t;
+
+/***
+ * @function common_make_virtio_balloon(vm, pci, ioport, ioport_range, port_type, interrupt_pin, interrupt_line, backend)
+ * Initialise a new virtio_balloon device with Base Address Registers (BARs) starting at iobase. The balloon starts
+ * out empty.
+ * @param {vm_t *} vm                               Handle to the VM
+ * @param {vmm_pci_space_t *} pci                   PCI library instance to register virtio balloon device
+ * @param {vmm_io_port_list_t *} ioport             IOPort library instance to register virtio balloon ioport
+ * @param {ioport_range_t} ioport_range             BAR port for front end emulation
+ * @param {ioport_type_t} port_type                 Type of ioport i.e. whether to alloc or use given range
+ * @param {unsigned int} interrupt_pin              PCI interrupt pin e.g. INTA = 1, INTB = 2 ,...
+ * @param {unsigned int} interrupt_line             PCI interrupt line for virtio balloon IRQS
+ * @param {struct balloon_passthrough} backend      Backend injecting the device's interrupt
+ * @return                                          Pointer to an initialised virtio_balloon_t, NULL if error.
+ */
+virtio_balloon_t *common_make_virtio_balloon(vm_t *vm, vmm_pci_space_t *pci, vmm_io_port_list_t *ioport,
+                                             ioport_range_t ioport_range, ioport_type_t port_type,
+                                             unsigned int interrupt_pin, unsigned int interrupt_line,
+                                             struct balloon_passthrough backend);
+
+#ifdef CONFIG_ARCH_ARM
+/***
+ * @function common_make_virtio_balloon_mmio(vm, addr, backend)
+ * Initialise a new virtio_balloon device exposed through a virtio mmio register window rather than virtio-pci, see
+ * `vm_install_virtio_mmio`. The guest is told of the device with `fdt_generate_virtio_mmio_node`. Only available on ARM.
+ * @param {vm_t *} vm                               Handle to the VM
+ * @param {uintptr_t} addr                          Guest physical address of the register window
+ * @param {struct balloon_passthrough} backend      Backend injecting the device's interrupt
+ * @return                                          Pointer to an initialised virtio_balloon_t, NULL if error.
+ */
+virtio_balloon_t *common_make_virtio_balloon_mmio(vm_t *vm, uintptr_t addr, struct balloon_passthrough backend);
+#endif
+
+/***
+ * @function virtio_balloon_set_target(balloon, num_pages)
+ * Ask the guest to inflate or deflate the balloon until it holds a number of 4K pages
+ * @param {virtio_balloon_t *} balloon          Handle to the balloon device
+ * @param {uint32_t} num_pages                  Number of 4K pages wanted in the balloon
+ */
+void virtio_balloon_set_target(virtio_balloon_t *balloon, uint32_t num_pages);
+
+/***
+ * @function virtio_balloon_get_actual(balloon)
+ * Get the number of 4K pages the guest reports having put in the balloon
+ * @param {virtio_balloon_t *} balloon          Handle to the balloon device
+ * @return                                      Number of 4K pages in the balloon
+ */
+uint32_t virtio_balloon_get_actual(virtio_balloon_t *balloon);
@@ -0,0 +1,80 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+/***
+ * @module virtio_blk.h
+ * This interface provides the ability to initalise a VMM virtio block device, creating a virtio PCI device in the
+ * VM's virtual pci. Guest requests are handed to a pluggable backend, described by `struct blk_passthrough`, which
+ * completes them synchronously or asynchronously through the request's `complete` callback. Multiple requests are in
+ * flight with the backend at once, and guest requests for adjacent sectors are merged into a single backend request.
+ * Completed requests are handed back to the guest in batches, with a single interrupt for each batch.
+ */
+
+#include <sel4vm/guest_vm.h>
+
+#include <sel4vmmplatsupport/ioports.h>
+#include <sel4vmmplatsupport/drivers/pci.h>
+#include <sel4vmmplatsupport/drivers/virtio_pci_emul.h>
+
+/***
+ * @struct virtio_blk
+ * Virtio Block Driver Interface
+ * @param {unsigned int} iobase                         IO Port base for virtio blk device
+ * @param {virtio_emul_t *} emul                        Virtio block emulation interface: VMM <-> Guest
+ * @param {struct blk_passthrough} emul_driver_funcs    Virtio block backend functions: VMM <-> Backend
+ * @param {ps_io_ops_t} ioops                           Platform support io ops datastructure
+ */
+typedef struct virtio_blk {
+    unsigned int iobase;
+    virtio_emul_t *emul;
+    struct blk_passthrough emul_driver_funcs;
+    ps_io_ops_t ioops;
+} virtio_blk_t;
+
+/***
+ * @function common_make_virtio_blk(vm, pci, ioport, ioport_range, port_type, interrupt_pin, interrupt_line, backend)
+ * Initialise a new virtio_blk device with Base Address Registers (BARs) starting at iobase and the backend
+ * specified by the blk_passthrough struct. The backend's requests and completions must be serialised with the
+ * VMM's handling of the device's faults.
+ * @param {vm_t *} vm                           Handle to the VM
+ * @param {vmm_pci_space_t *} pci               PCI library instance to register virtio blk device
+ * @param {vmm_io_port_list_t *} ioport         IOPort library instance to register virtio blk ioport
+ * @param {ioport_range_t} ioport_range         BAR port for front end emulation
+ * @param {ioport_type_t} port_type             Type of ioport i.e. whether to alloc or use given range
+ * @param {unsigned int} interrupt_pin          PCI interrupt pin e.g. INTA = 1, INTB = 2 ,...
+ * @param {unsigned int} interrupt_line         PCI interrupt line for virtio blk IRQS
+ * @param {struct blk_passthrough} backend      Backend implementation, e.g. from virtio_blk_ramdisk_backend
+ * @return                                      Pointer to an initialised virtio_blk_t, NULL if error.
+ */
+virtio_blk_t *common_make_virtio_blk(vm_t *vm, vmm_pci_space_t *pci, vmm_io_port_list_t *ioport,
+                                     ioport_range_t ioport_range, ioport_type_t port_type, unsigned int interrupt_pin,
+                                     unsigned int interrupt_line, struct blk_passthrough backend);
+
+#ifdef CONFIG_ARCH_ARM
+/***
+ * @function common_make_virtio_blk_mmio(vm, addr, backend)
+ * Initialise a new virtio_blk device exposed through a virtio mmio register window rather than virtio-pci, see
+ * `vm_install_virtio_mmio`. The guest is told of the device with `fdt_generate_virtio_mmio_node`. Only available on ARM.
+ * @param {vm_t *} vm                           Handle to the VM
+ * @param {uintptr_t} addr                      Guest physical address of the register window
+ * @param {struct blk_passthrough} backend      Backend implementation, e.g. from virtio_blk_ramdisk_backend
+ * @return                                      Pointer to an initialised virtio_blk_t, NULL if error.
+ */
+virtio_blk_t *common_make_virtio_blk_mmio(vm_t *vm, uintptr_t addr, struct blk_passthrough backend);
+#endif
+
+/***
+ * @function virtio_blk_ramdisk_backend(disk, size, backend)
+ * Populate a backend serving requests from a RAM disk, completing each request as it is submitted. The caller
+ * provides the backend's `handleIRQ`.
+ * @param {void *} disk                         Contents of the disk, which remain in use by the backend
+ * @param {size_t} size                         Size of the disk in bytes, a multiple of VIRTIO_BLK_SECTOR_SIZE
+ * @param {struct blk_passthrough *} backend    Backend to populate
+ * @return                                      0 on success, -1 on error
+ */
+int virtio_blk_ramdisk_backend(void *disk, size_t size, struct blk_passthrough *backend);
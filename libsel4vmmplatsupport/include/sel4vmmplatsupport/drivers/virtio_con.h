@@ -10,6 +10,7 @@
  * @module virtio_con.h
  * This interface provides the ability to initalise a VMM virtio console driver. This creating a virtio
  * PCI device in the VM's virtual pci. This can subsequently be accessed through '/dev/hvc0' in the guest.
+ * Further ports, each with queues and buffering of their own, can be added to the device with `virtio_con_add_ports`.
  */
 
 #include <sel4vm/guest_vm.h>
@@ -56,3 +57,30 @@ virtio_con_t *common_make_virtio_con(vm_t *vm,
                                      unsigned int interrupt_pin,
                                      unsigned int interrupt_line,
                                      struct console_passthrough backend);
+
+#ifdef CONFIG_ARCH_ARM
+/***
+ * @function common_make_virtio_con_mmio(vm, addr, backend)
+ * Initialise a new virtio_con device exposed through a virtio mmio register window rather than virtio-pci, see
+ * `vm_install_virtio_mmio`. The guest is told of the device with `fdt_generate_virtio_mmio_node`. Only available on ARM.
+ * @param {vm_t *} vm                               Handle to the VM
+ * @param {uintptr_t} addr                          Guest physical address of the register window
+ * @param {struct console_passthrough} backend      Function pointers to backend implementation
+ * @return                                          Pointer to an initialised virtio_con_t, NULL if error.
+ */
+virtio_con_t *common_make_virtio_con_mmio(vm_t *vm, uintptr_t addr, struct console_passthrough backend);
+#endif
+
+/***
+ * @function virtio_con_add_ports(con, ports, num_ports)
+ * Make the device a multiport console, offering the guest further ports beside the console the device was created
+ * with, which is port 0. Each port has its own virtqueues, backend and buffering, so a busy port doesn't hold up
+ * the others. Named ports show up in the guest under '/dev/virtio-ports', console ports as further '/dev/hvc' devices.
+ * Input is handed to the guest on a port with `virtio_console_port_putchar`. Ports without a `handleIRQ` interrupt
+ * the guest through the backend of port 0. Must be called before the guest starts using the device.
+ * @param {virtio_con_t *} con                      Handle to the virtio console device
+ * @param {const struct console_port *} ports       Ports to add, numbered from 1 in order
+ * @param {unsigned int} num_ports                  Number of ports to add, at most VIRTIO_CONSOLE_MAX_PORTS in total
+ * @return                                          0 on success, -1 on error
+ */
+int virtio_con_add_ports(virtio_con_t *con, const struct console_port *ports, unsigned int num_ports);
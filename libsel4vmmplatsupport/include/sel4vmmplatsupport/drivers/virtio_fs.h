@@ -0,0 +1,64 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+/***
+ * @module virtio_fs.h
+ * This interface provides the ability to initialise a VMM virtio-fs device, through which the guest mounts a file
+ * system served by a file server component. The device passes the guest's FUSE requests to the server and its
+ * replies back over a pair of single-producer, single-consumer rings laid out in dataports shared with the server
+ * (see `cross_vm_ring.h`), one `struct virtio_fs_msg` per request or reply. The server is notified once per pass over
+ * the device, and only if it is waiting on one of the rings, and it signals the VMM, which then calls
+ * `virtio_fs_poll`, only if the VMM is waiting. Reads of large files can be served without copying through the
+ * device's DAX window: the guest asks for a range of a file to be mapped into the window with FUSE_SETUPMAPPING, the
+ * server places the range in its page cache and replies with where, and the VMM maps the frames of the cache into the
+ * window, read-only unless the guest asked for a writable mapping. The server has to offer the guest FUSE_MAP_ALIGNMENT
+ * of 4K pages when replying to FUSE_INIT. Ranges are unmapped as the guest removes them with FUSE_REMOVEMAPPING, which
+ * the server is passed on to release its pages, and when the guest resets the device.
+ */
+
+#include <sel4vm/guest_vm.h>
+
+#include <sel4vmmplatsupport/drivers/pci.h>
+#include <sel4vmmplatsupport/drivers/virtio_pci_emul.h>
+
+/***
+ * @struct virtio_fs
+ * Virtio FS Driver Interface
+ * @param {virtio_emul_t *} emul                            Virtio fs emulation interface: VMM <-> Guest
+ * @param {struct fs_passthrough} emul_driver_funcs         Virtio fs backend: VMM <-> File server
+ */
+typedef struct virtio_fs {
+    virtio_emul_t *emul;
+    struct fs_passthrough emul_driver_funcs;
+} virtio_fs_t;
+
+/***
+ * @function common_make_virtio_fs(vm, pci, bar_addr, dax_addr, dax_size_bits, interrupt_pin, interrupt_line, backend, emulate_bar_access)
+ * Initialise a new virtio_fs device, exposed to the guest as a modern (virtio 1.0) PCI device with its registers in
+ * memory bar 0, see `common_make_virtio_net_modern`, and its DAX window in memory bar 1.
+ * @param {vm_t *} vm                               Handle to the VM
+ * @param {vmm_pci_space_t *} pci                   PCI library instance to register virtio fs device
+ * @param {uintptr_t} bar_addr                      Guest physical address of the register bar, of 4K and aligned to its size
+ * @param {uintptr_t} dax_addr                      Guest physical address of the DAX window, aligned to its size
+ * @param {size_t} dax_size_bits                    Size of the DAX window in bits, 0 for no window, in which case reads are always copied
+ * @param {unsigned int} interrupt_pin              PCI interrupt pin e.g. INTA = 1, INTB = 2 ,...
+ * @param {unsigned int} interrupt_line             PCI interrupt line for virtio fs IRQS
+ * @param {struct fs_passthrough} backend           File server the device is backed by, and the tag the guest mounts it by
+ * @param {bool} emulate_bar_access                 Emulate read and writes accesses to the PCI device Base Address Registers.
+ * @return                                          Pointer to an initialised virtio_fs_t, NULL if error.
+ */
+virtio_fs_t *common_make_virtio_fs(vm_t *vm, vmm_pci_space_t *pci, uintptr_t bar_addr, uintptr_t dax_addr,
+                                   size_t dax_size_bits, unsigned int interrupt_pin, unsigned int interrupt_line,
+                                   struct fs_passthrough backend, bool emulate_bar_access);
+
+/***
+ * @function virtio_fs_poll(fs)
+ * Pass requests and replies between the guest and the file server, to be called when the server signals the VMM
+ * @param {virtio_fs_t *} fs                        Handle to the fs device
+ */
+void virtio_fs_poll(virtio_fs_t *fs);
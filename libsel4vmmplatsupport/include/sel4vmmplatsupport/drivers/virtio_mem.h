@@ -0,0 +1,82 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+/***
+ * @module virtio_mem.h
+ * This interface provides the ability to initialise a VMM virtio mem device, through which guest memory is hot-plugged
+ * and unplugged at runtime. The device owns a region of guest physical address space, kept clear of all other guest RAM
+ * and devices, that the guest plugs memory into in blocks. The VMM sets the amount of memory it wants plugged with
+ * `virtio_mem_set_requested_size`, and the guest driver plugs or unplugs blocks until it matches. Blocks are registered
+ * as guest RAM with `vm_ram_register_at` as the guest first plugs them, and with lazy RAM are only backed by frames as the
+ * guest touches them. Unplugged blocks stay registered, their frames being given back with `vm_ram_release`. Together
+ * with ballooning this lets a guest be sized to its load rather than its peak.
+ */
+
+#include <sel4vm/guest_vm.h>
+
+#include <sel4vmmplatsupport/drivers/pci.h>
+#include <sel4vmmplatsupport/drivers/virtio_pci_emul.h>
+
+/***
+ * @struct virtio_mem
+ * Virtio Mem Driver Interface
+ * @param {virtio_emul_t *} emul                        Virtio mem emulation interface: VMM <-> Guest
+ * @param {struct mem_passthrough} emul_driver_funcs    Virtio mem backend functions: VMM <-> Backend
+ */
+typedef struct virtio_mem {
+    virtio_emul_t *emul;
+    struct mem_passthrough emul_driver_funcs;
+} virtio_mem_t;
+
+/***
+ * @function common_make_virtio_mem(vm, pci, bar_addr, interrupt_pin, interrupt_line, backend, emulate_bar_access)
+ * Initialise a new virtio_mem device, exposed to the guest as a modern (virtio 1.0) PCI device as virtio mem has no
+ * legacy interface. Its registers are in a memory BAR, see `common_make_virtio_net_modern`. No memory is plugged until
+ * requested with `virtio_mem_set_requested_size`.
+ * @param {vm_t *} vm                               Handle to the VM
+ * @param {vmm_pci_space_t *} pci                   PCI library instance to register virtio mem device
+ * @param {uintptr_t} bar_addr                      Guest physical address of the memory BAR, of 4K and aligned to its size
+ * @param {unsigned int} interrupt_pin              PCI interrupt pin e.g. INTA = 1, INTB = 2 ,...
+ * @param {unsigned int} interrupt_line             PCI interrupt line for virtio mem IRQS
+ * @param {struct mem_passthrough} backend          Backend injecting the device's interrupt, and the region and block size
+ * @param {bool} emulate_bar_access                 Emulate read and writes accesses to the PCI device Base Address Registers.
+ * @return                                          Pointer to an initialised virtio_mem_t, NULL if error.
+ */
+virtio_mem_t *common_make_virtio_mem(vm_t *vm, vmm_pci_space_t *pci, uintptr_t bar_addr,
+                                     unsigned int interrupt_pin, unsigned int interrupt_line,
+                                     struct mem_passthrough backend, bool emulate_bar_access);
+
+#ifdef CONFIG_ARCH_ARM
+/***
+ * @function common_make_virtio_mem_mmio(vm, addr, backend)
+ * Initialise a new virtio_mem device exposed through a virtio mmio register window rather than virtio-pci, see
+ * `vm_install_virtio_mmio`. The guest is told of the device with `fdt_generate_virtio_mmio_node`. Only available on ARM.
+ * @param {vm_t *} vm                               Handle to the VM
+ * @param {uintptr_t} addr                          Guest physical address of the register window
+ * @param {struct mem_passthrough} backend          Backend injecting the device's interrupt, and the region and block size
+ * @return                                          Pointer to an initialised virtio_mem_t, NULL if error.
+ */
+virtio_mem_t *common_make_virtio_mem_mmio(vm_t *vm, uintptr_t addr, struct mem_passthrough backend);
+#endif
+
+/***
+ * @function virtio_mem_set_requested_size(mem, bytes)
+ * Ask the guest to plug or unplug memory until the given amount is plugged, rounded down to whole blocks and capped at
+ * the size of the device's region. The guest is told with a configuration change interrupt.
+ * @param {virtio_mem_t *} mem                      Handle to the mem device
+ * @param {uint64_t} bytes                          Amount of memory to be plugged
+ */
+void virtio_mem_set_requested_size(virtio_mem_t *mem, uint64_t bytes);
+
+/***
+ * @function virtio_mem_get_plugged_size(mem)
+ * Get the amount of memory the guest has plugged, which trails the requested size as the guest works towards it
+ * @param {virtio_mem_t *} mem                      Handle to the mem device
+ * @return                                          Bytes of memory plugged
+ */
+uint64_t virtio_mem_get_plugged_size(virtio_mem_t *mem);
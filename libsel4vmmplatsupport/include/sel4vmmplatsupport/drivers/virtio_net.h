@@ -19,6 +19,27 @@
 #include <sel4vmmplatsupport/drivers/pci.h>
 #include <sel4vmmplatsupport/drivers/virtio_pci_emul.h>
 
+/***
+ * @struct virtio_net_bench
+ * Measurements of a benchmark window of a virtio_net device, see `virtio_net_bench_start`. Exits and VMM ticks are
+ * only measured if libsel4vm is built with CONFIG_LIB_SEL4VM_EXIT_STATS, and are 0 otherwise. Ticks are those of the
+ * architecture's timestamp counter, the TSC on x86 and the virtual counter on arm.
+ * @param {uint64_t} packets        Packets transmitted by the guest
+ * @param {uint64_t} bytes          Bytes of the packets transmitted by the guest, excluding virtio net headers
+ * @param {uint64_t} interrupts     Guest interrupts raised by the device
+ * @param {uint64_t} exits          Exits of all vcpus of the VM, holding the count at the start of the window until it is stopped
+ * @param {uint64_t} vmm_ticks      Ticks the VMM spent handling the exits and notifications of all vcpus, likewise
+ * @param {uint64_t} elapsed_ns     Length of the window in nanoseconds
+ */
+typedef struct virtio_net_bench {
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t interrupts;
+    uint64_t exits;
+    uint64_t vmm_ticks;
+    uint64_t elapsed_ns;
+} virtio_net_bench_t;
+
 /***
  * @struct virtio_net
  * Virtio Net Driver Interface
@@ -27,6 +48,9 @@
  * @param {struct eth_driver *} emul_driver             Backend Ethernet driver interface: VMM <-> Ethernet driver
  * @param {struct raw_iface_funcs} emul_driver_funcs    Virtio Ethernet emulation functions: VMM <-> Guest
  * @param {ps_io_ops_t} ioops                           Platform support ioops for dma management
+ * @param {unsigned int} num_queue_pairs                Number of rx/tx queue pairs of the device
+ * @param {struct eth_driver *} emul_drivers            Backend Ethernet driver interface of each queue pair, the first being `emul_driver`
+ * @param {virtio_net_bench_t *} bench                  Benchmark window being measured, NULL if none
  */
 typedef struct virtio_net {
     unsigned int iobase;
@@ -34,8 +58,34 @@ typedef struct virtio_net {
     struct eth_driver *emul_driver;
     struct raw_iface_funcs emul_driver_funcs;
     ps_io_ops_t ioops;
+    unsigned int num_queue_pairs;
+    struct eth_driver *emul_drivers[VIRTIO_MAX_QUEUE_PAIRS];
+    virtio_net_bench_t *bench;
 } virtio_net_t;
 
+/***
+ * @struct virtio_net_vhost_config
+ * Backend component the queues of a virtio_net device are offloaded to, see `virtio_net_enable_vhost`
+ * @param {struct virtio_vhost_shared *} shared     Page shared with the backend, as laid out in virtio_vhost.h
+ * @param {vspace_t *} backend_vspace               Vspace of the backend to map guest RAM into, NULL if guest RAM is mapped into the backend at its guest physical addresses by other means
+ * @param {const seL4_CPtr *} kicks                 Notifications of the backend signalled on guest kicks of each queue, queues without one of their own signalling the first
+ * @param {unsigned int} num_kicks                  Number of notifications in `kicks`, at least 1
+ * @param {seL4_Word} irq_badge                     Badge bit of the VMM's notification the backend signals to interrupt the guest, see `vm_bind_notification_irq`
+ * @param {int} irq                                 IRQ of the device
+ * @param {bool} irq_level                          Whether the IRQ is level triggered, as PCI interrupt pins are
+ * @param {seL4_CPtr} resample                      Notification of the backend signalled when the guest acknowledges the IRQ, seL4_CapNull if not needed
+ */
+typedef struct virtio_net_vhost_config {
+    struct virtio_vhost_shared *shared;
+    vspace_t *backend_vspace;
+    const seL4_CPtr *kicks;
+    unsigned int num_kicks;
+    seL4_Word irq_badge;
+    int irq;
+    bool irq_level;
+    seL4_CPtr resample;
+} virtio_net_vhost_config_t;
+
 /***
  * @function common_make_virtio_net(vm, pci, ioport, ioport_range, port_type, interrupt_pin, interrupt_line, backend, emulate_bar_access)
  * Initialise a new virtio_net device with Base Address Registers (BARs) starting at iobase and backend functions
@@ -56,9 +106,196 @@ virtio_net_t *common_make_virtio_net(vm_t *vm, vmm_pci_space_t *pci, vmm_io_port
                                      ioport_range_t ioport_range, ioport_type_t port_type, unsigned int interrupt_pin, unsigned int interrupt_line,
                                      struct raw_iface_funcs backend, bool emulate_bar_access);
 
+/***
+ * @function common_make_virtio_net_mq(vm, pci, ioport, ioport_range, port_type, interrupt_pin, interrupt_line, backend, emulate_bar_access, num_queue_pairs)
+ * Initialise a new virtio_net device as `common_make_virtio_net` does, offering the guest multiple rx/tx queue pairs
+ * through VIRTIO_NET_F_MQ. Each queue pair has its own backend `struct eth_driver`, found in `emul_drivers`, whose
+ * `raw_tx` receives the packets the guest transmits on the pair and whose callbacks deliver received packets to the
+ * pair. The backend's `raw_handleIRQ` is passed the index of the queue pair to interrupt the guest for, or
+ * `num_queue_pairs` for the control queue. Queue pairs share no emulation state, such that each can be serviced by
+ * a different VMM thread, provided calls for one pair are serialised and guest RAM is accessible from those threads.
+ * @param {vm_t *} vm                       A handle to the VM
+ * @param {vmm_pci_space_t *} pci           PCI library instance to register virtio net device
+ * @param {vmm_io_port_list_t *} ioport     IOPort library instance to register virtio net ioport
+ * @param {ioport_range_t} ioport_range     BAR port for front end emulation
+ * @param {ioport_type_t} port_type         Type of ioport i.e. whether to alloc or use given range
+ * @param {unsigned int} interrupt_pin      PCI interrupt pin e.g. INTA = 1, INTB = 2 ,...
+ * @param {unsigned int} interrupt_line     PCI interrupt line for virtio net IRQS
+ * @param {struct raw_iface_funcs} backend  Function pointers to backend implementation, shared by the queue pairs
+ * @param {bool} emulate_bar                Emulate read and writes accesses to the PCI device Base Address Registers.
+ * @param {unsigned int} num_queue_pairs    Number of queue pairs, from 1 to VIRTIO_MAX_QUEUE_PAIRS
+ * @return                                  Pointer to an initialised virtio_net_t, NULL if error.
+ */
+virtio_net_t *common_make_virtio_net_mq(vm_t *vm, vmm_pci_space_t *pci, vmm_io_port_list_t *ioport,
+                                        ioport_range_t ioport_range, ioport_type_t port_type, unsigned int interrupt_pin,
+                                        unsigned int interrupt_line, struct raw_iface_funcs backend, bool emulate_bar_access,
+                                        unsigned int num_queue_pairs);
+
+/***
+ * @function common_make_virtio_net_modern(vm, pci, bar_addr, interrupt_pin, interrupt_line, backend, emulate_bar_access, num_queue_pairs)
+ * Initialise a new virtio_net device as `common_make_virtio_net_mq` does, exposing it to the guest as a modern
+ * (virtio 1.0) PCI device rather than a legacy one. Its registers are in a memory BAR, described by virtio vendor
+ * capabilities, and each queue has its own doorbell in the BAR, such that a guest notification is a single MMIO
+ * fault. Guests may negotiate packed virtqueues (VIRTIO_F_RING_PACKED). MSI-X is not provided, the device interrupts
+ * the guest through its legacy interrupt pin.
+ * @param {vm_t *} vm                       A handle to the VM
+ * @param {vmm_pci_space_t *} pci           PCI library instance to register virtio net device
+ * @param {uintptr_t} bar_addr              Guest physical address of the memory BAR, of 4K and aligned to its size
+ * @param {unsigned int} interrupt_pin      PCI interrupt pin e.g. INTA = 1, INTB = 2 ,...
+ * @param {unsigned int} interrupt_line     PCI interrupt line for virtio net IRQS
+ * @param {struct raw_iface_funcs} backend  Function pointers to backend implementation, shared by the queue pairs
+ * @param {bool} emulate_bar                Emulate read and writes accesses to the PCI device Base Address Registers.
+ * @param {unsigned int} num_queue_pairs    Number of queue pairs, from 1 to VIRTIO_MAX_QUEUE_PAIRS
+ * @return                                  Pointer to an initialised virtio_net_t, NULL if error.
+ */
+virtio_net_t *common_make_virtio_net_modern(vm_t *vm, vmm_pci_space_t *pci, uintptr_t bar_addr,
+                                            unsigned int interrupt_pin, unsigned int interrupt_line,
+                                            struct raw_iface_funcs backend, bool emulate_bar_access,
+                                            unsigned int num_queue_pairs);
+
+#ifdef CONFIG_ARCH_ARM
+/***
+ * @function common_make_virtio_net_mmio(vm, addr, backend, num_queue_pairs)
+ * Initialise a new virtio_net device exposed through a virtio mmio register window rather than virtio-pci, see
+ * `vm_install_virtio_mmio`. The guest is told of the device with `fdt_generate_virtio_mmio_node`, and its interrupt is
+ * raised by the backend's `raw_handleIRQ` as for `common_make_virtio_net_mq`. Only available on ARM.
+ * @param {vm_t *} vm                       A handle to the VM
+ * @param {uintptr_t} addr                  Guest physical address of the register window, aligned to VIRTIO_MMIO_SIZE
+ * @param {struct raw_iface_funcs} backend  Function pointers to backend implementation, shared by the queue pairs
+ * @param {unsigned int} num_queue_pairs    Number of queue pairs, from 1 to VIRTIO_MAX_QUEUE_PAIRS
+ * @return                                  Pointer to an initialised virtio_net_t, NULL if error.
+ */
+virtio_net_t *common_make_virtio_net_mmio(vm_t *vm, uintptr_t addr, struct raw_iface_funcs backend,
+                                          unsigned int num_queue_pairs);
+#endif
+
+/***
+ * @function virtio_net_queue_pair(net, driver)
+ * Find the queue pair served by a backend driver, e.g. from within the backend's `raw_tx`
+ * @param {virtio_net_t *} net              A handle to the virtio net device
+ * @param {struct eth_driver *} driver      Backend driver of a queue pair
+ * @return                                  Index of the queue pair, -1 if the driver belongs to no queue pair of the device
+ */
+int virtio_net_queue_pair(virtio_net_t *net, struct eth_driver *driver);
+
 /***
  * @function virtio_net_default_backend()
  * @return          A struct with a default virtio_net backend. It is the responsibility of the caller to
  *                  update these function pointers with its own custom backend.
  */
 struct raw_iface_funcs virtio_net_default_backend(void);
+
+/***
+ * @function virtio_net_loopback_backend()
+ * A backend without any hardware, which receives every packet the guest transmits straight back into the guest's
+ * receive queue of the same queue pair. The device has the locally administered MAC address 02:00:00:00:00:01. This
+ * measures the cost of the virtio net emulation apart from that of a network driver, see `virtio_net_bench_start`.
+ * Packets are dropped if the guest has no receive buffers. Zero copy transmit is not supported. It is the
+ * responsibility of the caller to set `raw_handleIRQ` to interrupt the guest, as for `virtio_net_default_backend`
+ * @return          A struct with the loopback virtio_net backend
+ */
+struct raw_iface_funcs virtio_net_loopback_backend(void);
+
+/***
+ * @function virtio_net_enable_zero_copy_tx(net, identity_mapped)
+ * Pass the guest's transmit buffers to the backend driver by their guest physical address, rather than copying each
+ * packet into a driver buffer. This is only possible if the backend device can access guest RAM by its guest
+ * physical addresses, either because guest RAM is mapped into the device's IO space (see `vm_guest_add_iospace`) or
+ * because guest RAM is identity mapped. The descriptors of a packet are returned to the guest once the backend
+ * completes its transmit. Without an IO space the device is not confined to guest RAM, so identity mapped guests are
+ * trusted with the device's DMA. Must be called before the guest initialises the device.
+ * @param {virtio_net_t *} net              A handle to the virtio net device
+ * @param {bool} identity_mapped            Guest RAM is identity mapped, guest physical addresses being host physical
+ * @return                                  0 on success, -1 if the VM has no IO space and is not identity mapped
+ */
+int virtio_net_enable_zero_copy_tx(virtio_net_t *net, bool identity_mapped);
+
+/***
+ * @function virtio_net_set_rx_coalescing(net, max_packets)
+ * Coalesce the delivery of received packets, publishing them to the guest's used ring and interrupting the guest
+ * once per batch of up to `max_packets` packets. A batch is delivered early once the guest has no receive buffers
+ * left. To bound the latency of a partial batch, `virtio_net_flush_rx` should be called periodically, e.g. from a
+ * VMM timer at the desired coalescing interval. Interrupts are further suppressed as requested by the guest through
+ * VRING_AVAIL_F_NO_INTERRUPT or its event index. Defaults to 1, delivering each packet as it is received.
+ * @param {virtio_net_t *} net              A handle to the virtio net device
+ * @param {unsigned int} max_packets        Number of packets to batch, from 1 to the size of the virtqueue
+ * @return                                  0 on success, -1 if `max_packets` is out of range
+ */
+int virtio_net_set_rx_coalescing(virtio_net_t *net, unsigned int max_packets);
+
+/***
+ * @function virtio_net_flush_rx(net)
+ * Deliver any received packets held back by rx coalescing to the guest
+ * @param {virtio_net_t *} net              A handle to the virtio net device
+ */
+void virtio_net_flush_rx(virtio_net_t *net);
+
+/***
+ * @function virtio_net_set_tx_coalescing(net, max_packets)
+ * Coalesce the return of transmitted packets, publishing their descriptors to the guest's used ring and
+ * interrupting the guest once per batch of up to `max_packets` completed transmits. This mostly matters for
+ * backends completing transmits asynchronously, each completion otherwise raising an interrupt of its own. A batch
+ * is returned early when the guest next notifies the device, or once most of the guest's tx ring is waiting to be
+ * returned. To bound the latency of a partial batch, `virtio_net_flush_tx` should be called periodically, e.g. from
+ * a VMM timer at the desired coalescing interval. Interrupts are further suppressed as requested by the guest
+ * through VRING_AVAIL_F_NO_INTERRUPT or its event index. Defaults to 1, returning each packet as its transmit
+ * completes.
+ * @param {virtio_net_t *} net              A handle to the virtio net device
+ * @param {unsigned int} max_packets        Number of completed transmits to batch, from 1 to the size of the virtqueue
+ * @return                                  0 on success, -1 if `max_packets` is out of range
+ */
+int virtio_net_set_tx_coalescing(virtio_net_t *net, unsigned int max_packets);
+
+/***
+ * @function virtio_net_flush_tx(net)
+ * Return any transmitted packets held back by tx coalescing to the guest
+ * @param {virtio_net_t *} net              A handle to the virtio net device
+ */
+void virtio_net_flush_tx(virtio_net_t *net);
+
+/***
+ * @function virtio_net_bench_start(net, bench)
+ * Start a benchmark window of a virtio_net device, counting the packets the guest transmits and the interrupts the
+ * device raises until `virtio_net_bench_stop`, alongside the exits of the VM and the time the VMM spends handling
+ * them. The guest drives the traffic, e.g. a packet generator sending to its own address over
+ * `virtio_net_loopback_backend`, and a window is measured for each packet size of interest. Works with any backend
+ * that is not offloaded through `virtio_net_enable_vhost`. To be called from the thread servicing the device
+ * @param {virtio_net_t *} net              A handle to the virtio net device
+ * @param {virtio_net_bench_t *} bench      Measurements populated by the window, owned by the caller
+ * @return                                  0 on success, -1 if a window is already being measured
+ */
+int virtio_net_bench_start(virtio_net_t *net, virtio_net_bench_t *bench);
+
+/***
+ * @function virtio_net_bench_stop(net, elapsed_ns)
+ * Stop the benchmark window of a virtio_net device, completing its measurements
+ * @param {virtio_net_t *} net              A handle to the virtio net device
+ * @param {uint64_t} elapsed_ns             Length of the window in nanoseconds, as measured by the caller's timer
+ * @return                                  0 on success, -1 if no window is being measured
+ */
+int virtio_net_bench_stop(virtio_net_t *net, uint64_t elapsed_ns);
+
+/***
+ * @function virtio_net_print_bench_results(results, num_results)
+ * Print the measurements of benchmark windows to the console as CSV, preceded by a header line naming the columns.
+ * Each window is reported with its average packet size, packets per second, and the VMM ticks, exits and interrupts
+ * per packet
+ * @param {virtio_net_bench_t *} results    Measurements of stopped windows
+ * @param {size_t} num_results              Number of windows
+ */
+void virtio_net_print_bench_results(virtio_net_bench_t *results, size_t num_results);
+
+/***
+ * @function virtio_net_enable_vhost(net, config)
+ * Offload the processing of the device's queues to a backend component, such as a network driver running on another
+ * core, in the style of vhost. The VMM keeps emulating the device's registers and publishes the rings the guest sets
+ * up in the page shared with the backend, along with where guest RAM is mapped in the backend. Guest kicks signal the
+ * backend directly through doorbells on the queue notification registers, and the backend interrupts the guest
+ * through the VMM's notification, without the VMM touching the rings or packets. The device's backend functions are
+ * then no longer used to transmit and receive. Guest RAM must all be registered beforehand and its frames must not
+ * subsequently change, see `vm_ram_share_vspace`. Must be called before the guest initialises the device.
+ * @param {virtio_net_t *} net                      A handle to the virtio net device
+ * @param {virtio_net_vhost_config_t *} config      Backend to offload the queues to
+ * @return                                          0 on success, -1 on error
+ */
+int virtio_net_enable_vhost(virtio_net_t *net, virtio_net_vhost_config_t *config);
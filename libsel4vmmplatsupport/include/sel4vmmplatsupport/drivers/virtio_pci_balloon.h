@@ -0,0 +1,22 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/* Balloon pages are always 4K, whatever the page size of the guest */
+#define VIRTIO_BALLOON_PFN_SHIFT 12
+
+typedef void (*balloon_handle_irq_fn_t)(void *cookie);
+
+struct balloon_passthrough {
+    /* inject the device's interrupt into the guest */
+    balloon_handle_irq_fn_t handleIRQ;
+    void *balloon_data;
+};
+
+typedef int (*balloon_driver_init)(struct balloon_passthrough *driver, ps_io_ops_t io_ops, void *config);
@@ -0,0 +1,56 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Sectors of virtio block devices are always 512 bytes */
+#define VIRTIO_BLK_SECTOR_SIZE 512
+
+/* Request types and statuses, as defined by the virtio spec */
+#ifndef VIRTIO_BLK_T_IN
+#define VIRTIO_BLK_T_IN 0
+#define VIRTIO_BLK_T_OUT 1
+#define VIRTIO_BLK_T_FLUSH 4
+#define VIRTIO_BLK_T_GET_ID 8
+
+#define VIRTIO_BLK_S_OK 0
+#define VIRTIO_BLK_S_IOERR 1
+#define VIRTIO_BLK_S_UNSUPP 2
+#endif
+
+/* A request handed to a block backend. Reads and writes transfer 'len' bytes
+ * between the device sectors starting at 'sector' and 'buf'. Flushes have no
+ * data. Once done, the backend completes the request with 'complete' and a
+ * VIRTIO_BLK_S_* status, either from within 'submit' or at any later point */
+typedef struct blk_request {
+    uint32_t type;
+    uint64_t sector;
+    void *buf;
+    /* device address of 'buf', for backends that transfer with DMA */
+    uintptr_t phys;
+    size_t len;
+    void (*complete)(struct blk_request *req, int status);
+} blk_request_t;
+
+typedef void (*blk_handle_irq_fn_t)(void *cookie);
+/* Start a request. Returns 0 once the request is submitted, or -1 if the
+ * backend cannot take it, which fails the request */
+typedef int (*blk_submit_fn_t)(void *cookie, blk_request_t *req);
+
+struct blk_passthrough {
+    blk_handle_irq_fn_t handleIRQ;
+    blk_submit_fn_t submit;
+    /* size of the device in sectors */
+    uint64_t capacity;
+    bool read_only;
+    void *blk_data;
+};
+
+typedef int (*blk_driver_init)(struct blk_passthrough *driver, ps_io_ops_t io_ops, void *config);
@@ -6,13 +6,29 @@
 
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
+
 typedef void (*console_handle_irq_fn_t)(void *cookie);
 typedef void (*console_putchar_fn_t)(char c);
+/* Write a block of guest output. Used in preference to putchar when set */
+typedef void (*console_write_fn_t)(void *cookie, const char *buf, size_t len);
 
 struct console_passthrough {
     console_handle_irq_fn_t handleIRQ;
     console_putchar_fn_t    putchar;
+    console_write_fn_t      write;
     void                   *console_data;
 };
 
+/* A port of a multiport console, beside the console port given at init */
+struct console_port {
+    /* name the guest finds the port by, e.g. under /dev/virtio-ports, or NULL */
+    const char *name;
+    /* whether the guest is to use the port as a console rather than a plain port */
+    bool console;
+    /* backend of the port */
+    struct console_passthrough backend;
+};
+
 typedef int (*console_driver_init)(struct console_passthrough *driver, ps_io_ops_t io_ops, void *config);
@@ -11,7 +11,14 @@
 #include <platsupport/io.h>
 #include <ethdrivers/raw.h>
 #include <sel4vmmplatsupport/drivers/virtio_pci_console.h>
+#include <sel4vmmplatsupport/drivers/virtio_pci_blk.h>
+#include <sel4vmmplatsupport/drivers/virtio_pci_balloon.h>
+#include <sel4vmmplatsupport/drivers/virtio_pci_vsock.h>
+#include <sel4vmmplatsupport/drivers/virtio_pci_fs.h>
+#include <sel4vmmplatsupport/drivers/virtio_pci_mem.h>
+#include <sel4vmmplatsupport/drivers/virtio_vhost.h>
 #include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_ram.h>
 #include <ethdrivers/virtio/virtio_ring.h>
 #include <ethdrivers/virtio/virtio_pci.h>
 #include <ethdrivers/virtio/virtio_net.h>
@@ -20,20 +27,89 @@
 #define RX_QUEUE 0
 #define TX_QUEUE 1
 
+/* Maximum number of rx/tx queue pairs of a device */
+#define VIRTIO_MAX_QUEUE_PAIRS 8
+/* Queue pairs may be followed by a control queue */
+#define VIRTIO_MAX_QUEUES (VIRTIO_MAX_QUEUE_PAIRS * 2 + 1)
+/* Queues of the queue pair 'pair' */
+#define VIRTIO_RX_QUEUE(pair) ((pair) * 2 + RX_QUEUE)
+#define VIRTIO_TX_QUEUE(pair) ((pair) * 2 + TX_QUEUE)
+
+/* A queue's rings are made up of the descriptor table, the driver area and the device area */
+#define VIRTIO_RING_AREAS 3
+
+/* Maximum number of descriptors gathered from a single descriptor chain */
+#define VIRTIO_MAX_CHAIN_DESCS 64
+
+/* Features beyond the 32 bits of legacy devices, which only the modern
+ * transport can negotiate */
+#ifndef VIRTIO_F_VERSION_1
+#define VIRTIO_F_VERSION_1 32
+#endif
+#ifndef VIRTIO_F_RING_PACKED
+#define VIRTIO_F_RING_PACKED 34
+#endif
+
+/* Packed virtqueue layout, as defined by the virtio 1.1 spec */
+#ifndef VRING_PACKED_DESC_F_AVAIL
+#define VRING_PACKED_DESC_F_AVAIL 7
+#define VRING_PACKED_DESC_F_USED 15
+
+#define VRING_PACKED_EVENT_FLAG_ENABLE 0x0
+#define VRING_PACKED_EVENT_FLAG_DISABLE 0x1
+#define VRING_PACKED_EVENT_FLAG_DESC 0x2
+#define VRING_PACKED_EVENT_F_WRAP_CTR 15
+
+struct vring_packed_desc_event {
+    uint16_t off_wrap;
+    uint16_t flags;
+};
+
+struct vring_packed_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t id;
+    uint16_t flags;
+};
+#endif
+
 typedef enum virtio_pci_devices {
     VIRTIO_NET,
     VIRTIO_CONSOLE,
+    VIRTIO_BLK,
+    VIRTIO_BALLOON,
+    VIRTIO_VSOCK,
+    VIRTIO_FS,
+    VIRTIO_MEM,
 } virtio_pci_devices_t;
 
 typedef struct v_queue {
     int status;
     uint16_t queue;
-    struct vring vring[2];
-    uint16_t queue_size[2];
-    uint32_t queue_pfn[2];
-    uint16_t last_idx[2];
+    /* number of queues provided by the device */
+    uint16_t num_queues;
+    struct vring vring[VIRTIO_MAX_QUEUES];
+    uint16_t queue_size[VIRTIO_MAX_QUEUES];
+    uint32_t queue_pfn[VIRTIO_MAX_QUEUES];
+    /* next position of the avail ring to consume */
+    uint16_t last_idx[VIRTIO_MAX_QUEUES];
+    /* next position of the used ring to publish, as seen by the guest */
+    uint16_t used_idx[VIRTIO_MAX_QUEUES];
+    /* features negotiated with the guest */
+    uint64_t features;
+    /* areas of the rings mapped into the VMM, those that couldn't be are
+     * accessed through guest memory touches */
+    vm_ram_mapping_t ring_maps[VIRTIO_MAX_QUEUES][VIRTIO_RING_AREAS];
 } vqueue_t;
 
+/* A descriptor chain taken from the avail ring */
+typedef struct virtio_chain {
+    /* id the chain is handed back to the guest with */
+    uint16_t id;
+    /* number of ring positions the chain takes up, always 1 with split rings */
+    uint16_t num;
+} virtio_chain_t;
+
 typedef struct virtio_emul {
     /* pointer to internal information */
     void *internal;
@@ -44,25 +120,153 @@ typedef struct virtio_emul {
      * typically this would be due to link coming up
      * meaning that transmits can finally happen */
     void (*notify)(struct virtio_emul *emul);
+    /* device specific handler of guest notifications of a queue. If
+     * NULL, notifications of the tx queue call 'notify' */
+    void (*notify_queue)(struct virtio_emul *emul, unsigned int queue);
     /* device specific io port interface functions*/
     bool (*device_io_in)(struct virtio_emul *emul, unsigned int offset, unsigned int size, unsigned int *result);
     bool (*device_io_out)(struct virtio_emul *emul, unsigned int offset, unsigned int size, unsigned int result);
+    /* queues are rx/tx pairs, with kicks of the rx queues ignored */
+    bool rx_tx_pairs;
+    /* guest physical address of the queue notification register of queue 0, and
+     * the distance between those of consecutive queues, 0 if the queues share a
+     * register. Set by transports whose notifications are MMIO writes, otherwise 0 */
+    uintptr_t notify_addr;
+    unsigned int notify_stride;
+    /* page shared with a backend component processing the queues, see
+     * 'virtio_emul_enable_vhost'. NULL if the queues are processed by the VMM */
+    struct virtio_vhost_shared *vhost;
+    /* notifications of the backend signalled on guest kicks of each queue */
+    seL4_CPtr vhost_kicks[VIRTIO_MAX_QUEUES];
     /* generic virtqueue structure */
     vqueue_t virtq;
     vm_t *vm;
 } virtio_emul_t;
 
-virtio_emul_t *virtio_emul_init(ps_io_ops_t io_ops, int queue_size, vm_t *vm, void *driver,
-                                void *config, virtio_pci_devices_t device);
+virtio_emul_t *virtio_emul_init(ps_io_ops_t io_ops, int queue_size, unsigned int num_queue_pairs, vm_t *vm,
+                                void *driver, void *config, virtio_pci_devices_t device);
+
+/* Point a queue at the rings the guest has set up at the given guest physical
+ * addresses, starting the queue over. 'driver' and 'device' are the avail and
+ * used rings of split queues, or the event suppression structures of packed ones */
+void virtio_emul_queue_setup(virtio_emul_t *emul, unsigned int queue, uintptr_t desc, uintptr_t driver,
+                             uintptr_t device);
+
+/* Offload the processing of the queues to a backend component, publishing the
+ * state the guest sets up in the page 'shared' as laid out in virtio_vhost.h.
+ * The regions of guest RAM in the page are to be filled in by the caller. Guest
+ * kicks of a queue signal 'kicks[queue]', or 'kicks[0]' for queues without a
+ * notification of their own, instead of calling the device's handlers, and the
+ * device no longer touches the rings. Must be enabled before the guest starts
+ * using the device */
+int virtio_emul_enable_vhost(virtio_emul_t *emul, struct virtio_vhost_shared *shared, const seL4_CPtr *kicks,
+                             unsigned int num_kicks);
+
+/* Ring helpers work on both split and packed rings, as negotiated with the
+ * guest. Ring positions are free running counters, which for packed rings
+ * requires power of 2 queue sizes */
+
+/* Whether the guest has made a descriptor chain available at position 'idx' */
+bool ring_avail_ready(virtio_emul_t *emul, unsigned int queue, uint16_t idx);
+
+/* Take the descriptor chain at position 'idx' and gather its buffers into 'iov'.
+ * Returns the number of entries filled in, populating at most 'max_iov' entries,
+ * or 0 if the guest has not made a chain available. 'idx' then advances by 'chain->num' */
+int ring_avail_chain(virtio_emul_t *emul, unsigned int queue, uint16_t idx, virtio_chain_t *chain,
+                     vm_guest_iovec_t *iov, int max_iov);
+
+/* Position of the used ring following the entries published so far */
+uint16_t ring_used_idx(virtio_emul_t *emul, unsigned int queue);
+
+/* Write a used ring entry handing 'chain' back with 'len' bytes written at position 'idx',
+ * without making it visible to the guest. Returns the number of positions the entry takes up */
+uint16_t ring_used_write(virtio_emul_t *emul, unsigned int queue, uint16_t idx, const virtio_chain_t *chain,
+                         uint32_t len);
+
+/* Make the used ring entries up to position 'idx' visible to the guest */
+void ring_used_publish(virtio_emul_t *emul, unsigned int queue, uint16_t idx);
+
+/* Write and publish a single used ring entry */
+void ring_used_add(virtio_emul_t *emul, unsigned int queue, const virtio_chain_t *chain, uint32_t len);
+
+/* Whether the guest wants an interrupt for the used ring moving from 'old_idx'
+ * to 'new_idx', honouring its event index or interrupt suppression flags */
+bool ring_need_interrupt(virtio_emul_t *emul, unsigned int queue, uint16_t old_idx, uint16_t new_idx);
 
-void ring_used_add(virtio_emul_t *emul, struct vring *vring, struct vring_used_elem elem);
+/* Ask the guest to notify once the avail ring passes 'idx', if event index is in use */
+void ring_avail_event_set(virtio_emul_t *emul, unsigned int queue, uint16_t idx);
 
-struct vring_desc ring_desc(virtio_emul_t *emul, struct vring *vring, uint16_t idx);
+/* Ask the guest not to notify of the buffers it adds to a ring. With event
+ * index in use on split rings, this has to be repeated as 'last_idx' advances */
+void ring_avail_notify_disable(virtio_emul_t *emul, unsigned int queue, uint16_t last_idx);
 
-uint16_t ring_avail_idx(virtio_emul_t *emul, struct vring *vring);
+void *net_virtio_emul_init(virtio_emul_t *emul, ps_io_ops_t io_ops, int queue_size, unsigned int num_queue_pairs,
+                           ethif_driver_init driver, void *config);
 
-uint16_t ring_avail(virtio_emul_t *emul, struct vring *vring, uint16_t idx);
+/* Transmit guest descriptor chains directly instead of copying them into
+ * driver buffers. Must be enabled before the guest starts using the device */
+int net_virtio_emul_enable_zero_copy_tx(virtio_emul_t *emul);
 
-void *net_virtio_emul_init(virtio_emul_t *emul, ps_io_ops_t io_ops, ethif_driver_init driver, void *config);
+/* Publish received packets in batches of up to 'max_packets' */
+int net_virtio_emul_set_rx_coalescing(virtio_emul_t *emul, unsigned int max_packets);
+
+/* Publish any received packets held back by rx coalescing */
+void net_virtio_emul_flush_rx(virtio_emul_t *emul);
+
+/* Publish completed transmits in batches of up to 'max_packets' */
+int net_virtio_emul_set_tx_coalescing(virtio_emul_t *emul, unsigned int max_packets);
+
+/* Publish any completed transmits held back by tx coalescing */
+void net_virtio_emul_flush_tx(virtio_emul_t *emul);
 
 void *console_virtio_emul_init(virtio_emul_t *emul, ps_io_ops_t io_ops, console_driver_init driver, void *config);
+
+/* Maximum number of ports of a multiport console. Each has a queue pair of its
+ * own, beside the queue pair of the control queues */
+#define VIRTIO_CONSOLE_MAX_PORTS (VIRTIO_MAX_QUEUE_PAIRS - 1)
+
+/* Offer the guest a multiport console, with 'num_ports' ports following port 0,
+ * the console the device was initialised with. Must be called before the guest
+ * starts using the device */
+int console_virtio_emul_add_ports(virtio_emul_t *emul, const struct console_port *ports, unsigned int num_ports);
+
+/* Hand 'len' bytes of input to the guest on port 0 */
+void virtio_console_putchar(virtio_emul_t *con, char *buf, int len);
+
+/* Hand 'len' bytes of input to the guest on 'port'. Input the guest has no
+ * buffers for is dropped */
+void virtio_console_port_putchar(virtio_emul_t *con, unsigned int port, char *buf, int len);
+
+void *blk_virtio_emul_init(virtio_emul_t *emul, ps_io_ops_t io_ops, blk_driver_init driver, void *config);
+
+void *balloon_virtio_emul_init(virtio_emul_t *emul, ps_io_ops_t io_ops, balloon_driver_init driver, void *config);
+
+/* Ask the guest to give up pages until 'num_pages' 4K pages are in the balloon */
+void balloon_virtio_emul_set_target(virtio_emul_t *emul, uint32_t num_pages);
+
+/* Number of 4K pages the guest reports being in the balloon */
+uint32_t balloon_virtio_emul_get_actual(virtio_emul_t *emul);
+
+void *vsock_virtio_emul_init(virtio_emul_t *emul, ps_io_ops_t io_ops, vsock_driver_init driver, void *config);
+
+/* Maximum number of host ports a vsock device serves */
+#define VIRTIO_VSOCK_MAX_PORTS 16
+
+/* Serve connections of the guest to 'port', laying out the rings to and from
+ * its component. Must be called before the guest starts using the device */
+int vsock_virtio_emul_add_port(virtio_emul_t *emul, const struct vsock_port *port);
+
+void *fs_virtio_emul_init(virtio_emul_t *emul, ps_io_ops_t io_ops, fs_driver_init driver, void *config);
+
+/* Reserve the guest's DAX window of 'size' bytes at guest physical address
+ * 'addr', into which the server's cache is mapped. Without a window the
+ * guest's FUSE_SETUPMAPPING requests fail */
+int fs_virtio_emul_install_dax(virtio_emul_t *emul, uintptr_t addr, size_t size);
+
+void *mem_virtio_emul_init(virtio_emul_t *emul, ps_io_ops_t io_ops, mem_driver_init driver, void *config);
+
+/* Ask the guest to plug or unplug memory until 'size' bytes are plugged */
+void mem_virtio_emul_set_requested(virtio_emul_t *emul, uint64_t size);
+
+/* Number of bytes of memory the guest has plugged */
+uint64_t mem_virtio_emul_get_plugged(virtio_emul_t *emul);
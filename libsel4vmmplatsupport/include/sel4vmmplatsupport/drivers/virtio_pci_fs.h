@@ -0,0 +1,61 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sel4/sel4.h>
+
+/* Size of the tag the guest mounts the file system by */
+#define VIRTIO_FS_TAG_LEN 36
+
+/* Id of requests the server must not reply to, such as FUSE_FORGET */
+#define VIRTIO_FS_MSG_NO_REPLY UINT32_MAX
+
+/* A FUSE request of the guest or a reply of the server, exchanged over the
+ * rings shared with the server (see cross_vm_ring.h). A message takes up as
+ * many consecutive slots as it needs, carrying on from the last slot of the
+ * ring to the first, and is committed whole */
+struct virtio_fs_msg {
+    /* id of the request, given back in its reply */
+    uint32_t id;
+    /* bytes of the FUSE message following, from its in or out header on */
+    uint32_t len;
+    /* of a request, bytes of reply the guest has room for. Of a successful
+     * reply to FUSE_SETUPMAPPING, the page of the cache the file range is
+     * mapped from, the range being laid out contiguously from it */
+    uint32_t arg;
+    uint32_t reserved;
+    uint8_t data[];
+};
+
+typedef void (*fs_handle_irq_fn_t)(void *cookie);
+
+struct fs_passthrough {
+    /* inject the device's interrupt into the guest */
+    fs_handle_irq_fn_t handleIRQ;
+    void *fs_data;
+    /* name the guest mounts the file system by, of up to VIRTIO_FS_TAG_LEN characters */
+    const char *tag;
+    /* dataports shared with the file server holding the rings of requests to
+     * it and of replies from it, which the VMM lays out with slots of
+     * 'slot_size' bytes */
+    void *to_server;
+    size_t to_server_size;
+    void *from_server;
+    size_t from_server_size;
+    uint32_t slot_size;
+    /* signalled on commits to a ring the server is waiting on */
+    seL4_CPtr notification;
+    /* 4K frames of the page cache of the server, mapped into the guest's DAX
+     * window on FUSE_SETUPMAPPING. NULL if the server serves reads by copying */
+    const seL4_CPtr *cache_frames;
+    size_t num_cache_frames;
+};
+
+typedef int (*fs_driver_init)(struct fs_passthrough *driver, ps_io_ops_t io_ops, void *config);
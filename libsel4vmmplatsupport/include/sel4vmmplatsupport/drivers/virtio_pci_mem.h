@@ -0,0 +1,28 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef void (*mem_handle_irq_fn_t)(void *cookie);
+
+struct mem_passthrough {
+    /* inject the device's interrupt into the guest */
+    mem_handle_irq_fn_t handleIRQ;
+    void *mem_data;
+    /* guest physical region the guest plugs memory into, of whole blocks and
+     * aligned to the block size. Kept clear of all other guest RAM and devices */
+    uintptr_t addr;
+    size_t region_size;
+    /* granularity of plugging memory, a power of 2 of at least 4K */
+    size_t block_size;
+    /* NUMA node of the guest the memory belongs to */
+    uint16_t node_id;
+};
+
+typedef int (*mem_driver_init)(struct mem_passthrough *driver, ps_io_ops_t io_ops, void *config);
@@ -0,0 +1,55 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sel4/sel4.h>
+
+/* Messages exchanged with the component serving a port, one per slot of the
+ * port's rings (see cross_vm_ring.h) */
+/* the guest has connected to the port, only sent to the component */
+#define VSOCK_PORT_MSG_CONNECT 0
+/* stream data following the message */
+#define VSOCK_PORT_MSG_DATA 1
+/* the sender will send no more data on the connection */
+#define VSOCK_PORT_MSG_SHUTDOWN 2
+
+struct vsock_port_msg {
+    uint32_t type;
+    /* bytes of data following, within the slot */
+    uint32_t len;
+    uint8_t data[];
+};
+
+typedef void (*vsock_handle_irq_fn_t)(void *cookie);
+
+struct vsock_passthrough {
+    /* inject the device's interrupt into the guest */
+    vsock_handle_irq_fn_t handleIRQ;
+    void *vsock_data;
+    /* context id of the guest, 3 or above */
+    uint64_t guest_cid;
+};
+
+/* A port of the host the guest can connect streams to, served by a component */
+struct vsock_port {
+    /* port number the guest connects to */
+    uint32_t port;
+    /* dataports shared with the component holding the rings to and from it,
+     * which the VMM lays out with slots of 'slot_size' bytes */
+    void *to_component;
+    size_t to_component_size;
+    void *from_component;
+    size_t from_component_size;
+    uint32_t slot_size;
+    /* signalled on commits to a ring the component is waiting on */
+    seL4_CPtr notification;
+};
+
+typedef int (*vsock_driver_init)(struct vsock_passthrough *driver, ps_io_ops_t io_ops, void *config);
@@ -0,0 +1,134 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+/***
+ * @module virtio_vhost.h
+ * Layout of the page shared between a VMM and a backend component that a virtio device's queues are offloaded to,
+ * in the style of vhost. The VMM keeps emulating the device's registers, and publishes in the page the state the
+ * guest sets up through them: the device status, the negotiated features, the rings of each queue and where guest
+ * RAM is mapped in the backend. The backend processes the rings itself, accessing them and the buffers they point to
+ * through its mapping of guest RAM, in parallel with the VMM handling vcpu exits. Guest kicks of a queue signal a
+ * notification of the backend, through a doorbell where the transport allows, and the backend interrupts the guest
+ * by signalling a notification of the VMM that is bound to the device's IRQ. The interface is self contained,
+ * depending on nothing but the compiler's atomic builtins, so that the backend can include it.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#define VIRTIO_VHOST_MAGIC 0x54534856
+/* Queues of a device, matching VIRTIO_MAX_QUEUES of the emulation */
+#define VIRTIO_VHOST_MAX_QUEUES 17
+/* Contiguous regions of guest RAM */
+#define VIRTIO_VHOST_MAX_REGIONS 16
+
+/* Rings of a queue, at guest physical addresses */
+struct virtio_vhost_queue {
+    uint64_t desc;
+    uint64_t driver;
+    uint64_t device;
+    uint16_t num;
+    /* the guest has set the queue up, its rings start over from position 0 */
+    uint16_t ready;
+    uint32_t reserved;
+};
+
+/* A contiguous region of guest RAM and where it is mapped in the backend */
+struct virtio_vhost_region {
+    uint64_t guest_addr;
+    uint64_t size;
+    uint64_t backend_addr;
+};
+
+/* Layout of the shared page, written by the VMM only */
+struct virtio_vhost_shared {
+    uint32_t magic;
+    /* odd whilst the VMM updates the page, and changed by every update */
+    uint32_t seq;
+    /* device status and features, as set by the guest */
+    uint32_t status;
+    uint32_t num_queues;
+    uint64_t features;
+    uint32_t num_regions;
+    uint32_t reserved;
+    struct virtio_vhost_region regions[VIRTIO_VHOST_MAX_REGIONS];
+    struct virtio_vhost_queue queues[VIRTIO_VHOST_MAX_QUEUES];
+};
+
+/***
+ * @function virtio_vhost_update_begin(shared)
+ * Start updating the shared page, done by the VMM. Readers retry until the update is finished
+ * @param {struct virtio_vhost_shared *} shared     The shared page
+ */
+static inline void virtio_vhost_update_begin(struct virtio_vhost_shared *shared)
+{
+    __atomic_store_n(&shared->seq, shared->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/***
+ * @function virtio_vhost_update_end(shared)
+ * Finish updating the shared page, done by the VMM
+ * @param {struct virtio_vhost_shared *} shared     The shared page
+ */
+static inline void virtio_vhost_update_end(struct virtio_vhost_shared *shared)
+{
+    __atomic_store_n(&shared->seq, shared->seq + 1, __ATOMIC_RELEASE);
+}
+
+/***
+ * @function virtio_vhost_read(shared, copy)
+ * Take a consistent copy of the shared page, done by the backend whenever it is kicked or polls for a change of
+ * state. As the page is written by the VMM, the copy is only checked for being consistent, and the addresses it holds
+ * are to be checked against the regions of guest RAM before use, e.g. with 'virtio_vhost_translate'
+ * @param {const struct virtio_vhost_shared *} shared   The shared page
+ * @param {struct virtio_vhost_shared *} copy           Populated with a copy of the page
+ * @return                                              true if the copy is consistent and the page is initialised,
+ *                                                      false if the page is being updated and is to be read again
+ */
+static inline bool virtio_vhost_read(const struct virtio_vhost_shared *shared, struct virtio_vhost_shared *copy)
+{
+    uint32_t seq = __atomic_load_n(&shared->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1) {
+        return false;
+    }
+    memcpy(copy, (const void *)shared, sizeof(*copy));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&shared->seq, __ATOMIC_RELAXED) != seq || copy->magic != VIRTIO_VHOST_MAGIC) {
+        return false;
+    }
+    if (copy->num_regions > VIRTIO_VHOST_MAX_REGIONS) {
+        copy->num_regions = VIRTIO_VHOST_MAX_REGIONS;
+    }
+    if (copy->num_queues > VIRTIO_VHOST_MAX_QUEUES) {
+        copy->num_queues = VIRTIO_VHOST_MAX_QUEUES;
+    }
+    return true;
+}
+
+/***
+ * @function virtio_vhost_translate(copy, guest_addr, size)
+ * Find the backend address of a range of guest RAM, such as a ring or a buffer of a descriptor
+ * @param {const struct virtio_vhost_shared *} copy     Copy of the shared page taken with 'virtio_vhost_read'
+ * @param {uint64_t} guest_addr                         Guest physical address of the range
+ * @param {uint64_t} size                               Size of the range in bytes
+ * @return                                              Address of the range in the backend, NULL if the range is not
+ *                                                      entirely within a region of guest RAM
+ */
+static inline void *virtio_vhost_translate(const struct virtio_vhost_shared *copy, uint64_t guest_addr, uint64_t size)
+{
+    for (uint32_t i = 0; i < copy->num_regions; i++) {
+        const struct virtio_vhost_region *region = &copy->regions[i];
+        if (guest_addr >= region->guest_addr && guest_addr - region->guest_addr <= region->size &&
+            size <= region->size - (guest_addr - region->guest_addr)) {
+            return (void *)(uintptr_t)(region->backend_addr + (guest_addr - region->guest_addr));
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,90 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+/***
+ * @module virtio_vsock.h
+ * This interface provides the ability to initialise a VMM virtio vsock device, through which the guest connects
+ * AF_VSOCK stream sockets to ports of the host (context id 2). Each port is served by a seL4 component, the stream
+ * data of a connection being passed to and from the component over a pair of single-producer, single-consumer rings
+ * laid out in dataports shared with it (see `cross_vm_ring.h`), one message of `struct vsock_port_msg` per slot. The
+ * component is told of the guest connecting to and shutting down a connection by messages of their own. Flow control
+ * follows the credit scheme of virtio vsock: the guest may send as much as the ring to the component holds, being
+ * told of the space the component makes as it consumes, and data from the component is only sent to the guest as its
+ * receive buffers allow, otherwise staying in the ring. Notifications are batched: the VMM signals a component once
+ * per pass over the device, and only if the component is waiting on one of its rings, and the component signals the
+ * VMM, which then calls `virtio_vsock_poll`, only if the VMM is waiting. Guest packets are handled in order, so a
+ * component that stops consuming holds up the guest's packets for other ports. A port serves a single connection
+ * at a time, a new connection of the guest replacing the last.
+ */
+
+#include <sel4vm/guest_vm.h>
+
+#include <sel4vmmplatsupport/drivers/pci.h>
+#include <sel4vmmplatsupport/drivers/virtio_pci_emul.h>
+
+/***
+ * @struct virtio_vsock
+ * Virtio Vsock Driver Interface
+ * @param {virtio_emul_t *} emul                            Virtio vsock emulation interface: VMM <-> Guest
+ * @param {struct vsock_passthrough} emul_driver_funcs      Virtio vsock backend functions: VMM <-> Backend
+ */
+typedef struct virtio_vsock {
+    virtio_emul_t *emul;
+    struct vsock_passthrough emul_driver_funcs;
+} virtio_vsock_t;
+
+/***
+ * @function common_make_virtio_vsock(vm, pci, bar_addr, interrupt_pin, interrupt_line, backend, emulate_bar_access)
+ * Initialise a new virtio_vsock device, exposed to the guest as a modern (virtio 1.0) PCI device as virtio vsock has
+ * no legacy interface. Its registers are in a memory BAR, see `common_make_virtio_net_modern`. The device serves no
+ * ports until they are added with `virtio_vsock_add_port`.
+ * @param {vm_t *} vm                               Handle to the VM
+ * @param {vmm_pci_space_t *} pci                   PCI library instance to register virtio vsock device
+ * @param {uintptr_t} bar_addr                      Guest physical address of the memory BAR, of 4K and aligned to its size
+ * @param {unsigned int} interrupt_pin              PCI interrupt pin e.g. INTA = 1, INTB = 2 ,...
+ * @param {unsigned int} interrupt_line             PCI interrupt line for virtio vsock IRQS
+ * @param {struct vsock_passthrough} backend        Backend injecting the device's interrupt, and the guest's context id
+ * @param {bool} emulate_bar_access                 Emulate read and writes accesses to the PCI device Base Address Registers.
+ * @return                                          Pointer to an initialised virtio_vsock_t, NULL if error.
+ */
+virtio_vsock_t *common_make_virtio_vsock(vm_t *vm, vmm_pci_space_t *pci, uintptr_t bar_addr,
+                                         unsigned int interrupt_pin, unsigned int interrupt_line,
+                                         struct vsock_passthrough backend, bool emulate_bar_access);
+
+#ifdef CONFIG_ARCH_ARM
+/***
+ * @function common_make_virtio_vsock_mmio(vm, addr, backend)
+ * Initialise a new virtio_vsock device exposed through a virtio mmio register window rather than virtio-pci, see
+ * `vm_install_virtio_mmio`. The guest is told of the device with `fdt_generate_virtio_mmio_node`. Only available on ARM.
+ * @param {vm_t *} vm                               Handle to the VM
+ * @param {uintptr_t} addr                          Guest physical address of the register window
+ * @param {struct vsock_passthrough} backend        Backend injecting the device's interrupt, and the guest's context id
+ * @return                                          Pointer to an initialised virtio_vsock_t, NULL if error.
+ */
+virtio_vsock_t *common_make_virtio_vsock_mmio(vm_t *vm, uintptr_t addr, struct vsock_passthrough backend);
+#endif
+
+/***
+ * @function virtio_vsock_add_port(vsock, port)
+ * Serve guest connections to a port of the host with a component, laying out the rings to and from the component in
+ * the dataports given. The component attaches to the rings with `crossvm_ring_attach` once they are laid out, as the
+ * consumer of the ring to it and the producer of the ring from it. Must be called before the guest starts using the
+ * device.
+ * @param {virtio_vsock_t *} vsock                  Handle to the vsock device
+ * @param {const struct vsock_port *} port          Port to serve, and the rings and notification of its component
+ * @return                                          0 on success, -1 if the port is already served, VIRTIO_VSOCK_MAX_PORTS
+ *                                                  are served or the rings do not fit in the dataports
+ */
+int virtio_vsock_add_port(virtio_vsock_t *vsock, const struct vsock_port *port);
+
+/***
+ * @function virtio_vsock_poll(vsock)
+ * Move data between the guest and the components of the device's ports, to be called when a component signals the VMM
+ * @param {virtio_vsock_t *} vsock                  Handle to the vsock device
+ */
+void virtio_vsock_poll(virtio_vsock_t *vsock);
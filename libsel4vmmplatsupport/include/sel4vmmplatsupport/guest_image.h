@@ -66,3 +66,23 @@ int vm_load_guest_kernel(vm_t *vm, const char *kernel_name, uintptr_t load_addre
  */
 int vm_load_guest_module(vm_t *vm, const char *module_name, uintptr_t load_address, size_t alignment,
                          guest_image_t *guest_image);
+
+/***
+ * @function vm_map_guest_module(vm, frames, num_frames, frame_size_bits, size, load_address, writable, guest_image)
+ * Boot a guest module (e.g. initrd) in place, by mapping the frames it already sits in, such as those of a dataport,
+ * into the guest at the load address rather than copying it into guest RAM. The frames are registered as a region
+ * of guest RAM of their own, so the load address must not lie within RAM that is already registered. A read only
+ * module is mapped without write rights, and the guest faults if it writes to it. A writable module is given to
+ * the guest, which may then modify or reclaim it
+ * @param {vm_t *} vm                           Handle to the VM
+ * @param {seL4_CPtr *} frames                  Caps to the frames holding the module, in order
+ * @param {int} num_frames                      Number of frames in `frames`
+ * @param {size_t} frame_size_bits              Size bits of each of the frames
+ * @param {size_t} size                         Size of the module
+ * @param {uintptr_t} load_address              Address to map the module at, aligned to the frame size
+ * @param {bool} writable                       Whether the guest may write to the module
+ * @param {guest_image_t *} guest_image         Handle to information regarding the resulted loading of the guest module image
+ * @return                                      0 on success, otherwise -1 on error
+ */
+int vm_map_guest_module(vm_t *vm, seL4_CPtr *frames, int num_frames, size_t frame_size_bits, size_t size,
+                        uintptr_t load_address, bool writable, guest_image_t *guest_image);
@@ -39,7 +39,9 @@ void *create_device_reservation_frame(vm_t *vm, uintptr_t addr, seL4_CapRights_t
                                       memory_fault_callback_fn fault_callback, void *fault_cookie);
 /***
  * @function map_ut_alloc_reservation_with_base_paddr(vm, paddr, reservation)
- * Map a guest reservation backed with untyped frames allocated from a base paddr
+ * Map a guest reservation backed with untyped frames allocated from a base paddr. With LIB_SEL4VM_LARGE_FRAMES enabled,
+ * parts of the reservation whose guest and physical addresses share the alignment of a large (or huge) page are backed
+ * by large frames, and the unaligned edges by 4K frames, unless the VM has IO spaces
  * @param {vm_t *} vm                               A handle to the VM
  * @param {uintptr_t} paddr                         Base paddr to allocate from
  * @param {vm_memory_reservation_t *} reservation   Pointer to reservation object being mapped
@@ -0,0 +1,226 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+/***
+ * @module guest_migration.h
+ * This interface provides pre-copy live migration of a VM to a VMM on another node. The source VMM streams records
+ * describing the VM into a single-producer, single-consumer ring laid out in a dataport shared with a network
+ * component (see `cross_vm_ring.h`), which relays the stream to the network component of the destination VMM, where it
+ * is written into a ring the destination VMM consumes. Whilst the guest keeps running, the source sends all of its
+ * allocated RAM, then in further rounds the pages the guest has written to since the last round, using the dirty log of
+ * `vm_ram_dirty_log_enable`. Pages that are entirely zero are sent as a bare header, and are not sent at all in the
+ * first round, and other pages are run length encoded where that makes them smaller. Once the set of dirty pages is
+ * small, or after a given number of rounds, the VMM stops the guest's vcpus, and the pages dirtied in the meantime are
+ * sent along with the state of each vcpu and that of the devices registered for migration. Interrupt controllers and
+ * emulated devices take part by registering handlers saving and loading their state. The destination VM is set up the
+ * same way as the source, with the same RAM registered, vcpus created and devices registered in the same order, and is
+ * not started until the stream has been received in full.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sel4/sel4.h>
+#include <sel4vm/guest_vm.h>
+
+#define VM_MIGRATION_MAGIC 0x4d47494d
+#define VM_MIGRATION_VERSION 1
+/* Size of a device's name, including the terminating NUL */
+#define VM_MIGRATION_DEVICE_NAME_LEN 16
+/* Largest state a device can save */
+#define VM_MIGRATION_MAX_DEVICE_STATE 0x4000
+/* Largest payload of a record, which the rings have to have room for */
+#define VM_MIGRATION_MAX_RECORD_DATA (VM_MIGRATION_DEVICE_NAME_LEN + VM_MIGRATION_MAX_DEVICE_STATE)
+
+/* Types of the records of a migration stream, in the order they are sent */
+enum vm_migration_record_type {
+    /* data: struct vm_migration_header */
+    VM_MIGRATION_RECORD_HEADER = 1,
+    /* arg: guest physical address. data: the 4K page */
+    VM_MIGRATION_RECORD_PAGE,
+    /* arg: guest physical address. data: the 4K page, run length encoded */
+    VM_MIGRATION_RECORD_PAGE_RLE,
+    /* arg: guest physical address of a 4K page now entirely zero. No data */
+    VM_MIGRATION_RECORD_PAGE_ZERO,
+    /* arg: vcpu id. data: architecture specific register state */
+    VM_MIGRATION_RECORD_VCPU,
+    /* data: the device's name, VM_MIGRATION_DEVICE_NAME_LEN bytes, followed by its state */
+    VM_MIGRATION_RECORD_DEVICE,
+    /* the stream is complete. No data */
+    VM_MIGRATION_RECORD_END,
+};
+
+/* A record of a migration stream. A record takes up as many consecutive slots
+ * of a ring as it needs, carrying on from the last slot of the ring to the
+ * first, and is committed whole */
+struct vm_migration_record {
+    uint32_t type;
+    /* bytes of data following */
+    uint32_t len;
+    uint64_t arg;
+    uint8_t data[];
+};
+
+/* A contiguous region of allocated guest RAM */
+struct vm_migration_region {
+    uint64_t start;
+    uint64_t size;
+};
+
+/* First record of a stream */
+struct vm_migration_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_vcpus;
+    uint32_t num_regions;
+    struct vm_migration_region regions[];
+};
+
+/* A page is run length encoded as a sequence of runs, each being a run of
+ * 'zeros' zero words followed by 'literals' words given after the run, until
+ * the page's 512 64-bit words are covered */
+struct vm_migration_rle_run {
+    uint16_t zeros;
+    uint16_t literals;
+};
+
+/***
+ * @function vm_migration_save_fn(cookie, buf, size, len)
+ * Save the state of a device on the source, called once the VM has stopped
+ * @param {void *} cookie       Cookie the device was registered with
+ * @param {void *} buf          Buffer to save the state into
+ * @param {size_t} size         Size of the buffer, VM_MIGRATION_MAX_DEVICE_STATE
+ * @param {size_t *} len        Set to the number of bytes of state saved
+ * @return                      0 on success, -1 on error
+ */
+typedef int (*vm_migration_save_fn)(void *cookie, void *buf, size_t size, size_t *len);
+
+/***
+ * @function vm_migration_load_fn(cookie, buf, len)
+ * Load the state of a device on the destination, as saved by the device on the source. The state is received from the
+ * network, and so is to be validated before use
+ * @param {void *} cookie       Cookie the device was registered with
+ * @param {const void *} buf    The saved state
+ * @param {size_t} len          Number of bytes of state
+ * @return                      0 on success, -1 on error
+ */
+typedef int (*vm_migration_load_fn)(void *cookie, const void *buf, size_t len);
+
+/***
+ * @struct vm_migration_stats
+ * Counters of a migration, on either side
+ * @param {size_t} rounds               Number of rounds of pre-copying RAM completed
+ * @param {size_t} pages                Number of pages sent or received in full
+ * @param {size_t} rle_pages            Number of pages sent or received run length encoded
+ * @param {size_t} zero_pages           Number of zero pages sent or received as a bare header
+ * @param {size_t} elided_pages         Number of zero pages not sent at all
+ * @param {size_t} last_round_pages     Number of pages dirtied during the last round
+ * @param {uint64_t} bytes              Number of bytes of records sent or received
+ */
+typedef struct vm_migration_stats {
+    size_t rounds;
+    size_t pages;
+    size_t rle_pages;
+    size_t zero_pages;
+    size_t elided_pages;
+    size_t last_round_pages;
+    uint64_t bytes;
+} vm_migration_stats_t;
+
+/* Progress of a migration, as returned by 'vm_migration_send' and 'vm_migration_receive' */
+typedef enum vm_migration_status {
+    /* the migration failed, and the stream is to be abandoned */
+    VM_MIGRATION_FAILED = -1,
+    /* the ring is full or empty, to be called again once the network component signals the VMM */
+    VM_MIGRATION_WAIT,
+    /* source: a round has ended and the set of dirty pages is small, or the rounds are used up. The guest is to be
+     * stopped and 'vm_migration_stop' called. Pre-copying carries on if 'vm_migration_send' is called instead */
+    VM_MIGRATION_CONVERGED,
+    /* the stream has been sent or received in full. The destination VM can be started */
+    VM_MIGRATION_DONE,
+} vm_migration_status_t;
+
+typedef struct vm_migration vm_migration_t;
+
+/***
+ * @function vm_migration_init(vm, ring, ring_size, slot_size, notification, source)
+ * Initialise the migration of a VM, laying out the ring shared with the network component in its dataport. The ring
+ * has to have room for the largest record, of VM_MIGRATION_MAX_RECORD_DATA bytes of data
+ * @param {vm_t *} vm                   A handle to the VM
+ * @param {void *} ring                 Dataport shared with the network component
+ * @param {size_t} ring_size            Size of the dataport in bytes
+ * @param {uint32_t} slot_size          Size of each slot of the ring in bytes, a multiple of 8 of at least 16
+ * @param {seL4_CPtr} notification      Notification of the network component, signalled on commits it is waiting on
+ * @param {bool} source                 Whether this is the source of the migration, which produces the stream, rather
+ *                                      than the destination, which consumes it
+ * @return                              Pointer to the migration, NULL on error
+ */
+vm_migration_t *vm_migration_init(vm_t *vm, void *ring, size_t ring_size, uint32_t slot_size, seL4_CPtr notification,
+                                  bool source);
+
+/***
+ * @function vm_migration_register_device(migration, name, save, load, cookie)
+ * Register a device whose state is sent once the VM has stopped, on both the source and the destination
+ * @param {vm_migration_t *} migration      The migration
+ * @param {const char *} name               Name of the device, unique to the VM, of less than VM_MIGRATION_DEVICE_NAME_LEN characters
+ * @param {vm_migration_save_fn} save       Called on the source to save the state of the device
+ * @param {vm_migration_load_fn} load       Called on the destination to load the state of the device
+ * @param {void *} cookie                   Cookie passed to the handlers
+ * @return                                  0 on success, -1 on error
+ */
+int vm_migration_register_device(vm_migration_t *migration, const char *name, vm_migration_save_fn save,
+                                 vm_migration_load_fn load, void *cookie);
+
+/***
+ * @function vm_migration_start(migration, max_rounds, stop_pages)
+ * Source: start logging the pages of allocated guest RAM the guest writes to, and start the first round of sending
+ * RAM. No RAM can be registered or allocated from here on
+ * @param {vm_migration_t *} migration      The migration
+ * @param {size_t} max_rounds               Number of rounds after which the migration converges regardless
+ * @param {size_t} stop_pages               Number of dirty pages at the end of a round at or below which the migration converges
+ * @return                                  0 on success, -1 on error
+ */
+int vm_migration_start(vm_migration_t *migration, size_t max_rounds, size_t stop_pages);
+
+/***
+ * @function vm_migration_send(migration)
+ * Source: send as much of the stream as fits in the ring, to be called after 'vm_migration_start' and again whenever
+ * the network component signals the VMM, with the guest running until the migration has converged
+ * @param {vm_migration_t *} migration      The migration
+ * @return                                  Progress of the migration
+ */
+vm_migration_status_t vm_migration_send(vm_migration_t *migration);
+
+/***
+ * @function vm_migration_stop(migration)
+ * Source: move on to the last round, once the caller has stopped all the vcpus of the VM. The remaining dirty pages,
+ * the state of the vcpus and devices are then sent by 'vm_migration_send'. The VM is not to be resumed unless the
+ * migration fails
+ * @param {vm_migration_t *} migration      The migration
+ * @return                                  0 on success, -1 on error
+ */
+int vm_migration_stop(vm_migration_t *migration);
+
+/***
+ * @function vm_migration_receive(migration)
+ * Destination: apply the records available in the ring to the VM, to be called whenever the network component
+ * signals the VMM. The guest RAM of the VM must not have been written to before the migration, as zero pages of the
+ * first round are not sent
+ * @param {vm_migration_t *} migration      The migration
+ * @return                                  Progress of the migration
+ */
+vm_migration_status_t vm_migration_receive(vm_migration_t *migration);
+
+/***
+ * @function vm_migration_get_stats(migration, stats)
+ * Get the counters of a migration
+ * @param {vm_migration_t *} migration      The migration
+ * @param {vm_migration_stats_t *} stats    Populated with the counters
+ */
+void vm_migration_get_stats(vm_migration_t *migration, vm_migration_stats_t *stats);
@@ -0,0 +1,33 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+/***
+ * @module guest_mmio_batch_call.h
+ * The guest MMIO batch call interface exposes `vm_mmio_batch_run` to the guest as a hypercall, for paravirtual
+ * drivers to program the registers of emulated devices with a single exit. The guest passes the guest physical
+ * address of an array of `vm_mmio_batch_op_t` and the number of accesses in it, and gets back the number of accesses
+ * run, or -1 if the array could not be accessed. The values read are written back into the array.
+ */
+
+#include <sel4vm/guest_vm.h>
+
+/* Token of the x86 vmcall running a batch, with the address of the array in EBX and the number of accesses in ECX.
+ * The result is returned in EAX */
+#define VM_MMIO_BATCH_VMCALL_TOKEN 0x4d4d4942
+/* Function id of the ARM HVC or SMC running a batch, with the address of the array in the first argument register
+ * and the number of accesses in the second. The result is returned in the function id register. A fast, 32 bit,
+ * vendor specific hypervisor service call */
+#define VM_MMIO_BATCH_SMC_FUNC_ID 0x86000101
+
+/***
+ * @function vm_install_mmio_batch_call(vm)
+ * Install the MMIO batch hypercall into a VM
+ * @param {vm_t *} vm       A handle to the VM
+ * @return                  0 on success, -1 on error
+ */
+int vm_install_mmio_batch_call(vm_t *vm);
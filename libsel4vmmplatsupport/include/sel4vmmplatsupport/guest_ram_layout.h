@@ -0,0 +1,131 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <sel4vm/guest_vm.h>
+
+/***
+ * @module guest_ram_layout.h
+ * The guest ram layout interface plans the guest physical address space of a VM, placing its RAM around the MMIO
+ * holes of the platform such that as much of the RAM as possible is aligned to large pages, and can be backed by
+ * large (or huge) frames when LIB_SEL4VM_LARGE_FRAMES is enabled. A layout is built by adding the fixed holes of the
+ * platform (e.g. the BIOS area, IOAPIC and LAPIC on x86, or the devices passed through on ARM), then placing the MMIO
+ * windows whose address is up to the VMM (e.g. the vPCI window and cross-VM BARs), and last planning the RAM in the
+ * space that is left. The planned RAM is registered with the VM, from which the e820 map or DT memory nodes of the
+ * guest are generated as before.
+ */
+
+#define VM_RAM_LAYOUT_MAX_REGIONS 32
+
+/***
+ * @struct vm_ram_layout_region
+ * A region of guest physical memory
+ * @param {uintptr_t} start         Guest physical address of the region
+ * @param {size_t} size             Size of the region in bytes
+ */
+typedef struct vm_ram_layout_region {
+    uintptr_t start;
+    size_t size;
+} vm_ram_layout_region_t;
+
+/***
+ * @struct vm_ram_layout
+ * A plan of the guest physical address space of a VM
+ * @param {uintptr_t} base                                              Lowest guest physical address RAM is placed at
+ * @param {uintptr_t} limit                                             Guest physical address RAM and holes are placed below
+ * @param {int} num_holes                                               Number of holes
+ * @param {vm_ram_layout_region_t} holes[VM_RAM_LAYOUT_MAX_REGIONS]     MMIO holes RAM is kept out of, in order of address
+ * @param {int} num_ram                                                 Number of RAM regions planned
+ * @param {vm_ram_layout_region_t} ram[VM_RAM_LAYOUT_MAX_REGIONS]       Planned RAM regions, in order of address
+ */
+typedef struct vm_ram_layout {
+    uintptr_t base;
+    uintptr_t limit;
+    int num_holes;
+    vm_ram_layout_region_t holes[VM_RAM_LAYOUT_MAX_REGIONS];
+    int num_ram;
+    vm_ram_layout_region_t ram[VM_RAM_LAYOUT_MAX_REGIONS];
+} vm_ram_layout_t;
+
+/***
+ * @struct vm_ram_layout_coverage
+ * How much of the planned RAM of a layout can be backed by large frames. The guest physical alignment is only half
+ * of it, whether a large frame is used also depends on the host memory backing the RAM
+ * @param {size_t} ram_size         Bytes of RAM planned
+ * @param {size_t} large_size       Bytes of RAM within large pages lying entirely in a RAM region
+ * @param {size_t} huge_size        Bytes of RAM within huge pages lying entirely in a RAM region, 0 without huge pages
+ */
+typedef struct vm_ram_layout_coverage {
+    size_t ram_size;
+    size_t large_size;
+    size_t huge_size;
+} vm_ram_layout_coverage_t;
+
+/***
+ * @function vm_ram_layout_init(layout, base, limit)
+ * Initialise an empty layout
+ * @param {vm_ram_layout_t *} layout    Layout to initialise
+ * @param {uintptr_t} base              Lowest guest physical address RAM is placed at
+ * @param {uintptr_t} limit             Guest physical address RAM and holes are placed below
+ * @return                              0 on success, -1 on error
+ */
+int vm_ram_layout_init(vm_ram_layout_t *layout, uintptr_t base, uintptr_t limit);
+
+/***
+ * @function vm_ram_layout_add_hole(layout, start, size)
+ * Keep a fixed region of guest physical memory out of the planned RAM. Overlapping holes are merged. Holes must be
+ * added before the RAM is planned
+ * @param {vm_ram_layout_t *} layout    Layout to add the hole to
+ * @param {uintptr_t} start             Guest physical address of the hole
+ * @param {size_t} size                 Size of the hole in bytes
+ * @return                              0 on success, -1 on error
+ */
+int vm_ram_layout_add_hole(vm_ram_layout_t *layout, uintptr_t start, size_t size);
+
+/***
+ * @function vm_ram_layout_place_hole(layout, size, align_bits, start)
+ * Place a hole for an MMIO window the VMM is free to choose the address of, at the highest aligned address it fits
+ * below the limit of the layout. Placing windows above the RAM leaves the RAM in one piece
+ * @param {vm_ram_layout_t *} layout    Layout to place the hole in
+ * @param {size_t} size                 Size of the hole in bytes
+ * @param {size_t} align_bits           Alignment of the hole
+ * @param {uintptr_t *} start           Set with the guest physical address of the hole
+ * @return                              0 on success, -1 if the hole does not fit
+ */
+int vm_ram_layout_place_hole(vm_ram_layout_t *layout, size_t size, size_t align_bits, uintptr_t *start);
+
+/***
+ * @function vm_ram_layout_plan(layout, ram_size)
+ * Plan the RAM of a layout. RAM is placed in the large page aligned parts of the space between holes first, lowest
+ * first, and only falls back onto the unaligned edges around the holes once those are used up
+ * @param {vm_ram_layout_t *} layout    Layout to plan the RAM of
+ * @param {size_t} ram_size             Bytes of RAM to place, rounded up to a multiple of 4K
+ * @return                              0 on success, -1 if the RAM does not fit
+ */
+int vm_ram_layout_plan(vm_ram_layout_t *layout, size_t ram_size);
+
+/***
+ * @function vm_ram_layout_get_coverage(layout, coverage)
+ * Report how much of the planned RAM of a layout can be backed by large and huge frames
+ * @param {vm_ram_layout_t *} layout                Planned layout
+ * @param {vm_ram_layout_coverage_t *} coverage     Set with the coverage of the RAM
+ */
+void vm_ram_layout_get_coverage(vm_ram_layout_t *layout, vm_ram_layout_coverage_t *coverage);
+
+/***
+ * @function vm_ram_layout_register(vm, layout, untyped)
+ * Register the planned RAM of a layout with a VM (see 'vm_ram_register_at')
+ * @param {vm_t *} vm                   A handle to the VM
+ * @param {vm_ram_layout_t *} layout    Planned layout
+ * @param {bool} untyped                Allocate the RAM from untyped memory
+ * @return                              0 on success, -1 on error
+ */
+int vm_ram_layout_register(vm_t *vm, vm_ram_layout_t *layout, bool untyped);
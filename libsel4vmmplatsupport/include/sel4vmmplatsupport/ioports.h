@@ -70,12 +70,15 @@ typedef struct ioport_entry {
  * @param {int} num_ioports         Total number of registered ioports
  * @param {ioport_entry_t **}       List of registered ioport objects
  * @param {uint16_t} alloc_addr      Base ioport address we can safely bump allocate from, used when registering ioport handlers of type 'IOPORT_FREE'
+ * @param {uint16_t *} port_map     Map of each ioport address to (index + 1) of its entry in 'ioports', 0 if unhandled
  */
 typedef struct vmm_io_list {
     int num_ioports;
-    /* Sorted list of ioport functions */
+    /* List of ioport functions, in registration order */
     ioport_entry_t **ioports;
     uint16_t alloc_addr;
+    /* Direct map of ioport addresses to handler ids, allocated on the first handler registration */
+    uint16_t *port_map;
 } vmm_io_port_list_t;
 
 /***
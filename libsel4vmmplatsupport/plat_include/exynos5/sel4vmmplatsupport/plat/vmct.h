@@ -6,7 +6,58 @@
 
 #pragma once
 
+#include <stdint.h>
+
 #include <sel4vm/guest_vm.h>
 
+/* Global comparators and local timers of the MCT */
+#define VMCT_NUM_COMPARATORS 4
+#define VMCT_NUM_LOCAL_TIMERS 4
+
 extern const struct device dev_vmct_timer;
-int vm_install_vmct(vm_t *vm);
+
+struct vmct_priv;
+
+/**
+ * Host timer a virtual MCT is driven by, and the guest IRQs it raises
+ */
+struct vmct_config {
+    /* Current value of a free running host counter ticking at the rate of
+     * the MCT's input clock, such as the architected timer's counter */
+    uint64_t (*get_count)(void *cookie);
+    /* Arrange for vm_vmct_handle_timer to be called once the host counter
+     * reaches 'count'. Each call replaces the previous deadline, a deadline
+     * of UINT64_MAX cancels it */
+    int (*set_deadline)(uint64_t count, void *cookie);
+    void *cookie;
+    /* Guest IRQs of each global comparator and local timer, -1 for none */
+    int global_irqs[VMCT_NUM_COMPARATORS];
+    int local_irqs[VMCT_NUM_LOCAL_TIMERS];
+};
+
+/**
+ * Installs a fully emulated MCT, for when the kernel does not export the
+ * MCT to be passed through. The registers are kept in a frame mapped read
+ * only into the guest, such that register reads, including those of the
+ * free running counter, are served without a fault. Writes fault and are
+ * emulated. The counter in the frame is brought up to date on every write,
+ * and every call to vm_vmct_handle_timer, which the VMM can additionally
+ * call periodically to refresh it. Guests should use the architected timer
+ * as their clocksource and the MCT for clock events. Comparators and local
+ * timers interrupt through the deadline of the host timer. The local free
+ * running counters and the prescaler are not emulated. Must be called once
+ * the boot vcpu has been created
+ * @param[in] vm      The VM in which to install the device
+ * @param[in] config  Host timer and guest IRQs of the device
+ * @param[out] vmct   Handle to the device, for delivering timer expiries
+ * @return            0 on success
+ */
+int vm_install_vmct(vm_t *vm, const struct vmct_config *config, struct vmct_priv **vmct);
+
+/**
+ * Handles the expiry of the host timer deadline of a virtual MCT, raising
+ * the interrupts of the comparators and local timers that have expired and
+ * setting the next deadline. Called from the VMM's notification handler
+ * @param[in] vmct  Handle to the device
+ */
+void vm_vmct_handle_timer(struct vmct_priv *vmct);
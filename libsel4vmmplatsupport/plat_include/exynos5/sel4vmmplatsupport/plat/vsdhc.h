@@ -10,5 +10,13 @@
 
 const struct device dev_msh0;
 const struct device dev_msh2;
+/* Install an SDHC whose registers the guest reads directly and whose register
+ * writes are trapped and passed on, with the guest denied DMA */
 int vm_install_nodma_sdhc0(vm_t *vm);
 int vm_install_nodma_sdhc2(vm_t *vm);
+/* Install an SDHC as above, with the guest's internal DMA controller descriptors
+ * translated into a ring of the VMM's, checking that each buffer is guest RAM.
+ * Descriptors are translated on poll demand and data command writes, and given
+ * back to the guest on writes to the IDMAC status register */
+int vm_install_dma_sdhc0(vm_t *vm);
+int vm_install_dma_sdhc2(vm_t *vm);
@@ -14,6 +14,8 @@ extern const struct device dev_uart1;
 extern const struct device dev_uart2;
 extern const struct device dev_uart3;
 
+struct vuart_priv;
+
 /**
  * Installs a UART device which provides access to FIFO and IRQ
  * control registers, but prevents access to configuration registers
@@ -31,3 +33,25 @@ int vm_install_ac_uart(vm_t *vm, const struct device *d);
  * @return       0 on success
  */
 int vm_install_vconsole(vm_t *vm);
+
+/**
+ * Installs the default console device with its output deferred. Characters
+ * written to the console are put on a ring without waiting for them to be
+ * printed, to be printed by vm_vconsole_drain, such as from a lower priority
+ * thread than the VM's vcpus. Characters written while the ring is full are
+ * dropped, and the number dropped is printed by the next drain
+ * @param[in] vm         The VM in which to install the vconsole device
+ * @param[in] ring_size  Size of the output ring in bytes, a power of 2
+ * @param[out] console   Handle to the console, for draining it
+ * @return               0 on success
+ */
+int vm_install_vconsole_deferred(vm_t *vm, size_t ring_size, struct vuart_priv **console);
+
+/**
+ * Prints the output waiting on the ring of a console installed with
+ * vm_install_vconsole_deferred. Safe to call from a different thread to
+ * the one handling the VM's faults, though only from one thread at a time
+ * @param[in] console  Handle to the console
+ * @return             Number of characters taken from the ring
+ */
+size_t vm_vconsole_drain(struct vuart_priv *console);
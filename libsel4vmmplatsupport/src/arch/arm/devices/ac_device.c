@@ -8,16 +8,39 @@
 
 #include <sel4vm/guest_vm.h>
 #include <sel4vm/guest_vcpu_fault.h>
+#include <sel4vm/guest_vm_arena.h>
 #include <sel4vmmplatsupport/device.h>
+#include <sel4vmmplatsupport/guest_memory_util.h>
 #include <sel4vmmplatsupport/arch/ac_device.h>
 
+/* Access violations reported before reports are limited to one in every AC_REPORT_INTERVAL */
+#define AC_REPORT_BURST 8
+#define AC_REPORT_INTERVAL 1024
+
 struct gac_device_priv {
     void *regs;
     void *mask;
     size_t mask_size;
     enum vacdev_action action;
+    unsigned long violations;
 };
 
+static void report_gac_violation(struct device *dev, struct gac_device_priv *gac_device_priv, vm_vcpu_t *vcpu,
+                                 seL4_Word bits, uintptr_t fault_addr)
+{
+    unsigned long violations = gac_device_priv->violations++;
+    if (violations >= AC_REPORT_BURST && (violations - AC_REPORT_BURST) % AC_REPORT_INTERVAL) {
+        return;
+    }
+    printf("[ac/%s] pc %p | access violation: bits %p @ %p\n",
+           dev->name, (void *) get_vcpu_fault_ip(vcpu), (void *)bits, (void *) fault_addr);
+    if (violations == AC_REPORT_BURST - 1) {
+        printf("[ac/%s] limiting access violation reports to one in every %d\n", dev->name, AC_REPORT_INTERVAL);
+    } else if (violations >= AC_REPORT_BURST) {
+        printf("[ac/%s] %lu access violations so far\n", dev->name, violations + 1);
+    }
+}
+
 static memory_fault_result_t handle_gac_fault(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t fault_addr, size_t fault_length,
                                               void *cookie)
 {
@@ -44,10 +67,7 @@ static memory_fault_result_t handle_gac_fault(vm_t *vm, vm_vcpu_t *vcpu, uintptr
             switch (gac_device_priv->action) {
             case VACDEV_REPORT_AND_MASK:
             case VACDEV_REPORT_ONLY:
-                printf("[ac/%s] pc %p | access violation: bits %p @ %p\n",
-                       dev->name, (void *) get_vcpu_fault_ip(vcpu),
-                       (void *)((result ^ *reg) & ~mask),
-                       (void *) fault_addr);
+                report_gac_violation(dev, gac_device_priv, vcpu, (result ^ *reg) & ~mask, fault_addr);
             default:
                 break;
             }
@@ -71,16 +91,13 @@ static memory_fault_result_t handle_gac_fault(vm_t *vm, vm_vcpu_t *vcpu, uintptr
 }
 
 
-int vm_install_generic_ac_device(vm_t *vm, const struct device *d, void *mask,
-                                 size_t mask_size, enum vacdev_action action)
+static int install_gac_device(vm_t *vm, const struct device *d, void *mask, size_t mask_size,
+                              enum vacdev_action action, bool trap_writes)
 {
     struct gac_device_priv *gac_device_priv;
     struct device *dev;
-    vspace_t *vmm_vspace;
-    vmm_vspace = &vm->mem.vmm_vspace;
-    int err;
 
-    dev = (struct device *)calloc(1, sizeof(struct device));
+    dev = vm_arena_alloc(vm, sizeof(struct device));
     if (!dev) {
         return -1;
     }
@@ -89,29 +106,41 @@ int vm_install_generic_ac_device(vm_t *vm, const struct device *d, void *mask,
     /* initialise private data */
     gac_device_priv = (struct gac_device_priv *)calloc(1, sizeof(*gac_device_priv));
     if (gac_device_priv == NULL) {
-        free(dev);
+        vm_arena_free(vm, sizeof(struct device), dev);
         return -1;
     }
     gac_device_priv->mask = mask;
     gac_device_priv->mask_size = mask_size;
     gac_device_priv->action = action;
 
+    /* Add the device */
+    dev->priv = gac_device_priv;
+
+    if (trap_writes) {
+        /* Map the device read only into the guest as well, so that only writes fault */
+        gac_device_priv->regs = create_device_reservation_frame(vm, dev->pstart, seL4_CanRead, handle_gac_fault,
+                                                                (void *)dev);
+        if (gac_device_priv->regs == NULL) {
+            vm_arena_free(vm, sizeof(struct device), dev);
+            free(gac_device_priv);
+            return -1;
+        }
+        return 0;
+    }
+
     /* Map the device */
     gac_device_priv->regs = ps_io_map(&vm->io_ops->io_mapper, d->pstart, PAGE_SIZE_4K, 0, PS_MEM_NORMAL);
 
     if (gac_device_priv->regs == NULL) {
-        free(dev);
+        vm_arena_free(vm, sizeof(struct device), dev);
         free(gac_device_priv);
         return -1;
     }
 
-    /* Add the device */
-    dev->priv = gac_device_priv;
-
     vm_memory_reservation_t *reservation = vm_reserve_memory_at(vm, dev->pstart, dev->size,
                                                                 handle_gac_fault, (void *)dev);
     if (!reservation) {
-        free(dev);
+        vm_arena_free(vm, sizeof(struct device), dev);
         free(gac_device_priv);
         return -1;
     }
@@ -119,3 +148,18 @@ int vm_install_generic_ac_device(vm_t *vm, const struct device *d, void *mask,
     return 0;
 }
 
+int vm_install_generic_ac_device(vm_t *vm, const struct device *d, void *mask,
+                                 size_t mask_size, enum vacdev_action action)
+{
+    return install_gac_device(vm, d, mask, mask_size, action, false);
+}
+
+int vm_install_generic_ac_device_trap_writes(vm_t *vm, const struct device *d, void *mask,
+                                             size_t mask_size, enum vacdev_action action)
+{
+    if (d->pstart % PAGE_SIZE_4K || d->size > PAGE_SIZE_4K) {
+        ZF_LOGE("Failed to install ac device %s: Only a single aligned page can have just writes trapped", d->name);
+        return -1;
+    }
+    return install_gac_device(vm, d, mask, mask_size, action, true);
+}
@@ -8,14 +8,41 @@
 
 #include <sel4vm/guest_vm.h>
 #include <sel4vm/guest_vcpu_fault.h>
+#include <sel4vm/guest_vm_arena.h>
 
 #include <sel4vmmplatsupport/arch/generic_forward_device.h>
 #include <sel4vmmplatsupport/device.h>
 
 struct gf_device_priv {
     struct generic_forward_cfg cfg;
+    /* writes have been posted since the last flush */
+    bool writes_posted;
 };
 
+static void flush_posted_writes(struct gf_device_priv *gf_device_priv)
+{
+    if (gf_device_priv->writes_posted) {
+        gf_device_priv->cfg.flush_fn();
+        gf_device_priv->writes_posted = false;
+    }
+}
+
+static void forward_write(struct gf_device_priv *gf_device_priv, uint32_t offset, uint32_t value)
+{
+    if (gf_device_priv->cfg.post_write_fn == NULL) {
+        gf_device_priv->cfg.write_fn(offset, value);
+        return;
+    }
+    if (gf_device_priv->cfg.post_write_fn(offset, value)) {
+        /* Make room by waiting for the posted writes */
+        gf_device_priv->cfg.flush_fn();
+        if (gf_device_priv->cfg.post_write_fn(offset, value)) {
+            ZF_LOGF("Failed to post write to empty queue");
+        }
+    }
+    gf_device_priv->writes_posted = true;
+}
+
 static memory_fault_result_t handle_gf_fault(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t fault_addr, size_t fault_length,
                                              void *cookie)
 {
@@ -30,6 +57,8 @@ static memory_fault_result_t handle_gf_fault(vm_t *vm, vm_vcpu_t *vcpu, uintptr_
 
     /* Dispatch to external fault handler */
     if (is_vcpu_read_fault(vcpu)) {
+        /* Reads are ordered after earlier posted writes */
+        flush_posted_writes(gf_device_priv);
         if (gf_device_priv->cfg.read_fn == NULL) {
             ZF_LOGD("No read function provided");
             set_vcpu_fault_data(vcpu, 0);
@@ -37,10 +66,10 @@ static memory_fault_result_t handle_gf_fault(vm_t *vm, vm_vcpu_t *vcpu, uintptr_
             set_vcpu_fault_data(vcpu, gf_device_priv->cfg.read_fn(offset));
         }
     } else  {
-        if (gf_device_priv->cfg.write_fn == NULL) {
+        if (gf_device_priv->cfg.write_fn == NULL && gf_device_priv->cfg.post_write_fn == NULL) {
             ZF_LOGD("No write function provided");
         } else {
-            gf_device_priv->cfg.write_fn(offset, get_vcpu_fault_data(vcpu));
+            forward_write(gf_device_priv, offset, get_vcpu_fault_data(vcpu));
         }
     }
 
@@ -56,7 +85,12 @@ int vm_install_generic_forward_device(vm_t *vm, const struct device *d,
     struct device *dev;
     int err;
 
-    dev = (struct device *)calloc(1, sizeof(struct device));
+    if (cfg.post_write_fn && !cfg.flush_fn) {
+        ZF_LOGE("Failed to install forward device: Posting writes requires a flush function");
+        return -1;
+    }
+
+    dev = vm_arena_alloc(vm, sizeof(struct device));
     if (!dev) {
         return -1;
     }
@@ -66,7 +100,7 @@ int vm_install_generic_forward_device(vm_t *vm, const struct device *d,
     gf_device_priv = (struct gf_device_priv *)calloc(1, sizeof(*gf_device_priv));
     if (gf_device_priv == NULL) {
         ZF_LOGE("error calloc returned null");
-        free(dev);
+        vm_arena_free(vm, sizeof(struct device), dev);
         return -1;
     }
     gf_device_priv->cfg = cfg;
@@ -77,7 +111,7 @@ int vm_install_generic_forward_device(vm_t *vm, const struct device *d,
     vm_memory_reservation_t *reservation = vm_reserve_memory_at(vm, dev->pstart, dev->size,
                                                                 handle_gf_fault, (void *)dev);
     if (!reservation) {
-        free(dev);
+        vm_arena_free(vm, sizeof(struct device), dev);
         free(gf_device_priv);
         return -1;
     }
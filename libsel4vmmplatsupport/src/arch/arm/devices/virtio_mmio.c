@@ -0,0 +1,256 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_memory.h>
+#include <sel4vm/guest_vcpu_fault.h>
+
+#include <sel4vmmplatsupport/drivers/virtio.h>
+#include <sel4vmmplatsupport/arch/virtio_mmio.h>
+
+#include <libfdt.h>
+#include <fdtgen.h>
+
+#define FDT_OP(op)                                      \
+    do {                                                \
+        int err = (op);                                 \
+        ZF_LOGF_IF(err < 0, "FDT operation failed");    \
+    } while(0)                                          \
+
+/* Registers of the legacy virtio mmio layout */
+#define VIRTIO_MMIO_MAGIC_VALUE         0x000
+#define VIRTIO_MMIO_VERSION             0x004
+#define VIRTIO_MMIO_DEVICE_ID           0x008
+#define VIRTIO_MMIO_VENDOR_ID           0x00c
+#define VIRTIO_MMIO_HOST_FEATURES       0x010
+#define VIRTIO_MMIO_HOST_FEATURES_SEL   0x014
+#define VIRTIO_MMIO_GUEST_FEATURES      0x020
+#define VIRTIO_MMIO_GUEST_FEATURES_SEL  0x024
+#define VIRTIO_MMIO_GUEST_PAGE_SIZE     0x028
+#define VIRTIO_MMIO_QUEUE_SEL           0x030
+#define VIRTIO_MMIO_QUEUE_NUM_MAX       0x034
+#define VIRTIO_MMIO_QUEUE_NUM           0x038
+#define VIRTIO_MMIO_QUEUE_ALIGN         0x03c
+#define VIRTIO_MMIO_QUEUE_PFN           0x040
+#define VIRTIO_MMIO_QUEUE_NOTIFY        0x050
+#define VIRTIO_MMIO_INTERRUPT_STATUS    0x060
+#define VIRTIO_MMIO_INTERRUPT_ACK       0x064
+#define VIRTIO_MMIO_STATUS              0x070
+#define VIRTIO_MMIO_CONFIG              0x100
+
+#define VIRTIO_MMIO_MAGIC               0x74726976 /* "virt" */
+#define VIRTIO_MMIO_VERSION_LEGACY      1
+
+/* The emulation lays out rings in pages of this size */
+#define VIRTIO_MMIO_RING_PAGE_SIZE      BIT(VIRTIO_PCI_QUEUE_ADDR_SHIFT)
+
+typedef struct virtio_mmio {
+    virtio_emul_t *emul;
+    uintptr_t addr;
+    uint32_t device_id;
+    uint32_t host_features_sel;
+    uint32_t guest_features_sel;
+    uint32_t guest_page_size;
+    /* size of the queues the device was created with, the guest may use smaller ones */
+    uint16_t queue_num_max;
+} virtio_mmio_t;
+
+/* Registers are translated to the legacy virtio pci registers of the emulation */
+static uint32_t virtio_mmio_read(virtio_mmio_t *mmio, unsigned int offset, size_t size)
+{
+    virtio_emul_t *emul = mmio->emul;
+    unsigned int value = 0;
+    if (offset >= VIRTIO_MMIO_CONFIG) {
+        emul->io_in(emul, VIRTIO_PCI_CONFIG_OFF(false) + offset - VIRTIO_MMIO_CONFIG, size, &value);
+        return value;
+    }
+    switch (offset) {
+    case VIRTIO_MMIO_MAGIC_VALUE:
+        return VIRTIO_MMIO_MAGIC;
+    case VIRTIO_MMIO_VERSION:
+        return VIRTIO_MMIO_VERSION_LEGACY;
+    case VIRTIO_MMIO_DEVICE_ID:
+        return mmio->device_id;
+    case VIRTIO_MMIO_VENDOR_ID:
+        return VIRTIO_PCI_VENDOR_ID;
+    case VIRTIO_MMIO_HOST_FEATURES:
+        /* legacy devices have only 32 feature bits */
+        if (mmio->host_features_sel == 0) {
+            emul->io_in(emul, VIRTIO_PCI_HOST_FEATURES, 4, &value);
+        }
+        return value;
+    case VIRTIO_MMIO_QUEUE_NUM_MAX:
+        if (emul->virtq.queue < emul->virtq.num_queues) {
+            value = mmio->queue_num_max;
+        }
+        return value;
+    case VIRTIO_MMIO_QUEUE_PFN:
+        emul->io_in(emul, VIRTIO_PCI_QUEUE_PFN, 4, &value);
+        return (uint64_t)value * VIRTIO_MMIO_RING_PAGE_SIZE / mmio->guest_page_size;
+    case VIRTIO_MMIO_INTERRUPT_STATUS:
+        emul->io_in(emul, VIRTIO_PCI_ISR, 1, &value);
+        return value;
+    case VIRTIO_MMIO_STATUS:
+        emul->io_in(emul, VIRTIO_PCI_STATUS, 1, &value);
+        return value;
+    default:
+        ZF_LOGE("Unhandled virtio mmio read of offset 0x%x", offset);
+        return 0;
+    }
+}
+
+static void virtio_mmio_write(virtio_mmio_t *mmio, unsigned int offset, size_t size, uint32_t value)
+{
+    virtio_emul_t *emul = mmio->emul;
+    if (offset >= VIRTIO_MMIO_CONFIG) {
+        emul->io_out(emul, VIRTIO_PCI_CONFIG_OFF(false) + offset - VIRTIO_MMIO_CONFIG, size, value);
+        return;
+    }
+    switch (offset) {
+    case VIRTIO_MMIO_HOST_FEATURES_SEL:
+        mmio->host_features_sel = value;
+        break;
+    case VIRTIO_MMIO_GUEST_FEATURES_SEL:
+        mmio->guest_features_sel = value;
+        break;
+    case VIRTIO_MMIO_GUEST_FEATURES:
+        if (mmio->guest_features_sel == 0) {
+            emul->io_out(emul, VIRTIO_PCI_GUEST_FEATURES, 4, value);
+        } else if (value) {
+            ZF_LOGE("Ignoring guest features 0x%x of unsupported word %u", value, mmio->guest_features_sel);
+        }
+        break;
+    case VIRTIO_MMIO_GUEST_PAGE_SIZE:
+        if (!value || value % VIRTIO_MMIO_RING_PAGE_SIZE) {
+            ZF_LOGE("Ignoring unsupported guest page size 0x%x", value);
+            break;
+        }
+        mmio->guest_page_size = value;
+        break;
+    case VIRTIO_MMIO_QUEUE_SEL:
+        emul->io_out(emul, VIRTIO_PCI_QUEUE_SEL, 2, value);
+        break;
+    case VIRTIO_MMIO_QUEUE_NUM:
+        if (emul->virtq.queue >= emul->virtq.num_queues) {
+            break;
+        }
+        if (!value || value > mmio->queue_num_max || (value & (value - 1))) {
+            ZF_LOGE("Ignoring unsupported queue size %u", value);
+            break;
+        }
+        emul->virtq.queue_size[emul->virtq.queue] = value;
+        break;
+    case VIRTIO_MMIO_QUEUE_ALIGN:
+        /* the emulation expects rings laid out as for virtio pci */
+        if (value != VIRTIO_PCI_VRING_ALIGN) {
+            ZF_LOGE("Unsupported queue alignment 0x%x, rings must be aligned to 0x%x", value, VIRTIO_PCI_VRING_ALIGN);
+        }
+        break;
+    case VIRTIO_MMIO_QUEUE_PFN:
+        emul->io_out(emul, VIRTIO_PCI_QUEUE_PFN, 4,
+                     (uint64_t)value * mmio->guest_page_size / VIRTIO_MMIO_RING_PAGE_SIZE);
+        break;
+    case VIRTIO_MMIO_QUEUE_NOTIFY:
+        emul->io_out(emul, VIRTIO_PCI_QUEUE_NOTIFY, 2, value);
+        break;
+    case VIRTIO_MMIO_INTERRUPT_ACK:
+        /* the interrupt status is not tracked, see VIRTIO_MMIO_INTERRUPT_STATUS */
+        break;
+    case VIRTIO_MMIO_STATUS:
+        emul->io_out(emul, VIRTIO_PCI_STATUS, 1, value);
+        break;
+    default:
+        ZF_LOGE("Unhandled virtio mmio write of 0x%x to offset 0x%x", value, offset);
+        break;
+    }
+}
+
+static memory_fault_result_t virtio_mmio_fault_handler(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t fault_addr,
+                                                       size_t fault_length, void *cookie)
+{
+    virtio_mmio_t *mmio = (virtio_mmio_t *)cookie;
+    unsigned int offset = fault_addr - mmio->addr;
+    size_t size = get_vcpu_fault_size(vcpu);
+    if (is_vcpu_read_fault(vcpu)) {
+        uint32_t value = virtio_mmio_read(mmio, offset, size);
+        /* read data is expected in its place within the word */
+        set_vcpu_fault_data(vcpu, (seL4_Word)value << ((fault_addr & 0x3) * 8));
+    } else {
+        seL4_Word data = get_vcpu_fault_data(vcpu);
+        virtio_mmio_write(mmio, offset, size, size < sizeof(uint32_t) ? data & MASK(size * 8) : data);
+    }
+    advance_vcpu_fault(vcpu);
+    return FAULT_HANDLED;
+}
+
+int vm_install_virtio_mmio(vm_t *vm, virtio_emul_t *emul, uintptr_t addr, uint32_t device_id)
+{
+    if (addr % VIRTIO_MMIO_SIZE) {
+        ZF_LOGE("Failed to install virtio mmio: Address 0x%"PRIxPTR" not aligned to its size", addr);
+        return -1;
+    }
+    virtio_mmio_t *mmio = calloc(1, sizeof(*mmio));
+    if (!mmio) {
+        ZF_LOGE("Failed to install virtio mmio: Unable to allocate transport");
+        return -1;
+    }
+    mmio->emul = emul;
+    mmio->addr = addr;
+    mmio->device_id = device_id;
+    mmio->guest_page_size = VIRTIO_MMIO_RING_PAGE_SIZE;
+    mmio->queue_num_max = emul->virtq.queue_size[0];
+    emul->notify_addr = addr + VIRTIO_MMIO_QUEUE_NOTIFY;
+    emul->notify_stride = 0;
+
+    /* the window fits within a page, so faults on it take the MMIO dispatch fast path */
+    vm_memory_reservation_t *reservation = vm_reserve_memory_at(vm, addr, VIRTIO_MMIO_SIZE,
+                                                                virtio_mmio_fault_handler, (void *)mmio);
+    if (!reservation) {
+        ZF_LOGE("Failed to install virtio mmio: Unable to reserve window at 0x%"PRIxPTR, addr);
+        free(mmio);
+        return -1;
+    }
+    return 0;
+}
+
+static int append_prop_with_cells(void *fdt, int offset,  uint64_t val, int num_cells, const char *name)
+{
+    if (num_cells == 2) {
+        return fdt_appendprop_u64(fdt, offset, name, val);
+    } else if (num_cells == 1) {
+        return fdt_appendprop_u32(fdt, offset, name, val);
+    }
+    ZF_LOGE("non-supported arch");
+    return -1;
+}
+
+int fdt_generate_virtio_mmio_node(void *fdt, uintptr_t addr, int irq, int gic_phandle)
+{
+    int root_offset = fdt_path_offset(fdt, "/");
+    int address_cells = fdt_address_cells(fdt, root_offset);
+    int size_cells = fdt_size_cells(fdt, root_offset);
+    char name[32];
+
+    snprintf(name, sizeof(name), "virtio_mmio@%"PRIxPTR, addr);
+    int node = fdt_add_subnode(fdt, root_offset, name);
+    if (node < 0) {
+        ZF_LOGE("Failed to generate virtio mmio node: Unable to add %s", name);
+        return -1;
+    }
+    /* interrupts are shared peripheral interrupts, triggered on a high level */
+    uint32_t interrupts[3] = { cpu_to_fdt32(0), cpu_to_fdt32(irq - 32), cpu_to_fdt32(0x4) };
+    FDT_OP(fdt_appendprop_string(fdt, node, "compatible", "virtio,mmio"));
+    FDT_OP(append_prop_with_cells(fdt, node, addr, address_cells, "reg"));
+    FDT_OP(append_prop_with_cells(fdt, node, VIRTIO_MMIO_SIZE, size_cells, "reg"));
+    FDT_OP(fdt_appendprop_u32(fdt, node, "interrupt-parent", gic_phandle));
+    FDT_OP(fdt_appendprop(fdt, node, "interrupts", interrupts, sizeof(interrupts)));
+    FDT_OP(fdt_appendprop(fdt, node, "dma-coherent", NULL, 0));
+    return 0;
+}
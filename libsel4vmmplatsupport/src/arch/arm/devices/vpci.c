@@ -15,6 +15,7 @@
 
 #include <sel4vm/guest_vm.h>
 #include <sel4vm/guest_vcpu_fault.h>
+#include <sel4vm/guest_vm_boot_phases.h>
 
 #include <sel4vmmplatsupport/drivers/pci_helper.h>
 #include <sel4vmmplatsupport/drivers/pci.h>
@@ -189,7 +190,7 @@ struct device dev_vpci_cfg_io = {
     .priv = NULL,
 };
 
-int vm_install_vpci(vm_t *vm, vmm_io_port_list_t *io_port, vmm_pci_space_t *pci)
+static int install_vpci(vm_t *vm, vmm_io_port_list_t *io_port, vmm_pci_space_t *pci)
 {
 
     ps_io_ops_t *ops = vm->io_ops;
@@ -220,6 +221,14 @@ int vm_install_vpci(vm_t *vm, vmm_io_port_list_t *io_port, vmm_pci_space_t *pci)
     return 0;
 }
 
+int vm_install_vpci(vm_t *vm, vmm_io_port_list_t *io_port, vmm_pci_space_t *pci)
+{
+    int phase = vm_boot_phase_begin("vm_install_vpci");
+    int err = install_vpci(vm, io_port, pci);
+    vm_boot_phase_end(phase);
+    return err;
+}
+
 static int append_prop_with_cells(void *fdt, int offset,  uint64_t val, int num_cells, const char *name)
 {
     int err;
@@ -235,7 +244,7 @@ static int append_prop_with_cells(void *fdt, int offset,  uint64_t val, int num_
     return err;
 }
 
-int fdt_generate_vpci_node(vm_t *vm, vmm_pci_space_t *pci, void *fdt, int gic_phandle)
+static int generate_vpci_node(vm_t *vm, vmm_pci_space_t *pci, void *fdt, int gic_phandle)
 {
     int err;
     int root_offset = fdt_path_offset(fdt, "/");
@@ -318,3 +327,11 @@ int fdt_generate_vpci_node(vm_t *vm, vmm_pci_space_t *pci, void *fdt, int gic_ph
 
     return 0;
 }
+
+int fdt_generate_vpci_node(vm_t *vm, vmm_pci_space_t *pci, void *fdt, int gic_phandle)
+{
+    int phase = vm_boot_phase_begin("fdt_generate");
+    int err = generate_vpci_node(vm, pci, fdt, gic_phandle);
+    vm_boot_phase_end(phase);
+    return err;
+}
@@ -6,6 +6,7 @@
 
 #include <sel4vm/guest_vm.h>
 #include <sel4vm/guest_vcpu_fault.h>
+#include <sel4vm/guest_vm_arena.h>
 
 #ifdef CONFIG_LIB_USB
 #include <sel4vmmplatsupport/device.h>
@@ -27,6 +28,7 @@
 #include <string.h>
 
 #define MAX_ACTIVE_URB   (0x1000 / sizeof(struct sel4urb))
+#define URB_BITMAP_WORDS ((MAX_ACTIVE_URB + seL4_WordBits - 1) / seL4_WordBits)
 
 #define SURBT_PARAM_GET_TYPE(param) (((param) >> 30) & 0x3)
 #define SURBT_PARAM_GET_SIZE(param) (((param) >>  0) & 0x0fffffff)
@@ -101,7 +103,12 @@ struct vusb_device {
         struct vusb_device *vusb;
         int idx;
     } token[MAX_ACTIVE_URB];
+    /* URBs scheduled with the hcd and not yet completed */
+    seL4_Word active_urbs[URB_BITMAP_WORDS];
     int int_pending;
+    /* Completions within a batch share an interrupt injected at the end of the batch */
+    int batch_depth;
+    bool batch_irq;
 };
 
 
@@ -122,12 +129,43 @@ static inline void surb_epaddr_change_state(struct sel4urb *u, uint32_t s)
 static void vusb_inject_irq(vusb_device_t *vusb)
 {
     vusb->ctrl_regs->intr = 1;
+    if (vusb->batch_depth) {
+        vusb->batch_irq = true;
+        return;
+    }
     if (vusb->int_pending == 0) {
         vusb->int_pending = 1;
         vm_inject_IRQ(vusb->virq);
     }
 }
 
+static void vusb_batch_begin(vusb_device_t *vusb)
+{
+    vusb->batch_depth++;
+}
+
+static void vusb_batch_end(vusb_device_t *vusb)
+{
+    if (--vusb->batch_depth == 0 && vusb->batch_irq) {
+        vusb->batch_irq = false;
+        vusb_inject_irq(vusb);
+    }
+}
+
+static inline bool urb_active(vusb_device_t *vusb, int idx)
+{
+    return vusb->active_urbs[idx / seL4_WordBits] & BIT(idx % seL4_WordBits);
+}
+
+static inline void urb_set_active(vusb_device_t *vusb, int idx, bool active)
+{
+    if (active) {
+        vusb->active_urbs[idx / seL4_WordBits] |= BIT(idx % seL4_WordBits);
+    } else {
+        vusb->active_urbs[idx / seL4_WordBits] &= ~BIT(idx % seL4_WordBits);
+    }
+}
+
 static int desc_to_xact(vm_t *vm, struct sel4urbt *desc, struct xact *xact)
 {
     switch (SURBT_PARAM_GET_TYPE(desc->param)) {
@@ -316,6 +354,7 @@ static int vusb_complete_cb(void *token, enum usb_xact_status stat, int rbytes)
     uint32_t status;
 
     ZF_LOGD("packet completion callback %d\n", surb_idx);
+    urb_set_active(vusb, surb_idx, false);
     surb->urb_bytes_remaining = rbytes;
     switch (stat) {
     case XACTSTAT_SUCCESS:
@@ -347,8 +386,16 @@ void vm_vusb_notify(vusb_device_t *vusb)
     int len;
     int nxact;
     int i;
+    vusb_batch_begin(vusb);
     for (i = 0; i < MAX_ACTIVE_URB; i++) {
         struct xact_token *t;
+        if (urb_active(vusb, i)) {
+            /* Already with the hcd, skip every active slot of a word at once */
+            if (vusb->active_urbs[i / seL4_WordBits] == ~(seL4_Word)0) {
+                i |= seL4_WordBits - 1;
+            }
+            continue;
+        }
         u = &vusb->data_regs->sel4urb[i];
         if (SURB_EPADDR_GET_STATE(u->epaddr) != SURB_EPADDR_STATE_PENDING) {
             continue;
@@ -370,26 +417,36 @@ void vm_vusb_notify(vusb_device_t *vusb)
             ZF_LOGD("descriptor error\n");
             surb_epaddr_change_state(u, SURB_EPADDR_STATE_ERROR);
             vusb_inject_irq(vusb);
-            return;
+            continue;
         }
         t = &vusb->token[i];
         t->vusb = vusb;
         t->idx = i;
-        ep.num = SURB_EPADDR_EP(u->epaddr);
+        ep.num = SURB_EPADDR_GET_EP(u->epaddr);
         ep.max_pkt = u->max_pkt;
         ep.interval = u->rate_ms;
+        /* Completions may be called back from within scheduling */
+        surb_epaddr_change_state(u, SURB_EPADDR_STATE_ACTIVE);
+        urb_set_active(vusb, i, true);
         len = usb_hcd_schedule(vusb->hcd, SURB_EPADDR_GET_ADDR(u->epaddr),
                                SURB_EPADDR_GET_HUB_ADDR(u->epaddr),
                                SURB_EPADDR_GET_HUB_PORT(u->epaddr),
                                speed, &ep,
                                xact, nxact, &vusb_complete_cb, t);
         if (len < 0) {
+            urb_set_active(vusb, i, false);
             surb_epaddr_change_state(u, SURB_EPADDR_STATE_ERROR);
             vusb_inject_irq(vusb);
-        } else {
-            surb_epaddr_change_state(u, SURB_EPADDR_STATE_ACTIVE);
         }
     }
+    vusb_batch_end(vusb);
+}
+
+void vm_vusb_handle_hcd_irq(vusb_device_t *vusb)
+{
+    vusb_batch_begin(vusb);
+    usb_hcd_handle_irq(vusb->hcd);
+    vusb_batch_end(vusb);
 }
 
 vusb_device_t *vm_install_vusb(vm_t *vm, usb_host_t *hcd, uintptr_t pbase, int virq,
@@ -400,7 +457,7 @@ vusb_device_t *vm_install_vusb(vm_t *vm, usb_host_t *hcd, uintptr_t pbase, int v
     struct endpoint ep;
     int err;
 
-    d = (struct device *)calloc(1, sizeof(struct device));
+    d = vm_arena_alloc(vm, sizeof(struct device));
     if (!d) {
         return NULL;
     }
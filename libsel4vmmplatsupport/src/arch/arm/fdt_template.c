@@ -0,0 +1,98 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdlib.h>
+
+#include <utils/util.h>
+
+#include <sel4vmmplatsupport/arch/fdt_template.h>
+
+#include <libfdt.h>
+
+int fdt_template_create(const void *fdt, void **template, size_t *size)
+{
+    if (fdt_check_header(fdt)) {
+        ZF_LOGE("Failed to create fdt template: Invalid fdt");
+        return -1;
+    }
+    size_t total_size = fdt_totalsize(fdt);
+    void *copy = malloc(total_size);
+    if (!copy) {
+        ZF_LOGE("Failed to create fdt template: Unable to allocate template");
+        return -1;
+    }
+    int err = fdt_move(fdt, copy, total_size);
+    if (!err) {
+        err = fdt_pack(copy);
+    }
+    if (err) {
+        ZF_LOGE("Failed to create fdt template: %s", fdt_strerror(err));
+        free(copy);
+        return -1;
+    }
+    *template = copy;
+    *size = fdt_totalsize(copy);
+    return 0;
+}
+
+int fdt_template_instantiate(const void *template, void *fdt, size_t fdt_size, const fdt_template_patch_t *patches,
+                             int num_patches)
+{
+    int err = fdt_open_into(template, fdt, fdt_size);
+    if (err) {
+        ZF_LOGE("Failed to instantiate fdt template: %s", fdt_strerror(err));
+        return -1;
+    }
+    for (int i = 0; i < num_patches; i++) {
+        const fdt_template_patch_t *patch = &patches[i];
+        int offset = fdt_path_offset(fdt, patch->path);
+        if (offset < 0) {
+            ZF_LOGE("Failed to instantiate fdt template: Node %s: %s", patch->path, fdt_strerror(offset));
+            return -1;
+        }
+        /* Values of the same length as the template's are written in place */
+        int len;
+        if (fdt_getprop(fdt, offset, patch->name, &len) && len == patch->len) {
+            err = fdt_setprop_inplace(fdt, offset, patch->name, patch->value, patch->len);
+        } else {
+            err = fdt_setprop(fdt, offset, patch->name, patch->value, patch->len);
+        }
+        if (err) {
+            ZF_LOGE("Failed to instantiate fdt template: Property %s of %s: %s", patch->name, patch->path,
+                    fdt_strerror(err));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int fdt_template_encode_reg(const void *template, const char *path, uint64_t addr, uint64_t size, uint32_t *cells)
+{
+    int offset = fdt_path_offset(template, path);
+    if (offset < 0) {
+        ZF_LOGE("Failed to encode reg: Node %s: %s", path, fdt_strerror(offset));
+        return -1;
+    }
+    int parent = fdt_parent_offset(template, offset);
+    int address_cells = fdt_address_cells(template, parent);
+    int size_cells = fdt_size_cells(template, parent);
+    if (address_cells < 1 || address_cells > 2 || size_cells < 0 || size_cells > 2) {
+        ZF_LOGE("Failed to encode reg: Unsupported number of cells for %s", path);
+        return -1;
+    }
+    int i = 0;
+    if (address_cells == 2) {
+        cells[i++] = cpu_to_fdt32(addr >> 32);
+    }
+    cells[i++] = cpu_to_fdt32(addr);
+    if (size_cells == 2) {
+        cells[i++] = cpu_to_fdt32(size >> 32);
+    }
+    if (size_cells) {
+        cells[i++] = cpu_to_fdt32(size);
+    }
+    return i * sizeof(*cells);
+}
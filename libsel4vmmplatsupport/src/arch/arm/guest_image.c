@@ -18,9 +18,12 @@
 #include <sel4vm/guest_vm.h>
 #include <sel4vm/guest_memory.h>
 #include <sel4vm/guest_ram.h>
+#include <sel4vm/guest_vm_boot_phases.h>
 
 #include <sel4vmmplatsupport/guest_image.h>
 
+#include "../../guest_image_lz4.h"
+
 #define UIMAGE_MAGIC 0x56190527
 #define ZIMAGE_MAGIC 0x016F2818
 #define DTB_MAGIC    0xedfe0dd0
@@ -94,6 +97,8 @@ enum img_type image_get_type(void *file)
         return IMG_DTB;
     } else if (is_initrd(file) == 0) {
         return IMG_INITRD_GZ;
+    } else if (image_is_lz4(file)) {
+        return IMG_LZ4;
     } else {
         return IMG_BIN;
     }
@@ -132,9 +137,19 @@ static int get_guest_image_type(const char *image_name, enum img_type *image_typ
     return 0;
 }
 
-static int guest_write_address(vm_t *vm, uintptr_t paddr, void *vaddr, size_t size, size_t offset, void *cookie)
+static int guest_read_address(vm_t *vm, uintptr_t paddr, void *vaddr, size_t size, size_t offset, void *cookie)
 {
-    memcpy(vaddr, cookie + offset, size);
+    int fd = *(int *)cookie;
+    /* The file is read straight into guest memory, in order */
+    size_t done = 0;
+    while (done < size) {
+        ssize_t len = read(fd, vaddr + done, size - done);
+        if (len <= 0) {
+            ZF_LOGE("Failed to read image into guest address %p", (void *)(paddr + done));
+            return -1;
+        }
+        done += len;
+    }
     if (config_set(CONFIG_PLAT_TX1) || config_set(CONFIG_PLAT_TX2)) {
         seL4_CPtr cap = vspace_get_cap(&vm->mem.vmm_vspace, vaddr);
         if (cap == seL4_CapNull) {
@@ -148,10 +163,14 @@ static int guest_write_address(vm_t *vm, uintptr_t paddr, void *vaddr, size_t si
     return 0;
 }
 
+static ssize_t image_fd_read(void *cookie, void *buf, size_t len)
+{
+    return read(*(int *)cookie, buf, len);
+}
+
 static int load_image(vm_t *vm, const char *image_name, uintptr_t load_addr,  size_t *resulting_image_size)
 {
     int fd;
-    size_t len;
     int error;
     fd = open(image_name, 0);
     if (fd == -1) {
@@ -159,38 +178,35 @@ static int load_image(vm_t *vm, const char *image_name, uintptr_t load_addr,  si
         return -1;
     }
 
-    /* Try and load the image 1MiB at a time. Reduce the size by half if
-     * there isn't enough memory available.  The total loading time may be
-     * faster if a larger buffer is used as it allows for more batching.
-     */
-    size_t read_size = BIT(20);
-    char *buf = malloc(read_size);
-    while (buf == NULL) {
-        read_size /= 2;
-        if (read_size < 4096) {
-            ZF_LOGE("Not enough memory for copy buffer");
-        }
-        buf = malloc(read_size);
-    }
-    size_t offset = 0;
-    while (1) {
-        /* Load the image */
-        len = read(fd, buf, read_size);
-        if (!len) {
-            break;
-        }
-        vm_ram_mark_allocated(vm, load_addr + offset, len);
-        error = vm_ram_touch(vm, load_addr + offset, len, guest_write_address, (void *)buf);
+    /* Compressed images are decompressed into guest RAM as they are read */
+    uint32_t magic = 0;
+    if (read(fd, &magic, sizeof(magic)) == sizeof(magic) && image_is_lz4(&magic)) {
+        error = load_lz4_image(vm, image_fd_read, &fd, load_addr, resulting_image_size);
+        close(fd);
         if (error) {
             ZF_LOGE("Error: Failed to load \'%s\'", image_name);
-            close(fd);
             return -1;
         }
-        offset += len;
+        return 0;
+    }
+
+    off_t image_size = lseek(fd, 0, SEEK_END);
+    if (image_size <= 0 || lseek(fd, 0, SEEK_SET) != 0) {
+        ZF_LOGE("Error: Unable to find the size of image \'%s\'", image_name);
+        close(fd);
+        return -1;
     }
-    free(buf);
-    *resulting_image_size = offset;
+
+    /* Read the image directly into each frame of guest RAM it lands in, mapping each frame
+     * once (or not at all if the RAM is direct mapped), rather than through a bounce buffer */
+    vm_ram_mark_allocated(vm, load_addr, image_size);
+    error = vm_ram_touch(vm, load_addr, image_size, guest_read_address, &fd);
     close(fd);
+    if (error) {
+        ZF_LOGE("Error: Failed to load \'%s\'", image_name);
+        return -1;
+    }
+    *resulting_image_size = image_size;
     return 0;
 }
 
@@ -208,6 +224,7 @@ static void *load_guest_kernel_image(vm_t *vm, const char *kernel_image_name, ui
     /* Determine the load address */
     switch (ret_file_type) {
     case IMG_BIN:
+    case IMG_LZ4:
         if (config_set(CONFIG_PLAT_TX1) || config_set(CONFIG_PLAT_TX2) || config_set(CONFIG_PLAT_QEMU_ARM_VIRT)
             || config_set(CONFIG_PLAT_ODROIDC2)) {
             /* This is likely an aarch64/aarch32 linux difference */
@@ -244,6 +261,7 @@ static void *load_guest_module_image(vm_t *vm, const char *image_name, uintptr_t
     switch (ret_file_type) {
     case IMG_DTB:
     case IMG_INITRD_GZ:
+    case IMG_LZ4:
         load_addr = load_base_addr;
         break;
     default:
@@ -257,8 +275,8 @@ static void *load_guest_module_image(vm_t *vm, const char *image_name, uintptr_t
     return (void *)load_addr;
 }
 
-int vm_load_guest_kernel(vm_t *vm, const char *kernel_name, uintptr_t load_address, size_t alignment,
-                         guest_kernel_image_t *guest_kernel_image)
+static int load_kernel(vm_t *vm, const char *kernel_name, uintptr_t load_address, size_t alignment,
+                       guest_kernel_image_t *guest_kernel_image)
 {
     void *load_addr;
     size_t kernel_len;
@@ -275,8 +293,8 @@ int vm_load_guest_kernel(vm_t *vm, const char *kernel_name, uintptr_t load_addre
     return 0;
 }
 
-int vm_load_guest_module(vm_t *vm, const char *module_name, uintptr_t load_address, size_t alignment,
-                         guest_image_t *guest_image)
+static int load_module(vm_t *vm, const char *module_name, uintptr_t load_address, size_t alignment,
+                       guest_image_t *guest_image)
 {
     void *load_addr;
     size_t module_len;
@@ -295,3 +313,21 @@ int vm_load_guest_module(vm_t *vm, const char *module_name, uintptr_t load_addre
     guest_image->size = module_len;
     return 0;
 }
+
+int vm_load_guest_kernel(vm_t *vm, const char *kernel_name, uintptr_t load_address, size_t alignment,
+                         guest_kernel_image_t *guest_kernel_image)
+{
+    int phase = vm_boot_phase_begin("vm_load_guest_kernel");
+    int err = load_kernel(vm, kernel_name, load_address, alignment, guest_kernel_image);
+    vm_boot_phase_end(phase);
+    return err;
+}
+
+int vm_load_guest_module(vm_t *vm, const char *module_name, uintptr_t load_address, size_t alignment,
+                         guest_image_t *guest_image)
+{
+    int phase = vm_boot_phase_begin("vm_load_guest_module");
+    int err = load_module(vm, module_name, load_address, alignment, guest_image);
+    vm_boot_phase_end(phase);
+    return err;
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <string.h>
+
+#include <sel4/sel4.h>
+#include <utils/util.h>
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/arch/guest_arm_context.h>
+
+#include "../../guest_migration_arch.h"
+
+/* The state of a vcpu is that of its thread and of every register of its kernel vcpu object */
+struct vcpu_state {
+    seL4_UserContext context;
+    seL4_Word vcpu_regs[seL4_VCPUReg_Num];
+};
+
+int vm_migration_vcpu_save(vm_vcpu_t *vcpu, void *buf, size_t size, size_t *len)
+{
+    struct vcpu_state state;
+    if (size < sizeof(state) || vm_get_thread_context(vcpu, &state.context)) {
+        return -1;
+    }
+    for (seL4_Word reg = 0; reg < seL4_VCPUReg_Num; reg++) {
+        uintptr_t value;
+        if (vm_get_arm_vcpu_reg(vcpu, reg, &value)) {
+            ZF_LOGE("Failed to save vcpu: Unable to read vcpu register %lu", (unsigned long)reg);
+            return -1;
+        }
+        state.vcpu_regs[reg] = value;
+    }
+    memcpy(buf, &state, sizeof(state));
+    *len = sizeof(state);
+    return 0;
+}
+
+int vm_migration_vcpu_load(vm_vcpu_t *vcpu, const void *buf, size_t len)
+{
+    struct vcpu_state state;
+    if (len != sizeof(state)) {
+        ZF_LOGE("Failed to load vcpu: State of %zu bytes rather than %zu", len, sizeof(state));
+        return -1;
+    }
+    memcpy(&state, buf, sizeof(state));
+    for (seL4_Word reg = 0; reg < seL4_VCPUReg_Num; reg++) {
+        if (vm_set_arm_vcpu_reg(vcpu, reg, state.vcpu_regs[reg])) {
+            ZF_LOGE("Failed to load vcpu: Unable to write vcpu register %lu", (unsigned long)reg);
+            return -1;
+        }
+    }
+    return vm_set_thread_context(vcpu, state.context);
+}
@@ -8,6 +8,7 @@
 
 #include <sel4utils/util.h>
 #include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_ram.h>
 
 #include <sel4vmmplatsupport/arch/guest_reboot.h>
 
@@ -26,7 +27,7 @@ int vmm_register_reboot_callback(reboot_hooks_list_t *rb_hooks_list, reboot_hook
         .token = token
     };
 
-    reboot_hook_t *new_hooks = realloc(rb_hooks_list->rb_hooks, sizeof(reboot_hook_t) * rb_hooks_list->nhooks + 1);
+    reboot_hook_t *new_hooks = realloc(rb_hooks_list->rb_hooks, sizeof(reboot_hook_t) * (rb_hooks_list->nhooks + 1));
     if (!new_hooks) {
         ZF_LOGE("Failed to allocate memory for new reboot hook");
         return -1;
@@ -57,5 +58,46 @@ int vmm_init_reboot_hooks_list(reboot_hooks_list_t *rb_hooks_list)
 {
     rb_hooks_list->nhooks = 0;
     rb_hooks_list->rb_hooks = NULL;
+    rb_hooks_list->boot_ram = NULL;
+    return 0;
+}
+
+int vmm_fast_reboot_init(vm_t *vm, reboot_hooks_list_t *rb_hooks_list)
+{
+    if (rb_hooks_list->boot_ram) {
+        ZF_LOGE("Failed to init fast reboot: Boot RAM already saved");
+        return -1;
+    }
+    vm_ram_snapshot_t *boot_ram = calloc(1, sizeof(*boot_ram));
+    if (!boot_ram) {
+        ZF_LOGE("Failed to init fast reboot: Unable to allocate boot RAM snapshot");
+        return -1;
+    }
+    int err = vm_ram_snapshot(vm, boot_ram);
+    if (err) {
+        ZF_LOGE("Failed to init fast reboot: Unable to snapshot boot RAM");
+        free(boot_ram);
+        return -1;
+    }
+    rb_hooks_list->boot_ram = boot_ram;
+    return 0;
+}
+
+int vmm_fast_reboot(vm_t *vm, reboot_hooks_list_t *rb_hooks_list)
+{
+    if (!rb_hooks_list->boot_ram) {
+        ZF_LOGE("Failed to fast reboot: Boot RAM not saved with vmm_fast_reboot_init");
+        return -1;
+    }
+    int err = vmm_process_reboot_callbacks(vm, rb_hooks_list);
+    if (err) {
+        ZF_LOGE("Failed to fast reboot: Unable to process reboot callbacks");
+        return -1;
+    }
+    err = vm_ram_reset(vm, rb_hooks_list->boot_ram);
+    if (err) {
+        ZF_LOGE("Failed to fast reboot: Unable to reset guest RAM");
+        return -1;
+    }
     return 0;
 }
@@ -4,6 +4,9 @@
  * SPDX-License-Identifier: BSD-2-Clause
  */
 
+#include <stdlib.h>
+#include <string.h>
+
 #include <sel4vm/guest_vm.h>
 #include <sel4vm/arch/processor.h>
 #include <sel4vm/sel4_arch/processor.h>
@@ -11,10 +14,32 @@
 
 #include <vcpu_fault_handlers.h>
 
+/* Exception handlers of a VM that has registered any of its own, starting out
+ * as the default handlers */
+typedef struct vm_exception_handlers {
+    vm_t *vm;
+    vcpu_exception_handler_fn handlers[HSR_MAX_EXCEPTION + 1];
+    struct vm_exception_handlers *next;
+} vm_exception_handlers_t;
+
+static vm_exception_handlers_t *vm_exception_handlers;
+
+static vm_exception_handlers_t *vm_exception_handlers_get(vm_t *vm)
+{
+    for (vm_exception_handlers_t *handlers = vm_exception_handlers; handlers; handlers = handlers->next) {
+        if (handlers->vm == vm) {
+            return handlers;
+        }
+    }
+    return NULL;
+}
+
 int vmm_handle_arm_vcpu_exception(vm_vcpu_t *vcpu, uint32_t hsr, void *cookie)
 {
     uint32_t ec_class = HSR_EXCEPTION_CLASS(hsr);
-    vcpu_exception_handler_fn exception_handler = vcpu_exception_handlers[ec_class];
+    vm_exception_handlers_t *handlers = vm_exception_handlers_get(vcpu->vm);
+    vcpu_exception_handler_fn exception_handler = handlers ? handlers->handlers[ec_class] :
+                                                  vcpu_exception_handlers[ec_class];
     if (!exception_handler) {
         ZF_LOGE("Unknown VCPU HSR Exception Class: No registered handler");
         return -1;
@@ -22,12 +47,24 @@ int vmm_handle_arm_vcpu_exception(vm_vcpu_t *vcpu, uint32_t hsr, void *cookie)
     return exception_handler(vcpu, hsr);
 }
 
-int register_arm_vcpu_exception_handler(uint32_t ec_class, vcpu_exception_handler_fn exception_handler)
+int register_arm_vcpu_exception_handler(vm_t *vm, uint32_t ec_class, vcpu_exception_handler_fn exception_handler)
 {
     if (ec_class > HSR_MAX_EXCEPTION) {
         ZF_LOGE("Failed to register vcpu exception handler: Invalid handler");
         return -1;
     }
-    vcpu_exception_handlers[ec_class] = exception_handler;
+    vm_exception_handlers_t *handlers = vm_exception_handlers_get(vm);
+    if (!handlers) {
+        handlers = calloc(1, sizeof(*handlers));
+        if (!handlers) {
+            ZF_LOGE("Failed to register vcpu exception handler: Unable to allocate handlers");
+            return -1;
+        }
+        handlers->vm = vm;
+        memcpy(handlers->handlers, vcpu_exception_handlers, sizeof(handlers->handlers));
+        handlers->next = vm_exception_handlers;
+        vm_exception_handlers = handlers;
+    }
+    handlers->handlers[ec_class] = exception_handler;
     return 0;
 }
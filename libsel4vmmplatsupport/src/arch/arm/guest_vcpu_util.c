@@ -4,9 +4,13 @@
  * SPDX-License-Identifier: BSD-2-Clause
  */
 
+#include <inttypes.h>
+
 #include <sel4vm/guest_vm.h>
 #include <sel4vm/boot.h>
 #include <sel4vm/guest_irq_controller.h>
+#include <sel4vm/guest_ram.h>
+#include <sel4vm/guest_vm_boot_phases.h>
 
 #include <sel4vmmplatsupport/guest_vcpu_util.h>
 #include <sel4vmmplatsupport/arch/guest_vcpu_fault.h>
@@ -82,7 +86,7 @@ static int generate_psci_node(void *fdt, int root_offset)
     return 0;
 }
 
-int fdt_generate_plat_vcpu_node(vm_t *vm, void *fdt)
+static int generate_plat_vcpu_node(vm_t *vm, void *fdt)
 {
     int root_offset = fdt_path_offset(fdt, "/");
     int cpu_node = fdt_add_subnode(fdt, root_offset, "cpus");
@@ -105,6 +109,10 @@ int fdt_generate_plat_vcpu_node(vm_t *vm, void *fdt)
         if (vm->num_vcpus > 1) {
             FDT_OP(fdt_appendprop_string(fdt, sub_cpu_node, "enable-method", "psci"));
         }
+        int ram_node = vm_vcpu_ram_node(vcpu);
+        if (ram_node >= 0) {
+            FDT_OP(fdt_appendprop_u32(fdt, sub_cpu_node, "numa-node-id", ram_node));
+        }
     }
     int ret = 0;
     if (vm->num_vcpus > 1) {
@@ -112,3 +120,28 @@ int fdt_generate_plat_vcpu_node(vm_t *vm, void *fdt)
     }
     return 0;
 }
+
+int fdt_generate_plat_vcpu_node(vm_t *vm, void *fdt)
+{
+    int phase = vm_boot_phase_begin("fdt_generate");
+    int err = generate_plat_vcpu_node(vm, fdt);
+    vm_boot_phase_end(phase);
+    return err;
+}
+
+int fdt_generate_numa_memory_node(void *fdt, uintptr_t addr, size_t size, int node)
+{
+    int root_offset = fdt_path_offset(fdt, "/");
+    char name[32];
+
+    snprintf(name, sizeof(name), "memory@%"PRIxPTR, addr);
+    int mem_node = fdt_add_subnode(fdt, root_offset, name);
+    if (mem_node < 0) {
+        ZF_LOGE("Failed to generate memory node: Unable to add %s", name);
+        return -1;
+    }
+    FDT_OP(fdt_appendprop_string(fdt, mem_node, "device_type", "memory"));
+    FDT_OP(fdt_appendprop_addrrange(fdt, root_offset, mem_node, "reg", addr, size));
+    FDT_OP(fdt_appendprop_u32(fdt, mem_node, "numa-node-id", node));
+    return 0;
+}
@@ -36,36 +36,54 @@ static int start_new_vcpu(vm_vcpu_t *vcpu,  uintptr_t entry_address, uintptr_t c
     return 0;
 }
 
-int handle_psci(vm_vcpu_t *vcpu, seL4_Word fn_number, bool convention)
+/* Whether a function identifier is that of a PSCI function we implement */
+static bool psci_is_supported(seL4_Word func_id)
 {
-    int err;
-    seL4_UserContext regs;
-    err = vm_get_thread_context(vcpu, &regs);
-    if (err) {
-        ZF_LOGE("Failed to get vcpu registers");
-        return -1;
+    if (((func_id >> SMC_SERVICE_CALL_SHIFT) & SMC_SERVICE_CALL_MASK) != SMC_CALL_STD_SERVICE) {
+        return false;
     }
+    switch (func_id & SMC_FUNC_ID_MASK) {
+    case PSCI_VERSION:
+    case PSCI_CPU_SUSPEND:
+    case PSCI_CPU_ON:
+    case PSCI_MIGRATE_INFO_TYPE:
+    case PSCI_SYSTEM_RESET:
+    case PSCI_FEATURES:
+        return true;
+    default:
+        return false;
+    }
+}
+
+int handle_psci(vm_vcpu_t *vcpu, smc_call_t *call, void *cookie)
+{
+    seL4_Word fn_number = smc_get_function_id(call) & SMC_FUNC_ID_MASK;
     switch (fn_number) {
     case PSCI_VERSION:
-        smc_set_return_value(&regs, 0x00010000); /* version 1 */
+        smc_set_return_value(call, 0x00010000); /* version 1 */
         break;
+    case PSCI_CPU_SUSPEND:
+        /* As KVM does, every power state is entered as a standby state that behaves like WFI: the vcpu resumes
+         * after the call once it has an interrupt pending, without having lost its context */
+        smc_set_return_value(call, PSCI_SUCCESS);
+        return SMC_CALL_WAIT;
     case PSCI_CPU_ON: {
-        uintptr_t target_cpu = smc_get_arg(&regs, 1);
-        uintptr_t entry_point_address = smc_get_arg(&regs, 2);
-        uintptr_t context_id = smc_get_arg(&regs, 3);
+        uintptr_t target_cpu = smc_get_arg(call, 1);
+        uintptr_t entry_point_address = smc_get_arg(call, 2);
+        uintptr_t context_id = smc_get_arg(call, 3);
         vm_vcpu_t *target_vcpu = vm_vcpu_for_target_cpu(vcpu->vm, target_cpu);
         if (target_vcpu == NULL) {
             target_vcpu = vm_find_free_unassigned_vcpu(vcpu->vm);
             if (target_vcpu && start_new_vcpu(target_vcpu, entry_point_address, context_id, target_cpu) == 0) {
-                smc_set_return_value(&regs, PSCI_SUCCESS);
+                smc_set_return_value(call, PSCI_SUCCESS);
             } else {
-                smc_set_return_value(&regs, PSCI_INTERNAL_FAILURE);
+                smc_set_return_value(call, PSCI_INTERNAL_FAILURE);
             }
         } else {
             if (is_vcpu_online(target_vcpu)) {
-                smc_set_return_value(&regs, PSCI_ALREADY_ON);
+                smc_set_return_value(call, PSCI_ALREADY_ON);
             } else {
-                smc_set_return_value(&regs, PSCI_INTERNAL_FAILURE);
+                smc_set_return_value(call, PSCI_INTERNAL_FAILURE);
             }
         }
 
@@ -73,24 +91,19 @@ int handle_psci(vm_vcpu_t *vcpu, seL4_Word fn_number, bool convention)
     }
     case PSCI_MIGRATE_INFO_TYPE:
         /* trusted OS does not require migration */
-        smc_set_return_value(&regs, 2);
+        smc_set_return_value(call, 2);
         break;
     case PSCI_FEATURES:
-        /* TODO Not sure if required */
-        smc_set_return_value(&regs, PSCI_NOT_SUPPORTED);
+        /* For CPU_SUSPEND a zero result also gives the original power state parameter format, and no OS-initiated
+         * mode */
+        smc_set_return_value(call, psci_is_supported(smc_get_arg(call, 1)) ? PSCI_SUCCESS : PSCI_NOT_SUPPORTED);
         break;
     case PSCI_SYSTEM_RESET:
-        smc_set_return_value(&regs, PSCI_SUCCESS);
+        smc_set_return_value(call, PSCI_SUCCESS);
         break;
     default:
         ZF_LOGE("Unhandled PSCI function id %lu\n", fn_number);
         return -1;
     }
-    err = vm_set_thread_context(vcpu, regs);
-    if (err) {
-        ZF_LOGE("Failed to set vcpu context registers");
-        return -1;
-    }
-    advance_vcpu_fault(vcpu);
     return 0;
 }
@@ -51,4 +51,7 @@ typedef enum psci {
     PSCI_MAX = 0x1f
 } psci_id_t;
 
-int handle_psci(vm_vcpu_t *vcpu, seL4_Word fn_number, bool convention);
+#include "smc.h"
+
+/* Handler of the PSCI calls of the standard service */
+int handle_psci(vm_vcpu_t *vcpu, smc_call_t *call, void *cookie);
@@ -5,93 +5,173 @@
  */
 
 
+#include <stddef.h>
+#include <string.h>
+
 #include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_vcpu_fault.h>
 #include <sel4vm/arch/guest_arm_context.h>
 
 #include "smc.h"
 #include "psci.h"
 
-static smc_call_id_t smc_get_call(uintptr_t func_id)
+typedef struct smc_handler {
+    seL4_Word fn_start;
+    seL4_Word fn_end;
+    smc_handler_fn handler;
+    void *cookie;
+} smc_handler_t;
+
+/* Handlers of the calls of a service, sorted by function number */
+typedef struct smc_service {
+    int num_handlers;
+    smc_handler_t handlers[SMC_MAX_SERVICE_HANDLERS];
+} smc_service_t;
+
+/* Handlers indexed by the owning entity of the call */
+static smc_service_t smc_services[SMC_NUM_SERVICES] = {
+    [SMC_CALL_STD_SERVICE] = {
+        .num_handlers = 1,
+        .handlers = {{ .fn_start = 0, .fn_end = PSCI_MAX - 1, .handler = handle_psci }}
+    },
+};
+
+static seL4_Word smc_get_service(uintptr_t func_id)
 {
-    seL4_Word service = ((func_id >> SMC_SERVICE_CALL_SHIFT) & SMC_SERVICE_CALL_MASK);
-    assert(service >= 0 && service <= 0xFFFF);
-
-    if (service <= SMC_CALL_VENDOR_HYP_SERVICE) {
-        return service;
-    } else if (service < SMC_CALL_TRUSTED_APP) {
-        return SMC_CALL_RESERVED;
-    } else if (service < SMC_CALL_TRUSTED_OS) {
-        return SMC_CALL_TRUSTED_APP;
-    } else if (service < SMC_CALL_RESERVED) {
-        return SMC_CALL_TRUSTED_OS;
-    } else {
-        return SMC_CALL_RESERVED;
+    return (func_id >> SMC_SERVICE_CALL_SHIFT) & SMC_SERVICE_CALL_MASK;
+}
+
+static uintptr_t smc_get_function_number(uintptr_t func_id)
+{
+    return (func_id & SMC_FUNC_ID_MASK);
+}
+
+int smc_register_handler(unsigned int service, seL4_Word fn_start, seL4_Word fn_end, smc_handler_fn handler,
+                         void *cookie)
+{
+    if (service >= SMC_NUM_SERVICES || fn_start > fn_end || fn_end > SMC_FUNC_ID_MASK || !handler) {
+        ZF_LOGE("Failed to register SMC handler: Invalid service %u call range %lu-%lu", service, fn_start, fn_end);
+        return -1;
+    }
+    smc_service_t *s = &smc_services[service];
+    if (s->num_handlers == SMC_MAX_SERVICE_HANDLERS) {
+        ZF_LOGE("Failed to register SMC handler: Too many handlers of service %u", service);
+        return -1;
     }
+    int i;
+    for (i = 0; i < s->num_handlers && s->handlers[i].fn_start < fn_start; i++);
+    if ((i > 0 && s->handlers[i - 1].fn_end >= fn_start) || (i < s->num_handlers && s->handlers[i].fn_start <= fn_end)) {
+        ZF_LOGE("Failed to register SMC handler: Service %u calls %lu-%lu already have a handler", service, fn_start,
+                fn_end);
+        return -1;
+    }
+    memmove(&s->handlers[i + 1], &s->handlers[i], (s->num_handlers - i) * sizeof(smc_handler_t));
+    s->handlers[i] = (smc_handler_t) {
+        .fn_start = fn_start,
+        .fn_end = fn_end,
+        .handler = handler,
+        .cookie = cookie
+    };
+    s->num_handlers++;
+    return 0;
 }
 
-static bool smc_call_is_32(uintptr_t func_id)
+static smc_handler_t *smc_find_handler(seL4_Word service, seL4_Word fn_number)
 {
-    return !!(func_id & SMC_CALLING_CONVENTION) == SMC_CALLING_CONVENTION_32;
+    smc_service_t *s = &smc_services[service];
+    for (int i = 0; i < s->num_handlers && s->handlers[i].fn_start <= fn_number; i++) {
+        if (fn_number <= s->handlers[i].fn_end) {
+            return &s->handlers[i];
+        }
+    }
+    return NULL;
 }
 
-static bool smc_call_is_atomic(uintptr_t func_id)
+/* Read the register window of a call. The register at the highest context index is read first, such that a single
+ * transfer from the TCB brings in the registers of the whole window */
+static int smc_read_call(vm_vcpu_t *vcpu, smc_call_t *call)
 {
-    return !!(func_id & SMC_FAST_CALL);
+    int top = 0;
+    for (int i = 1; i < SMC_CALL_NUM_REGS; i++) {
+        if (smc_call_reg(i) > smc_call_reg(top)) {
+            top = i;
+        }
+    }
+    for (int i = 0; i < SMC_CALL_NUM_REGS; i++) {
+        int n = (top + i) % SMC_CALL_NUM_REGS;
+        if (vm_get_thread_context_reg(vcpu, smc_call_reg(n), &call->regs[n])) {
+            return -1;
+        }
+    }
+    return 0;
 }
 
-static uintptr_t smc_get_function_number(uintptr_t func_id)
+/* Write back the registers of the window a handler changed */
+static int smc_write_call(vm_vcpu_t *vcpu, smc_call_t *entry, smc_call_t *call)
 {
-    return (func_id & SMC_FUNC_ID_MASK);
+    for (int i = 0; i < SMC_CALL_NUM_REGS; i++) {
+        if (call->regs[i] != entry->regs[i] && vm_set_thread_context_reg(vcpu, smc_call_reg(i), call->regs[i])) {
+            return -1;
+        }
+    }
+    return 0;
 }
 
-int handle_smc(vm_vcpu_t *vcpu, uint32_t hsr)
+/* An HVC returns to the instruction after it, where a trapped SMC returns to the SMC itself. The PC is stepped
+ * back over the HVC such that completing the call advances past it as for an SMC */
+static int hvc_rewind(vm_vcpu_t *vcpu)
 {
-    int err;
-    seL4_UserContext regs;
-    err = vm_get_thread_context(vcpu, &regs);
-    if (err) {
+    seL4_Word pc;
+    unsigned int pc_reg = offsetof(seL4_UserContext, pc) / sizeof(seL4_Word);
+    if (vm_get_thread_context_reg(vcpu, pc_reg, &pc)) {
+        return -1;
+    }
+    return vm_set_thread_context_reg(vcpu, pc_reg, pc - 4);
+}
+
+static int handle_call(vm_vcpu_t *vcpu, bool hvc)
+{
+    smc_call_t entry, call;
+    if (smc_read_call(vcpu, &entry)) {
         ZF_LOGE("Failed to get vcpu registers to decode smc fault");
         return -1;
     }
-    seL4_Word id = smc_get_function_id(&regs);
+    seL4_Word id = smc_get_function_id(&entry);
+    seL4_Word service = smc_get_service(id);
     seL4_Word fn_number = smc_get_function_number(id);
-    smc_call_id_t service = smc_get_call(id);
-
-    switch (service) {
-    case SMC_CALL_ARM_ARCH:
-        ZF_LOGE("Unhandled SMC: arm architecture call %lu\n", fn_number);
-        break;
-    case SMC_CALL_CPU_SERVICE:
-        ZF_LOGE("Unhandled SMC: CPU service call %lu\n", fn_number);
-        break;
-    case SMC_CALL_SIP_SERVICE:
-        ZF_LOGE("Got SiP service call %lu\n", fn_number);
-        break;
-    case SMC_CALL_OEM_SERVICE:
-        ZF_LOGE("Unhandled SMC: OEM service call %lu\n", fn_number);
-        break;
-    case SMC_CALL_STD_SERVICE:
-        if (fn_number < PSCI_MAX) {
-            return handle_psci(vcpu, fn_number, smc_call_is_32(id));
-        }
-        ZF_LOGE("Unhandled SMC: standard service call %lu\n", fn_number);
-        break;
-    case SMC_CALL_STD_HYP_SERVICE:
-        ZF_LOGE("Unhandled SMC: standard hyp service call %lu\n", fn_number);
-        break;
-    case SMC_CALL_VENDOR_HYP_SERVICE:
-        ZF_LOGE("Unhandled SMC: vendor hyp service call %lu\n", fn_number);
-        break;
-    case SMC_CALL_TRUSTED_APP:
-        ZF_LOGE("Unhandled SMC: trusted app call %lu\n", fn_number);
-        break;
-    case SMC_CALL_TRUSTED_OS:
-        ZF_LOGE("Unhandled SMC: trusted os call %lu\n", fn_number);
-        break;
-    default:
-        ZF_LOGE("Unhandle SMC: unknown value service: %lu fn_number: %lu\n",
-                (unsigned long) service, fn_number);
-        break;
+
+    smc_handler_t *h = smc_find_handler(service, fn_number);
+    if (!h) {
+        ZF_LOGE("Unhandled %s: service %lu call %lu\n", hvc ? "HVC" : "SMC", service, fn_number);
+        return -1;
+    }
+    call = entry;
+    int ret = h->handler(vcpu, &call, h->cookie);
+    if (ret < 0) {
+        return -1;
     }
-    return -1;
+    if (smc_write_call(vcpu, &entry, &call)) {
+        ZF_LOGE("Failed to set vcpu registers to complete smc");
+        return -1;
+    }
+    if (hvc && hvc_rewind(vcpu)) {
+        ZF_LOGE("Failed to rewind vcpu pc to complete hvc");
+        return -1;
+    }
+    if (ret == SMC_CALL_WAIT) {
+        wait_vcpu_fault(vcpu);
+    } else {
+        advance_vcpu_fault(vcpu);
+    }
+    return 0;
+}
+
+int handle_smc(vm_vcpu_t *vcpu, uint32_t hsr)
+{
+    return handle_call(vcpu, false);
+}
+
+int handle_hvc(vm_vcpu_t *vcpu, uint32_t hsr)
+{
+    return handle_call(vcpu, true);
 }
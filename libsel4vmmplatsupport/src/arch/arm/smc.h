@@ -38,11 +38,60 @@ typedef enum {
     SMC_CALL_RESERVED = 64,
 } smc_call_id_t;
 
+/* Number of owning entities, the services of the function identifier space */
+#define SMC_NUM_SERVICES (SMC_SERVICE_CALL_MASK + 1)
+
+/* Number of registers passed by an SMC call: the function identifier and six arguments */
+#define SMC_CALL_NUM_REGS 7
+
+/* Register window of an SMC call, x0-x6 (r0-r6 on AArch32). On entry 'regs[0]' holds the function identifier and
+ * 'regs[1]' to 'regs[6]' the arguments, a handler replaces them with the results of the call. Only the window is
+ * transferred to and from the vcpu, registers left unchanged are not written back */
+typedef struct smc_call {
+    seL4_Word regs[SMC_CALL_NUM_REGS];
+} smc_call_t;
+
+/* Handler of a range of SMC calls. Returns 0 on success, SMC_CALL_WAIT to resume the vcpu with the results only
+ * once an interrupt is pending for it, or -1 on error */
+#define SMC_CALL_WAIT 1
+typedef int (*smc_handler_fn)(vm_vcpu_t *vcpu, smc_call_t *call, void *cookie);
+
+/* Maximum number of handlers of the calls of a single service */
+#define SMC_MAX_SERVICE_HANDLERS 8
+
+/* Register a handler of the calls 'fn_start' to 'fn_end' (inclusive) of the owning entity 'service',
+ * one of smc_call_id_t or an entity within the trusted app and trusted os ranges. Handlers are shared by all VMs */
+int smc_register_handler(unsigned int service, seL4_Word fn_start, seL4_Word fn_end, smc_handler_fn handler,
+                         void *cookie);
+
 /* SMC VCPU fault handler */
 int handle_smc(vm_vcpu_t *vcpu, uint32_t hsr);
 
+/* HVC VCPU fault handler, dispatching HVC calls to the same handlers as SMC calls */
+int handle_hvc(vm_vcpu_t *vcpu, uint32_t hsr);
+
+/* Index of the seL4_UserContext register holding register 'n' of an SMC call window */
+unsigned int smc_call_reg(unsigned int n);
+
 /* SMC Helpers */
-seL4_Word smc_get_function_id(seL4_UserContext *u);
-seL4_Word smc_set_return_value(seL4_UserContext *u, seL4_Word val);
-seL4_Word smc_get_arg(seL4_UserContext *u, seL4_Word arg);
-void smc_set_arg(seL4_UserContext *u, seL4_Word arg, seL4_Word val);
+static inline seL4_Word smc_get_function_id(smc_call_t *call)
+{
+    return call->regs[0];
+}
+
+static inline void smc_set_return_value(smc_call_t *call, seL4_Word val)
+{
+    call->regs[0] = val;
+}
+
+static inline seL4_Word smc_get_arg(smc_call_t *call, seL4_Word arg)
+{
+    assert(arg > 0 && arg < SMC_CALL_NUM_REGS);
+    return call->regs[arg];
+}
+
+static inline void smc_set_arg(smc_call_t *call, seL4_Word arg, seL4_Word val)
+{
+    assert(arg > 0 && arg < SMC_CALL_NUM_REGS);
+    call->regs[arg] = val;
+}
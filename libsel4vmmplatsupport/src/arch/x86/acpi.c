@@ -7,6 +7,9 @@
 /* Routines for generating guest ACPI tables.
 Author: W.A. */
 
+#include <autoconf.h>
+#include <sel4vm/gen_config.h>
+
 #include <stdlib.h>
 #include <string.h>
 
@@ -17,6 +20,7 @@ Author: W.A. */
 #include <sel4vm/guest_ram.h>
 #include <sel4vm/guest_memory.h>
 #include <sel4vm/guest_memory_helpers.h>
+#include <sel4vm/guest_vm_boot_phases.h>
 #include <platsupport/plat/acpi/acpi.h>
 
 #include <sel4vmmplatsupport/guest_memory_util.h>
@@ -24,6 +28,74 @@ Author: W.A. */
 
 #define APIC_FLAGS_ENABLED (1)
 
+#define SRAT_TYPE_CPU_AFFINITY (0)
+#define SRAT_TYPE_MEMORY_AFFINITY (1)
+#define SRAT_FLAGS_ENABLED (1)
+
+#define SLIT_LOCAL_DISTANCE (10)
+#define SLIT_REMOTE_DISTANCE (20)
+
+/* System Resource Affinity Table, followed by its affinity structures */
+typedef struct acpi_srat {
+    acpi_header_t header;
+    uint32_t reserved1;
+    uint64_t reserved2;
+} PACKED acpi_srat_t;
+
+typedef struct acpi_srat_cpu_affinity {
+    uint8_t type;
+    uint8_t length;
+    uint8_t proximity_lo;
+    uint8_t apic_id;
+    uint32_t flags;
+    uint8_t sapic_eid;
+    uint8_t proximity_hi[3];
+    uint32_t clock_domain;
+} PACKED acpi_srat_cpu_affinity_t;
+
+typedef struct acpi_srat_memory_affinity {
+    uint8_t type;
+    uint8_t length;
+    uint32_t proximity;
+    uint16_t reserved1;
+    uint64_t base;
+    uint64_t length_bytes;
+    uint32_t reserved2;
+    uint32_t flags;
+    uint64_t reserved3;
+} PACKED acpi_srat_memory_affinity_t;
+
+/* System Locality Information Table, followed by its distance matrix */
+typedef struct acpi_slit {
+    acpi_header_t header;
+    uint64_t localities;
+} PACKED acpi_slit_t;
+
+/* NUMA topology of a VM */
+typedef struct guest_numa_topology {
+    vm_t *vm;
+    guest_numa_config_t *numa;
+    struct guest_numa_topology *next;
+} guest_numa_topology_t;
+
+static guest_numa_topology_t *guest_numa_topologies;
+
+static guest_numa_topology_t *guest_numa_topology_get(vm_t *vm)
+{
+    for (guest_numa_topology_t *topology = guest_numa_topologies; topology; topology = topology->next) {
+        if (topology->vm == vm) {
+            return topology;
+        }
+    }
+    return NULL;
+}
+
+static guest_numa_config_t *guest_numa_get(vm_t *vm)
+{
+    guest_numa_topology_t *topology = guest_numa_topology_get(vm);
+    return topology ? topology->numa : NULL;
+}
+
 uint8_t acpi_calc_checksum(const char *table, int length)
 {
     uint32_t sum = 0;
@@ -52,14 +124,6 @@ static void acpi_fill_table_head(acpi_header_t *head, const char *signature, uin
     head->creator_revision = 1;
 }
 
-static int make_guest_acpi_tables_continued(vm_t *vm, uintptr_t paddr, void *vaddr,
-                                            size_t size, size_t offset, void *cookie)
-{
-    (void)offset;
-    memcpy((char *)vaddr, (char *)cookie, size);
-    return 0;
-}
-
 struct bios_iterator_cookie {
     cspacepath_t *bios_frames;
     vm_t *vm;
@@ -130,45 +194,129 @@ static void *alloc_bios_memory(vm_t *vm, cspacepath_t **bios_frames)
         ZF_LOGE("Failed to map new pages for bios memory");
         return NULL;
     }
-    memset(bios_addr, LOWER_BIOS_SIZE, 0);
     *bios_frames = bios_frames_paths;
     return bios_addr;
 }
 
-// Give some ACPI tables to the guest
-int make_guest_acpi_tables(vm_t *vm)
+static int guest_numa_vcpu_node(vm_t *vm, int vcpu)
+{
+    guest_numa_config_t *guest_numa = guest_numa_get(vm);
+    if (guest_numa->vcpu_nodes) {
+        return guest_numa->vcpu_nodes[vcpu];
+    }
+    return vm_vcpu_ram_node(vm->vcpus[vcpu]);
+}
+
+/* Build the SRAT and SLIT at 'offset' into the lower BIOS memory, adding them to the XSDT entries. Returns the number
+ * of bytes used */
+static size_t build_guest_numa_tables(vm_t *vm, char *bios, size_t offset, uint64_t **entry)
+{
+    guest_numa_config_t *guest_numa = guest_numa_get(vm);
+    int nodes = guest_numa->num_nodes;
+
+    // SRAT
+    size_t srat_size = sizeof(acpi_srat_t) + sizeof(acpi_srat_cpu_affinity_t) * vm->num_vcpus
+                       + sizeof(acpi_srat_memory_affinity_t) * nodes;
+    acpi_srat_t *srat = (acpi_srat_t *)(bios + offset);
+    acpi_fill_table_head(&srat->header, "SRAT", 3);
+    srat->reserved1 = 1;
+    srat->reserved2 = 0;
+
+    acpi_srat_cpu_affinity_t *cpu = (acpi_srat_cpu_affinity_t *)((char *)srat + sizeof(acpi_srat_t));
+    for (int i = 0; i < vm->num_vcpus; i++) {
+        uint32_t node = guest_numa_vcpu_node(vm, i);
+        *cpu++ = (acpi_srat_cpu_affinity_t) {
+            .type = SRAT_TYPE_CPU_AFFINITY,
+            .length = sizeof(acpi_srat_cpu_affinity_t),
+            .proximity_lo = node & 0xff,
+            .apic_id = i,
+            .flags = SRAT_FLAGS_ENABLED,
+            .proximity_hi = {(node >> 8) & 0xff, (node >> 16) & 0xff, (node >> 24) & 0xff}
+        };
+    }
+
+    acpi_srat_memory_affinity_t *mem = (acpi_srat_memory_affinity_t *)cpu;
+    for (int i = 0; i < nodes; i++) {
+        *mem++ = (acpi_srat_memory_affinity_t) {
+            .type = SRAT_TYPE_MEMORY_AFFINITY,
+            .length = sizeof(acpi_srat_memory_affinity_t),
+            .proximity = i,
+            .base = guest_numa->nodes[i].ram_start,
+            .length_bytes = guest_numa->nodes[i].ram_size,
+            .flags = SRAT_FLAGS_ENABLED
+        };
+    }
+
+    srat->header.length = srat_size;
+    srat->header.checksum = acpi_calc_checksum((char *)srat, srat_size);
+    ZF_LOGD("ACPI table \"SRAT\", addr = %p, size = %zu bytes\n", (void *)(LOWER_BIOS_START + offset), srat_size);
+    *(*entry)++ = LOWER_BIOS_START + offset;
+    offset += srat_size;
+
+    // SLIT
+    size_t slit_size = sizeof(acpi_slit_t) + nodes * nodes;
+    acpi_slit_t *slit = (acpi_slit_t *)(bios + offset);
+    acpi_fill_table_head(&slit->header, "SLIT", 1);
+    slit->localities = nodes;
+
+    uint8_t *distance = (uint8_t *)slit + sizeof(acpi_slit_t);
+    for (int i = 0; i < nodes; i++) {
+        for (int j = 0; j < nodes; j++) {
+            if (guest_numa->distances) {
+                *distance++ = guest_numa->distances[i * nodes + j];
+            } else {
+                *distance++ = i == j ? SLIT_LOCAL_DISTANCE : SLIT_REMOTE_DISTANCE;
+            }
+        }
+    }
+
+    slit->header.length = slit_size;
+    slit->header.checksum = acpi_calc_checksum((char *)slit, slit_size);
+    ZF_LOGD("ACPI table \"SLIT\", addr = %p, size = %zu bytes\n", (void *)(LOWER_BIOS_START + offset), slit_size);
+    *(*entry)++ = LOWER_BIOS_START + offset;
+
+    return srat_size + slit_size;
+}
+
+/* Build the tables in place in the lower BIOS memory mapped at 'bios', returning the number of bytes used from
+ * ACPI_START. Tables refer to each other by their guest physical addresses */
+static size_t build_guest_acpi_tables(vm_t *vm, char *bios)
 {
     ZF_LOGD("Making ACPI tables\n");
 
     int cpus = vm->num_vcpus;
+    guest_numa_config_t *guest_numa = guest_numa_get(vm);
 
-    int err;
-
-    // XSDT and other tables
-    void *tables[MAX_ACPI_TABLES];
-    size_t table_sizes[MAX_ACPI_TABLES];
-    int num_tables = 1;
+    // Tables listed by the XSDT, which they follow
+    int num_tables = guest_numa ? MAX_ACPI_TABLES - 1 : 1;
+    size_t xsdt_offset = XSDT_START - LOWER_BIOS_START;
+    size_t xsdt_size = sizeof(acpi_xsdt_t) + sizeof(uint64_t) * num_tables;
+    acpi_xsdt_t *xsdt = (acpi_xsdt_t *)(bios + xsdt_offset);
+    uint64_t *entry = (uint64_t *)((char *)xsdt + sizeof(acpi_xsdt_t));
+    size_t table_offset = xsdt_offset + xsdt_size;
 
     // MADT
     int madt_size = sizeof(acpi_madt_t)
-                    /* + sizeof(acpi_madt_ioapic_t)*/
+#ifdef CONFIG_LIB_SEL4VM_IOAPIC
+                    + sizeof(acpi_madt_ioapic_t)
+#endif
                     + sizeof(acpi_madt_local_apic_t) * cpus;
-    acpi_madt_t *madt = calloc(1, madt_size);
+    acpi_madt_t *madt = (acpi_madt_t *)(bios + table_offset);
     acpi_fill_table_head(&madt->header, "APIC", 3);
     madt->local_int_crt_address = APIC_DEFAULT_PHYS_BASE;
     madt->flags = 1;
 
     char *madt_entry = (char *)madt + sizeof(acpi_madt_t);
 
-#if 0
-    acpi_madt_ioapic_t ioapic = { // MADT IOAPIC entry
+#ifdef CONFIG_LIB_SEL4VM_IOAPIC
+    acpi_madt_ioapic_t ioapic = { // MADT IOAPIC entry, with ISA irqs identity mapped onto its pins
         .header = {
             .type = ACPI_APIC_IOAPIC,
             .length = sizeof(acpi_madt_ioapic_t)
         },
         .ioapic_id = 0,
-        .address = IOAPIC_DEFAULT_PHYS_BASE,
-        .gs_interrupt_base = 0 // TODO set this up?
+        .address = IO_APIC_DEFAULT_PHYS_BASE,
+        .gs_interrupt_base = 0
     };
     memcpy(madt_entry, &ioapic, sizeof(ioapic));
     madt_entry += sizeof(ioapic);
@@ -191,67 +339,34 @@ int make_guest_acpi_tables(vm_t *vm)
     madt->header.length = madt_size;
     madt->header.checksum = acpi_calc_checksum((char *)madt, madt_size);
 
-    tables[num_tables] = madt;
-    table_sizes[num_tables] = madt_size;
-    num_tables++;
+    ZF_LOGD("ACPI table \"APIC\", addr = %p, size = %d bytes\n",
+            (void *)(LOWER_BIOS_START + table_offset), madt_size);
+    *entry++ = LOWER_BIOS_START + table_offset;
+    table_offset += madt_size;
 
-    // Could set up other tables here...
-
-    // XSDT
-    size_t xsdt_size = sizeof(acpi_xsdt_t) + sizeof(uint64_t) * (num_tables - 1);
-
-    // How much space will all the tables take up?
-    size_t acpi_size = xsdt_size;
-    for (int i = 1; i < num_tables; i++) {
-        acpi_size += table_sizes[i];
-    }
-
-    cspacepath_t *bios_frames;
-    uintptr_t lower_bios_addr = (uintptr_t)alloc_bios_memory(vm, &bios_frames);
-    if (lower_bios_addr == 0) {
-        return -1;
+    if (guest_numa) {
+        table_offset += build_guest_numa_tables(vm, bios, table_offset, &entry);
     }
 
-    uintptr_t xsdt_addr = lower_bios_addr + (XSDT_START - LOWER_BIOS_START);
+    // Could set up other tables here...
 
-    acpi_xsdt_t *xsdt = calloc(1, xsdt_size);
+    // XSDT
     acpi_fill_table_head(&xsdt->header, "XSDT", 1);
-
-    // Add previous tables to XSDT pointer list
-    uintptr_t table_paddr = xsdt_addr + xsdt_size;
-    uint64_t *entry = (uint64_t *)((char *)xsdt + sizeof(acpi_xsdt_t));
-    for (int i = 1; i < num_tables; i++) {
-        *entry++ = (uint64_t)table_paddr;
-        table_paddr += table_sizes[i];
-    }
-
     xsdt->header.length = xsdt_size;
     xsdt->header.checksum = acpi_calc_checksum((char *)xsdt, xsdt_size);
-
-    tables[0] = xsdt;
-    table_sizes[0] = xsdt_size;
-
-    // Copy all the tables to guest
-    table_paddr = xsdt_addr;
-    for (int i = 0; i < num_tables; i++) {
-        ZF_LOGD("ACPI table \"%.4s\", addr = %p, size = %zu bytes\n",
-                (char *)tables[i], (void *)table_paddr, table_sizes[i]);
-        memcpy((void *)table_paddr, (char *)tables[i], table_sizes[i]);
-        table_paddr += table_sizes[i];
-    }
+    ZF_LOGD("ACPI table \"XSDT\", addr = %p, size = %zu bytes\n", (void *)XSDT_START, xsdt_size);
 
     // RSDP
-    uintptr_t rsdp_addr = lower_bios_addr + (ACPI_START - LOWER_BIOS_START);
     acpi_rsdp_t rsdp = {
         .signature = "RSD PTR ",
         .oem_id = "NICTA ",
         .revision = 2, /* ACPI v3*/
         .checksum = 0,
-        .rsdt_address = xsdt_addr,
+        .rsdt_address = XSDT_START,
         /* rsdt_addrss will not be inspected as the xsdt is present.
            This is not ACPI 1 compliant */
         .length = sizeof(acpi_rsdp_t),
-        .xsdt_address = xsdt_addr,
+        .xsdt_address = XSDT_START,
         .extended_checksum = 0,
         .reserved = {0}
     };
@@ -259,10 +374,16 @@ int make_guest_acpi_tables(vm_t *vm)
     rsdp.checksum = acpi_calc_checksum((char *)&rsdp, 20);
     rsdp.extended_checksum = acpi_calc_checksum((char *)&rsdp, sizeof(rsdp));
 
-    ZF_LOGD("ACPI RSDP addr = %p\n", (void *)rsdp_addr);
+    ZF_LOGD("ACPI RSDP addr = %p\n", (void *)ACPI_START);
 
-    memcpy((void *)rsdp_addr, (char *)&rsdp, sizeof(rsdp));
+    memcpy(bios + (ACPI_START - LOWER_BIOS_START), (char *)&rsdp, sizeof(rsdp));
 
+    assert(table_offset <= LOWER_BIOS_SIZE);
+    return table_offset - (ACPI_START - LOWER_BIOS_START);
+}
+
+static int map_bios_memory(vm_t *vm, cspacepath_t *bios_frames)
+{
     struct bios_iterator_cookie *bios_cookie = calloc(1, sizeof(struct bios_iterator_cookie));
     if (!bios_cookie) {
         ZF_LOGE("Failed to allocate bios iterator cookie");
@@ -278,3 +399,118 @@ int make_guest_acpi_tables(vm_t *vm)
     }
     return vm_map_reservation(vm, bios_reservation, bios_memory_iterator, (void *)bios_cookie);
 }
+
+static int check_guest_numa_vcpus(vm_t *vm)
+{
+    guest_numa_config_t *guest_numa = guest_numa_get(vm);
+    if (!guest_numa) {
+        return 0;
+    }
+    for (int i = 0; i < vm->num_vcpus; i++) {
+        int node = guest_numa_vcpu_node(vm, i);
+        if (node < 0 || node >= guest_numa->num_nodes) {
+            ZF_LOGE("Failed to describe NUMA topology: vcpu %d has invalid node %d", i, node);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Give some ACPI tables to the guest
+static int make_acpi_tables(vm_t *vm)
+{
+    if (check_guest_numa_vcpus(vm)) {
+        return -1;
+    }
+    cspacepath_t *bios_frames;
+    char *bios = alloc_bios_memory(vm, &bios_frames);
+    if (!bios) {
+        return -1;
+    }
+    build_guest_acpi_tables(vm, bios);
+    return map_bios_memory(vm, bios_frames);
+}
+
+int make_guest_acpi_tables(vm_t *vm)
+{
+    int phase = vm_boot_phase_begin("make_guest_acpi_tables");
+    int err = make_acpi_tables(vm);
+    vm_boot_phase_end(phase);
+    return err;
+}
+
+static int make_acpi_tables_cached(vm_t *vm, guest_acpi_tables_t *cache)
+{
+    if (check_guest_numa_vcpus(vm)) {
+        return -1;
+    }
+    cspacepath_t *bios_frames;
+    char *bios = alloc_bios_memory(vm, &bios_frames);
+    if (!bios) {
+        return -1;
+    }
+    char *acpi = bios + (ACPI_START - LOWER_BIOS_START);
+    guest_numa_config_t *guest_numa = guest_numa_get(vm);
+    if (cache->data && cache->num_vcpus == vm->num_vcpus && cache->numa == guest_numa) {
+        memcpy(acpi, cache->data, cache->size);
+    } else {
+        size_t size = build_guest_acpi_tables(vm, bios);
+        void *data = malloc(size);
+        if (!data) {
+            ZF_LOGE("Failed to cache ACPI tables: Unable to allocate copy");
+            return -1;
+        }
+        memcpy(data, acpi, size);
+        free(cache->data);
+        cache->num_vcpus = vm->num_vcpus;
+        cache->numa = guest_numa;
+        cache->size = size;
+        cache->data = data;
+    }
+    return map_bios_memory(vm, bios_frames);
+}
+
+int make_guest_acpi_tables_cached(vm_t *vm, guest_acpi_tables_t *cache)
+{
+    int phase = vm_boot_phase_begin("make_guest_acpi_tables");
+    int err = make_acpi_tables_cached(vm, cache);
+    vm_boot_phase_end(phase);
+    return err;
+}
+
+int make_guest_numa_topology(vm_t *vm, guest_numa_config_t *numa)
+{
+    if (numa->num_nodes <= 0 || !numa->nodes) {
+        ZF_LOGE("Failed to make NUMA topology: Invalid configuration");
+        return -1;
+    }
+    guest_numa_topology_t *topology = guest_numa_topology_get(vm);
+    if (!topology) {
+        topology = calloc(1, sizeof(*topology));
+        if (!topology) {
+            ZF_LOGE("Failed to make NUMA topology: Unable to allocate topology");
+            return -1;
+        }
+        topology->vm = vm;
+        topology->next = guest_numa_topologies;
+        guest_numa_topologies = topology;
+    }
+
+    for (int i = 0; i < numa->num_nodes; i++) {
+        guest_numa_node_t *node = &numa->nodes[i];
+        int err;
+        if (node->map_iterator) {
+            err = vm_ram_register_at_custom_iterator(vm, node->ram_start, node->ram_size, node->map_iterator,
+                                                     node->map_cookie);
+        } else {
+            err = vm_ram_register_at(vm, node->ram_start, node->ram_size, true);
+        }
+        if (err) {
+            ZF_LOGE("Failed to make NUMA topology: Unable to register RAM of node %d", i);
+            return -1;
+        }
+    }
+
+    topology->numa = numa;
+    return 0;
+}
@@ -4,9 +4,18 @@
  * SPDX-License-Identifier: BSD-2-Clause
  */
 
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vka/capops.h>
+#include <simple/simple.h>
+
 #include <sel4vm/guest_vm.h>
 #include <sel4vm/guest_memory_helpers.h>
+#include <sel4vm/guest_vcpu_fault.h>
 #include <sel4vm/arch/ioports.h>
+#include <sel4vm/arch/msi.h>
 #include <sel4vm/boot.h>
 
 #include <sel4vmmplatsupport/guest_memory_util.h>
@@ -14,7 +23,235 @@
 #include <sel4vmmplatsupport/drivers/pci.h>
 #include <sel4vmmplatsupport/drivers/pci_helper.h>
 
-int vmm_pci_helper_map_bars(vm_t *vm, libpci_device_iocfg_t *cfg, vmm_pci_bar_t *bars)
+/* Layout of the MSI-X capability */
+#define MSIX_CAP_CONTROL                0x2
+#define MSIX_CAP_TABLE                  0x4
+#define MSIX_CAP_SIZE                   0xc
+#define MSIX_CONTROL_TABLE_SIZE_MASK    MASK(11)
+#define MSIX_CONTROL_FUNCTION_MASK      BIT(14)
+#define MSIX_CONTROL_ENABLE             BIT(15)
+#define MSIX_TABLE_BIR_MASK             MASK(3)
+
+/* Layout of an entry of the MSI-X table, as 32-bit words */
+#define MSIX_ENTRY_SIZE                 16
+#define MSIX_ENTRY_WORDS                4
+#define MSIX_ENTRY_ADDRESS_LO           0
+#define MSIX_ENTRY_ADDRESS_HI           1
+#define MSIX_ENTRY_DATA                 2
+#define MSIX_ENTRY_CONTROL              3
+#define MSIX_ENTRY_CONTROL_MASKED       BIT(0)
+
+struct pci_msix_passthrough {
+    /* entry of the device the capability is emulated on top of */
+    vmm_pci_entry_t passthrough;
+    /* VM the table is emulated for, set once the bars are mapped */
+    vm_t *vm;
+    uint8_t cap_offset;
+    /* number of vectors exposed to the guest, each backed by a host vector */
+    unsigned int num_vectors;
+    /* number of entries of the device's table */
+    unsigned int table_size;
+    uint8_t table_bir;
+    /* offset of the table within its bar */
+    uint32_t table_offset;
+    /* enable and function mask bits of the message control register written by the guest */
+    uint16_t control;
+    /* table as programmed by the guest */
+    uint32_t (*entries)[MSIX_ENTRY_WORDS];
+    bool *pending;
+    pci_msix_host_vector_t *host_vectors;
+    /* pages of the bar holding the table, which are emulated, as offset within
+     * the bar, guest physical address and mapping in the VMM */
+    uintptr_t trapped_offset;
+    size_t trapped_size;
+    uintptr_t trapped_addr;
+    volatile uint8_t *trapped_vmm;
+};
+
+/* Deliver the message the guest programmed for a vector, or hold it pending
+ * while the vector is masked */
+static int msix_deliver(pci_msix_passthrough_t *msix, unsigned int vector)
+{
+    uint32_t *entry = msix->entries[vector];
+    if (!(msix->control & MSIX_CONTROL_ENABLE) || !msix->vm) {
+        return -1;
+    }
+    if ((msix->control & MSIX_CONTROL_FUNCTION_MASK) || (entry[MSIX_ENTRY_CONTROL] & MSIX_ENTRY_CONTROL_MASKED)) {
+        msix->pending[vector] = true;
+        return 0;
+    }
+    msix->pending[vector] = false;
+    uint64_t address = ((uint64_t)entry[MSIX_ENTRY_ADDRESS_HI] << 32) | entry[MSIX_ENTRY_ADDRESS_LO];
+    return vm_inject_msi(msix->vm, address, entry[MSIX_ENTRY_DATA]);
+}
+
+static void msix_deliver_pending(pci_msix_passthrough_t *msix)
+{
+    for (unsigned int i = 0; i < msix->num_vectors; i++) {
+        if (msix->pending[i]) {
+            msix_deliver(msix, i);
+        }
+    }
+}
+
+static memory_fault_result_t msix_table_fault(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t fault_addr, size_t fault_length,
+                                              void *cookie)
+{
+    pci_msix_passthrough_t *msix = (pci_msix_passthrough_t *)cookie;
+    size_t size = get_vcpu_fault_size(vcpu);
+    if (fault_addr < msix->trapped_addr || fault_addr + size > msix->trapped_addr + msix->trapped_size) {
+        /* The rest of the bar is mapped into the guest */
+        ZF_LOGE("Unexpected fault on MSI-X bar at %p", (void *)fault_addr);
+        return FAULT_ERROR;
+    }
+    uintptr_t offset = fault_addr - msix->trapped_addr;
+    uintptr_t table_start = msix->table_offset - msix->trapped_offset;
+    uintptr_t table_end = table_start + msix->table_size * MSIX_ENTRY_SIZE;
+    if (offset >= table_start && offset < table_end) {
+        unsigned int vector = (offset - table_start) / MSIX_ENTRY_SIZE;
+        unsigned int word = ((offset - table_start) % MSIX_ENTRY_SIZE) / sizeof(uint32_t);
+        if ((size != 4 && size != 8) || offset % size) {
+            ZF_LOGW("Ignoring unaligned access of size %zu to MSI-X table at offset 0x%zx", size, (size_t)offset);
+        } else if (is_vcpu_read_fault(vcpu)) {
+            uint64_t value = 0;
+            if (vector < msix->num_vectors) {
+                value = msix->entries[vector][word];
+                if (size == 8) {
+                    value |= (uint64_t)msix->entries[vector][word + 1] << 32;
+                }
+            } else if (word + size / sizeof(uint32_t) > MSIX_ENTRY_CONTROL) {
+                /* Vectors without a host vector always read as masked */
+                value = (uint64_t)MSIX_ENTRY_CONTROL_MASKED << ((MSIX_ENTRY_CONTROL - word) * 32);
+            }
+            set_vcpu_fault_data(vcpu, value);
+        } else if (vector < msix->num_vectors) {
+            uint64_t value = get_vcpu_fault_data(vcpu);
+            msix->entries[vector][word] = (uint32_t)value;
+            if (size == 8) {
+                msix->entries[vector][word + 1] = (uint32_t)(value >> 32);
+            }
+            if (msix->pending[vector]) {
+                msix_deliver(msix, vector);
+            }
+        }
+    } else {
+        /* Anything sharing the table's pages, such as the pending bit array, is the device's */
+        volatile void *reg = msix->trapped_vmm + offset;
+        if (size != 1 && size != 2 && size != 4 && size != 8) {
+            ZF_LOGE("Invalid access of size %zu to MSI-X bar", size);
+            return FAULT_ERROR;
+        }
+        if (is_vcpu_read_fault(vcpu)) {
+            uint64_t value = size == 1 ? *(volatile uint8_t *)reg :
+                             size == 2 ? *(volatile uint16_t *)reg :
+                             size == 4 ? *(volatile uint32_t *)reg : *(volatile uint64_t *)reg;
+            set_vcpu_fault_data(vcpu, value);
+        } else {
+            uint64_t value = get_vcpu_fault_data(vcpu);
+            if (size == 1) {
+                *(volatile uint8_t *)reg = value;
+            } else if (size == 2) {
+                *(volatile uint16_t *)reg = value;
+            } else if (size == 4) {
+                *(volatile uint32_t *)reg = value;
+            } else {
+                *(volatile uint64_t *)reg = value;
+            }
+        }
+    }
+    advance_vcpu_fault(vcpu);
+    return FAULT_HANDLED;
+}
+
+static int device_frame(vm_t *vm, uintptr_t paddr, seL4_CPtr *cap)
+{
+    cspacepath_t path;
+    int error = vka_cspace_alloc_path(vm->vka, &path);
+    if (error) {
+        ZF_LOGE("Failed to allocate path");
+        return error;
+    }
+    error = simple_get_frame_cap(vm->simple, (void *)paddr, seL4_PageBits, &path);
+    if (error) {
+        uintptr_t vka_cookie;
+        error = vka_utspace_alloc_at(vm->vka, &path, kobject_get_type(KOBJECT_FRAME, seL4_PageBits), seL4_PageBits,
+                                     paddr, &vka_cookie);
+    }
+    if (error) {
+        vka_cspace_free_path(vm->vka, path);
+        return error;
+    }
+    *cap = path.capPtr;
+    return 0;
+}
+
+/* Map the bar holding an MSI-X table into the guest but for the pages of the
+ * table, which are mapped into the VMM and trapped, and program the device's
+ * table with the host messages */
+static int map_msix_bar(vm_t *vm, uintptr_t paddr, size_t size, pci_msix_passthrough_t *msix, uintptr_t *addr)
+{
+    uintptr_t trapped_start = ROUND_DOWN(msix->table_offset, BIT(seL4_PageBits));
+    uintptr_t trapped_end = ROUND_UP(msix->table_offset + msix->table_size * MSIX_ENTRY_SIZE, BIT(seL4_PageBits));
+    if (trapped_end > size) {
+        ZF_LOGE("MSI-X table at offset 0x%x overruns its bar of size %zu", (unsigned int)msix->table_offset, size);
+        return -1;
+    }
+    vm_memory_reservation_t *reservation = vm_reserve_anon_memory(vm, size, size, msix_table_fault, msix, addr);
+    if (!reservation) {
+        ZF_LOGE("Failed to reserve MSI-X table bar");
+        return -1;
+    }
+    if (*addr % size) {
+        ZF_LOGE("Guest PCI bar address %p is not aligned to size %zu", (void *)*addr, size);
+        return -1;
+    }
+    size_t num_trapped = (trapped_end - trapped_start) >> seL4_PageBits;
+    seL4_CPtr trapped_caps[num_trapped];
+    for (uintptr_t offset = 0; offset < size; offset += BIT(seL4_PageBits)) {
+        seL4_CPtr cap;
+        if (device_frame(vm, paddr + offset, &cap)) {
+            ZF_LOGE("Failed to get frame of MSI-X table bar at %p", (void *)(paddr + offset));
+            return -1;
+        }
+        if (offset >= trapped_start && offset < trapped_end) {
+            trapped_caps[(offset - trapped_start) >> seL4_PageBits] = cap;
+            continue;
+        }
+        vm_frame_t frame = {
+            .cptr = cap,
+            .rights = seL4_AllRights,
+            .vaddr = *addr + offset,
+            .size_bits = seL4_PageBits
+        };
+        if (vm_reservation_map_frame(vm, reservation, frame)) {
+            ZF_LOGE("Failed to map frame of MSI-X table bar into the guest");
+            return -1;
+        }
+    }
+    void *trapped = vspace_map_pages(&vm->mem.vmm_vspace, trapped_caps, NULL, seL4_AllRights, num_trapped,
+                                     seL4_PageBits, 0);
+    if (!trapped) {
+        ZF_LOGE("Failed to map MSI-X table into the VMM");
+        return -1;
+    }
+    msix->trapped_offset = trapped_start;
+    msix->trapped_size = trapped_end - trapped_start;
+    msix->trapped_addr = *addr + trapped_start;
+    msix->trapped_vmm = trapped;
+    /* Each vector signals its own host IRQ, masking being emulated */
+    volatile uint32_t *table = (volatile uint32_t *)(msix->trapped_vmm + msix->table_offset - trapped_start);
+    for (unsigned int i = 0; i < msix->num_vectors; i++) {
+        volatile uint32_t *entry = table + i * MSIX_ENTRY_WORDS;
+        entry[MSIX_ENTRY_ADDRESS_LO] = (uint32_t)msix->host_vectors[i].address;
+        entry[MSIX_ENTRY_ADDRESS_HI] = (uint32_t)(msix->host_vectors[i].address >> 32);
+        entry[MSIX_ENTRY_DATA] = msix->host_vectors[i].data;
+        entry[MSIX_ENTRY_CONTROL] = 0;
+    }
+    msix->vm = vm;
+    return 0;
+}
+
+static int map_bars(vm_t *vm, libpci_device_iocfg_t *cfg, vmm_pci_bar_t *bars, pci_msix_passthrough_t *msix)
 {
     int i;
     int bar = 0;
@@ -31,8 +268,19 @@ int vmm_pci_helper_map_bars(vm_t *vm, libpci_device_iocfg_t *cfg, vmm_pci_bar_t
         }
         bars[bar].size_bits = size_bits;
         if (cfg->base_addr_space[i] == PCI_BASE_ADDRESS_SPACE_MEMORY) {
-            /* Need to map into the VMM. Make sure it is aligned */
             uintptr_t addr;
+            if (msix && i == msix->table_bir) {
+                int err = map_msix_bar(vm, (uintptr_t)cfg->base_addr[i], size, msix, &addr);
+                if (err) {
+                    ZF_LOGE("Failed to map MSI-X table bar %p size %zu", (void *)(uintptr_t)cfg->base_addr[i], size);
+                    return -1;
+                }
+                bars[bar].address = addr;
+                bars[bar].mem_type = cfg->base_addr_prefetchable[i] ? PREFETCH_MEM : NON_PREFETCH_MEM;
+                bar++;
+                continue;
+            }
+            /* Need to map into the VMM. Make sure it is aligned */
             vm_memory_reservation_t *reservation = vm_reserve_anon_memory(vm, size, size,
                                                                           default_error_fault_callback, NULL,
                                                                           &addr);
@@ -57,8 +305,9 @@ int vmm_pci_helper_map_bars(vm_t *vm, libpci_device_iocfg_t *cfg, vmm_pci_bar_t
                 bars[bar].mem_type = NON_PREFETCH_MEM;
             }
         } else {
-            /* Need to add the IO port range */
-            int error = vm_enable_passthrough_ioport(vm->vcpus[BOOT_VCPU], cfg->base_addr[i], cfg->base_addr[i] + size - 1);
+            /* Pass the IO port range through to all vcpus, BAR emulation keeps the
+             * guest's view of the BAR at the host's ports */
+            int error = vm_passthrough_ioport(vm, cfg->base_addr[i], cfg->base_addr[i] + size - 1);
             if (error) {
                 return error;
             }
@@ -70,6 +319,175 @@ int vmm_pci_helper_map_bars(vm_t *vm, libpci_device_iocfg_t *cfg, vmm_pci_bar_t
     return bar;
 }
 
+int vmm_pci_helper_map_bars(vm_t *vm, libpci_device_iocfg_t *cfg, vmm_pci_bar_t *bars)
+{
+    return map_bars(vm, cfg, bars, NULL);
+}
+
+int vmm_pci_helper_map_bars_msix(vm_t *vm, libpci_device_iocfg_t *cfg, vmm_pci_bar_t *bars,
+                                  pci_msix_passthrough_t *msix)
+{
+    if (!msix) {
+        return map_bars(vm, cfg, bars, NULL);
+    }
+    if (msix->table_bir >= 6 || cfg->base_addr[msix->table_bir] == 0 ||
+        cfg->base_addr_space[msix->table_bir] != PCI_BASE_ADDRESS_SPACE_MEMORY) {
+        ZF_LOGE("Failed to map bars: MSI-X table is not in a memory bar (bir %d)", msix->table_bir);
+        return -1;
+    }
+    return map_bars(vm, cfg, bars, msix);
+}
+
+int vmm_pci_helper_inject_msi(vm_t *vm, pci_msi_emulation_t *msi, unsigned int vector)
+{
+    uint64_t address;
+    uint32_t data;
+    if (vmm_pci_msi_get_message(msi, vector, &address, &data)) {
+        return -1;
+    }
+    return vm_inject_msi(vm, address, data);
+}
+
+static int msix_cap_read(void *cookie, int offset, int size, uint32_t *result)
+{
+    pci_msix_passthrough_t *msix = (pci_msix_passthrough_t *)cookie;
+    int error = msix->passthrough.ioread(msix->passthrough.cookie, offset, size, result);
+    if (error) {
+        return error;
+    }
+    /* Patch in the guest's message control register over any of its bytes read */
+    int control = msix->cap_offset + MSIX_CAP_CONTROL;
+    uint16_t value = msix->control | (msix->num_vectors - 1);
+    for (int i = 0; i < 2; i++) {
+        int pos = control + i - offset;
+        if (pos >= 0 && pos < size) {
+            *result &= ~(MASK(8) << (pos * 8));
+            *result |= ((value >> (i * 8)) & MASK(8)) << (pos * 8);
+        }
+    }
+    return 0;
+}
+
+static int msix_cap_write(void *cookie, int offset, int size, uint32_t value)
+{
+    pci_msix_passthrough_t *msix = (pci_msix_passthrough_t *)cookie;
+    if (offset >= msix->cap_offset + MSIX_CAP_SIZE || offset + size <= msix->cap_offset) {
+        return msix->passthrough.iowrite(msix->passthrough.cookie, offset, size, value);
+    }
+    /* Only the enable and function mask bits of the capability are writable */
+    int control = msix->cap_offset + MSIX_CAP_CONTROL;
+    uint16_t written = msix->control;
+    for (int i = 0; i < 2; i++) {
+        int pos = control + i - offset;
+        if (pos >= 0 && pos < size) {
+            written &= ~(MASK(8) << (i * 8));
+            written |= ((value >> (pos * 8)) & MASK(8)) << (i * 8);
+        }
+    }
+    msix->control = written & (MSIX_CONTROL_ENABLE | MSIX_CONTROL_FUNCTION_MASK);
+    /* The device follows the guest's enable, its function left unmasked as masking is emulated */
+    int error = msix->passthrough.iowrite(msix->passthrough.cookie, control, 2, msix->control & MSIX_CONTROL_ENABLE);
+    if (error) {
+        return error;
+    }
+    if (msix->control & MSIX_CONTROL_ENABLE) {
+        msix_deliver_pending(msix);
+    }
+    return 0;
+}
+
+static uint8_t find_msix_cap(vmm_pci_entry_t existing)
+{
+    uint32_t value = 0;
+    int UNUSED error = existing.ioread(existing.cookie, PCI_STATUS, 1, &value);
+    assert(!error);
+    if (!(value & PCI_STATUS_CAP_LIST)) {
+        return 0;
+    }
+    error = existing.ioread(existing.cookie, PCI_CAPABILITY_LIST, 1, &value);
+    assert(!error);
+    value &= ~MASK(2);
+    while (value != 0) {
+        uint32_t cap_type = 0;
+        error = existing.ioread(existing.cookie, value, 1, &cap_type);
+        assert(!error);
+        if (cap_type == PCI_CAP_ID_MSIX) {
+            return value;
+        }
+        error = existing.ioread(existing.cookie, value + 1, 1, &value);
+        assert(!error);
+        value &= ~MASK(2);
+    }
+    return 0;
+}
+
+vmm_pci_entry_t vmm_pci_helper_create_msix_passthrough(vmm_pci_entry_t existing,
+                                                       const pci_msix_host_vector_t *host_vectors,
+                                                       unsigned int num_vectors, pci_msix_passthrough_t **msix)
+{
+    *msix = NULL;
+    uint8_t cap = find_msix_cap(existing);
+    if (!cap) {
+        ZF_LOGW("Device has no MSI-X capability, hiding its MSI capabilities");
+        return vmm_pci_no_msi_cap_emulation(existing);
+    }
+    uint32_t control = 0;
+    uint32_t table = 0;
+    int UNUSED error = existing.ioread(existing.cookie, cap + MSIX_CAP_CONTROL, 2, &control);
+    assert(!error);
+    error = existing.ioread(existing.cookie, cap + MSIX_CAP_TABLE, 4, &table);
+    assert(!error);
+    unsigned int table_size = (control & MSIX_CONTROL_TABLE_SIZE_MASK) + 1;
+    if (num_vectors == 0 || !host_vectors) {
+        ZF_LOGE("Failed to create MSI-X passthrough: no host vectors given");
+        return vmm_pci_no_msi_cap_emulation(existing);
+    }
+    if (num_vectors > table_size) {
+        num_vectors = table_size;
+    }
+
+    pci_msix_passthrough_t *emul = calloc(1, sizeof(*emul));
+    if (emul) {
+        emul->entries = calloc(num_vectors, sizeof(*emul->entries));
+        emul->pending = calloc(num_vectors, sizeof(*emul->pending));
+        emul->host_vectors = calloc(num_vectors, sizeof(*emul->host_vectors));
+    }
+    if (!emul || !emul->entries || !emul->pending || !emul->host_vectors) {
+        ZF_LOGE("Failed to allocate MSI-X passthrough");
+        if (emul) {
+            free(emul->entries);
+            free(emul->pending);
+            free(emul->host_vectors);
+            free(emul);
+        }
+        return vmm_pci_no_msi_cap_emulation(existing);
+    }
+    emul->cap_offset = cap;
+    emul->num_vectors = num_vectors;
+    emul->table_size = table_size;
+    emul->table_bir = table & MSIX_TABLE_BIR_MASK;
+    emul->table_offset = table & ~MSIX_TABLE_BIR_MASK;
+    memcpy(emul->host_vectors, host_vectors, num_vectors * sizeof(*host_vectors));
+    /* Vectors come out of reset masked */
+    for (unsigned int i = 0; i < num_vectors; i++) {
+        emul->entries[i][MSIX_ENTRY_CONTROL] = MSIX_ENTRY_CONTROL_MASKED;
+    }
+    emul->passthrough = vmm_pci_msix_only_cap_emulation(existing);
+    *msix = emul;
+    return (vmm_pci_entry_t) {
+        .cookie = emul, .ioread = msix_cap_read, .iowrite = msix_cap_write
+    };
+}
+
+int vmm_pci_helper_inject_msix(vm_t *vm, pci_msix_passthrough_t *msix, unsigned int vector)
+{
+    if (!msix || vector >= msix->num_vectors) {
+        ZF_LOGE("Failed to inject MSI-X vector %u: out of range", vector);
+        return -1;
+    }
+    return msix_deliver(msix, vector);
+}
+
 ioport_fault_result_t vmm_pci_io_port_in(vm_vcpu_t *vcpu, void *cookie, unsigned int port_no, unsigned int size,
                                          unsigned int *result)
 {
@@ -9,8 +9,6 @@
 #include <string.h>
 
 #include <elf/elf.h>
-#include <sel4utils/mapping.h>
-#include <vka/capops.h>
 #include <cpio/cpio.h>
 
 #include <sel4vmmplatsupport/guest_image.h>
@@ -18,6 +16,9 @@
 #include <sel4vm/guest_vm.h>
 #include <sel4vm/guest_memory.h>
 #include <sel4vm/guest_ram.h>
+#include <sel4vm/guest_vm_boot_phases.h>
+
+#include "../../guest_image_lz4.h"
 
 typedef struct boot_guest_cookie {
     vm_t *vm;
@@ -42,15 +43,37 @@ static int read_elf_headers(void *buf, vm_t *vm, FILE *file, size_t buf_size, el
     return elf_newFile_maybe_unsafe(buf, buf_size, true, false, elf);
 }
 
-static int guest_elf_write_address(vm_t *vm, uintptr_t paddr, void *vaddr, size_t size, size_t offset, void *cookie)
+typedef struct reloc_batch {
+    uint32_t *relocs;
+    int count;
+    /* guest physical address the touched range starts at */
+    uintptr_t start;
+    uintptr_t link_vaddr;
+    uintptr_t load_paddr;
+    int delta;
+} reloc_batch_t;
+
+static uintptr_t reloc_guest_paddr(reloc_batch_t *batch, uint32_t vaddr)
 {
-    memcpy(vaddr, cookie + offset, size);
-    return 0;
+    return (uintptr_t)vaddr - batch->link_vaddr + batch->load_paddr;
 }
 
-static int guest_elf_read_address(vm_t *vm, uintptr_t paddr, void *vaddr, size_t size, size_t offset, void *cookie)
+/* Apply each relocation of the batch that lies within the touched frame */
+static int guest_elf_relocate_batch(vm_t *vm, uintptr_t paddr, void *vaddr, size_t size, size_t offset, void *cookie)
 {
-    memcpy(cookie + offset, vaddr, size);
+    reloc_batch_t *batch = (reloc_batch_t *)cookie;
+    uintptr_t start = batch->start + offset;
+    for (int i = 0; i < batch->count; i++) {
+        uintptr_t guest_paddr = reloc_guest_paddr(batch, batch->relocs[i]);
+        if (guest_paddr < start || guest_paddr + sizeof(uint32_t) > start + size) {
+            continue;
+        }
+        uint32_t addr;
+        void *fixup = vaddr + (guest_paddr - start);
+        memcpy(&addr, fixup, sizeof(addr));
+        addr += batch->delta;
+        memcpy(fixup, &addr, sizeof(addr));
+    }
     return 0;
 }
 
@@ -81,6 +104,28 @@ int guest_elf_relocate(vm_t *vm, const char *relocs_filename, guest_kernel_image
     relocs_size = ftell(file);
     fseek(file, 0, SEEK_SET);
 
+    uint32_t num_relocations = relocs_size / sizeof(uint32_t) - 1;
+    if (relocs_size < sizeof(uint32_t) || num_relocations == 0) {
+        ZF_LOGE("Relocation required, but Kernel has not been build with CONFIG_RELOCATABLE.");
+        fclose(file);
+        return -1;
+    }
+
+    /* The whole relocs file is read at once */
+    uint32_t *relocs = malloc(relocs_size);
+    if (!relocs) {
+        ZF_LOGE("Failed to allocate memory for relocs file %s", relocs_filename);
+        fclose(file);
+        return -1;
+    }
+    size_t result = fread(relocs, relocs_size, 1, file);
+    fclose(file);
+    if (result != 1) {
+        ZF_LOGE("Failed to read relocs file %s", relocs_filename);
+        free(relocs);
+        return -1;
+    }
+
     /* The relocs file is the same relocs file format used by the Linux kernel decompressor to
      * relocate the Linux kernel:
      *
@@ -93,126 +138,116 @@ int guest_elf_relocate(vm_t *vm, const char *relocs_filename, guest_kernel_image
      * So we work backwards from the end of the file, and modify the guest kernel OS binary.
      * We only support 32-bit relocations, and ignore the 64-bit data.
      *
+     * The relocations are sorted, so each run of them within a page is applied with a
+     * single touch of that page.
+     *
      * src: Linux kernel 3.5.3 arch/x86/boot/compressed/misc.c
      */
-    uint32_t last_relocated_vaddr = 0xFFFFFFFF;
-    uint32_t num_relocations = relocs_size / sizeof(uint32_t) - 1;
-    for (int i = 0; ; i++) {
-        uint32_t vaddr;
-        /* Get the next relocation from the relocs file. */
-        uint32_t offset = relocs_size - (sizeof(uint32_t) * (i + 1));
-        fseek(file, offset, SEEK_SET);
-        size_t result = fread(&vaddr, sizeof(uint32_t), 1, file);
-        ZF_LOGF_IF(result != 1, "Read failed unexpectedly");
-        if (!vaddr) {
-            break;
+    reloc_batch_t batch = {
+        .link_vaddr = image->kernel_image_arch.link_vaddr,
+        .load_paddr = load_addr + delta,
+        .delta = delta,
+    };
+    int err = 0;
+    int end = relocs_size / sizeof(uint32_t);
+    int first = end;
+    while (first > 0 && relocs[first - 1]) {
+        assert(relocs[first - 1] >= (uint32_t)image->kernel_image_arch.link_vaddr);
+        first--;
+    }
+    for (int i = first; i < end && !err;) {
+        uintptr_t lo = reloc_guest_paddr(&batch, relocs[i]);
+        uintptr_t hi = lo + sizeof(uint32_t);
+        uintptr_t page = ROUND_DOWN(lo, BIT(seL4_PageBits));
+        if (ROUND_DOWN(hi - 1, BIT(seL4_PageBits)) != page) {
+            /* A relocation straddling two pages is applied on its own */
+            uint32_t addr;
+            err = vm_ram_touch(vm, lo, sizeof(addr), vm_guest_ram_read_callback, &addr);
+            addr += delta;
+            err = err ? err : vm_ram_touch(vm, lo, sizeof(addr), vm_guest_ram_write_callback, &addr);
+            i++;
+            continue;
         }
-        assert(i * sizeof(uint32_t) < relocs_size);
-        last_relocated_vaddr = vaddr;
-
-        /* Calculate the corresponding guest-physical address at which we have already
-           allocated and mapped the ELF contents into. */
-        assert(vaddr >= (uint32_t)image->kernel_image_arch.link_vaddr);
-        uintptr_t guest_paddr = (uintptr_t)vaddr - (uintptr_t)image->kernel_image_arch.link_vaddr +
-                                (uintptr_t)(load_addr + delta);
-
-        /* Perform the relocation. */
-        ZF_LOGI("   reloc vaddr 0x%x guest_addr 0x%x", (unsigned int)vaddr, (unsigned int)guest_paddr);
-        uint32_t addr;
-        vm_ram_touch(vm, guest_paddr, sizeof(int),
-                     guest_elf_read_address, &addr);
-        addr += delta;
-        vm_ram_touch(vm, guest_paddr, sizeof(int),
-                     guest_elf_write_address, &addr);
-
-        if (i && i % 50000 == 0) {
-            ZF_LOGE("    %u relocs done.", i);
+        int j = i + 1;
+        while (j < end) {
+            uintptr_t guest_paddr = reloc_guest_paddr(&batch, relocs[j]);
+            if (ROUND_DOWN(guest_paddr, BIT(seL4_PageBits)) != page
+                || ROUND_DOWN(guest_paddr + sizeof(uint32_t) - 1, BIT(seL4_PageBits)) != page) {
+                break;
+            }
+            lo = MIN(lo, guest_paddr);
+            hi = MAX(hi, guest_paddr + sizeof(uint32_t));
+            j++;
         }
+        batch.relocs = &relocs[i];
+        batch.count = j - i;
+        batch.start = lo;
+        err = vm_ram_touch(vm, lo, hi - lo, guest_elf_relocate_batch, &batch);
+        i = j;
     }
-    ZF_LOGI("plat: last relocated addr was %d", last_relocated_vaddr);
-    ZF_LOGI("plat: %d kernel relocations completed.", num_relocations);
-    (void) last_relocated_vaddr;
+    ZF_LOGI("plat: %d kernel relocations completed.", end - first);
+    free(relocs);
 
-    if (num_relocations == 0) {
-        ZF_LOGE("Relocation required, but Kernel has not been build with CONFIG_RELOCATABLE.");
+    if (err) {
+        ZF_LOGE("Failed to relocate guest kernel");
         return -1;
     }
-
-    fclose(file);
     return 0;
 }
 
 /* TODO: Refactor and stop rewriting fucking elf loading code */
+typedef struct load_segment_cookie {
+    FILE *file;
+    /* bytes of the segment still to be read from the file, the rest being zeroed */
+    size_t remain;
+} load_segment_cookie_t;
+
+static int load_segment_continued(vm_t *vm, uintptr_t paddr, void *addr, size_t size, size_t offset, void *cookie)
+{
+    load_segment_cookie_t *segment = (load_segment_cookie_t *)cookie;
+    size_t copy_len = MIN(size, segment->remain);
+    /* The file is positioned at the start of the segment, and the segment is touched in order */
+    if (copy_len) {
+        size_t result = fread(addr, copy_len, 1, segment->file);
+        if (result != 1) {
+            ZF_LOGE("Failed to read elf segment at %p", (void *)paddr);
+            return -1;
+        }
+        segment->remain -= copy_len;
+    }
+    memset(addr + copy_len, 0, size - copy_len);
+    return 0;
+}
+
 static int load_guest_segment(vm_t *vm, seL4_Word source_offset,
                               seL4_Word dest_addr, unsigned int segment_size, unsigned int file_size, FILE *file)
 {
-
-    int ret;
-    unsigned int page_size = seL4_PageBits;
     assert(file_size <= segment_size);
 
-    /* Allocate a cslot for duplicating frame caps */
-    cspacepath_t dup_slot;
-    ret = vka_cspace_alloc_path(vm->vka, &dup_slot);
-    if (ret) {
-        ZF_LOGE("Failed to allocate slot");
-        return ret;
+    if (fseek(file, source_offset, SEEK_SET)) {
+        ZF_LOGE("Failed to seek to elf segment at offset %zu", (size_t)source_offset);
+        return -1;
     }
 
-    size_t current = 0;
-    size_t remain = file_size;
-    while (current < segment_size) {
-        /* Retrieve the mapping */
-        seL4_CPtr cap;
-        cap = vspace_get_cap(&vm->mem.vm_vspace, (void *)dest_addr);
-        if (!cap) {
-            ZF_LOGE("Failed to find frame cap while loading elf segment at %p", (void *)dest_addr);
-            return -1;
-        }
-        cspacepath_t cap_path;
-        vka_cspace_make_path(vm->vka, cap, &cap_path);
-
-        /* Copy cap and map into our vspace */
-        vka_cnode_copy(&dup_slot, &cap_path, seL4_AllRights);
-        void *map_vaddr = vspace_map_pages(&vm->mem.vmm_vspace, &dup_slot.capPtr, NULL, seL4_AllRights, 1, page_size, 1);
-        if (!map_vaddr) {
-            ZF_LOGE("Failed to map page into host vspace");
+    /* Direct mapped RAM is loaded with a single read */
+    void *vaddr = vm_guest_ram_vaddr(vm, dest_addr, segment_size);
+    if (vaddr) {
+        if (file_size && fread(vaddr, file_size, 1, file) != 1) {
+            ZF_LOGE("Failed to read elf segment at %p", (void *)dest_addr);
             return -1;
         }
-
-        /* Copy the contents of page from ELF into the mapped frame. */
-        size_t offset = dest_addr & ((BIT(page_size)) - 1);
-
-        void *copy_vaddr = map_vaddr + offset;
-        size_t copy_len = (BIT(page_size)) - offset;
-
-        if (remain > 0) {
-            if (copy_len > remain) {
-                /* Don't copy past end of data. */
-                copy_len = remain;
-            }
-
-            ZF_LOGI("load page src %zu dest %p remain %zu offset %zu copy vaddr %p "
-                    "copy len %zu\n", source_offset, (void *)dest_addr, remain, offset, copy_vaddr, copy_len);
-
-            fseek(file, source_offset, SEEK_SET);
-            size_t result = fread(copy_vaddr, copy_len, 1, file);
-            ZF_LOGF_IF(result != 1, "Read failed unexpectedly");
-            source_offset += copy_len;
-            remain -= copy_len;
-        } else {
-            memset(copy_vaddr, 0, copy_len);
-        }
-
-        dest_addr += copy_len;
-
-        current += copy_len;
-
-        /* Unamp the page and delete the temporary cap */
-        vspace_unmap_pages(&vm->mem.vmm_vspace, map_vaddr, 1, page_size, NULL);
-        vka_cnode_delete(&dup_slot);
+        memset(vaddr + file_size, 0, segment_size - file_size);
+        return 0;
     }
 
+    /* Otherwise each frame backing the segment is mapped once, large frames whole,
+     * and read into sequentially */
+    load_segment_cookie_t cookie = { .file = file, .remain = file_size };
+    int ret = vm_ram_touch(vm, dest_addr, segment_size, load_segment_continued, &cookie);
+    if (ret) {
+        ZF_LOGE("Failed to load elf segment at %p", (void *)dest_addr);
+        return -1;
+    }
     return 0;
 }
 
@@ -314,8 +349,8 @@ static int load_guest_elf(vm_t *vm, const char *image_name, uintptr_t load_addre
     return 0;
 }
 
-int vm_load_guest_kernel(vm_t *vm, const char *kernel_name, uintptr_t load_address, size_t alignment,
-                         guest_kernel_image_t *guest_kernel_image)
+static int load_kernel(vm_t *vm, const char *kernel_name, uintptr_t load_address, size_t alignment,
+                       guest_kernel_image_t *guest_kernel_image)
 {
     int err;
     err = load_guest_elf(vm, kernel_name, load_address, alignment, guest_kernel_image);
@@ -342,8 +377,15 @@ static int load_module_continued(vm_t *vm, uintptr_t paddr, void *addr, size_t s
     return 0;
 }
 
-int vm_load_guest_module(vm_t *vm, const char *module_name, uintptr_t load_address, size_t alignment,
-                         guest_image_t *guest_image)
+static ssize_t image_file_read(void *cookie, void *buf, size_t len)
+{
+    FILE *file = (FILE *)cookie;
+    size_t result = fread(buf, 1, len, file);
+    return ferror(file) ? -1 : result;
+}
+
+static int load_module(vm_t *vm, const char *module_name, uintptr_t load_address, size_t alignment,
+                       guest_image_t *guest_image)
 {
     ZF_LOGI("Loading module \"%s\" at 0x%x\n", module_name, (unsigned int)load_address);
 
@@ -353,6 +395,20 @@ int vm_load_guest_module(vm_t *vm, const char *module_name, uintptr_t load_addre
         ZF_LOGE("Module \"%s\" not found.", module_name);
         return -1;
     }
+
+    /* Compressed modules are decompressed into guest RAM as they are read */
+    uint32_t magic = 0;
+    if (fread(&magic, sizeof(magic), 1, file) == 1 && image_is_lz4(&magic)) {
+        int err = load_lz4_image(vm, image_file_read, file, load_address, &module_size);
+        fclose(file);
+        if (err) {
+            ZF_LOGE("Failed to load module \"%s\"", module_name);
+            return -1;
+        }
+        guest_image->load_paddr = load_address;
+        guest_image->size = module_size;
+        return 0;
+    }
     fseek(file, 0, SEEK_END);
     module_size = ftell(file);
     fseek(file, 0, SEEK_SET);
@@ -372,3 +428,21 @@ int vm_load_guest_module(vm_t *vm, const char *module_name, uintptr_t load_addre
 
     return 0;
 }
+
+int vm_load_guest_kernel(vm_t *vm, const char *kernel_name, uintptr_t load_address, size_t alignment,
+                         guest_kernel_image_t *guest_kernel_image)
+{
+    int phase = vm_boot_phase_begin("vm_load_guest_kernel");
+    int err = load_kernel(vm, kernel_name, load_address, alignment, guest_kernel_image);
+    vm_boot_phase_end(phase);
+    return err;
+}
+
+int vm_load_guest_module(vm_t *vm, const char *module_name, uintptr_t load_address, size_t alignment,
+                         guest_image_t *guest_image)
+{
+    int phase = vm_boot_phase_begin("vm_load_guest_module");
+    int err = load_module(vm, module_name, load_address, alignment, guest_image);
+    vm_boot_phase_end(phase);
+    return err;
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <string.h>
+
+#include <sel4/sel4.h>
+#include <utils/util.h>
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/arch/guest_x86_context.h>
+#include <sel4vm/arch/vmcs_fields.h>
+
+#include "../../guest_migration_arch.h"
+
+/* Guest state fields of the VMCS making up the state of a vcpu, alongside its general purpose registers */
+static const seL4_Word vmcs_fields[] = {
+    VMX_GUEST_RIP, VMX_GUEST_RSP, VMX_GUEST_RFLAGS,
+    VMX_GUEST_CR0, VMX_GUEST_CR3, VMX_GUEST_CR4, VMX_GUEST_EFER, VMX_GUEST_PAT, VMX_GUEST_DR7,
+    VMX_GUEST_ES_SELECTOR, VMX_GUEST_CS_SELECTOR, VMX_GUEST_SS_SELECTOR, VMX_GUEST_DS_SELECTOR,
+    VMX_GUEST_FS_SELECTOR, VMX_GUEST_GS_SELECTOR, VMX_GUEST_LDTR_SELECTOR, VMX_GUEST_TR_SELECTOR,
+    VMX_GUEST_ES_LIMIT, VMX_GUEST_CS_LIMIT, VMX_GUEST_SS_LIMIT, VMX_GUEST_DS_LIMIT,
+    VMX_GUEST_FS_LIMIT, VMX_GUEST_GS_LIMIT, VMX_GUEST_LDTR_LIMIT, VMX_GUEST_TR_LIMIT,
+    VMX_GUEST_ES_ACCESS_RIGHTS, VMX_GUEST_CS_ACCESS_RIGHTS, VMX_GUEST_SS_ACCESS_RIGHTS, VMX_GUEST_DS_ACCESS_RIGHTS,
+    VMX_GUEST_FS_ACCESS_RIGHTS, VMX_GUEST_GS_ACCESS_RIGHTS, VMX_GUEST_LDTR_ACCESS_RIGHTS, VMX_GUEST_TR_ACCESS_RIGHTS,
+    VMX_GUEST_ES_BASE, VMX_GUEST_CS_BASE, VMX_GUEST_SS_BASE, VMX_GUEST_DS_BASE,
+    VMX_GUEST_FS_BASE, VMX_GUEST_GS_BASE, VMX_GUEST_LDTR_BASE, VMX_GUEST_TR_BASE,
+    VMX_GUEST_GDTR_BASE, VMX_GUEST_GDTR_LIMIT, VMX_GUEST_IDTR_BASE, VMX_GUEST_IDTR_LIMIT,
+    VMX_GUEST_SYSENTER_CS, VMX_GUEST_SYSENTER_ESP, VMX_GUEST_SYSENTER_EIP,
+    VMX_GUEST_INTERRUPTABILITY, VMX_GUEST_ACTIVITY, VMX_GUEST_PENDING_DEBUG_EXCEPTIONS,
+};
+
+struct vcpu_state {
+    seL4_VCPUContext context;
+    uint32_t vmcs[ARRAY_SIZE(vmcs_fields)];
+};
+
+int vm_migration_vcpu_save(vm_vcpu_t *vcpu, void *buf, size_t size, size_t *len)
+{
+    struct vcpu_state state;
+    if (size < sizeof(state) || vm_get_thread_context(vcpu, &state.context)) {
+        return -1;
+    }
+    for (int i = 0; i < ARRAY_SIZE(vmcs_fields); i++) {
+        if (vm_get_vmcs_field(vcpu, vmcs_fields[i], &state.vmcs[i])) {
+            ZF_LOGE("Failed to save vcpu: Unable to read VMCS field 0x%x", (unsigned int)vmcs_fields[i]);
+            return -1;
+        }
+    }
+    memcpy(buf, &state, sizeof(state));
+    *len = sizeof(state);
+    return 0;
+}
+
+int vm_migration_vcpu_load(vm_vcpu_t *vcpu, const void *buf, size_t len)
+{
+    struct vcpu_state state;
+    if (len != sizeof(state)) {
+        ZF_LOGE("Failed to load vcpu: State of %zu bytes rather than %zu", len, sizeof(state));
+        return -1;
+    }
+    memcpy(&state, buf, sizeof(state));
+    for (int i = 0; i < ARRAY_SIZE(vmcs_fields); i++) {
+        if (vm_set_vmcs_field(vcpu, vmcs_fields[i], state.vmcs[i])) {
+            ZF_LOGE("Failed to load vcpu: Unable to write VMCS field 0x%x", (unsigned int)vmcs_fields[i]);
+            return -1;
+        }
+    }
+    return vm_set_thread_context(vcpu, state.context);
+}
@@ -17,9 +17,20 @@ int device_list_init(device_list_t *list)
     return 0;
 }
 
-static int dev_cmp(const void *a, const void *b)
+/* Index of the first device in the list starting above addr */
+static int device_upper_bound(device_list_t *list, uintptr_t addr)
 {
-    return ((const struct device *)a)->pstart - ((const struct device *)b)->pstart;
+    int low = 0;
+    int high = list->num_devices;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (list->devices[mid].pstart <= addr) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
 }
 
 int add_device(device_list_t *list, const struct device *d)
@@ -33,26 +44,25 @@ int add_device(device_list_t *list, const struct device *d)
         return -1;
     }
     list->devices = updated_devices;
-    memcpy(&list->devices[list->num_devices++], d, sizeof(struct device));
-    qsort(list->devices, list->num_devices, sizeof(struct device), dev_cmp);
+    /* Keep the list sorted by start address */
+    int pos = device_upper_bound(list, d->pstart);
+    memmove(&list->devices[pos + 1], &list->devices[pos], sizeof(struct device) * (list->num_devices - pos));
+    memcpy(&list->devices[pos], d, sizeof(struct device));
+    list->num_devices++;
     return 0;
 }
 
 struct device *
 find_device_by_pa(device_list_t *dev_list, uintptr_t addr)
 {
-    struct device *dev = NULL;
-    for (int i = 0; i < dev_list->num_devices; i++) {
-        struct device *curr_dev = &dev_list->devices[i];
-        if (addr < curr_dev->pstart) {
-            break;
-        }
-
-        if (addr < curr_dev->pstart + curr_dev->size) {
-            /* Found a match */
-            dev = curr_dev;
-            break;
-        }
+    int pos = device_upper_bound(dev_list, addr);
+    if (pos == 0) {
+        return NULL;
+    }
+    struct device *curr_dev = &dev_list->devices[pos - 1];
+    if (addr - curr_dev->pstart < curr_dev->size) {
+        /* Found a match */
+        return curr_dev;
     }
-    return dev;
+    return NULL;
 }
@@ -7,6 +7,7 @@
 #include <sel4vm/guest_vm.h>
 #include <sel4vm/guest_vcpu_fault.h>
 #include <sel4vm/guest_memory_helpers.h>
+#include <sel4vm/guest_vm_arena.h>
 
 #include <sel4vmmplatsupport/guest_memory_util.h>
 #include <sel4vmmplatsupport/device.h>
@@ -40,33 +41,30 @@ static memory_fault_result_t passthrough_device_fault(vm_t *vm, vm_vcpu_t *vcpu,
 int vm_install_passthrough_device(vm_t *vm, const struct device *device)
 {
     struct device d;
-    uintptr_t paddr;
     int err;
     d = *device;
-    for (paddr = d.pstart; paddr - d.pstart < d.size; paddr += 0x1000) {
-        void *addr;
-        vm_memory_reservation_t *reservation;
-        reservation = vm_reserve_memory_at(vm, paddr, 0x1000, passthrough_device_fault, NULL);
-        if (!reservation) {
-            return -1;
-        }
-        err = map_ut_alloc_reservation(vm, reservation);
+    /* A single reservation covers the whole device. Its frames are as large as the alignment of the device allows,
+     * as the guest address of a passthrough device is its physical address */
+    vm_memory_reservation_t *reservation = vm_reserve_memory_at(vm, d.pstart, ROUND_UP(d.size, PAGE_SIZE_4K),
+                                                                passthrough_device_fault, NULL);
+    if (!reservation) {
+        return -1;
+    }
+    err = map_ut_alloc_reservation(vm, reservation);
 #ifdef PLAT_EXYNOS5
-        if (err && paddr == MCT_ADDR) {
-            printf("*****************************************\n");
-            printf("*** Linux will try to use the MCT but ***\n");
-            printf("*** the kernel is not exporting it!   ***\n");
-            printf("*****************************************\n");
-            /* VMCT is not fully functional yet */
-//            err = vm_install_vmct(vm);
-            return -1;
-        }
+    if (err && MCT_ADDR >= d.pstart && MCT_ADDR - d.pstart < d.size) {
+        printf("*****************************************\n");
+        printf("*** Linux will try to use the MCT but ***\n");
+        printf("*** the kernel is not exporting it!   ***\n");
+        printf("*** Emulate it with vm_install_vmct   ***\n");
+        printf("*****************************************\n");
+        return -1;
+    }
 #endif
-        if (err) {
-            return -1;
-        }
+    if (err) {
+        return -1;
     }
-    return err;
+    return 0;
 }
 
 static memory_fault_result_t handle_listening_fault(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t fault_addr,
@@ -110,7 +108,7 @@ int vm_install_listening_device(vm_t *vm, const struct device *dev_listening)
     void **map;
     int err;
     pages = dev_listening->size >> 12;
-    d = (struct device *)calloc(1, sizeof(struct device));
+    d = vm_arena_alloc(vm, sizeof(struct device));
     if (!d) {
         return -1;
     }
@@ -127,7 +125,7 @@ int vm_install_listening_device(vm_t *vm, const struct device *dev_listening)
     vm_memory_reservation_t *reservation = vm_reserve_memory_at(vm, d->pstart, d->size,
                                                                 handle_listening_fault, (void *)d);
     if (!reservation) {
-        free(d);
+        vm_arena_free(vm, sizeof(struct device), d);
         free(map);
         return -1;
     }
@@ -174,7 +172,7 @@ int vm_install_listening_ram(vm_t *vm, uintptr_t addr, size_t size)
     struct device *d;
     int err;
 
-    d = (struct device *)calloc(1, sizeof(struct device));
+    d = vm_arena_alloc(vm, sizeof(struct device));
     if (!d) {
         return -1;
     }
@@ -196,3 +194,96 @@ int vm_install_listening_ram(vm_t *vm, uintptr_t addr, size_t size)
     }
     return 0;
 }
+
+struct vm_shadow_device {
+    struct device dev;
+    vm_shadow_device_write_fn write;
+    void *cookie;
+    /* Shadow pages, in the VMM's vspace */
+    void **pages;
+};
+
+volatile uint32_t *vm_shadow_device_reg(vm_shadow_device_t *sdev, uintptr_t offset)
+{
+    assert(offset < sdev->dev.size);
+    return (volatile uint32_t *)(sdev->pages[offset >> 12] + (offset & MASK(12) & ~MASK(2)));
+}
+
+static memory_fault_result_t handle_shadow_device_fault(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t fault_addr,
+                                                        size_t fault_length, void *cookie)
+{
+    vm_shadow_device_t *sdev = (vm_shadow_device_t *)cookie;
+    uintptr_t offset = (fault_addr - sdev->dev.pstart) & ~MASK(2);
+    volatile uint32_t *reg = vm_shadow_device_reg(sdev, offset);
+    uint32_t value;
+
+    /* The shadow is mapped read only, so only writes fault */
+    if (is_vcpu_read_fault(vcpu)) {
+        set_vcpu_fault_data(vcpu, *reg);
+        advance_vcpu_fault(vcpu);
+        return FAULT_HANDLED;
+    }
+
+    value = emulate_vcpu_fault(vcpu, *reg);
+    if (sdev->write && sdev->write(vm, vcpu, offset, &value, sdev->cookie)) {
+        return FAULT_ERROR;
+    }
+    *reg = value;
+    advance_vcpu_fault(vcpu);
+    return FAULT_HANDLED;
+}
+
+vm_shadow_device_t *vm_install_shadow_device(vm_t *vm, const struct device *device, bool copy_hw,
+                                             vm_shadow_device_write_fn write, void *cookie)
+{
+    vm_shadow_device_t *sdev;
+    size_t pages;
+
+    if (device->pstart % PAGE_SIZE_4K) {
+        ZF_LOGE("Failed to install shadow device %s: Device is not page aligned", device->name);
+        return NULL;
+    }
+    pages = ROUND_UP(device->size, PAGE_SIZE_4K) >> 12;
+
+    sdev = (vm_shadow_device_t *)calloc(1, sizeof(*sdev));
+    if (!sdev) {
+        ZF_LOGE("Failed to install shadow device %s: Unable to allocate device", device->name);
+        return NULL;
+    }
+    sdev->pages = (void **)calloc(pages, sizeof(void *));
+    if (!sdev->pages) {
+        ZF_LOGE("Failed to install shadow device %s: Unable to allocate page list", device->name);
+        free(sdev);
+        return NULL;
+    }
+    sdev->dev = *device;
+    sdev->dev.priv = sdev;
+    sdev->write = write;
+    sdev->cookie = cookie;
+
+    for (size_t i = 0; i < pages; i++) {
+        uintptr_t addr = device->pstart + (i << 12);
+        sdev->pages[i] = create_allocated_reservation_frame(vm, addr, seL4_CanRead, handle_shadow_device_fault,
+                                                            (void *)sdev);
+        if (!sdev->pages[i]) {
+            /* The reservations of the pages already installed are kept */
+            ZF_LOGE("Failed to install shadow device %s: Unable to create shadow page", device->name);
+            return NULL;
+        }
+        memset(sdev->pages[i], 0, PAGE_SIZE_4K);
+        if (copy_hw) {
+            volatile uint32_t *hw = ps_io_map(&vm->io_ops->io_mapper, addr, PAGE_SIZE_4K, 0, PS_MEM_NORMAL);
+            uint32_t *shadow = sdev->pages[i];
+            if (!hw) {
+                ZF_LOGE("Failed to install shadow device %s: Unable to map device", device->name);
+                return NULL;
+            }
+            /* Copy a word at a time, as device memory may not take wider or narrower accesses */
+            for (int j = 0; j < PAGE_SIZE_4K / sizeof(uint32_t); j++) {
+                shadow[j] = hw[j];
+            }
+            ps_io_unmap(&vm->io_ops->io_mapper, (void *)hw, PAGE_SIZE_4K);
+        }
+    }
+    return sdev;
+}
@@ -4,6 +4,7 @@
  * SPDX-License-Identifier: BSD-2-Clause
  */
 
+#include <inttypes.h>
 #include <stdlib.h>
 #include <sel4/sel4.h>
 #include <vka/capops.h>
@@ -14,6 +15,8 @@
 #include <sel4vm/guest_irq_controller.h>
 #include <sel4vm/guest_vcpu_fault.h>
 #include <sel4vm/boot.h>
+#include <sel4vm/guest_vm_boot_phases.h>
+#include <sel4vm/guest_vm_arena.h>
 
 #include <sel4vmmplatsupport/device.h>
 #include <sel4vmmplatsupport/guest_memory_util.h>
@@ -23,6 +26,15 @@
 
 #include <pci/helper.h>
 
+#ifdef CONFIG_ARCH_X86
+#include <sel4vm/arch/vmcall.h>
+#include <sel4vm/arch/guest_x86_context.h>
+#endif
+#ifdef CONFIG_ARCH_ARM
+#include <sel4vm/arch/guest_arm_context.h>
+#include "smc.h"
+#endif
+
 #define MAX_NUM_CONNECTIONS 32
 
 #define EVENT_BAR_EMIT_REGISTER 0x0
@@ -31,6 +43,8 @@
 #define EVENT_BAR_CONSUME_EVENT_REGISTER_INDEX 1
 #define EVENT_BAR_DEVICE_NAME_REGISTER 0x8
 #define EVENT_BAR_DEVICE_NAME_MAX_LEN 50
+#define EVENT_BAR_FAST_EMIT_REGISTER 0x40
+#define EVENT_BAR_FAST_EMIT_REGISTER_INDEX 16
 
 struct connection_info {
     uintptr_t event_address;
@@ -43,19 +57,41 @@ struct connection_info {
 
 struct dataport_iterator_cookie {
     seL4_CPtr *dataport_frames;
+    unsigned int num_frames;
+    size_t frame_size_bits;
     uintptr_t dataport_start;
     size_t dataport_size;
     vm_t *vm;
 };
 
-struct connection_info info[MAX_NUM_CONNECTIONS];
-int total_connections;
+/* Connections of a VM */
+typedef struct crossvm_connections {
+    vm_t *vm;
+    struct connection_info info[MAX_NUM_CONNECTIONS];
+    int total_connections;
+    /* connection consuming events of each badge bit, -1 if none. Connections
+     * with badges of more than one bit are instead matched on their whole badge */
+    int8_t badge_bit_connection[seL4_WordBits];
+    struct crossvm_connections *next;
+} crossvm_connections_t;
+
+static crossvm_connections_t *vm_connections;
+
+static crossvm_connections_t *crossvm_connections_get(vm_t *vm)
+{
+    for (crossvm_connections_t *conns = vm_connections; conns; conns = conns->next) {
+        if (conns->vm == vm) {
+            return conns;
+        }
+    }
+    return NULL;
+}
 
 static int construct_connection_bar(vm_t *vm, struct connection_info *info, int num_connections, vmm_pci_space_t *pci)
 {
     for (int conn_idx = 0; conn_idx < num_connections; conn_idx++) {
         vmm_pci_device_def_t *pci_config;
-        pci_config = calloc(1, sizeof(*pci_config));
+        pci_config = vm_arena_alloc(vm, sizeof(*pci_config));
         ZF_LOGF_IF(pci_config == NULL, "Failed to allocate pci config");
         *pci_config = (vmm_pci_device_def_t) {
             .vendor_id = 0x1af4,
@@ -137,7 +173,7 @@ static memory_fault_result_t handle_event_bar_fault(vm_t *vm, vm_vcpu_t *vcpu, u
 
 static int reserve_event_bar(vm_t *vm, uintptr_t event_bar_address, struct connection_info *info)
 {
-    struct device *event_bar = calloc(1, sizeof(struct device));
+    struct device *event_bar = vm_arena_alloc(vm, sizeof(struct device));
     if (!event_bar) {
         ZF_LOGE("Failed to create event bar device");
         return -1;
@@ -167,15 +203,19 @@ static vm_frame_t dataport_memory_iterator(uintptr_t addr, void *cookie)
     vm_t *vm = dataport_cookie->vm;
     uintptr_t dataport_start = dataport_cookie->dataport_start;
     size_t dataport_size = dataport_cookie->dataport_size;
-    int page_size = seL4_PageBits;
+    size_t page_size = dataport_cookie->frame_size_bits;
 
     uintptr_t frame_start = ROUND_DOWN(addr, BIT(page_size));
     if (frame_start <  dataport_start ||
-        frame_start > dataport_start + dataport_size) {
+        frame_start >= dataport_start + dataport_size) {
         ZF_LOGE("Error: Not Dataport region");
         return frame_result;
     }
-    int page_idx = (frame_start - dataport_start) / BIT(page_size);
+    unsigned int page_idx = (frame_start - dataport_start) >> page_size;
+    if (page_idx >= dataport_cookie->num_frames) {
+        ZF_LOGE("Error: Dataport has no frame for 0x%"PRIxPTR, addr);
+        return frame_result;
+    }
     frame_result.cptr = dataport_frames[page_idx];
     frame_result.rights = seL4_AllRights;
     frame_result.vaddr = frame_start;
@@ -190,7 +230,14 @@ static int reserve_dataport_memory(vm_t *vm, crossvm_dataport_handle_t *dataport
     size_t size = dataport->size;
     unsigned int num_frames = dataport->num_frames;
     seL4_CPtr *frames = dataport->frames;
+    size_t frame_size_bits = dataport->frame_size_bits ? dataport->frame_size_bits : seL4_PageBits;
 
+    /* large frames can only be mapped at addresses aligned to their size */
+    if (!IS_ALIGNED(dataport_address, frame_size_bits) || (uint64_t)num_frames << frame_size_bits < size) {
+        ZF_LOGE("Failed to reserve dataport: %u frames of size bits %zu can't back 0x%zx bytes at 0x%"PRIxPTR,
+                num_frames, frame_size_bits, size, dataport_address);
+        return -1;
+    }
     vm_memory_reservation_t *dataport_reservation = vm_reserve_memory_at(vm, dataport_address, size,
                                                                          default_error_fault_callback,
                                                                          NULL);
@@ -201,6 +248,8 @@ static int reserve_dataport_memory(vm_t *vm, crossvm_dataport_handle_t *dataport
     }
     dataport_cookie->vm = vm;
     dataport_cookie->dataport_frames = frames;
+    dataport_cookie->num_frames = num_frames;
+    dataport_cookie->frame_size_bits = frame_size_bits;
     dataport_cookie->dataport_start = dataport_address;
     dataport_cookie->dataport_size = size;
     err = vm_map_reservation(vm, dataport_reservation, dataport_memory_iterator, (void *)dataport_cookie);
@@ -215,27 +264,50 @@ static int reserve_dataport_memory(vm_t *vm, crossvm_dataport_handle_t *dataport
 
 static void connection_consume_ack(vm_vcpu_t *vcpu, int irq, void *cookie) {}
 
+static void connection_consume(struct connection_info *conn_info)
+{
+    /* We have an event - update the value in the event status register */
+    uint32_t *event_registers = (uint32_t *)conn_info->event_registers;
+    /* Increment the register to indicate a signal event occured -
+     * we assume our kernel module will clear it as it consumes interrupt */
+    event_registers[EVENT_BAR_CONSUME_EVENT_REGISTER_INDEX]++;
+}
+
 void consume_connection_event(vm_t *vm, seL4_Word event_id, bool inject_irq)
 {
+    crossvm_connections_t *conns = crossvm_connections_get(vm);
+    if (conns == NULL) {
+        return;
+    }
     struct connection_info *conn_info = NULL;
-    /* Search for a connection with a matching badge */
-    for (int i = 0; i < total_connections; i++) {
-        if (info[i].connection.consume_id == event_id) {
-            conn_info = &info[i];
-            break;
+    /* Notifications combine the badges of the events they deliver, so each
+     * bit of the badge may be an event of its own */
+    if (event_id && (event_id & (event_id - 1))) {
+        for (int i = 0; i < conns->total_connections; i++) {
+            if (conns->info[i].connection.consume_id == event_id) {
+                conn_info = &conns->info[i];
+                break;
+            }
+        }
+    }
+    if (conn_info) {
+        connection_consume(conn_info);
+    } else {
+        for (seL4_Word bits = event_id; bits; bits &= bits - 1) {
+            int conn_idx = conns->badge_bit_connection[CTZL(bits)];
+            if (conn_idx < 0) {
+                continue;
+            }
+            conn_info = &conns->info[conn_idx];
+            connection_consume(conn_info);
         }
     }
     if (conn_info == NULL) {
         /* No match */
         return;
     }
-    /* We have an event - update the value in the event status register */
-    uint32_t *event_registers = (uint32_t *)conn_info->event_registers;
-    /* Increment the register to indicate a signal event occured -
-     * we assume our kernel module will clear it as it consumes interrupt */
-    event_registers[EVENT_BAR_CONSUME_EVENT_REGISTER_INDEX]++;
     if (inject_irq) {
-        /* Inject our event interrupt */
+        /* Inject our event interrupt, shared by all connections, once for all of the events */
         int err = vm_inject_irq(vm->vcpus[BOOT_VCPU], conn_info->connection_irq);
         if (err) {
             ZF_LOGE("Failed to inject connection irq");
@@ -298,8 +370,87 @@ static int initialise_connections(vm_t *vm, uintptr_t connection_base_addr, cros
     return 0;
 }
 
-int cross_vm_connections_init_common(vm_t *vm, uintptr_t connection_base_addr, crossvm_handle_t *connections,
-                                     int num_connections, vmm_pci_space_t *pci, alloc_free_interrupt_fn alloc_irq)
+/* Emit on every connection set in 'mask', returning -1 if any of them cannot emit */
+static int fast_emit_connections(vm_t *vm, seL4_Word mask)
+{
+    crossvm_connections_t *conns = crossvm_connections_get(vm);
+    int total_connections = conns ? conns->total_connections : 0;
+    int err = 0;
+    for (int i = 0; mask; i++, mask >>= 1) {
+        if (!(mask & 1)) {
+            continue;
+        }
+        if (i >= total_connections || !conns->info[i].connection.emit_fn) {
+            ZF_LOGE("Connection %d is not configured with an emit function", i);
+            err = -1;
+            continue;
+        }
+        conns->info[i].connection.emit_fn();
+    }
+    return err;
+}
+
+#ifdef CONFIG_ARCH_X86
+static int fast_emit_vmcall_handler(vm_vcpu_t *vcpu)
+{
+    uint32_t mask;
+    int err = vm_get_thread_context_reg(vcpu, VCPU_CONTEXT_EBX, &mask);
+    if (err) {
+        ZF_LOGE("Failed to get connection mask of fast emit");
+        return -1;
+    }
+    return vm_set_thread_context_reg(vcpu, VCPU_CONTEXT_EAX, fast_emit_connections(vcpu->vm, mask));
+}
+
+static int register_fast_emit(vm_t *vm)
+{
+    return vm_reg_new_vmcall_handler(vm, fast_emit_vmcall_handler, CROSSVM_FAST_EMIT_VMCALL_TOKEN);
+}
+#endif
+
+#ifdef CONFIG_ARCH_ARM
+static int fast_emit_smc_handler(vm_vcpu_t *vcpu, smc_call_t *call, void *cookie)
+{
+    smc_set_return_value(call, fast_emit_connections(vcpu->vm, smc_get_arg(call, 1)));
+    return 0;
+}
+
+static int register_fast_emit(vm_t *vm)
+{
+    /* SMC handlers are shared by all VMs, and find the connections by the vcpu's VM */
+    static bool registered;
+    if (registered) {
+        return 0;
+    }
+    seL4_Word fn_number = CROSSVM_FAST_EMIT_SMC_FUNC_ID & SMC_FUNC_ID_MASK;
+    int err = smc_register_handler(SMC_CALL_VENDOR_HYP_SERVICE, fn_number, fn_number, fast_emit_smc_handler, NULL);
+    registered = !err;
+    return err;
+}
+#endif
+
+int cross_vm_connections_init_fast_emit(vm_t *vm)
+{
+    crossvm_connections_t *conns = crossvm_connections_get(vm);
+    if (conns == NULL) {
+        ZF_LOGE("Failed to init fast emit: VM has no connections");
+        return -1;
+    }
+    int err = register_fast_emit(vm);
+    if (err) {
+        ZF_LOGE("Failed to register fast emit hypercall");
+        return -1;
+    }
+    /* tell the guest of each connection which bit of the mask is its own */
+    for (int i = 0; i < conns->total_connections; i++) {
+        uint32_t *event_registers = (uint32_t *)conns->info[i].event_registers;
+        event_registers[EVENT_BAR_FAST_EMIT_REGISTER_INDEX] = CROSSVM_FAST_EMIT_ENABLED | i;
+    }
+    return 0;
+}
+
+static int init_connections(vm_t *vm, uintptr_t connection_base_addr, crossvm_handle_t *connections,
+                            int num_connections, vmm_pci_space_t *pci, alloc_free_interrupt_fn alloc_irq)
 {
     uintptr_t guest_paddr = 0;
     size_t guest_size = 0;
@@ -307,17 +458,53 @@ int cross_vm_connections_init_common(vm_t *vm, uintptr_t connection_base_addr, c
         ZF_LOGE("Unable to register more than %d dataports", MAX_NUM_CONNECTIONS);
         return -1;
     }
+    if (crossvm_connections_get(vm)) {
+        ZF_LOGE("Cross vm connections of the VM are already initialised");
+        return -1;
+    }
+    crossvm_connections_t *conns = calloc(1, sizeof(*conns));
+    if (conns == NULL) {
+        ZF_LOGE("Failed to allocate cross vm connections");
+        return -1;
+    }
+    conns->vm = vm;
     int connection_irq = alloc_irq();
-    int err = initialise_connections(vm, connection_base_addr, connections, num_connections, info, connection_irq);
+    int err = initialise_connections(vm, connection_base_addr, connections, num_connections, conns->info,
+                                     connection_irq);
     if (err) {
         ZF_LOGE("Failed to reserve memory for dataports");
         return -1;
     }
-    err = construct_connection_bar(vm, info, num_connections, pci);
+    err = construct_connection_bar(vm, conns->info, num_connections, pci);
     if (err) {
         ZF_LOGE("Failed to construct pci device for dataports");
         return -1;
     }
-    total_connections = num_connections;
+    memset(conns->badge_bit_connection, -1, sizeof(conns->badge_bit_connection));
+    for (int i = 0; i < num_connections; i++) {
+        seL4_Word consume_id = connections[i].consume_id;
+        if (consume_id == 0 || (consume_id & (consume_id - 1))) {
+            continue;
+        }
+        int8_t *bit_connection = &conns->badge_bit_connection[CTZL(consume_id)];
+        if (*bit_connection >= 0) {
+            ZF_LOGW("Connections %d and %d share a consume badge, only %d consumes its events", *bit_connection, i,
+                    *bit_connection);
+            continue;
+        }
+        *bit_connection = i;
+    }
+    conns->total_connections = num_connections;
+    conns->next = vm_connections;
+    vm_connections = conns;
     return 0;
 }
+
+int cross_vm_connections_init_common(vm_t *vm, uintptr_t connection_base_addr, crossvm_handle_t *connections,
+                                     int num_connections, vmm_pci_space_t *pci, alloc_free_interrupt_fn alloc_irq)
+{
+    int phase = vm_boot_phase_begin("cross_vm_connections_init_common");
+    int err = init_connections(vm, connection_base_addr, connections, num_connections, pci, alloc_irq);
+    vm_boot_phase_end(phase);
+    return err;
+}
@@ -16,6 +16,27 @@
 
 #define PCI_CAPABILITY_SPACE_OFFSET 0x40
 
+/* Read only bytes of a configuration header: the vendor and device IDs, revision and class, and header type */
+#define HEADER_BYTES(offset, n) ((uint64_t)MASK(n) << (offset))
+#define PCI_HEADER_READ_ONLY    (HEADER_BYTES(PCI_VENDOR_ID, 4) | HEADER_BYTES(PCI_REVISION_ID, 4) \
+                                 | HEADER_BYTES(PCI_HEADER_TYPE, 1))
+/* and for a type 0 header the subsystem IDs, capability pointer and interrupt pin */
+#define PCI_HEADER_NORMAL_READ_ONLY  (PCI_HEADER_READ_ONLY | HEADER_BYTES(PCI_SUBSYSTEM_VENDOR_ID, 4) \
+                                      | HEADER_BYTES(PCI_CAPABILITY_LIST, 1) | HEADER_BYTES(PCI_INTERRUPT_PIN, 1))
+
+/* Layout of a 64-bit MSI capability without per-vector masking */
+#define MSI_CAP_CONTROL         0x2
+#define MSI_CAP_ADDRESS_LO      0x4
+#define MSI_CAP_ADDRESS_HI      0x8
+#define MSI_CAP_DATA            0xc
+#define MSI_CAP_SIZE            0xe
+#define MSI_CONTROL_ENABLE      BIT(0)
+#define MSI_CONTROL_MMC_SHIFT   1
+#define MSI_CONTROL_MME_SHIFT   4
+#define MSI_CONTROL_MME_MASK    (MASK(3) << MSI_CONTROL_MME_SHIFT)
+#define MSI_CONTROL_64BIT       BIT(7)
+#define MSI_MAX_VECTORS_LOG2    5
+
 /* Read PCI memory device */
 int vmm_pci_mem_device_read(void *cookie, int offset, int size, uint32_t *result)
 {
@@ -23,9 +44,17 @@ int vmm_pci_mem_device_read(void *cookie, int offset, int size, uint32_t *result
         ZF_LOGE("Offset should not be negative");
         return -1;
     }
-    if (offset + size >= PCI_CAPABILITY_SPACE_OFFSET) {
-        ZF_LOGI("Indexing capability space not yet supported, returning 0");
+    if (offset + size > PCI_CAPABILITY_SPACE_OFFSET) {
+        /* Capabilities the device defines are laid out from the start of
+         * the capability space */
+        vmm_pci_device_def_t *dev = (vmm_pci_device_def_t *)cookie;
+        int cap_offset = offset - PCI_CAPABILITY_SPACE_OFFSET;
         *result = 0;
+        if (dev->caps && cap_offset >= 0 && cap_offset + size <= dev->caps_len) {
+            memcpy(result, (uint8_t *)dev->caps + cap_offset, size);
+            return 0;
+        }
+        ZF_LOGI("Indexing capability space not yet supported, returning 0");
         return 0;
     }
     *result = 0;
@@ -42,7 +71,7 @@ int vmm_pci_mem_device_write(void *cookie, int offset, int size, uint32_t value)
         ZF_LOGE("Offset should not be negative");
         return -1;
     }
-    if (offset + size >= PCI_CAPABILITY_SPACE_OFFSET) {
+    if (offset + size > PCI_CAPABILITY_SPACE_OFFSET) {
         ZF_LOGI("Indexing capability space not yet supported, returning 0");
         return 0;
     }
@@ -107,6 +136,12 @@ void define_pci_host_bridge(vmm_pci_device_def_t *bridge)
 static int passthrough_pci_config_ioread(void *cookie, int offset, int size, uint32_t *result)
 {
     pci_passthrough_device_t *dev = (pci_passthrough_device_t *)cookie;
+    if (offset >= 0 && offset + size <= PCI_CAPABILITY_SPACE_OFFSET
+        && ((dev->header_cached >> offset) & MASK(size)) == MASK(size)) {
+        *result = 0;
+        memcpy(result, dev->header + offset, size);
+        return 0;
+    }
     switch (size) {
     case 1:
         *result = dev->config.ioread8(dev->config.cookie, dev->addr, offset);
@@ -285,6 +320,16 @@ vmm_pci_entry_t vmm_pci_create_passthrough(vmm_pci_address_t addr, vmm_pci_confi
     assert(dev);
     dev->addr = addr;
     dev->config = config;
+    /* Copy the header, so the registers that never change needn't be read from the device again */
+    for (int i = 0; i < PCI_CAPABILITY_SPACE_OFFSET; i += 4) {
+        uint32_t value = config.ioread32(config.cookie, addr, i);
+        memcpy(dev->header + i, &value, sizeof(value));
+    }
+    if ((dev->header[PCI_HEADER_TYPE] & ~BIT(7)) == PCI_HEADER_TYPE_NORMAL) {
+        dev->header_cached = PCI_HEADER_NORMAL_READ_ONLY;
+    } else {
+        dev->header_cached = PCI_HEADER_READ_ONLY;
+    }
     ZF_LOGI("Creating passthrough device for %02x:%02x.%d", addr.bus, addr.dev, addr.fun);
     return (vmm_pci_entry_t) {
         .cookie = dev, .ioread = passthrough_pci_config_ioread, .iowrite = passthrough_pci_config_iowrite
@@ -390,7 +435,8 @@ vmm_pci_entry_t vmm_pci_create_cap_emulation(vmm_pci_entry_t existing, int num_c
 
 #define MAX_CAPS 256
 
-vmm_pci_entry_t vmm_pci_no_msi_cap_emulation(vmm_pci_entry_t existing)
+/* Hide the MSI capability of a device, and its MSI-X capability unless 'keep_msix' */
+static vmm_pci_entry_t msi_cap_emulation(vmm_pci_entry_t existing, bool keep_msix)
 {
     uint32_t value;
     int UNUSED error;
@@ -427,7 +473,7 @@ vmm_pci_entry_t vmm_pci_no_msi_cap_emulation(vmm_pci_entry_t existing)
             ignore_start[num_ignore] = value;
             ignore_end[num_ignore] = value + 20;
             num_ignore++;
-        } else if (cap_type == PCI_CAP_ID_MSIX) {
+        } else if (cap_type == PCI_CAP_ID_MSIX && !keep_msix) {
             ignore_start[num_ignore] = value;
             ignore_end[num_ignore] = value + 8;
             num_ignore++;
@@ -445,3 +491,118 @@ vmm_pci_entry_t vmm_pci_no_msi_cap_emulation(vmm_pci_entry_t existing)
         return existing;
     }
 }
+
+vmm_pci_entry_t vmm_pci_no_msi_cap_emulation(vmm_pci_entry_t existing)
+{
+    return msi_cap_emulation(existing, false);
+}
+
+vmm_pci_entry_t vmm_pci_msix_only_cap_emulation(vmm_pci_entry_t existing)
+{
+    return msi_cap_emulation(existing, true);
+}
+
+static void pci_msi_emul_make_cap(pci_msi_emulation_t *emul, uint8_t cap[MSI_CAP_SIZE])
+{
+    uint16_t control = emul->control | MSI_CONTROL_64BIT | (emul->vectors_log2 << MSI_CONTROL_MMC_SHIFT);
+    uint32_t address_lo = emul->address & 0xffffffff;
+    uint32_t address_hi = emul->address >> 32;
+    cap[0] = PCI_CAP_ID_MSI;
+    cap[1] = emul->next_cap;
+    memcpy(cap + MSI_CAP_CONTROL, &control, sizeof(control));
+    memcpy(cap + MSI_CAP_ADDRESS_LO, &address_lo, sizeof(address_lo));
+    memcpy(cap + MSI_CAP_ADDRESS_HI, &address_hi, sizeof(address_hi));
+    memcpy(cap + MSI_CAP_DATA, &emul->data, sizeof(emul->data));
+}
+
+static bool pci_msi_emul_in_cap(pci_msi_emulation_t *emul, int offset, int size)
+{
+    return offset >= emul->cap_offset && offset + size <= emul->cap_offset + MSI_CAP_SIZE;
+}
+
+static int pci_msi_emul_read(void *cookie, int offset, int size, uint32_t *result)
+{
+    pci_msi_emulation_t *emul = (pci_msi_emulation_t *)cookie;
+    if (pci_msi_emul_in_cap(emul, offset, size)) {
+        uint8_t cap[MSI_CAP_SIZE];
+        pci_msi_emul_make_cap(emul, cap);
+        *result = 0;
+        memcpy(result, cap + offset - emul->cap_offset, size);
+        return 0;
+    }
+    /* do the regular read, then patch in the capability list head */
+    int ret = emul->passthrough.ioread(emul->passthrough.cookie, offset, size, result);
+    if (ret) {
+        return ret;
+    }
+    if (offset <= PCI_STATUS && offset + size > PCI_STATUS) {
+        *result |= (PCI_STATUS_CAP_LIST << ((PCI_STATUS - offset) * 8));
+    }
+    if (offset <= PCI_CAPABILITY_LIST && offset + size > PCI_CAPABILITY_LIST) {
+        int bit_offset = (PCI_CAPABILITY_LIST - offset) * 8;
+        *result &= ~(MASK(8) << bit_offset);
+        *result |= (emul->cap_offset << bit_offset);
+    }
+    return 0;
+}
+
+static int pci_msi_emul_write(void *cookie, int offset, int size, uint32_t value)
+{
+    pci_msi_emulation_t *emul = (pci_msi_emulation_t *)cookie;
+    if (!pci_msi_emul_in_cap(emul, offset, size)) {
+        return emul->passthrough.iowrite(emul->passthrough.cookie, offset, size, value);
+    }
+    uint8_t cap[MSI_CAP_SIZE];
+    pci_msi_emul_make_cap(emul, cap);
+    memcpy(cap + offset - emul->cap_offset, &value, size);
+
+    uint16_t control;
+    uint32_t address_lo, address_hi;
+    memcpy(&control, cap + MSI_CAP_CONTROL, sizeof(control));
+    memcpy(&address_lo, cap + MSI_CAP_ADDRESS_LO, sizeof(address_lo));
+    memcpy(&address_hi, cap + MSI_CAP_ADDRESS_HI, sizeof(address_hi));
+    memcpy(&emul->data, cap + MSI_CAP_DATA, sizeof(emul->data));
+    /* Only the enable bit and number of enabled vectors are writable, the latter limited to those supported */
+    uint16_t mme = MIN((control & MSI_CONTROL_MME_MASK) >> MSI_CONTROL_MME_SHIFT, emul->vectors_log2);
+    emul->control = (control & MSI_CONTROL_ENABLE) | (mme << MSI_CONTROL_MME_SHIFT);
+    emul->address = ((uint64_t)address_hi << 32) | (address_lo & ~MASK(2));
+    return 0;
+}
+
+vmm_pci_entry_t vmm_pci_create_msi_emulation(vmm_pci_entry_t existing, uint8_t cap_offset, unsigned int num_vectors,
+                                             pci_msi_emulation_t **msi)
+{
+    uint32_t value = 0;
+    int UNUSED error;
+    assert(cap_offset >= PCI_CAPABILITY_SPACE_OFFSET && !(cap_offset & MASK(2)));
+    assert(num_vectors > 0 && BIT(CTZ(num_vectors)) == num_vectors && num_vectors <= BIT(MSI_MAX_VECTORS_LOG2));
+    pci_msi_emulation_t *emul = calloc(1, sizeof(*emul));
+    assert(emul);
+    emul->passthrough = existing;
+    emul->cap_offset = cap_offset;
+    emul->vectors_log2 = CTZ(num_vectors);
+    /* Chain the existing capability list, if any, after the emulated capability */
+    error = existing.ioread(existing.cookie, PCI_STATUS, 1, &value);
+    assert(!error);
+    if (value & PCI_STATUS_CAP_LIST) {
+        error = existing.ioread(existing.cookie, PCI_CAPABILITY_LIST, 1, &value);
+        assert(!error);
+        emul->next_cap = value & ~MASK(2);
+    }
+    *msi = emul;
+    return (vmm_pci_entry_t) {
+        .cookie = emul, .ioread = pci_msi_emul_read, .iowrite = pci_msi_emul_write
+    };
+}
+
+int vmm_pci_msi_get_message(pci_msi_emulation_t *msi, unsigned int vector, uint64_t *address, uint32_t *data)
+{
+    unsigned int vectors_log2 = (msi->control & MSI_CONTROL_MME_MASK) >> MSI_CONTROL_MME_SHIFT;
+    if (!(msi->control & MSI_CONTROL_ENABLE) || vector >= BIT(vectors_log2)) {
+        return -1;
+    }
+    /* With multiple vectors enabled the device replaces the low bits of the data with the vector */
+    *address = msi->address;
+    *data = (msi->data & ~MASK(vectors_log2)) | vector;
+    return 0;
+}
@@ -0,0 +1,214 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <utils/util.h>
+
+#include <sel4vmmplatsupport/ioports.h>
+#include <sel4vmmplatsupport/drivers/serial.h>
+
+/* 16550 UART register offsets */
+#define UART_RBR_THR 0
+#define UART_IER 1
+#define UART_IIR_FCR 2
+#define UART_LCR 3
+#define UART_MCR 4
+#define UART_LSR 5
+#define UART_MSR 6
+#define UART_SCR 7
+
+#define UART_LCR_DLAB BIT(7)
+#define UART_FCR_FIFO_ENABLE BIT(0)
+#define UART_IIR_NO_INT BIT(0)
+#define UART_IIR_FIFO_ENABLED (BIT(7) | BIT(6))
+#define UART_LSR_THRE BIT(5)
+#define UART_LSR_TEMT BIT(6)
+#define UART_MSR_CTS BIT(4)
+#define UART_MSR_DSR BIT(5)
+#define UART_MSR_DCD BIT(7)
+#define UART_MCR_LOOP BIT(4)
+
+struct vmm_serial {
+    uint16_t iobase;
+    /* Emulated register state */
+    uint8_t ier;
+    uint8_t fcr;
+    uint8_t lcr;
+    uint8_t mcr;
+    uint8_t scr;
+    uint8_t dll;
+    uint8_t dlm;
+    /* Output ring buffer */
+    char *buf;
+    size_t buf_size;
+    size_t head;
+    size_t count;
+    size_t flush_threshold;
+    /* Backend receiving flushed output */
+    vmm_serial_write_fn write_fn;
+    void *cookie;
+};
+
+int vmm_serial_flush(vmm_serial_t *serial)
+{
+    if (!serial) {
+        ZF_LOGE("Failed to flush serial: Invalid serial device");
+        return -1;
+    }
+    while (serial->count > 0) {
+        /* Pass on the contiguous run of bytes up to the end of the ring */
+        size_t len = MIN(serial->count, serial->buf_size - serial->head);
+        int written = serial->write_fn(serial->cookie, serial->buf + serial->head, len);
+        if (written < 0) {
+            ZF_LOGE("Failed to flush serial: Backend returned error");
+            return -1;
+        }
+        serial->head = (serial->head + written) % serial->buf_size;
+        serial->count -= written;
+        if ((size_t)written < len) {
+            /* Backend is full, keep the remainder for the next flush */
+            break;
+        }
+    }
+    return 0;
+}
+
+static int serial_put_char(vmm_serial_t *serial, char c)
+{
+    if (serial->count == serial->buf_size && vmm_serial_flush(serial)) {
+        return -1;
+    }
+    if (serial->count == serial->buf_size) {
+        /* Backend did not make any progress, drop the oldest byte */
+        serial->head = (serial->head + 1) % serial->buf_size;
+        serial->count--;
+    }
+    serial->buf[(serial->head + serial->count) % serial->buf_size] = c;
+    serial->count++;
+    if (c == '\n' || (serial->flush_threshold && serial->count >= serial->flush_threshold)) {
+        return vmm_serial_flush(serial);
+    }
+    return 0;
+}
+
+static int serial_io_in(void *cookie, unsigned int port_no, unsigned int size, unsigned int *result)
+{
+    vmm_serial_t *serial = (vmm_serial_t *)cookie;
+    unsigned int offset = port_no - serial->iobase;
+    bool dlab = serial->lcr & UART_LCR_DLAB;
+
+    switch (offset) {
+    case UART_RBR_THR:
+        /* No receive data is ever available */
+        *result = dlab ? serial->dll : 0;
+        break;
+    case UART_IER:
+        *result = dlab ? serial->dlm : serial->ier;
+        break;
+    case UART_IIR_FCR:
+        *result = UART_IIR_NO_INT | ((serial->fcr & UART_FCR_FIFO_ENABLE) ? UART_IIR_FIFO_ENABLED : 0);
+        break;
+    case UART_LCR:
+        *result = serial->lcr;
+        break;
+    case UART_MCR:
+        *result = serial->mcr;
+        break;
+    case UART_LSR:
+        /* Output is buffered, so the transmitter is always ready */
+        *result = UART_LSR_THRE | UART_LSR_TEMT;
+        break;
+    case UART_MSR:
+        *result = (serial->mcr & UART_MCR_LOOP) ? 0 : UART_MSR_DCD | UART_MSR_DSR | UART_MSR_CTS;
+        break;
+    case UART_SCR:
+        *result = serial->scr;
+        break;
+    default:
+        *result = 0;
+        break;
+    }
+    return 0;
+}
+
+static int serial_io_out(void *cookie, unsigned int port_no, unsigned int size, unsigned int value)
+{
+    vmm_serial_t *serial = (vmm_serial_t *)cookie;
+    unsigned int offset = port_no - serial->iobase;
+    bool dlab = serial->lcr & UART_LCR_DLAB;
+
+    switch (offset) {
+    case UART_RBR_THR:
+        if (dlab) {
+            serial->dll = value;
+        } else if (!(serial->mcr & UART_MCR_LOOP)) {
+            return serial_put_char(serial, value);
+        }
+        break;
+    case UART_IER:
+        if (dlab) {
+            serial->dlm = value;
+        } else {
+            serial->ier = value & 0xf;
+        }
+        break;
+    case UART_IIR_FCR:
+        serial->fcr = value;
+        break;
+    case UART_LCR:
+        serial->lcr = value;
+        break;
+    case UART_MCR:
+        serial->mcr = value & 0x1f;
+        break;
+    case UART_SCR:
+        serial->scr = value;
+        break;
+    default:
+        /* LSR and MSR are read only */
+        break;
+    }
+    return 0;
+}
+
+vmm_serial_t *vmm_serial_init(vmm_io_port_list_t *io_list, ioport_range_t ioport_range, ioport_type_t port_type,
+                              size_t buffer_size, size_t flush_threshold, vmm_serial_write_fn write_fn, void *cookie)
+{
+    if (!write_fn || buffer_size == 0) {
+        ZF_LOGE("Failed to initialise serial: Invalid backend or buffer size");
+        return NULL;
+    }
+
+    vmm_serial_t *serial = calloc(1, sizeof(vmm_serial_t));
+    if (!serial) {
+        ZF_LOGE("Failed to initialise serial: Unable to allocate serial device");
+        return NULL;
+    }
+    serial->buf = malloc(buffer_size);
+    if (!serial->buf) {
+        ZF_LOGE("Failed to initialise serial: Unable to allocate output buffer");
+        free(serial);
+        return NULL;
+    }
+    serial->buf_size = buffer_size;
+    serial->flush_threshold = MIN(flush_threshold, buffer_size);
+    serial->write_fn = write_fn;
+    serial->cookie = cookie;
+
+    ioport_interface_t serial_io_interface = {serial, serial_io_in, serial_io_out, "SERIAL"};
+    ioport_entry_t *io_entry = vmm_io_port_add_handler(io_list, ioport_range, serial_io_interface, port_type);
+    if (!io_entry) {
+        ZF_LOGE("Failed to initialise serial: Unable to add vmm io port handler");
+        free(serial->buf);
+        free(serial);
+        return NULL;
+    }
+    serial->iobase = io_entry->range.start;
+    return serial;
+}
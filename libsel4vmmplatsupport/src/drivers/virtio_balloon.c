@@ -0,0 +1,201 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <platsupport/io.h>
+
+#include <sel4vmmplatsupport/drivers/virtio.h>
+#include <sel4vmmplatsupport/drivers/virtio_balloon.h>
+
+#include <pci/helper.h>
+#include <sel4vmmplatsupport/drivers/pci_helper.h>
+
+#ifdef CONFIG_ARCH_ARM
+#include <sel4vmmplatsupport/arch/virtio_mmio.h>
+#endif
+
+#define QUEUE_SIZE 128
+
+static ps_io_ops_t ops;
+
+static int virtio_balloon_io_in(void *cookie, unsigned int port_no, unsigned int size, unsigned int *result)
+{
+    virtio_balloon_t *balloon = (virtio_balloon_t *)cookie;
+    unsigned int offset = port_no - balloon->iobase;
+    unsigned int val;
+    int err = balloon->emul->io_in(balloon->emul, offset, size, &val);
+    if (err) {
+        return err;
+    }
+    *result = val;
+    return 0;
+}
+
+static int virtio_balloon_io_out(void *cookie, unsigned int port_no, unsigned int size, unsigned int value)
+{
+    virtio_balloon_t *balloon = (virtio_balloon_t *)cookie;
+    unsigned int offset = port_no - balloon->iobase;
+    return balloon->emul->io_out(balloon->emul, offset, size, value);
+}
+
+static int emul_balloon_driver_init(struct balloon_passthrough *driver, ps_io_ops_t io_ops, void *config)
+{
+    virtio_balloon_t *balloon = (virtio_balloon_t *)config;
+    *driver = balloon->emul_driver_funcs;
+    return 0;
+}
+
+static void *malloc_dma_alloc(void *cookie, size_t size, int align, int cached, ps_mem_flags_t flags)
+{
+    assert(cached);
+    int error;
+    void *ret;
+    error = posix_memalign(&ret, align, size);
+    if (error) {
+        return NULL;
+    }
+    return ret;
+}
+
+static void malloc_dma_free(void *cookie, void *addr, size_t size)
+{
+    free(addr);
+}
+
+static uintptr_t malloc_dma_pin(void *cookie, void *addr, size_t size)
+{
+    return (uintptr_t)addr;
+}
+
+static void malloc_dma_unpin(void *cookie, void *addr, size_t size)
+{
+}
+
+static void malloc_dma_cache_op(void *cookie, void *addr, size_t size, dma_cache_op_t op)
+{
+}
+
+/* Create the emulated device behind a transport */
+static virtio_emul_t *virtio_balloon_emul_create(virtio_balloon_t *balloon, vm_t *vm, struct balloon_passthrough backend)
+{
+    ps_io_ops_t ioops;
+    ioops.dma_manager = (ps_dma_man_t) {
+        .cookie = NULL,
+        .dma_alloc_fn = malloc_dma_alloc,
+        .dma_free_fn = malloc_dma_free,
+        .dma_pin_fn = malloc_dma_pin,
+        .dma_unpin_fn = malloc_dma_unpin,
+        .dma_cache_op_fn = malloc_dma_cache_op
+    };
+
+    balloon->emul_driver_funcs = backend;
+    return virtio_emul_init(ioops, QUEUE_SIZE, 1, vm, emul_balloon_driver_init, balloon, VIRTIO_BALLOON);
+}
+
+static vmm_pci_entry_t vmm_virtio_balloon_pci_bar(unsigned int iobase, size_t iobase_size_bits,
+                                              unsigned int interrupt_pin, unsigned int interrupt_line)
+{
+    vmm_pci_device_def_t *pci_config;
+    int err = ps_calloc(&ops.malloc_ops, 1, sizeof(*pci_config), (void **)&pci_config);
+    ZF_LOGF_IF(err, "Failed to allocate pci config");
+    *pci_config = (vmm_pci_device_def_t) {
+        .vendor_id = VIRTIO_PCI_VENDOR_ID,
+        .device_id = VIRTIO_BALLOON_PCI_DEVICE_ID,
+        .command = PCI_COMMAND_IO | PCI_COMMAND_MEMORY,
+        .header_type = PCI_HEADER_TYPE_NORMAL,
+        .subsystem_vendor_id    = VIRTIO_PCI_SUBSYSTEM_VENDOR_ID,
+        .subsystem_id       = VIRTIO_ID_BALLOON,
+        .interrupt_pin = interrupt_pin,
+        .interrupt_line = interrupt_line,
+        .bar0 = iobase | PCI_BASE_ADDRESS_SPACE_IO,
+        .cache_line_size = 64,
+        .latency_timer = 64,
+        .prog_if = VIRTIO_PCI_CLASS_BALLOON & 0xff,
+        .subclass = (VIRTIO_PCI_CLASS_BALLOON >> 8) & 0xff,
+        .class_code = (VIRTIO_PCI_CLASS_BALLOON >> 16) & 0xff,
+    };
+    vmm_pci_entry_t entry = (vmm_pci_entry_t) {
+        .cookie = pci_config,
+        .ioread = vmm_pci_mem_device_read,
+        .iowrite = vmm_pci_mem_device_write
+    };
+
+    vmm_pci_bar_t bars[1] = {{
+            .mem_type = NON_MEM,
+            .address = iobase,
+            .size_bits = iobase_size_bits
+        }
+    };
+    return vmm_pci_create_passthrough_bar_emulation(entry, 1, bars);
+}
+
+virtio_balloon_t *common_make_virtio_balloon(vm_t *vm, vmm_pci_space_t *pci, vmm_io_port_list_t *ioport,
+                                     ioport_range_t ioport_range, ioport_type_t port_type, unsigned int interrupt_pin,
+                                     unsigned int interrupt_line, struct balloon_passthrough backend)
+{
+    int err = ps_new_stdlib_malloc_ops(&ops.malloc_ops);
+    ZF_LOGF_IF(err, "Failed to get malloc ops");
+
+    virtio_balloon_t *balloon;
+    err = ps_calloc(&ops.malloc_ops, 1, sizeof(*balloon), (void **)&balloon);
+    ZF_LOGF_IF(err, "Failed to allocate virtio balloon");
+
+    ioport_interface_t virtio_io_interface = {balloon, virtio_balloon_io_in, virtio_balloon_io_out, "VIRTIO BALLOON"};
+    ioport_entry_t *io_entry = vmm_io_port_add_handler(ioport, ioport_range, virtio_io_interface, port_type);
+    if (!io_entry) {
+        ZF_LOGE("Failed to add vmm io port handler");
+        return NULL;
+    }
+
+    size_t iobase_size_bits = BYTES_TO_SIZE_BITS(io_entry->range.size);
+    balloon->iobase = io_entry->range.start;
+    vmm_pci_entry_t balloon_entry = vmm_virtio_balloon_pci_bar(io_entry->range.start, iobase_size_bits, interrupt_pin,
+                                                       interrupt_line);
+    vmm_pci_add_entry(pci, balloon_entry, NULL);
+
+    balloon->emul = virtio_balloon_emul_create(balloon, vm, backend);
+
+    assert(balloon->emul);
+    return balloon;
+}
+
+#ifdef CONFIG_ARCH_ARM
+virtio_balloon_t *common_make_virtio_balloon_mmio(vm_t *vm, uintptr_t addr, struct balloon_passthrough backend)
+{
+    int err = ps_new_stdlib_malloc_ops(&ops.malloc_ops);
+    ZF_LOGF_IF(err, "Failed to get malloc ops");
+
+    virtio_balloon_t *balloon;
+    err = ps_calloc(&ops.malloc_ops, 1, sizeof(*balloon), (void **)&balloon);
+    ZF_LOGF_IF(err, "Failed to allocate virtio balloon");
+
+    balloon->emul = virtio_balloon_emul_create(balloon, vm, backend);
+    if (!balloon->emul) {
+        ZF_LOGE("Failed to make virtio balloon: Unable to create the emulated device");
+        ps_free(&ops.malloc_ops, sizeof(*balloon), balloon);
+        return NULL;
+    }
+
+    err = vm_install_virtio_mmio(vm, balloon->emul, addr, VIRTIO_ID_BALLOON);
+    if (err) {
+        ZF_LOGE("Failed to make virtio balloon: Unable to install mmio transport");
+        return NULL;
+    }
+    return balloon;
+}
+#endif
+
+void virtio_balloon_set_target(virtio_balloon_t *balloon, uint32_t num_pages)
+{
+    balloon_virtio_emul_set_target(balloon->emul, num_pages);
+}
+
+uint32_t virtio_balloon_get_actual(virtio_balloon_t *balloon)
+{
+    return balloon_virtio_emul_get_actual(balloon->emul);
+}
@@ -0,0 +1,207 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <sel4vmmplatsupport/drivers/virtio_pci_emul.h>
+#include <stdbool.h>
+
+#include "virtio_emul_helpers.h"
+
+/* Pages given up by the guest, and pages it takes back */
+#define BALLOON_INFLATE_QUEUE 0
+#define BALLOON_DEFLATE_QUEUE 1
+
+/* Page numbers read from the guest at once */
+#define BALLOON_PFN_BATCH 256
+
+#define VIRTIO_BALLOON_F_MUST_TELL_HOST 0
+
+/* The guest has to tell us before using pages it takes back, so they are
+ * backed again before it touches them */
+#define BALLOON_HOST_FEATURES BIT(VIRTIO_BALLOON_F_MUST_TELL_HOST)
+
+#ifndef VIRTIO_PCI_ISR_CONFIG
+#define VIRTIO_PCI_ISR_CONFIG 0x2
+#endif
+
+/* Device configuration space, following the common virtio registers */
+struct virtio_balloon_config {
+    /* pages the device wants in the balloon */
+    uint32_t num_pages;
+    /* pages the guest has put in the balloon */
+    uint32_t actual;
+} PACKED;
+
+typedef struct balloon_virtio_emul_internal {
+    struct balloon_passthrough driver;
+    virtio_emul_t *emul;
+    struct virtio_balloon_config config;
+    /* the configuration has changed since the guest last read the interrupt status */
+    bool config_changed;
+} balloon_internal_t;
+
+/* Release or repopulate a run of contiguous guest pages */
+static void balloon_update_pages(virtio_emul_t *emul, unsigned int queue, uintptr_t addr, size_t size)
+{
+    int err;
+    if (queue == BALLOON_INFLATE_QUEUE) {
+        err = vm_ram_release(emul->vm, addr, size);
+    } else {
+        err = vm_ram_repopulate(emul->vm, addr, size);
+    }
+    if (err) {
+        ZF_LOGW("Failed to %s balloon pages at 0x%x of size 0x%zx",
+                queue == BALLOON_INFLATE_QUEUE ? "release" : "repopulate", addr, size);
+    }
+}
+
+/* Handle the page numbers of a chain, grouping consecutive pages together */
+static void balloon_chain_pages(virtio_emul_t *emul, unsigned int queue, vm_guest_iovec_t *iov, int iovcnt)
+{
+    uint32_t pfns[BALLOON_PFN_BATCH];
+    uintptr_t run_start = 0;
+    size_t run_size = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        for (size_t offset = 0; offset + sizeof(uint32_t) <= iov[i].len;) {
+            size_t len = MIN(sizeof(pfns), ROUND_DOWN(iov[i].len - offset, sizeof(uint32_t)));
+            vm_guest_read_mem(emul->vm, pfns, iov[i].addr + offset, len);
+            for (int j = 0; j < len / sizeof(uint32_t); j++) {
+                uintptr_t addr = (uintptr_t)pfns[j] << VIRTIO_BALLOON_PFN_SHIFT;
+                if (run_size && addr == run_start + run_size) {
+                    run_size += BIT(VIRTIO_BALLOON_PFN_SHIFT);
+                    continue;
+                }
+                if (run_size) {
+                    balloon_update_pages(emul, queue, run_start, run_size);
+                }
+                run_start = addr;
+                run_size = BIT(VIRTIO_BALLOON_PFN_SHIFT);
+            }
+            offset += len;
+        }
+    }
+    if (run_size) {
+        balloon_update_pages(emul, queue, run_start, run_size);
+    }
+}
+
+static void emul_balloon_notify_queue(virtio_emul_t *emul, unsigned int queue)
+{
+    balloon_internal_t *balloon = (balloon_internal_t *)emul->internal;
+    uint16_t idx = emul->virtq.last_idx[queue];
+    uint16_t old_used = ring_used_idx(emul, queue);
+    uint16_t used = old_used;
+    while (true) {
+        vm_guest_iovec_t iov[VIRTIO_MAX_CHAIN_DESCS];
+        virtio_chain_t chain;
+        int iovcnt = ring_avail_chain(emul, queue, idx, &chain, iov, VIRTIO_MAX_CHAIN_DESCS);
+        if (!iovcnt) {
+            break;
+        }
+        balloon_chain_pages(emul, queue, iov, iovcnt);
+        used += ring_used_write(emul, queue, used, &chain, 0);
+        idx += chain.num;
+    }
+    emul->virtq.last_idx[queue] = idx;
+    if (used == old_used) {
+        return;
+    }
+    ring_used_publish(emul, queue, used);
+    if (ring_need_interrupt(emul, queue, old_used, used)) {
+        balloon->driver.handleIRQ(balloon->driver.balloon_data);
+    }
+}
+
+static void emul_balloon_notify(virtio_emul_t *emul)
+{
+    emul_balloon_notify_queue(emul, BALLOON_INFLATE_QUEUE);
+    emul_balloon_notify_queue(emul, BALLOON_DEFLATE_QUEUE);
+}
+
+static bool balloon_device_emul_io_in(struct virtio_emul *emul, unsigned int offset, unsigned int size,
+                                      unsigned int *result)
+{
+    balloon_internal_t *balloon = (balloon_internal_t *)emul->internal;
+    unsigned int config_offset = VIRTIO_PCI_CONFIG_OFF(false);
+    switch (offset) {
+    case VIRTIO_PCI_HOST_FEATURES:
+        assert(size == 4);
+        *result = BALLOON_HOST_FEATURES;
+        return true;
+    case VIRTIO_PCI_ISR:
+        assert(size == 1);
+        /* reading the interrupt status acknowledges a configuration change */
+        *result = 1 | (balloon->config_changed ? VIRTIO_PCI_ISR_CONFIG : 0);
+        balloon->config_changed = false;
+        return true;
+    }
+    if (offset >= config_offset && offset + size <= config_offset + sizeof(balloon->config)) {
+        /* the configuration may be read in pieces of any size */
+        *result = 0;
+        memcpy(result, (uint8_t *)&balloon->config + offset - config_offset, size);
+        return true;
+    }
+    return false;
+}
+
+static bool balloon_device_emul_io_out(struct virtio_emul *emul, unsigned int offset, unsigned int size,
+                                       unsigned int value)
+{
+    balloon_internal_t *balloon = (balloon_internal_t *)emul->internal;
+    unsigned int actual_offset = VIRTIO_PCI_CONFIG_OFF(false) + offsetof(struct virtio_balloon_config, actual);
+    if (offset == VIRTIO_PCI_GUEST_FEATURES) {
+        assert(size == 4);
+        assert(!(value & ~BALLOON_HOST_FEATURES));
+        emul->virtq.features = value;
+        return true;
+    }
+    if (offset >= actual_offset && offset + size <= actual_offset + sizeof(balloon->config.actual)) {
+        /* only the number of pages in the balloon is written by the guest */
+        memcpy((uint8_t *)&balloon->config.actual + offset - actual_offset, &value, size);
+        return true;
+    }
+    return false;
+}
+
+void balloon_virtio_emul_set_target(virtio_emul_t *emul, uint32_t num_pages)
+{
+    balloon_internal_t *balloon = (balloon_internal_t *)emul->internal;
+    balloon->config.num_pages = num_pages;
+    balloon->config_changed = true;
+    balloon->driver.handleIRQ(balloon->driver.balloon_data);
+}
+
+uint32_t balloon_virtio_emul_get_actual(virtio_emul_t *emul)
+{
+    balloon_internal_t *balloon = (balloon_internal_t *)emul->internal;
+    return balloon->config.actual;
+}
+
+void *balloon_virtio_emul_init(virtio_emul_t *emul, ps_io_ops_t io_ops, balloon_driver_init driver, void *config)
+{
+    balloon_internal_t *internal = calloc(1, sizeof(*internal));
+    if (!internal) {
+        goto error;
+    }
+    int err = driver(&internal->driver, io_ops, config);
+    if (err) {
+        ZF_LOGE("Failed to initialize driver");
+        goto error;
+    }
+    emul->notify = emul_balloon_notify;
+    emul->notify_queue = emul_balloon_notify_queue;
+    emul->device_io_in = balloon_device_emul_io_in;
+    emul->device_io_out = balloon_device_emul_io_out;
+    internal->emul = emul;
+    return (void *)internal;
+error:
+    if (emul) {
+        free(emul);
+    }
+    if (internal) {
+        free(internal);
+    }
+    return NULL;
+}
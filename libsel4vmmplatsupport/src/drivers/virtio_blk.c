@@ -0,0 +1,239 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <platsupport/io.h>
+
+#include <sel4vmmplatsupport/drivers/virtio.h>
+#include <sel4vmmplatsupport/drivers/virtio_blk.h>
+
+#include <pci/helper.h>
+#include <sel4vmmplatsupport/drivers/pci_helper.h>
+
+#ifdef CONFIG_ARCH_ARM
+#include <sel4vmmplatsupport/arch/virtio_mmio.h>
+#endif
+
+#define QUEUE_SIZE 128
+
+static ps_io_ops_t ops;
+
+typedef struct ramdisk {
+    uint8_t *disk;
+    size_t size;
+} ramdisk_t;
+
+static int virtio_blk_io_in(void *cookie, unsigned int port_no, unsigned int size, unsigned int *result)
+{
+    virtio_blk_t *blk = (virtio_blk_t *)cookie;
+    unsigned int offset = port_no - blk->iobase;
+    unsigned int val;
+    int err = blk->emul->io_in(blk->emul, offset, size, &val);
+    if (err) {
+        return err;
+    }
+    *result = val;
+    return 0;
+}
+
+static int virtio_blk_io_out(void *cookie, unsigned int port_no, unsigned int size, unsigned int value)
+{
+    virtio_blk_t *blk = (virtio_blk_t *)cookie;
+    unsigned int offset = port_no - blk->iobase;
+    return blk->emul->io_out(blk->emul, offset, size, value);
+}
+
+static int emul_blk_driver_init(struct blk_passthrough *driver, ps_io_ops_t io_ops, void *config)
+{
+    virtio_blk_t *blk = (virtio_blk_t *)config;
+    *driver = blk->emul_driver_funcs;
+    return 0;
+}
+
+static void *malloc_dma_alloc(void *cookie, size_t size, int align, int cached, ps_mem_flags_t flags)
+{
+    assert(cached);
+    int error;
+    void *ret;
+    error = posix_memalign(&ret, align, size);
+    if (error) {
+        return NULL;
+    }
+    return ret;
+}
+
+static void malloc_dma_free(void *cookie, void *addr, size_t size)
+{
+    free(addr);
+}
+
+static uintptr_t malloc_dma_pin(void *cookie, void *addr, size_t size)
+{
+    return (uintptr_t)addr;
+}
+
+static void malloc_dma_unpin(void *cookie, void *addr, size_t size)
+{
+}
+
+static void malloc_dma_cache_op(void *cookie, void *addr, size_t size, dma_cache_op_t op)
+{
+}
+
+/* Create the emulated device behind a transport */
+static virtio_emul_t *virtio_blk_emul_create(virtio_blk_t *blk, vm_t *vm, struct blk_passthrough backend)
+{
+    ps_io_ops_t ioops;
+    ioops.dma_manager = (ps_dma_man_t) {
+        .cookie = NULL,
+        .dma_alloc_fn = malloc_dma_alloc,
+        .dma_free_fn = malloc_dma_free,
+        .dma_pin_fn = malloc_dma_pin,
+        .dma_unpin_fn = malloc_dma_unpin,
+        .dma_cache_op_fn = malloc_dma_cache_op
+    };
+
+    blk->emul_driver_funcs = backend;
+    return virtio_emul_init(ioops, QUEUE_SIZE, 1, vm, emul_blk_driver_init, blk, VIRTIO_BLK);
+}
+
+static vmm_pci_entry_t vmm_virtio_blk_pci_bar(unsigned int iobase, size_t iobase_size_bits,
+                                              unsigned int interrupt_pin, unsigned int interrupt_line)
+{
+    vmm_pci_device_def_t *pci_config;
+    int err = ps_calloc(&ops.malloc_ops, 1, sizeof(*pci_config), (void **)&pci_config);
+    ZF_LOGF_IF(err, "Failed to allocate pci config");
+    *pci_config = (vmm_pci_device_def_t) {
+        .vendor_id = VIRTIO_PCI_VENDOR_ID,
+        .device_id = VIRTIO_BLK_PCI_DEVICE_ID,
+        .command = PCI_COMMAND_IO | PCI_COMMAND_MEMORY,
+        .header_type = PCI_HEADER_TYPE_NORMAL,
+        .subsystem_vendor_id    = VIRTIO_PCI_SUBSYSTEM_VENDOR_ID,
+        .subsystem_id       = VIRTIO_ID_BLOCK,
+        .interrupt_pin = interrupt_pin,
+        .interrupt_line = interrupt_line,
+        .bar0 = iobase | PCI_BASE_ADDRESS_SPACE_IO,
+        .cache_line_size = 64,
+        .latency_timer = 64,
+        .prog_if = VIRTIO_PCI_CLASS_BLOCK & 0xff,
+        .subclass = (VIRTIO_PCI_CLASS_BLOCK >> 8) & 0xff,
+        .class_code = (VIRTIO_PCI_CLASS_BLOCK >> 16) & 0xff,
+    };
+    vmm_pci_entry_t entry = (vmm_pci_entry_t) {
+        .cookie = pci_config,
+        .ioread = vmm_pci_mem_device_read,
+        .iowrite = vmm_pci_mem_device_write
+    };
+
+    vmm_pci_bar_t bars[1] = {{
+            .mem_type = NON_MEM,
+            .address = iobase,
+            .size_bits = iobase_size_bits
+        }
+    };
+    return vmm_pci_create_passthrough_bar_emulation(entry, 1, bars);
+}
+
+virtio_blk_t *common_make_virtio_blk(vm_t *vm, vmm_pci_space_t *pci, vmm_io_port_list_t *ioport,
+                                     ioport_range_t ioport_range, ioport_type_t port_type, unsigned int interrupt_pin,
+                                     unsigned int interrupt_line, struct blk_passthrough backend)
+{
+    int err = ps_new_stdlib_malloc_ops(&ops.malloc_ops);
+    ZF_LOGF_IF(err, "Failed to get malloc ops");
+
+    virtio_blk_t *blk;
+    err = ps_calloc(&ops.malloc_ops, 1, sizeof(*blk), (void **)&blk);
+    ZF_LOGF_IF(err, "Failed to allocate virtio blk");
+
+    ioport_interface_t virtio_io_interface = {blk, virtio_blk_io_in, virtio_blk_io_out, "VIRTIO BLK"};
+    ioport_entry_t *io_entry = vmm_io_port_add_handler(ioport, ioport_range, virtio_io_interface, port_type);
+    if (!io_entry) {
+        ZF_LOGE("Failed to add vmm io port handler");
+        return NULL;
+    }
+
+    size_t iobase_size_bits = BYTES_TO_SIZE_BITS(io_entry->range.size);
+    blk->iobase = io_entry->range.start;
+    vmm_pci_entry_t blk_entry = vmm_virtio_blk_pci_bar(io_entry->range.start, iobase_size_bits, interrupt_pin,
+                                                       interrupt_line);
+    vmm_pci_add_entry(pci, blk_entry, NULL);
+
+    blk->emul = virtio_blk_emul_create(blk, vm, backend);
+
+    assert(blk->emul);
+    return blk;
+}
+
+#ifdef CONFIG_ARCH_ARM
+virtio_blk_t *common_make_virtio_blk_mmio(vm_t *vm, uintptr_t addr, struct blk_passthrough backend)
+{
+    int err = ps_new_stdlib_malloc_ops(&ops.malloc_ops);
+    ZF_LOGF_IF(err, "Failed to get malloc ops");
+
+    virtio_blk_t *blk;
+    err = ps_calloc(&ops.malloc_ops, 1, sizeof(*blk), (void **)&blk);
+    ZF_LOGF_IF(err, "Failed to allocate virtio blk");
+
+    blk->emul = virtio_blk_emul_create(blk, vm, backend);
+    if (!blk->emul) {
+        ZF_LOGE("Failed to make virtio blk: Unable to create the emulated device");
+        ps_free(&ops.malloc_ops, sizeof(*blk), blk);
+        return NULL;
+    }
+
+    err = vm_install_virtio_mmio(vm, blk->emul, addr, VIRTIO_ID_BLOCK);
+    if (err) {
+        ZF_LOGE("Failed to make virtio blk: Unable to install mmio transport");
+        return NULL;
+    }
+    return blk;
+}
+#endif
+
+static int ramdisk_submit(void *cookie, blk_request_t *req)
+{
+    ramdisk_t *ramdisk = (ramdisk_t *)cookie;
+    /* the emulation only submits requests within the capacity of the disk */
+    uint8_t *data = ramdisk->disk + req->sector * VIRTIO_BLK_SECTOR_SIZE;
+    switch (req->type) {
+    case VIRTIO_BLK_T_IN:
+        memcpy(req->buf, data, req->len);
+        break;
+    case VIRTIO_BLK_T_OUT:
+        memcpy(data, req->buf, req->len);
+        break;
+    case VIRTIO_BLK_T_FLUSH:
+        break;
+    default:
+        req->complete(req, VIRTIO_BLK_S_UNSUPP);
+        return 0;
+    }
+    req->complete(req, VIRTIO_BLK_S_OK);
+    return 0;
+}
+
+int virtio_blk_ramdisk_backend(void *disk, size_t size, struct blk_passthrough *backend)
+{
+    if (!disk || size % VIRTIO_BLK_SECTOR_SIZE) {
+        ZF_LOGE("Failed to create ramdisk backend: Size 0x%zx is not a multiple of the sector size", size);
+        return -1;
+    }
+    ramdisk_t *ramdisk = calloc(1, sizeof(*ramdisk));
+    if (!ramdisk) {
+        ZF_LOGE("Failed to create ramdisk backend: Unable to allocate ramdisk");
+        return -1;
+    }
+    ramdisk->disk = disk;
+    ramdisk->size = size;
+    backend->submit = ramdisk_submit;
+    backend->capacity = size / VIRTIO_BLK_SECTOR_SIZE;
+    backend->read_only = false;
+    backend->blk_data = ramdisk;
+    return 0;
+}
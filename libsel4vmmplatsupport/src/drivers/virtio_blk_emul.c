@@ -0,0 +1,432 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <sel4vmmplatsupport/drivers/virtio_pci_emul.h>
+#include <stdbool.h>
+
+#include "virtio_emul_helpers.h"
+
+/* The device has a single request queue */
+#define BLK_QUEUE 0
+
+/* Largest request the device handles, once merged with adjacent ones. Guests
+ * are told to keep requests within it through the segment limits */
+#define BLK_MAX_REQUEST_SIZE (128 * 1024)
+#define BLK_SIZE_MAX 4096
+#define BLK_SEG_MAX (BLK_MAX_REQUEST_SIZE / BLK_SIZE_MAX)
+
+/* Requests handed to the backend at once, each with its own bounce buffer */
+#define BLK_MAX_INFLIGHT 16
+/* Most descriptor chains merged into a single backend request */
+#define BLK_MAX_MERGE 8
+
+/* Length of the device id string returned for VIRTIO_BLK_T_GET_ID */
+#define BLK_ID_LEN 20
+#define BLK_ID "sel4-virtio-blk"
+
+#define VIRTIO_BLK_F_SIZE_MAX 1
+#define VIRTIO_BLK_F_SEG_MAX 2
+#define VIRTIO_BLK_F_RO 5
+#define VIRTIO_BLK_F_BLK_SIZE 6
+#define VIRTIO_BLK_F_FLUSH 9
+
+#define BLK_HOST_FEATURES (BIT(VIRTIO_BLK_F_SIZE_MAX) | BIT(VIRTIO_BLK_F_SEG_MAX) | BIT(VIRTIO_BLK_F_BLK_SIZE) | \
+                           BIT(VIRTIO_BLK_F_FLUSH) | BIT(VIRTIO_RING_F_EVENT_IDX))
+
+/* Header at the start of every request */
+struct virtio_blk_outhdr {
+    uint32_t type;
+    uint32_t ioprio;
+    uint64_t sector;
+} PACKED;
+
+/* Device configuration space, following the common virtio registers */
+struct virtio_blk_config {
+    uint64_t capacity;
+    uint32_t size_max;
+    uint32_t seg_max;
+    struct {
+        uint16_t cylinders;
+        uint8_t heads;
+        uint8_t sectors;
+    } PACKED geometry;
+    uint32_t blk_size;
+} PACKED;
+
+/* A descriptor chain of a request, split into its parts */
+typedef struct blk_chain {
+    virtio_chain_t chain;
+    /* data buffers of the chain, between the header and the status */
+    vm_guest_iovec_t data[VIRTIO_MAX_CHAIN_DESCS];
+    int num_data;
+    size_t len;
+    /* guest physical address of the status byte */
+    uintptr_t status;
+} blk_chain_t;
+
+struct blk_virtio_emul_internal;
+
+/* A request in flight with the backend, which may cover several adjacent
+ * requests of the guest */
+typedef struct blk_slot {
+    blk_request_t req;
+    struct blk_virtio_emul_internal *blk;
+    struct blk_slot *next;
+    blk_chain_t chains[BLK_MAX_MERGE];
+    unsigned int num_chains;
+} blk_slot_t;
+
+typedef struct blk_virtio_emul_internal {
+    struct blk_passthrough driver;
+    virtio_emul_t *emul;
+    ps_dma_man_t dma_man;
+    struct virtio_blk_config config;
+    blk_slot_t slots[BLK_MAX_INFLIGHT];
+    blk_slot_t *free_slots;
+    /* completed chains written to the used ring but not yet published, up to used_end */
+    unsigned int used_pending;
+    uint16_t used_end;
+    /* set while the request queue is processed, during which completions
+     * are published together once processing is done */
+    bool in_notify;
+} blk_internal_t;
+
+static void emul_blk_notify(virtio_emul_t *emul);
+
+/* Populate 'out' with 'len' bytes of a guest iovec from its first 'offset'
+ * bytes. Returns the number of entries populated */
+static int guest_iov_range(const vm_guest_iovec_t *iov, int iovcnt, size_t offset, size_t len,
+                           vm_guest_iovec_t *out)
+{
+    int num = 0;
+    for (int i = 0; i < iovcnt && len; i++) {
+        if (offset >= iov[i].len) {
+            offset -= iov[i].len;
+            continue;
+        }
+        size_t n = MIN(iov[i].len - offset, len);
+        out[num].addr = iov[i].addr + offset;
+        out[num].len = n;
+        num++;
+        len -= n;
+        offset = 0;
+    }
+    return num;
+}
+
+static blk_slot_t *blk_slot_get(blk_internal_t *blk)
+{
+    blk_slot_t *slot = blk->free_slots;
+    if (slot) {
+        blk->free_slots = slot->next;
+        slot->num_chains = 0;
+        slot->req.len = 0;
+    }
+    return slot;
+}
+
+static void blk_slot_put(blk_internal_t *blk, blk_slot_t *slot)
+{
+    slot->next = blk->free_slots;
+    blk->free_slots = slot;
+}
+
+/* Publish the chains completed so far, interrupting the guest once for all of them */
+static void blk_used_flush(blk_internal_t *blk)
+{
+    virtio_emul_t *emul = blk->emul;
+    if (!blk->used_pending) {
+        return;
+    }
+    uint16_t old_idx = ring_used_idx(emul, BLK_QUEUE);
+    ring_used_publish(emul, BLK_QUEUE, blk->used_end);
+    blk->used_pending = 0;
+    if (ring_need_interrupt(emul, BLK_QUEUE, old_idx, blk->used_end)) {
+        blk->driver.handleIRQ(blk->driver.blk_data);
+    }
+}
+
+/* Put a chain in the used ring, 'len' bytes having been written to it */
+static void blk_used_add(blk_internal_t *blk, virtio_chain_t *chain, uint32_t len)
+{
+    virtio_emul_t *emul = blk->emul;
+    if (!blk->used_pending) {
+        blk->used_end = ring_used_idx(emul, BLK_QUEUE);
+    }
+    blk->used_end += ring_used_write(emul, BLK_QUEUE, blk->used_end, chain, len);
+    blk->used_pending++;
+}
+
+/* Hand a chain back with its status, 'written' bytes of data having been written to it */
+static void blk_chain_done(blk_internal_t *blk, blk_chain_t *chain, uint8_t status, uint32_t written)
+{
+    vm_guest_write_mem(blk->emul->vm, &status, chain->status, sizeof(status));
+    blk_used_add(blk, &chain->chain, written + sizeof(status));
+}
+
+static void blk_request_complete(blk_request_t *req, int status)
+{
+    blk_slot_t *slot = (blk_slot_t *)req;
+    blk_internal_t *blk = slot->blk;
+    virtio_emul_t *emul = blk->emul;
+    size_t offset = 0;
+    /* the request's data is split back up across the chains it covers */
+    for (int i = 0; i < slot->num_chains; i++) {
+        blk_chain_t *chain = &slot->chains[i];
+        size_t written = 0;
+        if (req->type == VIRTIO_BLK_T_IN && status == VIRTIO_BLK_S_OK) {
+            vm_host_iovec_t host_iov = { .base = (uint8_t *)req->buf + offset, .len = chain->len };
+            vm_guest_writev(emul->vm, &host_iov, 1, chain->data, chain->num_data, &written);
+        }
+        offset += chain->len;
+        blk_chain_done(blk, chain, status, written);
+    }
+    blk_slot_put(blk, slot);
+    if (!blk->in_notify) {
+        /* requests may have been waiting for the slot */
+        emul_blk_notify(emul);
+    }
+}
+
+static void blk_slot_submit(blk_internal_t *blk, blk_slot_t *slot)
+{
+    virtio_emul_t *emul = blk->emul;
+    if (slot->req.type == VIRTIO_BLK_T_OUT) {
+        size_t offset = 0;
+        for (int i = 0; i < slot->num_chains; i++) {
+            blk_chain_t *chain = &slot->chains[i];
+            vm_host_iovec_t host_iov = { .base = (uint8_t *)slot->req.buf + offset, .len = chain->len };
+            size_t copied = 0;
+            vm_guest_readv(emul->vm, &host_iov, 1, chain->data, chain->num_data, &copied);
+            offset += chain->len;
+        }
+    }
+    if (blk->driver.submit(blk->driver.blk_data, &slot->req)) {
+        blk_request_complete(&slot->req, VIRTIO_BLK_S_IOERR);
+    }
+}
+
+static void blk_slot_add(blk_slot_t *slot, blk_chain_t *chain)
+{
+    slot->chains[slot->num_chains++] = *chain;
+    slot->req.len += chain->len;
+}
+
+/* Whether a read or write can be merged into the end of a request */
+static bool blk_can_merge(blk_slot_t *slot, uint32_t type, uint64_t sector, size_t len)
+{
+    return slot && slot->req.type == type && slot->req.sector + slot->req.len / VIRTIO_BLK_SECTOR_SIZE == sector &&
+           slot->num_chains < BLK_MAX_MERGE && slot->req.len + len <= BLK_MAX_REQUEST_SIZE;
+}
+
+static void emul_blk_notify(virtio_emul_t *emul)
+{
+    blk_internal_t *blk = (blk_internal_t *)emul->internal;
+    if (blk->in_notify) {
+        return;
+    }
+    blk->in_notify = true;
+    uint16_t idx = emul->virtq.last_idx[BLK_QUEUE];
+    /* request that adjacent requests are merged into, until it is submitted */
+    blk_slot_t *slot = NULL;
+    while (true) {
+        vm_guest_iovec_t guest_iov[VIRTIO_MAX_CHAIN_DESCS];
+        blk_chain_t chain;
+        int guest_iovcnt = ring_avail_chain(emul, BLK_QUEUE, idx, &chain.chain, guest_iov, VIRTIO_MAX_CHAIN_DESCS);
+        if (!guest_iovcnt) {
+            break;
+        }
+        struct virtio_blk_outhdr hdr;
+        vm_host_iovec_t host_iov = { .base = &hdr, .len = sizeof(hdr) };
+        size_t copied = 0;
+        vm_guest_readv(emul->vm, &host_iov, 1, guest_iov, guest_iovcnt, &copied);
+        size_t total = 0;
+        for (int i = 0; i < guest_iovcnt; i++) {
+            total += guest_iov[i].len;
+        }
+        if (copied < sizeof(hdr) || total < sizeof(hdr) + 1) {
+            /* there is nowhere to put a status, hand the chain straight back */
+            ZF_LOGW("Dropping malformed block request");
+            blk_used_add(blk, &chain.chain, 0);
+            idx += chain.chain.num;
+            continue;
+        }
+        chain.len = total - sizeof(hdr) - 1;
+        chain.num_data = guest_iov_range(guest_iov, guest_iovcnt, sizeof(hdr), chain.len, chain.data);
+        vm_guest_iovec_t status_iov;
+        guest_iov_range(guest_iov, guest_iovcnt, total - 1, 1, &status_iov);
+        chain.status = status_iov.addr;
+
+        switch (hdr.type) {
+        case VIRTIO_BLK_T_IN:
+        case VIRTIO_BLK_T_OUT: {
+            uint64_t num_sectors = chain.len / VIRTIO_BLK_SECTOR_SIZE;
+            if (chain.len % VIRTIO_BLK_SECTOR_SIZE || chain.len > BLK_MAX_REQUEST_SIZE ||
+                hdr.sector > blk->driver.capacity || num_sectors > blk->driver.capacity - hdr.sector ||
+                (hdr.type == VIRTIO_BLK_T_OUT && blk->driver.read_only)) {
+                blk_chain_done(blk, &chain, VIRTIO_BLK_S_IOERR, 0);
+                break;
+            }
+            if (blk_can_merge(slot, hdr.type, hdr.sector, chain.len)) {
+                blk_slot_add(slot, &chain);
+                break;
+            }
+            if (slot) {
+                blk_slot_submit(blk, slot);
+            }
+            slot = blk_slot_get(blk);
+            if (!slot) {
+                /* try again once a request completes */
+                goto out;
+            }
+            slot->req.type = hdr.type;
+            slot->req.sector = hdr.sector;
+            blk_slot_add(slot, &chain);
+            break;
+        }
+        case VIRTIO_BLK_T_FLUSH: {
+            /* writes before the flush are submitted ahead of it */
+            if (slot) {
+                blk_slot_submit(blk, slot);
+            }
+            slot = blk_slot_get(blk);
+            if (!slot) {
+                goto out;
+            }
+            slot->req.type = VIRTIO_BLK_T_FLUSH;
+            slot->req.sector = 0;
+            chain.len = 0;
+            blk_slot_add(slot, &chain);
+            blk_slot_submit(blk, slot);
+            slot = NULL;
+            break;
+        }
+        case VIRTIO_BLK_T_GET_ID: {
+            char id[BLK_ID_LEN] = BLK_ID;
+            vm_host_iovec_t id_iov = { .base = id, .len = MIN(chain.len, sizeof(id)) };
+            size_t written = 0;
+            vm_guest_writev(emul->vm, &id_iov, 1, chain.data, chain.num_data, &written);
+            blk_chain_done(blk, &chain, VIRTIO_BLK_S_OK, written);
+            break;
+        }
+        default:
+            blk_chain_done(blk, &chain, VIRTIO_BLK_S_UNSUPP, 0);
+            break;
+        }
+        idx += chain.chain.num;
+    }
+    if (slot) {
+        blk_slot_submit(blk, slot);
+    }
+out:
+    emul->virtq.last_idx[BLK_QUEUE] = idx;
+    /* have the guest notify us of the next request it adds */
+    ring_avail_event_set(emul, BLK_QUEUE, idx);
+    blk->in_notify = false;
+    blk_used_flush(blk);
+}
+
+static void emul_blk_notify_queue(virtio_emul_t *emul, unsigned int queue)
+{
+    emul_blk_notify(emul);
+}
+
+static uint32_t blk_host_features(blk_internal_t *blk)
+{
+    return BLK_HOST_FEATURES | (blk->driver.read_only ? BIT(VIRTIO_BLK_F_RO) : 0);
+}
+
+bool blk_device_emul_io_in(struct virtio_emul *emul, unsigned int offset, unsigned int size, unsigned int *result)
+{
+    blk_internal_t *blk = (blk_internal_t *)emul->internal;
+    unsigned int config_offset = VIRTIO_PCI_CONFIG_OFF(false);
+    if (offset == VIRTIO_PCI_HOST_FEATURES) {
+        assert(size == 4);
+        *result = blk_host_features(blk);
+        return true;
+    }
+    if (offset >= config_offset && offset + size <= config_offset + sizeof(blk->config)) {
+        /* the configuration may be read in pieces of any size */
+        *result = 0;
+        memcpy(result, (uint8_t *)&blk->config + offset - config_offset, size);
+        return true;
+    }
+    return false;
+}
+
+bool blk_device_emul_io_out(struct virtio_emul *emul, unsigned int offset, unsigned int size, unsigned int value)
+{
+    blk_internal_t *blk = (blk_internal_t *)emul->internal;
+    bool handled = false;
+    switch (offset) {
+    case VIRTIO_PCI_GUEST_FEATURES:
+        handled = true;
+        assert(size == 4);
+        assert(!(value & ~blk_host_features(blk)));
+        emul->virtq.features = value;
+        break;
+    }
+    return handled;
+}
+
+void *blk_virtio_emul_init(virtio_emul_t *emul, ps_io_ops_t io_ops, blk_driver_init driver, void *config)
+{
+    blk_internal_t *internal = calloc(1, sizeof(*internal));
+    if (!internal) {
+        goto error;
+    }
+    int err = driver(&internal->driver, io_ops, config);
+    if (err) {
+        ZF_LOGE("Failed to initialize driver");
+        goto error;
+    }
+    emul->notify = emul_blk_notify;
+    emul->notify_queue = emul_blk_notify_queue;
+    emul->device_io_in = blk_device_emul_io_in;
+    emul->device_io_out = blk_device_emul_io_out;
+    emul->virtq.num_queues = 1;
+    internal->emul = emul;
+    internal->dma_man = io_ops.dma_manager;
+    internal->config = (struct virtio_blk_config) {
+        .capacity = internal->driver.capacity,
+        .size_max = BLK_SIZE_MAX,
+        .seg_max = BLK_SEG_MAX,
+        .blk_size = VIRTIO_BLK_SECTOR_SIZE,
+    };
+    /* bounce buffers of the requests in flight are allocated and pinned up
+     * front, so requests never have to go to the dma allocator */
+    for (int i = 0; i < BLK_MAX_INFLIGHT; i++) {
+        blk_slot_t *slot = &internal->slots[i];
+        slot->blk = internal;
+        slot->req.complete = blk_request_complete;
+        slot->req.buf = ps_dma_alloc(&internal->dma_man, BLK_MAX_REQUEST_SIZE, BLK_SIZE_MAX, 1, PS_MEM_NORMAL);
+        if (!slot->req.buf) {
+            ZF_LOGE("Failed to allocate request buffer %d of %d", i, BLK_MAX_INFLIGHT);
+            goto error;
+        }
+        slot->req.phys = ps_dma_pin(&internal->dma_man, slot->req.buf, BLK_MAX_REQUEST_SIZE);
+        if (!slot->req.phys) {
+            ZF_LOGE("Failed to pin request buffer %d of %d", i, BLK_MAX_INFLIGHT);
+            goto error;
+        }
+        blk_slot_put(internal, slot);
+    }
+    return (void *)internal;
+error:
+    if (emul) {
+        free(emul);
+    }
+    if (internal) {
+        for (int i = 0; i < BLK_MAX_INFLIGHT; i++) {
+            if (internal->slots[i].req.buf) {
+                ps_dma_unpin(&internal->dma_man, internal->slots[i].req.buf, BLK_MAX_REQUEST_SIZE);
+                ps_dma_free(&internal->dma_man, internal->slots[i].req.buf, BLK_MAX_REQUEST_SIZE);
+            }
+        }
+        free(internal);
+    }
+    return NULL;
+}
@@ -16,6 +16,10 @@
 #include <pci/helper.h>
 #include <sel4vmmplatsupport/drivers/pci_helper.h>
 
+#ifdef CONFIG_ARCH_ARM
+#include <sel4vmmplatsupport/arch/virtio_mmio.h>
+#endif
+
 #define QUEUE_SIZE 128
 
 static ps_io_ops_t ops;
@@ -112,8 +116,41 @@ virtio_con_t *common_make_virtio_con(vm_t *vm, vmm_pci_space_t *pci, vmm_io_port
 
     ps_io_ops_t ioops;
     con->emul_driver_funcs = backend;
-    con->emul = virtio_emul_init(ioops, QUEUE_SIZE, vm, emul_con_driver_init, con, VIRTIO_CONSOLE);
+    con->emul = virtio_emul_init(ioops, QUEUE_SIZE, 1, vm, emul_con_driver_init, con, VIRTIO_CONSOLE);
 
     assert(con->emul);
     return con;
 }
+
+#ifdef CONFIG_ARCH_ARM
+virtio_con_t *common_make_virtio_con_mmio(vm_t *vm, uintptr_t addr, struct console_passthrough backend)
+{
+    int err = ps_new_stdlib_malloc_ops(&ops.malloc_ops);
+    ZF_LOGF_IF(err, "Failed to get malloc ops");
+
+    virtio_con_t *con;
+    err = ps_calloc(&ops.malloc_ops, 1, sizeof(*con), (void **)&con);
+    ZF_LOGF_IF(err, "Failed to allocate virtio con");
+
+    ps_io_ops_t ioops;
+    con->emul_driver_funcs = backend;
+    con->emul = virtio_emul_init(ioops, QUEUE_SIZE, 1, vm, emul_con_driver_init, con, VIRTIO_CONSOLE);
+    if (!con->emul) {
+        ZF_LOGE("Failed to make virtio con: Unable to create the emulated device");
+        ps_free(&ops.malloc_ops, sizeof(*con), con);
+        return NULL;
+    }
+
+    err = vm_install_virtio_mmio(vm, con->emul, addr, VIRTIO_ID_CONSOLE);
+    if (err) {
+        ZF_LOGE("Failed to make virtio con: Unable to install mmio transport");
+        return NULL;
+    }
+    return con;
+}
+#endif
+
+int virtio_con_add_ports(virtio_con_t *con, const struct console_port *ports, unsigned int num_ports)
+{
+    return console_virtio_emul_add_ports(con->emul, ports, num_ports);
+}
@@ -11,148 +11,419 @@
 
 #define VUART_BUFLEN 4088
 
-char buf[VUART_BUFLEN];
+#ifndef VIRTIO_CONSOLE_F_MULTIPORT
+#define VIRTIO_CONSOLE_F_MULTIPORT 1
+#endif
 
-typedef struct console_virtio_emul_internal {
+/* Features offered to the guest */
+#define CONSOLE_HOST_FEATURES BIT(VIRTIO_RING_F_EVENT_IDX)
+
+/* Control messages of multiport consoles, as defined by the virtio spec */
+#define CONSOLE_DEVICE_READY 0
+#define CONSOLE_DEVICE_ADD 1
+#define CONSOLE_DEVICE_REMOVE 2
+#define CONSOLE_PORT_READY 3
+#define CONSOLE_CONSOLE_PORT 4
+#define CONSOLE_RESIZE 5
+#define CONSOLE_PORT_OPEN 6
+#define CONSOLE_PORT_NAME 7
+
+/* Port 0 uses the first queue pair, the control queues the second, and
+ * every other port the pair following its number */
+#define CONSOLE_CONTROL_PAIR 1
+#define CONSOLE_PORT_PAIR(port) ((port) ? (port) + 1 : 0)
+
+/* Control messages the guest has not given us buffers for yet. Enough for
+ * every message of every port to be outstanding */
+#define CONSOLE_MAX_CONTROL 32
+
+struct console_control {
+    uint32_t id;
+    uint16_t event;
+    uint16_t value;
+} PACKED;
+
+/* Device configuration space, following the common virtio registers */
+typedef struct console_config {
+    uint16_t cols;
+    uint16_t rows;
+    uint32_t max_nr_ports;
+    uint32_t emerg_wr;
+} PACKED console_config_t;
+
+typedef struct console_port_internal {
     struct console_passthrough driver;
+    const char *name;
+    bool console;
+    /* whether the guest has taken the port on */
+    bool ready;
+    /* each port gathers its own output, so a port with a slow backend holds up no other */
+    char buf[VUART_BUFLEN];
+} console_port_t;
+
+typedef struct console_virtio_emul_internal {
+    virtio_emul_t *emul;
+    unsigned int num_ports;
+    console_port_t ports[VIRTIO_CONSOLE_MAX_PORTS + 1];
+    console_config_t config;
+    /* control messages queued for the guest */
+    struct console_control control[CONSOLE_MAX_CONTROL];
+    unsigned int control_head;
+    unsigned int control_tail;
 } console_internal_t;
 
-static void emul_con_rx_complete(void *iface, char *buf, unsigned int len)
+static bool con_multiport(console_internal_t *con)
 {
-    virtio_emul_t *emul = (virtio_emul_t *)iface;
-    console_internal_t *con = emul->internal;
+    return con->num_ports > 1;
+}
+
+static void con_port_irq(console_internal_t *con, unsigned int port)
+{
+    /* ports that leave it to port 0 share its interrupt */
+    struct console_passthrough *driver = &con->ports[port].driver;
+    if (!driver->handleIRQ) {
+        driver = &con->ports[0].driver;
+    }
+    driver->handleIRQ(driver->console_data);
+}
+
+static void emul_con_rx_complete(console_internal_t *con, unsigned int port, char *buf, unsigned int len)
+{
+    virtio_emul_t *emul = con->emul;
     vqueue_t *virtq = &emul->virtq;
-    int i;
-    struct vring *vring = &virtq->vring[RX_QUEUE];
+    unsigned int queue = VIRTIO_RX_QUEUE(CONSOLE_PORT_PAIR(port));
 
-    uint16_t guest_idx = ring_avail_idx(emul, vring);
-    uint16_t idx = virtq->last_idx[RX_QUEUE];
-    if (idx != guest_idx) {
-        /* total length of the written packet so far */
+    if (port >= con->num_ports || (con_multiport(con) && !con->ports[port].ready)) {
+        return;
+    }
+    virtio_chain_t chain;
+    vm_guest_iovec_t guest_iov[VIRTIO_MAX_CHAIN_DESCS];
+    int guest_iovcnt = ring_avail_chain(emul, queue, virtq->last_idx[queue], &chain, guest_iov,
+                                        VIRTIO_MAX_CHAIN_DESCS);
+    if (guest_iovcnt) {
+        /* a descriptor chain too short to hold the whole buffer truncates it */
+        vm_host_iovec_t host_iov = { .base = buf, .len = len };
         size_t tot_written = 0;
-        /* amount of the current descriptor written */
-        size_t desc_written = 0;
-        /* how much we have written of the current buffer */
-        size_t buf_written = 0;
-        /* the current buffer. -1 indicates the virtio con buffer */
-        int current_buf = 0;
-        uint16_t desc_head = ring_avail(emul, vring, idx);
-        /* start walking the descriptors */
-        struct vring_desc desc;
-        uint16_t desc_idx = desc_head;
-        do {
-            desc = ring_desc(emul, vring, desc_idx);
-            /* determine how much we can copy */
-            uint32_t copy;
-            copy = len - buf_written;
-            copy = MIN(copy, desc.len - desc_written);
-            vm_guest_write_mem(emul->vm, buf + buf_written, (uintptr_t)desc.addr + desc_written, copy);
-            /* update amounts */
-            tot_written += copy;
-            desc_written += copy;
-            buf_written += copy;
-            /* see what's gone over */
-            if (desc_written == desc.len) {
-                if (!desc.flags & VRING_DESC_F_NEXT) {
-                    /* descriptor chain is too short to hold the whole packet.
-                     * just truncate */
-                    break;
-                }
-                desc_idx = desc.next;
-                desc_written = 0;
-            }
-            if (buf_written == len) {
-                current_buf++;
-                buf_written = 0;
-            }
-
-        } while (current_buf < 1);
+        vm_guest_writev(emul->vm, &host_iov, 1, guest_iov, guest_iovcnt, &tot_written);
         /* now put it in the used ring */
-        struct vring_used_elem used_elem = {desc_head, tot_written};
-        ring_used_add(emul, vring, used_elem);
+        uint16_t used_idx = ring_used_idx(emul, queue);
+        ring_used_add(emul, queue, &chain, tot_written);
 
         /* record that we've used this descriptor chain now */
-        virtq->last_idx[RX_QUEUE]++;
+        virtq->last_idx[queue] += chain.num;
+        ring_avail_notify_disable(emul, queue, virtq->last_idx[queue]);
         /* notify the guest that there is something in its used ring */
-        con->driver.handleIRQ(con->driver.console_data);
+        if (ring_need_interrupt(emul, queue, used_idx, ring_used_idx(emul, queue))) {
+            con_port_irq(con, port);
+        }
     }
 }
 
 void virtio_console_putchar(virtio_emul_t *con, char *buf, int len)
 {
-    emul_con_rx_complete((void *)con, buf, len);
+    emul_con_rx_complete(con->internal, 0, buf, len);
 }
 
-static void emul_con_notify_tx(virtio_emul_t *emul)
+void virtio_console_port_putchar(virtio_emul_t *con, unsigned int port, char *buf, int len)
 {
-    console_internal_t *con = emul->internal;
+    emul_con_rx_complete(con->internal, port, buf, len);
+}
+
+/* Hand buffered guest output to the backend */
+static void emul_con_tx_flush(console_port_t *port, size_t len)
+{
+    if (port->driver.write) {
+        port->driver.write(port->driver.console_data, port->buf, len);
+        return;
+    }
+    for (size_t i = 0; i < len; i++) {
+        port->driver.putchar(port->buf[i]);
+    }
+}
+
+static void emul_con_notify_tx(console_internal_t *con, unsigned int port_num)
+{
+    virtio_emul_t *emul = con->emul;
     vqueue_t *virtq = &emul->virtq;
-    struct vring *vring = &virtq->vring[TX_QUEUE];
-    /* read the index */
-    uint16_t guest_idx = ring_avail_idx(emul, vring);
+    console_port_t *port = &con->ports[port_num];
+    unsigned int queue = VIRTIO_TX_QUEUE(CONSOLE_PORT_PAIR(port_num));
     /* process what we can of the ring */
-
-    uint16_t idx = virtq->last_idx[TX_QUEUE];
-    while (idx != guest_idx) {
-
-        /* read the head of the descriptor chain */
-        uint16_t desc_head = ring_avail(emul, vring, idx);
-
-        /* length of the final packet to deliver */
-        uint32_t len = 0;
-        /* we want to skip the initial virtio header, as this should
-         * not be sent to the actual ethernet driver. This records
-         * how much we have skipped so far. */
-        uint32_t skipped = 0;
-        /* start walking the descriptors */
-        struct vring_desc desc;
-        uint16_t desc_idx = desc_head;
-        do {
-            desc = ring_desc(emul, vring, desc_idx);
-
-            vm_guest_read_mem(emul->vm, buf + len, (uintptr_t)desc.addr, desc.len);
-            len += desc.len;
-            desc_idx = desc.next;
-        } while (desc.flags & VRING_DESC_F_NEXT);
-        /* ship it */
-        for (int i = 0; i < len; i++) {
-            con->driver.putchar(buf[i]);
+    uint16_t idx = virtq->last_idx[queue];
+    uint16_t old_used_idx = ring_used_idx(emul, queue);
+    uint16_t used_idx = old_used_idx;
+    /* output of consecutive chains is gathered into the buffer and written together */
+    size_t buffered = 0;
+    while (true) {
+        /* read the next descriptor chain */
+        virtio_chain_t chain;
+        vm_guest_iovec_t guest_iov[VIRTIO_MAX_CHAIN_DESCS];
+        int guest_iovcnt = ring_avail_chain(emul, queue, idx, &chain, guest_iov, VIRTIO_MAX_CHAIN_DESCS);
+        if (!guest_iovcnt) {
+            break;
+        }
+        size_t chain_len = 0;
+        for (int i = 0; i < guest_iovcnt; i++) {
+            chain_len += guest_iov[i].len;
         }
+        if (buffered && buffered + chain_len > VUART_BUFLEN) {
+            emul_con_tx_flush(port, buffered);
+            buffered = 0;
+        }
+        /* gather the chain into the buffer, truncating what does not fit */
+        vm_host_iovec_t host_iov = { .base = port->buf + buffered, .len = VUART_BUFLEN - buffered };
+        size_t len = 0;
+        vm_guest_readv(emul->vm, &host_iov, 1, guest_iov, guest_iovcnt, &len);
+        buffered += len;
         /* next */
-        idx++;
-        struct vring_used_elem used_elem = {desc_head, 0};
-        ring_used_add(emul, &virtq->vring[TX_QUEUE], used_elem);
-        con->driver.handleIRQ(con->driver.console_data);
+        idx += chain.num;
+        used_idx += ring_used_write(emul, queue, used_idx, &chain, 0);
+    }
+    /* ship it */
+    if (buffered) {
+        emul_con_tx_flush(port, buffered);
     }
     /* update which parts of the ring we have processed */
-    virtq->last_idx[TX_QUEUE] = idx;
+    virtq->last_idx[queue] = idx;
+    /* have the guest notify us of the next buffer it adds */
+    ring_avail_event_set(emul, queue, idx);
+    if (used_idx != old_used_idx) {
+        /* hand the buffers back, interrupting the guest once for all of them */
+        ring_used_publish(emul, queue, used_idx);
+        if (ring_need_interrupt(emul, queue, old_used_idx, used_idx)) {
+            con_port_irq(con, port_num);
+        }
+    }
+}
+
+static void con_control_queue(console_internal_t *con, uint32_t id, uint16_t event, uint16_t value)
+{
+    if (con->control_tail - con->control_head == CONSOLE_MAX_CONTROL) {
+        ZF_LOGE("Dropping control message %d of port %d: Too many outstanding messages", event, id);
+        return;
+    }
+    con->control[con->control_tail % CONSOLE_MAX_CONTROL] = (struct console_control) {
+        .id = id,
+        .event = event,
+        .value = value
+    };
+    con->control_tail++;
+}
+
+/* Hand queued control messages to the guest for as long as it has buffers for
+ * them. Returns whether the guest wants an interrupt for them */
+static bool con_control_flush(console_internal_t *con)
+{
+    virtio_emul_t *emul = con->emul;
+    unsigned int queue = VIRTIO_RX_QUEUE(CONSOLE_CONTROL_PAIR);
+    uint16_t idx = emul->virtq.last_idx[queue];
+    uint16_t old_used_idx = ring_used_idx(emul, queue);
+    uint16_t used_idx = old_used_idx;
+    while (con->control_head != con->control_tail) {
+        virtio_chain_t chain;
+        vm_guest_iovec_t guest_iov[VIRTIO_MAX_CHAIN_DESCS];
+        int guest_iovcnt = ring_avail_chain(emul, queue, idx, &chain, guest_iov, VIRTIO_MAX_CHAIN_DESCS);
+        if (!guest_iovcnt) {
+            break;
+        }
+        struct console_control *control = &con->control[con->control_head % CONSOLE_MAX_CONTROL];
+        /* names follow their message in the same buffer */
+        const char *name = con->ports[control->id].name;
+        vm_host_iovec_t host_iov[2] = {
+            { .base = control, .len = sizeof(*control) },
+            { .base = (void *)name, .len = control->event == CONSOLE_PORT_NAME ? strlen(name) : 0 }
+        };
+        size_t written = 0;
+        vm_guest_writev(emul->vm, host_iov, 2, guest_iov, guest_iovcnt, &written);
+        con->control_head++;
+        idx += chain.num;
+        used_idx += ring_used_write(emul, queue, used_idx, &chain, written);
+    }
+    emul->virtq.last_idx[queue] = idx;
+    if (used_idx == old_used_idx) {
+        return false;
+    }
+    ring_used_publish(emul, queue, used_idx);
+    return ring_need_interrupt(emul, queue, old_used_idx, used_idx);
+}
+
+static void con_control_handle(console_internal_t *con, struct console_control *control)
+{
+    switch (control->event) {
+    case CONSOLE_DEVICE_READY:
+        if (!control->value) {
+            ZF_LOGE("Guest failed to set up the console");
+            break;
+        }
+        /* the guest is (re)starting, tell it of every port again */
+        con->control_head = con->control_tail = 0;
+        for (unsigned int i = 0; i < con->num_ports; i++) {
+            con->ports[i].ready = false;
+            con_control_queue(con, i, CONSOLE_DEVICE_ADD, 0);
+        }
+        break;
+    case CONSOLE_PORT_READY:
+        if (control->id >= con->num_ports) {
+            ZF_LOGE("Ignoring ready of port %d not provided by the device", control->id);
+            break;
+        }
+        if (!control->value) {
+            ZF_LOGE("Guest failed to set up port %d", control->id);
+            break;
+        }
+        console_port_t *port = &con->ports[control->id];
+        port->ready = true;
+        if (port->console) {
+            con_control_queue(con, control->id, CONSOLE_CONSOLE_PORT, 1);
+        }
+        if (port->name) {
+            con_control_queue(con, control->id, CONSOLE_PORT_NAME, 0);
+        }
+        /* the backend is always connected */
+        con_control_queue(con, control->id, CONSOLE_PORT_OPEN, 1);
+        break;
+    case CONSOLE_PORT_OPEN:
+        /* output of ports the guest has closed is dropped by the guest */
+        break;
+    default:
+        ZF_LOGW("Ignoring control message %d from guest", control->event);
+        break;
+    }
+}
+
+static void emul_con_notify_control(console_internal_t *con)
+{
+    virtio_emul_t *emul = con->emul;
+    unsigned int queue = VIRTIO_TX_QUEUE(CONSOLE_CONTROL_PAIR);
+    uint16_t idx = emul->virtq.last_idx[queue];
+    uint16_t old_used_idx = ring_used_idx(emul, queue);
+    uint16_t used_idx = old_used_idx;
+    while (true) {
+        virtio_chain_t chain;
+        vm_guest_iovec_t guest_iov[VIRTIO_MAX_CHAIN_DESCS];
+        int guest_iovcnt = ring_avail_chain(emul, queue, idx, &chain, guest_iov, VIRTIO_MAX_CHAIN_DESCS);
+        if (!guest_iovcnt) {
+            break;
+        }
+        struct console_control control;
+        vm_host_iovec_t host_iov = { .base = &control, .len = sizeof(control) };
+        size_t len = 0;
+        vm_guest_readv(emul->vm, &host_iov, 1, guest_iov, guest_iovcnt, &len);
+        if (len == sizeof(control)) {
+            con_control_handle(con, &control);
+        }
+        idx += chain.num;
+        used_idx += ring_used_write(emul, queue, used_idx, &chain, 0);
+    }
+    emul->virtq.last_idx[queue] = idx;
+    ring_avail_event_set(emul, queue, idx);
+    bool irq = false;
+    if (used_idx != old_used_idx) {
+        ring_used_publish(emul, queue, used_idx);
+        irq = ring_need_interrupt(emul, queue, old_used_idx, used_idx);
+    }
+    /* answer the messages in the same interrupt */
+    irq |= con_control_flush(con);
+    if (irq) {
+        con_port_irq(con, 0);
+    }
+}
+
+static void emul_con_notify_queue(virtio_emul_t *emul, unsigned int queue)
+{
+    console_internal_t *con = emul->internal;
+    unsigned int pair = queue / 2;
+    if (con_multiport(con)) {
+        /* guests don't notify of control buffers they add after being told not
+         * to, so any notification is a chance to hand over queued messages */
+        if (con_control_flush(con)) {
+            con_port_irq(con, 0);
+        }
+        if (pair == CONSOLE_CONTROL_PAIR) {
+            if (queue == VIRTIO_TX_QUEUE(pair)) {
+                emul_con_notify_control(con);
+            }
+            return;
+        }
+    }
+    /* input is dropped if there was no space, so there is nothing to do for rx */
+    if (queue == VIRTIO_TX_QUEUE(pair)) {
+        emul_con_notify_tx(con, pair ? pair - 1 : 0);
+    }
+}
+
+static void emul_con_notify(virtio_emul_t *emul)
+{
+    emul_con_notify_queue(emul, TX_QUEUE);
+}
+
+static uint32_t con_host_features(console_internal_t *con)
+{
+    return CONSOLE_HOST_FEATURES | (con_multiport(con) ? BIT(VIRTIO_CONSOLE_F_MULTIPORT) : 0);
 }
 
-// NOTE: Both in/out are the same. Leaving stubs here incase additional features are needed.
 bool console_device_emul_io_in(struct virtio_emul *emul, unsigned int offset, unsigned int size, unsigned int *result)
 {
-    bool handled = false;
-    switch (offset) {
-    case VIRTIO_PCI_HOST_FEATURES:
-        handled = true;
+    console_internal_t *con = emul->internal;
+    unsigned int config_offset = VIRTIO_PCI_CONFIG_OFF(false);
+    if (offset == VIRTIO_PCI_HOST_FEATURES) {
         assert(size == 4);
-        break;
+        *result = con_host_features(con);
+        return true;
     }
-    return handled;
+    if (offset >= config_offset && offset + size <= config_offset + sizeof(con->config)) {
+        /* the configuration may be read in pieces of any size */
+        *result = 0;
+        memcpy(result, (uint8_t *)&con->config + offset - config_offset, size);
+        return true;
+    }
+    return false;
 }
 
 bool console_device_emul_io_out(struct virtio_emul *emul, unsigned int offset, unsigned int size, unsigned int value)
 {
+    console_internal_t *con = emul->internal;
     bool handled = false;
     switch (offset) {
     case VIRTIO_PCI_GUEST_FEATURES:
         handled = true;
         assert(size == 4);
+        assert(!(value & ~con_host_features(con)));
+        emul->virtq.features = value;
         break;
     }
     return handled;
 }
 
+int console_virtio_emul_add_ports(virtio_emul_t *emul, const struct console_port *ports, unsigned int num_ports)
+{
+    console_internal_t *con = emul->internal;
+    if (con->num_ports + num_ports > VIRTIO_CONSOLE_MAX_PORTS + 1) {
+        ZF_LOGE("Failed to add console ports: At most %d ports are supported", VIRTIO_CONSOLE_MAX_PORTS);
+        return -1;
+    }
+    for (unsigned int i = 0; i < num_ports; i++) {
+        if (!ports[i].backend.putchar && !ports[i].backend.write) {
+            ZF_LOGE("Failed to add console ports: Port %s has no backend", ports[i].name ? ports[i].name : "");
+            return -1;
+        }
+    }
+    for (unsigned int i = 0; i < num_ports; i++) {
+        console_port_t *port = &con->ports[con->num_ports++];
+        port->driver = ports[i].backend;
+        port->name = ports[i].name;
+        port->console = ports[i].console;
+    }
+    con->config.max_nr_ports = con->num_ports;
+    /* the queues of the new ports and of the control queues follow the queues of port 0 */
+    unsigned int num_queues = (CONSOLE_PORT_PAIR(con->num_ports - 1) + 1) * 2;
+    for (unsigned int i = emul->virtq.num_queues; i < num_queues; i++) {
+        emul->virtq.queue_size[i] = emul->virtq.queue_size[0];
+        vring_init(&emul->virtq.vring[i], emul->virtq.queue_size[i], 0, VIRTIO_PCI_VRING_ALIGN);
+    }
+    emul->virtq.num_queues = num_queues;
+    return 0;
+}
+
 void *console_virtio_emul_init(virtio_emul_t *emul, ps_io_ops_t io_ops, console_driver_init driver, void *config)
 {
     console_internal_t *internal = NULL;
@@ -161,14 +432,20 @@ void *console_virtio_emul_init(virtio_emul_t *emul, ps_io_ops_t io_ops, console_
     if (!internal) {
         goto error;
     }
-    err = driver(&internal->driver, io_ops, config);
+    err = driver(&internal->ports[0].driver, io_ops, config);
     emul->device_io_in = console_device_emul_io_in;
     emul->device_io_out = console_device_emul_io_out;
     if (err) {
         ZF_LOGE("Failed to initialize driver");
         goto error;
     }
-    emul->notify = emul_con_notify_tx;
+    internal->emul = emul;
+    internal->num_ports = 1;
+    internal->ports[0].console = true;
+    internal->config.max_nr_ports = 1;
+    emul->notify = emul_con_notify;
+    emul->notify_queue = emul_con_notify_queue;
+    emul->rx_tx_pairs = true;
     return (void *)internal;
 error:
     if (emul) {
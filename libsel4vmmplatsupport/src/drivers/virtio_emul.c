@@ -4,38 +4,370 @@
  * SPDX-License-Identifier: BSD-2-Clause
  */
 
+#include <sel4vm/boot.h>
+#include <sel4vm/guest_vm_event_trace.h>
 #include <sel4vmmplatsupport/drivers/virtio_pci_emul.h>
 
 #include "virtio_emul_helpers.h"
 
-uint16_t ring_avail_idx(virtio_emul_t *emul, struct vring *vring)
+/* Guest physical address of a ring field */
+#define RING_ADDR(field) ((uintptr_t)&(field))
+
+static inline bool ring_packed(virtio_emul_t *emul)
+{
+    return emul->virtq.features & (1ull << VIRTIO_F_RING_PACKED);
+}
+
+static inline bool ring_event_idx(virtio_emul_t *emul)
+{
+    return emul->virtq.features & BIT(VIRTIO_RING_F_EVENT_IDX);
+}
+
+/* Positions of a ring are free running, so with power of 2 queue sizes
+ * the wrap counter of a packed ring is the parity of the lap a position
+ * is on. The counters start out set */
+static inline bool ring_wrap(struct vring *vring, uint16_t idx)
+{
+    return !((idx / vring->num) & 1);
+}
+
+static struct vring_packed_desc *ring_packed_desc(struct vring *vring)
+{
+    return (struct vring_packed_desc *)vring->desc;
+}
+
+/* With packed rings the driver and device areas are the event suppression
+ * structures, which are written by the driver and the device respectively */
+static struct vring_packed_desc_event *ring_driver_event(struct vring *vring)
 {
-    uint16_t idx;
-    vm_guest_read_mem(emul->vm, &idx, (uintptr_t)&vring->avail->idx, sizeof(vring->avail->idx));
-    return idx;
+    return (struct vring_packed_desc_event *)vring->avail;
 }
 
-uint16_t ring_avail(virtio_emul_t *emul, struct vring *vring, uint16_t idx)
+static struct vring_packed_desc_event *ring_device_event(struct vring *vring)
 {
-    uint16_t elem;
-    vm_guest_read_mem(emul->vm, &elem, (uintptr_t) & (vring->avail->ring[idx % vring->num]), sizeof(elem));
-    return elem;
+    return (struct vring_packed_desc_event *)vring->used;
 }
 
-struct vring_desc ring_desc(virtio_emul_t *emul, struct vring *vring, uint16_t idx)
+/* Areas of a queue's rings, as mapped in 'ring_maps' */
+enum ring_area {
+    RING_DESC,
+    RING_DRIVER,
+    RING_DEVICE,
+};
+
+/* Ring fields are loaded and stored directly where their area of the rings is
+ * mapped into the VMM, otherwise they are copied through a guest memory touch.
+ * Either way the accesses are ordered against the guest by their callers */
+static void ring_read(virtio_emul_t *emul, unsigned int queue, enum ring_area area, void *buf, uintptr_t addr,
+                      size_t size)
 {
+    vm_ram_mapping_t *map = &emul->virtq.ring_maps[queue][area];
+    if (map->vaddr) {
+        /* the guest changes the rings under us, so always load them again */
+        COMPILER_MEMORY_FENCE();
+        memcpy(buf, map->vaddr + (addr - map->start), size);
+        return;
+    }
+    vm_guest_read_mem(emul->vm, buf, addr, size);
+}
+
+static void ring_write(virtio_emul_t *emul, unsigned int queue, enum ring_area area, void *buf, uintptr_t addr,
+                       size_t size)
+{
+    vm_ram_mapping_t *map = &emul->virtq.ring_maps[queue][area];
+    if (map->vaddr) {
+        memcpy(map->vaddr + (addr - map->start), buf, size);
+        COMPILER_MEMORY_FENCE();
+        return;
+    }
+    vm_guest_write_mem(emul->vm, buf, addr, size);
+}
+
+/* Size of an area of the rings of a queue with 'num' entries */
+static size_t ring_area_size(virtio_emul_t *emul, unsigned int num, enum ring_area area)
+{
+    if (ring_packed(emul)) {
+        return area == RING_DESC ? num * sizeof(struct vring_packed_desc) : sizeof(struct vring_packed_desc_event);
+    }
+    switch (area) {
+    case RING_DESC:
+        return num * sizeof(struct vring_desc);
+    case RING_DRIVER:
+        /* the avail ring is followed by the used event */
+        return sizeof(struct vring_avail) + num * sizeof(uint16_t) + sizeof(uint16_t);
+    default:
+        /* the used ring is followed by the avail event */
+        return sizeof(struct vring_used) + num * sizeof(struct vring_used_elem) + sizeof(uint16_t);
+    }
+}
+
+bool ring_avail_ready(virtio_emul_t *emul, unsigned int queue, uint16_t idx)
+{
+    struct vring *vring = &emul->virtq.vring[queue];
+    if (ring_packed(emul)) {
+        uint16_t flags;
+        ring_read(emul, queue, RING_DESC, &flags, RING_ADDR(ring_packed_desc(vring)[idx % vring->num].flags),
+                  sizeof(flags));
+        bool wrap = ring_wrap(vring, idx);
+        return !!(flags & BIT(VRING_PACKED_DESC_F_AVAIL)) == wrap && !!(flags & BIT(VRING_PACKED_DESC_F_USED)) != wrap;
+    }
+    uint16_t avail_idx;
+    ring_read(emul, queue, RING_DRIVER, &avail_idx, RING_ADDR(vring->avail->idx), sizeof(avail_idx));
+    return avail_idx != idx;
+}
+
+static int ring_split_chain(virtio_emul_t *emul, unsigned int queue, uint16_t idx, virtio_chain_t *chain,
+                            vm_guest_iovec_t *iov, int max_iov)
+{
+    struct vring *vring = &emul->virtq.vring[queue];
+    uint16_t desc_head;
+    ring_read(emul, queue, RING_DRIVER, &desc_head, RING_ADDR(vring->avail->ring[idx % vring->num]),
+              sizeof(desc_head));
     struct vring_desc desc;
-    vm_guest_read_mem(emul->vm, &desc, (uintptr_t) & (vring->desc[idx]), sizeof(desc));
-    return desc;
+    uint16_t desc_idx = desc_head;
+    int num_iov = 0;
+    do {
+        ring_read(emul, queue, RING_DESC, &desc, RING_ADDR(vring->desc[desc_idx % vring->num]), sizeof(desc));
+        iov[num_iov].addr = (uintptr_t)desc.addr;
+        iov[num_iov].len = desc.len;
+        num_iov++;
+        desc_idx = desc.next;
+    } while ((desc.flags & VRING_DESC_F_NEXT) && num_iov < max_iov);
+    chain->id = desc_head;
+    chain->num = 1;
+    return num_iov;
 }
 
-void ring_used_add(virtio_emul_t *emul, struct vring *vring, struct vring_used_elem elem)
+static int ring_packed_chain(virtio_emul_t *emul, unsigned int queue, uint16_t idx, virtio_chain_t *chain,
+                             vm_guest_iovec_t *iov, int max_iov)
 {
-    uint16_t guest_idx;
-    vm_guest_read_mem(emul->vm, &guest_idx, (uintptr_t)&vring->used->idx, sizeof(vring->used->idx));
-    vm_guest_write_mem(emul->vm, &elem, (uintptr_t)&vring->used->ring[guest_idx % vring->num], sizeof(elem));
-    guest_idx++;
-    vm_guest_write_mem(emul->vm, &guest_idx, (uintptr_t)&vring->used->idx, sizeof(vring->used->idx));
+    struct vring *vring = &emul->virtq.vring[queue];
+    struct vring_packed_desc desc;
+    int num_iov = 0;
+    uint16_t num = 0;
+    /* the descriptors of a chain are consecutive, with the buffer id in the last */
+    do {
+        ring_read(emul, queue, RING_DESC, &desc,
+                  RING_ADDR(ring_packed_desc(vring)[(uint16_t)(idx + num) % vring->num]), sizeof(desc));
+        num++;
+        if (num_iov < max_iov) {
+            iov[num_iov].addr = (uintptr_t)desc.addr;
+            iov[num_iov].len = desc.len;
+            num_iov++;
+        }
+    } while ((desc.flags & VRING_DESC_F_NEXT) && num < vring->num);
+    chain->id = desc.id;
+    chain->num = num;
+    return num_iov;
+}
+
+int ring_avail_chain(virtio_emul_t *emul, unsigned int queue, uint16_t idx, virtio_chain_t *chain,
+                     vm_guest_iovec_t *iov, int max_iov)
+{
+    if (!ring_avail_ready(emul, queue, idx)) {
+        return 0;
+    }
+    /* the chain is only read once the guest has made it available */
+    THREAD_MEMORY_ACQUIRE();
+    if (ring_packed(emul)) {
+        return ring_packed_chain(emul, queue, idx, chain, iov, max_iov);
+    }
+    return ring_split_chain(emul, queue, idx, chain, iov, max_iov);
+}
+
+uint16_t ring_used_idx(virtio_emul_t *emul, unsigned int queue)
+{
+    return emul->virtq.used_idx[queue];
+}
+
+uint16_t ring_used_write(virtio_emul_t *emul, unsigned int queue, uint16_t idx, const virtio_chain_t *chain,
+                         uint32_t len)
+{
+    struct vring *vring = &emul->virtq.vring[queue];
+    if (ring_packed(emul)) {
+        struct vring_packed_desc *desc = &ring_packed_desc(vring)[idx % vring->num];
+        struct {
+            uint32_t len;
+            uint16_t id;
+        } __attribute__((packed)) elem = { len, chain->id };
+        ring_write(emul, queue, RING_DESC, &elem, RING_ADDR(desc->len), sizeof(elem));
+        /* the flags hand the descriptor back, so go last */
+        uint16_t flags = len ? VRING_DESC_F_WRITE : 0;
+        if (ring_wrap(vring, idx)) {
+            flags |= BIT(VRING_PACKED_DESC_F_AVAIL) | BIT(VRING_PACKED_DESC_F_USED);
+        }
+        THREAD_MEMORY_RELEASE();
+        ring_write(emul, queue, RING_DESC, &flags, RING_ADDR(desc->flags), sizeof(flags));
+        /* the chain's descriptors are skipped over, to be reused by the guest */
+        return chain->num;
+    }
+    struct vring_used_elem elem = { chain->id, len };
+    ring_write(emul, queue, RING_DEVICE, &elem, RING_ADDR(vring->used->ring[idx % vring->num]), sizeof(elem));
+    return 1;
+}
+
+void ring_used_publish(virtio_emul_t *emul, unsigned int queue, uint16_t idx)
+{
+    struct vring *vring = &emul->virtq.vring[queue];
+    emul->virtq.used_idx[queue] = idx;
+    if (!ring_packed(emul)) {
+        THREAD_MEMORY_RELEASE();
+        ring_write(emul, queue, RING_DEVICE, &idx, RING_ADDR(vring->used->idx), sizeof(idx));
+    }
+    /* device events are not tied to a vcpu, they are traced on the boot vcpu */
+    vm_event_trace_record(emul->vm->vcpus[BOOT_VCPU], VM_EVENT_TRACE_DEVICE_COMPLETE, queue, idx, 0);
+}
+
+void ring_used_add(virtio_emul_t *emul, unsigned int queue, const virtio_chain_t *chain, uint32_t len)
+{
+    uint16_t used_idx = ring_used_idx(emul, queue);
+    used_idx += ring_used_write(emul, queue, used_idx, chain, len);
+    ring_used_publish(emul, queue, used_idx);
+}
+
+/* Whether the used ring passing the event of a packed ring's driver event
+ * suppression needs an interrupt, as for vring_need_event */
+static bool ring_packed_need_event(struct vring *vring, uint16_t off_wrap, uint16_t old_idx, uint16_t new_idx)
+{
+    uint16_t off = off_wrap & ~BIT(VRING_PACKED_EVENT_F_WRAP_CTR);
+    bool wrap = off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR;
+    /* position of the event on the lap of 'new_idx', or the one before it */
+    uint16_t event_idx = new_idx - new_idx % vring->num + off;
+    if (wrap != ring_wrap(vring, new_idx)) {
+        event_idx -= vring->num;
+    }
+    return vring_need_event(event_idx, new_idx, old_idx);
+}
+
+bool ring_need_interrupt(virtio_emul_t *emul, unsigned int queue, uint16_t old_idx, uint16_t new_idx)
+{
+    struct vring *vring = &emul->virtq.vring[queue];
+    /* the guest's suppression is read after the used entries it applies to are written */
+    THREAD_MEMORY_FENCE();
+    if (ring_packed(emul)) {
+        struct vring_packed_desc_event event;
+        ring_read(emul, queue, RING_DRIVER, &event, RING_ADDR(*ring_driver_event(vring)), sizeof(event));
+        if (event.flags == VRING_PACKED_EVENT_FLAG_DESC && ring_event_idx(emul)) {
+            return ring_packed_need_event(vring, event.off_wrap, old_idx, new_idx);
+        }
+        return event.flags != VRING_PACKED_EVENT_FLAG_DISABLE;
+    }
+    if (ring_event_idx(emul)) {
+        /* the guest asks to be interrupted once the used ring passes its event index */
+        uint16_t used_event;
+        ring_read(emul, queue, RING_DRIVER, &used_event, RING_ADDR(vring_used_event(vring)), sizeof(used_event));
+        return vring_need_event(used_event, new_idx, old_idx);
+    }
+    uint16_t flags;
+    ring_read(emul, queue, RING_DRIVER, &flags, RING_ADDR(vring->avail->flags), sizeof(vring->avail->flags));
+    return !(flags & VRING_AVAIL_F_NO_INTERRUPT);
+}
+
+void ring_avail_event_set(virtio_emul_t *emul, unsigned int queue, uint16_t idx)
+{
+    struct vring *vring = &emul->virtq.vring[queue];
+    if (!ring_event_idx(emul)) {
+        return;
+    }
+    if (ring_packed(emul)) {
+        struct vring_packed_desc_event event = {
+            .off_wrap = (idx % vring->num) | (ring_wrap(vring, idx) << VRING_PACKED_EVENT_F_WRAP_CTR),
+            .flags = VRING_PACKED_EVENT_FLAG_DESC
+        };
+        ring_write(emul, queue, RING_DEVICE, &event, RING_ADDR(*ring_device_event(vring)), sizeof(event));
+        return;
+    }
+    ring_write(emul, queue, RING_DEVICE, &idx, RING_ADDR(vring_avail_event(vring)), sizeof(idx));
+}
+
+void ring_avail_notify_disable(virtio_emul_t *emul, unsigned int queue, uint16_t last_idx)
+{
+    struct vring *vring = &emul->virtq.vring[queue];
+    if (ring_packed(emul)) {
+        /* packed rings have a flag for this that holds without event index */
+        uint16_t flags = VRING_PACKED_EVENT_FLAG_DISABLE;
+        ring_write(emul, queue, RING_DEVICE, &flags, RING_ADDR(ring_device_event(vring)->flags), sizeof(flags));
+        return;
+    }
+    if (ring_event_idx(emul)) {
+        /* an event index behind every index the guest can reach before we
+         * consume more of the ring is never passed */
+        ring_avail_event_set(emul, queue, last_idx - 1);
+        return;
+    }
+    uint16_t flags = VRING_USED_F_NO_NOTIFY;
+    ring_write(emul, queue, RING_DEVICE, &flags, RING_ADDR(vring->used->flags), sizeof(vring->used->flags));
+}
+
+/* Publish the device state set up by the guest to the vhost backend */
+static void vhost_publish(virtio_emul_t *emul)
+{
+    struct virtio_vhost_shared *shared = emul->vhost;
+    virtio_vhost_update_begin(shared);
+    shared->status = emul->virtq.status;
+    shared->features = emul->virtq.features;
+    shared->num_queues = emul->virtq.num_queues;
+    for (int i = 0; i < emul->virtq.num_queues; i++) {
+        struct vring *vring = &emul->virtq.vring[i];
+        shared->queues[i] = (struct virtio_vhost_queue) {
+            .desc = (uintptr_t)vring->desc,
+            .driver = (uintptr_t)vring->avail,
+            .device = (uintptr_t)vring->used,
+            .num = vring->num,
+            .ready = vring->desc != NULL,
+        };
+    }
+    virtio_vhost_update_end(shared);
+}
+
+int virtio_emul_enable_vhost(virtio_emul_t *emul, struct virtio_vhost_shared *shared, const seL4_CPtr *kicks,
+                             unsigned int num_kicks)
+{
+    if (!shared || num_kicks == 0 || num_kicks > emul->virtq.num_queues || kicks[0] == seL4_CapNull) {
+        ZF_LOGE("Failed to enable vhost: Invalid shared page or kick notifications");
+        return -1;
+    }
+    if (emul->virtq.status) {
+        ZF_LOGE("Failed to enable vhost: Device already in use by the guest");
+        return -1;
+    }
+    for (int i = 0; i < emul->virtq.num_queues; i++) {
+        emul->vhost_kicks[i] = i < num_kicks && kicks[i] != seL4_CapNull ? kicks[i] : kicks[0];
+    }
+    emul->vhost = shared;
+    shared->magic = VIRTIO_VHOST_MAGIC;
+    vhost_publish(emul);
+    return 0;
+}
+
+void virtio_emul_queue_setup(virtio_emul_t *emul, unsigned int queue, uintptr_t desc, uintptr_t driver,
+                             uintptr_t device)
+{
+    struct vring *vring = &emul->virtq.vring[queue];
+    vring->num = emul->virtq.queue_size[queue];
+    vring->desc = (struct vring_desc *)desc;
+    vring->avail = (struct vring_avail *)driver;
+    vring->used = (struct vring_used *)device;
+    emul->virtq.last_idx[queue] = 0;
+    emul->virtq.used_idx[queue] = 0;
+    if (emul->vhost) {
+        /* the rings are the backend's to access */
+        vhost_publish(emul);
+        return;
+    }
+    /* map the rings for the queue's lifetime, rather than for every access */
+    uintptr_t area_addrs[VIRTIO_RING_AREAS] = { desc, driver, device };
+    for (int area = 0; area < VIRTIO_RING_AREAS; area++) {
+        vm_ram_unmap(emul->vm, &emul->virtq.ring_maps[queue][area]);
+        if (area_addrs[area] && vm_ram_map(emul->vm, area_addrs[area], ring_area_size(emul, vring->num, area),
+                                           &emul->virtq.ring_maps[queue][area])) {
+            ZF_LOGW("Unable to map area %d of the rings of queue %u, accessing it through touches", area, queue);
+        }
+    }
+    if (emul->rx_tx_pairs && queue % 2 == RX_QUEUE && queue != emul->virtq.num_queues - 1 && desc) {
+        /* kicks of the rx queue are ignored, see VIRTIO_PCI_QUEUE_NOTIFY */
+        ring_avail_notify_disable(emul, queue, 0);
+    }
 }
 
 static int emul_io_in(virtio_emul_t *emul, unsigned int offset, unsigned int size, unsigned int *result)
@@ -50,7 +382,8 @@ static int emul_io_in(virtio_emul_t *emul, unsigned int offset, unsigned int siz
         break;
     case VIRTIO_PCI_QUEUE_NUM:
         assert(size == 2);
-        *result = emul->virtq.queue_size[emul->virtq.queue];
+        /* queues the device doesn't provide have a size of 0 */
+        *result = emul->virtq.queue < emul->virtq.num_queues ? emul->virtq.queue_size[emul->virtq.queue] : 0;
         break;
     case VIRTIO_PCI_QUEUE_PFN:
         assert(size == 4);
@@ -76,22 +409,41 @@ static int emul_io_out(virtio_emul_t *emul, unsigned int offset, unsigned int si
     case VIRTIO_PCI_STATUS:
         assert(size == 1);
         emul->virtq.status = value & 0xff;
+        if (emul->vhost) {
+            vhost_publish(emul);
+        }
         break;
     case VIRTIO_PCI_QUEUE_SEL:
         assert(size == 2);
         emul->virtq.queue = (value & 0xffff);
-        assert(emul->virtq.queue == 0 || emul->virtq.queue == 1);
+        assert(emul->virtq.queue < VIRTIO_MAX_QUEUES);
         break;
     case VIRTIO_PCI_QUEUE_PFN: {
         assert(size == 4);
         int queue = emul->virtq.queue;
+        if (queue >= emul->virtq.num_queues) {
+            ZF_LOGE("Ignoring setup of queue %d not provided by the device", queue);
+            break;
+        }
         emul->virtq.queue_pfn[queue] = value;
-        vring_init(&emul->virtq.vring[queue], emul->virtq.queue_size[queue], (void *)(uintptr_t)(value << 12),
+        /* legacy rings are laid out contiguously from the page given */
+        struct vring vring;
+        vring_init(&vring, emul->virtq.queue_size[queue], (void *)((uintptr_t)value << VIRTIO_PCI_QUEUE_ADDR_SHIFT),
                    VIRTIO_PCI_VRING_ALIGN);
+        virtio_emul_queue_setup(emul, queue, (uintptr_t)vring.desc, (uintptr_t)vring.avail, (uintptr_t)vring.used);
         break;
     }
     case VIRTIO_PCI_QUEUE_NOTIFY:
-        if (value == RX_QUEUE) {
+        if (value >= emul->virtq.num_queues) {
+            break;
+        }
+        vm_event_trace_record(emul->vm->vcpus[BOOT_VCPU], VM_EVENT_TRACE_DEVICE_KICK, value,
+                              emul->virtq.last_idx[value], 0);
+        if (emul->vhost) {
+            seL4_Signal(emul->vhost_kicks[value]);
+        } else if (emul->notify_queue) {
+            emul->notify_queue(emul, value);
+        } else if (value == RX_QUEUE) {
             /* Currently RX packets will just get dropped if there was no space
              * so we will never have work to do if the client suddenly adds
              * more buffers */
@@ -106,8 +458,8 @@ static int emul_io_out(virtio_emul_t *emul, unsigned int offset, unsigned int si
     return 0;
 }
 
-virtio_emul_t *virtio_emul_init(ps_io_ops_t io_ops, int queue_size, vm_t *vm, void *driver,
-                                void *config, virtio_pci_devices_t device)
+virtio_emul_t *virtio_emul_init(ps_io_ops_t io_ops, int queue_size, unsigned int num_queue_pairs, vm_t *vm,
+                                void *driver, void *config, virtio_pci_devices_t device)
 {
     virtio_emul_t *emul = NULL;
     emul = calloc(1, sizeof(*emul));
@@ -115,24 +467,42 @@ virtio_emul_t *virtio_emul_init(ps_io_ops_t io_ops, int queue_size, vm_t *vm, vo
         free(emul);
         return NULL;
     }
+    /* a single queue pair unless the device sets up more */
+    emul->virtq.num_queues = 2;
     /* module specific initialisation function */
     switch (device) {
     case VIRTIO_CONSOLE:
         emul->internal = console_virtio_emul_init(emul, io_ops, (console_driver_init)driver, config);
         break;
     case VIRTIO_NET:
-        emul->internal = net_virtio_emul_init(emul, io_ops, (ethif_driver_init)driver, config);
+        emul->internal = net_virtio_emul_init(emul, io_ops, queue_size, num_queue_pairs, (ethif_driver_init)driver,
+                                              config);
+        break;
+    case VIRTIO_BLK:
+        emul->internal = blk_virtio_emul_init(emul, io_ops, (blk_driver_init)driver, config);
+        break;
+    case VIRTIO_BALLOON:
+        emul->internal = balloon_virtio_emul_init(emul, io_ops, (balloon_driver_init)driver, config);
+        break;
+    case VIRTIO_VSOCK:
+        emul->internal = vsock_virtio_emul_init(emul, io_ops, (vsock_driver_init)driver, config);
+        break;
+    case VIRTIO_FS:
+        emul->internal = fs_virtio_emul_init(emul, io_ops, (fs_driver_init)driver, config);
+        break;
+    case VIRTIO_MEM:
+        emul->internal = mem_virtio_emul_init(emul, io_ops, (mem_driver_init)driver, config);
         break;
     }
     if (emul->internal == NULL) {
         return NULL;
     }
     emul->vm = vm;
-    emul->virtq.queue_size[RX_QUEUE] = queue_size;
-    emul->virtq.queue_size[TX_QUEUE] = queue_size;
-    /* create dummy rings. we never actually dereference the rings so they can be null */
-    vring_init(&emul->virtq.vring[RX_QUEUE], emul->virtq.queue_size[RX_QUEUE], 0, VIRTIO_PCI_VRING_ALIGN);
-    vring_init(&emul->virtq.vring[TX_QUEUE], emul->virtq.queue_size[RX_QUEUE], 0, VIRTIO_PCI_VRING_ALIGN);
+    for (int i = 0; i < emul->virtq.num_queues; i++) {
+        emul->virtq.queue_size[i] = queue_size;
+        /* create dummy rings. we never actually dereference the rings so they can be null */
+        vring_init(&emul->virtq.vring[i], emul->virtq.queue_size[i], 0, VIRTIO_PCI_VRING_ALIGN);
+    }
     emul->io_in = emul_io_in;
     emul->io_out = emul_io_out;
 
@@ -12,14 +12,14 @@
 static int read_guest_mem(vm_t *vm, uintptr_t phys, void *vaddr, size_t size, size_t offset, void *cookie)
 {
     /* Copy memory from the guest (vaddr) to our given memory destination (cookie) */
-    memcpy(cookie + offset, vaddr, size);
+    vm_ram_copy(cookie + offset, vaddr, size, VM_RAM_COPY_CACHED);
     return 0;
 }
 
 static int write_guest_mem(vm_t *vm, uintptr_t phys, void *vaddr, size_t size, size_t offset, void *cookie)
 {
     /* Copy memory to our guest (vaddr) from our given memory location (cookie) */
-    memcpy(vaddr, cookie + offset, size);
+    vm_ram_copy(vaddr, cookie + offset, size, VM_RAM_COPY_CACHED);
     return 0;
 }
 
@@ -32,3 +32,15 @@ int vm_guest_read_mem(vm_t *vm, void *data, uintptr_t address, size_t size)
 {
     return vm_ram_touch(vm, address, size, read_guest_mem, data);
 }
+
+int vm_guest_writev(vm_t *vm, const vm_host_iovec_t *host_iov, int host_iovcnt, const vm_guest_iovec_t *guest_iov,
+                    int guest_iovcnt, size_t *copied)
+{
+    return vm_ram_writev(vm, guest_iov, guest_iovcnt, host_iov, host_iovcnt, copied);
+}
+
+int vm_guest_readv(vm_t *vm, const vm_host_iovec_t *host_iov, int host_iovcnt, const vm_guest_iovec_t *guest_iov,
+                   int guest_iovcnt, size_t *copied)
+{
+    return vm_ram_readv(vm, guest_iov, guest_iovcnt, host_iov, host_iovcnt, copied);
+}
@@ -7,7 +7,14 @@
 #pragma once
 
 #include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_ram.h>
 
 int vm_guest_write_mem(vm_t *vm, void *data, uintptr_t address, size_t size);
 
 int vm_guest_read_mem(vm_t *vm, void *data, uintptr_t address, size_t size);
+
+int vm_guest_writev(vm_t *vm, const vm_host_iovec_t *host_iov, int host_iovcnt, const vm_guest_iovec_t *guest_iov,
+                    int guest_iovcnt, size_t *copied);
+
+int vm_guest_readv(vm_t *vm, const vm_host_iovec_t *host_iov, int host_iovcnt, const vm_guest_iovec_t *guest_iov,
+                   int guest_iovcnt, size_t *copied);
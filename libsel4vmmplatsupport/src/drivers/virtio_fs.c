@@ -0,0 +1,139 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <platsupport/io.h>
+
+#include <sel4vmmplatsupport/drivers/virtio.h>
+#include <sel4vmmplatsupport/drivers/virtio_fs.h>
+
+#include <pci/helper.h>
+#include <sel4vmmplatsupport/drivers/pci_helper.h>
+
+#include "virtio_pci_modern.h"
+
+#define QUEUE_SIZE 128
+
+/* Bar of the DAX window, following the bar of the registers */
+#define VIRTIO_FS_DAX_BAR 1
+/* Id of the DAX window amongst the shared memory regions of the device */
+#define VIRTIO_FS_SHMCAP_ID_CACHE 0
+
+static ps_io_ops_t ops;
+
+static int emul_fs_driver_init(struct fs_passthrough *driver, ps_io_ops_t io_ops, void *config)
+{
+    virtio_fs_t *fs = (virtio_fs_t *)config;
+    *driver = fs->emul_driver_funcs;
+    return 0;
+}
+
+static vmm_pci_entry_t vmm_virtio_fs_pci_bar(uintptr_t bar_addr, uintptr_t dax_addr, size_t dax_size_bits,
+                                             unsigned int interrupt_pin, unsigned int interrupt_line,
+                                             bool emulate_bar_access)
+{
+    vmm_pci_device_def_t *pci_config;
+    int err = ps_calloc(&ops.malloc_ops, 1, sizeof(*pci_config), (void **)&pci_config);
+    ZF_LOGF_IF(err, "Failed to allocate pci config");
+    *pci_config = (vmm_pci_device_def_t) {
+        .vendor_id = VIRTIO_PCI_VENDOR_ID,
+        .device_id = VIRTIO_PCI_MODERN_DEVICE_ID(VIRTIO_ID_FS),
+        .revision_id = 1,
+        .command = PCI_COMMAND_MEMORY,
+        .header_type = PCI_HEADER_TYPE_NORMAL,
+        .subsystem_vendor_id    = VIRTIO_PCI_SUBSYSTEM_VENDOR_ID,
+        .subsystem_id       = VIRTIO_ID_FS,
+        .interrupt_pin = interrupt_pin,
+        .interrupt_line = interrupt_line,
+        .bar0 = bar_addr | PCI_BASE_ADDRESS_SPACE_MEMORY,
+        .bar1 = dax_size_bits ? dax_addr | PCI_BASE_ADDRESS_SPACE_MEMORY : 0,
+        .cache_line_size = 64,
+        .latency_timer = 64,
+        .prog_if = VIRTIO_PCI_CLASS_FS & 0xff,
+        .subclass = (VIRTIO_PCI_CLASS_FS >> 8) & 0xff,
+        .class_code = (VIRTIO_PCI_CLASS_FS >> 16) & 0xff,
+    };
+    err = virtio_pci_modern_add_caps(pci_config, 0);
+    ZF_LOGF_IF(err, "Failed to add virtio capabilities");
+    if (dax_size_bits) {
+        err = virtio_pci_modern_add_shm_cap(pci_config, VIRTIO_FS_DAX_BAR, VIRTIO_FS_SHMCAP_ID_CACHE, 0,
+                                            BIT(dax_size_bits));
+        ZF_LOGF_IF(err, "Failed to add virtio DAX window capability");
+    }
+    vmm_pci_entry_t entry = (vmm_pci_entry_t) {
+        .cookie = pci_config,
+        .ioread = vmm_pci_mem_device_read,
+        .iowrite = vmm_pci_mem_device_write
+    };
+
+    vmm_pci_bar_t bars[2] = {
+        {
+            .mem_type = NON_PREFETCH_MEM,
+            .address = bar_addr,
+            .size_bits = VIRTIO_PCI_MODERN_BAR_SIZE_BITS
+        },
+        {
+            .mem_type = PREFETCH_MEM,
+            .address = dax_addr,
+            .size_bits = dax_size_bits
+        }
+    };
+    int num_bars = dax_size_bits ? 2 : 1;
+    if (emulate_bar_access) {
+        return vmm_pci_create_bar_emulation(entry, num_bars, bars);
+    }
+    return vmm_pci_create_passthrough_bar_emulation(entry, num_bars, bars);
+}
+
+virtio_fs_t *common_make_virtio_fs(vm_t *vm, vmm_pci_space_t *pci, uintptr_t bar_addr, uintptr_t dax_addr,
+                                   size_t dax_size_bits, unsigned int interrupt_pin, unsigned int interrupt_line,
+                                   struct fs_passthrough backend, bool emulate_bar_access)
+{
+    if (dax_size_bits && (dax_size_bits < seL4_PageBits || dax_size_bits >= 32 ||
+                          !IS_ALIGNED(dax_addr, dax_size_bits))) {
+        ZF_LOGE("Failed to make virtio fs: DAX window of size bits %zu at 0x%"PRIxPTR" not a valid bar", dax_size_bits,
+                dax_addr);
+        return NULL;
+    }
+
+    int err = ps_new_stdlib_malloc_ops(&ops.malloc_ops);
+    ZF_LOGF_IF(err, "Failed to get malloc ops");
+
+    virtio_fs_t *fs;
+    err = ps_calloc(&ops.malloc_ops, 1, sizeof(*fs), (void **)&fs);
+    ZF_LOGF_IF(err, "Failed to allocate virtio fs");
+
+    /* guest memory is only accessed by copying, the device needs no DMA */
+    ps_io_ops_t ioops = { 0 };
+    fs->emul_driver_funcs = backend;
+    fs->emul = virtio_emul_init(ioops, QUEUE_SIZE, 1, vm, emul_fs_driver_init, fs, VIRTIO_FS);
+    if (!fs->emul) {
+        ZF_LOGE("Failed to make virtio fs: Unable to create the emulated device");
+        ps_free(&ops.malloc_ops, sizeof(*fs), fs);
+        return NULL;
+    }
+    if (dax_size_bits && fs_virtio_emul_install_dax(fs->emul, dax_addr, BIT(dax_size_bits))) {
+        ZF_LOGE("Failed to make virtio fs: Unable to install DAX window");
+        return NULL;
+    }
+    err = virtio_pci_modern_install(vm, fs->emul, bar_addr);
+    if (err) {
+        ZF_LOGE("Failed to make virtio fs: Unable to install pci registers");
+        return NULL;
+    }
+    vmm_pci_entry_t entry = vmm_virtio_fs_pci_bar(bar_addr, dax_addr, dax_size_bits, interrupt_pin, interrupt_line,
+                                                  emulate_bar_access);
+    vmm_pci_add_entry(pci, entry, NULL);
+    return fs;
+}
+
+void virtio_fs_poll(virtio_fs_t *fs)
+{
+    fs->emul->notify(fs->emul);
+}
@@ -0,0 +1,673 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+
+#include <vka/capops.h>
+
+#include <sel4vm/guest_memory.h>
+#include <sel4vm/guest_vcpu_fault.h>
+
+#include <sel4vmmplatsupport/drivers/virtio_pci_emul.h>
+#include <sel4vmmplatsupport/drivers/cross_vm_ring.h>
+
+#include "virtio_emul_helpers.h"
+
+/* Requests that can't wait behind others, such as FUSE_FORGET, and all others */
+#define FS_HIPRIO_QUEUE 0
+#define FS_REQUEST_QUEUE 1
+#define FS_NUM_QUEUES 2
+
+#define FS_HOST_FEATURES BIT(VIRTIO_RING_F_EVENT_IDX)
+
+/* Requests handed to the server that haven't been replied to. A request id is
+ * made up of the index of its entry and the entry's generation, so that late
+ * replies to requests of a reset device match no later request */
+#define FS_MAX_REQUESTS 64
+#define FS_REQUEST_ID(index, gen) (((uint32_t)(gen) << 8) | (index))
+#define FS_REQUEST_INDEX(id) ((id) & MASK(8))
+#define FS_REQUEST_GEN(id) ((id) >> 8)
+
+/* FUSE protocol, as defined by linux/fuse.h */
+#define FUSE_SETUPMAPPING 48
+#define FUSE_REMOVEMAPPING 49
+
+#define FUSE_SETUPMAPPING_FLAG_WRITE BIT(0)
+
+struct fuse_in_header {
+    uint32_t len;
+    uint32_t opcode;
+    uint64_t unique;
+    uint64_t nodeid;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t pid;
+    uint32_t padding;
+} PACKED;
+
+struct fuse_out_header {
+    uint32_t len;
+    int32_t error;
+    uint64_t unique;
+} PACKED;
+
+struct fuse_setupmapping_in {
+    uint64_t fh;
+    uint64_t foffset;
+    uint64_t len;
+    uint64_t flags;
+    uint64_t moffset;
+} PACKED;
+
+struct fuse_removemapping_in {
+    uint32_t count;
+} PACKED;
+
+struct fuse_removemapping_one {
+    uint64_t moffset;
+    uint64_t len;
+} PACKED;
+
+/* Device configuration space, following the common virtio registers */
+struct virtio_fs_config {
+    char tag[VIRTIO_FS_TAG_LEN];
+    uint32_t num_request_queues;
+} PACKED;
+
+typedef struct fs_request {
+    bool in_use;
+    uint16_t gen;
+    /* queue and chain the request was taken from */
+    unsigned int queue;
+    virtio_chain_t chain;
+    uint64_t unique;
+    uint32_t opcode;
+    /* range to map once the server replies, of FUSE_SETUPMAPPING */
+    struct fuse_setupmapping_in setup;
+    /* buffers of the chain following the request, for the reply */
+    int iovcnt;
+    vm_guest_iovec_t iov[VIRTIO_MAX_CHAIN_DESCS];
+} fs_request_t;
+
+typedef struct fs_virtio_emul_internal {
+    struct fs_passthrough driver;
+    virtio_emul_t *emul;
+    struct virtio_fs_config config;
+    crossvm_ring_t to_server;
+    crossvm_ring_t from_server;
+    /* the server has to be notified once the current batch is committed */
+    bool notify;
+    /* slots the request at the head of a queue is waiting for the server to free */
+    uint32_t wait_slots;
+    fs_request_t requests[FS_MAX_REQUESTS];
+    /* the guest's DAX window and the copies of the cache frames mapped into
+     * each of its pages, seL4_CapNull where nothing is mapped */
+    vm_memory_reservation_t *dax;
+    uintptr_t dax_addr;
+    size_t dax_size;
+    seL4_CPtr *dax_caps;
+} fs_internal_t;
+
+/* Result of handling a request of the guest */
+typedef enum fs_request_result {
+    /* the request was handed over to the server or answered */
+    FS_REQUEST_DONE,
+    /* the request must wait for the server to free slots of its ring or to reply to requests */
+    FS_REQUEST_STALL_RING,
+    FS_REQUEST_STALL_REPLIES,
+} fs_request_result_t;
+
+static size_t fs_chain_len(const vm_guest_iovec_t *iov, int iovcnt)
+{
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        len += iov[i].len;
+    }
+    return len;
+}
+
+/* Buffers of a descriptor chain from 'offset' bytes on */
+static int fs_chain_skip(const vm_guest_iovec_t *iov, int iovcnt, size_t offset, vm_guest_iovec_t *skipped)
+{
+    int num = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (offset >= iov[i].len) {
+            offset -= iov[i].len;
+            continue;
+        }
+        skipped[num++] = (vm_guest_iovec_t) {
+            .addr = iov[i].addr + offset,
+            .len = iov[i].len - offset
+        };
+        offset = 0;
+    }
+    return num;
+}
+
+/* Read 'len' bytes from 'offset' bytes into a descriptor chain */
+static size_t fs_chain_read(vm_t *vm, const vm_guest_iovec_t *iov, int iovcnt, size_t offset, void *buf,
+                            size_t len)
+{
+    vm_guest_iovec_t skipped[VIRTIO_MAX_CHAIN_DESCS];
+    int num = fs_chain_skip(iov, iovcnt, offset, skipped);
+    vm_host_iovec_t host_iov = { .base = buf, .len = len };
+    size_t copied = 0;
+    vm_guest_readv(vm, &host_iov, 1, skipped, num, &copied);
+    return copied;
+}
+
+/* Slots taken up by a message with 'len' bytes of FUSE message */
+static uint64_t fs_msg_slots(crossvm_ring_t *ring, uint64_t len)
+{
+    return DIV_ROUND_UP(sizeof(struct virtio_fs_msg) + len, ring->slot_size);
+}
+
+/* Describe the 'len' bytes of FUSE message of the message at position 'idx', which
+ * may carry on from the end of the ring to its start */
+static void fs_msg_data(crossvm_ring_t *ring, uint32_t idx, size_t len, vm_host_iovec_t iov[2])
+{
+    uint8_t *msg = crossvm_ring_slot(ring, idx);
+    size_t to_end = (size_t)(ring->num_slots - (idx & (ring->num_slots - 1))) * ring->slot_size -
+                    sizeof(struct virtio_fs_msg);
+    iov[0] = (vm_host_iovec_t) {
+        .base = msg + sizeof(struct virtio_fs_msg),
+        .len = MIN(len, to_end)
+    };
+    iov[1] = (vm_host_iovec_t) {
+        .base = ring->slots,
+        .len = len - iov[0].len
+    };
+}
+
+/* Answer a request without involving the server. Returns the bytes written for the guest */
+static uint32_t fs_reply_error(fs_internal_t *fs, const vm_guest_iovec_t *iov, int iovcnt, uint64_t unique,
+                               int error)
+{
+    struct fuse_out_header out = {
+        .len = sizeof(out),
+        .error = -error,
+        .unique = unique,
+    };
+    vm_host_iovec_t host_iov = { .base = &out, .len = sizeof(out) };
+    size_t written = 0;
+    vm_guest_writev(fs->emul->vm, &host_iov, 1, iov, iovcnt, &written);
+    return written;
+}
+
+static void fs_dax_unmap_page(fs_internal_t *fs, size_t page)
+{
+    seL4_CPtr cap = fs->dax_caps[page];
+    if (cap == seL4_CapNull) {
+        return;
+    }
+    vka_t *vka = fs->emul->vm->vka;
+    if (vm_reservation_unmap_frame(fs->emul->vm, fs->dax, fs->dax_addr + page * PAGE_SIZE_4K)) {
+        ZF_LOGE("Failed to unmap DAX window page %zu, leaking its cap", page);
+        return;
+    }
+    cspacepath_t path;
+    vka_cspace_make_path(vka, cap, &path);
+    vka_cnode_delete(&path);
+    vka_cspace_free_path(vka, path);
+    fs->dax_caps[page] = seL4_CapNull;
+}
+
+static void fs_dax_unmap(fs_internal_t *fs, uint64_t moffset, uint64_t len)
+{
+    if (!fs->dax || moffset >= fs->dax_size) {
+        return;
+    }
+    len = MIN(len, fs->dax_size - moffset);
+    for (size_t page = moffset / PAGE_SIZE_4K; page < DIV_ROUND_UP(moffset + len, PAGE_SIZE_4K); page++) {
+        fs_dax_unmap_page(fs, page);
+    }
+}
+
+/* Whether a range of the window can be set up, checked before bothering the server */
+static bool fs_dax_range_valid(fs_internal_t *fs, const struct fuse_setupmapping_in *setup)
+{
+    return fs->dax && setup->len && IS_ALIGNED(setup->moffset, seL4_PageBits) &&
+           IS_ALIGNED(setup->len, seL4_PageBits) && setup->moffset < fs->dax_size &&
+           setup->len <= fs->dax_size - setup->moffset;
+}
+
+/* Map the frames of the cache the server set a file range up in into the window */
+static int fs_dax_map(fs_internal_t *fs, const struct fuse_setupmapping_in *setup, uint32_t cache_page)
+{
+    size_t num_pages = setup->len / PAGE_SIZE_4K;
+    if (cache_page > fs->driver.num_cache_frames || num_pages > fs->driver.num_cache_frames - cache_page) {
+        ZF_LOGE("Failed to set up DAX mapping: Cache pages %u-%zu out of range", cache_page,
+                cache_page + num_pages);
+        return -1;
+    }
+    vm_t *vm = fs->emul->vm;
+    vka_t *vka = vm->vka;
+    seL4_CapRights_t rights = setup->flags & FUSE_SETUPMAPPING_FLAG_WRITE ? seL4_AllRights : seL4_CanRead;
+    size_t first = setup->moffset / PAGE_SIZE_4K;
+    for (size_t i = 0; i < num_pages; i++) {
+        /* a mapping replaces whatever the range was mapped to */
+        fs_dax_unmap_page(fs, first + i);
+        /* a cache page can be mapped at several places of the window, each with a copy of its cap */
+        cspacepath_t src, dest;
+        vka_cspace_make_path(vka, fs->driver.cache_frames[cache_page + i], &src);
+        if (vka_cspace_alloc_path(vka, &dest)) {
+            ZF_LOGE("Failed to set up DAX mapping: Unable to allocate cspace path");
+            goto error;
+        }
+        if (vka_cnode_copy(&dest, &src, seL4_AllRights)) {
+            ZF_LOGE("Failed to set up DAX mapping: Unable to copy cache frame cap");
+            vka_cspace_free_path(vka, dest);
+            goto error;
+        }
+        vm_frame_t frame = { dest.capPtr, rights, fs->dax_addr + (first + i) * PAGE_SIZE_4K, seL4_PageBits, 0 };
+        if (vm_reservation_map_frame(vm, fs->dax, frame)) {
+            ZF_LOGE("Failed to set up DAX mapping: Unable to map cache frame");
+            vka_cnode_delete(&dest);
+            vka_cspace_free_path(vka, dest);
+            goto error;
+        }
+        fs->dax_caps[first + i] = dest.capPtr;
+    }
+    return 0;
+error:
+    /* the guest is told the range is not set up, so it is left unmapped */
+    fs_dax_unmap(fs, setup->moffset, setup->len);
+    return -1;
+}
+
+/* Unmap the ranges of the window a FUSE_REMOVEMAPPING request lists */
+static void fs_dax_remove(fs_internal_t *fs, const vm_guest_iovec_t *iov, int iovcnt, uint32_t in_len)
+{
+    struct fuse_removemapping_in remove;
+    size_t offset = sizeof(struct fuse_in_header);
+    if (in_len < offset + sizeof(remove) ||
+        fs_chain_read(fs->emul->vm, iov, iovcnt, offset, &remove, sizeof(remove)) != sizeof(remove)) {
+        return;
+    }
+    offset += sizeof(remove);
+    uint32_t count = MIN(remove.count, (in_len - offset) / sizeof(struct fuse_removemapping_one));
+    for (uint32_t i = 0; i < count; i++) {
+        struct fuse_removemapping_one one;
+        if (fs_chain_read(fs->emul->vm, iov, iovcnt, offset + i * sizeof(one), &one, sizeof(one)) != sizeof(one)) {
+            return;
+        }
+        fs_dax_unmap(fs, one.moffset, one.len);
+    }
+}
+
+static fs_request_t *fs_request_alloc(fs_internal_t *fs)
+{
+    for (int i = 0; i < FS_MAX_REQUESTS; i++) {
+        if (!fs->requests[i].in_use) {
+            fs->requests[i].in_use = true;
+            fs->requests[i].gen++;
+            return &fs->requests[i];
+        }
+    }
+    return NULL;
+}
+
+static fs_request_t *fs_request_find(fs_internal_t *fs, uint32_t id)
+{
+    if (FS_REQUEST_INDEX(id) >= FS_MAX_REQUESTS) {
+        return NULL;
+    }
+    fs_request_t *request = &fs->requests[FS_REQUEST_INDEX(id)];
+    return request->in_use && request->gen == FS_REQUEST_GEN(id) ? request : NULL;
+}
+
+/* Hand a request of the guest to the server, or answer it. 'used' is set if the
+ * chain is used right away, with 'len' bytes written for the guest, rather than
+ * once the server replies */
+static fs_request_result_t fs_handle_request(fs_internal_t *fs, unsigned int queue, virtio_chain_t *chain,
+                                             vm_guest_iovec_t *iov, int iovcnt, uint32_t *len, bool *used)
+{
+    vm_t *vm = fs->emul->vm;
+    crossvm_ring_t *ring = &fs->to_server;
+    size_t chain_len = fs_chain_len(iov, iovcnt);
+    *used = true;
+    *len = 0;
+    struct fuse_in_header in;
+    if (fs_chain_read(vm, iov, iovcnt, 0, &in, sizeof(in)) != sizeof(in) || in.len < sizeof(in) ||
+        in.len > chain_len) {
+        ZF_LOGE("Dropping malformed FUSE request of %zu bytes", chain_len);
+        return FS_REQUEST_DONE;
+    }
+    /* whatever follows the request is for the reply */
+    vm_guest_iovec_t reply_iov[VIRTIO_MAX_CHAIN_DESCS];
+    int reply_iovcnt = fs_chain_skip(iov, iovcnt, in.len, reply_iov);
+    size_t reply_len = chain_len - in.len;
+    if (reply_len && reply_len < sizeof(struct fuse_out_header)) {
+        ZF_LOGE("Dropping FUSE request %d with no room for its reply", in.opcode);
+        return FS_REQUEST_DONE;
+    }
+    uint64_t num_slots = fs_msg_slots(ring, in.len);
+    if (num_slots > ring->num_slots) {
+        *len = reply_len ? fs_reply_error(fs, reply_iov, reply_iovcnt, in.unique, E2BIG) : 0;
+        return FS_REQUEST_DONE;
+    }
+    struct fuse_setupmapping_in setup = { 0 };
+    if (in.opcode == FUSE_SETUPMAPPING && reply_len) {
+        if (in.len < sizeof(in) + sizeof(setup) ||
+            fs_chain_read(vm, iov, iovcnt, sizeof(in), &setup, sizeof(setup)) != sizeof(setup) ||
+            !fs_dax_range_valid(fs, &setup)) {
+            *len = fs_reply_error(fs, reply_iov, reply_iovcnt, in.unique, EINVAL);
+            return FS_REQUEST_DONE;
+        }
+    }
+    if (num_slots > crossvm_ring_free(ring)) {
+        fs->wait_slots = num_slots;
+        return FS_REQUEST_STALL_RING;
+    }
+    uint32_t id = VIRTIO_FS_MSG_NO_REPLY;
+    if (reply_len) {
+        fs_request_t *request = fs_request_alloc(fs);
+        if (!request) {
+            return FS_REQUEST_STALL_REPLIES;
+        }
+        request->queue = queue;
+        request->chain = *chain;
+        request->unique = in.unique;
+        request->opcode = in.opcode;
+        request->setup = setup;
+        request->iovcnt = reply_iovcnt;
+        memcpy(request->iov, reply_iov, sizeof(*reply_iov) * reply_iovcnt);
+        id = FS_REQUEST_ID(request - fs->requests, request->gen);
+        /* the chain is used once the server replies */
+        *used = false;
+    }
+    if (in.opcode == FUSE_REMOVEMAPPING) {
+        /* the guest no longer accesses the ranges, the server being told so it can release them */
+        fs_dax_remove(fs, iov, iovcnt, in.len);
+    }
+    struct virtio_fs_msg *msg = crossvm_ring_produce_slot(ring, 0);
+    msg->id = id;
+    msg->len = in.len;
+    msg->arg = MIN(reply_len, UINT32_MAX);
+    msg->reserved = 0;
+    vm_host_iovec_t host_iov[2];
+    fs_msg_data(ring, ring->index, in.len, host_iov);
+    size_t copied = 0;
+    vm_guest_readv(vm, host_iov, 2, iov, iovcnt, &copied);
+    fs->notify |= crossvm_ring_produce_commit(ring, num_slots);
+    return FS_REQUEST_DONE;
+}
+
+/* Have the server notify us as it frees slots, returning false if it has already
+ * freed enough for the request waiting */
+static bool fs_wait_free(fs_internal_t *fs)
+{
+    crossvm_ring_t *ring = &fs->to_server;
+    /* a request may need more than the single free slot crossvm_ring_prepare_wait waits for */
+    __atomic_store_n(&ring->shared->producer.wait_seq, ++ring->wait_seq, __ATOMIC_RELAXED);
+    __atomic_store_n(&ring->shared->producer.waiting, 1, __ATOMIC_RELEASE);
+    /* pairs with the server's order of moving its tail before reading the flag */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return crossvm_ring_free(ring) < fs->wait_slots;
+}
+
+/* Take requests of the guest for as long as the server has room for them.
+ * Returns whether the guest wants an interrupt */
+static bool fs_notify_requests(fs_internal_t *fs, unsigned int queue)
+{
+    virtio_emul_t *emul = fs->emul;
+    uint16_t idx = emul->virtq.last_idx[queue];
+    uint16_t old_used_idx = ring_used_idx(emul, queue);
+    uint16_t used_idx = old_used_idx;
+    while (true) {
+        virtio_chain_t chain;
+        vm_guest_iovec_t guest_iov[VIRTIO_MAX_CHAIN_DESCS];
+        int guest_iovcnt = ring_avail_chain(emul, queue, idx, &chain, guest_iov, VIRTIO_MAX_CHAIN_DESCS);
+        if (!guest_iovcnt) {
+            break;
+        }
+        uint32_t len;
+        bool used;
+        fs_request_result_t result = fs_handle_request(fs, queue, &chain, guest_iov, guest_iovcnt, &len, &used);
+        if (result == FS_REQUEST_STALL_RING) {
+            /* wait for the server to free slots, carrying on if it already has */
+            if (fs_wait_free(fs)) {
+                break;
+            }
+            continue;
+        }
+        if (result == FS_REQUEST_STALL_REPLIES) {
+            /* requests are taken again once the server replies */
+            break;
+        }
+        idx += chain.num;
+        if (used) {
+            used_idx += ring_used_write(emul, queue, used_idx, &chain, len);
+        }
+    }
+    emul->virtq.last_idx[queue] = idx;
+    ring_avail_event_set(emul, queue, idx);
+    if (used_idx == old_used_idx) {
+        return false;
+    }
+    ring_used_publish(emul, queue, used_idx);
+    return ring_need_interrupt(emul, queue, old_used_idx, used_idx);
+}
+
+/* Hand the replies of the server back to the guest. Returns whether the guest wants an interrupt */
+static bool fs_flush_replies(fs_internal_t *fs)
+{
+    virtio_emul_t *emul = fs->emul;
+    crossvm_ring_t *ring = &fs->from_server;
+    uint16_t old_used_idx[FS_NUM_QUEUES];
+    uint16_t used_idx[FS_NUM_QUEUES];
+    for (int i = 0; i < FS_NUM_QUEUES; i++) {
+        old_used_idx[i] = used_idx[i] = ring_used_idx(emul, i);
+    }
+    uint32_t available;
+    while ((available = crossvm_ring_available(ring))) {
+        /* the server is not trusted with the messages it writes */
+        struct virtio_fs_msg msg;
+        memcpy(&msg, crossvm_ring_consume_slot(ring, 0), sizeof(msg));
+        uint64_t num_slots = fs_msg_slots(ring, msg.len);
+        if (num_slots > available) {
+            /* replies are committed whole, so this one is garbage */
+            ZF_LOGE("Dropping malformed reply of %u bytes", msg.len);
+            fs->notify |= crossvm_ring_consume_commit(ring, 1);
+            continue;
+        }
+        fs_request_t *request = fs_request_find(fs, msg.id);
+        if (request) {
+            vm_host_iovec_t host_iov[2];
+            fs_msg_data(ring, ring->index, msg.len, host_iov);
+            struct fuse_out_header out = { 0 };
+            if (msg.len >= sizeof(out)) {
+                size_t first = MIN(host_iov[0].len, sizeof(out));
+                memcpy(&out, host_iov[0].base, first);
+                memcpy((uint8_t *)&out + first, host_iov[1].base, sizeof(out) - first);
+            }
+            size_t written = 0;
+            if (msg.len < sizeof(out)) {
+                written = fs_reply_error(fs, request->iov, request->iovcnt, request->unique, EIO);
+            } else if (request->opcode == FUSE_SETUPMAPPING && !out.error &&
+                       fs_dax_map(fs, &request->setup, msg.arg)) {
+                written = fs_reply_error(fs, request->iov, request->iovcnt, request->unique, EINVAL);
+            } else {
+                vm_guest_writev(emul->vm, host_iov, 2, request->iov, request->iovcnt, &written);
+            }
+            unsigned int queue = request->queue;
+            used_idx[queue] += ring_used_write(emul, queue, used_idx[queue], &request->chain, written);
+            request->in_use = false;
+        }
+        fs->notify |= crossvm_ring_consume_commit(ring, num_slots);
+    }
+    bool irq = false;
+    for (int i = 0; i < FS_NUM_QUEUES; i++) {
+        if (used_idx[i] != old_used_idx[i]) {
+            ring_used_publish(emul, i, used_idx[i]);
+            irq |= ring_need_interrupt(emul, i, old_used_idx[i], used_idx[i]);
+        }
+    }
+    return irq;
+}
+
+static void emul_fs_notify(virtio_emul_t *emul)
+{
+    fs_internal_t *fs = emul->internal;
+    crossvm_ring_finish_wait(&fs->to_server, true);
+    crossvm_ring_finish_wait(&fs->from_server, false);
+    bool irq = false;
+    do {
+        /* replies go first, making room for the requests they free */
+        irq |= fs_flush_replies(fs);
+        irq |= fs_notify_requests(fs, FS_HIPRIO_QUEUE);
+        irq |= fs_notify_requests(fs, FS_REQUEST_QUEUE);
+        /* have the server notify us of the replies it sends next, carrying on if it already has */
+    } while (crossvm_ring_available(&fs->from_server) || !crossvm_ring_prepare_wait(&fs->from_server, false));
+    /* the server is notified once for everything committed to its ring */
+    if (fs->notify) {
+        fs->notify = false;
+        seL4_Signal(fs->driver.notification);
+    }
+    if (irq) {
+        fs->driver.handleIRQ(fs->driver.fs_data);
+    }
+}
+
+static void emul_fs_notify_queue(virtio_emul_t *emul, unsigned int queue)
+{
+    emul_fs_notify(emul);
+}
+
+/* Forget the requests and mappings of the guest, as it resets the device */
+static void fs_reset(fs_internal_t *fs)
+{
+    for (int i = 0; i < FS_MAX_REQUESTS; i++) {
+        /* the server's replies to them match no later request */
+        fs->requests[i].in_use = false;
+    }
+    fs_dax_unmap(fs, 0, fs->dax_size);
+}
+
+static bool fs_device_emul_io_in(struct virtio_emul *emul, unsigned int offset, unsigned int size,
+                                 unsigned int *result)
+{
+    fs_internal_t *fs = emul->internal;
+    unsigned int config_offset = VIRTIO_PCI_CONFIG_OFF(false);
+    if (offset == VIRTIO_PCI_HOST_FEATURES) {
+        assert(size == 4);
+        *result = FS_HOST_FEATURES;
+        return true;
+    }
+    if (offset >= config_offset && offset + size <= config_offset + sizeof(fs->config)) {
+        /* the configuration may be read in pieces of any size */
+        *result = 0;
+        memcpy(result, (uint8_t *)&fs->config + offset - config_offset, size);
+        return true;
+    }
+    return false;
+}
+
+static bool fs_device_emul_io_out(struct virtio_emul *emul, unsigned int offset, unsigned int size,
+                                  unsigned int value)
+{
+    if (offset == VIRTIO_PCI_GUEST_FEATURES) {
+        assert(size == 4);
+        assert(!(value & ~FS_HOST_FEATURES));
+        emul->virtq.features = value;
+        return true;
+    }
+    if (offset == VIRTIO_PCI_STATUS && value == 0) {
+        fs_reset(emul->internal);
+    }
+    /* status writes carry on to the generic handling */
+    return false;
+}
+
+static memory_fault_result_t fs_dax_fault_handler(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t fault_addr,
+                                                  size_t fault_length, void *cookie)
+{
+    /* the guest only accesses ranges of the window it set up, anything else
+     * reading as zeros and having its writes dropped */
+    ZF_LOGW("Guest access of unmapped DAX window address 0x%"PRIxPTR, fault_addr);
+    if (is_vcpu_read_fault(vcpu)) {
+        set_vcpu_fault_data(vcpu, 0);
+    }
+    advance_vcpu_fault(vcpu);
+    return FAULT_HANDLED;
+}
+
+int fs_virtio_emul_install_dax(virtio_emul_t *emul, uintptr_t addr, size_t size)
+{
+    fs_internal_t *fs = emul->internal;
+    if (fs->dax) {
+        ZF_LOGE("Failed to install DAX window: Window already installed");
+        return -1;
+    }
+    if (!fs->driver.cache_frames || !fs->driver.num_cache_frames) {
+        ZF_LOGE("Failed to install DAX window: Server has no cache frames to map");
+        return -1;
+    }
+    if (!size || !IS_ALIGNED(addr, seL4_PageBits) || !IS_ALIGNED(size, seL4_PageBits)) {
+        ZF_LOGE("Failed to install DAX window: 0x%zx bytes at 0x%"PRIxPTR" not page aligned", size, addr);
+        return -1;
+    }
+    fs->dax_caps = calloc(size / PAGE_SIZE_4K, sizeof(seL4_CPtr));
+    if (!fs->dax_caps) {
+        ZF_LOGE("Failed to install DAX window: Unable to allocate page caps");
+        return -1;
+    }
+    fs->dax = vm_reserve_memory_at(emul->vm, addr, size, fs_dax_fault_handler, (void *)fs);
+    if (!fs->dax) {
+        ZF_LOGE("Failed to install DAX window: Unable to reserve 0x%zx bytes at 0x%"PRIxPTR, size, addr);
+        free(fs->dax_caps);
+        fs->dax_caps = NULL;
+        return -1;
+    }
+    fs->dax_addr = addr;
+    fs->dax_size = size;
+    return 0;
+}
+
+void *fs_virtio_emul_init(virtio_emul_t *emul, ps_io_ops_t io_ops, fs_driver_init driver, void *config)
+{
+    fs_internal_t *internal = calloc(1, sizeof(*internal));
+    if (!internal) {
+        goto error;
+    }
+    int err = driver(&internal->driver, io_ops, config);
+    if (err) {
+        ZF_LOGE("Failed to initialize driver");
+        goto error;
+    }
+    struct fs_passthrough *backend = &internal->driver;
+    if (!backend->tag || strlen(backend->tag) > VIRTIO_FS_TAG_LEN) {
+        ZF_LOGE("Failed to initialize driver: Tag must be of up to %d characters", VIRTIO_FS_TAG_LEN);
+        goto error;
+    }
+    if (backend->slot_size < sizeof(struct virtio_fs_msg) ||
+        crossvm_ring_init(&internal->to_server, backend->to_server, backend->to_server_size, backend->slot_size) ||
+        crossvm_ring_init(&internal->from_server, backend->from_server, backend->from_server_size,
+                          backend->slot_size)) {
+        ZF_LOGE("Failed to initialize driver: Unable to lay out rings of %u byte slots", backend->slot_size);
+        goto error;
+    }
+    /* the tag is not NUL terminated when it fills the field */
+    strncpy(internal->config.tag, backend->tag, VIRTIO_FS_TAG_LEN);
+    internal->config.num_request_queues = FS_NUM_QUEUES - FS_REQUEST_QUEUE;
+    emul->notify = emul_fs_notify;
+    emul->notify_queue = emul_fs_notify_queue;
+    emul->device_io_in = fs_device_emul_io_in;
+    emul->device_io_out = fs_device_emul_io_out;
+    emul->virtq.num_queues = FS_NUM_QUEUES;
+    internal->emul = emul;
+    return (void *)internal;
+error:
+    if (emul) {
+        free(emul);
+    }
+    if (internal) {
+        free(internal);
+    }
+    return NULL;
+}
@@ -0,0 +1,147 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <platsupport/io.h>
+
+#include <sel4vmmplatsupport/drivers/virtio.h>
+#include <sel4vmmplatsupport/drivers/virtio_mem.h>
+
+#include <pci/helper.h>
+#include <sel4vmmplatsupport/drivers/pci_helper.h>
+
+#ifdef CONFIG_ARCH_ARM
+#include <sel4vmmplatsupport/arch/virtio_mmio.h>
+#endif
+
+#include "virtio_pci_modern.h"
+
+#define QUEUE_SIZE 128
+
+static ps_io_ops_t ops;
+
+static int emul_mem_driver_init(struct mem_passthrough *driver, ps_io_ops_t io_ops, void *config)
+{
+    virtio_mem_t *mem = (virtio_mem_t *)config;
+    *driver = mem->emul_driver_funcs;
+    return 0;
+}
+
+/* Create the emulated device behind a transport */
+static virtio_emul_t *virtio_mem_emul_create(virtio_mem_t *mem, vm_t *vm, struct mem_passthrough backend)
+{
+    /* guest memory is only accessed by copying, the device needs no DMA */
+    ps_io_ops_t ioops = { 0 };
+    mem->emul_driver_funcs = backend;
+    return virtio_emul_init(ioops, QUEUE_SIZE, 1, vm, emul_mem_driver_init, mem, VIRTIO_MEM);
+}
+
+static virtio_mem_t *virtio_mem_create(vm_t *vm, struct mem_passthrough backend)
+{
+    int err = ps_new_stdlib_malloc_ops(&ops.malloc_ops);
+    ZF_LOGF_IF(err, "Failed to get malloc ops");
+
+    virtio_mem_t *mem;
+    err = ps_calloc(&ops.malloc_ops, 1, sizeof(*mem), (void **)&mem);
+    ZF_LOGF_IF(err, "Failed to allocate virtio mem");
+
+    mem->emul = virtio_mem_emul_create(mem, vm, backend);
+    if (!mem->emul) {
+        ZF_LOGE("Failed to make virtio mem: Unable to create the emulated device");
+        ps_free(&ops.malloc_ops, sizeof(*mem), mem);
+        return NULL;
+    }
+    return mem;
+}
+
+static vmm_pci_entry_t vmm_virtio_mem_pci_bar(uintptr_t bar_addr, unsigned int interrupt_pin,
+                                                unsigned int interrupt_line, bool emulate_bar_access)
+{
+    vmm_pci_device_def_t *pci_config;
+    int err = ps_calloc(&ops.malloc_ops, 1, sizeof(*pci_config), (void **)&pci_config);
+    ZF_LOGF_IF(err, "Failed to allocate pci config");
+    *pci_config = (vmm_pci_device_def_t) {
+        .vendor_id = VIRTIO_PCI_VENDOR_ID,
+        .device_id = VIRTIO_PCI_MODERN_DEVICE_ID(VIRTIO_ID_MEM),
+        .revision_id = 1,
+        .command = PCI_COMMAND_MEMORY,
+        .header_type = PCI_HEADER_TYPE_NORMAL,
+        .subsystem_vendor_id    = VIRTIO_PCI_SUBSYSTEM_VENDOR_ID,
+        .subsystem_id       = VIRTIO_ID_MEM,
+        .interrupt_pin = interrupt_pin,
+        .interrupt_line = interrupt_line,
+        .bar0 = bar_addr | PCI_BASE_ADDRESS_SPACE_MEMORY,
+        .cache_line_size = 64,
+        .latency_timer = 64,
+        .prog_if = VIRTIO_PCI_CLASS_MEM & 0xff,
+        .subclass = (VIRTIO_PCI_CLASS_MEM >> 8) & 0xff,
+        .class_code = (VIRTIO_PCI_CLASS_MEM >> 16) & 0xff,
+    };
+    err = virtio_pci_modern_add_caps(pci_config, 0);
+    ZF_LOGF_IF(err, "Failed to add virtio capabilities");
+    vmm_pci_entry_t entry = (vmm_pci_entry_t) {
+        .cookie = pci_config,
+        .ioread = vmm_pci_mem_device_read,
+        .iowrite = vmm_pci_mem_device_write
+    };
+
+    vmm_pci_bar_t bars[1] = {{
+            .mem_type = NON_PREFETCH_MEM,
+            .address = bar_addr,
+            .size_bits = VIRTIO_PCI_MODERN_BAR_SIZE_BITS
+        }
+    };
+    if (emulate_bar_access) {
+        return vmm_pci_create_bar_emulation(entry, 1, bars);
+    }
+    return vmm_pci_create_passthrough_bar_emulation(entry, 1, bars);
+}
+
+virtio_mem_t *common_make_virtio_mem(vm_t *vm, vmm_pci_space_t *pci, uintptr_t bar_addr,
+                                         unsigned int interrupt_pin, unsigned int interrupt_line,
+                                         struct mem_passthrough backend, bool emulate_bar_access)
+{
+    virtio_mem_t *mem = virtio_mem_create(vm, backend);
+    if (!mem) {
+        return NULL;
+    }
+    int err = virtio_pci_modern_install(vm, mem->emul, bar_addr);
+    if (err) {
+        ZF_LOGE("Failed to make virtio mem: Unable to install pci registers");
+        return NULL;
+    }
+    vmm_pci_entry_t entry = vmm_virtio_mem_pci_bar(bar_addr, interrupt_pin, interrupt_line, emulate_bar_access);
+    vmm_pci_add_entry(pci, entry, NULL);
+    return mem;
+}
+
+#ifdef CONFIG_ARCH_ARM
+virtio_mem_t *common_make_virtio_mem_mmio(vm_t *vm, uintptr_t addr, struct mem_passthrough backend)
+{
+    virtio_mem_t *mem = virtio_mem_create(vm, backend);
+    if (!mem) {
+        return NULL;
+    }
+    int err = vm_install_virtio_mmio(vm, mem->emul, addr, VIRTIO_ID_MEM);
+    if (err) {
+        ZF_LOGE("Failed to make virtio mem: Unable to install mmio transport");
+        return NULL;
+    }
+    return mem;
+}
+#endif
+
+void virtio_mem_set_requested_size(virtio_mem_t *mem, uint64_t bytes)
+{
+    mem_virtio_emul_set_requested(mem->emul, bytes);
+}
+
+uint64_t virtio_mem_get_plugged_size(virtio_mem_t *mem)
+{
+    return mem_virtio_emul_get_plugged(mem->emul);
+}
@@ -0,0 +1,413 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
+
+#include <sel4vm/guest_ram.h>
+
+#include <sel4vmmplatsupport/drivers/virtio_pci_emul.h>
+
+#include "virtio_emul_helpers.h"
+
+/* Plug and unplug requests of the guest */
+#define MEM_GUEST_QUEUE 0
+#define MEM_NUM_QUEUES 1
+
+#define VIRTIO_MEM_F_ACPI_PXM 0
+#define VIRTIO_MEM_F_UNPLUGGED_INACCESSIBLE 1
+
+/* The guest does not touch the memory it has unplugged, which is given back
+ * to the VKA and would otherwise be given fresh frames when touched */
+#define MEM_HOST_FEATURES BIT(VIRTIO_MEM_F_UNPLUGGED_INACCESSIBLE)
+
+#ifndef VIRTIO_PCI_ISR_CONFIG
+#define VIRTIO_PCI_ISR_CONFIG 0x2
+#endif
+
+#define VIRTIO_MEM_REQ_PLUG 0
+#define VIRTIO_MEM_REQ_UNPLUG 1
+#define VIRTIO_MEM_REQ_UNPLUG_ALL 2
+#define VIRTIO_MEM_REQ_STATE 3
+
+#define VIRTIO_MEM_RESP_ACK 0
+#define VIRTIO_MEM_RESP_NACK 1
+#define VIRTIO_MEM_RESP_BUSY 2
+#define VIRTIO_MEM_RESP_ERROR 3
+
+#define VIRTIO_MEM_STATE_PLUGGED 0
+#define VIRTIO_MEM_STATE_UNPLUGGED 1
+#define VIRTIO_MEM_STATE_MIXED 2
+
+#define BITMAP_BITS (sizeof(unsigned long) * CHAR_BIT)
+
+/* Device configuration space, following the common virtio registers */
+struct virtio_mem_config {
+    uint64_t block_size;
+    uint16_t node_id;
+    uint8_t padding[6];
+    uint64_t addr;
+    uint64_t region_size;
+    /* the part of the region the guest may plug memory into */
+    uint64_t usable_region_size;
+    uint64_t plugged_size;
+    /* memory the device wants plugged */
+    uint64_t requested_size;
+} PACKED;
+
+/* Requests of the guest, all but UNPLUG_ALL being of a range of blocks */
+struct virtio_mem_req {
+    uint16_t type;
+    uint16_t padding[3];
+    uint64_t addr;
+    uint16_t nb_blocks;
+    uint16_t padding_range[3];
+} PACKED;
+
+struct virtio_mem_resp {
+    uint16_t type;
+    uint16_t padding[3];
+    /* of STATE requests */
+    uint16_t state;
+} PACKED;
+
+typedef struct mem_virtio_emul_internal {
+    struct mem_passthrough driver;
+    virtio_emul_t *emul;
+    struct virtio_mem_config config;
+    /* the configuration has changed since the guest last read the interrupt status */
+    bool config_changed;
+    size_t num_blocks;
+    /* blocks the guest has plugged, and blocks registered as guest RAM. Blocks
+     * stay registered once unplugged, with their frames released */
+    unsigned long *plugged;
+    unsigned long *registered;
+} mem_internal_t;
+
+static bool block_test(const unsigned long *bitmap, size_t block)
+{
+    return bitmap[block / BITMAP_BITS] & BIT(block % BITMAP_BITS);
+}
+
+static void block_set(unsigned long *bitmap, size_t block, bool set)
+{
+    if (set) {
+        bitmap[block / BITMAP_BITS] |= BIT(block % BITMAP_BITS);
+    } else {
+        bitmap[block / BITMAP_BITS] &= ~BIT(block % BITMAP_BITS);
+    }
+}
+
+static uintptr_t block_addr(mem_internal_t *mem, size_t block)
+{
+    return mem->driver.addr + block * mem->driver.block_size;
+}
+
+/* Give the frames of a block back to the VKA, the block staying registered */
+static int mem_release_block(mem_internal_t *mem, size_t block)
+{
+    if (vm_ram_release(mem->emul->vm, block_addr(mem, block), mem->driver.block_size)) {
+        ZF_LOGE("Failed to unplug memory block at 0x%"PRIxPTR, block_addr(mem, block));
+        return -1;
+    }
+    block_set(mem->plugged, block, false);
+    mem->config.plugged_size -= mem->driver.block_size;
+    return 0;
+}
+
+/* Register the blocks of a range that have never been plugged as guest RAM,
+ * which is only backed by frames as the guest touches it with lazy RAM, and
+ * mark the range plugged. Blocks plugged before were released on being
+ * unplugged, and are given fresh frames as the guest touches them */
+static uint16_t mem_plug(mem_internal_t *mem, size_t first, size_t num)
+{
+    vm_t *vm = mem->emul->vm;
+    size_t block_size = mem->driver.block_size;
+    if (mem->config.plugged_size + num * block_size > mem->config.requested_size) {
+        return VIRTIO_MEM_RESP_NACK;
+    }
+    for (size_t block = first; block < first + num; block++) {
+        if (block_test(mem->plugged, block)) {
+            return VIRTIO_MEM_RESP_ERROR;
+        }
+    }
+    for (size_t block = first; block < first + num; block++) {
+        if (!block_test(mem->registered, block)) {
+            if (vm_ram_register_at(vm, block_addr(mem, block), block_size, false)) {
+                ZF_LOGE("Failed to plug memory block at 0x%"PRIxPTR": Unable to register RAM", block_addr(mem, block));
+                /* the blocks plugged so far are given up again */
+                while (block-- > first) {
+                    mem_release_block(mem, block);
+                }
+                return VIRTIO_MEM_RESP_NACK;
+            }
+            vm_ram_mark_allocated(vm, block_addr(mem, block), block_size);
+            block_set(mem->registered, block, true);
+        }
+        block_set(mem->plugged, block, true);
+        mem->config.plugged_size += block_size;
+    }
+    return VIRTIO_MEM_RESP_ACK;
+}
+
+static uint16_t mem_unplug(mem_internal_t *mem, size_t first, size_t num)
+{
+    for (size_t block = first; block < first + num; block++) {
+        if (!block_test(mem->plugged, block)) {
+            return VIRTIO_MEM_RESP_ERROR;
+        }
+    }
+    for (size_t block = first; block < first + num; block++) {
+        if (mem_release_block(mem, block)) {
+            return VIRTIO_MEM_RESP_ERROR;
+        }
+    }
+    return VIRTIO_MEM_RESP_ACK;
+}
+
+static uint16_t mem_unplug_all(mem_internal_t *mem)
+{
+    for (size_t block = 0; block < mem->num_blocks; block++) {
+        if (block_test(mem->plugged, block) && mem_release_block(mem, block)) {
+            return VIRTIO_MEM_RESP_ERROR;
+        }
+    }
+    return VIRTIO_MEM_RESP_ACK;
+}
+
+static uint16_t mem_state(mem_internal_t *mem, size_t first, size_t num)
+{
+    size_t num_plugged = 0;
+    for (size_t block = first; block < first + num; block++) {
+        num_plugged += block_test(mem->plugged, block);
+    }
+    if (num_plugged == num) {
+        return VIRTIO_MEM_STATE_PLUGGED;
+    }
+    return num_plugged ? VIRTIO_MEM_STATE_MIXED : VIRTIO_MEM_STATE_UNPLUGGED;
+}
+
+/* Handle a request, returning the response */
+static struct virtio_mem_resp mem_handle_request(mem_internal_t *mem, const struct virtio_mem_req *req)
+{
+    struct virtio_mem_resp resp = { .type = VIRTIO_MEM_RESP_ERROR };
+    if (req->type == VIRTIO_MEM_REQ_UNPLUG_ALL) {
+        resp.type = mem_unplug_all(mem);
+        return resp;
+    }
+    /* ranges are of whole blocks within the usable region */
+    uint64_t offset = req->addr - mem->driver.addr;
+    if (req->addr < mem->driver.addr || offset % mem->driver.block_size || !req->nb_blocks ||
+        offset / mem->driver.block_size + req->nb_blocks > mem->config.usable_region_size / mem->driver.block_size) {
+        ZF_LOGE("Rejecting memory request of type %u of %u blocks at 0x%"PRIx64, req->type, req->nb_blocks,
+                req->addr);
+        return resp;
+    }
+    size_t first = offset / mem->driver.block_size;
+    switch (req->type) {
+    case VIRTIO_MEM_REQ_PLUG:
+        resp.type = mem_plug(mem, first, req->nb_blocks);
+        break;
+    case VIRTIO_MEM_REQ_UNPLUG:
+        resp.type = mem_unplug(mem, first, req->nb_blocks);
+        break;
+    case VIRTIO_MEM_REQ_STATE:
+        resp.type = VIRTIO_MEM_RESP_ACK;
+        resp.state = mem_state(mem, first, req->nb_blocks);
+        break;
+    default:
+        ZF_LOGE("Rejecting memory request of unknown type %u", req->type);
+        break;
+    }
+    return resp;
+}
+
+/* Buffers of a descriptor chain from 'offset' bytes on */
+static int mem_chain_skip(const vm_guest_iovec_t *iov, int iovcnt, size_t offset, vm_guest_iovec_t *skipped)
+{
+    int num = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (offset >= iov[i].len) {
+            offset -= iov[i].len;
+            continue;
+        }
+        skipped[num++] = (vm_guest_iovec_t) {
+            .addr = iov[i].addr + offset,
+            .len = iov[i].len - offset
+        };
+        offset = 0;
+    }
+    return num;
+}
+
+/* Handle the request of a chain, returning the bytes of response written */
+static uint32_t mem_chain_request(mem_internal_t *mem, vm_guest_iovec_t *iov, int iovcnt)
+{
+    vm_t *vm = mem->emul->vm;
+    struct virtio_mem_req req;
+    vm_host_iovec_t req_iov = { .base = &req, .len = sizeof(req) };
+    size_t copied = 0;
+    vm_guest_readv(vm, &req_iov, 1, iov, iovcnt, &copied);
+    if (copied != sizeof(req)) {
+        ZF_LOGE("Dropping memory request of %zu bytes", copied);
+        return 0;
+    }
+    struct virtio_mem_resp resp = mem_handle_request(mem, &req);
+    /* the response follows the request */
+    vm_guest_iovec_t resp_iov[VIRTIO_MAX_CHAIN_DESCS];
+    int resp_iovcnt = mem_chain_skip(iov, iovcnt, sizeof(req), resp_iov);
+    vm_host_iovec_t host_iov = { .base = &resp, .len = sizeof(resp) };
+    size_t written = 0;
+    vm_guest_writev(vm, &host_iov, 1, resp_iov, resp_iovcnt, &written);
+    return written;
+}
+
+static void emul_mem_notify_queue(virtio_emul_t *emul, unsigned int queue)
+{
+    mem_internal_t *mem = emul->internal;
+    if (queue != MEM_GUEST_QUEUE) {
+        return;
+    }
+    uint16_t idx = emul->virtq.last_idx[queue];
+    uint16_t old_used = ring_used_idx(emul, queue);
+    uint16_t used = old_used;
+    while (true) {
+        vm_guest_iovec_t iov[VIRTIO_MAX_CHAIN_DESCS];
+        virtio_chain_t chain;
+        int iovcnt = ring_avail_chain(emul, queue, idx, &chain, iov, VIRTIO_MAX_CHAIN_DESCS);
+        if (!iovcnt) {
+            break;
+        }
+        uint32_t len = mem_chain_request(mem, iov, iovcnt);
+        used += ring_used_write(emul, queue, used, &chain, len);
+        idx += chain.num;
+    }
+    emul->virtq.last_idx[queue] = idx;
+    if (used == old_used) {
+        return;
+    }
+    ring_used_publish(emul, queue, used);
+    if (ring_need_interrupt(emul, queue, old_used, used)) {
+        mem->driver.handleIRQ(mem->driver.mem_data);
+    }
+}
+
+static void emul_mem_notify(virtio_emul_t *emul)
+{
+    emul_mem_notify_queue(emul, MEM_GUEST_QUEUE);
+}
+
+static bool mem_device_emul_io_in(struct virtio_emul *emul, unsigned int offset, unsigned int size,
+                                  unsigned int *result)
+{
+    mem_internal_t *mem = emul->internal;
+    unsigned int config_offset = VIRTIO_PCI_CONFIG_OFF(false);
+    switch (offset) {
+    case VIRTIO_PCI_HOST_FEATURES:
+        assert(size == 4);
+        *result = MEM_HOST_FEATURES;
+        return true;
+    case VIRTIO_PCI_ISR:
+        assert(size == 1);
+        /* reading the interrupt status acknowledges a configuration change */
+        *result = 1 | (mem->config_changed ? VIRTIO_PCI_ISR_CONFIG : 0);
+        mem->config_changed = false;
+        return true;
+    }
+    if (offset >= config_offset && offset + size <= config_offset + sizeof(mem->config)) {
+        /* the configuration may be read in pieces of any size */
+        *result = 0;
+        memcpy(result, (uint8_t *)&mem->config + offset - config_offset, size);
+        return true;
+    }
+    return false;
+}
+
+static bool mem_device_emul_io_out(struct virtio_emul *emul, unsigned int offset, unsigned int size,
+                                   unsigned int value)
+{
+    unsigned int config_offset = VIRTIO_PCI_CONFIG_OFF(false);
+    if (offset == VIRTIO_PCI_GUEST_FEATURES) {
+        assert(size == 4);
+        assert(!(value & ~MEM_HOST_FEATURES));
+        emul->virtq.features = value;
+        return true;
+    }
+    if (offset >= config_offset && offset + size <= config_offset + sizeof(struct virtio_mem_config)) {
+        /* the configuration is read-only to the guest */
+        return true;
+    }
+    /* the memory plugged stays plugged across resets of the device, which the
+     * guest unplugs itself as its driver starts up */
+    return false;
+}
+
+void mem_virtio_emul_set_requested(virtio_emul_t *emul, uint64_t size)
+{
+    mem_internal_t *mem = emul->internal;
+    mem->config.requested_size = ROUND_DOWN(MIN(size, mem->config.usable_region_size), mem->driver.block_size);
+    mem->config_changed = true;
+    mem->driver.handleIRQ(mem->driver.mem_data);
+}
+
+uint64_t mem_virtio_emul_get_plugged(virtio_emul_t *emul)
+{
+    mem_internal_t *mem = emul->internal;
+    return mem->config.plugged_size;
+}
+
+void *mem_virtio_emul_init(virtio_emul_t *emul, ps_io_ops_t io_ops, mem_driver_init driver, void *config)
+{
+    mem_internal_t *internal = calloc(1, sizeof(*internal));
+    if (!internal) {
+        goto error;
+    }
+    int err = driver(&internal->driver, io_ops, config);
+    if (err) {
+        ZF_LOGE("Failed to initialize driver");
+        goto error;
+    }
+    struct mem_passthrough *backend = &internal->driver;
+    size_t block_size = backend->block_size;
+    if (block_size < PAGE_SIZE_4K || (block_size & (block_size - 1)) || !IS_ALIGNED(backend->addr, CTZL(block_size)) ||
+        !backend->region_size || backend->region_size % block_size) {
+        ZF_LOGE("Failed to initialize driver: Region of 0x%zx bytes at 0x%"PRIxPTR" not of whole blocks of 0x%zx bytes",
+                backend->region_size, backend->addr, block_size);
+        goto error;
+    }
+    internal->num_blocks = backend->region_size / block_size;
+    internal->plugged = calloc(DIV_ROUND_UP(internal->num_blocks, BITMAP_BITS), sizeof(unsigned long));
+    internal->registered = calloc(DIV_ROUND_UP(internal->num_blocks, BITMAP_BITS), sizeof(unsigned long));
+    if (!internal->plugged || !internal->registered) {
+        ZF_LOGE("Failed to initialize driver: Unable to allocate block bitmaps");
+        goto error;
+    }
+    internal->config = (struct virtio_mem_config) {
+        .block_size = block_size,
+        .node_id = backend->node_id,
+        .addr = backend->addr,
+        .region_size = backend->region_size,
+        .usable_region_size = backend->region_size,
+    };
+    emul->notify = emul_mem_notify;
+    emul->notify_queue = emul_mem_notify_queue;
+    emul->device_io_in = mem_device_emul_io_in;
+    emul->device_io_out = mem_device_emul_io_out;
+    emul->virtq.num_queues = MEM_NUM_QUEUES;
+    internal->emul = emul;
+    return (void *)internal;
+error:
+    if (emul) {
+        free(emul);
+    }
+    if (internal) {
+        free(internal->plugged);
+        free(internal->registered);
+        free(internal);
+    }
+    return NULL;
+}
@@ -4,6 +4,7 @@
  * SPDX-License-Identifier: BSD-2-Clause
  */
 
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,11 +14,29 @@
 #include <sel4vmmplatsupport/drivers/virtio.h>
 #include <sel4vmmplatsupport/drivers/virtio_net.h>
 
+#include <sel4vm/boot.h>
+#include <sel4vm/guest_iospace.h>
+#include <sel4vm/guest_doorbell.h>
+#include <sel4vm/guest_irq_controller.h>
+#include <sel4vm/guest_vm_boot_phases.h>
+#include <sel4vm/guest_vm_exit_stats.h>
+
+#ifdef CONFIG_ARCH_ARM
+#include <sel4vmmplatsupport/arch/virtio_mmio.h>
+#endif
+#ifdef CONFIG_ARCH_X86
+#include <sel4vm/arch/ioports.h>
+#endif
+
 #include <pci/helper.h>
 #include <sel4vmmplatsupport/drivers/pci_helper.h>
 
+#include "virtio_pci_modern.h"
+
 #define QUEUE_SIZE 128
 
+#define NSEC_PER_SEC 1000000000ULL
+
 static ps_io_ops_t ops;
 
 static int virtio_net_io_in(void *cookie, unsigned int port_no, unsigned int size, unsigned int *result)
@@ -81,7 +100,11 @@ static int emul_driver_init(struct eth_driver *driver, ps_io_ops_t io_ops, void
     driver->eth_data = config;
     driver->dma_alignment = sizeof(uintptr_t);
     driver->i_fn = net->emul_driver_funcs;
-    net->emul_driver = driver;
+    /* called once for each queue pair, in order */
+    if (!net->num_queue_pairs) {
+        net->emul_driver = driver;
+    }
+    net->emul_drivers[net->num_queue_pairs++] = driver;
     return 0;
 }
 
@@ -116,11 +139,79 @@ static void malloc_dma_cache_op(void *cookie, void *addr, size_t size, dma_cache
 }
 
 
+/* Create the emulated device behind a transport */
+static virtio_emul_t *virtio_net_emul_create(virtio_net_t *net, vm_t *vm, struct raw_iface_funcs backend,
+                                             unsigned int num_queue_pairs)
+{
+    ps_io_ops_t ioops;
+    ioops.dma_manager = (ps_dma_man_t) {
+        .cookie = NULL,
+        .dma_alloc_fn = malloc_dma_alloc,
+        .dma_free_fn = malloc_dma_free,
+        .dma_pin_fn = malloc_dma_pin,
+        .dma_unpin_fn = malloc_dma_unpin,
+        .dma_cache_op_fn = malloc_dma_cache_op
+    };
+
+    net->emul_driver_funcs = backend;
+    return virtio_emul_init(ioops, QUEUE_SIZE, num_queue_pairs, vm, emul_driver_init, net, VIRTIO_NET);
+}
+
 struct raw_iface_funcs virtio_net_default_backend()
 {
     return emul_driver_funcs;
 }
 
+/* Reflect a transmitted packet into the guest's receive queue. The emulation's packet buffers are addressed by their
+ * virtual address, see malloc_dma_pin */
+static int loopback_raw_tx(struct eth_driver *driver, unsigned int num, uintptr_t *phys, unsigned int *len,
+                           void *cookie)
+{
+    unsigned int total = 0;
+    for (int i = 0; i < num; i++) {
+        total += len[i];
+    }
+    void *rx_cookie;
+    uintptr_t rx_phys = driver->i_cb.allocate_rx_buf(driver->cb_cookie, total, &rx_cookie);
+    if (!rx_phys) {
+        /* no buffer to receive into, the packet is lost as it would be on the wire */
+        return ETHIF_TX_COMPLETE;
+    }
+    unsigned int offset = 0;
+    for (int i = 0; i < num; i++) {
+        memcpy((uint8_t *)rx_phys + offset, (void *)phys[i], len[i]);
+        offset += len[i];
+    }
+    driver->i_cb.rx_complete(driver->cb_cookie, 1, &rx_cookie, &total);
+    return ETHIF_TX_COMPLETE;
+}
+
+static void loopback_raw_poll(struct eth_driver *driver)
+{
+}
+
+static void loopback_print_state(struct eth_driver *driver)
+{
+}
+
+static void loopback_low_level_init(struct eth_driver *driver, uint8_t *mac, int *mtu)
+{
+    /* a locally administered address */
+    static const uint8_t loopback_mac[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x01};
+    memcpy(mac, loopback_mac, sizeof(loopback_mac));
+    *mtu = 1500;
+}
+
+struct raw_iface_funcs virtio_net_loopback_backend(void)
+{
+    struct raw_iface_funcs backend = emul_driver_funcs;
+    backend.raw_tx = loopback_raw_tx;
+    backend.raw_poll = loopback_raw_poll;
+    backend.print_state = loopback_print_state;
+    backend.low_level_init = loopback_low_level_init;
+    return backend;
+}
+
 static vmm_pci_entry_t vmm_virtio_net_pci_bar(unsigned int iobase,
                                               size_t iobase_size_bits, unsigned int interrupt_pin,
                                               unsigned int interrupt_line, bool emulate_bar_access)
@@ -169,6 +260,21 @@ virtio_net_t *common_make_virtio_net(vm_t *vm, vmm_pci_space_t *pci, vmm_io_port
                                      ioport_range_t ioport_range, ioport_type_t port_type, unsigned int interrupt_pin, unsigned int interrupt_line,
                                      struct raw_iface_funcs backend, bool emulate_bar_access)
 {
+    return common_make_virtio_net_mq(vm, pci, ioport, ioport_range, port_type, interrupt_pin, interrupt_line, backend,
+                                     emulate_bar_access, 1);
+}
+
+static virtio_net_t *make_virtio_net(vm_t *vm, vmm_pci_space_t *pci, vmm_io_port_list_t *ioport,
+                                     ioport_range_t ioport_range, ioport_type_t port_type, unsigned int interrupt_pin,
+                                     unsigned int interrupt_line, struct raw_iface_funcs backend, bool emulate_bar_access,
+                                     unsigned int num_queue_pairs)
+{
+    if (num_queue_pairs == 0 || num_queue_pairs > VIRTIO_MAX_QUEUE_PAIRS) {
+        ZF_LOGE("Failed to make virtio net: %u queue pairs outside of 1 to %d", num_queue_pairs,
+                VIRTIO_MAX_QUEUE_PAIRS);
+        return NULL;
+    }
+
     int err = ps_new_stdlib_malloc_ops(&ops.malloc_ops);
     ZF_LOGF_IF(err, "Failed to get malloc ops");
 
@@ -190,19 +296,354 @@ virtio_net_t *common_make_virtio_net(vm_t *vm, vmm_pci_space_t *pci, vmm_io_port
                                                    emulate_bar_access);
     vmm_pci_add_entry(pci, entry, NULL);
 
-    ps_io_ops_t ioops;
-    ioops.dma_manager = (ps_dma_man_t) {
-        .cookie = NULL,
-        .dma_alloc_fn = malloc_dma_alloc,
-        .dma_free_fn = malloc_dma_free,
-        .dma_pin_fn = malloc_dma_pin,
-        .dma_unpin_fn = malloc_dma_unpin,
-        .dma_cache_op_fn = malloc_dma_cache_op
+    net->emul = virtio_net_emul_create(net, vm, backend, num_queue_pairs);
+
+    assert(net->emul);
+    return net;
+}
+
+virtio_net_t *common_make_virtio_net_mq(vm_t *vm, vmm_pci_space_t *pci, vmm_io_port_list_t *ioport,
+                                        ioport_range_t ioport_range, ioport_type_t port_type, unsigned int interrupt_pin,
+                                        unsigned int interrupt_line, struct raw_iface_funcs backend, bool emulate_bar_access,
+                                        unsigned int num_queue_pairs)
+{
+    int phase = vm_boot_phase_begin("common_make_virtio_net");
+    virtio_net_t *net = make_virtio_net(vm, pci, ioport, ioport_range, port_type, interrupt_pin, interrupt_line,
+                                        backend, emulate_bar_access, num_queue_pairs);
+    vm_boot_phase_end(phase);
+    return net;
+}
+
+static vmm_pci_entry_t vmm_virtio_net_pci_modern_bar(uintptr_t bar_addr, unsigned int interrupt_pin,
+                                                     unsigned int interrupt_line, bool emulate_bar_access)
+{
+    vmm_pci_device_def_t *pci_config;
+    int err = ps_calloc(&ops.malloc_ops, 1, sizeof(*pci_config), (void **)&pci_config);
+    ZF_LOGF_IF(err, "Failed to allocate pci config");
+    *pci_config = (vmm_pci_device_def_t) {
+        .vendor_id = VIRTIO_PCI_VENDOR_ID,
+        .device_id = VIRTIO_PCI_MODERN_DEVICE_ID(VIRTIO_ID_NET),
+        .revision_id = 1,
+        .command = PCI_COMMAND_MEMORY,
+        .header_type = PCI_HEADER_TYPE_NORMAL,
+        .subsystem_vendor_id    = VIRTIO_PCI_SUBSYSTEM_VENDOR_ID,
+        .subsystem_id       = VIRTIO_ID_NET,
+        .interrupt_pin = interrupt_pin,
+        .interrupt_line = interrupt_line,
+        .bar0 = bar_addr | PCI_BASE_ADDRESS_SPACE_MEMORY,
+        .cache_line_size = 64,
+        .latency_timer = 64,
+        .prog_if = VIRTIO_PCI_CLASS_NET & 0xff,
+        .subclass = (VIRTIO_PCI_CLASS_NET >> 8) & 0xff,
+        .class_code = (VIRTIO_PCI_CLASS_NET >> 16) & 0xff,
+    };
+    err = virtio_pci_modern_add_caps(pci_config, 0);
+    ZF_LOGF_IF(err, "Failed to add virtio capabilities");
+    vmm_pci_entry_t entry = (vmm_pci_entry_t) {
+        .cookie = pci_config,
+        .ioread = vmm_pci_mem_device_read,
+        .iowrite = vmm_pci_mem_device_write
     };
 
-    net->emul_driver_funcs = backend;
-    net->emul = virtio_emul_init(ioops, QUEUE_SIZE, vm, emul_driver_init, net, VIRTIO_NET);
+    vmm_pci_bar_t bars[1] = {{
+            .mem_type = NON_PREFETCH_MEM,
+            .address = bar_addr,
+            .size_bits = VIRTIO_PCI_MODERN_BAR_SIZE_BITS
+        }
+    };
+    if (emulate_bar_access) {
+        return vmm_pci_create_bar_emulation(entry, 1, bars);
+    }
+    return vmm_pci_create_passthrough_bar_emulation(entry, 1, bars);
+}
 
-    assert(net->emul);
+virtio_net_t *common_make_virtio_net_modern(vm_t *vm, vmm_pci_space_t *pci, uintptr_t bar_addr,
+                                            unsigned int interrupt_pin, unsigned int interrupt_line,
+                                            struct raw_iface_funcs backend, bool emulate_bar_access,
+                                            unsigned int num_queue_pairs)
+{
+    if (num_queue_pairs == 0 || num_queue_pairs > VIRTIO_MAX_QUEUE_PAIRS) {
+        ZF_LOGE("Failed to make virtio net: %u queue pairs outside of 1 to %d", num_queue_pairs,
+                VIRTIO_MAX_QUEUE_PAIRS);
+        return NULL;
+    }
+
+    int err = ps_new_stdlib_malloc_ops(&ops.malloc_ops);
+    ZF_LOGF_IF(err, "Failed to get malloc ops");
+
+    virtio_net_t *net;
+    err = ps_calloc(&ops.malloc_ops, 1, sizeof(*net), (void **)&net);
+    ZF_LOGF_IF(err, "Failed to allocate virtio net");
+
+    net->emul = virtio_net_emul_create(net, vm, backend, num_queue_pairs);
+    if (!net->emul) {
+        ZF_LOGE("Failed to make virtio net: Unable to create the emulated device");
+        ps_free(&ops.malloc_ops, sizeof(*net), net);
+        return NULL;
+    }
+
+    err = virtio_pci_modern_install(vm, net->emul, bar_addr);
+    if (err) {
+        ZF_LOGE("Failed to make virtio net: Unable to install pci registers");
+        return NULL;
+    }
+    vmm_pci_entry_t entry = vmm_virtio_net_pci_modern_bar(bar_addr, interrupt_pin, interrupt_line,
+                                                          emulate_bar_access);
+    vmm_pci_add_entry(pci, entry, NULL);
+    return net;
+}
+
+#ifdef CONFIG_ARCH_ARM
+virtio_net_t *common_make_virtio_net_mmio(vm_t *vm, uintptr_t addr, struct raw_iface_funcs backend,
+                                          unsigned int num_queue_pairs)
+{
+    if (num_queue_pairs == 0 || num_queue_pairs > VIRTIO_MAX_QUEUE_PAIRS) {
+        ZF_LOGE("Failed to make virtio net: %u queue pairs outside of 1 to %d", num_queue_pairs,
+                VIRTIO_MAX_QUEUE_PAIRS);
+        return NULL;
+    }
+
+    int err = ps_new_stdlib_malloc_ops(&ops.malloc_ops);
+    ZF_LOGF_IF(err, "Failed to get malloc ops");
+
+    virtio_net_t *net;
+    err = ps_calloc(&ops.malloc_ops, 1, sizeof(*net), (void **)&net);
+    ZF_LOGF_IF(err, "Failed to allocate virtio net");
+
+    net->emul = virtio_net_emul_create(net, vm, backend, num_queue_pairs);
+    if (!net->emul) {
+        ZF_LOGE("Failed to make virtio net: Unable to create the emulated device");
+        ps_free(&ops.malloc_ops, sizeof(*net), net);
+        return NULL;
+    }
+
+    err = vm_install_virtio_mmio(vm, net->emul, addr, VIRTIO_ID_NET);
+    if (err) {
+        ZF_LOGE("Failed to make virtio net: Unable to install mmio transport");
+        return NULL;
+    }
     return net;
 }
+#endif
+
+int virtio_net_enable_zero_copy_tx(virtio_net_t *net, bool identity_mapped)
+{
+    if (!identity_mapped && !vm_guest_num_iospaces(net->emul->vm)) {
+        ZF_LOGE("Failed to enable zero copy tx: Guest RAM is not addressable by the device");
+        return -1;
+    }
+    return net_virtio_emul_enable_zero_copy_tx(net->emul);
+}
+
+int virtio_net_set_rx_coalescing(virtio_net_t *net, unsigned int max_packets)
+{
+    return net_virtio_emul_set_rx_coalescing(net->emul, max_packets);
+}
+
+void virtio_net_flush_rx(virtio_net_t *net)
+{
+    net_virtio_emul_flush_rx(net->emul);
+}
+
+int virtio_net_set_tx_coalescing(virtio_net_t *net, unsigned int max_packets)
+{
+    return net_virtio_emul_set_tx_coalescing(net->emul, max_packets);
+}
+
+void virtio_net_flush_tx(virtio_net_t *net)
+{
+    net_virtio_emul_flush_tx(net->emul);
+}
+
+/* Backend functions interposed on during a benchmark, forwarding to those of the device */
+static int bench_raw_tx(struct eth_driver *driver, unsigned int num, uintptr_t *phys, unsigned int *len, void *cookie)
+{
+    virtio_net_t *net = (virtio_net_t *)driver->eth_data;
+    net->bench->packets++;
+    for (int i = 0; i < num; i++) {
+        net->bench->bytes += len[i];
+    }
+    return net->emul_driver_funcs.raw_tx(driver, num, phys, len, cookie);
+}
+
+static void bench_raw_handle_irq(struct eth_driver *driver, int irq)
+{
+    virtio_net_t *net = (virtio_net_t *)driver->eth_data;
+    net->bench->interrupts++;
+    net->emul_driver_funcs.raw_handleIRQ(driver, irq);
+}
+
+/* Total exits of the VM's vcpus and the ticks spent handling them and notifications, 0 without exit stats */
+static void bench_exit_totals(vm_t *vm, uint64_t *exits, uint64_t *vmm_ticks)
+{
+    vm_exit_stats_t stats;
+    *exits = 0;
+    *vmm_ticks = 0;
+    for (int i = 0; i < vm->num_vcpus; i++) {
+        if (!vm->vcpus[i] || !vm->vcpus[i]->exit_stats || vm_get_exit_stats(vm->vcpus[i], &stats)) {
+            continue;
+        }
+        for (int j = 0; j < ARRAY_SIZE(stats.exits); j++) {
+            *exits += stats.exits[j].count;
+            *vmm_ticks += stats.exits[j].total_cycles;
+        }
+        *vmm_ticks += stats.notifications.total_cycles;
+    }
+}
+
+int virtio_net_bench_start(virtio_net_t *net, virtio_net_bench_t *bench)
+{
+    if (!net || !bench || net->bench) {
+        ZF_LOGE("Failed to start virtio net benchmark: Invalid device or already running");
+        return -1;
+    }
+    memset(bench, 0, sizeof(*bench));
+    bench_exit_totals(net->emul->vm, &bench->exits, &bench->vmm_ticks);
+    net->bench = bench;
+    for (int i = 0; i < net->num_queue_pairs; i++) {
+        net->emul_drivers[i]->i_fn.raw_tx = bench_raw_tx;
+        net->emul_drivers[i]->i_fn.raw_handleIRQ = bench_raw_handle_irq;
+    }
+    return 0;
+}
+
+int virtio_net_bench_stop(virtio_net_t *net, uint64_t elapsed_ns)
+{
+    if (!net || !net->bench) {
+        ZF_LOGE("Failed to stop virtio net benchmark: Not running");
+        return -1;
+    }
+    virtio_net_bench_t *bench = net->bench;
+    for (int i = 0; i < net->num_queue_pairs; i++) {
+        net->emul_drivers[i]->i_fn.raw_tx = net->emul_driver_funcs.raw_tx;
+        net->emul_drivers[i]->i_fn.raw_handleIRQ = net->emul_driver_funcs.raw_handleIRQ;
+    }
+    net->bench = NULL;
+    uint64_t exits, vmm_ticks;
+    bench_exit_totals(net->emul->vm, &exits, &vmm_ticks);
+    bench->exits = exits - bench->exits;
+    bench->vmm_ticks = vmm_ticks - bench->vmm_ticks;
+    bench->elapsed_ns = elapsed_ns;
+    return 0;
+}
+
+/* Print 'num / den' with two decimal places */
+static void bench_print_ratio(uint64_t num, uint64_t den)
+{
+    uint64_t hundredths = den ? num * 100 / den : 0;
+    printf(",%"PRIu64".%02"PRIu64, hundredths / 100, hundredths % 100);
+}
+
+void virtio_net_print_bench_results(virtio_net_bench_t *results, size_t num_results)
+{
+    printf("packet_size,packets,elapsed_ns,packets_per_sec,vmm_ticks_per_packet,exits_per_packet,"
+           "interrupts_per_packet\n");
+    for (size_t i = 0; i < num_results; i++) {
+        virtio_net_bench_t *result = &results[i];
+        uint64_t packet_size = result->packets ? result->bytes / result->packets : 0;
+        /* split the rate to not overflow the conversion of long windows */
+        uint64_t pps = result->elapsed_ns ? result->packets / result->elapsed_ns * NSEC_PER_SEC +
+                       result->packets % result->elapsed_ns * NSEC_PER_SEC / result->elapsed_ns : 0;
+        printf("%"PRIu64",%"PRIu64",%"PRIu64",%"PRIu64, packet_size, result->packets, result->elapsed_ns, pps);
+        bench_print_ratio(result->vmm_ticks, result->packets);
+        bench_print_ratio(result->exits, result->packets);
+        bench_print_ratio(result->interrupts, result->packets);
+        printf("\n");
+    }
+}
+
+/* Describe guest RAM to the backend, merging contiguous RAM regions */
+static int vhost_add_regions(vm_t *vm, struct virtio_vhost_shared *shared, vspace_t *backend_vspace)
+{
+    shared->num_regions = 0;
+    for (int i = 0; i < vm->mem.num_ram_regions; i++) {
+        struct vm_ram_region *ram = &vm->mem.ram_regions[i];
+        struct virtio_vhost_region *prev = shared->num_regions ? &shared->regions[shared->num_regions - 1] : NULL;
+        if (prev && prev->guest_addr + prev->size == ram->start) {
+            prev->size += ram->size;
+            continue;
+        }
+        if (shared->num_regions == VIRTIO_VHOST_MAX_REGIONS) {
+            ZF_LOGE("Guest RAM made up of more than %d regions", VIRTIO_VHOST_MAX_REGIONS);
+            return -1;
+        }
+        shared->regions[shared->num_regions++] = (struct virtio_vhost_region) {
+            .guest_addr = ram->start,
+            .size = ram->size,
+            .backend_addr = ram->start,
+        };
+    }
+    if (!backend_vspace) {
+        return 0;
+    }
+    for (int i = 0; i < shared->num_regions; i++) {
+        struct virtio_vhost_region *region = &shared->regions[i];
+        void *vaddr = vm_ram_share_vspace(vm, region->guest_addr, region->size, backend_vspace);
+        if (!vaddr) {
+            ZF_LOGE("Unable to map guest RAM at 0x%"PRIx64" into the backend", region->guest_addr);
+            return -1;
+        }
+        region->backend_addr = (uintptr_t)vaddr;
+    }
+    return 0;
+}
+
+/* Kick the backend straight from the queue notification registers, leaving other
+ * writes to the emulation. Failing to does not stop the backend from being kicked */
+static void vhost_add_doorbells(virtio_net_t *net)
+{
+    virtio_emul_t *emul = net->emul;
+    int err = 0;
+    for (int i = 0; i < emul->virtq.num_queues && !err; i++) {
+        if (emul->notify_addr) {
+            err = vm_register_mmio_doorbell(emul->vm, emul->notify_addr + i * emul->notify_stride, sizeof(uint16_t),
+                                            true, i, emul->vhost_kicks[i]);
+#ifdef CONFIG_ARCH_X86
+        } else if (net->iobase) {
+            err = vm_register_ioport_doorbell(emul->vm, net->iobase + VIRTIO_PCI_QUEUE_NOTIFY,
+                                              net->iobase + VIRTIO_PCI_QUEUE_NOTIFY + 1, true, i,
+                                              emul->vhost_kicks[i]);
+#endif
+        }
+    }
+    if (err) {
+        ZF_LOGW("Unable to register queue doorbells, guest kicks are forwarded by the emulation");
+    }
+}
+
+int virtio_net_enable_vhost(virtio_net_t *net, virtio_net_vhost_config_t *config)
+{
+    vm_t *vm = net->emul->vm;
+    if (!config->shared || !config->kicks) {
+        ZF_LOGE("Failed to enable vhost: No shared page or kick notifications");
+        return -1;
+    }
+    memset(config->shared, 0, sizeof(*config->shared));
+    if (vhost_add_regions(vm, config->shared, config->backend_vspace)) {
+        ZF_LOGE("Failed to enable vhost: Unable to describe guest RAM to the backend");
+        return -1;
+    }
+    int err = vm_bind_notification_irq(vm->vcpus[BOOT_VCPU], config->irq_badge, config->irq, config->irq_level,
+                                       config->resample);
+    if (err) {
+        ZF_LOGE("Failed to enable vhost: Unable to bind the backend's notification to IRQ %d", config->irq);
+        return -1;
+    }
+    err = virtio_emul_enable_vhost(net->emul, config->shared, config->kicks, config->num_kicks);
+    if (err) {
+        ZF_LOGE("Failed to enable vhost: Unable to offload the queues");
+        return -1;
+    }
+    vhost_add_doorbells(net);
+    return 0;
+}
+
+int virtio_net_queue_pair(virtio_net_t *net, struct eth_driver *driver)
+{
+    for (int i = 0; i < net->num_queue_pairs; i++) {
+        if (net->emul_drivers[i] == driver) {
+            return i;
+        }
+    }
+    return -1;
+}
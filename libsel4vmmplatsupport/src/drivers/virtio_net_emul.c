@@ -8,206 +8,621 @@
 #include <stdbool.h>
 
 #include "virtio_emul_helpers.h"
+#include "virtio_net_offload.h"
 
 #define BUF_SIZE 2048
 
-typedef struct ethif_virtio_emul_internal {
+/* Most receive chains a packet is merged across */
+#define NET_RX_MAX_MERGE 16
+
+/* Features offered to the guest. Checksums and segmentation the guest
+ * offloads are completed in software before packets reach the driver */
+#define NET_HOST_FEATURES (BIT(VIRTIO_NET_F_MAC) | BIT(VIRTIO_RING_F_EVENT_IDX) | BIT(VIRTIO_NET_F_CSUM) | \
+                           BIT(VIRTIO_NET_F_GUEST_CSUM) | BIT(VIRTIO_NET_F_HOST_TSO4) | \
+                           BIT(VIRTIO_NET_F_HOST_TSO6) | BIT(VIRTIO_NET_F_MRG_RXBUF))
+/* Features offered to the guest with multiple queue pairs */
+#define NET_HOST_FEATURES_MQ (NET_HOST_FEATURES | BIT(VIRTIO_NET_F_CTRL_VQ) | BIT(VIRTIO_NET_F_MQ))
+
+/* Device configuration space, following the common virtio registers */
+#define NET_CONFIG_MAC 0x14
+#define NET_CONFIG_STATUS 0x1a
+#define NET_CONFIG_MAX_QUEUE_PAIRS 0x1c
+
+/* Control queue commands, as defined by the virtio spec */
+#define NET_CTRL_OK 0
+#define NET_CTRL_ERR 1
+#define NET_CTRL_MQ 4
+#define NET_CTRL_MQ_VQ_PAIRS_SET 0
+
+/* A pinned packet buffer of BUF_SIZE bytes. Buffers are handed to the
+ * driver as their own cookies */
+typedef struct emul_buf {
+    struct emul_buf *next;
+    void *vaddr;
+    uintptr_t phys;
+    /* tx descriptor chain the buffer holds */
+    virtio_chain_t chain;
+} emul_buf_t;
+
+struct ethif_virtio_emul_internal;
+
+/* An rx/tx queue pair. Queue pairs share no mutable state, such that each can
+ * be serviced by its own thread */
+typedef struct ethif_queue_pair {
+    /* driver instance of the pair, whose callbacks are passed the pair */
     struct eth_driver driver;
+    virtio_emul_t *emul;
+    struct ethif_virtio_emul_internal *net;
+    unsigned int index;
+    unsigned int rx_queue;
+    unsigned int tx_queue;
+    /* preallocated packet buffers shared by the rx and tx paths */
+    emul_buf_t *bufs;
+    int num_bufs;
+    emul_buf_t *free_bufs;
+    int num_free;
+    /* outstanding driver transmits of each tx descriptor chain, indexed by
+     * chain id. A chain is used once all have completed */
+    uint16_t *tx_pending;
+    /* packet being segmented, allocated on the first segmentation offload */
+    uint8_t *tso_buf;
+    /* cookies of zero copy transmits, indexed by chain id. NULL unless zero
+     * copy transmit is enabled */
+    emul_buf_t *zero_copy_tx;
+    /* received packets written to the used ring but not yet published,
+     * from rx_used_idx up to rx_used_end */
+    uint16_t rx_used_idx;
+    uint16_t rx_used_end;
+    unsigned int rx_pending;
+    /* completed transmits written to the used ring but not yet published,
+     * from tx_used_idx up to tx_used_end */
+    uint16_t tx_used_idx;
+    uint16_t tx_used_end;
+    unsigned int tx_done;
+} ethif_queue_pair_t;
+
+typedef struct ethif_virtio_emul_internal {
     uint8_t mac[6];
     ps_dma_man_t dma_man;
+    int queue_size;
+    /* number of received packets to publish at once */
+    unsigned int rx_coalesce_packets;
+    /* number of completed transmits to publish at once */
+    unsigned int tx_coalesce_packets;
+    unsigned int num_pairs;
+    /* queue pairs the guest has enabled through the control queue */
+    unsigned int active_pairs;
+    ethif_queue_pair_t pairs[VIRTIO_MAX_QUEUE_PAIRS];
 } ethif_internal_t;
 
-typedef struct emul_tx_cookie {
-    uint16_t desc_head;
-    void *vaddr;
-} emul_tx_cookie_t;
+static emul_buf_t *emul_buf_get(ethif_queue_pair_t *pair)
+{
+    emul_buf_t *buf = pair->free_bufs;
+    if (buf) {
+        pair->free_bufs = buf->next;
+        pair->num_free--;
+    }
+    return buf;
+}
+
+static void emul_buf_put(ethif_queue_pair_t *pair, emul_buf_t *buf)
+{
+    buf->next = pair->free_bufs;
+    pair->free_bufs = buf;
+    pair->num_free++;
+}
+
+static void emul_buf_pool_destroy(ethif_queue_pair_t *pair)
+{
+    ps_dma_man_t *dma_man = &pair->net->dma_man;
+    for (int i = 0; i < pair->num_bufs; i++) {
+        if (pair->bufs[i].vaddr) {
+            ps_dma_unpin(dma_man, pair->bufs[i].vaddr, BUF_SIZE);
+            ps_dma_free(dma_man, pair->bufs[i].vaddr, BUF_SIZE);
+        }
+    }
+    free(pair->bufs);
+    free(pair->tx_pending);
+    free(pair->tso_buf);
+    pair->bufs = NULL;
+    pair->num_bufs = 0;
+    pair->free_bufs = NULL;
+    pair->num_free = 0;
+    pair->tx_pending = NULL;
+    pair->tso_buf = NULL;
+}
+
+/* Allocate and pin 'num_bufs' packet buffers up front, so the rx and tx paths
+ * never have to go to the dma allocator */
+static int emul_buf_pool_init(ethif_queue_pair_t *pair, int num_bufs)
+{
+    ps_dma_man_t *dma_man = &pair->net->dma_man;
+    pair->bufs = calloc(num_bufs, sizeof(emul_buf_t));
+    if (!pair->bufs) {
+        ZF_LOGE("Failed to allocate packet buffer pool");
+        return -1;
+    }
+    pair->num_bufs = num_bufs;
+    pair->tx_pending = calloc(pair->net->queue_size, sizeof(uint16_t));
+    if (!pair->tx_pending) {
+        ZF_LOGE("Failed to allocate tx completion counts");
+        emul_buf_pool_destroy(pair);
+        return -1;
+    }
+    for (int i = 0; i < num_bufs; i++) {
+        emul_buf_t *buf = &pair->bufs[i];
+        buf->vaddr = ps_dma_alloc(dma_man, BUF_SIZE, pair->driver.dma_alignment, 1, PS_MEM_NORMAL);
+        if (!buf->vaddr) {
+            ZF_LOGE("Failed to allocate packet buffer %d of %d", i, num_bufs);
+            emul_buf_pool_destroy(pair);
+            return -1;
+        }
+        buf->phys = ps_dma_pin(dma_man, buf->vaddr, BUF_SIZE);
+        if (!buf->phys) {
+            ZF_LOGE("Failed to pin packet buffer %d of %d", i, num_bufs);
+            ps_dma_free(dma_man, buf->vaddr, BUF_SIZE);
+            buf->vaddr = NULL;
+            emul_buf_pool_destroy(pair);
+            return -1;
+        }
+        emul_buf_put(pair, buf);
+    }
+    return 0;
+}
 
 static uintptr_t emul_allocate_rx_buf(void *iface, size_t buf_size, void **cookie)
 {
-    virtio_emul_t *emul = (virtio_emul_t *)iface;
-    ethif_internal_t *net = emul->internal;
+    ethif_queue_pair_t *pair = (ethif_queue_pair_t *)iface;
     if (buf_size > BUF_SIZE) {
         return 0;
     }
-    void *vaddr = ps_dma_alloc(&net->dma_man, BUF_SIZE, net->driver.dma_alignment, 1, PS_MEM_NORMAL);
-    if (!vaddr) {
+    emul_buf_t *buf = emul_buf_get(pair);
+    if (!buf) {
         return 0;
     }
-    uintptr_t phys = ps_dma_pin(&net->dma_man, vaddr, BUF_SIZE);
-    *cookie = vaddr;
-    return phys;
+    *cookie = buf;
+    return buf->phys;
+}
+
+static void emul_rx_flush(ethif_queue_pair_t *pair)
+{
+    virtio_emul_t *emul = pair->emul;
+    if (!pair->rx_pending) {
+        return;
+    }
+    uint16_t old_idx = pair->rx_used_idx;
+    uint16_t new_idx = pair->rx_used_end;
+    ring_used_publish(emul, pair->rx_queue, new_idx);
+    pair->rx_pending = 0;
+    /* keep rx kicks suppressed as the guest refills the ring */
+    ring_avail_notify_disable(emul, pair->rx_queue, emul->virtq.last_idx[pair->rx_queue]);
+    /* notify the guest that there is something in its used ring */
+    if (ring_need_interrupt(emul, pair->rx_queue, old_idx, new_idx)) {
+        pair->driver.i_fn.raw_handleIRQ(&pair->driver, pair->index);
+    }
+}
+
+/* Length of the virtio net header preceding packets in both directions. It
+ * always has the number of buffers field with virtio 1.0 */
+static size_t net_hdr_len(virtio_emul_t *emul)
+{
+    if (emul->virtq.features & (BIT(VIRTIO_NET_F_MRG_RXBUF) | (1ull << VIRTIO_F_VERSION_1))) {
+        return sizeof(struct virtio_net_hdr_mrg_rxbuf);
+    }
+    return sizeof(struct virtio_net_hdr);
+}
+
+/* Populate 'out' with the part of a host iovec following its first 'offset'
+ * bytes. Returns the number of entries populated */
+static int host_iov_slice(const vm_host_iovec_t *iov, int iovcnt, size_t offset, vm_host_iovec_t *out)
+{
+    int num = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (offset >= iov[i].len) {
+            offset -= iov[i].len;
+            continue;
+        }
+        out[num].base = (uint8_t *)iov[i].base + offset;
+        out[num].len = iov[i].len - offset;
+        offset = 0;
+        num++;
+    }
+    return num;
 }
 
 static void emul_rx_complete(void *iface, unsigned int num_bufs, void **cookies, unsigned int *lens)
 {
-    virtio_emul_t *emul = (virtio_emul_t *)iface;
-    ethif_internal_t *net = (ethif_internal_t *)emul->internal;
+    ethif_queue_pair_t *pair = (ethif_queue_pair_t *)iface;
+    virtio_emul_t *emul = pair->emul;
     vqueue_t *vq = &emul->virtq;
     int i;
-    struct vring *vring = &vq->vring[RX_QUEUE];
+    bool mergeable = vq->features & BIT(VIRTIO_NET_F_MRG_RXBUF);
 
-    /* grab the next receive chain */
-    struct virtio_net_hdr virtio_hdr;
+    /* the virtio net header precedes the packet buffers */
+    struct virtio_net_hdr_mrg_rxbuf virtio_hdr;
     memset(&virtio_hdr, 0, sizeof(virtio_hdr));
-    uint16_t guest_idx = ring_avail_idx(emul, vring);
-    uint16_t idx = vq->last_idx[RX_QUEUE];
-    if (idx != guest_idx) {
-        /* total length of the written packet so far */
-        size_t tot_written = 0;
-        /* amount of the current descriptor written */
-        size_t desc_written = 0;
-        /* how much we have written of the current buffer */
-        size_t buf_written = 0;
-        /* the current buffer. -1 indicates the virtio net buffer */
-        int current_buf = -1;
-        uint16_t desc_head = ring_avail(emul, vring, idx);
-        /* start walking the descriptors */
-        struct vring_desc desc;
-        uint16_t desc_idx = desc_head;
-        do {
-            desc = ring_desc(emul, vring, desc_idx);
-            /* determine how much we can copy */
-            uint32_t copy;
-            void *buf_base = NULL;
-            if (current_buf == -1) {
-                copy = sizeof(struct virtio_net_hdr) - buf_written;
-                buf_base = &virtio_hdr;
-            } else {
-                copy = lens[current_buf] - buf_written;
-                buf_base = cookies[current_buf];
-            }
-            copy = MIN(copy, desc.len - desc_written);
-            vm_guest_write_mem(emul->vm, buf_base + buf_written, (uintptr_t)desc.addr + desc_written, copy);
-            /* update amounts */
-            tot_written += copy;
-            desc_written += copy;
-            buf_written += copy;
-            /* see what's gone over */
-            if (desc_written == desc.len) {
-                if (!desc.flags & VRING_DESC_F_NEXT) {
-                    /* descriptor chain is too short to hold the whole packet.
-                     * just truncate */
-                    break;
-                }
-                desc_idx = desc.next;
-                desc_written = 0;
-            }
-            if (current_buf == -1) {
-                if (buf_written == sizeof(struct virtio_net_hdr)) {
-                    current_buf++;
-                    buf_written = 0;
-                }
-            } else {
-                if (buf_written == lens[current_buf]) {
-                    current_buf++;
-                    buf_written = 0;
-                }
-            }
-        } while (current_buf < num_bufs);
-        /* now put it in the used ring */
-        struct vring_used_elem used_elem = {desc_head, tot_written};
-        ring_used_add(emul, vring, used_elem);
+    virtio_hdr.num_buffers = 1;
+    vm_host_iovec_t host_iov[num_bufs + 1];
+    host_iov[0].base = &virtio_hdr;
+    host_iov[0].len = net_hdr_len(emul);
+    size_t pkt_len = host_iov[0].len;
+    for (i = 0; i < num_bufs; i++) {
+        host_iov[i + 1].base = ((emul_buf_t *)cookies[i])->vaddr;
+        host_iov[i + 1].len = lens[i];
+        pkt_len += lens[i];
+    }
+
+    /* write the packet across as many receive chains as it takes, which with
+     * mergeable rx buffers may be several. Nothing is visible to the guest
+     * until the chains are put in the used ring */
+    uint16_t idx = vq->last_idx[pair->rx_queue];
+    unsigned int max_chains = mergeable ? NET_RX_MAX_MERGE : 1;
+    virtio_chain_t chains[NET_RX_MAX_MERGE];
+    uint32_t chain_lens[NET_RX_MAX_MERGE];
+    /* the first chain is kept to update the header once the number of chains is known */
+    vm_guest_iovec_t first_iov[VIRTIO_MAX_CHAIN_DESCS];
+    int first_iovcnt = 0;
+    unsigned int num_chains = 0;
+    size_t tot_written = 0;
+    while (tot_written < pkt_len && num_chains < max_chains) {
+        vm_guest_iovec_t guest_iov[VIRTIO_MAX_CHAIN_DESCS];
+        vm_guest_iovec_t *chain_guest_iov = num_chains ? guest_iov : first_iov;
+        vm_host_iovec_t chain_iov[num_bufs + 1];
+        int guest_iovcnt = ring_avail_chain(emul, pair->rx_queue, idx, &chains[num_chains], chain_guest_iov,
+                                            VIRTIO_MAX_CHAIN_DESCS);
+        if (!guest_iovcnt) {
+            break;
+        }
+        idx += chains[num_chains].num;
+        int chain_iovcnt = host_iov_slice(host_iov, num_bufs + 1, tot_written, chain_iov);
+        size_t written = 0;
+        vm_guest_writev(emul->vm, chain_iov, chain_iovcnt, chain_guest_iov, guest_iovcnt, &written);
+        if (!num_chains) {
+            first_iovcnt = guest_iovcnt;
+        }
+        chain_lens[num_chains] = written;
+        tot_written += written;
+        num_chains++;
+    }
+    /* a packet that does not fit in the chains available is dropped rather
+     * than handed to the guest truncated */
+    if (num_chains && tot_written == pkt_len) {
+        if (num_chains > 1) {
+            virtio_hdr.num_buffers = num_chains;
+            size_t written = 0;
+            vm_guest_writev(emul->vm, host_iov, 1, first_iov, first_iovcnt, &written);
+        }
+        /* put the chains in the used ring, behind any packets not yet published */
+        if (!pair->rx_pending) {
+            pair->rx_used_idx = ring_used_idx(emul, pair->rx_queue);
+            pair->rx_used_end = pair->rx_used_idx;
+        }
+        for (i = 0; i < num_chains; i++) {
+            pair->rx_used_end += ring_used_write(emul, pair->rx_queue, pair->rx_used_end, &chains[i], chain_lens[i]);
+            pair->rx_pending++;
+        }
 
-        /* record that we've used this descriptor chain now */
-        vq->last_idx[RX_QUEUE]++;
-        /* notify the guest that there is something in its used ring */
-        net->driver.i_fn.raw_handleIRQ(&net->driver, 0);
+        /* record that we've used these descriptor chains now */
+        vq->last_idx[pair->rx_queue] = idx;
+        /* publish a full batch, or early if the guest has run out of buffers
+         * and needs to see the used ones to refill the ring */
+        if (pair->rx_pending >= pair->net->rx_coalesce_packets || !ring_avail_ready(emul, pair->rx_queue, idx)) {
+            emul_rx_flush(pair);
+        }
     }
     for (i = 0; i < num_bufs; i++) {
-        ps_dma_unpin(&net->dma_man, cookies[i], BUF_SIZE);
-        ps_dma_free(&net->dma_man, cookies[i], BUF_SIZE);
+        emul_buf_put(pair, cookies[i]);
     }
 }
 
-static void emul_tx_complete(void *iface, void *cookie)
+static void emul_tx_flush(ethif_queue_pair_t *pair)
 {
-    virtio_emul_t *emul = (virtio_emul_t *)iface;
-    ethif_internal_t *net = emul->internal;
-    emul_tx_cookie_t *tx_cookie = (emul_tx_cookie_t *)cookie;
-    /* free the dma memory */
-    ps_dma_unpin(&net->dma_man, tx_cookie->vaddr, BUF_SIZE);
-    ps_dma_free(&net->dma_man, tx_cookie->vaddr, BUF_SIZE);
-    /* put the descriptor chain into the used list */
-    struct vring_used_elem used_elem = {tx_cookie->desc_head, 0};
-    ring_used_add(emul, &emul->virtq.vring[TX_QUEUE], used_elem);
-    free(tx_cookie);
+    virtio_emul_t *emul = pair->emul;
+    if (!pair->tx_done) {
+        return;
+    }
+    uint16_t old_idx = pair->tx_used_idx;
+    uint16_t new_idx = pair->tx_used_end;
+    ring_used_publish(emul, pair->tx_queue, new_idx);
+    pair->tx_done = 0;
     /* notify the guest that we have completed some of its buffers */
-    net->driver.i_fn.raw_handleIRQ(&net->driver, 0);
+    if (ring_need_interrupt(emul, pair->tx_queue, old_idx, new_idx)) {
+        pair->driver.i_fn.raw_handleIRQ(&pair->driver, pair->index);
+    }
 }
 
-static void emul_notify_tx(virtio_emul_t *emul)
+/* Whether the guest has most of its tx ring tied up in chains it has not
+ * been given back, and is about to run out of descriptors to send with */
+static bool emul_tx_ring_low(ethif_queue_pair_t *pair)
 {
-    ethif_internal_t *net = (ethif_internal_t *)emul->internal;
-    struct vring *vring = &emul->virtq.vring[TX_QUEUE];
-    /* read the index */
-    uint16_t guest_idx = ring_avail_idx(emul, vring);
+    virtio_emul_t *emul = pair->emul;
+    uint16_t in_flight = emul->virtq.last_idx[pair->tx_queue] - ring_used_idx(emul, pair->tx_queue);
+    return in_flight >= pair->net->queue_size - pair->net->queue_size / 4;
+}
+
+/* Put a tx descriptor chain into the used list, behind any completed
+ * transmits not yet published */
+static void emul_tx_chain_done(ethif_queue_pair_t *pair, const virtio_chain_t *chain)
+{
+    virtio_emul_t *emul = pair->emul;
+    if (!pair->tx_done) {
+        pair->tx_used_idx = ring_used_idx(emul, pair->tx_queue);
+        pair->tx_used_end = pair->tx_used_idx;
+    }
+    pair->tx_used_end += ring_used_write(emul, pair->tx_queue, pair->tx_used_end, chain, 0);
+    pair->tx_done++;
+    /* publish a full batch, or early if the guest is running out of
+     * descriptors and needs the used ones back */
+    if (pair->tx_done >= pair->net->tx_coalesce_packets || emul_tx_ring_low(pair)) {
+        emul_tx_flush(pair);
+    }
+}
+
+static void emul_tx_complete(void *iface, void *cookie)
+{
+    ethif_queue_pair_t *pair = (ethif_queue_pair_t *)iface;
+    emul_buf_t *buf = (emul_buf_t *)cookie;
+    virtio_chain_t chain = buf->chain;
+    /* return the buffer to the pool, zero copy cookies have no buffer */
+    if (buf->vaddr) {
+        emul_buf_put(pair, buf);
+    }
+    /* a segmented packet's chain is used once its last segment is sent */
+    uint16_t *pending = &pair->tx_pending[chain.id % pair->net->queue_size];
+    assert(*pending);
+    if (--(*pending) == 0) {
+        emul_tx_chain_done(pair, &chain);
+    }
+}
+
+/* Hand a packet buffer to the driver. A transmit the driver fails is dropped */
+static void emul_buf_tx(ethif_queue_pair_t *pair, emul_buf_t *buf, const virtio_chain_t *chain, unsigned int len)
+{
+    buf->chain = *chain;
+    int result = pair->driver.i_fn.raw_tx(&pair->driver, 1, &buf->phys, &len, buf);
+    if (result != ETHIF_TX_ENQUEUED) {
+        emul_tx_complete(pair, buf);
+    }
+}
+
+/* Hand a descriptor chain to the driver as is, skipping the virtio net
+ * header. Returns the result of the driver's transmit */
+static int emul_zero_copy_tx(ethif_queue_pair_t *pair, const virtio_chain_t *chain, vm_guest_iovec_t *guest_iov,
+                             int guest_iovcnt)
+{
+    uintptr_t phys[VIRTIO_MAX_CHAIN_DESCS];
+    unsigned int len[VIRTIO_MAX_CHAIN_DESCS];
+    unsigned int num = 0;
+    size_t hdr_left = net_hdr_len(pair->emul);
+    emul_buf_t *cookie = &pair->zero_copy_tx[chain->id % pair->net->queue_size];
+
+    cookie->chain = *chain;
+    for (int i = 0; i < guest_iovcnt; i++) {
+        size_t skip = MIN(hdr_left, guest_iov[i].len);
+        hdr_left -= skip;
+        if (guest_iov[i].len == skip) {
+            continue;
+        }
+        /* guest physical addresses are device addresses in zero copy mode */
+        phys[num] = guest_iov[i].addr + skip;
+        len[num] = guest_iov[i].len - skip;
+        num++;
+    }
+    if (!num) {
+        /* nothing but the header, there is no packet to send */
+        return ETHIF_TX_COMPLETE;
+    }
+    return pair->driver.i_fn.raw_tx(&pair->driver, num, phys, len, cookie);
+}
+
+/* Copy the packet of a descriptor chain into a packet buffer, completing any
+ * checksum the guest has left to us. Returns 0 if the chain was consumed, or
+ * -1 to try again once a transmit completes */
+static int emul_copy_tx(ethif_queue_pair_t *pair, const virtio_chain_t *chain, vm_guest_iovec_t *guest_iov,
+                        int guest_iovcnt)
+{
+    virtio_emul_t *emul = pair->emul;
+    /* take a packet buffer from the pool */
+    emul_buf_t *buf = emul_buf_get(pair);
+    if (!buf) {
+        return -1;
+    }
+    /* we want to skip the initial virtio header, as this should
+     * not be sent to the actual ethernet driver. Packets that are
+     * too large are truncated */
+    struct virtio_net_hdr_mrg_rxbuf virtio_hdr;
+    size_t hdr_len = net_hdr_len(emul);
+    vm_host_iovec_t host_iov[2] = {
+        { .base = &virtio_hdr, .len = hdr_len },
+        { .base = buf->vaddr, .len = BUF_SIZE }
+    };
+    size_t copied = 0;
+    vm_guest_readv(emul->vm, host_iov, 2, guest_iov, guest_iovcnt, &copied);
+    /* length of the final packet to deliver */
+    uint32_t len = copied > hdr_len ? copied - hdr_len : 0;
+    if ((emul->virtq.features & BIT(VIRTIO_NET_F_CSUM)) && (virtio_hdr.hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)) {
+        if (net_tx_csum(buf->vaddr, len, virtio_hdr.hdr.csum_start, virtio_hdr.hdr.csum_offset)) {
+            ZF_LOGW("Sending packet with checksum offsets outside of the packet");
+        }
+    }
+    /* ship it */
+    pair->tx_pending[chain->id % pair->net->queue_size] = 1;
+    emul_buf_tx(pair, buf, chain, len);
+    return 0;
+}
+
+/* Cut a packet the guest has offloaded segmentation of into segments of at
+ * most gso_size bytes of payload. Returns 0 if the chain was consumed, or -1
+ * to try again once enough transmits complete */
+static int emul_tso_tx(ethif_queue_pair_t *pair, const virtio_chain_t *chain, vm_guest_iovec_t *guest_iov,
+                       int guest_iovcnt, struct virtio_net_hdr *hdr)
+{
+    virtio_emul_t *emul = pair->emul;
+    if (!pair->tso_buf) {
+        pair->tso_buf = malloc(NET_TSO_MAX_PACKET);
+        if (!pair->tso_buf) {
+            ZF_LOGE("Failed to allocate segmentation buffer, dropping packet");
+            emul_tx_chain_done(pair, chain);
+            return 0;
+        }
+    }
+    struct virtio_net_hdr_mrg_rxbuf virtio_hdr;
+    size_t hdr_len = net_hdr_len(emul);
+    vm_host_iovec_t host_iov[2] = {
+        { .base = &virtio_hdr, .len = hdr_len },
+        { .base = pair->tso_buf, .len = NET_TSO_MAX_PACKET }
+    };
+    size_t copied = 0;
+    vm_guest_readv(emul->vm, host_iov, 2, guest_iov, guest_iovcnt, &copied);
+    size_t len = copied > hdr_len ? copied - hdr_len : 0;
+    net_tso_t tso;
+    if (net_tso_prepare(pair->tso_buf, len, hdr, &tso) || tso.hdr_len + tso.mss > BUF_SIZE ||
+        tso.num_segs > pair->num_bufs) {
+        ZF_LOGW("Dropping packet that cannot be segmented");
+        emul_tx_chain_done(pair, chain);
+        return 0;
+    }
+    if (tso.num_segs > pair->num_free) {
+        return -1;
+    }
+    pair->tx_pending[chain->id % pair->net->queue_size] = tso.num_segs;
+    for (unsigned int seg = 0; seg < tso.num_segs; seg++) {
+        emul_buf_t *buf = emul_buf_get(pair);
+        size_t seg_len = net_tso_segment(pair->tso_buf, &tso, seg, buf->vaddr);
+        emul_buf_tx(pair, buf, chain, seg_len);
+    }
+    return 0;
+}
+
+static void emul_notify_pair_tx(ethif_queue_pair_t *pair)
+{
+    virtio_emul_t *emul = pair->emul;
+    bool offloads = emul->virtq.features & BIT(VIRTIO_NET_F_CSUM);
     /* process what we can of the ring */
-    uint16_t idx = emul->virtq.last_idx[TX_QUEUE];
-    while (idx != guest_idx) {
-        uint16_t desc_head;
-        /* read the head of the descriptor chain */
-        desc_head = ring_avail(emul, vring, idx);
-        /* allocate a packet */
-        void *vaddr = ps_dma_alloc(&net->dma_man, BUF_SIZE, net->driver.dma_alignment, 1, PS_MEM_NORMAL);
-        if (!vaddr) {
-            /* try again later */
+    uint16_t idx = emul->virtq.last_idx[pair->tx_queue];
+    while (true) {
+        /* read the next descriptor chain */
+        virtio_chain_t chain;
+        vm_guest_iovec_t guest_iov[VIRTIO_MAX_CHAIN_DESCS];
+        int guest_iovcnt = ring_avail_chain(emul, pair->tx_queue, idx, &chain, guest_iov, VIRTIO_MAX_CHAIN_DESCS);
+        if (!guest_iovcnt) {
             break;
         }
-        uintptr_t phys = ps_dma_pin(&net->dma_man, vaddr, BUF_SIZE);
-        assert(phys);
-        /* length of the final packet to deliver */
-        uint32_t len = 0;
-        /* we want to skip the initial virtio header, as this should
-         * not be sent to the actual ethernet driver. This records
-         * how much we have skipped so far. */
-        uint32_t skipped = 0;
-        /* start walking the descriptors */
-        struct vring_desc desc;
-        uint16_t desc_idx = desc_head;
-        do {
-            desc = ring_desc(emul, vring, desc_idx);
-            uint32_t skip = 0;
-            /* if we haven't yet skipped the full virtio net header, work
-             * out how much of this descriptor should be skipped */
-            if (skipped < sizeof(struct virtio_net_hdr)) {
-                skip = MIN(sizeof(struct virtio_net_hdr) - skipped, desc.len);
-                skipped += skip;
+        /* packets with offloads need touching up before they can be sent */
+        struct virtio_net_hdr hdr = {0};
+        if (offloads) {
+            vm_host_iovec_t host_iov = { .base = &hdr, .len = sizeof(hdr) };
+            size_t copied = 0;
+            vm_guest_readv(emul->vm, &host_iov, 1, guest_iov, guest_iovcnt, &copied);
+        }
+        int err;
+        if (hdr.gso_type != VIRTIO_NET_HDR_GSO_NONE) {
+            err = emul_tso_tx(pair, &chain, guest_iov, guest_iovcnt, &hdr);
+        } else if (pair->zero_copy_tx && !(hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)) {
+            /* the chain is in use by the driver until the transmit completes */
+            pair->tx_pending[chain.id % pair->net->queue_size] = 1;
+            int result = emul_zero_copy_tx(pair, &chain, guest_iov, guest_iovcnt);
+            if (result == ETHIF_TX_COMPLETE) {
+                emul_tx_complete(pair, &pair->zero_copy_tx[chain.id % pair->net->queue_size]);
+            } else if (result == ETHIF_TX_FAILED) {
+                pair->tx_pending[chain.id % pair->net->queue_size] = 0;
             }
-            /* truncate packets that are too large */
-            uint32_t this_len = desc.len - skip;
-            this_len = MIN(BUF_SIZE - len, this_len);
-            vm_guest_read_mem(emul->vm, vaddr + len, (uintptr_t)desc.addr + skip, this_len);
-            len += this_len;
-            desc_idx = desc.next;
-        } while (desc.flags & VRING_DESC_F_NEXT);
-        /* ship it */
-        emul_tx_cookie_t *cookie = calloc(1, sizeof(*cookie));
-        assert(cookie);
-        cookie->desc_head = desc_head;
-        cookie->vaddr = vaddr;
-        int result = net->driver.i_fn.raw_tx(&net->driver, 1, &phys, &len, cookie);
-        switch (result) {
-        case ETHIF_TX_COMPLETE:
-            emul_tx_complete(emul, cookie);
-            break;
-        case ETHIF_TX_FAILED:
-            ps_dma_unpin(&net->dma_man, vaddr, BUF_SIZE);
-            ps_dma_free(&net->dma_man, vaddr, BUF_SIZE);
-            free(cookie);
+            err = result == ETHIF_TX_FAILED ? -1 : 0;
+        } else {
+            err = emul_copy_tx(pair, &chain, guest_iov, guest_iovcnt);
+        }
+        if (err) {
+            /* try again once a transmit completes */
             break;
         }
         /* next */
-        idx++;
+        idx += chain.num;
     }
     /* update which parts of the ring we have processed */
-    emul->virtq.last_idx[TX_QUEUE] = idx;
+    emul->virtq.last_idx[pair->tx_queue] = idx;
+    /* have the guest notify us of the next packet it adds */
+    ring_avail_event_set(emul, pair->tx_queue, idx);
+}
+
+/* Process the requests of the control queue */
+static void emul_notify_ctrl(virtio_emul_t *emul)
+{
+    ethif_internal_t *net = (ethif_internal_t *)emul->internal;
+    unsigned int queue = emul->virtq.num_queues - 1;
+    uint16_t idx = emul->virtq.last_idx[queue];
+    uint16_t old_used_idx = ring_used_idx(emul, queue);
+    uint16_t used_idx = old_used_idx;
+    while (true) {
+        virtio_chain_t chain;
+        vm_guest_iovec_t guest_iov[VIRTIO_MAX_CHAIN_DESCS];
+        int guest_iovcnt = ring_avail_chain(emul, queue, idx, &chain, guest_iov, VIRTIO_MAX_CHAIN_DESCS);
+        if (!guest_iovcnt) {
+            break;
+        }
+        /* a class and command, followed by the command's data and an
+         * acknowledgement to write back in the last descriptor */
+        uint8_t cmd[4] = {0};
+        size_t cmd_len = 0;
+        uint8_t ack = NET_CTRL_ERR;
+        if (guest_iovcnt > 1) {
+            vm_host_iovec_t host_iov = { .base = cmd, .len = sizeof(cmd) };
+            vm_guest_readv(emul->vm, &host_iov, 1, guest_iov, guest_iovcnt - 1, &cmd_len);
+        }
+        if (cmd_len >= 4 && cmd[0] == NET_CTRL_MQ && cmd[1] == NET_CTRL_MQ_VQ_PAIRS_SET) {
+            uint16_t pairs = cmd[2] | (cmd[3] << 8);
+            if (pairs >= 1 && pairs <= net->num_pairs) {
+                net->active_pairs = pairs;
+                ack = NET_CTRL_OK;
+            }
+        }
+        vm_guest_write_mem(emul->vm, &ack, guest_iov[guest_iovcnt - 1].addr, sizeof(ack));
+        used_idx += ring_used_write(emul, queue, used_idx, &chain, sizeof(ack));
+        idx += chain.num;
+    }
+    emul->virtq.last_idx[queue] = idx;
+    ring_avail_event_set(emul, queue, idx);
+    if (used_idx != old_used_idx) {
+        ring_used_publish(emul, queue, used_idx);
+        if (ring_need_interrupt(emul, queue, old_used_idx, used_idx)) {
+            net->pairs[0].driver.i_fn.raw_handleIRQ(&net->pairs[0].driver, net->num_pairs);
+        }
+    }
+}
+
+/* Process a kick of the guest, handing back completed transmits before
+ * taking the chains it has queued */
+static void emul_kick_pair_tx(ethif_queue_pair_t *pair)
+{
+    emul_tx_flush(pair);
+    emul_notify_pair_tx(pair);
+}
+
+static void emul_notify_tx(virtio_emul_t *emul)
+{
+    ethif_internal_t *net = (ethif_internal_t *)emul->internal;
+    for (int i = 0; i < net->num_pairs; i++) {
+        emul_kick_pair_tx(&net->pairs[i]);
+    }
+}
+
+static void emul_notify_queue(virtio_emul_t *emul, unsigned int queue)
+{
+    ethif_internal_t *net = (ethif_internal_t *)emul->internal;
+    if (net->num_pairs > 1 && queue == emul->virtq.num_queues - 1) {
+        emul_notify_ctrl(emul);
+    } else if (queue % 2 == TX_QUEUE) {
+        emul_kick_pair_tx(&net->pairs[queue / 2]);
+    }
+    /* Currently RX packets will just get dropped if there was no space
+     * so we will never have work to do if the client suddenly adds
+     * more buffers */
 }
 
 static void emul_tx_complete_external(void *iface, void *cookie)
 {
     emul_tx_complete(iface, cookie);
     /* space may have cleared for additional transmits */
-    emul_notify_tx(iface);
+    emul_notify_pair_tx(iface);
 }
 
 static struct raw_iface_callbacks emul_callbacks = {
@@ -225,19 +640,111 @@ static int emul_notify(virtio_emul_t *emul)
     return 0;
 }
 
+int net_virtio_emul_enable_zero_copy_tx(virtio_emul_t *emul)
+{
+    ethif_internal_t *net = (ethif_internal_t *)emul->internal;
+    if (emul->virtq.status & VIRTIO_CONFIG_S_DRIVER_OK) {
+        ZF_LOGE("Failed to enable zero copy tx: Device already in use by the guest");
+        return -1;
+    }
+    for (int i = 0; i < net->num_pairs; i++) {
+        ethif_queue_pair_t *pair = &net->pairs[i];
+        if (pair->zero_copy_tx) {
+            continue;
+        }
+        pair->zero_copy_tx = calloc(net->queue_size, sizeof(emul_buf_t));
+        if (!pair->zero_copy_tx) {
+            ZF_LOGE("Failed to enable zero copy tx: Unable to allocate tx cookies");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int net_virtio_emul_set_rx_coalescing(virtio_emul_t *emul, unsigned int max_packets)
+{
+    ethif_internal_t *net = (ethif_internal_t *)emul->internal;
+    if (max_packets == 0 || max_packets > net->queue_size) {
+        ZF_LOGE("Failed to set rx coalescing: %u packets outside of 1 to the queue size %d", max_packets,
+                net->queue_size);
+        return -1;
+    }
+    net->rx_coalesce_packets = max_packets;
+    /* a smaller batch may already be due */
+    for (int i = 0; i < net->num_pairs; i++) {
+        if (net->pairs[i].rx_pending >= max_packets) {
+            emul_rx_flush(&net->pairs[i]);
+        }
+    }
+    return 0;
+}
+
+void net_virtio_emul_flush_rx(virtio_emul_t *emul)
+{
+    ethif_internal_t *net = (ethif_internal_t *)emul->internal;
+    for (int i = 0; i < net->num_pairs; i++) {
+        emul_rx_flush(&net->pairs[i]);
+    }
+}
+
+int net_virtio_emul_set_tx_coalescing(virtio_emul_t *emul, unsigned int max_packets)
+{
+    ethif_internal_t *net = (ethif_internal_t *)emul->internal;
+    if (max_packets == 0 || max_packets > net->queue_size) {
+        ZF_LOGE("Failed to set tx coalescing: %u packets outside of 1 to the queue size %d", max_packets,
+                net->queue_size);
+        return -1;
+    }
+    net->tx_coalesce_packets = max_packets;
+    /* a smaller batch may already be due */
+    for (int i = 0; i < net->num_pairs; i++) {
+        if (net->pairs[i].tx_done >= max_packets) {
+            emul_tx_flush(&net->pairs[i]);
+        }
+    }
+    return 0;
+}
+
+void net_virtio_emul_flush_tx(virtio_emul_t *emul)
+{
+    ethif_internal_t *net = (ethif_internal_t *)emul->internal;
+    for (int i = 0; i < net->num_pairs; i++) {
+        emul_tx_flush(&net->pairs[i]);
+    }
+}
+
+static uint32_t net_host_features(ethif_internal_t *net)
+{
+    return net->num_pairs > 1 ? NET_HOST_FEATURES_MQ : NET_HOST_FEATURES;
+}
+
 bool net_device_emul_io_in(struct virtio_emul *emul, unsigned int offset, unsigned int size, unsigned int *result)
 {
+    ethif_internal_t *net = (ethif_internal_t *)emul->internal;
     bool handled = false;
     switch (offset) {
     case VIRTIO_PCI_HOST_FEATURES:
         handled = true;
         assert(size == 4);
         //Net only
-        *result = BIT(VIRTIO_NET_F_MAC);
+        *result = net_host_features(net);
         break;
-    case 0x14 ... 0x19:
+    case NET_CONFIG_MAC ... NET_CONFIG_MAC + 5:
         assert(size == 1);
-        *result = ((ethif_internal_t *)emul->internal)->mac[offset - 0x14];
+        *result = net->mac[offset - NET_CONFIG_MAC];
+        handled = true;
+        break;
+    case NET_CONFIG_STATUS:
+    case NET_CONFIG_STATUS + 1:
+        /* no link status is reported without VIRTIO_NET_F_STATUS */
+        *result = 0;
+        handled = true;
+        break;
+    case NET_CONFIG_MAX_QUEUE_PAIRS:
+    case NET_CONFIG_MAX_QUEUE_PAIRS + 1:
+        /* legacy virtio mmio guests read the configuration a byte at a time */
+        assert(size + offset - NET_CONFIG_MAX_QUEUE_PAIRS <= 2);
+        *result = (net->num_pairs >> ((offset - NET_CONFIG_MAX_QUEUE_PAIRS) * 8)) & MASK(size * 8);
         handled = true;
         break;
     }
@@ -246,44 +753,78 @@ bool net_device_emul_io_in(struct virtio_emul *emul, unsigned int offset, unsign
 
 bool net_device_emul_io_out(struct virtio_emul *emul, unsigned int offset, unsigned int size, unsigned int value)
 {
+    ethif_internal_t *net = (ethif_internal_t *)emul->internal;
     bool handled = false;
     switch (offset) {
     case VIRTIO_PCI_GUEST_FEATURES:
         handled = true;
         assert(size == 4);
         //Net only
-        assert(value == BIT(VIRTIO_NET_F_MAC));
+        assert(!(value & ~net_host_features(net)));
+        emul->virtq.features = value;
         break;
     }
     return handled;
 }
 
-void *net_virtio_emul_init(virtio_emul_t *emul, ps_io_ops_t io_ops, ethif_driver_init driver, void *config)
+void *net_virtio_emul_init(virtio_emul_t *emul, ps_io_ops_t io_ops, int queue_size, unsigned int num_queue_pairs,
+                           ethif_driver_init driver, void *config)
 {
     ethif_internal_t *internal = NULL;
+    if (num_queue_pairs == 0 || num_queue_pairs > VIRTIO_MAX_QUEUE_PAIRS) {
+        ZF_LOGE("Invalid number of queue pairs %u", num_queue_pairs);
+        goto error;
+    }
     internal = calloc(1, sizeof(*internal));
     if (!internal) {
         goto error;
     }
     emul->notify = emul_notify_tx;
+    emul->notify_queue = emul_notify_queue;
+    emul->rx_tx_pairs = true;
     emul->device_io_in = net_device_emul_io_in;
     emul->device_io_out = net_device_emul_io_out;
-    internal->driver.cb_cookie = emul;
-    internal->driver.i_cb = emul_callbacks;
+    /* multiple queue pairs are followed by the control queue */
+    emul->virtq.num_queues = num_queue_pairs * 2 + (num_queue_pairs > 1 ? 1 : 0);
     internal->dma_man = io_ops.dma_manager;
-    int err = driver(&internal->driver, io_ops, config);
-    if (err) {
-        ZF_LOGE("Failed to initialize driver");
-        goto error;
+    internal->queue_size = queue_size;
+    internal->rx_coalesce_packets = 1;
+    internal->tx_coalesce_packets = 1;
+    internal->num_pairs = num_queue_pairs;
+    internal->active_pairs = 1;
+    for (int i = 0; i < num_queue_pairs; i++) {
+        ethif_queue_pair_t *pair = &internal->pairs[i];
+        pair->emul = emul;
+        pair->net = internal;
+        pair->index = i;
+        pair->rx_queue = VIRTIO_RX_QUEUE(i);
+        pair->tx_queue = VIRTIO_TX_QUEUE(i);
+        pair->driver.cb_cookie = pair;
+        pair->driver.i_cb = emul_callbacks;
+        int err = driver(&pair->driver, io_ops, config);
+        if (err) {
+            ZF_LOGE("Failed to initialize driver");
+            goto error;
+        }
+        /* enough buffers to have every descriptor of both queues in flight */
+        err = emul_buf_pool_init(pair, queue_size * 2);
+        if (err) {
+            goto error;
+        }
+        int mtu;
+        pair->driver.i_fn.low_level_init(&pair->driver, internal->mac, &mtu);
     }
-    int mtu;
-    internal->driver.i_fn.low_level_init(&internal->driver, internal->mac, &mtu);
     return (void *)internal;
 error:
     if (emul) {
         free(emul);
     }
     if (internal) {
+        for (int i = 0; i < internal->num_pairs; i++) {
+            if (internal->pairs[i].bufs) {
+                emul_buf_pool_destroy(&internal->pairs[i]);
+            }
+        }
         free(internal);
     }
     return NULL;
@@ -0,0 +1,200 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <string.h>
+
+#include <utils/util.h>
+
+#include "virtio_net_offload.h"
+
+#define ETH_HLEN 14
+#define ETH_P_IP 0x0800
+#define ETH_P_IPV6 0x86dd
+#define ETH_P_8021Q 0x8100
+#define VLAN_HLEN 4
+#define IPV6_HLEN 40
+#define IPPROTO_TCP 6
+#define TCP_HLEN 20
+
+#define TCP_FLAG_FIN 0x01
+#define TCP_FLAG_PSH 0x08
+#define TCP_FLAG_CWR 0x80
+
+static inline uint16_t get_be16(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static inline void put_be16(uint8_t *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static inline uint32_t get_be32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static inline void put_be32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+uint32_t net_csum_partial(const void *buf, size_t len, uint32_t sum)
+{
+    const uint8_t *p = buf;
+    /* Sum 32 bit words into a 64 bit accumulator, leaving the end around
+     * carries to the fold. Ones' complement sums are independent of byte
+     * order, so words are summed in native order */
+    uint64_t acc = sum;
+    while (len >= 16) {
+        uint32_t w[4];
+        memcpy(w, p, sizeof(w));
+        acc += (uint64_t)w[0] + w[1] + w[2] + w[3];
+        p += 16;
+        len -= 16;
+    }
+    while (len >= 4) {
+        uint32_t w;
+        memcpy(&w, p, sizeof(w));
+        acc += w;
+        p += 4;
+        len -= 4;
+    }
+    if (len >= 2) {
+        uint16_t h;
+        memcpy(&h, p, sizeof(h));
+        acc += h;
+        p += 2;
+        len -= 2;
+    }
+    if (len) {
+        /* a trailing byte is padded with zero to a 16 bit word */
+        uint8_t last[2] = { *p, 0 };
+        uint16_t h;
+        memcpy(&h, last, sizeof(h));
+        acc += h;
+    }
+    acc = (acc & 0xffffffff) + (acc >> 32);
+    acc = (acc & 0xffffffff) + (acc >> 32);
+    return acc;
+}
+
+uint16_t net_csum_fold(uint32_t sum)
+{
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return ~sum;
+}
+
+static void csum_store(uint8_t *field, uint16_t csum)
+{
+    memcpy(field, &csum, sizeof(csum));
+}
+
+int net_tx_csum(uint8_t *pkt, size_t len, uint16_t csum_start, uint16_t csum_offset)
+{
+    if (csum_start >= len || (size_t)csum_start + csum_offset + sizeof(uint16_t) > len) {
+        return -1;
+    }
+    /* the guest seeds the checksum field with the sum of the pseudo header */
+    csum_store(pkt + csum_start + csum_offset, net_csum_fold(net_csum_partial(pkt + csum_start, len - csum_start, 0)));
+    return 0;
+}
+
+int net_tso_prepare(const uint8_t *pkt, size_t len, const struct virtio_net_hdr *hdr, net_tso_t *tso)
+{
+    uint8_t gso_type = hdr->gso_type & ~VIRTIO_NET_HDR_GSO_ECN;
+    if ((gso_type != VIRTIO_NET_HDR_GSO_TCPV4 && gso_type != VIRTIO_NET_HDR_GSO_TCPV6) || !hdr->gso_size) {
+        return -1;
+    }
+    if (len < ETH_HLEN) {
+        return -1;
+    }
+    size_t l3 = ETH_HLEN;
+    uint16_t ethertype = get_be16(pkt + 12);
+    if (ethertype == ETH_P_8021Q) {
+        if (len < ETH_HLEN + VLAN_HLEN) {
+            return -1;
+        }
+        ethertype = get_be16(pkt + 16);
+        l3 += VLAN_HLEN;
+    }
+
+    size_t l4;
+    if (ethertype == ETH_P_IP && gso_type == VIRTIO_NET_HDR_GSO_TCPV4) {
+        if (len < l3 + 20 || (pkt[l3] >> 4) != 4 || pkt[l3 + 9] != IPPROTO_TCP) {
+            return -1;
+        }
+        l4 = l3 + (pkt[l3] & 0xf) * 4;
+        tso->ipv6 = false;
+    } else if (ethertype == ETH_P_IPV6 && gso_type == VIRTIO_NET_HDR_GSO_TCPV6) {
+        /* extension headers are not supported */
+        if (len < l3 + IPV6_HLEN || (pkt[l3] >> 4) != 6 || pkt[l3 + 6] != IPPROTO_TCP) {
+            return -1;
+        }
+        l4 = l3 + IPV6_HLEN;
+        tso->ipv6 = true;
+    } else {
+        return -1;
+    }
+    if (len < l4 + TCP_HLEN) {
+        return -1;
+    }
+    size_t hdr_len = l4 + (pkt[l4 + 12] >> 4) * 4;
+    if (hdr_len < l4 + TCP_HLEN || hdr_len > len) {
+        return -1;
+    }
+
+    tso->l3_offset = l3;
+    tso->l4_offset = l4;
+    tso->hdr_len = hdr_len;
+    tso->payload_len = len - hdr_len;
+    tso->mss = hdr->gso_size;
+    tso->num_segs = tso->payload_len ? DIV_ROUND_UP(tso->payload_len, tso->mss) : 1;
+    return 0;
+}
+
+size_t net_tso_segment(const uint8_t *pkt, const net_tso_t *tso, unsigned int seg, uint8_t *out)
+{
+    size_t offset = seg * tso->mss;
+    size_t seg_payload = MIN(tso->mss, tso->payload_len - offset);
+    memcpy(out, pkt, tso->hdr_len);
+    memcpy(out + tso->hdr_len, pkt + tso->hdr_len + offset, seg_payload);
+
+    uint8_t *ip = out + tso->l3_offset;
+    uint8_t *tcp = out + tso->l4_offset;
+    size_t tcp_len = tso->hdr_len - tso->l4_offset + seg_payload;
+    uint32_t sum;
+    if (tso->ipv6) {
+        put_be16(ip + 4, tso->l4_offset - tso->l3_offset - IPV6_HLEN + tcp_len);
+        uint8_t pseudo[8] = { tcp_len >> 24, tcp_len >> 16, tcp_len >> 8, tcp_len, 0, 0, 0, IPPROTO_TCP };
+        sum = net_csum_partial(ip + 8, 32, net_csum_partial(pseudo, sizeof(pseudo), 0));
+    } else {
+        size_t ip_len = tso->l4_offset - tso->l3_offset;
+        put_be16(ip + 2, ip_len + tcp_len);
+        put_be16(ip + 4, get_be16(ip + 4) + seg);
+        put_be16(ip + 10, 0);
+        csum_store(ip + 10, net_csum_fold(net_csum_partial(ip, ip_len, 0)));
+        uint8_t pseudo[4] = { 0, IPPROTO_TCP, tcp_len >> 8, tcp_len };
+        sum = net_csum_partial(ip + 12, 8, net_csum_partial(pseudo, sizeof(pseudo), 0));
+    }
+
+    put_be32(tcp + 4, get_be32(tcp + 4) + offset);
+    if (seg != tso->num_segs - 1) {
+        tcp[13] &= ~(TCP_FLAG_FIN | TCP_FLAG_PSH);
+    }
+    if (seg) {
+        tcp[13] &= ~TCP_FLAG_CWR;
+    }
+    put_be16(tcp + 16, 0);
+    csum_store(tcp + 16, net_csum_fold(net_csum_partial(tcp, tcp_len, sum)));
+    return tso->hdr_len + seg_payload;
+}
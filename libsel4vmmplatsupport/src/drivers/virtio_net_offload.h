@@ -0,0 +1,74 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sel4vmmplatsupport/drivers/virtio_pci_emul.h>
+
+/* Largest packet a guest may hand over for segmentation, including its headers */
+#define NET_TSO_MAX_PACKET (64 * 1024 + 256)
+
+/* Layout of a packet being segmented */
+typedef struct net_tso {
+    size_t l3_offset;
+    size_t l4_offset;
+    size_t hdr_len;
+    size_t payload_len;
+    size_t mss;
+    unsigned int num_segs;
+    bool ipv6;
+} net_tso_t;
+
+/**
+ * Add a buffer to a ones' complement sum
+ * @param {const void *} buf        Buffer to sum
+ * @param {size_t} len              Length of the buffer in bytes
+ * @param {uint32_t} sum            Sum to add to
+ * @return                          Partial sum, to be folded with net_csum_fold
+ */
+uint32_t net_csum_partial(const void *buf, size_t len, uint32_t sum);
+
+/**
+ * Fold a partial ones' complement sum into a checksum
+ * @param {uint32_t} sum            Partial sum
+ * @return                          Checksum in the byte order of the summed data
+ */
+uint16_t net_csum_fold(uint32_t sum);
+
+/**
+ * Complete the checksum of a packet the guest left to the device (VIRTIO_NET_HDR_F_NEEDS_CSUM). The data from
+ * 'csum_start' is summed and the checksum stored 'csum_offset' bytes past it
+ * @param {uint8_t *} pkt           Packet to checksum
+ * @param {size_t} len              Length of the packet
+ * @param {uint16_t} csum_start     Offset of the data to checksum
+ * @param {uint16_t} csum_offset    Offset of the checksum field from 'csum_start'
+ * @return                          0 on success, -1 if the offsets are outside of the packet
+ */
+int net_tx_csum(uint8_t *pkt, size_t len, uint16_t csum_start, uint16_t csum_offset);
+
+/**
+ * Work out how a TCP packet is cut into segments of 'hdr->gso_size' bytes of payload
+ * @param {const uint8_t *} pkt     Packet to segment
+ * @param {size_t} len              Length of the packet
+ * @param {const struct virtio_net_hdr *} hdr   Virtio net header of the packet
+ * @param {net_tso_t *} tso         Layout of the packet to populate
+ * @return                          0 on success, -1 if the packet cannot be segmented
+ */
+int net_tso_prepare(const uint8_t *pkt, size_t len, const struct virtio_net_hdr *hdr, net_tso_t *tso);
+
+/**
+ * Build a segment of a packet, with its headers and checksums fixed up
+ * @param {const uint8_t *} pkt     Packet being segmented
+ * @param {const net_tso_t *} tso   Layout of the packet
+ * @param {unsigned int} seg        Index of the segment
+ * @param {uint8_t *} out           Buffer to write the segment to, of at least hdr_len + mss bytes
+ * @return                          Length of the segment
+ */
+size_t net_tso_segment(const uint8_t *pkt, const net_tso_t *tso, unsigned int seg, uint8_t *out);
@@ -0,0 +1,447 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <autoconf.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_memory.h>
+#include <sel4vm/guest_vcpu_fault.h>
+
+#include <pci/helper.h>
+
+#include "virtio_pci_modern.h"
+
+/* Vendor capabilities of a modern virtio pci device */
+#define VIRTIO_PCI_CAP_ID_VNDR          0x09
+#define VIRTIO_PCI_CAP_COMMON_CFG       1
+#define VIRTIO_PCI_CAP_NOTIFY_CFG       2
+#define VIRTIO_PCI_CAP_ISR_CFG          3
+#define VIRTIO_PCI_CAP_DEVICE_CFG       4
+#define VIRTIO_PCI_CAP_SHARED_MEMORY_CFG 8
+
+/* Capabilities are laid out from the start of the capability space */
+#define VIRTIO_PCI_CAPS_OFFSET          0x40
+
+/* Layout of the memory bar, with a structure per capability */
+#define MODERN_COMMON                   0x000
+#define MODERN_COMMON_LEN               0x038
+#define MODERN_ISR                      0x100
+#define MODERN_ISR_LEN                  0x001
+#define MODERN_DEVICE                   0x200
+#define MODERN_DEVICE_LEN               0x100
+#define MODERN_NOTIFY                   0x300
+/* each queue has its own doorbell */
+#define MODERN_NOTIFY_MULTIPLIER        4
+#define MODERN_NOTIFY_LEN               (VIRTIO_MAX_QUEUES * MODERN_NOTIFY_MULTIPLIER)
+
+/* Registers of the common configuration structure */
+#define COMMON_DEVICE_FEATURE_SELECT    0x00
+#define COMMON_DEVICE_FEATURE           0x04
+#define COMMON_DRIVER_FEATURE_SELECT    0x08
+#define COMMON_DRIVER_FEATURE           0x0c
+#define COMMON_MSIX_CONFIG              0x10
+#define COMMON_NUM_QUEUES               0x12
+#define COMMON_DEVICE_STATUS            0x14
+#define COMMON_CONFIG_GENERATION        0x15
+#define COMMON_QUEUE_SELECT             0x16
+#define COMMON_QUEUE_SIZE               0x18
+#define COMMON_QUEUE_MSIX_VECTOR        0x1a
+#define COMMON_QUEUE_ENABLE             0x1c
+#define COMMON_QUEUE_NOTIFY_OFF         0x1e
+#define COMMON_QUEUE_DESC_LO            0x20
+#define COMMON_QUEUE_DESC_HI            0x24
+#define COMMON_QUEUE_DRIVER_LO          0x28
+#define COMMON_QUEUE_DRIVER_HI          0x2c
+#define COMMON_QUEUE_DEVICE_LO          0x30
+#define COMMON_QUEUE_DEVICE_HI          0x34
+
+/* MSI-X is not provided, leaving the guest with the legacy interrupt */
+#define VIRTIO_MSI_NO_VECTOR            0xffff
+
+/* Features the transport offers on top of those of the device */
+#define MODERN_FEATURES_HI              ((uint32_t)(((1ull << VIRTIO_F_VERSION_1) | \
+                                                     (1ull << VIRTIO_F_RING_PACKED)) >> 32))
+
+struct virtio_pci_cap {
+    uint8_t cap_vndr;
+    uint8_t cap_next;
+    uint8_t cap_len;
+    uint8_t cfg_type;
+    uint8_t bar;
+    uint8_t padding[3];
+    uint32_t offset;
+    uint32_t length;
+} PACKED;
+
+struct virtio_pci_notify_cap {
+    struct virtio_pci_cap cap;
+    uint32_t notify_off_multiplier;
+} PACKED;
+
+/* Capability of a shared memory region, whose id takes the first byte of padding */
+struct virtio_pci_cap64 {
+    struct virtio_pci_cap cap;
+    uint32_t offset_hi;
+    uint32_t length_hi;
+} PACKED;
+
+struct virtio_pci_modern_caps {
+    struct virtio_pci_cap common;
+    struct virtio_pci_notify_cap notify;
+    struct virtio_pci_cap isr;
+    struct virtio_pci_cap device;
+} PACKED;
+
+typedef struct virtio_pci_modern {
+    virtio_emul_t *emul;
+    uintptr_t addr;
+    uint32_t device_feature_sel;
+    uint32_t driver_feature_sel;
+    /* driver features beyond the 32 bits of the legacy registers */
+    uint32_t driver_features_hi;
+    /* size of the queues the device was created with, the guest may use smaller ones */
+    uint16_t queue_size_max;
+    /* rings of each queue, which are only set up once the guest enables the queue */
+    bool queue_enable[VIRTIO_MAX_QUEUES];
+    uint64_t queue_desc[VIRTIO_MAX_QUEUES];
+    uint64_t queue_driver[VIRTIO_MAX_QUEUES];
+    uint64_t queue_device[VIRTIO_MAX_QUEUES];
+} virtio_pci_modern_t;
+
+/* Position of a capability in the capability space */
+#define MODERN_CAP_OFFSET(cap) (VIRTIO_PCI_CAPS_OFFSET + offsetof(struct virtio_pci_modern_caps, cap))
+
+static void modern_cap_init(struct virtio_pci_cap *cap, uint8_t cap_len, uint8_t cfg_type, int bar,
+                            uint32_t offset, uint32_t length, uint8_t cap_next)
+{
+    cap->cap_vndr = VIRTIO_PCI_CAP_ID_VNDR;
+    cap->cap_next = cap_next;
+    cap->cap_len = cap_len;
+    cap->cfg_type = cfg_type;
+    cap->bar = bar;
+    cap->offset = offset;
+    cap->length = length;
+}
+
+int virtio_pci_modern_add_caps(vmm_pci_device_def_t *def, int bar)
+{
+    if (def->caps) {
+        ZF_LOGE("Failed to add virtio capabilities: Device already has capabilities");
+        return -1;
+    }
+    struct virtio_pci_modern_caps *caps = calloc(1, sizeof(*caps));
+    if (!caps) {
+        ZF_LOGE("Failed to add virtio capabilities: Unable to allocate capabilities");
+        return -1;
+    }
+    modern_cap_init(&caps->common, sizeof(caps->common), VIRTIO_PCI_CAP_COMMON_CFG, bar, MODERN_COMMON,
+                    MODERN_COMMON_LEN, MODERN_CAP_OFFSET(notify));
+    modern_cap_init(&caps->notify.cap, sizeof(caps->notify), VIRTIO_PCI_CAP_NOTIFY_CFG, bar, MODERN_NOTIFY,
+                    MODERN_NOTIFY_LEN, MODERN_CAP_OFFSET(isr));
+    caps->notify.notify_off_multiplier = MODERN_NOTIFY_MULTIPLIER;
+    modern_cap_init(&caps->isr, sizeof(caps->isr), VIRTIO_PCI_CAP_ISR_CFG, bar, MODERN_ISR, MODERN_ISR_LEN,
+                    MODERN_CAP_OFFSET(device));
+    modern_cap_init(&caps->device, sizeof(caps->device), VIRTIO_PCI_CAP_DEVICE_CFG, bar, MODERN_DEVICE,
+                    MODERN_DEVICE_LEN, 0);
+
+    def->caps = caps;
+    def->caps_len = sizeof(*caps);
+    def->caps_pointer = VIRTIO_PCI_CAPS_OFFSET;
+    def->status |= PCI_STATUS_CAP_LIST;
+    return 0;
+}
+
+int virtio_pci_modern_add_shm_cap(vmm_pci_device_def_t *def, int bar, uint8_t id, uint64_t offset, uint64_t length)
+{
+    if (def->caps_len != sizeof(struct virtio_pci_modern_caps)) {
+        ZF_LOGE("Failed to add virtio shared memory capability: Device lacks the modern capabilities");
+        return -1;
+    }
+    struct virtio_pci_modern_caps *caps = realloc(def->caps, sizeof(*caps) + sizeof(struct virtio_pci_cap64));
+    if (!caps) {
+        ZF_LOGE("Failed to add virtio shared memory capability: Unable to allocate capability");
+        return -1;
+    }
+    /* appended to the capability list after the device configuration */
+    struct virtio_pci_cap64 *shm = (struct virtio_pci_cap64 *)(caps + 1);
+    memset(shm, 0, sizeof(*shm));
+    modern_cap_init(&shm->cap, sizeof(*shm), VIRTIO_PCI_CAP_SHARED_MEMORY_CFG, bar, (uint32_t)offset,
+                    (uint32_t)length, 0);
+    shm->cap.padding[0] = id;
+    shm->offset_hi = offset >> 32;
+    shm->length_hi = length >> 32;
+    caps->device.cap_next = VIRTIO_PCI_CAPS_OFFSET + sizeof(*caps);
+
+    def->caps = caps;
+    def->caps_len = sizeof(*caps) + sizeof(*shm);
+    return 0;
+}
+
+/* Keep the features beyond the legacy registers, which the emulation does not know of */
+static void modern_features_update(virtio_pci_modern_t *modern)
+{
+    vqueue_t *vq = &modern->emul->virtq;
+    vq->features = (uint32_t)vq->features | ((uint64_t)modern->driver_features_hi << 32);
+}
+
+/* Return a device to its initial state, as the guest does by writing a status of 0 */
+static void modern_reset(virtio_pci_modern_t *modern)
+{
+    virtio_emul_t *emul = modern->emul;
+    emul->virtq.features = 0;
+    modern->driver_features_hi = 0;
+    for (int i = 0; i < emul->virtq.num_queues; i++) {
+        modern->queue_enable[i] = false;
+        modern->queue_desc[i] = 0;
+        modern->queue_driver[i] = 0;
+        modern->queue_device[i] = 0;
+        emul->virtq.queue_size[i] = modern->queue_size_max;
+        virtio_emul_queue_setup(emul, i, 0, 0, 0);
+    }
+}
+
+/* Selected queue, or -1 for a queue the device doesn't provide */
+static int modern_queue(virtio_pci_modern_t *modern)
+{
+    vqueue_t *vq = &modern->emul->virtq;
+    return vq->queue < vq->num_queues ? vq->queue : -1;
+}
+
+static uint32_t modern_addr_read(uint64_t *addr, bool hi)
+{
+    return hi ? *addr >> 32 : (uint32_t)*addr;
+}
+
+static void modern_addr_write(uint64_t *addr, bool hi, uint32_t value)
+{
+    if (hi) {
+        *addr = (uint32_t)*addr | ((uint64_t)value << 32);
+    } else {
+        *addr = (*addr & ~(uint64_t)UINT32_MAX) | value;
+    }
+}
+
+static uint32_t modern_common_read(virtio_pci_modern_t *modern, unsigned int offset)
+{
+    virtio_emul_t *emul = modern->emul;
+    int queue = modern_queue(modern);
+    unsigned int value = 0;
+    switch (offset) {
+    case COMMON_DEVICE_FEATURE_SELECT:
+        return modern->device_feature_sel;
+    case COMMON_DEVICE_FEATURE:
+        if (modern->device_feature_sel == 0) {
+            emul->io_in(emul, VIRTIO_PCI_HOST_FEATURES, 4, &value);
+        } else if (modern->device_feature_sel == 1) {
+            value = MODERN_FEATURES_HI;
+        }
+        return value;
+    case COMMON_DRIVER_FEATURE_SELECT:
+        return modern->driver_feature_sel;
+    case COMMON_DRIVER_FEATURE:
+        if (modern->driver_feature_sel == 0) {
+            return (uint32_t)emul->virtq.features;
+        }
+        return modern->driver_feature_sel == 1 ? modern->driver_features_hi : 0;
+    case COMMON_MSIX_CONFIG:
+    case COMMON_QUEUE_MSIX_VECTOR:
+        return VIRTIO_MSI_NO_VECTOR;
+    case COMMON_NUM_QUEUES:
+        return emul->virtq.num_queues;
+    case COMMON_DEVICE_STATUS:
+        emul->io_in(emul, VIRTIO_PCI_STATUS, 1, &value);
+        return value;
+    case COMMON_CONFIG_GENERATION:
+        /* the device configuration never changes underneath the guest */
+        return 0;
+    case COMMON_QUEUE_SELECT:
+        return emul->virtq.queue;
+    case COMMON_QUEUE_SIZE:
+        return queue < 0 ? 0 : emul->virtq.queue_size[queue];
+    case COMMON_QUEUE_ENABLE:
+        return queue < 0 ? 0 : modern->queue_enable[queue];
+    case COMMON_QUEUE_NOTIFY_OFF:
+        return queue < 0 ? 0 : queue;
+    case COMMON_QUEUE_DESC_LO:
+    case COMMON_QUEUE_DESC_HI:
+        return queue < 0 ? 0 : modern_addr_read(&modern->queue_desc[queue], offset == COMMON_QUEUE_DESC_HI);
+    case COMMON_QUEUE_DRIVER_LO:
+    case COMMON_QUEUE_DRIVER_HI:
+        return queue < 0 ? 0 : modern_addr_read(&modern->queue_driver[queue], offset == COMMON_QUEUE_DRIVER_HI);
+    case COMMON_QUEUE_DEVICE_LO:
+    case COMMON_QUEUE_DEVICE_HI:
+        return queue < 0 ? 0 : modern_addr_read(&modern->queue_device[queue], offset == COMMON_QUEUE_DEVICE_HI);
+    default:
+        ZF_LOGE("Unhandled virtio common configuration read of offset 0x%x", offset);
+        return 0;
+    }
+}
+
+static void modern_common_write(virtio_pci_modern_t *modern, unsigned int offset, uint32_t value)
+{
+    virtio_emul_t *emul = modern->emul;
+    int queue = modern_queue(modern);
+    switch (offset) {
+    case COMMON_DEVICE_FEATURE_SELECT:
+        modern->device_feature_sel = value;
+        break;
+    case COMMON_DRIVER_FEATURE_SELECT:
+        modern->driver_feature_sel = value;
+        break;
+    case COMMON_DRIVER_FEATURE:
+        if (modern->driver_feature_sel == 0) {
+            emul->io_out(emul, VIRTIO_PCI_GUEST_FEATURES, 4, value);
+        } else if (modern->driver_feature_sel == 1) {
+            if (value & ~MODERN_FEATURES_HI) {
+                ZF_LOGE("Ignoring unsupported guest features 0x%x of word 1", value & ~MODERN_FEATURES_HI);
+            }
+            modern->driver_features_hi = value & MODERN_FEATURES_HI;
+        } else if (value) {
+            ZF_LOGE("Ignoring guest features 0x%x of unsupported word %u", value, modern->driver_feature_sel);
+        }
+        modern_features_update(modern);
+        break;
+    case COMMON_MSIX_CONFIG:
+    case COMMON_QUEUE_MSIX_VECTOR:
+        /* reads back as VIRTIO_MSI_NO_VECTOR, the guest falls back to the legacy interrupt */
+        break;
+    case COMMON_DEVICE_STATUS:
+        if (!value) {
+            modern_reset(modern);
+        }
+        emul->io_out(emul, VIRTIO_PCI_STATUS, 1, value);
+        break;
+    case COMMON_QUEUE_SELECT:
+        if (value >= VIRTIO_MAX_QUEUES) {
+            ZF_LOGE("Ignoring selection of queue %u not provided by the device", value);
+            break;
+        }
+        emul->io_out(emul, VIRTIO_PCI_QUEUE_SEL, 2, value);
+        break;
+    case COMMON_QUEUE_SIZE:
+        if (queue < 0 || modern->queue_enable[queue]) {
+            break;
+        }
+        /* free running ring positions need power of 2 sizes */
+        if (!value || value > modern->queue_size_max || (value & (value - 1))) {
+            ZF_LOGE("Ignoring unsupported queue size %u", value);
+            break;
+        }
+        emul->virtq.queue_size[queue] = value;
+        break;
+    case COMMON_QUEUE_ENABLE:
+        if (queue < 0 || modern->queue_enable[queue] || value != 1) {
+            break;
+        }
+        modern->queue_enable[queue] = true;
+        virtio_emul_queue_setup(emul, queue, modern->queue_desc[queue], modern->queue_driver[queue],
+                                modern->queue_device[queue]);
+        break;
+    case COMMON_QUEUE_DESC_LO:
+    case COMMON_QUEUE_DESC_HI:
+        if (queue >= 0) {
+            modern_addr_write(&modern->queue_desc[queue], offset == COMMON_QUEUE_DESC_HI, value);
+        }
+        break;
+    case COMMON_QUEUE_DRIVER_LO:
+    case COMMON_QUEUE_DRIVER_HI:
+        if (queue >= 0) {
+            modern_addr_write(&modern->queue_driver[queue], offset == COMMON_QUEUE_DRIVER_HI, value);
+        }
+        break;
+    case COMMON_QUEUE_DEVICE_LO:
+    case COMMON_QUEUE_DEVICE_HI:
+        if (queue >= 0) {
+            modern_addr_write(&modern->queue_device[queue], offset == COMMON_QUEUE_DEVICE_HI, value);
+        }
+        break;
+    default:
+        ZF_LOGE("Unhandled virtio common configuration write of 0x%x to offset 0x%x", value, offset);
+        break;
+    }
+}
+
+static uint32_t modern_read(virtio_pci_modern_t *modern, unsigned int offset, size_t size)
+{
+    virtio_emul_t *emul = modern->emul;
+    unsigned int value = 0;
+    if (offset >= MODERN_NOTIFY) {
+        return 0;
+    } else if (offset >= MODERN_DEVICE) {
+        emul->io_in(emul, VIRTIO_PCI_CONFIG_OFF(false) + offset - MODERN_DEVICE, size, &value);
+        return value;
+    } else if (offset >= MODERN_ISR) {
+        emul->io_in(emul, VIRTIO_PCI_ISR, 1, &value);
+        return value;
+    }
+    return modern_common_read(modern, offset - MODERN_COMMON);
+}
+
+static void modern_write(virtio_pci_modern_t *modern, unsigned int offset, size_t size, uint32_t value)
+{
+    virtio_emul_t *emul = modern->emul;
+    if (offset >= MODERN_NOTIFY) {
+        /* the doorbell written identifies the queue, the data is ignored */
+        emul->io_out(emul, VIRTIO_PCI_QUEUE_NOTIFY, 2, (offset - MODERN_NOTIFY) / MODERN_NOTIFY_MULTIPLIER);
+    } else if (offset >= MODERN_DEVICE) {
+        emul->io_out(emul, VIRTIO_PCI_CONFIG_OFF(false) + offset - MODERN_DEVICE, size, value);
+    } else if (offset < MODERN_ISR) {
+        modern_common_write(modern, offset - MODERN_COMMON, value);
+    }
+}
+
+static memory_fault_result_t modern_fault_handler(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t fault_addr,
+                                                  size_t fault_length, void *cookie)
+{
+    virtio_pci_modern_t *modern = (virtio_pci_modern_t *)cookie;
+    unsigned int offset = fault_addr - modern->addr;
+    size_t size = get_vcpu_fault_size(vcpu);
+    if (is_vcpu_read_fault(vcpu)) {
+        seL4_Word value = modern_read(modern, offset, size);
+#ifdef CONFIG_ARCH_ARM
+        /* read data is expected in its place within the word */
+        value <<= (fault_addr & 0x3) * 8;
+#endif
+        set_vcpu_fault_data(vcpu, value);
+    } else {
+        seL4_Word data = get_vcpu_fault_data(vcpu);
+        modern_write(modern, offset, size, size < sizeof(uint32_t) ? data & MASK(size * 8) : data);
+    }
+    advance_vcpu_fault(vcpu);
+    return FAULT_HANDLED;
+}
+
+int virtio_pci_modern_install(vm_t *vm, virtio_emul_t *emul, uintptr_t addr)
+{
+    if (addr % BIT(VIRTIO_PCI_MODERN_BAR_SIZE_BITS)) {
+        ZF_LOGE("Failed to install virtio pci registers: Address 0x%"PRIxPTR" not aligned to the bar size", addr);
+        return -1;
+    }
+    virtio_pci_modern_t *modern = calloc(1, sizeof(*modern));
+    if (!modern) {
+        ZF_LOGE("Failed to install virtio pci registers: Unable to allocate transport");
+        return -1;
+    }
+    modern->emul = emul;
+    modern->addr = addr;
+    modern->queue_size_max = emul->virtq.queue_size[0];
+    emul->notify_addr = addr + MODERN_NOTIFY;
+    emul->notify_stride = MODERN_NOTIFY_MULTIPLIER;
+
+    /* the bar is a single page, so doorbell writes take the MMIO dispatch fast path */
+    vm_memory_reservation_t *reservation = vm_reserve_memory_at(vm, addr, BIT(VIRTIO_PCI_MODERN_BAR_SIZE_BITS),
+                                                                modern_fault_handler, (void *)modern);
+    if (!reservation) {
+        ZF_LOGE("Failed to install virtio pci registers: Unable to reserve bar at 0x%"PRIxPTR, addr);
+        free(modern);
+        return -1;
+    }
+    return 0;
+}
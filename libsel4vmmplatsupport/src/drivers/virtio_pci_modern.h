@@ -0,0 +1,50 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vmmplatsupport/drivers/pci_helper.h>
+#include <sel4vmmplatsupport/drivers/virtio_pci_emul.h>
+
+/* Size of the memory bar holding the registers of a modern virtio pci device */
+#define VIRTIO_PCI_MODERN_BAR_SIZE_BITS 12
+
+/* Device ids of modern virtio pci devices follow from the virtio device id */
+#define VIRTIO_PCI_MODERN_DEVICE_ID(id) (0x1040 + (id))
+
+/**
+ * Add the vendor capabilities locating the registers of a modern virtio device in memory bar 'bar' to
+ * a PCI device header, which must not have capabilities of its own
+ * @param {vmm_pci_device_def_t *} def  PCI device header of the device
+ * @param {int} bar                     Memory bar the registers are installed at
+ * @return                              0 on success, -1 on error
+ */
+int virtio_pci_modern_add_caps(vmm_pci_device_def_t *def, int bar);
+
+/**
+ * Add a capability locating shared memory region 'id' of a device, at 'offset' bytes into memory bar 'bar', to a
+ * PCI device header given the capabilities of a modern virtio device with 'virtio_pci_modern_add_caps'
+ * @param {vmm_pci_device_def_t *} def  PCI device header of the device
+ * @param {int} bar                     Memory bar holding the region
+ * @param {uint8_t} id                  Device specific id of the region
+ * @param {uint64_t} offset             Offset of the region into the bar
+ * @param {uint64_t} length             Size of the region in bytes
+ * @return                              0 on success, -1 on error
+ */
+int virtio_pci_modern_add_shm_cap(vmm_pci_device_def_t *def, int bar, uint8_t id, uint64_t offset, uint64_t length);
+
+/**
+ * Install the registers of a modern virtio pci device for an emulated virtio device, at the guest physical
+ * address its memory bar is at. Registers are translated to the legacy virtio pci registers of the emulation
+ * @param {vm_t *} vm                   A handle to the VM
+ * @param {virtio_emul_t *} emul        Emulated virtio device to expose, which must not be used by another transport
+ * @param {uintptr_t} addr              Guest physical address of the memory bar
+ * @return                              0 on success, -1 on error
+ */
+int virtio_pci_modern_install(vm_t *vm, virtio_emul_t *emul, uintptr_t addr);
@@ -0,0 +1,674 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <sel4vmmplatsupport/drivers/virtio_pci_emul.h>
+#include <sel4vmmplatsupport/drivers/cross_vm_ring.h>
+#include <stdbool.h>
+
+#include "virtio_emul_helpers.h"
+
+/* Packets for the guest, packets from the guest and transport events */
+#define VSOCK_RX_QUEUE 0
+#define VSOCK_TX_QUEUE 1
+#define VSOCK_EVENT_QUEUE 2
+#define VSOCK_NUM_QUEUES 3
+
+/* Features offered to the guest, streams being implied without any vsock features */
+#define VSOCK_HOST_FEATURES BIT(VIRTIO_RING_F_EVENT_IDX)
+
+/* Well known context id of the host */
+#define VSOCK_HOST_CID 2
+
+/* Packet types and operations, as defined by the virtio spec */
+#define VSOCK_TYPE_STREAM 1
+
+#define VSOCK_OP_INVALID 0
+#define VSOCK_OP_REQUEST 1
+#define VSOCK_OP_RESPONSE 2
+#define VSOCK_OP_RST 3
+#define VSOCK_OP_SHUTDOWN 4
+#define VSOCK_OP_RW 5
+#define VSOCK_OP_CREDIT_UPDATE 6
+#define VSOCK_OP_CREDIT_REQUEST 7
+
+#define VSOCK_SHUTDOWN_RCV 1
+#define VSOCK_SHUTDOWN_SEND 2
+
+/* Control packets waiting for a guest receive buffer. Each packet taken from
+ * the guest is answered by at most two, and packets are only taken whilst
+ * there is room for the answers */
+#define VSOCK_MAX_CONTROL 32
+#define VSOCK_MAX_PKT_CONTROL 2
+
+struct virtio_vsock_hdr {
+    uint64_t src_cid;
+    uint64_t dst_cid;
+    uint32_t src_port;
+    uint32_t dst_port;
+    uint32_t len;
+    uint16_t type;
+    uint16_t op;
+    uint32_t flags;
+    uint32_t buf_alloc;
+    uint32_t fwd_cnt;
+} PACKED;
+
+/* Device configuration space, following the common virtio registers */
+struct virtio_vsock_config {
+    uint64_t guest_cid;
+} PACKED;
+
+typedef struct vsock_port_internal {
+    uint32_t port;
+    seL4_CPtr notification;
+    crossvm_ring_t to_component;
+    crossvm_ring_t from_component;
+    /* the component has to be notified once the current batch is committed */
+    bool notify;
+    /* bytes of stream data held in each slot of the ring to the component, to
+     * count the bytes it consumes */
+    uint32_t *slot_lens;
+    /* position of the ring to the component up to which slots are accounted */
+    uint32_t tail;
+    /* the guest is connected to the port, from its port 'guest_port' */
+    bool connected;
+    uint32_t guest_port;
+    /* bytes of the guest's stream consumed by the component, and as last told to the guest */
+    uint32_t fwd_cnt;
+    uint32_t fwd_cnt_sent;
+    /* receive buffer space of the guest, bytes of it the guest has consumed and
+     * bytes sent to it */
+    uint32_t peer_buf_alloc;
+    uint32_t peer_fwd_cnt;
+    uint32_t tx_cnt;
+    /* bytes of the slot at the tail of the ring from the component already sent */
+    uint32_t rx_offset;
+} vsock_port_t;
+
+typedef struct vsock_virtio_emul_internal {
+    struct vsock_passthrough driver;
+    virtio_emul_t *emul;
+    struct virtio_vsock_config config;
+    unsigned int num_ports;
+    vsock_port_t ports[VIRTIO_VSOCK_MAX_PORTS];
+    /* port sent from first, rotating so that no port starves the others */
+    unsigned int rx_next;
+    /* control packets queued for the guest */
+    struct virtio_vsock_hdr control[VSOCK_MAX_CONTROL];
+    unsigned int control_head;
+    unsigned int control_tail;
+    /* bytes of the packet at the head of the tx queue already handed to a component */
+    size_t tx_offset;
+} vsock_internal_t;
+
+/* Result of handling a packet from the guest */
+typedef enum vsock_pkt_result {
+    VSOCK_PKT_DONE,
+    /* the packet must wait for the component to free slots of its ring */
+    VSOCK_PKT_STALL,
+} vsock_pkt_result_t;
+
+static size_t vsock_slot_payload(crossvm_ring_t *ring)
+{
+    return ring->slot_size - sizeof(struct vsock_port_msg);
+}
+
+/* Stream data the guest may send before the component has consumed any */
+static uint32_t vsock_port_buf_alloc(vsock_port_t *port)
+{
+    return port->to_component.num_slots * vsock_slot_payload(&port->to_component);
+}
+
+static vsock_port_t *vsock_port_find(vsock_internal_t *vsock, uint32_t port)
+{
+    for (unsigned int i = 0; i < vsock->num_ports; i++) {
+        if (vsock->ports[i].port == port) {
+            return &vsock->ports[i];
+        }
+    }
+    return NULL;
+}
+
+/* Read 'len' bytes from 'offset' bytes into a descriptor chain */
+static size_t vsock_chain_read(vm_t *vm, const vm_guest_iovec_t *iov, int iovcnt, size_t offset, void *buf,
+                               size_t len)
+{
+    vm_guest_iovec_t skipped[VIRTIO_MAX_CHAIN_DESCS];
+    int num = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (offset >= iov[i].len) {
+            offset -= iov[i].len;
+            continue;
+        }
+        skipped[num++] = (vm_guest_iovec_t) {
+            .addr = iov[i].addr + offset,
+            .len = iov[i].len - offset
+        };
+        offset = 0;
+    }
+    vm_host_iovec_t host_iov = { .base = buf, .len = len };
+    size_t copied = 0;
+    vm_guest_readv(vm, &host_iov, 1, skipped, num, &copied);
+    return copied;
+}
+
+static unsigned int vsock_control_room(vsock_internal_t *vsock)
+{
+    return VSOCK_MAX_CONTROL - (vsock->control_tail - vsock->control_head);
+}
+
+/* Queue a control packet for the guest, from host port 'src_port' to guest port 'dst_port' */
+static void vsock_control_queue(vsock_internal_t *vsock, uint32_t src_port, uint32_t dst_port, uint16_t op,
+                                uint32_t flags)
+{
+    if (!vsock_control_room(vsock)) {
+        ZF_LOGE("Dropping control packet %d for port %u: Too many outstanding packets", op, dst_port);
+        return;
+    }
+    vsock->control[vsock->control_tail % VSOCK_MAX_CONTROL] = (struct virtio_vsock_hdr) {
+        .src_cid = VSOCK_HOST_CID,
+        .dst_cid = vsock->config.guest_cid,
+        .src_port = src_port,
+        .dst_port = dst_port,
+        .type = VSOCK_TYPE_STREAM,
+        .op = op,
+        .flags = flags,
+    };
+    vsock->control_tail++;
+}
+
+/* Reset a guest packet we have no connection for, unless it is a reset itself */
+static void vsock_reset(vsock_internal_t *vsock, struct virtio_vsock_hdr *hdr)
+{
+    if (hdr->op != VSOCK_OP_RST) {
+        vsock_control_queue(vsock, hdr->dst_port, hdr->src_port, VSOCK_OP_RST, 0);
+    }
+}
+
+/* Account the slots the component has consumed from its ring since last looked at */
+static void vsock_port_update_fwd_cnt(vsock_port_t *port)
+{
+    crossvm_ring_t *ring = &port->to_component;
+    uint32_t tail = __atomic_load_n(&ring->shared->consumer.tail, __ATOMIC_ACQUIRE);
+    /* the component's tail is only trusted to lie between what we accounted and produced */
+    if ((uint32_t)(tail - port->tail) > (uint32_t)(ring->index - port->tail)) {
+        return;
+    }
+    for (; port->tail != tail; port->tail++) {
+        uint32_t *len = &port->slot_lens[port->tail & (ring->num_slots - 1)];
+        port->fwd_cnt += *len;
+        *len = 0;
+    }
+}
+
+/* Have the component notify us on consuming from its ring, even though the ring
+ * is not full, so that the space it makes is passed on to the guest */
+static void vsock_port_wait_consume(vsock_port_t *port)
+{
+    crossvm_ring_t *ring = &port->to_component;
+    __atomic_store_n(&ring->shared->producer.wait_seq, ++ring->wait_seq, __ATOMIC_RELAXED);
+    __atomic_store_n(&ring->shared->producer.waiting, 1, __ATOMIC_RELEASE);
+    /* pairs with the component's order of moving its tail before reading the flag */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/* Queue a message without data for the component, if its ring has room */
+static bool vsock_port_send_msg(vsock_port_t *port, uint32_t type)
+{
+    crossvm_ring_t *ring = &port->to_component;
+    if (!crossvm_ring_free(ring)) {
+        return false;
+    }
+    struct vsock_port_msg *msg = crossvm_ring_produce_slot(ring, 0);
+    msg->type = type;
+    msg->len = 0;
+    port->notify |= crossvm_ring_produce_commit(ring, 1);
+    return true;
+}
+
+static void vsock_port_open(vsock_port_t *port, struct virtio_vsock_hdr *hdr)
+{
+    vsock_port_update_fwd_cnt(port);
+    port->connected = true;
+    port->guest_port = hdr->src_port;
+    port->fwd_cnt = 0;
+    port->fwd_cnt_sent = 0;
+    port->tx_cnt = 0;
+    port->rx_offset = 0;
+}
+
+static void vsock_port_close(vsock_port_t *port)
+{
+    port->connected = false;
+    /* data of the connection still to be consumed by the component counts towards no later connection */
+    vsock_port_update_fwd_cnt(port);
+    for (uint32_t idx = port->tail; idx != port->to_component.index; idx++) {
+        port->slot_lens[idx & (port->to_component.num_slots - 1)] = 0;
+    }
+    /* and data the component sent for the connection is dropped */
+    uint32_t available = crossvm_ring_available(&port->from_component);
+    port->notify |= crossvm_ring_consume_commit(&port->from_component, available);
+    port->rx_offset = 0;
+}
+
+/* Hand stream data of a guest packet to the component, from 'vsock->tx_offset' bytes into its payload */
+static vsock_pkt_result_t vsock_port_send_data(vsock_internal_t *vsock, vsock_port_t *port, vm_guest_iovec_t *iov,
+                                               int iovcnt, size_t len)
+{
+    crossvm_ring_t *ring = &port->to_component;
+    size_t payload = vsock_slot_payload(ring);
+    uint32_t num_free = crossvm_ring_free(ring);
+    uint32_t num = 0;
+    while (vsock->tx_offset < len && num < num_free) {
+        struct vsock_port_msg *msg = crossvm_ring_produce_slot(ring, num);
+        size_t chunk = MIN(len - vsock->tx_offset, payload);
+        chunk = vsock_chain_read(vsock->emul->vm, iov, iovcnt, sizeof(struct virtio_vsock_hdr) + vsock->tx_offset,
+                                 msg->data, chunk);
+        if (!chunk) {
+            break;
+        }
+        msg->type = VSOCK_PORT_MSG_DATA;
+        msg->len = chunk;
+        port->slot_lens[(ring->index + num) & (ring->num_slots - 1)] = chunk;
+        vsock->tx_offset += chunk;
+        num++;
+    }
+    port->notify |= crossvm_ring_produce_commit(ring, num);
+    if (num == num_free && vsock->tx_offset < len) {
+        return VSOCK_PKT_STALL;
+    }
+    vsock->tx_offset = 0;
+    return VSOCK_PKT_DONE;
+}
+
+static vsock_pkt_result_t vsock_handle_pkt(vsock_internal_t *vsock, struct virtio_vsock_hdr *hdr,
+                                           vm_guest_iovec_t *iov, int iovcnt, size_t len)
+{
+    if (hdr->src_cid != vsock->config.guest_cid || hdr->dst_cid != VSOCK_HOST_CID || hdr->type != VSOCK_TYPE_STREAM) {
+        vsock_reset(vsock, hdr);
+        return VSOCK_PKT_DONE;
+    }
+    vsock_port_t *port = vsock_port_find(vsock, hdr->dst_port);
+    if (!port) {
+        vsock_reset(vsock, hdr);
+        return VSOCK_PKT_DONE;
+    }
+    if (hdr->op == VSOCK_OP_REQUEST) {
+        if (port->connected) {
+            /* a port serves a single connection, a new one replacing the last,
+             * which the guest may have forgotten of as it was reset */
+            if (!vsock_port_send_msg(port, VSOCK_PORT_MSG_SHUTDOWN)) {
+                return VSOCK_PKT_STALL;
+            }
+            vsock_port_close(port);
+            if (port->guest_port != hdr->src_port) {
+                vsock_control_queue(vsock, port->port, port->guest_port, VSOCK_OP_RST, 0);
+            }
+        }
+        if (!vsock_port_send_msg(port, VSOCK_PORT_MSG_CONNECT)) {
+            return VSOCK_PKT_STALL;
+        }
+        vsock_port_open(port, hdr);
+        port->peer_buf_alloc = hdr->buf_alloc;
+        port->peer_fwd_cnt = hdr->fwd_cnt;
+        vsock_control_queue(vsock, port->port, port->guest_port, VSOCK_OP_RESPONSE, 0);
+        return VSOCK_PKT_DONE;
+    }
+    if (!port->connected || port->guest_port != hdr->src_port) {
+        vsock_reset(vsock, hdr);
+        return VSOCK_PKT_DONE;
+    }
+    /* every packet carries the guest's credit */
+    port->peer_buf_alloc = hdr->buf_alloc;
+    port->peer_fwd_cnt = hdr->fwd_cnt;
+    switch (hdr->op) {
+    case VSOCK_OP_RW:
+        return vsock_port_send_data(vsock, port, iov, iovcnt, MIN(hdr->len, len - sizeof(*hdr)));
+    case VSOCK_OP_CREDIT_UPDATE:
+        /* sending resumes once the guest's buffers are flushed */
+        break;
+    case VSOCK_OP_CREDIT_REQUEST:
+        port->fwd_cnt_sent = port->fwd_cnt;
+        vsock_control_queue(vsock, port->port, port->guest_port, VSOCK_OP_CREDIT_UPDATE, 0);
+        break;
+    default:
+        /* the connection ends with the guest shutting it down or resetting it, or
+         * with anything unexpected, the component only being told the stream is over */
+        if (!vsock_port_send_msg(port, VSOCK_PORT_MSG_SHUTDOWN)) {
+            return VSOCK_PKT_STALL;
+        }
+        if (hdr->op == VSOCK_OP_SHUTDOWN && (hdr->flags & (VSOCK_SHUTDOWN_RCV | VSOCK_SHUTDOWN_SEND)) !=
+            (VSOCK_SHUTDOWN_RCV | VSOCK_SHUTDOWN_SEND)) {
+            /* the guest only shut down a direction, carrying on receiving */
+            break;
+        }
+        vsock_port_close(port);
+        /* a close completes with the reset, as does an unexpected packet */
+        vsock_reset(vsock, hdr);
+        break;
+    }
+    return VSOCK_PKT_DONE;
+}
+
+/* Take packets from the guest for as long as the components have room for them.
+ * Returns whether the guest wants an interrupt */
+static bool vsock_notify_tx(vsock_internal_t *vsock)
+{
+    virtio_emul_t *emul = vsock->emul;
+    unsigned int queue = VSOCK_TX_QUEUE;
+    uint16_t idx = emul->virtq.last_idx[queue];
+    uint16_t old_used_idx = ring_used_idx(emul, queue);
+    uint16_t used_idx = old_used_idx;
+    while (vsock_control_room(vsock) >= VSOCK_MAX_PKT_CONTROL) {
+        virtio_chain_t chain;
+        vm_guest_iovec_t guest_iov[VIRTIO_MAX_CHAIN_DESCS];
+        int guest_iovcnt = ring_avail_chain(emul, queue, idx, &chain, guest_iov, VIRTIO_MAX_CHAIN_DESCS);
+        if (!guest_iovcnt) {
+            break;
+        }
+        size_t chain_len = 0;
+        for (int i = 0; i < guest_iovcnt; i++) {
+            chain_len += guest_iov[i].len;
+        }
+        struct virtio_vsock_hdr hdr;
+        if (vsock_chain_read(emul->vm, guest_iov, guest_iovcnt, 0, &hdr, sizeof(hdr)) == sizeof(hdr)) {
+            vsock_port_t *port = vsock_port_find(vsock, hdr.dst_port);
+            if (vsock_handle_pkt(vsock, &hdr, guest_iov, guest_iovcnt, chain_len) == VSOCK_PKT_STALL) {
+                /* wait for the component to free slots, carrying on if it already has */
+                if (crossvm_ring_prepare_wait(&port->to_component, true)) {
+                    break;
+                }
+                continue;
+            }
+        }
+        idx += chain.num;
+        used_idx += ring_used_write(emul, queue, used_idx, &chain, 0);
+    }
+    emul->virtq.last_idx[queue] = idx;
+    ring_avail_event_set(emul, queue, idx);
+    if (used_idx == old_used_idx) {
+        return false;
+    }
+    ring_used_publish(emul, queue, used_idx);
+    return ring_need_interrupt(emul, queue, old_used_idx, used_idx);
+}
+
+/* Tell the guest of the space the component has made, once it is worth a packet */
+static void vsock_port_credit(vsock_internal_t *vsock, vsock_port_t *port)
+{
+    vsock_port_update_fwd_cnt(port);
+    if (!port->connected || port->fwd_cnt == port->fwd_cnt_sent || !vsock_control_room(vsock)) {
+        return;
+    }
+    if (port->fwd_cnt - port->fwd_cnt_sent >= vsock_port_buf_alloc(port) / 4 ||
+        port->tail == port->to_component.index) {
+        port->fwd_cnt_sent = port->fwd_cnt;
+        vsock_control_queue(vsock, port->port, port->guest_port, VSOCK_OP_CREDIT_UPDATE, 0);
+    }
+}
+
+/* Next message of the component a packet can be sent to the guest for, NULL if none */
+static struct vsock_port_msg *vsock_port_rx_msg(vsock_port_t *port)
+{
+    crossvm_ring_t *ring = &port->from_component;
+    while (port->connected && crossvm_ring_available(ring)) {
+        struct vsock_port_msg *msg = crossvm_ring_consume_slot(ring, 0);
+        /* the component is not trusted with the length of its messages */
+        if (msg->type == VSOCK_PORT_MSG_DATA && msg->len <= vsock_slot_payload(ring) && msg->len > port->rx_offset) {
+            /* sent within the guest's credit */
+            return port->peer_buf_alloc - (port->tx_cnt - port->peer_fwd_cnt) ? msg : NULL;
+        }
+        if (msg->type == VSOCK_PORT_MSG_SHUTDOWN) {
+            return msg;
+        }
+        port->notify |= crossvm_ring_consume_commit(ring, 1);
+        port->rx_offset = 0;
+    }
+    return NULL;
+}
+
+/* Hand queued control packets and the components' data to the guest for as
+ * long as it has buffers for them. Returns whether the guest wants an interrupt */
+static bool vsock_flush_rx(vsock_internal_t *vsock)
+{
+    virtio_emul_t *emul = vsock->emul;
+    unsigned int queue = VSOCK_RX_QUEUE;
+    uint16_t idx = emul->virtq.last_idx[queue];
+    uint16_t old_used_idx = ring_used_idx(emul, queue);
+    uint16_t used_idx = old_used_idx;
+    while (true) {
+        vsock_port_t *port = NULL;
+        struct vsock_port_msg *msg = NULL;
+        if (vsock->control_head == vsock->control_tail) {
+            for (unsigned int i = 0; i < vsock->num_ports && !msg; i++) {
+                port = &vsock->ports[(vsock->rx_next + i) % vsock->num_ports];
+                msg = vsock_port_rx_msg(port);
+            }
+            if (!msg) {
+                break;
+            }
+        }
+        virtio_chain_t chain;
+        vm_guest_iovec_t guest_iov[VIRTIO_MAX_CHAIN_DESCS];
+        int guest_iovcnt = ring_avail_chain(emul, queue, idx, &chain, guest_iov, VIRTIO_MAX_CHAIN_DESCS);
+        if (!guest_iovcnt) {
+            break;
+        }
+        size_t chain_len = 0;
+        for (int i = 0; i < guest_iovcnt; i++) {
+            chain_len += guest_iov[i].len;
+        }
+        struct virtio_vsock_hdr hdr;
+        uint32_t len = 0;
+        if (!msg) {
+            hdr = vsock->control[vsock->control_head % VSOCK_MAX_CONTROL];
+            vsock->control_head++;
+            port = vsock_port_find(vsock, hdr.src_port);
+        } else if (msg->type == VSOCK_PORT_MSG_DATA) {
+            uint32_t credit = port->peer_buf_alloc - (port->tx_cnt - port->peer_fwd_cnt);
+            len = MIN(MIN(msg->len - port->rx_offset, credit), chain_len - MIN(chain_len, sizeof(hdr)));
+            hdr = (struct virtio_vsock_hdr) {
+                .src_cid = VSOCK_HOST_CID,
+                .dst_cid = vsock->config.guest_cid,
+                .src_port = port->port,
+                .dst_port = port->guest_port,
+                .len = len,
+                .type = VSOCK_TYPE_STREAM,
+                .op = VSOCK_OP_RW,
+            };
+        } else {
+            /* the component is done sending, the guest resets the connection once it has read everything */
+            hdr = (struct virtio_vsock_hdr) {
+                .src_cid = VSOCK_HOST_CID,
+                .dst_cid = vsock->config.guest_cid,
+                .src_port = port->port,
+                .dst_port = port->guest_port,
+                .type = VSOCK_TYPE_STREAM,
+                .op = VSOCK_OP_SHUTDOWN,
+                .flags = VSOCK_SHUTDOWN_RCV | VSOCK_SHUTDOWN_SEND,
+            };
+        }
+        if (port && port->connected) {
+            hdr.buf_alloc = vsock_port_buf_alloc(port);
+            hdr.fwd_cnt = port->fwd_cnt;
+            port->fwd_cnt_sent = port->fwd_cnt;
+        }
+        vm_host_iovec_t host_iov[2] = {
+            { .base = &hdr, .len = sizeof(hdr) },
+            { .base = msg ? msg->data + port->rx_offset : NULL, .len = len }
+        };
+        size_t written = 0;
+        vm_guest_writev(emul->vm, host_iov, 2, guest_iov, guest_iovcnt, &written);
+        idx += chain.num;
+        used_idx += ring_used_write(emul, queue, used_idx, &chain, written);
+        if (msg) {
+            port->tx_cnt += len;
+            port->rx_offset += len;
+            if (msg->type != VSOCK_PORT_MSG_DATA || port->rx_offset == msg->len) {
+                port->notify |= crossvm_ring_consume_commit(&port->from_component, 1);
+                port->rx_offset = 0;
+            }
+            vsock->rx_next = (port - vsock->ports + 1) % vsock->num_ports;
+        }
+    }
+    emul->virtq.last_idx[queue] = idx;
+    ring_avail_event_set(emul, queue, idx);
+    if (used_idx == old_used_idx) {
+        return false;
+    }
+    ring_used_publish(emul, queue, used_idx);
+    return ring_need_interrupt(emul, queue, old_used_idx, used_idx);
+}
+
+static void emul_vsock_notify(virtio_emul_t *emul)
+{
+    vsock_internal_t *vsock = emul->internal;
+    for (unsigned int i = 0; i < vsock->num_ports; i++) {
+        crossvm_ring_finish_wait(&vsock->ports[i].to_component, true);
+        crossvm_ring_finish_wait(&vsock->ports[i].from_component, false);
+    }
+    bool irq = false;
+    bool again;
+    do {
+        irq |= vsock_notify_tx(vsock);
+        for (unsigned int i = 0; i < vsock->num_ports; i++) {
+            vsock_port_credit(vsock, &vsock->ports[i]);
+        }
+        irq |= vsock_flush_rx(vsock);
+        /* have the components notify us of the data they send next and of the
+         * data they consume, carrying on if they already have */
+        again = false;
+        for (unsigned int i = 0; i < vsock->num_ports; i++) {
+            vsock_port_t *port = &vsock->ports[i];
+            if (!port->connected) {
+                continue;
+            }
+            if (!crossvm_ring_available(&port->from_component) &&
+                !crossvm_ring_prepare_wait(&port->from_component, false)) {
+                again = true;
+            }
+            if (port->tail != port->to_component.index) {
+                unsigned int control_tail = vsock->control_tail;
+                vsock_port_wait_consume(port);
+                vsock_port_credit(vsock, port);
+                again |= vsock->control_tail != control_tail;
+            }
+        }
+    } while (again);
+    /* components are notified once for everything committed to their rings */
+    for (unsigned int i = 0; i < vsock->num_ports; i++) {
+        vsock_port_t *port = &vsock->ports[i];
+        if (port->notify) {
+            port->notify = false;
+            seL4_Signal(port->notification);
+        }
+    }
+    if (irq) {
+        vsock->driver.handleIRQ(vsock->driver.vsock_data);
+    }
+}
+
+static void emul_vsock_notify_queue(virtio_emul_t *emul, unsigned int queue)
+{
+    /* events are never sent, leaving the event queue's buffers with the device */
+    if (queue != VSOCK_EVENT_QUEUE) {
+        emul_vsock_notify(emul);
+    }
+}
+
+static bool vsock_device_emul_io_in(struct virtio_emul *emul, unsigned int offset, unsigned int size,
+                                    unsigned int *result)
+{
+    vsock_internal_t *vsock = emul->internal;
+    unsigned int config_offset = VIRTIO_PCI_CONFIG_OFF(false);
+    if (offset == VIRTIO_PCI_HOST_FEATURES) {
+        assert(size == 4);
+        *result = VSOCK_HOST_FEATURES;
+        return true;
+    }
+    if (offset >= config_offset && offset + size <= config_offset + sizeof(vsock->config)) {
+        /* the configuration may be read in pieces of any size */
+        *result = 0;
+        memcpy(result, (uint8_t *)&vsock->config + offset - config_offset, size);
+        return true;
+    }
+    return false;
+}
+
+static bool vsock_device_emul_io_out(struct virtio_emul *emul, unsigned int offset, unsigned int size,
+                                     unsigned int value)
+{
+    if (offset == VIRTIO_PCI_GUEST_FEATURES) {
+        assert(size == 4);
+        assert(!(value & ~VSOCK_HOST_FEATURES));
+        emul->virtq.features = value;
+        return true;
+    }
+    return false;
+}
+
+int vsock_virtio_emul_add_port(virtio_emul_t *emul, const struct vsock_port *port)
+{
+    vsock_internal_t *vsock = emul->internal;
+    if (vsock->num_ports == VIRTIO_VSOCK_MAX_PORTS) {
+        ZF_LOGE("Failed to add vsock port: At most %d ports are supported", VIRTIO_VSOCK_MAX_PORTS);
+        return -1;
+    }
+    if (vsock_port_find(vsock, port->port)) {
+        ZF_LOGE("Failed to add vsock port: Port %u already added", port->port);
+        return -1;
+    }
+    if (port->slot_size <= sizeof(struct vsock_port_msg)) {
+        ZF_LOGE("Failed to add vsock port: Slots of %u bytes hold no data", port->slot_size);
+        return -1;
+    }
+    vsock_port_t *new_port = &vsock->ports[vsock->num_ports];
+    memset(new_port, 0, sizeof(*new_port));
+    if (crossvm_ring_init(&new_port->to_component, port->to_component, port->to_component_size, port->slot_size) ||
+        crossvm_ring_init(&new_port->from_component, port->from_component, port->from_component_size,
+                          port->slot_size)) {
+        ZF_LOGE("Failed to add vsock port: Unable to lay out rings of %u byte slots", port->slot_size);
+        return -1;
+    }
+    new_port->slot_lens = calloc(new_port->to_component.num_slots, sizeof(uint32_t));
+    if (!new_port->slot_lens) {
+        ZF_LOGE("Failed to add vsock port: Unable to allocate slot accounting");
+        return -1;
+    }
+    new_port->port = port->port;
+    new_port->notification = port->notification;
+    vsock->num_ports++;
+    return 0;
+}
+
+void *vsock_virtio_emul_init(virtio_emul_t *emul, ps_io_ops_t io_ops, vsock_driver_init driver, void *config)
+{
+    vsock_internal_t *internal = calloc(1, sizeof(*internal));
+    if (!internal) {
+        goto error;
+    }
+    int err = driver(&internal->driver, io_ops, config);
+    if (err) {
+        ZF_LOGE("Failed to initialize driver");
+        goto error;
+    }
+    internal->config.guest_cid = internal->driver.guest_cid;
+    emul->notify = emul_vsock_notify;
+    emul->notify_queue = emul_vsock_notify_queue;
+    emul->device_io_in = vsock_device_emul_io_in;
+    emul->device_io_out = vsock_device_emul_io_out;
+    emul->virtq.num_queues = VSOCK_NUM_QUEUES;
+    internal->emul = emul;
+    return (void *)internal;
+error:
+    if (emul) {
+        free(emul);
+    }
+    if (internal) {
+        free(internal);
+    }
+    return NULL;
+}
@@ -0,0 +1,94 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sel4/sel4.h>
+#include <vka/vka.h>
+#include <vka/capops.h>
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_memory.h>
+#include <sel4vm/guest_ram.h>
+
+#include <sel4vmmplatsupport/guest_image.h>
+
+struct image_frame_iterator_cookie {
+    vm_t *vm;
+    seL4_CPtr *frames;
+    int num_frames;
+    size_t frame_size_bits;
+    uintptr_t load_address;
+    seL4_CapRights_t rights;
+};
+
+static vm_frame_t image_frame_iterator(uintptr_t addr, void *cookie)
+{
+    struct image_frame_iterator_cookie *image = (struct image_frame_iterator_cookie *)cookie;
+    vm_frame_t frame_result = { seL4_CapNull, seL4_NoRights, 0, 0 };
+    int idx = (addr - image->load_address) >> image->frame_size_bits;
+    if (idx < 0 || idx >= image->num_frames) {
+        ZF_LOGE("Failed to map image frame: Address %p is outside the image", (void *)addr);
+        return frame_result;
+    }
+
+    /* The source frames are likely already mapped elsewhere, so the guest is given copies */
+    cspacepath_t src, dest;
+    int ret = vka_cspace_alloc_path(image->vm->vka, &dest);
+    if (ret) {
+        ZF_LOGE("Failed to map image frame: Unable to allocate cspace path");
+        return frame_result;
+    }
+    vka_cspace_make_path(image->vm->vka, image->frames[idx], &src);
+    ret = vka_cnode_copy(&dest, &src, seL4_AllRights);
+    if (ret) {
+        ZF_LOGE("Failed to map image frame: Unable to copy frame cap");
+        vka_cspace_free_path(image->vm->vka, dest);
+        return frame_result;
+    }
+
+    frame_result.cptr = dest.capPtr;
+    frame_result.rights = image->rights;
+    frame_result.vaddr = addr;
+    frame_result.size_bits = image->frame_size_bits;
+    return frame_result;
+}
+
+int vm_map_guest_module(vm_t *vm, seL4_CPtr *frames, int num_frames, size_t frame_size_bits, size_t size,
+                        uintptr_t load_address, bool writable, guest_image_t *guest_image)
+{
+    if (!size || size > ((size_t)num_frames << frame_size_bits)) {
+        ZF_LOGE("Failed to map guest module: Size 0x%zx doesn't fit in the %d frames given", size, num_frames);
+        return -1;
+    }
+    if (!IS_ALIGNED(load_address, frame_size_bits)) {
+        ZF_LOGE("Failed to map guest module: Load address %p isn't aligned to the frame size", (void *)load_address);
+        return -1;
+    }
+
+    struct image_frame_iterator_cookie cookie = {
+        .vm = vm,
+        .frames = frames,
+        .num_frames = num_frames,
+        .frame_size_bits = frame_size_bits,
+        .load_address = load_address,
+        .rights = writable ? seL4_AllRights : seL4_CanRead,
+    };
+    size_t bytes = ROUND_UP(size, BIT(frame_size_bits));
+    int err = vm_ram_register_at_custom_iterator(vm, load_address, bytes, image_frame_iterator, &cookie);
+    if (err) {
+        ZF_LOGE("Failed to map guest module: Unable to register its frames as RAM");
+        return -1;
+    }
+    vm_ram_mark_allocated(vm, load_address, bytes);
+
+    guest_image->load_paddr = load_address;
+    guest_image->alignment = BIT(frame_size_bits);
+    guest_image->size = size;
+    return 0;
+}
@@ -0,0 +1,178 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <utils/util.h>
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_ram.h>
+
+#include "guest_image_lz4.h"
+
+/* Legacy blocks are independent and each decompresses to at most 8MiB */
+#define LZ4_LEGACY_BLOCK_SIZE BIT(23)
+#define LZ4_COMPRESS_BOUND(size) ((size) + (size) / 255 + 16)
+#define LZ4_MIN_MATCH 4
+
+bool image_is_lz4(void *file)
+{
+    uint32_t magic = LZ4_LEGACY_MAGIC;
+    return !memcmp(file, &magic, sizeof(magic));
+}
+
+static int read_full(image_read_fn read_fn, void *cookie, void *buf, size_t len)
+{
+    size_t done = 0;
+    while (done < len) {
+        ssize_t ret = read_fn(cookie, buf + done, len - done);
+        if (ret <= 0) {
+            return done ? -1 : 1;
+        }
+        done += ret;
+    }
+    return 0;
+}
+
+/* Read the extension bytes of a literal or match length */
+static int lz4_read_length(const uint8_t **ip, const uint8_t *iend, size_t *length)
+{
+    uint8_t byte;
+    do {
+        if (*ip >= iend) {
+            return -1;
+        }
+        byte = *(*ip)++;
+        *length += byte;
+    } while (byte == 255);
+    return 0;
+}
+
+/* Decompress a single lz4 block, returning the decompressed size or -1 if the block is malformed */
+static ssize_t lz4_decompress_block(const uint8_t *src, size_t src_len, uint8_t *dst, size_t dst_len)
+{
+    const uint8_t *ip = src;
+    const uint8_t *iend = src + src_len;
+    uint8_t *op = dst;
+    uint8_t *oend = dst + dst_len;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        size_t length = token >> 4;
+        if (length == 15 && lz4_read_length(&ip, iend, &length)) {
+            return -1;
+        }
+        if (length > iend - ip || length > oend - op) {
+            return -1;
+        }
+        memcpy(op, ip, length);
+        ip += length;
+        op += length;
+        /* The last sequence of a block has only literals */
+        if (ip == iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op - dst) {
+            return -1;
+        }
+        length = token & 15;
+        if (length == 15 && lz4_read_length(&ip, iend, &length)) {
+            return -1;
+        }
+        length += LZ4_MIN_MATCH;
+        if (length > oend - op) {
+            return -1;
+        }
+        /* Matches may overlap their own output, so are copied forwards */
+        const uint8_t *match = op - offset;
+        if (offset >= length) {
+            memcpy(op, match, length);
+            op += length;
+        } else {
+            while (length--) {
+                *op++ = *match++;
+            }
+        }
+    }
+    return op - dst;
+}
+
+int load_lz4_image(vm_t *vm, image_read_fn read_fn, void *cookie, uintptr_t load_addr, size_t *image_size)
+{
+    int ret = -1;
+    size_t offset = 0;
+    uint8_t *in = malloc(LZ4_COMPRESS_BOUND(LZ4_LEGACY_BLOCK_SIZE));
+    uint8_t *out = NULL;
+    if (!in) {
+        ZF_LOGE("Failed to load lz4 image: Unable to allocate input buffer");
+        return -1;
+    }
+
+    while (1) {
+        uint32_t block_len;
+        int err = read_full(read_fn, cookie, &block_len, sizeof(block_len));
+        if (err > 0) {
+            /* The image ends after a whole block */
+            ret = 0;
+            break;
+        }
+        if (err) {
+            ZF_LOGE("Failed to load lz4 image: Truncated block header");
+            break;
+        }
+        /* Concatenated images each start with the magic again */
+        if (block_len == LZ4_LEGACY_MAGIC) {
+            continue;
+        }
+        if (block_len > LZ4_COMPRESS_BOUND(LZ4_LEGACY_BLOCK_SIZE)) {
+            ZF_LOGE("Failed to load lz4 image: Invalid block length 0x%x", block_len);
+            break;
+        }
+        if (read_full(read_fn, cookie, in, block_len)) {
+            ZF_LOGE("Failed to load lz4 image: Truncated block");
+            break;
+        }
+
+        /* Decompress straight into guest RAM where it can be, or else through a block sized buffer */
+        uintptr_t block_addr = load_addr + offset;
+        uint8_t *dst = vm_guest_ram_vaddr(vm, block_addr, LZ4_LEGACY_BLOCK_SIZE);
+        if (!dst) {
+            if (!out) {
+                out = malloc(LZ4_LEGACY_BLOCK_SIZE);
+                if (!out) {
+                    ZF_LOGE("Failed to load lz4 image: Unable to allocate output buffer");
+                    break;
+                }
+            }
+            dst = out;
+        }
+        ssize_t len = lz4_decompress_block(in, block_len, dst, LZ4_LEGACY_BLOCK_SIZE);
+        if (len < 0) {
+            ZF_LOGE("Failed to load lz4 image: Corrupt block at offset 0x%zx", offset);
+            break;
+        }
+
+        vm_ram_mark_allocated(vm, block_addr, len);
+        if (dst == out && vm_ram_touch(vm, block_addr, len, vm_guest_ram_stream_write_callback, out)) {
+            ZF_LOGE("Failed to load lz4 image: Unable to write block to guest address %p", (void *)block_addr);
+            break;
+        }
+        offset += len;
+    }
+
+    free(in);
+    free(out);
+    *image_size = offset;
+    return ret;
+}
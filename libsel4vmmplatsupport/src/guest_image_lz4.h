@@ -0,0 +1,27 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include <sel4vm/guest_vm.h>
+
+/* Images compressed in the lz4 legacy format, as produced by `lz4 -l` and used for Linux kernel images */
+#define LZ4_LEGACY_MAGIC 0x184C2102
+
+/* Read up to len bytes of an image into buf, returning the number read, 0 at the end of the image or -1 on error */
+typedef ssize_t (*image_read_fn)(void *cookie, void *buf, size_t len);
+
+/* Whether the start of an image is the lz4 legacy magic */
+bool image_is_lz4(void *file);
+
+/* Decompress an lz4 legacy image into guest RAM at load_addr, reading it through read_fn from just after its
+ * magic. Each block is decompressed straight into guest RAM if it is direct mapped, otherwise through a buffer
+ * of a single block. Returns 0 on success, setting the decompressed size, otherwise -1 */
+int load_lz4_image(vm_t *vm, image_read_fn read_fn, void *cookie, uintptr_t load_addr, size_t *image_size);
@@ -4,6 +4,9 @@
  * SPDX-License-Identifier: BSD-2-Clause
  */
 
+#include <autoconf.h>
+#include <sel4vm/gen_config.h>
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,6 +18,7 @@
 #include <sel4vm/guest_vm.h>
 #include <sel4vm/guest_memory.h>
 #include <sel4vm/guest_memory_helpers.h>
+#include <sel4vm/guest_iospace.h>
 
 #include <sel4vmmplatsupport/guest_memory_util.h>
 
@@ -32,6 +36,13 @@ struct ut_alloc_iterator_cookie {
     vm_memory_reservation_t *reservation;
     uintptr_t paddr;
     bool with_paddr;
+    /* Frames retyped ahead of the iterator, which maps the reservation in address order */
+    vm_frame_batch_t batch;
+};
+
+struct frame_alloc_iterator_cookie {
+    vm_t *vm;
+    vm_memory_reservation_t *reservation;
 };
 
 static vm_frame_t device_frame_iterator(uintptr_t addr, void *cookie)
@@ -67,48 +78,129 @@ static vm_frame_t device_frame_iterator(uintptr_t addr, void *cookie)
     return frame_result;
 }
 
+static int ut_alloc_frame(vm_t *vm, uintptr_t alloc_addr, size_t page_size, cspacepath_t *path)
+{
+    int error = vka_cspace_alloc_path(vm->vka, path);
+    if (error) {
+        ZF_LOGE("Failed to allocate path");
+        return error;
+    }
+    error = simple_get_frame_cap(vm->simple, (void *)alloc_addr, page_size, path);
+    if (error) {
+        /* attempt to allocate */
+        uintptr_t vka_cookie;
+        error = vka_utspace_alloc_at(vm->vka, path, kobject_get_type(KOBJECT_FRAME, page_size), page_size, alloc_addr,
+                                     &vka_cookie);
+    }
+    if (error) {
+        vka_cspace_free_path(vm->vka, *path);
+    }
+    return error;
+}
+
+/* Frame sizes untyped backed reservations are mapped with, largest first */
+static const size_t ut_frame_bits[] = {
+#ifdef seL4_HugePageBits
+    seL4_HugePageBits,
+#endif
+    seL4_LargePageBits,
+    seL4_PageBits
+};
+
+/* Whether a frame of the given size can back the reservation at an address mapping
+ * 'paddr_offset' bytes on in physical memory */
+static bool ut_frame_fits(vm_t *vm, vm_memory_reservation_t *reservation, uintptr_t addr, uintptr_t paddr_offset,
+                          size_t size_bits)
+{
+    if (size_bits == seL4_PageBits) {
+        return true;
+    }
+    /* IO spaces only map 4K frames */
+    if (!config_set(CONFIG_LIB_SEL4VM_LARGE_FRAMES) || vm_guest_num_iospaces(vm)) {
+        return false;
+    }
+    uintptr_t base_vaddr;
+    size_t size;
+    vm_get_reservation_memory_region(reservation, &base_vaddr, &size);
+    /* The physical address has to share the alignment of the guest address */
+    return IS_ALIGNED(addr, size_bits) && IS_ALIGNED(paddr_offset, size_bits) && addr >= base_vaddr &&
+           addr + BIT(size_bits) <= base_vaddr + size;
+}
+
+/* Size of the largest frame that fits the reservation at an address */
+static size_t ut_frame_bits_at(vm_t *vm, vm_memory_reservation_t *reservation, uintptr_t addr, uintptr_t paddr_offset)
+{
+    for (int i = 0; i < ARRAY_SIZE(ut_frame_bits); i++) {
+        if (ut_frame_fits(vm, reservation, addr, paddr_offset, ut_frame_bits[i])) {
+            return ut_frame_bits[i];
+        }
+    }
+    return seL4_PageBits;
+}
+
+/* Take the frame from the iterator's batch, retyping a new batch of the frames
+ * of the same size that follow it if the batch doesn't hold it */
+static int ut_alloc_batch_frame(struct ut_alloc_iterator_cookie *alloc_cookie, uintptr_t addr,
+                                uintptr_t paddr_offset, size_t page_size, cspacepath_t *path)
+{
+    vm_t *vm = alloc_cookie->vm;
+    uintptr_t paddr = ROUND_DOWN(addr + paddr_offset, BIT(page_size));
+    seL4_CPtr frame = vm_frame_batch_take(&alloc_cookie->batch, paddr, page_size);
+    if (frame == seL4_CapNull) {
+        uintptr_t base_vaddr;
+        size_t size;
+        vm_get_reservation_memory_region(alloc_cookie->reservation, &base_vaddr, &size);
+        unsigned int num_frames = 0;
+        for (uintptr_t frame_addr = ROUND_DOWN(addr, BIT(page_size));
+             num_frames < VM_FRAME_BATCH_MAX_FRAMES && frame_addr + BIT(page_size) <= base_vaddr + size &&
+             ut_frame_bits_at(vm, alloc_cookie->reservation, frame_addr, paddr_offset) == page_size;
+             frame_addr += BIT(page_size)) {
+            num_frames++;
+        }
+        frame = vm_frame_batch_alloc(vm, &alloc_cookie->batch, paddr, page_size, num_frames);
+    }
+    if (frame == seL4_CapNull) {
+        return -1;
+    }
+    vka_cspace_make_path(vm->vka, frame, path);
+    return 0;
+}
+
 static vm_frame_t ut_alloc_iterator(uintptr_t addr, void *cookie)
 {
-    int ret;
-    int error;
-    vka_object_t object;
-    uintptr_t alloc_addr;
+    int error = -1;
     cspacepath_t path;
     vm_frame_t frame_result = { seL4_CapNull, seL4_NoRights, 0, 0 };
     struct ut_alloc_iterator_cookie *alloc_cookie = (struct ut_alloc_iterator_cookie *)cookie;
     vm_t *vm = alloc_cookie->vm;
-    int page_size = seL4_PageBits;
-    uintptr_t frame_start = ROUND_DOWN(addr, BIT(page_size));
+    size_t page_size = seL4_PageBits;
+    uintptr_t paddr_offset = 0;
 
     if (alloc_cookie->with_paddr) {
         uintptr_t base_vaddr;
         size_t size;
         vm_get_reservation_memory_region(alloc_cookie->reservation, &base_vaddr, &size);
-        alloc_addr = ROUND_DOWN(alloc_cookie->paddr + (addr - base_vaddr),  BIT(page_size));
-    } else {
-        alloc_addr = frame_start;
-    }
-    error = vka_cspace_alloc_path(vm->vka, &path);
-    if (error) {
-        ZF_LOGE("Failed to allocate path");
-        return frame_result;
+        paddr_offset = alloc_cookie->paddr - base_vaddr;
     }
-    error = simple_get_frame_cap(vm->simple, (void *)alloc_addr, page_size, &path);
-    if (error) {
-        /* attempt to allocate */
-        uintptr_t vka_cookie;
-        error = vka_utspace_alloc_at(vm->vka, &path, kobject_get_type(KOBJECT_FRAME, page_size), page_size, alloc_addr,
-                                     &vka_cookie);
+    /* Map with the largest frame that fits, falling back onto smaller frames
+     * where the untyped or device memory cannot provide it */
+    for (int i = 0; error && i < ARRAY_SIZE(ut_frame_bits); i++) {
+        page_size = ut_frame_bits[i];
+        if (ut_frame_fits(vm, alloc_cookie->reservation, addr, paddr_offset, page_size)) {
+            error = ut_alloc_batch_frame(alloc_cookie, addr, paddr_offset, page_size, &path);
+            if (error) {
+                error = ut_alloc_frame(vm, ROUND_DOWN(addr + paddr_offset, BIT(page_size)), page_size, &path);
+            }
+        }
     }
     if (error) {
         ZF_LOGE("Failed to allocate page");
-        vka_cspace_free_path(vm->vka, path);
         return frame_result;
     }
 
     frame_result.cptr = path.capPtr;
     frame_result.rights = seL4_AllRights;
-    frame_result.vaddr = frame_start;
+    frame_result.vaddr = ROUND_DOWN(addr, BIT(page_size));
     frame_result.size_bits = page_size;
     return frame_result;
 }
@@ -141,20 +233,25 @@ static vm_frame_t frame_alloc_iterator(uintptr_t addr, void *cookie)
     int ret;
     vka_object_t object;
     vm_frame_t frame_result = { seL4_CapNull, seL4_NoRights, 0, 0 };
-    vm_t *vm = (vm_t *)cookie;
-    if (!vm) {
+    struct frame_alloc_iterator_cookie *alloc_cookie = (struct frame_alloc_iterator_cookie *)cookie;
+    if (!alloc_cookie) {
         return frame_result;
     }
-    int page_size = seL4_PageBits;
-    uintptr_t frame_start = ROUND_DOWN(addr, BIT(page_size));
+    vm_t *vm = alloc_cookie->vm;
+    size_t page_size = vm_get_reservation_frame_size_bits(alloc_cookie->reservation, addr);
     ret = vka_alloc_frame(vm->vka, page_size, &object);
+    if (ret && page_size != seL4_PageBits) {
+        /* Fall back onto a 4K frame */
+        page_size = seL4_PageBits;
+        ret = vka_alloc_frame(vm->vka, page_size, &object);
+    }
     if (ret) {
         ZF_LOGE("Failed to allocate frame for address 0x%x", addr);
         return frame_result;
     }
     frame_result.cptr = object.cptr;
     frame_result.rights = seL4_AllRights;
-    frame_result.vaddr = frame_start;
+    frame_result.vaddr = ROUND_DOWN(addr, BIT(page_size));
     frame_result.size_bits = page_size;
     return frame_result;
 }
@@ -327,7 +424,16 @@ int map_ut_alloc_reservation_with_base_paddr(vm_t *vm, uintptr_t paddr, vm_memor
 
 int map_frame_alloc_reservation(vm_t *vm, vm_memory_reservation_t *reservation)
 {
-    return vm_map_reservation(vm, reservation, frame_alloc_iterator, (void *)vm);
+    struct frame_alloc_iterator_cookie *cookie;
+    ps_io_ops_t *ops = vm->io_ops;
+    int err = ps_calloc(&ops->malloc_ops, 1, sizeof(struct frame_alloc_iterator_cookie), (void **)&cookie);
+    if (err) {
+        ZF_LOGE("Failed to map frame alloc reservation: Unable to allocate cookie");
+        return -1;
+    }
+    cookie->vm = vm;
+    cookie->reservation = reservation;
+    return vm_map_reservation(vm, reservation, frame_alloc_iterator, (void *)cookie);
 }
 
 int map_maybe_device_reservation(vm_t *vm, vm_memory_reservation_t *reservation)
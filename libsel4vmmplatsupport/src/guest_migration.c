@@ -0,0 +1,687 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <inttypes.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sel4/sel4.h>
+#include <utils/util.h>
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_ram.h>
+
+#include <sel4vmmplatsupport/guest_migration.h>
+#include <sel4vmmplatsupport/drivers/cross_vm_ring.h>
+
+#include "guest_migration_arch.h"
+
+#define PAGE_WORDS (PAGE_SIZE_4K / sizeof(uint64_t))
+#define BITMAP_BITS (sizeof(unsigned long) * CHAR_BIT)
+
+typedef struct migration_region {
+    uintptr_t start;
+    size_t size;
+    size_t num_pages;
+    /* pages left to send in this round */
+    unsigned long *pending;
+    /* pages dirtied during the last round, as fetched from the dirty log */
+    unsigned long *dirty;
+} migration_region_t;
+
+typedef struct migration_device {
+    char name[VM_MIGRATION_DEVICE_NAME_LEN];
+    vm_migration_save_fn save;
+    vm_migration_load_fn load;
+    void *cookie;
+    bool loaded;
+} migration_device_t;
+
+typedef enum migration_state {
+    MIGRATION_INIT,
+    /* source: pre-copying RAM with the guest running */
+    MIGRATION_PRECOPY,
+    /* source: sending the last round with the guest stopped */
+    MIGRATION_STOPPED,
+    /* destination: the header has been received */
+    MIGRATION_RECEIVING,
+    MIGRATION_DONE,
+    MIGRATION_FAILED,
+} migration_state_t;
+
+struct vm_migration {
+    vm_t *vm;
+    bool source;
+    migration_state_t state;
+    /* ring shared with the network component, produced into by the source and consumed from by the destination */
+    crossvm_ring_t ring;
+    seL4_CPtr notification;
+    migration_region_t *regions;
+    size_t num_regions;
+    migration_device_t *devices;
+    size_t num_devices;
+    size_t max_rounds;
+    size_t stop_pages;
+    /* the first round is being sent, with the destination's RAM still all zero */
+    bool initial;
+    /* position of the next page to send, then of the next vcpu and device of the last round */
+    size_t region;
+    size_t page;
+    unsigned int next_vcpu;
+    size_t next_device;
+    /* the record being sent or received, built from or applied to 'page' */
+    struct vm_migration_record *record;
+    bool record_pending;
+    bool waiting;
+    uint64_t page_buf[PAGE_WORDS];
+    vm_migration_stats_t stats;
+};
+
+static size_t record_slots(crossvm_ring_t *ring, size_t len)
+{
+    return DIV_ROUND_UP(sizeof(struct vm_migration_record) + len, ring->slot_size);
+}
+
+/* Copy 'len' bytes to or from the ring starting at the slot 'idx', carrying on from the last slot to the first */
+static void ring_copy(crossvm_ring_t *ring, uint32_t idx, void *buf, size_t len, bool to_ring)
+{
+    size_t ring_bytes = (size_t)ring->num_slots * ring->slot_size;
+    size_t start = (size_t)(idx & (ring->num_slots - 1)) * ring->slot_size;
+    size_t first = MIN(len, ring_bytes - start);
+    if (to_ring) {
+        memcpy(ring->slots + start, buf, first);
+        memcpy(ring->slots, (uint8_t *)buf + first, len - first);
+    } else {
+        memcpy(buf, ring->slots + start, first);
+        memcpy((uint8_t *)buf + first, ring->slots, len - first);
+    }
+}
+
+/* Free slots of the ring. The consumer's tail is read every time, as a record
+ * can need more slots than the ones last known to be free */
+static uint32_t ring_free(crossvm_ring_t *ring)
+{
+    uint32_t tail = crossvm_ring_peer_load(ring, &ring->shared->consumer.tail, ring->peer_index, ring->index);
+    return ring->num_slots - (ring->index - tail);
+}
+
+/* Put the pending record in the ring. Returns false if there is no room for it,
+ * with the network component to notify us once it has freed slots */
+static bool migration_put(vm_migration_t *migration)
+{
+    crossvm_ring_t *ring = &migration->ring;
+    size_t len = sizeof(*migration->record) + migration->record->len;
+    uint32_t num_slots = record_slots(ring, migration->record->len);
+    if (ring_free(ring) < num_slots) {
+        __atomic_store_n(&ring->shared->producer.wait_seq, ++ring->wait_seq, __ATOMIC_RELAXED);
+        __atomic_store_n(&ring->shared->producer.waiting, 1, __ATOMIC_RELEASE);
+        /* pairs with the network component's order of moving its tail before reading the flag */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        migration->waiting = true;
+        if (ring_free(ring) < num_slots) {
+            return false;
+        }
+    }
+    if (migration->waiting) {
+        crossvm_ring_finish_wait(ring, true);
+        migration->waiting = false;
+    }
+    ring_copy(ring, ring->index, migration->record, len, true);
+    if (crossvm_ring_produce_commit(ring, num_slots)) {
+        seL4_Signal(migration->notification);
+    }
+    migration->record_pending = false;
+    migration->stats.bytes += len;
+    return true;
+}
+
+/* Run length encode a page into 'out', returning the length of the encoding or
+ * 0 if it takes more than 'size' bytes */
+static size_t rle_encode(const uint64_t *words, uint8_t *out, size_t size, size_t *num_literals)
+{
+    size_t len = 0;
+    size_t i = 0;
+    *num_literals = 0;
+    while (i < PAGE_WORDS) {
+        struct vm_migration_rle_run run = { 0 };
+        for (; i < PAGE_WORDS && !words[i]; i++) {
+            run.zeros++;
+        }
+        /* a single zero word costs less as a new run than as a literal */
+        size_t first = i;
+        for (; i < PAGE_WORDS && words[i]; i++) {
+            run.literals++;
+        }
+        size_t literal_len = run.literals * sizeof(uint64_t);
+        if (len + sizeof(run) + literal_len > size) {
+            return 0;
+        }
+        memcpy(out + len, &run, sizeof(run));
+        memcpy(out + len + sizeof(run), &words[first], literal_len);
+        len += sizeof(run) + literal_len;
+        *num_literals += run.literals;
+    }
+    return len;
+}
+
+static int rle_decode(const uint8_t *in, size_t len, uint64_t *words)
+{
+    size_t i = 0;
+    size_t pos = 0;
+    while (pos < len) {
+        struct vm_migration_rle_run run;
+        if (len - pos < sizeof(run)) {
+            return -1;
+        }
+        memcpy(&run, in + pos, sizeof(run));
+        pos += sizeof(run);
+        size_t literal_len = run.literals * sizeof(uint64_t);
+        if (run.zeros > PAGE_WORDS - i || run.literals > PAGE_WORDS - i - run.zeros || literal_len > len - pos) {
+            return -1;
+        }
+        memset(&words[i], 0, run.zeros * sizeof(uint64_t));
+        i += run.zeros;
+        memcpy(&words[i], in + pos, literal_len);
+        i += run.literals;
+        pos += literal_len;
+    }
+    return i == PAGE_WORDS ? 0 : -1;
+}
+
+/* Find the next page left to send in this round, taking it off the pending set */
+static bool migration_next_page(vm_migration_t *migration, uintptr_t *addr)
+{
+    for (; migration->region < migration->num_regions; migration->region++, migration->page = 0) {
+        migration_region_t *region = &migration->regions[migration->region];
+        while (migration->page < region->num_pages) {
+            size_t page = migration->page;
+            unsigned long word = region->pending[page / BITMAP_BITS] >> (page % BITMAP_BITS);
+            if (!word) {
+                migration->page = ROUND_UP(page + 1, BITMAP_BITS);
+                continue;
+            }
+            page += CTZL(word);
+            region->pending[page / BITMAP_BITS] &= ~BIT(page % BITMAP_BITS);
+            migration->page = page + 1;
+            *addr = region->start + page * PAGE_SIZE_4K;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Add the pages dirtied since the dirty log was last fetched to the pending set, starting a new round */
+static int migration_collect_dirty(vm_migration_t *migration, size_t *num_dirty)
+{
+    *num_dirty = 0;
+    for (size_t i = 0; i < migration->num_regions; i++) {
+        migration_region_t *region = &migration->regions[i];
+        if (vm_ram_get_dirty_log(migration->vm, region->start, region->size, region->dirty, true)) {
+            ZF_LOGE("Failed to collect dirty pages: Unable to get dirty log of region at 0x%"PRIxPTR, region->start);
+            return -1;
+        }
+        for (size_t w = 0; w < DIV_ROUND_UP(region->num_pages, BITMAP_BITS); w++) {
+            region->pending[w] |= region->dirty[w];
+            *num_dirty += __builtin_popcountl(region->dirty[w]);
+        }
+    }
+    migration->region = 0;
+    migration->page = 0;
+    /* pages already sent may now be zero, and have to be sent as such */
+    migration->initial = false;
+    return 0;
+}
+
+/* Build the record of a page, which is not built if the page is zero and the destination has it zeroed already */
+static int migration_build_page(vm_migration_t *migration, uintptr_t addr)
+{
+    struct vm_migration_record *record = migration->record;
+    uint64_t *words = migration->page_buf;
+    if (vm_ram_touch(migration->vm, addr, PAGE_SIZE_4K, vm_guest_ram_read_callback, words)) {
+        ZF_LOGE("Failed to send page: Unable to read page at 0x%"PRIxPTR, addr);
+        return -1;
+    }
+    size_t num_literals;
+    size_t len = rle_encode(words, record->data, PAGE_SIZE_4K - sizeof(uint64_t), &num_literals);
+    record->arg = addr;
+    if (len && !num_literals) {
+        if (migration->initial) {
+            migration->stats.elided_pages++;
+            return 0;
+        }
+        record->type = VM_MIGRATION_RECORD_PAGE_ZERO;
+        record->len = 0;
+        migration->stats.zero_pages++;
+    } else if (len) {
+        record->type = VM_MIGRATION_RECORD_PAGE_RLE;
+        record->len = len;
+        migration->stats.rle_pages++;
+    } else {
+        record->type = VM_MIGRATION_RECORD_PAGE;
+        record->len = PAGE_SIZE_4K;
+        memcpy(record->data, words, PAGE_SIZE_4K);
+        migration->stats.pages++;
+    }
+    migration->record_pending = true;
+    return 0;
+}
+
+/* Build the next record of the last round once all pages have been sent */
+static int migration_build_state(vm_migration_t *migration)
+{
+    vm_t *vm = migration->vm;
+    struct vm_migration_record *record = migration->record;
+    size_t len = 0;
+    if (migration->next_vcpu < vm->num_vcpus) {
+        vm_vcpu_t *vcpu = vm->vcpus[migration->next_vcpu++];
+        if (vm_migration_vcpu_save(vcpu, record->data, VM_MIGRATION_MAX_RECORD_DATA, &len)) {
+            ZF_LOGE("Failed to send vcpu %u: Unable to save vcpu state", vcpu->vcpu_id);
+            return -1;
+        }
+        record->type = VM_MIGRATION_RECORD_VCPU;
+        record->arg = vcpu->vcpu_id;
+    } else if (migration->next_device < migration->num_devices) {
+        migration_device_t *device = &migration->devices[migration->next_device++];
+        memcpy(record->data, device->name, VM_MIGRATION_DEVICE_NAME_LEN);
+        if (device->save(device->cookie, record->data + VM_MIGRATION_DEVICE_NAME_LEN, VM_MIGRATION_MAX_DEVICE_STATE,
+                         &len) || len > VM_MIGRATION_MAX_DEVICE_STATE) {
+            ZF_LOGE("Failed to send device %s: Unable to save device state", device->name);
+            return -1;
+        }
+        record->type = VM_MIGRATION_RECORD_DEVICE;
+        record->arg = 0;
+        len += VM_MIGRATION_DEVICE_NAME_LEN;
+    } else {
+        record->type = VM_MIGRATION_RECORD_END;
+        record->arg = 0;
+    }
+    record->len = len;
+    migration->record_pending = true;
+    return 0;
+}
+
+static void migration_free(vm_migration_t *migration)
+{
+    for (size_t i = 0; i < migration->num_regions; i++) {
+        free(migration->regions[i].pending);
+        free(migration->regions[i].dirty);
+    }
+    free(migration->regions);
+    free(migration->devices);
+    free(migration->record);
+    free(migration);
+}
+
+vm_migration_t *vm_migration_init(vm_t *vm, void *ring, size_t ring_size, uint32_t slot_size, seL4_CPtr notification,
+                                  bool source)
+{
+    if (slot_size < sizeof(struct vm_migration_record)) {
+        ZF_LOGE("Failed to initialise migration: Slots of %u bytes are too small", slot_size);
+        return NULL;
+    }
+    vm_migration_t *migration = calloc(1, sizeof(*migration));
+    if (!migration) {
+        ZF_LOGE("Failed to initialise migration: Unable to allocate migration");
+        return NULL;
+    }
+    migration->record = malloc(sizeof(*migration->record) + VM_MIGRATION_MAX_RECORD_DATA);
+    if (!migration->record) {
+        ZF_LOGE("Failed to initialise migration: Unable to allocate record");
+        migration_free(migration);
+        return NULL;
+    }
+    if (crossvm_ring_init(&migration->ring, ring, ring_size, slot_size)) {
+        ZF_LOGE("Failed to initialise migration: Unable to lay out ring");
+        migration_free(migration);
+        return NULL;
+    }
+    if (record_slots(&migration->ring, VM_MIGRATION_MAX_RECORD_DATA) > migration->ring.num_slots) {
+        ZF_LOGE("Failed to initialise migration: Ring has no room for the largest record");
+        migration_free(migration);
+        return NULL;
+    }
+    migration->vm = vm;
+    migration->source = source;
+    migration->notification = notification;
+    return migration;
+}
+
+int vm_migration_register_device(vm_migration_t *migration, const char *name, vm_migration_save_fn save,
+                                 vm_migration_load_fn load, void *cookie)
+{
+    if (migration->state != MIGRATION_INIT) {
+        ZF_LOGE("Failed to register migration device: Migration already started");
+        return -1;
+    }
+    if (!name || strlen(name) >= VM_MIGRATION_DEVICE_NAME_LEN || (migration->source ? !save : !load)) {
+        ZF_LOGE("Failed to register migration device: Invalid name or handlers");
+        return -1;
+    }
+    for (size_t i = 0; i < migration->num_devices; i++) {
+        if (!strcmp(migration->devices[i].name, name)) {
+            ZF_LOGE("Failed to register migration device: Device %s already registered", name);
+            return -1;
+        }
+    }
+    migration_device_t *devices = realloc(migration->devices, sizeof(*devices) * (migration->num_devices + 1));
+    if (!devices) {
+        ZF_LOGE("Failed to register migration device: Unable to allocate device");
+        return -1;
+    }
+    migration->devices = devices;
+    migration_device_t *device = &devices[migration->num_devices++];
+    memset(device, 0, sizeof(*device));
+    strncpy(device->name, name, VM_MIGRATION_DEVICE_NAME_LEN - 1);
+    device->save = save;
+    device->load = load;
+    device->cookie = cookie;
+    return 0;
+}
+
+static int migration_add_region(vm_migration_t *migration, uintptr_t start, size_t size)
+{
+    migration_region_t *regions = realloc(migration->regions, sizeof(*regions) * (migration->num_regions + 1));
+    if (!regions) {
+        return -1;
+    }
+    migration->regions = regions;
+    migration_region_t *region = &regions[migration->num_regions];
+    region->start = start;
+    region->size = size;
+    region->num_pages = size / PAGE_SIZE_4K;
+    size_t num_words = DIV_ROUND_UP(region->num_pages, BITMAP_BITS);
+    region->pending = calloc(num_words, sizeof(unsigned long));
+    region->dirty = calloc(num_words, sizeof(unsigned long));
+    migration->num_regions++;
+    return region->pending && region->dirty ? 0 : -1;
+}
+
+int vm_migration_start(vm_migration_t *migration, size_t max_rounds, size_t stop_pages)
+{
+    vm_t *vm = migration->vm;
+    if (!migration->source || migration->state != MIGRATION_INIT) {
+        ZF_LOGE("Failed to start migration: Not the source of a new migration");
+        return -1;
+    }
+    struct vm_migration_header *header = (struct vm_migration_header *)migration->record->data;
+    size_t max_regions = (VM_MIGRATION_MAX_RECORD_DATA - sizeof(*header)) / sizeof(header->regions[0]);
+    for (int i = 0; i < vm->mem.num_ram_regions; i++) {
+        vm_ram_region_t *ram = &vm->mem.ram_regions[i];
+        if (!ram->allocated) {
+            continue;
+        }
+        if (migration->num_regions == max_regions) {
+            ZF_LOGE("Failed to start migration: Too many regions of guest RAM");
+            return -1;
+        }
+        if (migration_add_region(migration, ram->start, ram->size)) {
+            ZF_LOGE("Failed to start migration: Unable to allocate region");
+            return -1;
+        }
+        if (vm_ram_dirty_log_enable(vm, ram->start, ram->size)) {
+            ZF_LOGE("Failed to start migration: Unable to log region at 0x%"PRIxPTR, ram->start);
+            return -1;
+        }
+        /* the first round sends every page */
+        migration_region_t *region = &migration->regions[migration->num_regions - 1];
+        for (size_t page = 0; page < region->num_pages; page++) {
+            region->pending[page / BITMAP_BITS] |= BIT(page % BITMAP_BITS);
+        }
+    }
+    header->magic = VM_MIGRATION_MAGIC;
+    header->version = VM_MIGRATION_VERSION;
+    header->num_vcpus = vm->num_vcpus;
+    header->num_regions = migration->num_regions;
+    for (size_t i = 0; i < migration->num_regions; i++) {
+        header->regions[i].start = migration->regions[i].start;
+        header->regions[i].size = migration->regions[i].size;
+    }
+    migration->record->type = VM_MIGRATION_RECORD_HEADER;
+    migration->record->len = sizeof(*header) + sizeof(header->regions[0]) * migration->num_regions;
+    migration->record->arg = 0;
+    migration->record_pending = true;
+    migration->max_rounds = max_rounds;
+    migration->stop_pages = stop_pages;
+    migration->initial = true;
+    migration->state = MIGRATION_PRECOPY;
+    return 0;
+}
+
+vm_migration_status_t vm_migration_send(vm_migration_t *migration)
+{
+    if (!migration->source || migration->state == MIGRATION_INIT) {
+        ZF_LOGE("Failed to send migration: Migration not started");
+        return VM_MIGRATION_FAILED;
+    }
+    while (migration->state != MIGRATION_FAILED && migration->state != MIGRATION_DONE) {
+        if (migration->record_pending) {
+            if (!migration_put(migration)) {
+                return VM_MIGRATION_WAIT;
+            }
+            if (migration->record->type == VM_MIGRATION_RECORD_END) {
+                migration->state = MIGRATION_DONE;
+            }
+            continue;
+        }
+        uintptr_t addr;
+        int err;
+        if (migration_next_page(migration, &addr)) {
+            err = migration_build_page(migration, addr);
+        } else if (migration->state == MIGRATION_STOPPED) {
+            err = migration_build_state(migration);
+        } else {
+            /* the round is over, the next one sending what the guest dirtied in the meantime */
+            size_t num_dirty;
+            err = migration_collect_dirty(migration, &num_dirty);
+            if (!err) {
+                migration->stats.rounds++;
+                migration->stats.last_round_pages = num_dirty;
+                if (num_dirty <= migration->stop_pages || migration->stats.rounds >= migration->max_rounds) {
+                    return VM_MIGRATION_CONVERGED;
+                }
+            }
+        }
+        if (err) {
+            migration->state = MIGRATION_FAILED;
+        }
+    }
+    return migration->state == MIGRATION_DONE ? VM_MIGRATION_DONE : VM_MIGRATION_FAILED;
+}
+
+int vm_migration_stop(vm_migration_t *migration)
+{
+    if (!migration->source || migration->state != MIGRATION_PRECOPY) {
+        ZF_LOGE("Failed to stop migration: Migration not pre-copying");
+        return -1;
+    }
+    size_t num_dirty;
+    if (migration_collect_dirty(migration, &num_dirty)) {
+        migration->state = MIGRATION_FAILED;
+        return -1;
+    }
+    migration->stats.last_round_pages = num_dirty;
+    migration->state = MIGRATION_STOPPED;
+    return 0;
+}
+
+static migration_region_t *migration_find_region(vm_migration_t *migration, uint64_t addr)
+{
+    for (size_t i = 0; i < migration->num_regions; i++) {
+        migration_region_t *region = &migration->regions[i];
+        if (addr >= region->start && addr - region->start < region->size) {
+            return region;
+        }
+    }
+    return NULL;
+}
+
+static int migration_load_header(vm_migration_t *migration, struct vm_migration_record *record)
+{
+    vm_t *vm = migration->vm;
+    struct vm_migration_header *header = (struct vm_migration_header *)record->data;
+    if (record->len < sizeof(*header) || header->magic != VM_MIGRATION_MAGIC ||
+        header->version != VM_MIGRATION_VERSION ||
+        header->num_regions > (record->len - sizeof(*header)) / sizeof(header->regions[0])) {
+        ZF_LOGE("Failed to receive migration: Invalid header");
+        return -1;
+    }
+    if (header->num_vcpus != vm->num_vcpus) {
+        ZF_LOGE("Failed to receive migration: VM has %u vcpus rather than %u", vm->num_vcpus, header->num_vcpus);
+        return -1;
+    }
+    for (uint32_t i = 0; i < header->num_regions; i++) {
+        struct vm_migration_region *region = &header->regions[i];
+        if (!IS_ALIGNED(region->start, seL4_PageBits) || !IS_ALIGNED(region->size, seL4_PageBits) ||
+            region->start + region->size < region->start || region->start + region->size - 1 > UINTPTR_MAX) {
+            ZF_LOGE("Failed to receive migration: Invalid region of guest RAM");
+            return -1;
+        }
+        if (migration_add_region(migration, region->start, region->size)) {
+            ZF_LOGE("Failed to receive migration: Unable to allocate region");
+            return -1;
+        }
+        vm_ram_mark_allocated(vm, region->start, region->size);
+    }
+    migration->state = MIGRATION_RECEIVING;
+    return 0;
+}
+
+static int migration_load_page(vm_migration_t *migration, struct vm_migration_record *record)
+{
+    uint64_t *words = migration->page_buf;
+    if (!IS_ALIGNED(record->arg, seL4_PageBits) || !migration_find_region(migration, record->arg)) {
+        ZF_LOGE("Failed to receive page: Invalid address 0x%"PRIx64, record->arg);
+        return -1;
+    }
+    const void *page = words;
+    if (record->type == VM_MIGRATION_RECORD_PAGE && record->len == PAGE_SIZE_4K) {
+        page = record->data;
+        migration->stats.pages++;
+    } else if (record->type == VM_MIGRATION_RECORD_PAGE_RLE && !rle_decode(record->data, record->len, words)) {
+        migration->stats.rle_pages++;
+    } else if (record->type == VM_MIGRATION_RECORD_PAGE_ZERO && !record->len) {
+        memset(words, 0, PAGE_SIZE_4K);
+        migration->stats.zero_pages++;
+    } else {
+        ZF_LOGE("Failed to receive page: Malformed page at 0x%"PRIx64, record->arg);
+        return -1;
+    }
+    if (vm_ram_touch(migration->vm, record->arg, PAGE_SIZE_4K, vm_guest_ram_write_callback, (void *)page)) {
+        ZF_LOGE("Failed to receive page: Unable to write page at 0x%"PRIx64, record->arg);
+        return -1;
+    }
+    return 0;
+}
+
+static int migration_load_device(vm_migration_t *migration, struct vm_migration_record *record)
+{
+    if (record->len < VM_MIGRATION_DEVICE_NAME_LEN || record->data[VM_MIGRATION_DEVICE_NAME_LEN - 1]) {
+        ZF_LOGE("Failed to receive device: Malformed device state");
+        return -1;
+    }
+    const char *name = (const char *)record->data;
+    for (size_t i = 0; i < migration->num_devices; i++) {
+        migration_device_t *device = &migration->devices[i];
+        if (strcmp(device->name, name)) {
+            continue;
+        }
+        if (device->loaded || device->load(device->cookie, record->data + VM_MIGRATION_DEVICE_NAME_LEN,
+                                           record->len - VM_MIGRATION_DEVICE_NAME_LEN)) {
+            ZF_LOGE("Failed to receive device: Unable to load state of device %s", name);
+            return -1;
+        }
+        device->loaded = true;
+        return 0;
+    }
+    ZF_LOGE("Failed to receive device: Device %s not registered", name);
+    return -1;
+}
+
+static int migration_apply(vm_migration_t *migration, struct vm_migration_record *record)
+{
+    vm_t *vm = migration->vm;
+    if ((migration->state == MIGRATION_INIT) != (record->type == VM_MIGRATION_RECORD_HEADER)) {
+        ZF_LOGE("Failed to receive migration: Stream does not start with a single header");
+        return -1;
+    }
+    switch (record->type) {
+    case VM_MIGRATION_RECORD_HEADER:
+        return migration_load_header(migration, record);
+    case VM_MIGRATION_RECORD_PAGE:
+    case VM_MIGRATION_RECORD_PAGE_RLE:
+    case VM_MIGRATION_RECORD_PAGE_ZERO:
+        return migration_load_page(migration, record);
+    case VM_MIGRATION_RECORD_VCPU:
+        if (record->arg >= vm->num_vcpus ||
+            vm_migration_vcpu_load(vm->vcpus[record->arg], record->data, record->len)) {
+            ZF_LOGE("Failed to receive vcpu: Unable to load state of vcpu %"PRIu64, record->arg);
+            return -1;
+        }
+        return 0;
+    case VM_MIGRATION_RECORD_DEVICE:
+        return migration_load_device(migration, record);
+    case VM_MIGRATION_RECORD_END:
+        for (size_t i = 0; i < migration->num_devices; i++) {
+            if (!migration->devices[i].loaded) {
+                ZF_LOGE("Failed to receive migration: State of device %s not received", migration->devices[i].name);
+                return -1;
+            }
+        }
+        migration->state = MIGRATION_DONE;
+        return 0;
+    default:
+        ZF_LOGE("Failed to receive migration: Unknown record type %u", record->type);
+        return -1;
+    }
+}
+
+vm_migration_status_t vm_migration_receive(vm_migration_t *migration)
+{
+    crossvm_ring_t *ring = &migration->ring;
+    if (migration->source) {
+        ZF_LOGE("Failed to receive migration: Not the destination of the migration");
+        return VM_MIGRATION_FAILED;
+    }
+    if (migration->waiting) {
+        crossvm_ring_finish_wait(ring, false);
+        migration->waiting = false;
+    }
+    while (migration->state != MIGRATION_FAILED && migration->state != MIGRATION_DONE) {
+        uint32_t available = crossvm_ring_available(ring);
+        if (!available) {
+            if (crossvm_ring_prepare_wait(ring, false)) {
+                migration->waiting = true;
+                return VM_MIGRATION_WAIT;
+            }
+            continue;
+        }
+        /* records are committed whole, and one that is not all there is malformed */
+        struct vm_migration_record *record = migration->record;
+        ring_copy(ring, ring->index, record, sizeof(*record), false);
+        uint32_t len = record->len;
+        if (len > VM_MIGRATION_MAX_RECORD_DATA || record_slots(ring, len) > available) {
+            ZF_LOGE("Failed to receive migration: Malformed record of type %u", record->type);
+            migration->state = MIGRATION_FAILED;
+            break;
+        }
+        ring_copy(ring, ring->index, record, sizeof(*record) + len, false);
+        record->len = len;
+        if (crossvm_ring_consume_commit(ring, record_slots(ring, len))) {
+            seL4_Signal(migration->notification);
+        }
+        migration->stats.bytes += sizeof(*record) + len;
+        if (migration_apply(migration, record)) {
+            migration->state = MIGRATION_FAILED;
+        }
+    }
+    return migration->state == MIGRATION_DONE ? VM_MIGRATION_DONE : VM_MIGRATION_FAILED;
+}
+
+void vm_migration_get_stats(vm_migration_t *migration, vm_migration_stats_t *stats)
+{
+    *stats = migration->stats;
+}
@@ -0,0 +1,19 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#include <sel4vm/guest_vm.h>
+
+/* Save the register state of a stopped vcpu into buf of size bytes, setting
+ * the number of bytes saved. Returns 0 on success, otherwise -1 */
+int vm_migration_vcpu_save(vm_vcpu_t *vcpu, void *buf, size_t size, size_t *len);
+
+/* Load the register state of a vcpu saved by 'vm_migration_vcpu_save' on the
+ * source, checking it is of the expected size. Returns 0 on success, otherwise -1 */
+int vm_migration_vcpu_load(vm_vcpu_t *vcpu, const void *buf, size_t len);
@@ -0,0 +1,78 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <autoconf.h>
+#include <sel4vm/gen_config.h>
+
+#include <stdbool.h>
+
+#include <utils/util.h>
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_mmio_batch.h>
+
+#include <sel4vmmplatsupport/guest_mmio_batch_call.h>
+
+#ifdef CONFIG_ARCH_X86
+#include <sel4vm/arch/vmcall.h>
+#include <sel4vm/arch/guest_x86_context.h>
+#endif
+#ifdef CONFIG_ARCH_ARM
+#include "smc.h"
+#endif
+
+/* Result of the hypercall, the number of accesses run or -1 */
+static seL4_Word mmio_batch_call(vm_vcpu_t *vcpu, uintptr_t ops_addr, size_t num_ops)
+{
+    size_t num_run;
+    if (vm_mmio_batch_run(vcpu, ops_addr, num_ops, &num_run)) {
+        return -1;
+    }
+    return num_run;
+}
+
+#ifdef CONFIG_ARCH_X86
+static int mmio_batch_vmcall_handler(vm_vcpu_t *vcpu)
+{
+    uint32_t ops_addr, num_ops;
+    if (vm_get_thread_context_reg(vcpu, VCPU_CONTEXT_EBX, &ops_addr)
+        || vm_get_thread_context_reg(vcpu, VCPU_CONTEXT_ECX, &num_ops)) {
+        ZF_LOGE("Failed to get arguments of mmio batch call");
+        return -1;
+    }
+    return vm_set_thread_context_reg(vcpu, VCPU_CONTEXT_EAX, mmio_batch_call(vcpu, ops_addr, num_ops));
+}
+
+int vm_install_mmio_batch_call(vm_t *vm)
+{
+    return vm_reg_new_vmcall_handler(vm, mmio_batch_vmcall_handler, VM_MMIO_BATCH_VMCALL_TOKEN);
+}
+#endif
+
+#ifdef CONFIG_ARCH_ARM
+static int mmio_batch_smc_handler(vm_vcpu_t *vcpu, smc_call_t *call, void *cookie)
+{
+    smc_set_return_value(call, mmio_batch_call(vcpu, smc_get_arg(call, 1), smc_get_arg(call, 2)));
+    return 0;
+}
+
+int vm_install_mmio_batch_call(vm_t *vm)
+{
+    /* SMC handlers are shared by all VMs, and run the batch against the vcpu's VM */
+    static bool registered;
+    if (registered) {
+        return 0;
+    }
+    seL4_Word fn_number = VM_MMIO_BATCH_SMC_FUNC_ID & SMC_FUNC_ID_MASK;
+    int err = smc_register_handler(SMC_CALL_VENDOR_HYP_SERVICE, fn_number, fn_number, mmio_batch_smc_handler, NULL);
+    if (err) {
+        ZF_LOGE("Failed to install mmio batch call: Unable to register SMC handler");
+        return -1;
+    }
+    registered = true;
+    return 0;
+}
+#endif
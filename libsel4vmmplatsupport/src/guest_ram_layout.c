@@ -0,0 +1,227 @@
+/*
+ * Copyright 2019, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <autoconf.h>
+#include <sel4vm/gen_config.h>
+
+#include <inttypes.h>
+#include <string.h>
+
+#include <sel4/sel4.h>
+#include <utils/util.h>
+
+#include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_ram.h>
+
+#include <sel4vmmplatsupport/guest_ram_layout.h>
+
+/* Size of the region of [start, end) made up of whole pages of 'bits' */
+static size_t aligned_size(uintptr_t start, uintptr_t end, size_t bits)
+{
+    uintptr_t aligned_start = ROUND_UP(start, BIT(bits));
+    uintptr_t aligned_end = ROUND_DOWN(end, BIT(bits));
+    return aligned_start < aligned_end ? aligned_end - aligned_start : 0;
+}
+
+/* Get the free space between the holes of a layout, returning false past the last gap */
+static bool layout_gap(vm_ram_layout_t *layout, int index, uintptr_t *start, uintptr_t *end)
+{
+    if (index > layout->num_holes) {
+        return false;
+    }
+    *start = index ? layout->holes[index - 1].start + layout->holes[index - 1].size : layout->base;
+    *end = index < layout->num_holes ? layout->holes[index].start : layout->limit;
+    /* Holes may lie partly or entirely outside of the range of the layout */
+    *start = MIN(MAX(*start, layout->base), layout->limit);
+    *end = MAX(MIN(*end, layout->limit), *start);
+    return true;
+}
+
+static int layout_add_ram(vm_ram_layout_t *layout, uintptr_t start, size_t size)
+{
+    int idx = 0;
+    while (idx < layout->num_ram && layout->ram[idx].start < start) {
+        idx++;
+    }
+    /* Merge with the regions either side where they touch */
+    bool merge_prev = idx > 0 && layout->ram[idx - 1].start + layout->ram[idx - 1].size == start;
+    bool merge_next = idx < layout->num_ram && start + size == layout->ram[idx].start;
+    if (merge_prev && merge_next) {
+        layout->ram[idx - 1].size += size + layout->ram[idx].size;
+        layout->num_ram--;
+        memmove(&layout->ram[idx], &layout->ram[idx + 1], sizeof(vm_ram_layout_region_t) * (layout->num_ram - idx));
+        return 0;
+    }
+    if (merge_prev) {
+        layout->ram[idx - 1].size += size;
+        return 0;
+    }
+    if (merge_next) {
+        layout->ram[idx].start = start;
+        layout->ram[idx].size += size;
+        return 0;
+    }
+    if (layout->num_ram == VM_RAM_LAYOUT_MAX_REGIONS) {
+        ZF_LOGE("Failed to plan ram layout: Too many RAM regions");
+        return -1;
+    }
+    memmove(&layout->ram[idx + 1], &layout->ram[idx], sizeof(vm_ram_layout_region_t) * (layout->num_ram - idx));
+    layout->ram[idx].start = start;
+    layout->ram[idx].size = size;
+    layout->num_ram++;
+    return 0;
+}
+
+/* Take up to 'need' bytes of RAM from [start, end), returning the bytes taken */
+static size_t layout_take_ram(vm_ram_layout_t *layout, uintptr_t start, uintptr_t end, size_t need, int *err)
+{
+    start = ROUND_UP(start, BIT(seL4_PageBits));
+    end = ROUND_DOWN(end, BIT(seL4_PageBits));
+    if (start >= end || need == 0) {
+        return 0;
+    }
+    size_t size = MIN(need, end - start);
+    *err = layout_add_ram(layout, start, size);
+    return *err ? 0 : size;
+}
+
+int vm_ram_layout_init(vm_ram_layout_t *layout, uintptr_t base, uintptr_t limit)
+{
+    if (!layout || base >= limit) {
+        ZF_LOGE("Failed to initialise ram layout: Invalid address range");
+        return -1;
+    }
+    memset(layout, 0, sizeof(*layout));
+    layout->base = base;
+    layout->limit = limit;
+    return 0;
+}
+
+int vm_ram_layout_add_hole(vm_ram_layout_t *layout, uintptr_t start, size_t size)
+{
+    if (size == 0 || start + size < start) {
+        ZF_LOGE("Failed to add ram layout hole: Invalid hole 0x%"PRIxPTR" of size %zu", start, size);
+        return -1;
+    }
+    if (layout->num_ram) {
+        ZF_LOGE("Failed to add ram layout hole: RAM has already been planned");
+        return -1;
+    }
+    uintptr_t end = start + size;
+    /* Absorb any holes the new hole overlaps or touches */
+    int first = 0;
+    while (first < layout->num_holes && layout->holes[first].start + layout->holes[first].size < start) {
+        first++;
+    }
+    int last = first;
+    while (last < layout->num_holes && layout->holes[last].start <= end) {
+        start = MIN(start, layout->holes[last].start);
+        end = MAX(end, layout->holes[last].start + layout->holes[last].size);
+        last++;
+    }
+    int merged = last - first;
+    if (merged == 0 && layout->num_holes == VM_RAM_LAYOUT_MAX_REGIONS) {
+        ZF_LOGE("Failed to add ram layout hole: Too many holes");
+        return -1;
+    }
+    memmove(&layout->holes[first + 1], &layout->holes[last],
+            sizeof(vm_ram_layout_region_t) * (layout->num_holes - last));
+    layout->holes[first].start = start;
+    layout->holes[first].size = end - start;
+    layout->num_holes += 1 - merged;
+    return 0;
+}
+
+int vm_ram_layout_place_hole(vm_ram_layout_t *layout, size_t size, size_t align_bits, uintptr_t *start)
+{
+    uintptr_t gap_start, gap_end;
+    if (size == 0) {
+        ZF_LOGE("Failed to place ram layout hole: Invalid size");
+        return -1;
+    }
+    /* Highest gap first, keeping windows above the RAM */
+    for (int i = layout->num_holes; i >= 0; i--) {
+        layout_gap(layout, i, &gap_start, &gap_end);
+        if (gap_end - gap_start < size) {
+            continue;
+        }
+        uintptr_t hole_start = ROUND_DOWN(gap_end - size, BIT(align_bits));
+        if (hole_start >= gap_start) {
+            *start = hole_start;
+            return vm_ram_layout_add_hole(layout, hole_start, size);
+        }
+    }
+    ZF_LOGE("Failed to place ram layout hole: No space for a hole of size %zu", size);
+    return -1;
+}
+
+int vm_ram_layout_plan(vm_ram_layout_t *layout, size_t ram_size)
+{
+    uintptr_t gap_start, gap_end;
+    size_t need = ROUND_UP(ram_size, BIT(seL4_PageBits));
+    int err = 0;
+    if (layout->num_ram) {
+        ZF_LOGE("Failed to plan ram layout: RAM has already been planned");
+        return -1;
+    }
+    /* The large page aligned middle of each gap first */
+    for (int i = 0; need && !err && layout_gap(layout, i, &gap_start, &gap_end); i++) {
+        uintptr_t start = ROUND_UP(gap_start, BIT(seL4_LargePageBits));
+        uintptr_t end = ROUND_DOWN(gap_end, BIT(seL4_LargePageBits));
+        if (start < end) {
+            need -= layout_take_ram(layout, start, end, need, &err);
+        }
+    }
+    /* Then the unaligned edges of each gap */
+    for (int i = 0; need && !err && layout_gap(layout, i, &gap_start, &gap_end); i++) {
+        uintptr_t start = ROUND_UP(gap_start, BIT(seL4_LargePageBits));
+        uintptr_t end = ROUND_DOWN(gap_end, BIT(seL4_LargePageBits));
+        if (start >= end) {
+            need -= layout_take_ram(layout, gap_start, gap_end, need, &err);
+            continue;
+        }
+        need -= layout_take_ram(layout, gap_start, start, need, &err);
+        if (!err) {
+            need -= layout_take_ram(layout, end, gap_end, need, &err);
+        }
+    }
+    if (err || need) {
+        ZF_LOGE("Failed to plan ram layout: %zu bytes of RAM do not fit", need);
+        layout->num_ram = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void vm_ram_layout_get_coverage(vm_ram_layout_t *layout, vm_ram_layout_coverage_t *coverage)
+{
+    memset(coverage, 0, sizeof(*coverage));
+    for (int i = 0; i < layout->num_ram; i++) {
+        uintptr_t start = layout->ram[i].start;
+        uintptr_t end = start + layout->ram[i].size;
+        coverage->ram_size += layout->ram[i].size;
+        coverage->large_size += aligned_size(start, end, seL4_LargePageBits);
+#ifdef seL4_HugePageBits
+        coverage->huge_size += aligned_size(start, end, seL4_HugePageBits);
+#endif
+    }
+}
+
+int vm_ram_layout_register(vm_t *vm, vm_ram_layout_t *layout, bool untyped)
+{
+    vm_ram_layout_coverage_t coverage;
+    for (int i = 0; i < layout->num_ram; i++) {
+        int err = vm_ram_register_at(vm, layout->ram[i].start, layout->ram[i].size, untyped);
+        if (err) {
+            ZF_LOGE("Failed to register ram layout: Unable to register RAM at 0x%"PRIxPTR, layout->ram[i].start);
+            return -1;
+        }
+    }
+    vm_ram_layout_get_coverage(layout, &coverage);
+    ZF_LOGI("Guest RAM of %zu bytes registered in %d regions, %zu bytes large page aligned, %zu bytes huge page aligned",
+            coverage.ram_size, layout->num_ram, coverage.large_size, coverage.huge_size);
+    return 0;
+}
@@ -10,33 +10,17 @@
 #include <sel4utils/util.h>
 #include <sel4vmmplatsupport/ioports.h>
 
-static int io_port_compare_by_range(const void *pkey, const void *pelem)
-{
-    unsigned int key = (unsigned int)(uintptr_t)pkey;
-    const ioport_entry_t *entry = (const ioport_entry_t *)(*(const ioport_entry_t **)pelem);
-    const ioport_range_t *elem = &entry->range;
-    if (key < elem->start) {
-        return -1;
-    }
-    if (key > elem->end) {
-        return 1;
-    }
-    return 0;
-}
-
-static int io_port_compare_by_start(const void *a, const void *b)
-{
-    const ioport_entry_t *a_entry = (const ioport_entry_t *)(*(const ioport_entry_t **)a);
-    const ioport_range_t *a_range = &a_entry->range;
-    const ioport_entry_t *b_entry = (const ioport_entry_t *)(*(const ioport_entry_t **)b);
-    const ioport_range_t *b_range = &b_entry->range;
-    return a_range->start - b_range->start;
-}
+/* Number of entries in the port map, one for each addressable ioport */
+#define IOPORT_MAP_SIZE BIT(16)
 
 static ioport_entry_t **search_port(vmm_io_port_list_t *io_port, unsigned int port_no)
 {
-    return (ioport_entry_t **)bsearch((void *)(uintptr_t)port_no, io_port->ioports, io_port->num_ioports,
-                                      sizeof(ioport_entry_t *), io_port_compare_by_range);
+    if (!io_port->port_map || port_no >= IOPORT_MAP_SIZE) {
+        return NULL;
+    }
+    /* Port map entries are offset by one such that 0 denotes an unhandled port */
+    uint16_t id = io_port->port_map[port_no];
+    return id ? &io_port->ioports[id - 1] : NULL;
 }
 
 /* Debug helper function for port no. */
@@ -94,24 +78,47 @@ static int add_io_port_range(vmm_io_port_list_t *io_list, ioport_entry_t *port)
         ZF_LOGE("Unable to add port - io port list is uninitalised");
         return -1;
     }
+    if (port->range.start > port->range.end) {
+        ZF_LOGE("Invalid ioport range 0x%x-0x%x for %s", port->range.start, port->range.end,
+                port->interface.desc ? port->interface.desc : "Unknown IO Port");
+        return -1;
+    }
+    /* Handler ids are stored in 16 bits with 0 reserved for unhandled ports */
+    if (io_list->num_ioports >= UINT16_MAX) {
+        ZF_LOGE("Unable to add ioport range 0x%x-0x%x: Too many ioport handlers", port->range.start, port->range.end);
+        return -1;
+    }
+    if (!io_list->port_map) {
+        io_list->port_map = calloc(IOPORT_MAP_SIZE, sizeof(uint16_t));
+        if (!io_list->port_map) {
+            ZF_LOGE("Unable to add port - failed to allocate port map");
+            return -1;
+        }
+    }
     /* ensure this range does not overlap */
-    for (int i = 0; i < io_list->num_ioports; i++) {
-        if (io_list->ioports[i]->range.end >= port->range.start && io_list->ioports[i]->range.start <= port->range.end) {
+    for (unsigned int i = port->range.start; i <= port->range.end; i++) {
+        if (io_list->port_map[i]) {
+            ioport_entry_t *existing = io_list->ioports[io_list->port_map[i] - 1];
             ZF_LOGE("Requested ioport range 0x%x-0x%x for %s overlaps with existing range 0x%x-0x%x for %s",
                     port->range.start, port->range.end, port->interface.desc ? port->interface.desc : "Unknown IO Port",
-                    io_list->ioports[i]->range.start, io_list->ioports[i]->range.end,
-                    io_list->ioports[i]->interface.desc ? io_list->ioports[i]->interface.desc : "Unknown IO Port");
+                    existing->range.start, existing->range.end,
+                    existing->interface.desc ? existing->interface.desc : "Unknown IO Port");
             return -1;
         }
     }
     /* grow the array */
-    io_list->ioports = realloc(io_list->ioports, sizeof(ioport_entry_t *) * (io_list->num_ioports + 1));
-    assert(io_list->ioports);
-    /* add the new entry */
+    ioport_entry_t **ioports = realloc(io_list->ioports, sizeof(ioport_entry_t *) * (io_list->num_ioports + 1));
+    if (!ioports) {
+        ZF_LOGE("Unable to add port - failed to grow io port list");
+        return -1;
+    }
+    io_list->ioports = ioports;
+    /* add the new entry, entries are never reordered such that port map ids remain valid */
     io_list->ioports[io_list->num_ioports] = port;
     io_list->num_ioports++;
-    /* sort */
-    qsort(io_list->ioports, io_list->num_ioports, sizeof(ioport_entry_t *), io_port_compare_by_start);
+    for (unsigned int i = port->range.start; i <= port->range.end; i++) {
+        io_list->port_map[i] = io_list->num_ioports;
+    }
     return 0;
 }
 
@@ -170,6 +177,7 @@ int vmm_io_port_init(vmm_io_port_list_t **io_list, uint16_t ioport_alloc_addr)
 
     init_iolist->num_ioports = 0;
     init_iolist->ioports = NULL;
+    init_iolist->port_map = NULL;
     init_iolist->alloc_addr = ioport_alloc_addr;
     *io_list = init_iolist;
     return 0;
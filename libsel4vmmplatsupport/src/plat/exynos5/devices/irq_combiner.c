@@ -8,6 +8,7 @@
 #include <sel4vm/guest_memory.h>
 #include <sel4vm/boot.h>
 #include <sel4vm/guest_vcpu_fault.h>
+#include <sel4vm/guest_vm_arena.h>
 
 #include <sel4vmmplatsupport/guest_memory_util.h>
 #include <sel4vmmplatsupport/plat/device_map.h>
@@ -35,20 +36,34 @@ struct irq_combiner_map {
 
 
 
+#define COMBINER_NUM_GROUPS     32
+#define COMBINER_GROUP_IRQS     8
+/* Each register word of the group map covers 4 groups of 8 IRQs */
+#define COMBINER_NUM_WORDS      ARRAY_SIZE(((struct irq_combiner_map *)0)->g)
+#define COMBINER_WORD(group)    ((group) / 4)
+#define COMBINER_BIT(group, i)  (((group) % 4) * COMBINER_GROUP_IRQS + (i))
+
 struct irq_group_data {
     combiner_irq_handler_fn cb;
     void *priv;
-};
-
-struct combiner_data {
-    irq_combiner_t pcombiner;
-    struct irq_group_data *data[32];
+    /* Handed to cb, preallocated so that forwarding an IRQ does not allocate */
+    struct combiner_irq cirq;
 };
 
 /* For virtualisation */
 struct virq_combiner {
     /* What the VM reads */
     struct irq_combiner_map *vregs;
+    /* IRQs forwarded by the combiner and not yet acknowledged, per register word */
+    uint32_t pending[COMBINER_NUM_WORDS];
+    /* IRQs the guest has enabled, per register word */
+    uint32_t enabled[COMBINER_NUM_WORDS];
+};
+
+struct combiner_data {
+    irq_combiner_t pcombiner;
+    struct irq_group_data *data[COMBINER_NUM_GROUPS];
+    struct virq_combiner *vcombiner;
 };
 
 struct combiner_data _combiner;
@@ -58,34 +73,60 @@ static inline struct virq_combiner *vcombiner_priv_get_vcombiner(void *priv)
     return (struct virq_combiner *)priv;
 }
 
+/* Bring the status registers of a register word, and its groups' bits of the
+ * group pending register, up to date in the page the guest reads */
+static void vcombiner_sync(struct virq_combiner *vcombiner, int w)
+{
+    struct combiner_gmap *gmap = &vcombiner->vregs->g[w];
+    uint32_t masked = vcombiner->pending[w] & vcombiner->enabled[w];
+    uint32_t groups = 0;
+
+    for (int b = 0; b < 4; b++) {
+        if (masked & (MASK(COMBINER_GROUP_IRQS) << (b * COMBINER_GROUP_IRQS))) {
+            groups |= BIT(b);
+        }
+    }
+
+    gmap->enable_set = vcombiner->enabled[w];
+    gmap->enable_clr = vcombiner->enabled[w];
+    gmap->status = vcombiner->pending[w];
+    gmap->masked_status = masked;
+    vcombiner->vregs->pending = (vcombiner->vregs->pending & ~(MASK(4) << (w * 4))) | (groups << (w * 4));
+}
+
 void vm_combiner_irq_handler(vm_t *vm, int irq)
 {
     struct combiner_data *combiner = &_combiner;
-    struct combiner_irq *cirq;
+    struct virq_combiner *vcombiner = combiner->vcombiner;
+    struct irq_group_data *data;
     uint32_t imsr;
-    int i, g;
+    int g;
 
-    /* Decode group and index */
+    /* Decode group */
     g = irq - 32;
-    imsr = irq_combiner_group_pending(&combiner->pcombiner, g);
-    i = __builtin_ctz(imsr);
-    /* Disable the IRQ */
-    irq_combiner_enable_irq(&combiner->pcombiner, COMBINER_IRQ(g, i));
-
-    /* Allocate a combiner IRQ structure */
-    cirq = (struct combiner_irq *)calloc(1, sizeof(*cirq));
-    assert(cirq);
-    if (!cirq) {
-        printf("No memory to allocate combiner IRQ\n");
-        return;
+    assert(0 <= g && g < COMBINER_NUM_GROUPS);
+    data = combiner->data[g];
+    imsr = irq_combiner_group_pending(&combiner->pcombiner, g) & MASK(COMBINER_GROUP_IRQS);
+
+    /* Mark every IRQ of the group that is pending before forwarding any of
+     * them, so that the guest sees them all on its first read of the status */
+    for (uint32_t bits = imsr; bits; bits &= bits - 1) {
+        int i = CTZ(bits);
+        /* Disable the IRQ until it is acknowledged */
+        irq_combiner_disable_irq(&combiner->pcombiner, COMBINER_IRQ(g, i));
+        vcombiner->pending[COMBINER_WORD(g)] |= BIT(COMBINER_BIT(g, i));
+    }
+    vcombiner_sync(vcombiner, COMBINER_WORD(g));
+
+    /* Forward the IRQs */
+    for (uint32_t bits = imsr; bits; bits &= bits - 1) {
+        int i = CTZ(bits);
+        if (data == NULL || data[i].cb == NULL) {
+            ZF_LOGE("No handler for combiner IRQ (%d, %d)", g, i);
+            continue;
+        }
+        data[i].cb(&data[i].cirq);
     }
-    cirq->priv = combiner->data[g][i].priv;
-    cirq->index = i;
-    cirq->group = g;
-    cirq->combiner_priv = combiner;
-
-    /* Forward the IRQ */
-    combiner->data[g][i].cb(cirq);
 }
 
 void combiner_irq_ack(struct combiner_irq *cirq)
@@ -96,23 +137,25 @@ void combiner_irq_ack(struct combiner_irq *cirq)
     combiner = (struct combiner_data *)cirq->combiner_priv;
     g = cirq->group;
     i = cirq->index;
+    combiner->vcombiner->pending[COMBINER_WORD(g)] &= ~BIT(COMBINER_BIT(g, i));
+    vcombiner_sync(combiner->vcombiner, COMBINER_WORD(g));
     /* Re-enable the IRQ */
     irq_combiner_enable_irq(&combiner->pcombiner, COMBINER_IRQ(g, i));
-    free(cirq);
 }
 
 
 int vmm_register_combiner_irq(int group, int idx, combiner_irq_handler_fn cb, void *priv)
 {
     struct combiner_data *combiner = &_combiner;
-    assert(0 <= group && group < 32);
-    assert(0 <= idx && idx < 8);
+    struct combiner_irq *cirq;
+    assert(0 <= group && group < COMBINER_NUM_GROUPS);
+    assert(0 <= idx && idx < COMBINER_GROUP_IRQS);
 
     /* If no IRQ's for this group yet, setup the group */
     if (combiner->data[group] == NULL) {
         void *addr;
 
-        addr = calloc(1, sizeof(struct irq_group_data) * 8);
+        addr = calloc(1, sizeof(struct irq_group_data) * COMBINER_GROUP_IRQS);
         assert(addr);
         if (addr == NULL) {
             return -1;
@@ -126,6 +169,11 @@ int vmm_register_combiner_irq(int group, int idx, combiner_irq_handler_fn cb, vo
     /* Register the callback */
     combiner->data[group][idx].cb = cb;
     combiner->data[group][idx].priv = priv;
+    cirq = &combiner->data[group][idx].cirq;
+    cirq->priv = priv;
+    cirq->index = idx;
+    cirq->group = group;
+    cirq->combiner_priv = combiner;
 
     /* Enable the irq */
     irq_combiner_enable_irq(&combiner->pcombiner, COMBINER_IRQ(group, idx));
@@ -135,76 +183,43 @@ int vmm_register_combiner_irq(int group, int idx, combiner_irq_handler_fn cb, vo
 static memory_fault_result_t vcombiner_fault(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t fault_addr, size_t fault_length,
                                              void *cookie)
 {
-    int err;
-    memory_fault_result_t ret;
     struct virq_combiner *vcombiner;
     int offset;
     int gidx;
-    uint32_t mask;
-    uint32_t *reg;
+    uint32_t data;
     struct device *d;
 
     d = (struct device *)cookie;
     assert(d->priv);
 
     vcombiner = vcombiner_priv_get_vcombiner(d->priv);
-    mask = get_vcpu_fault_data_mask(vcpu);
     offset = fault_addr - d->pstart;
-    reg = (uint32_t *)((uintptr_t)vcombiner->vregs + offset);
     gidx = offset / sizeof(struct combiner_gmap);
     assert(offset >= 0 && offset < sizeof(*vcombiner->vregs));
 
-    ret = FAULT_HANDLED;
-    if (offset == 0x100) {
-        ZF_LOGD("Fault on group pending register\n");
-    } else if (offset < 0x80) {
-        uint32_t data;
-        int group, index;
-        (void)group;
-        (void)index;
+    /* Reads are served from the page, so only writes fault */
+    if (offset < sizeof(vcombiner->vregs->g)) {
+        data = get_vcpu_fault_data(vcpu) & get_vcpu_fault_data_mask(vcpu);
         switch (offset / 4 % 4) {
         case 0:
-            data = get_vcpu_fault_data(vcpu);
-            data &= mask;
-            data &= ~(*reg);
-            while (data) {
-                int i;
-                i = CTZ(data);
-                data &= ~(1U << i);
-                group = gidx * 4 + i / 8;
-                index = i % 8;
-                ZF_LOGD("enable IRQ %d.%d (%d)\n", group, index, group + 32);
-            }
-            ret = FAULT_IGNORE;
+            vcombiner->enabled[gidx] |= data;
+            vcombiner_sync(vcombiner, gidx);
             break;
         case 1:
-            data = get_vcpu_fault_data(vcpu);
-            data &= mask;
-            data &= *reg;
-            while (data) {
-                int i;
-                i = CTZ(data);
-                data &= ~(1U << i);
-                group = gidx * 4 + i / 8;
-                index = i % 8;
-                ZF_LOGD("disable IRQ %d.%d (%d)\n", group, index, group + 32);
-            }
-            ret = FAULT_IGNORE;
+            vcombiner->enabled[gidx] &= ~data;
+            vcombiner_sync(vcombiner, gidx);
             break;
         case 2:
         case 3:
         /* Read only registers */
         default:
-            ZF_LOGD("Error handling register access at offset 0x%x\n", offset);
+            ZF_LOGD("Write to read only register at offset 0x%x\n", offset);
         }
     } else {
-        ZF_LOGD("Unknown register access at offset 0%x\n", offset);
-    }
-    if (err) {
-        ret = FAULT_ERROR;
+        ZF_LOGD("Unknown register access at offset 0x%x\n", offset);
     }
     advance_vcpu_fault(vcpu);
-    return ret;
+    return FAULT_HANDLED;
 }
 
 
@@ -229,7 +244,7 @@ int vm_install_vcombiner(vm_t *vm)
     }
 
     /* Distributor */
-    combiner = (struct device *)calloc(1, sizeof(struct device));
+    combiner = vm_arena_alloc(vm, sizeof(struct device));
     if (!combiner) {
         return -1;
     }
@@ -249,5 +264,6 @@ int vm_install_vcombiner(vm_t *vm)
     memset(addr, 0, 0x1000);
     vcombiner->vregs = (struct irq_combiner_map *)addr;
     combiner->priv = (void *)vcombiner;
+    _combiner.vcombiner = vcombiner;
     return 0;
 }
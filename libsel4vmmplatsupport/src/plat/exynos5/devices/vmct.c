@@ -3,15 +3,44 @@
  *
  * SPDX-License-Identifier: BSD-2-Clause
  */
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <utils/util.h>
+#include <vka/capops.h>
+
 #include <sel4vm/guest_vm.h>
+#include <sel4vm/guest_memory.h>
+#include <sel4vm/guest_irq_controller.h>
 #include <sel4vm/guest_vcpu_fault.h>
+#include <sel4vm/boot.h>
+#include <sel4vm/guest_vm_arena.h>
 
+#include <sel4vmmplatsupport/device.h>
+#include <sel4vmmplatsupport/plat/device_map.h>
 #include <sel4vmmplatsupport/plat/vmct.h>
 #include <sel4vmmplatsupport/plat/devices.h>
 
+/* Register offsets */
+#define MCT_G_CNT_L          0x100
+#define MCT_G_CNT_U          0x104
+#define MCT_G_CNT_WSTAT      0x110
+#define MCT_G_COMP0_L        0x200
+#define MCT_G_TCON           0x240
+#define MCT_G_INT_CSTAT      0x244
+#define MCT_G_INT_ENB        0x248
+#define MCT_G_WSTAT          0x24C
+#define MCT_L_BASE           0x300
+#define MCT_L_SIZE           0x100
+#define MCT_L_TCNTB          0x00
+#define MCT_L_ICNTB          0x08
+#define MCT_L_FRCNTB         0x10
+#define MCT_L_TCON           0x20
+#define MCT_L_INT_CSTAT      0x30
+#define MCT_L_INT_ENB        0x34
+#define MCT_L_WSTAT          0x40
+
 #define GWSTAT_TCON          (1U << 16)
 #define GWSTAT_COMP3_ADD_INC (1U << 14)
 #define GWSTAT_COMP3H        (1U << 13)
@@ -26,11 +55,91 @@
 #define GWSTAT_COMP0H        (1U << 1)
 #define GWSTAT_COMP0L        (1U << 0)
 
+/* G_TCON: enable and auto increment bits of comparator n, and the counter enable */
+#define GTCON_COMP_ENABLE(n)  (1U << ((n) * 2))
+#define GTCON_AUTO_INC(n)     (1U << ((n) * 2 + 1))
+#define GTCON_TIMER_ENABLE    (1U << 8)
+
+/* L_TCON */
+#define LTCON_TIMER_START    (1U << 0)
+#define LTCON_INT_START      (1U << 1)
+#define LTCON_AUTO_RELOAD    (1U << 2)
+
+/* L_ICNTB: manual update of the interrupt count */
+#define LICNTB_MANUAL_UPDATE (1U << 31)
+
+/* L_WSTAT */
+#define LWSTAT_TCNTB         (1U << 0)
+#define LWSTAT_ICNTB         (1U << 1)
+#define LWSTAT_FRCNTB        (1U << 2)
+#define LWSTAT_TCON          (1U << 3)
+
+/* Register map of the MCT, as laid out in the frame shared with the guest */
+struct mct_comparator {
+    uint32_t l;
+    uint32_t u;
+    uint32_t add_incr;
+    uint32_t res;
+};
+
+struct mct_local_timer {
+    uint32_t tcntb;                   /* 0x00 */
+    uint32_t tcnto;                   /* 0x04 */
+    uint32_t icntb;                   /* 0x08 */
+    uint32_t icnto;                   /* 0x0C */
+    uint32_t frcntb;                  /* 0x10 */
+    uint32_t frcnto;                  /* 0x14 */
+    uint32_t res0[2];
+    uint32_t tcon;                    /* 0x20 */
+    uint32_t res1[3];
+    uint32_t int_cstat;               /* 0x30 */
+    uint32_t int_enb;                 /* 0x34 */
+    uint32_t res2[2];
+    uint32_t wstat;                   /* 0x40 */
+    uint32_t res3[47];
+};
+
+struct mct_map {
+    uint32_t cfg;                     /* 0x000 */
+    uint32_t res0[63];
+    uint32_t cnt_l;                   /* 0x100 */
+    uint32_t cnt_u;                   /* 0x104 */
+    uint32_t res1[2];
+    uint32_t cnt_wstat;               /* 0x110 */
+    uint32_t res2[59];
+    struct mct_comparator comp[VMCT_NUM_COMPARATORS]; /* 0x200 */
+    uint32_t tcon;                    /* 0x240 */
+    uint32_t int_cstat;               /* 0x244 */
+    uint32_t int_enb;                 /* 0x248 */
+    uint32_t wstat;                   /* 0x24C */
+    uint32_t res3[44];
+    struct mct_local_timer local[VMCT_NUM_LOCAL_TIMERS]; /* 0x300 */
+};
+
+compile_time_assert(mct_map_cnt_l, offsetof(struct mct_map, cnt_l) == MCT_G_CNT_L);
+compile_time_assert(mct_map_tcon, offsetof(struct mct_map, tcon) == MCT_G_TCON);
+compile_time_assert(mct_map_local, offsetof(struct mct_map, local) == MCT_L_BASE);
+compile_time_assert(mct_local_wstat, offsetof(struct mct_local_timer, wstat) == MCT_L_WSTAT);
+compile_time_assert(mct_map_size, sizeof(struct mct_map) <= BIT(seL4_PageBits));
 
 struct vmct_priv {
-    uint32_t wstat;
-    uint32_t cnt_wstat;
-    uint32_t lwstat[4];
+    vm_t *vm;
+    struct vmct_config config;
+    /* Registers, mapped read only into the guest */
+    volatile struct mct_map *regs;
+    vka_object_t frame;
+    /* The guest's counter is the host counter plus 'count_offset' whilst
+     * enabled, and stays at 'count_stopped' whilst disabled */
+    uint64_t count_offset;
+    uint64_t count_stopped;
+    /* Comparators waiting for the counter to reach them */
+    bool comp_armed[VMCT_NUM_COMPARATORS];
+    /* Host counter value local timers next expire at, and their periods */
+    uint64_t local_deadline[VMCT_NUM_LOCAL_TIMERS];
+    uint64_t local_period[VMCT_NUM_LOCAL_TIMERS];
+    bool local_armed[VMCT_NUM_LOCAL_TIMERS];
+    /* Host counter value of the current host timer deadline */
+    uint64_t deadline;
 };
 
 static inline struct vmct_priv *vmct_get_priv(void *priv)
@@ -39,79 +148,261 @@ static inline struct vmct_priv *vmct_get_priv(void *priv)
     return (struct vmct_priv *)priv;
 }
 
+static uint64_t vmct_count(struct vmct_priv *mct, uint64_t host_count)
+{
+    if (!(mct->regs->tcon & GTCON_TIMER_ENABLE)) {
+        return mct->count_stopped;
+    }
+    return host_count + mct->count_offset;
+}
 
-static memory_fault_result_t handle_vmct_fault(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t fault_addr, size_t fault_length,
-                                               void *cookie)
+static void vmct_set_count(struct vmct_priv *mct, uint64_t host_count, uint64_t count)
 {
-    struct vmct_priv *mct_priv;
-    int offset;
-    uint32_t mask;
-    struct device *dev = (struct device *)cookie;
+    mct->count_stopped = count;
+    mct->count_offset = count - host_count;
+}
 
-    mct_priv = vmct_get_priv(dev->priv);
-
-    /* Gather fault information */
-    offset = fault_addr - dev->pstart;
-    mask = get_vcpu_fault_data_mask(vcpu);
-    /* Handle the fault */
-    if (offset < 0x300) {
-        /*** Global ***/
-        uint32_t *wstat;
-        uint32_t *cnt_wstat;
-        wstat = &mct_priv->wstat;
-        cnt_wstat = &mct_priv->cnt_wstat;
-        if (!is_vcpu_read_fault(vcpu)) {
-            if (offset >= 0x100 && offset < 0x108) {
-                /* Count registers */
-                *cnt_wstat |= (1 << (offset - 0x100) / 4);
-            } else if (offset == 0x110) {
-                *cnt_wstat &= ~(get_vcpu_fault_data(vcpu) & mask);
-            } else if (offset >= 0x200 && offset < 0x244) {
-                /* compare registers */
-                *wstat |= (1 << (offset - 0x200) / 4);
-            } else if (offset == 0x24C) {
-                /* Write status */
-                *wstat &= ~(get_vcpu_fault_data(vcpu) & mask);
-            } else {
-                ZF_LOGD("global MCT fault on unknown offset 0x%x\n", offset);
+static uint64_t vmct_comp(struct vmct_priv *mct, int n)
+{
+    return ((uint64_t)mct->regs->comp[n].u << 32) | mct->regs->comp[n].l;
+}
+
+static void vmct_raise(struct vmct_priv *mct, int irq)
+{
+    if (irq < 0) {
+        return;
+    }
+    if (vm_inject_irq(mct->vm->vcpus[BOOT_VCPU], irq)) {
+        ZF_LOGE("Failed to inject MCT irq %d", irq);
+    }
+}
+
+static void vmct_irq_ack(vm_vcpu_t *vcpu, int irq, void *cookie)
+{
+    struct vmct_priv *mct = vmct_get_priv(cookie);
+    /* Interrupts are level triggered, and stay asserted as long as their status is */
+    for (int i = 0; i < VMCT_NUM_COMPARATORS; i++) {
+        if (mct->config.global_irqs[i] == irq && (mct->regs->int_cstat & mct->regs->int_enb & BIT(i))) {
+            vmct_raise(mct, irq);
+            return;
+        }
+    }
+    for (int i = 0; i < VMCT_NUM_LOCAL_TIMERS; i++) {
+        volatile struct mct_local_timer *l = &mct->regs->local[i];
+        if (mct->config.local_irqs[i] == irq && (l->int_cstat & l->int_enb & BIT(0))) {
+            vmct_raise(mct, irq);
+            return;
+        }
+    }
+}
+
+/* (Re)start a local timer from the current host count, if its interrupt counter is running. Local timers count
+ * input clock ticks whether or not the global counter is enabled */
+static void vmct_local_start(struct vmct_priv *mct, int n, uint64_t host_count)
+{
+    volatile struct mct_local_timer *l = &mct->regs->local[n];
+    uint64_t period = (uint64_t)(l->icntb & ~LICNTB_MANUAL_UPDATE) * ((uint64_t)l->tcntb + 1);
+    mct->local_period[n] = period;
+    mct->local_armed[n] = period && (l->tcon & LTCON_TIMER_START) && (l->tcon & LTCON_INT_START);
+    mct->local_deadline[n] = host_count + period;
+}
+
+/* Raise the interrupts of whatever has expired by now, bring the counter
+ * and observation registers up to date and set the next host deadline */
+static void vmct_update(struct vmct_priv *mct)
+{
+    volatile struct mct_map *regs = mct->regs;
+    uint64_t host_count = mct->config.get_count(mct->config.cookie);
+    uint64_t count = vmct_count(mct, host_count);
+    uint64_t next = UINT64_MAX;
+
+    for (int i = 0; i < VMCT_NUM_COMPARATORS; i++) {
+        if (!(regs->tcon & GTCON_COMP_ENABLE(i)) || !mct->comp_armed[i] || !(regs->tcon & GTCON_TIMER_ENABLE)) {
+            continue;
+        }
+        uint64_t comp = vmct_comp(mct, i);
+        if (comp <= count) {
+            regs->int_cstat |= BIT(i);
+            if (regs->int_enb & BIT(i)) {
+                vmct_raise(mct, mct->config.global_irqs[i]);
             }
-        } else {
-            /* read fault */
-            if (offset == 0x110) {
-                set_vcpu_fault_data(vcpu, *cnt_wstat);
-            } else if (offset == 0x24C) {
-                set_vcpu_fault_data(vcpu, *wstat);
+            if ((regs->tcon & GTCON_AUTO_INC(i)) && regs->comp[i].add_incr) {
+                /* Skip over the periods the counter has passed, interrupting once */
+                uint64_t incr = regs->comp[i].add_incr;
+                comp += ((count - comp) / incr + 1) * incr;
+                regs->comp[i].l = (uint32_t)comp;
+                regs->comp[i].u = (uint32_t)(comp >> 32);
             } else {
-                set_vcpu_fault_data(vcpu, 0);
+                mct->comp_armed[i] = false;
+                continue;
             }
         }
-    } else {
-        /*** Local ***/
-        int timer = (offset - 0x300) / 0x100;
-        int loffset = (offset - 0x300) - (timer * 0x100);
-        uint32_t *wstat = &mct_priv->lwstat[timer];
-        if (is_vcpu_read_fault(vcpu)) {
-            if (loffset == 0x0) {        /* tcompl */
-                *wstat |= (1 << 1);
-            } else if (loffset == 0x8) {  /* tcomph */
-                *wstat |= (1 << 1);
-            } else if (loffset == 0x20) { /* tcon */
-                *wstat |= (1 << 3);
-            } else if (loffset == 0x34) { /* int_en */
-                /* Do nothing */
-            } else if (loffset == 0x40) { /* wstat */
-                *wstat &= ~(get_vcpu_fault_data(vcpu) & mask);
+        next = MIN(next, comp - mct->count_offset);
+    }
+
+    for (int i = 0; i < VMCT_NUM_LOCAL_TIMERS; i++) {
+        volatile struct mct_local_timer *l = &regs->local[i];
+        if (!mct->local_armed[i]) {
+            l->icnto = 0;
+            l->tcnto = 0;
+            continue;
+        }
+        if (mct->local_deadline[i] <= host_count) {
+            l->int_cstat |= BIT(0);
+            if (l->int_enb & BIT(0)) {
+                vmct_raise(mct, mct->config.local_irqs[i]);
+            }
+            if (l->tcon & LTCON_AUTO_RELOAD) {
+                uint64_t period = mct->local_period[i];
+                mct->local_deadline[i] += ((host_count - mct->local_deadline[i]) / period + 1) * period;
             } else {
-                ZF_LOGD("local MCT fault on unknown offset 0x%x\n", offset);
+                mct->local_armed[i] = false;
+                l->icnto = 0;
+                l->tcnto = 0;
+                continue;
             }
+        }
+        uint64_t remaining = mct->local_deadline[i] - host_count;
+        l->icnto = remaining / ((uint64_t)l->tcntb + 1);
+        l->tcnto = remaining % ((uint64_t)l->tcntb + 1);
+        next = MIN(next, mct->local_deadline[i]);
+    }
+
+    regs->cnt_l = (uint32_t)count;
+    regs->cnt_u = (uint32_t)(count >> 32);
+    if (next != mct->deadline) {
+        mct->deadline = next;
+        if (mct->config.set_deadline(next, mct->config.cookie)) {
+            ZF_LOGE("Failed to set MCT deadline");
+        }
+    }
+}
+
+static void vmct_global_write(struct vmct_priv *mct, vm_vcpu_t *vcpu, int offset)
+{
+    volatile struct mct_map *regs = mct->regs;
+    uint32_t mask = get_vcpu_fault_data_mask(vcpu);
+    uint32_t data = get_vcpu_fault_data(vcpu) & mask;
+    uint64_t host_count = mct->config.get_count(mct->config.cookie);
+    uint64_t count = vmct_count(mct, host_count);
+
+    if (offset == MCT_G_CNT_L || offset == MCT_G_CNT_U) {
+        if (offset == MCT_G_CNT_L) {
+            count = (count & ~(uint64_t)MASK(32)) | emulate_vcpu_fault(vcpu, (uint32_t)count);
         } else {
-            /* read fault */
-            if (loffset == 0x40) {
-                set_vcpu_fault_data(vcpu, *wstat);
+            count = (count & MASK(32)) | ((uint64_t)emulate_vcpu_fault(vcpu, (uint32_t)(count >> 32)) << 32);
+        }
+        vmct_set_count(mct, host_count, count);
+        regs->cnt_wstat |= BIT((offset - MCT_G_CNT_L) / 4);
+    } else if (offset == MCT_G_CNT_WSTAT) {
+        regs->cnt_wstat &= ~data;
+    } else if (offset >= MCT_G_COMP0_L && offset < MCT_G_TCON) {
+        int n = (offset - MCT_G_COMP0_L) / sizeof(struct mct_comparator);
+        int reg = ((offset - MCT_G_COMP0_L) % sizeof(struct mct_comparator)) / 4;
+        volatile uint32_t *r = (volatile uint32_t *)&regs->comp[n] + reg;
+        if (reg < 3) {
+            *r = emulate_vcpu_fault(vcpu, *r);
+            regs->wstat |= BIT(n * 4 + reg);
+            mct->comp_armed[n] = true;
+        }
+    } else if (offset == MCT_G_TCON) {
+        uint32_t old = regs->tcon;
+        regs->tcon = emulate_vcpu_fault(vcpu, old);
+        if ((old ^ regs->tcon) & GTCON_TIMER_ENABLE) {
+            /* Stopping the counter freezes it, starting it carries on from where it stopped */
+            if (regs->tcon & GTCON_TIMER_ENABLE) {
+                vmct_set_count(mct, host_count, mct->count_stopped);
             } else {
-                set_vcpu_fault_data(vcpu, 0);
+                mct->count_stopped = count;
+            }
+        }
+        for (int i = 0; i < VMCT_NUM_COMPARATORS; i++) {
+            if ((regs->tcon & ~old) & GTCON_COMP_ENABLE(i)) {
+                mct->comp_armed[i] = true;
             }
         }
+        regs->wstat |= GWSTAT_TCON;
+    } else if (offset == MCT_G_INT_CSTAT) {
+        regs->int_cstat &= ~data;
+    } else if (offset == MCT_G_INT_ENB) {
+        regs->int_enb = emulate_vcpu_fault(vcpu, regs->int_enb);
+    } else if (offset == MCT_G_WSTAT) {
+        regs->wstat &= ~data;
+    } else if (offset == 0) {
+        regs->cfg = emulate_vcpu_fault(vcpu, regs->cfg);
+    } else {
+        ZF_LOGD("global MCT fault on unknown offset 0x%x\n", offset);
+    }
+}
+
+static void vmct_local_write(struct vmct_priv *mct, vm_vcpu_t *vcpu, int n, int loffset)
+{
+    volatile struct mct_local_timer *l = &mct->regs->local[n];
+    uint32_t mask = get_vcpu_fault_data_mask(vcpu);
+    uint32_t data = get_vcpu_fault_data(vcpu) & mask;
+
+    switch (loffset) {
+    case MCT_L_TCNTB:
+        l->tcntb = emulate_vcpu_fault(vcpu, l->tcntb);
+        l->wstat |= LWSTAT_TCNTB;
+        break;
+    case MCT_L_ICNTB:
+        l->icntb = emulate_vcpu_fault(vcpu, l->icntb);
+        l->wstat |= LWSTAT_ICNTB;
+        if (l->icntb & LICNTB_MANUAL_UPDATE) {
+            vmct_local_start(mct, n, mct->config.get_count(mct->config.cookie));
+        }
+        break;
+    case MCT_L_FRCNTB:
+        l->frcntb = emulate_vcpu_fault(vcpu, l->frcntb);
+        l->wstat |= LWSTAT_FRCNTB;
+        break;
+    case MCT_L_TCON: {
+        uint32_t old = l->tcon;
+        l->tcon = emulate_vcpu_fault(vcpu, old);
+        l->wstat |= LWSTAT_TCON;
+        if ((l->tcon & ~old) & (LTCON_TIMER_START | LTCON_INT_START)) {
+            vmct_local_start(mct, n, mct->config.get_count(mct->config.cookie));
+        } else if (!(l->tcon & LTCON_TIMER_START) || !(l->tcon & LTCON_INT_START)) {
+            mct->local_armed[n] = false;
+        }
+        break;
+    }
+    case MCT_L_INT_CSTAT:
+        l->int_cstat &= ~data;
+        break;
+    case MCT_L_INT_ENB:
+        l->int_enb = emulate_vcpu_fault(vcpu, l->int_enb);
+        break;
+    case MCT_L_WSTAT:
+        l->wstat &= ~data;
+        break;
+    default:
+        ZF_LOGD("local MCT fault on unknown offset 0x%x\n", MCT_L_BASE + n * MCT_L_SIZE + loffset);
+        break;
+    }
+}
+
+static memory_fault_result_t handle_vmct_fault(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t fault_addr, size_t fault_length,
+                                               void *cookie)
+{
+    struct device *dev = (struct device *)cookie;
+    struct vmct_priv *mct = vmct_get_priv(dev->priv);
+    int offset = ROUND_DOWN(fault_addr - dev->pstart, sizeof(uint32_t));
+
+    if (is_vcpu_read_fault(vcpu)) {
+        /* Reads are served from the frame without faulting, unless it has been unmapped */
+        vmct_update(mct);
+        set_vcpu_fault_data(vcpu, ((volatile uint32_t *)mct->regs)[offset / 4]);
+    } else if (offset < MCT_L_BASE) {
+        vmct_global_write(mct, vcpu, offset);
+        vmct_update(mct);
+    } else if (offset < MCT_L_BASE + VMCT_NUM_LOCAL_TIMERS * MCT_L_SIZE) {
+        int n = (offset - MCT_L_BASE) / MCT_L_SIZE;
+        vmct_local_write(mct, vcpu, n, (offset - MCT_L_BASE) % MCT_L_SIZE);
+        vmct_update(mct);
+    } else {
+        ZF_LOGD("MCT fault on unknown offset 0x%x\n", offset);
     }
     advance_vcpu_fault(vcpu);
     return FAULT_HANDLED;
@@ -126,14 +417,45 @@ const struct device dev_vmct_timer = {
     .priv = NULL
 };
 
+static vm_frame_t vmct_frame_iterator(uintptr_t addr, void *cookie)
+{
+    int err;
+    cspacepath_t frame;
+    cspacepath_t shared_frame;
+    vm_frame_t frame_result = { seL4_CapNull, seL4_NoRights, 0, 0 };
+    struct vmct_priv *mct = vmct_get_priv(cookie);
+
+    err = vka_cspace_alloc_path(mct->vm->vka, &frame);
+    if (err) {
+        ZF_LOGE("Failed to allocate cslot for MCT registers");
+        return frame_result;
+    }
+    vka_cspace_make_path(mct->vm->vka, mct->frame.cptr, &shared_frame);
+    err = vka_cnode_copy(&frame, &shared_frame, seL4_AllRights);
+    if (err) {
+        ZF_LOGE("Failed to copy MCT registers cap");
+        vka_cspace_free_path(mct->vm->vka, frame);
+        return frame_result;
+    }
+    /* Reads are served from the frame without faulting, writes fault and are emulated */
+    frame_result.cptr = frame.capPtr;
+    frame_result.rights = seL4_CanRead;
+    frame_result.vaddr = MCT_ADDR;
+    frame_result.size_bits = seL4_PageBits;
+    return frame_result;
+}
 
-int vm_install_vmct(vm_t *vm)
+int vm_install_vmct(vm_t *vm, const struct vmct_config *config, struct vmct_priv **vmct)
 {
     struct vmct_priv *vmct_data;
     struct device *d;
     int err;
 
-    d = (struct device *)calloc(1, sizeof(struct device));
+    if (!config || !config->get_count || !config->set_deadline || vm->num_vcpus == 0) {
+        ZF_LOGE("Failed to install vmct: Invalid host timer or no boot vcpu");
+        return -1;
+    }
+    d = vm_arena_alloc(vm, sizeof(struct device));
     if (!d) {
         return -1;
     }
@@ -141,16 +463,56 @@ int vm_install_vmct(vm_t *vm)
     /* Initialise the virtual device */
     vmct_data = calloc(1, sizeof(struct vmct_priv));
     if (vmct_data == NULL) {
-        assert(vmct_data);
+        vm_arena_free(vm, sizeof(struct device), d);
         return -1;
     }
+    vmct_data->vm = vm;
+    vmct_data->config = *config;
+    vmct_data->deadline = UINT64_MAX;
+    err = vka_alloc_frame(vm->vka, seL4_PageBits, &vmct_data->frame);
+    if (err) {
+        ZF_LOGE("Failed to allocate MCT registers frame");
+        goto error;
+    }
+    cspacepath_t path;
+    vka_cspace_make_path(vm->vka, vmct_data->frame.cptr, &path);
+    /* Uncached, as the guest reads the registers through a device mapping */
+    vmct_data->regs = vspace_map_pages(&vm->mem.vmm_vspace, &path.capPtr, NULL, seL4_AllRights, 1, seL4_PageBits, 0);
+    if (!vmct_data->regs) {
+        ZF_LOGE("Failed to map MCT registers into vmm vspace");
+        vka_free_object(vm->vka, &vmct_data->frame);
+        goto error;
+    }
     d->priv = vmct_data;
     vm_memory_reservation_t *reservation = vm_reserve_memory_at(vm, d->pstart, d->size,
                                                                 handle_vmct_fault, (void *)d);
     if (!reservation) {
-        free(d);
-        free(vmct_data);
+        goto error;
+    }
+    err = vm_map_reservation(vm, reservation, vmct_frame_iterator, vmct_data);
+    if (err) {
+        ZF_LOGE("Failed to map MCT registers into vm");
         return -1;
     }
+    for (int i = 0; i < VMCT_NUM_COMPARATORS + VMCT_NUM_LOCAL_TIMERS; i++) {
+        int irq = i < VMCT_NUM_COMPARATORS ? config->global_irqs[i] : config->local_irqs[i - VMCT_NUM_COMPARATORS];
+        if (irq >= 0 && vm_register_irq(vm->vcpus[BOOT_VCPU], irq, vmct_irq_ack, vmct_data)) {
+            ZF_LOGE("Failed to register MCT irq %d", irq);
+            return -1;
+        }
+    }
+    *vmct = vmct_data;
     return 0;
+
+error:
+    vm_arena_free(vm, sizeof(struct device), d);
+    free(vmct_data);
+    return -1;
+}
+
+void vm_vmct_handle_timer(struct vmct_priv *vmct)
+{
+    /* The deadline has passed, and is set again by the update */
+    vmct->deadline = UINT64_MAX;
+    vmct_update(vmct);
 }
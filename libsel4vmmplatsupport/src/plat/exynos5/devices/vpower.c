@@ -11,6 +11,7 @@
 
 #include <sel4vmmplatsupport/plat/vpower.h>
 #include <sel4vmmplatsupport/device.h>
+#include <sel4vmmplatsupport/device_utils.h>
 #include <sel4vmmplatsupport/plat/devices.h>
 
 #define PWR_SWRST_BANK    0
@@ -26,68 +27,62 @@ struct power_priv {
     vm_power_cb reboot_cb;
     void *reboot_token;
     void *regs[5];
+    vm_shadow_device_t *sdev;
 };
 
 
-static memory_fault_result_t handle_vpower_fault(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t fault_addr, size_t fault_length,
-                                                 void *cookie)
+static int handle_vpower_write(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t vm_offset, uint32_t *value, void *cookie)
 {
-    struct device *dev = (struct device *)cookie;
-    struct power_priv *power_data = (struct power_priv *)dev->priv;
+    struct power_priv *power_data = (struct power_priv *)cookie;
     volatile uint32_t *reg;
-    int vm_offset, offset, reg_offset;
+    int offset;
     int bank;
 
     /* Gather fault information */
-    vm_offset = fault_addr - dev->pstart;
     bank = vm_offset >> 12;
     offset = vm_offset & MASK(12);
-    reg_offset = offset & ~MASK(2);
 
-    /* Handle the fault */
+    /* Handle the write, leaving the shadow as it was unless the write is passed on */
     reg = (volatile uint32_t *)(power_data->regs[bank] + offset);
-    if (is_vcpu_read_fault(vcpu)) {
-        set_vcpu_fault_data(vcpu, *reg);
-        ZF_LOGD("[%s] pc0x%x| r0x%x:0x%x\n", dev->name, get_vcpu_fault_ip(vcpu),
-                fault_addr, get_vcpu_fault_data(vcpu));
-    } else {
-        if (bank == PWR_SWRST_BANK && reg_offset == PWR_SWRST_OFFSET) {
-            if (get_vcpu_fault_data(vcpu)) {
-                /* Software reset */
-                ZF_LOGD("[%s] Software reset\n", dev->name);
-                if (power_data->reboot_cb) {
-                    int err;
-                    err = power_data->reboot_cb(vm, power_data->reboot_token);
-                    if (err) {
-                        return FAULT_ERROR;
-                    }
+    if (bank == PWR_SWRST_BANK && offset == PWR_SWRST_OFFSET) {
+        if (get_vcpu_fault_data(vcpu)) {
+            /* Software reset */
+            ZF_LOGD("[%s] Software reset\n", dev_alive.name);
+            if (power_data->reboot_cb) {
+                int err;
+                err = power_data->reboot_cb(vm, power_data->reboot_token);
+                if (err) {
+                    return -1;
                 }
             }
-        } else if (bank == PWR_SHUTDOWN_BANK && reg_offset == PWR_SHUTDOWN_OFFSET) {
-            uint32_t new_reg = emulate_vcpu_fault(vcpu, *reg);
-            new_reg &= BIT(31) | BIT(9) | BIT(8);
-            if (new_reg == (BIT(31) | BIT(9))) {
-                /* Software power down */
-                ZF_LOGD("[%s] Power down\n", dev->name);
-                if (power_data->shutdown_cb) {
-                    int err;
-                    err = power_data->shutdown_cb(vm, power_data->reboot_token);
-                    if (err) {
-                        return FAULT_ERROR;
-                    }
+        }
+        *value = *vm_shadow_device_reg(power_data->sdev, vm_offset);
+    } else if (bank == PWR_SHUTDOWN_BANK && offset == PWR_SHUTDOWN_OFFSET) {
+        uint32_t new_reg = *value;
+        new_reg &= BIT(31) | BIT(9) | BIT(8);
+        if (new_reg == (BIT(31) | BIT(9))) {
+            /* Software power down */
+            ZF_LOGD("[%s] Power down\n", dev_alive.name);
+            if (power_data->shutdown_cb) {
+                int err;
+                err = power_data->shutdown_cb(vm, power_data->reboot_token);
+                if (err) {
+                    return -1;
                 }
-            } else {
-                *reg = emulate_vcpu_fault(vcpu, *reg);
             }
-
+            *value = *vm_shadow_device_reg(power_data->sdev, vm_offset);
         } else {
-            ZF_LOGD("[%s] pc 0x%x| access violation writing 0x%x to 0x%x\n",
-                    dev->name, get_vcpu_fault_ip(vcpu), get_vcpu_fault_data(vcpu),
-                    fault_addr);
+            *reg = *value;
+            *value = *reg;
         }
+
+    } else {
+        ZF_LOGD("[%s] pc 0x%x| access violation writing 0x%x to 0x%x\n",
+                dev_alive.name, get_vcpu_fault_ip(vcpu), get_vcpu_fault_data(vcpu),
+                dev_alive.pstart + vm_offset);
+        *value = *vm_shadow_device_reg(power_data->sdev, vm_offset);
     }
-    advance_vcpu_fault(vcpu);
-    return FAULT_HANDLED;
+    return 0;
 }
 
 const struct device dev_alive = {
@@ -101,18 +96,12 @@ int vm_install_vpower(vm_t *vm, vm_power_cb shutdown_cb, void *shutdown_token,
                       vm_power_cb reboot_cb, void *reboot_token)
 {
     struct power_priv *power_data;
-    struct device *d;
-    int err;
     int i;
 
-    d = calloc(1, sizeof(struct device));
-    memcpy(d, &dev_alive, sizeof(struct device));
-
     /* Initialise the virtual device */
     power_data = calloc(1, sizeof(struct power_priv));
     if (power_data == NULL) {
         assert(power_data);
-        free(d);
         return -1;
     }
     power_data->vm = vm;
@@ -121,20 +110,18 @@ int vm_install_vpower(vm_t *vm, vm_power_cb shutdown_cb, void *shutdown_token,
     power_data->reboot_cb = reboot_cb;
     power_data->reboot_token = reboot_token;
 
-    for (i = 0; i < d->size >> 12; i++) {
-        power_data->regs[i] = ps_io_map(&vm->io_ops->io_mapper, d->pstart + (i << 12), PAGE_SIZE_4K, 0, PS_MEM_NORMAL);
+    for (i = 0; i < dev_alive.size >> 12; i++) {
+        power_data->regs[i] = ps_io_map(&vm->io_ops->io_mapper, dev_alive.pstart + (i << 12), PAGE_SIZE_4K, 0,
+                                        PS_MEM_NORMAL);
         if (power_data->regs[i] == NULL) {
-            free(d);
             free(power_data);
             return -1;
         }
     }
 
-    d->priv = power_data;
-    vm_memory_reservation_t *reservation = vm_reserve_memory_at(vm, d->pstart, d->size,
-                                                                handle_vpower_fault, (void *)d);
-    if (!reservation) {
-        free(d);
+    /* Reads are served from a shadow of the registers, only writes fault */
+    power_data->sdev = vm_install_shadow_device(vm, &dev_alive, true, handle_vpower_write, power_data);
+    if (!power_data->sdev) {
         free(power_data);
         return -1;
     }
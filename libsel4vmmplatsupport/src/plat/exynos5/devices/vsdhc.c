@@ -7,21 +7,80 @@
  * DesignWare eMMC
  */
 
+#include <inttypes.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <sel4vm/guest_vm.h>
 #include <sel4vm/guest_vcpu_fault.h>
+#include <sel4vm/guest_ram.h>
+#include <sel4vm/guest_vm_arena.h>
+#include <sel4vm/arch/guest_memory_arch.h>
 
 #include <sel4vmmplatsupport/guest_memory_util.h>
 #include <sel4vmmplatsupport/plat/vsdhc.h>
 #include <sel4vmmplatsupport/device.h>
 #include <sel4vmmplatsupport/plat/devices.h>
 
+#define DWEMMC_CTRL_OFFSET      0x000
+#define DWEMMC_CMD_OFFSET       0x02C
+#define DWEMMC_BMOD_OFFSET      0x080
+#define DWEMMC_PLDMND_OFFSET    0x084
 #define DWEMMC_DBADDR_OFFSET    0x088
+#define DWEMMC_IDSTS_OFFSET     0x08C
 #define DWEMMC_DSCADDR_OFFSET   0x094
 #define DWEMMC_BUFADDR_OFFSET   0x098
 
+#define DWEMMC_CTRL_DMA_RESET   BIT(2)
+#define DWEMMC_CMD_START        BIT(31)
+#define DWEMMC_CMD_DATA_EXP     BIT(9)
+#define DWEMMC_BMOD_SWR         BIT(0)
+#define DWEMMC_BMOD_DSL_SHIFT   2
+#define DWEMMC_BMOD_DSL_MASK    (MASK(5) << DWEMMC_BMOD_DSL_SHIFT)
+
+/* Internal DMA controller descriptor */
+struct idmac_desc {
+    uint32_t des0;
+    uint32_t des1;
+    uint32_t des2;
+    uint32_t des3;
+};
+
+#define IDMAC_DES0_OWN          BIT(31)
+#define IDMAC_DES0_CES          BIT(30)
+#define IDMAC_DES0_ER           BIT(5)
+#define IDMAC_DES0_CH           BIT(4)
+#define IDMAC_DES1_BS1(d)       ((d) & MASK(13))
+#define IDMAC_DES1_BS2(d)       (((d) >> 13) & MASK(13))
+#define IDMAC_DES1(bs1, bs2)    ((bs1) | ((bs2) << 13))
+
+/* Largest ring of descriptors translated, a page of them */
+#define SDHC_MAX_DESCS          (PAGE_SIZE_4K / sizeof(struct idmac_desc))
+
+/* A contiguous piece of a guest DMA buffer */
+struct sdhc_dma_piece {
+    uintptr_t paddr;
+    size_t size;
+};
+
+struct sdhc_dma {
+    /* Translated descriptors, the ring the IDMAC runs on */
+    volatile struct idmac_desc *shadow;
+    uintptr_t shadow_paddr;
+    /* Guest's descriptor list base and skip length */
+    uint32_t dbaddr;
+    int dsl;
+    /* Descriptors in the guest's ring, 0 until it is next walked */
+    int ring_len;
+    /* Guest physical address and control word of each descriptor */
+    uintptr_t guest_addr[SDHC_MAX_DESCS];
+    uint32_t guest_des0[SDHC_MAX_DESCS];
+    /* Whether a descriptor has been handed to the IDMAC and not yet given back to the guest */
+    bool inflight[SDHC_MAX_DESCS];
+    int num_inflight;
+};
+
 struct sdhc_priv {
     /* The VM associated with this device */
     vm_t *vm;
@@ -29,8 +88,233 @@ struct sdhc_priv {
     void *regs;
     /* Residual for 64 bit atomic access to FIFO */
     uint32_t a64;
+    /* Translation of the guest's DMA, NULL if the guest is denied DMA */
+    struct sdhc_dma *dma;
 };
 
+struct sdhc_dma_translation {
+    struct sdhc_dma_piece *pieces;
+    int num_pieces;
+    int max_pieces;
+};
+
+static int sdhc_dma_piece_callback(vm_t *vm, uintptr_t guest_addr, void *vaddr, size_t size, size_t offset,
+                                   void *cookie)
+{
+    struct sdhc_dma_translation *t = (struct sdhc_dma_translation *)cookie;
+    struct sdhc_dma_piece *last = t->num_pieces ? &t->pieces[t->num_pieces - 1] : NULL;
+    uintptr_t paddr = vm_arm_ipa_to_pa(vm, guest_addr, size);
+    if (!paddr) {
+        return -1;
+    }
+    if (last && last->paddr + last->size == paddr) {
+        last->size += size;
+        return 0;
+    }
+    if (t->num_pieces == t->max_pieces) {
+        return -1;
+    }
+    t->pieces[t->num_pieces++] = (struct sdhc_dma_piece) {
+        paddr, size
+    };
+    return 0;
+}
+
+/* Translate a guest buffer into the physically contiguous pieces of it. Touching the buffer
+ * checks that it is guest RAM, populates it, unshares it and logs it as dirtied, as the
+ * device may write to it */
+static int sdhc_dma_translate_buffer(vm_t *vm, uintptr_t addr, size_t size, struct sdhc_dma_translation *t)
+{
+    if (size == 0) {
+        return 0;
+    }
+    return vm_ram_touch(vm, addr, size, sdhc_dma_piece_callback, t);
+}
+
+static int sdhc_dma_read_desc(vm_t *vm, uintptr_t addr, struct idmac_desc *desc)
+{
+    return vm_ram_touch(vm, addr, sizeof(*desc), vm_guest_ram_read_callback, desc);
+}
+
+static void sdhc_dma_reset(struct sdhc_dma *dma)
+{
+    for (int i = 0; i < SDHC_MAX_DESCS; i++) {
+        dma->shadow[i].des0 = 0;
+        dma->inflight[i] = false;
+    }
+    dma->num_inflight = 0;
+}
+
+/* Find the descriptors of the guest's ring, which are followed from then on, as the IDMAC
+ * never sees the guest's addresses */
+static int sdhc_dma_walk_ring(vm_t *vm, struct sdhc_dma *dma)
+{
+    uintptr_t addr = dma->dbaddr;
+    int n;
+
+    for (n = 0; n < SDHC_MAX_DESCS;) {
+        struct idmac_desc desc;
+        if (sdhc_dma_read_desc(vm, addr, &desc)) {
+            ZF_LOGE("Failed to walk SDHC descriptor ring: Descriptor at 0x%"PRIxPTR" is not guest RAM", addr);
+            return -1;
+        }
+        dma->guest_addr[n++] = addr;
+        if (desc.des0 & IDMAC_DES0_ER) {
+            break;
+        }
+        addr = (desc.des0 & IDMAC_DES0_CH) ? desc.des3 : addr + sizeof(desc) + dma->dsl * sizeof(uint32_t);
+        if (addr == dma->dbaddr) {
+            break;
+        }
+    }
+    dma->ring_len = n;
+    return 0;
+}
+
+/* Give the descriptors the IDMAC has completed back to the guest */
+static void sdhc_dma_sync(vm_t *vm, struct sdhc_dma *dma)
+{
+    for (int i = 0; i < dma->ring_len && dma->num_inflight; i++) {
+        uint32_t des0 = dma->shadow[i].des0;
+        if (!dma->inflight[i] || (des0 & IDMAC_DES0_OWN)) {
+            continue;
+        }
+        des0 = (dma->guest_des0[i] & ~(IDMAC_DES0_OWN | IDMAC_DES0_CES)) | (des0 & IDMAC_DES0_CES);
+        if (vm_ram_touch(vm, dma->guest_addr[i], sizeof(des0), vm_guest_ram_write_callback, &des0)) {
+            ZF_LOGE("Failed to complete SDHC descriptor at 0x%"PRIxPTR, dma->guest_addr[i]);
+        }
+        dma->inflight[i] = false;
+        dma->num_inflight--;
+    }
+}
+
+static int sdhc_dma_translate_desc(vm_t *vm, struct sdhc_dma *dma, int i, const struct idmac_desc *desc)
+{
+    volatile struct idmac_desc *shadow = &dma->shadow[i];
+    struct sdhc_dma_piece pieces[2];
+    struct sdhc_dma_translation t = { pieces, 0, ARRAY_SIZE(pieces) };
+    uint32_t des0;
+
+    /* The shadow ring uses both buffers of each descriptor, so the buffers of a guest
+     * descriptor have to come down to two physically contiguous pieces */
+    if (sdhc_dma_translate_buffer(vm, desc->des2, IDMAC_DES1_BS1(desc->des1), &t)) {
+        return -1;
+    }
+    if (!(desc->des0 & IDMAC_DES0_CH) && sdhc_dma_translate_buffer(vm, desc->des3, IDMAC_DES1_BS2(desc->des1), &t)) {
+        return -1;
+    }
+    for (int j = t.num_pieces; j < ARRAY_SIZE(pieces); j++) {
+        pieces[j] = (struct sdhc_dma_piece) {
+            0, 0
+        };
+    }
+    if (pieces[0].size > MASK(13) || pieces[1].size > MASK(13)) {
+        return -1;
+    }
+
+    shadow->des1 = IDMAC_DES1(pieces[0].size, pieces[1].size);
+    shadow->des2 = pieces[0].paddr;
+    shadow->des3 = pieces[1].paddr;
+    des0 = desc->des0 & ~(IDMAC_DES0_CH | IDMAC_DES0_ER | IDMAC_DES0_CES);
+    if (i == dma->ring_len - 1) {
+        des0 |= IDMAC_DES0_ER;
+    }
+    /* Hand the descriptor over last */
+    THREAD_MEMORY_RELEASE();
+    shadow->des0 = des0;
+    dma->guest_des0[i] = desc->des0;
+    dma->inflight[i] = true;
+    dma->num_inflight++;
+    return 0;
+}
+
+/* Translate the descriptors the guest has handed to the IDMAC since the last translation,
+ * starting from the one the IDMAC is up to */
+static void sdhc_dma_translate(struct sdhc_priv *sdhc_data)
+{
+    struct sdhc_dma *dma = sdhc_data->dma;
+    vm_t *vm = sdhc_data->vm;
+    uintptr_t dscaddr;
+    int cur = 0;
+
+    if (!dma->ring_len && sdhc_dma_walk_ring(vm, dma)) {
+        return;
+    }
+    sdhc_dma_sync(vm, dma);
+
+    dscaddr = *(volatile uint32_t *)(sdhc_data->regs + DWEMMC_DSCADDR_OFFSET);
+    if (dscaddr >= dma->shadow_paddr && dscaddr < dma->shadow_paddr + dma->ring_len * sizeof(struct idmac_desc)) {
+        cur = (dscaddr - dma->shadow_paddr) / sizeof(struct idmac_desc);
+    }
+    for (int k = 0; k < dma->ring_len; k++) {
+        int i = (cur + k) % dma->ring_len;
+        struct idmac_desc desc;
+        if (dma->inflight[i]) {
+            continue;
+        }
+        if (sdhc_dma_read_desc(vm, dma->guest_addr[i], &desc) || !(desc.des0 & IDMAC_DES0_OWN)) {
+            break;
+        }
+        if (sdhc_dma_translate_desc(vm, dma, i, &desc)) {
+            /* Leave the descriptor to the guest, so the IDMAC suspends on it */
+            ZF_LOGE("Failed to translate SDHC descriptor at 0x%"PRIxPTR": Buffer is not contiguous guest RAM",
+                    dma->guest_addr[i]);
+            break;
+        }
+    }
+}
+
+/* Emulate a write to a register of the IDMAC, returning false for those passed on as is */
+static bool handle_sdhc_dma_write(struct sdhc_priv *sdhc_data, int offset, uint32_t data)
+{
+    struct sdhc_dma *dma = sdhc_data->dma;
+    volatile uint32_t *reg = (volatile uint32_t *)(sdhc_data->regs + offset);
+
+    switch (offset) {
+    case DWEMMC_CTRL_OFFSET:
+        *reg = data;
+        if (data & DWEMMC_CTRL_DMA_RESET) {
+            /* The IDMAC starts over from the base of the ring */
+            sdhc_dma_reset(dma);
+        }
+        return true;
+    case DWEMMC_CMD_OFFSET:
+        if ((data & (DWEMMC_CMD_START | DWEMMC_CMD_DATA_EXP)) == (DWEMMC_CMD_START | DWEMMC_CMD_DATA_EXP)) {
+            sdhc_dma_translate(sdhc_data);
+        }
+        *reg = data;
+        return true;
+    case DWEMMC_BMOD_OFFSET:
+        /* The shadow ring has no gaps between descriptors */
+        dma->dsl = (data & DWEMMC_BMOD_DSL_MASK) >> DWEMMC_BMOD_DSL_SHIFT;
+        *reg = data & ~DWEMMC_BMOD_DSL_MASK;
+        if (data & DWEMMC_BMOD_SWR) {
+            sdhc_dma_reset(dma);
+        }
+        return true;
+    case DWEMMC_PLDMND_OFFSET:
+        sdhc_dma_translate(sdhc_data);
+        *reg = data;
+        return true;
+    case DWEMMC_DBADDR_OFFSET:
+        dma->dbaddr = data;
+        dma->ring_len = 0;
+        sdhc_dma_reset(dma);
+        *reg = dma->shadow_paddr;
+        return true;
+    case DWEMMC_IDSTS_OFFSET:
+        sdhc_dma_sync(sdhc_data->vm, dma);
+        *reg = data;
+        return true;
+    case DWEMMC_DSCADDR_OFFSET:
+    case DWEMMC_BUFADDR_OFFSET:
+        /* Read only */
+        return true;
+    default:
+        return false;
+    }
+}
+
 static memory_fault_result_t handle_sdhc_fault(vm_t *vm, vm_vcpu_t *vcpu, uintptr_t fault_addr, size_t fault_length,
                                                void *cookie)
 {
@@ -62,6 +346,10 @@ static memory_fault_result_t handle_sdhc_fault(vm_t *vm, vm_vcpu_t *vcpu, uintpt
         }
         ZF_LOGD("[%s] pc0x%x| r0x%x:0x%x\n", d->name, get_vcpu_fault_ip(vcpu),
                 fault_addr, get_vcpu_fault_data(vcpu));
+    } else if (sdhc_data->dma && fault_length != sizeof(uint64_t)
+               && handle_sdhc_dma_write(sdhc_data, offset & ~0x3, get_vcpu_fault_data(vcpu))) {
+        ZF_LOGD("[%s] pc0x%x| dma w0x%x:0x%x\n", d->name, get_vcpu_fault_ip(vcpu),
+                fault_addr, get_vcpu_fault_data(vcpu));
     } else {
         switch (offset & ~0x3) {
         case DWEMMC_DBADDR_OFFSET:
@@ -108,12 +396,12 @@ const struct device dev_msh2 = {
     .priv = NULL
 };
 
-static int vm_install_nodma_sdhc(vm_t *vm, int idx)
+static int vm_install_sdhc(vm_t *vm, int idx, bool dma)
 {
     struct sdhc_priv *sdhc_data;
     struct device *d;
     int err;
-    d = calloc(1, sizeof(struct device));
+    d = vm_arena_alloc(vm, sizeof(struct device));
     if (!d) {
         return -1;
     }
@@ -136,6 +424,23 @@ static int vm_install_nodma_sdhc(vm_t *vm, int idx)
         return -1;
     }
     sdhc_data->vm = vm;
+    if (dma) {
+        struct sdhc_dma *sdhc_dma = calloc(1, sizeof(*sdhc_dma));
+        if (sdhc_dma == NULL) {
+            ZF_LOGE("Failed to install %s: Unable to allocate DMA state", d->name);
+            return -1;
+        }
+        sdhc_dma->shadow = ps_dma_alloc(&vm->io_ops->dma_manager, PAGE_SIZE_4K, PAGE_SIZE_4K, 0, PS_MEM_NORMAL);
+        if (sdhc_dma->shadow == NULL) {
+            ZF_LOGE("Failed to install %s: Unable to allocate descriptor ring", d->name);
+            free(sdhc_dma);
+            return -1;
+        }
+        sdhc_dma->shadow_paddr = ps_dma_pin(&vm->io_ops->dma_manager, (void *)sdhc_dma->shadow, PAGE_SIZE_4K);
+        sdhc_dma_reset(sdhc_dma);
+        sdhc_data->dma = sdhc_dma;
+    }
+    /* Reads of the registers go to the device, writes are trapped */
     sdhc_data->regs = create_device_reservation_frame(vm, d->pstart, seL4_CanRead,
                                                       handle_sdhc_fault, (void *)d);
     if (sdhc_data->regs == NULL) {
@@ -148,10 +453,20 @@ static int vm_install_nodma_sdhc(vm_t *vm, int idx)
 
 int vm_install_nodma_sdhc0(vm_t *vm)
 {
-    return vm_install_nodma_sdhc(vm, 0);
+    return vm_install_sdhc(vm, 0, false);
 }
 
 int vm_install_nodma_sdhc2(vm_t *vm)
 {
-    return vm_install_nodma_sdhc(vm, 2);
+    return vm_install_sdhc(vm, 2, false);
+}
+
+int vm_install_dma_sdhc0(vm_t *vm)
+{
+    return vm_install_sdhc(vm, 0, true);
+}
+
+int vm_install_dma_sdhc2(vm_t *vm)
+{
+    return vm_install_sdhc(vm, 2, true);
 }
@@ -9,13 +9,15 @@
 #include <sel4vm/guest_vm.h>
 #include <sel4vm/guest_vcpu_fault.h>
 #include <sel4vm/guest_memory.h>
+#include <sel4vm/guest_vm_arena.h>
 
 #include <sel4vmmplatsupport/device.h>
 #include <sel4vmmplatsupport/plat/device_map.h>
 #include <sel4vmmplatsupport/plat/vuart.h>
 #include <sel4vmmplatsupport/plat/devices.h>
 
-#define VUART_BUFLEN 300
+/* Ring size of consoles drained as they are written to */
+#define VUART_RING_SIZE 512
 
 #define ULCON       0x000 /* line control */
 #define UCON        0x004 /* control */
@@ -38,8 +40,17 @@
 
 struct vuart_priv {
     void *regs;
-    char buffer[VUART_BUFLEN];
-    int buf_pos;
+    /* Ring of console output, written to by the vcpu faulting on the device and drained by
+     * vconsole_drain. With deferred output it is drained by a different thread */
+    char *ring;
+    size_t ring_size;
+    size_t head;
+    size_t tail;
+    /* Characters dropped as the ring of a deferred console was full */
+    size_t dropped;
+    bool deferred;
+    /* Drain is within an escape sequence, which are left out of the output */
+    bool in_escape;
     vm_t *vm;
 };
 
@@ -60,24 +71,54 @@ static void vuart_reset(struct device *d)
     memcpy(vuart_priv_get_regs(d), reset_data, sizeof(reset_data));
 }
 
-static void flush_vconsole_device(struct device *d)
+/* Write out a run of the ring, leaving out ANSI colour escapes up to their terminating 'm' */
+static void write_vconsole_output(struct vuart_priv *vuart_data, const char *buf, size_t len)
 {
-    struct vuart_priv *vuart_data;
-    char *buf;
-    int i;
-    assert(d->priv);
-    vuart_data = (struct vuart_priv *)d->priv;
-    buf = vuart_data->buffer;
-    for (i = 0; i < vuart_data->buf_pos; i++) {
-        if (buf[i] != '\033') {
-            putchar(buf[i]);
-        } else {
-            while (i < vuart_data->buf_pos && buf[i] != 'm') {
-                i++;
+    while (len) {
+        if (vuart_data->in_escape) {
+            const char *end = memchr(buf, 'm', len);
+            if (!end) {
+                return;
             }
+            vuart_data->in_escape = false;
+            len -= end + 1 - buf;
+            buf = end + 1;
+            continue;
+        }
+        const char *esc = memchr(buf, '\033', len);
+        size_t out = esc ? esc - buf : len;
+        fwrite(buf, 1, out, stdout);
+        buf += out;
+        len -= out;
+        if (esc) {
+            vuart_data->in_escape = true;
+            buf++;
+            len--;
         }
     }
-    vuart_data->buf_pos = 0;
+}
+
+static size_t vconsole_drain(struct vuart_priv *vuart_data)
+{
+    size_t tail = vuart_data->tail;
+    size_t head = __atomic_load_n(&vuart_data->head, __ATOMIC_ACQUIRE);
+    size_t drained = head - tail;
+    while (tail != head) {
+        /* Write out up to the end of the ring at a time */
+        size_t start = tail & (vuart_data->ring_size - 1);
+        size_t len = MIN(head - tail, vuart_data->ring_size - start);
+        write_vconsole_output(vuart_data, vuart_data->ring + start, len);
+        tail += len;
+    }
+    __atomic_store_n(&vuart_data->tail, tail, __ATOMIC_RELEASE);
+    size_t dropped = __atomic_exchange_n(&vuart_data->dropped, 0, __ATOMIC_RELAXED);
+    if (dropped) {
+        printf("\n[vconsole: %zu characters dropped]\n", dropped);
+    }
+    if (drained || dropped) {
+        fflush(stdout);
+    }
+    return drained;
 }
 
 static void vuart_putchar(struct device *d, char c)
@@ -86,14 +127,20 @@ static void vuart_putchar(struct device *d, char c)
     assert(d->priv);
     vuart_data = (struct vuart_priv *)d->priv;
 
-    if (vuart_data->buf_pos == VUART_BUFLEN) {
-        flush_vconsole_device(d);
+    size_t head = vuart_data->head;
+    if (head - __atomic_load_n(&vuart_data->tail, __ATOMIC_ACQUIRE) == vuart_data->ring_size) {
+        if (vuart_data->deferred) {
+            /* Never wait on the thread draining the console */
+            __atomic_fetch_add(&vuart_data->dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        vconsole_drain(vuart_data);
     }
-    assert(vuart_data->buf_pos < VUART_BUFLEN);
-    vuart_data->buffer[vuart_data->buf_pos++] = c;
+    vuart_data->ring[head & (vuart_data->ring_size - 1)] = c;
+    __atomic_store_n(&vuart_data->head, head + 1, __ATOMIC_RELEASE);
 
-    if ((c & 0xff) == '\n') {
-        flush_vconsole_device(d);
+    if (!vuart_data->deferred && (c & 0xff) == '\n') {
+        vconsole_drain(vuart_data);
     }
 }
 
@@ -167,15 +214,15 @@ const struct device dev_uart3 = {
 };
 
 
-int vm_install_vconsole(vm_t *vm)
+static struct vuart_priv *install_vconsole(vm_t *vm, size_t ring_size, bool deferred)
 {
     struct vuart_priv *vuart_data;
     struct device *d;
     int err;
 
-    d = (struct device *)calloc(1, sizeof(struct device));
+    d = vm_arena_alloc(vm, sizeof(struct device));
     if (!d) {
-        return -1;
+        return NULL;
     }
 
     *d = dev_vconsole;
@@ -183,24 +230,51 @@ int vm_install_vconsole(vm_t *vm)
     vuart_data = calloc(1, sizeof(struct vuart_priv));
     if (vuart_data == NULL) {
         assert(vuart_data);
-        return -1;
+        return NULL;
     }
     vuart_data->vm = vm;
+    vuart_data->deferred = deferred;
 
     vuart_data->regs = calloc(1, UART_SIZE);
     if (vuart_data->regs == NULL) {
         assert(vuart_data->regs);
-        return -1;
+        return NULL;
     }
+    vuart_data->ring = malloc(ring_size);
+    if (vuart_data->ring == NULL) {
+        ZF_LOGE("Failed to install vconsole: Unable to allocate output ring");
+        return NULL;
+    }
+    vuart_data->ring_size = ring_size;
 
     vm_memory_reservation_t *reservation = vm_reserve_memory_at(vm, d->pstart, d->size,
                                                                 handle_vuart_fault, (void *)d);
     if (!reservation) {
-        return -1;
+        return NULL;
     }
     d->priv = vuart_data;
     vuart_reset(d);
-    return 0;
+    return vuart_data;
+}
+
+int vm_install_vconsole(vm_t *vm)
+{
+    return install_vconsole(vm, VUART_RING_SIZE, false) ? 0 : -1;
+}
+
+int vm_install_vconsole_deferred(vm_t *vm, size_t ring_size, struct vuart_priv **console)
+{
+    if (!ring_size || (ring_size & (ring_size - 1))) {
+        ZF_LOGE("Failed to install vconsole: Ring size %zu is not a power of 2", ring_size);
+        return -1;
+    }
+    *console = install_vconsole(vm, ring_size, true);
+    return *console ? 0 : -1;
+}
+
+size_t vm_vconsole_drain(struct vuart_priv *console)
+{
+    return vconsole_drain(console);
 }
 
 
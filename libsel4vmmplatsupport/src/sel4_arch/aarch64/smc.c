@@ -5,62 +5,20 @@
  */
 
 
+#include <stddef.h>
+
 #include <sel4vm/guest_vm.h>
 
 #include "smc.h"
 
-seL4_Word smc_get_function_id(seL4_UserContext *u)
-{
-    return u->x0;
-}
-
-seL4_Word smc_set_return_value(seL4_UserContext *u, seL4_Word val)
-{
-    u->x0 = val;
-}
+#define CTX_REG(r) (offsetof(seL4_UserContext, r) / sizeof(seL4_Word))
 
-seL4_Word smc_get_arg(seL4_UserContext *u, seL4_Word arg)
-{
-    switch (arg) {
-    case 1:
-        return u->x1;
-    case 2:
-        return u->x2;
-    case 3:
-        return u->x3;
-    case 4:
-        return u->x4;
-    case 5:
-        return u->x5;
-    case 6:
-        return u->x6;
-    default:
-        ZF_LOGF("SMC only has 6 argument registers");
-    }
-}
+static const unsigned int smc_call_regs[SMC_CALL_NUM_REGS] = {
+    CTX_REG(x0), CTX_REG(x1), CTX_REG(x2), CTX_REG(x3), CTX_REG(x4), CTX_REG(x5), CTX_REG(x6)
+};
 
-void smc_set_arg(seL4_UserContext *u, seL4_Word arg, seL4_Word val)
+unsigned int smc_call_reg(unsigned int n)
 {
-    switch (arg) {
-    case 1:
-        u->x1 = val;
-        break;
-    case 2:
-        u->x2 = val;
-        break;
-    case 3:
-        u->x3 = val;
-        break;
-    case 4:
-        u->x4 = val;
-        break;
-    case 5:
-        u->x5 = val;
-        break;
-    case 6:
-        u->x6 = val;
-        break;
-    default:
-        ZF_LOGF("SMC only has 6 argument registers");
-    }
+    assert(n < SMC_CALL_NUM_REGS);
+    return smc_call_regs[n];
 }
@@ -54,11 +54,61 @@ static bool is_sysreg_match(sysreg_t *sysreg, sysreg_entry_t *sysreg_entry)
            );
 }
 
-static sysreg_entry_t *find_sysreg_entry(vm_vcpu_t *vcpu, sysreg_t *sysreg_op)
+static bool is_sysreg_exact(sysreg_entry_t *sysreg_entry)
+{
+    uint32_t encoding_mask = SYSREG_OP0_MASK | SYSREG_OP1_MASK | SYSREG_OP2_MASK | SYSREG_CRn_MASK | SYSREG_CRm_MASK;
+    return (sysreg_entry->sysreg_match_mask.hsr_val & encoding_mask) == encoding_mask;
+}
+
+/* Entries matching a single register are found through an open-addressed table indexed by a hash of their key,
+ * slots holding the index of the entry plus one. Entries matching a class of registers are searched in order after
+ * a miss */
+#define SYSREG_INDEX_BITS 6
+#define SYSREG_INDEX_SIZE BIT(SYSREG_INDEX_BITS)
+compile_time_assert(sysreg_index_size, ARRAY_SIZE(sysreg_table) < SYSREG_INDEX_SIZE);
+
+static uint8_t sysreg_index[SYSREG_INDEX_SIZE];
+static uint8_t sysreg_masked[ARRAY_SIZE(sysreg_table)];
+static int num_sysreg_masked;
+static bool sysreg_index_built;
+
+static inline unsigned int sysreg_hash(uint16_t key)
+{
+    /* Fibonacci hashing spreads neighbouring encodings across the table */
+    return ((uint32_t)key * 2654435769u) >> (32 - SYSREG_INDEX_BITS);
+}
+
+static void build_sysreg_index(void)
 {
     for (int i = 0; i < ARRAY_SIZE(sysreg_table); i++) {
         sysreg_entry_t *sysreg_entry = &sysreg_table[i];
-        sysreg_t match_sysreg_op = *sysreg_op;
+        if (!is_sysreg_exact(sysreg_entry)) {
+            sysreg_masked[num_sysreg_masked++] = i;
+            continue;
+        }
+        unsigned int slot = sysreg_hash(sysreg_key(&sysreg_entry->sysreg));
+        while (sysreg_index[slot]) {
+            slot = (slot + 1) % SYSREG_INDEX_SIZE;
+        }
+        sysreg_index[slot] = i + 1;
+    }
+    sysreg_index_built = true;
+}
+
+static sysreg_entry_t *find_sysreg_entry(vm_vcpu_t *vcpu, sysreg_t *sysreg_op)
+{
+    if (!sysreg_index_built) {
+        build_sysreg_index();
+    }
+    uint16_t key = sysreg_key(sysreg_op);
+    for (unsigned int slot = sysreg_hash(key); sysreg_index[slot]; slot = (slot + 1) % SYSREG_INDEX_SIZE) {
+        sysreg_entry_t *sysreg_entry = &sysreg_table[sysreg_index[slot] - 1];
+        if (sysreg_key(&sysreg_entry->sysreg) == key) {
+            return sysreg_entry;
+        }
+    }
+    for (int i = 0; i < num_sysreg_masked; i++) {
+        sysreg_entry_t *sysreg_entry = &sysreg_table[sysreg_masked[i]];
         if (is_sysreg_match(sysreg_op, sysreg_entry)) {
             return sysreg_entry;
         }
@@ -74,5 +124,13 @@ int sysreg_exception_handler(vm_vcpu_t *vcpu, uint32_t hsr)
     if (!entry) {
         return -1;
     }
-    return entry->handler(vcpu, &entry->sysreg, sysreg_op.params.direction);
+    if (entry->ignore) {
+        return ignore_sysreg_exception(vcpu, &entry->sysreg, sysreg_op.params.direction);
+    }
+    int err = entry->handler(vcpu, &entry->sysreg, sysreg_op.params.direction);
+    if (err == SYSREG_HANDLED_ONCE) {
+        entry->ignore = true;
+        return 0;
+    }
+    return err;
 }
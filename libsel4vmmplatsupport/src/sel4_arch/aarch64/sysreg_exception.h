@@ -44,12 +44,29 @@ typedef union sysreg {
     } params;
 } sysreg_t;
 
+/* Key packing the encoding of a system register, op0:op1:CRn:CRm:op2, into 16 bits */
+#define SYSREG_KEY(op0, op1, crn, crm, op2) \
+    ((uint16_t)(((op0) << 14) | ((op1) << 11) | ((crn) << 7) | ((crm) << 3) | (op2)))
+
+static inline uint16_t sysreg_key(sysreg_t *sysreg)
+{
+    return SYSREG_KEY(sysreg->params.op0, sysreg->params.op1, sysreg->params.crn, sysreg->params.crm,
+                      sysreg->params.op2);
+}
+
+/* Handler results, besides -1 on error. SYSREG_HANDLED_ONCE has any later accesses of the register completed as
+ * ignored without calling the handler again, for registers that only need to be emulated once */
+#define SYSREG_HANDLED      0
+#define SYSREG_HANDLED_ONCE 1
+
 typedef int (*sysreg_exception_handler_fn)(vm_vcpu_t *vcpu, sysreg_t *sysreg_reg, bool is_read);
 
 typedef struct sysreg_entry {
     sysreg_t sysreg;
     sysreg_t sysreg_match_mask;
     sysreg_exception_handler_fn handler;
+    /* Set once the handler has returned SYSREG_HANDLED_ONCE */
+    bool ignore;
 } sysreg_entry_t;
 
 int sysreg_exception_handler(vm_vcpu_t *vcpu, uint32_t hsr);
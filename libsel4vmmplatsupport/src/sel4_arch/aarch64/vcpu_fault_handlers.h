@@ -17,10 +17,12 @@
 
 int software_breakpoint_exception(vm_vcpu_t *vcpu, uint32_t hsr);
 
-static vcpu_exception_handler_fn vcpu_exception_handlers[] = {
+/* Default handlers, of VMs that haven't registered their own */
+static const vcpu_exception_handler_fn vcpu_exception_handlers[] = {
     [0 ... HSR_MAX_EXCEPTION] = unknown_vcpu_exception_handler,
     [HSR_WFx_EXCEPTION] = ignore_exception,
     [HSR_SYSREG_64_EXCEPTION] = sysreg_exception_handler,
     [HSR_SWBRK_64_EXCEPTION] = software_breakpoint_exception,
-    [HSR_SMC_64_EXCEPTION] = handle_smc
+    [HSR_SMC_64_EXCEPTION] = handle_smc,
+    [HSR_HVC_64_EXCEPTION] = handle_hvc
 };
@@ -5,62 +5,20 @@
  */
 
 
+#include <stddef.h>
+
 #include <sel4vm/guest_vm.h>
 
 #include "smc.h"
 
-seL4_Word smc_get_function_id(seL4_UserContext *u)
-{
-    return u->r0;
-}
-
-seL4_Word smc_set_return_value(seL4_UserContext *u, seL4_Word val)
-{
-    u->r0 = val;
-}
+#define CTX_REG(r) (offsetof(seL4_UserContext, r) / sizeof(seL4_Word))
 
-seL4_Word smc_get_arg(seL4_UserContext *u, seL4_Word arg)
-{
-    switch (arg) {
-    case 1:
-        return u->r1;
-    case 2:
-        return u->r2;
-    case 3:
-        return u->r3;
-    case 4:
-        return u->r4;
-    case 5:
-        return u->r5;
-    case 6:
-        return u->r6;
-    default:
-        ZF_LOGF("SMC only has 6 argument registers");
-    }
-}
+static const unsigned int smc_call_regs[SMC_CALL_NUM_REGS] = {
+    CTX_REG(r0), CTX_REG(r1), CTX_REG(r2), CTX_REG(r3), CTX_REG(r4), CTX_REG(r5), CTX_REG(r6)
+};
 
-void smc_set_arg(seL4_UserContext *u, seL4_Word arg, seL4_Word val)
+unsigned int smc_call_reg(unsigned int n)
 {
-    switch (arg) {
-    case 1:
-        u->r1 = val;
-        break;
-    case 2:
-        u->r2 = val;
-        break;
-    case 3:
-        u->r3 = val;
-        break;
-    case 4:
-        u->r4 = val;
-        break;
-    case 5:
-        u->r5 = val;
-        break;
-    case 6:
-        u->r6 = val;
-        break;
-    default:
-        ZF_LOGF("SMC only has 6 argument registers");
-    }
+    assert(n < SMC_CALL_NUM_REGS);
+    return smc_call_regs[n];
 }
@@ -14,8 +14,10 @@
 #include "vcpu_fault.h"
 #include "smc.h"
 
-static vcpu_exception_handler_fn vcpu_exception_handlers[] = {
+/* Default handlers, of VMs that haven't registered their own */
+static const vcpu_exception_handler_fn vcpu_exception_handlers[] = {
     [0 ... HSR_MAX_EXCEPTION] = unknown_vcpu_exception_handler,
     [HSR_WFx_EXCEPTION] = ignore_exception,
     [HSR_SMC_EXCEPTION] = handle_smc,
+    [HSR_HVC_EXCEPTION] = handle_hvc,
 };